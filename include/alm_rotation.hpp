@@ -0,0 +1,103 @@
+#ifndef COSMO_PP_ALM_ROTATION_HPP
+#define COSMO_PP_ALM_ROTATION_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <complex_types.hpp>
+#include <three_rotation.hpp>
+
+namespace Math
+{
+
+/// Rotation of spherical harmonic coefficients with precomputed Wigner d matrices.
+
+/// The rotation is active, the rotated field at the direction rot * n equals the original field at n (the same as rotate_alm of Healpix with the same matrix).
+/// The rotation is decomposed into Euler angles, D^l_{mm'} = exp(-i m alpha) d^l_{mm'}(beta) exp(-i m' gamma), and all of the d^l_{mm'}(beta) up to lMax are calculated once in the constructor (with the Clebsch-Gordan recursion in l, which is stable), then any number of alm sets can be rotated with them. The memory is about lMax^3 doubles.
+/// The coefficients are those of real fields, i.e. only m >= 0 is stored, in the order of Healpix (all of the l-s for m = 0, then for m = 1, etc.).
+class AlmRotation
+{
+public:
+    /// Constructor. Calculates the Wigner d matrices.
+    /// \param rot The rotation.
+    /// \param lMax The maximum l.
+    AlmRotation(const ThreeRotationMatrix& rot, int lMax);
+
+    /// The maximum l.
+    int getLMax() const { return lMax_; }
+
+    /// The first Euler angle of the rotation, rot = R_z(alpha) R_y(beta) R_z(gamma).
+    double alpha() const { return alpha_; }
+
+    /// The second Euler angle of the rotation.
+    double beta() const { return beta_; }
+
+    /// The third Euler angle of the rotation.
+    double gamma() const { return gamma_; }
+
+    /// The Wigner d matrix element d^l_{mm'}(beta).
+    /// \param l The index l.
+    /// \param m The index m, between -l and l.
+    /// \param m1 The index m', between -l and l.
+    double d(int l, int m, int m1) const
+    {
+        check(l >= 0 && l <= lMax_, "invalid l = " << l);
+        check(m >= -l && m <= l, "invalid m = " << m);
+        check(m1 >= -l && m1 <= l, "invalid m' = " << m1);
+
+        // only m >= 0 is stored, d_{-m,-m'} = (-1)^(m - m') d_{mm'}
+        if(m < 0)
+            return ((m - m1) % 2 ? -1.0 : 1.0) * d_[offset(l) + (unsigned long)(-m) * (2 * l + 1) + (l - m1)];
+        return d_[offset(l) + (unsigned long)(m) * (2 * l + 1) + (l + m1)];
+    }
+
+    /// Rotate the coefficients of one l of many alm sets.
+    /// \param l The index l.
+    /// \param n The number of sets.
+    /// \param alm The coefficients, l + 1 of them (m from 0 to l) for each set, the sets one after the other. Rotated in place.
+    void rotate(int l, unsigned long n, ComplexDouble* alm) const;
+
+    /// Rotate many alm sets.
+    /// \param n The number of sets.
+    /// \param alm The sets, each one has (lMax + 1)(lMax + 2) / 2 coefficients in the Healpix order. Rotated in place.
+    void rotate(unsigned long n, ComplexDouble* const* alm) const;
+
+    /// Rotate many Healpix alm sets.
+    /// \param n The number of sets.
+    /// \param alm The sets (for example Alm<xcomplex<double> >), must have lMax = mMax = getLMax(). Rotated in place.
+    template<typename AlmType>
+    void rotate(unsigned long n, AlmType* const* alm) const
+    {
+        std::vector<ComplexDouble*> sets(n);
+        for(unsigned long i = 0; i < n; ++i)
+        {
+            check(alm[i]->Lmax() == lMax_ && alm[i]->Mmax() == lMax_, "the alm sets must have lMax = mMax = " << lMax_);
+            sets[i] = reinterpret_cast<ComplexDouble*>(&((*alm[i])(0, 0)));
+        }
+        rotate(n, &(sets[0]));
+    }
+
+    /// Rotate a Healpix alm set.
+    /// \param alm The set (for example Alm<xcomplex<double> >), must have lMax = mMax = getLMax(). Rotated in place.
+    template<typename AlmType>
+    void rotate(AlmType& alm) const
+    {
+        AlmType* sets[1] = {&alm};
+        rotate(1, sets);
+    }
+
+private:
+    unsigned long offset(int l) const { return offsets_[l]; }
+
+private:
+    int lMax_;
+    double alpha_, beta_, gamma_;
+
+    // for each l the rows m = 0 to l, each one has the columns m' = -l to l
+    std::vector<unsigned long> offsets_;
+    std::vector<double> d_;
+};
+
+} // namespace Math
+
+#endif
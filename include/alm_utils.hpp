@@ -0,0 +1,49 @@
+#ifndef COSMO_PP_ALM_UTILS_HPP
+#define COSMO_PP_ALM_UTILS_HPP
+
+#include <vector>
+
+#include <alm.h>
+#include <xcomplex.h>
+
+/// Utility functions for the spherical harmonic coefficients.
+
+/// All of the functions in the class are static. The loops go over the m columns of the alm, which are contiguous in memory (l = m..lMax for each m), so that the inner loops vectorize.
+/// The work is split between the OpenMP threads, except for small lMax. The functions can be called from inside parallel regions too (they then run in the calling thread, unless nested parallelism is enabled).
+class AlmUtils
+{
+public:
+    /// Calculates the power spectrum C_l = (|a_l0|^2 + 2 sum_{m>0} |a_lm|^2) / (2l + 1).
+    /// \param alm The alm.
+    /// \param cl The power spectrum is written here upon return, the index is l from 0 to lMax.
+    static void powerSpectrum(const Alm<xcomplex<double> >& alm, std::vector<double>* cl);
+
+    /// Calculates the cross spectrum C_l = (Re(a_l0 b_l0*) + 2 sum_{m>0} Re(a_lm b_lm*)) / (2l + 1).
+    /// \param a The first alm.
+    /// \param b The second alm, must have the same lMax and mMax as the first one.
+    /// \param cl The cross spectrum is written here upon return, the index is l from 0 to lMax.
+    static void crossSpectrum(const Alm<xcomplex<double> >& a, const Alm<xcomplex<double> >& b, std::vector<double>* cl);
+
+    /// Calculates sigma_l = |a_l0|^2 + 2 sum_{m>0} |a_lm|^2, i.e. the power spectrum without the 1/(2l + 1) factor.
+    /// \param alm The alm.
+    /// \param sigmaL The result is written here upon return, the index is l from 0 to lMax.
+    static void sigmaL(const Alm<xcomplex<double> >& alm, std::vector<double>* sigmaL);
+
+    /// Packs the alm of a real map into a real vector of size (lMax + 1)^2. For each l the elements from l^2 are Re(a_l0), then Re(a_lm), Im(a_lm) for m = 1..l.
+    /// \param alm The alm, must have mMax = lMax. The imaginary parts of a_l0 must be 0.
+    /// \param v The vector is written here upon return.
+    static void almToVector(const Alm<xcomplex<double> >& alm, std::vector<double>* v);
+
+    /// Unpacks a real vector into alm, the inverse of almToVector.
+    /// \param v The vector, of size (lMax + 1)^2.
+    /// \param alm The alm are written here upon return. Must already have the right lMax, and mMax = lMax.
+    static void vectorToAlm(const std::vector<double>& v, Alm<xcomplex<double> >* alm);
+
+    /// Multiplies a_lm by factor_l, for example by sqrt(C_l) or by the beam.
+    /// \param alm The alm to be scaled.
+    /// \param factor The factors, the index is l, must have at least lMax + 1 elements.
+    static void scale(Alm<xcomplex<double> >* alm, const std::vector<double>& factor);
+};
+
+#endif
+
@@ -0,0 +1,83 @@
+#ifndef COSMO_PP_BANDED_MATRIX_HPP
+#define COSMO_PP_BANDED_MATRIX_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <matrix.hpp>
+
+namespace Math
+{
+
+/// A matrix stored by rows, keeping only a contiguous range of columns for each row.
+
+/// This is for matrices that are strongly banded, like the mode coupling kernels of masks, where most of the elements far from the diagonal are negligible. Each row keeps the elements from its first to its last non-negligible element (the band can have a different width for each row), all of the rows are stored one after the other, so the products go through contiguous memory and are vectorized (see VectorKernels).
+class BandedMatrix
+{
+public:
+    /// Constructor. Creates an empty matrix.
+    BandedMatrix() : rows_(0), cols_(0) {}
+
+    /// Constructor.
+    /// \param mat The full matrix.
+    /// \param threshold The elements at the ends of each row with absolute values not larger than threshold times the largest absolute value in the row are dropped. With 0 only the exact zeros at the ends are dropped.
+    BandedMatrix(const Matrix<double>& mat, double threshold = 0) { set(mat, threshold); }
+
+    /// Set from a full matrix.
+    /// \param mat The full matrix.
+    /// \param threshold The elements at the ends of each row with absolute values not larger than threshold times the largest absolute value in the row are dropped. With 0 only the exact zeros at the ends are dropped.
+    void set(const Matrix<double>& mat, double threshold = 0);
+
+    /// The number of rows.
+    int rows() const { return rows_; }
+
+    /// The number of columns.
+    int cols() const { return cols_; }
+
+    /// The number of stored elements.
+    unsigned long size() const { return v_.size(); }
+
+    /// The first stored column of a row.
+    /// \param i The row index.
+    int first(int i) const { check(i >= 0 && i < rows_, "invalid index " << i); return first_[i]; }
+
+    /// The number of stored columns of a row.
+    /// \param i The row index.
+    int width(int i) const { check(i >= 0 && i < rows_, "invalid index " << i); return int(start_[i + 1] - start_[i]); }
+
+    /// Element access.
+    /// \param i The row index.
+    /// \param j The column index.
+    /// \return The (i, j) element, 0 if it is outside of the band.
+    double operator()(int i, int j) const;
+
+    /// Multiply with a vector, y = A x.
+    /// \param x The vector to multiply, must have cols() elements.
+    /// \param y The result, must have rows() elements.
+    void multiply(const double* x, double* y) const;
+
+    /// Multiply the transpose with a vector, y = A^T x.
+    /// \param x The vector to multiply, must have rows() elements.
+    /// \param y The result, must have cols() elements.
+    void multiplyTransposed(const double* x, double* y) const;
+
+    /// The bilinear form x^T A y.
+    /// \param x Must have rows() elements.
+    /// \param y Must have cols() elements.
+    double bilinearForm(const double* x, const double* y) const;
+
+    /// Copy into a full matrix, for example to multiply with many vectors at once.
+    /// \param res The matrix to copy into.
+    void copyTo(Matrix<double>* res) const;
+
+private:
+    int rows_, cols_;
+    std::vector<int> first_;
+    std::vector<unsigned long> start_;
+    std::vector<double> v_;
+};
+
+} // namespace Math
+
+#endif
+
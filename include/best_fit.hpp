@@ -6,10 +6,14 @@
 #include <sstream>
 #include <fstream>
 #include <limits>
+#include <algorithm>
+#include <cstdio>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <likelihood_function.hpp>
+#include <likelihood_gradient.hpp>
+#include <chain_file.hpp>
 
 #include "Minuit2/FCNGradientBase.h"
 #include "Minuit2/FunctionMinimum.h"
@@ -20,76 +24,196 @@
 namespace Math
 {
 
+/// The function minimized by BestFit, -2ln(likelihood), which also logs the evaluations.
+
+/// The log file is kept open and the records are flushed in batches (see setLog), so that logging does not cost more than fast likelihoods. The text log has the same format as the chain files, the binary log is in the format of BinaryChain.
 class BestFitMinuitCalculator : public ROOT::Minuit2::FCNBase
 {
 public:
-    BestFitMinuitCalculator(int nPar, LikelihoodFunction& like, std::string fileRoot, unsigned long* calls = NULL) : nPar_(nPar), like_(like), calls_(calls), fileRoot_(fileRoot)
+    /// The format of the log of the evaluations.
+    enum LOG_FORMAT { TEXT_LOG = 0, BINARY_LOG, NO_LOG, LOG_FORMAT_MAX };
+
+    /// Constructor. Opens the text log (fileRoot).txt.
+    /// \param nPar The number of parameters.
+    /// \param like The likelihood function.
+    /// \param fileRoot The root of the log file name.
+    /// \param calls If not NULL, the number of calls will be counted here.
+    BestFitMinuitCalculator(int nPar, LikelihoodFunction& like, std::string fileRoot, unsigned long* calls = NULL) : nPar_(nPar), like_(like), calls_(calls), fileRoot_(fileRoot), format_(TEXT_LOG), flushEvery_(1), onlyImprovements_(false), notFlushed_(0), best_(std::numeric_limits<double>::max()), parCopy_(nPar), lineBuff_((nPar + 2) * 32)
     {
         check(nPar > 0, "Invalid number of parameters " << nPar << ". Must be positive.");
 
-        std::stringstream fileName;
-        fileName << fileRoot_ << ".txt";
-        std::ofstream out(fileName.str().c_str());
-        StandardException exc;
-        if(!out)
-        {
-            std::stringstream exceptionStr;
-            exceptionStr << "Cannot write into file " << fileName.str() << ".";
-            exc.set(exceptionStr.str());
-            throw exc;
-        }
-        out.close();
+        openLog(NULL);
     }
 
     ~BestFitMinuitCalculator()
     {
+        if(out_.is_open())
+            out_.close();
+    }
+
+    /// Set the format of the log. The log file is reopened (and truncated).
+    /// \param format TEXT_LOG for the text format ((fileRoot).txt), BINARY_LOG for the binary format ((fileRoot).bin, see BinaryChain), NO_LOG for no logging.
+    /// \param flushEvery The log is flushed after this many records, 0 to flush only when the log is closed (or flush is called).
+    /// \param onlyImprovements If true, only the evaluations improving on the best likelihood so far are logged.
+    /// \param paramNames The names of the parameters, used in the header of the binary log. If NULL, Parameter_0, Parameter_1, etc. are used.
+    void setLog(LOG_FORMAT format, int flushEvery = 1, bool onlyImprovements = false, const std::vector<std::string>* paramNames = NULL)
+    {
+        check(format >= TEXT_LOG && format < LOG_FORMAT_MAX, "invalid log format " << format);
+        check(flushEvery >= 0, "invalid flushEvery " << flushEvery);
+
+        format_ = format;
+        flushEvery_ = flushEvery;
+        onlyImprovements_ = onlyImprovements;
+        best_ = std::numeric_limits<double>::max();
+        openLog(paramNames);
+    }
+
+    /// Flush the log.
+    void flush() const
+    {
+        if(out_.is_open())
+            out_.flush();
+        notFlushed_ = 0;
     }
 
     virtual double operator()(const std::vector<double>& par) const
     {
         check(par.size() == nPar_, "the number of parameters must be " << nPar_ << ", however " << par.size() << " provided");
-        std::vector<double> parCopy(par);
+
+        // calculate needs a non-const pointer, the buffer is reused
+        std::copy(par.begin(), par.end(), parCopy_.begin());
+        const double res = like_.calculate(&(parCopy_[0]), nPar_);
+
+        if(calls_)
+            ++(*calls_);
+
+        if(format_ != NO_LOG && (!onlyImprovements_ || res < best_))
+            writeRecord(res, par);
+
+        if(res < best_)
+            best_ = res;
+
+        return res;
+    }
+
+    unsigned long calls() const { return (calls_ ? *calls_ : 0); }
+
+    double Up() const {return 1.;}
+
+private:
+    void openLog(const std::vector<std::string>* paramNames)
+    {
+        if(out_.is_open())
+            out_.close();
+        notFlushed_ = 0;
+
+        if(format_ == NO_LOG)
+            return;
 
         std::stringstream fileName;
-        fileName << fileRoot_ << ".txt";
-        std::ofstream out(fileName.str().c_str(), std::ios::app);
-        StandardException exc;
-        if(!out)
+        fileName << fileRoot_ << (format_ == BINARY_LOG ? ".bin" : ".txt");
+        if(format_ == BINARY_LOG)
+        {
+            std::vector<std::string> names(nPar_);
+            for(int i = 0; i < nPar_; ++i)
+            {
+                std::stringstream name;
+                name << "Parameter_" << i;
+                names[i] = (paramNames ? (*paramNames)[i] : name.str());
+            }
+            out_.open(fileName.str().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            if(out_)
+                BinaryChain::writeHeader(out_, names);
+        }
+        else
+            out_.open(fileName.str().c_str());
+
+        if(!out_)
         {
+            StandardException exc;
             std::stringstream exceptionStr;
             exceptionStr << "Cannot write into file " << fileName.str() << ".";
             exc.set(exceptionStr.str());
             throw exc;
         }
+    }
 
-        const double res = like_.calculate(&(parCopy[0]), nPar_);
-        out << "1 " << res;
-        for(int i = 0; i < nPar_; ++i)
-            out << ' ' << par[i];
-        out << std::endl;
-        out.close();
+    void writeRecord(double res, const std::vector<double>& par) const
+    {
+        if(format_ == BINARY_LOG)
+            BinaryChain::writeRecord(out_, 1, res, &(par[0]), nPar_);
+        else
+        {
+            // the same format as streaming the values with the default precision
+            int pos = std::snprintf(&(lineBuff_[0]), lineBuff_.size(), "1 %g", res);
+            for(int i = 0; i < nPar_; ++i)
+                pos += std::snprintf(&(lineBuff_[pos]), lineBuff_.size() - pos, " %g", par[i]);
+            check(pos < lineBuff_.size(), "the log line buffer is too small");
+            lineBuff_[pos++] = '\n';
+            out_.write(&(lineBuff_[0]), pos);
+        }
 
-        if(calls_)
-            ++(*calls_);
+        if(flushEvery_ > 0 && ++notFlushed_ >= flushEvery_)
+            flush();
+    }
+
+private:
+    int nPar_;
+    Math::LikelihoodFunction& like_;
+    unsigned long *calls_;
+    std::string fileRoot_;
+
+    LOG_FORMAT format_;
+    int flushEvery_;
+    bool onlyImprovements_;
+    mutable std::ofstream out_;
+    mutable int notFlushed_;
+    mutable double best_;
+    mutable std::vector<double> parCopy_;
+    mutable std::vector<char> lineBuff_;
+};
+
+/// The function minimized by BestFit in the analytic gradient mode (see BestFit::setParallelGradient).
+
+/// The values are calculated (and logged) by a BestFitMinuitCalculator, the gradients by a LikelihoodGradient, which evaluates all of the points of the finite differences in one batch.
+class BestFitMinuitGradientCalculator : public ROOT::Minuit2::FCNGradientBase
+{
+public:
+    /// Constructor.
+    /// \param calculator The calculator of the values.
+    /// \param gradient The gradient.
+    /// \param calls If not NULL, the likelihood evaluations of the gradients will be counted here.
+    BestFitMinuitGradientCalculator(const BestFitMinuitCalculator& calculator, LikelihoodGradient& gradient, unsigned long* calls = NULL) : calculator_(calculator), gradient_(gradient), calls_(calls) {}
+
+    virtual double operator()(const std::vector<double>& par) const { return calculator_(par); }
+
+    virtual std::vector<double> Gradient(const std::vector<double>& par) const
+    {
+        check(par.size() == gradient_.nParams(), "the number of parameters must be " << gradient_.nParams() << ", however " << par.size() << " provided");
 
+        std::vector<double> res(par.size());
+        const unsigned long before = gradient_.evaluations();
+        gradient_.gradient(&(par[0]), &(res[0]));
+        if(calls_)
+            (*calls_) += gradient_.evaluations() - before;
         return res;
     }
 
-    unsigned long calls() const { return (calls_ ? *calls_ : 0); }
+    /// Minuit would check the gradient with its own serial finite differences, which is exactly what this class avoids.
+    virtual bool CheckGradient() const { return false; }
 
     double Up() const {return 1.;}
 
 private:
-    int nPar_;
-    Math::LikelihoodFunction& like_;
-    unsigned long *calls_;
-    std::string fileRoot_;
+    const BestFitMinuitCalculator& calculator_;
+    LikelihoodGradient& gradient_;
+    unsigned long* calls_;
 };
 
 class BestFit
 {
 public:
-    BestFit(int nPar, LikelihoodFunction& like, std::string fileRoot) : calculator_(nPar, like, fileRoot, &calls_), calls_(0), nPar_(nPar), fileRoot_(fileRoot), paramNames_(nPar), starting_(nPar, 0.0), min_(nPar, 0.0), max_(nPar, 1.0), error_(nPar, 0.01)
+    BestFit(int nPar, LikelihoodFunction& like, std::string fileRoot) : like_(like), calculator_(nPar, like, fileRoot, &calls_), calls_(0), nPar_(nPar), fileRoot_(fileRoot), paramNames_(nPar), starting_(nPar, 0.0), min_(nPar, 0.0), max_(nPar, 1.0), error_(nPar, 0.01), logFormat_(BestFitMinuitCalculator::TEXT_LOG), flushEvery_(1), onlyImprovements_(false), parallelGradient_(false), gradientStep_(0.1), distributeGradient_(false)
     {
         check(nPar > 0, "Invalid number of parameters " << nPar << ". Must be positive.");
 
@@ -119,14 +243,41 @@ public:
         setParam(i, name, mean - 5 * sigma, mean + 5 * sigma, starting, accuracy);
     }
 
+    /// Set the format of the log of the likelihood evaluations (see BestFitMinuitCalculator::setLog). By default all of the evaluations are logged in the text format and flushed after each one.
+    /// \param format TEXT_LOG for the text format ((fileRoot).txt), BINARY_LOG for the binary format ((fileRoot).bin), NO_LOG for no logging.
+    /// \param flushEvery The log is flushed after this many records, 0 to flush only at the end.
+    /// \param onlyImprovements If true, only the evaluations improving on the best likelihood so far are logged.
+    void setLog(BestFitMinuitCalculator::LOG_FORMAT format, int flushEvery = 1, bool onlyImprovements = false)
+    {
+        check(format >= BestFitMinuitCalculator::TEXT_LOG && format < BestFitMinuitCalculator::LOG_FORMAT_MAX, "invalid log format " << format);
+        check(flushEvery >= 0, "invalid flushEvery " << flushEvery);
+        logFormat_ = format;
+        flushEvery_ = flushEvery;
+        onlyImprovements_ = onlyImprovements;
+    }
+
+    /// Give Minuit the gradients calculated by LikelihoodGradient instead of letting it do its own finite differences.
+    /// Minuit evaluates the differences one by one, while LikelihoodGradient evaluates all of the 2n points in one call to LikelihoodFunction::calculateBatch, so with a likelihood that calculates its batches in parallel (for example using a CMBPool), or with the points split between the MPI processes, a gradient costs about as much as one evaluation.
+    /// \param parallel Turns the analytic gradient mode on or off (off by default).
+    /// \param stepFactor The finite difference step of each parameter is this times its accuracy (see setParam).
+    /// \param distribute If true, the points of the gradients are split between the MPI processes. All of the processes must then call run at the same time, they all go through the same minimization.
+    void setParallelGradient(bool parallel, double stepFactor = 0.1, bool distribute = false)
+    {
+        check(stepFactor > 0, "invalid step factor " << stepFactor);
+        parallelGradient_ = parallel;
+        gradientStep_ = stepFactor;
+        distributeGradient_ = distribute;
+    }
+
     void run()
     {
+        calculator_.setLog(logFormat_, flushEvery_, onlyImprovements_, &paramNames_);
+
         ROOT::Minuit2::MnUserParameters upar;
         for(int i = 0; i < nPar_; ++i)
             upar.Add(paramNames_[i].c_str(), starting_[i], error_[i], min_[i], max_[i]);
 
-        ROOT::Minuit2::MnMigrad migrad(calculator_, upar);
-        ROOT::Minuit2::FunctionMinimum minRes = migrad();
+        ROOT::Minuit2::FunctionMinimum minRes = minimize(upar);
         ROOT::Minuit2::MnUserParameters result = minRes.UserParameters();
 
         std::stringstream fileName;
@@ -146,6 +297,7 @@ public:
             params[i] = result.Value(paramNames_[i].c_str());
 
         const double bestFitLike = calculator_(params);
+        calculator_.flush();
         out << "Best fit likelihood = " << bestFitLike << std::endl;
         for(int i = 0; i < nPar_; ++i)
             out << paramNames_[i] << ":\t" << params[i] << " +/- " << result.Error(paramNames_[i].c_str()) << std::endl;
@@ -153,12 +305,37 @@ public:
     }
 
 private:
+    ROOT::Minuit2::FunctionMinimum minimize(const ROOT::Minuit2::MnUserParameters& upar)
+    {
+        if(!parallelGradient_)
+        {
+            ROOT::Minuit2::MnMigrad migrad(calculator_, upar);
+            return migrad();
+        }
+
+        std::vector<double> steps(error_);
+        for(int i = 0; i < nPar_; ++i)
+            steps[i] *= gradientStep_;
+        LikelihoodGradient gradient(like_, steps, &min_, &max_, distributeGradient_);
+        BestFitMinuitGradientCalculator gradientCalculator(calculator_, gradient, &calls_);
+        ROOT::Minuit2::MnMigrad migrad(gradientCalculator, upar);
+        return migrad();
+    }
+
+private:
+    LikelihoodFunction& like_;
     unsigned long calls_;
     BestFitMinuitCalculator calculator_;
     const int nPar_;
     const std::string fileRoot_;
     std::vector<std::string> paramNames_;
     std::vector<double> starting_, min_, max_, error_;
+    BestFitMinuitCalculator::LOG_FORMAT logFormat_;
+    int flushEvery_;
+    bool onlyImprovements_;
+    bool parallelGradient_;
+    double gradientStep_;
+    bool distributeGradient_;
 };
 
 } // namespace Math
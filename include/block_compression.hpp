@@ -0,0 +1,119 @@
+#ifndef COSMO_PP_BLOCK_COMPRESSION_HPP
+#define COSMO_PP_BLOCK_COMPRESSION_HPP
+
+#include <string>
+#include <vector>
+
+#include <macros.hpp>
+
+/// Lossless compression of arrays of doubles.
+
+/// All of the functions in the class are static.
+/// The bytes of the values are first shuffled (the first byte of every value, then the second byte, etc.), which puts the slowly varying sign and exponent bytes next to each other, and then compressed with a general purpose codec.
+/// The codecs are only available if the code has been compiled with the corresponding library (zlib is used if found, zstd if ZSTD_DIR is specified). NONE is always available, the values are then only shuffled.
+class BlockCompression
+{
+public:
+    /// The codecs. The values are stored in the files, so they cannot be changed.
+    enum Codec { NONE = 0, ZLIB, ZSTD, CODEC_MAX };
+
+    /// Check if a given codec has been compiled in.
+    static bool isAvailable(Codec codec);
+
+    /// The name of a codec, for the messages.
+    static const char* codecName(Codec codec);
+
+    /// The best codec available, ZSTD if compiled in, otherwise ZLIB, otherwise NONE.
+    static Codec defaultCodec();
+
+    /// Shuffle the bytes of an array of values.
+    /// \param in The input array.
+    /// \param nValues The number of values.
+    /// \param valueSize The size of each value in bytes.
+    /// \param out The output array, must have the same size as the input and be different from it.
+    static void shuffle(const void* in, unsigned long nValues, int valueSize, void* out);
+
+    /// The inverse of shuffle.
+    static void unshuffle(const void* in, unsigned long nValues, int valueSize, void* out);
+
+    /// Shuffle and compress an array of doubles.
+    /// \param codec The codec. Throws an exception if it is not available.
+    /// \param values The values.
+    /// \param n The number of values.
+    /// \param out The compressed bytes will be written here.
+    static void compress(Codec codec, const double* values, unsigned long n, std::vector<char>& out);
+
+    /// Decompress and unshuffle an array of doubles compressed with compress. Throws an exception if the data is corrupted.
+    /// \param codec The codec used for compression.
+    /// \param data The compressed bytes.
+    /// \param size The number of compressed bytes.
+    /// \param values The output array.
+    /// \param n The number of values, must be the same as given to compress.
+    static void decompress(Codec codec, const char* data, unsigned long size, double* values, unsigned long n);
+
+    /// Compress an array of records (each one a fixed number of doubles) in independently compressed blocks. The blocks are compressed in parallel with OpenMP.
+    /// The result starts with the codec, the record length, the number of records, the number of records in a block, and the number of blocks, followed by the offset and the size of each block, and then the blocks. Everything is aligned to 8 bytes. See CompressedRecords for reading it.
+    /// \param codec The codec.
+    /// \param records The records, one after the other.
+    /// \param nRecords The number of records.
+    /// \param recordLength The number of doubles in each record.
+    /// \param blockRecords The number of records in each block.
+    /// \param out The result will be written here.
+    static void compressRecords(Codec codec, const double* records, unsigned long nRecords, int recordLength, unsigned long blockRecords, std::vector<char>& out);
+};
+
+/// A read-only view of records compressed with BlockCompression::compressRecords.
+
+/// The data is not copied, it needs to stay valid (for example memory-mapped) while the view is used. Since the blocks are independent, any block can be decompressed on its own, and different blocks can be decompressed by different threads at the same time.
+class CompressedRecords
+{
+public:
+    /// Constructor. Checks the layout, throws an exception if it is invalid.
+    /// \param data The compressed records.
+    /// \param size The number of bytes available. It can be larger than the size of the compressed records.
+    /// \param name The name of the data (for example the file name), used in error messages only.
+    CompressedRecords(const char* data, unsigned long size, const char* name = "");
+
+    /// The codec.
+    BlockCompression::Codec codec() const { return codec_; }
+
+    /// The number of doubles in each record.
+    int recordLength() const { return recordLength_; }
+
+    /// The total number of records.
+    unsigned long size() const { return nRecords_; }
+
+    /// The number of bytes taken by the compressed records.
+    unsigned long compressedSize() const { return compressedSize_; }
+
+    /// The number of blocks.
+    unsigned long nBlocks() const { return nBlocks_; }
+
+    /// The index of the first record of a given block.
+    unsigned long blockStart(unsigned long b) const { check(b < nBlocks_, "invalid block " << b); return b * blockRecords_; }
+
+    /// The number of records in a given block.
+    unsigned long blockSize(unsigned long b) const { check(b < nBlocks_, "invalid block " << b); return (b == nBlocks_ - 1 ? nRecords_ - b * blockRecords_ : blockRecords_); }
+
+    /// Decompress one block. Thread safe.
+    /// \param b The index of the block.
+    /// \param records The records of the block will be written here, must have space for blockSize(b) * recordLength() doubles.
+    void decompressBlock(unsigned long b, double* records) const;
+
+    /// Decompress all of the records, the blocks are decompressed in parallel with OpenMP.
+    /// \param records The records will be written here, must have space for size() * recordLength() doubles.
+    void decompress(double* records) const;
+
+private:
+    const char* data_;
+    const long* index_;
+    std::string name_;
+    BlockCompression::Codec codec_;
+    int recordLength_;
+    unsigned long nRecords_;
+    unsigned long blockRecords_;
+    unsigned long nBlocks_;
+    unsigned long compressedSize_;
+};
+
+#endif
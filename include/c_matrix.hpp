@@ -4,6 +4,9 @@
 #include <vector>
 #include <string>
 
+#include <memory_tracker.hpp>
+#include <first_touch.hpp>
+
 /// Covariance matrix in pixel space.
 
 /// This class represents a covariance matrix in pixel space. By definition, the matrix is symmetric.
@@ -20,7 +23,7 @@ public:
     
     /// Initializes a matrix by reading from a binary file.
     /// \param fileName The name of the file.
-    CMatrix(const char* fileName) { readFromFile(fileName); }
+    CMatrix(const char* fileName) : memory_(MemoryTracker::C_MATRIX) { readFromFile(fileName); }
     
     /// Gives access to an element of the matrix that can be changed. Note that changing the element (i, j) automatically
     /// changes the element (j, i) too.
@@ -47,6 +50,10 @@ public:
     /// \param fileName The name of the file.
     void writeIntoFile(const char* fileName) const;
     
+    /// Writes the matrix into a binary file that can be memory-mapped with Math::MappedMatrix, which has the same element order. The comment is not saved.
+    /// \param fileName The name of the file.
+    void writeIntoMappableFile(const char* fileName) const;
+    
     /// Writes the matrix into a text file.
     /// \param fileName The name of the file.
     void writeIntoTextFile(const char* fileName) const;
@@ -67,19 +74,28 @@ public:
     /// \param maskFileName The name of the file containing the mask (fits format).
     void maskMatrix(const char* maskFileName);
     
-    /// Given a mask, reduces the matrix to keep only the unmasked pixels.
+    /// Given a mask, reduces the matrix to keep only the unmasked pixels. For increasing good pixel indices (as returned by Utils::readMask) the matrix is compacted in place, so no memory is needed for a second matrix, otherwise a new matrix is built.
+    /// To avoid having the full matrix in memory at all, generate it for the unmasked pixels only (see the goodPixels arguments of CMatrixGenerator).
     /// \param goodPixels A vector containing the indices of the unmasked pixels.
     void maskMatrix(const std::vector<int>& goodPixels);
     
+    /// The memory needed for a matrix, without allocating it.
+    /// \param nPix The number of pixels.
+    /// \return The number of bytes.
+    static unsigned long memoryEstimate(int nPix) { return (unsigned long)(nPix) * (nPix + 1) / 2 * sizeof(double); }
+    
 private:
     int getIndex(int i, int j) const;
     void initialize();
     
 private:
     int nPix_;
-    std::vector<double> matrix_;
+    // filled by the threads on NUMA nodes (see Math::FirstTouchAllocator)
+    std::vector<double, Math::FirstTouchAllocator<double> > matrix_;
     
     std::string comment_;
+    
+    MemoryTracker::Allocation memory_;
 };
 
 #endif
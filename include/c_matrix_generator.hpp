@@ -5,6 +5,9 @@
 
 #include <c_matrix.hpp>
 #include <whole_matrix.hpp>
+#include <tiled_matrix.hpp>
+#include <memory_tracker.hpp>
+#include <mapped_file.hpp>
 
 /// A container for Legendre Polynomials calculated between pixels. Can be used in the CMatrixGenerator class to speed up calculations.
 class LegendrePolynomialContainer
@@ -14,10 +17,11 @@ public:
     /// \param lMax Maximum value of l to store Legendre polynomials for.
     /// \param nSide NSide of the pixelization.
     /// \param goodPixels A pointer to a vector containig the indices of unmasked pixels, NULL to use them all. Legendre polynomials are calculated between all of the unmasked pixels.
-    LegendrePolynomialContainer(int lMax, long nSide, const std::vector<int>* goodPixels = NULL);
+    /// \param singlePrecision Store the values as float instead of double, which halves the memory.
+    LegendrePolynomialContainer(int lMax, long nSide, const std::vector<int>* goodPixels = NULL, bool singlePrecision = false);
     
-    /// Constructor that reads from a file.
-    /// \param fileName The name of the file containing the Legendre polynomials.
+    /// Constructor that reads from a file. The file is memory-mapped, nothing is read until the values are used, and the processes on the same node share the pages.
+    /// \param fileName The name of the file containing the Legendre polynomials, written by writeIntoFile.
     LegendrePolynomialContainer(const char* fileName);
     
     /// Retreives the value of Legendre polynomial l applied to cos(theta) where theta is the angle between pixel i and j.
@@ -26,13 +30,56 @@ public:
     /// \param j The index of the second pixel (indices are the same as in goodPixels given in the constructor).
     double value(int l, int j, int i) const;
     
-    /// Saves the contents into a file.
+    /// The sum over l of w_l P_l(cos(theta)) where theta is the angle between pixel i and j. The values for a pair are stored contiguously, so this is a vectorized dot product.
+    /// \param j The index of the second pixel.
+    /// \param i The index of the first pixel, must not be larger than j.
+    /// \param w The weights, the index is l.
+    /// \param lMin The minimum l in the sum.
+    /// \param lMax The maximum l in the sum.
+    double sum(int j, int i, const double* w, int lMin, int lMax) const;
+    
+    /// The maximum value of l.
+    int getLMax() const { return lMax_; }
+    
+    /// The number of pixels.
+    int getNPix() const { return nPix_; }
+    
+    /// Are the values stored as float.
+    bool isSinglePrecision() const { return singlePrecision_; }
+    
+    /// Saves the contents into a file that can be memory-mapped. The format has the header of Math::MappedFile (a magic string, a version, a byte order tag and the element size, followed by lMax and the number of pixels), followed by the values in the same order as in memory.
     /// \param fileName The name of the file to contain the Legendre polynomials.
     void writeIntoFile(const char* fileName) const;
     
+    /// The memory needed for the container, without allocating it.
+    /// \param lMax Maximum value of l.
+    /// \param nSide NSide of the pixelization.
+    /// \param goodPixels A pointer to a vector containig the indices of unmasked pixels, NULL to use them all.
+    /// \param singlePrecision Store the values as float instead of double.
+    /// \return The number of bytes.
+    static unsigned long memoryEstimate(int lMax, long nSide, const std::vector<int>* goodPixels = NULL, bool singlePrecision = false);
+    
 private:
-    //first index is l, second index is j, third index is i, each element is P_l(n_j dot n_i) * B_l * B_l, B_l is the beam function
-    std::vector<std::vector<std::vector<double> > > data_;
+    LegendrePolynomialContainer(const LegendrePolynomialContainer&);
+    LegendrePolynomialContainer& operator=(const LegendrePolynomialContainer&);
+    
+    unsigned long offset(int j, int i) const { return ((unsigned long)(j) * (j + 1) / 2 + i) * (lMax_ + 1); }
+    
+private:
+    int lMax_, nPix_;
+    bool singlePrecision_;
+    
+    // the pairs (j, i) with i <= j one after the other, for each pair all of the l values, each element is P_l(n_j dot n_i)
+    std::vector<double> data_;
+    std::vector<float> dataFloat_;
+    
+    // point to the vectors above, or to the memory-mapped file
+    const double* values_;
+    const float* valuesFloat_;
+    
+    Math::MappedFile file_;
+    
+    MemoryTracker::Allocation memory_;
 };
 
 /// Converts covariance matrices from l-m space to pixel space.
@@ -44,6 +91,7 @@ public:
     /// Creates a covariance matrix from C_l values read from a text file.
     
     /// This function creates a CMatrix from given values of C_l.
+    /// Without a Legendre polynomials container the sums over l are calculated on the fly with the Clenshaw recurrence, in parallel (OpenMP) over the rows and in vectorized blocks of pixel pairs, so the memory needed is only the matrix itself.
     /// \param cl A vector with values of C_l, the index is l. l_max = size of cl - 1.
     /// \param nSide NSide of the output matrix.
     /// \param fwhm The full width at half maximum of the gaussian beam.
@@ -64,6 +112,27 @@ public:
     /// \return A pointer to the generated covariance matrix. The units are mK. It must be deleted after using.
     static CMatrix* clToCMatrix(const char* clFileName, long nSide, int lMax, double fwhm, const std::vector<int>* goodPixels = NULL, const LegendrePolynomialContainer* lp = NULL);
 
+    /// Creates a covariance matrix from C_l values using the ring symmetry of the HEALPix pixelization.
+
+    /// This function gives the same result as clToCMatrix (without a Legendre polynomials container). The pixels of HEALPix lie on rings of constant latitude, so the angular separation of a pair of pixels is determined by their two rings and their azimuthal separation, and the same separations repeat many times. The pairs are grouped by (ring_i, ring_j, delta phi), the covariance is calculated once for each group, and the matrix is filled from that table.
+    /// This is much faster than clToCMatrix for the full sky (or large unmasked regions), at the cost of a hash table with one entry for each unique separation.
+    /// \param cl A vector with values of C_l, the index is l. l_max = size of cl - 1.
+    /// \param nSide NSide of the output matrix.
+    /// \param fwhm The full width at half maximum of the gaussian beam.
+    /// \param goodPixels A pointer to a vector containing the indices of unmasked pixels, NULL to use them all.
+    /// \return A pointer to the generated covariance matrix. The units are mK. It must be deleted after using.
+    static CMatrix* clToCMatrixRingSymmetric(const std::vector<double>& cl, long nSide, double fwhm, const std::vector<int>* goodPixels = NULL);
+
+    /// Creates a covariance matrix from C_l values as an out-of-core tiled matrix.
+
+    /// This function is the same as clToCMatrix but the matrix is written tile by tile into a TiledMatrix on disk, so it can be larger than the memory. The tiles are calculated in parallel (OpenMP).
+    /// \param cl A vector with values of C_l, the index is l. l_max = size of cl - 1.
+    /// \param nSide NSide of the output matrix.
+    /// \param fwhm The full width at half maximum of the gaussian beam.
+    /// \param res The tiled matrix to write into. Its size must be the number of pixels (the size of goodPixels if given).
+    /// \param goodPixels A pointer to a vector containing the indices of unmasked pixels, NULL to use them all.
+    static void clToTiledMatrix(const std::vector<double>& cl, long nSide, double fwhm, Math::TiledMatrix* res, const std::vector<int>* goodPixels = NULL);
+
     /// Generates a whole matrix from given C_l values.
 
     /// This function takes given C_l values and writes them into a whole matrix.
@@ -88,6 +157,7 @@ public:
     /// It also rotates passively the coordinate frame by given three Euler angles. 
     /// The rotation is done as follows. First rotate counterclockwise by angle phi, then rotate counterclockwise around the new x axis by angle theta, 
     /// then rotate counterclockwise around the new z axis by angle psi.
+    /// The conversion is streamed one (l', m') and then one pixel at a time, in parallel (OpenMP), so apart from the result the memory needed is O(lMax^2 nPix).
     /// \param wholeMatrix The WholeMatrix to be converted.
     /// \param nSide The NSide of the pixel space to convert to.
     /// \param fwhm Full width at half maximum of the gaussian beam, in degrees.
@@ -103,6 +173,7 @@ public:
     /// It also rotates passively the coordinate frame by given three Euler angles. 
     /// The rotation is done as follows. First rotate counterclockwise by angle phi, then rotate counterclockwise around the new x axis by angle theta, 
     /// then rotate counterclockwise around the new z axis by angle psi.
+    /// The conversion is streamed the same way as in wholeMatrixToCMatrix.
     /// \param ee The WholeMatrix E-E to be converted.
     /// \param nSide The NSide of the pixel space to convert to.
     /// \param fwhm Full width at half maximum of the gaussian beam, in degrees.
@@ -143,22 +214,27 @@ public:
     /// This function generates a diagonal matrix with fixed white noise in each pixel.
     /// \param nSide NSide of the matrix generated.
     /// \param noise The white noise in units of mK.
+    /// \param goodPixels A pointer to a vector containing the indices of unmasked pixels, NULL to use them all. The matrix is generated for the unmasked pixels only.
     /// \return A pointer to the generated noise matrix. The units are mK. It must be deleted after using.
-    static CMatrix* generateNoiseMatrix(long nSide, double noise = 1e-3);
+    static CMatrix* generateNoiseMatrix(long nSide, double noise = 1e-3, const std::vector<int>* goodPixels = NULL);
     
     /// Downgrade noise matrix from higher resolution to low resolution. Needs further testing!
     
     /// This function estimates the low resolution noise matrix using simulations. In high resolution the noise per pixel is determined from N_Obs. 
     /// Multiple instances of noise are generated in high resolution, then downgraded and multiplied by the beam.
     /// The noise matrix is estimated by calculating the correlations between different pixels in simulations.
+    /// The simulations are split between the MPI processes and the threads (OpenMP), each thread only adds to its own sums over the unmasked pixel pairs (nPix^2 / 2 values per thread), the simulated maps are not stored. All of the processes must call this function at the same time and they all get the result.
+    /// The random stream of each simulation is determined from seed and the index of the simulation, so the result does not depend on the number of processes or threads.
     /// \param maskFileName The file containing the mask. The generated noise matrix is masked.
     /// \param noiseDataFileName This file contains the original maps in text format. Each line ust have pixel number, temperature, N_Obs separated by white space.
     /// \param sigma0 Sigma_0 of the original map in units of mK.
     /// \param fwhm Full width at half maximum of the beam for the low resolution map.
     /// \param nSideOriginal NSide of the high resolution map (NSide of low resolution is determined from the mask).
     /// \param fwhmOriginal Full width at half maximum of the beam of the original map.
+    /// \param nSims The number of simulations, at least 2.
+    /// \param seed The random seed, 0 to determine it from the current time (the same on all of the processes).
     /// \return A pointer to the calculated noise matrix. The units are mK. It must be deleted after using.
-    static CMatrix* calculateNoiseMatrix(const char* maskFileName, const char* noiseDataFileName, double sigma0, double fwhm, long nSideOriginal = 512, double fwhmOriginal = 1);
+    static CMatrix* calculateNoiseMatrix(const char* maskFileName, const char* noiseDataFileName, double sigma0, double fwhm, long nSideOriginal = 512, double fwhmOriginal = 1, int nSims = 1000, unsigned long seed = 0);
 };
 
 #endif
@@ -0,0 +1,146 @@
+#ifndef COSMO_PP_CG_PRECONDITIONERS_HPP
+#define COSMO_PP_CG_PRECONDITIONERS_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+
+namespace Math
+{
+
+/// A diagonal (Jacobi) preconditioner, the inverse of the diagonal of the matrix.
+
+/// Can be used for the preconditioner function of the treats of ConjugateGradient (see PreconditionedCGTreats), and inside the optional preconditioner function of the function of CG_General.
+class DiagonalPreconditioner
+{
+public:
+    /// Constructor. Creates a unit preconditioner.
+    /// \param n The number of variables.
+    DiagonalPreconditioner(int n = 0) : inv_(n, 1.0) {}
+
+    /// Constructor.
+    /// \param diagonal The diagonal of the matrix, all of the elements must be positive.
+    DiagonalPreconditioner(const std::vector<double>& diagonal) { set(diagonal); }
+
+    /// Set from the diagonal of the matrix.
+    /// \param diagonal The diagonal of the matrix, all of the elements must be positive.
+    void set(const std::vector<double>& diagonal);
+
+    /// The number of variables.
+    int size() const { return int(inv_.size()); }
+
+    /// Apply the preconditioner, y = D^-1 x.
+    /// \param x The original vector.
+    /// \param y The result, can be the same as x.
+    void apply(const double* x, double* y) const;
+
+    /// Apply the preconditioner, y = D^-1 x.
+    /// \param x The original vector.
+    /// \param y The result, resized if needed.
+    void apply(const std::vector<double>& x, std::vector<double>& y) const
+    {
+        check(x.size() == inv_.size(), "");
+        y.resize(inv_.size());
+        apply(&(x[0]), &(y[0]));
+    }
+
+private:
+    std::vector<double> inv_;
+};
+
+/// A block diagonal preconditioner, the inverse of the diagonal blocks of the matrix.
+
+/// The variables are split into consecutive blocks, each one has a dense symmetric positive definite block of the matrix, which is Cholesky factorized in setBlock.
+/// For operators in harmonic space the blocks are typically the (l, m) coefficients of each l, which keeps the couplings between the m-s (for example from an azimuthally symmetric mask or scan) that a diagonal preconditioner misses (see harmonicBlocks).
+class BlockPreconditioner
+{
+public:
+    /// Constructor. Creates unit blocks.
+    /// \param blockSizes The sizes of the blocks, all positive.
+    BlockPreconditioner(const std::vector<int>& blockSizes);
+
+    /// The block sizes for the real degrees of freedom of the alm-s of a real field, ordered by l, with l^2 + 2 * m - 1 and l^2 + 2 * m for the real and imaginary parts of a_lm (the real part of a_l0 is at l^2), i.e. 2l + 1 values for each l.
+    /// \param lMax The maximum l.
+    /// \param lMin The minimum l, the variables start at lMin^2.
+    static std::vector<int> harmonicBlocks(int lMax, int lMin = 0);
+
+    /// The number of blocks.
+    int numBlocks() const { return int(sizes_.size()); }
+
+    /// The total number of variables.
+    int size() const { return int(start_.back()); }
+
+    /// The size of a block.
+    int blockSize(int k) const { check(k >= 0 && k < numBlocks(), "invalid block " << k); return sizes_[k]; }
+
+    /// The index of the first variable of a block.
+    int blockStart(int k) const { check(k >= 0 && k < numBlocks(), "invalid block " << k); return int(start_[k]); }
+
+    /// Set a block of the matrix. It is Cholesky factorized, so it must be symmetric positive definite, otherwise an exception is thrown.
+    /// \param k The index of the block.
+    /// \param block The elements of the block by rows, blockSize(k)^2 of them. Only the lower triangle is used.
+    void setBlock(int k, const double* block);
+
+    /// Set all of the blocks from a function giving the matrix elements.
+    /// \param element A function (or function object) of the row and the column (both global indices), called for all of the pairs in each block with column <= row.
+    template<typename ElementFunc>
+    void setBlocks(ElementFunc element)
+    {
+        std::vector<double> block;
+        for(int k = 0; k < numBlocks(); ++k)
+        {
+            const int n = sizes_[k], s = int(start_[k]);
+            block.assign(n * n, 0);
+            for(int i = 0; i < n; ++i)
+                for(int j = 0; j <= i; ++j)
+                    block[i * n + j] = element(s + i, s + j);
+            setBlock(k, &(block[0]));
+        }
+    }
+
+    /// Apply the preconditioner, y = B^-1 x.
+    /// \param x The original vector.
+    /// \param y The result, can be the same as x.
+    void apply(const double* x, double* y) const;
+
+    /// Apply the preconditioner, y = B^-1 x.
+    /// \param x The original vector.
+    /// \param y The result, resized if needed.
+    void apply(const std::vector<double>& x, std::vector<double>& y) const
+    {
+        check(x.size() == size(), "");
+        y.resize(size());
+        apply(&(x[0]), &(y[0]));
+    }
+
+private:
+    std::vector<int> sizes_;
+    std::vector<unsigned long> start_, offset_;
+
+    // the Cholesky factors of the blocks by rows, each one has blockSize^2 elements
+    std::vector<double> factors_;
+};
+
+/// A treats class for ConjugateGradient that combines the matrix multiplication of another treats class with a preconditioner (for example DiagonalPreconditioner or BlockPreconditioner).
+template<typename CGTreats, typename Preconditioner>
+class PreconditionedCGTreats
+{
+public:
+    /// Constructor.
+    /// \param treats The treats for the matrix multiplication (its preconditioner is not used).
+    /// \param precond The preconditioner, needs to have a function apply(const std::vector<double>& x, std::vector<double>& y).
+    PreconditionedCGTreats(CGTreats& treats, const Preconditioner& precond) : treats_(treats), precond_(precond) {}
+
+    void multiplyByMatrix(const std::vector<double>& original, std::vector<double>& result) { treats_.multiplyByMatrix(original, result); }
+
+    void preconditioner(const std::vector<double>& original, std::vector<double>& result) const { precond_.apply(original, result); }
+
+private:
+    CGTreats& treats_;
+    const Preconditioner& precond_;
+};
+
+} // namespace Math
+
+#endif
+
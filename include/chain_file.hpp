@@ -0,0 +1,333 @@
+#ifndef COSMO_PP_CHAIN_FILE_HPP
+#define COSMO_PP_CHAIN_FILE_HPP
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <macros.hpp>
+#include <block_compression.hpp>
+#include <mapped_file.hpp>
+
+/// A class for reading and writing Markov chains in the binary format.
+
+/// All of the functions in the class are static.
+/// A binary chain file starts with a header containing the magic string COSMOCHN, the format version, the number of parameters, the offset of the first record, and the parameter names.
+/// The header is followed by fixed width records, one per chain element. Each record contains the weight, -2ln(likelihood), and the values of all of the parameters, all as doubles.
+/// The first record starts at an offset aligned to 8 bytes, so the records can be used directly from a memory-mapped file.
+class BinaryChain
+{
+public:
+    /// The current version of the format.
+    static const int version = 1;
+
+    /// Check if a given file is a binary chain file.
+    /// \param fileName The name of the file.
+    /// \return true if the file exists and starts with the binary chain header.
+    static bool isBinary(const char* fileName);
+
+    /// Write the header of a binary chain file.
+    /// \param out The output stream, must be opened in binary mode and positioned at the beginning of the file.
+    /// \param paramNames The names of the parameters.
+    static void writeHeader(std::ofstream& out, const std::vector<std::string>& paramNames);
+
+    /// Read the header of a binary chain file. Throws an exception if the header is invalid.
+    /// \param in The input stream, must be opened in binary mode and positioned at the beginning of the file. Upon return it is positioned at the first record.
+    /// \param paramNames The names of the parameters will be written here.
+    /// \param fileName The name of the file, used in error messages only.
+    /// \return The offset of the first record, in bytes.
+    static long readHeader(std::ifstream& in, std::vector<std::string>& paramNames, const char* fileName = "");
+
+    /// Write one chain element.
+    /// \param out The output stream.
+    /// \param prob The weight of the element.
+    /// \param like -2ln(likelihood) for the element.
+    /// \param params The parameter values (passed as a pointer to the first element).
+    /// \param nParams The number of parameters.
+    static void writeRecord(std::ofstream& out, double prob, double like, const double* params, int nParams)
+    {
+        out.write((const char*)(&prob), sizeof(double));
+        out.write((const char*)(&like), sizeof(double));
+        out.write((const char*)params, nParams * sizeof(double));
+    }
+
+    /// The size of one record in bytes.
+    /// \param nParams The number of parameters.
+    static long recordSize(int nParams) { return (2 + nParams) * long(sizeof(double)); }
+
+    /// Write a complete binary chain file at once. The file is first written under a temporary name and then renamed, so a reader never sees a partially written file.
+    /// \param fileName The name of the file.
+    /// \param paramNames The names of the parameters.
+    /// \param records The records, one after the other, each containing the weight, -2ln(likelihood), and the parameter values.
+    /// \param nRecords The number of records.
+    static void writeFile(const char* fileName, const std::vector<std::string>& paramNames, const double* records, unsigned long nRecords);
+
+    /// Convert a text chain file (weight, -2ln(likelihood), parameters on each line) into a binary chain file.
+    /// \param textFileName The name of the text file.
+    /// \param binaryFileName The name of the binary chain file to be written.
+    /// \param paramNames The names of the parameters, needs to match the number of parameter columns in the text file.
+    /// \return The number of elements converted.
+    static unsigned long convertFromText(const char* textFileName, const char* binaryFileName, const std::vector<std::string>& paramNames);
+
+    /// Convert a binary chain file into the text format used by MetropolisHastings (weight, -2ln(likelihood), parameters on each line).
+    /// \param binaryFileName The name of the binary chain file. Compressed binary chain files (see CompressedBinaryChain) can also be converted.
+    /// \param textFileName The name of the text file to be written.
+    /// \param paramNamesFileName If not NULL, the parameter names will also be written into this file in the .paramnames format.
+    /// \return The number of elements converted.
+    static unsigned long convertToText(const char* binaryFileName, const char* textFileName, const char* paramNamesFileName = NULL);
+};
+
+/// A read-only memory-mapped view of a binary chain file.
+
+/// The file is mapped into memory and the records are accessed in place, nothing is parsed or copied.
+/// The burnin and the thinning are applied by the view itself, so the element with index i is record burnin + i * thin of the file.
+/// A partially written last record is ignored.
+class MappedBinaryChain
+{
+public:
+    /// A strided view of one column of the chain.
+    struct Column
+    {
+        const double* first;
+        long stride;
+        unsigned long n;
+
+        /// The number of elements.
+        unsigned long size() const { return n; }
+
+        /// Access element i.
+        double operator[](unsigned long i) const { check(i < n, "invalid index " << i); return first[i * stride]; }
+    };
+
+public:
+    /// Constructor. Throws an exception if the file cannot be opened or mapped.
+    /// \param fileName The name of the binary chain file.
+    /// \param burnin The number of records to skip from the beginning of the chain.
+    /// \param thin The thinning factor. Must be positive.
+    MappedBinaryChain(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1);
+
+    /// The number of parameters.
+    int nParams() const { return paramNames_.size(); }
+
+    /// The names of the parameters.
+    const std::vector<std::string>& paramNames() const { return paramNames_; }
+
+    /// The number of elements, after the burnin and thinning.
+    unsigned long size() const { return size_; }
+
+    /// The record for a given element, containing the weight, -2ln(likelihood), and the parameter values.
+    /// \param i The index of the element.
+    const double* record(unsigned long i) const { check(i < size_, "invalid index " << i); return data_ + i * stride_; }
+
+    /// The weight of a given element.
+    double prob(unsigned long i) const { return record(i)[0]; }
+
+    /// -2ln(likelihood) for a given element.
+    double like(unsigned long i) const { return record(i)[1]; }
+
+    /// The value of a given parameter for a given element.
+    double param(unsigned long i, int j) const { check(j >= 0 && j < nParams(), "invalid parameter index " << j); return record(i)[2 + j]; }
+
+    /// The column of the weights.
+    Column probColumn() const { return column(0); }
+
+    /// The column of -2ln(likelihood).
+    Column likeColumn() const { return column(1); }
+
+    /// The column of a given parameter.
+    /// \param j The index of the parameter.
+    Column paramColumn(int j) const { check(j >= 0 && j < nParams(), "invalid parameter index " << j); return column(2 + j); }
+
+private:
+    MappedBinaryChain(const MappedBinaryChain&);
+    MappedBinaryChain& operator=(const MappedBinaryChain&);
+
+    Column column(int k) const { Column c; c.first = data_ + k; c.stride = stride_; c.n = size_; return c; }
+
+private:
+    std::vector<std::string> paramNames_;
+    Math::MappedFile file_;
+    const double* data_;
+    long stride_;
+    unsigned long size_;
+};
+
+/// A class for the layout of a binary file containing many chains (written by MetropolisHastings with SHARED_BINARY_CHAIN, see CosmoMPI::File).
+
+/// All of the functions in the class are static.
+/// The file starts with a header containing the magic string COSMOSHC, the format version, the number of parameters, the number of chains, the number of records in a block, the offsets of the record counts and of the data, and the parameter names.
+/// The header is followed by the number of records written by each chain, as longs, and then by the data. The records have the same format as in BinaryChain, and each chain writes them in blocks of a fixed number of records.
+/// Block k of chain c is the block k * nChains + c of the data, so the position of every record is known in advance and the chains can write into the file independently, without any coordination.
+class SharedBinaryChain
+{
+public:
+    /// The current version of the format.
+    static const int version = 1;
+
+    /// The default number of records in a block.
+    static const int defaultBlockRecords = 1024;
+
+    /// The layout of a shared chain file.
+    struct Layout
+    {
+        std::vector<std::string> paramNames;
+        int nChains;
+        int blockRecords;
+        long countsOffset;
+        long dataOffset;
+
+        /// The number of parameters.
+        int nParams() const { return paramNames.size(); }
+
+        /// The offset of the record count of a given chain, in bytes.
+        long countOffset(int chain) const { check(chain >= 0 && chain < nChains, "invalid chain " << chain); return countsOffset + chain * long(sizeof(long)); }
+
+        /// The offset of a given record of a given chain, in bytes.
+        long recordOffset(int chain, unsigned long i) const
+        {
+            check(chain >= 0 && chain < nChains, "invalid chain " << chain);
+            const long block = long(i / blockRecords) * nChains + chain;
+            return dataOffset + (block * blockRecords + long(i % blockRecords)) * BinaryChain::recordSize(nParams());
+        }
+
+        /// The number of records starting from record i that are contiguous in the file (i.e. up to the end of its block).
+        unsigned long contiguousRecords(unsigned long i) const { return blockRecords - i % blockRecords; }
+    };
+
+    /// Check if a given file is a shared chain file.
+    /// \param fileName The name of the file.
+    /// \return true if the file exists and starts with the shared chain header.
+    static bool isShared(const char* fileName);
+
+    /// Create the header of a shared chain file, with all of the record counts set to 0.
+    /// \param paramNames The names of the parameters.
+    /// \param nChains The number of chains.
+    /// \param blockRecords The number of records in a block.
+    /// \param layout The layout of the file will be written here.
+    /// \return The header, to be written at the beginning of the file.
+    static std::string header(const std::vector<std::string>& paramNames, int nChains, int blockRecords, Layout& layout);
+
+    /// Read the header of a shared chain file. Throws an exception if the header is invalid.
+    /// \param in The input stream, must be opened in binary mode and positioned at the beginning of the file.
+    /// \param layout The layout of the file will be written here.
+    /// \param counts The number of records written by each chain will be written here.
+    /// \param fileName The name of the file, used in error messages only.
+    static void readHeader(std::ifstream& in, Layout& layout, std::vector<unsigned long>& counts, const char* fileName = "");
+};
+
+/// A read-only memory-mapped view of a shared chain file (see SharedBinaryChain).
+
+/// The records of each chain are accessed in place. A record count pointing beyond the end of the file (for example if the run was interrupted while writing) is reduced to the complete records.
+class MappedSharedBinaryChain
+{
+public:
+    /// Constructor. Throws an exception if the file cannot be opened or mapped.
+    /// \param fileName The name of the shared chain file.
+    MappedSharedBinaryChain(const char* fileName);
+
+    /// The number of parameters.
+    int nParams() const { return layout_.nParams(); }
+
+    /// The names of the parameters.
+    const std::vector<std::string>& paramNames() const { return layout_.paramNames; }
+
+    /// The number of chains.
+    int nChains() const { return layout_.nChains; }
+
+    /// The number of elements in a given chain.
+    unsigned long chainSize(int chain) const { check(chain >= 0 && chain < nChains(), "invalid chain " << chain); return counts_[chain]; }
+
+    /// The record for a given element of a given chain, containing the weight, -2ln(likelihood), and the parameter values.
+    /// \param chain The index of the chain.
+    /// \param i The index of the element.
+    const double* record(int chain, unsigned long i) const { check(i < chainSize(chain), "invalid index " << i); return (const double*)((const char*)file_.data() + layout_.recordOffset(chain, i)); }
+
+private:
+    MappedSharedBinaryChain(const MappedSharedBinaryChain&);
+    MappedSharedBinaryChain& operator=(const MappedSharedBinaryChain&);
+
+private:
+    SharedBinaryChain::Layout layout_;
+    std::vector<unsigned long> counts_;
+    Math::MappedFile file_;
+};
+
+/// A class for reading and writing Markov chains in the compressed binary format.
+
+/// All of the functions in the class are static.
+/// A compressed chain file has the same header as a binary chain file (see BinaryChain) but with the magic string COSMOCHZ. It is followed by the records compressed in independent blocks with BlockCompression::compressRecords (the bytes of the doubles are shuffled and then compressed with zlib or zstd).
+/// The blocks can be decompressed in parallel and any part of the chain can be read without decompressing the rest. MarkovChain, StreamingChain and BinaryChain::convertToText read compressed chain files directly.
+class CompressedBinaryChain
+{
+public:
+    /// The current version of the format.
+    static const int version = 1;
+
+    /// The default number of records in a block.
+    static const int defaultBlockRecords = 4096;
+
+    /// Check if a given file is a compressed chain file.
+    /// \param fileName The name of the file.
+    /// \return true if the file exists and starts with the compressed chain header.
+    static bool isCompressed(const char* fileName);
+
+    /// Write a complete compressed chain file at once. The blocks are compressed in parallel with OpenMP. The file is first written under a temporary name and then renamed.
+    /// \param fileName The name of the file.
+    /// \param paramNames The names of the parameters.
+    /// \param records The records, one after the other, each containing the weight, -2ln(likelihood), and the parameter values.
+    /// \param nRecords The number of records.
+    /// \param codec The compression codec. Throws an exception if it is not available.
+    /// \param blockRecords The number of records in a block.
+    static void writeFile(const char* fileName, const std::vector<std::string>& paramNames, const double* records, unsigned long nRecords, BlockCompression::Codec codec = BlockCompression::defaultCodec(), int blockRecords = defaultBlockRecords);
+
+    /// Compress a binary chain file. A partially written last record is ignored.
+    /// \param binaryFileName The name of the binary chain file.
+    /// \param compressedFileName The name of the compressed chain file to be written.
+    /// \param codec The compression codec.
+    /// \param blockRecords The number of records in a block.
+    /// \return The number of elements compressed.
+    static unsigned long compress(const char* binaryFileName, const char* compressedFileName, BlockCompression::Codec codec = BlockCompression::defaultCodec(), int blockRecords = defaultBlockRecords);
+
+    /// Decompress a compressed chain file into a binary chain file.
+    /// \param compressedFileName The name of the compressed chain file.
+    /// \param binaryFileName The name of the binary chain file to be written.
+    /// \return The number of elements decompressed.
+    static unsigned long decompress(const char* compressedFileName, const char* binaryFileName);
+};
+
+/// A read-only view of a compressed chain file (see CompressedBinaryChain).
+
+/// The file is memory-mapped and the blocks are decompressed on demand. Different blocks can be decompressed by different threads at the same time.
+class MappedCompressedBinaryChain
+{
+public:
+    /// Constructor. Throws an exception if the file cannot be opened or mapped, or if it is invalid.
+    /// \param fileName The name of the compressed chain file.
+    MappedCompressedBinaryChain(const char* fileName);
+
+    /// Destructor.
+    ~MappedCompressedBinaryChain();
+
+    /// The number of parameters.
+    int nParams() const { return paramNames_.size(); }
+
+    /// The names of the parameters.
+    const std::vector<std::string>& paramNames() const { return paramNames_; }
+
+    /// The compressed records. Each record contains the weight, -2ln(likelihood), and the parameter values.
+    const CompressedRecords& records() const { check(records_, ""); return *records_; }
+
+    /// The number of elements.
+    unsigned long size() const { return records().size(); }
+
+private:
+    MappedCompressedBinaryChain(const MappedCompressedBinaryChain&);
+    MappedCompressedBinaryChain& operator=(const MappedCompressedBinaryChain&);
+
+private:
+    std::vector<std::string> paramNames_;
+    Math::MappedFile file_;
+    CompressedRecords* records_;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef COSMO_PP_CHECKPOINT_COORDINATOR_HPP
+#define COSMO_PP_CHECKPOINT_COORDINATOR_HPP
+
+#include <vector>
+#include <mutex>
+
+#include <macros.hpp>
+
+/// Preemption-safe checkpointing, for jobs that get a termination signal some time before being killed (for example on preemptible nodes, or from a batch system at the end of the time limit).
+
+/// All of the functions in the class are static.
+/// install traps the termination signals. The handlers only set a flag, everything else is done by the samplers at a safe point: MetropolisHastings, EnsembleSampler, and ParallelTempering check the flag after each complete step, stop the run, and write their chain files and resume information, which are then consistent with each other, so the run is resumed from exactly that point when started again. Then the registered objects (Checkpointable, for example LearnAsYouGo with a file) write their snapshots, all of them in the background at the same time, and the sampler waits for them to finish before returning.
+/// A second signal after the first one is not trapped anymore, so it terminates the process as usual.
+/// With MPI, all of the processes must call install (the samplers that move in lockstep check the flags of all of the processes together only if it has been installed). EnsembleSampler, ParallelTempering, and MetropolisHastings with the COLLECTIVE protocol combine the flags of the processes, so it is enough for one process to get the signal. MetropolisHastings with point to point communication is stopped by its master, so the master process must get the signal (mpirun and the batch systems send it to all of the processes). After run returns, requested() tells if the run was stopped because of a signal, so the program can exit instead of starting its post-processing.
+/// \code
+/// CheckpointCoordinator::install();
+/// mh.run(100000, 100);
+/// if(CheckpointCoordinator::requested())
+///     return 0;
+/// \endcode
+class CheckpointCoordinator
+{
+public:
+    /// An abstract class for the objects that write their state when the run is stopped.
+    class Checkpointable
+    {
+    public:
+        virtual ~Checkpointable() {}
+
+        /// Start writing the current state (purely virtual). Should return as soon as possible, writing in the background.
+        virtual void startFlush() = 0;
+
+        /// Wait until the state started by startFlush has been written (purely virtual).
+        virtual void finishFlush() = 0;
+    };
+
+    /// Trap the termination signals SIGTERM, SIGINT, SIGHUP, SIGUSR1 and SIGUSR2 (SIGUSR1 and SIGUSR2 are often used by the batch systems to warn before the time limit). Can be called more than once.
+    static void install();
+
+    /// Trap one more signal.
+    /// \param signal The signal number.
+    static void installSignal(int signal);
+
+    /// Checks if install has been called.
+    static bool isInstalled();
+
+    /// Checks if a stop has been requested in this process, by a signal or by request.
+    static bool requested();
+
+    /// Checks if a stop has been requested in any of the processes. With MPI, ALL of the processes must call this at the same time.
+    static bool requestedEverywhere();
+
+    /// Request a stop, the same as receiving a signal.
+    static void request();
+
+    /// Forget the request, for example to continue with another run. Does not trap the signals again, call install for that.
+    static void reset();
+
+    /// Register an object to be checkpointed by flush. The object must unregister itself before it is destroyed.
+    static void add(Checkpointable* object);
+
+    /// Unregister an object.
+    static void remove(Checkpointable* object);
+
+    /// Checkpoint all of the registered objects, starting all of them before waiting for any. Only done once after each request, called by the samplers when they stop because of a request. Should not be called while the objects are being used by other threads.
+    static void flush();
+
+private:
+    static std::mutex mutex_;
+    static std::vector<Checkpointable*> objects_;
+    static bool installed_;
+    static bool flushed_;
+};
+
+#endif
+
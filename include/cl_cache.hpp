@@ -0,0 +1,88 @@
+#ifndef COSMO_PP_CL_CACHE_HPP
+#define COSMO_PP_CL_CACHE_HPP
+
+#include <vector>
+#include <list>
+#include <map>
+
+#include <macros.hpp>
+
+/// A cache of power spectra keyed by parameter vectors.
+
+/// This keeps the results of the most recently used parameters (least recently used entries are dropped when the capacity is reached), so that the samplers revisiting the same points (rejected fast-slow steps, repeated evaluations, resumed runs) do not need to repeat the Boltzmann calculation. The keys must match exactly.
+/// Each entry is a set of spectra (vectors of doubles), some of which can be empty.
+/// Optionally, an additional cache can be shared between the processes on the same node (useNodeSharedStorage). That one is a fixed size table in shared memory, where each key goes into one slot determined from its hash, replacing the previous entry in that slot. The entries found there are also added to the local cache.
+/// The cache is used by CMB (see CMB::setClCache), but can be used for any other spectra as well.
+class ClCache
+{
+public:
+    /// Constructor.
+    /// \param capacity The maximum number of entries kept in the local cache.
+    ClCache(unsigned long capacity = 100);
+
+    /// Destructor. Frees the node shared memory if used, so must be called by all of the processes on the node at the same time in that case.
+    ~ClCache();
+
+    /// Use a cache shared between the processes on the same node, in addition to the local one. Must be called by all of the processes at the same time. Does nothing if there is only one process.
+    /// \param capacity The number of slots in the shared table. Only the value given by the first process on the node is used.
+    /// \param maxKeySize The maximum size of the keys. Larger keys are not shared.
+    /// \param maxValueSize The maximum total size of the spectra of an entry (plus one for each spectrum and one more). Larger entries are not shared.
+    void useNodeSharedStorage(unsigned long capacity, int maxKeySize, int maxValueSize);
+
+    /// Look up an entry.
+    /// \param key The key.
+    /// \param spectra The spectra will be written here if found.
+    /// \return true if found.
+    bool find(const std::vector<double>& key, std::vector<std::vector<double> >* spectra);
+
+    /// Add an entry. If the key is already there, its spectra are replaced.
+    /// \param key The key.
+    /// \param spectra The spectra.
+    void insert(const std::vector<double>& key, const std::vector<std::vector<double> >& spectra);
+
+    /// The number of entries in the local cache.
+    unsigned long size() const { return entries_.size(); }
+
+    /// The maximum number of entries in the local cache.
+    unsigned long capacity() const { return capacity_; }
+
+    /// Remove all of the local entries.
+    void clear();
+
+    /// The number of lookups found in the local cache.
+    unsigned long hits() const { return hits_; }
+
+    /// The number of lookups found in the node shared cache (and not in the local one).
+    unsigned long sharedHits() const { return sharedHits_; }
+
+    /// The number of lookups not found.
+    unsigned long misses() const { return misses_; }
+
+private:
+    ClCache(const ClCache&);
+    ClCache& operator=(const ClCache&);
+
+    void insertLocal(const std::vector<double>& key, const std::vector<std::vector<double> >& spectra);
+    bool findShared(const std::vector<double>& key, std::vector<std::vector<double> >* spectra);
+    void insertShared(const std::vector<double>& key, const std::vector<std::vector<double> >& spectra);
+    double* sharedSlot(unsigned long i) const;
+
+private:
+    typedef std::pair<std::vector<double>, std::vector<std::vector<double> > > Entry;
+
+    unsigned long capacity_;
+    // the most recently used entries are in the front
+    std::list<Entry> entries_;
+    std::map<std::vector<double>, std::list<Entry>::iterator> index_;
+
+    unsigned long hits_, sharedHits_, misses_;
+
+    void* sharedWindow_;
+    void* sharedBase_;
+    unsigned long sharedCapacity_;
+    int maxKeySize_, maxValueSize_;
+    std::vector<double> flat_;
+};
+
+#endif
+
@@ -0,0 +1,102 @@
+#ifndef COSMO_PP_CL_SET_FILE_HPP
+#define COSMO_PP_CL_SET_FILE_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <mapped_file.hpp>
+
+/// A class for writing many sets of CMB power spectra (Cl-s) into one binary file, for example from a Boltzmann code or an emulator, to be read back with MappedClSets.
+
+/// All of the functions in the class are static.
+/// A Cl set file starts with a 32 byte header containing the magic string COSMOCLS, the format version, l_max, the mask of the spectra included (1 << spectrum for each), and the number of sets.
+/// The header is followed by the sets, each one containing the included spectra in the order of the Spectrum enum, each from l = 0 to l_max, all as doubles. The spectra are in the same units as given to PlanckLikelihood::setCls.
+class ClSetFile
+{
+public:
+    /// The spectra.
+    enum Spectrum { TT = 0, EE, TE, BB, PP, SPECTRUM_MAX };
+
+    /// The current version of the format.
+    static const int version = 1;
+
+    /// The size of the header in bytes.
+    static const long headerSize = 32;
+
+    /// Check if a given file is a Cl set file.
+    /// \param fileName The name of the file.
+    /// \return true if the file exists and starts with the Cl set header.
+    static bool isClSetFile(const char* fileName);
+
+    /// The number of spectra included for a given mask.
+    static int nSpectra(int spectraMask);
+
+    /// Write a complete Cl set file at once. The file is first written under a temporary name and then renamed, so a reader never sees a partially written file.
+    /// \param fileName The name of the file.
+    /// \param lMax The maximum l of the spectra.
+    /// \param spectraMask The spectra included, the sum of 1 << spectrum. Must include TT.
+    /// \param sets The sets, one after the other, each containing nSpectra(spectraMask) * (lMax + 1) values.
+    /// \param nSets The number of sets.
+    static void writeFile(const char* fileName, int lMax, int spectraMask, const double* sets, unsigned long nSets);
+};
+
+/// A read-only memory-mapped view of a Cl set file (see ClSetFile).
+
+/// The file is mapped into memory and the spectra are accessed in place, nothing is parsed or copied. The mapped pages are shared by all of the processes mapping the same file, including the ones forked after the mapping (for example the workers of Math::ProcessLikelihoodPool).
+/// The sets are usually read in order, so the kernel is told to read ahead. prefetch can be used to start reading a range of the sets in the background before it is needed.
+class MappedClSets
+{
+public:
+    /// Constructor. Throws an exception if the file cannot be opened or mapped, or is not a valid Cl set file.
+    /// \param fileName The name of the file.
+    MappedClSets(const char* fileName);
+
+    /// The maximum l of the spectra.
+    int lMax() const { return lMax_; }
+
+    /// The mask of the spectra included (see ClSetFile::writeFile).
+    int spectraMask() const { return mask_; }
+
+    /// Checks if a given spectrum is included.
+    bool hasSpectrum(ClSetFile::Spectrum s) const { return (mask_ & (1 << s)) != 0; }
+
+    /// The number of sets.
+    unsigned long size() const { return size_; }
+
+    /// The number of values in one set.
+    long setLength() const { return setLength_; }
+
+    /// A given set, containing all of the included spectra one after the other.
+    /// \param i The index of the set.
+    const double* set(unsigned long i) const { check(i < size_, "invalid index " << i); return data_ + i * setLength_; }
+
+    /// One spectrum of a given set, the index is l.
+    /// \param i The index of the set.
+    /// \param s The spectrum.
+    /// \return A pointer to the lMax() + 1 values, NULL if the spectrum is not included.
+    const double* spectrum(unsigned long i, ClSetFile::Spectrum s) const { return (offsets_[s] < 0 ? NULL : set(i) + offsets_[s]); }
+
+    /// Copy one spectrum of a given set.
+    /// \param i The index of the set.
+    /// \param s The spectrum, must be included.
+    /// \param cl The values are written here upon return, the index is l.
+    void getSpectrum(unsigned long i, ClSetFile::Spectrum s, std::vector<double>* cl) const;
+
+    /// Start reading the sets from begin to end in the background, so that they are in memory by the time they are needed. Returns immediately.
+    void prefetch(unsigned long begin, unsigned long end) const;
+
+private:
+    MappedClSets(const MappedClSets&);
+    MappedClSets& operator=(const MappedClSets&);
+
+private:
+    Math::MappedFile file_;
+    const double* data_;
+    int lMax_, mask_;
+    long setLength_;
+    long offsets_[ClSetFile::SPECTRUM_MAX];
+    unsigned long size_;
+};
+
+#endif
+
@@ -2,8 +2,10 @@
 #define COSMO_PP_CMB_HPP
 
 #include <vector>
+#include <ostream>
 
 #include <table_function.hpp>
+#include <matrix.hpp>
 #include <cosmological_params.hpp>
 
 struct precision;
@@ -18,6 +20,8 @@ struct nonlinear;
 struct lensing;
 struct output;
 
+class ClCache;
+
 /// This class can be used to calculate cmb power spectra, transfer functions, etc. It uses the publicly available code CLASS.
 /// To do calculations one needs to first pre-initialize it, then initialize it, after which one can get the power spectra and the transfer functions.
 /// Initialization can be done multiple times after pre-initialization with new parameters. The initialization is divided into two steps for faster calculations with different cosmological parameters.
@@ -26,10 +30,55 @@ class CMB
 {
 public:
     /// Constructor.
-    CMB() : preInit_(false), init_(false), primordialInitialize_(true), lensing_(false), includeTensors_(false) { allocate(); }
+    CMB() : preInit_(false), init_(false), primordialInitialize_(true), lensing_(false), includeTensors_(false), clCache_(NULL), fromCache_(false), lowPrecision_(false), precisionChanged_(false), printStageStatsAtEnd_(false), stageStats_(STAGE_MAX) { allocate(); }
 
     /// Destructor.
-    virtual ~CMB() { if(preInit_) preClean(); deAllocate(); }
+    virtual ~CMB();
+
+    /// The stages of the CLASS calculation in initialize, for the timing statistics.
+    enum Stage { BACKGROUND = 0, THERMODYNAMICS, PERTURBATIONS, PRIMORDIAL, NONLINEAR, TRANSFER, SPECTRA, LENSING, STAGE_MAX };
+
+    /// Timing statistics of one stage.
+    struct StageStats
+    {
+        StageStats() : calls(0), retries(0), seconds(0) {}
+
+        /// The number of times the stage has been calculated (the stages that are reused from the previous initialize are not counted).
+        unsigned long calls;
+
+        /// The number of times the CLASS init function of the stage failed and was tried again with slightly changed parameters.
+        unsigned long retries;
+
+        /// The total wall time in seconds, including the retries.
+        double seconds;
+    };
+
+    /// The name of a stage.
+    static const char* stageName(Stage s);
+
+    /// The statistics of a stage, summed over the initialize calls since construction (or the last resetStageStats).
+    /// \param s The stage.
+    const StageStats& stageStats(Stage s) const { check(s >= 0 && s < STAGE_MAX, "invalid stage " << s); return stageStats_[s]; }
+
+    /// The total number of retries of all the stages, summed over the initialize calls since construction (or the last resetStageStats).
+    unsigned long totalRetries() const
+    {
+        unsigned long r = 0;
+        for(int i = 0; i < STAGE_MAX; ++i)
+            r += stageStats_[i].retries;
+        return r;
+    }
+
+    /// Reset the statistics of all the stages.
+    void resetStageStats();
+
+    /// Print a table of the statistics of all the stages, summed over all of the MPI processes (the maximum time over the processes is also given). Must be called by all of the processes at the same time, only the master process prints.
+    /// \param out The stream to print to.
+    void printStageStats(std::ostream& out) const;
+
+    /// Print the statistics of this process to the screen when this object is destroyed. Off by default.
+    /// \param print Turns the printing on or off.
+    void setPrintStageStatsAtEnd(bool print) { printStageStatsAtEnd_ = print; }
 
     /// Pre-initialization routine. Always must be called after the constructor and before initialization can be done.
     /// \param lMax The maximum value of l for calculations. NOTE: Lensed cl-s will be calculated up to a value less than lMax, if requested. It is recommended to give lMax higher than requested lensed cl-s by 1000.
@@ -42,7 +91,17 @@ public:
     /// \param kMax Used only if primordialInitialize is true. This is the upper end for initializing the primordial power spectrum.
     virtual void preInitialize(int lMax, bool wantAllL = false, bool primordialInitialize = true, bool includeTensors = false, int lMaxTensors = 0, double kPerDecade = 100, double kMin = 1e-6, double kMax = 1.0);
 
+    /// Switch to a cheaper, lower precision calculation, or back to the full precision set by preInitialize. Useful for the burnin of a sampler (see MetropolisHastings::usePrecisionSchedule).
+    /// The low precision uses half as many k values for the primordial power spectrum and the perturbations, a sparser l sampling (unless wantAllL was set in preInitialize), and a lower tolerance for the integration of the perturbations.
+    /// Must be called after preInitialize, which resets the precision to full. The next call of initialize recalculates everything.
+    /// \param low true for the low precision, false for the full precision.
+    void setLowPrecision(bool low);
+
+    /// Checks if the low precision is used (see setLowPrecision).
+    bool isLowPrecision() const { return lowPrecision_; }
+
     /// Initialization routine. Must be called after pre-initialization. Can be called multiple times in a row.
+    /// Only the CLASS modules affected by the parameters that changed since the previous call are recalculated. For example, if only the primordial power spectrum has changed (A_s, n_s, or the shape given by params.powerSpectrum()) the perturbations and the transfer functions are reused, and only the primordial power spectrum and the Cl-s are recalculated (as long as the matter power spectrum is not needed). If nothing has changed, nothing is recalculated.
     /// \param params The cosmological parameters to use.
     /// \param wantT A flag specifying if the T mode (temperature) should be calculated.
     /// \param wantPol A flag specifying if polarization modes (E and B) should be calculated.
@@ -51,6 +110,10 @@ public:
     /// \param zMaxPk The redshift up to which the matter power spectrum is needed. This parameter matters only if wantMatterPs is true.
     virtual void initialize(const CosmologicalParams& params, bool wantT = true, bool wantPol = false, bool wantLensing = false, bool wantMatterPs = false, double zMaxPk = 0);
 
+    /// Use a cache of the Cl-s. If initialize is called again with the same parameters (as given by getAllParameters, which must be implemented by the parameters class) and the same settings, the Cl-s are taken from the cache and CLASS is not called. In that case only getCl and getLensedCl can be used until the next initialize.
+    /// \param cache The cache, NULL turns caching off. It is not owned by this class, so it can be kept (and shared between CMB objects used from the same thread).
+    void setClCache(ClCache* cache) { clCache_ = cache; fromCache_ = false; }
+
     /// Retrieves the values of the calculated CMB power spectra.
     /// \param clTT A pointer to a vector where TT power spectra should be stored. Give NULL if not wanted. NOTE: Can only be requested if T modes have been calculated during initialization.
     /// \param clEE A pointer to a vector where EE power spectra should be stored. Give NULL if not wanted. NOTE: Can only be requested if polarization modes have been calculated during initialization.
@@ -68,6 +131,31 @@ public:
     /// \param clBB A pointer to a vector where lensed BB power spectra should be stored. Give NULL if not wanted. NOTE: Can only be requested if polarization modes have been calculated during initialization.
     virtual void getLensedCl(std::vector<double>* clTT, std::vector<double>* clEE = NULL, std::vector<double>* clTE = NULL, std::vector<double>* clBB = NULL);
 
+    /// The maximum l of the Cl-s returned by getCl (the lMax given to preInitialize).
+    int lMax() const { return lMax_; }
+
+    /// The maximum l of the lensed Cl-s returned by getLensedCl. Can be called only if lensing has been calculated during initialization.
+    int lMaxLensed() const;
+
+    /// Retrieves the values of the calculated CMB power spectra into buffers given by the caller, without allocating memory. All of the requested spectra are extracted together in one pass over l. The conditions for requesting each spectrum are the same as for getCl.
+    /// \param lMax The buffers must have size at least lMax + 1. The values for l above lMax() (and for l < 2) are set to 0.
+    /// \param clTT The buffer for the TT power spectrum, NULL if not wanted.
+    /// \param clEE The buffer for the EE power spectrum, NULL if not wanted.
+    /// \param clTE The buffer for the TE power spectrum, NULL if not wanted.
+    /// \param clPP The buffer for the PP power spectrum (lensing potential), NULL if not wanted.
+    /// \param clTP The buffer for the TP power spectrum, NULL if not wanted.
+    /// \param clEP The buffer for the EP power spectrum, NULL if not wanted.
+    /// \param clBB The buffer for the BB power spectrum, NULL if not wanted.
+    virtual void getClInto(int lMax, double* clTT, double* clEE = NULL, double* clTE = NULL, double* clPP = NULL, double* clTP = NULL, double* clEP = NULL, double* clBB = NULL);
+
+    /// Retrieves the values of the lensed Cl-s into buffers given by the caller, without allocating memory. All of the requested spectra are extracted together in one pass over l. The conditions for requesting each spectrum are the same as for getLensedCl.
+    /// \param lMax The buffers must have size at least lMax + 1. The values for l above lMaxLensed() (and for l < 2) are set to 0.
+    /// \param clTT The buffer for the lensed TT power spectrum, NULL if not wanted.
+    /// \param clEE The buffer for the lensed EE power spectrum, NULL if not wanted.
+    /// \param clTE The buffer for the lensed TE power spectrum, NULL if not wanted.
+    /// \param clBB The buffer for the lensed BB power spectrum, NULL if not wanted.
+    virtual void getLensedClInto(int lMax, double* clTT, double* clEE = NULL, double* clTE = NULL, double* clBB = NULL);
+
     /// Retrieves CMB transfer functions. In order for this function to work properly all l calculation must be requested during pre-initialization.
     /// \param l The value of l for the transfer function.
     /// \param t A pointer to a map where the temperature transfer function should be stored. Give NULL if not wanted. NOTE: Can only be requested if T modes have been calculated during initialization.
@@ -75,6 +163,15 @@ public:
     /// \param p A pointer to a map where the the lensing potential transfer function should be stored. Give NULL if not wanted. NOTE: Can only be requested if lensing has been calculated during initialization.
     virtual void getTransfer(int l, Math::TableFunction<double, double>* t, Math::TableFunction<double, double>* e = NULL, Math::TableFunction<double, double>* p = NULL);
 
+    /// Retrieves the CMB transfer functions for all l in a range at once, as dense arrays. In order for this function to work properly all l calculation must be requested during pre-initialization.
+    /// \param lMin The minimum value of l, at least 2.
+    /// \param lMax The maximum value of l, at most the lMax of pre-initialization.
+    /// \param k The values of k will be written here, the same for all l.
+    /// \param t The temperature transfer functions will be written here, the row l - lMin contains the values for l at the k values. Give NULL if not wanted. NOTE: Can only be requested if T modes have been calculated during initialization.
+    /// \param e The E mode transfer functions, in the same format. Give NULL if not wanted. NOTE: Can only be requested if polarization modes have been calculated during initialization.
+    /// \param p The lensing potential transfer functions, in the same format. Give NULL if not wanted. NOTE: Can only be requested if lensing has been calculated during initialization.
+    virtual void getTransfers(int lMin, int lMax, std::vector<double>* k, Math::Matrix<double>* t, Math::Matrix<double>* e = NULL, Math::Matrix<double>* p = NULL);
+
     /// Retrieves the matter power spectrum. Should not be called unless wantMatterPs is set to true in initialize.
     /// \param z The redshift at which the matter power spectrum is wanted. Should not exceed zMaxPk of initialize.
     /// \param ps A pointer to a map where the matter power spectrum will be written.
@@ -85,6 +182,12 @@ public:
     /// \param tk A pointer to a map where the matter transfer function will be written.
     virtual void getMatterTransfer(double z, Math::TableFunction<double, double>* tk);
 
+    /// Retrieves the matter transfer function for several redshifts at once, as a dense array. Should not be called unless wantMatterPs is set to true in initialize.
+    /// \param z The redshifts. None of them should exceed zMaxPk of initialize.
+    /// \param k The values of k will be written here, the same for all z.
+    /// \param tk The transfer functions will be written here, the row i contains the values for z[i] at the k values.
+    virtual void getMatterTransfers(const std::vector<double>& z, std::vector<double>* k, Math::Matrix<double>* tk);
+
     /// Calculates sigma_8. Should not be called unless wantMatterPs is set to true in initialize.
     /// \return The sigma_8 value.
     virtual double sigma8();
@@ -103,6 +206,18 @@ protected:
     void allocate();
     void deAllocate();
 
+    // tabulate ln(f(k)) on the k grid of the primordial power spectrum table of CLASS
+    void tabulatePrimordial(const Math::RealFunction& f, std::vector<double>* lnPk) const;
+
+    // the key for the Cl cache, the parameters followed by the settings
+    void clCacheKey(const CosmologicalParams& params, bool wantT, bool wantPol, bool wantLensing, bool wantMatterPs, double zMaxPk, std::vector<double>* key) const;
+    void addToClCache();
+    void copyCachedCl(int i, std::vector<double>* cl) const;
+    void copyCachedCl(int i, int lMax, double* cl) const;
+
+    // replace the primordial power spectrum table of CLASS for a given mode and initial condition with tabulated values, and re-spline
+    void setPrimordialTable(int mdIndex, int icIndex, const std::vector<double>& lnPk);
+
 protected:
     const CosmologicalParams* params_;
 
@@ -138,6 +253,23 @@ protected:
     int prevNCDM_;
     std::vector<double> prevTCDM_, prevMCDM_;
     bool prevWantMatter_, prevWantT_, prevWantP_, prevWantLens_;
+    double prevAs_, prevNs_, prevPivot_, prevR_, prevNt_;
+    std::vector<double> prevLnPk_, prevLnPkTensor_;
+    unsigned long prevPrimordialRevision_;
+
+    ClCache* clCache_;
+    bool fromCache_;
+    std::vector<double> cacheKey_;
+
+    // the precision settings of preInitialize that setLowPrecision changes
+    bool wantAllL_;
+    bool lowPrecision_, precisionChanged_;
+    double fullKPerDecadePrimordial_, fullLLogstep_, fullLLinstep_, fullKStepSub_, fullKStepSuper_, fullTolPerturbIntegration_, fullPerturbSamplingStepsize_;
+    // the unlensed TT, EE, TE, PP, TP, EP, BB, followed by the lensed TT, EE, TE, BB, empty if not calculated
+    std::vector<std::vector<double> > cachedCls_;
+
+    bool printStageStatsAtEnd_;
+    std::vector<StageStats> stageStats_;
 };
 
 #endif
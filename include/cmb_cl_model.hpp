@@ -0,0 +1,42 @@
+#ifndef COSMO_PP_CMB_CL_MODEL_HPP
+#define COSMO_PP_CMB_CL_MODEL_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <cmb_pool.hpp>
+#include <cosmological_params.hpp>
+#include <fisher_matrix.hpp>
+
+/// The CMB power spectra calculated by CLASS, as a Math::ClModel for FisherMatrix.
+
+/// The points of a batch are calculated concurrently by the instances of a CMBPool. The parameter vectors are set into the given CosmologicalParams objects with setParameters, so the parameters of the Fisher matrix are the parameters of that model.
+class CMBClModel : public Math::ClModel
+{
+public:
+    /// Constructor.
+    /// \param pool The pool of CMB instances. Its lMax must be at least lMax.
+    /// \param params The cosmological parameters objects, all of the same model. The batches are calculated in chunks of params.size() points, so there should be at least pool.size() of them.
+    /// \param lMax The maximum l of the spectra.
+    /// \param polarization Calculate the EE and TE spectra too.
+    /// \param lensed Calculate the lensed spectra.
+    CMBClModel(CMBPool& pool, const std::vector<CosmologicalParams*>& params, int lMax, bool polarization = true, bool lensed = false);
+
+    virtual int lMax() const { return lMax_; }
+    virtual bool hasPolarization() const { return polarization_; }
+    virtual void calculateBatch(const double* params, int nParams, int nPoints, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE);
+
+private:
+    CMBPool& pool_;
+    std::vector<CosmologicalParams*> params_;
+    const int lMax_;
+    const bool polarization_;
+    const bool lensed_;
+
+    // the points of one chunk and their spectra, reused
+    std::vector<const CosmologicalParams*> chunk_;
+    std::vector<std::vector<double> > tt_, ee_, te_;
+};
+
+#endif
+
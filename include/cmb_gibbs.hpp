@@ -4,6 +4,8 @@
 #include <vector>
 
 #include <random.hpp>
+#include <mapped_matrix.hpp>
+#include <spherical_harmonic_transform.hpp>
 
 #include <healpix_map.h>
 #include <alm.h>
@@ -25,7 +27,7 @@ public:
     /// \param lMax The maximum value of l for sampling.
     /// \param fwhm The full width at half maximum of the beam function of the map (in degrees).
     /// \param startingClFileName The name of the file containing the C_l values for starting the sampling. Each line of the file should contain one C_l value, starting from l = 0.
-    /// \param seed A random seed for scanning. If the value is 0 (which it is by default) the seed will be chosen from the current time.
+    /// \param seed A random seed for scanning. If the value is 0 (which it is by default) the seed will be chosen from the current time. The id of the MPI process is added to the seed so that the processes generate independent samples.
     CMBGibbsSampler(const char* mapName, const char* noiseMapName, const char* maskName, double pixelNoise, int lMax, double fwhm, const char* startingClFileName, time_t seed = 0);
 
     /// Constructor.
@@ -36,7 +38,7 @@ public:
     /// \param lMax The maximum value of l for sampling.
     /// \param fwhm The full width at half maximum of the beam function of the map (in degrees).
     /// \param startingCl A vector containing the C_l values for starting the sampling, starting from l = 0.
-    /// \param seed A random seed for scanning. If the value is 0 (which it is by default) the seed will be chosen from the current time.
+    /// \param seed A random seed for scanning. If the value is 0 (which it is by default) the seed will be chosen from the current time. The id of the MPI process is added to the seed so that the processes generate independent samples.
     CMBGibbsSampler(const Healpix_Map<double>& map, const Healpix_Map<double>& noiseMap, const Healpix_Map<double>& mask, double pixelNoise, int lMax, double fwhm, const std::vector<double>& startingCl, time_t seed = 0);
 
     /// Destructor.
@@ -67,12 +69,49 @@ public:
     /// \return -2ln(likelihood).
     static double calculateLikelihood(const std::vector<double>& cl, const GibbsSampleChain& chain, int lMax);
 
+    /// Calculate the likelihood of given C_l values given a Gibbs chain memory-mapped from a file written by writeChainIntoMappedFile. Only the rows with l <= lMax are read.
+    /// \param cl A vector containg the C_l values for which the likelihood must be calculated, starting from l = 0.
+    /// \param chain The mapped chain, with the sigma_l values of all of the samples for each l in a row.
+    /// \param lMax The maximum value of l to be used in the calculation. cl must have size >= lMax + 1 and the chain must have at least lMax + 1 rows.
+    /// \return -2ln(likelihood).
+    static double calculateLikelihood(const std::vector<double>& cl, const Math::MappedMatrix& chain, int lMax);
+
+    /// Calculate the likelihood of given C_l values given a sigma_l sample, and its gradient with respect to the C_l-s in closed form.
+    /// \param cl A vector containg the C_l values for which the likelihood must be calculated, starting from l = 0.
+    /// \param sigmaL A vector containing the sigma_l sample, starting from l = 0.
+    /// \param lMax The maximum value of l to be used in the calculation. Both cl and sigmaL must have sizes >= lMax + 1.
+    /// \param grad The derivatives of -2ln(likelihood) with respect to the C_l-s will be written here, starting from l = 0 (lMax + 1 values, 0 for l < 2).
+    /// \return -2ln(likelihood).
+    static double calculateLikelihoodWithGradient(const std::vector<double>& cl, const std::vector<double>& sigmaL, int lMax, std::vector<double>* grad);
+
+    /// Calculate the Blackwell-Rao likelihood of given C_l values given a Gibbs chain, and its gradient with respect to the C_l-s in closed form. The gradient is the average of the gradients of the samples weighted by their likelihoods, so it costs about the same as calculateLikelihood.
+    /// \param cl A vector containg the C_l values for which the likelihood must be calculated, starting from l = 0.
+    /// \param chain The Gibbs chain to be used for the likelihood calculation, can be generated using generateChain.
+    /// \param lMax The maximum value of l to be used in the calculation. The chain elements and cl must have sizes >= lMax + 1.
+    /// \param grad The derivatives of -2ln(likelihood) with respect to the C_l-s will be written here, starting from l = 0 (lMax + 1 values, 0 for l < 2).
+    /// \return -2ln(likelihood), the same as calculateLikelihood.
+    static double calculateLikelihoodWithGradient(const std::vector<double>& cl, const GibbsSampleChain& chain, int lMax, std::vector<double>* grad);
+
+    /// Calculate the Blackwell-Rao likelihood of given C_l values given a memory-mapped Gibbs chain (see calculateLikelihood), and its gradient with respect to the C_l-s in closed form.
+    /// \param cl A vector containg the C_l values for which the likelihood must be calculated, starting from l = 0.
+    /// \param chain The mapped chain, with the sigma_l values of all of the samples for each l in a row.
+    /// \param lMax The maximum value of l to be used in the calculation. cl must have size >= lMax + 1 and the chain must have at least lMax + 1 rows.
+    /// \param grad The derivatives of -2ln(likelihood) with respect to the C_l-s will be written here, starting from l = 0 (lMax + 1 values, 0 for l < 2).
+    /// \return -2ln(likelihood), the same as calculateLikelihood.
+    static double calculateLikelihoodWithGradient(const std::vector<double>& cl, const Math::MappedMatrix& chain, int lMax, std::vector<double>* grad);
+
     /// Generate a Gibbs chain. The chain will be generated from the current state of the sampler, i.e. samples will be generated and written in the chain starting from the current state.
     /// \param chain The Gibbs chain will be written here.
     /// \param nSamples The number of samples that the chain must contain.
     /// \param burnIn The number of samples to ignore before starting to write the chain.
     void generateChain(GibbsSampleChain& chain, int nSamples, int burnIn = 10);
 
+    /// Generate Gibbs chains in parallel with MPI. Each process runs its own independent chain (the random sequences of the processes are different, see the constructor) and all of the chains are combined, so calculateLikelihood gives the Blackwell-Rao estimator from all of them. Must be called by all of the processes at the same time. The spherical harmonic transforms of each process can still use threads (OpenMP).
+    /// \param chain The combined chain will be written here on all of the processes, the samples of process 0 first, then those of process 1, etc.
+    /// \param nSamples The number of samples for each process.
+    /// \param burnIn The number of samples to ignore on each process before starting to write the chain.
+    void generateChainMPI(GibbsSampleChain& chain, int nSamples, int burnIn = 10);
+
     /// Write a given Gibbs chain into a file.
     /// \param chain The chain to be written in a file.
     /// \param fileName The name of the file to contain the chain.
@@ -83,8 +122,24 @@ public:
     /// \param fileName The name of the file to read from.
     static void readChainFromFile(GibbsSampleChain& chain, const char* fileName);
 
+    /// Write a given Gibbs chain into a binary file that can be memory-mapped (see Math::MappedMatrix). The values are stored by l, i.e. the sigma_l values of all of the samples are contiguous for each l, so the likelihood calculations for low l only read the beginning of the file.
+    /// \param chain The chain to be written in a file.
+    /// \param fileName The name of the file to contain the chain.
+    static void writeChainIntoMappedFile(const GibbsSampleChain& chain, const char* fileName);
+
+    /// Read a Gibbs chain from a file written by writeChainIntoMappedFile.
+    /// \param chain The chain will be written here.
+    /// \param fileName The name of the file to read from.
+    /// \param lMax Only the values up to this l are read. A negative value (the default) reads all of them.
+    static void readChainFromMappedFile(GibbsSampleChain& chain, const char* fileName, int lMax = -1);
+
 private:
+    static double combineLikelihoods(std::vector<double>& likeVec);
+    static double combineWeights(const std::vector<double>& likeVec, std::vector<double>* weights);
+    static void mappedLikelihoods(const std::vector<double>& cl, const Math::MappedMatrix& chain, int lMax, std::vector<double>* likeVec);
+
     void calculateSigmaL();
+    void calculateNoiseDiagonal();
 
     void generateCl();
     void generateSignal();
@@ -98,10 +153,14 @@ private:
     Alm<xcomplex<double> > s_;
     std::vector<double> beam_;
     double pixelNoise_;
+    std::vector<double> noiseDiag_; // the diagonal of Y^T N^-1 Y in harmonic space, used for preconditioning
     double a00_, a1m1_, a10_, a11_; // monopole and dipole coefficients
     Healpix_Map<double> y00_, y1m1_, y10_, y11_;
 
     Math::GaussianGenerator* generator_;
+
+    // the geometry of the transforms is set up once for all of the steps
+    SphericalHarmonicTransform* sht_;
 };
 
 #endif
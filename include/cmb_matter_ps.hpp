@@ -0,0 +1,34 @@
+#ifndef COSMO_PP_CMB_MATTER_PS_HPP
+#define COSMO_PP_CMB_MATTER_PS_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <function.hpp>
+#include <table_function.hpp>
+#include <cosmological_params.hpp>
+#include <cmb.hpp>
+
+/// The matter power spectrum calculated with CLASS as a function of the cosmological parameters, on a fixed grid of k and z values. This is the function emulated by MatterPsEmulator for large scale structure likelihoods.
+class CMBMatterPs : public Math::RealFunctionMultiToMulti
+{
+public:
+    /// Constructor.
+    /// \param cmb The CMB object, must be pre-initialized.
+    /// \param params The cosmological parameters, the input of evaluate is given to its setAllParameters.
+    /// \param k The k values of the grid, in increasing order. The power spectrum is interpolated to them in log-log space.
+    /// \param z The redshifts of the grid, in increasing order.
+    CMBMatterPs(CMB& cmb, CosmologicalParams& params, const std::vector<double>& k, const std::vector<double>& z);
+
+    /// Calculate the power spectrum. CMB::initialize is called with only the matter power spectrum requested.
+    /// \param x The cosmological parameters.
+    /// \param res P(k[i], z[j]) will be written at index j * k.size() + i.
+    virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const;
+
+private:
+    CMB& cmb_;
+    CosmologicalParams& params_;
+    const std::vector<double> k_, z_;
+};
+
+#endif
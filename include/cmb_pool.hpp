@@ -0,0 +1,73 @@
+#ifndef COSMO_PP_CMB_POOL_HPP
+#define COSMO_PP_CMB_POOL_HPP
+
+#include <vector>
+#include <string>
+#include <thread>
+
+#include <macros.hpp>
+#include <cmb.hpp>
+#include <cosmological_params.hpp>
+
+/// A pool of independent CMB instances for calculating the Cl-s of several points at the same time.
+
+/// A single CMB object (and the CLASS structures it owns) cannot be used from multiple threads. This class holds a given number of CMB objects, all pre-initialized with the same settings, and calculates the Cl-s of a batch of points in parallel, each instance on its own thread (OpenMP).
+/// The threads are shared between the instances, each instance runs the OpenMP parallel regions of CLASS on (total number of threads) / (number of instances) threads, so the cores are not oversubscribed.
+/// This is meant for the samplers that evaluate batches of points (the walkers of EnsembleSampler, the multiple tries of MetropolisHastings), to do several Boltzmann calculations per process at once.
+/// The batches can also be calculated asynchronously with startCls and finishCls.
+class CMBPool
+{
+public:
+    /// Constructor. Allocates and pre-initializes the CMB instances. The parameters are the same as for CMB::preInitialize.
+    /// \param nInstances The number of CMB instances, i.e. the number of points calculated at the same time.
+    /// \param lMax The maximum l.
+    /// \param wantAllL See CMB::preInitialize.
+    /// \param primordialInitialize See CMB::preInitialize.
+    /// \param includeTensors See CMB::preInitialize.
+    /// \param lMaxTensors See CMB::preInitialize.
+    /// \param kPerDecade See CMB::preInitialize.
+    /// \param kMin See CMB::preInitialize.
+    /// \param kMax See CMB::preInitialize.
+    CMBPool(int nInstances, int lMax, bool wantAllL = false, bool primordialInitialize = true, bool includeTensors = false, int lMaxTensors = 0, double kPerDecade = 100, double kMin = 1e-6, double kMax = 1.0);
+
+    /// Destructor. Waits for the asynchronous calculation, if any.
+    ~CMBPool();
+
+    /// The number of instances.
+    int size() const { return cmbs_.size(); }
+
+    /// Access one of the instances, for example to get other results than the Cl-s. Must not be used while a batch is being calculated.
+    /// \param i The index of the instance.
+    CMB& instance(int i) { check(i >= 0 && i < cmbs_.size(), "invalid index " << i); return *(cmbs_[i]); }
+
+    /// Calculate the Cl-s for a batch of points. The Cl-s that are not needed can be NULL. Exceptions thrown by CLASS are rethrown after the whole batch is done.
+    /// \param params The cosmological parameters of the points. Each point is given to one of the instances, so they must be different objects.
+    /// \param clTT The TT spectra will be written here, one vector for each point.
+    /// \param clEE The EE spectra.
+    /// \param clTE The TE spectra.
+    /// \param clBB The BB spectra.
+    /// \param lensed Calculate the lensed Cl-s.
+    void computeCls(const std::vector<const CosmologicalParams*>& params, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE = NULL, std::vector<std::vector<double> >* clTE = NULL, std::vector<std::vector<double> >* clBB = NULL, bool lensed = false);
+
+    /// Start calculating the Cl-s for a batch of points in a separate thread. The arguments are the same as for computeCls and must be kept until finishCls is called. The instances must not be used until then.
+    void startCls(const std::vector<const CosmologicalParams*>& params, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE = NULL, std::vector<std::vector<double> >* clTE = NULL, std::vector<std::vector<double> >* clBB = NULL, bool lensed = false);
+
+    /// Wait until the batch started by startCls is done. Rethrows the exceptions of the calculation.
+    void finishCls();
+
+private:
+    CMBPool(const CMBPool&);
+    CMBPool& operator=(const CMBPool&);
+
+    void computeClsAsync(const std::vector<const CosmologicalParams*>* params, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE, std::vector<std::vector<double> >* clBB, bool lensed);
+
+private:
+    std::vector<CMB*> cmbs_;
+    int threadsPerInstance_;
+
+    std::thread* thread_;
+    std::string asyncError_;
+};
+
+#endif
+
@@ -3,9 +3,12 @@
 
 #include <vector>
 #include <memory>
+#include <cmath>
+#include <utility>
 
 #include <macros.hpp>
 #include <line_search.hpp>
+#include <large_vector_ops.hpp>
 #include <cosmo_mpi.hpp>
 
 namespace Math
@@ -27,6 +30,8 @@ public:
     void add(const LargeVector& other, double c = 1.);
     // swap
     void swap(LargeVector& other);
+
+    // OPTIONAL: dotProducts and linearCombination, see large_vector_ops.hpp
 };
 */
 
@@ -49,12 +54,49 @@ public:
     // for MPI, ALL the processes should get the function value
     double value();
     void derivative(LargeVector *res);
+
+    // OPTIONAL: valueAndDerivative, see line_search.hpp
+
+    // OPTIONAL: apply a symmetric positive definite preconditioner (an approximation of the inverse Hessian) to the gradient, used by CG_General if available
+    void preconditioner(const LargeVector& g, LargeVector *res);
 };
 */
 
+/// Detects the optional preconditioner function of the function of CG_General.
+template<typename Function, typename LargeVector>
+class HasPreconditioner
+{
+private:
+    template<typename F>
+    static char test(decltype(std::declval<F&>().preconditioner(std::declval<const LargeVector&>(), (LargeVector*)(0)))*);
+
+    template<typename F>
+    static long test(...);
+
+public:
+    static const bool value = (sizeof(test<Function>(0)) == 1);
+};
+
+/// Calls the preconditioner of the function if available (see HasPreconditioner).
+template<typename Function, typename LargeVector, bool Preconditioned = HasPreconditioner<Function, LargeVector>::value>
+struct CGPreconditioner
+{
+    static void apply(Function* f, const LargeVector& g, LargeVector* res) { check(false, "the function has no preconditioner"); }
+};
+
+template<typename Function, typename LargeVector>
+struct CGPreconditioner<Function, LargeVector, true>
+{
+    static void apply(Function* f, const LargeVector& g, LargeVector* res) { f->preconditioner(g, res); }
+};
+
 /// A general Non-linear conjugate gradient optimizer.
 
 /// This class can be used to optimize functions (including nonlinear) of possibly very large dimensions using the nonlinear conjugate gradient method.
+/// All of the vectors are allocated in the constructor, the previous point, gradient and direction swap buffers with the current ones instead of being copied.
+/// If the function has the optional preconditioner function (see HasPreconditioner), the preconditioned method is used, the directions are built from the preconditioned gradients h = P g, and g.g in beta is replaced by g.h.
+/// For badly scaled problems (for example in map space) a good preconditioner reduces the number of iterations by orders of magnitude.
+/// The dot products needed for beta are kept from the previous steps, so each iteration takes two reductions besides the line search (fused if LargeVector has dotProducts), and the new direction is calculated in one pass if LargeVector has linearCombination.
 template <typename LargeVector, typename LargeVectorFactory, typename Function>
 class CG_General
 {
@@ -92,7 +134,7 @@ public:
     double minimize(LargeVector *res, double epsilon = 1e-3, double gNormTol = 1e-5, int maxIter = 1000000, Method m = FLETCHER_REEVES)
     {
         DummyCallBack* cb = NULL; // this is a hack
-        minimize(res, epsilon, gNormTol, maxIter, m, cb);
+        return minimize(res, epsilon, gNormTol, maxIter, m, cb);
     }
 
     /// Function for minimization (the main function of this class) WITH callback.
@@ -115,10 +157,21 @@ private:
     double val_;
     std::unique_ptr<LargeVector> g_, gPrev_;
     std::unique_ptr<LargeVector> z_, zPrev_;
-    std::unique_ptr<LargeVector> x0_, g0_;
+    std::unique_ptr<LargeVector> x0_;
     double gradNorm_;
     int iter_;
 
+    // the preconditioned gradients, h = P g (only allocated with a preconditioner, otherwise h is g)
+    static const bool preconditioned_ = HasPreconditioner<Function, LargeVector>::value;
+    std::unique_ptr<LargeVector> h_, hPrev_;
+    const LargeVector& h() const { return (preconditioned_ ? *h_ : *g_); }
+    const LargeVector& hPrev() const { return (preconditioned_ ? *hPrev_ : *gPrev_); }
+
+    // g.g, g.h, g.hPrev, g.zPrev and gPrev.hPrev, gPrev.zPrev, kept for beta
+    double gg_, gh_, ghPrev_, gzPrev_, gPrevhPrev_, gPrevzPrev_;
+    const LargeVector* others_[4];
+    double dots_[4];
+
     CosmoMPI& mpi_;
     double rate_;
 };
@@ -133,7 +186,11 @@ CG_General<LargeVector, LargeVectorFactory, Function>::CG_General(LargeVectorFac
     z_.reset(factory->giveMeOne());
     zPrev_.reset(factory->giveMeOne());
     x0_.reset(factory->giveMeOne());
-    g0_.reset(factory->giveMeOne());
+    if(preconditioned_)
+    {
+        h_.reset(factory->giveMeOne());
+        hPrev_.reset(factory->giveMeOne());
+    }
 
     setStarting(starting);
 }
@@ -145,9 +202,16 @@ CG_General<LargeVector, LargeVectorFactory, Function>::setStarting(const LargeVe
     x_->copy(starting);
 
     f_->set(*x_);
-    val_ = f_->value();
-    f_->derivative(g_.get());
+    val_ = FunctionValueAndDerivative<Function, LargeVector>::calculate(f_, g_.get());
     gradNorm_ = g_->norm();
+    gg_ = gradNorm_ * gradNorm_;
+    gh_ = gg_;
+    if(preconditioned_)
+    {
+        CGPreconditioner<Function, LargeVector>::apply(f_, *g_, h_.get());
+        gh_ = g_->dotProduct(*h_);
+    }
+    ghPrev_ = gzPrev_ = gPrevhPrev_ = gPrevzPrev_ = 0;
 
     gPrev_->copy(*g_);
     zPrev_->setToZero();
@@ -177,40 +241,29 @@ CG_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *res
 
     while(true)
     {
-        z_->copy(*g_, -1);
+        // the previous direction, its buffer gets the new one
+        z_.swap(zPrev_);
+
+        double beta = 0;
         if(iter_ > 0)
         {
-            double beta = 0;
-            double a, b, c, d;
             switch(m)
             {
             case FLETCHER_REEVES:
-                b = gPrev_->dotProduct(*gPrev_);
-                check(b > 0, "");
-                a = g_->dotProduct(*g_);
-                beta = a / b;
+                check(gPrevhPrev_ > 0, "");
+                beta = gh_ / gPrevhPrev_;
                 break;
             case POLAK_RIBIERE:
-                b = gPrev_->dotProduct(*gPrev_);
-                check(b > 0, "");
-                a = g_->dotProduct(*g_);
-                c = g_->dotProduct(*gPrev_);
-                beta = (a - c) / b;
+                check(gPrevhPrev_ > 0, "");
+                beta = (gh_ - ghPrev_) / gPrevhPrev_;
                 break;
             case HESTENES_STIEFEL:
-                a = g_->dotProduct(*g_);
-                b = g_->dotProduct(*gPrev_);
-                c = zPrev_->dotProduct(*g_);
-                d = zPrev_->dotProduct(*gPrev_);
-                check(c - d != 0, "");
-                beta = (a - b) / (c - d);
+                check(gzPrev_ - gPrevzPrev_ != 0, "");
+                beta = (gh_ - ghPrev_) / (gzPrev_ - gPrevzPrev_);
                 break;
             case DAI_YUAN:
-                a = g_->dotProduct(*g_);
-                c = zPrev_->dotProduct(*g_);
-                d = zPrev_->dotProduct(*gPrev_);
-                check(c - d != 0, "");
-                beta = a / (c - d);
+                check(gzPrev_ - gPrevzPrev_ != 0, "");
+                beta = gh_ / (gzPrev_ - gPrevzPrev_);
                 break;
             default:
                 check(false, "");
@@ -224,13 +277,20 @@ CG_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *res
                 }
                 beta = 0;
             }
-
-            if(beta > 0)
-                z_->add(*zPrev_, beta);
         }
 
-        const double zNorm = z_->norm();
-        double zg = -z_->dotProduct(*g_) / zNorm;
+        if(beta > 0)
+            linearCombination(z_.get(), -1.0, h(), beta, *zPrev_);
+        else
+            z_->copy(h(), -1);
+
+        // z.z and z.g together
+        others_[0] = z_.get();
+        others_[1] = g_.get();
+        LargeVectorDotProducts<LargeVector>::calculate(*z_, 2, others_, dots_);
+        const double zNorm = std::sqrt(dots_[0]);
+        double zgRaw = dots_[1];
+        double zg = -zgRaw / zNorm;
         if(zg / gradNorm_ < 0.01)
         {
             if(mpi_.isMaster())
@@ -239,6 +299,7 @@ CG_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *res
             }
             z_->copy(*g_, -1);
             zg = 1.0;
+            zgRaw = -gg_;
         }
 
         const double oldVal = val_;
@@ -254,18 +315,34 @@ CG_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *res
         const double stpmax = 1e15;
         const int maxfev = 100;
         int nfev = 0;
-        
-        x0_->copy(*x_);
-
-        gPrev_->copy(*g_);
-        zPrev_->copy(*z_);
 
+        // the current point and gradient become the previous ones, the buffers of the previous ones get the new point and gradient
+        x_.swap(x0_);
+        g_.swap(gPrev_);
+        if(preconditioned_)
+            h_.swap(hPrev_);
 
         const int info = moreThuenteSearch(f_, *x0_, val_, *gPrev_, *z_, rate_, ftol, gtol, xtol, stpmin, stpmax, maxfev, x_.get(), g_.get(), nfev);
         check(info != 0, "info needs to be nonzero but it is " << info << ", step = " << rate_ << " iteration: " << iter_);
 
         functionEval += nfev;
-        gradNorm_ = g_->norm();
+
+        if(preconditioned_)
+            CGPreconditioner<Function, LargeVector>::apply(f_, *g_, h_.get());
+
+        // the direction just used is zPrev for the next iteration
+        gPrevhPrev_ = gh_;
+        gPrevzPrev_ = zgRaw;
+        others_[0] = g_.get();
+        others_[1] = &hPrev();
+        others_[2] = z_.get();
+        others_[3] = &h();
+        LargeVectorDotProducts<LargeVector>::calculate(*g_, (preconditioned_ ? 4 : 3), others_, dots_);
+        gg_ = dots_[0];
+        ghPrev_ = dots_[1];
+        gzPrev_ = dots_[2];
+        gh_ = (preconditioned_ ? dots_[3] : gg_);
+        gradNorm_ = std::sqrt(gg_);
         
         ++iter_;
         ++thisIter;
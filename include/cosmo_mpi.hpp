@@ -1,6 +1,11 @@
 #ifndef COSMO_PP_COSMO_MPI_HPP
 #define COSMO_PP_COSMO_MPI_HPP
 
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <utility>
+
 class CosmoMPI
 {
 private:
@@ -18,20 +23,338 @@ public:
     int numProcesses() const;
     bool isMaster() const { return (processId() == 0); }
     void barrier() const;
-    int getCommTag();
+
+    /// Get a new tag for point to point communication. Must be called by all of the processes at the same time.
+    /// \param width The tags from the returned one up to (but not including) the returned one + 10 * width * numProcesses() are reserved for the caller.
+    int getCommTag(int width = 1);
+
+    /// Checks if MPI can be called from several threads at the same time (MPI_THREAD_MULTIPLE is provided). Always true for the non-MPI version.
+    bool supportsThreads() const;
+
+    /// Checks if MPI was initialized by CosmoMPI (otherwise it was initialized before, by the caller, and it is not finalized by CosmoMPI either).
+    bool initializedHere() const { return initializedHere_; }
 
     enum DataType { DOUBLE = 0, INT, LONG, DATA_TYPE_MAX };
     enum ReduceOp { SUM = 0, MAX, MIN, PROD, REDUCE_OP_MAX };
 
+    /// The DataType of a C++ type (double, int, long), for the typed versions of the communication functions.
+    template<typename T>
+    static DataType dataType();
+
+    /// A group of processes, either all of them (world()), the ones on the same node (nodeCommunicator()), or a subgroup created by split.
+    /// The communication functions below use the world communicator if NULL is passed for the communicator.
+    class Communicator
+    {
+    public:
+        /// Destructor. Frees the communicator if it was created by split. Must be called by all of its processes, before the end of the program.
+        ~Communicator();
+
+        /// The index of this process in the communicator.
+        int processId() const;
+
+        /// The number of processes in the communicator.
+        int numProcesses() const;
+
+        /// Checks if this is the first process of the communicator (the root of the collective operations).
+        bool isMaster() const { return (processId() == 0); }
+
+        /// A pointer to the underlying MPI_Comm, NULL for the non-MPI version.
+        void* handle() const { return comm_; }
+
+    private:
+        friend class CosmoMPI;
+        Communicator(void* comm, bool owned) : comm_(comm), owned_(owned) {}
+
+        // not copyable
+        Communicator(const Communicator&);
+        Communicator& operator = (const Communicator&);
+
+        void* comm_;
+        const bool owned_;
+    };
+
+    /// A handle of a non-blocking communication (see iallreduce, iallgatherv, ibcast).
+    /// If the operation is still in progress when the request is destroyed, the destructor waits for it, so the buffers need to stay valid until then. A request can be reused after the operation is complete.
+    class Request
+    {
+    public:
+        Request();
+
+        /// Destructor. Waits for the operation to complete if it is still in progress.
+        ~Request();
+
+        /// Checks if an operation is in progress.
+        bool active() const { return active_; }
+
+        /// Checks if the operation has completed, without blocking.
+        /// \return true if the operation has completed (or there is no operation in progress).
+        bool test();
+
+        /// Waits for the operation to complete.
+        void wait();
+
+    private:
+        friend class CosmoMPI;
+
+        // not copyable
+        Request(const Request&);
+        Request& operator = (const Request&);
+
+        void* req_;
+        bool active_;
+    };
+
+    /// A pool of buffers for non-blocking point to point sends of doubles (on the world communicator).
+    /// The completed sends are found with MPI_Testsome whenever a new buffer is needed (or progress is called), and their buffers are reused, so the memory and the number of pending requests stay bounded by the number of sends actually in progress.
+    /// Not thread safe, each thread should have its own pool.
+    class SendPool
+    {
+    public:
+        SendPool();
+
+        /// Destructor. The sends still in progress are not waited for (the receivers may have already stopped), their requests are freed and their buffers are kept by CosmoMPI until the end of the program.
+        ~SendPool();
+
+        /// Get a buffer for a new message, the buffer of a completed send is reused if possible.
+        /// \param count The number of elements.
+        /// \return The buffer, it belongs to the pool and stays valid until all of the sends posted from it complete.
+        double* getBuffer(int count);
+
+        /// Post a non-blocking send from a buffer obtained from getBuffer. Several sends (for example to different processes) can be posted from the same buffer, it is reused when all of them are complete.
+        /// \param buffer The buffer, returned by the last call of getBuffer.
+        /// \param count The number of elements to send.
+        /// \param dest The destination process.
+        /// \param tag The tag.
+        void isend(double* buffer, int count, int dest, int tag);
+
+        /// Check the sends in progress and recycle the buffers of the completed ones.
+        void progress();
+
+        /// The number of sends in progress.
+        int pending() const { return nPending_; }
+
+        /// The number of buffers allocated so far.
+        int numBuffers() const { return int(buffers_.size()); }
+
+    private:
+        // not copyable
+        SendPool(const SendPool&);
+        SendPool& operator = (const SendPool&);
+
+        std::vector<std::vector<double>*> buffers_;
+        std::vector<int> bufferSends_;
+        std::vector<int> freeBuffers_;
+        int current_;
+
+        // the requests (a vector of MPI_Request), the buffer of each one, and the free request slots
+        void* requests_;
+        std::vector<int> requestBuffer_;
+        std::vector<int> freeRequests_;
+        int nPending_;
+
+        std::vector<int> indices_;
+    };
+
+    /// A file opened by all of the processes of a communicator (MPI-IO), for example one file shared by many chains. Each process writes and reads its own parts of the file at explicit offsets, independently of the others.
+    /// The non-MPI version uses the standard file operations. Throws an exception if the file cannot be opened or written.
+    class File
+    {
+    public:
+        /// Constructor. Opens the file for reading and writing, creating it if it does not exist. Must be called by all of the processes of the communicator at the same time.
+        /// \param fileName The name of the file, must be the same on all of the processes.
+        /// \param comm The communicator, NULL for the world.
+        File(const char* fileName, const Communicator* comm = NULL);
+
+        /// Destructor. Closes the file, must be called by all of the processes of the communicator at the same time.
+        ~File();
+
+        /// Write data at a given offset, independently of the other processes.
+        /// \param offset The offset in bytes from the beginning of the file.
+        /// \param data The data.
+        /// \param size The size of the data in bytes.
+        void writeAt(long offset, const void* data, long size);
+
+        /// Read data from a given offset, independently of the other processes.
+        /// \param offset The offset in bytes from the beginning of the file.
+        /// \param data The data will be written here.
+        /// \param size The size of the data in bytes.
+        /// \return The number of bytes read, smaller than size if the end of the file is reached.
+        long readAt(long offset, void* data, long size);
+
+        /// The size of the file in bytes.
+        long size() const;
+
+        /// Make sure the data written by all of the processes is in the file. Must be called by all of the processes of the communicator at the same time.
+        void sync();
+
+        /// The name of the file.
+        const std::string& name() const { return name_; }
+
+    private:
+        // not copyable
+        File(const File&);
+        File& operator = (const File&);
+
+        const std::string name_;
+
+        // a pointer to an MPI_File for the MPI version, the file descriptor otherwise
+        void* file_;
+        int fd_;
+    };
+
+    /// The communicator of all of the processes.
+    const Communicator& world() const { return *world_; }
+
+    /// The communicator of the processes on the same node as this one (see nodeProcessId).
+    const Communicator& nodeCommunicator() const { return *node_; }
+
+    /// The communicator of the node masters (the first process of each node, see isNodeMaster), ordered as in the world. The master process is the first one.
+    /// \return The communicator for the node masters, NULL for the other processes.
+    const Communicator* leaderCommunicator() const { return leader_; }
+
+    /// The number of nodes.
+    int numNodes() const { return numNodes_; }
+
+    /// The index of the node of this process, between 0 and numNodes() - 1 (the rank of its node master in leaderCommunicator()).
+    int nodeIndex() const { return nodeIndex_; }
+
+    /// Split a communicator into subgroups, for example the processes running one chain each. Must be called by all of the processes of the communicator at the same time.
+    /// \param color The processes with the same color form a subgroup. Must be non-negative.
+    /// \param key Determines the order of the processes in the subgroup, ties are broken by the order in the original communicator.
+    /// \param comm The communicator to split, NULL for the world.
+    /// \return The new communicator, needs to be deleted by the caller (on all of its processes, before the end of the program).
+    Communicator* split(int color, int key = 0, const Communicator* comm = NULL);
+
     int send(int dest, void *buf, int count, DataType type, int tag);
     int recv(int source, void *buf, int count, DataType type, int tag);
 
     int reduce(void *send, void *recv, int count, DataType type, ReduceOp op);
     int bcast(void *data, int count, DataType type);
 
+    /// Reduce, with the result given to all of the processes of the communicator.
+    /// \param send The data of this process.
+    /// \param recv The result will be written here, can be the same as send.
+    int allreduce(void *send, void *recv, int count, DataType type, ReduceOp op, const Communicator* comm = NULL);
+
+    /// Gather data of different sizes from all of the processes of the communicator, to all of them.
+    /// \param send The data of this process.
+    /// \param sendCount The size of the data of this process.
+    /// \param recv The gathered data will be written here, in the order of the processes.
+    /// \param recvCounts The sizes of the data of all of the processes.
+    /// \param displs The positions in recv where the data of each process starts.
+    int allgatherv(const void *send, int sendCount, void *recv, const int *recvCounts, const int *displs, DataType type, const Communicator* comm = NULL);
+
+    /// Non-blocking version of allreduce. The buffers must not be used until the request is complete.
+    int iallreduce(void *send, void *recv, int count, DataType type, ReduceOp op, Request* request, const Communicator* comm = NULL);
+
+    /// Non-blocking version of allgatherv. The buffers must not be used until the request is complete.
+    int iallgatherv(const void *send, int sendCount, void *recv, const int *recvCounts, const int *displs, DataType type, Request* request, const Communicator* comm = NULL);
+
+    /// Non-blocking broadcast from the first process of the communicator. The buffer must not be used until the request is complete.
+    int ibcast(void *data, int count, DataType type, Request* request, const Communicator* comm = NULL);
+
+    /// Hierarchical reduce to the master process: a reduction to the node masters over the node communicator (shared memory), then one among the node masters, so only one message per node goes between the nodes. Must be called by all of the processes at the same time.
+    /// \param send The data of this process.
+    /// \param recv The result will be written here on the master, must have count elements on all of the processes (it is used as a temporary buffer on the node masters). Can be the same as send.
+    int hierarchicalReduce(void *send, void *recv, int count, DataType type, ReduceOp op);
+
+    /// Hierarchical allreduce, a reduction to the node masters, an allreduce among them, then a broadcast on each node. Must be called by all of the processes at the same time.
+    /// \param send The data of this process.
+    /// \param recv The result will be written here. Can be the same as send.
+    int hierarchicalAllreduce(void *send, void *recv, int count, DataType type, ReduceOp op);
+
+    /// Hierarchical broadcast from the master process, first among the node masters, then on each node. Must be called by all of the processes at the same time.
+    int hierarchicalBcast(void *data, int count, DataType type);
+
+    /// Typed versions of the collective operations.
+    template<typename T>
+    int allreduce(T *send, T *recv, int count, ReduceOp op, const Communicator* comm = NULL) { return allreduce((void*) send, (void*) recv, count, dataType<T>(), op, comm); }
+
+    template<typename T>
+    int allgatherv(const T *send, int sendCount, T *recv, const int *recvCounts, const int *displs, const Communicator* comm = NULL) { return allgatherv((const void*) send, sendCount, (void*) recv, recvCounts, displs, dataType<T>(), comm); }
+
+    template<typename T>
+    int iallreduce(T *send, T *recv, int count, ReduceOp op, Request* request, const Communicator* comm = NULL) { return iallreduce((void*) send, (void*) recv, count, dataType<T>(), op, request, comm); }
+
+    template<typename T>
+    int iallgatherv(const T *send, int sendCount, T *recv, const int *recvCounts, const int *displs, Request* request, const Communicator* comm = NULL) { return iallgatherv((const void*) send, sendCount, (void*) recv, recvCounts, displs, dataType<T>(), request, comm); }
+
+    template<typename T>
+    int ibcast(T *data, int count, Request* request, const Communicator* comm = NULL) { return ibcast((void*) data, count, dataType<T>(), request, comm); }
+
+    template<typename T>
+    int hierarchicalReduce(T *send, T *recv, int count, ReduceOp op) { return hierarchicalReduce((void*) send, (void*) recv, count, dataType<T>(), op); }
+
+    template<typename T>
+    int hierarchicalAllreduce(T *send, T *recv, int count, ReduceOp op) { return hierarchicalAllreduce((void*) send, (void*) recv, count, dataType<T>(), op); }
+
+    template<typename T>
+    int hierarchicalBcast(T *data, int count) { return hierarchicalBcast((void*) data, count, dataType<T>()); }
+
+    /// The index of this process among the processes running on the same node (i.e. the ones that can share memory), between 0 and numNodeProcesses() - 1.
+    int nodeProcessId() const;
+
+    /// The number of processes running on the same node as this one.
+    int numNodeProcesses() const;
+
+    /// Checks if this is the first process on its node.
+    bool isNodeMaster() const { return (nodeProcessId() == 0); }
+
+    /// Allocate memory shared by all of the processes on the same node (an MPI shared memory window). Must be called by all of the processes at the same time.
+    /// The memory is allocated by the node master, all of the processes on the node get a pointer to the same memory. Synchronizing the accesses is up to the caller.
+    /// \param size The size in bytes. Only the value given by the node master is used.
+    /// \param window A handle for freeing the memory will be returned here.
+    /// \return A pointer to the shared memory.
+    void* allocateNodeShared(unsigned long size, void** window);
+
+    /// Free the memory allocated by allocateNodeShared. Must be called by all of the processes on the node at the same time.
+    /// \param window The handle returned by allocateNodeShared.
+    void freeNodeShared(void* window);
+
+    /// Set the node-local directory for staging input data (see stageToNode). The default is the value of the environment variable COSMO_NODE_STAGE_DIR, if it is set.
+    /// \param dir The directory, for example on a local disk or in /dev/shm. It should be specific to the job. NULL or empty turns the staging off.
+    void setNodeStageDir(const char* dir);
+
+    /// The node-local directory for staging, empty if the staging is off.
+    const std::string& nodeStageDir() const { return nodeStageDir_; }
+
+    /// Stage a large input file or directory (for example a likelihood data directory) into node-local storage, so that the processes read it from there instead of all of them reading it from the shared file system at the same time.
+    /// The first process on each node copies the data into the node stage directory (see setNodeStageDir), the other processes on the node wait for it, then all of them get the path of the local copy. Each path is staged only once per process, later calls return the local path right away. Data already staged by an earlier job (with a complete copy in the same directory) is not copied again.
+    /// If the staging is off the path is returned unchanged and nothing else is done. Otherwise must be called by all of the processes on the node at the same time (the first time for a given path). Thread safe, but only one thread of each process should do the first call for a given path.
+    /// \param path The path of the file or the directory on the shared file system.
+    /// \return The path of the local copy, or path if the staging is off.
+    std::string stageToNode(const std::string& path);
+
 private:
+    // keeps the buffers of the sends abandoned by the send pools until the end of the program
+    void keepUntilFinalize(std::vector<double>* buffer);
+
     int commTag_;
+    int threadSupport_;
+    bool initializedHere_;
+    std::vector<std::vector<double>*> abandonedBuffers_;
+
+    // the communicator of the processes on the same node
+    void* nodeComm_;
+
+    Communicator* world_;
+    Communicator* node_;
+    Communicator* leader_;
+    int numNodes_;
+    int nodeIndex_;
+
+    std::string nodeStageDir_;
+    std::vector<std::pair<std::string, std::string> > staged_;
 };
 
+template<>
+inline CosmoMPI::DataType CosmoMPI::dataType<double>() { return DOUBLE; }
+
+template<>
+inline CosmoMPI::DataType CosmoMPI::dataType<int>() { return INT; }
+
+template<>
+inline CosmoMPI::DataType CosmoMPI::dataType<long>() { return LONG; }
+
 #endif
 
@@ -3,6 +3,8 @@
 
 #include <cmath>
 #include <string>
+#include <vector>
+#include <atomic>
 
 #include <macros.hpp>
 #include <phys_constants.hpp>
@@ -13,8 +15,15 @@
 class CosmologicalParams
 {
 public:
+    /// The groups of the parameters by the parts of the calculation they affect, can be combined with |.
+    enum ParameterGroup { BACKGROUND = 1, REIONIZATION = 2, PRIMORDIAL = 4, ALL_GROUPS = 7 };
+
     /// Constructor.
-    CosmologicalParams() : temp_(2.726) {}
+    CosmologicalParams() : temp_(2.726), changed_(ALL_GROUPS)
+    {
+        for(int i = 0; i < numGroups; ++i)
+            revision_[i] = newRevision();
+    }
 
     /// Destructor.
     virtual ~CosmologicalParams() {}
@@ -96,6 +105,43 @@ public:
     /// \return true if successful, false otherwise.
     virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL) = 0;
 
+    /// The number of the relevant parameters, i.e. the size of the vector of getAllParameters.
+    virtual int numParameters() const { std::vector<double> v; getAllParameters(v); return v.size(); }
+
+    /// The same as getAllParameters, without a vector. The default implementation calls getAllParameters, the classes below override it so that nothing is allocated.
+    /// \param v The parameters will be written here, must have numParameters() elements.
+    virtual void getParameters(double* v) const
+    {
+        std::vector<double> p;
+        getAllParameters(p);
+        for(int i = 0; i < p.size(); ++i)
+            v[i] = p[i];
+    }
+
+    /// The same as setAllParameters, without a vector. The default implementation calls setAllParameters, the classes below override it so that nothing is allocated (the spline power spectra are updated in place).
+    /// \param v The parameters.
+    /// \param n The number of the parameters, must be at least numParameters().
+    /// \param badLike The same as for setAllParameters.
+    /// \return true if successful, false otherwise.
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL)
+    {
+        return setAllParameters(std::vector<double>(v, v + n), badLike);
+    }
+
+    /// The groups of the parameters that have changed in the last call of setParameters or setAllParameters, a combination of ParameterGroup values. ALL_GROUPS for new objects and for classes that do not track the changes.
+    int changedGroups() const { return changed_; }
+
+    /// Specifies if the class tracks the changes of the parameters, i.e. reports them in changedGroups and revision. The default is false.
+    virtual bool tracksChanges() const { return false; }
+
+    /// A number that changes every time the parameters of a given group change (only if tracksChanges() is true). The numbers are unique among all of the objects, so the calculations can keep the revision they were done for and compare it later to see if the group needs to be recalculated, even for a different object.
+    /// \param group One of BACKGROUND, REIONIZATION, or PRIMORDIAL.
+    unsigned long revision(ParameterGroup group) const
+    {
+        const int i = groupIndex(group);
+        return revision_[i];
+    }
+
     /// The Hubble constant without units (the reduced Planck mass is assumed to be 1, together with c and hbar).
     virtual double getHubbleUnitless() const
     {
@@ -133,8 +179,49 @@ public:
     /// Set the temperature of photons in K.
     void setTemperature(double temp) { check(temp > 0, "invalid temperature " << temp); temp_ = temp; }
 
+protected:
+    /// To be called by the classes that track the changes at the end of setting the parameters.
+    /// \param changed The groups that have changed, a combination of ParameterGroup values.
+    void setChanged(int changed)
+    {
+        changed_ = changed;
+        for(int i = 0; i < numGroups; ++i)
+        {
+            if(changed & (1 << i))
+                revision_[i] = newRevision();
+        }
+    }
+
+private:
+    static const int numGroups = 3;
+
+    static int groupIndex(ParameterGroup group)
+    {
+        switch(group)
+        {
+        case BACKGROUND:
+            return 0;
+        case REIONIZATION:
+            return 1;
+        case PRIMORDIAL:
+            return 2;
+        default:
+            check(false, "invalid group " << group);
+            return 0;
+        }
+    }
+
+    // unique among all of the objects (and threads)
+    static unsigned long newRevision()
+    {
+        static std::atomic<unsigned long> counter(0);
+        return ++counter;
+    }
+
 private:
     double temp_;
+    int changed_;
+    unsigned long revision_[numGroups];
 };
 
 class LambdaCDMParams : public CosmologicalParams
@@ -175,7 +262,20 @@ public:
     virtual std::string name() const { return "LambdaCDM"; }
     virtual void getAllParameters(std::vector<double>& v) const
     {
-        v.resize(6);
+        v.resize(numParameters());
+        getParameters(&(v[0]));
+    }
+
+    virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL)
+    {
+        check(v.size() >= numParameters(), "");
+        return setParameters(&(v[0]), v.size(), badLike);
+    }
+
+    virtual int numParameters() const { return 6; }
+
+    virtual void getParameters(double* v) const
+    {
         v[0] = getOmBH2();
         v[1] = getOmCH2();
         v[2] = getH();
@@ -184,15 +284,26 @@ public:
         v[5] = std::log(getAs() * 1e10);
     }
 
-    virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL)
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL)
     {
-        check(v.size() >= 6, "");
+        check(n >= 6, "");
+        int changed = 0;
+        if(omBH2_ != v[0] || omCH2_ != v[1] || h_ != v[2])
+            changed |= BACKGROUND;
+        if(tau_ != v[3])
+            changed |= REIONIZATION;
+        const double as = std::exp(v[5]) / 1e10;
+        if(ps_.getNs() != v[4] || ps_.getAs() != as)
+            changed |= PRIMORDIAL;
+
         omBH2_ = v[0];
         omCH2_ = v[1];
         h_ = v[2];
         tau_ = v[3];
         ps_.setNs(v[4]);
-        ps_.setAs(std::exp(v[5]) / 1e10);
+        ps_.setAs(as);
+
+        setChanged(changed);
 
         if(badLike)
             *badLike = 0;
@@ -200,6 +311,8 @@ public:
         return true;
     }
 
+    virtual bool tracksChanges() const { return true; }
+
 protected:
     double omBH2_;
     double omCH2_;
@@ -226,22 +339,29 @@ public:
     virtual const Math::RealFunction& powerSpectrumTensor() const { return *psT_; }
 
     virtual std::string name() const { return "LCDMWithTensor"; }
-    virtual void getAllParameters(std::vector<double>& v) const
+
+    virtual int numParameters() const { return 7; }
+
+    virtual void getParameters(double* v) const
     {
-        LambdaCDMParams::getAllParameters(v);
-        v.push_back(getR());
+        LambdaCDMParams::getParameters(v);
+        v[6] = getR();
     }
 
-    virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL)
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL)
     {
-        check(v.size() >= 7, "");
+        check(n >= 7, "");
 
-        LambdaCDMParams::setAllParameters(v, badLike);
+        const bool tensorChanged = (r_ != v[6] || nt_ != 0.0);
+        LambdaCDMParams::setParameters(v, n, badLike);
         r_ = v[6];
         nt_ = 0.0;
         const double piv = psT_->getPivot();
         psT_->set(powerSpectrum(), r_, nt_, piv);
 
+        if(tensorChanged)
+            setChanged(changedGroups() | PRIMORDIAL);
+
         return true;
     }
 
@@ -282,6 +402,8 @@ public:
     virtual std::string name() const { return "LCDMWithDegenerateNeutrinos"; }
     virtual void getAllParameters(std::vector<double>& v) const { check(false, "not implemented"); }
     virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL) { check(false, "not implemented"); return false; }
+    virtual void getParameters(double* v) const { check(false, "not implemented"); }
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL) { check(false, "not implemented"); return false; }
 
 private:
     double nEff_;
@@ -328,6 +450,8 @@ public:
     virtual std::string name() const { return "LCDMWithTensorAndDegenerateNeutrinos"; }
     virtual void getAllParameters(std::vector<double>& v) const { check(false, "not implemented"); }
     virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL) { check(false, "not implemented"); return false; }
+    virtual void getParameters(double* v) const { check(false, "not implemented"); }
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL) { check(false, "not implemented"); return false; }
 
 private:
     double nEff_;
@@ -355,6 +479,8 @@ public:
     virtual std::string name() const { return "LCDMWithCutoffTensorDegenerateNeutrinos"; }
     virtual void getAllParameters(std::vector<double>& v) const { check(false, "not implemented"); }
     virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL) { check(false, "not implemented"); return false; }
+    virtual void getParameters(double* v) const { check(false, "not implemented"); }
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL) { check(false, "not implemented"); return false; }
 
 private:
     CutoffPowerSpectrum psC_;
@@ -395,8 +521,71 @@ public:
     virtual const Math::RealFunction& powerSpectrumTensor() const { return psTensor_; }
 
     virtual std::string name() const { return "LinearSpline"; }
-    virtual void getAllParameters(std::vector<double>& v) const { check(false, "not implemented"); }
-    virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL) { check(false, "not implemented"); return false; }
+
+    /// The parameters are omBH2, omCH2, h, tau, and ln(10^10 A) for each of the amplitudes of the spline.
+    virtual void getAllParameters(std::vector<double>& v) const
+    {
+        v.resize(numParameters());
+        getParameters(&(v[0]));
+    }
+
+    virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL)
+    {
+        check(v.size() >= numParameters(), "");
+        return setParameters(&(v[0]), v.size(), badLike);
+    }
+
+    virtual int numParameters() const { return 4 + ps_.numKnots(); }
+
+    virtual void getParameters(double* v) const
+    {
+        v[0] = omBH2_;
+        v[1] = omCH2_;
+        v[2] = h_;
+        v[3] = tau_;
+        const int nKnots = ps_.numKnots();
+        const double lnScale = std::log(1e10);
+        for(int i = 0; i < nKnots; ++i)
+            v[4 + i] = ps_.lnAmplitude(i) + lnScale;
+    }
+
+    /// The spline of the power spectrum is updated in place, nothing is allocated.
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL)
+    {
+        const int nKnots = ps_.numKnots();
+        check(n >= 4 + nKnots, "");
+
+        int changed = 0;
+        if(omBH2_ != v[0] || omCH2_ != v[1] || h_ != v[2])
+            changed |= BACKGROUND;
+        if(tau_ != v[3])
+            changed |= REIONIZATION;
+
+        omBH2_ = v[0];
+        omCH2_ = v[1];
+        h_ = v[2];
+        tau_ = v[3];
+
+        const double lnScale = std::log(1e10);
+        for(int i = 0; i < nKnots; ++i)
+        {
+            if(ps_.lnAmplitude(i) != v[4 + i] - lnScale)
+            {
+                changed |= PRIMORDIAL;
+                ps_.setLnAmplitudes(v + 4, -lnScale);
+                break;
+            }
+        }
+
+        setChanged(changed);
+
+        if(badLike)
+            *badLike = 0;
+
+        return true;
+    }
+
+    virtual bool tracksChanges() const { return true; }
 
 private:
     double omBH2_;
@@ -442,8 +631,71 @@ public:
     virtual const Math::RealFunction& powerSpectrumTensor() const { return psTensor_; }
 
     virtual std::string name() const { return "CubicSpline"; }
-    virtual void getAllParameters(std::vector<double>& v) const { check(false, "not implemented"); }
-    virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL) { check(false, "not implemented"); return false; }
+
+    /// The parameters are omBH2, omCH2, h, tau, and ln(10^10 A) for each of the amplitudes of the spline.
+    virtual void getAllParameters(std::vector<double>& v) const
+    {
+        v.resize(numParameters());
+        getParameters(&(v[0]));
+    }
+
+    virtual bool setAllParameters(const std::vector<double>& v, double *badLike = NULL)
+    {
+        check(v.size() >= numParameters(), "");
+        return setParameters(&(v[0]), v.size(), badLike);
+    }
+
+    virtual int numParameters() const { return 4 + ps_.numKnots(); }
+
+    virtual void getParameters(double* v) const
+    {
+        v[0] = omBH2_;
+        v[1] = omCH2_;
+        v[2] = h_;
+        v[3] = tau_;
+        const int nKnots = ps_.numKnots();
+        const double lnScale = std::log(1e10);
+        for(int i = 0; i < nKnots; ++i)
+            v[4 + i] = ps_.lnAmplitude(i) + lnScale;
+    }
+
+    /// The spline of the power spectrum is updated in place, nothing is allocated.
+    virtual bool setParameters(const double* v, int n, double *badLike = NULL)
+    {
+        const int nKnots = ps_.numKnots();
+        check(n >= 4 + nKnots, "");
+
+        int changed = 0;
+        if(omBH2_ != v[0] || omCH2_ != v[1] || h_ != v[2])
+            changed |= BACKGROUND;
+        if(tau_ != v[3])
+            changed |= REIONIZATION;
+
+        omBH2_ = v[0];
+        omCH2_ = v[1];
+        h_ = v[2];
+        tau_ = v[3];
+
+        const double lnScale = std::log(1e10);
+        for(int i = 0; i < nKnots; ++i)
+        {
+            if(ps_.lnAmplitude(i) != v[4 + i] - lnScale)
+            {
+                changed |= PRIMORDIAL;
+                ps_.setLnAmplitudes(v + 4, -lnScale);
+                break;
+            }
+        }
+
+        setChanged(changed);
+
+        if(badLike)
+            *badLike = 0;
+
+        return true;
+    }
+
+    virtual bool tracksChanges() const { return true; }
 
 private:
     double omBH2_;
@@ -2,49 +2,86 @@
 #define COSMO_PP_CUBIC_SPLINE_HPP
 
 #include <vector>
-#include <set>
+#include <algorithm>
+#include <utility>
 
 #include <function.hpp>
+#include <table_function.hpp>
 #include <macros.hpp>
 
 namespace Math
 {
 
 /// A class that implements a cubic spline.
+
+/// The points and the spline coefficients are stored in contiguous arrays, finding the interval for a given x is a binary search, or a direct calculation if the points are uniformly or logarithmically uniformly spaced (see FlatTableAxis).
+/// For many points use the batch evaluation, which is vectorized and checks the previous interval first, so monotonic sequences of x need no search at all.
 class CubicSpline : public RealFunction
 {
 public:
+    /// Constructor. Creates an empty spline, which needs to be assigned to before evaluating.
+    CubicSpline() {}
+
     /// Constructor.
     /// \param x A vector containing the x coordinates of the points to be used for the spline. At least 2 points needed. No double entries are allowed. The vector does not have to be sorted.
     /// \param y A vector containing the y coordinates of the points to be used for the spline. Has to be of the same size as x.
     inline CubicSpline(const std::vector<double>& x, const std::vector<double>& y);
 
     /// Destructor.
-    inline ~CubicSpline();
+    ~CubicSpline() {}
 
     /// A function that evaluates the spline for any given x. The argument x has to be between the smallest and biggest values of x of all of the spline points.
-    inline virtual double evaluate(double x) const;
+    virtual double evaluate(double x) const { return evaluateInterval(interval(x), x); }
+
+    /// Evaluate the spline for many points.
+    /// \param n The number of points.
+    /// \param x The points, all of them need to be between the smallest and biggest values of x of all of the spline points. Monotonic (increasing or decreasing) sequences are the fastest.
+    /// \param res The results will be written here, must have n elements.
+    inline virtual void evaluate(unsigned long n, const double* x, double* res) const;
+
+    /// Evaluate the spline for many points.
+    /// \param x The points, all of them need to be between the smallest and biggest values of x of all of the spline points.
+    /// \param res The results will be written here, resized if needed.
+    void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+    {
+        check(res, "");
+        res->resize(x.size());
+        if(!x.empty())
+            evaluate(x.size(), &(x[0]), &((*res)[0]));
+    }
 
     /// Get the parameters of the spline at a given point x. The spline is defined by a + b * (x - x0) + c * (x - x0)^2 + d * (x - x0)^3
     inline void getSplineParams(double x, double& x0, double& a, double& b, double& c, double& d) const;
+
+    /// Set new y values for the same x values. The tridiagonal system of the spline only depends on x and is factorized in the constructor, so only the coefficients are recalculated (linear in the number of points) and nothing is allocated.
+    /// \param y The new y values, in the same order as the x values given in the constructor.
+    inline void setValues(const double* y);
+
 private:
-    struct SplineData
-    {
-        double a, b, c, d;
-    };
+    inline void calculateCoefficients();
 
-    struct SplinePoints
+    // the index i of the interval x_i <= x < x_(i + 1), the last interval if x is the last point
+    int interval(double x) const
     {
-        double x, y;
-        SplineData* data;
-
-        bool operator < (const SplinePoints& other) const { return x < other.x; }
-    };
+        check(axis_.size() >= 2, "not properly initialized");
+        const int i = int(axis_.index(x));
+        return (i < a_.size() ? i : i - 1);
+    }
 
-    typedef std::set<SplinePoints> SplineDataSet;
+    double evaluateInterval(int i, double x) const
+    {
+        const double deltaX = x - axis_[i];
+        return a_[i] + deltaX * (b_[i] + deltaX * (c_[i] + deltaX * d_[i]));
+    }
 
 private:
-    SplineDataSet splineDataSet_;
+    // the points in increasing order, and the coefficients for each interval
+    FlatTableAxis<double> axis_;
+    std::vector<double> a_, b_, c_, d_;
+
+    // for setValues, the index in the constructor arguments of each point in increasing order, the y values in increasing order of x, and the factorization of the tridiagonal system
+    std::vector<int> order_;
+    std::vector<double> y_, h_, l_, mu_, z_;
 };
 
 CubicSpline::CubicSpline(const std::vector<double>& x, const std::vector<double>& y)
@@ -52,137 +89,148 @@ CubicSpline::CubicSpline(const std::vector<double>& x, const std::vector<double>
     check(x.size() == y.size(), "the x and y vectors need to have the same size");
     check(x.size() >= 2, "at least 2 points needed for the spline");
 
-    SplinePoints sp;
-    for(int i = 0; i < x.size(); ++i)
-    {
-        sp.x = x[i];
-        sp.y = y[i];
-        sp.data = new SplineData;
-        splineDataSet_.insert(sp);
-    }
-
-    check(splineDataSet_.size() == x.size(), "duplicate entries detected");
+    const int n = x.size();
+    std::vector<std::pair<double, int> > points(n);
+    for(int i = 0; i < n; ++i)
+        points[i] = std::make_pair(x[i], i);
+    std::sort(points.begin(), points.end());
 
     // algorithm from http://en.wikipedia.org/w/index.php?title=Spline_%28mathematics%29&oldid=288288033#Algorithm_for_computing_natural_cubic_splines
-    std::vector<double> a, h;
-
-    for(SplineDataSet::const_iterator it = splineDataSet_.begin(); it != splineDataSet_.end(); ++it)
-        a.push_back((*it).y);
+    std::vector<double> xs(n);
+    order_.resize(n);
+    y_.resize(n);
+    h_.resize(n - 1);
+    for(int i = 0; i < n; ++i)
+    {
+        xs[i] = points[i].first;
+        order_[i] = points[i].second;
+        y_[i] = y[order_[i]];
+        if(i > 0)
+        {
+            check(xs[i] != xs[i - 1], "duplicate entries detected");
+            h_[i - 1] = xs[i] - xs[i - 1];
+        }
+    }
+    axis_ = FlatTableAxis<double>(xs);
 
-    check(a.size() == x.size(), "");
+    // the tridiagonal system only depends on the x values
+    l_.resize(n);
+    mu_.resize(n);
+    z_.resize(n);
+    l_[0] = 1;
+    mu_[0] = 0;
 
-    SplineDataSet::const_iterator it = splineDataSet_.begin();
-    double xPrev = (*it).x;
-    while(++it != splineDataSet_.end())
+    for(int i = 1; i < h_.size(); ++i)
     {
-        double x = (*it).x;
-        h.push_back(x - xPrev);
-        xPrev = x;
+        l_[i] = 2 * (h_[i] + h_[i - 1]) - h_[i - 1] * mu_[i - 1];
+        
+        check(l_[i] != 0, "bad things happening");
+
+        mu_[i] = h_[i] / l_[i];
     }
 
-    check(h.size() == a.size() - 1, "");
+    l_[n - 1] = 1;
+
+    a_.resize(n - 1);
+    b_.resize(n - 1);
+    c_.resize(n);
+    d_.resize(n - 1);
+    calculateCoefficients();
+}
 
-    std::vector<double> alpha(h.size());
-    for(int i = 1; i < alpha.size(); ++i)
-        alpha[i] = (3.0 / h[i]) * (a[i + 1] - a[i]) - (3.0 / h[i - 1]) * (a[i] - a[i - 1]);
+void
+CubicSpline::setValues(const double* y)
+{
+    check(!order_.empty(), "not properly initialized");
+    for(int i = 0; i < order_.size(); ++i)
+        y_[i] = y[order_[i]];
+    calculateCoefficients();
+}
 
-    std::vector<double> c(a.size()), l(a.size()), mu(a.size()), z(a.size());
-    std::vector<double> b(h.size()), d(h.size());
-    l[0] = 1;
-    mu[0] = 0;
-    z[0] = 0;
+void
+CubicSpline::calculateCoefficients()
+{
+    const int n = y_.size();
+    const std::vector<double>& a = y_;
+    const std::vector<double>& h = h_;
 
+    z_[0] = 0;
     for(int i = 1; i < h.size(); ++i)
     {
-        l[i] = 2 * (h[i] + h[i - 1]) - h[i - 1] * mu[i - 1];
-        
-        check(l[i] != 0, "bad things happening");
-
-        mu[i] = h[i] / l[i];
-        z[i] = (alpha[i] - h[i - 1] * z[i - 1]) / l[i];
+        const double alpha = (3.0 / h[i]) * (a[i + 1] - a[i]) - (3.0 / h[i - 1]) * (a[i] - a[i - 1]);
+        z_[i] = (alpha - h[i - 1] * z_[i - 1]) / l_[i];
     }
 
-    l[l.size() - 1] = 1;
-    z[z.size() - 1] = 0;
-    c[c.size() - 1] = 0;
+    z_[n - 1] = 0;
+    c_[n - 1] = 0;
 
     for(int j = h.size() - 1; j >= 0; --j)
     {
-        c[j] = z[j] - mu[j] * c[j + 1];
+        c_[j] = z_[j] - mu_[j] * c_[j + 1];
 
         check(h[j] != 0, "bad things happening");
 
-        b[j] = (a[j + 1] - a[j]) / h[j] - h[j] * (c[j + 1] + 2 * c[j]) / 3.0;
-        d[j] = (c[j + 1] - c[j]) / (3.0 * h[j]);
+        b_[j] = (a[j + 1] - a[j]) / h[j] - h[j] * (c_[j + 1] + 2 * c_[j]) / 3.0;
+        d_[j] = (c_[j + 1] - c_[j]) / (3.0 * h[j]);
+        a_[j] = a[j];
     }
-
-    SplineDataSet::iterator iter = splineDataSet_.begin();
-    for(int i = 0; i < h.size(); ++i)
-    {
-        check((*iter).y == a[i], "");
-        (*iter).data->a = a[i];
-        (*iter).data->b = b[i];
-        (*iter).data->c = c[i];
-        (*iter).data->d = d[i];
-
-        ++iter;
-    }
-
-    check(++iter == splineDataSet_.end(), "");
-}
-
-CubicSpline::~CubicSpline()
-{
-    for(SplineDataSet::iterator it = splineDataSet_.begin(); it != splineDataSet_.end(); ++it)
-        delete (*it).data;
 }
 
-double
-CubicSpline::evaluate(double x) const
+void
+CubicSpline::evaluate(unsigned long n, const double* x, double* res) const
 {
-    check(splineDataSet_.size() >= 2, "not properly initialized");
-    SplinePoints xx;
-    xx.x = x;
-    SplineDataSet::const_iterator it = splineDataSet_.lower_bound(xx);
-    check(it != splineDataSet_.end(), "element is outside the range");
-    if(it == splineDataSet_.begin())
+    const int blockSize = 64;
+    check(axis_.size() >= 2, "not properly initialized");
+    const int last = int(a_.size()) - 1;
+    const double* xp = &(axis_.points()[0]);
+    const double* a = &(a_[0]);
+    const double* b = &(b_[0]);
+    const double* c = &(c_[0]);
+    const double* d = &(d_[0]);
+
+    int index[blockSize];
+    int i = 0;
+    for(unsigned long start = 0; start < n; start += blockSize)
     {
-        check((*it).x == x, "element is outside the range");
-        return (*it).y;
+        const int m = int(std::min((unsigned long)blockSize, n - start));
+        const double* xBlock = x + start;
+        double* resBlock = res + start;
+
+        // find the intervals, trying the previous one and its neighbors before searching
+        for(int j = 0; j < m; ++j)
+        {
+            const double v = xBlock[j];
+            if(!(v >= xp[i] && v < xp[i + 1]))
+            {
+                if(i < last && v >= xp[i + 1] && v < xp[i + 2])
+                    ++i;
+                else if(i > 0 && v >= xp[i - 1] && v < xp[i])
+                    --i;
+                else
+                    i = interval(v);
+            }
+            index[j] = i;
+        }
+
+#pragma omp simd
+        for(int j = 0; j < m; ++j)
+        {
+            const int k = index[j];
+            const double deltaX = xBlock[j] - xp[k];
+            resBlock[j] = a[k] + deltaX * (b[k] + deltaX * (c[k] + deltaX * d[k]));
+        }
     }
-
-    --it;
-    check(x > (*it).x, "");
-    const double deltaX = x - (*it).x;
-    const double deltaX2 = deltaX * deltaX;
-    const double deltaX3 = deltaX2 * deltaX;
-
-    const SplineData& sp = *((*it).data);
-    return sp.a + sp.b * deltaX + sp.c * deltaX2 + sp.d * deltaX3;
 }
 
 void
 CubicSpline::getSplineParams(double x, double& x0, double& a, double& b, double& c, double& d) const
 {
-    check(splineDataSet_.size() >= 2, "not properly initialized");
-    SplinePoints xx;
-    xx.x = x;
-    SplineDataSet::const_iterator it = splineDataSet_.lower_bound(xx);
-    check(it != splineDataSet_.end(), "element is outside the range");
-    if(it == splineDataSet_.begin())
-    {
-        check((*it).x == x, "element is outside the range");
-    }
-    else
-        --it;
-
-    check(x >= (*it).x, "");
-    const SplineData& sp = *((*it).data);
-    x0 = (*it).x;
-    a = sp.a;
-    b = sp.b;
-    c = sp.c;
-    d = sp.d;
+    const int i = interval(x);
+    x0 = axis_[i];
+    a = a_[i];
+    b = b_[i];
+    c = c_[i];
+    d = d_[i];
 }
 
 } // namespace Math
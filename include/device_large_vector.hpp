@@ -0,0 +1,168 @@
+#ifndef COSMO_PP_DEVICE_LARGE_VECTOR_HPP
+#define COSMO_PP_DEVICE_LARGE_VECTOR_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+
+namespace Math
+{
+
+/// A large vector kept in the memory of the GPU, for LBFGS_General, CG_General, HMCGeneral and NUTSGeneral (see BasicLargeVector for the LargeVector concept).
+
+/// When Cosmo++ is built with CUDA (COSMO_CUDA defined, see GpuLinearAlgebra) and a GPU is found, the elements are allocated on the device and stay there, all of the operations are done with cuBLAS on one stream without copying the elements to the host. The copies, additions and linear combinations are only queued on the stream, so the host goes ahead with the next operation. The reductions (norm, dotProduct, dotProducts, addAndWeightedSquare) write their results into device memory and only wait once for all of them, so dotProducts with the stored L-BFGS pairs costs one synchronization instead of one per pair. The elements are copied to the host only by download (and by divide and pow, which have no cuBLAS equivalent, see below).
+/// Without CUDA, or if there is no GPU (or it is disabled with GpuLinearAlgebra::setEnabled before the first vector is created), the elements are in host memory and the operations are done with VectorKernels, so the same code runs everywhere. onDevice() tells which one is used, it is the same for all of the vectors of a process.
+/// divide and pow are done on the host (the elements are copied there and back). They are only used for setting up the mass in HMCGeneral and NUTSGeneral, and for each step of NUTSGeneral, while LBFGS_General and CG_General don't need them.
+/// The vectors are not thread safe, and there is no MPI: each process has its own vectors (see DistributedLargeVector for splitting a vector between the processes).
+class DeviceLargeVector
+{
+public:
+    /// Constructor. All of the elements are initialized to 0.
+    /// \param size The number of elements.
+    DeviceLargeVector(long size);
+
+    /// Destructor.
+    ~DeviceLargeVector();
+
+    /// Checks if the vectors are in the GPU memory (the same for all of the vectors of a process, decided when the first one is created).
+    static bool onDevice();
+
+    /// Wait until all of the queued operations on the vectors are done. Only needed before using data() in code that does not run on the same stream (see stream()).
+    static void synchronize();
+
+    /// The CUDA stream of the operations (cudaStream_t), for the functions that launch their own kernels on data(). NULL without CUDA.
+    static void* stream();
+
+    /// The number of elements.
+    long size() const { return n_; }
+
+    /// The elements, in the device memory if onDevice(), otherwise in the host memory.
+    double* data() { return data_; }
+    const double* data() const { return data_; }
+
+    /// Copy from other, multiplying with a coefficient.
+    void copy(const DeviceLargeVector& other, double c = 1.);
+
+    /// Set all of the elements to 0.
+    void setToZero();
+
+    /// The norm.
+    double norm() const;
+
+    /// The dot product with another vector.
+    double dotProduct(const DeviceLargeVector& other) const;
+
+    /// Dot products with n other vectors, waiting only once for all of them.
+    /// \param n The number of the other vectors.
+    /// \param others The other vectors.
+    /// \param res The results are written here upon return.
+    void dotProducts(int n, const DeviceLargeVector* const* others, double* res) const;
+
+    /// Set to the linear combination c[0] v[0] + ... + c[n-1] v[n-1]. The vector itself can be one of v.
+    void linearCombination(int n, const double* c, const DeviceLargeVector* const* v);
+
+    /// Add another vector with a coefficient, then return the sum of w_i x_i^2 over the result.
+    double addAndWeightedSquare(const DeviceLargeVector& other, double c, const DeviceLargeVector& w);
+
+    /// Add another vector with a coefficient.
+    void add(const DeviceLargeVector& other, double c = 1.);
+
+    /// Multiply with another vector, element by element.
+    void multiply(const DeviceLargeVector& other);
+
+    /// Divide by another vector, element by element (done on the host).
+    void divide(const DeviceLargeVector& other);
+
+    /// Take the power of the elements (done on the host).
+    void pow(double p);
+
+    /// Swap with another vector of the same size. Only the pointers are swapped.
+    void swap(DeviceLargeVector& other);
+
+    /// Copy the elements to the host.
+    /// \param res The elements are written here upon return.
+    void download(std::vector<double>* res) const;
+
+    /// Copy the elements from the host.
+    /// \param v The elements, must have size() of them.
+    void upload(const std::vector<double>& v);
+
+private:
+    DeviceLargeVector(const DeviceLargeVector&);
+    DeviceLargeVector& operator=(const DeviceLargeVector&);
+
+private:
+    long n_;
+    bool device_;
+    double* data_;
+    std::vector<double> host_;
+};
+
+/// The LargeVectorFactory for DeviceLargeVector.
+class DeviceLargeVectorFactory
+{
+public:
+    /// Constructor.
+    /// \param size The number of elements of the vectors.
+    DeviceLargeVectorFactory(long size) : size_(size)
+    {
+        check(size_ >= 0, "");
+    }
+
+    DeviceLargeVector* giveMeOne()
+    {
+        return new DeviceLargeVector(size_);
+    }
+
+private:
+    long size_;
+};
+
+/// A function of a DeviceLargeVector, calculated where the vector is.
+
+/// The implementations can use the operations of DeviceLargeVector, or launch their own kernels on data() on the stream of the vectors (see DeviceLargeVector::stream()), so the point and the gradient don't need to be copied to the host.
+class DeviceFunction
+{
+public:
+    virtual ~DeviceFunction() {}
+
+    /// The function value.
+    /// \param x The point.
+    virtual double value(const DeviceLargeVector& x) = 0;
+
+    /// The derivatives.
+    /// \param x The point.
+    /// \param grad The derivatives are written here upon return, it has the same size as x.
+    virtual void derivative(const DeviceLargeVector& x, DeviceLargeVector* grad) = 0;
+};
+
+/// The Function for LBFGS_General, CG_General, HMCGeneral and NUTSGeneral with DeviceLargeVector (see BasicLBFGSFunc for the concept), from a DeviceFunction.
+class DeviceLBFGSFunc
+{
+public:
+    /// Constructor.
+    /// \param f The function. Must stay alive as long as this object.
+    DeviceLBFGSFunc(DeviceFunction& f) : f_(f), x_(NULL) {}
+
+    ~DeviceLBFGSFunc() { delete x_; }
+
+    /// Set the point, copied on the device.
+    void set(const DeviceLargeVector& x);
+
+    double value();
+
+    void derivative(DeviceLargeVector* res);
+
+    /// Generate white noise with a given amplitude. The noise is generated on the host and copied to the device, it is the same as from DistributedLBFGSFunc for the same seed.
+    void whitenoise(int seed, DeviceLargeVector* x, double amplitude);
+
+private:
+    DeviceFunction& f_;
+    DeviceLargeVector* x_;
+    std::vector<double> noise_;
+};
+
+} // namespace Math
+
+#endif
+
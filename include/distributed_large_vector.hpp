@@ -0,0 +1,192 @@
+#ifndef COSMO_PP_DISTRIBUTED_LARGE_VECTOR_HPP
+#define COSMO_PP_DISTRIBUTED_LARGE_VECTOR_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+
+namespace Math
+{
+
+/// A large vector split between the MPI processes, for LBFGS_General, CG_General, HMCGeneral and NUTSGeneral (see BasicLargeVector for the LargeVector concept).
+
+/// The vector of totalSize() elements is partitioned into contiguous blocks, one per process of the communicator, with sizes differing by at most 1 (see partition). Each process stores only its own block.
+/// The element-wise operations are done on the local block only, split between the OpenMP threads and vectorized (see VectorKernels). The reductions (norm, dotProduct, dotProducts, addAndWeightedSquare) are done locally, then with one allreduce, so ALL of the processes get the total.
+/// All of the functions, except for the local element access, need to be called by all of the processes of the communicator at the same time.
+class DistributedLargeVector
+{
+public:
+    /// Constructor. All of the elements are initialized to 0.
+    /// \param totalSize The total number of elements, over all of the processes.
+    /// \param comm The communicator to split the vector between. NULL (default) means all of the processes. Must stay alive as long as the vector.
+    DistributedLargeVector(long totalSize, const CosmoMPI::Communicator* comm = NULL);
+
+    /// The block of a process.
+    /// \param totalSize The total number of elements.
+    /// \param nProcesses The number of processes.
+    /// \param processId The index of the process, from 0 to nProcesses - 1.
+    /// \param begin The index of the first element of the block is written here upon return.
+    /// \param size The number of elements of the block is written here upon return.
+    static void partition(long totalSize, int nProcesses, int processId, long* begin, long* size);
+
+    /// The total number of elements, over all of the processes.
+    long totalSize() const { return totalSize_; }
+
+    /// The global index of the first element stored by this process.
+    long localBegin() const { return begin_; }
+
+    /// The number of elements stored by this process.
+    long localSize() const { return long(v_.size()); }
+
+    /// The communicator, NULL for all of the processes.
+    const CosmoMPI::Communicator* communicator() const { return comm_; }
+
+    /// Copy from other, multiplying with a coefficient (the same on all of the processes).
+    void copy(const DistributedLargeVector& other, double c = 1.);
+
+    /// Set all of the elements to 0.
+    void setToZero();
+
+    /// The norm of the whole vector, given to all of the processes.
+    double norm() const;
+
+    /// The dot product with another vector, given to all of the processes.
+    double dotProduct(const DistributedLargeVector& other) const;
+
+    /// Dot products with n other vectors, in one pass over the local block and one allreduce.
+    /// \param n The number of the other vectors.
+    /// \param others The other vectors.
+    /// \param res The results are written here upon return, on all of the processes.
+    void dotProducts(int n, const DistributedLargeVector* const* others, double* res) const;
+
+    /// Set to the linear combination c[0] v[0] + ... + c[n-1] v[n-1] in one pass. The vector itself can be one of v. No communication is needed.
+    void linearCombination(int n, const double* c, const DistributedLargeVector* const* v);
+
+    /// Add another vector with a coefficient, then return the sum of w_i x_i^2 over the result, in one pass and one allreduce. All of the processes get the result.
+    double addAndWeightedSquare(const DistributedLargeVector& other, double c, const DistributedLargeVector& w);
+
+    /// Add another vector with a coefficient (the same on all of the processes).
+    void add(const DistributedLargeVector& other, double c = 1.);
+
+    /// Multiply with another vector, element by element.
+    void multiply(const DistributedLargeVector& other);
+
+    /// Divide by another vector, element by element.
+    void divide(const DistributedLargeVector& other);
+
+    /// Take the power of the elements.
+    void pow(double p);
+
+    /// Swap with another vector, which must have the same partition.
+    void swap(DistributedLargeVector& other);
+
+    /// The local block of this process. The element i of the block is the element localBegin() + i of the whole vector.
+    std::vector<double>& contents() { return v_; }
+    const std::vector<double>& contents() const { return v_; }
+
+    /// Gather the whole vector to all of the processes.
+    /// \param res The whole vector is written here upon return, on all of the processes.
+    void gather(std::vector<double>* res) const;
+
+    /// Set the local block from the whole vector.
+    /// \param v The whole vector, of size totalSize().
+    void scatter(const std::vector<double>& v);
+
+private:
+    // the element counts and the offsets of the blocks of all of the processes, for gather
+    void blockSizes(std::vector<int>* counts, std::vector<int>* displs) const;
+    double allSum(double s) const;
+
+private:
+    long totalSize_;
+    long begin_;
+    const CosmoMPI::Communicator* comm_;
+    std::vector<double> v_;
+
+    // scratch space for dotProducts and linearCombination
+    mutable std::vector<const double*> terms_;
+    mutable std::vector<double> sums_;
+};
+
+/// The LargeVectorFactory for DistributedLargeVector.
+class DistributedLargeVectorFactory
+{
+public:
+    /// Constructor.
+    /// \param totalSize The total number of elements of the vectors.
+    /// \param comm The communicator to split the vectors between. NULL (default) means all of the processes.
+    DistributedLargeVectorFactory(long totalSize, const CosmoMPI::Communicator* comm = NULL) : totalSize_(totalSize), comm_(comm)
+    {
+        check(totalSize_ >= 0, "");
+    }
+
+    DistributedLargeVector* giveMeOne()
+    {
+        return new DistributedLargeVector(totalSize_, comm_);
+    }
+
+private:
+    long totalSize_;
+    const CosmoMPI::Communicator* comm_;
+};
+
+/// A function of a DistributedLargeVector, where each process calculates the contribution of its own block.
+
+/// The value is the sum of the local values of all of the processes. The gradient of each process is for its own block only.
+/// The local functions are called on all of the processes at the same time, so they can communicate if the function does not separate between the blocks (for example to exchange the elements at the block edges).
+class DistributedFunction
+{
+public:
+    virtual ~DistributedFunction() {}
+
+    /// The contribution of the local block to the function value.
+    /// \param x The local block.
+    /// \param begin The global index of the first element of the block.
+    /// \return The local contribution.
+    virtual double localValue(const std::vector<double>& x, long begin) const = 0;
+
+    /// The derivatives with respect to the local elements.
+    /// \param x The local block.
+    /// \param begin The global index of the first element of the block.
+    /// \param grad The derivatives are written here upon return, it has the same size as x.
+    virtual void localDerivative(const std::vector<double>& x, long begin, std::vector<double>* grad) const = 0;
+};
+
+/// The Function for LBFGS_General, CG_General, HMCGeneral and NUTSGeneral with DistributedLargeVector (see BasicLBFGSFunc for the concept), from a DistributedFunction.
+class DistributedLBFGSFunc
+{
+public:
+    /// Constructor.
+    /// \param f The function. Must stay alive as long as this object.
+    DistributedLBFGSFunc(const DistributedFunction& f) : f_(f), begin_(0), comm_(NULL) {}
+
+    void set(const DistributedLargeVector& x);
+
+    /// The total value, given to all of the processes.
+    double value();
+
+    void derivative(DistributedLargeVector* res);
+
+    /// Generate white noise with a given amplitude. The noise for a given seed does not depend on the number of processes.
+    void whitenoise(int seed, DistributedLargeVector* x, double amplitude);
+
+private:
+    const DistributedFunction& f_;
+    std::vector<double> x_;
+    long begin_;
+    const CosmoMPI::Communicator* comm_;
+};
+
+/// Generate a block of white noise, the same as the elements begin to begin + size - 1 of a whole vector of white noise. The noise for a given seed does not depend on how the vector is split into blocks (used by DistributedLBFGSFunc and DeviceLBFGSFunc).
+/// \param seed The seed.
+/// \param begin The index of the first element of the block.
+/// \param size The number of elements of the block.
+/// \param amplitude The amplitude of the noise.
+/// \param v The block is written here upon return, must have size elements.
+void whitenoiseBlock(int seed, long begin, long size, double amplitude, double* v);
+
+} // namespace Math
+
+#endif
+
@@ -0,0 +1,90 @@
+#ifndef COSMO_PP_DISTRIBUTED_MATRIX_HPP
+#define COSMO_PP_DISTRIBUTED_MATRIX_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <matrix.hpp>
+
+namespace Math
+{
+
+/// A symmetric positive definite matrix distributed across all of the MPI processes.
+
+/// The matrix is stored in the two dimensional block cyclic distribution of ScaLAPACK, on a process grid as close to square as possible, so each process keeps only about 1 / (number of processes) of the elements.
+/// This allows factorizing matrices that do not fit into the memory of one node (for example the pixel space covariance matrices for high resolution maps).
+/// Each process needs to set the elements it owns (see isLocal). It is simplest to loop over all of the elements of the lower triangle and only calculate the local ones.
+/// Without ScaLAPACK (COSMO_SCALAPACK not defined) every process keeps the whole matrix as a packed SymmetricMatrix and the same results are calculated with LAPACK, so the code using this class does not need to change.
+/// All of the functions except for the element access need to be called by all of the processes at the same time.
+class DistributedSymmetricMatrix
+{
+public:
+    /// Constructor. Must be called by all of the processes at the same time. All of the elements are initialized to 0.
+    /// \param n The number of rows (and columns).
+    /// \param blockSize The size of the square blocks of the block cyclic distribution.
+    DistributedSymmetricMatrix(int n, int blockSize = 64);
+
+    /// Destructor. Must be called by all of the processes at the same time.
+    ~DistributedSymmetricMatrix();
+
+    /// The number of rows (and columns).
+    int size() const { return n_; }
+
+    /// Check if an element is stored by this process. Since the matrix is symmetric, (i, j) and (j, i) are the same element.
+    /// \param i The row index.
+    /// \param j The column index.
+    bool isLocal(int i, int j) const;
+
+    /// Set an element (and the symmetric one). The element must be local. Cannot be called after choleskyFactorize.
+    /// \param i The row index.
+    /// \param j The column index.
+    /// \param val The value.
+    void set(int i, int j, double val) { check(!factorized_, "the matrix has been factorized"); localElement(i, j) = val; }
+
+    /// Get an element. The element must be local. After choleskyFactorize this gives the element of the Cholesky factor, which is lower triangular with ScaLAPACK and upper triangular without it.
+    /// \param i The row index.
+    /// \param j The column index.
+    double get(int i, int j) const { return const_cast<DistributedSymmetricMatrix*>(this)->localElement(i, j); }
+
+    /// Cholesky factorize the matrix (in place).
+    /// \return 0 if successful, otherwise an error code (see the documentation of pdpotrf).
+    int choleskyFactorize();
+
+    /// Calculate the logarithm of the determinant. This function should be called after choleskyFactorize.
+    /// \return The logarithm of the determinant of the matrix.
+    double logDetFromCholeskyFactorization() const;
+
+    /// Solve the linear system A x = b. This function should be called after choleskyFactorize.
+    /// \param b The right hand sides, a vector of size n * nRhs, each right hand side stored one after the other. Must be the same on all of the processes. Will be replaced by the solutions on all of the processes.
+    /// \param nRhs The number of right hand sides.
+    /// \return 0 if successful, otherwise an error code (see the documentation of pdpotrs).
+    int solveFromCholeskyFactorization(std::vector<double>& b, int nRhs = 1) const;
+
+private:
+    DistributedSymmetricMatrix(const DistributedSymmetricMatrix&);
+    DistributedSymmetricMatrix& operator=(const DistributedSymmetricMatrix&);
+
+    double& localElement(int i, int j);
+
+private:
+    const int n_;
+    const int blockSize_;
+    bool factorized_;
+
+#ifdef COSMO_SCALAPACK
+    int context_;
+    int nProcRows_, nProcCols_, procRow_, procCol_;
+    int localRows_, localCols_;
+    int desc_[9];
+
+    // the local blocks, column major
+    std::vector<double> local_;
+#else
+    SymmetricMatrix<double> matrix_;
+#endif
+};
+
+} // namespace Math
+
+#endif
+
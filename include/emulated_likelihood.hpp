@@ -0,0 +1,341 @@
+#ifndef COSMO_PP_EMULATED_LIKELIHOOD_HPP
+#define COSMO_PP_EMULATED_LIKELIHOOD_HPP
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cosmo_mpi.hpp>
+#include <function.hpp>
+#include <likelihood_function.hpp>
+#include <learn_as_you_go.hpp>
+
+/// A likelihood function enhanced by LearnAsYouGo.
+
+/// Any likelihood function can be wrapped, -2ln(likelihood) is emulated as a function of all of the parameters. The emulator learns from the exact calculations as the sampler runs, and once its training set is large enough, the approximation is used whenever its estimated error is below the precision.
+/// The training set is shared between the MPI processes and saved into a file, so later runs start with it (see LearnAsYouGo). This is the same as what PlanckLikeFast does for the Planck likelihood, for any likelihood (for example WMAP9Likelihood or a custom one).
+/// With MPI the constructor is collective, ALL of the processes must construct the object.
+/// \tparam L The type of the wrapped likelihood, Math::LikelihoodFunction by default. A more specific type only makes likelihood() return that type.
+template<typename L = Math::LikelihoodFunction>
+class EmulatedLikelihood : public Math::LikelihoodFunction
+{
+public:
+    /// Constructor.
+    /// \param like The likelihood to be emulated. It is only called for the exact calculations.
+    /// \param nParams The number of parameters.
+    /// \param fileName The name of the file for the training set. If it exists, the training set is read from it. If empty, nothing is saved.
+    /// \param precision The precision of -2ln(likelihood). If the estimated error of the approximation is less than this precision then the approximation is used (fast), otherwise the full likelihood will be calculated (slow).
+    /// \param minCount The minimum number of points in the training set for the approximation to be used.
+    EmulatedLikelihood(L& like, int nParams, const char* fileName = "", double precision = 0.2, unsigned long minCount = 10000) : like_(like), nParams_(nParams), func_(like), layg_(NULL), x_(nParams), res_(1), logError_(false), lastApproximate_(false), lastRetries_(0)
+    {
+        check(nParams_ > 0, "invalid number of parameters " << nParams_);
+        check(precision > 0, "invalid precision " << precision);
+
+        layg_ = new LearnAsYouGo(nParams_, 1, func_, errorFunc_, minCount, precision, fileName);
+    }
+
+    /// Destructor. The training set is saved into the file.
+    ~EmulatedLikelihood()
+    {
+        delete layg_;
+        if(logError_)
+            outError_.close();
+    }
+
+    /// Calculate the likelihood for a new input point. The calculation will be approximate if the approximation is acceptable.
+    /// \param params The parameters vector (passed as a pointer to the first element).
+    /// \param nParams The number of the parameters, used only for checking.
+    double calculate(double* params, int nParams) { return doCalculation(params, nParams, false); }
+
+    /// Same as calculate, but enforces exact calculation. The result is added to the training set.
+    /// \param params The parameters vector (passed as a pointer to the first element).
+    /// \param nParams The number of the parameters, used only for checking.
+    double calculateExact(double* params, int nParams) { return doCalculation(params, nParams, true); }
+
+    /// Same as calculate, but also gives the gradient (and optionally the Hessian) of -2ln(likelihood) from the emulator (see LearnAsYouGo::evaluateWithGradient).
+    /// \param params The parameters vector (passed as a pointer to the first element).
+    /// \param nParams The number of the parameters, used only for checking.
+    /// \param value -2ln(likelihood) will be returned here.
+    /// \param grad The gradient will be written here, nParams values.
+    /// \param hessian If not NULL, the Hessian will be written here, nParams x nParams values.
+    /// \return true if the gradient has been calculated, false if the emulator has not been constructed yet (then only value is set).
+    bool calculateWithGradient(double* params, int nParams, double* value, double* grad, double* hessian = NULL)
+    {
+        check(nParams == nParams_, "invalid number of parameters " << nParams << ", expected " << nParams_);
+        check(value, "");
+        check(grad, "");
+
+        x_.assign(params, params + nParams_);
+        func_.resetRetries();
+
+        const bool good = layg_->evaluateWithGradient(x_, &res_, &gradient_, (hessian ? &hessian_ : NULL));
+
+        check(res_.size() == 1, "");
+        lastApproximate_ = (layg_->lastEvaluationPath() == LearnAsYouGo::APPROXIMATED);
+        lastRetries_ = func_.retries();
+        *value = res_[0];
+
+        if(!good)
+            return false;
+
+        check(gradient_.size() == 1 && gradient_[0].size() == nParams_, "");
+        for(int i = 0; i < nParams_; ++i)
+            grad[i] = gradient_[0][i];
+
+        if(hessian)
+        {
+            check(hessian_.size() == 1 && hessian_[0].size() == nParams_ * nParams_, "");
+            for(int i = 0; i < nParams_ * nParams_; ++i)
+                hessian[i] = hessian_[0][i];
+        }
+        return true;
+    }
+
+    /// Information about the last call of calculate or calculateExact.
+    /// \param approximate Will be set to true if the approximation was used, false if the likelihood was calculated exactly (or taken from a training set point).
+    /// \param retries Will be set to the number of retries of the wrapped likelihood in the call, if it gives this information, otherwise 0.
+    /// \return true.
+    bool lastEvaluationInfo(bool* approximate, int* retries) const
+    {
+        *approximate = lastApproximate_;
+        *retries = lastRetries_;
+        return true;
+    }
+
+    /// Set the precision.
+    /// \param p The precision of -2ln(likelihood). If the estimated error of the approximation is less than this precision then the approximation is used (fast), otherwise the full likelihood will be calculated (slow).
+    void setPrecision(double p) { check(p > 0, "invalid precision " << p); layg_->setPrecision(p); }
+
+    /// Log the errors for each call of calculate. If this is set then for each call a new row will be added to the log file containing the input parameters followed by the resulting likelihood, the 68.3% and the 95.5% upper bounds of the absolute error, the mean of the error, and the variance of the error.
+    /// \param fileNameBase The file name base. If only one process is run then the log file name is simply the base followed by ".txt". If multiple MPI processes are run, each will create a log file with the name "fileNameBase_id.txt", where id is the MPI process ID, i.e. a number between 0 and number of processes - 1.
+    void logError(const char* fileNameBase)
+    {
+        check(!logError_, "this function has already been called");
+        std::stringstream str;
+        str << fileNameBase;
+        if(CosmoMPI::create().numProcesses() > 1)
+            str << "_" << CosmoMPI::create().processId();
+        str << ".txt";
+
+        outError_.open(str.str().c_str());
+        if(!outError_)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot write into file " << str.str();
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        outError_ << std::setprecision(10);
+        logError_ = true;
+    }
+
+    /// The wrapped likelihood.
+    L& likelihood() { return like_; }
+
+    /// The emulator, for the other settings (for example LearnAsYouGo::logIntoFile, LearnAsYouGo::setBackgroundRebuild, or LearnAsYouGo::setSnapshotCompression).
+    LearnAsYouGo& emulator() { return *layg_; }
+
+private:
+    EmulatedLikelihood(const EmulatedLikelihood&);
+    EmulatedLikelihood& operator = (const EmulatedLikelihood&);
+
+    double doCalculation(double* params, int nParams, bool exact)
+    {
+        check(nParams == nParams_, "invalid number of parameters " << nParams << ", expected " << nParams_);
+
+        x_.assign(params, params + nParams_);
+        func_.resetRetries();
+
+        double error1Sigma = 0, error2Sigma = 0, errorMean = 0, errorVar = 0;
+        if(exact)
+            layg_->evaluateExact(x_, &res_);
+        else
+            layg_->evaluate(x_, &res_, &error1Sigma, &error2Sigma, &errorMean, &errorVar);
+
+        check(res_.size() == 1, "");
+        lastApproximate_ = (layg_->lastEvaluationPath() == LearnAsYouGo::APPROXIMATED);
+        lastRetries_ = func_.retries();
+
+        if(logError_)
+        {
+            for(int i = 0; i < nParams_; ++i)
+                outError_ << params[i] << '\t';
+            outError_ << res_[0] << '\t' << error1Sigma << '\t' << error2Sigma << '\t' << errorMean << '\t' << errorVar << std::endl;
+        }
+
+        return res_[0];
+    }
+
+    // the function emulated by LearnAsYouGo, -2ln(likelihood) as the only output
+    class Func : public Math::RealFunctionMultiToMulti
+    {
+    public:
+        Func(L& like) : like_(like), retries_(0) {}
+
+        virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+        {
+            res->resize(1);
+            (*res)[0] = like_.calculate(const_cast<double*>(&(x[0])), x.size());
+
+            bool approximate;
+            int retries;
+            if(like_.lastEvaluationInfo(&approximate, &retries))
+                retries_ += retries;
+        }
+
+        void resetRetries() { retries_ = 0; }
+        int retries() const { return retries_; }
+
+    private:
+        L& like_;
+        mutable int retries_;
+    };
+
+    // the error is in -2ln(likelihood) itself
+    class ErrorFunc : public Math::RealFunctionMultiDim
+    {
+    public:
+        virtual double evaluate(const std::vector<double>& x) const
+        {
+            check(x.size() == 1, "");
+            return x[0];
+        }
+    };
+
+private:
+    L& like_;
+    const int nParams_;
+    Func func_;
+    ErrorFunc errorFunc_;
+    LearnAsYouGo* layg_;
+
+    std::vector<double> x_, res_;
+    std::vector<std::vector<double> > gradient_, hessian_;
+
+    std::ofstream outError_;
+    bool logError_;
+
+    bool lastApproximate_;
+    int lastRetries_;
+};
+
+/// An EmulatedLikelihood with derivatives, for HMC, and for LBFGS (through function and gradientFunction).
+
+/// The derivatives come from the emulator (see EmulatedLikelihood::calculateWithGradient). Before the emulator has been constructed they are calculated with central finite differences of EmulatedLikelihood::calculate with the given steps, so the first steps of a run are slow but add to the training set.
+/// The value and the gradient at the last point are stored, so calculate followed by calculateDeriv for all of the parameters at the same point (as in HMC) evaluates the emulator only once.
+/// \tparam L The type of the likelihood wrapped by the EmulatedLikelihood.
+template<typename L = Math::LikelihoodFunction>
+class EmulatedLikelihoodWithDerivs : public Math::LikelihoodWithDerivs
+{
+public:
+    /// Constructor.
+    /// \param emulated The emulated likelihood.
+    /// \param steps The finite difference steps for each parameter, used only before the emulator has been constructed. Must be positive, the size determines the number of parameters.
+    EmulatedLikelihoodWithDerivs(EmulatedLikelihood<L>& emulated, const std::vector<double>& steps) : emulated_(emulated), n_(steps.size()), steps_(steps), point_(steps.size()), grad_(steps.size()), value_(0), valid_(false), fromEmulator_(false), function_(*this), gradientFunction_(*this)
+    {
+        check(n_ > 0, "");
+        for(int i = 0; i < n_; ++i)
+        {
+            check(steps_[i] > 0, "invalid step " << steps_[i] << " for parameter " << i);
+        }
+    }
+
+    /// -2ln(likelihood).
+    double calculate(double* params, int nParams)
+    {
+        update(params, nParams);
+        return value_;
+    }
+
+    /// The derivative of -2ln(likelihood) with respect to parameter i.
+    double calculateDeriv(double* params, int nParams, int i)
+    {
+        check(i >= 0 && i < n_, "invalid index " << i);
+        update(params, nParams);
+        return grad_[i];
+    }
+
+    /// Information about the last evaluation of the emulated likelihood.
+    bool lastEvaluationInfo(bool* approximate, int* retries) const { return emulated_.lastEvaluationInfo(approximate, retries); }
+
+    /// Check if the gradient at the last point has come from the emulator, false if it has been calculated with finite differences.
+    bool isGradientFromEmulator() const { return fromEmulator_; }
+
+    /// -2ln(likelihood) as a function, for LBFGS.
+    const Math::RealFunctionMultiDim& function() const { return function_; }
+
+    /// The gradient of -2ln(likelihood) as a function, for LBFGS.
+    const Math::RealFunctionMultiToMulti& gradientFunction() const { return gradientFunction_; }
+
+private:
+    void update(const double* params, int nParams)
+    {
+        check(nParams == n_, "invalid number of parameters " << nParams << ", expected " << n_);
+        if(valid_ && std::equal(params, params + n_, point_.begin()))
+            return;
+
+        point_.assign(params, params + n_);
+        std::vector<double> x(point_);
+        fromEmulator_ = emulated_.calculateWithGradient(&(x[0]), n_, &value_, &(grad_[0]));
+        if(!fromEmulator_)
+        {
+            for(int i = 0; i < n_; ++i)
+            {
+                x[i] = point_[i] + steps_[i];
+                const double plus = emulated_.calculate(&(x[0]), n_);
+                x[i] = point_[i] - steps_[i];
+                const double minus = emulated_.calculate(&(x[0]), n_);
+                x[i] = point_[i];
+                grad_[i] = (plus - minus) / (2 * steps_[i]);
+            }
+        }
+        valid_ = true;
+    }
+
+    class Function : public Math::RealFunctionMultiDim
+    {
+    public:
+        Function(EmulatedLikelihoodWithDerivs& l) : l_(l) {}
+        using Math::RealFunctionMultiDim::evaluate;
+        virtual double evaluate(const std::vector<double>& x) const
+        {
+            l_.update(&(x[0]), x.size());
+            return l_.value_;
+        }
+    private:
+        EmulatedLikelihoodWithDerivs& l_;
+    };
+
+    class GradientFunction : public Math::RealFunctionMultiToMulti
+    {
+    public:
+        GradientFunction(EmulatedLikelihoodWithDerivs& l) : l_(l) {}
+        using Math::RealFunctionMultiToMulti::evaluate;
+        virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+        {
+            l_.update(&(x[0]), x.size());
+            *res = l_.grad_;
+        }
+    private:
+        EmulatedLikelihoodWithDerivs& l_;
+    };
+
+private:
+    EmulatedLikelihood<L>& emulated_;
+    const int n_;
+    std::vector<double> steps_, point_, grad_;
+    double value_;
+    bool valid_;
+    bool fromEmulator_;
+    Function function_;
+    GradientFunction gradientFunction_;
+};
+
+#endif
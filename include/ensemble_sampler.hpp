@@ -0,0 +1,136 @@
+#ifndef COSMO_PP_ENSEMBLE_SAMPLER_HPP
+#define COSMO_PP_ENSEMBLE_SAMPLER_HPP
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <limits>
+#include <ctime>
+
+#include <macros.hpp>
+#include <likelihood_function.hpp>
+#include <random.hpp>
+#include <mcmc.hpp>
+
+namespace Math
+{
+
+/// An affine-invariant ensemble sampler (Goodman & Weare 2010).
+
+/// An ensemble of walkers is evolved, each walker being moved using the positions of the other walkers, so the proposal adapts automatically to the shape of the posterior and needs no tuning.
+/// The walkers are split into two halves. All of the walkers in one half are moved at the same time using the positions of the walkers in the other half, which keeps the ensemble a valid Markov chain.
+/// The walkers of each half are distributed across the MPI processes, and each process evaluates the likelihoods of its walkers in one call to LikelihoodFunction::calculateBatch.
+/// The positions of all of the walkers after each iteration are written into the chain file (fileRoot).txt, which can be read by MarkovChain. Each iteration adds as many elements as there are walkers, so the burnin for MarkovChain should be multiplied by the number of walkers.
+class EnsembleSampler
+{
+private:
+    enum PRIOR_MODE { UNIFORM_PRIOR = 0, GAUSSIAN_PRIOR, PRIOR_MODE_MAX };
+
+public:
+    enum MOVE_TYPE { STRETCH_MOVE = 0, WALK_MOVE, MOVE_TYPE_MAX };
+
+    /// Constructor.
+    /// \param nPar The number of parameters.
+    /// \param like The likelihood function.
+    /// \param fileRoot The root for filenames produced by EnsembleSampler.
+    /// \param nWalkers The number of walkers. Must be even and at least twice the number of parameters.
+    /// \param seed A random seed. If set to 0 (the default value), it will be determined from the current time.
+    EnsembleSampler(int nPar, LikelihoodFunction& like, std::string fileRoot, int nWalkers, time_t seed = 0);
+
+    /// Destructor.
+    ~EnsembleSampler();
+
+    /// Define a given parameter to have a uniform prior. One of the parameter setting functions must be called for each parameter before the run.
+    /// \param i The index of the parameter, 0 <= i < number of parameters.
+    /// \param name The name of the parameter.
+    /// \param min The minimum value of the parameter (the lower bound for the prior).
+    /// \param max The maximum value of the parameter (the upper bound for the prior).
+    /// \param starting The center of the starting ball of the walkers. If not set, it will be set to the midpoint of the range by default.
+    /// \param startingWidth The walkers start at gaussian random points with this width around the starting value. If not set, by default it will be set to 1/100-th of the width of the range.
+    void setParam(int i, const std::string& name, double min, double max, double starting = std::numeric_limits<double>::max(), double startingWidth = 0.0);
+
+    /// Define a given parameter to have a gaussian prior. One of the parameter setting functions must be called for each parameter before the run.
+    /// \param i The index of the parameter, 0 <= i < number of parameters.
+    /// \param name The name of the parameter.
+    /// \param mean The mean of the prior
+    /// \param sigma The sigma of the prior
+    /// \param starting The center of the starting ball of the walkers. If not set, it will be set to the mean by default.
+    /// \param startingWidth The walkers start at gaussian random points with this width around the starting value. If not set, by default it will be set to 1/100-th of sigma.
+    void setParamGauss(int i, const std::string& name, double mean, double sigma, double starting = std::numeric_limits<double>::max(), double startingWidth = 0.0);
+
+    /// Get the name of a parameter.
+    /// \param i The index of the parameter.
+    /// \return The name of the parameter.
+    const std::string& getParamName(int i) const { check(i >= 0 && i < n_, "invalid index " << i); return paramNames_[i]; }
+
+    /// Set an external prior function for all of the parameters. The values set by setParam or setParamGauss will then be ignored.
+    /// One of these functions still needs to be called for each parameter to set their names and starting values.
+    /// \param prior A pointer to the external prior function.
+    void useExternalPrior(PriorFunctionBase* prior) { externalPrior_ = prior; }
+
+    /// Use the stretch move (the default). A walker is moved along the line connecting it to a random walker of the other half.
+    /// \param scale The scale parameter a of the stretch, must be larger than 1. The stretch factor is between 1/a and a.
+    void useStretchMove(double scale = 2.0);
+
+    /// Use the walk move. A walker is moved by a gaussian random combination of the offsets of a random subset of the other half from their mean. This works better than the stretch move in higher dimensions.
+    /// \param subsetSize The number of walkers in the subset, at least 2. 0 means the number of parameters + 1 (limited by the size of the half).
+    void useWalkMove(int subsetSize = 0);
+
+    /// The number of walkers.
+    int nWalkers() const { return nWalkers_; }
+
+    /// Run the scan. Should be called after all of the other necessary functions have been called to set all of the necessary settings.
+    /// \param nIterations The number of iterations. Each iteration moves every walker once.
+    /// \param thin Only every thin-th iteration is written into the chain file.
+    /// \param writeResumeInformationEvery The resume information is written after this many iterations. 0 means no resume information will be written.
+    /// If the termination signals are trapped (see CheckpointCoordinator), a signal stops the run after the current iteration, the resume information is written, then the registered checkpoints.
+    /// \return The acceptance fraction of the proposals.
+    double run(unsigned long nIterations = 10000, int thin = 1, int writeResumeInformationEvery = 100);
+
+private:
+    double calculatePrior(double* params);
+    void propose(int walker, int half, double* proposed, double& logFactor);
+    void evaluateHalf(int half, bool initial);
+    void gatherHalf(int half);
+    void walkerRange(int half, int processId, int& begin, int& end) const;
+    void openOut(bool append, long position);
+    void writeWalkers();
+    void writeResumeInfo(unsigned long iteration);
+    bool readResumeInfo(unsigned long& iteration, long& position);
+
+private:
+    int n_;
+    LikelihoodFunction* like_;
+    std::string fileRoot_, resumeFileName_;
+    std::vector<double> param1_, param2_, starting_, startingWidth_;
+    std::vector<PRIOR_MODE> priorMods_;
+    std::vector<std::string> paramNames_;
+    PriorFunctionBase* externalPrior_;
+
+    const int nWalkers_;
+    MOVE_TYPE move_;
+    double stretchScale_;
+    int walkSubset_;
+
+    int nProcesses_, processId_;
+
+    // the state of all of the walkers, the walkers with index < nWalkers_ / 2 belong to the first half
+    std::vector<double> positions_, likes_, priors_;
+
+    // work space for the walkers of the current process
+    std::vector<double> proposed_, logFactors_, batchParams_, batchLikes_;
+    std::vector<double> gatherSend_, gatherRecv_;
+    unsigned long proposals_, accepted_;
+
+    time_t seed_;
+    Math::UniformRealGenerator* uniformGen_;
+    Math::GaussianGenerator* generator_;
+
+    const int resumeCode_;
+    std::ofstream out_;
+};
+
+} // namespace Math
+
+#endif
+
@@ -9,6 +9,7 @@
 #include <timer.hpp>
 #include <matrix.hpp>
 #include <progress_meter.hpp>
+#include <memory_tracker.hpp>
 
 /// A class that can be used to find approximate values of a function at a given point by using a training set with exact input and output values of the function.
 /// There are training input and output points of certain dimensions. We call the inputs of the function "points" and the outputs "data".
@@ -32,9 +33,38 @@ public:
     /// \param k The number of nearest neighbors to use in the approximation.
     FastApproximator(int nIn, int nOut, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& values, int k);
 
+    /// Constructor that uses the output points in place instead of copying them (see the corresponding reset).
+    /// \param nIn The dimensionality of the input space, i.e. the number of the input parameters.
+    /// \param nOut The dimensionality of the output space, i.e. the number of the output parameters.
+    /// \param dataSize The number of data points to use.
+    /// \param points A vector containing all of the input points. There needs to be at least dataSize points here.
+    /// \param values Pointers to the output points, each pointing to nOut values. There needs to be at least dataSize pointers here. The values are not copied, so they must remain valid and unchanged for as long as they are used.
+    /// \param k The number of nearest neighbors to use in the approximation.
+    FastApproximator(int nIn, int nOut, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<const double*>& values, int k);
+
+    /// Constructor that reads the training set from a file saved by writeIntoFile, nothing is rebuilt (see readFromFile). Throws an exception if the file cannot be used.
+    /// \param nIn The dimensionality of the input space, i.e. the number of the input parameters.
+    /// \param nOut The dimensionality of the output space, i.e. the number of the output parameters.
+    /// \param k The number of nearest neighbors to use in the approximation.
+    /// \param fileName The name of the file.
+    /// \param dataSize If nonzero, the file is only used if it contains exactly this many points.
+    /// \param values If not NULL, the output points are used from here in place (see the corresponding reset) instead of being read from the file. Needed if the file has been written without the values.
+    FastApproximator(int nIn, int nOut, int k, const char* fileName, unsigned long dataSize = 0, const std::vector<const double*>* values = NULL);
+
     /// Destructor.
     ~FastApproximator();
 
+    /// The memory needed for a training set, without allocating it: the kd tree of the input points, and the output points if they are copied.
+    /// \param nIn The dimensionality of the input space.
+    /// \param nOut The dimensionality of the output space.
+    /// \param dataSize The number of data points.
+    /// \param copyValues True if the output points are copied (as in the constructor taking vectors), false if they are used in place.
+    /// \return The number of bytes.
+    static unsigned long memoryEstimate(int nIn, int nOut, unsigned long dataSize, bool copyValues = true)
+    {
+        return KDTree::memoryEstimate(nIn, dataSize) + dataSize * (sizeof(const double*) + (copyValues ? sizeof(std::vector<double>) + nOut * sizeof(double) : 0));
+    }
+
     /// Reset the training set.
     /// \param dataSize The number of data points to use.
     /// \param points A vector containing all of the input points. Each point should be a vector of dimension nPoints. There needs to be at least dataSize points here. If the size of this vector is larger than dataSize then only the first dataSize points will be used.
@@ -42,11 +72,50 @@ public:
     /// \param updateCovariance If this is set to true (by default) then the covariance matrix of the input parameters is recalculated for the new training set, and the linear transformation matrix is updated. It is important to keep in mind that if this step is performed then the distances to previously existing points will change. For example, if the training set is updated by just adding some new points and we want to keep the distances to the old points unchanged then this parameter should be set to false.
     void reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& values, bool updateCovariance = true);
 
-    /// Add a new point. This procedure simply adds the new point to the kd tree without recalculating the covariance matrix. Only if the kd tree has become very unbalanced (the depth is more than 4 times log of the number of elements), the kd tree is rebalanced.
+    /// Reset the training set, using the output points in place instead of copying them. This saves memory when the caller keeps the training set anyway (for example in memory shared between processes).
+    /// \param dataSize The number of data points to use.
+    /// \param points A vector containing all of the input points. There needs to be at least dataSize points here.
+    /// \param values Pointers to the output points, each pointing to nOut values. There needs to be at least dataSize pointers here. The values are not copied, so they must remain valid and unchanged for as long as they are used.
+    /// \param updateCovariance Same as for the other reset.
+    void reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<const double*>& values, bool updateCovariance = true);
+
+    /// Add a new point. This procedure simply adds the new point to the kd tree and updates the running mean and the Cholesky factor of the covariance matrix of the points (a rank-1 update). The linear transformation is only recalculated if this is enabled by setWhiteningDriftThreshold and the covariance has drifted enough. Only if the kd tree has become very unbalanced (the depth is more than 4 times log of the number of elements), the kd tree is rebalanced.
     /// \param p The input value.
     /// \param val The output value.
     void addPoint(const std::vector<double>& p, const std::vector<double>& val);
 
+    /// Add a new point, using the output value in place instead of copying it. Otherwise the same as the other addPoint.
+    /// \param p The input value.
+    /// \param val A pointer to the output value (nOut values). It must remain valid and unchanged for as long as it is used.
+    void addPoint(const std::vector<double>& p, const double* val);
+
+    /// Allow addPoint to update the linear transformation when the covariance matrix of the input points has changed significantly. The transformation calculated from the current covariance is then applied to the points already in the kd tree, and the tree is rebuilt.
+    /// \param threshold The drift is measured as the maximum deviation from the identity of the current transformation times the Cholesky factor of the current covariance. The transformation is recalculated when this exceeds the threshold. Set to 0 (default) to never update the transformation in addPoint.
+    void setWhiteningDriftThreshold(double threshold);
+
+    /// Save the training set into a binary file, including the linear transformation and the built kd tree. The file can be read with readFromFile, which memory-maps the tree instead of rebuilding it.
+    /// \param fileName The name of the file.
+    /// \param includeValues If false, the output points are not saved. This is useful if they are saved elsewhere anyway, they then need to be given to readFromFile.
+    void writeIntoFile(const char* fileName, bool includeValues = true) const;
+
+    /// Save the training set into a binary stream in the same format as writeIntoFile. The kd tree data is aligned to 8 bytes from the beginning of the stream, so the stream contents need to be written at the beginning of a file for readFromFile.
+    /// \param out The output stream, must be opened in binary mode.
+    /// \param includeValues Same as for writeIntoFile.
+    void writeIntoStream(std::ostream& out, bool includeValues = true) const;
+
+    /// Replace the training set with one saved by writeIntoFile. The kd tree is memory-mapped read-only, so this is much faster than reset and the processes reading the same file share one copy of the tree in memory.
+    /// The linear transformation is also read from the file, so the distances are the same as when the file was written.
+    /// \param fileName The name of the file.
+    /// \param dataSize If nonzero, the file is only used if it contains exactly this many points.
+    /// \param values If not NULL, the output points are used from here in place (see the corresponding reset) instead of being read from the file. They must be in the same order as the points in the file. Needed if the file has been written without the values.
+    /// \return true if the training set has been read. false is returned (and nothing changes) if the file doesn't exist or doesn't match the dimensions or dataSize, or if it doesn't contain the values and they are not given.
+    bool readFromFile(const char* fileName, unsigned long dataSize = 0, const std::vector<const double*>* values = NULL);
+
+    /// Use approximate nearest neighbor searches, which are much faster in high dimensions. The interpolation error is usually much larger than the error from using slightly farther neighbors.
+    /// \param epsilon The relative error allowed in the distances to the neighbors (see KDTree::setApproximation). Set to 0 for exact searches.
+    /// \param maxVisits The maximum number of kd tree nodes to visit in one search. Set to 0 (default) for no limit.
+    void setApproximateSearch(double epsilon, unsigned long maxVisits = 0) { check(knn_, ""); knn_->setApproximation(epsilon, maxVisits); }
+
     /// Find the nearest neighbors to a given point. This step needs to be always performed before calling getApproximation.
     /// \param point The input point.
     /// \param distances The distances to the nearest neighbors squared will be returned in this vector. This can be set to NULL if the distances are not needed (by default). Keep in mind that the distances are the Euclidean distances in a linearly transformed space where the input training parameters are decorrelated.
@@ -54,11 +123,28 @@ public:
     /// \param indices The indices of the nearest neighbors will be returned here. Set to NULL if not needed (by default).
     void findNearestNeighbors(const std::vector<double>& point, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL);
 
+    /// Check if there is a training point within a given distance of a given point. The distance is measured in the linearly transformed space where the input training parameters are decorrelated.
+    /// \param point The input point.
+    /// \param radius The distance.
+    /// \return true if there is a training point within the distance.
+    bool hasPointWithin(const std::vector<double>& point, double radius);
+
     /// Get the approximation of the output for the input point given to findNearestNeighbors. This function should be called after findNearestNeighbors.
     /// \param val The output will be returned here.
     /// \param method The interpolation method to be used.
     void getApproximation(std::vector<double>& val, InterpolationMethod method = QUADRATIC_INTERPOLATION);
     
+    /// Get the approximation of the output together with its derivatives for the input point given to findNearestNeighbors. The derivatives are the ones of the local fit (linear or quadratic) with respect to the original (not transformed) input parameters, so they come at almost no extra cost.
+    /// \param val The output will be returned here.
+    /// \param gradient The first derivatives will be returned here, gradient[i][j] is the derivative of output i with respect to input j.
+    /// \param method The interpolation method to be used.
+    /// \param hessian If not NULL, the second derivatives will be returned here, (*hessian)[i][j * nIn() + l] is the second derivative of output i with respect to inputs j and l. They are 0 for the linear interpolation.
+    /// \return false if the local fit is degenerate, then only val is set.
+    bool getApproximationWithGradient(std::vector<double>& val, std::vector<std::vector<double> >& gradient, InterpolationMethod method = QUADRATIC_INTERPOLATION, std::vector<std::vector<double> >* hessian = NULL);
+
+    /// Find the approximate output and its derivatives for a given input point. This function is equivalent to calling findNearestNeighbors followed by getApproximationWithGradient.
+    bool approximateWithGradient(const std::vector<double>& point, std::vector<double>& val, std::vector<std::vector<double> >& gradient, InterpolationMethod method = QUADRATIC_INTERPOLATION, std::vector<std::vector<double> >* hessian = NULL);
+
     /// Find the approximate output for a given input point. This function is equivalent to calling findNearestNeighbors followed by getApproximation.
     /// \param point The input point.
     /// \param val The output will be returned here.
@@ -68,6 +154,16 @@ public:
     /// \param indices The indices of the nearest neighbors will be returned here. Set to NULL if not needed (by default).
     void approximate(const std::vector<double>& point, std::vector<double>& val, InterpolationMethod = QUADRATIC_INTERPOLATION, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL);
 
+    /// Find the approximate outputs for many input points at once. The nearest neighbor searches and the interpolations are performed in parallel if OpenMP is enabled.
+    /// This function doesn't change the state used by findNearestNeighbors and getApproximation, so it can be called from several threads at the same time as long as the training set is not modified.
+    /// \param points The input points.
+    /// \param vals The outputs will be returned here, in the same order as the input points.
+    /// \param method The interpolation method to be used.
+    /// \param distances If not NULL, the distances to the nearest neighbors of each point will be returned here (the same as from findNearestNeighbors).
+    /// \param nearestNeighbors If not NULL, the nearest neighbors of each point RELATIVE to it in the linearly transformed space will be returned here.
+    /// \param linearVals If not NULL, the linear interpolations from the same neighbors will also be returned here (for comparing with the interpolation of the given method).
+    void approximate(const std::vector<std::vector<double> >& points, std::vector<std::vector<double> >& vals, InterpolationMethod method = QUADRATIC_INTERPOLATION, std::vector<std::vector<double> >* distances = NULL, std::vector<std::vector<std::vector<double> > >* nearestNeighbors = NULL, std::vector<std::vector<double> >* linearVals = NULL) const;
+
     /// Get the dimensionality of the input space.
     int nIn() const { return nPoints_; }
 
@@ -91,14 +187,45 @@ private:
         return cov(d);
     }
 
+    // transforms a point into the decorrelated basis, D is the dimension fixed at compile time for the common cases, 0 means that nPoints_ is used
+    template<int D>
+    void transformDim(const double* in, double* out) const;
+    void transform(const double* in, double* out) const;
+
+    // the buffers for the local fits, allocated once for the largest (quadratic) basis. Each thread doing fits needs its own
+    struct Workspace
+    {
+        Workspace(int nPoints, int k);
+
+        // the basis functions at the neighbors (k x fitSize), the normal equations matrix and its Cholesky factor (fitSize x fitSize), and the first row of its inverse
+        std::vector<double> basis, a, q;
+        std::vector<double> weights;
+        int fitSize;
+    };
+
+    // the approximation at a point (in the transformed space) from its k nearest neighbors
+    void fit(const double* pointTransformed, const unsigned long* indices, const double* dists, InterpolationMethod method, Workspace& w, double* val) const;
+    // sets up and solves the weighted least squares fit with m basis functions, returns false if the normal equations are not positive definite
+    // the differences from the point are divided by scale in the basis functions
+    bool solveFit(const double* pointTransformed, const unsigned long* indices, int m, Workspace& w, double scale = 1) const;
+
+    // the part of reset that doesn't depend on how the data is stored
+    void resetPoints(unsigned long dataSize, const std::vector<std::vector<double> >& points, bool updateCovariance);
+
+    double whiteningDrift() const;
+    // calculates transform_ from transformInv_
+    void updateTransform();
+    void reWhiten();
+    void updateMemory();
+
 private:
     const int k_;
     KDTree* knn_;
 
+    // the output points used, either pointing into data_ or to memory owned by the caller
+    std::vector<const double*> dataRows_;
     std::vector<std::vector<double > > data_;
 
-    std::vector<std::vector<double> > pointsTransformed_;
-
     std::vector<double> pointTransformed_;
 
     unsigned long dataSize_;
@@ -112,12 +239,22 @@ private:
 
     Math::SymmetricMatrix<double> covariance_;
     Math::Matrix<double> choleskyMat_;
-    Math::Matrix<double> v_, w_;
+    std::vector<double> transform_;
+
+    // transformInv_ is the Cholesky factor of the covariance matrix used for the current transformation, i.e. the inverse of transform_
+    std::vector<double> transformInv_;
+
+    // running moments of the points in the kd tree: the number of points, the mean, and the Cholesky factor of the scatter matrix (the sum of (x - mean)(x - mean)^T)
+    unsigned long momentsCount_;
+    std::vector<double> mean_;
+    std::vector<double> scatterChol_;
+    bool scatterValid_;
+    double driftThreshold_;
+
+    Workspace workspace_;
 
-    Math::Matrix<double> x_, xLin_;
-    Math::Matrix<double> xT_, xTLin_;
-    Math::Matrix<double> inv_, invLin_;
-    Math::Matrix<double> prod_, prodLin_;
+    // the output points owned (the kd tree has its own)
+    MemoryTracker::Allocation memory_;
 };
 
 #endif
@@ -30,6 +30,18 @@ public:
     /// \param dm The decision method, i.e. what property of the error probability distribution to use to compare to precision.
     FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testValues, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method = AVG_DISTANCE, double precision = 1.0, DecisionMethod dm = TWO_SIGMA);
 
+    /// Constructor with the output points of the test set given as pointers, each pointing to fa.nOut() values. Otherwise the same as the other constructor.
+    FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testValues, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method = AVG_DISTANCE, double precision = 1.0, DecisionMethod dm = TWO_SIGMA);
+
+    /// Constructor with the error ratios of the test set already known (from errorRatios of a previous object on the same training set), so the test set is not evaluated again.
+    /// \param fa A reference to the fast approximator being used.
+    /// \param ratios The ratios of the actual errors to the estimated errors for the test set.
+    /// \param f Same as for the other constructors.
+    /// \param method Same as for the other constructors. Should be the same as the one used for calculating the ratios.
+    /// \param precision Same as for the other constructors.
+    /// \param dm Same as for the other constructors.
+    FastApproximatorError(FastApproximator& fa, const std::vector<double>& ratios, const Math::RealFunctionMultiDim& f, ErrorMethod method = AVG_DISTANCE, double precision = 1.0, DecisionMethod dm = TWO_SIGMA);
+
     /// Destructor.
     ~FastApproximatorError();
 
@@ -40,6 +52,19 @@ public:
     /// \param end The index after the last point to be used. To use all of the points set end to the size of testPoints.
     void reset(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testValues, unsigned long begin, unsigned long end);
 
+    /// Reset the test set with the output points given as pointers, each pointing to fa.nOut() values. Otherwise the same as the other reset.
+    void reset(const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testValues, unsigned long begin, unsigned long end);
+
+    /// Add more points to the test set (the cross-validation set). Only the new points are evaluated, and the error distribution is updated with their ratios.
+    /// \param testPoints The input points to add.
+    /// \param testValues The output points to add. Must have the same size as testPoints.
+    /// \param begin The starting index of the points to add.
+    /// \param end The index after the last point to add.
+    void addTestPoints(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testValues, unsigned long begin, unsigned long end);
+
+    /// Add more points to the test set with the output points given as pointers, each pointing to fa.nOut() values. Otherwise the same as the other addTestPoints.
+    void addTestPoints(const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testValues, unsigned long begin, unsigned long end);
+
     /// Approximate function.
     /// \param point The input point at which the approximation needs to be done.
     /// \param val The approximated result is returned here.
@@ -49,6 +74,11 @@ public:
     /// \param errorVar If specified (i.e. not NULL), the variance of the error probability distribution will be returned here.
     bool approximate(const std::vector<double>& point, std::vector<double>& val, double *error1Sigma = NULL, double *error2Sigma = NULL, double *errorMean = NULL, double *errorVar = NULL);
 
+    /// The estimated error at a given point before it is scaled by the error probability distribution, so it is available even if the distribution has not been generated. Larger values mean larger errors, useful for comparing different points.
+    /// \param point The input point.
+    /// \return The estimated error.
+    double estimateError(const std::vector<double>& point);
+
     /// Set the precision.
     /// \param precision This is the error threshold. The error value will be acceptable if it's smaller than precision.
     /// \param dm The decision method, i.e. what property of the error probability distribution to use to compare to precision.
@@ -57,8 +87,22 @@ public:
     /// Get the error probability distribution.
     Posterior1D* getDistrib() { return posterior_; }
 
+    /// Check if the error probability distribution has been generated. It needs at least 100 test points, otherwise getDistrib has no distribution to evaluate.
+    bool isDistribGenerated() const { return posteriorGood_; }
+
+    /// The ratios of the actual errors to the estimated errors for the test set (the points where the estimated error is 0 are not included). The error probability distribution is the distribution of their absolute values.
+    const std::vector<double>& errorRatios() const { return ratios_; }
+
 private:
-    double evaluateError();
+    void init();
+    // the estimated error from the nearest neighbors (distances or nearestNeighbors, depending on the method) and the approximations val and linVal
+    double evaluateError(const std::vector<double>* distances, const std::vector<std::vector<double> >* nearestNeighbors, const std::vector<double>& val, const std::vector<double>& linVal) const;
+    // the ratios of the actual errors to the estimated errors for a range of test points, evaluated in batch
+    void evaluateRatios(const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testValues, unsigned long begin, unsigned long end, std::vector<double>& ratios) const;
+    // generates the error distribution from ratios_
+    void generateDistrib();
+    // adds new ratios to the error distribution
+    void addRatios(const double* ratios, unsigned long n);
 
 private:
     const Math::RealFunctionMultiDim& f_;
@@ -68,6 +112,9 @@ private:
     Posterior1D* posterior_;
     bool posteriorGood_;
     double mean_, var_;
+    // the bounds of the distribution are evaluated once when it changes, so the decisions don't depend on the size of the test set
+    double sigma1_, sigma2_;
+    double ratioSum_, ratioSum2_;
 
     std::vector<double> val_;
     std::vector<double> linVal_;
@@ -75,10 +122,10 @@ private:
     std::vector<double>* distances_;
     std::vector<std::vector<double> >* nearestNeighbors_;
 
-    std::vector<double> distanceSum_;
-
     std::vector<double> ge_;
 
+    std::vector<double> ratios_;
+
     double precision_;
     DecisionMethod decMethod_;
 };
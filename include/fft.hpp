@@ -0,0 +1,41 @@
+#ifndef COSMO_PP_FFT_HPP
+#define COSMO_PP_FFT_HPP
+
+#include <vector>
+#include <complex>
+
+namespace Math
+{
+
+/// In-place radix-2 fast Fourier transform.
+/// \param data The data to be transformed. The size must be a power of 2. Upon return contains the transform.
+/// \param inverse If true, the inverse transform is computed (including the normalization by 1/size).
+void fft(std::vector<std::complex<double> >& data, bool inverse = false);
+
+/// Linear (not circular) convolution of real data with a symmetric kernel, using the fast Fourier transform. The data is padded with zeros on both ends.
+/// \param data The data to be convolved.
+/// \param kernel The kernel, must have an odd size 2m + 1 with the center at index m.
+/// \param result Upon return contains the convolution, result[i] = sum_k data[i - k + m] * kernel[k]. It has the same size as data.
+void convolve(const std::vector<double>& data, const std::vector<double>& kernel, std::vector<double>& result);
+
+/// The normalized autocorrelation function of a series, using the fast Fourier transform (the series is padded with zeros, so this takes O(n log n) operations).
+/// \param x The series (passed as a pointer to the first element).
+/// \param n The length of the series.
+/// \param rho Upon return contains the autocorrelation for the lags 0 to n - 1, rho[0] = 1. All zeros if the series is constant.
+/// \param stride The distance between the consecutive elements of the series in x, for example the number of parameters for a parameter of a chain stored by rows.
+void autocorrelation(const double* x, unsigned long n, std::vector<double>& rho, long stride = 1);
+
+/// The integrated autocorrelation time tau = 1 + 2 sum_t rho(t) of a series, from the autocorrelation function calculated with the fast Fourier transform.
+/// The sum is cut off with the automatic window of Sokal, at the smallest lag M for which M >= c * tau(M), since the noise in rho(t) for large lags would dominate otherwise.
+/// The effective sample size of the series is n / tau.
+/// \param x The series (passed as a pointer to the first element).
+/// \param n The length of the series.
+/// \param stride The distance between the consecutive elements of the series in x.
+/// \param c The window constant, 5 by default. Larger values give less bias and more noise.
+/// \return The integrated autocorrelation time, at least 1 (the series is treated as uncorrelated if it is constant).
+double integratedAutocorrelationTime(const double* x, unsigned long n, long stride = 1, double c = 5);
+
+} // namespace Math
+
+#endif
+
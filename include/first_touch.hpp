@@ -0,0 +1,87 @@
+#ifndef COSMO_PP_FIRST_TOUCH_HPP
+#define COSMO_PP_FIRST_TOUCH_HPP
+
+#include <memory>
+#include <utility>
+#include <new>
+
+namespace Math
+{
+
+/// An allocator for std::vector that does not initialize the elements of resize without a value (for the built in types, like double, they are left uninitialized).
+
+/// On NUMA nodes (several sockets) a page of memory is placed on the node of the thread that first writes into it, not the one that allocates it. std::vector fills the new elements in the calling thread, so all of a large matrix ends up on one node and the threads on the other sockets read remote memory in the parallel loops.
+/// With this allocator the storage is only allocated by resize, and then filled with firstTouchFill or firstTouchFillPacked (or by a parallel copy), which split the work between the threads the same way as the parallel loops over the rows with the static schedule (the OpenMP default), so each thread finds its rows in local memory.
+/// The vectors with this allocator have a different type than std::vector<T>, but otherwise behave the same. resize with a value, assign, and the copies still initialize the elements in the calling thread.
+template<typename T>
+class FirstTouchAllocator : public std::allocator<T>
+{
+public:
+    template<typename U>
+    struct rebind { typedef FirstTouchAllocator<U> other; };
+
+    FirstTouchAllocator() {}
+
+    template<typename U>
+    FirstTouchAllocator(const FirstTouchAllocator<U>&) {}
+
+    /// Default initialization instead of value initialization, does nothing for the built in types.
+    template<typename U>
+    void construct(U* p) { ::new((void*)p) U; }
+
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+};
+
+/// The minimum number of elements for the first touch to be split between the OpenMP threads. For smaller arrays a page or two on the wrong node doesn't matter.
+const long firstTouchParallelSize = 32768;
+
+/// Fill a row-major matrix with a value, the rows split between the OpenMP threads with the static schedule.
+/// \param data The elements.
+/// \param rows The number of rows.
+/// \param rowLength The number of elements in each row.
+/// \param val The value.
+template<typename T>
+inline void firstTouchFill(T* data, int rows, long rowLength, const T& val)
+{
+#pragma omp parallel for default(shared) schedule(static) if(rows * rowLength >= firstTouchParallelSize)
+    for(int i = 0; i < rows; ++i)
+    {
+        T* row = data + i * rowLength;
+        for(long j = 0; j < rowLength; ++j)
+            row[j] = val;
+    }
+}
+
+/// Fill a packed symmetric matrix with a value, the lower triangle stored row by row (row i has i + 1 elements, as in SymmetricMatrix and CMatrix), the rows split between the OpenMP threads with the static schedule.
+/// \param data The elements, rows * (rows + 1) / 2 of them.
+/// \param rows The number of rows.
+/// \param val The value.
+template<typename T>
+inline void firstTouchFillPacked(T* data, int rows, const T& val)
+{
+#pragma omp parallel for default(shared) schedule(static) if((long)rows * (rows + 1) / 2 >= firstTouchParallelSize)
+    for(int i = 0; i < rows; ++i)
+    {
+        T* row = data + (long)i * (i + 1) / 2;
+        for(long j = 0; j <= i; ++j)
+            row[j] = val;
+    }
+}
+
+/// Copy an array, split between the OpenMP threads with the static schedule, so the copy is placed the same way as the array filled by firstTouchFill.
+/// \param n The number of elements.
+/// \param x The array to copy.
+/// \param y The copy, must be allocated.
+template<typename T>
+inline void firstTouchCopy(long n, const T* x, T* y)
+{
+#pragma omp parallel for default(shared) schedule(static) if(n >= firstTouchParallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] = x[i];
+}
+
+} // namespace Math
+
+#endif
+
@@ -0,0 +1,147 @@
+#ifndef COSMO_PP_FISHER_MATRIX_HPP
+#define COSMO_PP_FISHER_MATRIX_HPP
+
+#include <vector>
+#include <string>
+
+#include <macros.hpp>
+#include <matrix.hpp>
+#include <likelihood_function.hpp>
+
+namespace Math
+{
+
+/// An abstract model of the CMB power spectra as a function of the parameters, for FisherMatrix.
+class ClModel
+{
+public:
+    virtual ~ClModel() {}
+
+    /// The maximum l of the spectra.
+    virtual int lMax() const = 0;
+
+    /// Tells if the model gives the EE and TE spectra as well as TT.
+    virtual bool hasPolarization() const = 0;
+
+    /// Calculate the spectra for a batch of parameter vectors. Models that can calculate several points at once (for example with a CMBPool) should do the whole batch concurrently.
+    /// \param params The parameter vectors, stored one after the other (nPoints * nParams values).
+    /// \param nParams The number of the parameters.
+    /// \param nPoints The number of parameter vectors.
+    /// \param clTT The TT spectra will be written here, one vector of lMax() + 1 values (the index is l) for each point.
+    /// \param clEE The EE spectra, NULL if hasPolarization() is false.
+    /// \param clTE The TE spectra, NULL if hasPolarization() is false.
+    virtual void calculateBatch(const double* params, int nParams, int nPoints, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE) = 0;
+};
+
+/// Fisher matrix forecasts around a fiducial point.
+
+/// The Fisher matrix is calculated either from a likelihood, as half of the Hessian of -2ln(likelihood), or from a model of the CMB power spectra, as F_ij = sum_l fSky (2l + 1) / 2 Tr(C_l^-1 dC_l/dp_i C_l^-1 dC_l/dp_j), where C_l is the covariance matrix of the T (and E) modes including the noise.
+/// The derivatives are finite differences with a three point (second order) or five point (fourth order) stencil along each parameter. For a likelihood the mixed second derivatives use the products of the one dimensional stencils (4 or 16 points for each pair of parameters).
+/// All of the points of the stencil are evaluated in one call to LikelihoodFunction::calculateBatch or ClModel::calculateBatch, so they are calculated concurrently by the likelihoods and models that evaluate batches in parallel (for example with a CMBPool).
+/// The points can also be split between the MPI processes (see the constructors), then all of the processes must call calculate at the same time, and all of them get the results.
+class FisherMatrix
+{
+public:
+    /// The finite difference stencil.
+    enum Stencil { THREE_POINT = 0, FIVE_POINT, STENCIL_MAX };
+
+    /// Constructor for the Fisher matrix of a likelihood.
+    /// \param like The likelihood function.
+    /// \param steps The finite difference step for each parameter, must be positive. The size determines the number of parameters.
+    /// \param stencil The stencil. THREE_POINT needs 1 + 2n^2 evaluations, FIVE_POINT needs 1 + 8n^2 - 4n.
+    /// \param distribute If true, the points are split between the MPI processes.
+    FisherMatrix(LikelihoodFunction& like, const std::vector<double>& steps, Stencil stencil = THREE_POINT, bool distribute = false);
+
+    /// Constructor for the Fisher matrix from the CMB power spectra. The noise is 0 and fSky = 1 unless set by setExperiment.
+    /// \param model The model of the power spectra.
+    /// \param steps The finite difference step for each parameter, must be positive. The size determines the number of parameters.
+    /// \param stencil The stencil. THREE_POINT needs 2n + 1 spectra, FIVE_POINT needs 4n + 1.
+    /// \param distribute If true, the points are split between the MPI processes.
+    FisherMatrix(ClModel& model, const std::vector<double>& steps, Stencil stencil = THREE_POINT, bool distribute = false);
+
+    /// Set the experiment for the Fisher matrix from the power spectra.
+    /// \param fSky The observed fraction of the sky.
+    /// \param lMin The minimum l to include.
+    /// \param lMax The maximum l to include, can be at most the lMax of the model. A negative value means the lMax of the model.
+    /// \param noiseTT The noise power spectrum of T (including the beam), the index is l. Can be NULL for no noise.
+    /// \param noisePol The noise power spectrum of E. Can be NULL for no noise.
+    void setExperiment(double fSky, int lMin, int lMax = -1, const std::vector<double>* noiseTT = NULL, const std::vector<double>* noisePol = NULL);
+
+    /// The number of parameters.
+    int nParams() const { return n_; }
+
+    /// The number of evaluations (of the likelihood or the spectra) needed for one Fisher matrix, by all of the processes.
+    int nPoints() const { return nPoints_; }
+
+    /// Calculate the Fisher matrix.
+    /// \param fiducial The fiducial parameters, nParams() of them.
+    void calculate(const std::vector<double>& fiducial);
+
+    /// The Fisher matrix from the last calculate.
+    const SymmetricMatrix<double>& fisher() const { return fisher_; }
+
+    /// -2ln(likelihood) at the fiducial point, from the last calculate with a likelihood.
+    double fiducialValue() const { check(like_, "not a likelihood Fisher matrix"); return fiducialValue_; }
+
+    /// The derivatives of the spectra at the fiducial point, from the last calculate with a ClModel.
+    /// \param i The index of the parameter.
+    /// \param clTT The derivatives of TT will be written here, the index is l.
+    /// \param clEE The derivatives of EE, can be NULL.
+    /// \param clTE The derivatives of TE, can be NULL.
+    void clDerivatives(int i, std::vector<double>* clTT, std::vector<double>* clEE = NULL, std::vector<double>* clTE = NULL) const;
+
+    /// The covariance matrix of the parameters, the inverse of the Fisher matrix.
+    /// \param cov The covariance matrix will be written here.
+    void covariance(SymmetricMatrix<double>* cov) const;
+
+    /// The marginalized errors of the parameters, the square roots of the diagonal of the covariance matrix.
+    /// \param errors The errors will be written here.
+    void marginalizedErrors(std::vector<double>* errors) const;
+
+    /// Write the covariance matrix into a text file in the CosmoMC .covmat format, one row of the matrix per line. This can be given to MetropolisHastings::setStartingCovariance.
+    /// \param fileName The name of the file.
+    /// \param names The names of the parameters, for the first line of the file. Can be NULL.
+    void writeCovarianceFile(const char* fileName, const std::vector<std::string>* names = NULL) const;
+
+private:
+    void initialize(const std::vector<double>& steps);
+    void setPoints(const std::vector<double>& fiducial);
+    void calculateLikelihood();
+    void calculateCl();
+    void calculateBatch();
+    // evaluates a batch of points, the results of each point (resultSize() values) are written one after the other
+    void evaluate(double* points, int nPoints, double* res);
+    int resultSize() const;
+
+private:
+    LikelihoodFunction* like_;
+    ClModel* model_;
+    const int n_;
+    std::vector<double> steps_;
+    const Stencil stencil_;
+    const bool distribute_;
+
+    // the offsets (in units of the step) of the points along one direction, and the weights of the first and second derivatives (the second derivative also has centerWeight_ for the center)
+    std::vector<int> offsets_;
+    std::vector<double> weights_, weights2_;
+    double centerWeight_;
+    int nPoints_;
+
+    double fSky_;
+    int lMin_, lMax_;
+    std::vector<double> noiseTT_, noisePol_;
+
+    // the points and their results (one value for a likelihood, the spectra one after the other for a ClModel), and the share of this process if distributed, reused
+    std::vector<double> points_, results_;
+    std::vector<double> myPoints_, myResults_;
+    std::vector<std::vector<double> > clTT_, clEE_, clTE_;
+    std::vector<std::vector<double> > dTT_, dEE_, dTE_;
+
+    double fiducialValue_;
+    SymmetricMatrix<double> fisher_;
+};
+
+} // namespace Math
+
+#endif
+
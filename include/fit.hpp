@@ -2,6 +2,7 @@
 #define COSMO_PP_FIT_HPP
 
 #include <vector>
+#include <algorithm>
 #include <sstream>
 #include <string>
 
@@ -17,13 +18,24 @@
 namespace Math
 {
 
+/// Calculates the sum of the squared differences between the data and a parametric function, for Fit.
+
+/// The function is evaluated over the data in chunks with its batch evaluate function (see Function), so functions overriding it (for example Polynomial) are vectorized over the points.
+/// In the parallel mode the chunks are also split between the OpenMP threads. The parameters are set once for each call, then the batch evaluate function of the parametric function is called concurrently, so it must be safe to call from several threads at once (it should not modify any state).
 class Chi2Calculator : public ROOT::Minuit2::FCNBase
 {
 public:
-    Chi2Calculator(ParametricFunction& f, const std::vector<double>& x, const::std::vector<double>& y) : f_(f), x_(x), y_(y)
+    /// Constructor.
+    /// \param f The parametric function.
+    /// \param x The x coordinates of the data points.
+    /// \param y The y coordinates of the data points, must have the same size as x.
+    /// \param parallel Evaluate the chunks of the data in parallel with OpenMP.
+    /// \param chunkSize The number of points evaluated in one batch.
+    Chi2Calculator(ParametricFunction& f, const std::vector<double>& x, const::std::vector<double>& y, bool parallel = false, int chunkSize = 4096) : f_(f), x_(x), y_(y), parallel_(parallel), chunkSize_(chunkSize)
     {
         check(x_.size() == y_.size(), "");
         check(!x_.empty(), "");
+        check(chunkSize_ > 0, "invalid chunk size " << chunkSize_);
     }
     
     virtual double operator()(const std::vector<double>& par) const
@@ -32,11 +44,33 @@ public:
         for(int i = 0; i < f_.numberOfParams(); ++i)
             f_.parameter(i) = par[i];
         
+        const long n = x_.size();
+        const long nChunks = (n + chunkSize_ - 1) / chunkSize_;
+        const ParametricFunction& f = f_;
+
         double res = 0;
-        for(int i = 0; i < x_.size(); ++i)
+#pragma omp parallel if(parallel_ && nChunks > 1) default(shared) reduction(+:res)
         {
-            const double diff = y_[i] - f_.evaluate(x_[i]);
-            res += diff * diff;
+            std::vector<double> values(std::min(long(chunkSize_), n));
+
+#pragma omp for schedule(static)
+            for(long c = 0; c < nChunks; ++c)
+            {
+                const long begin = c * chunkSize_;
+                const long m = std::min(long(chunkSize_), n - begin);
+                f.evaluate((unsigned long)m, &(x_[begin]), &(values[0]));
+
+                const double* y = &(y_[begin]);
+                const double* v = &(values[0]);
+                double sum = 0;
+#pragma omp simd reduction(+:sum)
+                for(long i = 0; i < m; ++i)
+                {
+                    const double diff = y[i] - v[i];
+                    sum += diff * diff;
+                }
+                res += sum;
+            }
         }
         return res;
     }
@@ -47,6 +81,8 @@ private:
     ParametricFunction& f_;
     std::vector<double> x_;
     std::vector<double> y_;
+    const bool parallel_;
+    const int chunkSize_;
 };
 
 /// Curve fitting class.
@@ -65,9 +101,10 @@ public:
     /// \param error A vector containing the errors of the parameters.
     /// \param min A vector containing the lower limits for the ranges of the parameters. Provide an empty vector to allow unlimited ranges.
     /// \param max A vector containing the upper limits for the ranges of the parameters.
-    Fit(ParametricFunction& f, const std::vector<double>& x, const::std::vector<double>& y, const std::vector<double>& starting, const std::vector<double>& error, const std::vector<double>& min, const std::vector<double>& max) : f_(f)
+    /// \param parallel If true, the function is evaluated over the data points in parallel with OpenMP (see Chi2Calculator), in that case the batch evaluate function of f must be safe to call from several threads at once.
+    Fit(ParametricFunction& f, const std::vector<double>& x, const::std::vector<double>& y, const std::vector<double>& starting, const std::vector<double>& error, const std::vector<double>& min, const std::vector<double>& max, bool parallel = false) : f_(f)
     {
-        calc_ = new Chi2Calculator(f, x, y);
+        calc_ = new Chi2Calculator(f, x, y, parallel);
         check(starting.size() == f.numberOfParams(), "");
         check(error.size() == f.numberOfParams(), "");
         check(min.size() == f.numberOfParams() || min.empty(), "");
@@ -34,6 +34,18 @@ public:
     /// \param x The argument of the function.
     /// \return The value of the function.
 	virtual ValueType evaluate(VariableType x) const = 0;
+
+    /// Evaluate the function at many points.
+
+    /// The default implementation calls evaluate for each point. Derived classes can override it with a faster implementation, which needs to give the same results as evaluating the points one by one.
+    /// \param n The number of points.
+    /// \param x The arguments, must have n elements.
+    /// \param res The values of the function will be written here, must have n elements.
+	virtual void evaluate(unsigned long n, const VariableType* x, ValueType* res) const
+	{
+		for(unsigned long i = 0; i < n; ++i)
+			res[i] = evaluate(x[i]);
+	}
 };
 	
 /// An abstract template class for a 2 variable function.
@@ -68,6 +80,19 @@ public:
     /// \param x2 Argument 2.
     /// \return The value of the function.
 	virtual ValueType evaluate(Variable1Type x1, Variable2Type x2) const = 0;
+
+    /// Evaluate the function at many points.
+
+    /// The default implementation calls evaluate for each point. Derived classes can override it with a faster implementation, which needs to give the same results as evaluating the points one by one.
+    /// \param n The number of points.
+    /// \param x1 Argument 1 for each point, must have n elements.
+    /// \param x2 Argument 2 for each point, must have n elements.
+    /// \param res The values of the function will be written here, must have n elements.
+	virtual void evaluate(unsigned long n, const Variable1Type* x1, const Variable2Type* x2, ValueType* res) const
+	{
+		for(unsigned long i = 0; i < n; ++i)
+			res[i] = evaluate(x1[i], x2[i]);
+	}
 };
 
 /// An abstract template class for a 3 variable function.
@@ -106,6 +131,20 @@ public:
     /// \param x3 Argument 3.
     /// \return The value of the function.
 	virtual ValueType evaluate(Variable1Type x1, Variable2Type x2, Variable3Type x3) const = 0;
+
+    /// Evaluate the function at many points.
+
+    /// The default implementation calls evaluate for each point. Derived classes can override it with a faster implementation, which needs to give the same results as evaluating the points one by one.
+    /// \param n The number of points.
+    /// \param x1 Argument 1 for each point, must have n elements.
+    /// \param x2 Argument 2 for each point, must have n elements.
+    /// \param x3 Argument 3 for each point, must have n elements.
+    /// \param res The values of the function will be written here, must have n elements.
+	virtual void evaluate(unsigned long n, const Variable1Type* x1, const Variable2Type* x2, const Variable3Type* x3, ValueType* res) const
+	{
+		for(unsigned long i = 0; i < n; ++i)
+			res[i] = evaluate(x1[i], x2[i], x3[i]);
+	}
 };
 
 /// An abstract template class for a multidimensional function.
@@ -136,6 +175,18 @@ public:
     /// \param x All of the parameters of the function in a vector.
     /// \return The value of the function.
     virtual ValueType evaluate(const std::vector<VariableType>& x) const = 0;
+
+    /// Evaluate the function at many points.
+
+    /// The default implementation calls evaluate for each point. Derived classes can override it with a faster implementation, which needs to give the same results as evaluating the points one by one.
+    /// \param x The points, each one a vector of all of the parameters.
+    /// \param res The values of the function will be written here, resized to the number of points.
+    virtual void evaluate(const std::vector<std::vector<VariableType> >& x, std::vector<ValueType>* res) const
+    {
+        res->resize(x.size());
+        for(unsigned long i = 0; i < x.size(); ++i)
+            (*res)[i] = evaluate(x[i]);
+    }
 };
 
 /// An abstract template class for a multidimensional to multidimensional function.
@@ -166,6 +217,18 @@ public:
     /// \param x All of the parameters of the function in a vector.
     /// \param res Return the value of the function.
     virtual void evaluate(const std::vector<VariableType>& x, std::vector<ValueType>* res) const = 0;
+
+    /// Evaluate the function at many points.
+
+    /// The default implementation calls evaluate for each point. Derived classes can override it with a faster implementation, which needs to give the same results as evaluating the points one by one.
+    /// \param x The points, each one a vector of all of the parameters.
+    /// \param res The values of the function for each point will be written here, resized to the number of points.
+    virtual void evaluate(const std::vector<std::vector<VariableType> >& x, std::vector<std::vector<ValueType> >* res) const
+    {
+        res->resize(x.size());
+        for(unsigned long i = 0; i < x.size(); ++i)
+            evaluate(x[i], &((*res)[i]));
+    }
 };
 	
 	
@@ -7,6 +7,7 @@
 
 #include <macros.hpp>
 #include <function.hpp>
+#include <fft.hpp>
 
 namespace Math
 {
@@ -19,6 +20,9 @@ public:
     ~GaussSmooth() {}
 
     inline virtual double evaluate(double x) const;
+
+    /// Evaluate at many points, in parallel.
+    inline virtual void evaluate(unsigned long n, const double* x, double* res) const;
     
     double evaluateError(double x) const;
 
@@ -74,6 +78,14 @@ GaussSmooth::evaluate(double x) const
     return res / norm;
 }
 
+void
+GaussSmooth::evaluate(unsigned long n, const double* x, double* res) const
+{
+#pragma omp parallel for default(shared) schedule(static) if(n >= 256)
+    for(long i = 0; i < long(n); ++i)
+        res[i] = evaluate(x[i]);
+}
+
 double
 GaussSmooth::evaluateError(double x) const
 {
@@ -106,6 +118,93 @@ GaussSmooth::kernel(double x, double x1) const
     return std::exp(-diffSq / (2.0 * sigmaSq_));
 }
 
+/// Gaussian smoothing of values given on a regular grid, using the fast Fourier transform.
+
+/// The result is the same as for GaussSmooth (the kernel weighted average of the values within 4 sigma), but the smoothing is done once for the whole grid by convolution.
+/// The smoothed values in between the grid points are found by linear interpolation, so evaluate is O(1).
+class BinnedGaussSmooth : public RealFunction
+{
+public:
+    /// Constructor.
+    /// \param xMin The position of the first grid point.
+    /// \param xMax The position of the last grid point.
+    /// \param y The values on the grid, y[i] is at xMin + i * (xMax - xMin) / (y.size() - 1). At least 2 points needed.
+    /// \param sigma The smoothing scale.
+    /// \param error The errors of the values on the grid. If not NULL, must have the same size as y.
+    inline BinnedGaussSmooth(double xMin, double xMax, const std::vector<double>& y, double sigma, const std::vector<double> *error = NULL);
+
+    ~BinnedGaussSmooth() {}
+
+    inline virtual double evaluate(double x) const { return interpolate(smooth_, x); }
+
+    /// Evaluate at many points.
+    virtual void evaluate(unsigned long n, const double* x, double* res) const
+    {
+        for(unsigned long i = 0; i < n; ++i)
+            res[i] = interpolate(smooth_, x[i]);
+    }
+
+    double evaluateError(double x) const { check(!error_.empty(), "error not initialized"); return interpolate(error_, x); }
+
+private:
+    inline double interpolate(const std::vector<double>& v, double x) const;
+
+private:
+    const double xMin_, xMax_, d_;
+    std::vector<double> smooth_, error_;
+};
+
+BinnedGaussSmooth::BinnedGaussSmooth(double xMin, double xMax, const std::vector<double>& y, double sigma, const std::vector<double> *error) : xMin_(xMin), xMax_(xMax), d_((xMax - xMin) / (y.size() - 1))
+{
+    check(y.size() >= 2, "need to have at least 2 points");
+    check(xMax > xMin, "invalid range");
+    check(sigma > 0, "invalid sigma = " << sigma << ", must be positive");
+
+    const int m = int(4 * sigma / d_);
+    std::vector<double> kernel(2 * m + 1), kernelSq(2 * m + 1);
+    for(int k = -m; k <= m; ++k)
+    {
+        const double diff = k * d_;
+        kernel[k + m] = std::exp(-diff * diff / (2.0 * sigma * sigma));
+        kernelSq[k + m] = kernel[k + m] * kernel[k + m];
+    }
+
+    std::vector<double> norm;
+    const std::vector<double> ones(y.size(), 1.0);
+    convolve(ones, kernel, norm);
+    convolve(y, kernel, smooth_);
+    for(unsigned long i = 0; i < y.size(); ++i)
+        smooth_[i] /= norm[i];
+
+    if(error)
+    {
+        check(error->size() == y.size(), "");
+        std::vector<double> eSq(y.size());
+        for(unsigned long i = 0; i < y.size(); ++i)
+            eSq[i] = (*error)[i] * (*error)[i];
+
+        convolve(eSq, kernelSq, error_);
+        for(unsigned long i = 0; i < y.size(); ++i)
+            error_[i] = (error_[i] > 0 ? std::sqrt(error_[i]) : 0.0) / norm[i];
+    }
+}
+
+double
+BinnedGaussSmooth::interpolate(const std::vector<double>& v, double x) const
+{
+    if(x <= xMin_)
+        return v[0];
+    if(x >= xMax_)
+        return v[v.size() - 1];
+
+    const double t = (x - xMin_) / d_;
+    unsigned long i = (unsigned long)t;
+    if(i >= v.size() - 1)
+        i = v.size() - 2;
+    const double f = t - i;
+    return v[i] * (1 - f) + v[i + 1] * f;
+}
+
 class GaussSmooth2D : public Math::Function2<double, double, double>
 {
 public:
@@ -115,6 +214,9 @@ public:
 
     inline virtual double evaluate(double x1, double x2) const;
 
+    /// Evaluate at many points, in parallel.
+    inline virtual void evaluate(unsigned long n, const double* x1, const double* x2, double* res) const;
+
 private:
     inline double kernel(double x1, double x2, double x1Prime, double x2Prime) const;
 
@@ -169,6 +271,14 @@ GaussSmooth2D::evaluate(double x1, double x2) const
     return 0.0;
 }
 
+void
+GaussSmooth2D::evaluate(unsigned long n, const double* x1, const double* x2, double* res) const
+{
+#pragma omp parallel for default(shared) schedule(static) if(n >= 16)
+    for(long i = 0; i < long(n); ++i)
+        res[i] = evaluate(x1[i], x2[i]);
+}
+
 double
 GaussSmooth2D::kernel(double x1, double x2, double x1Prime, double x2Prime) const
 {
@@ -177,6 +287,117 @@ GaussSmooth2D::kernel(double x1, double x2, double x1Prime, double x2Prime) cons
     return std::exp(-diff1 * diff1 / (2.0 * sigmaSq1_) - diff2 * diff2 / (2.0 * sigmaSq2_));
 }
 
+/// Two dimensional Gaussian smoothing of values given on a regular grid, using the fast Fourier transform.
+
+/// The result is the same as for GaussSmooth2D, but the smoothing is done once for the whole grid by convolution (separately in each direction, since the kernel is separable).
+/// The smoothed values in between the grid points are found by bilinear interpolation.
+class BinnedGaussSmooth2D : public Math::Function2<double, double, double>
+{
+public:
+    /// Constructor.
+    /// \param x1Min The first grid point in the first direction.
+    /// \param x1Max The last grid point in the first direction.
+    /// \param x2Min The first grid point in the second direction.
+    /// \param x2Max The last grid point in the second direction.
+    /// \param y The values on the grid, y[i][j] is at (x1Min + i * (x1Max - x1Min) / (y.size() - 1), x2Min + j * (x2Max - x2Min) / (y[i].size() - 1)). At least 2 points needed in each direction.
+    /// \param sigma1 The smoothing scale in the first direction.
+    /// \param sigma2 The smoothing scale in the second direction. If 0, sigma1 is used.
+    inline BinnedGaussSmooth2D(double x1Min, double x1Max, double x2Min, double x2Max, const std::vector<std::vector<double> >& y, double sigma1, double sigma2 = 0);
+
+    ~BinnedGaussSmooth2D() {}
+
+    inline virtual double evaluate(double x1, double x2) const;
+
+private:
+    inline static void kernel(double sigma, double d, std::vector<double>& k);
+
+private:
+    const double x1Min_, x1Max_, x2Min_, x2Max_;
+    int n1_, n2_;
+    double d1_, d2_;
+    std::vector<double> smooth_;
+};
+
+BinnedGaussSmooth2D::BinnedGaussSmooth2D(double x1Min, double x1Max, double x2Min, double x2Max, const std::vector<std::vector<double> >& y, double sigma1, double sigma2) : x1Min_(x1Min), x1Max_(x1Max), x2Min_(x2Min), x2Max_(x2Max)
+{
+    check(y.size() >= 2, "need to have at least 2 points in each direction");
+    check(y[0].size() >= 2, "need to have at least 2 points in each direction");
+    check(x1Max > x1Min, "invalid range");
+    check(x2Max > x2Min, "invalid range");
+    check(sigma1 > 0, "invalid sigma1 = " << sigma1 << ", must be positive");
+    check(sigma2 >= 0, "invalid sigma2 = " << sigma2 << ", must be positive or 0 to use sigma 1");
+
+    if(sigma2 == 0)
+        sigma2 = sigma1;
+
+    n1_ = y.size();
+    n2_ = y[0].size();
+    d1_ = (x1Max - x1Min) / (n1_ - 1);
+    d2_ = (x2Max - x2Min) / (n2_ - 1);
+
+    std::vector<double> k1, k2, norm1, norm2;
+    kernel(sigma1, d1_, k1);
+    kernel(sigma2, d2_, k2);
+    convolve(std::vector<double>(n1_, 1.0), k1, norm1);
+    convolve(std::vector<double>(n2_, 1.0), k2, norm2);
+
+    // smooth along the second direction first, then along the first
+    smooth_.resize(n1_ * n2_);
+    std::vector<double> res;
+    for(int i = 0; i < n1_; ++i)
+    {
+        check(y[i].size() == n2_, "the elements of y must have the same size");
+        convolve(y[i], k2, res);
+        for(int j = 0; j < n2_; ++j)
+            smooth_[i * n2_ + j] = res[j];
+    }
+
+    std::vector<double> column(n1_);
+    for(int j = 0; j < n2_; ++j)
+    {
+        for(int i = 0; i < n1_; ++i)
+            column[i] = smooth_[i * n2_ + j];
+        convolve(column, k1, res);
+        for(int i = 0; i < n1_; ++i)
+            smooth_[i * n2_ + j] = res[i] / (norm1[i] * norm2[j]);
+    }
+}
+
+void
+BinnedGaussSmooth2D::kernel(double sigma, double d, std::vector<double>& k)
+{
+    const int m = int(4 * sigma / d);
+    k.resize(2 * m + 1);
+    for(int i = -m; i <= m; ++i)
+    {
+        const double diff = i * d;
+        k[i + m] = std::exp(-diff * diff / (2.0 * sigma * sigma));
+    }
+}
+
+double
+BinnedGaussSmooth2D::evaluate(double x1, double x2) const
+{
+    double t1 = (x1 - x1Min_) / d1_, t2 = (x2 - x2Min_) / d2_;
+    if(t1 < 0)
+        t1 = 0;
+    if(t1 > n1_ - 1)
+        t1 = n1_ - 1;
+    if(t2 < 0)
+        t2 = 0;
+    if(t2 > n2_ - 1)
+        t2 = n2_ - 1;
+
+    int i = int(t1), j = int(t2);
+    if(i > n1_ - 2)
+        i = n1_ - 2;
+    if(j > n2_ - 2)
+        j = n2_ - 2;
+    const double f1 = t1 - i, f2 = t2 - j;
+
+    return (1 - f1) * ((1 - f2) * smooth_[i * n2_ + j] + f2 * smooth_[i * n2_ + j + 1]) + f1 * ((1 - f2) * smooth_[(i + 1) * n2_ + j] + f2 * smooth_[(i + 1) * n2_ + j + 1]);
+}
+
 } // namespace Math
 
 #endif
@@ -0,0 +1,114 @@
+#ifndef COSMO_PP_GPU_LINEAR_ALGEBRA_HPP
+#define COSMO_PP_GPU_LINEAR_ALGEBRA_HPP
+
+#include <vector>
+#include <map>
+
+namespace Math
+{
+
+/// A backend for offloading dense linear algebra to a GPU with cuBLAS and cuSOLVER.
+
+/// Used by Matrix::multiplyMatrices and the Cholesky factorization of SymmetricMatrix for large matrices when Cosmo++ is built with CUDA (COSMO_CUDA defined, set CUDA_DIR for cmake). Without CUDA enabled() is always false and nothing needs to be changed in the code using the matrices.
+/// The library handles, the device buffers and the cuSOLVER workspace are created once and kept across the calls, growing only if a larger matrix is given. So repeated operations with matrices of the same shape (for example the covariance matrix of a likelihood for each new set of parameters) only need to copy the data.
+/// The arrays that stay the same across many calls (for example a fixed matrix that is multiplied with a new one for each set of parameters) can be made resident with makeResident. They are then uploaded at their first use only, and the calls with the same host pointer use the copy on the device. If the host array is changed, invalidate must be called, so that it is uploaded again at its next use. The results written into a resident array (and the in place factorizations of one) are also kept on the device, so they do not need to be uploaded again.
+/// There is one instance (per process), given by create(). It is not thread safe, so the matrix operations that use it should not be called from several threads at the same time.
+/// All of the matrices are in the column major format of BLAS and LAPACK.
+class GpuLinearAlgebra
+{
+private:
+    GpuLinearAlgebra();
+    ~GpuLinearAlgebra();
+
+public:
+    /// Get the instance.
+    static GpuLinearAlgebra& create()
+    {
+        static GpuLinearAlgebra g;
+        return g;
+    }
+
+    /// Check if a GPU is used. False if Cosmo++ is built without CUDA, if there is no GPU, or if disabled by setEnabled.
+    bool enabled() const { return enabled_; }
+
+    /// Enable or disable the use of the GPU. Enabling has no effect if there is no GPU.
+    /// \param enable Use the GPU or not.
+    void setEnabled(bool enable);
+
+    /// The minimum number of rows (and columns) of a matrix for the operations to be offloaded. Smaller matrices are faster on the host because of the transfers.
+    int minSize() const { return minSize_; }
+
+    /// Set the minimum size of the matrices to offload.
+    /// \param minSize The minimum number of rows (and columns).
+    void setMinSize(int minSize) { minSize_ = minSize; }
+
+    /// Check if a given operation should be offloaded.
+    /// \param n The smallest dimension of the matrices in the operation.
+    bool useFor(int n) const { return enabled_ && n >= minSize_; }
+
+    /// Matrix multiplication c = op(a) op(b) with the same arguments as dgemm (with alpha = 1, beta = 0).
+    void dgemm(char transa, char transb, int m, int n, int k, const double* a, int lda, const double* b, int ldb, double* c, int ldc);
+
+    /// Cholesky factorization in place, with the same arguments as dpotrf.
+    /// \return 0 if successful, otherwise an error code (see the documentation of dpotrf).
+    int dpotrf(char uplo, int n, double* a, int lda);
+
+    /// Inversion from the Cholesky factorization in place, with the same arguments as dpotri.
+    /// \return 0 if successful, otherwise an error code (see the documentation of dpotri).
+    int dpotri(char uplo, int n, double* a, int lda);
+
+    /// Keep a copy of a host array on the device, uploaded at its first use by the operations above and used by all of the following ones with the same pointer. Nothing is done if the GPU is not enabled.
+    /// \param data The host array.
+    /// \param size The number of elements, must be at least the size used by the operations.
+    void makeResident(const double* data, unsigned long size);
+
+    /// Mark the device copy of a resident array as outdated, it is uploaded again at its next use. Must be called each time the host array is changed (other than by the operations above).
+    /// \param data The host array, nothing is done if it is not resident.
+    void invalidate(const double* data);
+
+    /// Release the device copy of a resident array. Must be called before the host array is freed.
+    /// \param data The host array, nothing is done if it is not resident.
+    void release(const double* data);
+
+    /// Check if a host array is resident.
+    bool isResident(const double* data) const { return resident_.count(data) > 0; }
+
+private:
+    struct ResidentArray
+    {
+        double* device;
+        unsigned long size;
+        bool upToDate;
+    };
+
+    double* deviceBuffer(int i, unsigned long size);
+    int* deviceInfo();
+    // the device copy of an input array, the resident one or buffer i
+    double* upload(int i, const double* data, unsigned long size);
+
+    // the device array for an output, the resident one or buffer i
+    double* output(int i, const double* data, unsigned long size);
+
+    // called after the output has been copied into the host array
+    void downloaded(const double* data, unsigned long size);
+
+private:
+    bool available_, enabled_;
+    int minSize_;
+
+    void* blasHandle_;
+    void* solverHandle_;
+
+    // device buffers for up to 3 matrices, the solver workspace, and the solver info
+    std::vector<double*> buffers_;
+    std::vector<unsigned long> bufferSizes_;
+    int* info_;
+
+    // the device copies of the resident host arrays
+    std::map<const double*, ResidentArray> resident_;
+};
+
+} // namespace Math
+
+#endif
+
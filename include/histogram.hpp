@@ -7,12 +7,16 @@
 #include <cmath>
 #include <algorithm>
 
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+
 namespace Math
 {
 
 /// A histogram class.
 
 /// This class can be used to create a histogram from given data. A histogram is a map which maps the starting point of the bin to the bin value.
+/// By default all of the data points are stored and binned by createHistogram (so the binning can be chosen from the data). In the streaming mode (see the corresponding constructor) the bins are fixed up front, each data point is counted in its bin right away (constant time), and the data points are not stored. Streaming histograms from different threads or MPI processes can be combined with merge and allreduce.
 template<typename T>
 class Histogram
 {
@@ -21,13 +25,28 @@ public:
     typedef T VariableType;
 
     /// The histogram type
-    typedef std::map<VariableType, int> HistogramType;
+    typedef std::map<VariableType, long> HistogramType;
     
 public:
     /// Constructor.
 
     /// Constructs an empty histogram. To generate a histogram at least one data point must be provided.
-    Histogram() : binned_(false) { min_ = std::numeric_limits<VariableType>::max(); max_ = std::numeric_limits<VariableType>::min(); }
+    Histogram() : streaming_(false), nBins_(0), count_(0), underflow_(0), overflow_(0), binned_(false) { min_ = std::numeric_limits<VariableType>::max(); max_ = std::numeric_limits<VariableType>::min(); }
+
+    /// Constructor for the streaming mode.
+
+    /// Constructs an empty histogram with fixed bins. The data points are counted in the bins as they are added and are not stored.
+    /// \param min The start of the first bin.
+    /// \param max The end of the last bin.
+    /// \param nBins The number of bins, equally spaced between min and max.
+    Histogram(VariableType min, VariableType max, int nBins) : streaming_(true), binMin_(min), binMax_(max), nBins_(nBins), counts_(nBins, 0), count_(0), underflow_(0), overflow_(0), binned_(false)
+    {
+        check(max > min, "invalid range " << min << " to " << max);
+        check(nBins > 0, "The number of bins must be positive.");
+        step_ = (max - min) / nBins;
+        min_ = std::numeric_limits<VariableType>::max();
+        max_ = std::numeric_limits<VariableType>::min();
+    }
     
     /// Destructor.
     
@@ -48,9 +67,38 @@ public:
     
     /// Get the number of data points provided so far.
     /// \return The data size.
-    int getDataSize() const { return data_.size(); }
+    long getDataSize() const { return streaming_ ? count_ : long(data_.size()); }
+
+    /// Checks if the histogram is in the streaming mode (constructed with fixed bins).
+    bool streaming() const { return streaming_; }
+
+    /// The number of bins, in the streaming mode.
+    int numBins() const { check(streaming_, "only for the streaming mode"); return nBins_; }
+
+    /// The start of a bin, in the streaming mode.
+    /// \param i The index of the bin.
+    VariableType binStart(int i) const { check(streaming_, "only for the streaming mode"); check(i >= 0 && i < nBins_, "invalid bin " << i); return binMin_ + i * step_; }
+
+    /// The number of data points in a bin so far, in the streaming mode.
+    /// \param i The index of the bin.
+    long binCount(int i) const { check(streaming_, "only for the streaming mode"); check(i >= 0 && i < nBins_, "invalid bin " << i); return counts_[i]; }
+
+    /// The number of data points below the first bin, in the streaming mode.
+    long underflow() const { check(streaming_, "only for the streaming mode"); return underflow_; }
+
+    /// The number of data points above the last bin, in the streaming mode.
+    long overflow() const { check(streaming_, "only for the streaming mode"); return overflow_; }
+
+    /// Add the data of another histogram to this one. In the streaming mode both histograms must have the same bins and the counts are added, otherwise the data points are copied.
+    /// \param other The other histogram.
+    void merge(const Histogram<T>& other);
+
+    /// Combine the streaming histograms of all of the MPI processes of a communicator, all of them end up with the total counts. Must be called by all of the processes at the same time, with the same bins.
+    /// \param comm The communicator, NULL for all of the processes.
+    void allreduce(const CosmoMPI::Communicator* comm = NULL);
     
     /// This function creates an actual histogram out of the data given. Calling without any arguments creates a histogram on the whole range of data with an optimal number of bins. The optimal number is determined using the Freedman-Diaconis rule.
+    /// In the streaming mode the histogram is created from the bin counts, the arguments are ignored.
     /// \param min The minimum of the range to be used.
     /// \param max The maximum of the range to be used.
     /// \param nBins The number of bins to be used.
@@ -64,6 +112,13 @@ private:
     std::vector<VariableType> data_;
     VariableType min_;
     VariableType max_;
+
+    // for the streaming mode
+    bool streaming_;
+    VariableType binMin_, binMax_, step_;
+    int nBins_;
+    std::vector<long> counts_;
+    long count_, underflow_, overflow_;
     
     HistogramType histogram_;
     bool binned_;
@@ -78,12 +133,91 @@ void Histogram<T>::addData(VariableType element)
         histogram_.clear();
     }
     
-    data_.push_back(element);
     if(element < min_)
         min_ = element;
     
     if(element > max_)
         max_ = element;
+
+    if(!streaming_)
+    {
+        data_.push_back(element);
+        return;
+    }
+
+    ++count_;
+    if(element < binMin_)
+        ++underflow_;
+    else if(element > binMax_)
+        ++overflow_;
+    else
+    {
+        // the end of the last bin belongs to it, as in createHistogram
+        int i = int((element - binMin_) / step_);
+        if(i >= nBins_)
+            i = nBins_ - 1;
+        ++counts_[i];
+    }
+}
+
+template<typename T>
+void Histogram<T>::merge(const Histogram<T>& other)
+{
+    check(streaming_ == other.streaming_, "cannot merge a streaming histogram with a non-streaming one");
+
+    if(binned_)
+    {
+        binned_ = false;
+        histogram_.clear();
+    }
+
+    if(other.min_ < min_)
+        min_ = other.min_;
+    if(other.max_ > max_)
+        max_ = other.max_;
+
+    if(!streaming_)
+    {
+        data_.insert(data_.end(), other.data_.begin(), other.data_.end());
+        return;
+    }
+
+    check(nBins_ == other.nBins_ && binMin_ == other.binMin_ && binMax_ == other.binMax_, "the histograms must have the same bins");
+    for(int i = 0; i < nBins_; ++i)
+        counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    underflow_ += other.underflow_;
+    overflow_ += other.overflow_;
+}
+
+template<typename T>
+void Histogram<T>::allreduce(const CosmoMPI::Communicator* comm)
+{
+    check(streaming_, "only for the streaming mode");
+
+    if(binned_)
+    {
+        binned_ = false;
+        histogram_.clear();
+    }
+
+    CosmoMPI& mpi = CosmoMPI::create();
+
+    // the counts, then the total, the underflow, and the overflow in one message
+    std::vector<long> counts(counts_);
+    counts.push_back(count_);
+    counts.push_back(underflow_);
+    counts.push_back(overflow_);
+    mpi.allreduce(&(counts[0]), &(counts[0]), int(counts.size()), CosmoMPI::SUM, comm);
+    std::copy(counts.begin(), counts.begin() + nBins_, counts_.begin());
+    count_ = counts[nBins_];
+    underflow_ = counts[nBins_ + 1];
+    overflow_ = counts[nBins_ + 2];
+
+    VariableType m = min_;
+    mpi.allreduce(&m, &min_, 1, CosmoMPI::MIN, comm);
+    m = max_;
+    mpi.allreduce(&m, &max_, 1, CosmoMPI::MAX, comm);
 }
     
 template<typename T>
@@ -91,6 +225,15 @@ void Histogram<T>::createHistogram(VariableType min, VariableType max, int nBins
 {
     check(!binned_, "Already created.");
     check(histogram_.empty(), "");
+
+    if(streaming_)
+    {
+        for(int i = 0; i < nBins_; ++i)
+            histogram_[binMin_ + i * step_] = counts_[i];
+        binned_ = true;
+        return;
+    }
+
     check(!data_.empty(), "No data input yet.");
     
     if(min == std::numeric_limits<VariableType>::min())
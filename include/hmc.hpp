@@ -15,9 +15,20 @@
 namespace Math
 {
 
+/// A simple Hamiltonian Monte Carlo sampler.
+
+/// With MPI each process runs its own chain, written into fileRoot_i.txt (i is the process index), in the same format as the chains of MetropolisHastings, so they can be read with MarkovChain.
+/// The chains are checked for convergence with the Gelman-Rubin diagnostic, and can write resume information to continue an interrupted run (see run).
 class HMC
 {
 public:
+    /// Constructor.
+    /// \param nPar The number of parameters.
+    /// \param like The likelihood function, -2ln(like), with derivatives.
+    /// \param fileRoot The root of the output files.
+    /// \param tauMax The maximum step size.
+    /// \param nMax The maximum number of steps in a trajectory.
+    /// \param seed The random seed, 0 means the time is used. With MPI each chain gets a different stream.
     HMC(int nPar, LikelihoodWithDerivs& like, std::string fileRoot, double tauMax, int nMax, time_t seed = 0);
     ~HMC();
 
@@ -28,9 +39,21 @@ public:
     /// \return The name of the parameter.
     const std::string& getParamName(int i) const { check(i >= 0 && i < n_, "invalid index " << i); return paramNames_[i]; }
 
-    void run(int iters = 100);
+    /// Run the sampler. With MPI all of the processes must call it.
+    /// \param iters The maximum chain length.
+    /// \param writeResumeInformationEvery Defines if resume information should be written in a file and how often (in iterations). 0 means no resume information. If resume information from a previous run is found, the run continues from there.
+    /// \param convergenceCriterion If positive and there are several chains (MPI), the chains stop when the absolute values of (R - 1) of the Gelman-Rubin diagnostic are below this number for all of the parameters. The diagnostic is calculated every 100 iterations from the samples after the burnin.
+    /// \param burnin The number of initial samples not used for the convergence diagnostic.
+    void run(int iters = 100, int writeResumeInformationEvery = 0, double convergenceCriterion = 0, int burnin = 0);
+
+    /// The Gelman-Rubin estimated potential scale reduction of a parameter, from the last convergence check (-1 if there has not been one).
+    double gelmanRubin(int i) const { check(i >= 0 && i < n_, "invalid index " << i); return rGelmanRubin_[i]; }
 
 private:
+    void openOut(bool append, long position);
+    bool checkConvergence(double convergenceCriterion);
+    void writeResumeInfo(int iteration, int accepted, int total);
+    bool readResumeInfo(int& iteration, int& accepted, int& total, long& position);
     void outputCurrent();
     void generateP();
     void calculateDerivs();
@@ -60,6 +83,15 @@ private:
     double currentLike_;
 
     std::ofstream outChain_;
+
+    int nChains_, chainI_;
+    std::string resumeFileName_;
+    const int resumeCode_;
+
+    // running means and sums of squared deviations of the samples after the burnin, for the convergence diagnostic
+    unsigned long statN_;
+    std::vector<double> statMean_, statM2_;
+    std::vector<double> rGelmanRubin_;
 };
 
 } // namespace Math
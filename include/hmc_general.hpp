@@ -7,6 +7,7 @@
 #include <macros.hpp>
 #include <cosmo_mpi.hpp>
 #include <random.hpp>
+#include <large_vector_ops.hpp>
 
 namespace Math
 {
@@ -33,6 +34,8 @@ public:
     void pow(double p);
     // swap
     void swap(LargeVector& other);
+
+    // OPTIONAL: linearCombination and addAndWeightedSquare, see large_vector_ops.hpp
 };
 */
 
@@ -61,6 +64,10 @@ public:
 };
 */
 
+/// A Hamiltonian Monte Carlo sampler for functions of possibly very large dimensions.
+
+/// All of the vectors are allocated in the constructor. The starting point and gradient of a trajectory are kept by swapping buffers instead of copying, so a rejection costs no copies and no extra gradient evaluation.
+/// The two half steps of the momentum between the leapfrog steps are done together, and the kinetic energy at the end is calculated in the same pass as the last momentum update if LargeVector has addAndWeightedSquare.
 template <typename LargeVector, typename LargeVectorFactory, typename Function>
 class HMCGeneral
 {
@@ -75,8 +82,7 @@ public:
     void stop() { stop_ = true; }
 
 private:
-    void generateP();
-    double calculatePLike() const;
+    double generateP();
 
 private:
     LargeVectorFactory *factory_;
@@ -87,8 +93,8 @@ private:
 
     std::unique_ptr<Math::UniformRealGenerator> uniformGen_;
 
-    std::unique_ptr<LargeVector> mass_, massSqrt_;
-    std::unique_ptr<LargeVector> x_, p_, d_, prev_, temp_;
+    std::unique_ptr<LargeVector> invMass_, massSqrt_;
+    std::unique_ptr<LargeVector> x_, p_, d_, prev_, dPrev_, temp_;
 
     bool stop_;
 
@@ -105,7 +111,8 @@ HMCGeneral<LargeVector, LargeVectorFactory, Function>::HMCGeneral(LargeVectorFac
     p_.reset(factory->giveMeOne());
     d_.reset(factory->giveMeOne());
     prev_.reset(factory->giveMeOne());
-    mass_.reset(factory->giveMeOne());
+    dPrev_.reset(factory->giveMeOne());
+    invMass_.reset(factory->giveMeOne());
     massSqrt_.reset(factory->giveMeOne());
     temp_.reset(factory->giveMeOne());
 
@@ -121,9 +128,10 @@ HMCGeneral<LargeVector, LargeVectorFactory, Function>::HMCGeneral(LargeVectorFac
     }
     mpi_.bcast(&gaussSeed_, 1, CosmoMPI::INT);
 
-    mass_->copy(masses);
+    invMass_->copy(masses);
+    invMass_->pow(-1);
     x_->copy(starting);
-    massSqrt_->copy(*mass_);
+    massSqrt_->copy(masses);
     massSqrt_->pow(0.5);
 }
 
@@ -148,6 +156,9 @@ void HMCGeneral<LargeVector, LargeVectorFactory, Function>::run(int maxIters, Ca
     int total = 0, accepted = 0;
     int gradEvals = 0;
 
+    f_->derivative(d_.get());
+    ++gradEvals;
+
     for(int iter = 0; iter < maxIters; ++iter)
     {
         // x_ should be the current point here, f_ is set to x_, and currentLike is the likelihood for x_
@@ -166,30 +177,37 @@ void HMCGeneral<LargeVector, LargeVectorFactory, Function>::run(int maxIters, Ca
         check(tau > 0 && tau <= tauMax_, "");
         check(n > 0 && n <= nMax_, "");
 
-        f_->derivative(d_.get());
-        ++gradEvals;
-
-        generateP();
-
-        prev_->copy(*x_);
-        const double oldPLike = calculatePLike();
+        // d_ is the derivative at x_ here
+        const double oldPLike = generateP();
 
+        // the first half step of the momentum, then the full steps between the leapfrog steps
+        p_->add(*d_, -tau / 2 / 2); // divide by 2 because the derivative is of -2ln(like)
+        double newPLike = 0;
         for(int j = 0; j < n; ++j)
         {
-            p_->add(*d_, -tau / 2 / 2); // divide by 2 because the derivative is of -2ln(like)
             temp_->copy(*p_);
-            temp_->divide(*mass_);
-            x_->add(*temp_, tau);
+            temp_->multiply(*invMass_);
+            if(j == 0)
+            {
+                // the starting point and its derivative are kept in prev_ and dPrev_ in case of rejection
+                linearCombination(prev_.get(), 1.0, *x_, tau, *temp_);
+                x_.swap(prev_);
+                d_.swap(dPrev_);
+            }
+            else
+                x_->add(*temp_, tau);
 
             f_->set(*x_);
             mpi_.barrier();
             f_->derivative(d_.get());
             ++gradEvals;
-            p_->add(*d_, -tau / 2 / 2); // divide by 2 because the derivative is of -2ln(like)
+            if(j < n - 1)
+                p_->add(*d_, -tau / 2);
+            else
+                newPLike = LargeVectorAddAndWeightedSquare<LargeVector>::calculate(p_.get(), *d_, -tau / 2 / 2, *invMass_, temp_.get());
         }
 
         const double newLike = f_->value();
-        const double newPLike = calculatePLike();
 
         int accept;
 
@@ -213,7 +231,8 @@ void HMCGeneral<LargeVector, LargeVectorFactory, Function>::run(int maxIters, Ca
         }
         else
         {
-            x_->swap(*prev_);
+            x_.swap(prev_);
+            d_.swap(dPrev_);
             f_->set(*x_);
         }
         CosmoMPI::create().barrier();
@@ -231,18 +250,13 @@ void HMCGeneral<LargeVector, LargeVectorFactory, Function>::run(int maxIters, Ca
 }
 
 template <typename LargeVector, typename LargeVectorFactory, typename Function>
-void HMCGeneral<LargeVector, LargeVectorFactory, Function>::generateP()
+double HMCGeneral<LargeVector, LargeVectorFactory, Function>::generateP()
 {
+    // the kinetic term p M^-1 p is the norm squared of the white noise
     f_->whitenoise(gaussSeed_++, p_.get(), 1.0);
+    const double pLike = p_->dotProduct(*p_);
     p_->multiply(*massSqrt_);
-}
-
-template <typename LargeVector, typename LargeVectorFactory, typename Function>
-double HMCGeneral<LargeVector, LargeVectorFactory, Function>::calculatePLike() const
-{
-    temp_->copy(*p_);
-    temp_->divide(*mass_);
-    return temp_->dotProduct(*p_);
+    return pLike;
 }
 
 } // namespace Math
@@ -0,0 +1,82 @@
+#ifndef COSMO_PP_IMPORTANCE_REWEIGHTING_HPP
+#define COSMO_PP_IMPORTANCE_REWEIGHTING_HPP
+
+#include <string>
+#include <vector>
+
+#include <markov_chain.hpp>
+#include <likelihood_function.hpp>
+
+/// Importance reweighting of an existing chain with an extra likelihood.
+
+/// The extra likelihood (for example a new data set) is calculated for each element of the chain and the weights are multiplied by it, so the chain becomes a sample of the posterior with the extra likelihood included, without running the sampler again.
+/// The likelihood is only calculated once for each unique point of the chain (rejected Metropolis-Hastings steps repeat the previous point).
+/// With MPI the unique points are distributed over the processes. Each process calculates its points in batches with calculateBatch, so likelihoods that evaluate several points at once on threads are used as such.
+/// After each batch the results are shared between the processes and, if a checkpoint file is given, appended to it by the master process. Running again with the same checkpoint file only calculates the points that are not in it yet.
+/// The reweighting is reliable only if the extra likelihood doesn't change the posterior too much, effectiveSampleSize tells how many independent samples are left.
+class ImportanceReweighting
+{
+public:
+    /// Constructor. Finds the unique points of the chain.
+    /// \param chain The chain to be reweighted. The same chain must be given to all of the MPI processes.
+    /// \param like The extra likelihood.
+    /// \param checkpointFileName The name of the checkpoint file. If not empty, the calculated likelihoods are saved into it and the ones already in it are not calculated again. The checkpoint is only valid for the same chain.
+    /// \param batchSize The number of points each process calculates between the checkpoints.
+    ImportanceReweighting(const MarkovChain& chain, Math::LikelihoodFunction& like, const std::string& checkpointFileName = "", int batchSize = 100);
+
+    /// Calculate the extra likelihood for all of the unique points of the chain. With MPI this is collective, ALL of the processes must call it.
+    void run();
+
+    /// The number of elements in the chain.
+    unsigned long size() const { return uniqueIndex_.size(); }
+
+    /// The number of unique points in the chain, i.e. the number of likelihood calculations.
+    unsigned long uniqueCount() const { return uniquePoints_.size(); }
+
+    /// The number of likelihood calculations done by this process in run (not counting the ones read from the checkpoint).
+    unsigned long calculatedCount() const { return calculated_; }
+
+    /// -2ln(extra likelihood) for a given chain element. Must be called after run.
+    /// \param i The index of the element.
+    double extraLike(unsigned long i) const { check(done_, "run has not been called"); check(i < size(), "invalid index " << i); return uniqueLikes_[uniqueIndex_[i]]; }
+
+    /// The new weight of a given chain element, normalized so that the largest likelihood ratio is 1. Must be called after run.
+    /// \param i The index of the element.
+    double weight(unsigned long i) const { check(done_, "run has not been called"); check(i < size(), "invalid index " << i); return weights_[i]; }
+
+    /// The effective number of independent samples (sum w)^2 / sum w^2 of the new weights. Must be called after run.
+    double effectiveSampleSize() const;
+
+    /// Write the reweighted chain, with the new weights and the total -2ln(likelihood) (the original plus the extra). Must be called after run. With MPI, only the master process writes.
+    /// \param fileName The name of the output file.
+    /// \param paramNames If not NULL, the chain is written in the binary format (see BinaryChain) with these parameter names, otherwise in the text format.
+    void writeChain(const char* fileName, const std::vector<std::string>* paramNames = NULL) const;
+
+private:
+    ImportanceReweighting(const ImportanceReweighting&);
+    ImportanceReweighting& operator = (const ImportanceReweighting&);
+
+    void findUnique();
+    void readCheckpoint();
+    void calculateWeights();
+
+private:
+    const MarkovChain& chain_;
+    Math::LikelihoodFunction& like_;
+    const std::string checkpointFileName_;
+    const int batchSize_;
+
+    // the chain index of the first occurrence of each unique point, and the unique point of each chain element
+    std::vector<unsigned long> uniquePoints_;
+    std::vector<unsigned long> uniqueIndex_;
+
+    std::vector<double> uniqueLikes_;
+    std::vector<char> uniqueDone_;
+    std::vector<double> weights_;
+
+    unsigned long calculated_;
+    bool done_;
+};
+
+#endif
+
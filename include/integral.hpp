@@ -2,9 +2,13 @@
 #define COSMO_PP_INTEGRAL_HPP
 
 #include <algorithm>
+#include <vector>
+#include <queue>
+#include <cmath>
 
 #include <function.hpp>
 #include <macros.hpp>
+#include <math_constants.hpp>
 
 /// @namespace Math
 /// Contains math related functions, classes, and constants.
@@ -35,25 +39,231 @@ double realIntegral1D(const RealFunction& f, double xMin, double xMax, int numbe
 	check(numberOfPoints > 1, "");
 	
 	const double delta = (xMax - xMin) / (numberOfPoints - 1);
-	double a = xMin, b = xMin + delta;
-	double f1 = f.evaluate(a), f2 = f.evaluate(b);
-	double r = (f1 + f2) / 2;
-	for(int i = 1; i < numberOfPoints - 2; ++i)
-	{
-		a = b;
-		b = a + delta;
-		f1 = f2;
-		f2 = f.evaluate(b);
-		r += (f1 + f2) / 2;
-	}
-	a = b;
-	b = xMax;
-	f1 = f2;
-	f2 = f.evaluate(b);
-	r += (f1 + f2) / 2;
+
+	// evaluate all of the points at once
+	std::vector<double> x(numberOfPoints), y(numberOfPoints);
+	for(int i = 0; i < numberOfPoints - 1; ++i)
+		x[i] = xMin + i * delta;
+	x[numberOfPoints - 1] = xMax;
+	f.evaluate(numberOfPoints, &(x[0]), &(y[0]));
+
+	double r = 0;
+	for(int i = 0; i < numberOfPoints - 1; ++i)
+		r += (y[i] + y[i + 1]) / 2;
 	
 	return r * delta * sign;
 }
+
+/// Adaptive one dimensional integral with Gauss-Kronrod quadrature.
+
+/// The interval is integrated with the 15 point Kronrod rule, and the difference from the 7 point Gauss rule embedded in it is the error estimate.
+/// Then the subinterval with the largest error estimate is bisected repeatedly until the total error estimate is small enough.
+/// This is much more efficient than realIntegral1D for smooth functions, and puts the points where they are needed for sharply peaked ones.
+/// The function is evaluated with the batch evaluate, all of the points of both halves of a bisected interval at once.
+/// \param f The function to integrate.
+/// \param xMin The lower limit of the interval.
+/// \param xMax The upper limit of the interval.
+/// \param relError The required relative error.
+/// \param absError The required absolute error. The integration stops when either the relative or the absolute error is reached.
+/// \param maxIntervals The maximum number of subintervals. If reached, the best estimate is returned and the error estimate will be larger than required.
+/// \param error If not NULL, the error estimate will be written here.
+/// \return The value of the integral.
+inline
+double realIntegralGaussKronrod(const RealFunction& f, double xMin, double xMax, double relError = 1e-10, double absError = 0, int maxIntervals = 1000, double* error = NULL)
+{
+	check(relError >= 0 && absError >= 0, "invalid required errors " << relError << " and " << absError);
+	check(maxIntervals >= 1, "invalid maximum number of intervals " << maxIntervals);
+
+	// the Kronrod nodes (the odd ones are the Gauss nodes) and weights for the positive half of [-1, 1], the last node is the center
+	static const double xk[8] = {0.991455371120812639206854697526329, 0.949107912342758524526189684047851, 0.864864423359769072789712788640926, 0.741531185599394439863864773280788, 0.586087235467691130294144845693013, 0.405845151377397166906606412076961, 0.207784955007898467600689403773245, 0.0};
+	static const double wk[8] = {0.022935322010529224963732008058970, 0.063092092629978553290700663189204, 0.104790010322250183839876322541518, 0.140653259715525918745189590510238, 0.169004726639267902826583426598550, 0.190350578064785409913256402421014, 0.204432940075298892414161999234649, 0.209482141084727828012999174891714};
+	static const double wg[4] = {0.129484966168869693270611432679082, 0.279705391489276667901467771423780, 0.381830050505118944950369775488975, 0.417959183673469387755102040816327};
+
+	struct Interval
+	{
+		double a, b, value, error;
+		bool operator < (const Interval& other) const { return error < other.error; }
+
+		// the 15 points of the interval
+		void points(double* x) const
+		{
+			const double center = (a + b) / 2, half = (b - a) / 2;
+			for(int i = 0; i < 7; ++i)
+			{
+				x[2 * i] = center - half * xk[i];
+				x[2 * i + 1] = center + half * xk[i];
+			}
+			x[14] = center;
+		}
+
+		// the values at the points given by points
+		void integrate(const double* y)
+		{
+			const double half = (b - a) / 2;
+			double kronrod = wk[7] * y[14], gauss = wg[3] * y[14];
+			for(int i = 0; i < 7; ++i)
+			{
+				const double s = y[2 * i] + y[2 * i + 1];
+				kronrod += wk[i] * s;
+				if(i % 2 == 1)
+					gauss += wg[i / 2] * s;
+			}
+			value = kronrod * half;
+			error = std::abs((kronrod - gauss) * half);
+		}
+	};
+
+	double x[30], y[30];
+
+	Interval whole;
+	whole.a = xMin;
+	whole.b = xMax;
+	whole.points(x);
+	f.evaluate(15, x, y);
+	whole.integrate(y);
+
+	std::priority_queue<Interval> intervals;
+	intervals.push(whole);
+	double total = whole.value, totalError = whole.error;
+
+	while(totalError > std::max(absError, relError * std::abs(total)) && intervals.size() < maxIntervals)
+	{
+		const Interval worst = intervals.top();
+		intervals.pop();
+
+		// stop if the interval cannot be split any more
+		const double middle = (worst.a + worst.b) / 2;
+		if(middle == worst.a || middle == worst.b)
+		{
+			intervals.push(worst);
+			break;
+		}
+
+		Interval left, right;
+		left.a = worst.a;
+		left.b = middle;
+		right.a = middle;
+		right.b = worst.b;
+
+		left.points(x);
+		right.points(x + 15);
+		f.evaluate(30, x, y);
+		left.integrate(y);
+		right.integrate(y + 15);
+
+		intervals.push(left);
+		intervals.push(right);
+		total += left.value + right.value - worst.value;
+		totalError += left.error + right.error - worst.error;
+	}
+
+	// sum again to get rid of the accumulated rounding errors
+	total = 0;
+	totalError = 0;
+	while(!intervals.empty())
+	{
+		total += intervals.top().value;
+		totalError += intervals.top().error;
+		intervals.pop();
+	}
+
+	if(error)
+		*error = totalError;
+
+	return total;
+}
+
+/// Adaptive one dimensional integral with tanh-sinh (double exponential) quadrature.
+
+/// The variable is changed to x = (xMin + xMax) / 2 + (xMax - xMin) / 2 * tanh(pi / 2 * sinh(t)), and the integral over t is calculated with the trapezoid rule, halving the step until the result changes less than the required error.
+/// The integrand in t decays double exponentially, which makes this very efficient for functions that are analytic inside of the interval, even if they have (integrable) singularities at the ends. The function is never evaluated at the ends of the interval.
+/// Each time the step is halved the function is evaluated at all of the new points at once, with the batch evaluate.
+/// \param f The function to integrate.
+/// \param xMin The lower limit of the interval.
+/// \param xMax The upper limit of the interval.
+/// \param relError The required relative error.
+/// \param absError The required absolute error. The integration stops when either the relative or the absolute error is reached.
+/// \param maxLevels The maximum number of times the step is halved (the number of function evaluations is about 8 * 2^maxLevels). If reached, the best estimate is returned and the error estimate will be larger than required.
+/// \param error If not NULL, the error estimate will be written here.
+/// \return The value of the integral.
+inline
+double realIntegralTanhSinh(const RealFunction& f, double xMin, double xMax, double relError = 1e-10, double absError = 0, int maxLevels = 10, double* error = NULL)
+{
+	check(relError >= 0 && absError >= 0, "invalid required errors " << relError << " and " << absError);
+	check(maxLevels >= 2, "invalid maximum number of levels " << maxLevels);
+
+	// beyond this the weights are below 1e-35
+	const double tMax = 4;
+
+	const double center = (xMin + xMax) / 2, half = (xMax - xMin) / 2;
+
+	std::vector<double> x, y, w;
+
+	// the sum of the function values times the weights for all of the points so far, the integral is this times the step
+	double sum = 0;
+	double previous = 0, result = 0, err = 0;
+	for(int level = 0; level <= maxLevels; ++level)
+	{
+		const double h = std::ldexp(1.0, -level);
+
+		// all of the points at level 0, only the new ones (odd multiples of h) after that
+		const int step = (level == 0 ? 1 : 2);
+		const int first = (level == 0 ? 0 : 1);
+		const int kMax = int(tMax / h);
+
+		x.clear();
+		w.clear();
+		for(int k = first; k <= kMax; k += step)
+		{
+			const double t = k * h;
+			const double u = pi / 2 * std::sinh(t);
+			const double c = std::cosh(u);
+
+			// the distance from the ends, calculated without cancellation
+			const double complement = half / (std::exp(u) * c);
+			const double weight = half * pi / 2 * std::cosh(t) / (c * c);
+			if(k == 0)
+			{
+				x.push_back(center);
+				w.push_back(weight);
+				continue;
+			}
+
+			const double xLeft = xMin + complement, xRight = xMax - complement;
+			if(xLeft != xMin && xLeft != xMax)
+			{
+				x.push_back(xLeft);
+				w.push_back(weight);
+			}
+			if(xRight != xMax && xRight != xMin)
+			{
+				x.push_back(xRight);
+				w.push_back(weight);
+			}
+		}
+
+		y.resize(x.size());
+		if(!x.empty())
+			f.evaluate(x.size(), &(x[0]), &(y[0]));
+		for(unsigned long i = 0; i < x.size(); ++i)
+			sum += w[i] * y[i];
+
+		previous = result;
+		result = sum * h;
+
+		if(level > 0)
+		{
+			err = std::abs(result - previous);
+			if(level >= 2 && err <= std::max(absError, relError * std::abs(result)))
+				break;
+		}
+	}
+
+	if(error)
+		*error = err;
+
+	return result;
+}
 	
 } //namespace Math
 
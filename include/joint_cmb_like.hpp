@@ -0,0 +1,80 @@
+#ifndef COSMO_PP_JOINT_CMB_LIKE_HPP
+#define COSMO_PP_JOINT_CMB_LIKE_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <likelihood_function.hpp>
+#include <cmb.hpp>
+#include <planck_like.hpp>
+#include <wmap9_like.hpp>
+
+/// A joint Planck and WMAP9 likelihood, with the Cl-s calculated once for both.
+
+/// The component likelihoods should be constructed with useOwnCmb set to false. This class owns one CMB instance, calculates the Cl-s up to the larger of the two l_max values (with the polarization if any of the components needs it), and passes them to the components through setCls. This way CLASS is called once per point instead of once per component.
+/// The components can also be evaluated concurrently (see setConcurrentComponents).
+class JointCMBLikelihood : public Math::LikelihoodFunction
+{
+public:
+    /// Constructor.
+    /// \param planck The Planck likelihood, NULL if not used. Not owned by this class.
+    /// \param wmap The WMAP9 likelihood, NULL if not used. Not owned by this class.
+    /// \param includeTensors Defines if tensor modes should be taken into account during calculations (false by default).
+    /// \param kPerDecade The number of points per decade in the k space for the primordial power spectrum calculation.
+    JointCMBLikelihood(PlanckLikelihood* planck, WMAP9Likelihood* wmap, bool includeTensors = false, double kPerDecade = 100);
+
+    /// Set cosmological parameters, calculates the Cl-s and passes them to the components.
+    /// \param params The cosmological parameters.
+    void setCosmoParams(const CosmologicalParams& params);
+
+    /// Calculate the sum of the component likelihoods. Must be called after setCosmoParams. The nuisance parameters of Planck must be set in the Planck likelihood.
+    /// \return -2ln(likelihood).
+    double likelihood();
+
+    /// Use this parameters to set the model for the calculate function, as for PlanckLikelihood::setModelCosmoParams.
+    /// \param params A pointer to the model parameters. Note that when calculate is called params will be changed to set the new parameters.
+    void setModelCosmoParams(CosmologicalParams *params) { modelParams_ = params; modelParams_->getAllParameters(vModel_); haveModel_ = false; }
+
+    /// Calculate the likelihood taking all of the params as an input. This is for the general LikelihoodFunction interface. Can only be called if the model parameters are set by setModelCosmoParams.
+    /// \param params A vector of the parameters, the cosmological parameters followed by the nuisance parameters of Planck (see PlanckLikelihood::calculate).
+    /// \param nPar The number of the parameters, used only for checking.
+    /// \return -2ln(likelihood).
+    double calculate(double* params, int nPar);
+
+    /// Evaluate the Planck and the WMAP9 likelihoods concurrently in likelihood(), each on its own thread (OpenMP). Off by default.
+    /// \param concurrent Turns the concurrent evaluation on or off.
+    void setConcurrentComponents(bool concurrent = true) { concurrent_ = concurrent; }
+
+    /// The Planck likelihood from the last likelihood() call.
+    /// \return -2ln(likelihood).
+    double planckLike() const { check(planck_, "Planck not used"); return planckLike_; }
+
+    /// The WMAP9 likelihood from the last likelihood() call.
+    /// \return -2ln(likelihood).
+    double wmapLike() const { check(wmap_, "WMAP9 not used"); return wmapLike_; }
+
+    /// Get the l_max value used for the Cl-s.
+    int getLMax() const { return lMax_; }
+
+private:
+    PlanckLikelihood* planck_;
+    WMAP9Likelihood* wmap_;
+    CMB cmb_;
+    int lMax_;
+    bool wantPol_;
+
+    std::vector<double> clTT_, clEE_, clTE_, clBB_, clPP_;
+    std::vector<double> prevCosmoParams_, currentCosmoParams_;
+    bool haveCls_;
+
+    double planckLike_, wmapLike_;
+    bool concurrent_;
+
+    CosmologicalParams* modelParams_;
+    std::vector<double> vModel_;
+    bool haveModel_, modelSuccess_;
+    double modelBadLike_;
+};
+
+#endif
+
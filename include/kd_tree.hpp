@@ -2,10 +2,17 @@
 #define COSMO_PP_KD_TREE_HPP
 
 #include <vector>
-#include <queue>
 #include <utility>
+#include <fstream>
+
+#include <macros.hpp>
+#include <memory_tracker.hpp>
+#include <mapped_file.hpp>
 
 /// A k-d tree class.
+
+/// The points are kept in one contiguous row-major buffer, in the order of the tree nodes. The nodes are stored in an array in depth-first order, so that the left child of a node immediately follows it.
+/// A built tree can be saved into a binary file and later memory-mapped read-only, so that it doesn't need to be rebuilt. The mapped pages are shared between all of the processes mapping the same file. A mapped tree is copied into memory the first time it is modified.
 class KDTree
 {
 public:
@@ -14,26 +21,69 @@ public:
     /// \param points The points to build the tree on.
     KDTree(int dim, const std::vector<std::vector<double> >& points);
 
+    /// Constructor. Memory-maps a tree saved with writeIntoFile, nothing is rebuilt. Throws an exception if the file cannot be opened or is not a valid tree file.
+    /// \param fileName The name of the file.
+    /// \param offset The position in the file where the tree starts (in bytes).
+    KDTree(const char* fileName, long offset = 0);
+
     /// Destructor.
     ~KDTree();
 
+    /// Save the tree (the nodes, the permutation, and the points) into a binary file.
+    /// \param fileName The name of the file.
+    void writeIntoFile(const char* fileName) const;
+
+    /// Save the tree into a binary stream, starting at its current position. The tree data is aligned to 8 bytes from the beginning of the stream, so that it can be memory-mapped when the stream is written into a file from the beginning.
+    /// \param out The output stream, must be opened in binary mode.
+    void writeIntoFile(std::ostream& out) const;
+
+    /// Allow concurrent searches and modifications. When this is turned on, the searches share a read-write lock (any number of searches can run at the same time) and the modifications (insert, reBalance, reset, and the setters) take it exclusively, so they wait for the ongoing searches and block the new ones only while the tree is being modified.
+    /// The pointers returned by point() can be invalidated by a concurrent insertion, the search functions returning the neighbors themselves should be used instead. This function itself must not be called concurrently with anything else.
+    /// \param concurrent Turn the concurrent mode on or off. It is off by default, in which case there is no locking overhead.
+    void setConcurrentAccess(bool concurrent);
+
+    /// Check if concurrent access is turned on.
+    bool concurrentAccess() const { return lock_ != NULL; }
+
+    /// Check if the tree is memory-mapped from a file.
+    bool isMapped() const { return file_.data() != NULL; }
+
     /// Reset the set of points and rebuild the tree.
     void reset(const std::vector<std::vector<double> >& points);
 
     /// Rebalance the tree. The set of points doesn't change.
     void reBalance();
 
-    /// Insert a new point into the tree. The tree is not re-balanced, the element is simply inserted into the appropriate location of the tree.
+    /// Insert a new point into the tree. The element is inserted into the appropriate location of the tree, then if some subtree on its path has become unbalanced (see setBalanceFactor) the highest such subtree is rebuilt.
+    /// This keeps the depth logarithmic with an amortized logarithmic cost per insertion, without rebuilding the whole tree.
     /// \param point The point to insert.
     void insert(const std::vector<double>& point);
 
-    /// Get the depth of the tree.
+    /// Set the balance factor for the partial rebuilding of the tree during insertions. A subtree is rebuilt if one of its sides contains more than alpha times the elements of the subtree.
+    /// \param alpha The balance factor, between 0.5 and 1. Smaller values keep the tree more balanced at a higher insertion cost. 1 disables the rebuilding. The default value is 0.75.
+    void setBalanceFactor(double alpha);
+
+    /// Get the depth of the tree. After insertions this is an upper bound on the depth, the exact depth is restored by reBalance.
     /// \return The depth.
     int depth() const { return depth_; }
 
+    /// The memory needed for a tree (not memory-mapped), without building it. Insertions can take up to twice as much, since the arrays grow geometrically.
+    /// \param dim The dimensionality of the space.
+    /// \param nPoints The number of points.
+    /// \return The number of bytes.
+    static unsigned long memoryEstimate(int dim, unsigned long nPoints) { return nPoints * (sizeof(Node) + dim * sizeof(double) + 2 * sizeof(unsigned long)); }
+
     /// Get the number of elements in the tree.
     /// \return The number of elements.
-    unsigned long nElements() const { return elements_.size(); }
+    unsigned long nElements() const { return n_; }
+
+    /// Get the dimensionality of the space.
+    int dim() const { return dim_; }
+
+    /// Get a point in the tree.
+    /// \param index The index of the point, as in the original vector in the constructor (or following it for the inserted points).
+    /// \return A pointer to the first coordinate of the point.
+    const double* point(unsigned long index) const { check(index < n_, "invalid index " << index); return pointData_ + nodeOfData_[index] * dim_; }
 
     /// Find k nearest neighbors of a given point in the tree.
     /// \param point The point to search around.
@@ -49,14 +99,40 @@ public:
     /// \param distanceSquares A pointer to a vector where the squared distances to the nearest neighbors will be returned. Can be set to NULL (default option) in which case this will be ignored.
     void findNearestNeighbors(const std::vector<double> &point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL) const;
 
+    /// Find all of the points within a given distance of a given point.
+    /// \param point The point to search around.
+    /// \param radius The distance.
+    /// \param indices A pointer to a vector where the indices of the points found will be returned, sorted by increasing distance.
+    /// \param distanceSquares A pointer to a vector where the squared distances to the points found will be returned. Can be set to NULL (default option) in which case this will be ignored.
+    void findWithinRadius(const std::vector<double>& point, double radius, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL) const;
+
+    /// Check if there is a point within a given distance of a given point. The search stops as soon as such a point is found.
+    /// \param point The point to search around.
+    /// \param radius The distance.
+    /// \param index If not NULL, the index of a point found within the distance will be returned here.
+    /// \return true if there is a point within the distance (inclusive).
+    bool hasPointWithin(const std::vector<double>& point, double radius, unsigned long *index = NULL) const;
+
+    /// Switch to approximate nearest neighbor searches, or back to exact ones. This affects all of the subsequent searches.
+    /// \param epsilon The relative error allowed in the distances. A branch of the tree is skipped if it cannot contain points closer than the current k-th nearest neighbor divided by (1 + epsilon), so each returned neighbor is at most (1 + epsilon) times farther than the true neighbor with the same rank. Set to 0 for exact searches.
+    /// \param maxVisits The maximum number of nodes to visit in one search (once k neighbors have been found). Set to 0 (default) for no limit.
+    void setApproximation(double epsilon, unsigned long maxVisits = 0);
+
+    /// Find k nearest neighbors for many points at once. The queries are performed in parallel if OpenMP is enabled.
+    /// \param points The query points, stored one after the other (nPoints * dim values, passed as a pointer to the first element).
+    /// \param nPoints The number of query points.
+    /// \param k The number of nearest neighbors to return for each point.
+    /// \param indices A buffer of size nPoints * k where the indices of the nearest neighbors will be returned. The neighbors of point i are at positions i * k to (i + 1) * k - 1, from the closest to the farthest.
+    /// \param distanceSquares A buffer of size nPoints * k where the squared distances to the nearest neighbors will be returned, in the same layout as indices. Can be set to NULL (default option) in which case this will be ignored.
+    void findNearestNeighbors(const double* points, unsigned long nPoints, int k, unsigned long* indices, double* distanceSquares = NULL) const;
+
 private:
     struct Node
     {
-        unsigned long index;
+        unsigned long left;
+        unsigned long right;
+        unsigned long size;
         int depth;
-        Node *parent;
-        Node *left;
-        Node *right;
     };
 
     struct ComparePair
@@ -67,19 +143,65 @@ private:
         }
     };
 
+    // a bounded max-heap of (distance squared, node) pairs
+    typedef std::vector<std::pair<double, unsigned long> > BoundedQueue;
+
 private:
-    Node* construct(std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, Node *parent);
-    void destruct(Node *root);
+    KDTree(const KDTree&);
+    KDTree& operator=(const KDTree&);
+
+    // point the read-only views to the owned arrays, unmapping the file if needed
+    void attach();
+    // copy a mapped tree into the owned arrays before modifying it
+    void detach();
 
-    void search(const Node *current, std::priority_queue<std::pair<double, unsigned long>, std::vector<std::pair<double, unsigned long> >, ComparePair>& bpq, int k, const std::vector<double>& point) const;
+    void build(const std::vector<double>& points);
+    unsigned long construct(const std::vector<double>& points, std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, const std::vector<unsigned long>& slots, unsigned long& nextSlot);
+    unsigned long rebuild(unsigned long root);
+
+    void knn(const double* point, int k, BoundedQueue& bpq) const;
+    void searchRadius(unsigned long current, const double* point, double radiusSq, std::vector<std::pair<double, unsigned long> >& found) const;
+    unsigned long searchAny(unsigned long current, const double* point, double radiusSq) const;
+    // D is the dimension fixed at compile time for the common cases, 0 means that dim_ is used
+    template<int D>
+    void search(unsigned long current, BoundedQueue& bpq, int k, const double* point, unsigned long& visits) const;
 
 private:
+    static const unsigned long noNode = (unsigned long)(-1);
+
+    // small subtrees are not checked for balance
+    static const unsigned long minRebuildSize = 16;
+
     int dim_;
-    std::vector<std::vector<double> > elements_;
+
+    // the coordinates of the points, in the order of the nodes
+    std::vector<double> points_;
+
+    std::vector<Node> nodes_;
+
+    // the original index of the point at each node, and the node of each original index
+    std::vector<unsigned long> perm_, nodeOf_;
+
+    // read-only views used by the searches, pointing either to the arrays above or into the mapped file
+    unsigned long n_;
+    const Node* nodeData_;
+    const double* pointData_;
+    const unsigned long* permData_;
+    const unsigned long* nodeOfData_;
+
+    Math::MappedFile file_;
+
+    // a pthread_rwlock_t, allocated only in the concurrent access mode
+    void* lock_;
 
     int depth_;
 
-    Node *root_;
+    double epsilon_, pruneFactor_;
+    unsigned long maxVisits_;
+
+    double alpha_;
+
+    MemoryTracker::Allocation memory_;
 };
 
 #endif
@@ -0,0 +1,153 @@
+#ifndef COSMO_PP_LARGE_VECTOR_OPS_HPP
+#define COSMO_PP_LARGE_VECTOR_OPS_HPP
+
+#include <utility>
+
+#include <macros.hpp>
+
+namespace Math
+{
+
+/*
+Optional functions of LargeVector (see LBFGS_General, CG_General), used when available:
+
+class LargeVector
+{
+public:
+    // dot products with n other vectors, res[i] = this . others[i], in one pass and one reduction (for MPI, ALL the processes should get the results)
+    void dotProducts(int n, const LargeVector* const* others, double* res) const;
+    // set to the linear combination c[0] v[0] + ... + c[n-1] v[n-1] in one pass (for MPI, the correct coefficients should be passed for EVERY process)
+    // this can be one of the v[i]
+    void linearCombination(int n, const double* c, const LargeVector* const* v);
+    // add another vector with a given coefficient, then return the sum of w_i x_i^2 over the elements of the result, in one pass and one reduction (for MPI, ALL the processes should get the result)
+    double addAndWeightedSquare(const LargeVector& other, double c, const LargeVector& w);
+};
+*/
+
+/// Detects the optional dotProducts function of LargeVector.
+template<typename LargeVector>
+class HasDotProducts
+{
+private:
+    template<typename V>
+    static char test(decltype(std::declval<const V&>().dotProducts(0, (const V* const*)(0), (double*)(0)))*);
+
+    template<typename V>
+    static long test(...);
+
+public:
+    static const bool value = (sizeof(test<LargeVector>(0)) == 1);
+};
+
+/// Detects the optional linearCombination function of LargeVector.
+template<typename LargeVector>
+class HasLinearCombination
+{
+private:
+    template<typename V>
+    static char test(decltype(std::declval<V&>().linearCombination(0, (const double*)(0), (const V* const*)(0)))*);
+
+    template<typename V>
+    static long test(...);
+
+public:
+    static const bool value = (sizeof(test<LargeVector>(0)) == 1);
+};
+
+/// Detects the optional addAndWeightedSquare function of LargeVector.
+template<typename LargeVector>
+class HasAddAndWeightedSquare
+{
+private:
+    template<typename V>
+    static char test(decltype(std::declval<V&>().addAndWeightedSquare(std::declval<const V&>(), 0.0, std::declval<const V&>()))*);
+
+    template<typename V>
+    static long test(...);
+
+public:
+    static const bool value = (sizeof(test<LargeVector>(0)) == 1);
+};
+
+/// Calculates several dot products with dotProducts of LargeVector if available, otherwise one by one.
+template<typename LargeVector, bool Fused = HasDotProducts<LargeVector>::value>
+struct LargeVectorDotProducts
+{
+    static void calculate(const LargeVector& x, int n, const LargeVector* const* others, double* res)
+    {
+        for(int i = 0; i < n; ++i)
+            res[i] = x.dotProduct(*(others[i]));
+    }
+};
+
+template<typename LargeVector>
+struct LargeVectorDotProducts<LargeVector, true>
+{
+    static void calculate(const LargeVector& x, int n, const LargeVector* const* others, double* res)
+    {
+        x.dotProducts(n, others, res);
+    }
+};
+
+/// Calculates a linear combination with linearCombination of LargeVector if available, otherwise with copy and add (one pass for each term).
+template<typename LargeVector, bool Fused = HasLinearCombination<LargeVector>::value>
+struct LargeVectorLinearCombination
+{
+    static void calculate(LargeVector* x, int n, const double* c, const LargeVector* const* v)
+    {
+        check(n > 0, "");
+        for(int i = 1; i < n; ++i)
+        {
+            check(v[i] != x, "only the first term can be the result itself");
+        }
+
+        x->copy(*(v[0]), c[0]);
+        for(int i = 1; i < n; ++i)
+            x->add(*(v[i]), c[i]);
+    }
+};
+
+template<typename LargeVector>
+struct LargeVectorLinearCombination<LargeVector, true>
+{
+    static void calculate(LargeVector* x, int n, const double* c, const LargeVector* const* v)
+    {
+        x->linearCombination(n, c, v);
+    }
+};
+
+/// Adds c other to x and returns the sum of w_i x_i^2, with addAndWeightedSquare of LargeVector if available, otherwise in three passes using temp.
+template<typename LargeVector, bool Fused = HasAddAndWeightedSquare<LargeVector>::value>
+struct LargeVectorAddAndWeightedSquare
+{
+    static double calculate(LargeVector* x, const LargeVector& other, double c, const LargeVector& w, LargeVector* temp)
+    {
+        x->add(other, c);
+        temp->copy(*x);
+        temp->multiply(w);
+        return temp->dotProduct(*x);
+    }
+};
+
+template<typename LargeVector>
+struct LargeVectorAddAndWeightedSquare<LargeVector, true>
+{
+    static double calculate(LargeVector* x, const LargeVector& other, double c, const LargeVector& w, LargeVector* temp)
+    {
+        return x->addAndWeightedSquare(other, c, w);
+    }
+};
+
+/// x = a u + b v, in one pass if LargeVector has linearCombination. x can be u, but not v.
+template<typename LargeVector>
+inline void linearCombination(LargeVector* x, double a, const LargeVector& u, double b, const LargeVector& v)
+{
+    const double c[2] = {a, b};
+    const LargeVector* terms[2] = {&u, &v};
+    LargeVectorLinearCombination<LargeVector>::calculate(x, 2, c, terms);
+}
+
+} // namespace Math
+
+#endif
+
@@ -48,6 +48,12 @@ public:
     double norm() const;
     // dot product with another vector (for MPI, the master process should get the total norm)
     double dotProduct(const BasicLargeVector& other) const;
+    // dot products with n other vectors in one pass and one reduction (for MPI, ALL the processes get the results)
+    void dotProducts(int n, const BasicLargeVector* const* others, double* res) const;
+    // set to the linear combination c[0] v[0] + ... + c[n-1] v[n-1] in one pass
+    void linearCombination(int n, const double* c, const BasicLargeVector* const* v);
+    // add another vector with a given coefficient, then return the sum of w_i x_i^2 in one pass (for MPI, ALL the processes get the result)
+    double addAndWeightedSquare(const BasicLargeVector& other, double c, const BasicLargeVector& w);
     // add another vector with a given coefficient (for MPI, the correct coefficient should be passed for EVERY process)
     void add(const BasicLargeVector& other, double c = 1.);
     // multiply with another vector TERM BY TERM
@@ -64,6 +70,10 @@ public:
     
 private:
     std::vector<double> v_;
+
+    // scratch space for dotProducts and linearCombination
+    mutable std::vector<const double*> terms_;
+    mutable std::vector<double> sums_;
 };
 
 class BasicLargeVectorFactory
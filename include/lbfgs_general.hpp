@@ -3,9 +3,12 @@
 
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <cmath>
 
 #include <macros.hpp>
 #include <line_search.hpp>
+#include <large_vector_ops.hpp>
 #include <cosmo_mpi.hpp>
 
 namespace Math
@@ -27,6 +30,8 @@ public:
     void add(const LargeVector& other, double c = 1.);
     // swap
     void swap(LargeVector& other);
+
+    // OPTIONAL: dotProducts and linearCombination, see large_vector_ops.hpp
 };
 */
 
@@ -49,12 +54,19 @@ public:
     // for MPI, ALL the processes should get the function value
     double value();
     void derivative(LargeVector *res);
+
+    // OPTIONAL: valueAndDerivative, see line_search.hpp
 };
 */
 
 /// A general L-BFGS optimizer.
 
 /// This class can be used to optimize functions (including nonlinear) of possibly very large dimensions using the L-BFGS method.
+/// If LargeVector has the optional dotProducts function, the two-loop recursion is done on the Gram matrix of the stored pairs and the gradient (as in vector-free L-BFGS).
+/// The Gram matrix is updated with three calls of dotProducts per iteration (the new gradient, s and y), and the direction is then calculated without any dot products of the large vectors.
+/// This replaces the 2m + 5 separate dot products (each one a global reduction for MPI) of each iteration with 3, which matters when the reductions dominate, as for very large distributed vectors.
+/// All of the vectors are allocated in the constructor. The stored pairs are kept in a ring buffer and the previous point and gradient swap buffers with the current ones, so no vectors are allocated or copied around between the iterations.
+/// If LargeVector also has the optional linearCombination function, the new pairs, the backtracking line search points and the direction of the fused recursion are each calculated in one pass.
 template <typename LargeVector, typename LargeVectorFactory, typename Function>
 class LBFGS_General
 {
@@ -90,7 +102,7 @@ public:
     double minimize(LargeVector *res, double epsilon = 1e-3, double gNormTol = 1e-5, int maxIter = 1000000)
     {
         DummyCallBack* cb = NULL; // this is a hack
-        minimize(res, epsilon, gNormTol, maxIter, cb);
+        return minimize(res, epsilon, gNormTol, maxIter, cb);
     }
 
     /// Function for minimization (the main function of this class) WITH callback.
@@ -113,12 +125,27 @@ public:
 
     void applyInverseHessian(LargeVector *x);
 
+private:
+    void direction(int m, double* zNorm, double* zg);
+    void directionFused(int m, double* zNorm, double* zg);
+    // the stored pairs are in a ring buffer, i = 0 is the newest one
+    int slot(int i) const { return (head_ + i) % m_; }
+    LargeVector& pairS(int i) { return *(s_[slot(i)]); }
+    LargeVector& pairY(int i) { return *(y_[slot(i)]); }
+    double& pairRho(int i) { return rho_[slot(i)]; }
+
+    // the Gram matrix is indexed by the slots, so it does not move when a new pair is added
+    int gramIndex(bool y, int i) const { return (y ? m_ : 0) + slot(i); }
+    double& gram(int i, int j) { return gram_[i * (2 * m_ + 1) + j]; }
+    void updateGram(const LargeVector& v, int index, int m);
+
 private:
     Function *f_;
     std::unique_ptr<LargeVector> x_, xPrev_;
     int m_;
     std::vector<std::unique_ptr<LargeVector> > s_, y_;
     std::vector<double> rho_, alpha_;
+    int head_;
     double val_;
     std::unique_ptr<LargeVector> g_, gPrev_;
     std::unique_ptr<LargeVector> q_;
@@ -137,12 +164,25 @@ private:
     double rate_;
 
     const bool moreThuente_;
+
+    // the Gram matrix of s_0, ..., s_(m-1), y_0, ..., y_(m-1), g for the fused two-loop recursion, and the coefficients of the direction in that basis
+    static const bool fused_ = HasDotProducts<LargeVector>::value;
+    std::vector<double> gram_, delta_;
+    std::vector<const LargeVector*> basis_;
+    std::vector<double> dots_;
+    std::vector<int> used_;
 };
 
 template<typename LargeVector, typename LargeVectorFactory, typename Function>
 LBFGS_General<LargeVector, LargeVectorFactory, Function>::LBFGS_General(LargeVectorFactory* factory, Function *f, const LargeVector &starting, int m, bool moreThuenteLineSearch): f_(f), m_(m), s_(m), y_(m), rho_(m), alpha_(m), moreThuente_(moreThuenteLineSearch), mpi_(CosmoMPI::create()), rate_(1.0)
 {
     check(m_ > 0, "");
+
+    if(fused_)
+    {
+        gram_.resize((2 * m_ + 1) * (2 * m_ + 1));
+        delta_.resize(2 * m_ + 1);
+    }
     
     // allocate the memory
     x_.reset(factory->giveMeOne());
@@ -167,6 +207,7 @@ void
 LBFGS_General<LargeVector, LargeVectorFactory, Function>::setStarting(const LargeVector& starting)
 {
     x_->copy(starting);
+    head_ = 0;
 
     check(s_.size() == m_, "");
     check(y_.size() == m_, "");
@@ -174,19 +215,22 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::setStarting(const Larg
     check(alpha_.size() == m_, "");
     for(int i = 0; i < m_; ++i)
     {
-        s_[i]->setToZero();
-        y_[i]->setToZero();
-        rho_[i] = 0;
+        pairS(i).setToZero();
+        pairY(i).setToZero();
+        pairRho(i) = 0;
         alpha_[i] = 0;
     }
 
     f_->set(*x_);
-    val_ = f_->value();
-    f_->derivative(g_.get());
+    val_ = FunctionValueAndDerivative<Function, LargeVector>::calculate(f_, g_.get());
     gradNorm_ = g_->norm();
 
-    xPrev_->copy(*x_);
-    gPrev_->copy(*g_);
+    if(fused_)
+    {
+        std::fill(gram_.begin(), gram_.end(), 0.0);
+        gram(2 * m_, 2 * m_) = gradNorm_ * gradNorm_;
+    }
+
     H0k_ = 1;
 
     iter_ = 0;
@@ -217,27 +261,16 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *
 
     while(true)
     {
-        q_->copy(*g_);
-
         const int m = std::min(m_, iter_); // use this many previous things
-        for(int i = 0; i < m; ++i)
-        {
-            const double dotProduct = s_[i]->dotProduct(*q_);
-            alpha_[i] = rho_[i] * dotProduct;
-            q_->add(*(y_[i]), -alpha_[i]);
-        }
         H0kSaved_.push_back(H0k_);
-        z_->copy(*q_, H0k_);
-        for(int i = m - 1; i >= 0; --i)
-        {
-            const double dotProduct = y_[i]->dotProduct(*z_);
-            double beta = rho_[i] * dotProduct;
-            z_->add(*(s_[i]), alpha_[i] - beta);
-        }
+        double zNorm, zg;
+        if(fused_)
+            directionFused(m, &zNorm, &zg);
+        else
+            direction(m, &zNorm, &zg);
+        zg /= zNorm;
 
         bool usingCG = false;
-        const double zNorm = z_->norm();
-        double zg = z_->dotProduct(*g_) / zNorm;
         if(zg / gradNorm_ < 0.01)
         {
             if(mpi_.isMaster())
@@ -253,6 +286,10 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *
 
         const double oldVal = val_;
 
+        // the current point and gradient become the previous ones, the buffers of the previous ones get the new point and gradient
+        x_.swap(xPrev_);
+        g_.swap(gPrev_);
+
         if(iter_ <= 10 || usingCG)
             rate_ = 1.0 / gradNorm_;
         else
@@ -269,21 +306,20 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *
             int nfev = 0;
             
             ss_->copy(*z_, -1.0);
-            searchX_->copy(*x_);
-            q_->copy(*g_);
 
-
-            const int info = moreThuenteSearch(f_, *searchX_, val_, *q_, *ss_, rate_, ftol, gtol, xtol, stpmin, stpmax, maxfev, x_.get(), g_.get(), nfev);
+            const int info = moreThuenteSearch(f_, *xPrev_, val_, *gPrev_, *ss_, rate_, ftol, gtol, xtol, stpmin, stpmax, maxfev, x_.get(), g_.get(), nfev);
             check(info != 0, "info needs to be nonzero but it is " << info << ", step = " << rate_ << " iteration: " << iter_);
 
             functionEval += nfev;
-            gradNorm_ = g_->norm();
+            if(fused_)
+                updateGram(*g_, 2 * m_, m);
+            else
+                gradNorm_ = g_->norm();
         }
         else
         {
             const double tau = 0.5, c = 1e-5;
-            searchX_->copy(*x_);
-            searchX_->add(*z_, -rate_);
+            linearCombination(searchX_.get(), 1.0, *xPrev_, -rate_, *z_);
             f_->set(*searchX_);
             double newVal = f_->value();
             ++functionEval;
@@ -297,18 +333,20 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *
                     break;
 
                 rate_ *= tau;
-                searchX_->copy(*x_);
-                searchX_->add(*z_, -rate_);
+                linearCombination(searchX_.get(), 1.0, *xPrev_, -rate_, *z_);
                 f_->set(*searchX_);
                 newVal = f_->value();
                 ++functionEval;
             }
 
             // now move
-            x_->copy(*searchX_);
+            x_.swap(searchX_);
             val_ = newVal;
             f_->derivative(g_.get());
-            gradNorm_ = g_->norm();
+            if(fused_)
+                updateGram(*g_, 2 * m_, m);
+            else
+                gradNorm_ = g_->norm();
         }
 
         ++iter_;
@@ -344,22 +382,25 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *
             break;
         }
 
-        // move everything down
-        for(int i = m_ - 1; i > 0; --i)
+        // the new pair replaces the oldest one
+        head_ = (head_ + m_ - 1) % m_;
+        linearCombination(&pairS(0), 1.0, *x_, -1.0, *xPrev_);
+        linearCombination(&pairY(0), 1.0, *g_, -1.0, *gPrev_);
+        double ys, yy;
+        if(fused_)
         {
-            s_[i]->swap(*(s_[i - 1]));
-            y_[i]->swap(*(y_[i - 1]));
-            rho_[i] = rho_[i - 1];
+            const int mNew = std::min(m_, iter_);
+            updateGram(pairS(0), gramIndex(false, 0), mNew);
+            updateGram(pairY(0), gramIndex(true, 0), mNew);
+            ys = gram(gramIndex(false, 0), gramIndex(true, 0));
+            yy = gram(gramIndex(true, 0), gramIndex(true, 0));
+        }
+        else
+        {
+            ys = pairS(0).dotProduct(pairY(0));
+            yy = pairY(0).norm();
+            yy = yy * yy;
         }
-
-        // set the 0 element
-        s_[0]->copy(*x_);
-        s_[0]->add(*xPrev_, -1);
-        y_[0]->copy(*g_);
-        y_[0]->add(*gPrev_, -1);
-        double ys = s_[0]->dotProduct(*(y_[0]));
-        double yy = y_[0]->norm();
-        yy = yy * yy;
 
         if(ys == 0 || yy == 0)
         {
@@ -371,14 +412,11 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *
             break;
         }
 
-        rho_[0] = 1 / ys;
+        pairRho(0) = 1 / ys;
 
         // set H0k
         H0k_ = ys / yy;
 
-        xPrev_->copy(*x_);
-        gPrev_->copy(*g_);
-
         if(callback)
             (*callback)(thisIter, val_, gradNorm_, *x_, *g_, *z_);
 
@@ -402,6 +440,126 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::minimize(LargeVector *
     return val_;
 }
 
+template<typename LargeVector, typename LargeVectorFactory, typename Function>
+void
+LBFGS_General<LargeVector, LargeVectorFactory, Function>::direction(int m, double* zNorm, double* zg)
+{
+    q_->copy(*g_);
+    for(int i = 0; i < m; ++i)
+    {
+        const double dotProduct = pairS(i).dotProduct(*q_);
+        alpha_[i] = pairRho(i) * dotProduct;
+        q_->add(pairY(i), -alpha_[i]);
+    }
+    z_->copy(*q_, H0k_);
+    for(int i = m - 1; i >= 0; --i)
+    {
+        const double dotProduct = pairY(i).dotProduct(*z_);
+        double beta = pairRho(i) * dotProduct;
+        z_->add(pairS(i), alpha_[i] - beta);
+    }
+
+    *zNorm = z_->norm();
+    *zg = z_->dotProduct(*g_);
+}
+
+template<typename LargeVector, typename LargeVectorFactory, typename Function>
+void
+LBFGS_General<LargeVector, LargeVectorFactory, Function>::directionFused(int m, double* zNorm, double* zg)
+{
+    // the same recursion as in direction, on the coefficients of the basis s_0, ..., s_(m-1), y_0, ..., y_(m-1), g, the dot products are taken from the Gram matrix
+    const int nBasis = 2 * m_ + 1, gIndex = 2 * m_;
+    std::fill(delta_.begin(), delta_.end(), 0.0);
+    delta_[gIndex] = 1;
+
+    // the coefficients are nonzero only for the first m pairs and g
+    const int nUsed = 2 * m + 1;
+    std::vector<int>& used = used_;
+    used.resize(nUsed);
+    for(int i = 0; i < m; ++i)
+    {
+        used[i] = gramIndex(false, i);
+        used[m + i] = gramIndex(true, i);
+    }
+    used[2 * m] = gIndex;
+
+    for(int i = 0; i < m; ++i)
+    {
+        const int row = gramIndex(false, i);
+        double dotProduct = 0;
+        for(int k = 0; k < nUsed; ++k)
+            dotProduct += gram(row, used[k]) * delta_[used[k]];
+        alpha_[i] = pairRho(i) * dotProduct;
+        delta_[gramIndex(true, i)] -= alpha_[i];
+    }
+    for(int k = 0; k < nBasis; ++k)
+        delta_[k] *= H0k_;
+    for(int i = m - 1; i >= 0; --i)
+    {
+        const int row = gramIndex(true, i);
+        double dotProduct = 0;
+        for(int k = 0; k < nUsed; ++k)
+            dotProduct += gram(row, used[k]) * delta_[used[k]];
+        const double beta = pairRho(i) * dotProduct;
+        delta_[gramIndex(false, i)] += alpha_[i] - beta;
+    }
+
+    double zz = 0, zgRes = 0;
+    for(int k = 0; k < nUsed; ++k)
+    {
+        double row = 0;
+        for(int l = 0; l < nUsed; ++l)
+            row += gram(used[k], used[l]) * delta_[used[l]];
+        zz += delta_[used[k]] * row;
+        zgRes += delta_[used[k]] * gram(used[k], gIndex);
+    }
+
+    // z in one pass
+    basis_.resize(nUsed);
+    dots_.resize(nUsed);
+    for(int i = 0; i < m; ++i)
+    {
+        basis_[i] = &pairS(i);
+        basis_[m + i] = &pairY(i);
+    }
+    basis_[2 * m] = g_.get();
+    for(int k = 0; k < nUsed; ++k)
+        dots_[k] = delta_[used[k]];
+    LargeVectorLinearCombination<LargeVector>::calculate(z_.get(), nUsed, &(dots_[0]), &(basis_[0]));
+
+    *zNorm = std::sqrt(std::max(zz, 0.0));
+    *zg = zgRes;
+}
+
+template<typename LargeVector, typename LargeVectorFactory, typename Function>
+void
+LBFGS_General<LargeVector, LargeVectorFactory, Function>::updateGram(const LargeVector& v, int index, int m)
+{
+    // the dot products of v with the first m pairs and g, all in one call
+    basis_.resize(2 * m + 1);
+    used_.resize(2 * m + 1);
+    for(int i = 0; i < m; ++i)
+    {
+        basis_[i] = &pairS(i);
+        used_[i] = gramIndex(false, i);
+        basis_[m + i] = &pairY(i);
+        used_[m + i] = gramIndex(true, i);
+    }
+    basis_[2 * m] = g_.get();
+    used_[2 * m] = 2 * m_;
+
+    dots_.resize(2 * m + 1);
+    LargeVectorDotProducts<LargeVector>::calculate(v, 2 * m + 1, &(basis_[0]), &(dots_[0]));
+    for(int k = 0; k < 2 * m + 1; ++k)
+    {
+        gram(index, used_[k]) = dots_[k];
+        gram(used_[k], index) = dots_[k];
+    }
+
+    if(index == 2 * m_)
+        gradNorm_ = std::sqrt(std::max(gram(index, index), 0.0));
+}
+
 template<typename LargeVector, typename LargeVectorFactory, typename Function>
 void
 LBFGS_General<LargeVector, LargeVectorFactory, Function>::replay(LargeVector *x)
@@ -426,17 +584,17 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::replay(LargeVector *x)
             const int m = std::min(m_, it); // use this many previous things
             for(int i = 0; i < m; ++i)
             {
-                const double dotProduct = s_[iter_ - 1 - it + i]->dotProduct(*q_);
-                alpha_[i] = rho_[iter_ - 1 - it + i] * dotProduct;
-                q_->add(*(y_[iter_ - 1 - it + i]), -alpha_[i]);
+                const double dotProduct = pairS(iter_ - 1 - it + i).dotProduct(*q_);
+                alpha_[i] = pairRho(iter_ - 1 - it + i) * dotProduct;
+                q_->add(pairY(iter_ - 1 - it + i), -alpha_[i]);
             }
             H0k_ = H0kSaved_[it];
             z_->copy(*q_, H0k_);
             for(int i = m - 1; i >= 0; --i)
             {
-                const double dotProduct = y_[iter_ - 1 - it + i]->dotProduct(*z_);
-                double beta = rho_[iter_ - 1 - it + i] * dotProduct;
-                z_->add(*(s_[iter_ - 1 - it + i]), alpha_[i] - beta);
+                const double dotProduct = pairY(iter_ - 1 - it + i).dotProduct(*z_);
+                double beta = pairRho(iter_ - 1 - it + i) * dotProduct;
+                z_->add(pairS(iter_ - 1 - it + i), alpha_[i] - beta);
             }
         }
         const double rate = rates_[it];
@@ -469,17 +627,17 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::replay(LargeVector *x,
             const int m = std::min(m_, it); // use this many previous things
             for(int i = 0; i < m; ++i)
             {
-                const double dotProduct = s_[iter_ - 1 - it + i]->dotProduct(*q_);
-                alpha_[i] = rho_[iter_ - 1 - it + i] * dotProduct;
-                q_->add(*(y_[iter_ - 1 - it + i]), -alpha_[i]);
+                const double dotProduct = pairS(iter_ - 1 - it + i).dotProduct(*q_);
+                alpha_[i] = pairRho(iter_ - 1 - it + i) * dotProduct;
+                q_->add(pairY(iter_ - 1 - it + i), -alpha_[i]);
             }
             H0k_ = H0kSaved_[it];
             z_->copy(*q_, H0k_);
             for(int i = m - 1; i >= 0; --i)
             {
-                const double dotProduct = y_[iter_ - 1 - it + i]->dotProduct(*z_);
-                double beta = rho_[iter_ - 1 - it + i] * dotProduct;
-                z_->add(*(s_[iter_ - 1 - it + i]), alpha_[i] - beta);
+                const double dotProduct = pairY(iter_ - 1 - it + i).dotProduct(*z_);
+                double beta = pairRho(iter_ - 1 - it + i) * dotProduct;
+                z_->add(pairS(iter_ - 1 - it + i), alpha_[i] - beta);
             }
         }
         const double rate = rates_[it];
@@ -496,16 +654,16 @@ LBFGS_General<LargeVector, LargeVectorFactory, Function>::applyInverseHessian(La
     const int m = std::min(m_, iter_); // use this many previous things
     for(int i = 0; i < m; ++i)
     {
-        const double dotProduct = s_[i]->dotProduct(*q_);
-        alpha_[i] = rho_[i] * dotProduct;
-        q_->add(*(y_[i]), -alpha_[i]);
+        const double dotProduct = pairS(i).dotProduct(*q_);
+        alpha_[i] = pairRho(i) * dotProduct;
+        q_->add(pairY(i), -alpha_[i]);
     }
     x->copy(*q_, H0k_);
     for(int i = m - 1; i >= 0; --i)
     {
-        const double dotProduct = y_[i]->dotProduct(*z_);
-        double beta = rho_[i] * dotProduct;
-        x->add(*(s_[i]), alpha_[i] - beta);
+        const double dotProduct = pairY(i).dotProduct(*z_);
+        double beta = pairRho(i) * dotProduct;
+        x->add(pairS(i), alpha_[i] - beta);
     }
 }
 
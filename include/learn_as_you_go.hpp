@@ -4,18 +4,25 @@
 #include <fstream>
 #include <vector>
 #include <string>
-#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include <macros.hpp>
+#include <cosmo_mpi.hpp>
 #include <function.hpp>
 #include <random.hpp>
 #include <fast_approximator.hpp>
 #include <fast_approximator_error.hpp>
+#include <block_compression.hpp>
+#include <checkpoint_coordinator.hpp>
+#include <mapped_file.hpp>
 
 /// Learn as you go approximation class.
 /// This class evaluates a given function f, and as it goes it builds a training set. For every new call, it checks whether a quick approximation from the already existing set is acceptable and if so, calculates the approximation. Otherwise the exact value of f is calculated and added to the training set.
 /// This class supports parallelism through MPI. Namely, each process will perform the same task, but all of the processes periodically share their training sets with each other, so the training set for each process includes all of the exact calculations by all of the processes.
-class LearnAsYouGo
+/// If a file is given in the constructor, the object registers itself with CheckpointCoordinator, so the file is updated when a sampler is stopped by a termination signal.
+class LearnAsYouGo : public CheckpointCoordinator::Checkpointable
 {
 public:
     /// Constructor.
@@ -40,27 +47,67 @@ public:
     /// \param errorVar If specified (i.e. not NULL), the variance of the error probability distribution will be returned here.
     void evaluate(const std::vector<double>& x, std::vector<double>* res, double *error1Sigma = NULL, double *error2Sigma = NULL, double *errorMean = NULL, double *errorVar = NULL);
 
+    /// Same as evaluate, but also gives the derivatives of the outputs from the local quadratic fit of the fast approximator (see FastApproximator::getApproximationWithGradient), so gradient-based samplers and optimizers can run on the approximation.
+    /// The derivatives are available once the fast approximator has been constructed, also when the exact value is calculated (then the fit goes through the new point).
+    /// \param x The input point.
+    /// \param res The result will be returned here.
+    /// \param gradient The first derivatives will be returned here, (*gradient)[i][j] is the derivative of output i with respect to input j.
+    /// \param hessian If not NULL, the second derivatives will be returned here, (*hessian)[i][j * nIn + l] is the second derivative of output i with respect to inputs j and l.
+    /// \return true if the derivatives have been calculated.
+    bool evaluateWithGradient(const std::vector<double>& x, std::vector<double>* res, std::vector<std::vector<double> >* gradient, std::vector<std::vector<double> >* hessian = NULL);
+
     /// This is similar to evaluate except that it will always calculate the exact value and add to the training set.
     /// \param x The input point.
     /// \param res The result will be returned here.
     void evaluateExact(const std::vector<double>& x, std::vector<double>* res);
 
+    /// Active learning, adds exact calculations at points chosen to improve the approximation the most. This is meant to be called when the process would otherwise be idle (for example waiting for the other processes, or after its chain has stopped), so that the approximation is used for more calls sooner.
+    /// Before the fast approximator is constructed the points are a latin hypercube fill of the range (or random points around the centers, if given). After that, for each new point several random candidates are drawn and the one with the largest estimated error is calculated.
+    /// The new points are added to the training set and shared with the other processes as usual. Not collective, each process can call it independently.
+    /// \param nNew The number of exact calculations.
+    /// \param mins The lower bounds of the range (for example the prior), for each input dimension.
+    /// \param maxs The upper bounds of the range.
+    /// \param centers If specified (i.e. not NULL and not empty) the candidates are drawn around these points (for example the current positions of the chains) instead of the whole range.
+    /// \param width The standard deviation of the candidates around the centers in each direction, in units of the range.
+    /// \return The number of exact calculations done (the candidates already in the training set are skipped).
+    unsigned long activeLearn(unsigned long nNew, const std::vector<double>& mins, const std::vector<double>& maxs, const std::vector<std::vector<double> >* centers = NULL, double width = 0.05);
+
     /// Set the precision for the error model.
     /// \p The error threshold. This is used to decide whether or not the approximation is acceptable.
     void setPrecision(double p);
 
-    /// Save into a file.
+    /// Save into a file. The file is a versioned binary snapshot with a checksum, containing the training set (in the order in which the last part of it is the error set), the parameters of the error set, and the error ratios of the error model. If the fast approximator has been constructed, it is also saved (together with its linear transformation and kd tree, but without the output values which are in the main file) into a file with the same name followed by ".fast".
+    /// The files are written into temporary files first and then renamed, so a file being read or memory-mapped by other processes is never overwritten. Only the process with ID 0 writes.
     /// \param fileName The name of the file.
     void writeIntoFile(const char* fileName) const;
     
-    /// Read from a file.
+    /// Read from a file. The snapshot is memory-mapped and the output values are used in place, so processes on the same node reading the same file share them in memory (unless it is compressed, see setSnapshotCompression). Throws an exception if the checksum doesn't match or the file was written for different dimensions.
+    /// If the corresponding ".fast" file written by writeIntoFile matches the training set, the fast approximator is memory-mapped from it and the error model is restored from the saved error ratios, so nothing is rebuilt or evaluated.
+    /// Files in the old format (without a version and a checksum) can also be read, then the fast approximator is rebuilt.
     /// \param fileName The name of the file.
     /// \return If the operation was successful.
     bool readFromFile(const char* fileName);
 
+    /// Write the periodic updates of the file given in the constructor in a background thread (the default). The training set is copied (only the input points, since the output values never change) and the fast approximator is serialized in memory, the files are then written in the background. If the previous update is still being written the new one is skipped. The file written in the destructor is always written directly.
+    /// \param async true to write the updates in the background, false to write them directly.
+    void setAsyncCheckpoint(bool async);
+
+    /// Compress the training set in the files written by writeIntoFile (NONE by default). The points are compressed in independent blocks (see BlockCompression), which are decompressed in parallel by readFromFile.
+    /// Compressed files take less space and are faster to read from slow file systems, but they are not memory-mapped, so each process reading them has its own copy of the output values.
+    /// \param codec The compression codec. Throws an exception if it is not available.
+    void setSnapshotCompression(BlockCompression::Codec codec);
+
     /// Set a file to log the progress. Upon every call of evaluate a new row will be added to this log file with the following values: the total number of calls, the number of calls with for which the same input point has been used previously, the number of calls for which the approximation was successful (not counting the cases where the input point was the same as a point in the training set), and the number of calls for which the approximation failed and the exact value of the function was calculated.
     /// \param fileNameBase The file name base. If only one process is run then the log file name is simply the base followed by ".txt". If multiple MPI processes are run, each will create a log file with the name "fileNameBase_id.txt", where id is the MPI process ID, i.e. a number between 0 and number of processes - 1.
-    void logIntoFile(const char* fileNameBase);
+    /// \param timing If true, each row has two more values: the wall time of the call in seconds, and how the value was obtained (see EVALUATION_PATH).
+    void logIntoFile(const char* fileNameBase, bool timing = false);
+
+    /// How the value of a call of evaluate was obtained.
+    enum EVALUATION_PATH { SAME_POINT = 0, APPROXIMATED, CALCULATED, EVALUATION_PATH_MAX };
+
+    /// How the value of the last call of evaluate or evaluateExact was obtained.
+    /// \return SAME_POINT if the input point was already in the training set, APPROXIMATED if the approximation was used, CALCULATED if the exact value of the function was calculated.
+    EVALUATION_PATH lastEvaluationPath() const { return lastPath_; }
 
     /// Get the total number of calls.
     /// \return The total number of calls.
@@ -70,42 +117,90 @@ public:
     /// \return The number of successful calls.
     unsigned long getSuccessfulCount() const { return successfulCount_; }
 
+    /// Get the number of points in the training set, including the ones received from the other processes.
+    /// \return The number of points in the training set.
+    unsigned long getTrainingSetSize() const { return points_.size(); }
+
+    /// Share the training sets between the MPI processes with collective operations instead of point to point messages. The new points of each process are accumulated locally and all of the processes exchange them together with a nonblocking allgather every few calls of evaluate.
+    /// The number of messages is then independent of the number of processes, which is much better for large runs. Does nothing if MPI is not used or only one process is run.
+    /// Together with useNodeSharedStorage the points are first gathered by the node masters over the node, and only the node masters exchange them between the nodes.
+    /// Must be called by all of the processes, right after the construction and before any calls of evaluate.
+    /// \param interval The number of calls of evaluate between the exchanges. Must be positive.
+    void useCollectiveSync(unsigned long interval = 100);
+
+    /// Keep the training set in memory shared by all of the processes on the same node instead of having a separate copy in each process. The node master is the only one writing into the shared memory, it adds all of the new points (its own and the ones received from the other processes). The other processes on the node don't receive any points, they just read the new points from the shared memory without any locks. They keep their own copies only of the points that they have calculated themselves.
+    /// Must be called by all of the processes, right after the construction and before any calls of evaluate. Does nothing if only one process is run.
+    /// If the shared memory becomes full, the node master keeps the new points in its own memory only, so the capacity should be chosen generously.
+    /// \param capacity The maximum number of points in the shared memory.
+    void useNodeSharedStorage(unsigned long capacity);
+
+    /// Build the fast approximator and the error model in a background thread whenever they need to be rebuilt (including the first time). The current ones are used until the new ones are ready, then they are swapped in at the beginning of the next call of evaluate, after adding the points that arrived in the meantime. This removes the long pauses in evaluate during the rebuilds.
+    /// The error function given in the constructor is then called from the background thread, so it must not change any shared state.
+    /// \param background true to build in the background, false (by default) to build in evaluate.
+    void setBackgroundRebuild(bool background);
+
+    /// Start updating the file given in the constructor through the asynchronous checkpoint (see setAsyncCheckpoint), after finishing a background rebuild if one is running. Called by CheckpointCoordinator::flush.
+    void startFlush();
+
+    /// Wait until the update started by startFlush has been written. Throws an exception if it failed.
+    void finishFlush();
+
 private:
     void construct();
     void randomizeErrorSet();
 
-    void constructFast();
+    // if fastFile is given and contains a matching saved fast approximator, the kd tree for the full training set is mapped from it instead of being rebuilt
+    void constructFast(const char* fastFile = NULL);
+
+    // the number of nearest neighbors used by the fast approximator
+    int neighborCount() const { return (nPoints_ + nPoints_ * (nPoints_ + 1) / 2 + 1) * 2; }
 
-    void log();
+    // background rebuilding, startRebuild takes a snapshot of the training set and starts the thread, finishRebuild swaps in the result
+    void startRebuild();
+    void rebuild();
+    void finishRebuild();
+    void waitForRebuild();
+
+    static std::string fastFileName(const char* fileName) { return std::string(fileName) + ".fast"; }
+
+    bool readLegacyFile(const char* fileName);
+    // restores the fast approximator from the ".fast" file and the error model from the ratios, rebuilds them if the file doesn't match
+    void restoreFast(const char* fastFile, const std::vector<double>* ratios);
+    void writeSnapshot(const char* fileName, const std::vector<std::vector<double> >& points, const std::vector<const double*>& rows, const std::vector<double>* ratios, unsigned long testSize, unsigned long updateErrorThreshold, double precision) const;
+
+    // asynchronous checkpoints, startCheckpoint takes a snapshot and starts the thread, which only touches the checkpoint members
+    void startCheckpoint();
+    void checkpoint();
+    void waitForCheckpoint();
+
+    void log(EVALUATION_PATH path);
 
     void actual(const std::vector<double>& x, std::vector<double>* res);
 
     void communicate();
     void receive();
+    void receiveCollective();
+    void receiveCollectiveHierarchical();
+    void setupHierarchicalSync();
+    // adds the new points from the node shared memory (for the processes other than the node master)
+    void receiveShared();
 
     void addDataPoint(const std::vector<double>& p, const std::vector<double>& d);
+    // adds a point that is not in the training set yet, d points to its output values which must stay valid
+    void addStoredPoint(const std::vector<double>& p, const double* d);
 
+    // the points are found in an open addressing hash table of their indices in points_, the lookups need exact matches of all of the coordinates
     void resetPointMap();
+    void insertPoint(unsigned long index);
+    unsigned long findPoint(const std::vector<double>& p) const;
+    // the slot of the table referring to p (or to another copy of it), noPoint if not found
+    unsigned long findSlot(const std::vector<double>& p) const;
+    // swaps two points of the training set, only the entries of the table referring to them are updated
+    void swapPoints(unsigned long i, unsigned long j);
+    static unsigned long hashPoint(const std::vector<double>& p);
 
 private:
-    struct PointComp
-    {
-        bool operator()(const std::vector<double>& a, const std::vector<double>& b) const
-        {
-            check(a.size() == b.size(), "");
-            check(!a.empty(), "");
-
-            for(int i = 0; i < a.size(); ++i)
-            {
-                if(a[i] < b[i])
-                    return true;
-                if(a[i] > b[i])
-                    return false;
-            }
-
-            return false;
-        }
-    };
+    static const unsigned long noPoint = (unsigned long)(-1);
 
 private:
     int nPoints_, nData_;
@@ -131,11 +226,15 @@ private:
 
     int communicateTag_;
 
-    std::vector<void*> updateRequests_;
+    // the buffers and the requests of the points sent to the other processes
+    CosmoMPI::SendPool sendPool_;
     std::vector<void*> updateReceiveReq_;
     bool firstUpdateRequested_;
 
     std::ofstream* logFile_;
+    bool logTiming_;
+    std::chrono::steady_clock::time_point evaluateStart_;
+    EVALUATION_PATH lastPath_;
 
     Math::UniformRealGenerator gen_;
 
@@ -146,6 +245,9 @@ private:
 
     std::vector<std::vector<double> > points_, data_;
 
+    // the output values of the training set, pointing either into data_ or into the node shared memory (then data_ is not used)
+    std::vector<const double*> dataRows_;
+
     std::vector<double> tempParams_;
     std::vector<double> tempData_;
 
@@ -153,10 +255,71 @@ private:
     std::vector<double> currentData_;
 
     std::vector<double> communicateBuff_;
-    std::vector<std::vector<double> > communicateData_;
     std::vector<std::vector<double> > receiveBuff_;
 
-    std::map<std::vector<double>, unsigned long, PointComp> pointMap_;
+    // collective synchronization, syncInterval_ is 0 if not used
+    // syncStage_ is 0 if no exchange is going on, 1 if the counts are being exchanged, 2 if the points are being exchanged (3 and 4 for the same among the node masters in the hierarchical exchange)
+    unsigned long syncInterval_;
+    unsigned long syncCalls_;
+    int syncStage_;
+    void* syncComm_;
+    void* syncReq_;
+    int syncSendCount_;
+    std::vector<int> syncCounts_, syncDispls_;
+    std::vector<double> syncBuff_, syncSend_, syncRecv_;
+
+    // with the node shared storage the exchange goes through the node masters (see receiveCollectiveHierarchical), syncNodeComm_ is NULL otherwise
+    // the points are first gathered on each node, then exchanged among the node masters, so only one message per node goes between the nodes
+    void* syncNodeComm_;
+    void* syncLeaderComm_;
+    int syncNodeTotal_;
+    std::vector<int> syncNodeCounts_, syncNodeDispls_;
+    std::vector<double> syncNodeRecv_;
+
+    // node shared storage (see useNodeSharedStorage), sharedBase_ is NULL if not used
+    // the shared memory starts with the number of points written (an atomic counter), followed by the points (input and output values)
+    void* sharedWindow_;
+    void* sharedBase_;
+    double* sharedTable_;
+    unsigned long sharedCapacity_;
+    unsigned long sharedSeen_;
+    bool sharedFull_;
+    bool nodeMaster_;
+    std::vector<int> nodeMasters_;
+
+    // background rebuild (see setBackgroundRebuild), the thread only touches the rebuild members until rebuildDone_ is set
+    bool backgroundRebuild_;
+    std::thread* rebuildThread_;
+    std::atomic<bool> rebuildDone_;
+    std::vector<std::vector<double> > rebuildPoints_;
+    std::vector<const double*> rebuildRows_;
+    unsigned long rebuildTestSize_;
+    double rebuildPrecision_;
+    FastApproximator* rebuildFa_;
+    FastApproximatorError* rebuildFast_;
+    std::string rebuildError_;
+
+    // asynchronous checkpoints (see setAsyncCheckpoint)
+    bool asyncCheckpoint_;
+    std::thread* checkpointThread_;
+    std::atomic<bool> checkpointDone_;
+    std::vector<std::vector<double> > checkpointPoints_;
+    std::vector<const double*> checkpointRows_;
+    std::vector<double> checkpointRatios_;
+    bool checkpointHasRatios_;
+    unsigned long checkpointTestSize_, checkpointThreshold_;
+    double checkpointPrecision_;
+    std::string checkpointFast_;
+    std::string checkpointError_;
+
+    // the memory-mapped snapshot read in the constructor, the output values of the points read point into it
+    Math::MappedFile snapshot_;
+
+    BlockCompression::Codec snapshotCodec_;
+
+    // the size is a power of 2, empty slots contain noPoint
+    std::vector<unsigned long> pointTable_;
+    unsigned long pointTableCount_;
 };
 
 #endif
@@ -5,6 +5,9 @@
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
+
+#include <math_constants.hpp>
 
 namespace Math
 {
@@ -36,6 +39,56 @@ public:
         return vals_[l];
     }
 
+    /// Calculate all of the Legendre polynomials up to a given l for one argument, in one pass of the recursion.
+    /// \param lMax The maximum l.
+    /// \param x The argument of the polynomials.
+    /// \param res The values P_0(x), ..., P_lMax(x) will be written here, must have lMax + 1 elements.
+    static void calculateAll(int lMax, double x, double* res)
+    {
+        res[0] = 1;
+        if(lMax >= 1)
+            res[1] = x;
+        for(int l1 = 2; l1 <= lMax; ++l1)
+            res[l1] = (2 - 1.0 / l1) * x * res[l1 - 1] - (1 - 1.0 / l1) * res[l1 - 2];
+    }
+
+    /// Calculate a given Legendre polynomial for many arguments. The arguments are processed in blocks, the recursion steps for all of the arguments of a block are independent, so they are vectorized.
+    /// \param l The index of the polynomial.
+    /// \param n The number of arguments.
+    /// \param x The arguments.
+    /// \param res The values P_l(x[i]) will be written here, must have n elements.
+    static void calculate(unsigned int l, long n, const double* x, double* res)
+    {
+        const int blockSize = 64;
+        double pPrev[blockSize], p[blockSize];
+        for(long start = 0; start < n; start += blockSize)
+        {
+            const int k = int(std::min<long>(blockSize, n - start));
+            const double* xb = x + start;
+#pragma omp simd
+            for(int i = 0; i < k; ++i)
+            {
+                pPrev[i] = 1;
+                p[i] = xb[i];
+            }
+
+            for(int l1 = 2; l1 <= int(l); ++l1)
+            {
+                const double a = 2 - 1.0 / l1, b = 1 - 1.0 / l1;
+#pragma omp simd
+                for(int i = 0; i < k; ++i)
+                {
+                    const double pNext = a * xb[i] * p[i] - b * pPrev[i];
+                    pPrev[i] = p[i];
+                    p[i] = pNext;
+                }
+            }
+
+            for(int i = 0; i < k; ++i)
+                res[start + i] = (l == 0 ? 1.0 : p[i]);
+        }
+    }
+
 private:
     std::vector<double> vals_;
 };
@@ -98,6 +151,92 @@ public:
         return vals_[l];
     }
 
+    /// Calculate the normalized associated Legendre functions lambda_lm(x) = sqrt((2l + 1) / (4 pi) (l - m)! / (l + m)!) P_lm(x) (so that Y_lm = lambda_lm(cos(theta)) exp(i m phi)) for all l up to a given maximum, in one pass of the recursion.
+    /// The recursion is for the normalized functions, so unlike calculate it does not overflow for high l and m (the values that are too small for double precision come out as 0).
+    /// \param lMax The maximum l.
+    /// \param m The index m, must be between 0 and lMax.
+    /// \param x The argument, between -1 and 1.
+    /// \param res The values will be written here, the index is l, must have lMax + 1 elements. The elements with l < m are set to 0.
+    static void calculateNormalizedAll(int lMax, int m, double x, double* res)
+    {
+        for(int l1 = 0; l1 < m && l1 <= lMax; ++l1)
+            res[l1] = 0;
+        if(m > lMax)
+            return;
+
+        double lambda = normalizedMM(m, x);
+        double lambdaPrev = 0;
+        res[m] = lambda;
+        for(int l1 = m + 1; l1 <= lMax; ++l1)
+        {
+            const double lambdaNext = normalizedFactorA(l1, m) * x * lambda - normalizedFactorB(l1, m) * lambdaPrev;
+            lambdaPrev = lambda;
+            lambda = lambdaNext;
+            res[l1] = lambda;
+        }
+    }
+
+    /// Calculate a given normalized associated Legendre function (see calculateNormalizedAll) for many arguments. The arguments are processed in blocks, the recursion steps for all of the arguments of a block are independent, so they are vectorized.
+    /// \param l The index l.
+    /// \param m The index m, must be between 0 and l.
+    /// \param n The number of arguments.
+    /// \param x The arguments, between -1 and 1.
+    /// \param res The values will be written here, must have n elements.
+    static void calculateNormalized(int l, int m, long n, const double* x, double* res)
+    {
+        const int blockSize = 64;
+        double lambdaPrev[blockSize], lambda[blockSize];
+        for(long start = 0; start < n; start += blockSize)
+        {
+            const int k = int(std::min<long>(blockSize, n - start));
+            const double* xb = x + start;
+            for(int i = 0; i < k; ++i)
+            {
+                lambdaPrev[i] = 0;
+                lambda[i] = normalizedMM(m, xb[i]);
+            }
+
+            for(int l1 = m + 1; l1 <= l; ++l1)
+            {
+                const double a = normalizedFactorA(l1, m), b = normalizedFactorB(l1, m);
+#pragma omp simd
+                for(int i = 0; i < k; ++i)
+                {
+                    const double lambdaNext = a * xb[i] * lambda[i] - b * lambdaPrev[i];
+                    lambdaPrev[i] = lambda[i];
+                    lambda[i] = lambdaNext;
+                }
+            }
+
+            for(int i = 0; i < k; ++i)
+                res[start + i] = lambda[i];
+        }
+    }
+
+private:
+    // lambda_mm(x) = (-1)^m sqrt((2m + 1) / (4 pi) (2m - 1)!! / (2m)!!) (1 - x^2)^(m / 2), as a product so that nothing overflows
+    static double normalizedMM(int m, double x)
+    {
+        const double f = std::sqrt(std::max(0.0, 1.0 - x * x));
+        double lambda = 1.0 / std::sqrt(4 * Math::pi);
+        for(int m1 = 1; m1 <= m; ++m1)
+            lambda *= -std::sqrt((2.0 * m1 + 1) / (2.0 * m1)) * f;
+        return lambda;
+    }
+
+    // lambda_lm = A x lambda_(l-1)m - B lambda_(l-2)m
+    static double normalizedFactorA(int l, int m)
+    {
+        return std::sqrt((4.0 * l * l - 1) / (double(l) * l - double(m) * m));
+    }
+
+    static double normalizedFactorB(int l, int m)
+    {
+        if(l == m + 1)
+            return 0;
+        return std::sqrt((2.0 * l + 1) * (double(l - 1) * (l - 1) - double(m) * m) / ((2.0 * l - 3) * (double(l) * l - double(m) * m)));
+    }
+
 private:
     std::vector<double> vals_;
 };
@@ -8,6 +8,7 @@
 #include <c_matrix.hpp>
 #include <whole_matrix.hpp>
 #include <matrix.hpp>
+#include <banded_matrix.hpp>
 
 #include "alm.h"
 #include "xcomplex.h"
@@ -57,6 +58,26 @@ public:
     /// \param foreground A vector containing the foreground map. This can be read by the function readForeground. If it's empty foreground marginalization is not done.
     Likelihood(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<double>& foreground);
     
+    /// Constructor.
+    
+    /// Constructs a likelihood calculator marginalizing over the amplitudes of several templates (foregrounds, monopole, dipole, etc.).
+    /// The templates are handled with the Woodbury identity, i.e. the covariance matrix is factorized only once and the templates only add a small K x K system (K is the number of templates).
+    /// \param cMatrix The covariance matrix.
+    /// \param fiducialMatrix The fiducial covariance matrix.
+    /// \param noiseMatrix The noise covariance matrix.
+    /// \param goodPixels A vector containing the indices of the unmasked pixels.
+    /// \param templates The templates to marginalize over, each one of size goodPixels.size(). Can be empty. The monopole and the dipole can be added with addMonopoleDipole.
+    Likelihood(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<std::vector<double> >& templates);
+    
+    /// The number of templates marginalized over.
+    int numTemplates() const { return templates_.size(); }
+    
+    /// Set Gaussian priors on the template amplitudes.
+    
+    /// By default the template amplitudes are completely unconstrained. This function sets Gaussian priors with zero mean on them instead. Only the small K x K system is recalculated, the factorization of the covariance matrix is reused.
+    /// \param inverseVariances The inverse variances of the amplitudes, one for each template. A value of 0 means the amplitude is unconstrained.
+    void setTemplatePriors(const std::vector<double>& inverseVariances);
+    
     /// Calculate likelihood for a single map.
     
     /// This function calculates the likelihood function for a single map.
@@ -72,16 +93,26 @@ public:
     /// This function calculates the likelihood for many maps.
     /// \param inputListName The name of a file containing all the map names. The format is, the first line contains the number of maps, each following line contains the name of the map followed by the name of the noise map.
     /// \param results A vector to return the calculated results in. The new results are added to what exists in the vector.
-    void calculateAll(const char* inputListName, std::vector<LikelihoodResult>& results) const;
+    /// \param chunkSize The maps are read and calculated in chunks of this many maps. The next chunk is read on a separate thread while the likelihood is calculated for the current one, so only two chunks are kept in memory.
+    /// \param nThreads The number of threads for reading the maps (see readInput), 0 means the OpenMP default.
+    void calculateAll(const char* inputListName, std::vector<LikelihoodResult>& results, int chunkSize = 64, int nThreads = 0) const;
     
     /// Calculate likelihood for many maps.
     
-    /// This function calculates the likelihood for many maps.
+    /// This function calculates the likelihood for many maps. The maps are stacked into one matrix and the triangular solves with the Cholesky factor of C are done for all of them at once (dtrsm), so this is much faster than calling calculate for each map.
     /// \param t A vector of temperature maps (noise added). This can be read by the function readInput.
     /// \param mapNames A vector with the names of the maps. This can be read by the function readInput.
     /// \param results A vector to return the calculated results in. The new results are added to what exists in the vector.
     void calculateAll(const std::vector<std::vector<double> >& t, const std::vector<std::string>& mapNames, std::vector<LikelihoodResult>& results) const;
     
+    /// Calculate likelihood for many maps stored in one matrix.
+    
+    /// The same as the function above, but the maps are given as the rows of a matrix (as read by readInput), so they are used in place without being copied.
+    /// \param t The maps (noise added), one in each row. The matrix is overwritten.
+    /// \param mapNames A vector with the names of the maps, at least one for each row.
+    /// \param results A vector to return the calculated results in. The new results are added to what exists in the vector.
+    void calculateAll(Math::Matrix<double>* t, const std::vector<std::string>& mapNames, std::vector<LikelihoodResult>& results) const;
+    
     /// Calculate likelihood for a single map.
     
     /// This function calculates the likelihood function for a single map.
@@ -93,12 +124,23 @@ public:
     
     /// Read input from many maps.
     
-    /// This function reads many maps and noise maps and adds then together.
+    /// This function reads many maps and noise maps and adds then together. The list is read first, then the FITS files of different maps are decoded on several threads (OpenMP), which needs a thread safe (reentrant) build of cfitsio.
     /// \param inputListName The name of a file containing all the map names. The format is, the first line contains the number of maps, each following line contains the name of the map followed by the name of the noise map.
     /// \param goodPixels A vector containing the indices of the unmasked pixels.
     /// \param t A vector where the maps are returned in.
     /// \param mapNames A vector where the map names are returned in.
-    static void readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames);
+    /// \param nThreads The number of threads for reading the maps, 0 means the OpenMP default. 1 reads the maps one by one.
+    static void readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames, int nThreads = 0);
+    
+    /// Read input from many maps into one matrix.
+    
+    /// The same as the function above, but the maps are written straight into the rows of a matrix, which can be passed to calculateAll without copying.
+    /// \param inputListName The name of a file containing all the map names, the same format as above.
+    /// \param goodPixels A vector containing the indices of the unmasked pixels.
+    /// \param t The matrix where the maps are returned in, one map per row. It is resized to number of maps x number of good pixels.
+    /// \param mapNames A vector where the map names are returned in.
+    /// \param nThreads The number of threads for reading the maps, 0 means the OpenMP default.
+    static void readInput(const char* inputListName, const std::vector<int>& goodPixels, Math::Matrix<double>* t, std::vector<std::string>& mapNames, int nThreads = 0);
     
     /// Read a single map and noise map.
     
@@ -110,6 +152,16 @@ public:
     /// \param t The map (with added noise) to be returned.
     static void readMapAndNoise(const char* mapName, const char* noiseMapName, const std::vector<int>& goodPixels, long& nSide, std::vector<double>& t);
     
+    /// Read a single map and noise map into a given buffer.
+    
+    /// The same as the function above, but the result is written into a buffer of goodPixels.size() values (for example a row of a matrix).
+    /// \param mapName The name of the map file (fits format).
+    /// \param noiseMapName The name of the noise map file (fits format).
+    /// \param goodPixels A vector containing the indices of unmasked pixels.
+    /// \param nSide NSide of the map to be returned.
+    /// \param t The map (with added noise) will be written here.
+    static void readMapAndNoise(const char* mapName, const char* noiseMapName, const std::vector<int>& goodPixels, long& nSide, double* t);
+    
     /// Read the foreground map.
     
     /// This function reads the foreground map.
@@ -119,15 +171,33 @@ public:
     /// \param f The foreground map to be returned.
     static void readForeground(const char* foregroundFileName, const std::vector<int>& goodPixels, long& nSide, std::vector<double>& f);
     
+    /// Add the monopole and the dipole templates.
+    
+    /// This function adds 4 templates, the monopole and the x, y, z components of the dipole, for the unmasked pixels of a map with nested ordering.
+    /// \param nSide NSide of the map.
+    /// \param goodPixels A vector containing the unmasked pixels.
+    /// \param templates The templates will be added to this vector.
+    static void addMonopoleDipole(long nSide, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& templates);
+    
 private:
     void construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const char* maskFileName, const char* foregroundFileName);
-    void construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<double>& foreground);
-    double vmv(int n, const std::vector<double>& a, const Math::SymmetricMatrix<double>& matrix, const std::vector<double>& b) const; // transpose(a) * matrix * b
+    void construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<std::vector<double> >& templates);
+    void solveLower(int nRhs, double* b) const; // b = L^(-1) b for nRhs vectors stored one after the other
+    void chi2FromMaps(Math::Matrix<double>* y, std::vector<double>* chi2) const; // the rows of y are the maps, they are replaced by L^(-1) t
+    void calculateTemplateSystem();
     
 private:
-    Math::SymmetricMatrix<double> cInv_;
+    // the lower triangular Cholesky factor L of the covariance matrix (C = L L^T), stored as a full matrix so that it can be passed to dtrsm directly
+    Math::Matrix<double> l_;
     double logDet_;
-    std::vector<double> f_;
+    
+    // Woodbury: with G = L^(-1) F, chi2 = y^T y - (G^T y)^T A^(-1) (G^T y) where A = G^T G + P (P is the diagonal prior precision of the amplitudes)
+    std::vector<std::vector<double> > templates_;
+    Math::Matrix<double> g_; // the rows are L^(-1) f for each template
+    Math::SymmetricMatrix<double> gTg_;
+    std::vector<double> templatePriors_;
+    Math::SymmetricMatrix<double> aInv_;
+    double logDetTemplates_;
     std::vector<int> goodPixels_;
 };
 
@@ -177,7 +247,7 @@ public:
     
     /// Calculates the likelihood for a set of maps.
     
-    /// This function is used to calculate the likelihood for many maps at once.
+    /// This function is used to calculate the likelihood for many maps at once. The E projections and the noise and covariance matrices are applied to all of the maps together with dense matrix products, and the harmonic transforms of the different maps are done in parallel.
     /// \param v A vector of vectors containing Q and U maps. Each vector can be read using the function readMaps.
     /// \param alm A vector of TT Alm-s. Each Alm can be read using the function readMaps.
     /// \param mapNames A vector containig the names of maps. These names are used to write the results in the output.
@@ -195,6 +265,7 @@ public:
     /// Combines whole matrics.
     
     /// This function is used to produced combined (ET(TT)^(-1)TE) and ET(TT)^(-1) matrices from TT, TE, and EE matrices.
+    /// If all of the inputs are diagonal in (l, m) (isotropic) the results are calculated for each (l, m) separately, otherwise TT is inverted as a full matrix.
     /// \param tt Input TT whole matrix.
     /// \param te Input TE whole matrix.
     /// \param ee Input EE whole matrix.
@@ -216,7 +287,7 @@ public:
     
     /// Read input from many maps.
     
-    /// This function is a generalization of Likelihood::readInput. Reads many temperature and polarization maps.
+    /// This function is a generalization of Likelihood::readInput. Reads many temperature and polarization maps, the files of different maps are read on several threads.
     /// \param inputListName The name of a file containing all the map names. The format is, the first line contains the number of maps, each following line contains the name of the temperature map followed by the name of the noise map, TT alm file, Q map, and U map.
     /// \param goodPixels A vector containing the indices of unmasked pixels for temperature.
     /// \param t A vector that will contain temperature maps upon return.
@@ -225,22 +296,29 @@ public:
     /// \param v A vector that will contain Q and U maps upon return.
     /// \param alm A vector that will contain TT Alm-s upon return.
     /// \param lMaxPol Maximum value of l for polarization analysis.
-    static void readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames, const std::vector<int>& goodPixelsPol, std::vector<std::vector<double> >& v, std::vector<AlmType>& alm, int lMaxPol);
+    /// \param nThreads The number of threads for reading the maps, 0 means the OpenMP default.
+    static void readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames, const std::vector<int>& goodPixelsPol, std::vector<std::vector<double> >& v, std::vector<AlmType>& alm, int lMaxPol, int nThreads = 0);
+    
+private:
+    int almIndex(int l, int m) const; // the column of (l, m) in ettt_, -l <= m <= l
+    int eIndex(int l, int m) const; // the row of (l, m) in ettt_, 0 <= m <= l
     
 private:
-    Math::SymmetricMatrix<double> cInv_;
+    // the matrices are stored full (not packed) so that they can be applied to all of the maps at once with dgemm
+    Math::Matrix<double> cInv_;
     double logDet_;
     std::vector<int> goodPixels_;
     long nSide_;
     int lMax_;
+    int lMin_;
     
     double phi_;
     double theta_;
     double psi_;
     
-    Math::SymmetricMatrix<double> nInv_;
+    Math::Matrix<double> nInv_;
     
-    WholeMatrix etttInverse_;
+    Math::Matrix<double> ettt_;
     std::vector<double> beam_;
 };
 
@@ -256,7 +334,9 @@ public:
     /// \param couplingKernelFileName The name of the file containig the coupling kernel for the mask. This is produced when running Master.
     /// \param lMin The minimum value of l to include in the calculation.
     /// \param lMax The maximum value of l to include in the calculation.
-    LikelihoodHigh(const std::vector<double>& cl, const std::vector<double>& nl, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName = 0);
+    /// \param noiseCouplingKernelFileName The name of the file containing the coupling kernel for the noise (optional).
+    /// \param kernelThreshold The coupling kernels are stored as banded matrices, dropping the elements far from the diagonal that are smaller than kernelThreshold times the largest element in the row. The default 0 keeps everything except for exact zeros.
+    LikelihoodHigh(const std::vector<double>& cl, const std::vector<double>& nl, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName = 0, double kernelThreshold = 0);
 
     /// Constructor.
     /// \param dataClFileName The name of the file containing data Cl-s. The units should be muK^2. The format is each row should contain l followed by Cl.
@@ -264,25 +344,43 @@ public:
     /// \param couplingKernelFileName The name of the file containig the coupling kernel for the mask. This is produced when running Master.
     /// \param lMin The minimum value of l to include in the calculation.
     /// \param lMax The maximum value of l to include in the calculation.
-    LikelihoodHigh(const char* dataClFileName, const char* noiseClFileName, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName = 0);
+    /// \param noiseCouplingKernelFileName The name of the file containing the coupling kernel for the noise (optional).
+    /// \param kernelThreshold The coupling kernels are stored as banded matrices, dropping the elements far from the diagonal that are smaller than kernelThreshold times the largest element in the row. The default 0 keeps everything except for exact zeros.
+    LikelihoodHigh(const char* dataClFileName, const char* noiseClFileName, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName = 0, double kernelThreshold = 0);
 
     /// Calculate the likelihood for given Cl-s.
     /// \param cl Model Cl-s in muK^2. The index of the vector is l.
     /// \return -2ln(likelihood).
     double calculate(const std::vector<double>& cl) const;
 
+    /// Calculate the likelihood and its gradient with respect to the model Cl-s, in closed form. This is about as cheap as calculate, so it can be used by gradient based minimizers and samplers (LBFGS, HMC) on the Cl-s or, with the chain rule, on the parameters of the Cl-s.
+    /// \param cl Model Cl-s in muK^2. The index of the vector is l.
+    /// \param grad The derivatives of -2ln(likelihood) with respect to the Cl-s will be written here. The index is l, lMax + 1 values, 0 outside of the range lMin to lMax.
+    /// \return -2ln(likelihood).
+    double calculateWithGradient(const std::vector<double>& cl, std::vector<double>* grad) const;
+
     /// Calculate the likelihood for given Cl-s.
     /// \param clFileName The name of the file containing model Cl-s in muK^2. Each row should contain just the Cl, starting from l = 0.
     /// \return -2ln(likelihood).
     double calculate(const char* clFileName) const;
 
+    /// Calculate the likelihood for many sets of Cl-s at once. The coupling kernels are applied to all of them with a single matrix multiplication (dgemm).
+    /// \param cls Model Cl-s in muK^2, the index of each vector is l.
+    /// \param res The results, -2ln(likelihood) for each set of Cl-s.
+    void calculate(const std::vector<std::vector<double> >& cls, std::vector<double>* res) const;
+
 private:
-    void readCouplingKernel(const char* couplingKernelFileName, std::vector<std::vector<double> > & coupling);
+    void readCouplingKernel(const char* couplingKernelFileName, Math::Matrix<double>* coupling) const;
+    void setKernels(const char* couplingKernelFileName, const char* noiseCouplingKernelFileName, double kernelThreshold);
+    void weights(const std::vector<double>& cl, double* u, double* v) const;
 
 private:
     std::vector<double> cl_, nl_;
-    std::vector<std::vector<double> > coupling_;
-    std::vector<std::vector<double> > noiseCoupling_;
+
+    // with u = delta Cl Cl / (Cl + Nl)^2, v = delta Cl Nl / (Cl + Nl)^2, the result is (u^T S u + u^T X v + v^T X u + v^T N v) / 2
+    // S and N are the signal and noise coupling kernels times (2l + 1), X is the element by element geometric mean of the two
+    Math::BandedMatrix sig_, cross_, noise_;
+    bool noiseCoupling_;
     const int lMin_, lMax_;
     const double offset_;
 };
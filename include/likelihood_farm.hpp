@@ -0,0 +1,92 @@
+#ifndef COSMO_PP_LIKELIHOOD_FARM_HPP
+#define COSMO_PP_LIKELIHOOD_FARM_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <likelihood_function.hpp>
+
+namespace Math
+{
+
+/// A likelihood function that shares the evaluation of batches of points between all of the MPI processes.
+
+/// This balances the load when the likelihood evaluation time varies a lot across parameter space (for example CLASS with massive neutrinos), so that the processes with fast points do not sit idle waiting for the ones with slow points.
+/// Each process publishes its batch in an MPI window. The points are claimed one at a time with atomic operations, first by the owner, and then by the other processes that have already claimed all of their own points (work stealing).
+/// The results are written directly into the window of the owner, so the owner does not need to take part in the evaluation of the stolen points.
+/// The samplers that evaluate batches using LikelihoodFunction::calculateBatch (the walkers of EnsembleSampler, the multiple tries and the speculative evaluations of MetropolisHastings) are balanced automatically when given a LikelihoodFarm.
+/// Must be constructed by all of the processes at the same time, each with its own copy of the same likelihood function. Needs the one sided communication of MPI 3, otherwise (and without MPI) the batches are evaluated locally.
+/// Note that some MPI implementations only progress the one sided operations when the target process calls MPI, so a process that is busy with a long evaluation may answer the steals late.
+class LikelihoodFarm : public LikelihoodFunction
+{
+public:
+    /// Constructor. Must be called by all of the processes at the same time.
+    /// \param like The likelihood function. Must be the same function on all of the processes.
+    /// \param nPar The number of parameters.
+    /// \param maxBatchSize The maximum number of points published at once, larger batches are split.
+    LikelihoodFarm(LikelihoodFunction& like, int nPar, int maxBatchSize = 64);
+
+    /// Destructor. Must be called by all of the processes at the same time.
+    ~LikelihoodFarm();
+
+    /// Calculate the likelihood locally.
+    virtual double calculate(double* params, int nParams) { return like_->calculate(params, nParams); }
+
+    /// Calculate the exact likelihood locally.
+    virtual double calculateExact(double* params, int nParams) { return like_->calculateExact(params, nParams); }
+
+    /// Calculate the likelihood for a batch of points, sharing the points with the other processes. After the batch is done, this process keeps helping the other processes as long as they have unclaimed points.
+    /// \param params The parameter vectors, stored one after the other.
+    /// \param nParams The number of the parameters.
+    /// \param nPoints The number of parameter vectors.
+    /// \param results A vector of size nPoints that will contain -2ln(likelihood) for each point upon return.
+    virtual void calculateBatch(double* params, int nParams, int nPoints, double* results);
+
+    /// Start evaluating a batch asynchronously. The previous batch must have been finished.
+    /// \param params The parameter vectors, stored one after the other. They are copied, so the array does not need to be kept.
+    /// \param nPoints The number of parameter vectors, at most maxBatchSize.
+    void startBatch(const double* params, int nPoints);
+
+    /// Make progress with the current batch. Evaluates one of the unclaimed points of the current batch, or if there are none, one point of another process.
+    /// \return true if all of the points of the current batch have been evaluated.
+    bool progress();
+
+    /// Wait until the current batch is done, taking part in the evaluation.
+    /// \param results A vector of size nPoints that will contain the results upon return.
+    void finishBatch(double* results);
+
+    /// The number of points of the other processes evaluated by this process.
+    unsigned long stolen() const { return stolen_; }
+
+private:
+    int claim(int process);
+    void evaluate(int process, int index);
+    bool steal();
+    bool batchDone();
+
+private:
+    LikelihoodFunction* like_;
+    const int n_;
+    const int maxBatchSize_;
+    int nProcesses_, processId_;
+
+    int batchSize_;
+    long long generation_;
+    int nextVictim_;
+    unsigned long stolen_;
+
+    // the window with the parameters of the published points followed by their results, and the one with the claim counter, the batch descriptor and the done counter
+    void* dataWin_;
+    void* controlWin_;
+    double* data_;
+    long long* control_;
+
+    std::vector<double> point_;
+    // used instead of the window when the batches are evaluated locally
+    std::vector<double> localData_;
+};
+
+} // namespace Math
+
+#endif
+
@@ -25,6 +25,37 @@ public:
     {
         return calculate(params, nParams);
     }
+
+    /// Calculate the likelihood for a batch of parameter vectors in one call. The default implementation calls calculate for each point in turn.
+    /// Likelihoods that can evaluate several points at once (for example on several threads or MPI processes) should override this.
+    /// \param params The parameter vectors, stored one after the other (nPoints * nParams values, passed as a pointer to the first element).
+    /// \param nParams The number of the parameters.
+    /// \param nPoints The number of parameter vectors.
+    /// \param results A vector of size nPoints that will contain -2ln(likelihood) for each point upon return (passed as a pointer to the first element).
+    virtual void calculateBatch(double* params, int nParams, int nPoints, double* results)
+    {
+        for(int i = 0; i < nPoints; ++i)
+            results[i] = calculate(params + i * nParams, nParams);
+    }
+
+    /// Information about the last call of calculate or calculateExact, for likelihoods that use an approximation or retry their calculations. Used by the samplers for logging the evaluations (see MetropolisHastings::logEvaluations).
+    /// The default implementation has no information and returns false.
+    /// \param approximate Will be set to true if the approximation was used (for example an emulator), false if the exact likelihood was calculated.
+    /// \param retries Will be set to the number of retries of the underlying calculation (for example CLASS retries with a different precision), 0 if none.
+    /// \return true if the information is available.
+    virtual bool lastEvaluationInfo(bool* approximate, int* retries) const
+    {
+        return false;
+    }
+
+    /// Switch between a cheaper, lower precision calculation and the full precision one, for likelihoods that support it (for example the CLASS precision in PlanckLikelihood). Used by the samplers for the burnin (see MetropolisHastings::usePrecisionSchedule).
+    /// The default implementation does not support it and returns false.
+    /// \param low true for the low precision, false for the full precision.
+    /// \return true if the precision is supported and has been set.
+    virtual bool setLowPrecision(bool low)
+    {
+        return false;
+    }
 };
 
 class LikelihoodWithDerivs : public LikelihoodFunction
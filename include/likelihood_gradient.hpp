@@ -0,0 +1,94 @@
+#ifndef COSMO_PP_LIKELIHOOD_GRADIENT_HPP
+#define COSMO_PP_LIKELIHOOD_GRADIENT_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <function.hpp>
+#include <likelihood_function.hpp>
+
+namespace Math
+{
+
+/// Central finite difference gradient of a likelihood function.
+
+/// All of the 2n points of the central differences (n is the number of parameters) are evaluated in one call to LikelihoodFunction::calculateBatch, so they are calculated concurrently by the likelihoods that evaluate batches in parallel,
+/// for example a likelihood calculating its batches with a CMBPool. With enough threads or processes a gradient costs about as much as one likelihood evaluation.
+/// The points can also be split between the MPI processes (see the constructor). In that case all of the processes run the same minimization (the minimizers are deterministic, so they go through the same points), only the gradients are shared.
+/// The gradient can be used by BestFit (analytic gradient mode of Minuit, see BestFit::setParallelGradient) and by LBFGS (see function and gradientFunction).
+class LikelihoodGradient
+{
+public:
+    /// Constructor.
+    /// \param like The likelihood function.
+    /// \param steps The finite difference step for each parameter, must be positive. The size determines the number of parameters.
+    /// \param min The lower bounds of the parameters, optional (can be NULL). The points of the differences are kept inside the bounds, the differences become one-sided near them.
+    /// \param max The upper bounds of the parameters, optional (can be NULL).
+    /// \param distribute If true, the points are split between the MPI processes, each process evaluates its share in one batch and the results are combined. All of the processes must then calculate the gradients at the same points at the same time.
+    LikelihoodGradient(LikelihoodFunction& like, const std::vector<double>& steps, const std::vector<double>* min = NULL, const std::vector<double>* max = NULL, bool distribute = false);
+
+    /// The number of parameters.
+    int nParams() const { return n_; }
+
+    /// The total number of likelihood evaluations so far, by this process.
+    unsigned long evaluations() const { return evaluations_; }
+
+    /// Calculate the gradient of -2ln(likelihood), with one batch of 2n points.
+    /// \param params The parameters, nParams() of them.
+    /// \param grad The gradient will be written here, nParams() values.
+    void gradient(const double* params, double* grad);
+
+    /// Calculate -2ln(likelihood) and its gradient, with one batch of 2n + 1 points.
+    /// \param params The parameters, nParams() of them.
+    /// \param grad The gradient will be written here, nParams() values.
+    /// \return -2ln(likelihood) at params.
+    double calculate(const double* params, double* grad);
+
+    /// -2ln(likelihood) as a function, for LBFGS.
+    const RealFunctionMultiDim& function() const { return function_; }
+
+    /// The gradient of -2ln(likelihood) as a function, for LBFGS.
+    const RealFunctionMultiToMulti& gradientFunction() const { return gradientFunction_; }
+
+private:
+    void evaluate(const double* params, bool center, double* grad, double* value);
+    void calculateBatch(int nPoints);
+
+    class Function : public RealFunctionMultiDim
+    {
+    public:
+        Function(LikelihoodGradient& g) : g_(g) {}
+        using RealFunctionMultiDim::evaluate;
+        virtual double evaluate(const std::vector<double>& x) const;
+    private:
+        LikelihoodGradient& g_;
+    };
+
+    class GradientFunction : public RealFunctionMultiToMulti
+    {
+    public:
+        GradientFunction(LikelihoodGradient& g) : g_(g) {}
+        using RealFunctionMultiToMulti::evaluate;
+        virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const;
+    private:
+        LikelihoodGradient& g_;
+    };
+
+private:
+    LikelihoodFunction& like_;
+    const int n_;
+    std::vector<double> steps_, min_, max_;
+    const bool distribute_;
+    unsigned long evaluations_;
+
+    // the points of a batch and their likelihoods, and the share of this process if distributed, reused
+    std::vector<double> points_, results_;
+    std::vector<double> myPoints_, myResults_, total_;
+
+    Function function_;
+    GradientFunction gradientFunction_;
+};
+
+} // namespace Math
+
+#endif
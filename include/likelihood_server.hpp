@@ -0,0 +1,102 @@
+#ifndef COSMO_PP_LIKELIHOOD_SERVER_HPP
+#define COSMO_PP_LIKELIHOOD_SERVER_HPP
+
+#include <string>
+#include <vector>
+
+#include <macros.hpp>
+#include <likelihood_function.hpp>
+
+namespace Math
+{
+
+/// A long running process that keeps a likelihood function loaded and evaluates it for clients on the same machine.
+
+/// Short jobs (best fit restarts, reweighting, Fisher derivatives) can then use a likelihood with an expensive initialization (clik_init, CMB::preInitialize, reading the training set of PlanckLikeFast) through LikelihoodClient without paying for the initialization each time.
+/// The requests come through a Unix domain socket. Each request is a batch of parameter vectors, evaluated with LikelihoodFunction::calculateBatch (or calculateExact for the exact requests), so a likelihood that evaluates batches in parallel (for example a LikelihoodFarm) is used as such.
+/// The clients are served one at a time, in the order they connect, each one until it disconnects. An exception thrown by the likelihood is sent back to the client and thrown there, the server keeps running.
+/// See planck_like_server for a server with the Planck likelihoods.
+class LikelihoodServer
+{
+public:
+    /// Constructor. Creates the socket, so the clients can connect as soon as the constructor returns (they wait until run is called).
+    /// \param like The likelihood function.
+    /// \param socketPath The path of the socket. An old socket file with the same path (left by a server that did not finish properly) is replaced.
+    LikelihoodServer(LikelihoodFunction& like, const char* socketPath);
+
+    /// Destructor. Closes and removes the socket.
+    ~LikelihoodServer();
+
+    /// Serve the clients until one of them asks the server to stop (see LikelihoodClient::shutdownServer).
+    void run();
+
+    /// The path of the socket.
+    const std::string& socketPath() const { return socketPath_; }
+
+    /// The number of requests served.
+    unsigned long requests() const { return requests_; }
+
+    /// The number of parameter vectors evaluated.
+    unsigned long points() const { return points_; }
+
+private:
+    LikelihoodServer(const LikelihoodServer&);
+    LikelihoodServer& operator = (const LikelihoodServer&);
+
+    // serves one client until it disconnects, returns false if asked to stop
+    bool serve(int connection);
+
+private:
+    LikelihoodFunction* like_;
+    std::string socketPath_;
+    int socket_;
+
+    unsigned long requests_;
+    unsigned long points_;
+
+    std::vector<double> params_;
+    std::vector<double> results_;
+};
+
+/// A likelihood function that sends the evaluations to a LikelihoodServer.
+
+/// Can be used in place of the likelihood loaded by the server, with any of the samplers or minimizers. Each call is one round trip to the server, so the batches (calculateBatch) should be used where possible.
+/// Not thread safe, the threads of a process should each have their own client.
+class LikelihoodClient : public LikelihoodFunction
+{
+public:
+    /// Constructor. Connects to the server.
+    /// \param socketPath The path of the socket of the server.
+    /// \param timeout The number of seconds to keep trying if the server is not there yet (for example it is still initializing), 0 means try once.
+    LikelihoodClient(const char* socketPath, double timeout = 0);
+
+    /// Destructor. Disconnects from the server.
+    ~LikelihoodClient();
+
+    /// Calculate the likelihood on the server.
+    virtual double calculate(double* params, int nParams);
+
+    /// Calculate the exact likelihood on the server.
+    virtual double calculateExact(double* params, int nParams);
+
+    /// Calculate the likelihood for a batch of points on the server, in one request.
+    virtual void calculateBatch(double* params, int nParams, int nPoints, double* results);
+
+    /// Ask the server to stop after this request. The client cannot be used after this.
+    void shutdownServer();
+
+private:
+    LikelihoodClient(const LikelihoodClient&);
+    LikelihoodClient& operator = (const LikelihoodClient&);
+
+    void request(int type, const double* params, int nParams, int nPoints, double* results);
+
+private:
+    std::string socketPath_;
+    int socket_;
+};
+
+} // namespace Math
+
+#endif
+
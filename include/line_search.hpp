@@ -3,12 +3,61 @@
 
 #include <algorithm>
 #include <cmath>
+#include <utility>
 
 #include <macros.hpp>
+#include <large_vector_ops.hpp>
 
 namespace Math
 {
 
+/*
+Optional function of the Function of LBFGS_General and CG_General (and moreThuenteSearch), used when available:
+
+class Function
+{
+public:
+    // the value and the derivative at the point set with set, calculated together (for MPI, ALL the processes should get the function value)
+    double valueAndDerivative(LargeVector *res);
+};
+*/
+
+/// Detects the optional valueAndDerivative function of Function.
+template<typename Function, typename LargeVector>
+class HasValueAndDerivative
+{
+private:
+    template<typename F>
+    static char test(decltype(std::declval<F&>().valueAndDerivative((LargeVector*)(0)))*);
+
+    template<typename F>
+    static long test(...);
+
+public:
+    static const bool value = (sizeof(test<Function>(0)) == 1);
+};
+
+/// Calculates the value and the derivative of a function at the point set, with one call to valueAndDerivative if available, otherwise with value and derivative.
+template<typename Function, typename LargeVector, bool Combined = HasValueAndDerivative<Function, LargeVector>::value>
+struct FunctionValueAndDerivative
+{
+    static double calculate(Function* f, LargeVector* g)
+    {
+        const double val = f->value();
+        f->derivative(g);
+        return val;
+    }
+};
+
+template<typename Function, typename LargeVector>
+struct FunctionValueAndDerivative<Function, LargeVector, true>
+{
+    static double calculate(Function* f, LargeVector* g)
+    {
+        return f->valueAndDerivative(g);
+    }
+};
+
 inline
 int moreThuenteStep(double &stx, double &fx, double &dx, double &sty, double &fy, double &dy, double &stp, double &fp, double& dp, bool &brackt, double stpmin, double stpmax)
 {
@@ -168,10 +217,8 @@ int moreThuenteSearch(Function *func, const LargeVector& x0, double &f, const La
     check(stpmax >= stpmin, "");
     check(maxfev > 0, "");
 
-    x->copy(x0);
-    g->copy(g0);
-
-    const double dginit = g->dotProduct(s);
+    // x and g are written at each step, the first step is always taken
+    const double dginit = g0.dotProduct(s);
     check(dginit < 0, "");
 
     const double p66 = 0.66;
@@ -214,11 +261,9 @@ int moreThuenteSearch(Function *func, const LargeVector& x0, double &f, const La
         if((brackt && (stp <= stmin || stp >= stmax)) || nfev >= maxfev - 1 || infoc == 0 || (brackt && stmax - stmin <= xtol * stmax))
             stp = stx;
 
-        x->copy(x0);
-        x->add(s, stp);
+        linearCombination(x, 1.0, x0, stp, s);
         func->set(*x);
-        f = func->value();
-        func->derivative(g);
+        f = FunctionValueAndDerivative<Function, LargeVector>::calculate(func, g);
         ++nfev;
         dg = g->dotProduct(s);
         ftest1 = finit + stp * dgtest;
@@ -0,0 +1,133 @@
+#ifndef COSMO_PP_MAPPED_FILE_HPP
+#define COSMO_PP_MAPPED_FILE_HPP
+
+#include <string>
+#include <fstream>
+
+namespace Math
+{
+
+/// The beginning of the header of the binary files that are memory-mapped with MappedFile.
+
+/// The header of each format starts with these fields, followed by the fields of the format, and has MappedFile::headerSize bytes in total.
+struct MappedFileHeader
+{
+    /// The magic string of the format.
+    char magic[8];
+
+    /// A number that reads differently on a machine with the other byte order.
+    unsigned int byteOrder;
+
+    /// The version of the format.
+    int version;
+
+    /// The size of the elements in bytes.
+    int elementSize;
+};
+
+/// A memory-mapped binary file, and the header used by the formats that are memory-mapped (MappedMatrix, WholeMatrix, Wigner3jZeroMTable, LegendrePolynomialContainer).
+
+/// The files start with a header of headerSize bytes (a MappedFileHeader followed by the fields of the format), and the elements start right after it, so they are aligned to the cache lines. Files written on a machine with a different byte order are recognized and cannot be mapped (an exception is thrown).
+/// The files are written with write, into a temporary file first that then replaces the old file (see ReplacingOutputFile), so the objects mapped from the old file stay valid.
+class MappedFile
+{
+public:
+    /// The size of the header.
+    static const int headerSize = 64;
+
+    /// The size to pass to map to map the whole file.
+    static const unsigned long wholeFile = (unsigned long)(-1);
+
+    /// Constructor. Nothing is mapped.
+    MappedFile() : map_(NULL), size_(0) {}
+
+    /// Destructor. Unmaps the file.
+    ~MappedFile() { unmap(); }
+
+    /// Memory-map the beginning of a file. Throws an exception if the file cannot be opened, is shorter than size, or cannot be mapped.
+    /// \param fileName The name of the file.
+    /// \param size The number of bytes to map, from the beginning of the file (including the header), or wholeFile. If 0 (or the file is empty) only the file is checked and nothing is mapped.
+    /// \param what What the file contains, for the error messages (for example "matrix").
+    /// \param copyOnWrite If true the mapping is writable and private, the changes are not written into the file. Otherwise it is read-only, and the processes on the same node mapping the same file share one copy of the pages.
+    void map(const char* fileName, unsigned long size, const char* what, bool copyOnWrite = false);
+
+    /// Unmap the file, if mapped.
+    void unmap();
+
+    /// The beginning of the mapping (the beginning of the file), NULL if nothing is mapped.
+    void* data() const { return map_; }
+
+    /// The number of mapped bytes.
+    unsigned long size() const { return size_; }
+
+    /// Initialize a header for writing. The header must have headerSize bytes, the fields after the MappedFileHeader are set to 0.
+    /// \param magic The magic string of the format (8 characters).
+    /// \param version The version of the format.
+    /// \param elementSize The size of the elements in bytes.
+    /// \param header The header.
+    static void initHeader(const char* magic, int version, int elementSize, MappedFileHeader* header);
+
+    /// Read the header of a file. Throws an exception if the file cannot be opened, or if it starts with the magic string but was written on a machine with a different byte order. The version and the other fields are checked by the caller.
+    /// \param fileName The name of the file.
+    /// \param magic The magic string of the format (8 characters).
+    /// \param what What the file contains, for the error messages (for example "matrix").
+    /// \param header The header is read into this, must have headerSize bytes.
+    /// \return true if the file starts with the magic string, false if it does not (for example an older format or a text file).
+    static bool readHeader(const char* fileName, const char* magic, const char* what, MappedFileHeader* header);
+
+    /// Check if a file starts with a given magic string.
+    /// \param fileName The name of the file.
+    /// \param magic The magic string of the format (8 characters).
+    /// \return true if the file exists and starts with the magic string.
+    static bool hasMagic(const char* fileName, const char* magic);
+
+    /// Write a file that can be memory-mapped, the header followed by the elements. The file is replaced only after it is completely written.
+    /// \param fileName The name of the file.
+    /// \param header The header, must have headerSize bytes.
+    /// \param data The elements.
+    /// \param dataSize The size of the elements in bytes.
+    static void write(const char* fileName, const MappedFileHeader* header, const void* data, unsigned long dataSize);
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+private:
+    void* map_;
+    unsigned long size_;
+};
+
+/// An output file that replaces the old file only when it is completely written.
+
+/// The data is written into a temporary file (the file name followed by .tmp), which is renamed to the file name by commit. The objects memory-mapped from the old file keep the old contents, and readers never see a partially written file. If commit is not called (for example if writing throws an exception) the temporary file is removed.
+class ReplacingOutputFile
+{
+public:
+    /// Constructor. Opens the temporary file. Throws an exception if it cannot be opened.
+    /// \param fileName The name of the file to replace.
+    ReplacingOutputFile(const char* fileName);
+
+    /// Destructor. Removes the temporary file if commit has not been called.
+    ~ReplacingOutputFile();
+
+    /// The stream to write into.
+    std::ofstream& stream() { return out_; }
+
+    /// Close the temporary file and rename it to the file name. Throws an exception if writing failed or the file cannot be renamed.
+    void commit();
+
+private:
+    ReplacingOutputFile(const ReplacingOutputFile&);
+    ReplacingOutputFile& operator=(const ReplacingOutputFile&);
+
+private:
+    const std::string fileName_;
+    const std::string tempFileName_;
+    std::ofstream out_;
+    bool committed_;
+};
+
+} // namespace Math
+
+#endif
+
@@ -0,0 +1,91 @@
+#ifndef COSMO_PP_MAPPED_MATRIX_HPP
+#define COSMO_PP_MAPPED_MATRIX_HPP
+
+#include <macros.hpp>
+#include <matrix.hpp>
+#include <mapped_file.hpp>
+
+namespace Math
+{
+
+/// A read-only matrix memory-mapped from a binary file.
+
+/// This is for large matrices (for example pixel space covariance matrices or mode coupling matrices) that take a long time to read with Matrix::readFromFile. Nothing is read when the file is opened, the pages are loaded from the file when they are first accessed, and the processes on the same node mapping the same file share one copy of the pages in memory.
+/// The files are written with writeIntoFile. The format has the header of MappedFile (a magic string, a version, a byte order tag and the size of the elements, followed by the symmetry flag and the dimensions), followed by the elements. The elements are in the same order as the storage of Matrix (row major) or SymmetricMatrix (packed), so copyTo is a single copy.
+/// Files written on a machine with a different byte order cannot be mapped (an exception is thrown).
+class MappedMatrix
+{
+public:
+    /// Constructor. Memory-maps the file. Throws an exception if the file cannot be opened or is not a valid matrix file.
+    /// \param fileName The name of the file, written by writeIntoFile.
+    MappedMatrix(const char* fileName);
+
+    /// Write a Matrix or a SymmetricMatrix into a file that can be memory-mapped. The file is written into a temporary file first and then renamed, so matrices mapped from the old file stay valid.
+    /// \param mat The matrix.
+    /// \param fileName The name of the file.
+    static void writeIntoFile(const Matrix<double>& mat, const char* fileName);
+
+    /// Write the storage of a matrix into a file that can be memory-mapped.
+    /// \param rows The number of rows.
+    /// \param cols The number of columns.
+    /// \param symmetric If the matrix is symmetric. Then rows must be equal to cols and the data is the packed upper triangle in column major order (the storage of SymmetricMatrix and CMatrix), otherwise it is the full matrix in row major order.
+    /// \param data The elements.
+    /// \param fileName The name of the file.
+    static void writeIntoFile(int rows, int cols, bool symmetric, const double* data, const char* fileName);
+
+    /// Check if a file starts with the header of the format written by writeIntoFile, for example to support both this format and a text format for the same input.
+    /// \param fileName The name of the file.
+    /// \return true if the file exists and starts with the magic string of the format.
+    static bool isMappedMatrixFile(const char* fileName);
+
+    /// The number of rows.
+    int rows() const { return rows_; }
+
+    /// The number of columns.
+    int cols() const { return cols_; }
+
+    /// Is the matrix symmetric (stored in the packed format).
+    bool isSymmetric() const { return symmetric_; }
+
+    /// Element access.
+    /// \param i The row index.
+    /// \param j The column index.
+    /// \return The (i, j) element.
+    double operator()(int i, int j) const
+    {
+        check(i >= 0 && i < rows_, "invalid index " << i);
+        check(j >= 0 && j < cols_, "invalid index " << j);
+        if(!symmetric_)
+            return data_[(unsigned long)(i) * cols_ + j];
+        if(i < j)
+            return data_[(unsigned long)(j) * (j + 1) / 2 + i];
+        return data_[(unsigned long)(i) * (i + 1) / 2 + j];
+    }
+
+    /// The mapped elements, in the storage order of Matrix or SymmetricMatrix.
+    const double* data() const { return data_; }
+
+    /// The number of stored elements.
+    unsigned long size() const { return size_; }
+
+    /// Copy into a matrix, for example to factorize it.
+    /// \param res The matrix to copy into. Must be a SymmetricMatrix if this matrix is symmetric.
+    void copyTo(Matrix<double>* res) const;
+
+private:
+    MappedMatrix(const MappedMatrix&);
+    MappedMatrix& operator=(const MappedMatrix&);
+
+private:
+    int rows_, cols_;
+    bool symmetric_;
+    unsigned long size_;
+    const double* data_;
+
+    MappedFile file_;
+};
+
+} // namespace Math
+
+#endif
+
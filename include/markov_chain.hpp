@@ -5,17 +5,21 @@
 #include <limits>
 #include <ctime>
 #include <set>
+#include <string>
+#include <utility>
 
 #include <macros.hpp>
 #include <function.hpp>
 #include <table_function.hpp>
 #include <random.hpp>
 
+class MappedSharedBinaryChain;
+
 /// Posterior distribution for one parameter.
 class Posterior1D : public Math::RealFunction
 {
 public:
-    enum SmoothingMethod { GAUSSIAN_SMOOTHING = 0, SPLINE_SMOOTHING, SMOOTHING_MAX };
+    enum SmoothingMethod { GAUSSIAN_SMOOTHING = 0, SPLINE_SMOOTHING, BINNED_GAUSSIAN_SMOOTHING, SMOOTHING_MAX };
 public:
     ///Constructior.
     Posterior1D(int seed = 0) : smooth_(NULL), cumulInv_(NULL), min_(std::numeric_limits<double>::max()), max_(-std::numeric_limits<double>::max()), minLike_(std::numeric_limits<double>::max()), generator_((seed == 0 ? std::time(0) : seed), 1e-5, 1.0 - 1e-5), method_(SMOOTHING_MAX) {}
@@ -29,8 +33,17 @@ public:
     /// \param like The likelihood value for that given parameter value.
     void addPoint(double x, double prob, double like, double errMean = 0, double errVar = 0);
 
+    /// Add many sample points at once. All of the sample points must be added before generating the distribution with generate.
+    /// \param x The values of the parameter (passed as a pointer to the first element).
+    /// \param prob The probabilities (weights) of the sample points.
+    /// \param like The likelihood values for the sample points.
+    /// \param n The number of the sample points.
+    /// \param errMean The means of the likelihood errors for the sample points. If NULL, they are all set to 0.
+    /// \param errVar The variances of the likelihood errors for the sample points. If NULL, they are all set to 0.
+    void addPoints(const double* x, const double* prob, const double* like, unsigned long n, const double* errMean = NULL, const double* errVar = NULL);
+
     /// Generate the distribution. This function should be called after all of the sample points have been added with addPoint.
-    /// \param method The smoothing method. Can be GAUSSIAN_SMOOTHING for Gaussian smoothing or SPLINE_SMOOTHING for cubic spline smoothing.
+    /// \param method The smoothing method. Can be GAUSSIAN_SMOOTHING for Gaussian smoothing, SPLINE_SMOOTHING for cubic spline smoothing, or BINNED_GAUSSIAN_SMOOTHING for Gaussian smoothing of the points binned onto a fine grid using the fast Fourier transform (much faster for large numbers of points).
     /// \param scale The smoothing scale. For Gaussian smoothing this is simply the smoothing scale. For spline smoothing this determines the distance between the points used for constructing the cubic spline. If not specified, the scale will be automatically determined from the number of sample points and their overall range.
     void generate(SmoothingMethod method = GAUSSIAN_SMOOTHING, double scale = 0);
 
@@ -77,16 +90,32 @@ public:
     /// Calculate the distribution at a given point. Must be called after calling generate.
     virtual double evaluate(double x) const { check(smooth_, "not generated"); const double res = smooth_->evaluate(x) / norm_; return (res >= 0.0 ? res : 0.0); }
 
+    /// Calculate the distribution at many points at once, with a single call of the batch evaluation of the smoother. Must be called after calling generate.
+    /// \param n The number of points.
+    /// \param x The points.
+    /// \param res The results will be written here, must have n elements.
+    virtual void evaluate(unsigned long n, const double* x, double* res) const;
+
     double evaluateError(double x) const;
 
     /// Generate a random sample from this distribution
     double generateSample() { return cumulInv_->evaluate(generator_.generate() * norm_); }
 
+    /// Generate many random samples from this distribution at once. Must be called after calling generate.
+    /// \param n The number of samples.
+    /// \param samples The samples will be written here, must have n elements.
+    /// \param sorted If true, sorted uniform random numbers are generated directly (in linear time, from the normalized partial sums of exponential random numbers) and the inverse cumulative distribution is evaluated in a single pass over its points. The samples are then in increasing order, so shuffle them if the order matters.
+    void generateSamples(unsigned long n, double* samples, bool sorted = false);
+
     /// Write the distribution into a text file.
     /// \param fileName The name of the file.
     /// \param n The number of points (10,000 by default).
     void writeIntoFile(const char* fileName, int n = 10000, bool includeError = false) const;
 
+private:
+    void generateBinned(double scale, int resolution);
+    void generateCumulInv(int N);
+
 private:
     double min_, max_;
     double minLike_, maxLikePoint_;
@@ -96,7 +125,7 @@ private:
     std::vector<double> errMean_, errVar_;
     Math::RealFunction* smooth_;
     SmoothingMethod method_;
-    Math::TableFunction<double, double>* cumulInv_;
+    Math::FlatTableFunction<double, double>* cumulInv_;
     double norm_;
     double deltaNorm_;
 
@@ -106,6 +135,8 @@ private:
 /// Posterior distribution for two parameters. This is useful for making contour plots.
 class Posterior2D : public Math::Function2<double, double, double>
 {
+public:
+    enum SmoothingMethod { GAUSSIAN_SMOOTHING = 0, BINNED_GAUSSIAN_SMOOTHING, SMOOTHING_MAX };
 public:
     /// Constructor.
     Posterior2D() : smooth_(NULL), cumulInv_(NULL), min1_(std::numeric_limits<double>::max()), min2_(std::numeric_limits<double>::max()), max1_(-std::numeric_limits<double>::max()), max2_(-std::numeric_limits<double>::max()), minLike_(std::numeric_limits<double>::max()) {}
@@ -120,10 +151,19 @@ public:
     /// \param like The likelihood value for those given parameter values.
     void addPoint(double x1, double x2, double prob, double like);
 
+    /// Add many sample points at once. All of the sample points must be added before generating the distribution with generate.
+    /// \param x1 The values of the first parameter (passed as a pointer to the first element).
+    /// \param x2 The values of the second parameter.
+    /// \param prob The probabilities (weights) of the sample points.
+    /// \param like The likelihood values for the sample points.
+    /// \param n The number of the sample points.
+    void addPoints(const double* x1, const double* x2, const double* prob, const double* like, unsigned long n);
+
     /// Generate the distribution. This function should be called after all of the sample points have been added with addPoint. The distribution is smoothed using two dimensional Gaussian smoothing.
     /// \param scale1 The smoothing scale for parameter 1. If not specified, the scale will be automatically determined from the number of sample points and their overall range.
     /// \param scale2 The smoothing scale for parameter 2. If not specified, the scale will be automatically determined from the number of sample points and their overall range.
-    void generate(double scale1 = 0, double scale2 = 0);
+    /// \param method The smoothing method. Can be GAUSSIAN_SMOOTHING for smoothing a histogram of the points, or BINNED_GAUSSIAN_SMOOTHING for smoothing the points binned onto a fine grid using the fast Fourier transform.
+    void generate(double scale1 = 0, double scale2 = 0, SmoothingMethod method = GAUSSIAN_SMOOTHING);
 
     /// The minimum value of the first parameter.
     double min1() const { return min1_; }
@@ -146,6 +186,11 @@ public:
     /// The value of the distribution at the boundary of a region with a given confidence level.
     double getLevel(double confidence) const { check(cumulInv_, "not generated"); check (confidence >= 0 && confidence <= 1, "invalid confidence " << confidence); return cumulInv_->evaluate(confidence); }
 
+    /// The values of the distribution at the boundaries of the regions for many confidence levels at once.
+    /// \param confidences The confidence levels, between 0 and 1.
+    /// \param levels Upon return contains the value of the distribution for each confidence level, in the same order.
+    void getLevels(const std::vector<double>& confidences, std::vector<double>& levels) const { check(cumulInv_, "not generated"); levels.resize(confidences.size()); for(unsigned long i = 0; i < confidences.size(); ++i) levels[i] = getLevel(confidences[i]); }
+
     /// The value of the distribution at the boundary of the one sigma confidence region.
     double get1SigmaLevel() const { return getLevel(0.683); }
 
@@ -157,16 +202,23 @@ public:
     /// \param n The number of points in each dimension (1000 by default).
     void writeIntoFile(const char* fileName, int n = 1000) const;
 
+private:
+    Math::Function2<double, double, double>* histogramSmooth(int res1, int res2, double scale1, double scale2) const;
+    Math::Function2<double, double, double>* binnedSmooth(double scale1, double scale2) const;
+
 private:
     double min1_, min2_, max1_, max2_;
     double minLike_, maxLikePoint1_, maxLikePoint2_;
     std::vector<double> points1_, points2_, probs_;
     Math::Function2<double, double, double>* smooth_;
-    Math::TableFunction<double, double>* cumulInv_;
+    Math::FlatTableFunction<double, double>* cumulInv_;
     double norm_;
 };
 
 /// A class for analyzing one or more Markov chains.
+
+/// The chain is stored by columns: one contiguous array for each parameter, as well as for the weights and the likelihoods.
+/// The order of the elements sorted by likelihood is kept as a separate index permutation.
 class MarkovChain
 {
 public:
@@ -186,17 +238,20 @@ public:
 
 public:
     /// Constructor for the case of a single chain.
-    /// \param fileName The name of the file containing the chain.
+    /// \param fileName The name of the file containing the chain. If it is a shared chain file (see SharedBinaryChain), all of the chains in it are read, the burnin and the thinning are applied to each of them. Compressed chain files (see CompressedBinaryChain) are decompressed in parallel.
     /// \param burnin The number of elements to ignore from the beginning of the chain.
     /// \param thin The thinning factor. Must be positive.
-    MarkovChain(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1, const char *errorLogFileNameBase = NULL, int nError = 1);
+    /// \param countSteps If true, the weights must be positive integers, the multiplicities of the elements (for example from MetropolisHastings::setWeightedOutput), and the burnin and the thinning count the steps instead of the elements. An element of weight w stands for w steps, and it is kept with the number of its steps left after the burnin and the thinning as the weight, so the result is the same as from the chain with one element for each step.
+    MarkovChain(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1, const char *errorLogFileNameBase = NULL, int nError = 1, bool countSteps = false);
 
     /// Constructor for the case of multiple chains.
     /// \param nChains The number of chains.
-    /// \param fileNameRoot The root of the names of the files containing the chains. The actual file names should be this root followed by _ then the index of the chain (from 0 to nChains - 1) and then .txt
+    /// \param fileNameRoot The root of the names of the files containing the chains. The actual file names should be this root followed by _ then the index of the chain (from 0 to nChains - 1) and then .txt (or .bin for binary chains, which can also be compressed, see CompressedBinaryChain).
+    /// If the file (fileNameRoot).bin is a shared chain file (see SharedBinaryChain), the chains are read from it instead, and nChains must match the number of chains in it.
     /// \param burnin The number of elements to ignore from the beginning of the chain.
     /// \param thin The thinning factor. Must be positive.
-    MarkovChain(int nChains, const char* fileNameRoot, unsigned long burnin = 0, unsigned int thin = 1, const char *errorLogFileNameBase = NULL);
+    /// \param countSteps Count the burnin and the thinning in steps for the chains with multiplicities (see the first constructor).
+    MarkovChain(int nChains, const char* fileNameRoot, unsigned long burnin = 0, unsigned int thin = 1, const char *errorLogFileNameBase = NULL, bool countSteps = false);
 
     /// Destructor.
     ~MarkovChain();
@@ -205,10 +260,40 @@ public:
     /// \param fileName The name of the file containing the chain.
     /// \param burnin The number of elements to ignore from the beginning of the chain.
     /// \param thin The thinning factor. Must be positive.
-    void addFile(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1);
+    /// \param countSteps Count the burnin and the thinning in steps for the chains with multiplicities (see the first constructor).
+    void addFile(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1, bool countSteps = false);
 
     /// Returns the number of parameters.
     int nParams() const { return nParams_; }
+
+    /// Returns the number of elements in the chain.
+    unsigned long size() const { return probs_.size(); }
+
+    /// The weight of a given element.
+    double prob(unsigned long i) const { check(i < probs_.size(), "invalid index " << i); return probs_[i]; }
+
+    /// -2ln(likelihood) of a given element.
+    double like(unsigned long i) const { check(i < likes_.size(), "invalid index " << i); return likes_[i]; }
+
+    /// The value of a given parameter for a given element.
+    double param(unsigned long i, int paramIndex) const { check(paramIndex >= 0 && paramIndex < nParams_, "invalid parameter index " << paramIndex); check(i < params_[paramIndex].size(), "invalid index " << i); return params_[paramIndex][i]; }
+
+    /// All of the values of a given parameter, in the order of the elements.
+    const std::vector<double>& paramColumn(int paramIndex) const { check(paramIndex >= 0 && paramIndex < nParams_, "invalid parameter index " << paramIndex); return params_[paramIndex]; }
+
+    /// The weights of all of the elements.
+    const std::vector<double>& probColumn() const { return probs_; }
+
+    /// -2ln(likelihood) of all of the elements.
+    const std::vector<double>& likeColumn() const { return likes_; }
+
+    /// The indices of the elements sorted by increasing -2ln(likelihood).
+    const std::vector<unsigned long>& sortedIndices() const { return sorted_; }
+
+    /// Get a given element.
+    /// \param i The index of the element.
+    /// \param elem The element will be written here.
+    void getElement(unsigned long i, Element& elem) const;
     
     /// Get the one dimensional marginalized posterior distribution for a given parameter.
     /// \param paramIndex The index of the parameter, starting from 0.
@@ -222,8 +307,19 @@ public:
     /// \param paramIndex2 The index of the second parameter, starting from 0.
     /// \param scale1 The smoothing scale for parameter 1. If not specified, the scale will be automatically determined from the number of sample points and their overall range.
     /// \param scale2 The smoothing scale for parameter 2. If not specified, the scale will be automatically determined from the number of sample points and their overall range.
+    /// \param method The smoothing method. Can be Posterior2D::GAUSSIAN_SMOOTHING or Posterior2D::BINNED_GAUSSIAN_SMOOTHING.
     /// \return A pointer to the generated distribution. Must be deleted after using.
-    Posterior2D* posterior(int paramIndex1, int paramIndex2, double scale1 = 0, double scale2 = 0) const;
+    Posterior2D* posterior(int paramIndex1, int paramIndex2, double scale1 = 0, double scale2 = 0, Posterior2D::SmoothingMethod method = Posterior2D::GAUSSIAN_SMOOTHING) const;
+
+    /// Get many one and two dimensional marginalized posterior distributions at once, for example all of the distributions needed for a triangle plot.
+    /// The distributions are generated in parallel. The results are the same as from calling posterior for each of them separately.
+    /// \param paramIndices1D The indices of the parameters for which the one dimensional distributions are needed.
+    /// \param paramIndices2D The pairs of the parameter indices for which the two dimensional distributions are needed.
+    /// \param posts1D Upon return contains the one dimensional distributions, in the same order as paramIndices1D. Must be deleted after using.
+    /// \param posts2D Upon return contains the two dimensional distributions, in the same order as paramIndices2D. Must be deleted after using.
+    /// \param method The smoothing method for the one dimensional distributions.
+    /// \param method2D The smoothing method for the two dimensional distributions.
+    void posteriors(const std::vector<int>& paramIndices1D, const std::vector<std::pair<int, int> >& paramIndices2D, std::vector<Posterior1D*>& posts1D, std::vector<Posterior2D*>& posts2D, Posterior1D::SmoothingMethod method = Posterior1D::GAUSSIAN_SMOOTHING, Posterior2D::SmoothingMethod method2D = Posterior2D::GAUSSIAN_SMOOTHING) const;
 
     /// -2ln(likelihood) for the maximum likelihood point.
     double maxLike() const { return minLike_; }
@@ -232,13 +328,54 @@ public:
     /// \param container A vector where the elements will be written.
     /// \param pUpper The upper end of the confidence range.
     /// \param pLower The lower end of the confidence range.
-    void getRange(std::vector<Element*>& container, double pUpper = 0.683, double pLower = 0) const;
+    void getRange(std::vector<Element>& container, double pUpper = 0.683, double pLower = 0) const;
+
+    /// Get the indices of the points from at a given confidence level. Same as above, but only the indices of the elements are returned.
+    /// \param indices A vector where the indices of the elements will be written.
+    /// \param pUpper The upper end of the confidence range.
+    /// \param pLower The lower end of the confidence range.
+    void getRange(std::vector<unsigned long>& indices, double pUpper = 0.683, double pLower = 0) const;
+
+    /// The -2ln(likelihood) thresholds for many confidence levels at once, i.e. the likelihood of the last element of the range getRange would give for each level. The cumulative probabilities are calculated once when the chain is read, so each level only takes a binary search.
+    /// \param pUppers The confidence levels, between 0 and 1.
+    /// \param likeLevels Upon return contains the -2ln(likelihood) threshold for each level, in the same order.
+    void getLikeLevels(const std::vector<double>& pUppers, std::vector<double>& likeLevels) const;
+
+    /// The effective sample sizes of all of the parameters, from the integrated autocorrelation times calculated with the fast Fourier transform (see Math::integratedAutocorrelationTime). The parameters are done in parallel if OpenMP is enabled.
+    /// The weights are taken to be the numbers of repetitions of the elements (as written by MetropolisHastings) rounded to the nearest integer, and the autocorrelations are calculated for the chain with the elements repeated. Several chains are joined one after the other.
+    /// \param ess Upon return contains the effective sample size of each parameter.
+    /// \param tau If not NULL, the integrated autocorrelation time of each parameter (in steps of the chain with the elements repeated) will be returned here.
+    void effectiveSampleSizes(std::vector<double>& ess, std::vector<double>* tau = NULL) const;
+
+    /// The effective sample size of one parameter, see effectiveSampleSizes.
+    /// \param paramIndex The index of the parameter.
+    double effectiveSampleSize(int paramIndex) const;
 
 private:
-    void readFile(const char* fileName, unsigned long burnin, unsigned int thin, std::vector<Element*>& bigChain, double& maxP);
-    void filterChain(std::vector<Element*>& bigChain, double minP);
+    struct ChainColumns
+    {
+        ChainColumns() : maxP(std::numeric_limits<double>::min()), minLike(std::numeric_limits<double>::max()) {}
+
+        std::vector<double> probs, likes, errMeans, errVars;
+        std::vector<std::vector<double> > params;
+        double maxP, minLike;
+
+        unsigned long size() const { return probs.size(); }
+        void resize(int n);
+        void filter(double minP, bool parallel);
+    };
+
+    void readFile(const char* fileName, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const;
+    void readBinaryFile(const char* fileName, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const;
+    void readCompressedFile(const char* fileName, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const;
+    void readSharedChain(const MappedSharedBinaryChain& mapped, int chain, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const;
+    void addElement(ChainColumns& part, double prob, double like, const double* params, int& found, int& notFound) const;
+    void mergeParts(std::vector<ChainColumns>& parts, const std::vector<std::string>& fileNames);
+    void sortChain();
+    unsigned long rangeEnd(double p) const;
     
     void readErrorFiles(int nError, const char *fileNameBase);
+    bool findError(const double* params, int nParams, double like, double& errMean, double& errVar) const;
 
 private:
     struct ErrorEntry
@@ -255,7 +392,10 @@ private:
     };
 
 private:
-    std::vector<Element*> chain_;
+    std::vector<double> probs_, likes_, errMeans_, errVars_;
+    std::vector<std::vector<double> > params_;
+    std::vector<unsigned long> sorted_;
+    std::vector<double> cumulProbs_;
     int nParams_;
     double minLike_;
 
@@ -14,7 +14,7 @@ public:
     /// \param originalMask The original mask to be apodized.
     MaskApodizer(const Healpix_Map<double>& originalMask) : mask_(originalMask) {}
 
-    /// Perform the apodization.
+    /// Perform the apodization. The distance of each pixel from the edge of the mask is found with a k-d tree of the edge pixels, in parallel (OpenMP).
     /// \param type The apodization type.
     /// \param angle The apodization angle.
     /// \param result The resulting apodized mask will be written here.
@@ -24,6 +24,7 @@ private:
     double correctTheta(double theta) const;
     double cosApodization(double sigma, double x) const;
     double gaussApodization(double sigma, double x) const;
+    void pixelVector(const Healpix_Map<double>& map, long i, double* v) const;
 
 private:
     const Healpix_Map<double>& mask_;
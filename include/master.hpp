@@ -18,7 +18,7 @@ class Master
 public:
     /// Constructor.
     /// \param mask A reference to the mask (can be weights too).
-    /// \param couplingKernelFileName The name of the file containing the coupling kernel of the mask. Can be calculated using calculateCouplingKernel.
+    /// \param couplingKernelFileName The name of the file containing the coupling kernel of the mask (binary or text). Can be calculated using calculateCouplingKernel. "NA" calculates the kernel. If this is a directory, it is used as a cache of kernels: the kernel is read from the file given by couplingKernelCacheFileName for the pseudo-spectrum of the mask, or calculated and saved there if that does not exist.
     /// \param beam The beam function (including the pixel window function). The index is l.
     /// \param bins Specify this if you want to calculate the power spectrum on bins. Give NULL otherwise and it will calculate it for all l. The vector should contain the l values of the starting points of the bins. The last value will be an upper limit for the last bin. If this parameter is not NULL, the parameter lMax needs to be 0.
     /// \param lMax The maximum value of l up to which the power spectrum should be calculated. If bins are specified this value should be left to its default value of 0.
@@ -26,7 +26,7 @@ public:
 
     /// Constructor.
     /// \param maskName The name of the fits file containing the mask.
-    /// \param couplingKernelFileName The name of the file containing the coupling kernel of the mask. Can be calculated using calculateCouplingKernel.
+    /// \param couplingKernelFileName The name of the file containing the coupling kernel of the mask (binary or text). Can be calculated using calculateCouplingKernel. "NA" calculates the kernel. If this is a directory, it is used as a cache of kernels: the kernel is read from the file given by couplingKernelCacheFileName for the pseudo-spectrum of the mask, or calculated and saved there if that does not exist.
     /// \param beam The beam function (including the pixel window function). The index is l.
     /// \param bins Specify this if you want to calculate the power spectrum on bins. Give NULL otherwise and it will calculate it for all l. The vector should contain the l values of the starting points of the bins. The last value will be an upper limit for the last bin. If this parameter is not NULL, the parameter lMax needs to be 0.
     /// \param lMax The maximum value of l up to which the power spectrum should be calculated. If bins are specified this value should be left to its default value of 0.
@@ -39,11 +39,28 @@ public:
     /// Calculate the power spectrum for a given map.
     /// \param mapName The name of the fits file containing the map.
     void calculate(const char* mapName);
+
+    /// Calculate the power spectra of many maps at once. The masked maps are transformed together (see SphericalHarmonicTransform) and the estimator K^-1 P (the inverse of the binned coupling kernel times the binning operator, computed once in the constructor) is applied to all of the pseudo spectra with a single matrix product. This does not change powerSpectrum.
+    /// \param maps The maps. All of them are kept in memory together with their a_lm-s, so very many maps should be passed in chunks.
+    /// \param ps The power spectra, one vector for each map, in the same order as powerSpectrum.
+    void calculate(const std::vector<const Healpix_Map<double>*>& maps, std::vector<std::vector<double> >* ps) const;
     
     /// Retrieve the calculated power spectrum. Should be called after calculate.
     /// \return A constant reference to a map containing the power spectrum. The independent variable is l or the mid-points of bins if binning has been used.
     const std::map<double, double>& powerSpectrum() const { return ps_; }
 
+    /// Monte-Carlo simulations for the error bars of the power spectrum.
+
+    /// The maps are simulated with the given C_l-s and the beam (and white noise if given), masked, and the power spectrum is estimated the same way as in calculate. Only the mean and the covariance of the estimates are accumulated, the maps are not stored.
+    /// The simulations are split between the MPI processes and the threads (OpenMP), all of the processes must call this function at the same time and they all get the result. The seeds of each simulation are determined from seed and the index of the simulation, so the result does not depend on the number of processes or threads.
+    /// \param cl The C_l-s of the simulated maps (without the beam). The index is l, must contain at least up to lMax.
+    /// \param noise The white noise per pixel, 0 for no noise.
+    /// \param nSims The total number of simulations, at least 2.
+    /// \param seed The random seed.
+    /// \param mean The mean of the estimated power spectra will be written here, in the same order as powerSpectrum.
+    /// \param covariance The covariance matrix of the estimated power spectra will be written here.
+    void simulate(const std::vector<double>& cl, double noise, int nSims, unsigned long seed, std::vector<double>* mean, Math::Matrix<double>* covariance) const;
+
     /// Retrieve the calculated pseudo power spectrum. Should be called after calculate.
     /// \return A constant reference to a vector containing the pseudo power spectrum. The index is l.
     const std::vector<double>& getPseudoSpectrum() const { return c_; }
@@ -52,8 +69,16 @@ public:
     /// \return A constant reference to a vector containing the mask pseudo power spectrum. The index is l.
     const std::vector<double>& getMaskPseudoSpectrum() const { return w_; }
 
-    /// Calculate and store the coupling kernel for a given mask.
-    /// \param w A vector containing the weights of each pixel.
+    /// Calculate the coupling kernel for a given mask pseudo-spectrum.
+
+    /// The rows of l1 are calculated in parallel (OpenMP), with all of the l3 for each pair (l1, l2) from a single recursion of the Wigner 3j symbols (see Math::wigner3jZeroMRow).
+    /// \param w The pseudo-spectrum of the mask. The index is l.
+    /// \param lMax The maximum value of l.
+    /// \param kernel The kernel will be written here, the size is (lMax + 1) x (lMax + 1).
+    static void calculateCouplingKernel(const std::vector<double>& w, int lMax, Math::Matrix<double>* kernel);
+
+    /// Calculate and store the coupling kernel for a given mask. The file is written in the binary format of Math::MappedMatrix (which is also read by LikelihoodHigh).
+    /// \param w The pseudo-spectrum of the mask. The index is l.
     /// \param lMax The maximum value of l.
     /// \param fileName The name of the file where the result should be stored.
     static void calculateCouplingKernel(const std::vector<double>& w, int lMax, const char* fileName);
@@ -69,6 +94,13 @@ public:
     /// \param lMax The maximum value of l.
     /// \param fileName The name of the file where the result should be stored.
     static void calculateCouplingKernel(const char* maskName, int lMax, const char* fileName);
+
+    /// The name of the file in a cache directory for the coupling kernel of a mask.
+    /// \param directory The cache directory.
+    /// \param w The pseudo-spectrum of the mask. The index is l.
+    /// \param lMax The maximum value of l.
+    /// \return The file name, containing a hash of the pseudo-spectrum up to lMax and lMax.
+    static std::string couplingKernelCacheFileName(const char* directory, const std::vector<double>& w, int lMax);
     
 private:
     void construct(const std::vector<int>* bins, int lMax);
@@ -76,9 +108,10 @@ private:
     void calculateCoupling();
     void calculateK();
     void calculatePS();
-    
-    double p(int b, int l) const;
-    double q(int l, int b) const;
+    int numBins() const;
+    double binCenter(int b) const;
+    void estimate(const std::vector<double>& c, std::vector<double>* res) const;
+    void calculateBinning();
     
 private:
     int lMax_;
@@ -92,6 +125,12 @@ private:
     
     std::vector<std::vector<double> > coupling_;
     Math::Matrix<double> k_, kInv_;
+
+    // the binning operator P has p_[l] in row binOfL_[l] (-1 if l is not in any bin), the reverse operator Q has q_[l] in column binOfL_[l]
+    // the final estimator K^-1 P is precomputed, with one row for each bin and one column for each l
+    std::vector<int> binOfL_;
+    std::vector<double> p_, q_;
+    Math::Matrix<double> estimator_;
     
     std::map<double, double> ps_;
 };
@@ -2,8 +2,11 @@
 #define COSMO_PP_MATRIX_HPP
 
 #include <macros.hpp>
+#include <vector_kernels.hpp>
+#include <first_touch.hpp>
 
 #include <vector>
+#include <algorithm>
 
 namespace Math
 {
@@ -35,6 +38,10 @@ public:
     /// \param other Another matrix to copy from.
     Matrix(const Matrix<DataType>& other);
 
+    /// Move constructor. The storage of other is taken over, so no elements are copied (unless other is a symmetric matrix, which has a different storage).
+    /// \param other Another matrix to move from. It is left empty.
+    Matrix(Matrix<DataType>&& other);
+
     /// Constructor. Creates a single row or column matrix.
     /// \param vec An array of elemnts to initialize the matrix with.
     /// \param columnVector Specifies whether the vector should be a column (true, by default), or a row (false) of the matrix.
@@ -108,10 +115,19 @@ public:
     /// \return A reference to self after the assignment.
     Matrix<DataType>& operator=(const Matrix<DataType>& other) { copy(other); return *this; }
 
+    /// Move assignment operator. The storage of other is taken over if both matrices are of the same type, otherwise other is copied.
+    /// \param other Another matrix to move from.
+    /// \return A reference to self after the assignment.
+    Matrix<DataType>& operator=(Matrix<DataType>&& other) { if(isSymmetric() == other.isSymmetric()) swapStorage(other); else copy(other); return *this; }
+
     /// Add another matrix to this matrix (element by element).
     /// \param other The matrix to add.
     virtual void add(const Matrix<DataType>& other);
 
+    /// Multiply all of the elements by a number.
+    /// \param c The number to multiply with.
+    void scale(DataType c) { if(!v_.empty()) VectorKernels::scale(long(v_.size()), c, &(v_[0])); }
+
     /// Add two matrices and write the result into a third one. This is the recommended way to do matrix addition, instead of using the operator +.
     /// \param a The first matrix to add.
     /// \param b The second matrix to add.
@@ -150,13 +166,15 @@ public:
 
     /// Multiply this matrix with another matrix (this is lhs, other matrix is rhs).
     /// \param other The other matrix.
-    void multiply(const Matrix<DataType>& other) { Matrix<DataType> x; multiplyMatrices(*this, other, &x); copy(x); }
+    void multiply(const Matrix<DataType>& other) { Matrix<DataType> x; multiplyMatrices(*this, other, &x); swapStorage(x); }
 
     /// Multiply two matrices and write the result into a third one. This is the recommended way to do matrix multiplication, instead of using the operator *.
     /// \param a The left hand side matrix.
     /// \param b The right hand side matrix.
     /// \param res A pointer to a matrix where the result will be written.
-    static void multiplyMatrices(const Matrix<DataType>& a, const Matrix<DataType>& b, Matrix<DataType>* res);
+    /// \param transposeA Multiply with the transpose of a instead. The transpose is not formed explicitly.
+    /// \param transposeB Multiply with the transpose of b instead. The transpose is not formed explicitly.
+    static void multiplyMatrices(const Matrix<DataType>& a, const Matrix<DataType>& b, Matrix<DataType>* res, bool transposeA = false, bool transposeB = false);
 
     /// Multiply this matrix with another matrix (this is lhs).
     /// \param other The other matrix (rhs).
@@ -177,7 +195,7 @@ public:
     virtual Matrix<DataType> getTranspose() const { Matrix<DataType> res; getTranspose(&res); return res; }
     
     /// Transpose the matrix (in place).
-    virtual void transpose() { Matrix<DataType> x; getTranspose(&x); copy(x); }
+    virtual void transpose() { Matrix<DataType> x; getTranspose(&x); swapStorage(x); }
 
     /// Is this a symmetric matrix. Note that this function does not explicitly check all the elements, it just checks the type (because SymmetricMatrix is a subclass of Matrix). For the Matrix class the result is always false.
     virtual bool isSymmetric() const { return false; }
@@ -223,10 +241,20 @@ public:
 #endif
 
 protected:
+    // the storage is not initialized by the allocation, so on NUMA nodes its pages are placed by the threads that fill it (see FirstTouchAllocator)
+    typedef std::vector<DataType, FirstTouchAllocator<DataType> > StorageType;
+
     void checkIndices(int i, int j) const;
+    void swapStorage(Matrix<DataType>& other) { v_.swap(other.v_); std::swap(rows_, other.rows_); std::swap(cols_, other.cols_); }
+
+    // allocates the storage for rows_ x cols_ and fills it with val, the rows split between the threads like the parallel loops over the rows
+    void initializeStorage(DataType val) { v_.clear(); v_.resize(rows_ * cols_); if(!v_.empty()) firstTouchFill(&(v_[0]), rows_, cols_, val); }
+
+    // a copy of the storage of another matrix of the same kind, in parallel
+    void copyStorage(const StorageType& other) { v_.clear(); v_.resize(other.size()); if(!v_.empty()) firstTouchCopy(long(v_.size()), &(other[0]), &(v_[0])); }
 
 protected:
-    std::vector<DataType> v_;
+    StorageType v_;
     int rows_;
     int cols_;
 };
@@ -246,6 +274,10 @@ private:
     using BaseType::cols_;
     using BaseType::v_;
     using BaseType::checkIndices;
+    using BaseType::copyStorage;
+
+    // allocates the packed storage and fills it with val (see Matrix::initializeStorage)
+    void initializePackedStorage(DataType val) { v_.clear(); v_.resize(rows_ * (rows_ + 1) / 2); if(!v_.empty()) firstTouchFillPacked(&(v_[0]), rows_, val); }
 
 public:
     /// Default constructor. Constructs an empty matrix.
@@ -266,6 +298,20 @@ public:
     /// \param other Another matrix to copy from.
     SymmetricMatrix(const SymmetricMatrix<DataType>& other);
 
+    /// Move constructor. The storage of other is taken over.
+    /// \param other Another matrix to move from. It is left empty.
+    SymmetricMatrix(SymmetricMatrix<DataType>&& other) : BaseType() { this->swapStorage(other); }
+
+    /// Assignment operator.
+    /// \param other Another matrix to copy from.
+    /// \return A reference to self after the assignment.
+    SymmetricMatrix<DataType>& operator=(const SymmetricMatrix<DataType>& other) { copy(other); return *this; }
+
+    /// Move assignment operator. The storage of other is taken over.
+    /// \param other Another matrix to move from.
+    /// \return A reference to self after the assignment.
+    SymmetricMatrix<DataType>& operator=(SymmetricMatrix<DataType>&& other) { this->swapStorage(other); return *this; }
+
     /// Destructor.
     virtual ~SymmetricMatrix() {}
 
@@ -364,7 +410,7 @@ public:
     /// This function should NOT be called for SymmetricMatrix. Calling this function will throw an excpetion (if checks are on).
     virtual double logDetFromLUFactorization(std::vector<int> *pivot, int *sign) const { check(false, "cannot LU factorize a symmetric matrix"); return 0; }
 
-    /// Cholesky factorize the matrix (in place)
+    /// Cholesky factorize the matrix (in place). Large matrices are factorized in the rectangular full packed format, which needs a temporary copy of the packed storage but uses level 3 BLAS.
     int choleskyFactorize();
 
     /// Invert the matrix. This function should be called after choleskyFactorize.
@@ -399,6 +445,30 @@ public:
     /// \param positiveDefinite If the matrix is positive definite or not. A different method will be used for positive definite matrices, which may give more accurate results.
     /// \return 0 if successful, otherwise an error code (see Lapack documentation).
     int getEigen(std::vector<double>* eigenvals, Matrix<double>* eigenvecs, bool positiveDefinite = false) const;
+
+    /// Get the eigenvalues of the matrix only. This is much faster than calculating the eigenvectors too.
+    /// \param eigenvals A pointer to a vector where the eigenvalues will be written. The eigenvalues will be in ascending order.
+    /// \return 0 if successful, otherwise an error code (see Lapack documentation).
+    int getEigenvalues(std::vector<double>* eigenvals) const;
+
+    /// Get a range of the eigenvalues, given by their indices in ascending order, and the corresponding eigenvectors. Only the requested ones are calculated, so this is faster than getEigen when only a few eigenvectors are needed (for example the leading modes).
+    /// \param first The index of the first eigenvalue needed, 0 <= first <= last.
+    /// \param last The index of the last eigenvalue needed, last < number of rows. The leading k modes are given by first = rows - k, last = rows - 1.
+    /// \param eigenvals A pointer to a vector where the last - first + 1 eigenvalues will be written, in ascending order.
+    /// \param eigenvecs A pointer to a matrix where the eigenvectors will be written, as columns, in the same order as the eigenvalues. Can be NULL, then only the eigenvalues are calculated.
+    /// \return 0 if successful, otherwise an error code (see Lapack documentation).
+    int getEigenRange(int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs = NULL) const;
+
+    /// Get the eigenvalues in a given interval and the corresponding eigenvectors.
+    /// \param lower The lower bound of the interval (not included).
+    /// \param upper The upper bound of the interval (included).
+    /// \param eigenvals A pointer to a vector where the eigenvalues in the interval will be written, in ascending order.
+    /// \param eigenvecs A pointer to a matrix where the eigenvectors will be written, as columns, in the same order as the eigenvalues. Can be NULL, then only the eigenvalues are calculated.
+    /// \return 0 if successful, otherwise an error code (see Lapack documentation).
+    int getEigenValueRange(double lower, double upper, std::vector<double>* eigenvals, Matrix<double>* eigenvecs = NULL) const;
+
+private:
+    int getEigenSelected(char range, double lower, double upper, int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const;
 #endif
 };
 
@@ -28,7 +28,7 @@ Matrix<T>::Matrix(int rows, int cols)
 
     rows_ = rows;
     cols_ = cols;
-    v_.resize(rows_ * cols_);
+    initializeStorage(DataType());
 }
 
 template<typename T>
@@ -39,7 +39,7 @@ Matrix<T>::Matrix(int rows, int cols, DataType val)
 
     rows_ = rows;
     cols_ = cols;
-    v_.resize(rows_ * cols_, val);
+    initializeStorage(val);
 }
 
 template<typename T>
@@ -56,10 +56,33 @@ Matrix<T>::Matrix(const Matrix<DataType>& other)
     }
 }
 
+template<typename T>
+Matrix<T>::Matrix(Matrix<DataType>&& other)
+{
+    rows_ = other.rows_;
+    cols_ = other.cols_;
+
+    // the packed storage of a symmetric matrix cannot be taken over
+    if(other.isSymmetric())
+    {
+        v_.resize(rows_ * cols_);
+        for(int i = 0; i < rows_; ++i)
+        {
+            for(int j = 0; j < cols_; ++j)
+                v_[i * cols_ + j] = other(i, j);
+        }
+        return;
+    }
+
+    v_.swap(other.v_);
+    other.rows_ = 0;
+    other.cols_ = 0;
+}
+
 template<typename T>
 Matrix<T>::Matrix(const std::vector<DataType>& vec, bool columnVector)
 {
-    v_ = vec;
+    v_.assign(vec.begin(), vec.end());
     if(columnVector)
     {
         rows_ = vec.size();
@@ -81,8 +104,7 @@ Matrix<T>::resize(int rows, int cols)
 
     rows_ = rows;
     cols_ = cols;
-    v_.clear();
-    v_.resize(rows_ * cols_);
+    initializeStorage(DataType());
 }
 
 template<typename T>
@@ -94,8 +116,7 @@ Matrix<T>::resize(int rows, int cols, DataType val)
 
     rows_ = rows;
     cols_ = cols;
-    v_.clear();
-    v_.resize(rows_ * cols_, val);
+    initializeStorage(val);
 }
 
 template<typename T>
@@ -174,8 +195,7 @@ Matrix<T>::readFromFile(const char* fileName)
         throw exc;
     }
 
-    v_.clear();
-    v_.resize(rows_ * cols_);
+    initializeStorage(DataType());
 
     in.read((char*)(&(v_[0])), v_.size() * sizeof(DataType));
     in.close();
@@ -237,8 +257,7 @@ Matrix<T>::readFromTextFile(const char* fileName)
         throw exc;
     }
 
-    v_.clear();
-    v_.resize(rows_ * cols_);
+    initializeStorage(DataType());
     for(int i = 0; i < rows_; ++i)
     {
         for(int j = 0; j < cols_; ++j)
@@ -278,6 +297,15 @@ Matrix<T>::copy(const Matrix<DataType>& other)
     if(&other == this)
         return;
 
+    // the same storage, no need to go through the elements
+    if(!other.isSymmetric())
+    {
+        rows_ = other.rows_;
+        cols_ = other.cols_;
+        copyStorage(other.v_);
+        return;
+    }
+
     resize(other.rows(), other.cols());
 #pragma omp parallel for default(shared)
     for(int i = 0; i < rows_; ++i)
@@ -294,6 +322,13 @@ Matrix<T>::add(const Matrix<DataType>& other)
     check(rows_ == other.rows_, "cannot add matrices of different sizes");
     check(cols_ == other.cols_, "cannot add matrices of different sizes");
 
+    if(!other.isSymmetric())
+    {
+        if(!v_.empty())
+            VectorKernels::add(long(v_.size()), DataType(1), &(other.v_[0]), &(v_[0]));
+        return;
+    }
+
 #pragma omp parallel for default(shared)
     for(int i = 0; i < rows_; ++i)
     {
@@ -309,6 +344,13 @@ Matrix<T>::subtract(const Matrix<DataType>& other)
     check(rows_ == other.rows_, "cannot subtract matrices of different sizes");
     check(cols_ == other.cols_, "cannot subtract matrices of different sizes");
 
+    if(!other.isSymmetric())
+    {
+        if(!v_.empty())
+            VectorKernels::subtract(long(v_.size()), &(other.v_[0]), &(v_[0]));
+        return;
+    }
+
 #pragma omp parallel for default(shared)
     for(int i = 0; i < rows_; ++i)
     {
@@ -329,22 +371,34 @@ Matrix<T>::getTranspose(Matrix<DataType>* res) const
 
 template<typename T>
 void
-Matrix<T>::multiplyMatrices(const Matrix<DataType>& a, const Matrix<DataType>& b, Matrix<DataType>* res)
+Matrix<T>::multiplyMatrices(const Matrix<DataType>& a, const Matrix<DataType>& b, Matrix<DataType>* res, bool transposeA, bool transposeB)
 {
-    check(a.cols_ == b.rows_, "invalid multiplication, a must have the same number of columns as b rows");
+    const int m = (transposeA ? a.cols_ : a.rows_);
+    const int n = (transposeB ? b.rows_ : b.cols_);
+    const int l = (transposeA ? a.rows_ : a.cols_);
+    check(l == (transposeB ? b.cols_ : b.rows_), "invalid multiplication, a must have the same number of columns as b rows");
 
     check(!res->isSymmetric(), "the product of two matrices is not necessarily symmetric, even if both are");
 
-    res->resize(a.rows_, b.cols_);
+    // the result cannot be written over one of the operands
+    if(res == &a || res == &b)
+    {
+        Matrix<DataType> x;
+        multiplyMatrices(a, b, &x, transposeA, transposeB);
+        res->swapStorage(x);
+        return;
+    }
+
+    res->resize(m, n);
 
 #pragma omp parallel for default(shared)
-    for(int i = 0; i < a.rows_; ++i)
+    for(int i = 0; i < m; ++i)
     {
-        for(int j = 0; j < b.cols_; ++j)
+        for(int j = 0; j < n; ++j)
         {
             DataType x = 0;
-            for(int k = 0; k < a.cols_; ++k)
-                x += a(i, k) * b(k, j);
+            for(int k = 0; k < l; ++k)
+                x += (transposeA ? a(k, i) : a(i, k)) * (transposeB ? b(j, k) : b(k, j));
             (*res)(i, j) = x;
         }
     }
@@ -354,7 +408,7 @@ Matrix<T>::multiplyMatrices(const Matrix<DataType>& a, const Matrix<DataType>& b
 
 template<>
 void
-Matrix<double>::multiplyMatrices(const Matrix<double>& a, const Matrix<double>& b, Matrix<double>* res);
+Matrix<double>::multiplyMatrices(const Matrix<double>& a, const Matrix<double>& b, Matrix<double>* res, bool transposeA, bool transposeB);
 
 #endif
 
@@ -466,7 +520,7 @@ SymmetricMatrix<T>::SymmetricMatrix(int rows, int cols) : BaseType()
 
     rows_ = rows;
     cols_ = cols;
-    v_.resize(rows_ * (rows_ + 1) / 2);
+    initializePackedStorage(DataType());
 }
 
 template<typename T>
@@ -477,7 +531,7 @@ SymmetricMatrix<T>::SymmetricMatrix(int rows, int cols, DataType val) : BaseType
 
     rows_ = rows;
     cols_ = cols;
-    v_.resize(rows_ * (rows_ + 1) / 2, val);
+    initializePackedStorage(val);
 }
 
 template<typename T>
@@ -487,7 +541,7 @@ SymmetricMatrix<T>::SymmetricMatrix(const SymmetricMatrix<DataType>& other) : Ba
     cols_ = other.cols_;
     check(rows_ == cols_, "");
 
-    v_ = other.v_;
+    copyStorage(other.v_);
 }
 
 template<typename T>
@@ -517,8 +571,7 @@ SymmetricMatrix<T>::resize(int rows, int cols)
 
     rows_ = rows;
     cols_ = cols;
-    v_.clear();
-    v_.resize(rows_ * (rows_ + 1) / 2);
+    initializePackedStorage(DataType());
 }
 
 template<typename T>
@@ -530,8 +583,7 @@ SymmetricMatrix<T>::resize(int rows, int cols, DataType val)
 
     rows_ = rows;
     cols_ = cols;
-    v_.clear();
-    v_.resize(rows_ * (rows_ + 1) / 2, val);
+    initializePackedStorage(val);
 }
 
 template<typename T>
@@ -580,8 +632,7 @@ SymmetricMatrix<T>::readFromFile(const char* fileName)
 
     cols_ = rows_;
 
-    v_.clear();
-    v_.resize(rows_ * (rows_ + 1) / 2);
+    initializePackedStorage(DataType());
 
     in.read((char*)(&(v_[0])), v_.size() * sizeof(DataType));
     in.close();
@@ -652,8 +703,7 @@ SymmetricMatrix<T>::readFromTextFile(const char* fileName)
         throw exc;
     }
 
-    v_.clear();
-    v_.resize(rows_ * (rows_ + 1) / 2);
+    initializePackedStorage(DataType());
     for(int i = 0; i < rows_; ++i)
     {
         DataType x;
@@ -681,13 +731,10 @@ SymmetricMatrix<T>::copy(const Matrix<DataType>& other)
     
     check(other.isSymmetric(), "cannot copy from non-symmetric matrix to symmetric");
 
-    resize(other.rows(), other.cols());
-#pragma omp parallel for default(shared)
-    for(int i = 0; i < rows_; ++i)
-    {
-        for(int j = i; j < cols_; ++j)
-            (*this)(i, j) = other(i, j);
-    }
+    // the same packed storage
+    rows_ = other.rows();
+    cols_ = other.cols();
+    copyStorage(static_cast<const SymmetricMatrix<DataType>&>(other).v_);
 }
 
 template<typename T>
@@ -698,12 +745,9 @@ SymmetricMatrix<T>::add(const Matrix<DataType>& other)
     check(cols_ == other.cols(), "cannot add matrices of different sizes");
     check(other.isSymmetric(), "cannot add non-symmetric matrix to symmetric");
 
-#pragma omp parallel for default(shared)
-    for(int i = 0; i < rows_; ++i)
-    {
-        for(int j = i; j < cols_; ++j)
-            (*this)(i, j) += other(i, j);
-    }
+    // the same packed storage
+    if(!v_.empty())
+        VectorKernels::add(long(v_.size()), DataType(1), &(static_cast<const SymmetricMatrix<DataType>&>(other).v_[0]), &(v_[0]));
 }
 
 
@@ -715,12 +759,9 @@ SymmetricMatrix<T>::subtract(const Matrix<DataType>& other)
     check(cols_ == other.cols(), "cannot subtract matrices of different sizes");
     check(other.isSymmetric(), "cannot subtract non-symmetric matrix from symmetric");
 
-#pragma omp parallel for default(shared)
-    for(int i = 0; i < rows_; ++i)
-    {
-        for(int j = i; j < cols_; ++j)
-            (*this)(i, j) -= other(i, j);
-    }
+    // the same packed storage
+    if(!v_.empty())
+        VectorKernels::subtract(long(v_.size()), &(static_cast<const SymmetricMatrix<DataType>&>(other).v_[0]), &(v_[0]));
 }
 
 #ifdef COSMO_LAPACK
@@ -789,6 +830,38 @@ SymmetricMatrix<T>::getEigen(std::vector<double>* eigenvals, Matrix<double>* eig
     return -1;
 }
 
+template<typename T>
+int
+SymmetricMatrix<T>::getEigenvalues(std::vector<double>* eigenvals) const
+{
+    check(false, "");
+    return -1;
+}
+
+template<typename T>
+int
+SymmetricMatrix<T>::getEigenRange(int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const
+{
+    check(false, "");
+    return -1;
+}
+
+template<typename T>
+int
+SymmetricMatrix<T>::getEigenValueRange(double lower, double upper, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const
+{
+    check(false, "");
+    return -1;
+}
+
+template<typename T>
+int
+SymmetricMatrix<T>::getEigenSelected(char range, double lower, double upper, int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const
+{
+    check(false, "");
+    return -1;
+}
+
 template<>
 int
 SymmetricMatrix<double>::choleskyFactorize();
@@ -821,6 +894,22 @@ template<>
 int
 SymmetricMatrix<double>::getEigen(std::vector<double>* eigenvals, Matrix<double>* eigenvecs, bool positiveDefinite) const;
 
+template<>
+int
+SymmetricMatrix<double>::getEigenvalues(std::vector<double>* eigenvals) const;
+
+template<>
+int
+SymmetricMatrix<double>::getEigenRange(int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const;
+
+template<>
+int
+SymmetricMatrix<double>::getEigenValueRange(double lower, double upper, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const;
+
+template<>
+int
+SymmetricMatrix<double>::getEigenSelected(char range, double lower, double upper, int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const;
+
 
 #endif
 
@@ -0,0 +1,95 @@
+#ifndef COSMO_PP_MATTER_PS_EMULATOR_HPP
+#define COSMO_PP_MATTER_PS_EMULATOR_HPP
+
+#include <vector>
+#include <string>
+#include <cmath>
+
+#include <macros.hpp>
+#include <function.hpp>
+#include <table_function.hpp>
+#include <principal_components.hpp>
+#include <learn_as_you_go.hpp>
+
+/// A learn as you go emulator for the matter power spectrum P(k, z).
+
+/// The power spectrum is calculated by a given function on a fixed grid of k and z values (for example CMBMatterPs, which calls CLASS). The logarithm of the power spectrum is compressed onto its principal components, learned from the first compressionSamples exact calculations, and the coefficients are emulated with LearnAsYouGo.
+/// The error model of LearnAsYouGo is for the mean of ln P over the grid, so the precision is roughly the relative precision of P. If the estimated error is larger than the precision, the exact power spectrum is calculated (and added to the training set).
+/// With MPI the samples for the principal components are shared between the processes, so all of the processes must construct the object and make the same number of calls of calculate until the basis has been learned.
+class MatterPsEmulator
+{
+public:
+    /// Constructor.
+    /// \param ps The function calculating the power spectrum from the parameters. The output must have k.size() * z.size() positive values, P(k[i], z[j]) at index j * k.size() + i.
+    /// \param nParams The number of parameters.
+    /// \param k The k values of the grid, in increasing order.
+    /// \param z The redshifts of the grid, in increasing order.
+    /// \param fileName The name of the file for the training set. If it exists, the training set is read from it. The principal component basis is saved into a file with the same name followed by ".basis", and read from it if it exists. If empty, nothing is saved.
+    /// \param precision The precision of ln P. If the estimated error of the approximation is less than this precision then the approximation is used, otherwise the exact power spectrum is calculated.
+    /// \param minCount The minimum number of points in the training set for the approximation to be used.
+    /// \param compressionSamples The number of exact calculations (over all of the processes) from which the principal component basis is learned.
+    /// \param compressionTolerance The maximum fraction of the variance of ln P lost by the compression (see PrincipalComponents::learn).
+    MatterPsEmulator(const Math::RealFunctionMultiToMulti& ps, int nParams, const std::vector<double>& k, const std::vector<double>& z, const char* fileName = "", double precision = 0.01, unsigned long minCount = 2000, unsigned long compressionSamples = 200, double compressionTolerance = 1e-6);
+
+    /// Destructor. The training set is saved into the file.
+    ~MatterPsEmulator();
+
+    /// Calculate the power spectrum for given parameters, approximately if the approximation is acceptable. The result can be retrieved with getMatterPs or value.
+    /// \param params The parameters.
+    /// \param exact If true the exact power spectrum is calculated and added to the training set.
+    void calculate(const std::vector<double>& params, bool exact = false);
+
+    /// Check if the last call of calculate used the approximation.
+    bool lastApproximate() const { return lastApproximate_; }
+
+    /// The k values of the grid.
+    const std::vector<double>& k() const { return k_; }
+
+    /// The redshifts of the grid.
+    const std::vector<double>& z() const { return z_; }
+
+    /// The power spectrum from the last call of calculate at a grid point.
+    /// \param iz The index of the redshift.
+    /// \param ik The index of k.
+    double value(int iz, int ik) const { check(iz >= 0 && iz < z_.size(), "invalid index " << iz); check(ik >= 0 && ik < k_.size(), "invalid index " << ik); return std::exp(lnPs_[iz * k_.size() + ik]); }
+
+    /// Retrieves the power spectrum from the last call of calculate at a given redshift, the same way as CMB::getMatterPs. Between the redshifts of the grid ln P is linearly interpolated.
+    /// \param z The redshift, must be within the redshifts of the grid.
+    /// \param ps The power spectrum at the k values of the grid will be returned here.
+    void getMatterPs(double z, Math::TableFunction<double, double>* ps) const;
+
+    /// The emulator, NULL until the principal component basis has been learned.
+    LearnAsYouGo* emulator() { return layg_; }
+
+    /// The principal component basis of ln P.
+    const PrincipalComponents& principalComponents() const { return pca_; }
+
+private:
+    MatterPsEmulator(const MatterPsEmulator&);
+    MatterPsEmulator& operator = (const MatterPsEmulator&);
+
+    void learnCompression();
+    void createLearnAsYouGo();
+
+private:
+    const Math::RealFunctionMultiToMulti& ps_;
+    const int nParams_;
+    const std::vector<double> k_, z_;
+    const int nOut_;
+    std::string fileName_;
+    const double precision_;
+    const unsigned long minCount_;
+    const unsigned long compressionSamples_;
+    const double compressionTolerance_;
+
+    PrincipalComponents pca_;
+    void* func_;
+    void* errorFunc_;
+    LearnAsYouGo* layg_;
+
+    std::vector<double> samplePoints_, sampleData_;
+    std::vector<double> res_, lnPs_;
+    bool lastApproximate_;
+};
+
+#endif
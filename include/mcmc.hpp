@@ -9,13 +9,26 @@
 #include <cmath>
 #include <limits>
 #include <ctime>
+#include <cstdio>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <unistd.h>
 
 #include <macros.hpp>
+#include <cosmo_mpi.hpp>
 #include <exception_handler.hpp>
 #include <math_constants.hpp>
 #include <likelihood_function.hpp>
 #include <random.hpp>
 #include <matrix_impl.hpp>
+#include <chain_file.hpp>
+#include <checkpoint_coordinator.hpp>
+#include <fft.hpp>
+
+class MarkovChain;
 
 namespace Math
 {
@@ -63,7 +76,10 @@ private:
     enum PRIOR_MODE { UNIFORM_PRIOR = 0, GAUSSIAN_PRIOR, PRIOR_MODE_MAX };
 
 public:
-    enum CONVERGENCE_DIAGNOSTIC { GELMAN_RUBIN = 0, ACCURACY, CONVERGENCE_DIAGNOSTIC_MAX };
+    /// The convergence diagnostics. GELMAN_RUBIN needs several chains and stops when (R - 1) is small enough for all of the parameters. ACCURACY stops when the standard deviations of the means of all of the parameters (from the batch means of the chains) are smaller than the accuracies given in setParam. EFFECTIVE_SAMPLE_SIZE stops when the effective sample sizes of all of the parameters (from the integrated autocorrelation times calculated with the fast Fourier transform, combined over the chains) reach the given number.
+    enum CONVERGENCE_DIAGNOSTIC { GELMAN_RUBIN = 0, ACCURACY, EFFECTIVE_SAMPLE_SIZE, CONVERGENCE_DIAGNOSTIC_MAX };
+    enum CHAIN_FORMAT { TEXT_CHAIN = 0, BINARY_CHAIN, SHARED_BINARY_CHAIN, CHAIN_FORMAT_MAX };
+    enum COMMUNICATION_PROTOCOL { POINT_TO_POINT = 0, COLLECTIVE, COMMUNICATION_PROTOCOL_MAX };
 
     /// Constructor.
     /// \param nPar The number of parameters.
@@ -72,6 +88,20 @@ public:
     /// \param seed A random seed. If set to 0 (the default value), it will be determined from the current time.
     MetropolisHastings(int nPar, LikelihoodFunction& like, std::string fileRoot, time_t seed = 0, bool isLikelihoodApproximate = false);
 
+    /// Constructor for the hybrid MPI + OpenMP mode, in which each MPI process runs nThreads chains on separate threads. This needs fewer MPI processes for the same number of chains.
+    /// Must be called by all of the threads of an OpenMP parallel region with nThreads threads, followed by the same settings and a call to run on every thread.
+    /// The likelihood is called from all of the threads at the same time. The likelihoods of CLASS and clik are not thread safe, so each thread needs its own likelihood object, which loads its own tables, and the memory used by the tables is the same as with one MPI process per chain. A thread safe likelihood can be shared by the threads of a process, but then it must not rely on lastEvaluationInfo (logEvaluations) or setLowPrecision (usePrecisionSchedule), which keep the state of the last call.
+    /// The chains are numbered as (process id) * nThreads + threadIndex and are otherwise completely equivalent to the chains of the MPI version. The MPI library must support MPI_THREAD_MULTIPLE.
+    /// Nested OpenMP parallelism is off by default, so the likelihoods (including CLASS and clik) run on one thread per chain. Typically there should be one MPI process per node (or socket) and nThreads should be the number of cores.
+    /// \param nPar The number of parameters.
+    /// \param like The likelihood function.
+    /// \param fileRoot The root for filenames produced by MetropolisHastings.
+    /// \param seed A random seed. If set to 0, it will be determined from the current time.
+    /// \param isLikelihoodApproximate Set to true if the likelihood function is approximate.
+    /// \param nThreads The number of chains per process, must be the number of threads in the OpenMP parallel region.
+    /// \param threadIndex The index of the current thread (omp_get_thread_num()).
+    MetropolisHastings(int nPar, LikelihoodFunction& like, std::string fileRoot, time_t seed, bool isLikelihoodApproximate, int nThreads, int threadIndex);
+
     /// Destructor.
     ~MetropolisHastings();
 
@@ -116,42 +146,163 @@ public:
     /// \param proposal A pointer to the external proposal distribution.
     void useExternalProposal(ProposalFunctionBase* proposal) { externalProposal_ = proposal; }
 
+    /// Set the format of the chain file. By default the chain is written as text into (fileRoot).txt and flushed after every element.
+    /// \param format TEXT_CHAIN for the text format, BINARY_CHAIN for the binary format (see BinaryChain). The binary chain is written into (fileRoot).bin and can be read directly by MarkovChain or converted into text with BinaryChain::convertToText.
+    /// SHARED_BINARY_CHAIN writes all of the chains into one file, (fileRoot).bin, with MPI-IO (see SharedBinaryChain), instead of one file per chain. Each chain keeps its elements in memory and writes them at its own offsets in the file when it is flushed, without waiting for the other chains. The resume information of all of the chains except the master is kept in one file too, (fileRoot)resume_shared.dat, with two slots per chain that are written alternately, so an interrupted write never destroys the previous resume point.
+    /// This keeps the number of files constant for runs with many chains. MarkovChain reads the chains from the shared file directly. Cannot be used in the hybrid MPI + OpenMP mode.
+    /// \param flushEvery The chain file is flushed after this many elements. The chain file is also always flushed before the resume information is written. For the shared chain the elements are kept in memory until then, so a larger value means fewer and larger writes.
+    void setChainFormat(CHAIN_FORMAT format, int flushEvery = 1);
+
+    /// Log the likelihood evaluations into a side file next to the chain, (fileRoot)_evaluations.txt (with the chain index before the suffix like the chain file). The file has one row for each element of the chain, with the likelihood evaluations done since the previous element:
+    /// the total wall time of the evaluations in seconds, the number of evaluations, the number of them for which the approximation was used, and the total number of retries of the calculation (for example CLASS retries).
+    /// The last two are only available if the likelihood implements LikelihoodFunction::lastEvaluationInfo (they are 0 otherwise), and are not counted for the batches (multiple-try and speculative evaluation). Off by default. Like the text chain, the file is appended to when resuming.
+    /// \param log true to log the evaluations.
+    void logEvaluations(bool log = true) { logEvaluations_ = log; }
+
+    /// Write each state of the chain once, with its multiplicity as the weight, instead of one element with weight 1 for each step. The row of a state is written when the chain moves on (or at the end of the run), so a point that stays for 50 rejected steps is one row with weight 50.
+    /// This makes the chain file smaller and faster to read by about the inverse of the acceptance rate. Read the chain with MarkovChain with countSteps set to count the burnin and the thinning in steps, so the results are the same as from the unweighted chain. With logEvaluations, the evaluations file has one row for each row of the chain.
+    /// The number of steps of the last state is kept in the resume information, so a resumed run continues the same row. Off by default, works with all of the chain formats.
+    /// \param weighted true to write the weighted chain.
+    void setWeightedOutput(bool weighted = true) { weightedOutput_ = weighted; }
+
+    /// Use the multiple-try Metropolis algorithm. For each parameter block nTries trial points are proposed and their likelihoods are calculated in one call to LikelihoodFunction::calculateBatch,
+    /// followed by nTries - 1 reference points, also in one batch. This is useful when the likelihood can evaluate several points in parallel. The proposal distribution must be symmetric.
+    /// \param nTries The number of trial points per step. 1 (the default) means the standard Metropolis-Hastings algorithm.
+    void useMultipleTry(int nTries);
+
+    /// Use the two-stage delayed acceptance algorithm. The proposals are first accepted or rejected using LikelihoodFunction::calculate, which is assumed to be a cheap approximation (for example an emulator).
+    /// Only the proposals that pass the first stage are evaluated with LikelihoodFunction::calculateExact, and accepted with a second Metropolis-Hastings step that corrects for the error of the approximation, so the chain samples the exact posterior.
+    /// The likelihoods written into the chain are the exact ones. The approximation should be a deterministic function of the parameters for the correction to be exact. Cannot be combined with useMultipleTry.
+    /// \param delayed true to turn on delayed acceptance, false to turn it off.
+    void useDelayedAcceptance(bool delayed = true) { delayedAcceptance_ = delayed; }
+
+    /// Write the resume information in a background thread (the default). The state is serialized into memory in the sampling loop, and the thread writes it into a temporary file which then replaces the resume file. If the previous resume information is still being written the new one is kept, and only the latest one is written when run finishes.
+    /// The resume file is always replaced atomically, so stopping the code while it is being written will not corrupt it.
+    /// \param async true to write the resume information in the background, false to write it directly.
+    void setAsyncResumeWriting(bool async = true);
+
+    /// Use fast-slow sampling. The parameter blocks (see specifyParameterBlocks) are split into the slow blocks, which come first, and the fast blocks after them. In each iteration every slow block is updated once, followed by fastOversampling updates of every fast block, and one element is written into the chain.
+    /// This is useful when the likelihood caches the expensive part of the calculation that depends on the slow parameters only, so that steps changing only the fast parameters are cheap (for example PlanckLikelihood caches the Cl-s of the cosmological parameters, and the foreground parameters are fast).
+    /// \param nSlowBlocks The number of slow blocks, the rest of the blocks are fast. Must be smaller than the number of blocks by the time run is called.
+    /// \param fastOversampling The number of times each fast block is updated in each iteration. 1 means no oversampling.
+    void useFastSlowSampling(int nSlowBlocks, int fastOversampling);
+
+    /// Speculatively evaluate the proposals that follow a rejection. Together with each proposal the next depth proposals are generated from the current point, assuming that all of the previous ones will be rejected, and all of them are evaluated in one call to LikelihoodFunction::calculateBatch.
+    /// The proposals are then accepted or rejected one by one as usual, and the remaining ones are discarded as soon as one is accepted, so the chain has the same statistical properties. This is useful when the acceptance rate is low and the likelihood can evaluate several points in parallel.
+    /// The proposal distribution must be symmetric. Cannot be combined with useMultipleTry or useDelayedAcceptance.
+    /// \param depth The number of speculative proposals evaluated together with each proposal. 0 (the default) turns the speculative evaluation off.
+    void useSpeculativeEvaluation(int depth);
+
+    /// Set the protocol used for the communication between the chains.
+    /// With POINT_TO_POINT (the default) each chain sends its statistics to the master chain, which decides when to stop and sends the covariance matrix updates to each of the chains.
+    /// With COLLECTIVE the statistics of all of the chains are combined with non-blocking reductions, and the decision to stop and the covariance matrix updates are sent back with one non-blocking broadcast, so the master does not need to poll all of the chains. Both go through the node masters (see CosmoMPI::leaderCommunicator), so only one message per node goes between the nodes. This scales much better to large numbers of chains.
+    /// In this mode a chain that reaches maxChainLength stops all of the other chains. The collective mode needs MPI 3 and cannot be used in the hybrid MPI + OpenMP mode.
+    /// \param protocol The communication protocol.
+    void setCommunicationProtocol(COMMUNICATION_PROTOCOL protocol);
+
+    /// Set the tolerance for recomputing the adaptive proposal. The Cholesky factor of the covariance matrix is only recomputed and sent to the chains when an element of the covariance matrix has changed by more than tolerance * sigma_i * sigma_j since the last factorization.
+    /// \param tolerance The tolerance, 0.02 by default. 0 means that the factor is recomputed at every update.
+    void setCovarianceUpdateTolerance(double tolerance);
+
+    /// Start the adaptive proposal from a known covariance matrix instead of the diagonal proposal from the sampling widths, e.g. from a previous run. The proposal is ready from the first step and keeps adapting from there.
+    /// The parameters are matched by name with the ones given in setParam or setParamGauss when the run starts. The parameters that are not found keep the diagonal proposal from their sampling widths (which then must be positive), the extra parameters of the matrix are ignored. Only used with adaptiveProposal = true in run, and ignored when resuming (the saved state is used).
+    /// \param cov The covariance matrix of the parameters (not scaled for the proposal).
+    /// \param names The names of the parameters of the matrix, in the same order. If empty, the parameters must be the same as the ones of the sampler and in the same order.
+    /// \param mean The mean of the parameters. If empty, the adaptive state is started with the mean of the first elements of the run.
+    /// \param weight The number of samples that the starting covariance counts for in the adaptive updates (must be at least 2). Larger values make the proposal change more slowly from the starting one.
+    void setStartingCovariance(const Math::SymmetricMatrix<double>& cov, const std::vector<std::string>& names = std::vector<std::string>(), const std::vector<double>& mean = std::vector<double>(), unsigned long weight = 1000);
+
+    /// Start the adaptive proposal from the covariance matrix and the mean of a previous chain (see the other setStartingCovariance).
+    /// \param chain The chain, the elements are weighted with their probabilities.
+    /// \param names The names of the parameters of the chain, e.g. read from the .paramnames file of the previous run with readParamNames.
+    /// \param weight The number of samples that the starting covariance counts for in the adaptive updates.
+    void setStartingCovariance(const MarkovChain& chain, const std::vector<std::string>& names, unsigned long weight = 1000);
+
+    /// Start the adaptive proposal from a covariance matrix in a text file (see the other setStartingCovariance). The file has one row of the matrix per line. The first line can give the names of the parameters after a #, as in the CosmoMC .covmat files, otherwise the parameters must be the same as the ones of the sampler.
+    /// \param fileName The name of the covariance matrix file.
+    /// \param weight The number of samples that the starting covariance counts for in the adaptive updates.
+    void setStartingCovariance(const char* fileName, unsigned long weight = 1000);
+
+    /// Reads the parameter names from a .paramnames file (the first word of each line, with a trailing * of derived parameters removed).
+    /// \param fileName The name of the file.
+    /// \param names Upon return contains the names.
+    static void readParamNames(const char* fileName, std::vector<std::string>* names);
+
+    /// Use a precision schedule for the likelihood. The run starts with the low precision of the likelihood (see LikelihoodFunction::setLowPrecision), and switches to the full precision when the adaptive proposal has stabilized, i.e. when the proposal of the chain has not changed for stableIterations iterations (see setCovarianceUpdateTolerance),
+    /// or at the latest at the end of the burnin, so all of the elements after the burnin are at full precision. The likelihood of the current point is recalculated at full precision at the switch. Each chain switches on its own.
+    /// This is useful when the likelihood has an expensive precision setting, for example CLASS, and the burnin takes a large fraction of the run. Needs a nonzero burnin in run. If the likelihood does not support the low precision a warning is printed and the full precision is used throughout.
+    /// \param stableIterations The number of iterations without a change of the proposal after which the precision is switched. 0 turns the schedule off (the default).
+    void usePrecisionSchedule(unsigned long stableIterations = 1000) { precisionStableIterations_ = stableIterations; }
+
     /// Run the scan. Should be called after all of the other necessary functions have been called to set all of the necessary settings. The resulting chain is written in the file (fileRoot).txt. The first column is the number of repetitions of the element, the second column is -2ln(likelihood), the following columns are the values of all of the parameters.
+    /// If the termination signals are trapped (see CheckpointCoordinator), a signal stops all of the chains after their current steps. Each chain then flushes its chain file and writes its resume information (if writeResumeInformationEvery is not 0), the registered checkpoints are written, and run returns. All of the processes must call CheckpointCoordinator::install in that case.
     /// \param maxChainLength The maximum length of the chain (1000000 by default). The scan will stop when the chain reaches that length, even if the required accuracy for the parameters has not been achieved. If the accuracies are achieved earlier the scan will stop earlier.
-    /// \param writeResumeInformationEvery Defines if resume information should be written in a file and how often. This will allow an interrupted run to resume. 0 will mean no resume information will be written. The default setting of 1 is recommended in most cases. However, if the likelihood calculation is very fast, so that the likelihood computing time is faster or comparable to writing out a small binary file, this parameter should be set to higher value. The reason is that it will slow down the scan significantly, and the chance of the resume file being corrupt and useless will be high (this will happen if the code is stopped during writing out the resume file).
+    /// \param writeResumeInformationEvery Defines if resume information should be written in a file and how often. This will allow an interrupted run to resume. 0 will mean no resume information will be written. The default setting of 1 is recommended in most cases. However, if the likelihood calculation is very fast, so that the likelihood computing time is faster or comparable to writing out a small binary file, this parameter should be set to higher value, since serializing the state still takes time in the sampling loop (the file itself is written in the background, see setAsyncResumeWriting).
     /// \param burnin The burnin length. These elements will still be written out into the chain but will be ignored for determining convergence.
     /// \param cd Convergence diagnostic to be used.
-    /// \param convergenceCriterion A number used to determine convergence. For Gelman-Rubin diagnostic this is the number below which (R - 1) absolute values need to be for all the parameters.
+    /// \param convergenceCriterion A number used to determine convergence. For Gelman-Rubin diagnostic this is the number below which (R - 1) absolute values need to be for all the parameters. For the effective sample size diagnostic this is the effective sample size that all of the parameters need to reach (for all of the chains together).
     /// \param adaptiveProposal This turns on the usage of the Adaptive Metropolis algorithm (optional, true by default). The proposal distribution will be continuously updated during the run based on the covariance of the existing elements. This typically speeds up the run by about 1 order of magnitude! HIBHLY RECOMMENDED to keep this argument true.
     /// \return The number of chains generated.
     int run(unsigned long maxChainLength = 1000000, int writeResumeInformationEvery = 1, unsigned long burnin = 0, CONVERGENCE_DIAGNOSTIC cd = ACCURACY, double convergenceCriterion = 0.01, bool adaptiveProposal = true);
 
 private:
     void useAdaptiveProposal();
+    void applyStartingCovariance();
 
     inline double uniformPrior(double min, double max, double x) const;
     inline double gaussPrior(double mean, double sigma, double x) const;
-    inline double calculatePrior();
+    inline double calculatePrior(double* params);
     inline void calculateStoppingData();
     inline bool stop();
     inline bool checkStoppingCrit();
     inline double generateNewPoint(int i) const { return current_[i] + generator_->generate() * samplingWidth_[i]; }
     inline void openOut(bool append);
-    inline void closeOut() { out_.close(); }
+    inline static void truncateTextRows(const std::string& fileName, unsigned long rows);
+    inline void closeOut() { if(sharedOut_) closeSharedOut(); else out_.close(); if(evalOut_.is_open()) evalOut_.close(); }
+    inline void flushOut() { if(sharedOut_) flushSharedOut(); else out_.flush(); if(evalOut_.is_open()) evalOut_.flush(); notFlushed_ = 0; }
+    void openSharedOut(bool append);
+    void flushSharedOut();
+    void closeSharedOut();
+    double calculateLike(bool exact);
     inline void writeChainElement();
+    inline void writeChainRow(double weight, double like, const double* params);
+    inline void writePendingRow();
     inline void update();
-    inline void writeResumeInfo() const;
+    inline void serializeResumeInfo(std::ostream& out) const;
+    void writeResumeInfo();
+    void writeResumeBuffer();
+    void waitForResumeWriting();
+    void reportResumeError();
     inline bool readResumeInfo();
-
-    inline void writeCommInfo(std::ofstream& out) const;
-    inline void readCommInfo(std::ifstream& in);
+    inline bool readResumeInfo(std::istream& in);
+    inline bool useSharedResume() const { return sharedResume_ && !isMaster(); }
+    void openSharedResume();
+    void closeSharedResume();
+    bool readSharedResume(std::string& buffer);
+    void writeSharedResume();
+
+    inline void writeCommInfo(std::ostream& out) const;
+    inline void readCommInfo(std::istream& in);
     bool synchronizeCommInfo();
 
     inline void logProgress() const;
 
     inline bool isMaster() const { return currentChainI_ == 0; }
+    inline int chainProcess(int chainIndex) const { return chainIndex / nThreads_; }
+    void barrier() const;
+    // collective, combines the termination requests of all of the processes (see CheckpointCoordinator)
+    bool preemptedEverywhere() const;
     void communicate();
     void sendHaveStopped();
+    void startCollectiveRound(bool done);
+    bool progressCollectiveRound(bool wait);
+    void collectiveDecision();
+
+    void generateProposal(double* from, int blockBegin, int blockEnd, int blockIndex, double* to);
+    void evaluateTries(double* params, int nPoints, double* priors, double* likes);
+    bool multipleTryStep(int blockIndex, int blockBegin, int blockEnd);
+    void speculate(const std::vector<int>& blockSchedule, int schedulePos);
+    void switchToFullPrecision();
 
     inline void calculateMeanVar(std::vector<double>::const_iterator begin, std::vector<double>::const_iterator end, double& mean, double& var);
 
@@ -160,6 +311,191 @@ private:
         BadResumeInfo(int a) : n(a) {}
         int n;
     };
+
+    // streaming statistics of the chain after the burnin, each new element is added in constant time
+    struct ChainStatistics
+    {
+        ChainStatistics(int dim) : n(0), mean(dim, 0), m2(dim, 0), prevMean(dim, 0), lagM2(dim, 0), batchSize(1), batchCount(0), batchSum(dim, 0), nBatches(0), batchMeans(maxBatches * dim, 0), traceStride(1), traceCount(0), tau(dim, -1), tauTraceSize(0) {}
+
+        enum { maxBatches = 64, maxTrace = 16384, minTrace = 256 };
+
+        unsigned long n;
+
+        // Welford running means and sums of squared deviations, and the same for the pairs (x_t, x_{t-1}) to get the lag 1 autocorrelation
+        std::vector<double> mean, m2, prevMean, lagM2;
+
+        // batch means, when all of the batches are filled the neighboring pairs are merged and the batch size is doubled
+        unsigned long batchSize, batchCount;
+        std::vector<double> batchSum;
+        int nBatches;
+        std::vector<double> batchMeans;
+
+        // the chain thinned by traceStride (stored by rows) for the autocorrelation times, when it is full every other element is dropped and the stride is doubled
+        // it is not kept in the resume file, after resuming the autocorrelation times are estimated from the new elements only
+        std::vector<double> trace;
+        unsigned long traceStride, traceCount;
+
+        // the integrated autocorrelation times in steps of the chain (-1 if not calculated yet), and the size of the trace they were calculated from
+        std::vector<double> tau;
+        unsigned long tauTraceSize;
+
+        inline void add(const std::vector<double>& x, const std::vector<double>& prev)
+        {
+            const int dim = mean.size();
+            check(x.size() == dim, "");
+            check(prev.size() == dim, "");
+
+            ++n;
+            for(int i = 0; i < dim; ++i)
+            {
+                const double dx = x[i] - mean[i];
+                mean[i] += dx / n;
+                m2[i] += dx * (x[i] - mean[i]);
+
+                const double dp = prev[i] - prevMean[i];
+                prevMean[i] += dp / n;
+                lagM2[i] += dp * (x[i] - mean[i]);
+
+                batchSum[i] += x[i];
+            }
+
+            if(++traceCount == traceStride)
+            {
+                traceCount = 0;
+                if(trace.size() == maxTrace * dim)
+                {
+                    for(int k = 0; k < maxTrace / 2; ++k)
+                        std::copy(trace.begin() + 2 * k * dim, trace.begin() + (2 * k + 1) * dim, trace.begin() + k * dim);
+                    trace.resize(maxTrace / 2 * dim);
+                    traceStride *= 2;
+                    tauTraceSize = 0;
+                }
+                trace.insert(trace.end(), x.begin(), x.end());
+            }
+
+            if(++batchCount < batchSize)
+                return;
+
+            for(int i = 0; i < dim; ++i)
+            {
+                batchMeans[nBatches * dim + i] = batchSum[i] / batchSize;
+                batchSum[i] = 0;
+            }
+            batchCount = 0;
+
+            if(++nBatches < maxBatches)
+                return;
+
+            for(int k = 0; k < maxBatches / 2; ++k)
+            {
+                for(int i = 0; i < dim; ++i)
+                    batchMeans[k * dim + i] = (batchMeans[2 * k * dim + i] + batchMeans[(2 * k + 1) * dim + i]) / 2;
+            }
+            nBatches = maxBatches / 2;
+            batchSize *= 2;
+        }
+
+        inline double variance(int i) const { return (n > 1 ? m2[i] / (n - 1) : 0.0); }
+
+        // recalculates the autocorrelation times with the fast Fourier transform when the trace has grown by more than 10%, so the cost per step stays small
+        inline void updateAutocorrelation()
+        {
+            const int dim = mean.size();
+            const unsigned long size = trace.size() / dim;
+            if(size < minTrace || (tauTraceSize > 0 && size * 10 < tauTraceSize * 11))
+                return;
+
+            for(int i = 0; i < dim; ++i)
+                tau[i] = Math::integratedAutocorrelationTime(&(trace[i]), size, dim) * traceStride;
+            tauTraceSize = size;
+        }
+
+        // the standard deviation of the mean from the integrated autocorrelation time, or from stdMean if the trace is too short
+        inline double autocorrelationStdMean(int i) const
+        {
+            if(tau[i] < 0)
+                return stdMean(i);
+
+            return std::sqrt(variance(i) * std::max(tau[i], 1.0) / n);
+        }
+
+        // the larger of the lag 1 autocorrelation corrected and the batch means estimates of the standard deviation of the mean
+        inline double stdMean(int i) const
+        {
+            check(n > 0, "");
+
+            const double stdev = std::sqrt(m2[i] / n);
+            double res = stdev / std::sqrt(double(n));
+            const double cor = (m2[i] > 0 ? lagM2[i] / m2[i] : 0.0);
+            if(cor < 1 && cor > -1)
+                res *= std::sqrt((1 + cor) / (1 - cor));
+
+            if(nBatches < 2)
+                return res;
+
+            const int dim = mean.size();
+            double bMean = 0, bM2 = 0;
+            for(int k = 0; k < nBatches; ++k)
+            {
+                const double d = batchMeans[k * dim + i] - bMean;
+                bMean += d / (k + 1);
+                bM2 += d * (batchMeans[k * dim + i] - bMean);
+            }
+            const double batchRes = std::sqrt(bM2 / (nBatches - 1) / nBatches);
+
+            return std::max(res, batchRes);
+        }
+
+        inline void reset()
+        {
+            n = 0;
+            std::fill(mean.begin(), mean.end(), 0.0);
+            std::fill(m2.begin(), m2.end(), 0.0);
+            std::fill(prevMean.begin(), prevMean.end(), 0.0);
+            std::fill(lagM2.begin(), lagM2.end(), 0.0);
+            batchSize = 1;
+            batchCount = 0;
+            std::fill(batchSum.begin(), batchSum.end(), 0.0);
+            nBatches = 0;
+            trace.clear();
+            traceStride = 1;
+            traceCount = 0;
+            std::fill(tau.begin(), tau.end(), -1.0);
+            tauTraceSize = 0;
+        }
+
+        inline void writeIntoFile(std::ostream& out) const
+        {
+            const int dim = mean.size();
+            out.write((char*)(&n), sizeof(n));
+            out.write((char*)(&(mean[0])), dim * sizeof(double));
+            out.write((char*)(&(m2[0])), dim * sizeof(double));
+            out.write((char*)(&(prevMean[0])), dim * sizeof(double));
+            out.write((char*)(&(lagM2[0])), dim * sizeof(double));
+            out.write((char*)(&batchSize), sizeof(batchSize));
+            out.write((char*)(&batchCount), sizeof(batchCount));
+            out.write((char*)(&(batchSum[0])), dim * sizeof(double));
+            out.write((char*)(&nBatches), sizeof(nBatches));
+            out.write((char*)(&(batchMeans[0])), maxBatches * dim * sizeof(double));
+        }
+
+        inline void readFromFile(std::istream& in)
+        {
+            const int dim = mean.size();
+            in.read((char*)(&n), sizeof(n));
+            in.read((char*)(&(mean[0])), dim * sizeof(double));
+            in.read((char*)(&(m2[0])), dim * sizeof(double));
+            in.read((char*)(&(prevMean[0])), dim * sizeof(double));
+            in.read((char*)(&(lagM2[0])), dim * sizeof(double));
+            in.read((char*)(&batchSize), sizeof(batchSize));
+            in.read((char*)(&batchCount), sizeof(batchCount));
+            in.read((char*)(&(batchSum[0])), dim * sizeof(double));
+            in.read((char*)(&nBatches), sizeof(nBatches));
+            in.read((char*)(&(batchMeans[0])), maxBatches * dim * sizeof(double));
+            if(nBatches < 0 || nBatches >= maxBatches || batchSize == 0)
+                in.setstate(std::ios::failbit);
+        }
+    };
     
 private:
     int n_;
@@ -169,11 +505,25 @@ private:
     std::vector<double> param1_, param2_, starting_, samplingWidth_, accuracy_;
     std::vector<PRIOR_MODE> priorMods_;
     std::vector<std::string> paramNames_;
-    std::vector<double> paramSum_, paramSquaredSum_, corSum_, reachedSigma_;
+    ChainStatistics chainStats_;
+    std::vector<double> reachedSigma_;
+    std::vector<double> reachedESS_;
     PriorFunctionBase* externalPrior_;
     ProposalFunctionBase* externalProposal_;
     std::vector<int> blocks_;
 
+    int nTries_;
+    int nSlowBlocks_, fastOversampling_;
+
+    // the speculative proposals, evaluated assuming that the ones before them are rejected
+    int speculativeDepth_;
+    std::vector<double> specParams_, specPriors_, specLikes_;
+    std::vector<int> specBlocks_;
+    int specNext_, specCount_;
+    unsigned long specEvaluated_, specUsed_;
+    std::vector<double> tryParams_, tryPriors_, tryLikes_, tryWeights_, trySelected_;
+    std::vector<double> batchParams_, batchLikes_;
+
     unsigned long covarianceElementsNum_;
     Math::SymmetricMatrix<double> covariance_;
     std::vector<double> generatedVec_, rotatedVec_;
@@ -181,6 +531,12 @@ private:
 
     bool covarianceReady_;
     std::vector<double> paramMean_;
+
+    // the starting covariance matrix of the adaptive proposal, in the order of startNames_, applied when the run starts
+    std::vector<double> startCov_, startMean_;
+    std::vector<std::string> startNames_;
+    unsigned long startWeight_;
+    bool startMeanUnknown_;
     std::vector<double> paramMeanNew_;
     const double covEpsilon_;
     const double covFactor_;
@@ -192,44 +548,55 @@ private:
     double cc_;
 
     time_t seed_;
-    Math::UniformRealGenerator* uniformGen_;
-    Math::GaussianGenerator* generator_;
+    Math::UniformStreamGenerator* uniformGen_;
+    Math::GaussianStreamGenerator* generator_;
 
     std::vector<double> prev_, current_;
+    // the point before the current step, and the line buffer for the text chain, preallocated so that the steps do not allocate memory
+    std::vector<double> currentOld_;
+    std::vector<char> lineBuff_;
     unsigned long maxChainLength_;
     unsigned long iteration_;
     double currentLike_;
     double currentPrior_;
 
+    bool delayedAcceptance_;
+    double currentApproxLike_;
+
+    // the precision schedule (see usePrecisionSchedule), and the iteration at which the proposal of this chain has last changed
+    unsigned long precisionStableIterations_;
+    bool lowPrecision_;
+    unsigned long proposalChangedIter_;
+
     struct CommunicationInfo
     {
-        CommunicationInfo(int n = 0) : sums(n), sqSums(n), stdMean(n) {}
-        CommunicationInfo(const CommunicationInfo& other) : sums(other.sums), sqSums(other.sqSums), stdMean(other.stdMean), iter(other.iter) {}
+        CommunicationInfo(int n = 0) : means(n), vars(n), stdMean(n) {}
+        CommunicationInfo(const CommunicationInfo& other) : means(other.means), vars(other.vars), stdMean(other.stdMean), iter(other.iter) {}
 
-        std::vector<double> sums, sqSums, stdMean;
+        std::vector<double> means, vars, stdMean;
         double iter;
 
-        inline void writeIntoFile(std::ofstream& out) const
+        inline void writeIntoFile(std::ostream& out) const
         {
-            const int n = sums.size();
-            check(sqSums.size() == n, "");
+            const int n = means.size();
+            check(vars.size() == n, "");
             check(stdMean.size() == n, "");
 
             out.write((char*)(&iter), sizeof(iter));
-            out.write((char*)(&(sums[0])), n * sizeof(double));
-            out.write((char*)(&(sqSums[0])), n * sizeof(double));
+            out.write((char*)(&(means[0])), n * sizeof(double));
+            out.write((char*)(&(vars[0])), n * sizeof(double));
             out.write((char*)(&(stdMean[0])), n * sizeof(double));
         };
 
-        inline void readFromFile(std::ifstream& in)
+        inline void readFromFile(std::istream& in)
         {
-            const int n = sums.size();
-            check(sqSums.size() == n, "");
+            const int n = means.size();
+            check(vars.size() == n, "");
             check(stdMean.size() == n, "");
 
             in.read((char*)(&iter), sizeof(iter));
-            in.read((char*)(&(sums[0])), n * sizeof(double));
-            in.read((char*)(&(sqSums[0])), n * sizeof(double));
+            in.read((char*)(&(means[0])), n * sizeof(double));
+            in.read((char*)(&(vars[0])), n * sizeof(double));
             in.read((char*)(&(stdMean[0])), n * sizeof(double));
         }
     };
@@ -240,17 +607,49 @@ private:
     std::vector<std::vector<double> > communicationBuff_;
     std::vector<double> myStdMean_;
 
-    std::vector<std::vector<double> > sendComBuff_;
 
-    std::vector<std::vector<double> > covUpdateBuff_;
 
     const int resumeCode_;
 
+    // asynchronous resume writing (see setAsyncResumeWriting), resumeWriting_ and resumeError_ are only touched by the writing thread while it runs
+    bool asyncResume_;
+    std::thread* resumeThread_;
+    std::atomic<bool> resumeDone_;
+    std::string resumeWriting_, resumePending_, resumeError_;
+
     std::ofstream out_;
+    CHAIN_FORMAT chainFormat_;
+
+    // the shared chain file (SHARED_BINARY_CHAIN), the elements not written yet, and the number of elements in the file
+    CosmoMPI::File* sharedOut_;
+    SharedBinaryChain::Layout sharedLayout_;
+    std::vector<double> sharedBuffer_;
+    unsigned long sharedWritten_;
+
+    // the weighted output (setWeightedOutput), the state not written yet and its number of steps, and the number of rows written into the chain file (the same as iteration_ for the unweighted output)
+    bool weightedOutput_;
+    std::vector<double> pending_;
+    double pendingLike_;
+    unsigned long pendingWeight_;
+    unsigned long chainRows_;
+
+    // the shared resume file, the size of a slot, and the generation of the last resume information written into it
+    CosmoMPI::File* sharedResume_;
+    long resumeSlotSize_;
+    long resumeGeneration_;
+
+    // the likelihood evaluations since the last chain element, for logEvaluations
+    std::ofstream evalOut_;
+    bool logEvaluations_;
+    double evalSeconds_;
+    int evalCount_, evalApproximate_, evalRetries_;
+    int flushEvery_, notFlushed_;
     int nChains_, currentChainI_;
+    int nThreads_, threadIndex_;
     double burnin_;
 
     bool stop_;
+    bool preempted_;
     int stopRequestMessage_;
     int stopRequestTag_;
     bool stopRequestSent_;
@@ -269,17 +668,57 @@ private:
     std::vector<void*> haveStoppedReceiveReq_;
 
     int updateReqTag_;
-    std::vector<void*> updateRequests_;
+    // the buffers and the requests of the progress updates sent to the master and of the covariance matrix updates sent by the master
+    CosmoMPI::SendPool sendPool_;
     bool firstUpdateRequested_;
     std::vector<void*> updateReceiveReq_;
 
-    std::vector<void*> covarianceUpdateRequests_;
+    // the sums for the adaptive covariance matrix are sent to the master separately from the convergence summaries, only the upper triangle of the matrix is sent
+    int covSumReqTag_;
+    std::vector<void*> covSumReceiveReq_;
+    std::vector<std::vector<double> > covSumBuff_;
+
     int covUpdateReqTag_;
 
     bool firstCovUpdateRequested_;
     void* receiveCovUpdateRequest_;
     std::vector<double> eigenUpdateBuff_;
 
+    // the covariance matrix is only factorized again when it has drifted away from the last factorized one, the factor is then sent to the chains as a packed lower triangle
+    Math::SymmetricMatrix<double> factoredCovariance_;
+    double covUpdateTolerance_;
+    bool choleskyFactored_, choleskyUpdated_;
+
+    inline void packCholesky(double* packed) const
+    {
+        int k = 0;
+        for(int i = 0; i < n_; ++i)
+            for(int j = 0; j <= i; ++j)
+                packed[k++] = cholesky_(i, j);
+    }
+
+    inline void unpackCholesky(const double* packed)
+    {
+        int k = 0;
+        for(int i = 0; i < n_; ++i)
+            for(int j = 0; j <= i; ++j)
+                cholesky_(i, j) = packed[k++];
+    }
+
+    // the collective protocol, each round is a reduction of the statistics of all of the chains followed by a broadcast of the decision of the master
+    // only one round is in progress at a time, so all of the processes post the collective operations in the same order, on separate communicators
+    // both steps go through the node masters, on the node (shared memory) and among the node masters, so only one message per node goes between the nodes
+    enum COLLECTIVE_STAGE { COLLECTIVE_IDLE = 0, COLLECTIVE_REDUCING, COLLECTIVE_REDUCING_LEADERS, COLLECTIVE_BROADCASTING_LEADERS, COLLECTIVE_BROADCASTING };
+    COMMUNICATION_PROTOCOL protocol_;
+    COLLECTIVE_STAGE collectiveStage_;
+    void* collectiveNodeComm_;
+    void* collectiveLeaderComm_;
+    void* reduceRequest_;
+    void* bcastRequest_;
+    std::vector<double> reduceSendBuff_, nodeReduceBuff_, reduceRecvBuff_, bcastBuff_;
+    // 1 if the chains have converged, 2 if one of the chains has reached the maximum length
+    int collectiveStopReason_;
+
     struct CovarianceMatrixUpdateInfo
     {
         CovarianceMatrixUpdateInfo(int dim)
@@ -297,7 +736,7 @@ private:
         std::vector<double> paramSum;
         std::vector<std::vector<double> > matrixSum;
 
-        inline void writeIntoFile(std::ofstream& out) const
+        inline void writeIntoFile(std::ostream& out) const
         {
             const int dim = paramSum.size();
             check(matrixSum.size() == dim, "");
@@ -310,7 +749,7 @@ private:
             }
         }
 
-        inline void readFromFile(std::ifstream& in)
+        inline void readFromFile(std::istream& in)
         {
             const int dim = paramSum.size();
             check(matrixSum.size() == dim, "");
@@ -365,10 +804,10 @@ MetropolisHastings::gaussPrior(double mean, double sigma, double x) const
 }
 
 double
-MetropolisHastings::calculatePrior()
+MetropolisHastings::calculatePrior(double* params)
 {
     if(externalPrior_)
-        return externalPrior_->calculate(&(current_[0]), n_);
+        return externalPrior_->calculate(params, n_);
 
     double result = 1.0;
     for(int i = 0; i < n_; ++i)
@@ -376,11 +815,11 @@ MetropolisHastings::calculatePrior()
         switch(priorMods_[i])
         {
         case UNIFORM_PRIOR:
-            result *= uniformPrior(param1_[i], param2_[i], current_[i]);
+            result *= uniformPrior(param1_[i], param2_[i], params[i]);
             break;
 
         case GAUSSIAN_PRIOR:
-            result *= gaussPrior(param1_[i], param2_[i], current_[i]);
+            result *= gaussPrior(param1_[i], param2_[i], params[i]);
             break;
 
         default:
@@ -412,6 +851,12 @@ MetropolisHastings::logProgress() const
             output_log("MCMC parameter " << i << ": reached accuracy = " << reachedSigma_[i] << " , expected accuracy = " << accuracy_[i] << std::endl);
         }
         break;
+    case EFFECTIVE_SAMPLE_SIZE:
+        for(int i = 0; i < n_; ++i)
+        {
+            output_log("MCMC parameter " << i << ": effective sample size = " << reachedESS_[i] << " , expected effective sample size = " << cc_ << std::endl);
+        }
+        break;
     default:
         check(false ,"");
         break;
@@ -423,8 +868,16 @@ MetropolisHastings::stop()
 {
     check(iteration_ >= 0, "");
 
-    if(!isMaster())
-        return stop_;
+    // a termination signal stops the chain after the current step, the master then stops the other chains too
+    if(CheckpointCoordinator::requested())
+        preempted_ = true;
+
+    // in the collective mode all of the chains stop together, after the round in which the decision is made
+    if(protocol_ == COLLECTIVE)
+        return stop_ || preempted_ || iteration_ >= maxChainLength_;
+
+    if(!isMaster() || preempted_)
+        return stop_ || preempted_;
 
     if(iteration_ < burnin_ + 100)
         return false;
@@ -489,7 +942,7 @@ MetropolisHastings::checkStoppingCrit()
             for(int j = 0; j < nChains_; ++j)
             {
                 const CommunicationInfo& ci = *(commInfo_[j].begin());
-                means[j] = ci.sums[i] / total;
+                means[j] = ci.means[i];
                 totalMean += means[j];
             }
             totalMean /= nChains_;
@@ -500,8 +953,8 @@ MetropolisHastings::checkStoppingCrit()
                 const CommunicationInfo& ci = *(commInfo_[j].begin());
                 const double diff = means[j] - totalMean;
                 B += diff * diff;
-                const double s2 = (ci.sqSums[i] - 2 * means[j] * ci.sums[i] + total * means[j] * means[j]) / (total - 1);
-                check(s2 >= 0, "i = " << i << ", j = " << j << ", total = " << total << ", squared sum = " << ci.sqSums[i] << ", sum = " << ci.sums[i] << ", mean = " << means[j]);
+                const double s2 = ci.vars[i];
+                check(s2 >= 0, "i = " << i << ", j = " << j << ", total = " << total << ", variance = " << ci.vars[i] << ", mean = " << means[j]);
                 W += s2;
             }
             B *= total;
@@ -529,7 +982,10 @@ MetropolisHastings::checkStoppingCrit()
             s = 0;
             for(int j = 0; j < nChains_; ++j)
             {
-                const CommunicationInfo& ci = *(commInfo_[j].begin());
+                // only the latest summary of each chain is kept for this diagnostic
+                if(commInfo_[j].empty())
+                    return false;
+                const CommunicationInfo& ci = commInfo_[j].back();
                 x = ci.stdMean[i];
                 if(x == -1)
                     return false;
@@ -542,6 +998,30 @@ MetropolisHastings::checkStoppingCrit()
                 doStop = false;
         }
         break;
+    case EFFECTIVE_SAMPLE_SIZE:
+        for(int i = 0; i < nParamsToCheck; ++i)
+        {
+            // the effective sample size of the mean of all of the chains, i.e. the average variance divided by the squared standard deviation of that mean
+            s = 0;
+            x = 0;
+            for(int j = 0; j < nChains_; ++j)
+            {
+                if(commInfo_[j].empty())
+                    return false;
+                const CommunicationInfo& ci = commInfo_[j].back();
+                if(ci.stdMean[i] == -1)
+                    return false;
+
+                s += ci.stdMean[i] * ci.stdMean[i];
+                x += ci.vars[i];
+            }
+
+            reachedSigma_[i] = std::sqrt(s) / nChains_;
+            reachedESS_[i] = (s > 0 ? x / nChains_ / (reachedSigma_[i] * reachedSigma_[i]) : 0.0);
+            if(reachedESS_[i] < cc_)
+                doStop = false;
+        }
+        break;
     default:
         check(false, "");
         break;
@@ -576,20 +1056,18 @@ void
 MetropolisHastings::calculateStoppingData()
 {
     check(iteration_ > burnin_, "");
+    check(chainStats_.n > 0, "");
 
-    for(int i = 0; i < n_; ++i)
+    if(cd_ == EFFECTIVE_SAMPLE_SIZE)
     {
-        const double mean = paramSum_[i] / (iteration_ - burnin_);
-        const double meanSq = paramSquaredSum_[i] / (iteration_ - burnin_);
-
-        const double stdev = std::sqrt(meanSq - mean * mean);
-        double stdMean = stdev / std::sqrt(double(iteration_ - burnin_));
-
-        const double cor = (corSum_[i] / (iteration_ - burnin_) - mean * mean) / (stdev * stdev);
-        if(cor < 1 && cor > -1)
-            stdMean *= std::sqrt((1 + cor) / (1 - cor));
-        myStdMean_[i] = stdMean;
+        chainStats_.updateAutocorrelation();
+        for(int i = 0; i < n_; ++i)
+            myStdMean_[i] = chainStats_.autocorrelationStdMean(i);
+        return;
     }
+
+    for(int i = 0; i < n_; ++i)
+        myStdMean_[i] = chainStats_.stdMean(i);
 }
 
 void
@@ -599,12 +1077,73 @@ MetropolisHastings::openOut(bool append)
     fileName << fileRoot_;
     if(nChains_ > 1)
         fileName << '_' << currentChainI_;
-    fileName << ".txt";
+    fileName << (chainFormat_ == BINARY_CHAIN ? ".bin" : ".txt");
+
+    notFlushed_ = 0;
+
+    if(logEvaluations_)
+    {
+        std::stringstream evalFileName;
+        evalFileName << fileRoot_ << "_evaluations";
+        if(nChains_ > 1)
+            evalFileName << '_' << currentChainI_;
+        evalFileName << ".txt";
+        if(append)
+            truncateTextRows(evalFileName.str(), chainRows_);
+        evalOut_.open(evalFileName.str().c_str(), (append ? std::ios::app : std::ios::trunc) | std::ios::out);
+        if(!evalOut_)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot write into output file " << evalFileName.str() << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        evalSeconds_ = 0;
+        evalCount_ = 0;
+        evalApproximate_ = 0;
+        evalRetries_ = 0;
+    }
+
+    if(chainFormat_ == SHARED_BINARY_CHAIN)
+    {
+        openSharedOut(append);
+        return;
+    }
 
-    if(append)
-        out_.open(fileName.str().c_str(), std::ios::app);
+    if(chainFormat_ == BINARY_CHAIN)
+    {
+        if(append && BinaryChain::isBinary(fileName.str().c_str()))
+        {
+            // drop the elements written after the resume information, they will be generated again
+            std::ifstream in(fileName.str().c_str(), std::ios::in | std::ios::binary);
+            std::vector<std::string> names;
+            const long offset = BinaryChain::readHeader(in, names, fileName.str().c_str());
+            in.close();
+            check(names.size() == n_, "");
+            if(truncate(fileName.str().c_str(), offset + chainRows_ * BinaryChain::recordSize(n_)) != 0)
+            {
+                output_screen("WARNING: could not truncate the chain file " << fileName.str() << " to the resume point." << std::endl);
+            }
+            out_.open(fileName.str().c_str(), std::ios::out | std::ios::binary | std::ios::app);
+        }
+        else
+        {
+            out_.open(fileName.str().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            if(out_)
+                BinaryChain::writeHeader(out_, paramNames_);
+        }
+    }
     else
-        out_.open(fileName.str().c_str());
+    {
+        if(append)
+        {
+            truncateTextRows(fileName.str(), chainRows_);
+            out_.open(fileName.str().c_str(), std::ios::app);
+        }
+        else
+            out_.open(fileName.str().c_str());
+    }
     
     if(!out_)
     {
@@ -616,29 +1155,115 @@ MetropolisHastings::openOut(bool append)
     }
 }
 
+void
+MetropolisHastings::truncateTextRows(const std::string& fileName, unsigned long rows)
+{
+    // drop the rows written after the resume information, they will be generated again
+    std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+    if(!in)
+        return;
+
+    unsigned long n = 0;
+    std::string line;
+    while(n < rows && std::getline(in, line))
+        ++n;
+
+    if(n < rows)
+    {
+        output_screen("WARNING: the file " << fileName << " has " << n << " rows, the resume information has " << rows << "." << std::endl);
+        return;
+    }
+
+    // nothing after the last row
+    if(in.peek() == std::ifstream::traits_type::eof())
+        return;
+
+    const long offset = long(in.tellg());
+    in.close();
+    if(truncate(fileName.c_str(), offset) != 0)
+    {
+        output_screen("WARNING: could not truncate the file " << fileName << " to the resume point." << std::endl);
+    }
+}
+
 void
 MetropolisHastings::writeChainElement()
 {
-    check(out_, "");
-    out_ << 1 << "   " << currentLike_;
-    for(int i = 0; i < n_; ++i)
-        out_ << "   " << current_[i];
-    out_ << std::endl;
+    if(!weightedOutput_)
+    {
+        writeChainRow(1, currentLike_, &(current_[0]));
+        return;
+    }
+
+    // a rejected step stays at the same state
+    if(pendingWeight_ > 0 && currentLike_ == pendingLike_ && std::equal(current_.begin(), current_.end(), pending_.begin()))
+    {
+        ++pendingWeight_;
+        return;
+    }
+
+    writePendingRow();
+    pending_ = current_;
+    pendingLike_ = currentLike_;
+    pendingWeight_ = 1;
 }
 
 void
-MetropolisHastings::update()
+MetropolisHastings::writePendingRow()
 {
-    if(iteration_ > burnin_)
+    if(pendingWeight_ == 0)
+        return;
+
+    writeChainRow(double(pendingWeight_), pendingLike_, &(pending_[0]));
+    pendingWeight_ = 0;
+}
+
+void
+MetropolisHastings::writeChainRow(double weight, double like, const double* params)
+{
+    if(chainFormat_ == SHARED_BINARY_CHAIN)
+    {
+        sharedBuffer_.push_back(weight);
+        sharedBuffer_.push_back(like);
+        sharedBuffer_.insert(sharedBuffer_.end(), params, params + n_);
+    }
+    else if(chainFormat_ == BINARY_CHAIN)
+    {
+        check(out_, "");
+        BinaryChain::writeRecord(out_, weight, like, params, n_);
+    }
+    else
     {
+        // the same format as streaming the values with the default precision, without going through the stream formatting for each value
+        int pos = std::snprintf(&(lineBuff_[0]), lineBuff_.size(), "%.15g   %g", weight, like);
         for(int i = 0; i < n_; ++i)
-        {
-            paramSum_[i] += current_[i];
-            paramSquaredSum_[i] += current_[i] * current_[i];
-            corSum_[i] += current_[i] * prev_[i];
-        }
+            pos += std::snprintf(&(lineBuff_[pos]), lineBuff_.size() - pos, "   %g", params[i]);
+        check(pos < lineBuff_.size(), "the chain line buffer is too small");
+        lineBuff_[pos++] = '\n';
+        out_.write(&(lineBuff_[0]), pos);
+    }
+    ++chainRows_;
+
+    if(logEvaluations_)
+    {
+        const int pos = std::snprintf(&(lineBuff_[0]), lineBuff_.size(), "%g   %d   %d   %d\n", evalSeconds_, evalCount_, evalApproximate_, evalRetries_);
+        evalOut_.write(&(lineBuff_[0]), pos);
+        evalSeconds_ = 0;
+        evalCount_ = 0;
+        evalApproximate_ = 0;
+        evalRetries_ = 0;
     }
 
+    if(++notFlushed_ >= flushEvery_)
+        flushOut();
+}
+
+void
+MetropolisHastings::update()
+{
+    if(iteration_ > burnin_)
+        chainStats_.add(current_, prev_);
+
     if(adapt_)
     {
         ++myCovUpdateInfo_.n;
@@ -648,7 +1273,8 @@ MetropolisHastings::update()
         {
             myCovUpdateInfo_.paramSum[i] += current_[i];
             check(myCovUpdateInfo_.matrixSum[i].size() == n_, "");
-            for(int j = 0; j < n_; ++j)
+            // only the upper triangle is used
+            for(int j = i; j < n_; ++j)
                 myCovUpdateInfo_.matrixSum[i][j] += current_[i] * current_[j];
         }
     }
@@ -664,6 +1290,15 @@ MetropolisHastings::updateCovarianceMatrix(const CovarianceMatrixUpdateInfo& inf
 
     check(info.n >= 2, "at least 2 elements needed for updating");
     check(info.paramSum.size() == n_, "");
+
+    // a starting covariance matrix without a mean takes the mean of the first elements, so only their scatter around it is added
+    if(startMeanUnknown_)
+    {
+        for(int i = 0; i < n_; ++i)
+            paramMean_[i] = info.paramSum[i] / double(info.n);
+        startMeanUnknown_ = false;
+    }
+
     for(int i = 0; i < n_; ++i)
         paramMeanNew_[i] = double(covarianceElementsNum_) / double(covarianceElementsNum_ + info.n) * paramMean_[i] + info.paramSum[i] / double(covarianceElementsNum_ + info.n);
 
@@ -682,24 +1317,46 @@ MetropolisHastings::updateCovarianceMatrix(const CovarianceMatrixUpdateInfo& inf
 
     covarianceElementsNum_ += info.n;
 
-    for(int i = 0; i < n_; ++i)
+    // the factorization is only redone once the covariance matrix has drifted away from the last factorized one, in units of the standard deviations
+    bool drifted = !choleskyFactored_;
+    for(int i = 0; i < n_ && !drifted; ++i)
     {
-        for(int j = 0; j < n_; ++j)
-            cholesky_(i, j) = covariance_(i, j);
+        for(int j = i; j < n_ && !drifted; ++j)
+        {
+            const double norm = std::sqrt(factoredCovariance_(i, i) * factoredCovariance_(j, j));
+            // written so that nan also counts as a drift
+            if(!(std::abs(covariance_(i, j) - factoredCovariance_(i, j)) <= covUpdateTolerance_ * norm))
+                drifted = true;
+        }
     }
 
-    cholesky_.choleskyFactorize();
+    if(drifted)
+    {
+        for(int i = 0; i < n_; ++i)
+        {
+            for(int j = i; j < n_; ++j)
+            {
+                cholesky_(i, j) = covariance_(i, j);
+                factoredCovariance_(i, j) = covariance_(i, j);
+            }
+        }
+
+        cholesky_.choleskyFactorize();
+        choleskyFactored_ = true;
+        choleskyUpdated_ = true;
+        proposalChangedIter_ = iteration_;
 
-    // to be removed
-    covariance_.writeIntoTextFile("mcmc_covariance_matrix.txt");
-    cholesky_.writeIntoTextFile("mcmc_cholesky_matrix.txt");
+        // to be removed
+        covariance_.writeIntoTextFile("mcmc_covariance_matrix.txt");
+        cholesky_.writeIntoTextFile("mcmc_cholesky_matrix.txt");
+    }
 
     if(covarianceElementsNum_ > 100)
         covarianceReady_ = true;
 }
 
 void
-MetropolisHastings::writeCommInfo(std::ofstream& out) const
+MetropolisHastings::writeCommInfo(std::ostream& out) const
 {
     const int n = commInfo_.size();
     check(n == nChains_, "");
@@ -718,7 +1375,7 @@ MetropolisHastings::writeCommInfo(std::ofstream& out) const
 }
 
 void
-MetropolisHastings::readCommInfo(std::ifstream& in)
+MetropolisHastings::readCommInfo(std::istream& in)
 {
     commInfo_.clear();
     int n;
@@ -754,21 +1411,15 @@ MetropolisHastings::readCommInfo(std::ifstream& in)
 }
 
 void
-MetropolisHastings::writeResumeInfo() const
+MetropolisHastings::serializeResumeInfo(std::ostream& out) const
 {
-    std::ofstream out(resumeFileName_.c_str(), std::ios::binary | std::ios::out);
-    if(!out)
-        return;
-
     out.write((char*)(&maxChainLength_), sizeof(unsigned long));
     out.write((char*)(&iteration_), sizeof(unsigned long));
     out.write((char*)(&currentLike_), sizeof(double));
     out.write((char*)(&currentPrior_), sizeof(double));
     out.write((char*)(&(current_[0])), n_ * sizeof(double));
     out.write((char*)(&(prev_[0])), n_ * sizeof(double));
-    out.write((char*)(&(paramSum_[0])), n_ * sizeof(double));
-    out.write((char*)(&(paramSquaredSum_[0])), n_ * sizeof(double));
-    out.write((char*)(&(corSum_[0])), n_ * sizeof(double));
+    chainStats_.writeIntoFile(out);
 
     if(adapt_)
     {
@@ -798,32 +1449,52 @@ MetropolisHastings::writeResumeInfo() const
     if(isMaster())
         writeCommInfo(out);
 
-    out.write((char*)(&resumeCode_), sizeof(int));
+    const unsigned long long positions[2] = {uniformGen_->position(), generator_->position()};
+    out.write((char*)(positions), 2 * sizeof(unsigned long long));
+
+    // the rows up to the resume point, the current state is the pending row of the weighted output
+    out.write((char*)(&chainRows_), sizeof(unsigned long));
+    out.write((char*)(&pendingWeight_), sizeof(unsigned long));
 
-    out.close();
+    out.write((char*)(&resumeCode_), sizeof(int));
 }
 
 bool
 MetropolisHastings::readResumeInfo()
 {
+    if(useSharedResume())
+    {
+        std::string buffer;
+        if(!readSharedResume(buffer))
+            return false;
+        std::istringstream in(buffer, std::ios::binary | std::ios::in);
+        return readResumeInfo(in);
+    }
+
     std::ifstream in(resumeFileName_.c_str(), std::ios::binary | std::ios::in);
     if(!in)
         return false;
 
+    return readResumeInfo(in);
+}
+
+bool
+MetropolisHastings::readResumeInfo(std::istream& in)
+{
     in.read((char*)(&maxChainLength_), sizeof(unsigned long));
     in.read((char*)(&iteration_), sizeof(unsigned long));
     in.read((char*)(&currentLike_), sizeof(double));
     in.read((char*)(&currentPrior_), sizeof(double));
     in.read((char*)(&(current_[0])), n_ * sizeof(double));
     in.read((char*)(&(prev_[0])), n_ * sizeof(double));
-    in.read((char*)(&(paramSum_[0])), n_ * sizeof(double));
-    in.read((char*)(&(paramSquaredSum_[0])), n_ * sizeof(double));
-    in.read((char*)(&(corSum_[0])), n_ * sizeof(double));
+    chainStats_.readFromFile(in);
 
     if(adapt_)
     {
         myCovUpdateInfo_.readFromFile(in);
 
+        // the saved adaptive state replaces the starting covariance matrix
+        startMeanUnknown_ = false;
         in.read((char*)(&covarianceReady_), sizeof(covarianceReady_));
 
         check(covariance_.rows() == n_, "");
@@ -864,17 +1535,27 @@ MetropolisHastings::readResumeInfo()
         }
     }
 
+    unsigned long long positions[2] = {0, 0};
+    in.read((char*)(positions), 2 * sizeof(unsigned long long));
+
+    in.read((char*)(&chainRows_), sizeof(unsigned long));
+    in.read((char*)(&pendingWeight_), sizeof(unsigned long));
+    pending_ = current_;
+    pendingLike_ = currentLike_;
+
     int code = 0;
 
     in.read((char*)(&code), sizeof(int));
 
-    in.close();
-
     if(code != resumeCode_)
     {
         output_screen("Resume file is corrupt or not complete!" << std::endl);
         return false;
     }
+
+    // continue the random streams from where they stopped
+    uniformGen_->seek(positions[0]);
+    generator_->seek(positions[1]);
     return true;
 }
 } // namespace Math
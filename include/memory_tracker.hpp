@@ -0,0 +1,108 @@
+#ifndef COSMO_PP_MEMORY_TRACKER_HPP
+#define COSMO_PP_MEMORY_TRACKER_HPP
+
+#include <string>
+#include <atomic>
+
+/// Accounting of the memory of the large data structures.
+
+/// The classes that can take a lot of memory (CMatrix, WholeMatrix, LegendrePolynomialContainer, KDTree, and the data of FastApproximator) report the sizes of their buffers to the tracker, which keeps the current and the peak memory of each subsystem and of all of them together.
+/// Only the heap memory owned by the objects is counted, memory-mapped files are not. The report (also included in the Profiler report) gives the peaks and, with MPI, their minimum, mean and maximum over the processes, together with the peak resident memory of the process.
+/// The classes also have memoryEstimate functions that give the memory needed for given sizes without allocating anything.
+class MemoryTracker
+{
+public:
+    /// The subsystems for which the memory is counted.
+    enum Subsystem { C_MATRIX = 0, WHOLE_MATRIX, LEGENDRE_CONTAINER, KD_TREE, EMULATOR_DATA, SUBSYSTEM_MAX };
+
+    /// Get the tracker, there is only one.
+    static MemoryTracker& instance()
+    {
+        static MemoryTracker t;
+        return t;
+    }
+
+    /// The name of a subsystem, for the reports.
+    static const char* subsystemName(Subsystem s);
+
+    /// Count an allocation or a release. Thread safe.
+    /// \param s The subsystem.
+    /// \param bytes The number of bytes allocated, negative for a release.
+    void add(Subsystem s, long bytes);
+
+    /// The memory of a subsystem currently allocated in this process, in bytes.
+    long current(Subsystem s) const;
+
+    /// The peak memory of a subsystem in this process, in bytes.
+    long peak(Subsystem s) const;
+
+    /// The memory of all of the subsystems together currently allocated in this process, in bytes.
+    long totalCurrent() const { return totalCurrent_.load(); }
+
+    /// The peak of the memory of all of the subsystems together in this process, in bytes.
+    long totalPeak() const { return totalPeak_.load(); }
+
+    /// The peak resident memory of this process (as given by the operating system), in bytes. 0 if not available.
+    static long processPeak();
+
+    /// Set the peaks to the current values.
+    void resetPeaks();
+
+    /// The report of the memory of the subsystems.
+    /// With MPI this is collective, ALL of the processes must call it.
+    /// \param acrossProcesses If true (default) the statistics are combined over the MPI processes, otherwise only this process is reported.
+    /// \return The report, one line per subsystem with the current and the peak memory in megabytes (minimum, mean and maximum over the processes). Empty if nothing has been tracked. With MPI, the full report is only returned to the master process, the others get an empty string.
+    std::string report(bool acrossProcesses = true);
+
+    /// Output the report on the screen (only the master process with MPI). Collective with MPI, see report.
+    void printReport(bool acrossProcesses = true);
+
+    /// The memory of one object, to be used as a member of the classes being tracked. The memory is released from the tracker when the object is destroyed, and counted again when it is copied.
+    class Allocation
+    {
+    public:
+        /// Constructor.
+        /// \param s The subsystem.
+        Allocation(Subsystem s) : s_(s), bytes_(0) {}
+
+        Allocation(const Allocation& other) : s_(other.s_), bytes_(0) { set(other.bytes_); }
+
+        Allocation& operator = (const Allocation& other)
+        {
+            set(other.bytes_);
+            return *this;
+        }
+
+        ~Allocation() { set(0); }
+
+        /// Set the memory of the object.
+        /// \param bytes The number of bytes.
+        void set(unsigned long bytes)
+        {
+            if(bytes != bytes_)
+                MemoryTracker::instance().add(s_, long(bytes) - long(bytes_));
+            bytes_ = bytes;
+        }
+
+        /// The memory of the object in bytes.
+        unsigned long bytes() const { return bytes_; }
+
+    private:
+        const Subsystem s_;
+        unsigned long bytes_;
+    };
+
+private:
+    MemoryTracker();
+    MemoryTracker(const MemoryTracker&);
+    MemoryTracker& operator = (const MemoryTracker&);
+
+    static void updateMax(std::atomic<long>& m, long value);
+
+private:
+    std::atomic<long> current_[SUBSYSTEM_MAX];
+    std::atomic<long> peak_[SUBSYSTEM_MAX];
+    std::atomic<long> totalCurrent_, totalPeak_;
+};
+
+#endif
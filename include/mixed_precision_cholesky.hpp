@@ -0,0 +1,63 @@
+#ifndef COSMO_PP_MIXED_PRECISION_CHOLESKY_HPP
+#define COSMO_PP_MIXED_PRECISION_CHOLESKY_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+#include <matrix.hpp>
+
+namespace Math
+{
+
+/// A mixed precision Cholesky factorization of a symmetric positive definite matrix.
+
+/// The factorization is done and stored in single precision, so it needs half of the memory of a double precision factorization and is about twice as fast. The solutions are then refined in double precision with iterative refinement, using the original matrix, so they have double precision accuracy as long as the condition number of the matrix is well below 1 / (single precision epsilon) ~ 10^7.
+/// The original matrix is not copied, it is only referenced, so it must not be changed or destroyed while this object is used. So compared to a double precision factorization of a copy of the matrix (needed when the matrix is used later, as for the likelihood calculation) this needs 3/4 of the memory.
+/// If the single precision factorization fails or the refinement does not converge (the matrix is too ill conditioned) a double precision factorization is done instead, which needs a full copy of the matrix.
+/// Note that the log determinant is calculated from the single precision factor, the relative accuracy of each of its terms is about 10^-7.
+class MixedPrecisionCholesky
+{
+public:
+    /// Constructor.
+    /// \param mat The matrix to be factorized, must be positive definite. It is referenced, not copied.
+    MixedPrecisionCholesky(const SymmetricMatrix<double>& mat);
+
+    /// Cholesky factorize the matrix.
+    /// \return 0 if successful, otherwise an error code (see the documentation of dpptrf).
+    int factorize();
+
+    /// Check if the single precision factorization is being used, false if switched to double precision.
+    bool isSinglePrecision() const { return doubleFactor_.rows() == 0; }
+
+    /// The logarithm of the determinant. This function should be called after factorize.
+    double logDet() const;
+
+    /// Solve the linear system A x = b. This function should be called after factorize.
+    /// \param b The right hand sides, a vector of size n * nRhs, each right hand side stored one after the other. Will be replaced by the solutions.
+    /// \param nRhs The number of right hand sides.
+    /// \param maxIterations The maximum number of refinement iterations. The solutions are refined until the residuals are at the level of the double precision rounding errors (the same criterion as dsposv of LAPACK). If this is not reached the solutions are recalculated in double precision.
+    /// \return 0 if successful, otherwise an error code (see the documentation of dpptrs).
+    int solve(std::vector<double>& b, int nRhs = 1, int maxIterations = 30);
+
+    /// The maximum number of the refinement iterations over the right hand sides of the last solve, 0 if it was done in double precision.
+    int iterations() const { return iterations_; }
+
+private:
+    int switchToDouble();
+
+private:
+    const SymmetricMatrix<double>* mat_;
+    const int n_;
+    bool factorized_;
+    int iterations_;
+    double norm_;
+
+    // the single precision factor in the packed storage of SymmetricMatrix
+    std::vector<float> factor_;
+    SymmetricMatrix<double> doubleFactor_;
+};
+
+} // namespace Math
+
+#endif
+
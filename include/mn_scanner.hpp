@@ -3,9 +3,13 @@
 
 #include <vector>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include <likelihood_function.hpp>
-#include <table_function.hpp>
+#include <function.hpp>
+#include <prior_transform.hpp>
 
 /// A Multinest scanner.
 
@@ -21,6 +25,9 @@ public:
     /// \param accurateEvidence Defines if accurate Bayesian evidence calculation is required (true by default). If this is not required the run will be faster.
     MnScanner(int nPar, Math::LikelihoodFunction& like, int nLive, std::string fileRoot, bool accurateEvidence = true);
 
+    /// Destructor. Waits for the output being written in the background to finish.
+    ~MnScanner();
+
     /// Define a given parameter to have a uniform prior. One of the parameter setting functions must be called for each parameter before the run.
     /// \param i The index of the parameter, 0 <= i < number of parameters.
     /// \param name The name of the parameter.
@@ -35,13 +42,21 @@ public:
     /// \param sigma The sigma of the prior
     void setParamGauss(int i, const std::string& name, double mean, double sigma);
 
+    /// Define a given parameter to have a log uniform prior. One of the parameter setting functions must be called for each parameter before the run.
+    /// \param i The index of the parameter, 0 <= i < number of parameters.
+    /// \param name The name of the parameter.
+    /// \param min The minimum value of the parameter (the lower bound for the prior), must be positive.
+    /// \param max The maximum value of the parameter (the upper bound for the prior).
+    void setParamLogUniform(int i, const std::string& name, double min, double max);
+
     /// Define a given parameter to have a general prior. One of the parameter setting functions must be called for each parameter before the run.
     /// \param i The index of the parameter, 0 <= i < number of parameters.
     /// \param name The name of the parameter.
     /// \param min The minimum value of the parameter (the lower bound for the prior).
     /// \param max The maximum value of the parameter (the upper bound for the prior).
-    /// \param distrib The prior function. This function should be valid between min and max.
-    void setParamGeneral(int i, const std::string& name, double min, double max, const Math::RealFunction& distrib);
+    /// \param distrib The prior function. This function should be valid between min and max. It is tabulated once (see Math::PriorTransform::setGeneral).
+    /// \param cubic Use the cubic interpolation of the tabulated prior instead of the linear one.
+    void setParamGeneral(int i, const std::string& name, double min, double max, const Math::RealFunction& distrib, bool cubic = false);
 
     /// Define a given parameter to be fixed to a given value.
     /// \param i The index of the parameter, 0 <= i < number of parameters.
@@ -54,6 +69,29 @@ public:
     /// \return The name of the parameter.
     const std::string& getParamName(int i) const { check(i >= 0 && i < n_, "invalid index " << i); return paramNames_[i]; }
 
+    /// Set the number of OpenMP threads used by each likelihood evaluation during the run.
+    /// MultiNest requests the points of each process one at a time and chooses the next point based on the previous results, so the points cannot be evaluated concurrently. Instead, each evaluation is run on nThreads threads (see Math::ThreadedLikelihood), which are used by the parallel regions of the likelihood itself (CLASS and clik are parallelized with OpenMP). MultiNest and the output keep the thread setting of the caller.
+    /// Typically the number of MPI processes times nThreads should be the number of cores. Has no effect without OpenMP.
+    /// \param nThreads The number of threads. 0 (the default) leaves the OpenMP setting unchanged.
+    void setLikelihoodThreads(int nThreads) { check(nThreads >= 0, "invalid number of threads " << nThreads); likeThreads_ = nThreads; }
+
+    /// Write the posterior samples and the live points in the binary chain format (see BinaryChain) instead of text each time MultiNest updates its output.
+    /// The posterior samples are written into (fileRoot)posterior.bin, with the posterior probability as the weight, and the live points into (fileRoot)live.bin, all with weight 1. Both contain all of the parameters, including the fixed ones, and can be read directly by MarkovChain.
+    /// Each evidence update is appended to (fileRoot)evidence.txt as the number of samples, log(Z), the importance sampling log(Z), and the error of log(Z). The updates between the writes (see setDumpInterval) are kept, so none of them are lost.
+    /// The text files written by the MultiNest library itself are not affected.
+    /// \param binary Use the binary output or not.
+    void setBinaryOutput(bool binary = true) { binaryOutput_ = binary; }
+
+    /// Set the minimum wall time between the writes of the posterior samples and the constraints. MultiNest gives its output every 1000 iterations, the updates that come sooner than this after the last write are only copied into memory, and the latest one is written when the interval has passed or when run finishes.
+    /// The first update is always written.
+    /// \param seconds The interval in seconds (30 by default). 0 writes every update.
+    void setDumpInterval(double seconds) { check(seconds >= 0, "invalid interval " << seconds); dumpInterval_ = seconds; }
+
+    /// Write the posterior samples and the constraints in a background thread (the default). The MultiNest output is copied into memory in the callback, so the sampler (and the other processes waiting on it) can continue while the files are written. If the previous output is still being written the new one is kept, and only the latest one is written when run finishes.
+    /// The files are first written under temporary names and then renamed, so a reader never sees a partially written file.
+    /// \param async true to write in the background, false to write directly from the callback.
+    void setAsyncDump(bool async = true);
+
     /// Run the scan. Should be called after all of the other necessary functions have been called to set all of the necessary settings. The resulting chain is written in the file (fileRoot).txt. The first column is the number of repetitions of the element, the second column is -2ln(likelihood), the following columns are the values of all of the parameters.
     /// \param resume Resume from previous job or not (true by default).
     void run(bool resume = true);
@@ -63,18 +101,48 @@ public:
     void dumper(int &nSamples, int &nlive, int &nPar, double **physLive, double **posterior, double **paramConstr, double &maxLogLike, double &logZ, double &INSLogZ, double &logZerr);
 
 private:
+    // a copy of the MultiNest output, the arrays are stored column by column as given by MultiNest
+    struct DumpBuffer
+    {
+        int nSamples, nLive, nPar;
+        std::vector<double> posterior, physLive, paramConstr;
+        double logZ, INSLogZ, logZerr;
+        // the evidence lines not written yet
+        std::string evidence;
+    };
+
     void dumpInfo(const char* error);
+    void writeDump(const DumpBuffer& buffer) const;
+    void dumpText(const DumpBuffer& buffer) const;
+    void dumpBinary(const DumpBuffer& buffer) const;
+    void dumpConstraints(const DumpBuffer& buffer) const;
+    void writeDumpInBackground();
+    void startDumpWriting();
+    // joins the writing thread and writes the pending output, the errors are kept in dumpError_
+    void waitForDump();
 
 private:
     Math::LikelihoodFunction& like_;
     std::vector<double> paramsStarting_, paramsMean_, paramsStd_, paramsBest_, paramsCurrent_;
     std::vector<std::string> paramNames_;
-    std::vector<Math::TableFunction<double, double> > paramPriors_;
+    std::vector<Math::PriorTransform> paramPriors_;
     std::vector<double> paramsFixed_;
     int nFixed_;
     int n_, nLive_;
     std::string fileRoot_;
     bool accurateEvidence_;
+    int likeThreads_;
+    bool binaryOutput_;
+
+    // the output written in the background (see setAsyncDump), dumpWriting_ is only touched by the writing thread while it runs
+    bool asyncDump_;
+    double dumpInterval_;
+    bool dumpStarted_, hasPendingDump_;
+    std::chrono::steady_clock::time_point lastDump_;
+    std::thread* dumpThread_;
+    std::atomic<bool> dumpDone_;
+    DumpBuffer dumpWriting_, dumpPending_;
+    std::string dumpError_;
 };
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef COSMO_PP_MODE_DIRECTIONS_HPP
 #define COSMO_PP_MODE_DIRECTIONS_HPP
 
+#include <vector>
+
 #include <alm.h>
 #include <xcomplex.h>
 #include <healpix_map.h>
@@ -27,7 +29,50 @@ public:
     /// \param phi The angle phi of the direction maximizing the angular momentum dispersion will be written here.
     /// \param map A pointer to a Healpix map where the angular momentum dispersion as a function of direction will be stored. Give NULL to not store it (this is the default option). The resulting N_side of the map is the same as nSide.
     void maximizeAngularMomentumDispersion(int l, long nSide, double& theta, double& phi, Healpix_Map<double>* map = NULL) const;
+
+    /// Calculate the angular momentum dispersion for all of the modes up to lMax in a given direction. The rotation (the Wigner d matrices) is calculated only once for all of the modes.
+    /// \param lMax The maximum mode l.
+    /// \param theta The theta of the direction.
+    /// \param phi The phi of the direction.
+    /// \param disp The angular momentum dispersions for l from 0 to lMax will be written here.
+    void calculateAngularMomentumDispersion(int lMax, double theta, double phi, std::vector<double>* disp) const;
+
+    /// Find the direction in which the angular momentum dispersion is maximized with a hierarchical search, much faster than maximizeAngularMomentumDispersion for high resolutions.
+    /// The dispersion is first calculated on all of the pixels of a coarse Healpix grid, then the best nCandidates pixels are refined by going to the 4 subpixels (NEST scheme) until nSide is reached, keeping the best nCandidates pixels at each level. Finally, if tolerance is positive, the direction is refined further by a local (compass) search starting from the best pixel.
+    /// \param l The mode l.
+    /// \param nSideCoarse The nSide of the initial grid. It should be fine enough to resolve the peaks of the dispersion for the given l (about nSide >= l / 4).
+    /// \param nSide The nSide of the finest grid, must be nSideCoarse times a power of 2.
+    /// \param theta The angle theta of the direction maximizing the angular momentum dispersion will be written here.
+    /// \param phi The angle phi of the direction maximizing the angular momentum dispersion will be written here.
+    /// \param nCandidates The number of the candidate pixels kept at each level.
+    /// \param tolerance The angular precision (in radians) of the final local search, 0 means no local search (then the result is the center of a pixel of nSide).
+    /// \return The maximum angular momentum dispersion.
+    double searchAngularMomentumDispersion(int l, long nSideCoarse, long nSide, double& theta, double& phi, int nCandidates = 8, double tolerance = 0) const;
+
+    /// The same as searchAngularMomentumDispersion for all of the modes from 1 to lMax at once. At each level of the grid all of the modes are calculated for the union of the candidate pixels, so the rotation for each direction is shared between them. The local searches for the different modes are done in parallel.
+    /// \param lMax The maximum mode l.
+    /// \param nSideCoarse The nSide of the initial grid (see searchAngularMomentumDispersion, it should be fine enough for lMax).
+    /// \param nSide The nSide of the finest grid, must be nSideCoarse times a power of 2.
+    /// \param theta The angles theta of the directions for l from 0 to lMax will be written here (the value for l = 0 is meaningless).
+    /// \param phi The angles phi of the directions for l from 0 to lMax will be written here.
+    /// \param maxDisp If not NULL, the maximum dispersions for l from 0 to lMax will be written here.
+    /// \param nCandidates The number of the candidate pixels kept at each level for each l.
+    /// \param tolerance The angular precision of the final local search, 0 means no local search.
+    void searchAngularMomentumDispersion(int lMax, long nSideCoarse, long nSide, std::vector<double>* theta, std::vector<double>* phi, std::vector<double>* maxDisp = NULL, int nCandidates = 8, double tolerance = 0) const;
     
+private:
+    // the dispersions for l from lMin to lMax in a given direction
+    void calculateDispersions(int lMin, int lMax, double theta, double phi, double* disp) const;
+
+    // the dispersions for l from lMin to lMax for the given pixels (NEST scheme), pixel by pixel
+    void calculatePixels(int lMin, int lMax, long nSide, const std::vector<long>& pixels, std::vector<double>* disp) const;
+
+    // local search around the given direction starting from the given step size
+    double refine(int l, double& theta, double& phi, double disp, double step, double tolerance) const;
+
+    // the hierarchical search for l from lMin to lMax, the results are indexed by l - lMin
+    void search(int lMin, int lMax, long nSideCoarse, long nSide, int nCandidates, double tolerance, std::vector<double>* theta, std::vector<double>* phi, std::vector<double>* maxDisp) const;
+
 private:
     Alm<xcomplex<double> > alm_;
 };
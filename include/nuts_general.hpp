@@ -0,0 +1,521 @@
+#ifndef COSMO_PP_NUTS_GENERAL_HPP
+#define COSMO_PP_NUTS_GENERAL_HPP
+
+#include <ctime>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <random.hpp>
+#include <large_vector_ops.hpp>
+
+namespace Math
+{
+
+// LargeVector, LargeVectorFactory and Function are the same as for HMCGeneral (see hmc_general.hpp)
+
+/// A No-U-Turn sampler (NUTS) for functions of possibly very large dimensions.
+
+/// The trajectories are doubled in random directions until they make a U-turn (the generalized criterion of Betancourt, on the sums of the momenta), and the samples are drawn from them multinomially, so there is no trajectory length to tune.
+/// The step size is tuned during warm-up by dual averaging (Hoffman & Gelman 2014) to reach the target acceptance statistic, and the (diagonal) masses are set to the inverse variances of the samples in the windows of the warm-up, as in Stan.
+/// Dense mass matrices are not supported, since the LargeVector concept only has element-wise operations and a dense matrix does not fit in memory for the dimensions this class is meant for.
+/// The function value is -2ln(like), as for HMCGeneral. The memory use is 3 vectors for each tree depth plus 12 vectors (4 more during the mass adaptation), the momentum is only stored at the edges of the subtrees.
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+class NUTSGeneral
+{
+public:
+    /// Constructor.
+    /// \param factory A factory for LargeVector.
+    /// \param f The function, -2ln(like).
+    /// \param starting The starting point.
+    /// \param masses The starting masses, all positive. If the mass adaptation is on these are only used at the start of the warm-up.
+    /// \param epsilon The starting step size. If 0 or negative, a reasonable step size is found by doubling or halving until the acceptance probability of one step crosses 0.5.
+    /// \param maxDepth The maximum depth of the trees, i.e. at most 2^maxDepth - 1 steps for each sample.
+    /// \param seed The random seed, if 0 the time is used.
+    NUTSGeneral(LargeVectorFactory *factory, Function *f, const LargeVector& starting, const LargeVector& masses, double epsilon = 0, int maxDepth = 10, int seed = 0);
+    ~NUTSGeneral() {}
+
+    /// Set the target acceptance statistic for the step size adaptation, the default is 0.8.
+    void setTargetAcceptance(double delta) { check(delta > 0 && delta < 1, "invalid target acceptance " << delta); targetAccept_ = delta; }
+
+    /// Turn the mass adaptation on or off (on by default). The step size is always adapted during warm-up.
+    void setMassAdaptation(bool adapt) { adaptMass_ = adapt; }
+
+    /// Run the sampler.
+    /// \param nWarmup The number of warm-up iterations, during which the step size and the masses are adapted. These samples are not passed to the callback.
+    /// \param maxIters The number of samples after the warm-up.
+    /// \param callback A callback with "void operator()(const LargeVector& x, double like)", called for each sample after the warm-up (like is -2ln(like)).
+    template<typename CallBack>
+    void run(int nWarmup, int maxIters, CallBack* callback);
+
+    void stop() { stop_ = true; }
+
+    /// The current step size (the adapted one after the warm-up).
+    double stepSize() const { return epsilon_; }
+
+    /// Get the current masses.
+    void getMasses(LargeVector *m) const { m->copy(*mass_); }
+
+    /// The mean acceptance statistic of the samples after the warm-up.
+    double acceptanceStatistic() const { return (samples_ > 0 ? acceptSum_ / samples_ : 0); }
+
+    /// The number of divergent trajectories after the warm-up.
+    int divergences() const { return divergences_; }
+
+    /// The mean number of steps (leapfrog gradient evaluations) per sample after the warm-up.
+    double meanSteps() const { return (samples_ > 0 ? double(steps_) / samples_ : 0); }
+
+private:
+    // the state at one edge of the trajectory, integrated further when the trajectory is extended in that direction
+    struct Edge
+    {
+        std::unique_ptr<LargeVector> x, p, g;
+    };
+
+    // the sum of the momenta, the first momentum and the proposal of a subtree of a given depth
+    struct Level
+    {
+        std::unique_ptr<LargeVector> rho, pBegin, xProp;
+        double propLike;
+    };
+
+    double uniform();
+    void generateP(LargeVector *p);
+    double kinetic(const LargeVector& p) const;
+    void leapfrog(Edge& e, double eps, double* like);
+    bool turning(const LargeVector& rho, const LargeVector& p1, const LargeVector& p2) const;
+    bool buildTree(int depth, int dir, double h0, double* logW, double* acceptSum, int* nSteps);
+    void findReasonableEpsilon(double like);
+    void updateMasses();
+
+    static double logAddExp(double a, double b)
+    {
+        const double m = std::max(a, b);
+        return m + std::log(std::exp(a - m) + std::exp(b - m));
+    }
+
+private:
+    LargeVectorFactory *factory_;
+    Function *f_;
+    const int maxDepth_;
+    int gaussSeed_;
+
+    std::unique_ptr<Math::UniformRealGenerator> uniformGen_;
+
+    std::unique_ptr<LargeVector> mass_, massSqrt_;
+    std::unique_ptr<LargeVector> x_, rho_, temp_;
+    Edge edges_[2];
+    std::vector<Level> levels_;
+
+    // for the mass adaptation
+    std::unique_ptr<LargeVector> mean_, m2_, diff_, ones_;
+    int nVar_;
+
+    double epsilon_, targetAccept_;
+    bool adaptMass_;
+    bool divergent_;
+
+    int samples_, divergences_;
+    unsigned long steps_;
+    double acceptSum_;
+
+    bool stop_;
+
+    CosmoMPI& mpi_;
+};
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+NUTSGeneral<LargeVector, LargeVectorFactory, Function>::NUTSGeneral(LargeVectorFactory *factory, Function *f, const LargeVector& starting, const LargeVector& masses, double epsilon, int maxDepth, int seed) : factory_(factory), f_(f), maxDepth_(maxDepth), levels_(maxDepth), nVar_(0), epsilon_(epsilon), targetAccept_(0.8), adaptMass_(true), divergent_(false), samples_(0), divergences_(0), steps_(0), acceptSum_(0), stop_(false), mpi_(CosmoMPI::create())
+{
+    check(maxDepth_ >= 1, "invalid maximum depth " << maxDepth_);
+
+    x_.reset(factory->giveMeOne());
+    rho_.reset(factory->giveMeOne());
+    temp_.reset(factory->giveMeOne());
+    mass_.reset(factory->giveMeOne());
+    massSqrt_.reset(factory->giveMeOne());
+    for(int i = 0; i < 2; ++i)
+    {
+        edges_[i].x.reset(factory->giveMeOne());
+        edges_[i].p.reset(factory->giveMeOne());
+        edges_[i].g.reset(factory->giveMeOne());
+    }
+    for(int d = 0; d < maxDepth_; ++d)
+    {
+        levels_[d].rho.reset(factory->giveMeOne());
+        levels_[d].pBegin.reset(factory->giveMeOne());
+        levels_[d].xProp.reset(factory->giveMeOne());
+        levels_[d].propLike = 0;
+    }
+
+    if(mpi_.isMaster())
+    {
+        int uniformSeed = seed;
+        if(uniformSeed == 0)
+            uniformSeed = std::time(0);
+
+        gaussSeed_ = uniformSeed + 1;
+
+        uniformGen_.reset(new Math::UniformRealGenerator(uniformSeed, 0, 1));
+    }
+    mpi_.bcast(&gaussSeed_, 1, CosmoMPI::INT);
+
+    mass_->copy(masses);
+    x_->copy(starting);
+    massSqrt_->copy(*mass_);
+    massSqrt_->pow(0.5);
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+template<typename CallBack>
+void NUTSGeneral<LargeVector, LargeVectorFactory, Function>::run(int nWarmup, int maxIters, CallBack *callback)
+{
+    check(nWarmup >= 0, "");
+    check(maxIters > 0, "");
+
+    f_->set(*x_);
+    CosmoMPI::create().barrier();
+
+    double currentLike = f_->value();
+
+    if(epsilon_ <= 0)
+        findReasonableEpsilon(currentLike);
+
+    // dual averaging parameters
+    const double gamma = 0.05, t0 = 10, kappa = 0.75;
+    double mu = std::log(10 * epsilon_), hBar = 0, logEpsBar = 0;
+    int t = 0;
+
+    // the mass adaptation windows (as in Stan), a fast initial buffer, slow windows doubling in size, then a fast terminal buffer
+    int initBuffer = 75, termBuffer = 50, window = 25;
+    if(nWarmup < 20)
+        initBuffer = termBuffer = window = -1;
+    else if(initBuffer + termBuffer + window > nWarmup)
+    {
+        initBuffer = int(0.15 * nWarmup);
+        termBuffer = int(0.1 * nWarmup);
+        window = nWarmup - initBuffer - termBuffer;
+    }
+    const bool adaptMass = adaptMass_ && window > 0;
+    const int slowEnd = nWarmup - termBuffer;
+    int windowEnd = initBuffer + window;
+    if(adaptMass)
+    {
+        if(windowEnd + 2 * window > slowEnd)
+            windowEnd = slowEnd;
+        mean_.reset(factory_->giveMeOne());
+        m2_.reset(factory_->giveMeOne());
+        diff_.reset(factory_->giveMeOne());
+        ones_.reset(factory_->giveMeOne());
+        ones_->copy(*x_);
+        ones_->pow(0);
+        mean_->setToZero();
+        m2_->setToZero();
+        nVar_ = 0;
+    }
+
+    samples_ = 0;
+    divergences_ = 0;
+    steps_ = 0;
+    acceptSum_ = 0;
+    unsigned long gradEvals = 0;
+
+    for(int iter = 0; iter < nWarmup + maxIters; ++iter)
+    {
+        // x_ should be the current point here, f_ is set to x_, and currentLike is the likelihood for x_
+        const bool warmup = (iter < nWarmup);
+
+        Edge& e0 = edges_[0];
+        f_->derivative(e0.g.get());
+        ++gradEvals;
+
+        generateP(e0.p.get());
+        e0.x->copy(*x_);
+        edges_[1].x->copy(*e0.x);
+        edges_[1].p->copy(*e0.p);
+        edges_[1].g->copy(*e0.g);
+        rho_->copy(*e0.p);
+
+        const double h0 = (currentLike + kinetic(*e0.p)) / 2;
+        double logWTotal = 0;
+        double acceptSum = 0;
+        int nSteps = 0;
+        divergent_ = false;
+
+        for(int depth = 0; depth < maxDepth_; ++depth)
+        {
+            const int dir = (uniform() < 0.5 ? 0 : 1);
+            double logW;
+            if(!buildTree(depth, dir, h0, &logW, &acceptSum, &nSteps))
+                break;
+
+            // biased progressive sampling, favors the new subtree
+            const Level& lev = levels_[depth];
+            if(uniform() < std::exp(logW - logWTotal))
+            {
+                x_->swap(*lev.xProp);
+                currentLike = lev.propLike;
+            }
+            logWTotal = logAddExp(logWTotal, logW);
+            rho_->add(*lev.rho);
+
+            if(turning(*rho_, *(edges_[0].p), *(edges_[1].p)))
+                break;
+        }
+
+        gradEvals += nSteps;
+        const double alpha = (nSteps > 0 ? acceptSum / nSteps : 0);
+
+        f_->set(*x_);
+        mpi_.barrier();
+
+        if(warmup)
+        {
+            ++t;
+            const double eta = 1.0 / (t + t0);
+            hBar = (1 - eta) * hBar + eta * (targetAccept_ - alpha);
+            const double logEps = mu - std::sqrt(double(t)) / gamma * hBar;
+            const double w = std::pow(double(t), -kappa);
+            logEpsBar = w * logEps + (1 - w) * logEpsBar;
+            epsilon_ = std::exp(logEps);
+
+            if(adaptMass && iter >= initBuffer && iter < slowEnd)
+            {
+                // Welford's algorithm for the variances
+                ++nVar_;
+                diff_->copy(*x_);
+                diff_->add(*mean_, -1);
+                mean_->add(*diff_, 1.0 / nVar_);
+                temp_->copy(*x_);
+                temp_->add(*mean_, -1);
+                temp_->multiply(*diff_);
+                m2_->add(*temp_);
+
+                if(iter == windowEnd - 1)
+                {
+                    updateMasses();
+                    mean_->setToZero();
+                    m2_->setToZero();
+                    nVar_ = 0;
+
+                    // the step size needs to be adapted again for the new masses
+                    mu = std::log(10 * epsilon_);
+                    hBar = 0;
+                    logEpsBar = 0;
+                    t = 0;
+
+                    window *= 2;
+                    windowEnd = iter + 1 + window;
+                    if(windowEnd + 2 * window > slowEnd)
+                        windowEnd = slowEnd;
+                }
+            }
+
+            if(iter == nWarmup - 1)
+            {
+                epsilon_ = std::exp(logEpsBar);
+                if(mpi_.isMaster())
+                {
+                    output_screen("NUTS warm-up finished! Step size: " << epsilon_ << std::endl);
+                }
+            }
+            continue;
+        }
+
+        ++samples_;
+        steps_ += nSteps;
+        acceptSum_ += alpha;
+        if(divergent_)
+            ++divergences_;
+
+        (*callback)(*x_, currentLike);
+
+        if(stop_)
+            break;
+    }
+
+    if(adaptMass)
+    {
+        mean_.reset();
+        m2_.reset();
+        diff_.reset();
+        ones_.reset();
+    }
+
+    if(mpi_.isMaster())
+    {
+        output_screen("NUTS Sampling finished! Total " << samples_ << " samples, grad evaluations: " << gradEvals << ", mean steps per sample: " << meanSteps() << ", mean acceptance statistic: " << acceptanceStatistic() << ", divergences: " << divergences_ << std::endl);
+    }
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+double NUTSGeneral<LargeVector, LargeVectorFactory, Function>::uniform()
+{
+    double q = 0;
+    if(mpi_.isMaster())
+        q = uniformGen_->generate();
+    mpi_.bcast(&q, 1, CosmoMPI::DOUBLE);
+    return q;
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+void NUTSGeneral<LargeVector, LargeVectorFactory, Function>::generateP(LargeVector *p)
+{
+    f_->whitenoise(gaussSeed_++, p, 1.0);
+    p->multiply(*massSqrt_);
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+double NUTSGeneral<LargeVector, LargeVectorFactory, Function>::kinetic(const LargeVector& p) const
+{
+    temp_->copy(p);
+    temp_->divide(*mass_);
+    return temp_->dotProduct(p);
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+void NUTSGeneral<LargeVector, LargeVectorFactory, Function>::leapfrog(Edge& e, double eps, double* like)
+{
+    e.p->add(*e.g, -eps / 2 / 2); // divide by 2 because the derivative is of -2ln(like)
+    temp_->copy(*e.p);
+    temp_->divide(*mass_);
+    e.x->add(*temp_, eps);
+
+    f_->set(*e.x);
+    mpi_.barrier();
+    *like = f_->value();
+    f_->derivative(e.g.get());
+    e.p->add(*e.g, -eps / 2 / 2);
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+bool NUTSGeneral<LargeVector, LargeVectorFactory, Function>::turning(const LargeVector& rho, const LargeVector& p1, const LargeVector& p2) const
+{
+    // rho . M^-1 p at both ends
+    temp_->copy(rho);
+    temp_->divide(*mass_);
+    const LargeVector* others[2] = {&p1, &p2};
+    double dots[2];
+    LargeVectorDotProducts<LargeVector>::calculate(*temp_, 2, others, dots);
+    return !(dots[0] > 0 && dots[1] > 0);
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+bool NUTSGeneral<LargeVector, LargeVectorFactory, Function>::buildTree(int depth, int dir, double h0, double* logW, double* acceptSum, int* nSteps)
+{
+    Edge& e = edges_[dir];
+    Level& lev = levels_[depth];
+
+    if(depth == 0)
+    {
+        double like;
+        leapfrog(e, (dir == 0 ? -epsilon_ : epsilon_), &like);
+        ++(*nSteps);
+
+        const double h = (like + kinetic(*e.p)) / 2;
+        const double maxDeltaH = 1000;
+        if(!(h - h0 <= maxDeltaH))
+        {
+            divergent_ = true;
+            return false;
+        }
+
+        *logW = h0 - h;
+        *acceptSum += std::min(1.0, std::exp(h0 - h));
+        lev.rho->copy(*e.p);
+        lev.pBegin->copy(*e.p);
+        lev.xProp->copy(*e.x);
+        lev.propLike = like;
+        return true;
+    }
+
+    // the first half, moved up to this level by swapping the buffers
+    double logW1;
+    if(!buildTree(depth - 1, dir, h0, &logW1, acceptSum, nSteps))
+        return false;
+
+    Level& sub = levels_[depth - 1];
+    lev.rho->swap(*sub.rho);
+    lev.pBegin->swap(*sub.pBegin);
+    lev.xProp->swap(*sub.xProp);
+    lev.propLike = sub.propLike;
+
+    // the second half
+    double logW2;
+    if(!buildTree(depth - 1, dir, h0, &logW2, acceptSum, nSteps))
+        return false;
+
+    *logW = logAddExp(logW1, logW2);
+
+    // multinomial sampling inside the subtree
+    if(uniform() < std::exp(logW2 - *logW))
+    {
+        lev.xProp->swap(*sub.xProp);
+        lev.propLike = sub.propLike;
+    }
+    lev.rho->add(*sub.rho);
+
+    return !turning(*lev.rho, *lev.pBegin, *e.p);
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+void NUTSGeneral<LargeVector, LargeVectorFactory, Function>::findReasonableEpsilon(double like)
+{
+    Edge& e0 = edges_[0];
+    Edge& e1 = edges_[1];
+    f_->derivative(e0.g.get());
+    generateP(e0.p.get());
+    const double h0 = (like + kinetic(*e0.p)) / 2;
+
+    epsilon_ = 1;
+    int a = 0;
+    for(int i = 0; i < 100; ++i)
+    {
+        e1.x->copy(*x_);
+        e1.p->copy(*e0.p);
+        e1.g->copy(*e0.g);
+        double newLike;
+        leapfrog(e1, epsilon_, &newLike);
+        const double h = (newLike + kinetic(*e1.p)) / 2;
+        const double logP = h0 - h;
+
+        if(a == 0)
+            a = (logP > std::log(0.5) ? 1 : -1);
+
+        if(a == 1 && !(logP > std::log(0.5)))
+            break;
+        if(a == -1 && logP > std::log(0.5))
+            break;
+
+        epsilon_ *= (a == 1 ? 2.0 : 0.5);
+    }
+
+    f_->set(*x_);
+    mpi_.barrier();
+
+    if(mpi_.isMaster())
+    {
+        output_screen("NUTS starting step size: " << epsilon_ << std::endl);
+    }
+}
+
+template <typename LargeVector, typename LargeVectorFactory, typename Function>
+void NUTSGeneral<LargeVector, LargeVectorFactory, Function>::updateMasses()
+{
+    check(nVar_ > 2, "");
+
+    // the variances, regularized towards 1e-3 as in Stan
+    const double n = nVar_;
+    mass_->copy(*m2_, 1.0 / (n - 1) * n / (n + 5));
+    mass_->add(*ones_, 1e-3 * 5 / (n + 5));
+    mass_->pow(-1);
+    massSqrt_->copy(*mass_);
+    massSqrt_->pow(0.5);
+}
+
+} // namespace Math
+
+#endif
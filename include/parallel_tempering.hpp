@@ -0,0 +1,151 @@
+#ifndef COSMO_PP_PARALLEL_TEMPERING_HPP
+#define COSMO_PP_PARALLEL_TEMPERING_HPP
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <limits>
+#include <ctime>
+
+#include <macros.hpp>
+#include <likelihood_function.hpp>
+#include <random.hpp>
+#include <mcmc.hpp>
+
+namespace Math
+{
+
+/// A parallel tempering (replica exchange) scanner, useful for multimodal posteriors.
+
+/// A ladder of chains with temperatures distributed geometrically between 1 and a maximum temperature is run. The chain with temperature T samples prior * likelihood^(1/T), so the hot chains move freely between the modes.
+/// Neighboring chains in the ladder periodically propose to swap their states, which is accepted with the appropriate Metropolis-Hastings probability. Only the chains with temperature 1 sample the posterior and are written out.
+/// The temperatures are distributed across the MPI processes. If there are fewer processes than temperatures, each process runs several consecutive temperatures of one ladder. If there are more, each process runs one chain and there are (number of processes) / (number of temperatures) independent ladders.
+/// The swaps between chains on different processes are done with non-blocking point to point messages. All of the chains do the same number of iterations.
+class ParallelTempering
+{
+private:
+    enum PRIOR_MODE { UNIFORM_PRIOR = 0, GAUSSIAN_PRIOR, PRIOR_MODE_MAX };
+
+public:
+    /// Constructor.
+    /// \param nPar The number of parameters.
+    /// \param like The likelihood function. It is called for all of the chains on the current process, one after the other.
+    /// \param fileRoot The root for filenames produced by ParallelTempering. The cold chains are written into (fileRoot).txt, or (fileRoot)_0.txt, (fileRoot)_1.txt, ... if there are several ladders, and can be read by MarkovChain.
+    /// \param nTemperatures The number of temperatures in each ladder. Must be a multiple or a divisor of the number of MPI processes.
+    /// \param maxTemperature The temperature of the hottest chain. Must be at least 1.
+    /// \param seed A random seed. If set to 0 (the default value), it will be determined from the current time.
+    ParallelTempering(int nPar, LikelihoodFunction& like, std::string fileRoot, int nTemperatures, double maxTemperature, time_t seed = 0);
+
+    /// Destructor.
+    ~ParallelTempering();
+
+    /// Define a given parameter to have a uniform prior. One of the parameter setting functions must be called for each parameter before the run.
+    /// \param i The index of the parameter, 0 <= i < number of parameters.
+    /// \param name The name of the parameter.
+    /// \param min The minimum value of the parameter (the lower bound for the prior).
+    /// \param max The maximum value of the parameter (the upper bound for the prior).
+    /// \param starting The starting value of the parameter. If not set, it will be set to the midpoint of the range by default.
+    /// \param startingWidth Each chain starts at a random point within this width of the starting value. If not set, by default it will be set to 1/100-th of the width of the range.
+    /// \param samplingWidth The sampling width of the parameter (the width of the Gaussian proposal distribution) for the chains with temperature 1. It is multiplied by sqrt(T) for the chains with temperature T. If not set, by default it will be set to 1/100-th of the width of the range.
+    void setParam(int i, const std::string& name, double min, double max, double starting = std::numeric_limits<double>::max(), double startingWidth = 0.0, double samplingWidth = 0.0);
+
+    /// Define a given parameter to have a gaussian prior. One of the parameter setting functions must be called for each parameter before the run.
+    /// \param i The index of the parameter, 0 <= i < number of parameters.
+    /// \param name The name of the parameter.
+    /// \param mean The mean of the prior
+    /// \param sigma The sigma of the prior
+    /// \param starting The starting value of the parameter. If not set, it will be set to the mean by default.
+    /// \param startingWidth Each chain starts at a random point within this width of the starting value. If not set, by default it will be set to 1/100-th of sigma.
+    /// \param samplingWidth The sampling width of the parameter for the chains with temperature 1. It is multiplied by sqrt(T) for the chains with temperature T. If not set, by default it will be set to 1/100-th of sigma.
+    void setParamGauss(int i, const std::string& name, double mean, double sigma, double starting = std::numeric_limits<double>::max(), double startingWidth = 0.0, double samplingWidth = 0.0);
+
+    /// Get the name of a parameter.
+    /// \param i The index of the parameter.
+    /// \return The name of the parameter.
+    const std::string& getParamName(int i) const { check(i >= 0 && i < n_, "invalid index " << i); return paramNames_[i]; }
+
+    /// Set the blocks in which the parameters are varied. If this function is not called, each paramter will be assigned to a separate block, by default.
+    /// \param blocks A vector defining the indices of the parameters in each block, in the same format as for MetropolisHastings::specifyParameterBlocks.
+    void specifyParameterBlocks(const std::vector<int>& blocks);
+
+    /// Set an external prior function for all of the parameters. The values set by setParam or setParamGauss will then be ignored. The prior is not tempered.
+    /// One of these functions still needs to be called for each parameter to set their names, starting values, and sampling widths.
+    /// \param prior A pointer to the external prior function.
+    void useExternalPrior(PriorFunctionBase* prior) { externalPrior_ = prior; }
+
+    /// Set an external proposal distribution for all of the parameters. The sampling width value set by setParam or setParamGauss will then be ignored.
+    /// The same proposal is used for all of the temperatures.
+    /// \param proposal A pointer to the external proposal distribution.
+    void useExternalProposal(ProposalFunctionBase* proposal) { externalProposal_ = proposal; }
+
+    /// The number of temperatures in each ladder.
+    int nTemperatures() const { return nTemps_; }
+
+    /// The temperature with a given index.
+    /// \param i The index of the temperature, 0 <= i < nTemperatures(). Index 0 corresponds to temperature 1.
+    double temperature(int i) const { check(i >= 0 && i < nTemps_, "invalid index " << i); return temperatures_[i]; }
+
+    /// Run the scan. Should be called after all of the other necessary functions have been called to set all of the necessary settings.
+    /// Each line of the chain files contains the number of repetitions of the element (always 1), -2ln(likelihood), and the values of all of the parameters.
+    /// \param nIterations The number of iterations for each chain. Each iteration updates all of the parameter blocks once.
+    /// \param swapEvery Swaps between neighboring temperatures are proposed after every swapEvery iterations, alternating between the even and the odd pairs of the ladder.
+    /// \param writeResumeInformationEvery The resume information is written after this many iterations. 0 means no resume information will be written. A run can only be resumed if all of the processes have the same resume point.
+    /// If the termination signals are trapped (see CheckpointCoordinator), a signal stops all of the processes after the same iteration, the resume information is written, then the registered checkpoints.
+    /// \return The number of cold chains (i.e. the number of ladders).
+    int run(unsigned long nIterations = 100000, int swapEvery = 10, int writeResumeInformationEvery = 100);
+
+private:
+    struct Chain
+    {
+        int tempIndex;
+        double beta;
+        std::vector<double> current;
+        double like;
+        double prior;
+        unsigned long accepted;
+        unsigned long swapsProposed;
+        unsigned long swapsAccepted;
+    };
+
+    double calculatePrior(double* params);
+    void step(Chain& chain);
+    void swap(unsigned long round);
+    void openOut(bool append, long position);
+    void writeChainElement(const Chain& chain);
+    void writeResumeInfo(unsigned long iteration);
+    bool readResumeInfo(unsigned long& iteration, long& position);
+    int processOfChain(int globalIndex) const { return globalIndex / chainsPerProcess_; }
+
+private:
+    int n_;
+    LikelihoodFunction* like_;
+    std::string fileRoot_, resumeFileName_;
+    std::vector<double> param1_, param2_, starting_, startingWidth_, samplingWidth_;
+    std::vector<PRIOR_MODE> priorMods_;
+    std::vector<std::string> paramNames_;
+    PriorFunctionBase* externalPrior_;
+    ProposalFunctionBase* externalProposal_;
+    std::vector<int> blocks_;
+
+    int nTemps_;
+    std::vector<double> temperatures_;
+    int nProcesses_, processId_;
+    int chainsPerProcess_, nLadders_;
+    // the global index of the first chain of this process, the chain with global index g has temperature index g % nTemps_ and belongs to the ladder g / nTemps_
+    int firstChain_;
+    std::vector<Chain> chains_;
+
+    int stateTag_, decisionTag_;
+
+    time_t seed_;
+    Math::UniformRealGenerator* uniformGen_;
+    Math::GaussianGenerator* generator_;
+
+    const int resumeCode_;
+    std::ofstream out_;
+};
+
+} // namespace Math
+
+#endif
+
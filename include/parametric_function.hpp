@@ -53,6 +53,8 @@ public:
     /// \return A reference to the parameter (can be used to change it).
     virtual double& parameter(int i) { check(i >= 0 && i < params_.size(), "invalid i = " << i); return params_[i]; }
     
+    using Function<double, double>::evaluate;
+
     /// A purely virtual function to evaluate the function.
     /// \param x The argument of the function.
     /// \return The value of the function.
@@ -0,0 +1,88 @@
+#ifndef COSMO_PP_PLANCK_CL_SCORER_HPP
+#define COSMO_PP_PLANCK_CL_SCORER_HPP
+
+#include <vector>
+#include <string>
+
+#include <macros.hpp>
+#include <planck_like.hpp>
+#include <cl_set_file.hpp>
+#include <process_likelihood_pool.hpp>
+
+/// Scoring many precomputed sets of Cl-s (see ClSetFile) with the Planck likelihoods, for post-processing.
+
+/// The clik objects keep global state, so they cannot be used by several threads of one process. Instead the sets are scored by a pool of worker processes (see Math::ProcessLikelihoodPool), each with its own PlanckLikelihood. The file is memory-mapped before the workers are forked, so all of them read the spectra directly from the shared pages.
+/// The work is split into (set, component) pairs, so the components of the same set can be calculated by different workers at the same time and the load is balanced when some of the components are much more expensive than the others.
+/// The sets are scored in chunks. While the workers are busy with one chunk, the next chunk is prefetched from the file and the results of the previous one are collected, so the workers don't wait for the input.
+/// The calling process also creates a PlanckLikelihood, for the names of the components and for scoring the sets itself if there are no workers.
+class PlanckClScorer
+{
+public:
+    /// An abstract class creating the likelihoods of the workers.
+    class Factory
+    {
+    public:
+        virtual ~Factory() {}
+
+        /// Create a new likelihood (purely virtual). It should not use its own CMB (see the PlanckLikelihood constructor), and all of the nuisance parameters should be set here. Called in the worker processes, so it must not use MPI.
+        /// \param worker The index of the worker, -1 for the calling process.
+        /// \return A new likelihood, deleted when it is not needed anymore.
+        virtual PlanckLikelihood* create(int worker) = 0;
+    };
+
+public:
+    /// Constructor. Maps the file and starts the workers.
+    /// \param factory Creates the likelihoods.
+    /// \param clSetFile The name of the Cl set file. The included spectra must cover the ones needed by the likelihoods.
+    /// \param nWorkers The number of worker processes. If 0, the sets are scored by the calling process.
+    /// \param chunkSize The number of sets scored at once.
+    PlanckClScorer(Factory& factory, const char* clSetFile, int nWorkers, int chunkSize = 64);
+
+    /// Destructor. Stops the workers.
+    ~PlanckClScorer();
+
+    /// The number of sets in the file.
+    unsigned long size() const { return sets_.size(); }
+
+    /// The number of likelihood components.
+    int numberOfComponents() const { return names_.size(); }
+
+    /// The names of the likelihood components (see PlanckLikelihood::componentName).
+    const std::vector<std::string>& componentNames() const { return names_; }
+
+    /// The number of results for each set, the total followed by the components.
+    int resultSize() const { return 1 + numberOfComponents(); }
+
+    /// Score a range of sets.
+    /// A set for which a likelihood component throws an exception (for example a clik error) gets NaN for that component and the total.
+    /// \param begin The index of the first set.
+    /// \param end The index after the last set.
+    /// \param results The results are written here upon return, resultSize() values for each set: -2ln(likelihood) in total, followed by the components.
+    void score(unsigned long begin, unsigned long end, std::vector<double>* results);
+
+    /// Score all of the sets, split evenly between the MPI processes. All of the processes must call this at the same time, each with its own workers.
+    /// \param results The results of all of the sets are written here on the master process (see score), the other processes get an empty vector.
+    void scoreAll(std::vector<double>* results);
+
+private:
+    PlanckClScorer(const PlanckClScorer&);
+    PlanckClScorer& operator=(const PlanckClScorer&);
+
+    // the (set, component) pairs of a chunk, two values for each
+    void makePairs(unsigned long begin, unsigned long end, std::vector<double>* pairs) const;
+    // adds up the components of a chunk
+    void collect(unsigned long nSets, const std::vector<double>& values, double* results) const;
+
+private:
+    MappedClSets sets_;
+    std::vector<std::string> names_;
+    const int chunkSize_;
+
+    PlanckLikelihood* like_;
+    Math::LikelihoodFunction* local_;
+    Math::LikelihoodFactory* poolFactory_;
+    Math::ProcessLikelihoodPool* pool_;
+};
+
+#endif
+
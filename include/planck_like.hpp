@@ -75,9 +75,26 @@ public:
     /// \return -2ln(likelihood).
     double likelihood();
 
+    /// The number of the likelihood components included in the constructor (low-l, high-l, lensing, in this order).
+    int numberOfComponents() const;
+
+    /// The name of a likelihood component.
+    /// \param i The index of the component, from 0 to numberOfComponents() - 1.
+    std::string componentName(int i) const;
+
+    /// Calculate one likelihood component. Must be called after setCosmoParams or setCls. The sum of all of the components is likelihood().
+    /// \param i The index of the component, from 0 to numberOfComponents() - 1.
+    /// \return -2ln(likelihood) of the component.
+    double componentLike(int i);
+
+    /// Evaluate the likelihood components concurrently in likelihood(), each on its own thread (OpenMP) with its own input buffer. The clik objects of the components are independent, so this is useful when several of them are expensive. Off by default.
+    /// \param concurrent Turns the concurrent evaluation on or off.
+    void setConcurrentComponents(bool concurrent = true) { concurrent_ = concurrent; }
+
     /// Use this parameters to set the model for the calculate function. The number of cosmological parameters will be determined from here, and when calculate is called the cosmological parameters will be assigned to this model.
     /// \param params A pointer to the model parameters. Note that when calculate is called params will be changed to set the new parameters.
-    void setModelCosmoParams(CosmologicalParams *params) { modelParams_ = params; modelParams_->getAllParameters(vModel_); }
+    /// The model parameters are only set again by calculate when the cosmological part of the parameters changes, so params should not be changed by anything else in between the calls.
+    void setModelCosmoParams(CosmologicalParams *params) { modelParams_ = params; modelParams_->getAllParameters(vModel_); haveModel_ = false; }
 
     /// Calculate the likelihood taking all of the params as an input. This is for the general LikelihoodFunction interface. Can only be called if the model parameters are set by setModelCosmoParams.
     /// \param params A vector of the parameters, should always start with the cosmological parameters, followed by A_planck, followed by the high-l extra parameters (if high-l is included and not the lite version), followed by A_pol (if high-l polarization is included and not the lite version).
@@ -85,9 +102,27 @@ public:
     /// \return -2ln(likelihood).
     double calculate(double* params, int nPar);
 
+    /// The number of the cosmological parameters at the beginning of the params for calculate. Can only be called if the model parameters are set by setModelCosmoParams.
+    int numberOfCosmoParams() const { check(modelParams_, "model params must be set before calling this function"); return vModel_.size(); }
+
+    /// The number of the nuisance parameters following the cosmological parameters in the params for calculate. Changing only these does not require recalculating the spectra, so they can be sampled as fast parameters (see PolyChord::setFastParameters).
+    int numberOfNuisanceParams() const { return 1 + (highT_ && !highLikeLite_ ? (highP_ ? 33 : 15) : 0); }
+
+    /// Set all of the nuisance parameters at once, in the same order as they follow the cosmological parameters in calculate.
+    /// \param params The nuisance parameters, numberOfNuisanceParams() of them (passed as a pointer to the first element).
+    void setNuisanceParams(const double* params);
+
+    /// Checks if the polarization Cl-s are needed.
+    bool wantsPolarization() const { return lowP_ || highP_ || lensingP_; }
+
     /// Get the l_max value.
     int getLMax() const { return lMax_; }
 
+    /// Switch the CLASS calculation to the low precision, or back to the full precision (see CMB::setLowPrecision). The spectra are recalculated on the next call. This is the LikelihoodFunction interface used by MetropolisHastings::usePrecisionSchedule.
+    /// \param low true for the low precision, false for the full precision.
+    /// \return false if the own CMB is not used (see the constructor), true otherwise.
+    bool setLowPrecision(bool low);
+
 private:
     void *low_, *high_, *lens_;
     std::vector<std::string> spectraNames_, lensSpectraNames_;
@@ -101,17 +136,54 @@ private:
     std::vector<double> prevCosmoParams_;
     std::string prevCosmoParamsName_;
     std::vector<double> currentCosmoParams_;
-    double prevLow_, prevLens_;
-    bool haveLow_, haveLens_;
+    double prevLow_, prevHigh_, prevLens_;
+    bool haveLow_, haveHigh_, haveLens_;
+
+    // the spectra and the likelihoods for the cosmological parameters before the current ones
+    void swapCachedCls();
+
+    // the index of the i-th included component among all of the possible ones
+    int componentId(int i) const;
+    bool haveCosmoCls_, haveCachedCls_;
+    std::vector<double> cachedCosmoParams_;
+    std::vector<double> cachedClTT_, cachedClEE_, cachedClTE_, cachedClBB_, cachedClPP_;
+    double cachedLow_, cachedHigh_, cachedLens_;
+    bool cachedHaveLow_, cachedHaveHigh_, cachedHaveLens_;
 
     const CosmologicalParams* params_;
 
     CosmologicalParams* modelParams_;
     std::vector<double> vModel_;
-
-    std::vector<double> input_;
+    // the result of setting the model parameters for vModel_
+    bool haveModel_, modelSuccess_;
+    double modelBadLike_;
+    std::vector<double> nuisance_;
+
+    // where the spectra go in the input of a clik object, set up in the constructor
+    struct InputPlan
+    {
+        InputPlan() : extraOffset(0), clVersion(0) {}
+        void add(const std::vector<double>* cl, int l) { spectra.push_back(cl); offsets.push_back(extraOffset); lMax.push_back(l); extraOffset += l + 1; }
+
+        std::vector<const std::vector<double>*> spectra;
+        std::vector<int> offsets, lMax;
+        // the extra parameters start here
+        int extraOffset;
+        // the Cl-s currently in the input
+        unsigned long clVersion;
+    };
+
+    // copy the spectra into the input, if they have changed since the last time
+    void gatherCls(InputPlan& plan, std::vector<double>* input);
+
+    // separate input buffers, so that the components can be evaluated at the same time
+    std::vector<double> lowInput_, highInput_, lensInput_;
+    InputPlan lowPlan_, highPlan_, lensPlan_;
+    // changes every time the Cl-s change
+    unsigned long clVersion_;
 
     bool szPrior_;
+    bool concurrent_;
 };
 
 #else
@@ -175,9 +247,26 @@ public:
     /// \return -2ln(likelihood).
     double likelihood();
 
+    /// The number of the likelihood components included in the constructor (commander, camspec, pol, lensing, actspt, in this order).
+    int numberOfComponents() const;
+
+    /// The name of a likelihood component.
+    /// \param i The index of the component, from 0 to numberOfComponents() - 1.
+    std::string componentName(int i) const;
+
+    /// Calculate one likelihood component. Must be called after setCosmoParams or setCls. The sum of all of the components is likelihood().
+    /// \param i The index of the component, from 0 to numberOfComponents() - 1.
+    /// \return -2ln(likelihood) of the component.
+    double componentLike(int i);
+
+    /// Evaluate the likelihood components concurrently in likelihood(), each on its own thread (OpenMP) with its own input buffer. The clik objects of the components are independent, so this is useful when several of them are expensive. Off by default.
+    /// \param concurrent Turns the concurrent evaluation on or off.
+    void setConcurrentComponents(bool concurrent = true) { concurrent_ = concurrent; }
+
     /// Use this parameters to set the model for the calculate function. The number of cosmological parameters will be determined from here, and when calculate is called the cosmological parameters will be assigned to this model.
     /// \param params A pointer to the model parameters. Note that when calculate is called params will be changed to set the new parameters.
-    void setModelCosmoParams(CosmologicalParams *params) { modelParams_ = params; modelParams_->getAllParameters(vModel_); }
+    /// The model parameters are only set again by calculate when the cosmological part of the parameters changes, so params should not be changed by anything else in between the calls.
+    void setModelCosmoParams(CosmologicalParams *params) { modelParams_ = params; modelParams_->getAllParameters(vModel_); haveModel_ = false; }
 
     /// Calculate the likelihood taking all of the params as an input. This is for the general LikelihoodFunction interface. Can only be called if the model parameters are set by setModelCosmoParams.
     /// \param params A vector of the parameters, should always start with the cosmological parameters, followed by camspec extra parameters (if camspec is included), followed by high-l extra parameters (if high l is included).
@@ -185,9 +274,27 @@ public:
     /// \return -2ln(likelihood).
     double calculate(double* params, int nPar);
 
+    /// The number of the cosmological parameters at the beginning of the params for calculate. Can only be called if the model parameters are set by setModelCosmoParams.
+    int numberOfCosmoParams() const { check(modelParams_, "model params must be set before calling this function"); return vModel_.size(); }
+
+    /// The number of the nuisance parameters following the cosmological parameters in the params for calculate. Changing only these does not require recalculating the spectra, so they can be sampled as fast parameters (see PolyChord::setFastParameters).
+    int numberOfNuisanceParams() const { return (camspec_ ? 14 : 0) + (actspt_ ? 24 : 0); }
+
+    /// Set all of the nuisance parameters at once, in the same order as they follow the cosmological parameters in calculate.
+    /// \param params The nuisance parameters, numberOfNuisanceParams() of them (passed as a pointer to the first element).
+    void setNuisanceParams(const double* params);
+
+    /// Checks if the polarization Cl-s are needed.
+    bool wantsPolarization() const { return pol_ != NULL; }
+
     /// Get the l_max value.
     int getLMax() const { return lMax_; }
 
+    /// Switch the CLASS calculation to the low precision, or back to the full precision (see CMB::setLowPrecision). The spectra are recalculated on the next call. This is the LikelihoodFunction interface used by MetropolisHastings::usePrecisionSchedule.
+    /// \param low true for the low precision, false for the full precision.
+    /// \return false if the own CMB is not used (see the constructor), true otherwise.
+    bool setLowPrecision(bool low);
+
 private:
     void* commander_, *camspec_, *pol_, *actspt_;
     void* lens_;
@@ -202,10 +309,26 @@ private:
     double prevCommander_, prevPol_, prevLens_;
     bool haveCommander_, havePol_, haveLens_;
 
+    // the spectra and the likelihoods for the cosmological parameters before the current ones
+    void swapCachedCls();
+
+    // the index of the i-th included component among all of the possible ones
+    int componentId(int i) const;
+    bool haveCosmoCls_, haveCachedCls_;
+    std::vector<double> cachedCosmoParams_;
+    std::vector<double> cachedClTT_, cachedClEE_, cachedClTE_, cachedClPP_;
+    double cachedCommander_, cachedPol_, cachedLens_;
+    bool cachedHaveCommander_, cachedHavePol_, cachedHaveLens_;
+
     const CosmologicalParams* params_;
 
     CosmologicalParams* modelParams_;
     std::vector<double> vModel_;
+    // the result of setting the model parameters for vModel_
+    bool haveModel_, modelSuccess_;
+    double modelBadLike_;
+
+    bool concurrent_;
 };
 
 #endif
@@ -3,10 +3,12 @@
 
 #include <fstream>
 #include <vector>
+#include <string>
 
 #include <planck_like.hpp>
 #include <cmb.hpp>
 #include <learn_as_you_go.hpp>
+#include <principal_components.hpp>
 #include <random.hpp>
 
 /// Fast Planck likelihood class, enhanced by LearnAsYouGo.
@@ -27,7 +29,9 @@ public:
     /// \param kPerDecade The number of points per decade in the k space for the primordial power spectrum calculation.
     /// \param precision The precision of the likelihood. If the estimated error of the approximation is less than this precision then the approximation is used (fast), otherwise the full likelihood will be calculated (slow).
     /// \param minCount The minimum number of points in the training set for the approximation to be acceptable.
-    PlanckLikeFast(CosmologicalParams* params, bool lowT = true, bool lowP = true, bool highT = true, bool highP = true, bool highLikeLite = true, bool lensingT = true, bool lensingP = true, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000);
+    /// \param compressionSamples If not 0, the Cl vectors are compressed before being emulated. The first compressionSamples exact evaluations (split evenly between the MPI processes) are used to learn a principal component basis, and only the coefficients of the leading components are emulated afterwards. The basis is saved in a file and reused in later runs. The processes wait for each other once, when the basis is learned. Not used if the Cl values are not emulated.
+    /// \param compressionTolerance The maximum fraction of the variance of the standardized Cl vectors that may be lost by the compression.
+    PlanckLikeFast(CosmologicalParams* params, bool lowT = true, bool lowP = true, bool highT = true, bool highP = true, bool highLikeLite = true, bool lensingT = true, bool lensingP = true, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000, unsigned long compressionSamples = 0, double compressionTolerance = 1e-6);
 #else
     /// Constructor.
     /// \param params A pointer to CosmologicalParameters. This is used to simply set the parameter model and the number of cosmological parameters. The values of the parameters do not matter.
@@ -40,7 +44,9 @@ public:
     /// \param kPerDecade The number of points per decade in the k space for the primordial power spectrum calculation.
     /// \param precision The precision of the likelihood. If the estimated error of the approximation is less than this precision then the approximation is used (fast), otherwise the full likelihood will be calculated (slow).
     /// \param minCount The minimum number of points in the training set for the approximation to be acceptable.
-    PlanckLikeFast(CosmologicalParams* params, bool useCommander = true, bool useCamspec = true, bool useLensing = true, bool usePolarization = false, bool useActSpt = false, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000);
+    /// \param compressionSamples If not 0, the Cl vectors are compressed before being emulated. The first compressionSamples exact evaluations (split evenly between the MPI processes) are used to learn a principal component basis, and only the coefficients of the leading components are emulated afterwards. The basis is saved in a file and reused in later runs. The processes wait for each other once, when the basis is learned. Not used if the Cl values are not emulated.
+    /// \param compressionTolerance The maximum fraction of the variance of the standardized Cl vectors that may be lost by the compression.
+    PlanckLikeFast(CosmologicalParams* params, bool useCommander = true, bool useCamspec = true, bool useLensing = true, bool usePolarization = false, bool useActSpt = false, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000, unsigned long compressionSamples = 0, double compressionTolerance = 1e-6);
 #endif
 
     /// Destructor.
@@ -49,12 +55,23 @@ public:
     /// Calculate the likelihood for a new input point. The calculation will be approximate if the approximation is acceptable.
     /// \param params A vector of the parameters, should always start with the cosmological parameters, followed by camspec extra parameters (if camspec is included), followed by high-l extra parameters (if high l is included).
     /// \param nPar The number of the parameters, used only for checking.
-    double calculate(double* params, int nPar) { return doCalculation(params, nPar, false); }
+    double calculate(double* params, int nPar) { return trackedCalculation(params, nPar, false); }
 
     /// Same as calculate, but enforces exact calculation.
     /// \param params A vector of the parameters, should always start with the cosmological parameters, followed by camspec extra parameters (if camspec is included), followed by high-l extra parameters (if high l is included).
     /// \param nPar The number of the parameters, used only for checking.
-    double calculateExact(double* params, int nPar) { return doCalculation(params, nPar, true); }
+    double calculateExact(double* params, int nPar) { return trackedCalculation(params, nPar, true); }
+
+    /// Information about the last call of calculate or calculateExact.
+    /// \param approximate Will be set to true if the approximation was used, false if the likelihood was calculated exactly (or taken from a training set point).
+    /// \param retries Will be set to the number of CLASS retries in the call.
+    /// \return true.
+    bool lastEvaluationInfo(bool* approximate, int* retries) const
+    {
+        *approximate = lastApproximate_;
+        *retries = lastRetries_;
+        return true;
+    }
 
     /// Set the precision.
     /// \param p The precision of the likelihood. If the estimated error of the approximation is less than this precision then the approximation is used (fast), otherwise the full likelihood will be calculated (slow).
@@ -64,8 +81,30 @@ public:
     /// \param fileNameBase The file name base. If only one process is run then the log file name is simply the base followed by ".txt". If multiple MPI processes are run, each will create a log file with the name "fileNameBase_id.txt", where id is the MPI process ID, i.e. a number between 0 and number of processes - 1.
     void logError(const char* fileNameBase);
 
+    /// Set the directory of the emulator store. The training sets (and the compression bases) are kept there in files named by a hash of the likelihood configuration (the likelihoods included, lMax, the l values of the emulated Cl, kPerDecade, tensors and the parameter model), so each run automatically reads and extends the training set of the earlier runs with the same configuration, and never one of a different configuration. Each file has a ".config" file next to it with the configuration in text form.
+    /// The default is the environment variable COSMO_EMULATOR_STORE, or the current directory if it is not set. Must be called before the constructor.
+    /// \param directory The directory, created if it does not exist. NULL or empty for the current directory.
+    static void setEmulatorStore(const char* directory);
+
+    /// The directory of the emulator store, see setEmulatorStore.
+    static std::string emulatorStore();
+
 private:
     double doCalculation(double* params, int nPar, bool exact);
+    double trackedCalculation(double* params, int nPar, bool exact)
+    {
+        lastApproximate_ = false;
+        const unsigned long retries = cmb_.totalRetries();
+        const double res = doCalculation(params, nPar, exact);
+        lastRetries_ = int(cmb_.totalRetries() - retries);
+        return res;
+    }
+
+    std::string storeFileName(const std::string& configuration, const char* suffix) const;
+    void initCompression(const std::string& fileName, int nIn, int nOut, int nCompressed, unsigned long compressionSamples, double compressionTolerance);
+    const std::vector<double>& evaluateFunc(const std::vector<double>& x, bool exact, double* error1Sigma, double* error2Sigma, double* errorMean, double* errorVar);
+    void learnCompression();
+    void createCompressedLearnAsYouGo();
 
 private:
     CosmologicalParams* cosmoParams_;
@@ -101,6 +140,21 @@ private:
     void* func_;
     void* errorFunc_;
 
+    Math::RealFunctionMultiToMulti* fullFunc_;
+    Math::RealFunctionMultiDim* fullErrorFunc_;
+    double precision_;
+    unsigned long minCount_;
+
+    PrincipalComponents* pca_;
+    void* compressedFunc_;
+    void* compressedErrorFunc_;
+    std::string fileName_;
+    int nIn_, nOut_, nCompressed_;
+    unsigned long compressionSamples_;
+    double compressionTolerance_;
+    std::vector<double> samplePoints_, sampleData_;
+    std::vector<double> fullRes_;
+
 #ifdef COSMO_PLANCK_15
     std::vector<double> tt_, ee_, te_, bb_, pp_, clTT_, clEE_, clTE_, clBB_, clPP_;
     std::vector<double> allParamsVec_;
@@ -112,6 +166,9 @@ private:
     std::ofstream outError_;
     bool logError_;
     Math::UniformRealGenerator rand_;
+
+    bool lastApproximate_;
+    int lastRetries_;
 };
 
 #endif
@@ -71,6 +71,17 @@ public:
     /// \parm fracs A vector that contains the fractions of time spent in each hierarchy level (the sum should be one).
     void setParameterHierarchy(const std::vector<double>& fracs);
 
+    /// Set up a two level hierarchy, with the parameters from a given index on being fast (speed 2) and the ones before it slow (speed 1). Should be called after the parameter setting functions since they set the speeds too.
+    /// For example, for PlanckLikelihood the cosmological parameters come first and the nuisance parameters are fast, so firstFast should be PlanckLikelihood::numberOfCosmoParams().
+    /// \param firstFast The index of the first fast parameter. All of the parameters after it are fast too.
+    /// \param slowFraction The fraction of time spent on the slow parameters.
+    void setFastParameters(int firstFast, double slowFraction = 0.5);
+
+    /// Convert the resulting chain into the binary chain format (see BinaryChain) at the end of the run. The chain is written by the PolyChord library as text, so it is converted once here instead of being parsed every time it is read.
+    /// The binary chain is written into (fileRoot).bin and contains only the parameters that are not fixed. It can be read by MarkovChain by giving the file name explicitly.
+    /// \param binary Convert into binary or not.
+    void setBinaryOutput(bool binary = true) { binaryOutput_ = binary; }
+
     /// Run the scan. Should be called after all of the other necessary functions have been called to set all of the necessary settings. The resulting chain is written in the file (fileRoot).txt. The first column is the number of repetitions of the element, the second column is -2ln(likelihood), the following columns are the values of all of the parameters.
     /// \param resume Resume from previous job or not (true by default).
     void run(bool resume = true);
@@ -95,6 +106,7 @@ private:
     static bool running_;
 
     std::vector<double> fracs_;
+    bool binaryOutput_;
 };
 
 #endif
@@ -48,6 +48,30 @@ public:
         return res;
     }
 
+    using ParametricFunction::evaluate;
+
+    /// Evaluate the polynomial at many points, vectorized over the points.
+    /// \param n The number of points.
+    /// \param x The arguments, must have n elements.
+    /// \param res The values of the polynomial will be written here, must have n elements.
+    virtual void evaluate(unsigned long n, const double* x, double* res) const
+    {
+        const int m = params_.size();
+        const double* p = (m ? &(params_[0]) : NULL);
+#pragma omp simd
+        for(unsigned long i = 0; i < n; ++i)
+        {
+            double r = 0;
+            double current = 1;
+            for(int j = 0; j < m; ++j)
+            {
+                r += p[j] * current;
+                current *= x[i];
+            }
+            res[i] = r;
+        }
+    }
+
     Polynomial operator + (const Polynomial& other) const
     {
         unsigned int n = numberOfParams();
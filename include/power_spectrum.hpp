@@ -62,7 +62,21 @@ public:
     {
         const double lkPiv = std::log(k / pivot_);
         const double p = ns_ - 1.0 + 0.5 * run_ * lkPiv + 1.0 / 6.0 * runRun_ * lkPiv * lkPiv;
-        return as_ * std::pow(k / pivot_, p);
+        return as_ * std::exp(p * lkPiv);
+    }
+
+    /// Calculate the scalar power spectrum at many points.
+    /// \param n The number of points.
+    /// \param k The k values in Mpc^(-1), must have n elements.
+    /// \param res The scalar power spectrum values will be written here, must have n elements.
+    virtual void evaluate(unsigned long n, const double* k, double* res) const
+    {
+        for(unsigned long i = 0; i < n; ++i)
+        {
+            const double lkPiv = std::log(k[i] / pivot_);
+            const double p = ns_ - 1.0 + 0.5 * run_ * lkPiv + 1.0 / 6.0 * runRun_ * lkPiv * lkPiv;
+            res[i] = as_ * std::exp(p * lkPiv);
+        }
     }
 
 private:
@@ -88,6 +102,16 @@ public:
         return StandardPowerSpectrum::evaluate(k);
     }
 
+    virtual void evaluate(unsigned long n, const double* k, double* res) const
+    {
+        StandardPowerSpectrum::evaluate(n, k, res);
+        for(unsigned long i = 0; i < n; ++i)
+        {
+            if(k[i] < kCut_)
+                res[i] = 1e-100;
+        }
+    }
+
 private:
     double kCut_;
 };
@@ -163,8 +187,23 @@ public:
     /// \return The tensor power spectrum value.
     virtual double evaluate(double k) const
     {
-        const double p = nt_ + 0.5 * run_ * std::log(k / pivot_);
-        return at_ * std::pow(k / pivot_, p);
+        const double lkPiv = std::log(k / pivot_);
+        const double p = nt_ + 0.5 * run_ * lkPiv;
+        return at_ * std::exp(p * lkPiv);
+    }
+
+    /// Calculate the tensor power spectrum at many points.
+    /// \param n The number of points.
+    /// \param k The k values in Mpc^(-1), must have n elements.
+    /// \param res The tensor power spectrum values will be written here, must have n elements.
+    virtual void evaluate(unsigned long n, const double* k, double* res) const
+    {
+        for(unsigned long i = 0; i < n; ++i)
+        {
+            const double lkPiv = std::log(k[i] / pivot_);
+            const double p = nt_ + 0.5 * run_ * lkPiv;
+            res[i] = at_ * std::exp(p * lkPiv);
+        }
     }
 
 private:
@@ -186,8 +225,13 @@ public:
         check(kVals.size() >= 2, "at least two points needed");
         check(kVals.size() == amplitudes.size(), "");
 
+        logK_.resize(kVals.size());
         for(int i = 0; i < kVals.size(); ++i)
-            tf_[std::log(kVals[i])] = std::log(amplitudes[i]);
+        {
+            logK_[i] = std::log(kVals[i]);
+            tf_[logK_[i]] = std::log(amplitudes[i]);
+        }
+        check(tf_.size() == logK_.size(), "duplicate k values");
 
         ns_ = 1; // just whatever
         as_ = 2e-9; // just whatever
@@ -202,6 +246,41 @@ public:
         return std::exp(tf_.evaluate(std::log(k)));
     }
 
+    /// Calculate the scalar power spectrum at many points.
+    /// \param n The number of points.
+    /// \param k The k values in Mpc^(-1), must have n elements. Increasing (or decreasing) sequences are the fastest.
+    /// \param res The scalar power spectrum values will be written here, must have n elements.
+    virtual void evaluate(unsigned long n, const double* k, double* res) const
+    {
+        std::vector<double> logK(n);
+        for(unsigned long i = 0; i < n; ++i)
+            logK[i] = std::log(k[i]);
+        if(n > 0)
+            tf_.evaluate(n, &(logK[0]), res);
+        for(unsigned long i = 0; i < n; ++i)
+            res[i] = std::exp(res[i]);
+    }
+
+    /// The number of the k values.
+    int numKnots() const { return logK_.size(); }
+
+    /// The natural logarithm of the amplitude at a given k value.
+    /// \param i The index of the k value, in the order given in the constructor.
+    double lnAmplitude(int i) const
+    {
+        check(i >= 0 && i < logK_.size(), "invalid index " << i);
+        return tf_.find(logK_[i])->second;
+    }
+
+    /// Set new amplitudes for the same k values, in place (nothing is allocated).
+    /// \param lnAmplitudes The natural logarithms of the amplitudes, in the order of the k values given in the constructor, must have numKnots() elements.
+    /// \param shift A constant added to all of the logarithms.
+    void setLnAmplitudes(const double* lnAmplitudes, double shift = 0)
+    {
+        for(int i = 0; i < logK_.size(); ++i)
+            tf_.find(logK_[i])->second = lnAmplitudes[i] + shift;
+    }
+
     /// This function should not be used for this class, just written for compatibility.
     double getNs() const { return ns_; }
 
@@ -213,6 +292,7 @@ public:
 
 private:
     Math::TableFunction<double, double> tf_;
+    std::vector<double> logK_;
 
     double ns_;
     double as_;
@@ -231,14 +311,14 @@ public:
         check(kVals.size() >= 2, "at least two points needed");
         check(kVals.size() == amplitudes.size(), "");
 
-        std::vector<double> logK, logA;
+        std::vector<double> logK;
         for(int i = 0; i < kVals.size(); ++i)
         {
             logK.push_back(std::log(kVals[i]));
-            logA.push_back(std::log(amplitudes[i]));
+            logA_.push_back(std::log(amplitudes[i]));
         }
 
-        cs_ = new Math::CubicSpline(logK, logA);
+        cs_ = new Math::CubicSpline(logK, logA_);
 
         ns_ = 1; // just whatever
         as_ = 2e-9; // just whatever
@@ -259,6 +339,50 @@ public:
         return std::exp(cs_->evaluate(std::log(k)));
     }
 
+    /// Calculate the scalar power spectrum at many points.
+    /// \param n The number of points.
+    /// \param k The k values in Mpc^(-1), must have n elements. Increasing (or decreasing) sequences are the fastest.
+    /// \param res The scalar power spectrum values will be written here, must have n elements.
+    virtual void evaluate(unsigned long n, const double* k, double* res) const
+    {
+        std::vector<double> logK(n);
+        for(unsigned long i = 0; i < n; ++i)
+            logK[i] = std::log(k[i]);
+        evaluateLog(n, n > 0 ? &(logK[0]) : NULL, res);
+        for(unsigned long i = 0; i < n; ++i)
+            res[i] = std::exp(res[i]);
+    }
+
+    /// Calculate the logarithm of the scalar power spectrum at many points at once.
+    /// \param n The number of points.
+    /// \param logK The natural logarithms of the k values in Mpc^(-1). Increasing (or decreasing) sequences are the fastest.
+    /// \param res The natural logarithms of the power spectrum values will be written here, must have n elements.
+    void evaluateLog(unsigned long n, const double* logK, double* res) const
+    {
+        cs_->evaluate(n, logK, res);
+    }
+
+    /// The number of the k values.
+    int numKnots() const { return logA_.size(); }
+
+    /// The natural logarithm of the amplitude at a given k value.
+    /// \param i The index of the k value, in the order given in the constructor.
+    double lnAmplitude(int i) const
+    {
+        check(i >= 0 && i < logA_.size(), "invalid index " << i);
+        return logA_[i];
+    }
+
+    /// Set new amplitudes for the same k values, in place. The spline is not rebuilt, only its coefficients are recalculated (see Math::CubicSpline::setValues), nothing is allocated.
+    /// \param lnAmplitudes The natural logarithms of the amplitudes, in the order of the k values given in the constructor, must have numKnots() elements.
+    /// \param shift A constant added to all of the logarithms.
+    void setLnAmplitudes(const double* lnAmplitudes, double shift = 0)
+    {
+        for(int i = 0; i < logA_.size(); ++i)
+            logA_[i] = lnAmplitudes[i] + shift;
+        cs_->setValues(&(logA_[0]));
+    }
+
     /// This function should not be used for this class, just written for compatibility.
     double getNs() const { return ns_; }
 
@@ -270,6 +394,7 @@ public:
 
 private:
     Math::CubicSpline* cs_;
+    std::vector<double> logA_;
 
     double ns_;
     double as_;
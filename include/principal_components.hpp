@@ -0,0 +1,69 @@
+#ifndef COSMO_PP_PRINCIPAL_COMPONENTS_HPP
+#define COSMO_PP_PRINCIPAL_COMPONENTS_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+
+/// A class for compressing vectors by projecting them onto their leading principal components.
+
+/// The basis is learned from a set of sample vectors. Each component of the vectors is first standardized by subtracting the sample mean and dividing by the sample standard deviation, so components of very different magnitudes (for example Cl values at low and high l) contribute equally.
+/// The leading eigenvectors of the covariance matrix of the standardized samples are then kept, as many as needed for the fraction of the total variance lost to be below a given tolerance.
+/// The eigenvectors are found from the Gram matrix of the samples, so the cost depends on the dimension only linearly, which makes it possible to compress vectors with tens of thousands of components from a few hundred samples.
+class PrincipalComponents
+{
+public:
+    /// Default constructor. The basis needs to be learned or read from a file before using.
+    PrincipalComponents() : dim_(0), nComponents_(0), lostVariance_(0) {}
+
+    /// Learn the basis from sample vectors.
+    /// \param samples The sample vectors, stored one after the other (nSamples * dim values, passed as a pointer to the first element).
+    /// \param nSamples The number of samples. Must be at least 2.
+    /// \param dim The dimension of the vectors.
+    /// \param tolerance The maximum fraction of the total variance (of the standardized samples) that may be lost. The number of components is the smallest one satisfying this.
+    /// \param maxComponents The maximum number of components to keep. 0 means no limit.
+    void learn(const double* samples, unsigned long nSamples, int dim, double tolerance = 1e-6, int maxComponents = 0);
+
+    /// The dimension of the vectors.
+    int dim() const { return dim_; }
+
+    /// The number of components kept, i.e. the dimension of the compressed vectors.
+    int nComponents() const { return nComponents_; }
+
+    /// The fraction of the total variance of the samples that is lost by the compression.
+    double lostVariance() const { return lostVariance_; }
+
+    /// Compress a vector.
+    /// \param x The vector to compress, of dimension dim() (passed as a pointer to the first element).
+    /// \param c The nComponents() coefficients will be written here (passed as a pointer to the first element).
+    void compress(const double* x, double* c) const;
+
+    /// Reconstruct a vector from its coefficients.
+    /// \param c The nComponents() coefficients (passed as a pointer to the first element).
+    /// \param x The reconstructed vector of dimension dim() will be written here (passed as a pointer to the first element).
+    void decompress(const double* c, double* x) const;
+
+    /// Write the basis into a binary file.
+    /// \param fileName The name of the file.
+    void writeIntoFile(const char* fileName) const;
+
+    /// Read the basis from a binary file written by writeIntoFile.
+    /// \param fileName The name of the file.
+    /// \param dim The expected dimension of the vectors. If not 0 and the file has a different dimension the file is not read.
+    /// \return true if the basis has been read successfully.
+    bool readFromFile(const char* fileName, int dim = 0);
+
+private:
+    int dim_;
+    int nComponents_;
+    double lostVariance_;
+
+    std::vector<double> mean_;
+    std::vector<double> scale_;
+
+    // nComponents_ * dim_ values, one component after the other
+    std::vector<double> basis_;
+};
+
+#endif
+
@@ -0,0 +1,116 @@
+#ifndef COSMO_PP_PRIOR_TRANSFORM_HPP
+#define COSMO_PP_PRIOR_TRANSFORM_HPP
+
+#include <vector>
+#include <cmath>
+
+#include <macros.hpp>
+#include <function.hpp>
+
+namespace Math
+{
+
+/// The transform of a uniform variable u in [0, 1] into a parameter with a given prior, i.e. the inverse of the cumulative distribution function of the prior. Used by the nested samplers (see MnScanner) to map the unit hypercube to the parameters.
+
+/// The uniform, log-uniform and gaussian priors are calculated in closed form. General priors are tabulated once, on a uniform grid in u, so that each transform finds its interval in O(1) and interpolates linearly or with a monotonic cubic.
+class PriorTransform
+{
+public:
+    /// The types of the priors.
+    enum Type { NONE = 0, UNIFORM, LOG_UNIFORM, GAUSSIAN, TABLE, TYPE_MAX };
+
+    /// Constructor. Constructs an empty transform (type NONE), which cannot be used until one of the set functions is called.
+    PriorTransform() : type_(NONE), a_(0), b_(0), min_(0), max_(0), pLow_(0), pRange_(1), cubic_(false) {}
+
+    /// The type of the prior.
+    Type type() const { return type_; }
+
+    /// Checks if no prior has been set.
+    bool empty() const { return type_ == NONE; }
+
+    /// Reset to the empty transform.
+    void clear();
+
+    /// Uniform prior, x = min + u (max - min).
+    void setUniform(double min, double max);
+
+    /// Log-uniform prior, x = min (max / min)^u.
+    /// \param min The lower bound, must be positive.
+    /// \param max The upper bound.
+    void setLogUniform(double min, double max);
+
+    /// Gaussian prior, truncated at nSigma standard deviations from the mean.
+    /// \param mean The mean.
+    /// \param sigma The standard deviation, must be positive.
+    /// \param nSigma The truncation, the values are between mean - nSigma sigma and mean + nSigma sigma.
+    void setGauss(double mean, double sigma, double nSigma = 10);
+
+    /// General prior, from a distribution function (not necessarily normalized) between min and max.
+    /// The cumulative distribution is integrated on nIntegration intervals, then inverted onto a uniform grid of nTable intervals in u.
+    /// \param min The lower bound.
+    /// \param max The upper bound.
+    /// \param distrib The distribution, must be non-negative between min and max.
+    /// \param cubic Use the monotonic cubic interpolation between the table points instead of the linear one.
+    /// \param nTable The number of the intervals of the table.
+    /// \param nIntegration The number of the intervals for integrating the distribution.
+    void setGeneral(double min, double max, const RealFunction& distrib, bool cubic = false, int nTable = 10000, int nIntegration = 100000);
+
+    /// Transform one value.
+    /// \param u The uniform variable, between 0 and 1.
+    /// \return The value of the parameter.
+    double transform(double u) const
+    {
+        check(type_ != NONE, "the prior has not been set");
+        switch(type_)
+        {
+        case UNIFORM:
+            return a_ + u * b_;
+        case LOG_UNIFORM:
+            return a_ * std::exp(u * b_);
+        case GAUSSIAN:
+            return gaussTransform(u);
+        default:
+            return tableTransform(u);
+        }
+    }
+
+    /// Transform several values of the same parameter.
+    /// \param n The number of values.
+    /// \param u The uniform variables.
+    /// \param x The results will be written here, can be the same as u.
+    void transform(int n, const double* u, double* x) const;
+
+    /// The lower bound of the parameter.
+    double min() const { return min_; }
+
+    /// The upper bound of the parameter.
+    double max() const { return max_; }
+
+private:
+    double gaussTransform(double u) const;
+    double tableTransform(double u) const;
+
+private:
+    Type type_;
+
+    // uniform: min and width, log-uniform: min and ln(max / min), gaussian: mean and sigma
+    double a_, b_;
+    double min_, max_;
+
+    // gaussian: the cumulative probabilities of the truncated range
+    double pLow_, pRange_;
+
+    // the values of x at u = k / (size - 1), and for the cubic interpolation their derivatives with respect to u times the grid spacing
+    std::vector<double> x_, slopes_;
+    bool cubic_;
+};
+
+/// The inverse of the cumulative distribution function of the standard normal distribution, accurate to about the double precision.
+/// \param p The probability, between 0 and 1 (not including).
+/// \return x such that P(X < x) = p for a standard normal X.
+double inverseNormalCDF(double p);
+
+} // namespace Math
+
+#endif
+
@@ -0,0 +1,103 @@
+#ifndef COSMO_PP_PROCESS_LIKELIHOOD_POOL_HPP
+#define COSMO_PP_PROCESS_LIKELIHOOD_POOL_HPP
+
+#include <vector>
+#include <string>
+
+#include <macros.hpp>
+#include <likelihood_function.hpp>
+
+namespace Math
+{
+
+/// An abstract class creating the likelihood functions of the workers of ProcessLikelihoodPool.
+class LikelihoodFactory
+{
+public:
+    virtual ~LikelihoodFactory() {}
+
+    /// Create a new likelihood function (purely virtual). Called in the worker processes, so each worker has its own instance (and its own global state of the underlying code).
+    /// \param worker The index of the worker.
+    /// \return A new likelihood function, deleted by the worker when it exits.
+    virtual LikelihoodFunction* create(int worker) = 0;
+};
+
+/// A likelihood function that evaluates batches of points in parallel in helper processes, each with its own likelihood instance.
+
+/// This is for the likelihoods that cannot be evaluated from several threads of one process, because the underlying code keeps global state (the Fortran modules of WMAP9Likelihood, clik).
+/// The workers are forked in the constructor, each one creates its likelihood with the factory and then waits for work. The points of a batch are put in shared memory, and each worker claims the points one at a time with atomic operations until there are none left, so the load is balanced when the evaluation times vary. The results are written back into the shared memory.
+/// The samplers that evaluate batches using LikelihoodFunction::calculateBatch (the walkers of EnsembleSampler, the multiple tries and the speculative evaluations of MetropolisHastings) use the workers automatically. A single point (calculate) is evaluated by one of the workers.
+/// Exceptions thrown by the likelihood in the workers are rethrown by the pool after the batch is done, the workers keep running. If a worker process dies the pool throws an exception and cannot be used any more.
+/// The workers do not use MPI (they must not call MPI functions, so the factory and the likelihood must not use CosmoMPI), and the pool should be created before starting other threads in the process. Not thread safe, one thread at a time can use the pool.
+class ProcessLikelihoodPool : public LikelihoodFunction
+{
+public:
+    /// Constructor. Forks the workers and waits until all of them have created their likelihoods. Throws if any of them failed.
+    /// \param factory Creates the likelihood of each worker.
+    /// \param nPar The number of parameters.
+    /// \param nWorkers The number of worker processes.
+    /// \param maxBatchSize The maximum number of points published at once, larger batches are split.
+    ProcessLikelihoodPool(LikelihoodFactory& factory, int nPar, int nWorkers, int maxBatchSize = 64);
+
+    /// Destructor. Stops the workers and waits for them to exit.
+    ~ProcessLikelihoodPool();
+
+    /// The number of workers.
+    int nWorkers() const { return nWorkers_; }
+
+    /// Calculate the likelihood in one of the workers.
+    virtual double calculate(double* params, int nParams);
+
+    /// Calculate the exact likelihood in one of the workers.
+    virtual double calculateExact(double* params, int nParams);
+
+    /// Calculate the likelihood for a batch of points, split between the workers.
+    /// \param params The parameter vectors, stored one after the other.
+    /// \param nParams The number of the parameters.
+    /// \param nPoints The number of parameter vectors.
+    /// \param results A vector of size nPoints that will contain -2ln(likelihood) for each point upon return.
+    virtual void calculateBatch(double* params, int nParams, int nPoints, double* results);
+
+    /// Start evaluating a batch asynchronously, so that the calling process can do something else in the meantime. The previous batch must have been finished.
+    /// \param params The parameter vectors, stored one after the other. They are copied, so the array does not need to be kept.
+    /// \param nPoints The number of parameter vectors, at most maxBatchSize.
+    /// \param exact Use calculateExact instead of calculate.
+    void startBatch(const double* params, int nPoints, bool exact = false);
+
+    /// Wait until the current batch is done.
+    /// \param results A vector of size nPoints that will contain the results upon return.
+    void finishBatch(double* results);
+
+private:
+    ProcessLikelihoodPool(const ProcessLikelihoodPool&);
+    ProcessLikelihoodPool& operator = (const ProcessLikelihoodPool&);
+
+    void runWorker(LikelihoodFactory& factory, int worker);
+    void waitForWorker(int worker);
+    void stopWorkers();
+
+private:
+    const int n_;
+    const int maxBatchSize_;
+    const int nWorkers_;
+    std::vector<int> pids_;
+
+    // the shared memory, with the control block, the parameters and the results of the points, the status of the points, the error message, and the semaphores
+    void* shared_;
+    std::size_t sharedSize_;
+    void* control_;
+    double* params_;
+    double* results_;
+    int* status_;
+    char* error_;
+    void* start_;
+    void* done_;
+
+    int batchSize_;
+    bool broken_;
+};
+
+} // namespace Math
+
+#endif
+
@@ -0,0 +1,125 @@
+#ifndef COSMO_PP_PROFILER_HPP
+#define COSMO_PP_PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+#include <macros.hpp>
+
+/// A hierarchical profiler with scoped regions.
+
+/// The regions are nested, each thread keeps its own call tree of the regions with the number of calls and the total time, so there is no locking when entering or leaving a region.
+/// The report merges the trees of all of the threads, and, with MPI, of all of the processes, giving the minimum, mean and maximum over the processes.
+/// Profiling is off by default, when off a region costs one check of a flag. Compiling with COSMO_NO_PROFILE removes the regions completely.
+/// Use the COSMO_PROFILE_REGION macro to time the rest of the current scope:
+/// \code
+/// {
+///     COSMO_PROFILE_REGION("likelihood");
+///     ...
+/// }
+/// \endcode
+class Profiler
+{
+public:
+    /// Get the profiler, there is only one.
+    static Profiler& instance()
+    {
+        static Profiler p;
+        return p;
+    }
+
+    ~Profiler();
+
+    /// Turn the profiling on or off. The regions that are entered while profiling is off are not timed.
+    static void setEnabled(bool enabled) { enabled_ = enabled; }
+
+    /// Is profiling on.
+    static bool enabled() { return enabled_; }
+
+    /// Clear all of the statistics. No regions should be active in any of the threads.
+    void reset();
+
+    /// The report of the regions.
+    /// With MPI this is collective, ALL of the processes must call it. The regions are merged by their paths in the call trees, so the processes can have different regions.
+    /// \param acrossProcesses If true (default) the statistics are combined over the MPI processes, otherwise only this process is reported.
+    /// \return The report, one line per region with the number of calls and the minimum, mean, and maximum over the processes of the total time in seconds and the fraction of the total time of the parent region, followed by the report of MemoryTracker if any memory has been tracked. With MPI, the full report is only returned to the master process, the others get an empty string.
+    std::string report(bool acrossProcesses = true);
+
+    /// Output the report on the screen (only the master process with MPI). Collective with MPI, see report.
+    void printReport(bool acrossProcesses = true);
+
+    /// The total number of calls and seconds of a region in this process (all of the threads), given by its path, the names of the nested regions separated by '/', for example "mcmc/step/likelihood".
+    /// \param path The path of the region.
+    /// \param seconds The total time of the region will be written here.
+    /// \return The total number of calls, 0 if the region has not been entered.
+    unsigned long regionStats(const std::string& path, double* seconds);
+
+    /// A scoped region, timed from construction to destruction. Use the COSMO_PROFILE_REGION macro instead of creating these directly.
+    class Region
+    {
+    public:
+        /// Constructor.
+        /// \param name The name of the region, should be a string literal (it is stored by pointer and the regions are looked up by the pointer first).
+        Region(const char* name) : node_(NULL)
+        {
+            if(enabled_)
+                enter(name);
+        }
+
+        ~Region()
+        {
+            if(node_)
+                leave();
+        }
+
+    private:
+        Region(const Region&);
+        Region& operator = (const Region&);
+
+        void enter(const char* name);
+        void leave();
+
+    private:
+        void* node_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+private:
+    Profiler() {}
+    Profiler(const Profiler&);
+    Profiler& operator = (const Profiler&);
+
+    struct Node;
+    struct ThreadTree;
+
+    ThreadTree* threadTree();
+
+    struct Entry
+    {
+        std::string path;
+        unsigned long calls;
+        double seconds;
+    };
+
+    void collect(std::vector<Entry>* entries);
+
+private:
+    static bool enabled_;
+
+    std::mutex mutex_;
+    std::vector<ThreadTree*> trees_;
+};
+
+#define COSMO_PROFILE_CONCAT_IMPL(a, b) a ## b
+#define COSMO_PROFILE_CONCAT(a, b) COSMO_PROFILE_CONCAT_IMPL(a, b)
+
+#ifdef COSMO_NO_PROFILE
+#define COSMO_PROFILE_REGION(name)
+#else
+#define COSMO_PROFILE_REGION(name) Profiler::Region COSMO_PROFILE_CONCAT(cosmoProfileRegion, __LINE__)(name)
+#endif
+
+#endif
+
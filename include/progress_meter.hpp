@@ -1,42 +1,118 @@
 #ifndef COSMO_PP_PROGRESS_METER_HPP
 #define COSMO_PP_PROGRESS_METER_HPP
 
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <vector>
+
 #include <macros.hpp>
+#include <cosmo_mpi.hpp>
 
 /// Progress Meter class.
 
 /// This class helps monitor the progress of certain operations and outputs the percentage completed on the screen.
+/// advance is thread safe and cheap: an atomic addition and a comparison with the count of the next percent, the rest is done only when a new percent is reached.
+/// The display is updated at most once every given interval of wall-clock time (and always at 100%).
+/// For loops with very small iterations use a Local counter in each thread, which updates the meter only every given number of operations.
+/// With acrossProcesses the operations of all of the MPI processes are combined and the total progress is shown by the master process.
 class ProgressMeter
 {
 public:
     /// Constructor.
 
     /// Constructs the progress meter.
-    /// \param total The total number of operations to be performed.
-	ProgressMeter(unsigned long total) : total_(total), completed_(0), previous_(0) { check(total_ > 0, ""); output_screen_clean(previous_ << '%' << std::flush); }
+    /// \param total The total number of operations to be performed (by this process if acrossProcesses is true).
+    /// \param acrossProcesses If true, the progress of all of the MPI processes is combined, each process advancing its own operations. In that case the constructor must be called by all of the processes, and each of them must advance its meter up to its total. The progress is exchanged with non-blocking reductions, one for each percent of the operations of each process, so nothing waits for the other processes except the destructor (with threads MPI should support at least MPI_THREAD_SERIALIZED).
+    /// \param minInterval The minimum time in seconds between the updates of the display.
+	ProgressMeter(unsigned long total, bool acrossProcesses = false, double minInterval = 0.2);
+
+    /// Destructor.
+    ~ProgressMeter();
 
     /// Advace the meter.
 
-    /// This function advances the progress meter by a given amount of step (default is 1).
+    /// This function advances the progress meter by a given amount of step (default is 1). Can be called from several threads at the same time.
     /// \param delta The step size to advance the meter.
 	void advance(unsigned long delta = 1)
 	{
-		completed_ += delta;
-		check(completed_ <= total_, "called too many times");
-		unsigned progress = 100 * completed_ / total_;
-		if(progress == previous_)
-			return;
-		previous_ = progress;
-		output_screen_clean('\r' << previous_ << '%' << std::flush);
-		
-		if(previous_ == 100)
-			output_screen_clean(std::endl);
+		const unsigned long completed = completed_.fetch_add(delta, std::memory_order_relaxed) + delta;
+		check(completed <= total_, "called too many times");
+		if(completed >= next_.load(std::memory_order_relaxed))
+			update(completed);
 	}
-	
+
+    /// The number of operations completed by this process so far.
+    unsigned long completed() const { return completed_.load(); }
+
+    /// A per-thread counter that advances the meter in batches.
+
+    /// Create one in each thread (for example inside an OpenMP parallel region) and advance it instead of the meter. The remaining operations are added to the meter when it is destroyed.
+    class Local
+    {
+    public:
+        /// Constructor.
+        /// \param meter The progress meter.
+        /// \param batch The meter is advanced every batch operations.
+        Local(ProgressMeter& meter, unsigned long batch = 1024) : meter_(meter), batch_(batch), pending_(0) { check(batch_ > 0, ""); }
+
+        /// Destructor, adds the remaining operations to the meter.
+        ~Local() { flush(); }
+
+        /// Advance the counter.
+        /// \param delta The step size.
+        void advance(unsigned long delta = 1)
+        {
+            pending_ += delta;
+            if(pending_ >= batch_)
+                flush();
+        }
+
+        /// Add the operations counted so far to the meter.
+        void flush()
+        {
+            if(pending_)
+                meter_.advance(pending_);
+            pending_ = 0;
+        }
+
+    private:
+        Local(const Local&);
+        Local& operator = (const Local&);
+
+        ProgressMeter& meter_;
+        const unsigned long batch_;
+        unsigned long pending_;
+    };
+
+private:
+    ProgressMeter(const ProgressMeter&);
+    ProgressMeter& operator = (const ProgressMeter&);
+
+    void update(unsigned long completed);
+    void show(unsigned progress, bool force);
+    void progressRounds();
+
 private:
-	unsigned long total_;
-	unsigned long completed_;
+	const unsigned long total_;
+	std::atomic<unsigned long> completed_;
+    // the number of completed operations at which the next percent is reached
+	std::atomic<unsigned long> next_;
 	unsigned previous_;
+    unsigned shown_;
+
+    const double minInterval_;
+    std::chrono::steady_clock::time_point lastShown_;
+    std::mutex mutex_;
+
+    // the combined progress over the MPI processes, one reduction per percent of this process
+    const bool acrossProcesses_;
+    double globalTotal_;
+    unsigned roundsStarted_;
+    unsigned roundsDone_;
+    std::vector<double> roundSend_, roundRecv_;
+    std::vector<CosmoMPI::Request*> requests_;
+    CosmoMPI::Communicator* comm_;
 };
 
 #endif
@@ -2,6 +2,10 @@
 #define COSMO_PP_RANDOM_HPP
 
 #include <random>
+#include <vector>
+#include <cmath>
+
+#include <math_constants.hpp>
 
 namespace Math
 {
@@ -71,6 +75,295 @@ private:
     std::poisson_distribution<int> dist_;
 };
 
+/// A counter-based random number engine (Philox4x32-10, Salmon et al. 2011).
+
+/// The numbers are a fixed function of the key (the seed), the stream and the position in the stream, there is no state to be carried from one number to the next. So independent streams can be created cheaply for each realization of a simulation (or each thread, process, etc.), and a given realization is reproduced exactly no matter which thread or process generates it.
+/// Jumping to any position of the stream is free (see discard and position), so a run can be resumed from where it stopped by saving the position only.
+/// This satisfies the requirements of a uniform random bit generator, so it can be used with the distributions of the standard library.
+class PhiloxEngine
+{
+public:
+    /// The type of the generated numbers.
+    typedef unsigned int result_type;
+
+    /// Constructor.
+    /// \param seed The key of the generator.
+    /// \param stream The stream. Different streams with the same seed are independent.
+    PhiloxEngine(unsigned long long seed, unsigned long long stream = 0) : seed_(seed), stream_(stream), counter_(0), next_(4) {}
+
+    /// A stream for a given process and thread, so that all of the threads of all of the processes get different streams.
+    /// \param process The process index (for example CosmoMPI::processId()).
+    /// \param thread The thread index within the process.
+    /// \return The stream.
+    static unsigned long long parallelStream(unsigned int process, unsigned int thread) { return ((unsigned long long)(process) << 32) | thread; }
+
+    /// The minimum of the generated numbers.
+    static constexpr result_type min() { return 0; }
+
+    /// The maximum of the generated numbers.
+    static constexpr result_type max() { return 0xFFFFFFFFU; }
+
+    /// Generate the next number in the stream.
+    result_type operator()()
+    {
+        if(next_ == 4)
+        {
+            block(counter_, out_);
+            ++counter_;
+            next_ = 0;
+        }
+        return out_[next_++];
+    }
+
+    /// Generate the next n numbers in the stream at once. The whole blocks are independent of each other, so they are generated in a vectorized loop.
+    /// \param n The number of numbers to generate.
+    /// \param res The numbers will be written here, must have n elements.
+    void fill(unsigned long n, result_type* res)
+    {
+        unsigned long i = 0;
+        while(i < n && next_ != 4)
+            res[i++] = operator()();
+
+        const unsigned long nBlocks = (n - i) / 4;
+        const unsigned long long first = counter_;
+        result_type* out = res + i;
+#pragma omp simd
+        for(unsigned long j = 0; j < nBlocks; ++j)
+            block(first + j, out + 4 * j);
+        counter_ += nBlocks;
+        i += 4 * nBlocks;
+
+        while(i < n)
+            res[i++] = operator()();
+    }
+
+    /// The position in the stream, i.e. the number of numbers generated (or skipped) so far.
+    unsigned long long position() const { return next_ == 4 ? 4 * counter_ : 4 * (counter_ - 1) + next_; }
+
+    /// Skip numbers in the stream.
+    /// \param n The number of numbers to skip.
+    void discard(unsigned long long n) { seek(position() + n); }
+
+    /// Go to a given position in the stream (forward or backward).
+    /// \param pos The position, i.e. the number of numbers that have been generated from the beginning of the stream.
+    void seek(unsigned long long pos)
+    {
+        counter_ = pos / 4;
+        next_ = 4;
+        if(pos % 4)
+        {
+            operator()();
+            next_ = int(pos % 4);
+        }
+    }
+
+    /// The Philox4x32-10 function, encrypts a 128 bit counter with a 64 bit key.
+    /// \param ctr The counter.
+    /// \param key The key.
+    /// \param res The result.
+    static void block(const unsigned int ctr[4], const unsigned int key[2], unsigned int res[4])
+    {
+        unsigned int c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+        unsigned int k0 = key[0], k1 = key[1];
+        for(int round = 0; round < 10; ++round)
+        {
+            const unsigned long long p0 = 0xD2511F53ULL * c0, p1 = 0xCD9E8D57ULL * c2;
+            const unsigned int hi0 = (unsigned int)(p0 >> 32), lo0 = (unsigned int)(p0);
+            const unsigned int hi1 = (unsigned int)(p1 >> 32), lo1 = (unsigned int)(p1);
+            c0 = hi1 ^ c1 ^ k0;
+            c1 = lo1;
+            c2 = hi0 ^ c3 ^ k1;
+            c3 = lo0;
+            k0 += 0x9E3779B9U;
+            k1 += 0xBB67AE85U;
+        }
+        res[0] = c0;
+        res[1] = c1;
+        res[2] = c2;
+        res[3] = c3;
+    }
+
+    /// Convert two 32 bit numbers into a uniform double in (0, 1) with 53 random bits. Never returns exactly 0 or 1.
+    static double toUniform(result_type a, result_type b) { return ((a >> 5) * 67108864.0 + (b >> 6) + 0.5) * (1.0 / 9007199254740992.0); }
+
+private:
+    void block(unsigned long long counter, unsigned int res[4]) const
+    {
+        const unsigned int ctr[4] = {(unsigned int)(counter), (unsigned int)(counter >> 32), (unsigned int)(stream_), (unsigned int)(stream_ >> 32)};
+        const unsigned int key[2] = {(unsigned int)(seed_), (unsigned int)(seed_ >> 32)};
+        block(ctr, key, res);
+    }
+
+private:
+    unsigned long long seed_, stream_, counter_;
+    unsigned int out_[4];
+    int next_;
+};
+
+/// Uniform real generator with a counter-based engine.
+
+/// Same as UniformRealGenerator, but the numbers come from a given stream of a PhiloxEngine (see there). Each number uses two numbers of the engine, generating many at once gives the same numbers as generating them one by one.
+class UniformStreamGenerator
+{
+public:
+    /// Constructor.
+    /// \param seed The seed to use for the generator.
+    /// \param stream The stream. Different streams with the same seed are independent.
+    /// \param min The minimum of the range.
+    /// \param max The maximum of the range.
+    UniformStreamGenerator(unsigned long long seed, unsigned long long stream, double min = 0.0, double max = 1.0) : gen_(seed, stream), min_(min), width_(max - min) {}
+
+    /// A function to generate a random number from the distribution.
+    /// \return A random number from the uniform distribution.
+    double generate()
+    {
+        const PhiloxEngine::result_type a = gen_(), b = gen_();
+        return min_ + width_ * PhiloxEngine::toUniform(a, b);
+    }
+
+    /// Generate many random numbers at once (vectorized).
+    /// \param n The number of random numbers.
+    /// \param res The numbers will be written here, must have n elements.
+    void generate(unsigned long n, double* res)
+    {
+        buffer_.resize(2 * n);
+        gen_.fill(2 * n, &(buffer_[0]));
+#pragma omp simd
+        for(unsigned long i = 0; i < n; ++i)
+            res[i] = min_ + width_ * PhiloxEngine::toUniform(buffer_[2 * i], buffer_[2 * i + 1]);
+    }
+
+    /// The number of random numbers generated so far.
+    unsigned long long position() const { return gen_.position() / 2; }
+
+    /// Go to a given position, for example to continue a previous run.
+    /// \param pos The number of random numbers generated before.
+    void seek(unsigned long long pos) { gen_.seek(2 * pos); }
+
+private:
+    PhiloxEngine gen_;
+    double min_, width_;
+    std::vector<PhiloxEngine::result_type> buffer_;
+};
+
+/// Gaussian distribution generator with a counter-based engine.
+
+/// Same as GaussianGenerator, but the numbers come from a given stream of a PhiloxEngine (see there), so many independent and reproducible generators can be used in parallel (for example one for each realization of a simulation).
+/// The numbers are generated in pairs with the Box-Muller transform, each pair from one block of the engine. Generating many at once gives the same numbers (up to rounding in the vectorized math functions) as generating them one by one.
+class GaussianStreamGenerator
+{
+public:
+    /// Constructor.
+    /// \param seed The seed to use for the generator.
+    /// \param stream The stream. Different streams with the same seed are independent.
+    /// \param mean The mean of the Gaussian.
+    /// \param sigma The sigma of the Gaussian.
+    GaussianStreamGenerator(unsigned long long seed, unsigned long long stream, double mean, double sigma) : gen_(seed, stream), mean_(mean), sigma_(sigma), haveSpare_(false), spare_(0) {}
+
+    /// A function to generate a random number from the distribution.
+    /// \return A random number from the Gaussian distribution.
+    double generate()
+    {
+        if(haveSpare_)
+        {
+            haveSpare_ = false;
+            return spare_;
+        }
+
+        PhiloxEngine::result_type b[4];
+        for(int i = 0; i < 4; ++i)
+            b[i] = gen_();
+        double x;
+        boxMuller(b, &x, &spare_);
+        haveSpare_ = true;
+        return x;
+    }
+
+    /// Generate many random numbers at once (vectorized).
+    /// \param n The number of random numbers.
+    /// \param res The numbers will be written here, must have n elements.
+    void generate(unsigned long n, double* res)
+    {
+        unsigned long i = 0;
+        if(n > 0 && haveSpare_)
+            res[i++] = generate();
+
+        const unsigned long nPairs = (n - i) / 2;
+        if(nPairs > 0)
+        {
+            buffer_.resize(4 * nPairs);
+            gen_.fill(4 * nPairs, &(buffer_[0]));
+            double* out = res + i;
+#pragma omp simd
+            for(unsigned long j = 0; j < nPairs; ++j)
+                boxMuller(&(buffer_[4 * j]), out + 2 * j, out + 2 * j + 1);
+            i += 2 * nPairs;
+        }
+
+        if(i < n)
+            res[i] = generate();
+    }
+
+    /// The number of random numbers generated so far.
+    unsigned long long position() const { return gen_.position() / 2 - (haveSpare_ ? 1 : 0); }
+
+    /// Go to a given position, for example to continue a previous run.
+    /// \param pos The number of random numbers generated before.
+    void seek(unsigned long long pos)
+    {
+        gen_.seek(4 * (pos / 2));
+        haveSpare_ = false;
+        if(pos % 2)
+            generate();
+    }
+
+private:
+    void boxMuller(const PhiloxEngine::result_type* b, double* x, double* y) const
+    {
+        const double r = sigma_ * std::sqrt(-2 * std::log(PhiloxEngine::toUniform(b[0], b[1])));
+        const double phi = 2 * Math::pi * PhiloxEngine::toUniform(b[2], b[3]);
+        *x = mean_ + r * std::cos(phi);
+        *y = mean_ + r * std::sin(phi);
+    }
+
+private:
+    PhiloxEngine gen_;
+    double mean_, sigma_;
+    bool haveSpare_;
+    double spare_;
+    std::vector<PhiloxEngine::result_type> buffer_;
+};
+
+/// Poisson distribution generator with a counter-based engine.
+
+/// Same as PoissonGenerator, but the numbers come from a given stream of a PhiloxEngine (see there).
+class PoissonStreamGenerator
+{
+public:
+    /// Constructor.
+    /// \param seed The seed to use for the generator.
+    /// \param stream The stream. Different streams with the same seed are independent.
+    /// \param mean The mean of the Poisson distribution.
+    PoissonStreamGenerator(unsigned long long seed, unsigned long long stream, double mean) : gen_(seed, stream), dist_(mean) {}
+
+    /// A function to generate a random number from the distribution.
+    /// \return A random number from the Poisson distribution.
+    int generate() { return dist_(gen_); }
+
+    /// Generate many random numbers.
+    /// \param n The number of random numbers.
+    /// \param res The numbers will be written here, must have n elements.
+    void generate(unsigned long n, int* res)
+    {
+        for(unsigned long i = 0; i < n; ++i)
+            res[i] = dist_(gen_);
+    }
+
+private:
+    PhiloxEngine gen_;
+    std::poisson_distribution<int> dist_;
+};
+
 } // namespace Math
 
 #endif
@@ -1,37 +1,76 @@
 #ifndef COSMO_PP_SCALE_FACTOR_HPP
 #define COSMO_PP_SCALE_FACTOR_HPP
 
+#include <vector>
+
 #include <macros.hpp>
-#include <table_function.hpp>
+#include <cubic_spline.hpp>
 #include <cosmological_params.hpp>
 
+/// The scale factor as a function of time, and related quantities (time as a function of the scale factor, comoving distances, the growth factor).
+
+/// The background is integrated once for each cosmology, then all of the quantities are tabulated on dense grids uniform in ln(a) and ln(t) and cubic splines are used between the grid points, so none of the lookups (including the inverse ones) need any searching.
+/// Initializing again with the same cosmology does nothing.
+/// Before the radiation domination cut (very early times) the analytic radiation dominated solution is used.
 class ScaleFactorFunctionClass : public Math::RealFunction
 {
 public:
-	ScaleFactorFunctionClass() {}
+	ScaleFactorFunctionClass() : initialized_(false) {}
 	~ScaleFactorFunctionClass() {}
 	
 	void initialize(const CosmologicalParams& params);
 	
-	double age() const { check(!tableFunction_.empty(), ""); return tCut_ + tRadDom_; }
+	double age() const { check(initialized_, ""); return tCut_ + tRadDom_; }
 	
 	double evaluate(double t) const;
+
+    /// The scale factor at many times.
+    /// \param n The number of times.
+    /// \param t The times.
+    /// \param res The scale factors will be written here, must have n elements.
+	void evaluate(unsigned long n, const double* t, double* res) const;
 	
 	double time(double a) const; //Determine the time at which scale factor = a
+
+    /// The times for many scale factors.
+    /// \param n The number of scale factors.
+    /// \param a The scale factors.
+    /// \param res The times will be written here, must have n elements.
+	void time(unsigned long n, const double* a, double* res) const;
 	
 	double comovingDistance(double t1, double t2) const;
+
+    /// The comoving distance to a given redshift.
+    /// \param z The redshift.
+    /// \return The comoving distance from today to z.
+	double comovingDistanceToRedshift(double z) const;
+
+    /// The comoving distances to many redshifts.
+    /// \param n The number of redshifts.
+    /// \param z The redshifts.
+    /// \param res The comoving distances will be written here, must have n elements.
+	void comovingDistanceToRedshift(unsigned long n, const double* z, double* res) const;
 	
 	double hubble(double a) const;
     
     double growthFactor(double a) const;
+
+    /// The growth factor for many scale factors.
+    /// \param n The number of scale factors.
+    /// \param a The scale factors.
+    /// \param res The growth factors will be written here, must have n elements.
+    void growthFactor(unsigned long n, const double* a, double* res) const;
 	
-private:
-	typedef Math::TableFunction<double, double> TableFunctionType;
-    
 private:
     double growthFactorUnnormalizedRadDom(double a) const;
     
     double growthFactorFunction(double a) const;
+
+    // the conformal time as a function of time
+    double conformalTime(double t) const;
+
+    // evaluate one of the splines in logarithms for many points, x is clamped to [xMin, xMax] (the points outside are replaced by the analytic solutions by the callers), x and res can be the same
+    static void evaluateLogSpline(const Math::CubicSpline& spline, double xMin, double xMax, unsigned long n, const double* x, double* res);
 	
 private:
 	double omegaM_;
@@ -39,8 +78,17 @@ private:
 	double omegaR_;
 	double omegaK_;
 	double h0_;
-	TableFunctionType tableFunction_;
-    TableFunctionType growthFactor_;
+
+    bool initialized_;
+    // the cosmology the tables were calculated for
+    std::vector<double> params_;
+
+    // the tables, as functions of ln(a) for a from aCut_ to 1, and of ln(t) for t from tRadDom_ to the age
+    Math::CubicSpline logTOfLogA_, logEtaOfLogA_, logGrowthOfLogA_;
+    Math::CubicSpline logAOfLogT_, logEtaOfLogT_;
+    // the conformal time today
+    double eta0_;
+
     double growthFactorCoefficient_;
 	double tCut_;
 	double aCut_;
@@ -49,4 +97,3 @@ private:
 };
 
 #endif
-
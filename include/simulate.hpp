@@ -5,11 +5,24 @@
 #include <vector>
 
 #include <whole_matrix.hpp>
+#include <matrix.hpp>
 
 #include <alm.h>
 #include <xcomplex.h>
 #include <healpix_map.h>
 
+/// A receiver of simulated maps, for processing many simulations as they are generated without storing all of them (see Simulate::simulateWhiteNoise).
+class SimulatedMapConsumer
+{
+public:
+    virtual ~SimulatedMapConsumer() {}
+
+    /// Process one simulated map. Called from several threads at the same time (with different maps), so it must be thread safe.
+    /// \param realization The index of the realization.
+    /// \param map The simulated map. It is reused for the next realizations after the call returns, so copy it if needed.
+    virtual void consume(unsigned long realization, const Healpix_Map<double>& map) = 0;
+};
+
 /// Simulation functions.
 
 /// The functions in this class are used for simulating maps
@@ -37,6 +50,16 @@ public:
     /// \param seed A random seed. If 0 then the current time (in seconds) is taken as the seed.
     static void simulateAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm, int lMax = 0, time_t seed = 0);
 
+    /// Simulates alm from C_l-s with a counter-based random generator.
+
+    /// Same as above, but the random numbers come from the given stream (see Math::PhiloxEngine), so many simulations can be generated in parallel (on different threads or processes) reproducibly, each one from its own stream.
+    /// \param cl A vector of C_l-s, the index is l.
+    /// \param alm The simulated alm to be returned.
+    /// \param lMax The maximum value of l to use for simulation. If 0 it is determined from the size of cl.
+    /// \param seed The random seed.
+    /// \param stream The random stream, for example the index of the simulation.
+    static void simulateAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm, int lMax, unsigned long seed, unsigned long stream);
+
     /// White noise map generator.
     
     /// This function simulates a white noise map.
@@ -44,6 +67,75 @@ public:
     /// \param noiseVal The value of the noise (default = 1.0).
     /// \param seed A random seed. If 0 then the current time (in seconds) is taken as the seed.
     static void simulateWhiteNoise(Healpix_Map<double>& map, double noiseVal = 1.0, time_t seed = 0);
+
+    /// White noise map generator with a counter-based random generator.
+
+    /// Same as above, but the random numbers come from the given stream (see Math::PhiloxEngine).
+    /// \param map The map in which the simulated white noise will be written. The map's n_side or ordering scheme is not changed.
+    /// \param noiseVal The value of the noise.
+    /// \param seed The random seed.
+    /// \param stream The random stream, for example the index of the simulation.
+    static void simulateWhiteNoise(Healpix_Map<double>& map, double noiseVal, unsigned long seed, unsigned long stream);
+
+    /// Simulate many white noise maps at once, in parallel (OpenMP). Realization i is the same as from the single map version with the stream i, so the results do not depend on the number of threads.
+    /// \param nSide The n_side of the maps.
+    /// \param scheme The ordering scheme of the maps.
+    /// \param noiseVal The value of the noise.
+    /// \param seed The random seed.
+    /// \param first The index of the first realization.
+    /// \param n The number of realizations.
+    /// \param maps The maps of the realizations first, ..., first + n - 1.
+    static void simulateWhiteNoise(long nSide, Healpix_Ordering_Scheme scheme, double noiseVal, unsigned long seed, unsigned long first, int n, std::vector<Healpix_Map<double> >& maps);
+
+    /// Simulate many white noise maps and pass them to a consumer as they are generated, without storing them. Each thread generates its realizations into its own map, so the memory is one map per thread however many realizations there are.
+    /// The realizations are the same as from the other versions with the same seed.
+    /// \param nSide The n_side of the maps.
+    /// \param scheme The ordering scheme of the maps.
+    /// \param noiseVal The value of the noise.
+    /// \param seed The random seed.
+    /// \param first The index of the first realization.
+    /// \param n The number of realizations.
+    /// \param consumer Receives the maps, called from several threads at the same time.
+    /// \param nThreads The number of threads, 0 for the OpenMP default.
+    static void simulateWhiteNoise(long nSide, Healpix_Ordering_Scheme scheme, double noiseVal, unsigned long seed, unsigned long first, unsigned long n, SimulatedMapConsumer& consumer, int nThreads = 0);
+};
+
+/// Simulates many alm realizations from a whole matrix.
+
+/// The covariance matrix is decomposed once in the constructor, then any number of realizations can be drawn. Each realization is determined by the seed and its index (the stream of a counter-based random generator, see Math::PhiloxEngine), so the realizations can be generated in parallel on any number of threads or processes and give the same results.
+/// The generated alm-s correspond to a real map, so only m >= 0 are generated.
+class AlmSimulator
+{
+public:
+    /// Constructor. Decomposes the covariance matrix.
+    /// \param wholeMatrix The covariance matrix in l-m space.
+    AlmSimulator(const WholeMatrix& wholeMatrix);
+
+    /// Simulate one realization. Can be called from many threads at the same time.
+    /// \param seed The random seed.
+    /// \param realization The index of the realization.
+    /// \param alm The simulated alm to be returned. The alm-s for l < lMin are 0.
+    void simulate(unsigned long seed, unsigned long realization, Alm<xcomplex<double> >& alm) const;
+
+    /// Simulate many realizations at once. The results are the same as from the single realization version, but the matrix products are done for all of the realizations together, and the random numbers are generated in parallel (OpenMP).
+    /// \param seed The random seed.
+    /// \param first The index of the first realization.
+    /// \param n The number of realizations.
+    /// \param alms The simulated alm-s of the realizations first, ..., first + n - 1.
+    void simulate(unsigned long seed, unsigned long first, int n, std::vector<Alm<xcomplex<double> > >& alms) const;
+
+    /// The minimum l.
+    int getLMin() const { return lMin_; }
+
+    /// The maximum l.
+    int getLMax() const { return lMax_; }
+
+private:
+    void setAlm(const Math::Matrix<double>& re, const Math::Matrix<double>& im, int col, Alm<xcomplex<double> >& alm) const;
+
+private:
+    int lMin_, lMax_, size_;
+    Math::Matrix<double> reFactor_, imFactor_;
 };
 
 #endif
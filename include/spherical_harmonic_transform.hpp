@@ -0,0 +1,102 @@
+#ifndef COSMO_PP_SPHERICAL_HARMONIC_TRANSFORM_HPP
+#define COSMO_PP_SPHERICAL_HARMONIC_TRANSFORM_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+
+#include <arr.h>
+#include <healpix_map.h>
+#include <alm.h>
+#include <xcomplex.h>
+
+/// Spherical harmonic transforms of HEALPix maps with a precomputed geometry.
+
+/// The ring geometry of the HEALPix pixelization (together with the ring weights) and the layout of the a_lm are set up once in the constructor and reused by all of the transforms, instead of being set up again in every call as in the HEALPix functions map2alm and alm2map.
+/// With the SHARP backend (the default) libsharp is called directly. It is vectorized and multithreaded (OpenMP), and can do several transforms at once (see the batched alm2map and map2alm), which shares the recursions of the Legendre functions between the maps.
+/// The HEALPIX backend calls the HEALPix C++ functions with the cached ring weights, so the two backends can be compared and the SHARP one can be turned off if needed.
+/// The maps must be in the RING scheme with the nSide of the transform, the a_lm-s must have lMax and mMax equal to the lMax of the transform. All of the transforms are const, so one object can be used from several threads at the same time. In an OpenMP parallel region each transform runs on the calling thread only.
+class SphericalHarmonicTransform
+{
+public:
+    /// The backends.
+    enum Backend { SHARP_BACKEND = 0, HEALPIX_BACKEND, BACKEND_MAX };
+
+    /// Constructor.
+    /// \param nSide The NSide of the maps.
+    /// \param lMax The maximum l (and m) of the a_lm-s.
+    /// \param ringWeights The weights of the rings for map2alm, 2 * nSide values (the northern rings and the equator, the southern ones are the same by symmetry). NULL means all 1. As in HEALPix they multiply the pixel area 4pi / nPix.
+    /// \param backend The backend.
+    SphericalHarmonicTransform(long nSide, int lMax, const std::vector<double>* ringWeights = NULL, Backend backend = SHARP_BACKEND);
+
+    /// Destructor.
+    ~SphericalHarmonicTransform();
+
+    /// The NSide of the maps.
+    long nSide() const { return nSide_; }
+
+    /// The maximum l of the a_lm-s.
+    int lMax() const { return lMax_; }
+
+    /// The backend.
+    Backend backend() const { return backend_; }
+
+    /// Transform a_lm into a map.
+    /// \param alm The a_lm.
+    /// \param map The map, will be overwritten. It must have the NSide of the transform and the RING scheme.
+    void alm2map(const Alm<xcomplex<double> >& alm, Healpix_Map<double>& map) const;
+
+    /// Transform a map into a_lm, with the ring weights.
+    /// \param map The map, must have the NSide of the transform and the RING scheme.
+    /// \param alm The a_lm, will be overwritten.
+    /// \param weight A constant factor multiplying all of the ring weights for this transform. For example nPix / 4pi with the default ring weights gives the transpose of alm2map.
+    void map2alm(const Healpix_Map<double>& map, Alm<xcomplex<double> >& alm, double weight = 1) const;
+
+    /// Transform a map into a_lm with Jacobi iterations, the same as the HEALPix function map2alm_iter. Each iteration transforms the residual map back and adds its a_lm.
+    /// \param map The map, must have the NSide of the transform and the RING scheme.
+    /// \param alm The a_lm, will be overwritten.
+    /// \param nIter The number of iterations, 0 is the same as map2alm.
+    void map2almIter(const Healpix_Map<double>& map, Alm<xcomplex<double> >& alm, int nIter) const;
+
+    /// Transform T, E, and B a_lm into T, Q, and U maps, the same as the HEALPix function alm2map_pol.
+    /// \param almT The T a_lm.
+    /// \param almE The E a_lm.
+    /// \param almB The B a_lm.
+    /// \param mapT The T map, will be overwritten.
+    /// \param mapQ The Q map, will be overwritten.
+    /// \param mapU The U map, will be overwritten.
+    void alm2mapPol(const Alm<xcomplex<double> >& almT, const Alm<xcomplex<double> >& almE, const Alm<xcomplex<double> >& almB, Healpix_Map<double>& mapT, Healpix_Map<double>& mapQ, Healpix_Map<double>& mapU) const;
+
+    /// Transform several a_lm-s into maps at once.
+    /// \param n The number of transforms.
+    /// \param alms The a_lm-s, n pointers.
+    /// \param maps The maps, n pointers, will be overwritten.
+    void alm2map(int n, const Alm<xcomplex<double> >* const* alms, Healpix_Map<double>* const* maps) const;
+
+    /// Transform several maps into a_lm-s at once, with the ring weights.
+    /// \param n The number of transforms.
+    /// \param maps The maps, n pointers.
+    /// \param alms The a_lm-s, n pointers, will be overwritten.
+    /// \param weight A constant factor multiplying all of the ring weights (see map2alm).
+    void map2alm(int n, const Healpix_Map<double>* const* maps, Alm<xcomplex<double> >* const* alms, double weight = 1) const;
+
+private:
+    SphericalHarmonicTransform(const SphericalHarmonicTransform&);
+    SphericalHarmonicTransform& operator = (const SphericalHarmonicTransform&);
+
+    void checkMap(const Healpix_Map<double>& map) const;
+    void checkAlm(const Alm<xcomplex<double> >& alm) const;
+    void scaleAlm(Alm<xcomplex<double> >& alm, double weight) const;
+
+private:
+    long nSide_;
+    int lMax_;
+    Backend backend_;
+    arr<double> weights_;
+
+    // the libsharp geometry and a_lm information, for the SHARP backend
+    void* geometry_;
+    void* almInfo_;
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <vector>
 #include <cmath>
 
+#include <macros.hpp>
 #include <complex_types.hpp>
 #include <math_constants.hpp>
 
@@ -80,6 +81,104 @@ private:
     std::vector<double> vals_;
 };
 
+/// Calculates all of the spherical harmonics up to a given l at once.
+
+/// The coefficients of the recursion in l of the normalized associated Legendre functions are calculated once in the constructor, then for each direction all of the Y_lm are calculated in one pass, with cos(m phi) and sin(m phi) from the Chebyshev recursion in m. The recursion is for the normalized functions, so it is stable for high l.
+/// The object does not change after it is constructed, so it can be shared between threads (each thread writes into its own results).
+/// The results are stored for m >= 0 only, Y_l(-m) = (-1)^m conj(Y_lm), at the positions index(l, m).
+class SphericalHarmonicsRecursion
+{
+public:
+    /// Constructor.
+    /// \param lMax The maximum l.
+    SphericalHarmonicsRecursion(int lMax) : lMax_(lMax), a_(size()), b_(size()), mm_(lMax + 1)
+    {
+        check(lMax >= 0, "invalid lMax = " << lMax);
+
+        mm_[0] = 1.0 / std::sqrt(4 * pi);
+        for(int m = 1; m <= lMax_; ++m)
+            mm_[m] = -std::sqrt((2.0 * m + 1) / (2.0 * m));
+
+        for(int m = 0; m <= lMax_; ++m)
+        {
+            for(int l = m + 1; l <= lMax_; ++l)
+            {
+                const double d = double(l) * l - double(m) * m;
+                a_[index(l, m)] = std::sqrt((4.0 * l * l - 1) / d);
+                b_[index(l, m)] = (l == m + 1 ? 0.0 : std::sqrt((2.0 * l + 1) * (double(l - 1) * (l - 1) - double(m) * m) / ((2.0 * l - 3) * d)));
+            }
+        }
+    }
+
+    /// The maximum l.
+    int getLMax() const { return lMax_; }
+
+    /// The number of (l, m) pairs with m >= 0, i.e. the size of the results for one direction.
+    unsigned long size() const { return (unsigned long)(lMax_ + 1) * (lMax_ + 2) / 2; }
+
+    /// The position of Y_lm in the results.
+    /// \param l The index l.
+    /// \param m The index m, between 0 and l.
+    static unsigned long index(int l, int m) { return (unsigned long)(l) * (l + 1) / 2 + m; }
+
+    /// Calculate all of the spherical harmonics for one direction.
+    /// \param theta The angle theta of the direction.
+    /// \param phi The angle phi of the direction.
+    /// \param res The results will be written here, must have size() elements.
+    void calculate(double theta, double phi, ComplexDouble* res) const
+    {
+        const double x = std::cos(theta), sinTheta = std::sin(theta);
+        const double c1 = std::cos(phi), s1 = std::sin(phi);
+
+        double lambdaMM = mm_[0];
+        double cPrev = 1, sPrev = 0, c = 1, s = 0;
+        for(int m = 0; m <= lMax_; ++m)
+        {
+            if(m > 0)
+            {
+                lambdaMM *= mm_[m] * sinTheta;
+
+                // cos(m phi) and sin(m phi) from the ones for m - 1 and m - 2
+                const double cNext = (m == 1 ? c1 : 2 * c1 * c - cPrev);
+                const double sNext = (m == 1 ? s1 : 2 * c1 * s - sPrev);
+                cPrev = c;
+                sPrev = s;
+                c = cNext;
+                s = sNext;
+            }
+
+            double lambdaPrev = 0, lambda = lambdaMM;
+            res[index(m, m)] = ComplexDouble(lambda * c, lambda * s);
+            for(int l = m + 1; l <= lMax_; ++l)
+            {
+                const unsigned long k = index(l, m);
+                const double lambdaNext = a_[k] * x * lambda - b_[k] * lambdaPrev;
+                lambdaPrev = lambda;
+                lambda = lambdaNext;
+                res[k] = ComplexDouble(lambda * c, lambda * s);
+            }
+        }
+    }
+
+    /// Calculate all of the spherical harmonics for many directions, in parallel (OpenMP).
+    /// \param n The number of directions.
+    /// \param theta The angles theta of the directions.
+    /// \param phi The angles phi of the directions.
+    /// \param res The results will be written here, the ones for direction i starting at i * size(). Must have n * size() elements.
+    void calculate(long n, const double* theta, const double* phi, ComplexDouble* res) const
+    {
+        const unsigned long s = size();
+#pragma omp parallel for default(shared) schedule(static)
+        for(long i = 0; i < n; ++i)
+            calculate(theta[i], phi[i], res + i * s);
+    }
+
+private:
+    int lMax_;
+    // the recursion is lambda_lm = a_lm x lambda_(l-1)m - b_lm lambda_(l-2)m, and lambda_mm = mm_m sin(theta) lambda_(m-1)(m-1)
+    std::vector<double> a_, b_, mm_;
+};
+
 } // namespace Math
 #endif
 
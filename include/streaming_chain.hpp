@@ -0,0 +1,163 @@
+#ifndef COSMO_PP_STREAMING_CHAIN_HPP
+#define COSMO_PP_STREAMING_CHAIN_HPP
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <limits>
+
+#include <macros.hpp>
+#include <markov_chain.hpp>
+
+/// A quantile sketch in the style of the merging t-digest.
+
+/// Weighted points are collected in a buffer and merged into a bounded number of centroids. The centroids are small near the tails, so the quantiles far from the median are accurate.
+class QuantileSketch
+{
+public:
+    /// Constructor.
+    /// \param compression Determines the number of centroids kept (about 2 * compression at most). Larger values give more accurate quantiles.
+    QuantileSketch(double compression = 200);
+
+    /// Add a point.
+    /// \param x The value.
+    /// \param w The weight. Must be non-negative.
+    void add(double x, double w = 1);
+
+    /// The total weight of the points added.
+    double totalWeight() const { return totalWeight_; }
+
+    /// Find the value at a given quantile.
+    /// \param q The quantile, must be between 0 and 1.
+    /// \return The value below which a fraction q of the total weight lies.
+    double quantile(double q) const;
+
+    /// The number of centroids kept. Useful for testing only.
+    int nCentroids() const { flush(); return means_.size(); }
+
+private:
+    void flush() const;
+
+private:
+    double compression_;
+    double totalWeight_;
+    double min_, max_;
+
+    mutable std::vector<double> means_, weights_;
+    mutable std::vector<std::pair<double, double> > buffer_;
+};
+
+/// A class for analyzing Markov chains that are too long to be kept in memory.
+
+/// The chain files are read one element at a time. Only running weighted moments (Welford's algorithm), histograms on fixed grids for each parameter and for each requested pair of parameters, and quantile sketches are kept.
+/// The histogram ranges need to be known before reading the chains, they can be determined by a separate pass over the files using findRanges. Points outside of the ranges are counted in the moments and the quantiles but not in the histograms.
+class StreamingChain
+{
+public:
+    /// Constructor.
+    /// \param nParams The number of parameters.
+    /// \param mins The lower ends of the histogram ranges for each parameter.
+    /// \param maxs The upper ends of the histogram ranges for each parameter.
+    /// \param nBins The number of histogram bins for each parameter.
+    /// \param pairs The pairs of parameters for which two dimensional histograms are needed.
+    /// \param nBins2D The number of histogram bins in each direction for the two dimensional histograms.
+    /// \param compression The compression parameter of the quantile sketches.
+    StreamingChain(int nParams, const std::vector<double>& mins, const std::vector<double>& maxs, int nBins = 200, const std::vector<std::pair<int, int> >& pairs = std::vector<std::pair<int, int> >(), int nBins2D = 100, double compression = 200);
+
+    /// Destructor.
+    ~StreamingChain() {}
+
+    /// Find the ranges of the parameters in chain files, without keeping the elements. Can be called before constructing the object to determine the histogram ranges.
+    /// \param fileNames The names of the chain files, text, binary, or compressed binary (see CompressedBinaryChain).
+    /// \param mins The minimum values of the parameters will be written here.
+    /// \param maxs The maximum values of the parameters will be written here.
+    /// \param burnin The number of elements to ignore from the beginning of each file.
+    /// \param thin The thinning factor. Must be positive.
+    /// \return The number of parameters.
+    static int findRanges(const std::vector<std::string>& fileNames, std::vector<double>& mins, std::vector<double>& maxs, unsigned long burnin = 0, unsigned int thin = 1);
+
+    /// Read a chain file, text, binary, or compressed binary (see CompressedBinaryChain), and add all of its elements. Compressed files are decompressed one block at a time.
+    /// \param fileName The name of the file containing the chain.
+    /// \param burnin The number of elements to ignore from the beginning of the chain.
+    /// \param thin The thinning factor. Must be positive.
+    void addFile(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1);
+
+    /// Add one element.
+    /// \param prob The weight of the element.
+    /// \param like -2ln(likelihood) of the element.
+    /// \param params The values of the parameters (passed as a pointer to the first element).
+    void addElement(double prob, double like, const double* params);
+
+    /// Returns the number of parameters.
+    int nParams() const { return nParams_; }
+
+    /// The number of elements added.
+    unsigned long size() const { return size_; }
+
+    /// The total weight of the elements added.
+    double totalWeight() const { return totalWeight_; }
+
+    /// -2ln(likelihood) for the maximum likelihood point.
+    double maxLike() const { return minLike_; }
+
+    /// The maximum likelihood point.
+    const std::vector<double>& maxLikePoint() const { return maxLikePoint_; }
+
+    /// The weighted mean of a given parameter.
+    double mean(int i) const { check(i >= 0 && i < nParams_, "invalid parameter index " << i); return mean_[i]; }
+
+    /// The weighted covariance of two given parameters.
+    double covariance(int i, int j) const;
+
+    /// The value of a given parameter at a given quantile, from the quantile sketch.
+    /// \param i The index of the parameter.
+    /// \param q The quantile, must be between 0 and 1.
+    double quantile(int i, double q) const { check(i >= 0 && i < nParams_, "invalid parameter index " << i); return sketches_[i].quantile(q); }
+
+    /// Get the one dimensional marginalized posterior distribution for a given parameter, generated from the histogram.
+    /// \param paramIndex The index of the parameter, starting from 0.
+    /// \param method The smoothing method.
+    /// \param scale The smoothing scale. If not specified, the scale will be automatically determined.
+    /// \return A pointer to the generated distribution. Must be deleted after using.
+    Posterior1D* posterior(int paramIndex, Posterior1D::SmoothingMethod method = Posterior1D::GAUSSIAN_SMOOTHING, double scale = 0) const;
+
+    /// Get the two dimensional marginalized posterior distribution for a given pair of parameters, generated from the histogram. The pair must have been requested in the constructor.
+    /// \param paramIndex1 The index of the first parameter, starting from 0.
+    /// \param paramIndex2 The index of the second parameter, starting from 0.
+    /// \param scale1 The smoothing scale for parameter 1. If not specified, the scale will be automatically determined.
+    /// \param scale2 The smoothing scale for parameter 2. If not specified, the scale will be automatically determined.
+    /// \param method The smoothing method.
+    /// \return A pointer to the generated distribution. Must be deleted after using.
+    Posterior2D* posterior(int paramIndex1, int paramIndex2, double scale1 = 0, double scale2 = 0, Posterior2D::SmoothingMethod method = Posterior2D::GAUSSIAN_SMOOTHING) const;
+
+private:
+    int bin(int i, double x) const;
+    double binCenter(int i, int k) const { return mins_[i] + (k + 0.5) * (maxs_[i] - mins_[i]) / nBins_; }
+    double binCenter2D(int i, int k) const { return mins_[i] + (k + 0.5) * (maxs_[i] - mins_[i]) / nBins2D_; }
+
+    static void readFile(const char* fileName, unsigned long burnin, unsigned int thin, StreamingChain* chain, std::vector<double>* mins, std::vector<double>* maxs, int& nParams);
+
+private:
+    const int nParams_;
+    const int nBins_, nBins2D_;
+    std::vector<double> mins_, maxs_;
+    std::vector<std::pair<int, int> > pairs_;
+
+    unsigned long size_;
+    double totalWeight_;
+    double minLike_;
+    std::vector<double> maxLikePoint_;
+
+    std::vector<double> mean_;
+    std::vector<double> comoment_;
+
+    std::vector<std::vector<double> > hist_, histLike_;
+    std::vector<std::vector<double> > hist2D_, hist2DLike_;
+
+    std::vector<QuantileSketch> sketches_;
+
+    std::vector<double> delta_;
+};
+
+#endif
+
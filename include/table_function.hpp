@@ -3,6 +3,9 @@
 
 #include <istream>
 #include <map>
+#include <vector>
+#include <cmath>
+#include <algorithm>
 
 #include <function.hpp>
 #include <macros.hpp>
@@ -45,6 +48,13 @@ public:
     /// \param x The argument. Must be between the lowest and highest points defined.
     /// \return The value of the interpolation.
 	ValueType evaluate(VariableType x) const;
+
+    /// Evaluate the linear interpolation for many arguments.
+    /// The interval found for each argument is tried first for the next one, so monotonic sequences of arguments need few searches.
+    /// \param n The number of arguments.
+    /// \param x The arguments, all must be between the lowest and highest points defined.
+    /// \param res The values of the interpolation will be written here, must have n elements.
+	void evaluate(unsigned long n, const VariableType* x, ValueType* res) const;
 };
 	
 template<typename VarType, typename ValType, class Compare>
@@ -66,6 +76,296 @@ typename TableFunction<VarType, ValType, Compare>::ValueType TableFunction<VarTy
 	
 	return y1 + (x - x1) * (y2 - y1) / (x2 - x1);
 }
+
+template<typename VarType, typename ValType, class Compare>
+void TableFunction<VarType, ValType, Compare>::evaluate(unsigned long n, const VariableType* x, ValueType* res) const
+{
+	check(!MapType::empty(), "The map is empty!");
+	const Compare comp = MapType::key_comp();
+
+	// the current interval is (lo, hi], not valid if hi is end
+	const_iterator lo = MapType::end(), hi = MapType::end();
+	for(unsigned long i = 0; i < n; ++i)
+	{
+		const VariableType v = x[i];
+		if(!(hi != MapType::end() && comp(lo->first, v) && !comp(hi->first, v)))
+		{
+			const_iterator next = hi;
+			if(hi != MapType::end())
+				++next;
+
+			if(next != MapType::end() && comp(hi->first, v) && !comp(next->first, v))
+			{
+				lo = hi;
+				hi = next;
+			}
+			else
+			{
+				hi = MapType::lower_bound(v);
+				check(hi != MapType::end(), "Element " << v << " is outside the range!");
+				if(hi == MapType::begin())
+				{
+					check(!comp(v, hi->first), "Element " << v << " is outside the range!");
+					res[i] = hi->second;
+					hi = MapType::end();
+					continue;
+				}
+				lo = hi;
+				--lo;
+			}
+		}
+
+		if(!comp(v, hi->first))
+			res[i] = hi->second;
+		else
+			res[i] = lo->second + (v - lo->first) * (hi->second - lo->second) / (hi->first - lo->first);
+	}
+}
+
+/// The points along one axis of the flat table functions.
+/// The points are stored contiguously, so finding the interval containing a value is a binary search without pointer chasing.
+/// If the points are uniformly or logarithmically uniformly spaced (detected on construction) the interval is calculated directly, without any search.
+/// Only increasing order of the points is supported.
+template<typename VarType>
+class FlatTableAxis
+{
+public:
+    /// The grid types.
+	enum GridType { GENERAL_GRID = 0, UNIFORM_GRID, LOG_UNIFORM_GRID };
+
+public:
+    /// Constructor. Creates an empty axis.
+	FlatTableAxis() : gridType_(GENERAL_GRID), start_(0), delta_(0) {}
+
+    /// Constructor.
+    /// \param x The points, need to be strictly increasing, at least one point is needed.
+	FlatTableAxis(const std::vector<VarType>& x) : x_(x) { initialize(); }
+
+    /// The number of points.
+	unsigned long size() const { return x_.size(); }
+
+    /// Access a point.
+    /// \param i The index of the point.
+	const VarType& operator[](unsigned long i) const { check(i < x_.size(), "invalid index " << i); return x_[i]; }
+
+    /// The points.
+	const std::vector<VarType>& points() const { return x_; }
+
+    /// The type of the grid detected.
+	GridType gridType() const { return gridType_; }
+
+    /// Find the interval containing a value.
+    /// \param x The value. Must be between the lowest and highest points.
+    /// \return The index i such that x_i <= x < x_(i + 1), or the index of the last point if x is the last point.
+	unsigned long index(VarType x) const
+	{
+		check(!x_.empty(), "The table is empty!");
+		const unsigned long last = x_.size() - 1;
+		check(!(x < x_[0]) && !(x_[last] < x), "Element " << x << " is outside the range!");
+
+		if(gridType_ == GENERAL_GRID)
+		{
+			const typename std::vector<VarType>::const_iterator it = std::upper_bound(x_.begin(), x_.end(), x);
+			return (unsigned long)(it - x_.begin()) - 1;
+		}
+
+		const double t = ((gridType_ == UNIFORM_GRID ? double(x) : std::log(double(x))) - start_) / delta_;
+		unsigned long i = (t <= 0 ? 0 : (unsigned long)t);
+		if(i > last)
+			i = last;
+
+		// the calculated index can be off by one because of the rounding errors
+		while(i > 0 && x < x_[i])
+			--i;
+		while(i < last && !(x < x_[i + 1]))
+			++i;
+		return i;
+	}
+
+    /// Find the interval containing a value, and the linear interpolation weight.
+    /// \param x The value. Must be between the lowest and highest points.
+    /// \param w The linear interpolation weight of the point after the interval will be written here, 0 if x is exactly at the point returned.
+    /// \return The index i such that x_i <= x < x_(i + 1), or the index of the last point if x is the last point.
+	unsigned long locate(VarType x, VarType* w) const
+	{
+		const unsigned long i = index(x);
+		*w = (x_[i] < x ? (x - x_[i]) / (x_[i + 1] - x_[i]) : VarType(0));
+		return i;
+	}
+
+private:
+	void initialize()
+	{
+		check(!x_.empty(), "The table is empty!");
+		for(unsigned long i = 1; i < x_.size(); ++i)
+		{
+			check(x_[i - 1] < x_[i], "the points must be strictly increasing");
+		}
+
+		gridType_ = GENERAL_GRID;
+		start_ = 0;
+		delta_ = 0;
+		if(x_.size() < 3)
+			return;
+
+		const double eps = 1e-10;
+		const unsigned long last = x_.size() - 1;
+
+		const double delta = (double(x_[last]) - double(x_[0])) / last;
+		bool uniform = true;
+		for(unsigned long i = 1; i <= last && uniform; ++i)
+			uniform = (std::abs(double(x_[i]) - double(x_[0]) - i * delta) <= eps * i * delta);
+		if(uniform)
+		{
+			gridType_ = UNIFORM_GRID;
+			start_ = double(x_[0]);
+			delta_ = delta;
+			return;
+		}
+
+		if(!(x_[0] > 0))
+			return;
+
+		const double logDelta = (std::log(double(x_[last])) - std::log(double(x_[0]))) / last;
+		bool logUniform = true;
+		for(unsigned long i = 1; i <= last && logUniform; ++i)
+			logUniform = (std::abs(std::log(double(x_[i])) - std::log(double(x_[0])) - i * logDelta) <= eps * i * logDelta);
+		if(logUniform)
+		{
+			gridType_ = LOG_UNIFORM_GRID;
+			start_ = std::log(double(x_[0]));
+			delta_ = logDelta;
+		}
+	}
+
+private:
+	std::vector<VarType> x_;
+	GridType gridType_;
+	double start_;
+	double delta_;
+};
+
+/// A frozen version of TableFunction for fast evaluation.
+/// The interpolation points are copied into contiguous arrays (see FlatTableAxis), uniform and log-uniform grids are evaluated without any search.
+/// The points cannot be changed after construction. Only increasing order of the variable is supported.
+template<typename VarType, typename ValType>
+class FlatTableFunction : public Function<VarType, ValType>
+{
+public:
+	typedef Function<VarType, ValType> BaseType;
+
+    /// The variable type.
+	typedef typename BaseType::VariableType VariableType;
+
+    /// The value type.
+	typedef typename BaseType::ValueType ValueType;
+
+    /// The axis type.
+	typedef FlatTableAxis<VarType> AxisType;
+
+public:
+    /// Constructor.
+    /// \param table The table function to copy the points from, needs to have at least one point.
+	template<class Compare>
+	FlatTableFunction(const TableFunction<VarType, ValType, Compare>& table)
+	{
+		std::vector<VarType> x;
+		for(typename TableFunction<VarType, ValType, Compare>::const_iterator it = table.begin(); it != table.end(); ++it)
+		{
+			x.push_back(it->first);
+			y_.push_back(it->second);
+		}
+		axis_ = AxisType(x);
+	}
+
+    /// Constructor.
+    /// \param x The points, need to be strictly increasing, at least one point is needed.
+    /// \param y The values at the points, must have the same size as x.
+	FlatTableFunction(const std::vector<VarType>& x, const std::vector<ValType>& y) : axis_(x), y_(y)
+	{
+		check(x.size() == y.size(), "x has " << x.size() << " elements, y has " << y.size());
+	}
+
+    /// Destructor.
+	~FlatTableFunction() {}
+
+    /// The number of points.
+	unsigned long size() const { return axis_.size(); }
+
+    /// The points.
+	const AxisType& axis() const { return axis_; }
+
+    /// The type of the grid detected.
+	typename AxisType::GridType gridType() const { return axis_.gridType(); }
+
+    /// Evaluate the linear interpolation.
+    /// \param x The argument. Must be between the lowest and highest points defined.
+    /// \return The value of the interpolation.
+	ValueType evaluate(VariableType x) const
+	{
+		VariableType w;
+		const unsigned long i = axis_.locate(x, &w);
+		if(w == 0)
+			return y_[i];
+		return y_[i] + w * (y_[i + 1] - y_[i]);
+	}
+
+    /// Evaluate the linear interpolation for many arguments.
+    /// \param n The number of arguments.
+    /// \param x The arguments, all must be between the lowest and highest points defined.
+    /// \param res The results will be written here, must have n elements.
+	void evaluate(unsigned long n, const VariableType* x, ValueType* res) const
+	{
+		for(unsigned long j = 0; j < n; ++j)
+			res[j] = evaluate(x[j]);
+	}
+
+    /// Evaluate the linear interpolation for many arguments.
+    /// \param x The arguments, all must be between the lowest and highest points defined.
+    /// \param res The results will be written here, resized if needed.
+	void evaluate(const std::vector<VariableType>& x, std::vector<ValueType>* res) const
+	{
+		check(res, "");
+		res->resize(x.size());
+		if(!x.empty())
+			evaluate(x.size(), &(x[0]), &((*res)[0]));
+	}
+
+    /// Evaluate the linear interpolation for many arguments in increasing order, with a single pass over the points (no search for each argument).
+    /// \param n The number of arguments.
+    /// \param x The arguments, must be in non-decreasing order and between the lowest and highest points defined.
+    /// \param res The results will be written here, must have n elements.
+	void evaluateSorted(unsigned long n, const VariableType* x, ValueType* res) const
+	{
+		if(n == 0)
+			return;
+
+		const std::vector<VarType>& points = axis_.points();
+		const unsigned long last = points.size() - 1;
+		check(!(x[0] < points[0]) && !(points[last] < x[n - 1]), "the arguments " << x[0] << " to " << x[n - 1] << " are outside the range!");
+
+		// x and res can be the same array, so the previous argument is kept separately
+		unsigned long i = axis_.index(x[0]);
+		VariableType prev = x[0];
+		for(unsigned long j = 0; j < n; ++j)
+		{
+			const VariableType v = x[j];
+			check(!(v < prev), "the arguments must be in increasing order");
+			prev = v;
+			while(i < last && !(v < points[i + 1]))
+				++i;
+
+			if(i == last || !(points[i] < v))
+				res[j] = y_[i];
+			else
+				res[j] = y_[i] + (v - points[i]) / (points[i + 1] - points[i]) * (y_[i + 1] - y_[i]);
+		}
+	}
+
+private:
+	AxisType axis_;
+	std::vector<ValType> y_;
+};
 	
 /// A class for linear interpolation in two dimension. 
 /// It's inherited from both std::map and Function. The map functionality can be used to define and access interpolation points. 
@@ -133,7 +433,7 @@ typename TableFunction2<Var1Type, Var2Type, ValType, Compare1, Compare2>::ValueT
 	TableFunction2<Var1Type, Var2Type, ValType, Compare1, Compare2>::evaluate(Variable1Type x1, Variable2Type x2) const
 {
 	check(!MapType::empty(), "The map is empty!");
-	const_iterator it = lower_bound(x1);
+	const_iterator it = MapType::lower_bound(x1);
 	check(it != MapType::end(), "Element is outside the range!");
 	const Variable1Type x12 = (*it).first;
 	const ValueType y2 = (*it).second.evaluate(x2);
@@ -226,7 +526,7 @@ typename TableFunction3<Var1Type, Var2Type, Var3Type, ValType, Compare1, Compare
 	TableFunction3<Var1Type, Var2Type, Var3Type, ValType, Compare1, Compare2, Compare3>::evaluate(Variable1Type x1, Variable2Type x2, Variable3Type x3) const
 {
 	check(!MapType::empty(), "The map is empty!");
-	const_iterator it = lower_bound(x1);
+	const_iterator it = MapType::lower_bound(x1);
 	check(it != MapType::end(), "Element is outside the range!");
 	const Variable1Type x12 = (*it).first;
 	const ValueType y2 = (*it).second.evaluate(x2, x3);
@@ -242,6 +542,249 @@ typename TableFunction3<Var1Type, Var2Type, Var3Type, ValType, Compare1, Compare
 	return y1 + (x1 - x11) * (y2 - y1) / (x12 - x11);
 }
 	
+/// A frozen version of TableFunction2 for fast evaluation.
+/// The grid is stored as one axis for each variable (see FlatTableAxis) and the values in one contiguous array, the second variable changing fastest.
+/// The points cannot be changed after construction. Only increasing order of the variables is supported.
+template<typename Var1Type, typename Var2Type, typename ValType>
+class FlatTableFunction2 : public Function2<Var1Type, Var2Type, ValType>
+{
+public:
+	typedef Function2<Var1Type, Var2Type, ValType> BaseType;
+
+    /// The first variable type.
+	typedef typename BaseType::Variable1Type Variable1Type;
+
+    /// The second variable type.
+	typedef typename BaseType::Variable2Type Variable2Type;
+
+    /// The value type.
+	typedef typename BaseType::ValueType ValueType;
+
+public:
+    /// Constructor.
+    /// \param table The table function to copy the points from. The grid must be rectangular and have at least one point.
+	template<class Compare1, class Compare2>
+	FlatTableFunction2(const TableFunction2<Var1Type, Var2Type, ValType, Compare1, Compare2>& table)
+	{
+		typedef TableFunction2<Var1Type, Var2Type, ValType, Compare1, Compare2> TableType;
+		check(!table.empty(), "The table is empty!");
+
+		std::vector<Var1Type> x1;
+		std::vector<Var2Type> x2;
+		for(typename TableType::TF1Type::const_iterator it = table.begin()->second.begin(); it != table.begin()->second.end(); ++it)
+			x2.push_back(it->first);
+
+		for(typename TableType::const_iterator it = table.begin(); it != table.end(); ++it)
+		{
+			x1.push_back(it->first);
+			check(it->second.size() == x2.size(), "the grid is not rectangular");
+			unsigned long j = 0;
+			for(typename TableType::TF1Type::const_iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2, ++j)
+			{
+				check(!(it2->first < x2[j]) && !(x2[j] < it2->first), "the grid is not rectangular");
+				y_.push_back(it2->second);
+			}
+		}
+		axis1_ = FlatTableAxis<Var1Type>(x1);
+		axis2_ = FlatTableAxis<Var2Type>(x2);
+	}
+
+    /// Constructor.
+    /// \param x1 The points for the first variable, need to be strictly increasing.
+    /// \param x2 The points for the second variable, need to be strictly increasing.
+    /// \param y The values at the points, y[i * x2.size() + j] is the value at (x1[i], x2[j]).
+	FlatTableFunction2(const std::vector<Var1Type>& x1, const std::vector<Var2Type>& x2, const std::vector<ValType>& y) : axis1_(x1), axis2_(x2), y_(y)
+	{
+		check(y.size() == x1.size() * x2.size(), "y has " << y.size() << " elements, should be " << x1.size() * x2.size());
+	}
+
+    /// Destructor.
+	~FlatTableFunction2() {}
+
+    /// The points for the first variable.
+	const FlatTableAxis<Var1Type>& axis1() const { return axis1_; }
+
+    /// The points for the second variable.
+	const FlatTableAxis<Var2Type>& axis2() const { return axis2_; }
+
+    /// Evaluate the linear interpolation.
+    /// \param x1 The first variable.
+    /// \param x2 The second variable.
+    /// \return The value of the linear interpolation.
+	ValueType evaluate(Variable1Type x1, Variable2Type x2) const
+	{
+		Variable1Type w1;
+		Variable2Type w2;
+		const unsigned long i = axis1_.locate(x1, &w1);
+		const unsigned long j = axis2_.locate(x2, &w2);
+
+		const ValueType y1 = row(i, j, w2);
+		if(w1 == 0)
+			return y1;
+		return y1 + w1 * (row(i + 1, j, w2) - y1);
+	}
+
+    /// Evaluate the linear interpolation for many arguments.
+    /// \param n The number of arguments.
+    /// \param x1 The first variables.
+    /// \param x2 The second variables.
+    /// \param res The results will be written here, must have n elements.
+	void evaluate(unsigned long n, const Variable1Type* x1, const Variable2Type* x2, ValueType* res) const
+	{
+		for(unsigned long k = 0; k < n; ++k)
+			res[k] = evaluate(x1[k], x2[k]);
+	}
+
+private:
+	// the interpolation along the second variable
+	ValueType row(unsigned long i, unsigned long j, Variable2Type w2) const
+	{
+		const ValType* y = &(y_[i * axis2_.size() + j]);
+		if(w2 == 0)
+			return y[0];
+		return y[0] + w2 * (y[1] - y[0]);
+	}
+
+private:
+	FlatTableAxis<Var1Type> axis1_;
+	FlatTableAxis<Var2Type> axis2_;
+	std::vector<ValType> y_;
+};
+
+/// A frozen version of TableFunction3 for fast evaluation.
+/// The grid is stored as one axis for each variable (see FlatTableAxis) and the values in one contiguous array, the third variable changing fastest and the first one slowest.
+/// The points cannot be changed after construction. Only increasing order of the variables is supported.
+template<typename Var1Type, typename Var2Type, typename Var3Type, typename ValType>
+class FlatTableFunction3 : public Function3<Var1Type, Var2Type, Var3Type, ValType>
+{
+public:
+	typedef Function3<Var1Type, Var2Type, Var3Type, ValType> BaseType;
+
+    /// The first variable type.
+	typedef typename BaseType::Variable1Type Variable1Type;
+
+    /// The second variable type.
+	typedef typename BaseType::Variable2Type Variable2Type;
+
+    /// The third variable type.
+	typedef typename BaseType::Variable3Type Variable3Type;
+
+    /// The value type.
+	typedef typename BaseType::ValueType ValueType;
+
+public:
+    /// Constructor.
+    /// \param table The table function to copy the points from. The grid must be rectangular and have at least one point.
+	template<class Compare1, class Compare2, class Compare3>
+	FlatTableFunction3(const TableFunction3<Var1Type, Var2Type, Var3Type, ValType, Compare1, Compare2, Compare3>& table)
+	{
+		typedef TableFunction3<Var1Type, Var2Type, Var3Type, ValType, Compare1, Compare2, Compare3> TableType;
+		check(!table.empty(), "The table is empty!");
+
+		std::vector<Var1Type> x1;
+		std::vector<Var2Type> x2;
+		std::vector<Var3Type> x3;
+		for(typename TableType::const_iterator it = table.begin(); it != table.end(); ++it)
+		{
+			x1.push_back(it->first);
+			const FlatTableFunction2<Var2Type, Var3Type, ValType> f(it->second);
+			if(it == table.begin())
+			{
+				x2 = f.axis1().points();
+				x3 = f.axis2().points();
+			}
+			check(f.axis1().points() == x2 && f.axis2().points() == x3, "the grid is not rectangular");
+			for(unsigned long j = 0; j < x2.size(); ++j)
+			{
+				for(unsigned long k = 0; k < x3.size(); ++k)
+					y_.push_back(f.evaluate(x2[j], x3[k]));
+			}
+		}
+		axis1_ = FlatTableAxis<Var1Type>(x1);
+		axis2_ = FlatTableAxis<Var2Type>(x2);
+		axis3_ = FlatTableAxis<Var3Type>(x3);
+	}
+
+    /// Constructor.
+    /// \param x1 The points for the first variable, need to be strictly increasing.
+    /// \param x2 The points for the second variable, need to be strictly increasing.
+    /// \param x3 The points for the third variable, need to be strictly increasing.
+    /// \param y The values at the points, y[(i * x2.size() + j) * x3.size() + k] is the value at (x1[i], x2[j], x3[k]).
+	FlatTableFunction3(const std::vector<Var1Type>& x1, const std::vector<Var2Type>& x2, const std::vector<Var3Type>& x3, const std::vector<ValType>& y) : axis1_(x1), axis2_(x2), axis3_(x3), y_(y)
+	{
+		check(y.size() == x1.size() * x2.size() * x3.size(), "y has " << y.size() << " elements, should be " << x1.size() * x2.size() * x3.size());
+	}
+
+    /// Destructor.
+	~FlatTableFunction3() {}
+
+    /// The points for the first variable.
+	const FlatTableAxis<Var1Type>& axis1() const { return axis1_; }
+
+    /// The points for the second variable.
+	const FlatTableAxis<Var2Type>& axis2() const { return axis2_; }
+
+    /// The points for the third variable.
+	const FlatTableAxis<Var3Type>& axis3() const { return axis3_; }
+
+    /// Evaluate the linear interpolation.
+    /// \param x1 The first variable.
+    /// \param x2 The second variable.
+    /// \param x3 The third variable.
+    /// \return The value of the linear interpolation.
+	ValueType evaluate(Variable1Type x1, Variable2Type x2, Variable3Type x3) const
+	{
+		Variable1Type w1;
+		Variable2Type w2;
+		Variable3Type w3;
+		const unsigned long i = axis1_.locate(x1, &w1);
+		const unsigned long j = axis2_.locate(x2, &w2);
+		const unsigned long k = axis3_.locate(x3, &w3);
+
+		const ValueType y1 = plane(i, j, k, w2, w3);
+		if(w1 == 0)
+			return y1;
+		return y1 + w1 * (plane(i + 1, j, k, w2, w3) - y1);
+	}
+
+    /// Evaluate the linear interpolation for many arguments.
+    /// \param n The number of arguments.
+    /// \param x1 The first variables.
+    /// \param x2 The second variables.
+    /// \param x3 The third variables.
+    /// \param res The results will be written here, must have n elements.
+	void evaluate(unsigned long n, const Variable1Type* x1, const Variable2Type* x2, const Variable3Type* x3, ValueType* res) const
+	{
+		for(unsigned long l = 0; l < n; ++l)
+			res[l] = evaluate(x1[l], x2[l], x3[l]);
+	}
+
+private:
+	// the interpolation along the third variable
+	ValueType row(unsigned long i, unsigned long j, unsigned long k, Variable3Type w3) const
+	{
+		const ValType* y = &(y_[(i * axis2_.size() + j) * axis3_.size() + k]);
+		if(w3 == 0)
+			return y[0];
+		return y[0] + w3 * (y[1] - y[0]);
+	}
+
+	// the interpolation along the second and third variables
+	ValueType plane(unsigned long i, unsigned long j, unsigned long k, Variable2Type w2, Variable3Type w3) const
+	{
+		const ValueType y1 = row(i, j, k, w3);
+		if(w2 == 0)
+			return y1;
+		return y1 + w2 * (row(i, j + 1, k, w3) - y1);
+	}
+
+private:
+	FlatTableAxis<Var1Type> axis1_;
+	FlatTableAxis<Var2Type> axis2_;
+	FlatTableAxis<Var3Type> axis3_;
+	std::vector<ValType> y_;
+};
+
 } //namespace Math
 
 #endif
@@ -0,0 +1,20 @@
+#ifndef COSMO_PP_TEST_CHAIN_COMPRESSION_HPP
+#define COSMO_PP_TEST_CHAIN_COMPRESSION_HPP
+
+#include <test_framework.hpp>
+
+class TestChainCompression : public TestFramework
+{
+public:
+    TestChainCompression(double precision = 1e-5) : TestFramework(precision) {}
+    ~TestChainCompression() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return false; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -0,0 +1,19 @@
+#ifndef COSMO_PP_TEST_CHECKPOINT_COORDINATOR_HPP
+#define COSMO_PP_TEST_CHECKPOINT_COORDINATOR_HPP
+
+#include <test_framework.hpp>
+
+class TestCheckpointCoordinator : public TestFramework
+{
+public:
+    TestCheckpointCoordinator(double precision = 1e-10) : TestFramework(precision) {}
+    ~TestCheckpointCoordinator() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef COSMO_PP_TEST_CL_CACHE_HPP
+#define COSMO_PP_TEST_CL_CACHE_HPP
+
+#include <test_framework.hpp>
+
+class TestClCache : public TestFramework
+{
+public:
+    TestClCache(double precision = 1e-10) : TestFramework(precision) {}
+    ~TestClCache() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+
+private:
+    void runSubTest0(double& res, double& expected, std::string& subTestName);
+    void runSubTest1(double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
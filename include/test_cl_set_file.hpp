@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_CL_SET_FILE_HPP
+#define COSMO_PP_TEST_CL_SET_FILE_HPP
+
+#include <test_framework.hpp>
+
+class TestClSetFile : public TestFramework
+{
+public:
+    TestClSetFile(double precision = 1e-10) : TestFramework(precision) {}
+    ~TestClSetFile() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
@@ -12,6 +12,9 @@ protected:
     std::string name() const;
     unsigned int numberOfSubtests() const;
     void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+
+private:
+    void runPreconditionerSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
 };
 
 #endif
@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_DEVICE_LARGE_VECTOR_HPP
+#define COSMO_PP_TEST_DEVICE_LARGE_VECTOR_HPP
+
+#include <test_framework.hpp>
+
+class TestDeviceLargeVector : public TestFramework
+{
+public:
+    TestDeviceLargeVector(double precision = 1e-10) : TestFramework(precision) {}
+    ~TestDeviceLargeVector() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef COSMO_PP_TEST_DISTRIBUTED_LARGE_VECTOR_HPP
+#define COSMO_PP_TEST_DISTRIBUTED_LARGE_VECTOR_HPP
+
+#include <test_framework.hpp>
+
+class TestDistributedLargeVector : public TestFramework
+{
+public:
+    TestDistributedLargeVector(double precision = 1e-10) : TestFramework(precision) {}
+    ~TestDistributedLargeVector() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef COSMO_PP_TEST_ENSEMBLE_SAMPLER_HPP
+#define COSMO_PP_TEST_ENSEMBLE_SAMPLER_HPP
+
+#include <test_framework.hpp>
+
+class TestEnsembleSampler : public TestFramework
+{
+public:
+    ~TestEnsembleSampler() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
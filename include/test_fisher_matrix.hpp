@@ -0,0 +1,19 @@
+#ifndef COSMO_PP_TEST_FISHER_MATRIX_HPP
+#define COSMO_PP_TEST_FISHER_MATRIX_HPP
+
+#include <test_framework.hpp>
+
+class TestFisherMatrix : public TestFramework
+{
+public:
+    TestFisherMatrix(double precision = 1e-6) : TestFramework(precision) {}
+    ~TestFisherMatrix() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
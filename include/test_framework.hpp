@@ -3,6 +3,11 @@
 
 #include <string>
 
+/// The base class of the tests.
+
+/// Each test consists of subtests, the result of each subtest is compared to its expected result with the given precision.
+/// Optionally the subtests can also be timed (see setTiming), with warm-up runs and repetitions, and compared to a baseline file of earlier timings.
+/// A subtest that is slower than the baseline by more than a given factor fails, so the tests can also be used to catch performance regressions.
 class TestFramework
 {
 public:
@@ -19,6 +24,16 @@ public:
     /// \return true if all of the subtests passed.
     bool run(unsigned int& pass, unsigned int& fail);
 
+    /// Turn on timing of the subtests. Each subtest is run warmUp times without timing, then repetitions times timed, and the minimum time is reported. The result of the first run is compared to the expected result.
+    /// The subtests must give the same result when run several times.
+    /// The baseline file has one line per subtest, with the test name, the subtest index, the time in seconds, and the subtest name, separated by tabs. It is shared by all of the tests, only the lines of this test are changed.
+    /// \param warmUp The number of untimed runs of each subtest.
+    /// \param repetitions The number of timed runs of each subtest, 0 turns off timing.
+    /// \param baselineFileName The baseline file name. If empty, the times are only reported.
+    /// \param maxSlowdown A subtest fails if its time is more than maxSlowdown times its baseline time. Differences of less than 1 millisecond are ignored as noise.
+    /// \param updateBaseline If true, the times of all of the subtests are written into the baseline file (and are not compared), otherwise only the subtests missing from the baseline are written.
+    void setTiming(int warmUp, int repetitions, const std::string& baselineFileName = "", double maxSlowdown = 1.5, bool updateBaseline = false);
+
     /// Check if this is the master MPI process.
     bool isMaster() const;
 
@@ -41,6 +56,13 @@ protected:
 
 protected:
     const double precision_;
+
+private:
+    int warmUp_;
+    int repetitions_;
+    std::string baselineFileName_;
+    double maxSlowdown_;
+    bool updateBaseline_;
 };
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef COSMO_PP_TEST_HMC_HPP
+#define COSMO_PP_TEST_HMC_HPP
+
+#include <test_framework.hpp>
+
+class TestHMC : public TestFramework
+{
+public:
+    ~TestHMC() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
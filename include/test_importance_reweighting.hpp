@@ -0,0 +1,20 @@
+#ifndef COSMO_PP_TEST_IMPORTANCE_REWEIGHTING_HPP
+#define COSMO_PP_TEST_IMPORTANCE_REWEIGHTING_HPP
+
+#include <test_framework.hpp>
+
+class TestImportanceReweighting : public TestFramework
+{
+public:
+    TestImportanceReweighting(double precision = 1e-5) : TestFramework(precision) {}
+    ~TestImportanceReweighting() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -17,6 +17,12 @@ protected:
     void runSubTest2(double& res, double& expected, std::string& subTestName);
     void runSubTest3(double& res, double& expected, std::string& subTestName);
     void runSubTest4(double& res, double& expected, std::string& subTestName);
+    void runSubTest9(double& res, double& expected, std::string& subTestName);
+    void runSubTest10(double& res, double& expected, std::string& subTestName);
+    void runSubTest11(double& res, double& expected, std::string& subTestName);
+    void runSubTest12(double& res, double& expected, std::string& subTestName);
+    void runSubTest13(double& res, double& expected, std::string& subTestName);
+    void runSubTest14(double& res, double& expected, std::string& subTestName);
 
     bool test(int dim, unsigned long nPoints, int k, int seed = 0);
 };
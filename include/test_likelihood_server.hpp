@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_LIKELIHOOD_SERVER_HPP
+#define COSMO_PP_TEST_LIKELIHOOD_SERVER_HPP
+
+#include <test_framework.hpp>
+
+class TestLikelihoodServer : public TestFramework
+{
+public:
+    ~TestLikelihoodServer() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -34,6 +34,12 @@ private:
     void runSubTest17(double& res, double& expected, std::string& subTestName);
     void runSubTest18(double& res, double& expected, std::string& subTestName);
     void runSubTest19(double& res, double& expected, std::string& subTestName);
+    void runSubTest22(double& res, double& expected, std::string& subTestName);
+    void runSubTest23(double& res, double& expected, std::string& subTestName);
+    void runSubTest24(double& res, double& expected, std::string& subTestName);
+    void runSubTest25(double& res, double& expected, std::string& subTestName);
+    void runSubTest26(double& res, double& expected, std::string& subTestName);
+    void runSubTest27(double& res, double& expected, std::string& subTestName);
 
     void runSubTestEigen(double& res, double& expected, std::string& subTestName, bool pd);
 };
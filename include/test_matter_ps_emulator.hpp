@@ -0,0 +1,20 @@
+#ifndef COSMO_PP_TEST_MATTER_PS_EMULATOR_HPP
+#define COSMO_PP_TEST_MATTER_PS_EMULATOR_HPP
+
+#include <test_framework.hpp>
+
+class TestMatterPsEmulator : public TestFramework
+{
+public:
+    TestMatterPsEmulator(double precision = 1e-5) : TestFramework(precision) {}
+    ~TestMatterPsEmulator() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
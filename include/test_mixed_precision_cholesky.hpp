@@ -0,0 +1,24 @@
+#ifndef COSMO_PP_TEST_MIXED_PRECISION_CHOLESKY_HPP
+#define COSMO_PP_TEST_MIXED_PRECISION_CHOLESKY_HPP
+
+#include <test_framework.hpp>
+
+class TestMixedPrecisionCholesky : public TestFramework
+{
+public:
+    TestMixedPrecisionCholesky(double precision = 1e-10) : TestFramework(precision) {}
+    ~TestMixedPrecisionCholesky() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+
+private:
+    void runSubTest0(double& res, double& expected, std::string& subTestName);
+    void runSubTest1(double& res, double& expected, std::string& subTestName);
+    void runSubTest2(double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_NUTS_GENERAL_HPP
+#define COSMO_PP_TEST_NUTS_GENERAL_HPP
+
+#include <test_framework.hpp>
+
+class TestNUTSGeneral : public TestFramework
+{
+public:
+    ~TestNUTSGeneral() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -0,0 +1,19 @@
+#ifndef COSMO_PP_TEST_PARALLEL_TEMPERING_HPP
+#define COSMO_PP_TEST_PARALLEL_TEMPERING_HPP
+
+#include <test_framework.hpp>
+
+class TestParallelTempering : public TestFramework
+{
+public:
+    ~TestParallelTempering() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -0,0 +1,23 @@
+#ifndef COSMO_PP_TEST_PRINCIPAL_COMPONENTS_HPP
+#define COSMO_PP_TEST_PRINCIPAL_COMPONENTS_HPP
+
+#include <test_framework.hpp>
+
+class TestPrincipalComponents : public TestFramework
+{
+public:
+    TestPrincipalComponents(double precision = 1e-5) : TestFramework(precision) {}
+    ~TestPrincipalComponents() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+
+private:
+    void runSubTest0(double& res, double& expected, std::string& subTestName);
+    void runSubTest1(double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
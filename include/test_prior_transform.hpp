@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_PRIOR_TRANSFORM_HPP
+#define COSMO_PP_TEST_PRIOR_TRANSFORM_HPP
+
+#include <test_framework.hpp>
+
+class TestPriorTransform : public TestFramework
+{
+public:
+    TestPriorTransform(double precision = 1e-10) : TestFramework(precision) {}
+    ~TestPriorTransform() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_PROCESS_LIKELIHOOD_POOL_HPP
+#define COSMO_PP_TEST_PROCESS_LIKELIHOOD_POOL_HPP
+
+#include <test_framework.hpp>
+
+class TestProcessLikelihoodPool : public TestFramework
+{
+public:
+    ~TestProcessLikelihoodPool() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
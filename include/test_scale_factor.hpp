@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_SCALE_FACTOR_HPP
+#define COSMO_PP_TEST_SCALE_FACTOR_HPP
+
+#include <test_framework.hpp>
+
+class TestScaleFactor : public TestFramework
+{
+public:
+    ~TestScaleFactor() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -0,0 +1,20 @@
+#ifndef COSMO_PP_TEST_SPHERICAL_HARMONIC_TRANSFORM_HPP
+#define COSMO_PP_TEST_SPHERICAL_HARMONIC_TRANSFORM_HPP
+
+#include <test_framework.hpp>
+
+class TestSphericalHarmonicTransform : public TestFramework
+{
+public:
+    TestSphericalHarmonicTransform(double precision = 1e-8) : TestFramework(precision) {}
+
+    ~TestSphericalHarmonicTransform() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
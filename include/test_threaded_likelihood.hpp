@@ -0,0 +1,18 @@
+#ifndef COSMO_PP_TEST_THREADED_LIKELIHOOD_HPP
+#define COSMO_PP_TEST_THREADED_LIKELIHOOD_HPP
+
+#include <test_framework.hpp>
+
+class TestThreadedLikelihood : public TestFramework
+{
+public:
+    ~TestThreadedLikelihood() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+};
+
+#endif
+
@@ -0,0 +1,52 @@
+#ifndef COSMO_PP_THREADED_LIKELIHOOD_HPP
+#define COSMO_PP_THREADED_LIKELIHOOD_HPP
+
+#include <macros.hpp>
+#include <likelihood_function.hpp>
+
+namespace Math
+{
+
+/// A likelihood function that runs each evaluation of another likelihood on a given number of OpenMP threads.
+
+/// The samplers that request one point at a time (MnScanner, since MultiNest chooses each point from the previous results) cannot evaluate several points concurrently. Instead, the threads of the process can be given to the parallel regions of the likelihood itself (CLASS and clik are parallelized with OpenMP).
+/// The number of threads is set for the duration of each call only, the previous setting of the calling thread is restored afterwards (also if the likelihood throws). If called from inside of a parallel region, the parallel regions of the likelihood are nested ones, which only get the threads if nesting is enabled (see omp_set_max_active_levels).
+/// The results are the same as those of the likelihood called directly, up to the rounding differences of its own parallel reductions. Without OpenMP the calls are simply forwarded.
+class ThreadedLikelihood : public LikelihoodFunction
+{
+public:
+    /// Constructor.
+    /// \param like The likelihood function.
+    /// \param nThreads The number of threads for each evaluation.
+    ThreadedLikelihood(LikelihoodFunction& like, int nThreads) : like_(like), nThreads_(nThreads) { check(nThreads > 0, "invalid number of threads " << nThreads); }
+
+    /// Destructor.
+    ~ThreadedLikelihood() {}
+
+    /// The number of threads for each evaluation.
+    int nThreads() const { return nThreads_; }
+
+    /// Calculate the likelihood on the threads.
+    virtual double calculate(double* params, int nParams);
+
+    /// Calculate the exact likelihood on the threads.
+    virtual double calculateExact(double* params, int nParams);
+
+    /// Calculate the likelihood for a batch of points, the whole batch is given to the likelihood with the threads.
+    virtual void calculateBatch(double* params, int nParams, int nPoints, double* results);
+
+    /// Information about the last evaluation of the likelihood.
+    virtual bool lastEvaluationInfo(bool* approximate, int* retries) const { return like_.lastEvaluationInfo(approximate, retries); }
+
+    /// Set the precision of the likelihood.
+    virtual bool setLowPrecision(bool low) { return like_.setLowPrecision(low); }
+
+private:
+    LikelihoodFunction& like_;
+    const int nThreads_;
+};
+
+} // namespace Math
+
+#endif
+
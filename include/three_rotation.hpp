@@ -2,7 +2,6 @@
 #define COSMO_PP_THREE_ROTATION_HPP
 
 #include <cmath>
-#include <vector>
 
 #include <macros.hpp>
 #include <three_vector.hpp>
@@ -19,11 +18,9 @@ namespace Math
 /// then rotate counterclockwise around the new z axis by angle psi
 /// Thus we obtain a new coordinate frame, applying the rotation to a three-vector will give
 /// the same vector in the new frame.
+/// The elements are stored in a fixed size array, so the matrix can be copied freely and applied to large arrays of vectors quickly (see apply).
 class ThreeRotationMatrix
 {
-public:
-	typedef std::vector<double> VectorType;
-	
 public:
     /// Constructor.
     /// \param phi Euler angle phi.
@@ -31,13 +28,6 @@ public:
     /// \param psi Euler angle psi.
 	ThreeRotationMatrix(double phi = 0, double theta = 0, double psi = 0);
 
-    /// Copy constructor.
-    /// \param other The matrix to copy from.
-	ThreeRotationMatrix(const ThreeRotationMatrix& other);
-	
-    /// Destructor.
-	~ThreeRotationMatrix() {}
-	
     /// Set the Euler angles to new values.
     /// \param phi Euler angle phi.
     /// \param theta Euler angle theta.
@@ -51,8 +41,23 @@ public:
 	
     /// Access to a given row.
     /// \param i The index of the row (between 0 and 2).
-    /// \return A constant reference to the vector representing row i.
-	const VectorType& operator[](int i) const { check(i >= 0 && i < 3, "invalid index"); return matrix_[i]; }
+    /// \return A pointer to the 3 elements of row i.
+	const double* operator[](int i) const { check(i >= 0 && i < 3, "invalid index"); return matrix_[i]; }
+
+    /// The transpose, i.e. the inverse rotation.
+	ThreeRotationMatrix transpose() const;
+
+    /// Apply the matrix to many three-vectors at once.
+    /// \param n The number of vectors.
+    /// \param v The vectors, stored as x, y, z one after the other (3 n elements).
+    /// \param res The rotated vectors will be written here in the same format, can be the same as v.
+	void apply(unsigned long n, const double* v, double* res) const;
+
+    /// Apply the matrix to many three-vectors at once.
+    /// \param n The number of vectors.
+    /// \param v The vectors.
+    /// \param res The rotated vectors will be written here, can be the same as v.
+	void apply(unsigned long n, const ThreeVectorDouble* v, ThreeVectorDouble* res) const;
 
     /// Apply the matrix to a given three-vector.
     /// \param v The vector to apply the rotation to.
@@ -65,11 +70,6 @@ public:
     /// \return The resulting rotation matrix after the multiplication. Note that this isn't changed.
 	ThreeRotationMatrix operator * (const ThreeRotationMatrix& other) const;
 
-    /// Copy operator.
-    /// \param other The rotation matrix to copy from.
-    /// \return A reference to this after the copy is done.
-	ThreeRotationMatrix& operator = (const ThreeRotationMatrix& other);
-	
     /// Check equality.
     /// The precision of equality is 1e-3.
     /// \param other The other matrix to compare to.
@@ -77,25 +77,14 @@ public:
 	bool operator == (const ThreeRotationMatrix& other) const;
 	
 private:
-	std::vector<VectorType> matrix_;
+	double matrix_[3][3];
 };
 	
 inline
 ThreeRotationMatrix::ThreeRotationMatrix(double phi, double theta, double psi)
 {
-	matrix_.resize(3);
-	for(int i = 0; i < 3; ++i)
-		matrix_[i].resize(3);
-	
 	set(phi, theta, psi);
 }
-	
-inline
-ThreeRotationMatrix::ThreeRotationMatrix(const ThreeRotationMatrix& other)
-{
-	ThreeRotationMatrix();
-	*this = other;
-}
 
 inline
 void ThreeRotationMatrix::set(double phi, double theta, double psi)
@@ -184,15 +173,8 @@ inline
 ThreeRotationMatrix ThreeRotationMatrix::operator * (const ThreeRotationMatrix& other) const
 {
 	ThreeRotationMatrix result;
-	check(matrix_.size() == 3, "");
-	check(other.matrix_.size() == 3, "");
-	check(result.matrix_.size() == 3, "");
 	for(int i = 0; i < 3; ++i)
 	{
-		check(matrix_[i].size() == 3, "");
-		check(other.matrix_[i].size() == 3, "");
-		check(result.matrix_[i].size() == 3, "");
-		
 		for(int j = 0; j < 3; ++j)
 		{
 			result.matrix_[i][j] = 0;
@@ -205,29 +187,51 @@ ThreeRotationMatrix ThreeRotationMatrix::operator * (const ThreeRotationMatrix&
 }
 
 inline
-ThreeRotationMatrix& ThreeRotationMatrix::operator = (const ThreeRotationMatrix& other)
+ThreeRotationMatrix ThreeRotationMatrix::transpose() const
 {
-	check(matrix_.size() == 3, "");
-	check(other.matrix_.size() == 3, "");
+	ThreeRotationMatrix result;
 	for(int i = 0; i < 3; ++i)
 	{
-		check(matrix_[i].size() == 3, "");
-		check(other.matrix_[i].size() == 3, "");
 		for(int j = 0; j < 3; ++j)
-			matrix_[i][j] = other.matrix_[i][j];
+			result.matrix_[i][j] = matrix_[j][i];
+	}
+	return result;
+}
+
+inline
+void ThreeRotationMatrix::apply(unsigned long n, const double* v, double* res) const
+{
+	const double m00 = matrix_[0][0], m01 = matrix_[0][1], m02 = matrix_[0][2];
+	const double m10 = matrix_[1][0], m11 = matrix_[1][1], m12 = matrix_[1][2];
+	const double m20 = matrix_[2][0], m21 = matrix_[2][1], m22 = matrix_[2][2];
+
+#pragma omp simd
+	for(unsigned long i = 0; i < n; ++i)
+	{
+		const double x = v[3 * i], y = v[3 * i + 1], z = v[3 * i + 2];
+		res[3 * i] = m00 * x + m01 * y + m02 * z;
+		res[3 * i + 1] = m10 * x + m11 * y + m12 * z;
+		res[3 * i + 2] = m20 * x + m21 * y + m22 * z;
+	}
+}
+
+inline
+void ThreeRotationMatrix::apply(unsigned long n, const ThreeVectorDouble* v, ThreeVectorDouble* res) const
+{
+	for(unsigned long i = 0; i < n; ++i)
+	{
+		const double x = v[i].x(), y = v[i].y(), z = v[i].z();
+		res[i].x() = matrix_[0][0] * x + matrix_[0][1] * y + matrix_[0][2] * z;
+		res[i].y() = matrix_[1][0] * x + matrix_[1][1] * y + matrix_[1][2] * z;
+		res[i].z() = matrix_[2][0] * x + matrix_[2][1] * y + matrix_[2][2] * z;
 	}
-	return *this;
 }
 	
 inline
 bool ThreeRotationMatrix::operator == (const ThreeRotationMatrix& other) const
 {
-	check(matrix_.size() == 3, "");
-	check(other.matrix_.size() == 3, "");
 	for(int i = 0; i < 3; ++i)
 	{
-		check(matrix_[i].size() == 3, "");
-		check(other.matrix_[i].size() == 3, "");
 		for(int j = 0; j < 3; ++j)
 		{
 			if(!areEqual(matrix_[i][j], other.matrix_[i][j], 1E-3))
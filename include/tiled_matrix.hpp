@@ -0,0 +1,95 @@
+#ifndef COSMO_PP_TILED_MATRIX_HPP
+#define COSMO_PP_TILED_MATRIX_HPP
+
+#include <string>
+
+#include <macros.hpp>
+#include <function.hpp>
+#include <matrix.hpp>
+
+namespace Math
+{
+
+/// An out-of-core symmetric matrix, stored in square tiles on disk.
+
+/// This is for matrices that do not fit into memory, like the pixel space covariance matrices of high resolution maps. The lower triangle of tiles (I >= J) is stored, each tile in its own file in the format of MappedMatrix, in a given directory. Only a few tiles per thread are kept in memory at any time.
+/// The tiles are generated in parallel (OpenMP) with generate, and the matrix can be Cholesky factorized tile by tile (needs LAPACK). The factorization replaces the tiles with the tiles of the lower triangular factor L, where A = L L^T.
+/// The tiles are Matrix objects of size tileSize x tileSize, except for the last row and column of tiles which can be smaller.
+class TiledMatrix
+{
+public:
+    /// The function used to generate the elements, evaluate(i, j) should return the (i, j) element (it is only called for i >= j). It is called from multiple threads at the same time.
+    typedef Function2<int, int, double> ElementGenerator;
+
+public:
+    /// Constructor. Tiles already in the directory (for example from a previous run with the same size and tile size) are used.
+    /// \param n The size of the matrix.
+    /// \param tileSize The size of the tiles. The memory needed is a few tiles per thread, the disk space is n^2 / 2 elements.
+    /// \param directory The directory for the tile files. It is created if it does not exist.
+    TiledMatrix(int n, int tileSize, const char* directory);
+
+    /// The size of the matrix.
+    int rows() const { return n_; }
+
+    /// The size of the matrix.
+    int cols() const { return n_; }
+
+    /// The size of the tiles.
+    int tileSize() const { return tileSize_; }
+
+    /// The number of tiles in each row and column.
+    int numberOfTiles() const { return nTiles_; }
+
+    /// The number of rows (or columns) in a given row (or column) of tiles.
+    /// \param i The index of the tile row.
+    int tileRows(int i) const { check(i >= 0 && i < nTiles_, "invalid tile index " << i); return (i == nTiles_ - 1 ? n_ - i * tileSize_ : tileSize_); }
+
+    /// Generate all of the tiles in parallel, each thread builds one tile in memory at a time and writes it into its file.
+    /// \param generator The function giving the elements.
+    void generate(const ElementGenerator& generator);
+
+    /// Read a tile.
+    /// \param i The tile row, must be at least j.
+    /// \param j The tile column.
+    /// \param tile The tile will be written here.
+    void readTile(int i, int j, Matrix<double>* tile) const;
+
+    /// Write a tile.
+    /// \param i The tile row, must be at least j.
+    /// \param j The tile column.
+    /// \param tile The tile, must have size tileRows(i) x tileRows(j).
+    void writeTile(int i, int j, const Matrix<double>& tile);
+
+    /// Copy into a SymmetricMatrix, for small matrices (or for testing).
+    /// \param res The matrix to copy into.
+    void copyTo(SymmetricMatrix<double>* res) const;
+
+#ifdef COSMO_LAPACK
+    /// Cholesky factorize in place, tile by tile. The tiles are replaced by the tiles of the lower triangular factor (the elements above the diagonal in the diagonal tiles are set to 0). The tile operations are done in parallel (OpenMP).
+    /// \return 0 if successful, otherwise the order of the leading minor that is not positive definite (as for dpotrf). In that case the tiles are left partially factorized.
+    int choleskyFactorize();
+#endif
+
+    /// Check if the matrix has been Cholesky factorized.
+    bool isFactorized() const { return factorized_; }
+
+    /// The logarithm of the determinant, from the Cholesky factorization. This function should be called after choleskyFactorize.
+    double logDetFromCholeskyFactorization() const;
+
+    /// The name of the file of a given tile.
+    /// \param i The tile row, must be at least j.
+    /// \param j The tile column.
+    std::string tileFileName(int i, int j) const;
+
+private:
+    int n_;
+    int tileSize_;
+    int nTiles_;
+    std::string directory_;
+    bool factorized_;
+};
+
+} // namespace Math
+
+#endif
+
@@ -27,9 +27,15 @@ public:
     /// \return B_l.
     static double beamFunction(int l, double fwhm);
     
+    /// Calculates the gaussian beam function for all l up to lMax at once. Only two exponentials are calculated, the rest is done with a recurrence.
+    /// \param lMax The maximum l value.
+    /// \param fwhm Full width at half maximum of the gaussian beam in degrees. 0 means no beam (all of the values are 1).
+    /// \return A vector with B_l, the index is l.
+    static std::vector<double> beamFunctions(int lMax, double fwhm);
+    
     /// Reads a pixel window function.
     
-    /// Reads a pixel window function from the Healpix data directory, also multiplies by a gaussian beam function.
+    /// Reads a pixel window function from the Healpix data directory, also multiplies by a gaussian beam function. Each file is read only once (see pixelWindowFunction).
     /// \param f The gaussian beam coefficiants vector to be returned, the index is l.
     /// \param nSide The NSide of the pixel window function.
     /// \param lMax Maximum l value to be read.
@@ -37,6 +43,19 @@ public:
     /// \param polarization Specifies if polarization pixel window function should be read instead of temperature (false by default).
     static void readPixelWindowFunction(std::vector<double>& f, long nSide, int lMax, double fwhm = 0, bool polarization = false);
 
+    /// Returns a pixel window function multiplied by a gaussian beam function.
+    
+    /// The pixel window function files are read only once for each nSide and polarization and kept in a process-wide cache for all lMax, so repeated calls (for example when the setup is repeated for many masks and beams) do not read the files again. Thread safe.
+    /// \param nSide The NSide of the pixel window function.
+    /// \param lMax Maximum l value.
+    /// \param fwhm The full width at half maximum of the gaussian beam in degrees. 0 means no beam.
+    /// \param polarization Specifies if polarization pixel window function should be returned instead of temperature (false by default).
+    /// \return A vector with the values, the index is l.
+    static std::vector<double> pixelWindowFunction(long nSide, int lMax, double fwhm = 0, bool polarization = false);
+    
+    /// Clears the cache of the pixel window functions, so that the files are read again.
+    static void clearPixelWindowCache();
+
     /// Reads the values of cl-s from a text file.
 
     /// Reads the values of cl-s from a text file. Each line should contain one value, starting from l = 0. The l values can proceed the cl values, in this case this should be indicated by the parameter hasL.
@@ -0,0 +1,179 @@
+#ifndef COSMO_PP_VECTOR_KERNELS_HPP
+#define COSMO_PP_VECTOR_KERNELS_HPP
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+namespace Math
+{
+
+/// Element-wise operations on arrays, used for the inner loops of Matrix and the L-BFGS vectors.
+
+/// The loops are written so that the compiler vectorizes them (OpenMP simd) with the widest instructions enabled by the compiler flags (for example -march=native for AVX2 or AVX-512), and they are split between the OpenMP threads for arrays of at least parallelSize elements.
+/// The arrays must not overlap, unless they are the same.
+namespace VectorKernels
+{
+
+/// The minimum number of elements for the operations to be split between the OpenMP threads. Smaller arrays are not worth the overhead of starting the threads.
+const long parallelSize = 32768;
+
+/// y = c x
+template<typename T>
+inline void copy(long n, T c, const T* x, T* y)
+{
+#pragma omp parallel for simd if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] = c * x[i];
+}
+
+/// y = y + c x
+template<typename T>
+inline void add(long n, T c, const T* x, T* y)
+{
+#pragma omp parallel for simd if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] += c * x[i];
+}
+
+/// y = y - x
+template<typename T>
+inline void subtract(long n, const T* x, T* y)
+{
+#pragma omp parallel for simd if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] -= x[i];
+}
+
+/// y = c y
+template<typename T>
+inline void scale(long n, T c, T* y)
+{
+#pragma omp parallel for simd if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] *= c;
+}
+
+/// y = y * x, element by element
+template<typename T>
+inline void multiply(long n, const T* x, T* y)
+{
+#pragma omp parallel for simd if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] *= x[i];
+}
+
+/// y = y / x, element by element
+template<typename T>
+inline void divide(long n, const T* x, T* y)
+{
+#pragma omp parallel for simd if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] /= x[i];
+}
+
+/// y = y^p, element by element
+template<typename T>
+inline void pow(long n, T p, T* y)
+{
+#pragma omp parallel for simd if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] = std::pow(y[i], p);
+}
+
+/// The dot product of x and y. Note that the order of the summation depends on the vectorization and the number of threads, so the last digits can differ between runs with different settings.
+template<typename T>
+inline T dotProduct(long n, const T* x, const T* y)
+{
+    T s = 0;
+#pragma omp parallel for simd reduction(+:s) if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+        s += x[i] * y[i];
+    return s;
+}
+
+/// The dot products of x with k arrays, res[j] = x . y[j], in one pass over x. The elements are processed in blocks, each block of x is used for all of the products while it is in the cache.
+template<typename T>
+inline void dotProducts(long n, int k, const T* x, const T* const* y, T* res)
+{
+    const long blockSize = 1024;
+    const long nBlocks = (n + blockSize - 1) / blockSize;
+    std::fill(res, res + k, T(0));
+
+#pragma omp parallel default(shared) if(n >= parallelSize)
+    {
+        std::vector<T> s(k, T(0));
+
+#pragma omp for schedule(static)
+        for(long b = 0; b < nBlocks; ++b)
+        {
+            const long begin = b * blockSize, end = std::min(n, begin + blockSize);
+            for(int j = 0; j < k; ++j)
+            {
+                const T* yj = y[j];
+                T sj = 0;
+#pragma omp simd reduction(+:sj)
+                for(long i = begin; i < end; ++i)
+                    sj += x[i] * yj[i];
+                s[j] += sj;
+            }
+        }
+
+#pragma omp critical
+        for(int j = 0; j < k; ++j)
+            res[j] += s[j];
+    }
+}
+
+/// The linear combination y = c[0] x[0] + ... + c[k-1] x[k-1], in one pass over y. The elements are processed in blocks, each block of y stays in the cache while all of the terms are added. y can be one of the x[j].
+template<typename T>
+inline void linearCombination(long n, int k, const T* c, const T* const* x, T* y)
+{
+    const long blockSize = 1024;
+    const long nBlocks = (n + blockSize - 1) / blockSize;
+
+#pragma omp parallel for default(shared) schedule(static) if(n >= parallelSize)
+    for(long b = 0; b < nBlocks; ++b)
+    {
+        const long begin = b * blockSize, end = std::min(n, begin + blockSize);
+        T buf[blockSize];
+        const T* x0 = x[0];
+        const T c0 = c[0];
+#pragma omp simd
+        for(long i = begin; i < end; ++i)
+            buf[i - begin] = c0 * x0[i];
+        for(int j = 1; j < k; ++j)
+        {
+            const T* xj = x[j];
+            const T cj = c[j];
+#pragma omp simd
+            for(long i = begin; i < end; ++i)
+                buf[i - begin] += cj * xj[i];
+        }
+#pragma omp simd
+        for(long i = begin; i < end; ++i)
+            y[i] = buf[i - begin];
+    }
+}
+
+/// y = y + c x, then returns the sum of w y^2 (element by element), in one pass. For example the momentum update of a leapfrog step together with the kinetic energy.
+template<typename T>
+inline T addAndWeightedSquare(long n, T c, const T* x, const T* w, T* y)
+{
+    T s = 0;
+#pragma omp parallel for simd reduction(+:s) if(n >= parallelSize)
+    for(long i = 0; i < n; ++i)
+    {
+        const T yi = y[i] + c * x[i];
+        y[i] = yi;
+        s += w[i] * yi * yi;
+    }
+    return s;
+}
+
+} // namespace VectorKernels
+
+} // namespace Math
+
+#endif
+
@@ -3,84 +3,165 @@
 
 #include <vector>
 
+#include <macros.hpp>
+#include <matrix.hpp>
+#include <memory_tracker.hpp>
+#include <mapped_file.hpp>
+
 /// Whole Matrix class.
 
 /// This class represents a matrix in l-m space, which includes the off-diagonal elements.
+/// The elements are stored in one flat array, the rows are the (l', m') pairs and the columns are the (l, m) pairs, both ordered by l and then m (see index).
+/// For nearly isotropic cases the matrix can be banded in l, then only the elements with |l - l'| not larger than a given deltaL are stored (deltaL = 0 is block diagonal in l), all of the other elements are 0.
 class WholeMatrix
 {
 public:
     /// Constructor.
-    
+
     /// Constructs a matrix with all elements equal to 0.
     /// \param lMin Minimum l in the matrix, must be non-negative.
     /// \param lMax Maximum l in the matrix, must be not less than lMin.
-    WholeMatrix(int lMin, int lMax);
-    
+    /// \param deltaL Only the elements with |l - l'| <= deltaL are stored, the rest are 0 and cannot be changed. A negative value stores all of the elements.
+    WholeMatrix(int lMin, int lMax, int deltaL = -1);
+
     /// Constructor.
-    
+
     /// Constructs a matrix by reading from a file.
     /// \param fileName The name of the file.
     /// \param textFile Tells if it is a text file (true) or binary file (false).
-    WholeMatrix(const char* fileName, bool textFile = false) { if(textFile) readFromTextFile(fileName); else readFromFile(fileName); }
-    
+    WholeMatrix(const char* fileName, bool textFile = false);
+
     /// Copy-constructor.
-    
+
     /// Constructs a whole matrix by identically copying another matrix.
     /// \param other The whole matrix to be copied.
-    WholeMatrix(const WholeMatrix& other) : lMin_(other.lMin_), lMax_(other.lMax_), data_(other.data_) {}
-    
+    WholeMatrix(const WholeMatrix& other);
+
+    /// Destructor.
+    ~WholeMatrix();
+
+    /// Assignment operator.
+    /// \param other The whole matrix to be copied.
+    /// \return A reference to self after the assignment.
+    WholeMatrix& operator=(const WholeMatrix& other);
+
     /// Allows reading of an element.
     /// \param l1 First index l.
     /// \param m1 First index m.
     /// \param l Second index l.
     /// \param m Second index m.
-    /// \return The value of the element.
-    double element(int l1, int m1, int l, int m) const;
-    
+    /// \return The value of the element, 0 if it is outside of the band.
+    double element(int l1, int m1, int l, int m) const
+    {
+        check(checkIndices(l1, m1), "invalid l1, m1, l1 = " << l1 << " m1 = " << m1);
+        check(checkIndices(l, m), "invalid l, m, l = " << l << " m = " << m);
+        const int i = index(l1, m1), k = index(l, m) - rowFirst_[i];
+        if(k < 0 || k >= rowWidth(i))
+            return 0;
+        return values_[rowStart_[i] + k];
+    }
+
     /// Allows reading and writing of an element.
     /// \param l1 First index l.
     /// \param m1 First index m.
     /// \param l Second index l.
-    /// \param m Second index m.
+    /// \param m Second index m. The element must be inside of the band.
     /// \return A reference to the element.
-    double& element(int l1, int m1, int l, int m);
-    
+    double& element(int l1, int m1, int l, int m)
+    {
+        check(checkIndices(l1, m1), "invalid l1, m1, l1 = " << l1 << " m1 = " << m1);
+        check(checkIndices(l, m), "invalid l, m, l = " << l << " m = " << m);
+        check(isStored(l1, l), "the element l1 = " << l1 << ", l = " << l << " is outside of the band");
+        const int i = index(l1, m1);
+        return values_[rowStart_[i] + index(l, m) - rowFirst_[i]];
+    }
+
+    /// The index of (l, m) among all of the (l, m) pairs of the matrix, ordered by l and then m.
+    /// \param l The index l.
+    /// \param m The index m.
+    /// \return The index, from 0 to size() - 1.
+    int index(int l, int m) const { return l * l + l + m - lMin_ * lMin_; }
+
+    /// The number of (l, m) pairs, i.e. the number of rows and columns.
+    int size() const { return n_; }
+
+    /// The band width in l.
+    /// \return deltaL, negative if all of the elements are stored.
+    int getDeltaL() const { return deltaL_; }
+
+    /// Checks if the elements for given l' and l are stored (i.e. are inside of the band).
+    bool isStored(int l1, int l) const { return deltaL_ < 0 || (l - l1 <= deltaL_ && l1 - l <= deltaL_); }
+
+    /// Copy into a full matrix, the row index is index(l', m') and the column index is index(l, m). The elements outside of the band are 0.
+    /// \param mat The matrix to copy into.
+    void copyTo(Math::Matrix<double>* mat) const;
+
+    /// Set from a full matrix, the row index is index(l', m') and the column index is index(l, m). The elements outside of the band are ignored.
+    /// \param mat The matrix to copy from, must have size() rows and columns.
+    void set(const Math::Matrix<double>& mat);
+
+    /// Checks if the matrix is diagonal in (l, m), i.e. all of the stored elements outside of the diagonal are exactly 0 (as for isotropic covariance matrices).
+    /// \return true if diagonal.
+    bool isDiagonal() const;
+
+    /// Sets all of the elements to 0.
+    void setToZero();
+
     /// Reads from a file in text format.
     /// \param fileName The name of the text file.
     void readFromTextFile(const char* fileName);
-    
+
     /// Writes the matrix into a text file.
     /// \param fileName The name of the text file.
     void writeIntoTextFile(const char* fileName) const;
-    
-    /// Reads from a binary file. This is faster than reading from a text file. Binary files are also smaller in size.
+
+    /// Reads from a binary file. Files written by writeIntoFile are memory-mapped (copy on write), so nothing is read until the elements are used. The old binary format (the two l values followed by all of the elements) is still read.
     /// \param fileName The name of the binary file.
     void readFromFile(const char* fileName);
-    
-    /// Writes into a binary file. This is faster than writing into a text file. Binary files are also smaller in size.
+
+    /// Writes into a binary file that can be memory-mapped. The format has the header of Math::MappedFile (a magic string, a version, a byte order tag and the element size, followed by lMin, lMax and deltaL) and then the stored elements in the same order as in memory.
     /// \param fileName The name of the binary file.
     void writeIntoFile(const char* fileName) const;
-    
+
     /// Reads the minimum l.
     /// \return The minimum l.
     int getLMin() const { return lMin_; }
-    
+
     /// Reads the maximum l.
     /// \return The maximum l.
     int getLMax() const { return lMax_; }
-    
+
+    /// The memory needed for a matrix (not memory-mapped), without allocating it.
+    /// \param lMin The minimum value of l.
+    /// \param lMax The maximum value of l.
+    /// \param deltaL The half-width of the band in l, negative for the full matrix (see the constructor).
+    /// \return The number of bytes.
+    static unsigned long memoryEstimate(int lMin, int lMax, int deltaL = -1);
+
 private:
-    void initialize();
+    // sets up the rows, and allocates the elements if allocate is true
+    void initialize(bool allocate = true);
+    void release();
+    void updateMemory();
     bool checkIndices(int l, int m) const;
-    
-private:
-    // first index is l', second index is l' + m', third index is l, fourth index is l + m
-    typedef std::vector<std::vector<std::vector<std::vector<double> > > > DataType;
-    
+    int rowWidth(int i) const { return int(rowStart_[i + 1] - rowStart_[i]); }
+
 private:
     int lMin_;
     int lMax_;
-    DataType data_;
+    int deltaL_;
+    int n_;
+
+    // the first stored column of each row and the start of each row in the storage
+    std::vector<int> rowFirst_;
+    std::vector<unsigned long> rowStart_;
+
+    // values_ points either into data_ or into the memory-mapped file
+    std::vector<double> data_;
+    double* values_;
+    Math::MappedFile file_;
+
+    MemoryTracker::Allocation memory_;
 };
 
 #endif
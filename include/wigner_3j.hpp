@@ -3,6 +3,7 @@
 
 #include <cmath>
 #include <set>
+#include <vector>
 #include <algorithm>
 
 #include <macros.hpp>
@@ -124,6 +125,44 @@ Wigner3JZeroM<Treats>::calculate(int LMaxHalf)
     }
 }
 
+/// All of the Wigner 3j symbols (l1 l2 l3; 0 0 0) for given l1 and l2.
+
+/// This calculates the symbols for all l3 with the recursion in l3, in O(l1 + l2) operations and without any other storage, so it can be used from multiple threads with a separate result vector for each thread (for example to calculate the mode coupling kernels in parallel over l1).
+/// \param l1 The first l, must be non-negative.
+/// \param l2 The second l, must be non-negative.
+/// \param l3Max Only the symbols with l3 up to l3Max are calculated. A negative value means all of them (up to l1 + l2).
+/// \param res The symbols are written here, the index is l3 - |l1 - l2|. The symbols with odd l1 + l2 + l3 are 0. Empty if l3Max < |l1 - l2|.
+inline void wigner3jZeroMRow(int l1, int l2, int l3Max, std::vector<double>* res)
+{
+    check(l1 >= 0, "invalid l1 = " << l1);
+    check(l2 >= 0, "invalid l2 = " << l2);
+
+    if(l1 < l2)
+        std::swap(l1, l2);
+
+    const int l3Min = l1 - l2;
+    if(l3Max < 0 || l3Max > l1 + l2)
+        l3Max = l1 + l2;
+
+    res->clear();
+    if(l3Max < l3Min)
+        return;
+    res->resize(l3Max - l3Min + 1, 0);
+
+    // the first symbol from the closed form, L = 2 l1
+    const double logFirst = 0.5 * (std::lgamma(2.0 * l2 + 1) + std::lgamma(2.0 * l3Min + 1) - std::lgamma(2.0 * l1 + 2)) + std::lgamma(l1 + 1.0) - std::lgamma(l3Min + 1.0) - std::lgamma(l2 + 1.0);
+    double current = (l1 % 2 ? -1.0 : 1.0) * std::exp(logFirst);
+    (*res)[0] = current;
+
+    // the ratio of the symbols for l3 + 2 and l3, with L = l1 + l2 + l3 and g = L / 2
+    for(int l3 = l3Min; l3 + 2 <= l3Max; l3 += 2)
+    {
+        const int L = l1 + l2 + l3, g = L / 2;
+        current *= -std::sqrt(double(L - 2 * l1 + 1) * (L - 2 * l2 + 1) * (g + 1) * (g - l3) / (double(L - 2 * l3 - 1) * (L + 3) * (g - l1 + 1) * (g - l2 + 1)));
+        (*res)[l3 + 2 - l3Min] = current;
+    }
+}
+
 struct IntegerTriplet
 {
     int l1, l2, l3;
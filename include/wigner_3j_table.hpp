@@ -0,0 +1,85 @@
+#ifndef COSMO_PP_WIGNER_3J_TABLE_HPP
+#define COSMO_PP_WIGNER_3J_TABLE_HPP
+
+#include <vector>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <mapped_file.hpp>
+
+namespace Math
+{
+
+/// A table of all of the Wigner 3j symbols (l1 l2 l3; 0 0 0) up to a maximum l.
+
+/// These symbols do not change under the permutations of the l-s and are 0 unless l1 + l2 + l3 is even and the triangle condition holds, so only the symbols with l1 <= l2 <= l3 <= l1 + l2 and even l1 + l2 + l3 are stored, in one flat array. For each pair l1 <= l2 the stored l3-s are contiguous, so a lookup is a sort of the three l-s and a few index operations.
+/// The table is calculated in parallel (OpenMP) with wigner3jZeroMRow. It can be saved into a binary file and then memory-mapped, in which case the processes on the same node mapping the same file share one copy of it. The same table can be used for the mode coupling kernels, the polarization couplings, bispectra, etc.
+class Wigner3jZeroMTable
+{
+public:
+    /// Constructor. Calculates the table.
+    /// \param lMax The maximum l, all three l-s can go up to this value.
+    Wigner3jZeroMTable(int lMax);
+
+    /// Constructor. Memory-maps a table from a file written by writeIntoFile. Throws an exception if the file cannot be opened or is not a valid table file.
+    /// \param fileName The name of the file.
+    Wigner3jZeroMTable(const char* fileName);
+
+    /// Write the table into a binary file that can be memory-mapped. The format has the header of MappedFile (a magic string, a version, a byte order tag and the element size, followed by lMax) and then the stored symbols.
+    /// \param fileName The name of the file.
+    void writeIntoFile(const char* fileName) const;
+
+    /// The maximum l.
+    int getLMax() const { return lMax_; }
+
+    /// The number of stored symbols.
+    unsigned long size() const { return offsets_.back(); }
+
+    /// Get a symbol, the l-s can be in any order.
+    /// \param l1 The first l.
+    /// \param l2 The second l.
+    /// \param l3 The third l.
+    /// \return The symbol (l1 l2 l3; 0 0 0), 0 if it vanishes.
+    double operator()(int l1, int l2, int l3) const
+    {
+        check(l1 >= 0 && l1 <= lMax_, "invalid l1 = " << l1);
+        check(l2 >= 0 && l2 <= lMax_, "invalid l2 = " << l2);
+        check(l3 >= 0 && l3 <= lMax_, "invalid l3 = " << l3);
+
+        // sort so that l1 <= l2 <= l3
+        if(l1 > l2)
+            std::swap(l1, l2);
+        if(l2 > l3)
+            std::swap(l2, l3);
+        if(l1 > l2)
+            std::swap(l1, l2);
+
+        if(l3 > l1 + l2 || (l1 + l2 + l3) % 2)
+            return 0;
+
+        return values_[offsets_[pairIndex(l1, l2)] + (l3 - l2 - l1 % 2) / 2];
+    }
+
+private:
+    Wigner3jZeroMTable(const Wigner3jZeroMTable&);
+    Wigner3jZeroMTable& operator=(const Wigner3jZeroMTable&);
+
+    // the pairs l1 <= l2 are ordered by l1 and then l2
+    unsigned long pairIndex(int l1, int l2) const { return (unsigned long)(l1) * (2 * lMax_ + 3 - l1) / 2 + (l2 - l1); }
+    void initialize();
+
+private:
+    int lMax_;
+
+    // the start of the stored l3-s of each pair (l1, l2), these start from l2 or l2 + 1 (whichever makes the sum even) and go in steps of 2
+    std::vector<unsigned long> offsets_;
+
+    std::vector<double> data_;
+    const double* values_;
+    MappedFile file_;
+};
+
+} // namespace Math
+
+#endif
+
@@ -21,7 +21,8 @@ public:
     /// \param useHighlP Specifies if high l polarization likelihood should be included.
     /// \param useGibbs Specifies if the Gibbs likelihood should be used for low l temperature calculation (relevant only if it's included).
     /// \param useTTBeam Specifies if the beam and point source likelihood correction should be calculated for temperature.
-    WMAP9Likelihood(bool useLowlT = true, bool useHighlT = true, bool useLowlP = true, bool useHighlP = true, bool useGibbs = true, bool useTTBeam = true);
+    /// \param useOwnCmb If set to true then an instance of the CMB class will be created, and the Cl values are calculated from setCosmoParams and calculateCls. If useOwnCmb is false then the Cl values must be passed through setCls (for example when the Cl-s are shared with other likelihoods, see JointCMBLikelihood).
+    WMAP9Likelihood(bool useLowlT = true, bool useHighlT = true, bool useLowlP = true, bool useHighlP = true, bool useGibbs = true, bool useTTBeam = true, bool useOwnCmb = true);
 
     /// Destructor.
     ~WMAP9Likelihood();
@@ -33,6 +34,19 @@ public:
     /// Calculate the Cl values. Should be called after setCosmoParams but before any likelihood calculation.
     void calculateCls();
 
+    /// Set the Cl values, instead of setCosmoParams and calculateCls.
+    /// \param tt The Cl_TT values (not multiplied by l(l+1)/2pi, as returned by CMB).
+    /// \param ee The Cl_EE values. Can be NULL if polarization is not used.
+    /// \param te The Cl_TE values. Can be NULL if polarization is not used.
+    /// \param bb The Cl_BB values. Can be NULL if polarization is not used.
+    void setCls(const std::vector<double>* tt, const std::vector<double>* ee = NULL, const std::vector<double>* te = NULL, const std::vector<double>* bb = NULL);
+
+    /// Get the maximum l needed by the likelihood.
+    int getLMax() const { return lMax_; }
+
+    /// Checks if the polarization Cl-s are needed.
+    bool wantsPolarization() const { return useLowlP_ || useHighlP_; }
+
     /// Calculate all of the likelihoods included in the constructor. Must be called after calculateCls.
     /// \return -2ln(likelihood).
     double likelihood();
@@ -100,7 +114,8 @@ public:
     inline double TTBeamLike() const { check(useTTBeam_, "TT beam likelihood not initialized in constructor"); return ttBeam_; }
 
 private:
-    CMB cmb_;
+    CMB* cmb_;
+    int lMax_;
     std::vector<double> clTT_, clEE_, clTE_, clTB_, clEB_, clBB_;
     std::vector<double> like_;
     bool useLowlT_, useHighlT_, useLowlP_, useHighlP_, useGibbs_, useTTBeam_;
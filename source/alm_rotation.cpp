@@ -0,0 +1,146 @@
+#include <cmath>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <alm_rotation.hpp>
+
+namespace Math
+{
+
+AlmRotation::AlmRotation(const ThreeRotationMatrix& rot, int lMax) : lMax_(lMax)
+{
+    check(lMax >= 0, "invalid lMax = " << lMax);
+
+    // rot = R_z(alpha) R_y(beta) R_z(gamma)
+    const double sinBeta = std::sqrt(rot[0][2] * rot[0][2] + rot[1][2] * rot[1][2]);
+    beta_ = std::atan2(sinBeta, rot[2][2]);
+    if(sinBeta > 1e-12)
+    {
+        alpha_ = std::atan2(rot[1][2], rot[0][2]);
+        gamma_ = std::atan2(rot[2][1], -rot[2][0]);
+    }
+    else
+    {
+        // only alpha + gamma (or alpha - gamma) matters
+        gamma_ = 0;
+        alpha_ = (rot[2][2] > 0 ? std::atan2(rot[1][0], rot[0][0]) : std::atan2(-rot[1][0], -rot[0][0]));
+    }
+
+    offsets_.resize(lMax_ + 2);
+    offsets_[0] = 0;
+    for(int l = 0; l <= lMax_; ++l)
+        offsets_[l + 1] = offsets_[l] + (unsigned long)(l + 1) * (2 * l + 1);
+    d_.resize(offsets_.back());
+
+    const double c = std::cos(beta_), s = std::sin(beta_);
+
+    // d^1_{mm'} for m, m' = 1, 0, -1
+    const double d1[3][3] = {{(1 + c) / 2, -s / std::sqrt(2.0), (1 - c) / 2}, {s / std::sqrt(2.0), c, -s / std::sqrt(2.0)}, {(1 - c) / 2, s / std::sqrt(2.0), (1 + c) / 2}};
+
+    d_[0] = 1;
+
+    // D^l is the top component of D^(l-1) x D^1, d^l_{mm'} = sum C(l-1, m - mu; 1, mu | l, m) C(l-1, m' - mu'; 1, mu' | l, m') d^(l-1)_{m-mu, m'-mu'} d^1_{mu, mu'}
+    std::vector<double> cg1(3), cg2(3);
+    for(int l = 1; l <= lMax_; ++l)
+    {
+        const double norm1 = double(2 * l - 1) * (2 * l), norm0 = double(2 * l - 1) * l;
+        for(int m = 0; m <= l; ++m)
+        {
+            cg1[0] = std::sqrt(std::max(0.0, double(l - 1 - m) * (l - m) / norm1));
+            cg1[1] = std::sqrt(std::max(0.0, double(l - m) * (l + m) / norm0));
+            cg1[2] = std::sqrt(std::max(0.0, double(l - 1 + m) * (l + m) / norm1));
+
+            for(int m1 = -l; m1 <= l; ++m1)
+            {
+                cg2[0] = std::sqrt(std::max(0.0, double(l - 1 - m1) * (l - m1) / norm1));
+                cg2[1] = std::sqrt(std::max(0.0, double(l - m1) * (l + m1) / norm0));
+                cg2[2] = std::sqrt(std::max(0.0, double(l - 1 + m1) * (l + m1) / norm1));
+
+                double sum = 0;
+                for(int mu = -1; mu <= 1; ++mu)
+                {
+                    const int mPrev = m - mu;
+                    if(cg1[mu + 1] == 0 || mPrev < -(l - 1) || mPrev > l - 1)
+                        continue;
+                    for(int mu1 = -1; mu1 <= 1; ++mu1)
+                    {
+                        const int m1Prev = m1 - mu1;
+                        if(cg2[mu1 + 1] == 0 || m1Prev < -(l - 1) || m1Prev > l - 1)
+                            continue;
+                        sum += cg1[mu + 1] * cg2[mu1 + 1] * d(l - 1, mPrev, m1Prev) * d1[1 - mu][1 - mu1];
+                    }
+                }
+                d_[offset(l) + (unsigned long)(m) * (2 * l + 1) + (l + m1)] = sum;
+            }
+        }
+    }
+}
+
+void
+AlmRotation::rotate(int l, unsigned long n, ComplexDouble* alm) const
+{
+    check(l >= 0 && l <= lMax_, "invalid l = " << l);
+
+    std::vector<ComplexDouble> expAlpha(l + 1), expGamma(l + 1);
+    for(int m = 0; m <= l; ++m)
+    {
+        expAlpha[m] = ComplexDouble(std::cos(m * alpha_), -std::sin(m * alpha_));
+        expGamma[m] = ComplexDouble(std::cos(m * gamma_), -std::sin(m * gamma_));
+    }
+
+    // h_m' = exp(-i m' gamma) a_m', and h_-m' = (-1)^m' conj(h_m') for real fields
+    std::vector<ComplexDouble> h(l + 1), res(l + 1);
+    const unsigned long width = 2 * l + 1;
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        ComplexDouble* a = alm + i * (l + 1);
+        for(int m1 = 0; m1 <= l; ++m1)
+            h[m1] = expGamma[m1] * a[m1];
+
+        for(int m = 0; m <= l; ++m)
+        {
+            const double* row = &(d_[offset(l) + (unsigned long)(m) * width + l]);
+            ComplexDouble sum = row[0] * h[0];
+            for(int m1 = 1; m1 <= l; ++m1)
+            {
+                const ComplexDouble hMinus = (m1 % 2 ? -1.0 : 1.0) * std::conj(h[m1]);
+                sum += row[m1] * h[m1] + row[-m1] * hMinus;
+            }
+            res[m] = expAlpha[m] * sum;
+        }
+
+        std::copy(res.begin(), res.end(), a);
+    }
+}
+
+void
+AlmRotation::rotate(unsigned long n, ComplexDouble* const* alm) const
+{
+#pragma omp parallel default(shared)
+    {
+        std::vector<ComplexDouble> buffer;
+
+#pragma omp for schedule(dynamic)
+        for(int l = lMax_; l >= 0; --l)
+        {
+            buffer.resize(n * (l + 1));
+
+            // the Healpix index of (l, m) is m (2 lMax + 1 - m) / 2 + l
+            for(unsigned long i = 0; i < n; ++i)
+            {
+                for(int m = 0; m <= l; ++m)
+                    buffer[i * (l + 1) + m] = alm[i][(unsigned long)(m) * (2 * lMax_ + 1 - m) / 2 + l];
+            }
+
+            rotate(l, n, &(buffer[0]));
+
+            for(unsigned long i = 0; i < n; ++i)
+            {
+                for(int m = 0; m <= l; ++m)
+                    alm[i][(unsigned long)(m) * (2 * lMax_ + 1 - m) / 2 + l] = buffer[i * (l + 1) + m];
+            }
+        }
+    }
+}
+
+} // namespace Math
@@ -0,0 +1,189 @@
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <numerics.hpp>
+#include <alm_utils.hpp>
+
+namespace
+{
+
+// the l range is split into blocks, each done by one thread
+// within a block the loops go over the contiguous m columns, and for each l the sum over m is done in the order m = 0..l, so the results do not depend on the number of threads
+const int blockSize = 32;
+
+// below this the threads are not worth starting
+const int minParallelLMax = 128;
+
+int numberOfBlocks(int lMax)
+{
+    return lMax / blockSize + 1;
+}
+
+void blockRange(int block, int lMax, int* lBegin, int* lEnd)
+{
+    *lBegin = block * blockSize;
+    *lEnd = std::min(lMax + 1, *lBegin + blockSize);
+}
+
+// sigma_l, or the cross sigma_l if b is not NULL
+void sigmaLImpl(const Alm<xcomplex<double> >& a, const Alm<xcomplex<double> >* b, std::vector<double>* res)
+{
+    check(res, "");
+    const int lMax = a.Lmax();
+    const int mMax = a.Mmax();
+    check(lMax >= 0, "");
+    if(b)
+        check(b->Lmax() == lMax && b->Mmax() == mMax, "the alm must have the same lMax and mMax");
+
+    res->resize(lMax + 1);
+    double* r = &((*res)[0]);
+    const int nBlocks = numberOfBlocks(lMax);
+
+#pragma omp parallel for default(shared) schedule(dynamic) if(lMax >= minParallelLMax)
+    for(int block = 0; block < nBlocks; ++block)
+    {
+        int lBegin, lEnd;
+        blockRange(block, lMax, &lBegin, &lEnd);
+        for(int l = lBegin; l < lEnd; ++l)
+            r[l] = 0;
+
+        const int mEnd = std::min(lEnd - 1, mMax);
+        for(int m = 0; m <= mEnd; ++m)
+        {
+            const double factor = (m == 0 ? 1.0 : 2.0);
+            const int lStart = std::max(m, lBegin);
+            const xcomplex<double>* x = &(a(m, m)) - m;
+            if(b)
+            {
+                const xcomplex<double>* y = &((*b)(m, m)) - m;
+                for(int l = lStart; l < lEnd; ++l)
+                    r[l] += factor * (x[l].real() * y[l].real() + x[l].imag() * y[l].imag());
+            }
+            else
+            {
+                for(int l = lStart; l < lEnd; ++l)
+                    r[l] += factor * (x[l].real() * x[l].real() + x[l].imag() * x[l].imag());
+            }
+        }
+    }
+}
+
+void divideByModes(std::vector<double>* cl)
+{
+    for(int l = 0; l < cl->size(); ++l)
+        (*cl)[l] /= (2 * l + 1);
+}
+
+} // namespace
+
+void
+AlmUtils::sigmaL(const Alm<xcomplex<double> >& alm, std::vector<double>* sigmaL)
+{
+    sigmaLImpl(alm, NULL, sigmaL);
+}
+
+void
+AlmUtils::powerSpectrum(const Alm<xcomplex<double> >& alm, std::vector<double>* cl)
+{
+    sigmaLImpl(alm, NULL, cl);
+    divideByModes(cl);
+}
+
+void
+AlmUtils::crossSpectrum(const Alm<xcomplex<double> >& a, const Alm<xcomplex<double> >& b, std::vector<double>* cl)
+{
+    sigmaLImpl(a, &b, cl);
+    divideByModes(cl);
+}
+
+void
+AlmUtils::almToVector(const Alm<xcomplex<double> >& alm, std::vector<double>* v)
+{
+    check(v, "");
+    const int lMax = alm.Lmax();
+    check(alm.Mmax() == lMax, "mMax must be equal to lMax");
+
+    const xcomplex<double>* x0 = &(alm(0, 0));
+    for(int l = 0; l <= lMax; ++l)
+        check(Math::areEqual(x0[l].imag(), 0.0, 1e-10), "a_" << l << "0 must be real");
+
+    v->resize((lMax + 1) * (lMax + 1));
+    double* res = &((*v)[0]);
+    const int nBlocks = numberOfBlocks(lMax);
+
+#pragma omp parallel for default(shared) schedule(dynamic) if(lMax >= minParallelLMax)
+    for(int block = 0; block < nBlocks; ++block)
+    {
+        int lBegin, lEnd;
+        blockRange(block, lMax, &lBegin, &lEnd);
+        for(int l = lBegin; l < lEnd; ++l)
+            res[l * l] = x0[l].real();
+
+        for(int m = 1; m < lEnd; ++m)
+        {
+            const xcomplex<double>* x = &(alm(m, m)) - m;
+            for(int l = std::max(m, lBegin); l < lEnd; ++l)
+            {
+                res[l * l + 2 * m - 1] = x[l].real();
+                res[l * l + 2 * m] = x[l].imag();
+            }
+        }
+    }
+}
+
+void
+AlmUtils::vectorToAlm(const std::vector<double>& v, Alm<xcomplex<double> >* alm)
+{
+    check(alm, "");
+    const int lMax = alm->Lmax();
+    check(alm->Mmax() == lMax, "mMax must be equal to lMax");
+    check(v.size() == (lMax + 1) * (lMax + 1), "the vector has size " << v.size() << ", should be " << (lMax + 1) * (lMax + 1));
+
+    const double* x = &(v[0]);
+    const int nBlocks = numberOfBlocks(lMax);
+
+#pragma omp parallel for default(shared) schedule(dynamic) if(lMax >= minParallelLMax)
+    for(int block = 0; block < nBlocks; ++block)
+    {
+        int lBegin, lEnd;
+        blockRange(block, lMax, &lBegin, &lEnd);
+        xcomplex<double>* a0 = &((*alm)(0, 0));
+        for(int l = lBegin; l < lEnd; ++l)
+            a0[l] = xcomplex<double>(x[l * l], 0.0);
+
+        for(int m = 1; m < lEnd; ++m)
+        {
+            xcomplex<double>* a = &((*alm)(m, m)) - m;
+            for(int l = std::max(m, lBegin); l < lEnd; ++l)
+                a[l] = xcomplex<double>(x[l * l + 2 * m - 1], x[l * l + 2 * m]);
+        }
+    }
+}
+
+void
+AlmUtils::scale(Alm<xcomplex<double> >* alm, const std::vector<double>& factor)
+{
+    check(alm, "");
+    const int lMax = alm->Lmax();
+    const int mMax = alm->Mmax();
+    check(factor.size() >= lMax + 1, "need " << lMax + 1 << " factors, got " << factor.size());
+
+    const double* f = &(factor[0]);
+    const int nBlocks = numberOfBlocks(lMax);
+
+#pragma omp parallel for default(shared) schedule(dynamic) if(lMax >= minParallelLMax)
+    for(int block = 0; block < nBlocks; ++block)
+    {
+        int lBegin, lEnd;
+        blockRange(block, lMax, &lBegin, &lEnd);
+        const int mEnd = std::min(lEnd - 1, mMax);
+        for(int m = 0; m <= mEnd; ++m)
+        {
+            xcomplex<double>* a = &((*alm)(m, m)) - m;
+            for(int l = std::max(m, lBegin); l < lEnd; ++l)
+                a[l] *= f[l];
+        }
+    }
+}
+
@@ -0,0 +1,117 @@
+#include <cmath>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <vector_kernels.hpp>
+#include <matrix_impl.hpp>
+#include <banded_matrix.hpp>
+
+namespace Math
+{
+
+void
+BandedMatrix::set(const Matrix<double>& mat, double threshold)
+{
+    check(threshold >= 0, "invalid threshold " << threshold);
+
+    rows_ = mat.rows();
+    cols_ = mat.cols();
+    first_.resize(rows_);
+    start_.resize(rows_ + 1);
+    v_.clear();
+
+    start_[0] = 0;
+    for(int i = 0; i < rows_; ++i)
+    {
+        double maxAbs = 0;
+        for(int j = 0; j < cols_; ++j)
+            maxAbs = std::max(maxAbs, std::abs(mat(i, j)));
+
+        const double cut = threshold * maxAbs;
+        int first = 0, last = cols_ - 1;
+        while(first <= last && std::abs(mat(i, first)) <= cut)
+            ++first;
+        while(last >= first && std::abs(mat(i, last)) <= cut)
+            --last;
+
+        // an empty row
+        if(first > last)
+            first = last + 1;
+
+        first_[i] = first;
+        for(int j = first; j <= last; ++j)
+            v_.push_back(mat(i, j));
+        start_[i + 1] = v_.size();
+    }
+}
+
+double
+BandedMatrix::operator()(int i, int j) const
+{
+    check(i >= 0 && i < rows_, "invalid index " << i);
+    check(j >= 0 && j < cols_, "invalid index " << j);
+
+    const int k = j - first_[i];
+    if(k < 0 || k >= width(i))
+        return 0;
+    return v_[start_[i] + k];
+}
+
+void
+BandedMatrix::multiply(const double* x, double* y) const
+{
+#pragma omp parallel for default(shared) schedule(dynamic, 64) if(v_.size() >= VectorKernels::parallelSize)
+    for(int i = 0; i < rows_; ++i)
+    {
+        const long n = long(start_[i + 1] - start_[i]);
+        y[i] = (n > 0 ? VectorKernels::dotProduct(n, &(v_[start_[i]]), x + first_[i]) : 0);
+    }
+}
+
+void
+BandedMatrix::multiplyTransposed(const double* x, double* y) const
+{
+    // the rows are scattered into y, so this is done on one thread
+    for(int j = 0; j < cols_; ++j)
+        y[j] = 0;
+
+    for(int i = 0; i < rows_; ++i)
+    {
+        const long n = long(start_[i + 1] - start_[i]);
+        if(n == 0 || x[i] == 0)
+            continue;
+        const double* row = &(v_[start_[i]]);
+        double* yRow = y + first_[i];
+        for(long k = 0; k < n; ++k)
+            yRow[k] += x[i] * row[k];
+    }
+}
+
+double
+BandedMatrix::bilinearForm(const double* x, const double* y) const
+{
+    double res = 0;
+#pragma omp parallel for default(shared) schedule(dynamic, 64) reduction(+:res) if(v_.size() >= VectorKernels::parallelSize)
+    for(int i = 0; i < rows_; ++i)
+    {
+        const long n = long(start_[i + 1] - start_[i]);
+        if(n > 0 && x[i] != 0)
+            res += x[i] * VectorKernels::dotProduct(n, &(v_[start_[i]]), y + first_[i]);
+    }
+    return res;
+}
+
+void
+BandedMatrix::copyTo(Matrix<double>* res) const
+{
+    res->resize(rows_, cols_, 0);
+    for(int i = 0; i < rows_; ++i)
+    {
+        const int n = width(i);
+        for(int k = 0; k < n; ++k)
+            (*res)(i, first_[i] + k) = v_[start_[i] + k];
+    }
+}
+
+} // namespace Math
+
@@ -0,0 +1,355 @@
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+
+#ifdef COSMO_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef COSMO_ZSTD
+#include <zstd.h>
+#endif
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <block_compression.hpp>
+
+namespace
+{
+
+// codec, record length, number of records, records in a block, number of blocks
+const unsigned long recordsHeaderSize = 2 * sizeof(int) + 3 * sizeof(long);
+
+unsigned long
+aligned(unsigned long size)
+{
+    return (size + 7) / 8 * 8;
+}
+
+long
+readLong(const char* p)
+{
+    long x;
+    std::memcpy(&x, p, sizeof(long));
+    return x;
+}
+
+void
+throwError(const std::string& message)
+{
+    StandardException exc;
+    exc.set(message);
+    throw exc;
+}
+
+} // namespace
+
+bool
+BlockCompression::isAvailable(Codec codec)
+{
+    switch(codec)
+    {
+    case NONE:
+        return true;
+    case ZLIB:
+#ifdef COSMO_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case ZSTD:
+#ifdef COSMO_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char*
+BlockCompression::codecName(Codec codec)
+{
+    check(codec >= 0 && codec < CODEC_MAX, "invalid codec " << codec);
+    static const char* names[CODEC_MAX] = {"none", "zlib", "zstd"};
+    return names[codec];
+}
+
+BlockCompression::Codec
+BlockCompression::defaultCodec()
+{
+    if(isAvailable(ZSTD))
+        return ZSTD;
+    if(isAvailable(ZLIB))
+        return ZLIB;
+    return NONE;
+}
+
+void
+BlockCompression::shuffle(const void* in, unsigned long nValues, int valueSize, void* out)
+{
+    check(in != out, "cannot shuffle in place");
+    const char* src = (const char*) in;
+    char* dst = (char*) out;
+    for(unsigned long i = 0; i < nValues; ++i)
+        for(int k = 0; k < valueSize; ++k)
+            dst[k * nValues + i] = src[i * valueSize + k];
+}
+
+void
+BlockCompression::unshuffle(const void* in, unsigned long nValues, int valueSize, void* out)
+{
+    check(in != out, "cannot unshuffle in place");
+    const char* src = (const char*) in;
+    char* dst = (char*) out;
+    for(int k = 0; k < valueSize; ++k)
+        for(unsigned long i = 0; i < nValues; ++i)
+            dst[i * valueSize + k] = src[k * nValues + i];
+}
+
+void
+BlockCompression::compress(Codec codec, const double* values, unsigned long n, std::vector<char>& out)
+{
+    if(!isAvailable(codec))
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The compression codec " << (codec >= 0 && codec < CODEC_MAX ? codecName(codec) : "unknown") << " is not available.";
+        throwError(exceptionStr.str());
+    }
+
+    const unsigned long size = n * sizeof(double);
+    std::vector<char> shuffled(size);
+    if(n)
+        shuffle(values, n, sizeof(double), &(shuffled[0]));
+
+    if(codec == NONE)
+    {
+        out.swap(shuffled);
+        return;
+    }
+
+#ifdef COSMO_ZLIB
+    if(codec == ZLIB)
+    {
+        uLongf outSize = compressBound(size);
+        out.resize(outSize);
+        if(compress2((Bytef*)(&(out[0])), &outSize, (const Bytef*)(size ? &(shuffled[0]) : NULL), size, Z_DEFAULT_COMPRESSION) != Z_OK)
+            throwError("zlib compression failed.");
+        out.resize(outSize);
+        return;
+    }
+#endif
+
+#ifdef COSMO_ZSTD
+    if(codec == ZSTD)
+    {
+        out.resize(ZSTD_compressBound(size));
+        const size_t outSize = ZSTD_compress(&(out[0]), out.size(), (size ? &(shuffled[0]) : NULL), size, 3);
+        if(ZSTD_isError(outSize))
+            throwError(std::string("zstd compression failed: ") + ZSTD_getErrorName(outSize));
+        out.resize(outSize);
+        return;
+    }
+#endif
+
+    check(false, "");
+}
+
+void
+BlockCompression::decompress(Codec codec, const char* data, unsigned long size, double* values, unsigned long n)
+{
+    if(!isAvailable(codec))
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The data is compressed with the codec " << (codec >= 0 && codec < CODEC_MAX ? codecName(codec) : "unknown") << " which is not available.";
+        throwError(exceptionStr.str());
+    }
+
+    const unsigned long valuesSize = n * sizeof(double);
+    if(valuesSize == 0)
+        return;
+
+    std::vector<char> shuffled;
+    const char* src = data;
+    if(codec == NONE)
+    {
+        if(size != valuesSize)
+            throwError("Corrupted data, invalid size.");
+    }
+
+#ifdef COSMO_ZLIB
+    if(codec == ZLIB)
+    {
+        shuffled.resize(valuesSize);
+        uLongf outSize = valuesSize;
+        if(uncompress((Bytef*)(&(shuffled[0])), &outSize, (const Bytef*)data, size) != Z_OK || outSize != valuesSize)
+            throwError("Corrupted data, zlib decompression failed.");
+        src = &(shuffled[0]);
+    }
+#endif
+
+#ifdef COSMO_ZSTD
+    if(codec == ZSTD)
+    {
+        shuffled.resize(valuesSize);
+        const size_t outSize = ZSTD_decompress(&(shuffled[0]), valuesSize, data, size);
+        if(ZSTD_isError(outSize) || outSize != valuesSize)
+            throwError("Corrupted data, zstd decompression failed.");
+        src = &(shuffled[0]);
+    }
+#endif
+
+    unshuffle(src, n, sizeof(double), values);
+}
+
+void
+BlockCompression::compressRecords(Codec codec, const double* records, unsigned long nRecords, int recordLength, unsigned long blockRecords, std::vector<char>& out)
+{
+    check(recordLength > 0, "invalid record length " << recordLength);
+    check(blockRecords > 0, "");
+
+    if(!isAvailable(codec))
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The compression codec " << (codec >= 0 && codec < CODEC_MAX ? codecName(codec) : "unknown") << " is not available.";
+        throwError(exceptionStr.str());
+    }
+
+    const long nBlocks = (nRecords + blockRecords - 1) / blockRecords;
+    std::vector<std::vector<char> > blocks(nBlocks);
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(long b = 0; b < nBlocks; ++b)
+    {
+        const unsigned long begin = b * blockRecords;
+        const unsigned long n = std::min(blockRecords, nRecords - begin);
+        compress(codec, records + begin * recordLength, n * recordLength, blocks[b]);
+    }
+
+    const unsigned long indexOffset = recordsHeaderSize;
+    unsigned long offset = indexOffset + 2 * nBlocks * sizeof(long);
+    std::vector<long> index(2 * nBlocks);
+    for(long b = 0; b < nBlocks; ++b)
+    {
+        index[2 * b] = offset;
+        index[2 * b + 1] = blocks[b].size();
+        offset += aligned(blocks[b].size());
+    }
+
+    out.clear();
+    out.resize(offset, 0);
+
+    const int c = codec;
+    const long n = nRecords, br = blockRecords;
+    char* p = &(out[0]);
+    std::memcpy(p, &c, sizeof(int));
+    std::memcpy(p + sizeof(int), &recordLength, sizeof(int));
+    std::memcpy(p + 2 * sizeof(int), &n, sizeof(long));
+    std::memcpy(p + 2 * sizeof(int) + sizeof(long), &br, sizeof(long));
+    std::memcpy(p + 2 * sizeof(int) + 2 * sizeof(long), &nBlocks, sizeof(long));
+    if(nBlocks)
+        std::memcpy(p + indexOffset, &(index[0]), index.size() * sizeof(long));
+
+    for(long b = 0; b < nBlocks; ++b)
+    {
+        if(!blocks[b].empty())
+            std::memcpy(p + index[2 * b], &(blocks[b][0]), blocks[b].size());
+    }
+}
+
+CompressedRecords::CompressedRecords(const char* data, unsigned long size, const char* name) : data_(data), index_(NULL), name_(name), codec_(BlockCompression::NONE), recordLength_(0), nRecords_(0), blockRecords_(0), nBlocks_(0), compressedSize_(0)
+{
+    std::stringstream exceptionStr;
+    exceptionStr << "Invalid compressed records in " << name_ << ". ";
+
+    if(size < recordsHeaderSize)
+    {
+        exceptionStr << "The size " << size << " is too small for the header.";
+        throwError(exceptionStr.str());
+    }
+
+    int c;
+    std::memcpy(&c, data_, sizeof(int));
+    std::memcpy(&recordLength_, data_ + sizeof(int), sizeof(int));
+    const long n = readLong(data_ + 2 * sizeof(int));
+    const long br = readLong(data_ + 2 * sizeof(int) + sizeof(long));
+    const long nb = readLong(data_ + 2 * sizeof(int) + 2 * sizeof(long));
+
+    if(c < 0 || c >= BlockCompression::CODEC_MAX || recordLength_ <= 0 || n < 0 || br <= 0 || nb != (n + br - 1) / br)
+    {
+        exceptionStr << "Codec " << c << ", record length " << recordLength_ << ", " << n << " records, " << br << " records in a block, " << nb << " blocks.";
+        throwError(exceptionStr.str());
+    }
+
+    codec_ = BlockCompression::Codec(c);
+    nRecords_ = n;
+    blockRecords_ = br;
+    nBlocks_ = nb;
+
+    compressedSize_ = recordsHeaderSize + 2 * nBlocks_ * sizeof(long);
+    if(compressedSize_ > size)
+    {
+        exceptionStr << "The index of " << nBlocks_ << " blocks does not fit in " << size << " bytes.";
+        throwError(exceptionStr.str());
+    }
+    index_ = (const long*)(data_ + recordsHeaderSize);
+
+    for(unsigned long b = 0; b < nBlocks_; ++b)
+    {
+        const long offset = readLong((const char*)(index_ + 2 * b));
+        const long blockSize = readLong((const char*)(index_ + 2 * b + 1));
+        if(offset < (long)recordsHeaderSize || blockSize < 0 || offset + blockSize > (long)size)
+        {
+            exceptionStr << "Block " << b << " at offset " << offset << " with size " << blockSize << " does not fit in " << size << " bytes.";
+            throwError(exceptionStr.str());
+        }
+        compressedSize_ = std::max(compressedSize_, aligned(offset + blockSize));
+    }
+}
+
+void
+CompressedRecords::decompressBlock(unsigned long b, double* records) const
+{
+    check(b < nBlocks_, "invalid block " << b);
+    const long offset = readLong((const char*)(index_ + 2 * b));
+    const long blockSize = readLong((const char*)(index_ + 2 * b + 1));
+
+    try
+    {
+        BlockCompression::decompress(codec_, data_ + offset, blockSize, records, this->blockSize(b) * recordLength_);
+    }
+    catch (std::exception& e)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot decompress block " << b << " of " << name_ << ". " << e.what();
+        throwError(exceptionStr.str());
+    }
+}
+
+void
+CompressedRecords::decompress(double* records) const
+{
+    // exceptions cannot leave the parallel region, the first error is thrown after it
+    std::string errorMessage;
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(long b = 0; b < (long)nBlocks_; ++b)
+    {
+        try
+        {
+            decompressBlock(b, records + blockStart(b) * recordLength_);
+        }
+        catch (std::exception& e)
+        {
+#pragma omp critical (compressed_records_error)
+            {
+                if(errorMessage.empty())
+                    errorMessage = e.what();
+            }
+        }
+    }
+
+    if(!errorMessage.empty())
+        throwError(errorMessage);
+}
@@ -8,10 +8,11 @@
 #include <exception_handler.hpp>
 #include <utils.hpp>
 #include <c_matrix.hpp>
+#include <mapped_matrix.hpp>
 
 #include "chealpix.h"
 
-CMatrix::CMatrix(int nPix) : nPix_(nPix)
+CMatrix::CMatrix(int nPix) : nPix_(nPix), memory_(MemoryTracker::C_MATRIX)
 {
     initialize();
 }
@@ -21,7 +22,10 @@ CMatrix::initialize()
 {
     check(nPix_ > 0, "the number of pixels must be positive.");
     
-    matrix_.resize(nPix_ * (nPix_ + 1) / 2, 0);
+    matrix_.clear();
+    matrix_.resize(nPix_ * (nPix_ + 1) / 2);
+    Math::firstTouchFillPacked(&(matrix_[0]), nPix_, 0.0);
+    memory_.set(matrix_.capacity() * sizeof(double));
 }
 
 int
@@ -64,6 +68,12 @@ CMatrix::readFromFile(const char* fileName)
     inC.close();
 }
 
+void
+CMatrix::writeIntoMappableFile(const char* fileName) const
+{
+    Math::MappedMatrix::writeIntoFile(nPix_, nPix_, true, &(matrix_[0]), fileName);
+}
+
 void
 CMatrix::writeIntoFile(const char* fileName) const
 {
@@ -184,18 +194,49 @@ CMatrix::maskMatrix(const std::vector<int>& goodPixels)
 {
     const int goodPixelsSize = goodPixels.size();
     
-    std::vector<double> newMatrix(goodPixelsSize * (goodPixelsSize + 1) / 2);
+    bool sorted = true;
+    for(int i = 0; i < goodPixelsSize; ++i)
+    {
+        check(goodPixels[i] >= 0 && goodPixels[i] < nPix_, "invalid good pixel " << goodPixels[i]);
+        if(i > 0 && goodPixels[i] <= goodPixels[i - 1])
+            sorted = false;
+    }
+    
+    if(!sorted)
+    {
+        std::vector<double, Math::FirstTouchAllocator<double> > newMatrix((unsigned long)(goodPixelsSize) * (goodPixelsSize + 1) / 2);
         
+#pragma omp parallel for default(shared) schedule(static)
+        for(int j = 0; j < goodPixelsSize; ++j)
+        {
+            for(int i = 0; i <= j; ++i)
+            {
+                const int j1 = goodPixels[j];
+                const int i1 = goodPixels[i];
+                newMatrix[(unsigned long)(j) * (j + 1) / 2 + i] = element(i1, j1);
+            }
+        }
+        nPix_ = goodPixelsSize;
+        
+        // swap rather than copy, so that the memory of the full matrix is released
+        matrix_.swap(newMatrix);
+        memory_.set(matrix_.capacity() * sizeof(double));
+        return;
+    }
+    
+    // for increasing good pixels the packed index of (goodPixels[i], goodPixels[j]) is never smaller than that of (i, j) and increases in the same order,
+    // so the elements can be moved forward in place without overwriting any that are still needed, no memory for a second matrix is needed
+    unsigned long index = 0;
     for(int j = 0; j < goodPixelsSize; ++j)
     {
+        const unsigned long j1 = goodPixels[j];
+        const unsigned long columnStart = j1 * (j1 + 1) / 2;
         for(int i = 0; i <= j; ++i)
-        {
-            const int j1 = goodPixels[j];
-            const int i1 = goodPixels[i];
-            const int index = getIndex(i, j);
-            newMatrix[index] = element(i1, j1);
-        }
+            matrix_[index++] = matrix_[columnStart + goodPixels[i]];
     }
     nPix_ = goodPixelsSize;
-    matrix_ = newMatrix;
+    
+    matrix_.resize(index);
+    matrix_.shrink_to_fit();
+    memory_.set(matrix_.capacity() * sizeof(double));
 }
@@ -6,16 +6,24 @@
 #include <iomanip>
 #include <cmath>
 #include <ctime>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <numerics.hpp>
 #include <angular_coordinates.hpp>
 #include <three_rotation.hpp>
+#include <alm_rotation.hpp>
 #include <progress_meter.hpp>
 #include <utils.hpp>
 #include <random.hpp>
 #include <legendre.hpp>
+#include <vector_kernels.hpp>
+#include <cosmo_mpi.hpp>
+#include <spherical_harmonic_transform.hpp>
+#include <mapped_file.hpp>
 #include <c_matrix_generator.hpp>
 
 #include "healpix_base.h"
@@ -27,11 +35,28 @@
 #include "alm_powspec_tools.h"
 #include "chealpix.h"
 
-LegendrePolynomialContainer::LegendrePolynomialContainer(int lMax, long nSide, const std::vector<int>* goodPixels)
+namespace
+{
+
+const char legendreMagic[8] = {'C', 'O', 'S', 'M', 'O', 'L', 'E', 'G'};
+const int legendreVersion = 1;
+
+struct LegendreHeader : public Math::MappedFileHeader
+{
+    int lMax;
+    long long nPix;
+    char padding[Math::MappedFile::headerSize - sizeof(Math::MappedFileHeader) - sizeof(int) - sizeof(long long)];
+};
+
+static_assert(sizeof(LegendreHeader) == Math::MappedFile::headerSize, "the Legendre polynomials header must have the size of the MappedFile header");
+
+} // namespace
+
+LegendrePolynomialContainer::LegendrePolynomialContainer(int lMax, long nSide, const std::vector<int>* goodPixels, bool singlePrecision) : lMax_(lMax), singlePrecision_(singlePrecision), values_(NULL), valuesFloat_(NULL), memory_(MemoryTracker::LEGENDRE_CONTAINER)
 {
     check(lMax >= 0, "");
-    data_.resize(lMax + 1);
     const int nPix = (goodPixels ? goodPixels->size() : (int)nside2npix(nSide));
+    nPix_ = nPix;
     
     std::vector<Math::ThreeVectorDouble> pixels;
     
@@ -44,15 +69,30 @@ LegendrePolynomialContainer::LegendrePolynomialContainer(int lMax, long nSide, c
         pixels.push_back(pix);
     }
     
-    Math::Legendre legendre;
-    ProgressMeter meter((lMax + 1) * nPix * (nPix + 1) / 2);
+    const unsigned long size = (unsigned long)(nPix) * (nPix + 1) / 2 * (lMax + 1);
+    if(singlePrecision_)
+    {
+        dataFloat_.resize(size);
+        valuesFloat_ = (size ? &(dataFloat_[0]) : NULL);
+    }
+    else
+    {
+        data_.resize(size);
+        values_ = (size ? &(data_[0]) : NULL);
+    }
+    memory_.set(dataFloat_.capacity() * sizeof(float) + data_.capacity() * sizeof(double));
+    
+    ProgressMeter meter((unsigned long)(lMax + 1) * nPix * (nPix + 1) / 2);
     
-    for(int l = 0; l <= lMax; ++l)
+    // all of the l values for each pair in one pass of the recursion, the rows of pairs are split between the threads
+#pragma omp parallel default(shared)
     {
-        data_[l].resize(nPix);
+        // only needed for single precision
+        std::vector<double> row(lMax + 1);
+
+#pragma omp for schedule(dynamic)
         for(int j = 0; j < nPix; ++j)
         {
-            data_[l][j].resize(j + 1);
             for(int i = 0; i <= j; ++i)
             {
                 double dot = pixels[i] * pixels[j];
@@ -66,101 +106,202 @@ LegendrePolynomialContainer::LegendrePolynomialContainer(int lMax, long nSide, c
                     check(Math::areEqual(dot, -1.0, 0.0001), "");
                     dot = -1;
                 }
-                
-                data_[l][j][i] = legendre.calculate(l, dot);
-                
-                meter.advance();
+
+                const unsigned long start = offset(j, i);
+                if(singlePrecision_)
+                {
+                    Math::Legendre::calculateAll(lMax, dot, &(row[0]));
+                    for(int l = 0; l <= lMax; ++l)
+                        dataFloat_[start + l] = float(row[l]);
+                }
+                else
+                    Math::Legendre::calculateAll(lMax, dot, &(data_[start]));
             }
+
+            // one update for the whole row, the meter is thread safe
+            meter.advance((unsigned long)(lMax + 1) * (j + 1));
         }
     }
 }
 
+unsigned long
+LegendrePolynomialContainer::memoryEstimate(int lMax, long nSide, const std::vector<int>* goodPixels, bool singlePrecision)
+{
+    check(lMax >= 0, "");
+    const unsigned long nPix = (goodPixels ? goodPixels->size() : (unsigned long)(nside2npix(nSide)));
+    return nPix * (nPix + 1) / 2 * (lMax + 1) * (singlePrecision ? sizeof(float) : sizeof(double));
+}
+
 double
 LegendrePolynomialContainer::value(int l, int j, int i) const
 {
-    check(l < data_.size() && l >= 0, "invalid l = " << l);
-    check(j < data_[l].size() && j >= 0, "invalid j");
+    check(l <= lMax_ && l >= 0, "invalid l = " << l);
+    check(j < nPix_ && j >= 0, "invalid j");
     check(i <= j && i >= 0, "invalid i");
-    check(data_[l][j].size() == j + 1, "");
     
-    return data_[l][j][i];
+    const unsigned long k = offset(j, i) + l;
+    return (singlePrecision_ ? double(valuesFloat_[k]) : values_[k]);
 }
 
-LegendrePolynomialContainer::LegendrePolynomialContainer(const char* fileName)
+double
+LegendrePolynomialContainer::sum(int j, int i, const double* w, int lMin, int lMax) const
 {
-    std::ifstream in;
-    in.open(fileName, std::ios::in | std::ios::binary);
+    check(lMin >= 0 && lMax <= lMax_, "invalid l range " << lMin << " to " << lMax << ", the container has lMax = " << lMax_);
+    check(j < nPix_ && j >= 0, "invalid j");
+    check(i <= j && i >= 0, "invalid i");
     
-    StandardException exc;
-    if(!in)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot open input file " << fileName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
+    if(lMax < lMin)
+        return 0;
     
-    int lMax;
-    in.read((char*)(&lMax), sizeof(int));
-    if(lMax < 0)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "Invalid lMax = " << lMax << " read from file " << fileName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
-    int nPix;
-    in.read((char*)(&nPix), sizeof(int));
-    if(nPix < 0)
+    const unsigned long start = offset(j, i);
+    if(!singlePrecision_)
+        return Math::VectorKernels::dotProduct(long(lMax - lMin + 1), w + lMin, values_ + start + lMin);
+    
+    const float* p = valuesFloat_ + start;
+    double res = 0;
+#pragma omp simd reduction(+:res)
+    for(int l = lMin; l <= lMax; ++l)
+        res += w[l] * p[l];
+    return res;
+}
+
+LegendrePolynomialContainer::LegendrePolynomialContainer(const char* fileName) : lMax_(0), nPix_(0), singlePrecision_(false), values_(NULL), valuesFloat_(NULL), memory_(MemoryTracker::LEGENDRE_CONTAINER)
+{
+    LegendreHeader header;
+    const bool valid = Math::MappedFile::readHeader(fileName, legendreMagic, "Legendre polynomials", &header);
+    
+    if(!valid || header.version != legendreVersion || (header.elementSize != sizeof(double) && header.elementSize != sizeof(float)) || header.lMax < 0 || header.nPix < 0)
     {
+        StandardException exc;
         std::stringstream exceptionStr;
-        exceptionStr << "Invalid nPix = " << nPix << " read from file " << fileName << ".";
+        exceptionStr << "The file " << fileName << " does not contain valid Legendre polynomials.";
         exc.set(exceptionStr.str());
         throw exc;
     }
     
-    data_.resize(lMax + 1);
+    lMax_ = header.lMax;
+    nPix_ = int(header.nPix);
+    singlePrecision_ = (header.elementSize == sizeof(float));
     
-    for(int l = 0; l <= lMax; ++l)
-    {
-        data_[l].resize(nPix);
-        for(int j = 0; j < nPix; ++j)
-        {
-            data_[l][j].resize(j + 1);
-            in.read((char*)(&(data_[l][j][0])), (j + 1) * sizeof(double));
-        }
-    }
-    in.close();
+    const unsigned long size = (unsigned long)(nPix_) * (nPix_ + 1) / 2 * (lMax_ + 1);
+    file_.map(fileName, Math::MappedFile::headerSize + size * header.elementSize, "Legendre polynomials");
+    
+    const char* start = (const char*)file_.data() + Math::MappedFile::headerSize;
+    if(singlePrecision_)
+        valuesFloat_ = (const float*)start;
+    else
+        values_ = (const double*)start;
 }
 
 void
 LegendrePolynomialContainer::writeIntoFile(const char* fileName) const
 {
-    std::ofstream out(fileName, std::ios::binary | std::ios::out);
-    if(!out)
+    LegendreHeader header;
+    Math::MappedFile::initHeader(legendreMagic, legendreVersion, (singlePrecision_ ? sizeof(float) : sizeof(double)), &header);
+    header.lMax = lMax_;
+    header.nPix = nPix_;
+    
+    const unsigned long size = (unsigned long)(nPix_) * (nPix_ + 1) / 2 * (lMax_ + 1);
+    if(singlePrecision_)
+        Math::MappedFile::write(fileName, &header, valuesFloat_, size * sizeof(float));
+    else
+        Math::MappedFile::write(fileName, &header, values_, size * sizeof(double));
+}
+
+namespace
+{
+
+// the sums of c_l P_l(x) over l for many values of x at once with the Clenshaw recurrence, the beam and the pixel window are folded into c_l
+class LegendreSeries
+{
+public:
+    // the number of values of x evaluated together
+    static const int blockSize = 64;
+
+    LegendreSeries(const std::vector<double>& c) : c_(c), alpha_(c.size()), beta_(c.size() + 1, 0)
     {
-        StandardException exc;
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot write into file " << fileName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        check(!c.empty(), "");
+
+        // P_{l+1}(x) = alpha_l x P_l(x) + beta_l P_{l-1}(x)
+        for(int l = 0; l < c.size(); ++l)
+        {
+            alpha_[l] = double(2 * l + 1) / (l + 1);
+            beta_[l] = -double(l) / (l + 1);
+        }
     }
-    
-    const int lMax = data_.size() - 1;
-    check(lMax >= 0, "");
-    out.write((char*)(&lMax), sizeof(int));
-    const int nPix = data_[0].size();
-    out.write((char*)(&nPix), sizeof(int));
-    for(int l = 0; l <= lMax; ++l)
+
+    // n must not be larger than blockSize
+    void evaluate(int n, const double* x, double* res) const
     {
-        for(int j = 0; j < nPix; ++j)
+        check(n <= blockSize, "");
+
+        double b1[blockSize], b2[blockSize];
+        for(int k = 0; k < n; ++k)
         {
-            out.write((char*)(&(data_[l][j][0])), (j + 1) * sizeof(double));
+            b1[k] = 0;
+            b2[k] = 0;
         }
+
+        // the loop over the pixel pairs is the inner one so it is vectorized, the result is b_0
+        for(int l = c_.size() - 1; l >= 0; --l)
+        {
+            const double c = c_[l], alpha = alpha_[l], beta = beta_[l + 1];
+#pragma omp simd
+            for(int k = 0; k < n; ++k)
+            {
+                const double b = c + alpha * x[k] * b1[k] + beta * b2[k];
+                b2[k] = b1[k];
+                b1[k] = b;
+            }
+        }
+
+        for(int k = 0; k < n; ++k)
+            res[k] = b1[k];
     }
-    out.close();
+
+private:
+    const std::vector<double>& c_;
+    std::vector<double> alpha_, beta_;
+};
+
+// the cosine of the angle between two pixels, the rounding errors are clamped
+double
+pixelCosine(const Math::ThreeVectorDouble& a, const Math::ThreeVectorDouble& b)
+{
+    const double dot = a * b;
+    return std::max(-1.0, std::min(1.0, dot));
 }
 
+// the key of a pair is the two rings (in order) and the azimuthal separation, folded into [0, pi] and rounded
+class PairKey
+{
+public:
+    PairKey(int nRings, const std::vector<int>& ring, const std::vector<double>& phi) : nRings_(nRings), ring_(ring), phi_(phi) {}
+    
+    unsigned long long operator()(int i, int j) const
+    {
+        const int r1 = std::min(ring_[i], ring_[j]), r2 = std::max(ring_[i], ring_[j]);
+        const double deltaPhi = separation(i, j);
+        const unsigned long long q = (unsigned long long)(deltaPhi * 1e9 + 0.5);
+        return (((unsigned long long)(r1) * nRings_ + r2) << 32) | q;
+    }
+    
+    double separation(int i, int j) const
+    {
+        double deltaPhi = std::fmod(std::abs(phi_[i] - phi_[j]), 2 * Math::pi);
+        if(deltaPhi > Math::pi)
+            deltaPhi = 2 * Math::pi - deltaPhi;
+        return deltaPhi;
+    }
+    
+private:
+    const unsigned long long nRings_;
+    const std::vector<int>& ring_;
+    const std::vector<double>& phi_;
+};
+
+} // namespace
+
 CMatrix*
 CMatrixGenerator::clToCMatrix(const std::vector<double>& cl, long nSide, double fwhm, const std::vector<int>* goodPixels, const LegendrePolynomialContainer* lp)
 {
@@ -185,52 +326,201 @@ CMatrixGenerator::clToCMatrix(const std::vector<double>& cl, long nSide, double
         }
     
     CMatrix* cMat = new CMatrix(nPix);
-    std::vector<double> clCopy(cl.size());
     
+    // the weights of the Legendre polynomials, the sum over l is a dot product with the stored polynomials of the pair
+    std::vector<double> clBeam(lMax + 1, 0);
     for(int l = 2; l <= lMax; ++l)
+        clBeam[l] = cl[l] * (2 * l + 1) / (4 * Math::pi) * beam[l] * beam[l];
+    
+    ProgressMeter meter((unsigned long)(nPix) * (nPix + 1) / 2);
+    
+    if(lp)
     {
-        clCopy[l] = cl[l] * (2 * l + 1) / (4 * Math::pi);
+        for(int j = 0; j < nPix; ++j)
+        {
+            for(int i = 0; i <= j; ++i)
+            {
+                const double element = lp->sum(j, i, &(clBeam[0]), 2, lMax);
+                cMat->element(i, j) = element;
+                cMat->element(j, i) = element; // just in case if the implementation of CMatrix changes
+            }
+            meter.advance(j + 1);
+        }
+        return cMat;
     }
     
-    Math::Legendre legendre;
-    ProgressMeter meter(nPix * (nPix + 1) / 2);
+    // without the container the polynomials are not stored, the rows are split between the threads and each row is done in blocks of pixel pairs with the Clenshaw recurrence, so the memory is only the matrix itself
+    const LegendreSeries series(clBeam);
     
+#pragma omp parallel for default(shared) schedule(dynamic)
     for(int j = 0; j < nPix; ++j)
     {
-        for(int i = 0; i <= j; ++i)
+        double x[LegendreSeries::blockSize], element[LegendreSeries::blockSize];
+        for(int iStart = 0; iStart <= j; iStart += LegendreSeries::blockSize)
         {
-            double dot = 0;
-            if(!lp)
-            {
-                dot = pixels[i] * pixels[j];
-                if(dot > 1)
-                {
-                    check(Math::areEqual(dot, 1.0, 0.0001), "");
-                    dot = 1;
-                }
-                if(dot < -1)
-                {
-                    check(Math::areEqual(dot, -1.0, 0.0001), "");
-                    dot = -1;
-                }
-            }
+            const int n = std::min(LegendreSeries::blockSize, j + 1 - iStart);
+            for(int k = 0; k < n; ++k)
+                x[k] = pixelCosine(pixels[iStart + k], pixels[j]);
             
-            double element = 0;
-            for(int l = 2; l <= lMax; ++l)
+            series.evaluate(n, x, element);
+            
+            for(int k = 0; k < n; ++k)
             {
-                const double leg = (lp ? lp->value(l, j, i) : legendre.calculate(l, dot));
-                element += clCopy[l] * leg * beam[l] * beam[l];
+                cMat->element(iStart + k, j) = element[k];
+                cMat->element(j, iStart + k) = element[k]; // just in case if the implementation of CMatrix changes
             }
+        }
+        
+        meter.advance(j + 1);
+    }
+    return cMat;
+}
+
+CMatrix*
+CMatrixGenerator::clToCMatrixRingSymmetric(const std::vector<double>& cl, long nSide, double fwhm, const std::vector<int>* goodPixels)
+{
+    check(!cl.empty(), "");
+    
+    const int lMax = cl.size() - 1;
+    const int nPix = (goodPixels ? goodPixels->size() : (int)nside2npix(nSide));
+    
+    std::vector<double> beam;
+    Utils::readPixelWindowFunction(beam, nSide, lMax, fwhm);
+    
+    std::vector<double> clBeam(lMax + 1, 0);
+    for(int l = 2; l <= lMax; ++l)
+        clBeam[l] = cl[l] * (2 * l + 1) / (4 * Math::pi) * beam[l] * beam[l];
+    
+    std::vector<double> theta(nPix), phi(nPix);
+    for(int i = 0; i < nPix; ++i)
+    {
+        const int index = (goodPixels ? (*goodPixels)[i] : i);
+        pix2ang_nest(nSide, index, &(theta[i]), &(phi[i]));
+    }
+    
+    // the rings are identified by theta
+    std::vector<double> ringTheta(theta);
+    std::sort(ringTheta.begin(), ringTheta.end());
+    std::vector<double> ringCos, ringSin;
+    for(int i = 0; i < nPix; ++i)
+    {
+        if(!ringCos.empty() && ringTheta[i] - ringTheta[i - 1] < 1e-10)
+            continue;
+        ringCos.push_back(std::cos(ringTheta[i]));
+        ringSin.push_back(std::sin(ringTheta[i]));
+        ringTheta[ringCos.size() - 1] = ringTheta[i];
+    }
+    const int nRings = ringCos.size();
+    ringTheta.resize(nRings);
+    
+    std::vector<int> ring(nPix);
+    for(int i = 0; i < nPix; ++i)
+    {
+        ring[i] = int(std::lower_bound(ringTheta.begin(), ringTheta.end(), theta[i] - 1e-10) - ringTheta.begin());
+        check(ring[i] < nRings && std::abs(ringTheta[ring[i]] - theta[i]) < 1e-10, "");
+    }
+    
+    const PairKey key(nRings, ring, phi);
+    
+    // the unique separations
+    std::unordered_map<unsigned long long, int> unique;
+    std::vector<double> x;
+    for(int j = 0; j < nPix; ++j)
+    {
+        for(int i = 0; i <= j; ++i)
+        {
+            const unsigned long long k = key(i, j);
+            if(unique.find(k) != unique.end())
+                continue;
             
+            unique[k] = x.size();
+            const double dot = ringCos[ring[i]] * ringCos[ring[j]] + ringSin[ring[i]] * ringSin[ring[j]] * std::cos(key.separation(i, j));
+            x.push_back(std::max(-1.0, std::min(1.0, dot)));
+        }
+    }
+    
+    // the covariance for each unique separation
+    const LegendreSeries series(clBeam);
+    const int nUnique = x.size();
+    std::vector<double> value(nUnique);
+    
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int start = 0; start < nUnique; start += LegendreSeries::blockSize)
+    {
+        const int n = std::min(LegendreSeries::blockSize, nUnique - start);
+        series.evaluate(n, &(x[start]), &(value[start]));
+    }
+    
+    CMatrix* cMat = new CMatrix(nPix);
+    
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int j = 0; j < nPix; ++j)
+    {
+        for(int i = 0; i <= j; ++i)
+        {
+            const double element = value[unique.find(key(i, j))->second];
             cMat->element(i, j) = element;
             cMat->element(j, i) = element; // just in case if the implementation of CMatrix changes
-            
-            meter.advance();
         }
     }
+    
     return cMat;
 }
 
+namespace
+{
+
+// the elements of the covariance matrix for clToTiledMatrix, called from multiple threads
+class ClCovarianceElements : public Math::TiledMatrix::ElementGenerator
+{
+public:
+    ClCovarianceElements(const std::vector<double>& clBeam, const std::vector<Math::ThreeVectorDouble>& pixels) : series_(clBeam), pixels_(pixels) {}
+
+    double evaluate(int i, int j) const
+    {
+        const double dot = pixelCosine(pixels_[i], pixels_[j]);
+        double element;
+        series_.evaluate(1, &dot, &element);
+        return element;
+    }
+
+private:
+    const LegendreSeries series_;
+    const std::vector<Math::ThreeVectorDouble>& pixels_;
+};
+
+} // namespace
+
+void
+CMatrixGenerator::clToTiledMatrix(const std::vector<double>& cl, long nSide, double fwhm, Math::TiledMatrix* res, const std::vector<int>* goodPixels)
+{
+    check(!cl.empty(), "");
+
+    const int lMax = cl.size() - 1;
+    const int nPix = (goodPixels ? goodPixels->size() : (int)nside2npix(nSide));
+    check(res->rows() == nPix, "the tiled matrix has size " << res->rows() << ", should be " << nPix);
+
+    std::vector<double> beam;
+    Utils::readPixelWindowFunction(beam, nSide, lMax, fwhm);
+
+    std::vector<Math::ThreeVectorDouble> pixels;
+    for(int i = 0; i < nPix; ++i)
+    {
+        double theta, phi;
+        const int index = (goodPixels ? (*goodPixels)[i] : i);
+        pix2ang_nest(nSide, index, &theta, &phi);
+        const Math::ThreeVectorDouble pix(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
+        pixels.push_back(pix);
+    }
+
+    std::vector<double> clBeam(cl.size(), 0);
+    for(int l = 2; l <= lMax; ++l)
+        clBeam[l] = cl[l] * (2 * l + 1) / (4 * Math::pi) * beam[l] * beam[l];
+
+    ClCovarianceElements elements(clBeam, pixels);
+    res->generate(elements);
+}
+
 CMatrix*
 CMatrixGenerator::clToCMatrix(const char* clFileName, long nSide, int lMax, double fwhm, const std::vector<int>* goodPixels, const LegendrePolynomialContainer* lp)
 {
@@ -333,151 +623,206 @@ CMatrixGenerator::clToWholeMatrix(const char* clFileName, WholeMatrix& tt, Whole
     inCl.close();
 }
 
+namespace
+{
+
+void
+setError(std::string& error, const std::exception& e)
+{
+#pragma omp critical (c_matrix_generator_error)
+    {
+        if(error.empty())
+            error = e.what();
+    }
+}
+
+void
+throwIfError(const std::string& error)
+{
+    if(error.empty())
+        return;
+
+    StandardException exc;
+    exc.set(error);
+    throw exc;
+}
+
+// the index of (l, m) among all of the (l, m) with -l <= m <= l
+inline int
+lmIndex(int l, int m)
+{
+    return l * l + l + m;
+}
+
+} // namespace
+
 CMatrix*
 CMatrixGenerator::wholeMatrixToCMatrix(const WholeMatrix& wholeMatrix, long nSide, double fwhm, double phi, double theta, double psi)
 {
-    StandardException exc;
-    
     const int nPix = (int) nside2npix(nSide);
     
     CMatrix* mat = new CMatrix(nPix);
     
     const Math::ThreeRotationMatrix rot(phi, theta, psi);
-    const rotmatrix rotationMatrix(rot[0][0], rot[1][0], rot[2][0], rot[0][1], rot[1][1], rot[2][1], rot[0][2], rot[1][2], rot[2][2]);
     
     const int lMin = wholeMatrix.getLMin(), lMax = wholeMatrix.getLMax();
     
     check(lMin < lMax, "");
     
-    //first index is l', second index is l' + m'
-    std::vector<std::vector<Alm<xcomplex<double> > > > re(lMax + 1), im(lMax + 1);
-    std::vector<std::vector<Healpix_Map<double> > > reMap(lMax + 1), imMap(lMax + 1);
-    
-    for(int l1 = 0; l1 <= lMax; ++l1)
-    {
-        re[l1].resize(2 * l1 + 1);
-        im[l1].resize(2 * l1 + 1);
-        reMap[l1].resize(2 * l1 + 1);
-        imMap[l1].resize(2 * l1 + 1);
-        for(int m1 = -l1; m1 <= l1; ++m1)
-        {
-            re[l1][l1 + m1].Set(lMax, lMax);
-            im[l1][l1 + m1].Set(lMax, lMax);
-            reMap[l1][l1 + m1].SetNside(nSide, RING);
-            imMap[l1][l1 + m1].SetNside(nSide, RING);
-        }
-    }
+    // the Wigner d matrices are calculated once and used for all of the alm-s below
+    const Math::AlmRotation rotation(rot.transpose(), lMax);
     
     std::vector<double> beam;
     Utils::readPixelWindowFunction(beam, nSide, lMax, fwhm);
     
-    //output_screen("Calculating real and imaginary parts of first conversion..." << std::endl);
-    for(int l1 = 0; l1 <= lMax; ++l1)
+    // the pipeline is streamed, only one Alm and one map per thread are allocated at a time for each of the two conversions
+    // the only intermediate kept is the result of the first conversion, for each pixel the real and imaginary parts for all (l', m'), so the memory is O(lMax^2 nPix) in addition to the result
+    const int nLM = (lMax + 1) * (lMax + 1);
+    std::vector<double> reVals((unsigned long)(nPix) * nLM), imVals((unsigned long)(nPix) * nLM);
+    
+    // one transform is shared by all of the threads and both of the conversions
+    const SphericalHarmonicTransform sht(nSide, lMax);
+    
+    std::string error;
+    
+    // the first conversion, to pixel space for l and m, one (l', m') at a time
+#pragma omp parallel default(shared)
     {
-        for(int m1 = -l1; m1 <= l1; ++m1)
+        Alm<xcomplex<double> > re, im;
+        Healpix_Map<double> reMap, imMap;
+        re.Set(lMax, lMax);
+        im.Set(lMax, lMax);
+        reMap.SetNside(nSide, RING);
+        imMap.SetNside(nSide, RING);
+        
+#pragma omp for schedule(dynamic)
+        for(int k = 0; k < nLM; ++k)
         {
-            for(int l = 0; l <= lMax; ++l)
-            {
-                for(int m = 0; m <= l; ++m)
+            try {
+                const int l1 = int(std::sqrt(double(k)) + 1e-9);
+                const int m1 = k - lmIndex(l1, 0);
+                
+                if(l1 < lMin)
                 {
-                    if(l1 < lMin || l < lMin)
+                    for(int i = 0; i < nPix; ++i)
                     {
-                        re[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                        im[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                        continue;
+                        reVals[(unsigned long)(i) * nLM + k] = 0;
+                        imVals[(unsigned long)(i) * nLM + k] = 0;
                     }
-                    const int minus1m = (m % 2 ? -1 : 1);
-                    re[l1][l1 + m1](l, m) = xcomplex<double>((wholeMatrix.element(l1, m1, l, m) + minus1m * wholeMatrix.element(l1, m1, l, -m)) / 2, 0);
-                    im[l1][l1 + m1](l, m) = xcomplex<double>(0, -(wholeMatrix.element(l1, m1, l, m) - minus1m * wholeMatrix.element(l1, m1, l, -m)) / 2);
-                    
-                    // multiply by the beam
-                    re[l1][l1 + m1](l, m) *= (beam[l] * beam[l1]);
-                    im[l1][l1 + m1](l, m) *= (beam[l] * beam[l1]);
+                    continue;
+                }
+                
+                for(int l = 0; l <= lMax; ++l)
+                {
+                    for(int m = 0; m <= l; ++m)
+                    {
+                        if(l < lMin)
+                        {
+                            re(l, m) = xcomplex<double>(0, 0);
+                            im(l, m) = xcomplex<double>(0, 0);
+                            continue;
+                        }
+                        const int minus1m = (m % 2 ? -1 : 1);
+                        re(l, m) = xcomplex<double>((wholeMatrix.element(l1, m1, l, m) + minus1m * wholeMatrix.element(l1, m1, l, -m)) / 2, 0);
+                        im(l, m) = xcomplex<double>(0, -(wholeMatrix.element(l1, m1, l, m) - minus1m * wholeMatrix.element(l1, m1, l, -m)) / 2);
+                        
+                        // multiply by the beam
+                        re(l, m) *= (beam[l] * beam[l1]);
+                        im(l, m) *= (beam[l] * beam[l1]);
+                    }
+                }
+                
+                Alm<xcomplex<double> >* sets[2] = {&re, &im};
+                rotation.rotate(2, sets);
+                
+                // the real and imaginary parts are transformed together
+                const Alm<xcomplex<double> >* alms[2] = {&re, &im};
+                Healpix_Map<double>* maps[2] = {&reMap, &imMap};
+                sht.alm2map(2, alms, maps);
+                reMap.swap_scheme();
+                imMap.swap_scheme();
+                
+                for(int i = 0; i < nPix; ++i)
+                {
+                    reVals[(unsigned long)(i) * nLM + k] = reMap[i];
+                    imVals[(unsigned long)(i) * nLM + k] = imMap[i];
                 }
+                
+                // the maps are converted back to RING for the next alm2map
+                reMap.swap_scheme();
+                imMap.swap_scheme();
+            } catch (std::exception& e)
+            {
+                setError(error, e);
             }
         }
     }
-    //output_screen("OK" << std::endl);
+    throwIfError(error);
     
-    //output_screen("Converting to pixel space for l and m..." << std::endl);
-    //ProgressMeter meter1((lMax + 1) * (lMax + 1));
-    for(int l1 = 0; l1 <= lMax; ++l1)
+    // the second conversion, to pixel space for l' and m', one pixel at a time, the result is written straight into the matrix
+#pragma omp parallel default(shared)
     {
-        for(int m1 = -l1; m1 <= l1; ++m1)
-        {
-            rotate_alm(re[l1][l1 + m1], rotationMatrix);
-            rotate_alm(im[l1][l1 + m1], rotationMatrix);
-            
-            alm2map(re[l1][l1 + m1], reMap[l1][l1 + m1]);
-            alm2map(im[l1][l1 + m1], imMap[l1][l1 + m1]);
-            reMap[l1][l1 + m1].swap_scheme();
-            imMap[l1][l1 + m1].swap_scheme();
-            
-            //meter1.advance();
-        }
-    }
-    //output_screen("OK" << std::endl);
-    
-    //output_screen("Calculating real and imaginary parts of second conversion" << std::endl);
-    std::vector<Alm<xcomplex<double> > > rePix(nPix);
+        Alm<xcomplex<double> > rePix;
+        Healpix_Map<double> rePixMap;
+        rePix.Set(lMax, lMax);
+        rePixMap.SetNside(nSide, RING);
 #ifdef CHECKS_ON
-    std::vector<Alm<xcomplex<double> > > imPix(nPix);
+        Alm<xcomplex<double> > imPix;
+        Healpix_Map<double> imPixMap;
+        imPix.Set(lMax, lMax);
+        imPixMap.SetNside(nSide, RING);
 #endif
-    for(int i = 0; i < nPix; ++i)
-    {
-        rePix[i].Set(lMax, lMax);
-#ifdef CHECKS_ON
-        imPix[i].Set(lMax, lMax);
-#endif
-        for(int l1 = 0; l1 <= lMax; ++l1)
+        
+#pragma omp for schedule(dynamic)
+        for(int i = 0; i < nPix; ++i)
         {
-            for(int m1 = 0; m1 <= l1; ++m1)
-            {
-                const xcomplex<double> al1m1 = xcomplex<double>(reMap[l1][l1 + m1][i], -imMap[l1][l1 + m1][i]);
-                const xcomplex<double> al1minusm1 = xcomplex<double>(reMap[l1][l1 - m1][i], -imMap[l1][l1 - m1][i]);
-                
-                const double minus1m1 = (m1 % 2 ? -1.0 : 1.0);
-
-                rePix[i](l1, m1) = 0.5 * (al1m1 + minus1m1 * al1minusm1.conj());
+            try {
+                const double* re = &(reVals[(unsigned long)(i) * nLM]);
+                const double* im = &(imVals[(unsigned long)(i) * nLM]);
+                for(int l1 = 0; l1 <= lMax; ++l1)
+                {
+                    for(int m1 = 0; m1 <= l1; ++m1)
+                    {
+                        const xcomplex<double> al1m1 = xcomplex<double>(re[lmIndex(l1, m1)], -im[lmIndex(l1, m1)]);
+                        const xcomplex<double> al1minusm1 = xcomplex<double>(re[lmIndex(l1, -m1)], -im[lmIndex(l1, -m1)]);
+                        
+                        const double minus1m1 = (m1 % 2 ? -1.0 : 1.0);
+                        
+                        rePix(l1, m1) = 0.5 * (al1m1 + minus1m1 * al1minusm1.conj());
 #ifdef CHECKS_ON
-                imPix[i](l1, m1) = xcomplex<double>(0, -0.5) * (al1m1 - minus1m1 * al1minusm1.conj());
+                        imPix(l1, m1) = xcomplex<double>(0, -0.5) * (al1m1 - minus1m1 * al1minusm1.conj());
 #endif
-            }
-        }
-    }
-    //output_screen("OK" << std::endl);
-    
-    //output_screen("Converting to pixel space for l' and m'..." << std::endl);
-    std::vector<Healpix_Map<double> > rePixMap(nPix);
+                    }
+                }
+                
+                rotation.rotate(rePix);
+                sht.alm2map(rePix, rePixMap);
+                rePixMap.swap_scheme();
 #ifdef CHECKS_ON
-    std::vector<Healpix_Map<double> > imPixMap(nPix);
+                rotation.rotate(imPix);
+                sht.alm2map(imPix, imPixMap);
+                imPixMap.swap_scheme();
 #endif
-    //ProgressMeter meter2(nPix);
-    for(int i = 0; i < nPix; ++i)
-    {
-        rePixMap[i].SetNside(nSide, RING);
-        rotate_alm(rePix[i], rotationMatrix);
-        alm2map(rePix[i], rePixMap[i]);
-        rePixMap[i].swap_scheme();
+                
+                // each thread writes the elements (i, j) with j >= i, so the threads do not overlap
+                for(int j = i; j < nPix; ++j)
+                {
+                    mat->element(i, j) = rePixMap[j];
+                    mat->element(j, i) = rePixMap[j];
+                    check(Math::areEqual(imPixMap[j], 0.0, 1e-15), "");
+                }
+                
+                rePixMap.swap_scheme();
 #ifdef CHECKS_ON
-        imPixMap[i].SetNside(nSide, RING);
-        rotate_alm(imPix[i], rotationMatrix);
-        alm2map(imPix[i], imPixMap[i]);
-        imPixMap[i].swap_scheme();
+                imPixMap.swap_scheme();
 #endif
-        //meter2.advance();
-    }
-    //output_screen("OK" << std::endl);
-    
-    for(int j = 0; j < nPix; ++j)
-    {
-        for(int i = 0; i <= j; ++i)
-        {
-            mat->element(i, j) = rePixMap[i][j];
-            mat->element(j, i) = rePixMap[i][j];
-            check(Math::areEqual(imPixMap[i][j], 0.0, 1e-15), "");
+            } catch (std::exception& e)
+            {
+                setError(error, e);
+            }
         }
     }
+    throwIfError(error);
     
     return mat;
 }
@@ -485,211 +830,234 @@ CMatrixGenerator::wholeMatrixToCMatrix(const WholeMatrix& wholeMatrix, long nSid
 CMatrix*
 CMatrixGenerator::polarizationEEWholeMatrixToCMatrix(const WholeMatrix& ee, long nSide, double fwhm, double phi, double theta, double psi)
 {
-    StandardException exc;
-    
     const int nPix = (int) nside2npix(nSide);
     
     CMatrix* mat = new CMatrix(2 * nPix);
     mat->comment() = "polarization";
     
     const Math::ThreeRotationMatrix rot(phi, theta, psi);
-    const rotmatrix rotationMatrix(rot[0][0], rot[1][0], rot[2][0], rot[0][1], rot[1][1], rot[2][1], rot[0][2], rot[1][2], rot[2][2]);
     const int lMin = ee.getLMin(), lMax = ee.getLMax();
     
     check(lMin < lMax, "");
     
-    //first index is l', second index is l' + m'
-    std::vector<std::vector<Alm<xcomplex<double> > > > t(lMax + 1), reE(lMax + 1), imE(lMax + 1), b(lMax + 1);
-    std::vector<std::vector<Healpix_Map<double> > > tMap(lMax + 1), reQMap(lMax + 1), imQMap(lMax + 1), reUMap(lMax + 1), imUMap(lMax + 1);
-    
-    for(int l1 = 0; l1 <= lMax; ++l1)
-    {
-        t[l1].resize(2 * l1 + 1);
-        reE[l1].resize(2 * l1 + 1);
-        imE[l1].resize(2 * l1 + 1);
-        b[l1].resize(2 * l1 + 1);
-        
-        tMap[l1].resize(2 * l1 + 1);
-        reQMap[l1].resize(2 * l1 + 1);
-        imQMap[l1].resize(2 * l1 + 1);
-        reUMap[l1].resize(2 * l1 + 1);
-        imUMap[l1].resize(2 * l1 + 1);
-        
-        for(int m1 = -l1; m1 <= l1; ++m1)
-        {
-            t[l1][l1 + m1].Set(lMax, lMax);
-            reE[l1][l1 + m1].Set(lMax, lMax);
-            imE[l1][l1 + m1].Set(lMax, lMax);
-            b[l1][l1 + m1].Set(lMax, lMax);
-            
-            tMap[l1][l1 + m1].SetNside(nSide, RING);
-            reQMap[l1][l1 + m1].SetNside(nSide, RING);
-            imQMap[l1][l1 + m1].SetNside(nSide, RING);
-            reUMap[l1][l1 + m1].SetNside(nSide, RING);
-            imUMap[l1][l1 + m1].SetNside(nSide, RING);
-        }
-    }
+    // the Wigner d matrices are calculated once and used for all of the alm-s below
+    const Math::AlmRotation rotation(rot.transpose(), lMax);
     
     std::vector<double> beam;
     Utils::readPixelWindowFunction(beam, nSide, lMax, fwhm);
-
-    //output_screen("Calculating real and imaginary parts of first conversion..." << std::endl);
-    for(int l1 = 0; l1 <= lMax; ++l1)
+    
+    // streamed the same way as wholeMatrixToCMatrix, the intermediate is the real and imaginary parts of the Q and U maps for each pixel and all (l', m')
+    const int nLM = (lMax + 1) * (lMax + 1);
+    const unsigned long intermediateSize = (unsigned long)(nPix) * nLM;
+    std::vector<double> reQVals(intermediateSize), imQVals(intermediateSize), reUVals(intermediateSize), imUVals(intermediateSize);
+    
+    const SphericalHarmonicTransform sht(nSide, lMax);
+    
+    std::string error;
+    
+    // the first conversion, to pixel space for l and m, one (l', m') at a time
+#pragma omp parallel default(shared)
     {
-        for(int m1 = -l1; m1 <= l1; ++m1)
+        Alm<xcomplex<double> > t, reE, imE, b;
+        Healpix_Map<double> tMap, reQMap, imQMap, reUMap, imUMap;
+        t.Set(lMax, lMax);
+        reE.Set(lMax, lMax);
+        imE.Set(lMax, lMax);
+        b.Set(lMax, lMax);
+        tMap.SetNside(nSide, RING);
+        reQMap.SetNside(nSide, RING);
+        imQMap.SetNside(nSide, RING);
+        reUMap.SetNside(nSide, RING);
+        imUMap.SetNside(nSide, RING);
+        
+#pragma omp for schedule(dynamic)
+        for(int k = 0; k < nLM; ++k)
         {
-            for(int l = 0; l <= lMax; ++l)
-            {
-                for(int m = 0; m <= l; ++m)
+            try {
+                const int l1 = int(std::sqrt(double(k)) + 1e-9);
+                const int m1 = k - lmIndex(l1, 0);
+                
+                if(l1 < lMin)
                 {
-                    if(l1 < lMin || l < lMin)
+                    for(int i = 0; i < nPix; ++i)
                     {
-                        t[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                        reE[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                        imE[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                        b[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                        continue;
+                        const unsigned long index = (unsigned long)(i) * nLM + k;
+                        reQVals[index] = 0;
+                        imQVals[index] = 0;
+                        reUVals[index] = 0;
+                        imUVals[index] = 0;
+                    }
+                    continue;
+                }
+                
+                for(int l = 0; l <= lMax; ++l)
+                {
+                    for(int m = 0; m <= l; ++m)
+                    {
+                        t(l, m) = xcomplex<double>(0, 0);
+                        b(l, m) = xcomplex<double>(0, 0);
+                        if(l < lMin)
+                        {
+                            reE(l, m) = xcomplex<double>(0, 0);
+                            imE(l, m) = xcomplex<double>(0, 0);
+                            continue;
+                        }
+                        const int minus1m = (m % 2 ? -1 : 1);
+                        reE(l, m) = xcomplex<double>((ee.element(l1, m1, l, m) + minus1m * ee.element(l1, m1, l, -m)) / 2, 0);
+                        imE(l, m) = xcomplex<double>(0, -(ee.element(l1, m1, l, m) - minus1m * ee.element(l1, m1, l, -m)) / 2);
+                        
+                        // multiply by the beam
+                        reE(l, m) *= (beam[l] * beam[l1]);
+                        imE(l, m) *= (beam[l] * beam[l1]);
                     }
-                    const int minus1m = (m % 2 ? -1 : 1);
-                    t[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                    b[l1][l1 + m1](l, m) = xcomplex<double>(0, 0);
-                    reE[l1][l1 + m1](l, m) = xcomplex<double>((ee.element(l1, m1, l, m) + minus1m * ee.element(l1, m1, l, -m)) / 2, 0);
-                    imE[l1][l1 + m1](l, m) = xcomplex<double>(0, -(ee.element(l1, m1, l, m) - minus1m * ee.element(l1, m1, l, -m)) / 2);
-                    
-                    // multiply by the beam
-                    reE[l1][l1 + m1](l, m) *= (beam[l] * beam[l1]);
-                    imE[l1][l1 + m1](l, m) *= (beam[l] * beam[l1]);
                 }
+                
+                // T and B are 0, E is rotated like a scalar
+                Alm<xcomplex<double> >* sets[2] = {&reE, &imE};
+                rotation.rotate(2, sets);
+                
+                sht.alm2mapPol(t, reE, b, tMap, reQMap, reUMap);
+                sht.alm2mapPol(t, imE, b, tMap, imQMap, imUMap);
+                reQMap.swap_scheme();
+                imQMap.swap_scheme();
+                reUMap.swap_scheme();
+                imUMap.swap_scheme();
+                
+                for(int i = 0; i < nPix; ++i)
+                {
+                    const unsigned long index = (unsigned long)(i) * nLM + k;
+                    reQVals[index] = reQMap[i];
+                    imQVals[index] = imQMap[i];
+                    reUVals[index] = reUMap[i];
+                    imUVals[index] = imUMap[i];
+                }
+                
+                // the maps are converted back to RING for the next alm2mapPol
+                reQMap.swap_scheme();
+                imQMap.swap_scheme();
+                reUMap.swap_scheme();
+                imUMap.swap_scheme();
+            } catch (std::exception& e)
+            {
+                setError(error, e);
             }
         }
     }
-    //output_screen("OK" << std::endl);
-
-    //output_screen("Converting to pixel space for l and m..." << std::endl);
-    //ProgressMeter meter1((lMax + 1) * (lMax + 1));
-    for(int l1 = 0; l1 <= lMax; ++l1)
+    throwIfError(error);
+    
+    // the second conversion, to pixel space for l' and m', one pixel at a time, the result is written straight into the matrix
+#pragma omp parallel default(shared)
     {
-        for(int m1 = -l1; m1 <= l1; ++m1)
-        {
-            rotate_alm(t[l1][l1 + m1], reE[l1][l1 + m1], b[l1][l1 + m1], rotationMatrix);
-            rotate_alm(t[l1][l1 + m1], imE[l1][l1 + m1], b[l1][l1 + m1], rotationMatrix);
-            
-            alm2map_pol(t[l1][l1 + m1], reE[l1][l1 + m1], b[l1][l1 + m1], tMap[l1][l1 + m1], reQMap[l1][l1 + m1], reUMap[l1][l1 + m1]);
-            alm2map_pol(t[l1][l1 + m1], imE[l1][l1 + m1], b[l1][l1 + m1], tMap[l1][l1 + m1], imQMap[l1][l1 + m1], imUMap[l1][l1 + m1]);
-            reQMap[l1][l1 + m1].swap_scheme();
-            imQMap[l1][l1 + m1].swap_scheme();
-            reUMap[l1][l1 + m1].swap_scheme();
-            imUMap[l1][l1 + m1].swap_scheme();
-            
-            //meter1.advance();
-        }
-    }
-    //output_screen("OK" << std::endl);
-
-    //output_screen("Calculating real and imaginary parts of second conversion" << std::endl);
-    std::vector<Alm<xcomplex<double> > > tPix(nPix), reQPix(nPix), reUPix(nPix), bPix(nPix);
+        Alm<xcomplex<double> > tPix, reQPix, reUPix, bPix;
+        Healpix_Map<double> tPixMap, reQQPixMap, reQUPixMap, reUQPixMap, reUUPixMap;
+        tPix.Set(lMax, lMax);
+        reQPix.Set(lMax, lMax);
+        reUPix.Set(lMax, lMax);
+        bPix.Set(lMax, lMax);
+        tPixMap.SetNside(nSide, RING);
+        reQQPixMap.SetNside(nSide, RING);
+        reQUPixMap.SetNside(nSide, RING);
+        reUQPixMap.SetNside(nSide, RING);
+        reUUPixMap.SetNside(nSide, RING);
 #ifdef CHECKS_ON
-    std::vector<Alm<xcomplex<double> > > imQPix(nPix), imUPix(nPix);
+        Alm<xcomplex<double> > imQPix, imUPix;
+        Healpix_Map<double> imQQPixMap, imQUPixMap, imUQPixMap, imUUPixMap;
+        imQPix.Set(lMax, lMax);
+        imUPix.Set(lMax, lMax);
+        imQQPixMap.SetNside(nSide, RING);
+        imQUPixMap.SetNside(nSide, RING);
+        imUQPixMap.SetNside(nSide, RING);
+        imUUPixMap.SetNside(nSide, RING);
 #endif
-    for(int i = 0; i < nPix; ++i)
-    {
-        tPix[i].Set(lMax, lMax);
-        reQPix[i].Set(lMax, lMax);
-        reUPix[i].Set(lMax, lMax);
-        bPix[i].Set(lMax, lMax);
+        
+#pragma omp for schedule(dynamic)
+        for(int i = 0; i < nPix; ++i)
+        {
+            try {
+                const unsigned long start = (unsigned long)(i) * nLM;
+                const double* reQ = &(reQVals[start]);
+                const double* imQ = &(imQVals[start]);
+                const double* reU = &(reUVals[start]);
+                const double* imU = &(imUVals[start]);
+                for(int l1 = 0; l1 <= lMax; ++l1)
+                {
+                    for(int m1 = 0; m1 <= l1; ++m1)
+                    {
+                        const xcomplex<double> al1m1Q = xcomplex<double>(reQ[lmIndex(l1, m1)], -imQ[lmIndex(l1, m1)]);
+                        const xcomplex<double> al1minusm1Q = xcomplex<double>(reQ[lmIndex(l1, -m1)], -imQ[lmIndex(l1, -m1)]);
+                        const xcomplex<double> al1m1U = xcomplex<double>(reU[lmIndex(l1, m1)], -imU[lmIndex(l1, m1)]);
+                        const xcomplex<double> al1minusm1U = xcomplex<double>(reU[lmIndex(l1, -m1)], -imU[lmIndex(l1, -m1)]);
+                        
+                        const double minus1m1 = (m1 % 2 ? -1.0 : 1.0);
+                        
+                        tPix(l1, m1) = xcomplex<double>(0, 0);
+                        reQPix(l1, m1) = 0.5 * (al1m1Q + minus1m1 * al1minusm1Q.conj());
+                        reUPix(l1, m1) = 0.5 * (al1m1U + minus1m1 * al1minusm1U.conj());
+                        bPix(l1, m1) = xcomplex<double>(0, 0);
 #ifdef CHECKS_ON
-        imQPix[i].Set(lMax, lMax);
-        imUPix[i].Set(lMax, lMax);
+                        imQPix(l1, m1) = xcomplex<double>(0, -0.5) * (al1m1Q - minus1m1 * al1minusm1Q.conj());
+                        imUPix(l1, m1) = xcomplex<double>(0, -0.5) * (al1m1U - minus1m1 * al1minusm1U.conj());
 #endif
-        for(int l1 = 0; l1 <= lMax; ++l1)
-        {
-            for(int m1 = 0; m1 <= l1; ++m1)
-            {
-                const xcomplex<double> al1m1Q = xcomplex<double>(reQMap[l1][l1 + m1][i], -imQMap[l1][l1 + m1][i]);
-                const xcomplex<double> al1minusm1Q = xcomplex<double>(reQMap[l1][l1 - m1][i], -imQMap[l1][l1 - m1][i]);
-                const xcomplex<double> al1m1U = xcomplex<double>(reUMap[l1][l1 + m1][i], -imUMap[l1][l1 + m1][i]);
-                const xcomplex<double> al1minusm1U = xcomplex<double>(reUMap[l1][l1 - m1][i], -imUMap[l1][l1 - m1][i]);
+                    }
+                }
                 
-                const double minus1m1 = (m1 % 2 ? -1.0 : 1.0);
+                Alm<xcomplex<double> >* sets[2] = {&reQPix, &reUPix};
+                rotation.rotate(2, sets);
+                
+                sht.alm2mapPol(tPix, reQPix, bPix, tPixMap, reQQPixMap, reQUPixMap);
+                sht.alm2mapPol(tPix, reUPix, bPix, tPixMap, reUQPixMap, reUUPixMap);
+                
+                reQQPixMap.swap_scheme();
+                reQUPixMap.swap_scheme();
+                reUQPixMap.swap_scheme();
+                reUUPixMap.swap_scheme();
                 
-                tPix[i](l1, m1) = xcomplex<double>(0, 0);
-                reQPix[i](l1, m1) = 0.5 * (al1m1Q + minus1m1 * al1minusm1Q.conj());
-                reUPix[i](l1, m1) = 0.5 * (al1m1U + minus1m1 * al1minusm1U.conj());
-                bPix[i](l1, m1) = xcomplex<double>(0, 0);
-#ifdef CHECKS_ON
-                imQPix[i](l1, m1) = xcomplex<double>(0, -0.5) * (al1m1Q - minus1m1 * al1minusm1Q.conj());
-                imUPix[i](l1, m1) = xcomplex<double>(0, -0.5) * (al1m1U - minus1m1 * al1minusm1U.conj());
-#endif
-            }
-        }
-    }
-    //output_screen("OK" << std::endl);
-    
-    //output_screen("Converting to pixel space for l' and m'..." << std::endl);
-    std::vector<Healpix_Map<double> > tPixMap(nPix), reQQPixMap(nPix), reQUPixMap(nPix), reUQPixMap(nPix), reUUPixMap(nPix);
 #ifdef CHECKS_ON
-    std::vector<Healpix_Map<double> > imQQPixMap(nPix), imQUPixMap(nPix), imUQPixMap(nPix), imUUPixMap(nPix);
+                Alm<xcomplex<double> >* imSets[2] = {&imQPix, &imUPix};
+                rotation.rotate(2, imSets);
+                
+                sht.alm2mapPol(tPix, imQPix, bPix, tPixMap, imQQPixMap, imQUPixMap);
+                sht.alm2mapPol(tPix, imUPix, bPix, tPixMap, imUQPixMap, imUUPixMap);
+                
+                imQQPixMap.swap_scheme();
+                imQUPixMap.swap_scheme();
+                imUQPixMap.swap_scheme();
+                imUUPixMap.swap_scheme();
 #endif
-    //ProgressMeter meter2(nPix);
-    for(int i = 0; i < nPix; ++i)
-    {
-        tPixMap[i].SetNside(nSide, RING);
-        reQQPixMap[i].SetNside(nSide, RING);
-        reQUPixMap[i].SetNside(nSide, RING);
-        reUQPixMap[i].SetNside(nSide, RING);
-        reUUPixMap[i].SetNside(nSide, RING);
-        
-        rotate_alm(tPix[i], reQPix[i], bPix[i], rotationMatrix);
-        rotate_alm(tPix[i], reUPix[i], bPix[i], rotationMatrix);
-        
-        alm2map_pol(tPix[i], reQPix[i], bPix[i], tPixMap[i], reQQPixMap[i], reQUPixMap[i]);
-        alm2map_pol(tPix[i], reUPix[i], bPix[i], tPixMap[i], reUQPixMap[i], reUUPixMap[i]);
-        
-        reQQPixMap[i].swap_scheme();
-        reQUPixMap[i].swap_scheme();
-        reUQPixMap[i].swap_scheme();
-        reUUPixMap[i].swap_scheme();
-        
+                
+                // each thread writes the QQ and UU elements (i, j) with j >= i and the QU elements (i, j) for all j, the UQ block is the transpose of QU so the threads do not overlap
+                for(int j = 0; j < nPix; ++j)
+                {
+                    if(j >= i)
+                    {
+                        mat->element(i, j) = reQQPixMap[j];
+                        mat->element(nPix + i, nPix + j) = reUUPixMap[j];
+                    }
+                    mat->element(i, nPix + j) = reQUPixMap[j];
+                    
+                    check(Math::areEqual(imQQPixMap[j], 0.0, 1e-15), "");
+                    check(Math::areEqual(imQUPixMap[j], 0.0, 1e-15), "");
+                    check(Math::areEqual(imUQPixMap[j], 0.0, 1e-15), "");
+                    check(Math::areEqual(imUUPixMap[j], 0.0, 1e-15), "");
+                }
+                
+                reQQPixMap.swap_scheme();
+                reQUPixMap.swap_scheme();
+                reUQPixMap.swap_scheme();
+                reUUPixMap.swap_scheme();
 #ifdef CHECKS_ON
-        imQQPixMap[i].SetNside(nSide, RING);
-        imQUPixMap[i].SetNside(nSide, RING);
-        imUQPixMap[i].SetNside(nSide, RING);
-        imUUPixMap[i].SetNside(nSide, RING);
-        
-        rotate_alm(tPix[i], imQPix[i], bPix[i], rotationMatrix);
-        rotate_alm(tPix[i], imUPix[i], bPix[i], rotationMatrix);
-        
-        alm2map_pol(tPix[i], imQPix[i], bPix[i], tPixMap[i], imQQPixMap[i], imQUPixMap[i]);
-        alm2map_pol(tPix[i], imUPix[i], bPix[i], tPixMap[i], imUQPixMap[i], imUUPixMap[i]);
-        
-        imQQPixMap[i].swap_scheme();
-        imQUPixMap[i].swap_scheme();
-        imUQPixMap[i].swap_scheme();
-        imUUPixMap[i].swap_scheme();
+                imQQPixMap.swap_scheme();
+                imQUPixMap.swap_scheme();
+                imUQPixMap.swap_scheme();
+                imUUPixMap.swap_scheme();
 #endif
-        //meter2.advance();
-    }
-    //output_screen("OK" << std::endl);
-    
-    for(int j = 0; j < nPix; ++j)
-    {
-        for(int i = 0; i < nPix; ++i)
-        {
-            mat->element(i, j) = reQQPixMap[i][j];
-            mat->element(i, nPix + j) = reQUPixMap[i][j];
-            mat->element(nPix + i, j) = reUQPixMap[i][j];
-            mat->element(nPix + i, nPix + j) = reUUPixMap[i][j];
-            
-            check(Math::areEqual(reQQPixMap[i][j], reQQPixMap[j][i], 1e-7), reQQPixMap[i][j] << ' ' << reQQPixMap[j][i]);
-            check(Math::areEqual(reQUPixMap[i][j], reUQPixMap[j][i], 1e-7), i << ' ' << j << ' ' << reQUPixMap[i][j] << ' ' << reUQPixMap[j][i]);
-            check(Math::areEqual(reUUPixMap[i][j], reUUPixMap[j][i], 1e-7), "");
-            
-            check(Math::areEqual(imQQPixMap[i][j], 0.0, 1e-15), "");
-            check(Math::areEqual(imQUPixMap[i][j], 0.0, 1e-15), "");
-            check(Math::areEqual(imUQPixMap[i][j], 0.0, 1e-15), "");
-            check(Math::areEqual(imUUPixMap[i][j], 0.0, 1e-15), "");
+            } catch (std::exception& e)
+            {
+                setError(error, e);
+            }
         }
     }
+    throwIfError(error);
     
     return mat;
 }
@@ -727,7 +1095,11 @@ CMatrixGenerator::getFiducialMatrix(const std::vector<double>& cl, long nSide, i
     CMatrix* fiducialMat = new CMatrix(nPix);
     fiducialMat->comment() = "fiducial matrix";
     
-    Math::Legendre legendre;
+    std::vector<double> clBeam(lMaxMax + 1, 0);
+    for(int l = lMax + 1; l <= lMaxMax; ++l)
+        clBeam[l] = cl[l] * ((2 * l + 1) / (4 * Math::pi)) * beam[l] * beam[l];
+    
+    std::vector<double> legendre(lMaxMax + 1);
     ProgressMeter meter(nPix * (nPix + 1) / 2);
     
     for(int j = 0; j < nPix; ++j)
@@ -753,10 +1125,13 @@ CMatrixGenerator::getFiducialMatrix(const std::vector<double>& cl, long nSide, i
             }
             
             double element = 0;
-            for(int l = lMax + 1; l <= lMaxMax; ++l)
+            if(lp)
+                element = lp->sum(j, i, &(clBeam[0]), lMax + 1, lMaxMax);
+            else
             {
-                const double leg = (lp ? lp->value(l, j, i) : legendre.calculate(l, dot));
-                element += cl[l] * ((2 * l + 1) / (4 * Math::pi)) * leg * beam[l] * beam[l];
+                Math::Legendre::calculateAll(lMaxMax, dot, &(legendre[0]));
+                for(int l = lMax + 1; l <= lMaxMax; ++l)
+                    element += clBeam[l] * legendre[l];
             }
             
             //marginalize monopole and dipole
@@ -772,9 +1147,9 @@ CMatrixGenerator::getFiducialMatrix(const std::vector<double>& cl, long nSide, i
 }
 
 CMatrix*
-CMatrixGenerator::generateNoiseMatrix(long nSide, double noise)
+CMatrixGenerator::generateNoiseMatrix(long nSide, double noise, const std::vector<int>* goodPixels)
 {
-    const int nPix = (int)nside2npix(nSide);
+    const int nPix = (goodPixels ? goodPixels->size() : (int)nside2npix(nSide));
     
     CMatrix* mat = new CMatrix(nPix);
     mat->comment() = "noise matrix";
@@ -787,8 +1162,10 @@ CMatrixGenerator::generateNoiseMatrix(long nSide, double noise)
 }
 
 CMatrix*
-CMatrixGenerator::calculateNoiseMatrix(const char* maskFileName, const char* noiseDataFileName, double sigma0, double fwhm, long nSideOriginal, double fwhmOriginal)
+CMatrixGenerator::calculateNoiseMatrix(const char* maskFileName, const char* noiseDataFileName, double sigma0, double fwhm, long nSideOriginal, double fwhmOriginal, int nSims, unsigned long seed)
 {
+    check(nSims > 1, "need at least 2 simulations, " << nSims << " given");
+
     StandardException exc;
     
     long nSide;
@@ -832,16 +1209,17 @@ CMatrixGenerator::calculateNoiseMatrix(const char* maskFileName, const char* noi
         noiseMap[i] = sigma0 / std::sqrt(nObs);
     }
     
-    const int N = 1000;
-    
-    std::vector<Healpix_Map<double> > noiseSimLowRes(N);
-    
-    arr<double> weight(2 * nSideOriginal);
-    
-    for(int i = 0; i < 2 * nSideOriginal; ++i)
-        weight[i] = 1;
-    
-    Math::GaussianGenerator generator(std::time(0), 0, 1);
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = mpi.numProcesses(), processId = mpi.processId();
+
+    // all of the processes need the same seed for the streams of the simulations to be independent
+    if(seed == 0)
+    {
+        long s = long(std::time(0));
+        if(nProcesses > 1)
+            mpi.bcast(&s, 1, CosmoMPI::LONG);
+        seed = (unsigned long) s;
+    }
     
     const int lMax = 2 * nSide;
     output_screen("Reading the pixel window functions..." << std::endl);
@@ -851,74 +1229,110 @@ CMatrixGenerator::calculateNoiseMatrix(const char* maskFileName, const char* noi
     
     output_screen("OK" << std::endl);
     
-    output_screen("Simulating " << N << " instances of noise..." << std::endl);
-    ProgressMeter meter(N);
-    for(int i = 0; i < N; ++i)
+    // the upper triangle of the sum of the products of the pixel pairs, and the sum of each pixel
+    const unsigned long triangleSize = (unsigned long)(goodPixelsSize) * (goodPixelsSize + 1) / 2;
+    std::vector<double> sum(goodPixelsSize, 0), sumSq(triangleSize, 0);
+    std::string error;
+
+    // the transforms are shared by all of the threads
+    const SphericalHarmonicTransform shtOriginal(nSideOriginal, lMax), sht(nSide, lMax);
+
+    output_screen("Simulating " << nSims << " instances of noise..." << std::endl);
+
+    // the simulations are split between the processes and then between the threads, each thread has its own maps and accumulators, the simulated maps are never stored
+#pragma omp parallel default(shared)
     {
-        Healpix_Map<double> noiseSim;
-        noiseSim.SetNside(nSideOriginal, NEST);
-        for(int j = 0; j < nPixOriginal; ++j)
-        {
-            noiseSim[j] = generator.generate() * noiseMap[j];
-        }
-        noiseSim.swap_scheme();
+        // the maps keep their memory between the simulations, SetNside only resets the scheme
+        Healpix_Map<double> noiseSim, noiseSimLowRes;
         Alm<xcomplex<double> > alm(lMax, lMax);
-        map2alm_iter(noiseSim, alm, 10, weight);
-        
-        for(int l = 0; l <= lMax; ++l)
+        std::vector<double> gaussian(nPixOriginal), good(goodPixelsSize);
+        std::vector<double> threadSum(goodPixelsSize, 0), threadSumSq(triangleSize, 0);
+
+#pragma omp for schedule(dynamic)
+        for(int i = processId; i < nSims; i += nProcesses)
         {
-            for(int m = 0; m <= l; ++m)
+            try {
+                // the random stream depends only on the index of the simulation, so the result does not depend on the number of processes or threads
+                Math::GaussianStreamGenerator generator(seed, (unsigned long)(i), 0, 1);
+                generator.generate(nPixOriginal, &(gaussian[0]));
+
+                noiseSim.SetNside(nSideOriginal, NEST);
+                for(long j = 0; j < nPixOriginal; ++j)
+                    noiseSim[j] = gaussian[j] * noiseMap[j];
+                noiseSim.swap_scheme();
+                shtOriginal.map2almIter(noiseSim, alm, 10);
+                
+                for(int l = 0; l <= lMax; ++l)
+                {
+                    for(int m = 0; m <= l; ++m)
+                    {
+                        alm(l, m) *= (beam[l] / originalBeam[l]);
+                    }
+                }
+                
+                noiseSimLowRes.SetNside(nSide, RING);
+                sht.alm2map(alm, noiseSimLowRes);
+                noiseSimLowRes.swap_scheme();
+
+                for(int j = 0; j < goodPixelsSize; ++j)
+                    good[j] = noiseSimLowRes[goodPixels[j]];
+
+                unsigned long k = 0;
+                for(int j = 0; j < goodPixelsSize; ++j)
+                {
+                    threadSum[j] += good[j];
+                    const double gj = good[j];
+                    double* row = &(threadSumSq[k]);
+#pragma omp simd
+                    for(int l = j; l < goodPixelsSize; ++l)
+                        row[l - j] += gj * good[l];
+                    k += goodPixelsSize - j;
+                }
+            } catch (std::exception& e)
             {
-                alm(l, m) *= (beam[l] / originalBeam[l]);
+                setError(error, e);
             }
         }
-        
-        noiseSimLowRes[i].SetNside(nSide, RING);
-        alm2map(alm, noiseSimLowRes[i]);
-        noiseSimLowRes[i].swap_scheme();
-        meter.advance();
+
+#pragma omp critical (c_matrix_generator_noise_sums)
+        {
+            for(int j = 0; j < goodPixelsSize; ++j)
+                sum[j] += threadSum[j];
+            for(unsigned long k = 0; k < triangleSize; ++k)
+                sumSq[k] += threadSumSq[k];
+        }
     }
+    throwIfError(error);
     output_screen("OK" << std::endl);
+
+    if(nProcesses > 1)
+    {
+        mpi.allreduce(&(sum[0]), &(sum[0]), goodPixelsSize, CosmoMPI::SUM);
+        mpi.allreduce(&(sumSq[0]), &(sumSq[0]), triangleSize, CosmoMPI::SUM);
+    }
     
-    double averageNoise = 0;
-    double maxAvgPerPixel = 0;
     output_screen("Averaging out the simulations..." << std::endl);
     
+    unsigned long k = 0;
     for(int i = 0; i < goodPixelsSize; ++i)
     {
         for(int j = i; j < goodPixelsSize; ++j)
         {
-            double element = 0;
-            for(int k = 0; k < N; ++k)
-                element += noiseSimLowRes[k][goodPixels[i]] * noiseSimLowRes[k][goodPixels[j]];
-            
-            element /= N;
-            
+            const double element = sumSq[k++] / nSims;
             noiseMatrix->element(i, j) = element;
             noiseMatrix->element(j, i) = element;
         }
     }
+
+    double averageNoise = 0;
+    double maxAvgPerPixel = 0;
     for(int j = 0; j < goodPixelsSize; ++j)
     {
-        double avg = 0;
-        for(int i = 0; i < N; ++i)
-            avg += noiseSimLowRes[i][goodPixels[j]];
-        
-        avg /= N;
+        const double avg = sum[j] / nSims;
         if(std::abs(avg) > maxAvgPerPixel)
             maxAvgPerPixel = std::abs(avg);
-        
-        /*double sigma = 0;
-        for(int i = 0; i < N; ++i)
-        {
-            const double diff = noiseSimLowRes[i][goodPixels[j]] - avg;
-            sigma += diff * diff;
-        }
-        
-        sigma /= (N - 1);
-        
-        averageNoise += std::sqrt(sigma);
-        noiseMatrix->element(j, j) = sigma;*/
+
+        averageNoise += std::sqrt(noiseMatrix->element(j, j));
     }
     averageNoise /= goodPixelsSize;
     output_screen("Average noise per pixel is " << averageNoise << std::endl);
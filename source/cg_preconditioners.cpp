@@ -0,0 +1,139 @@
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <vector_kernels.hpp>
+#include <cg_preconditioners.hpp>
+
+namespace Math
+{
+
+void
+DiagonalPreconditioner::set(const std::vector<double>& diagonal)
+{
+    inv_.resize(diagonal.size());
+    for(int i = 0; i < diagonal.size(); ++i)
+    {
+        check(diagonal[i] > 0, "the diagonal element " << i << " = " << diagonal[i] << " must be positive");
+        inv_[i] = 1.0 / diagonal[i];
+    }
+}
+
+void
+DiagonalPreconditioner::apply(const double* x, double* y) const
+{
+    const long n = long(inv_.size());
+#pragma omp parallel for simd if(n >= VectorKernels::parallelSize)
+    for(long i = 0; i < n; ++i)
+        y[i] = inv_[i] * x[i];
+}
+
+BlockPreconditioner::BlockPreconditioner(const std::vector<int>& blockSizes) : sizes_(blockSizes), start_(blockSizes.size() + 1), offset_(blockSizes.size() + 1)
+{
+    check(!sizes_.empty(), "no blocks");
+
+    start_[0] = 0;
+    offset_[0] = 0;
+    for(int k = 0; k < sizes_.size(); ++k)
+    {
+        check(sizes_[k] > 0, "invalid block size " << sizes_[k]);
+        start_[k + 1] = start_[k] + sizes_[k];
+        offset_[k + 1] = offset_[k] + (unsigned long)(sizes_[k]) * sizes_[k];
+    }
+
+    // unit blocks
+    factors_.resize(offset_.back(), 0);
+    for(int k = 0; k < sizes_.size(); ++k)
+    {
+        for(int i = 0; i < sizes_[k]; ++i)
+            factors_[offset_[k] + i * sizes_[k] + i] = 1;
+    }
+}
+
+std::vector<int>
+BlockPreconditioner::harmonicBlocks(int lMax, int lMin)
+{
+    check(lMin >= 0, "invalid lMin = " << lMin);
+    check(lMax >= lMin, "invalid lMax = " << lMax);
+
+    std::vector<int> sizes;
+    for(int l = lMin; l <= lMax; ++l)
+        sizes.push_back(2 * l + 1);
+    return sizes;
+}
+
+void
+BlockPreconditioner::setBlock(int k, const double* block)
+{
+    check(k >= 0 && k < numBlocks(), "invalid block " << k);
+
+    const int n = sizes_[k];
+    double* l = &(factors_[offset_[k]]);
+    std::fill(l, l + n * n, 0.0);
+
+    // Cholesky, block = L L^T with L lower triangular
+    for(int j = 0; j < n; ++j)
+    {
+        double d = block[j * n + j];
+        for(int p = 0; p < j; ++p)
+            d -= l[j * n + p] * l[j * n + p];
+
+        if(!(d > 0))
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Block " << k << " of the preconditioner is not positive definite.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        const double ljj = std::sqrt(d);
+        l[j * n + j] = ljj;
+        for(int i = j + 1; i < n; ++i)
+        {
+            double s = block[i * n + j];
+            for(int p = 0; p < j; ++p)
+                s -= l[i * n + p] * l[j * n + p];
+            l[i * n + j] = s / ljj;
+        }
+    }
+}
+
+void
+BlockPreconditioner::apply(const double* x, double* y) const
+{
+#pragma omp parallel default(shared)
+    {
+        std::vector<double> z;
+
+#pragma omp for schedule(dynamic)
+        for(int k = 0; k < numBlocks(); ++k)
+        {
+            const int n = sizes_[k];
+            const double* l = &(factors_[offset_[k]]);
+            const double* xk = x + start_[k];
+            double* yk = y + start_[k];
+            z.resize(n);
+
+            // L z = x, then L^T y = z
+            for(int i = 0; i < n; ++i)
+            {
+                double s = xk[i];
+                for(int p = 0; p < i; ++p)
+                    s -= l[i * n + p] * z[p];
+                z[i] = s / l[i * n + i];
+            }
+            for(int i = n - 1; i >= 0; --i)
+            {
+                double s = z[i];
+                for(int p = i + 1; p < n; ++p)
+                    s -= l[p * n + i] * yk[p];
+                yk[i] = s / l[i * n + i];
+            }
+        }
+    }
+}
+
+} // namespace Math
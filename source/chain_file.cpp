@@ -0,0 +1,531 @@
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <memory>
+
+#include <sys/mman.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <chain_file.hpp>
+
+namespace
+{
+
+const char binaryChainMagic[8] = {'C', 'O', 'S', 'M', 'O', 'C', 'H', 'N'};
+const char sharedChainMagic[8] = {'C', 'O', 'S', 'M', 'O', 'S', 'H', 'C'};
+const char compressedChainMagic[8] = {'C', 'O', 'S', 'M', 'O', 'C', 'H', 'Z'};
+
+// the header of the binary chain files, also used for the compressed ones with a different magic string
+void
+writeChainHeader(std::ofstream& out, const char* magic, int version, const std::vector<std::string>& paramNames)
+{
+    const int nParams = paramNames.size();
+
+    long offset = 8 + 2 * sizeof(int) + sizeof(long);
+    for(int i = 0; i < nParams; ++i)
+        offset += sizeof(int) + paramNames[i].size();
+
+    // align the records to 8 bytes
+    const int padding = (8 - offset % 8) % 8;
+    offset += padding;
+
+    out.write(magic, 8);
+    out.write((const char*)(&version), sizeof(int));
+    out.write((const char*)(&nParams), sizeof(int));
+    out.write((const char*)(&offset), sizeof(long));
+    for(int i = 0; i < nParams; ++i)
+    {
+        const int length = paramNames[i].size();
+        out.write((const char*)(&length), sizeof(int));
+        out.write(paramNames[i].c_str(), length);
+    }
+
+    const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    out.write(zeros, padding);
+}
+
+long
+readChainHeader(std::ifstream& in, const char* magic, int version, std::vector<std::string>& paramNames, const char* fileName, const char* kind)
+{
+    StandardException exc;
+
+    char fileMagic[8];
+    in.read(fileMagic, 8);
+    if(!in || std::memcmp(fileMagic, magic, 8) != 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " is not a " << kind << " file.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    int v, nParams;
+    long offset;
+    in.read((char*)(&v), sizeof(int));
+    in.read((char*)(&nParams), sizeof(int));
+    in.read((char*)(&offset), sizeof(long));
+
+    if(!in || v != version || nParams < 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Invalid header in the " << kind << " file " << fileName << ". Version " << v << " (expected " << version << "), " << nParams << " parameters.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    paramNames.resize(nParams);
+    for(int i = 0; i < nParams; ++i)
+    {
+        int length;
+        in.read((char*)(&length), sizeof(int));
+        if(!in || length < 0 || length > 100000)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid parameter name in the " << kind << " file " << fileName << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        std::vector<char> name(length + 1, 0);
+        in.read(&(name[0]), length);
+        paramNames[i] = std::string(&(name[0]));
+    }
+
+    in.seekg(offset, std::ios::beg);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The " << kind << " file " << fileName << " has an incomplete header.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    return offset;
+}
+
+void
+writeTextRecord(std::ofstream& out, const double* record, int nParams)
+{
+    out << record[0] << "   " << record[1];
+    for(int i = 0; i < nParams; ++i)
+        out << "   " << record[2 + i];
+    out << '\n';
+}
+
+} // namespace
+
+const int BinaryChain::version;
+const int SharedBinaryChain::version;
+const int SharedBinaryChain::defaultBlockRecords;
+const int CompressedBinaryChain::version;
+const int CompressedBinaryChain::defaultBlockRecords;
+
+bool
+BinaryChain::isBinary(const char* fileName)
+{
+    return Math::MappedFile::hasMagic(fileName, binaryChainMagic);
+}
+
+void
+BinaryChain::writeHeader(std::ofstream& out, const std::vector<std::string>& paramNames)
+{
+    writeChainHeader(out, binaryChainMagic, version, paramNames);
+}
+
+long
+BinaryChain::readHeader(std::ifstream& in, std::vector<std::string>& paramNames, const char* fileName)
+{
+    return readChainHeader(in, binaryChainMagic, version, paramNames, fileName, "binary chain");
+}
+
+void
+BinaryChain::writeFile(const char* fileName, const std::vector<std::string>& paramNames, const double* records, unsigned long nRecords)
+{
+    Math::ReplacingOutputFile out(fileName);
+    writeHeader(out.stream(), paramNames);
+    out.stream().write((const char*)records, nRecords * recordSize(paramNames.size()));
+    out.commit();
+}
+
+unsigned long
+BinaryChain::convertFromText(const char* textFileName, const char* binaryFileName, const std::vector<std::string>& paramNames)
+{
+    StandardException exc;
+    std::ifstream in(textFileName);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << textFileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    const int nParams = paramNames.size();
+    std::vector<double> records;
+    std::vector<double> record(2 + nParams);
+    std::string line;
+    unsigned long count = 0;
+    while(std::getline(in, line))
+    {
+        if(line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        std::stringstream str(line);
+        for(int i = 0; i < 2 + nParams; ++i)
+            str >> record[i];
+
+        if(!str)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid line " << count + 1 << " in the text chain file " << textFileName << ", expected " << 2 + nParams << " columns.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        records.insert(records.end(), record.begin(), record.end());
+        ++count;
+    }
+    in.close();
+
+    writeFile(binaryFileName, paramNames, (records.empty() ? NULL : &(records[0])), count);
+    return count;
+}
+
+unsigned long
+BinaryChain::convertToText(const char* binaryFileName, const char* textFileName, const char* paramNamesFileName)
+{
+    StandardException exc;
+    std::ifstream in(binaryFileName, std::ios::in | std::ios::binary);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << binaryFileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    // compressed chains are decompressed one block at a time
+    std::unique_ptr<MappedCompressedBinaryChain> compressed;
+    std::vector<std::string> paramNames;
+    if(CompressedBinaryChain::isCompressed(binaryFileName))
+    {
+        in.close();
+        compressed.reset(new MappedCompressedBinaryChain(binaryFileName));
+        paramNames = compressed->paramNames();
+    }
+    else
+        readHeader(in, paramNames, binaryFileName);
+    const int nParams = paramNames.size();
+
+    std::ofstream out(textFileName);
+    if(!out)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << textFileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(paramNamesFileName)
+    {
+        std::ofstream outPar(paramNamesFileName);
+        if(!outPar)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot write into paramnames file " << paramNamesFileName << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        for(int i = 0; i < nParams; ++i)
+            outPar << paramNames[i] << '\t' << paramNames[i] << std::endl;
+        outPar.close();
+    }
+
+    out << std::setprecision(15);
+
+    if(compressed)
+    {
+        const CompressedRecords& records = compressed->records();
+        std::vector<double> block;
+        for(unsigned long b = 0; b < records.nBlocks(); ++b)
+        {
+            block.resize(records.blockSize(b) * (2 + nParams));
+            records.decompressBlock(b, &(block[0]));
+            for(unsigned long i = 0; i < records.blockSize(b); ++i)
+                writeTextRecord(out, &(block[i * (2 + nParams)]), nParams);
+        }
+        out.close();
+        return records.size();
+    }
+
+    std::vector<double> record(2 + nParams);
+    unsigned long count = 0;
+    while(in.read((char*)(&(record[0])), recordSize(nParams)))
+    {
+        writeTextRecord(out, &(record[0]), nParams);
+        ++count;
+    }
+
+    // a partially written last record (for example if the run was interrupted) is ignored
+    if(in.gcount() != 0)
+    {
+        output_screen("WARNING: the last record in " << binaryFileName << " is incomplete and has been ignored." << std::endl);
+    }
+
+    out.close();
+    return count;
+}
+
+MappedBinaryChain::MappedBinaryChain(const char* fileName, unsigned long burnin, unsigned int thin) : data_(NULL), stride_(0), size_(0)
+{
+    check(thin > 0, "thin factor cannot be 0");
+
+    StandardException exc;
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    const long offset = BinaryChain::readHeader(in, paramNames_, fileName);
+    in.close();
+
+    file_.map(fileName, Math::MappedFile::wholeFile, "binary chain");
+
+    const long recSize = BinaryChain::recordSize(nParams());
+    const unsigned long nRecords = (file_.size() > offset ? (file_.size() - offset) / recSize : 0);
+
+    if(nRecords > burnin)
+        size_ = (nRecords - burnin - 1) / thin + 1;
+
+    if(size_ == 0)
+        return;
+
+    // the records are read in order, let the kernel read ahead
+    madvise(file_.data(), file_.size(), MADV_SEQUENTIAL);
+
+    stride_ = long(thin) * (2 + nParams());
+    data_ = (const double*)((const char*)file_.data() + offset) + burnin * (2 + nParams());
+}
+
+bool
+SharedBinaryChain::isShared(const char* fileName)
+{
+    return Math::MappedFile::hasMagic(fileName, sharedChainMagic);
+}
+
+std::string
+SharedBinaryChain::header(const std::vector<std::string>& paramNames, int nChains, int blockRecords, Layout& layout)
+{
+    check(nChains > 0, "invalid number of chains " << nChains);
+    check(blockRecords > 0, "invalid block size " << blockRecords);
+
+    const int nParams = paramNames.size();
+
+    long offset = 8 + 4 * sizeof(int) + 2 * sizeof(long);
+    for(int i = 0; i < nParams; ++i)
+        offset += sizeof(int) + paramNames[i].size();
+
+    // align the counts and the records to 8 bytes
+    const int padding = (8 - offset % 8) % 8;
+
+    layout.paramNames = paramNames;
+    layout.nChains = nChains;
+    layout.blockRecords = blockRecords;
+    layout.countsOffset = offset + padding;
+    layout.dataOffset = layout.countsOffset + nChains * long(sizeof(long));
+
+    std::stringstream out(std::ios::out | std::ios::binary);
+    out.write(sharedChainMagic, 8);
+    out.write((const char*)(&version), sizeof(int));
+    out.write((const char*)(&nParams), sizeof(int));
+    out.write((const char*)(&nChains), sizeof(int));
+    out.write((const char*)(&blockRecords), sizeof(int));
+    out.write((const char*)(&(layout.countsOffset)), sizeof(long));
+    out.write((const char*)(&(layout.dataOffset)), sizeof(long));
+    for(int i = 0; i < nParams; ++i)
+    {
+        const int length = paramNames[i].size();
+        out.write((const char*)(&length), sizeof(int));
+        out.write(paramNames[i].c_str(), length);
+    }
+
+    const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    out.write(zeros, padding);
+
+    const std::vector<long> counts(nChains, 0);
+    out.write((const char*)(&(counts[0])), nChains * sizeof(long));
+
+    return out.str();
+}
+
+void
+SharedBinaryChain::readHeader(std::ifstream& in, Layout& layout, std::vector<unsigned long>& counts, const char* fileName)
+{
+    StandardException exc;
+
+    char magic[8];
+    in.read(magic, 8);
+    if(!in || std::memcmp(magic, sharedChainMagic, 8) != 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " is not a shared chain file.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    int v, nParams;
+    in.read((char*)(&v), sizeof(int));
+    in.read((char*)(&nParams), sizeof(int));
+    in.read((char*)(&(layout.nChains)), sizeof(int));
+    in.read((char*)(&(layout.blockRecords)), sizeof(int));
+    in.read((char*)(&(layout.countsOffset)), sizeof(long));
+    in.read((char*)(&(layout.dataOffset)), sizeof(long));
+
+    if(!in || v != version || nParams < 0 || layout.nChains <= 0 || layout.blockRecords <= 0 || layout.dataOffset != layout.countsOffset + layout.nChains * long(sizeof(long)))
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Invalid header in the shared chain file " << fileName << ". Version " << v << " (expected " << version << "), " << nParams << " parameters, " << layout.nChains << " chains.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    layout.paramNames.resize(nParams);
+    for(int i = 0; i < nParams; ++i)
+    {
+        int length;
+        in.read((char*)(&length), sizeof(int));
+        if(!in || length < 0 || length > 100000)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid parameter name in the shared chain file " << fileName << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        std::vector<char> name(length + 1, 0);
+        in.read(&(name[0]), length);
+        layout.paramNames[i] = std::string(&(name[0]));
+    }
+
+    std::vector<long> c(layout.nChains);
+    in.seekg(layout.countsOffset, std::ios::beg);
+    in.read((char*)(&(c[0])), layout.nChains * sizeof(long));
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The shared chain file " << fileName << " has an incomplete header.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    counts.resize(layout.nChains);
+    for(int i = 0; i < layout.nChains; ++i)
+        counts[i] = (c[i] > 0 ? c[i] : 0);
+}
+
+MappedSharedBinaryChain::MappedSharedBinaryChain(const char* fileName)
+{
+    StandardException exc;
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    SharedBinaryChain::readHeader(in, layout_, counts_, fileName);
+    in.close();
+
+    file_.map(fileName, Math::MappedFile::wholeFile, "shared chain");
+
+    // only the complete records, the counts are written after the records but a write may have been interrupted
+    const long recSize = BinaryChain::recordSize(nParams());
+    for(int c = 0; c < nChains(); ++c)
+    {
+        while(counts_[c] > 0 && (unsigned long)(layout_.recordOffset(c, counts_[c] - 1) + recSize) > file_.size())
+            --counts_[c];
+    }
+}
+
+bool
+CompressedBinaryChain::isCompressed(const char* fileName)
+{
+    return Math::MappedFile::hasMagic(fileName, compressedChainMagic);
+}
+
+void
+CompressedBinaryChain::writeFile(const char* fileName, const std::vector<std::string>& paramNames, const double* records, unsigned long nRecords, BlockCompression::Codec codec, int blockRecords)
+{
+    check(blockRecords > 0, "invalid number of records in a block " << blockRecords);
+
+    // compress first, so that an unavailable codec doesn't leave a file behind
+    std::vector<char> compressed;
+    BlockCompression::compressRecords(codec, records, nRecords, 2 + paramNames.size(), blockRecords, compressed);
+
+    Math::ReplacingOutputFile out(fileName);
+    writeChainHeader(out.stream(), compressedChainMagic, version, paramNames);
+    out.stream().write(&(compressed[0]), compressed.size());
+    out.commit();
+}
+
+unsigned long
+CompressedBinaryChain::compress(const char* binaryFileName, const char* compressedFileName, BlockCompression::Codec codec, int blockRecords)
+{
+    MappedBinaryChain mapped(binaryFileName);
+    writeFile(compressedFileName, mapped.paramNames(), (mapped.size() ? mapped.record(0) : NULL), mapped.size(), codec, blockRecords);
+    return mapped.size();
+}
+
+unsigned long
+CompressedBinaryChain::decompress(const char* compressedFileName, const char* binaryFileName)
+{
+    MappedCompressedBinaryChain mapped(compressedFileName);
+    std::vector<double> records(mapped.size() * (2 + mapped.nParams()));
+    if(!records.empty())
+        mapped.records().decompress(&(records[0]));
+    BinaryChain::writeFile(binaryFileName, mapped.paramNames(), (records.empty() ? NULL : &(records[0])), mapped.size());
+    return mapped.size();
+}
+
+MappedCompressedBinaryChain::MappedCompressedBinaryChain(const char* fileName) : records_(NULL)
+{
+    StandardException exc;
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    const long offset = readChainHeader(in, compressedChainMagic, CompressedBinaryChain::version, paramNames_, fileName, "compressed chain");
+    in.close();
+
+    file_.map(fileName, Math::MappedFile::wholeFile, "compressed chain");
+    if(file_.size() <= offset)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The compressed chain file " << fileName << " has no data.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    records_ = new CompressedRecords((const char*)file_.data() + offset, file_.size() - offset, fileName);
+    if(records_->recordLength() != 2 + nParams())
+    {
+        const int recordLength = records_->recordLength();
+        delete records_;
+        std::stringstream exceptionStr;
+        exceptionStr << "The compressed chain file " << fileName << " has records of length " << recordLength << ", expected " << 2 + nParams() << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+MappedCompressedBinaryChain::~MappedCompressedBinaryChain()
+{
+    delete records_;
+}
@@ -0,0 +1,155 @@
+#include <csignal>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <checkpoint_coordinator.hpp>
+
+namespace
+{
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+extern "C" void checkpointSignalHandler(int)
+{
+    stopRequested = 1;
+}
+
+} // namespace
+
+std::mutex CheckpointCoordinator::mutex_;
+std::vector<CheckpointCoordinator::Checkpointable*> CheckpointCoordinator::objects_;
+bool CheckpointCoordinator::installed_ = false;
+bool CheckpointCoordinator::flushed_ = false;
+
+void
+CheckpointCoordinator::install()
+{
+    installSignal(SIGTERM);
+    installSignal(SIGINT);
+    installSignal(SIGHUP);
+    installSignal(SIGUSR1);
+    installSignal(SIGUSR2);
+}
+
+void
+CheckpointCoordinator::installSignal(int signal)
+{
+    struct sigaction action;
+    action.sa_handler = checkpointSignalHandler;
+    sigemptyset(&action.sa_mask);
+    // the interrupted system calls (for example the writes of the chain files) are restarted, and the second signal is not trapped anymore
+    action.sa_flags = SA_RESTART | SA_RESETHAND;
+
+    const int res = sigaction(signal, &action, NULL);
+    check(res == 0, "cannot trap the signal " << signal);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    installed_ = true;
+}
+
+bool
+CheckpointCoordinator::isInstalled()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return installed_;
+}
+
+bool
+CheckpointCoordinator::requested()
+{
+    return stopRequested != 0;
+}
+
+bool
+CheckpointCoordinator::requestedEverywhere()
+{
+    int mine = (requested() ? 1 : 0);
+    int any = mine;
+    CosmoMPI::create().allreduce(&mine, &any, 1, CosmoMPI::MAX);
+
+    // so that the processes that didn't get the signal also know why the run has stopped
+    if(any)
+        stopRequested = 1;
+
+    return any != 0;
+}
+
+void
+CheckpointCoordinator::request()
+{
+    stopRequested = 1;
+}
+
+void
+CheckpointCoordinator::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopRequested = 0;
+    flushed_ = false;
+}
+
+void
+CheckpointCoordinator::add(Checkpointable* object)
+{
+    check(object, "");
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(std::find(objects_.begin(), objects_.end(), object) == objects_.end())
+        objects_.push_back(object);
+}
+
+void
+CheckpointCoordinator::remove(Checkpointable* object)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    objects_.erase(std::remove(objects_.begin(), objects_.end(), object), objects_.end());
+}
+
+void
+CheckpointCoordinator::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(flushed_)
+        return;
+
+    flushed_ = true;
+
+    if(objects_.empty())
+        return;
+
+    output_screen("Writing the checkpoints of " << objects_.size() << " object(s)..." << std::endl);
+
+    // all of the objects are written at the same time, a failing one does not stop the others
+    std::vector<bool> started(objects_.size(), false);
+    for(int i = 0; i < objects_.size(); ++i)
+    {
+        try
+        {
+            objects_[i]->startFlush();
+            started[i] = true;
+        }
+        catch (std::exception& e)
+        {
+            output_screen("WARNING: writing a checkpoint failed: " << e.what() << std::endl);
+        }
+    }
+
+    for(int i = 0; i < objects_.size(); ++i)
+    {
+        if(!started[i])
+            continue;
+
+        try
+        {
+            objects_[i]->finishFlush();
+        }
+        catch (std::exception& e)
+        {
+            output_screen("WARNING: writing a checkpoint failed: " << e.what() << std::endl);
+        }
+    }
+
+    output_screen("OK" << std::endl);
+}
+
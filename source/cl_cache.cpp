@@ -0,0 +1,241 @@
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <algorithm>
+
+#include <cosmo_mpi.hpp>
+#include <macros.hpp>
+#include <cl_cache.hpp>
+
+namespace
+{
+
+// the header of the node shared memory: the capacity, the maximum key size and the maximum value size, set by the node master
+const unsigned long sharedHeaderSize = 64;
+
+struct SharedHeader
+{
+    unsigned long capacity;
+    unsigned long maxKeySize;
+    unsigned long maxValueSize;
+};
+
+// each slot starts with a sequence number, odd while the slot is being written (a seqlock), 0 if the slot is empty
+std::atomic<unsigned long>&
+slotSequence(double* slot)
+{
+    return *reinterpret_cast<std::atomic<unsigned long>*>(slot);
+}
+
+unsigned long
+hashKey(const std::vector<double>& key)
+{
+    // FNV-1a over the bytes of the key
+    unsigned long h = 14695981039346656037UL;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(&(key[0]));
+    for(unsigned long i = 0; i < key.size() * sizeof(double); ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+} // namespace
+
+ClCache::ClCache(unsigned long capacity) : capacity_(capacity), hits_(0), sharedHits_(0), misses_(0), sharedWindow_(NULL), sharedBase_(NULL), sharedCapacity_(0), maxKeySize_(0), maxValueSize_(0)
+{
+    check(capacity > 0, "invalid capacity " << capacity);
+}
+
+ClCache::~ClCache()
+{
+    // all of the processes on the node need to get here, the shared memory is freed once nobody uses it
+    if(sharedWindow_)
+        CosmoMPI::create().freeNodeShared(sharedWindow_);
+}
+
+void
+ClCache::useNodeSharedStorage(unsigned long capacity, int maxKeySize, int maxValueSize)
+{
+    check(capacity > 0, "invalid capacity " << capacity);
+    check(maxKeySize > 0, "invalid maximum key size " << maxKeySize);
+    check(maxValueSize > 0, "invalid maximum value size " << maxValueSize);
+    check(!sharedBase_, "the node shared storage is already used");
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    if(mpi.numProcesses() == 1)
+        return;
+
+    const unsigned long size = sharedHeaderSize + capacity * (3 + maxKeySize + maxValueSize) * sizeof(double);
+    sharedBase_ = mpi.allocateNodeShared(size, &sharedWindow_);
+
+    if(mpi.isNodeMaster())
+    {
+        SharedHeader* header = (SharedHeader*) sharedBase_;
+        header->capacity = capacity;
+        header->maxKeySize = maxKeySize;
+        header->maxValueSize = maxValueSize;
+
+        sharedCapacity_ = capacity;
+        maxKeySize_ = maxKeySize;
+        maxValueSize_ = maxValueSize;
+        for(unsigned long i = 0; i < sharedCapacity_; ++i)
+            new(sharedSlot(i)) std::atomic<unsigned long>(0);
+    }
+    mpi.barrier();
+
+    // the sizes given by the node master are the ones that count
+    const SharedHeader* header = (const SharedHeader*) sharedBase_;
+    sharedCapacity_ = header->capacity;
+    maxKeySize_ = header->maxKeySize;
+    maxValueSize_ = header->maxValueSize;
+}
+
+double*
+ClCache::sharedSlot(unsigned long i) const
+{
+    check(i < sharedCapacity_, "");
+    return (double*)((char*) sharedBase_ + sharedHeaderSize) + i * (3 + maxKeySize_ + maxValueSize_);
+}
+
+bool
+ClCache::find(const std::vector<double>& key, std::vector<std::vector<double> >* spectra)
+{
+    check(!key.empty(), "empty key");
+    check(spectra, "");
+
+    std::map<std::vector<double>, std::list<Entry>::iterator>::iterator it = index_.find(key);
+    if(it != index_.end())
+    {
+        // move to the front
+        entries_.splice(entries_.begin(), entries_, it->second);
+        *spectra = it->second->second;
+        ++hits_;
+        return true;
+    }
+
+    if(sharedBase_ && findShared(key, spectra))
+    {
+        insertLocal(key, *spectra);
+        ++sharedHits_;
+        return true;
+    }
+
+    ++misses_;
+    return false;
+}
+
+void
+ClCache::insert(const std::vector<double>& key, const std::vector<std::vector<double> >& spectra)
+{
+    check(!key.empty(), "empty key");
+
+    insertLocal(key, spectra);
+    if(sharedBase_)
+        insertShared(key, spectra);
+}
+
+void
+ClCache::insertLocal(const std::vector<double>& key, const std::vector<std::vector<double> >& spectra)
+{
+    std::map<std::vector<double>, std::list<Entry>::iterator>::iterator it = index_.find(key);
+    if(it != index_.end())
+    {
+        entries_.splice(entries_.begin(), entries_, it->second);
+        it->second->second = spectra;
+        return;
+    }
+
+    if(entries_.size() == capacity_)
+    {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+
+    entries_.push_front(Entry(key, spectra));
+    index_[key] = entries_.begin();
+}
+
+void
+ClCache::clear()
+{
+    entries_.clear();
+    index_.clear();
+}
+
+bool
+ClCache::findShared(const std::vector<double>& key, std::vector<std::vector<double> >* spectra)
+{
+    if(key.size() > maxKeySize_)
+        return false;
+
+    double* slot = sharedSlot(hashKey(key) % sharedCapacity_);
+    std::atomic<unsigned long>& seq = slotSequence(slot);
+
+    const unsigned long s = seq.load(std::memory_order_acquire);
+    if(s == 0 || (s & 1))
+        return false;
+
+    const double* keyStart = slot + 2;
+    if((unsigned long)(slot[1]) != key.size() || std::memcmp(keyStart, &(key[0]), key.size() * sizeof(double)) != 0)
+        return false;
+
+    const double* value = slot + 2 + maxKeySize_;
+    const unsigned long valueSize = (unsigned long)(value[0]);
+    if(valueSize > maxValueSize_)
+        return false;
+    flat_.assign(value + 1, value + 1 + valueSize);
+
+    // the slot may have been rewritten while copying
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(seq.load(std::memory_order_relaxed) != s)
+        return false;
+
+    // the spectra are stored as the number of spectra, their sizes, then the values one after the other
+    const int nSpectra = int(flat_[0]);
+    spectra->resize(nSpectra);
+    unsigned long pos = 1 + nSpectra;
+    for(int i = 0; i < nSpectra; ++i)
+    {
+        const unsigned long n = (unsigned long)(flat_[1 + i]);
+        (*spectra)[i].assign(flat_.begin() + pos, flat_.begin() + pos + n);
+        pos += n;
+    }
+
+    return true;
+}
+
+void
+ClCache::insertShared(const std::vector<double>& key, const std::vector<std::vector<double> >& spectra)
+{
+    if(key.size() > maxKeySize_)
+        return;
+
+    flat_.clear();
+    flat_.push_back(spectra.size());
+    for(int i = 0; i < spectra.size(); ++i)
+        flat_.push_back(spectra[i].size());
+    for(int i = 0; i < spectra.size(); ++i)
+        flat_.insert(flat_.end(), spectra[i].begin(), spectra[i].end());
+
+    if(flat_.size() > maxValueSize_)
+        return;
+
+    double* slot = sharedSlot(hashKey(key) % sharedCapacity_);
+    std::atomic<unsigned long>& seq = slotSequence(slot);
+
+    // if another process is writing the same slot just skip it
+    unsigned long s = seq.load(std::memory_order_acquire);
+    if((s & 1) || !seq.compare_exchange_strong(s, s + 1, std::memory_order_acq_rel))
+        return;
+
+    slot[1] = key.size();
+    std::copy(key.begin(), key.end(), slot + 2);
+    double* value = slot + 2 + maxKeySize_;
+    value[0] = flat_.size();
+    std::copy(flat_.begin(), flat_.end(), value + 1);
+
+    seq.store(s + 2, std::memory_order_release);
+}
+
@@ -0,0 +1,163 @@
+#include <cstring>
+#include <sstream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cl_set_file.hpp>
+
+namespace
+{
+
+const char clSetMagic[8] = {'C', 'O', 'S', 'M', 'O', 'C', 'L', 'S'};
+
+// the header, 32 bytes so that the spectra are aligned
+struct ClSetHeader
+{
+    char magic[8];
+    int version;
+    int lMax;
+    int spectraMask;
+    int reserved;
+    unsigned long nSets;
+};
+
+static_assert(sizeof(ClSetHeader) == ClSetFile::headerSize, "the header of the Cl set files must be 32 bytes");
+
+} // namespace
+
+bool
+ClSetFile::isClSetFile(const char* fileName)
+{
+    return Math::MappedFile::hasMagic(fileName, clSetMagic);
+}
+
+int
+ClSetFile::nSpectra(int spectraMask)
+{
+    int n = 0;
+    for(int s = 0; s < SPECTRUM_MAX; ++s)
+    {
+        if(spectraMask & (1 << s))
+            ++n;
+    }
+    return n;
+}
+
+void
+ClSetFile::writeFile(const char* fileName, int lMax, int spectraMask, const double* sets, unsigned long nSets)
+{
+    check(lMax >= 0, "invalid l_max " << lMax);
+    check(spectraMask & (1 << TT), "TT must be included");
+    check(spectraMask >= 0 && spectraMask < (1 << SPECTRUM_MAX), "invalid spectra mask " << spectraMask);
+    check(sets || nSets == 0, "");
+
+    ClSetHeader header;
+    std::memcpy(header.magic, clSetMagic, 8);
+    header.version = version;
+    header.lMax = lMax;
+    header.spectraMask = spectraMask;
+    header.reserved = 0;
+    header.nSets = nSets;
+
+    Math::ReplacingOutputFile out(fileName);
+    out.stream().write((const char*)(&header), sizeof(header));
+    out.stream().write((const char*)sets, nSets * nSpectra(spectraMask) * (lMax + 1) * sizeof(double));
+    out.commit();
+}
+
+MappedClSets::MappedClSets(const char* fileName) : data_(NULL), lMax_(0), mask_(0), setLength_(0), size_(0)
+{
+    StandardException exc;
+
+    const int fd = open(fileName, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        if(fd >= 0)
+            close(fd);
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    ClSetHeader header;
+    if(st.st_size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header) || std::memcmp(header.magic, clSetMagic, 8) != 0)
+    {
+        close(fd);
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " is not a Cl set file.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    const int n = ClSetFile::nSpectra(header.spectraMask);
+    const unsigned long expectedSize = sizeof(header) + header.nSets * n * (unsigned long)(header.lMax + 1) * sizeof(double);
+    if(header.version != ClSetFile::version || header.lMax < 0 || !(header.spectraMask & (1 << ClSetFile::TT)) || header.spectraMask >= (1 << ClSetFile::SPECTRUM_MAX) || st.st_size != expectedSize)
+    {
+        close(fd);
+        std::stringstream exceptionStr;
+        exceptionStr << "The Cl set file " << fileName << " cannot be used. It has version " << header.version << " (expected " << ClSetFile::version << "), l_max " << header.lMax << ", spectra mask " << header.spectraMask << ", and size " << st.st_size << " (expected " << expectedSize << " for " << header.nSets << " sets).";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    lMax_ = header.lMax;
+    mask_ = header.spectraMask;
+    setLength_ = long(n) * (lMax_ + 1);
+    size_ = header.nSets;
+
+    long offset = 0;
+    for(int s = 0; s < ClSetFile::SPECTRUM_MAX; ++s)
+    {
+        offsets_[s] = -1;
+        if(mask_ & (1 << s))
+        {
+            offsets_[s] = offset;
+            offset += lMax_ + 1;
+        }
+    }
+
+    close(fd);
+    if(size_ == 0)
+        return;
+
+    file_.map(fileName, expectedSize, "Cl set");
+
+    // the sets are read in order, let the kernel read ahead
+    madvise(file_.data(), file_.size(), MADV_SEQUENTIAL);
+
+    data_ = (const double*)((const char*)file_.data() + sizeof(header));
+}
+
+void
+MappedClSets::getSpectrum(unsigned long i, ClSetFile::Spectrum s, std::vector<double>* cl) const
+{
+    check(cl, "");
+    const double* p = spectrum(i, s);
+    check(p, "the spectrum " << int(s) << " is not included");
+    cl->assign(p, p + lMax_ + 1);
+}
+
+void
+MappedClSets::prefetch(unsigned long begin, unsigned long end) const
+{
+    if(end > size_)
+        end = size_;
+    if(!file_.data() || begin >= end)
+        return;
+
+    // madvise needs a page aligned start
+    const unsigned long pageSize = sysconf(_SC_PAGESIZE);
+    unsigned long first = ClSetFile::headerSize + begin * setLength_ * sizeof(double);
+    const unsigned long last = ClSetFile::headerSize + end * setLength_ * sizeof(double);
+    first -= first % pageSize;
+
+    madvise((char*)file_.data() + first, last - first, MADV_WILLNEED);
+}
+
@@ -1,6 +1,7 @@
 #include <cosmo_mpi.hpp>
 
 #include <string>
+#include <functional>
 #include <sstream>
 #include <iomanip>
 #include <fstream>
@@ -8,15 +9,101 @@
 #include <cstring>
 #include <cstdlib>
 #include <limits>
+#include <algorithm>
+#include <chrono>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <math_constants.hpp>
+#include <matrix_impl.hpp>
 #include <cmb.hpp>
+#include <cl_cache.hpp>
 #include <timer.hpp>
+#include <profiler.hpp>
 
 #include <class.h>
 
+namespace
+{
+
+// adds the call and the wall time (also if an exception is thrown) to the statistics of a stage
+class StageTimer
+{
+public:
+    StageTimer(CMB::StageStats& stats) : stats_(stats), start_(std::chrono::steady_clock::now()) { ++stats_.calls; }
+    ~StageTimer() { stats_.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count(); }
+
+private:
+    CMB::StageStats& stats_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace
+
+CMB::~CMB()
+{
+    if(printStageStatsAtEnd_)
+    {
+        std::stringstream str;
+        for(int i = 0; i < STAGE_MAX; ++i)
+            str << std::setw(16) << stageName(Stage(i)) << "  calls: " << std::setw(8) << stageStats_[i].calls << "  retries: " << std::setw(6) << stageStats_[i].retries << "  time: " << stageStats_[i].seconds << " s" << std::endl;
+        output_screen("CLASS stage statistics:" << std::endl << str.str());
+    }
+
+    if(preInit_)
+        preClean();
+    deAllocate();
+}
+
+const char*
+CMB::stageName(Stage s)
+{
+    check(s >= 0 && s < STAGE_MAX, "invalid stage " << s);
+    static const char* names[STAGE_MAX] = {"background", "thermodynamics", "perturbations", "primordial", "nonlinear", "transfer", "spectra", "lensing"};
+    return names[s];
+}
+
+void
+CMB::resetStageStats()
+{
+    for(int i = 0; i < STAGE_MAX; ++i)
+        stageStats_[i] = StageStats();
+}
+
+void
+CMB::printStageStats(std::ostream& out) const
+{
+    std::vector<double> local(3 * STAGE_MAX), total(3 * STAGE_MAX), maxTime(STAGE_MAX);
+    for(int i = 0; i < STAGE_MAX; ++i)
+    {
+        local[3 * i] = stageStats_[i].calls;
+        local[3 * i + 1] = stageStats_[i].retries;
+        local[3 * i + 2] = stageStats_[i].seconds;
+        maxTime[i] = stageStats_[i].seconds;
+    }
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = mpi.numProcesses();
+    if(nProcesses > 1)
+    {
+        std::vector<double> localTime(maxTime);
+        mpi.reduce(&(local[0]), &(total[0]), 3 * STAGE_MAX, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+        mpi.reduce(&(localTime[0]), &(maxTime[0]), STAGE_MAX, CosmoMPI::DOUBLE, CosmoMPI::MAX);
+    }
+    else
+        total = local;
+
+    if(!mpi.isMaster())
+        return;
+
+    out << "CLASS stage statistics (summed over " << nProcesses << " processes):" << std::endl;
+    for(int i = 0; i < STAGE_MAX; ++i)
+    {
+        const double calls = total[3 * i];
+        out << std::setw(16) << stageName(Stage(i)) << "  calls: " << std::setw(8) << (unsigned long) calls << "  retries: " << std::setw(6) << (unsigned long) total[3 * i + 1] << "  time: " << total[3 * i + 2] << " s  max per process: " << maxTime[i] << " s  per call: " << (calls > 0 ? total[3 * i + 2] / calls : 0.0) << " s" << std::endl;
+    }
+}
+
 void CMB::allocate()
 {
     pr_ = new precision;
@@ -60,6 +147,45 @@ CMB::deAllocate()
     }
 }
 
+void
+CMB::tabulatePrimordial(const Math::RealFunction& f, std::vector<double>* lnPk) const
+{
+    lnPk->resize(pm_->lnk_size);
+
+    std::vector<double> k(pm_->lnk_size);
+    for(int i = 0; i < pm_->lnk_size; ++i)
+        k[i] = std::exp(pm_->lnk[i]);
+
+    // all of the k values at once, the power spectra have fast implementations for this
+    f.evaluate(pm_->lnk_size, &(k[0]), &((*lnPk)[0]));
+
+    for(int i = 0; i < pm_->lnk_size; ++i)
+    {
+        const double pk = (*lnPk)[i];
+        check(pk > 0, "the primordial power spectrum must be positive, got " << pk << " at k = " << k[i]);
+        (*lnPk)[i] = std::log(pk);
+    }
+}
+
+void
+CMB::setPrimordialTable(int mdIndex, int icIndex, const std::vector<double>& lnPk)
+{
+    check(lnPk.size() == pm_->lnk_size, "");
+
+    const int index = index_symmetric_matrix(icIndex, icIndex, pm_->ic_size[mdIndex]);
+    for(int i = 0; i < pm_->lnk_size; ++i)
+        pm_->lnpk[mdIndex][i * pm_->ic_ic_size[mdIndex] + index] = lnPk[i];
+
+    if(array_spline_table_lines(pm_->lnk, pm_->lnk_size, pm_->lnpk[mdIndex], pm_->ic_ic_size[mdIndex], pm_->ddlnpk[mdIndex], _SPLINE_EST_DERIV_, pm_->error_message) == _FAILURE_)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "CLASS: array_spline_table_lines failed!" << std::endl << pm_->error_message;
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
 void
 CMB::preInitialize(int lMax, bool wantAllL, bool primordialInitialize, bool includeTensors, int lMaxTensors, double kPerDecade, double kMin, double kMax)
 {
@@ -77,6 +203,11 @@ CMB::preInitialize(int lMax, bool wantAllL, bool primordialInitialize, bool incl
         throw exc;
     }
 
+    // the BBN table is read by every process, it is read from the node-local copy if the staging is on (see CosmoMPI::stageToNode)
+    const std::string bbnFile = CosmoMPI::create().stageToNode(pr_->sBBN_file);
+    check(bbnFile.size() < _FILENAMESIZE_, "the staged BBN file name " << bbnFile << " is too long for CLASS");
+    std::strcpy(pr_->sBBN_file, bbnFile.c_str());
+
     primordialInitialize_ = primordialInitialize;
 
     kMin_ = kMin;
@@ -98,6 +229,17 @@ CMB::preInitialize(int lMax, bool wantAllL, bool primordialInitialize, bool incl
         //pr_->l_linstep = 1;
     }
 
+    wantAllL_ = wantAllL;
+    lowPrecision_ = false;
+    precisionChanged_ = false;
+    fullKPerDecadePrimordial_ = pr_->k_per_decade_primordial;
+    fullLLogstep_ = pr_->l_logstep;
+    fullLLinstep_ = pr_->l_linstep;
+    fullKStepSub_ = pr_->k_step_sub;
+    fullKStepSuper_ = pr_->k_step_super;
+    fullTolPerturbIntegration_ = pr_->tol_perturb_integration;
+    fullPerturbSamplingStepsize_ = pr_->perturb_sampling_stepsize;
+
     if(input_default_params(br_, th_, pt_, tr_, pm_, sp_, nl_, le_, op_) == _FAILURE_)
     {
         std::string exceptionStr = "CLASS: input_default_params failed!";
@@ -153,19 +295,60 @@ CMB::preInitialize(int lMax, bool wantAllL, bool primordialInitialize, bool incl
     
     prevTCDM_.clear();
     prevMCDM_.clear();
+    prevPrimordialRevision_ = 0;
 
     preInit_ = true;
 }
 
+void
+CMB::setLowPrecision(bool low)
+{
+    check(preInit_, "need to pre-initialize first");
+
+    if(low == lowPrecision_)
+        return;
+
+    lowPrecision_ = low;
+    precisionChanged_ = true;
+
+    const double factor = (low ? 2.0 : 1.0);
+    pr_->k_per_decade_primordial = std::max(1.0, fullKPerDecadePrimordial_ / factor);
+    pr_->k_step_sub = fullKStepSub_ * factor;
+    pr_->k_step_super = fullKStepSuper_ * factor;
+    pr_->perturb_sampling_stepsize = fullPerturbSamplingStepsize_ * factor;
+    pr_->tol_perturb_integration = (low ? 10 * fullTolPerturbIntegration_ : fullTolPerturbIntegration_);
+
+    // all of the l values are needed for the transfer functions
+    if(!wantAllL_)
+    {
+        pr_->l_logstep = (low ? 1 + 2 * (fullLLogstep_ - 1) : fullLLogstep_);
+        pr_->l_linstep = fullLLinstep_ * factor;
+    }
+}
+
 void
 CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool wantLensing, bool wantMatterPs, double zMaxPk)
 {
+    COSMO_PROFILE_REGION("cmb_initialize");
+
     StandardException exc;
 
     check(preInit_, "need to preInitialize first");
 
     params_ = &params;
 
+    fromCache_ = false;
+    if(clCache_)
+    {
+        clCacheKey(params, wantT, wantPol, wantLensing, wantMatterPs, zMaxPk, &cacheKey_);
+        // the CLASS structures are left as they are, so the next calculation can still reuse them
+        if(clCache_->find(cacheKey_, &cachedCls_))
+        {
+            fromCache_ = true;
+            return;
+        }
+    }
+
     /*
     if(init_)
         clean();
@@ -173,8 +356,9 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
 
     const double ncdm = params.getNumNCDM();
 
+    // everything is recalculated after the precision has changed
     bool initBr = false;
-    if(!init_)
+    if(!init_ || precisionChanged_)
         initBr = true;
     else if(params.getH() != prevH_ || params.getTemperature() != prevT_ || params.getOmB() != prevOmB_ || params.getOmC() != prevOmC_ || params.getOmK() != prevOmK_ || params.getOmG() != prevOmG_ || params.getOmNeutrino() != prevOmNeutrino_)
         initBr = true;
@@ -200,11 +384,9 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         }
     }
 
-    //Timer t1("BACKGROUND");
-    //t1.start();
-
     if(initBr)
     {
+        StageTimer timer(stageStats_[BACKGROUND]);
 
         if(init_ && background_free(br_) == _FAILURE_)
         {
@@ -299,6 +481,7 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         while(background_init(pr_, br_) == _FAILURE_)
         {
             ++backgroundInitFailures;
+            ++stageStats_[BACKGROUND].retries;
             if(backgroundInitFailures >= 100)
             {
                 std::stringstream exceptionStr;
@@ -326,8 +509,6 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         //pr_->k_max_tau0_over_l_max = kMax_ * br_->conformal_age / lMax_;
     }
 
-    //t1.end();
-
     bool initThermo = false;
     if(!init_)
         initThermo = true;
@@ -336,11 +517,10 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
     else if(prevTau_ != params.getTau() || prevYHe_ != params.getYHe())
         initThermo = true;
 
-    //Timer t2("THERMO");
-    //t2.start();
-
     if(initThermo)
     {
+        StageTimer timer(stageStats_[THERMODYNAMICS]);
+
         if(init_ && thermodynamics_free(th_) == _FAILURE_)
         {
             std::stringstream exceptionStr;
@@ -370,6 +550,7 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         while(thermodynamics_init(pr_, br_, th_) == _FAILURE_)
         {
             ++thermoInitFailures;
+            ++stageStats_[THERMODYNAMICS].retries;
             if(thermoInitFailures >= 100)
             {
                 std::stringstream exceptionStr;
@@ -395,8 +576,6 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         }
     }
 
-    //t2.end();
-
     bool initPt = false;
     if(!init_)
         initPt = true;
@@ -407,11 +586,10 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
     else if(prevZMaxPk_ != zMaxPk)
         initPt = true;
 
-    //Timer t3("PERTURBATIONS");
-    //t3.start();
-
     if(initPt)
     {
+        StageTimer timer(stageStats_[PERTURBATIONS]);
+
         if(init_ && perturb_free(pt_) == _FAILURE_)
         {
             std::stringstream exceptionStr;
@@ -462,6 +640,7 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         while(perturb_init(pr_, br_, th_, pt_) == _FAILURE_)
         {
             ++perturbInitFailures;
+            ++stageStats_[PERTURBATIONS].retries;
             if(perturbInitFailures >= 100)
             {
                 std::stringstream exceptionStr;
@@ -545,161 +724,125 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         }
     }
 
-    //t3.end();
-
-    //Timer t4("PRIMORDIAL");
-    //t4.start();
-
-    if(init_ && primordial_free(pm_) == _FAILURE_)
+    // the primordial power spectrum needs to be recalculated if the k range has changed (with the perturbations) or the spectrum itself has changed
+    bool initPm = false;
+    if(!init_)
+        initPm = true;
+    else if(initPt)
+        initPm = true;
+    else if(prevAs_ != params.getAs() || prevNs_ != params.getNs() || prevPivot_ != params.getPivot())
+        initPm = true;
+    else if(includeTensors_ && (prevR_ != params.getR() || prevNt_ != params.getNt()))
+        initPm = true;
+
+    // the k grid has not changed in this case, so the new spectrum can be compared with the previous one
+    std::vector<double> lnPk, lnPkTensor;
+    // if the params report that the primordial parameters have not changed since the last call there is no need to tabulate and compare the spectrum
+    const bool primordialUnchanged = (params.tracksChanges() && params.revision(CosmologicalParams::PRIMORDIAL) == prevPrimordialRevision_);
+    if(!initPm && primordialInitialize_ && !primordialUnchanged)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "CLASS: primordial_free failed!" << std::endl << pm_->error_message;
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
+        tabulatePrimordial(params.powerSpectrum(), &lnPk);
+        if(includeTensors_)
+            tabulatePrimordial(params.powerSpectrumTensor(), &lnPkTensor);
 
-    pm_->n_s = params.getNs();
-    pm_->A_s = params.getAs();
-    pm_->k_pivot = params.getPivot();
-    if(includeTensors_)
-    {
-        pm_->r = params.getR();
-        pm_->n_t = params.getNt();
+        if(lnPk != prevLnPk_ || lnPkTensor != prevLnPkTensor_)
+            initPm = true;
     }
 
-    if(primordialInitialize_)
+    if(initPm)
     {
-        std::stringstream pkFileNameStr;
-        pkFileNameStr << "cosmo_pk";
-
-        if(CosmoMPI::create().numProcesses() > 1)
-            pkFileNameStr << '_' << CosmoMPI::create().processId();
+        StageTimer timer(stageStats_[PRIMORDIAL]);
 
-        pkFileNameStr << ".txt";
-        std::string pkFileName = pkFileNameStr.str();
-
-        std::ofstream outPk(pkFileName.c_str());
-        if(!outPk)
+        if(init_ && primordial_free(pm_) == _FAILURE_)
         {
             std::stringstream exceptionStr;
-            exceptionStr << "Cannot output the primordial power spectrum into the file " << pkFileName << ".";
+            exceptionStr << "CLASS: primordial_free failed!" << std::endl << pm_->error_message;
             exc.set(exceptionStr.str());
             throw exc;
         }
 
-        const double decades = std::log(pt_->k_max / pt_->k_min) / std::log(10.0);
-        check(decades > 0, "");
-        const int nPoints = int(decades * kPerDecade_);
-        check(nPoints > 0, "");
-        const double kDelta = (std::log(pt_->k_max) - std::log(pt_->k_min)) / nPoints;
-
-        for(int i = -2; i <= nPoints + 2; ++i)
+        pm_->n_s = params.getNs();
+        pm_->A_s = params.getAs();
+        pm_->k_pivot = params.getPivot();
+        prevNs_ = params.getNs();
+        prevAs_ = params.getAs();
+        prevPivot_ = params.getPivot();
+        if(includeTensors_)
         {
-            const double k = std::exp(std::log(pt_->k_min) + i * kDelta);
-            outPk << k << ' ' << params.powerSpectrum().evaluate(k);
-            
-            if(includeTensors_)
-                outPk << ' ' << params.powerSpectrumTensor().evaluate(k);
-            outPk << std::endl;
+            pm_->r = params.getR();
+            pm_->n_t = params.getNt();
+            prevR_ = params.getR();
+            prevNt_ = params.getNt();
         }
-        outPk.close();
-
-        std::stringstream classCommand;
-        classCommand << "cat " << pkFileName;
-
-        pm_->primordial_spec_type = external_Pk;
-        pm_->command = (char *) malloc(classCommand.str().size() + 1);
-        std::strcpy(pm_->command, classCommand.str().c_str());
-    }
-
-    if(primordial_init(pr_, pt_, pm_) == _FAILURE_)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "CLASS: primordial_init failed!" << std::endl << pm_->error_message;
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
 
-    //t4.end();
+        // the table is first calculated by CLASS from A_s and n_s, then the values are replaced by the power spectrum functions (without going through a file and an external command)
+        pm_->primordial_spec_type = analytic_Pk;
 
-    /*
-    if(primordialInitialize_)
-    {
-        // Altering the primordial power spectrum
-        const int iMdIndex = pt_->index_md_scalars;
-        for(int i = 0; i < pm_->lnk_size; ++i)
-        {
-            const double lnK = pm_->lnk[i];
-            const double k = std::exp(lnK);
-            const double pk = params.powerSpectrum().evaluate(k);
-            const double lnPk = std::log(pk);
-            pm_->lnpk[iMdIndex][i * pm_->ic_ic_size[iMdIndex] + pt_->index_ic_ad] = lnPk;
-        }
-
-        if(array_spline_table_lines(pm_->lnk, pm_->lnk_size, pm_->lnpk[iMdIndex], pm_->ic_ic_size[iMdIndex], pm_->ddlnpk[iMdIndex], _SPLINE_EST_DERIV_, pm_->error_message) == _FAILURE_)
+        if(primordial_init(pr_, pt_, pm_) == _FAILURE_)
         {
             std::stringstream exceptionStr;
-            exceptionStr << "CLASS: array_spline_table_lines failed!" << std::endl << pm_->error_message;
+            exceptionStr << "CLASS: primordial_init failed!" << std::endl << pm_->error_message;
             exc.set(exceptionStr.str());
             throw exc;
         }
 
-        if(includeTensors_)
+        if(primordialInitialize_)
         {
-            const int iMdIndex = pt_->index_md_tensors;
-            for(int i = 0; i < pm_->lnk_size; ++i)
+            if(lnPk.empty())
             {
-                const double lnK = pm_->lnk[i];
-                const double k = std::exp(lnK);
-                const double pk = params.powerSpectrumTensor().evaluate(k);
-                const double lnPk = std::log(pk);
-                pm_->lnpk[iMdIndex][i * pm_->ic_ic_size[iMdIndex] + pt_->index_ic_ad] = lnPk;
+                tabulatePrimordial(params.powerSpectrum(), &lnPk);
+                if(includeTensors_)
+                    tabulatePrimordial(params.powerSpectrumTensor(), &lnPkTensor);
             }
 
-            if(array_spline_table_lines(pm_->lnk, pm_->lnk_size, pm_->lnpk[iMdIndex], pm_->ic_ic_size[iMdIndex], pm_->ddlnpk[iMdIndex], _SPLINE_EST_DERIV_, pm_->error_message) == _FAILURE_)
-            {
-                std::stringstream exceptionStr;
-                exceptionStr << "CLASS: array_spline_table_lines failed!" << std::endl << pm_->error_message;
-                exc.set(exceptionStr.str());
-                throw exc;
-            }
+            setPrimordialTable(pt_->index_md_scalars, pt_->index_ic_ad, lnPk);
+            if(includeTensors_)
+                setPrimordialTable(pt_->index_md_tensors, pt_->index_ic_ten, lnPkTensor);
+
+            prevLnPk_.swap(lnPk);
+            prevLnPkTensor_.swap(lnPkTensor);
         }
     }
-    */
 
-    //Timer t5("NONLINEAR");
-    //t5.start();
+    prevPrimordialRevision_ = (params.tracksChanges() ? params.revision(CosmologicalParams::PRIMORDIAL) : 0);
 
-    if(init_ && nonlinear_free(nl_) == _FAILURE_)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "CLASS: nonlinear_free failed!" << std::endl << nl_->error_message;
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
+    // everything else depends on the primordial power spectrum, so if it has not changed (and so nothing before it has changed either) the previous results can be used
+    const bool initNl = initPm;
 
-    if(nonlinear_init(pr_, br_, th_, pt_, pm_, nl_) == _FAILURE_)
+    if(initNl)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "CLASS: nonlinear_init failed!" << std::endl << nl_->error_message;
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
+        StageTimer timer(stageStats_[NONLINEAR]);
 
-    //t5.end();
+        if(init_ && nonlinear_free(nl_) == _FAILURE_)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "CLASS: nonlinear_free failed!" << std::endl << nl_->error_message;
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
 
+        if(nonlinear_init(pr_, br_, th_, pt_, pm_, nl_) == _FAILURE_)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "CLASS: nonlinear_init failed!" << std::endl << nl_->error_message;
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+    }
+
+    // the transfer functions only depend on the primordial power spectrum through the nonlinear corrections
     bool initTr = false;
     if(!init_)
         initTr = true;
     else if(initPt)
         initTr = true;
-    else if(nl_->method != nl_none) // TBD: this condition might be too strict
+    else if(initNl && nl_->method != nl_none) // TBD: this condition might be too strict
         initTr = true;
 
-    //Timer t6("TRANSFER");
-    //t6.start();
     if(initTr)
     {
+        StageTimer timer(stageStats_[TRANSFER]);
+
         if(init_ && transfer_free(tr_) == _FAILURE_)
         {
             std::stringstream exceptionStr;
@@ -716,52 +859,54 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
             throw exc;
         }
     }
-    //t6.end();
 
+    // the requested spectra can only change together with the perturbations, so initPm covers everything here
+    const bool initSp = initPm;
 
-    //Timer t7("SPECTRA");
-    //t7.start();
-
-    if(init_ && spectra_free(sp_) == _FAILURE_)
+    if(initSp)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "CLASS: spectra_free failed!" << std::endl << sp_->error_message;
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
-
-    sp_->has_tt = wantT;
-    sp_->has_ee = wantPol;
-    sp_->has_te = (wantT && wantPol);
-    sp_->has_bb = wantPol;
-    sp_->has_pp = wantLensing;
-    sp_->has_tp = (wantT && wantLensing);
-    sp_->has_ep = (wantPol && wantLensing);
+        StageTimer timer(stageStats_[SPECTRA]);
 
-    if(spectra_init(pr_, br_, pt_, pm_, nl_, tr_, sp_) == _FAILURE_)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "CLASS: spectra_init failed!" << std::endl << sp_->error_message;
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
-    //t7.end();
+        if(init_ && spectra_free(sp_) == _FAILURE_)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "CLASS: spectra_free failed!" << std::endl << sp_->error_message;
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
 
-    //Timer t8("LENSING");
-    //t8.start();
+        sp_->has_tt = wantT;
+        sp_->has_ee = wantPol;
+        sp_->has_te = (wantT && wantPol);
+        sp_->has_bb = wantPol;
+        sp_->has_pp = wantLensing;
+        sp_->has_tp = (wantT && wantLensing);
+        sp_->has_ep = (wantPol && wantLensing);
 
-    lensing_ = wantLensing;
+        if(spectra_init(pr_, br_, pt_, pm_, nl_, tr_, sp_) == _FAILURE_)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "CLASS: spectra_init failed!" << std::endl << sp_->error_message;
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+    }
 
-    if(wantLensing)
+    // the previous lensing results are freed if they need to be recalculated or are not needed anymore
+    if(init_ && lensing_ && (initSp || !wantLensing))
     {
-        //TBD: may be able to skip lensing init sometimes, need to check nl_
-        if(init_ && lensing_free(le_) == _FAILURE_)
+        if(lensing_free(le_) == _FAILURE_)
         {
             std::stringstream exceptionStr;
             exceptionStr << "CLASS: lensing_free failed!" << std::endl << le_->error_message;
             exc.set(exceptionStr.str());
             throw exc;
         }
+    }
+
+    if(wantLensing && (initSp || !lensing_))
+    {
+        StageTimer timer(stageStats_[LENSING]);
 
         le_->has_lensed_cls = true;
         le_->has_tt = wantT;
@@ -769,6 +914,8 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         le_->has_te = (wantT && wantPol);
         le_->has_bb = wantPol;
 
+        // if this fails the lensing results are not there to be freed
+        lensing_ = false;
         if(lensing_init(pr_, pt_, sp_, nl_, le_)  == _FAILURE_)
         {
             std::stringstream exceptionStr;
@@ -778,16 +925,134 @@ CMB::initialize(const CosmologicalParams& params, bool wantT, bool wantPol, bool
         }
     }
 
-    //t8.end();
+    lensing_ = wantLensing;
 
     init_ = true;
+    precisionChanged_ = false;
+
+    if(clCache_)
+        addToClCache();
+}
+
+void
+CMB::clCacheKey(const CosmologicalParams& params, bool wantT, bool wantPol, bool wantLensing, bool wantMatterPs, double zMaxPk, std::vector<double>* key) const
+{
+    params.getAllParameters(*key);
+    key->push_back(double(std::hash<std::string>()(params.name())));
+    key->push_back(lMax_);
+    key->push_back(pr_->l_logstep);
+    key->push_back(lowPrecision_);
+    key->push_back(primordialInitialize_);
+    key->push_back(includeTensors_);
+    key->push_back(includeTensors_ ? lMaxTensors_ : 0);
+    key->push_back(primordialInitialize_ ? kPerDecade_ : 0);
+    key->push_back(kMin_);
+    key->push_back(kMax_);
+    key->push_back(wantT);
+    key->push_back(wantPol);
+    key->push_back(wantLensing);
+    key->push_back(wantMatterPs);
+    key->push_back(wantMatterPs ? zMaxPk : 0);
 }
 
+void
+CMB::addToClCache()
+{
+    std::vector<std::vector<double> > cls(11);
+    getCl((sp_->has_tt ? &(cls[0]) : NULL), (sp_->has_ee ? &(cls[1]) : NULL), (sp_->has_te ? &(cls[2]) : NULL), (sp_->has_pp ? &(cls[3]) : NULL), (sp_->has_tp ? &(cls[4]) : NULL), (sp_->has_ep ? &(cls[5]) : NULL), (sp_->has_bb ? &(cls[6]) : NULL));
+    if(lensing_)
+        getLensedCl((le_->has_tt ? &(cls[7]) : NULL), (le_->has_ee ? &(cls[8]) : NULL), (le_->has_te ? &(cls[9]) : NULL), (le_->has_bb ? &(cls[10]) : NULL));
+
+    clCache_->insert(cacheKey_, cls);
+}
+
+void
+CMB::copyCachedCl(int i, std::vector<double>* cl) const
+{
+    if(!cl)
+        return;
+
+    check(i >= 0 && i < cachedCls_.size(), "");
+    check(!cachedCls_[i].empty(), "this spectrum has not been requested earlier");
+    *cl = cachedCls_[i];
+}
+
+void
+CMB::copyCachedCl(int i, int lMax, double* cl) const
+{
+    if(!cl)
+        return;
+
+    check(i >= 0 && i < cachedCls_.size(), "");
+    check(!cachedCls_[i].empty(), "this spectrum has not been requested earlier");
+    const int n = std::min(lMax + 1, int(cachedCls_[i].size()));
+    std::copy(cachedCls_[i].begin(), cachedCls_[i].begin() + n, cl);
+    std::fill(cl + n, cl + lMax + 1, 0.0);
+}
+
+namespace
+{
+
+void
+resizeCl(std::vector<double>* cl, int size)
+{
+    // resize does not reallocate if the vector is reused with the same size
+    if(cl)
+        cl->resize(size);
+}
+
+double*
+clBuffer(std::vector<double>* cl)
+{
+    return (cl ? &((*cl)[0]) : NULL);
+}
+
+} // namespace
+
 void
 CMB::getCl(std::vector<double>* clTT, std::vector<double>* clEE, std::vector<double>* clTE, std::vector<double>* clPP, std::vector<double>* clTP, std::vector<double>* clEP, std::vector<double>* clBB)
 {
-    //Timer timer("GET CL");
-    //timer.start();
+    if(fromCache_)
+    {
+        copyCachedCl(0, clTT);
+        copyCachedCl(1, clEE);
+        copyCachedCl(2, clTE);
+        copyCachedCl(3, clPP);
+        copyCachedCl(4, clTP);
+        copyCachedCl(5, clEP);
+        copyCachedCl(6, clBB);
+        return;
+    }
+
+    const int lMax = lMax_;
+
+    resizeCl(clTT, lMax + 1);
+    resizeCl(clEE, lMax + 1);
+    resizeCl(clTE, lMax + 1);
+    resizeCl(clPP, lMax + 1);
+    resizeCl(clTP, lMax + 1);
+    resizeCl(clEP, lMax + 1);
+    resizeCl(clBB, lMax + 1);
+
+    getClInto(lMax, clBuffer(clTT), clBuffer(clEE), clBuffer(clTE), clBuffer(clPP), clBuffer(clTP), clBuffer(clEP), clBuffer(clBB));
+}
+
+void
+CMB::getClInto(int lMax, double* clTT, double* clEE, double* clTE, double* clPP, double* clTP, double* clEP, double* clBB)
+{
+    check(lMax >= 0, "invalid lMax = " << lMax);
+
+    if(fromCache_)
+    {
+        copyCachedCl(0, lMax, clTT);
+        copyCachedCl(1, lMax, clEE);
+        copyCachedCl(2, lMax, clTE);
+        copyCachedCl(3, lMax, clPP);
+        copyCachedCl(4, lMax, clTP);
+        copyCachedCl(5, lMax, clEP);
+        copyCachedCl(6, lMax, clBB);
+        return;
+    }
 
     StandardException exc;
 
@@ -801,45 +1066,33 @@ CMB::getCl(std::vector<double>* clTT, std::vector<double>* clEE, std::vector<dou
     check(sp_->has_ep || clEP == NULL, "Pol and Lensing have not been requested earlier");
     check(sp_->has_bb || clBB == NULL, "Pol has not been requested earlier");
 
-    const int lMax = lMax_;
-
-    if(clTT)
-    {
-        clTT->clear();
-        clTT->resize(lMax + 1, 0);
-    }
-    if(clEE)
-    {
-        clEE->clear();
-        clEE->resize(lMax + 1, 0);
-    }
-    if(clTE)
-    {
-        clTE->clear();
-        clTE->resize(lMax + 1, 0);
-    }
-    if(clPP)
-    {
-        clPP->clear();
-        clPP->resize(lMax + 1, 0);
-    }
-    if(clTP)
+    // the requested spectra with their CLASS indices and unit conversion factors (to muK^2)
+    const double tt = br_->T_cmb * br_->T_cmb * 1e12, t = br_->T_cmb * 1e6;
+    double* out[7];
+    int index[7];
+    double factor[7];
+    int n = 0;
+    if(clTT) { out[n] = clTT; index[n] = sp_->index_ct_tt; factor[n++] = tt; }
+    if(clEE) { out[n] = clEE; index[n] = sp_->index_ct_ee; factor[n++] = tt; }
+    if(clTE) { out[n] = clTE; index[n] = sp_->index_ct_te; factor[n++] = tt; }
+    if(clPP) { out[n] = clPP; index[n] = sp_->index_ct_pp; factor[n++] = 1; }
+    if(clTP) { out[n] = clTP; index[n] = sp_->index_ct_tp; factor[n++] = t; }
+    if(clEP) { out[n] = clEP; index[n] = sp_->index_ct_ep; factor[n++] = t; }
+    if(clBB) { out[n] = clBB; index[n] = sp_->index_ct_bb; factor[n++] = tt; }
+
+    const int lCalc = std::min(lMax, lMax_);
+    for(int i = 0; i < n; ++i)
     {
-        clTP->clear();
-        clTP->resize(lMax + 1, 0);
-    }
-    if(clEP)
-    {
-        clEP->clear();
-        clEP->resize(lMax + 1, 0);
-    }
-    if(clBB)
-    {
-        clBB->clear();
-        clBB->resize(lMax + 1, 0);
+        for(int l = 0; l < 2 && l <= lMax; ++l)
+            out[i][l] = 0;
+        for(int l = std::max(lCalc + 1, 2); l <= lMax; ++l)
+            out[i][l] = 0;
     }
 
-    for(int l = 2; l <= lMax; ++l)
+    if(n == 0)
+        return;
+
+    for(int l = 2; l <= lCalc; ++l)
     {
         double clTot[1000];
         if(spectra_cl_at_l(sp_, l, clTot, dum1_, dum2_) == _FAILURE_)
@@ -850,30 +1103,65 @@ CMB::getCl(std::vector<double>* clTT, std::vector<double>* clEE, std::vector<dou
             throw exc;
         }
 
-        if(clTT)
-            (*clTT)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[sp_->index_ct_tt];
-        if(clEE)
-            (*clEE)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[sp_->index_ct_ee];
-        if(clTE)
-            (*clTE)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[sp_->index_ct_te];
-        if(clPP)
-            (*clPP)[l] = clTot[sp_->index_ct_pp];
-        if(clTP)
-            (*clTP)[l] = br_->T_cmb * 1e6 * clTot[sp_->index_ct_tp];
-        if(clEP)
-            (*clEP)[l] = br_->T_cmb * 1e6 * clTot[sp_->index_ct_ep];
-        if(clBB)
-            (*clBB)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[sp_->index_ct_bb];
+        for(int i = 0; i < n; ++i)
+            out[i][l] = factor[i] * clTot[index[i]];
     }
+}
 
-    //timer.end();
+int
+CMB::lMaxLensed() const
+{
+    if(fromCache_)
+    {
+        for(int i = 7; i < 11; ++i)
+        {
+            if(!cachedCls_[i].empty())
+                return cachedCls_[i].size() - 1;
+        }
+        check(false, "lensing not requested");
+    }
+
+    check(init_, "need to initialize first");
+    check(lensing_, "lensing not requested");
+    return le_->l_lensed_max;
 }
 
 void
 CMB::getLensedCl(std::vector<double>* clTT, std::vector<double>* clEE, std::vector<double>* clTE, std::vector<double>* clBB)
 {
-    //Timer timer("GET LENSED CL");
-    //timer.start();
+    if(fromCache_)
+    {
+        copyCachedCl(7, clTT);
+        copyCachedCl(8, clEE);
+        copyCachedCl(9, clTE);
+        copyCachedCl(10, clBB);
+        return;
+    }
+
+    const int lMax = lMaxLensed();
+
+    resizeCl(clTT, lMax + 1);
+    resizeCl(clEE, lMax + 1);
+    resizeCl(clTE, lMax + 1);
+    resizeCl(clBB, lMax + 1);
+
+    getLensedClInto(lMax, clBuffer(clTT), clBuffer(clEE), clBuffer(clTE), clBuffer(clBB));
+}
+
+void
+CMB::getLensedClInto(int lMax, double* clTT, double* clEE, double* clTE, double* clBB)
+{
+    check(lMax >= 0, "invalid lMax = " << lMax);
+
+    if(fromCache_)
+    {
+        copyCachedCl(7, lMax, clTT);
+        copyCachedCl(8, lMax, clEE);
+        copyCachedCl(9, lMax, clTE);
+        copyCachedCl(10, lMax, clBB);
+        return;
+    }
+
     StandardException exc;
 
     check(init_, "need to initialize first");
@@ -884,30 +1172,28 @@ CMB::getLensedCl(std::vector<double>* clTT, std::vector<double>* clEE, std::vect
     check(le_->has_te || clTE == NULL, "T and Pol have not been requested earlier");
     check(le_->has_bb || clBB == NULL, "Pol has not been requested earlier");
 
-    const int lMax = le_->l_lensed_max;
-
-    if(clTT)
+    const double tt = br_->T_cmb * br_->T_cmb * 1e12;
+    double* out[4];
+    int index[4];
+    int n = 0;
+    if(clTT) { out[n] = clTT; index[n++] = le_->index_lt_tt; }
+    if(clEE) { out[n] = clEE; index[n++] = le_->index_lt_ee; }
+    if(clTE) { out[n] = clTE; index[n++] = le_->index_lt_te; }
+    if(clBB) { out[n] = clBB; index[n++] = le_->index_lt_bb; }
+
+    const int lCalc = std::min(lMax, le_->l_lensed_max);
+    for(int i = 0; i < n; ++i)
     {
-        clTT->clear();
-        clTT->resize(lMax + 1, 0);
-    }
-    if(clEE)
-    {
-        clEE->clear();
-        clEE->resize(lMax + 1, 0);
-    }
-    if(clTE)
-    {
-        clTE->clear();
-        clTE->resize(lMax + 1, 0);
-    }
-    if(clBB)
-    {
-        clBB->clear();
-        clBB->resize(lMax + 1, 0);
+        for(int l = 0; l < 2 && l <= lMax; ++l)
+            out[i][l] = 0;
+        for(int l = std::max(lCalc + 1, 2); l <= lMax; ++l)
+            out[i][l] = 0;
     }
 
-    for(int l = 2; l <= lMax; ++l)
+    if(n == 0)
+        return;
+
+    for(int l = 2; l <= lCalc; ++l)
     {
         double clTot[1000];
         if(lensing_cl_at_l(le_, l, clTot) == _FAILURE_)
@@ -918,16 +1204,9 @@ CMB::getLensedCl(std::vector<double>* clTT, std::vector<double>* clEE, std::vect
             throw exc;
         }
 
-        if(clTT)
-            (*clTT)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[le_->index_lt_tt];
-        if(clEE)
-            (*clEE)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[le_->index_lt_ee];
-        if(clTE)
-            (*clTE)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[le_->index_lt_te];
-        if(clBB)
-            (*clBB)[l] = br_->T_cmb * br_->T_cmb * 1e12 * clTot[le_->index_lt_bb];
+        for(int i = 0; i < n; ++i)
+            out[i][l] = tt * clTot[index[i]];
     }
-    //timer.end();
 }
 
 void
@@ -1036,6 +1315,7 @@ CMB::getTransfer(int l, Math::TableFunction<double, double>* t, Math::TableFunct
 {
     StandardException exc;
 
+    check(!fromCache_, "only the Cl-s are available when taken from the cache");
     check(init_, "need to initialize first");
     check(l >= 2 && l <= lMax_, "invalid value of l = " <<l);
 
@@ -1134,10 +1414,90 @@ CMB::getTransfer(int l, Math::TableFunction<double, double>* t, Math::TableFunct
     }
 }
 
+void
+CMB::getTransfers(int lMin, int lMax, std::vector<double>* k, Math::Matrix<double>* t, Math::Matrix<double>* e, Math::Matrix<double>* p)
+{
+    StandardException exc;
+
+    check(!fromCache_, "only the Cl-s are available when taken from the cache");
+    check(init_, "need to initialize first");
+    check(lMin >= 2 && lMin <= lMax && lMax <= lMax_, "invalid l range " << lMin << " to " << lMax);
+    check(k, "");
+
+    check(sp_->has_tt || t == NULL, "T has not been requested earlier");
+    check(sp_->has_ee || e == NULL, "Pol has not been requested earlier");
+    check(sp_->has_pp || p == NULL, "T and Pol have not been requested earlier");
+
+    const int iMdSc = pt_->index_md_scalars;
+    const int iIcAd = pt_->index_ic_ad;
+    const int lSize = tr_->l_size[iMdSc];
+    const int qSize = tr_->q_size;
+    const int ttSize = tr_->tt_size[iMdSc];
+
+    // the l values of CLASS are sorted, so the indices are found in one pass
+    std::vector<int> indexL(lMax - lMin + 1);
+    int i = 0;
+    for(int l = lMin; l <= lMax; ++l)
+    {
+        while(i < lSize && tr_->l[i] < l)
+            ++i;
+
+        if(i == lSize || tr_->l[i] != l)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Transfer function not calculated for l = " << l << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        indexL[l - lMin] = i;
+    }
+
+    k->resize(qSize);
+    for(int j = 0; j < qSize; ++j)
+        (*k)[j] = tr_->q[j];
+
+    if(t)
+        t->resize(lMax - lMin + 1, qSize);
+    if(e)
+        e->resize(lMax - lMin + 1, qSize);
+    if(p)
+        p->resize(lMax - lMin + 1, qSize);
+
+    // the k values are the nodes of the tables, so the values are read directly (this is what transfer_functions_at_q gives at the nodes)
+    const double* transfer = tr_->transfer[iMdSc];
+#pragma omp parallel for default(shared)
+    for(int row = 0; row < lMax - lMin + 1; ++row)
+    {
+        const int iL = indexL[row];
+        if(t)
+        {
+            const double* t0 = transfer + ((iIcAd * ttSize + tr_->index_tt_t0) * lSize + iL) * qSize;
+            const double* t1 = transfer + ((iIcAd * ttSize + tr_->index_tt_t1) * lSize + iL) * qSize;
+            const double* t2 = transfer + ((iIcAd * ttSize + tr_->index_tt_t2) * lSize + iL) * qSize;
+            double* out = &((*t)(row, 0));
+            for(int j = 0; j < qSize; ++j)
+                out[j] = t0[j] + t1[j] + t2[j];
+        }
+
+        if(e)
+        {
+            const double* e0 = transfer + ((iIcAd * ttSize + tr_->index_tt_e) * lSize + iL) * qSize;
+            std::copy(e0, e0 + qSize, &((*e)(row, 0)));
+        }
+
+        if(p)
+        {
+            const double* p0 = transfer + ((iIcAd * ttSize + tr_->index_tt_lcmb) * lSize + iL) * qSize;
+            std::copy(p0, p0 + qSize, &((*p)(row, 0)));
+        }
+    }
+}
+
 void
 CMB::getMatterPs(double z, Math::TableFunction<double, double>* ps)
 {
     StandardException exc;
+    check(!fromCache_, "only the Cl-s are available when taken from the cache");
     check(init_, "need to initialize first");
     check(pt_->has_pk_matter, "matter ps not requested");
     check(z >= 0 && z <= sp_->z_max_pk, "invalid z = " << z);
@@ -1170,6 +1530,7 @@ void
 CMB::getMatterTransfer(double z, Math::TableFunction<double, double>* tk)
 {
     StandardException exc;
+    check(!fromCache_, "only the Cl-s are available when taken from the cache");
     check(init_, "need to initialize first");
     check(pt_->has_density_transfers, "matter ps not requested");
     check(z >= 0 && z <= sp_->z_max_pk, "invalid z = " << z);
@@ -1196,10 +1557,48 @@ CMB::getMatterTransfer(double z, Math::TableFunction<double, double>* tk)
     }
 }
 
+void
+CMB::getMatterTransfers(const std::vector<double>& z, std::vector<double>* k, Math::Matrix<double>* tk)
+{
+    StandardException exc;
+    check(!fromCache_, "only the Cl-s are available when taken from the cache");
+    check(init_, "need to initialize first");
+    check(pt_->has_density_transfers, "matter ps not requested");
+    check(k, "");
+    check(tk, "");
+    const int kSize = sp_->ln_k_size;
+    check(kSize > 0, "");
+
+    k->resize(kSize);
+    for(int i = 0; i < kSize; ++i)
+        (*k)[i] = std::exp(sp_->ln_k[i]);
+
+    tk->resize(z.size(), kSize);
+
+    // all of the k values for a given z in one call, the first initial condition is used as in getMatterTransfer
+    const int icSize = sp_->ic_size[sp_->index_md_scalars];
+    std::vector<double> out(kSize * icSize * sp_->tr_size);
+    for(int j = 0; j < z.size(); ++j)
+    {
+        check(z[j] >= 0 && z[j] <= sp_->z_max_pk, "invalid z = " << z[j]);
+        if(spectra_tk_at_z(br_, sp_, z[j], &(out[0])) == _FAILURE_)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "CLASS: spectra_tk_at_z failed!" << std::endl << sp_->error_message;
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        for(int i = 0; i < kSize; ++i)
+            (*tk)(j, i) = out[i * icSize * sp_->tr_size + sp_->index_tr_delta_tot];
+    }
+}
+
 double
 CMB::sigma8()
 {
     StandardException exc;
+    check(!fromCache_, "only the Cl-s are available when taken from the cache");
     check(init_, "need to initialize first");
     check(pt_->has_density_transfers, "matter ps not requested");
 
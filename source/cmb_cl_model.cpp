@@ -0,0 +1,63 @@
+#include <sstream>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cmb_cl_model.hpp>
+
+CMBClModel::CMBClModel(CMBPool& pool, const std::vector<CosmologicalParams*>& params, int lMax, bool polarization, bool lensed) : pool_(pool), params_(params), lMax_(lMax), polarization_(polarization), lensed_(lensed)
+{
+    check(!params_.empty(), "no cosmological parameters objects");
+    check(lMax_ >= 2, "invalid lMax = " << lMax_);
+    for(int i = 0; i < params_.size(); ++i)
+    {
+        check(params_[i], "");
+    }
+}
+
+void
+CMBClModel::calculateBatch(const double* params, int nParams, int nPoints, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE)
+{
+    check(clTT, "");
+    check(!polarization_ || (clEE && clTE), "");
+
+    clTT->resize(nPoints);
+    if(polarization_)
+    {
+        clEE->resize(nPoints);
+        clTE->resize(nPoints);
+    }
+
+    const int chunkSize = int(params_.size());
+    for(int first = 0; first < nPoints; first += chunkSize)
+    {
+        const int n = std::min(chunkSize, nPoints - first);
+        chunk_.resize(n);
+        for(int i = 0; i < n; ++i)
+        {
+            if(!params_[i]->setParameters(params + (first + i) * nParams, nParams))
+            {
+                StandardException exc;
+                std::stringstream exceptionStr;
+                exceptionStr << "Invalid cosmological parameters for the point " << first + i << " of the batch.";
+                exc.set(exceptionStr.str());
+                throw exc;
+            }
+            chunk_[i] = params_[i];
+        }
+
+        pool_.computeCls(chunk_, &tt_, (polarization_ ? &ee_ : NULL), (polarization_ ? &te_ : NULL), NULL, lensed_);
+
+        for(int i = 0; i < n; ++i)
+        {
+            check(tt_[i].size() > lMax_, "the CMB pool gave the spectra up to l = " << tt_[i].size() - 1 << ", need up to " << lMax_);
+            (*clTT)[first + i].assign(tt_[i].begin(), tt_[i].begin() + lMax_ + 1);
+            if(polarization_)
+            {
+                (*clEE)[first + i].assign(ee_[i].begin(), ee_[i].begin() + lMax_ + 1);
+                (*clTE)[first + i].assign(te_[i].begin(), te_[i].begin() + lMax_ + 1);
+            }
+        }
+    }
+}
+
@@ -5,12 +5,16 @@
 #include <algorithm>
 
 #include <macros.hpp>
+#include <cosmo_mpi.hpp>
 #include <exception_handler.hpp>
 #include <math_constants.hpp>
 #include <progress_meter.hpp>
 #include <utils.hpp>
 #include <conjugate_gradient.hpp>
+#include <mapped_matrix.hpp>
 #include <numerics.hpp>
+#include <legendre.hpp>
+#include <alm_utils.hpp>
 #include <cmb_gibbs.hpp>
 
 #include <chealpix.h>
@@ -120,6 +124,8 @@ CMBGibbsSampler::CMBGibbsSampler(const Healpix_Map<double>& map, const Healpix_M
     check(pixelNoise > 0, "invalid pixel noise " << pixelNoise);
     pixelNoise_ = pixelNoise;
 
+    calculateNoiseDiagonal();
+
     a00_ = 0;
     a1m1_ = 0;
     a10_ = 0;
@@ -152,26 +158,30 @@ CMBGibbsSampler::CMBGibbsSampler(const Healpix_Map<double>& map, const Healpix_M
 
     check(signal.Scheme() == RING, "");
 
+    sht_ = new SphericalHarmonicTransform(map_.Nside(), lMax_);
+
     s_.Set(lMax, lMax);
     s_.SetToZero();
-    arr<double> weight(2 * signal.Nside(), 1);
-    map2alm(signal, s_, weight);
+    sht_->map2alm(signal, s_);
 
+    std::vector<double> beamInv(lMax + 1);
     for(int l = 0; l <= lMax; ++l)
-        for(int m = 0; m <= l; ++m)
-            s_(l, m) /= beam_[l];
+        beamInv[l] = 1.0 / beam_[l];
+    AlmUtils::scale(&s_, beamInv);
 
     calculateSigmaL();
 
     if(seed == 0)
         seed = std::time(0);
 
-    generator_ = new Math::GaussianGenerator(seed, 0, 1);
+    // each process has its own random sequence, so that the chains of different processes are independent
+    generator_ = new Math::GaussianGenerator(seed + CosmoMPI::create().processId(), 0, 1);
 }
 
 CMBGibbsSampler::~CMBGibbsSampler()
 {
     delete generator_;
+    delete sht_;
 }
 
 void
@@ -241,10 +251,8 @@ private:
 void
 CMBGibbsSampler::generateW()
 {
-    Alm<xcomplex<double> > alm(lMax_, lMax_);
-    for(int l = 0; l <= lMax_; ++l)
-        for(int m = 0; m <= l; ++m)
-            alm(l, m) = s_(l, m) * beam_[l];
+    Alm<xcomplex<double> > alm = s_;
+    AlmUtils::scale(&alm, beam_);
 
     Healpix_Map<double> map, omega0, omega1, omega2, omega3;
     map.SetNside(map_.Nside(), RING);
@@ -252,7 +260,7 @@ CMBGibbsSampler::generateW()
     omega1.SetNside(map_.Nside(), RING);
     omega2.SetNside(map_.Nside(), RING);
     omega3.SetNside(map_.Nside(), RING);
-    alm2map(alm, map);
+    sht_->alm2map(alm, map);
 
     std::vector<double> b(4, 0.0);
 
@@ -300,105 +308,52 @@ CMBGibbsSampler::generateW()
     a11_ = res[3];
 }
 
+// the vector of the real degrees of freedom has for each l the real part of a_l0, then the real and imaginary parts of a_lm for m > 0, so l starts at l^2
 class CmbGibbsCGTreats
 {
 public:
-    CmbGibbsCGTreats(long nSide, int lMax, const std::vector<double>& cl, const Healpix_Map<double>& mask, double pixelNoise, const std::vector<double>& beam) : nSide_(nSide), lMax_(lMax), cl_(cl), mask_(mask), pixelNoise_(pixelNoise), beam_(beam)
+    CmbGibbsCGTreats(const SphericalHarmonicTransform& sht, const std::vector<double>& cl, const Healpix_Map<double>& mask, double pixelNoise, const std::vector<double>& beam, const std::vector<double>& noiseDiag) : sht_(sht), nSide_(sht.nSide()), lMax_(sht.lMax()), mask_(mask), pixelNoise_(pixelNoise), factor_(lMax_ + 1), precond_((lMax_ + 1) * (lMax_ + 1)), alm_(lMax_, lMax_), weight_(12 * nSide_ * nSide_ / (4 * Math::pi))
     {
         check(lMax_ >= 2, "");
-        check(cl_.size() == lMax_ + 1, "");
+        check(cl.size() == lMax_ + 1, "");
         check(pixelNoise_ > 0, "");
-        check(beam_.size() == lMax_ + 1, "");
+        check(beam.size() == lMax_ + 1, "");
         check(mask_.Nside() == nSide_, "");
+        check(noiseDiag.size() == precond_.size(), "");
 
-        goodPix_ = 0;
-        for(long i = 0; i < mask_.Npix(); ++i)
-            if(mask_[i] > 0.5)
-                ++goodPix_;
-    }
-
-    static void almToVector(const Alm<xcomplex<double> >& alm, std::vector<double>& v)
-    {
-        const int lMax = alm.Lmax();
-        v.clear();
-        for(int l = 0; l <= lMax; ++l)
-        {
-            v.push_back(alm(l, 0).real());
-            check(Math::areEqual(alm(l, 0).imag(), 0.0, 1e-10), "");
-
-            for(int m = 1; m <= l; ++m)
-            {
-                v.push_back(alm(l, m).real());
-                v.push_back(alm(l, m).imag());
-            }
-        }
-    }
+        map_.SetNside(nSide_, RING);
 
-    static void vectorToAlm(const std::vector<double>& v, Alm<xcomplex<double> > & alm)
-    {
-        const int lMax = alm.Lmax();
-        std::vector<double>::const_iterator it = v.begin();
-        for(int l = 0; l <= lMax; ++l)
+        // the preconditioner is the inverse of the diagonal of the matrix, 1 + sqrt(C_l) b_l Y^T N^-1 Y b_l sqrt(C_l)
+        for(int l = 0; l <= lMax_; ++l)
         {
-            check(it != v.end(), "");
-            alm(l, 0) = xcomplex<double>((*it), 0.0);
-            ++it;
-            for(int m = 1; m <= l; ++m)
-            {
-                check(it != v.end(), "");
-                const double re = *it;
-                ++it;
-                check(it != v.end(), "");
-                const double im = *it;
-                ++it;
-                alm(l, m) = xcomplex<double>(re, im);
-            }
+            factor_[l] = beam[l] * std::sqrt(cl[l]);
+            for(int i = l * l; i < (l + 1) * (l + 1); ++i)
+                precond_[i] = 1.0 / (1.0 + factor_[l] * factor_[l] * noiseDiag[i]);
         }
     }
 
-    void multiplyByMatrix(const std::vector<double>& original, std::vector<double>& result) const
+    void multiplyByMatrix(const std::vector<double>& original, std::vector<double>& result)
     {
         check(result.size() == original.size(), "");
 
-        Alm<xcomplex<double> > alm(lMax_, lMax_);
-        vectorToAlm(original, alm);
-
-        Healpix_Map<double> map;
-        map.SetNside(nSide_, RING);
-
         // perform the matrix operation, part 1
-        for(int l = 0; l <= lMax_; ++l)
-        {
-            alm(l, 0) *= (beam_[l] * std::sqrt(cl_[l]));
-            for(int m = 1; m <= l; ++m)
-                alm(l, m) *= (beam_[l] * std::sqrt(cl_[l]));
-        }
+        AlmUtils::vectorToAlm(original, &alm_);
+        AlmUtils::scale(&alm_, factor_);
 
         // back to pixel space
-        alm2map(alm, map);
+        sht_.alm2map(alm_, map_);
 
         // apply noise
-        for(long i = 0; i < map.Npix(); ++i)
-        {
-            if(mask_[i] > 0.5)
-                map[i] /= (pixelNoise_ * pixelNoise_);
-            else
-                map[i] = 0;
-        }
+        const double nInv = 1.0 / (pixelNoise_ * pixelNoise_);
+        for(long i = 0; i < map_.Npix(); ++i)
+            map_[i] = (mask_[i] > 0.5 ? map_[i] * nInv : 0);
 
         // back to harmonic space
-        arr<double> weight(2 * map.Nside(), map.Npix() / (4 * Math::pi));
-        map2alm(map, alm, weight);
+        sht_.map2alm(map_, alm_, weight_);
 
         // perform the matrix operation, part 2
-        for(int l = 0; l <= lMax_; ++l)
-        {
-            alm(l, 0) *= (beam_[l] * std::sqrt(cl_[l]));
-            for(int m = 1; m <= l; ++m)
-                alm(l, m) *= (beam_[l] * std::sqrt(cl_[l]));
-        }
-
-        almToVector(alm, result);
+        AlmUtils::scale(&alm_, factor_);
+        AlmUtils::almToVector(alm_, &result);
 
         for(int i = 0; i < result.size(); ++i)
             result[i] += original[i];
@@ -406,33 +361,118 @@ public:
 
     void preconditioner(const std::vector<double>& original, std::vector<double>& result) const
     {
-        // go to harmonic space
-        Alm<xcomplex<double> > alm(lMax_, lMax_);
-        vectorToAlm(original, alm);
-
-        // perform preconditioning
-        for(int l = 0; l <= lMax_; ++l)
-            for(int m = 0; m <= l; ++m)
-            {
-                const double nl = pixelNoise_ * pixelNoise_ * 4 * Math::pi / goodPix_;
-                const double d = 1.0 + cl_[l] * beam_[l] * beam_[l] / nl;
-                alm(l, m) /= d;
-            }
+        check(original.size() == precond_.size(), "");
+        check(result.size() == precond_.size(), "");
 
-        // write map back into vector
-        almToVector(alm, result);
+        for(int i = 0; i < precond_.size(); ++i)
+            result[i] = precond_[i] * original[i];
     }
 
 private:
+    const SphericalHarmonicTransform& sht_;
     long nSide_;
     int lMax_;
-    const std::vector<double>& cl_;
     const Healpix_Map<double>& mask_;
     double pixelNoise_;
-    const std::vector<double>& beam_;
-    int goodPix_;
+    std::vector<double> factor_, precond_;
+
+    // work buffers, reused in all of the iterations
+    Alm<xcomplex<double> > alm_;
+    Healpix_Map<double> map_;
+    double weight_;
 };
 
+void
+CMBGibbsSampler::calculateNoiseDiagonal()
+{
+    const long nSide = mask_.Nside(), nPix = mask_.Npix();
+
+    // the pixels of each ring are contiguous in the RING scheme
+    std::vector<long> ringStart;
+    std::vector<double> ringTheta;
+    for(long i = 0; i < nPix; ++i)
+    {
+        double theta, phi;
+        pix2ang_ring(nSide, i, &theta, &phi);
+        if(ringTheta.empty() || theta != ringTheta.back())
+        {
+            ringStart.push_back(i);
+            ringTheta.push_back(theta);
+        }
+    }
+    ringStart.push_back(nPix);
+
+    const int nRings = ringTheta.size();
+    const int size = (lMax_ + 1) * (lMax_ + 1);
+    noiseDiag_.clear();
+    noiseDiag_.resize(size, 0);
+
+    // the diagonal is sum_p mask_p lambda_lm(theta_p)^2 2 cos^2(m phi_p) for the real parts (sin^2 for the imaginary parts, no factor of 2 for m = 0), so for each ring only the sums of cos(k phi) over the unmasked pixels are needed
+#pragma omp parallel default(shared)
+    {
+        std::vector<double> diag(size, 0), cosSum(2 * lMax_ + 1), lambda(lMax_ + 1);
+
+#pragma omp for schedule(dynamic)
+        for(int r = 0; r < nRings; ++r)
+        {
+            std::fill(cosSum.begin(), cosSum.end(), 0.0);
+            bool empty = true;
+            for(long i = ringStart[r]; i < ringStart[r + 1]; ++i)
+            {
+                if(mask_[i] <= 0.5)
+                    continue;
+
+                empty = false;
+                double theta, phi;
+                pix2ang_ring(nSide, i, &theta, &phi);
+                const double c1 = std::cos(phi);
+                double cPrev = 1, c = c1;
+                cosSum[0] += 1;
+                cosSum[1] += c1;
+                for(int k = 2; k <= 2 * lMax_; ++k)
+                {
+                    const double cNext = 2 * c1 * c - cPrev;
+                    cosSum[k] += cNext;
+                    cPrev = c;
+                    c = cNext;
+                }
+            }
+
+            if(empty)
+                continue;
+
+            const double x = std::cos(ringTheta[r]);
+            for(int m = 0; m <= lMax_; ++m)
+            {
+                Math::AssociatedLegendre::calculateNormalizedAll(lMax_, m, x, &(lambda[0]));
+
+                const double re = (m == 0 ? cosSum[0] : cosSum[0] + cosSum[2 * m]);
+                const double im = cosSum[0] - cosSum[2 * m];
+                for(int l = m; l <= lMax_; ++l)
+                {
+                    const double l2 = lambda[l] * lambda[l];
+                    if(m == 0)
+                        diag[l * l] += l2 * re;
+                    else
+                    {
+                        diag[l * l + 2 * m - 1] += l2 * re;
+                        diag[l * l + 2 * m] += l2 * im;
+                    }
+                }
+            }
+        }
+
+#pragma omp critical (cmb_gibbs_noise_diagonal)
+        {
+            for(int i = 0; i < size; ++i)
+                noiseDiag_[i] += diag[i];
+        }
+    }
+
+    for(int i = 0; i < size; ++i)
+        noiseDiag_[i] /= (pixelNoise_ * pixelNoise_);
+}
+
 void
 CMBGibbsSampler::generateSignal()
 {
@@ -462,33 +502,34 @@ CMBGibbsSampler::generateSignal()
 
     // harmonic space
     Alm<xcomplex<double> > alm(lMax_, lMax_), alm1(lMax_, lMax_), alm2(lMax_, lMax_);
-    arr<double> weight(2 * map.Nside(), map.Npix() / (4 * Math::pi));
-    arr<double> weight1(2 * map.Nside(), std::sqrt(map.Npix() / (4 * Math::pi)));
-    map2alm(map, alm, weight);
-    map2alm(omega1, alm1, weight);
+    // map and omega1 have the same weight, so they are transformed together
+    const double weight = map.Npix() / (4 * Math::pi);
+    const Healpix_Map<double>* maps[2] = {&map, &omega1};
+    Alm<xcomplex<double> >* alms[2] = {&alm, &alm1};
+    sht_->map2alm(2, maps, alms, weight);
 
     for(int l = 0; l <= lMax_; ++l)
         for(int m = 0; m <= l; ++m)
             alm(l, m) += alm1(l, m);
 
     // beam and sqrt(cl)
+    std::vector<double> sqrtCl(lMax_ + 1), factor(lMax_ + 1);
     for(int l = 0; l <= lMax_; ++l)
     {
-        alm(l, 0) *= (beam_[l] * std::sqrt(cl_[l]));
-        for(int m = 1; m <= l; ++m)
-            alm(l, m) *= (beam_[l] * std::sqrt(cl_[l]));
+        sqrtCl[l] = std::sqrt(cl_[l]);
+        factor[l] = beam_[l] * sqrtCl[l];
     }
+    AlmUtils::scale(&alm, factor);
 
-    arr<double> weight2(2 * map.Nside(), 1);
-    map2alm(omega0, alm2, weight1);
+    sht_->map2alm(omega0, alm2, std::sqrt(weight));
 
     for(int l = 0; l <= lMax_; ++l)
         for(int m = 0; m <= l; ++m)
             alm(l, m) += alm2(l, m);
     std::vector<double> b;
-    CmbGibbsCGTreats::almToVector(alm, b);
+    AlmUtils::almToVector(alm, &b);
 
-    CmbGibbsCGTreats cgTreats(map.Nside(), lMax_, cl_, mask_, pixelNoise_, beam_);
+    CmbGibbsCGTreats cgTreats(*sht_, cl_, mask_, pixelNoise_, beam_, noiseDiag_);
 
     Math::ConjugateGradient<CmbGibbsCGTreats> cg(b.size(), &cgTreats, b);
 
@@ -516,15 +557,10 @@ CMBGibbsSampler::generateSignal()
     // harmonic space
     map2alm(map, s_, weight);
     */
-    CmbGibbsCGTreats::vectorToAlm(res, s_);
+    AlmUtils::vectorToAlm(res, &s_);
 
     // fix for sqrt(cl)
-    for(int l = 0; l <= lMax_; ++l)
-    {
-        s_(l, 0) *= std::sqrt(cl_[l]);
-        for(int m = 1; m <= l; ++m)
-            s_(l, m) *= std::sqrt(cl_[l]);
-    }
+    AlmUtils::scale(&s_, sqrtCl);
 
     calculateSigmaL();
 }
@@ -540,12 +576,7 @@ CMBGibbsSampler::step()
 void
 CMBGibbsSampler::calculateSigmaL()
 {
-    for(int l = 0; l <= lMax_; ++l)
-    {
-        sigmaL_[l] = s_(l, 0).norm();
-        for(int m = 1; m <= l; ++m)
-            sigmaL_[l] += 2 * s_(l, m).norm();
-    }
+    AlmUtils::sigmaL(s_, &sigmaL_);
 }
 
 double
@@ -595,6 +626,37 @@ CMBGibbsSampler::generateChain(GibbsSampleChain& chain, int nSamples, int burnIn
     output_screen("OK" << std::endl);
 }
 
+void
+CMBGibbsSampler::generateChainMPI(GibbsSampleChain& chain, int nSamples, int burnIn)
+{
+    GibbsSampleChain myChain;
+    generateChain(myChain, nSamples, burnIn);
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = mpi.numProcesses();
+    if(nProcesses == 1)
+    {
+        chain.swap(myChain);
+        return;
+    }
+
+    // each process fills its own part of the combined chain with zeros elsewhere, then they are added up
+    const int n = lMax_ + 1;
+    const long total = long(nProcesses) * nSamples * n;
+    check(total <= 2147483647L, "the combined chain is too large to be communicated at once");
+    std::vector<double> send(total, 0), combined(total);
+    const long start = long(mpi.processId()) * nSamples * n;
+    for(int i = 0; i < nSamples; ++i)
+        std::copy(myChain[i].begin(), myChain[i].end(), send.begin() + start + long(i) * n);
+
+    mpi.reduce(&(send[0]), &(combined[0]), total, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+    mpi.bcast(&(combined[0]), total, CosmoMPI::DOUBLE);
+
+    chain.resize(long(nProcesses) * nSamples);
+    for(long i = 0; i < chain.size(); ++i)
+        chain[i].assign(combined.begin() + i * n, combined.begin() + (i + 1) * n);
+}
+
 double
 CMBGibbsSampler::calculateLikelihood(const std::vector<double>& cl, const GibbsSampleChain& chain, int lMax)
 {
@@ -602,7 +664,6 @@ CMBGibbsSampler::calculateLikelihood(const std::vector<double>& cl, const GibbsS
     check(cl.size() >= lMax + 1, "");
     check(!chain.empty(), "the chain is empty");
 
-    double like = 0;
     std::vector<double> likeVec(chain.size(), 0);
 
 #pragma omp parallel for default(shared)
@@ -612,15 +673,157 @@ CMBGibbsSampler::calculateLikelihood(const std::vector<double>& cl, const GibbsS
         likeVec[i] = calculateLikelihood(cl, chain[i], lMax);
     }
 
+    return combineLikelihoods(likeVec);
+}
+
+void
+CMBGibbsSampler::mappedLikelihoods(const std::vector<double>& cl, const Math::MappedMatrix& chain, int lMax, std::vector<double>* likeVec)
+{
+    check(lMax >= 2, "");
+    check(cl.size() >= lMax + 1, "");
+    check(!chain.isSymmetric(), "invalid chain");
+    check(chain.rows() >= lMax + 1, "the chain only has l up to " << chain.rows() - 1);
+    check(chain.cols() > 0, "the chain is empty");
+
+    const int size = chain.cols();
+    likeVec->assign(size, 0);
+
+    // the samples are split into blocks, for each block the rows (l) are read one after the other through contiguous memory, the rows above lMax are never touched
+    const int blockSize = 1024;
+    const int nBlocks = (size + blockSize - 1) / blockSize;
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int k = 0; k < nBlocks; ++k)
+    {
+        const int begin = k * blockSize, end = std::min(size, begin + blockSize);
+        for(int l = 2; l <= lMax; ++l)
+        {
+            check(cl[l] > 0, "");
+            const double* row = chain.data() + (unsigned long)(l) * size;
+            const double logCl = std::log(cl[l]);
+            for(int i = begin; i < end; ++i)
+            {
+                const double sigma = row[i] / double(2 * l + 1);
+                (*likeVec)[i] += (2 * l + 1) * (logCl + sigma / cl[l]) - (2 * l - 1) * std::log(sigma);
+            }
+        }
+    }
+}
+
+double
+CMBGibbsSampler::calculateLikelihood(const std::vector<double>& cl, const Math::MappedMatrix& chain, int lMax)
+{
+    std::vector<double> likeVec;
+    mappedLikelihoods(cl, chain, lMax, &likeVec);
+    return combineLikelihoods(likeVec);
+}
+
+double
+CMBGibbsSampler::calculateLikelihoodWithGradient(const std::vector<double>& cl, const std::vector<double>& sigmaL, int lMax, std::vector<double>* grad)
+{
+    const double res = calculateLikelihood(cl, sigmaL, lMax);
+
+    // d/dC_l of (2l + 1) (ln C_l + sigma / C_l), with (2l + 1) sigma = sigma_l
+    grad->assign(lMax + 1, 0);
+    for(int l = 2; l <= lMax; ++l)
+        (*grad)[l] = (2 * l + 1) / cl[l] - sigmaL[l] / (cl[l] * cl[l]);
+
+    return res;
+}
+
+double
+CMBGibbsSampler::calculateLikelihoodWithGradient(const std::vector<double>& cl, const GibbsSampleChain& chain, int lMax, std::vector<double>* grad)
+{
+    check(lMax >= 2, "");
+    check(cl.size() >= lMax + 1, "");
+    check(!chain.empty(), "the chain is empty");
+
+    std::vector<double> likeVec(chain.size(), 0);
+
+#pragma omp parallel for default(shared)
+    for(int i = 0; i < chain.size(); ++i)
+    {
+        check(chain[i].size() >= lMax + 1, "");
+        likeVec[i] = calculateLikelihood(cl, chain[i], lMax);
+    }
+
+    std::vector<double> weights;
+    const double res = combineWeights(likeVec, &weights);
+
+    // the gradient of -2ln of the average of the likelihoods is the average of the gradients of the samples weighted by their likelihoods
+    grad->assign(lMax + 1, 0);
+#pragma omp parallel for default(shared)
+    for(int l = 2; l <= lMax; ++l)
+    {
+        double sigma = 0;
+        for(int i = 0; i < chain.size(); ++i)
+            sigma += weights[i] * chain[i][l];
+        (*grad)[l] = (2 * l + 1) / cl[l] - sigma / (cl[l] * cl[l]);
+    }
+
+    return res;
+}
+
+double
+CMBGibbsSampler::calculateLikelihoodWithGradient(const std::vector<double>& cl, const Math::MappedMatrix& chain, int lMax, std::vector<double>* grad)
+{
+    std::vector<double> likeVec;
+    mappedLikelihoods(cl, chain, lMax, &likeVec);
+
+    std::vector<double> weights;
+    const double res = combineWeights(likeVec, &weights);
+
+    // one contiguous row of the chain for each l
+    const int size = chain.cols();
+    grad->assign(lMax + 1, 0);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int l = 2; l <= lMax; ++l)
+    {
+        const double* row = chain.data() + (unsigned long)(l) * size;
+        double sigma = 0;
+        for(int i = 0; i < size; ++i)
+            sigma += weights[i] * row[i];
+        (*grad)[l] = (2 * l + 1) / cl[l] - sigma / (cl[l] * cl[l]);
+    }
+
+    return res;
+}
+
+double
+CMBGibbsSampler::combineWeights(const std::vector<double>& likeVec, std::vector<double>* weights)
+{
+    check(!likeVec.empty(), "");
+
+    // the same as combineLikelihoods, also keeping the normalized weights of the samples
+    const double minLike = *std::min_element(likeVec.begin(), likeVec.end());
+    weights->resize(likeVec.size());
+    double total = 0;
+    for(int i = 0; i < likeVec.size(); ++i)
+    {
+        (*weights)[i] = (likeVec[i] - minLike < 20 ? std::exp(-(likeVec[i] - minLike) / 2.0) : 0);
+        total += (*weights)[i];
+    }
+
+    for(int i = 0; i < likeVec.size(); ++i)
+        (*weights)[i] /= total;
+
+    return minLike - 2 * std::log(total / likeVec.size());
+}
+
+double
+CMBGibbsSampler::combineLikelihoods(std::vector<double>& likeVec)
+{
+    check(!likeVec.empty(), "");
+
     std::sort(likeVec.begin(), likeVec.end());
 
+    double like = 0;
     for(int i = 0; i < likeVec.size(); ++i)
     {
         if(likeVec[i] - likeVec[0] < 20)
             like += std::exp(-(likeVec[i] - likeVec[0]) / 2.0);
     }
 
-    like /= chain.size();
+    like /= likeVec.size();
     return likeVec[0] - 2 * std::log(like);
 }
 
@@ -693,3 +896,45 @@ CMBGibbsSampler::readChainFromFile(GibbsSampleChain& chain, const char* fileName
 
     in.close();
 }
+
+void
+CMBGibbsSampler::writeChainIntoMappedFile(const GibbsSampleChain& chain, const char* fileName)
+{
+    check(!chain.empty(), "");
+    check(!chain[0].empty(), "");
+
+    // one row for each l, the samples are the columns
+    const int size = chain.size();
+    const int n = chain[0].size();
+    std::vector<double> data((unsigned long)(n) * size);
+    for(int i = 0; i < size; ++i)
+    {
+        check(chain[i].size() == n, "all of the samples must have the same size");
+        for(int l = 0; l < n; ++l)
+            data[(unsigned long)(l) * size + i] = chain[i][l];
+    }
+
+    Math::MappedMatrix::writeIntoFile(n, size, false, &(data[0]), fileName);
+}
+
+void
+CMBGibbsSampler::readChainFromMappedFile(GibbsSampleChain& chain, const char* fileName, int lMax)
+{
+    Math::MappedMatrix mapped(fileName);
+    check(!mapped.isSymmetric(), "invalid chain file " << fileName);
+    if(lMax < 0)
+        lMax = mapped.rows() - 1;
+    check(lMax < mapped.rows(), "the chain in " << fileName << " only has l up to " << mapped.rows() - 1);
+
+    const int size = mapped.cols();
+    chain.resize(size);
+    for(int i = 0; i < size; ++i)
+        chain[i].resize(lMax + 1);
+
+    for(int l = 0; l <= lMax; ++l)
+    {
+        const double* row = mapped.data() + (unsigned long)(l) * size;
+        for(int i = 0; i < size; ++i)
+            chain[i][l] = row[i];
+    }
+}
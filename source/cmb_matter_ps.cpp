@@ -0,0 +1,61 @@
+#include <cmath>
+#include <sstream>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cmb_matter_ps.hpp>
+
+CMBMatterPs::CMBMatterPs(CMB& cmb, CosmologicalParams& params, const std::vector<double>& k, const std::vector<double>& z) : cmb_(cmb), params_(params), k_(k), z_(z)
+{
+    check(!k_.empty(), "no k values");
+    check(!z_.empty(), "no redshifts");
+    for(int i = 0; i < k_.size(); ++i)
+    {
+        check(k_[i] > 0, "invalid k " << k_[i]);
+        check(i == 0 || k_[i] > k_[i - 1], "the k values must be in increasing order");
+    }
+    for(int i = 0; i < z_.size(); ++i)
+    {
+        check(z_[i] >= 0, "invalid redshift " << z_[i]);
+        check(i == 0 || z_[i] > z_[i - 1], "the redshifts must be in increasing order");
+    }
+}
+
+void
+CMBMatterPs::evaluate(const std::vector<double>& x, std::vector<double>* res) const
+{
+    if(!params_.setAllParameters(x))
+    {
+        StandardException exc;
+        exc.set("The cosmological parameters are invalid.");
+        throw exc;
+    }
+
+    cmb_.initialize(params_, false, false, false, true, z_.back());
+
+    res->resize(k_.size() * z_.size());
+    Math::TableFunction<double, double> ps;
+    for(int j = 0; j < z_.size(); ++j)
+    {
+        cmb_.getMatterPs(z_[j], &ps);
+        check(ps.size() >= 2, "");
+
+        for(int i = 0; i < k_.size(); ++i)
+        {
+            Math::TableFunction<double, double>::const_iterator it = ps.lower_bound(k_[i]);
+            if(it == ps.begin() || it == ps.end())
+            {
+                std::stringstream exceptionStr;
+                exceptionStr << "k = " << k_[i] << " is outside of the range " << ps.begin()->first << " to " << ps.rbegin()->first << " calculated by CLASS.";
+                StandardException exc;
+                exc.set(exceptionStr.str());
+                throw exc;
+            }
+
+            Math::TableFunction<double, double>::const_iterator prev = it;
+            --prev;
+            const double t = std::log(k_[i] / prev->first) / std::log(it->first / prev->first);
+            (*res)[j * k_.size() + i] = std::exp((1 - t) * std::log(prev->second) + t * std::log(it->second));
+        }
+    }
+}
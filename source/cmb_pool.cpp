@@ -0,0 +1,141 @@
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cmb_pool.hpp>
+
+CMBPool::CMBPool(int nInstances, int lMax, bool wantAllL, bool primordialInitialize, bool includeTensors, int lMaxTensors, double kPerDecade, double kMin, double kMax) : threadsPerInstance_(1), thread_(NULL)
+{
+    check(nInstances > 0, "invalid number of instances " << nInstances);
+
+#ifdef COSMO_OMP
+    threadsPerInstance_ = omp_get_max_threads() / nInstances;
+    if(threadsPerInstance_ < 1)
+        threadsPerInstance_ = 1;
+#endif
+
+    cmbs_.resize(nInstances);
+    for(int i = 0; i < nInstances; ++i)
+    {
+        cmbs_[i] = new CMB;
+        cmbs_[i]->preInitialize(lMax, wantAllL, primordialInitialize, includeTensors, lMaxTensors, kPerDecade, kMin, kMax);
+    }
+}
+
+CMBPool::~CMBPool()
+{
+    if(thread_)
+    {
+        thread_->join();
+        delete thread_;
+    }
+
+    for(int i = 0; i < cmbs_.size(); ++i)
+        delete cmbs_[i];
+}
+
+void
+CMBPool::computeCls(const std::vector<const CosmologicalParams*>& params, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE, std::vector<std::vector<double> >* clBB, bool lensed)
+{
+    check(clTT || clEE || clTE || clBB, "no Cl-s requested");
+
+    const int nPoints = params.size();
+    const bool wantT = (clTT || clTE);
+    const bool wantPol = (clEE || clTE || clBB);
+
+    if(clTT)
+        clTT->resize(nPoints);
+    if(clEE)
+        clEE->resize(nPoints);
+    if(clTE)
+        clTE->resize(nPoints);
+    if(clBB)
+        clBB->resize(nPoints);
+
+    std::string error;
+
+#ifdef COSMO_OMP
+    // CLASS runs its own parallel regions inside of the threads of the instances
+    const int maxLevels = omp_get_max_active_levels();
+    if(threadsPerInstance_ > 1 && maxLevels < 2)
+        omp_set_max_active_levels(2);
+#endif
+
+#pragma omp parallel for default(shared) schedule(dynamic) num_threads(cmbs_.size())
+    for(int i = 0; i < nPoints; ++i)
+    {
+        int instance = 0;
+#ifdef COSMO_OMP
+        instance = omp_get_thread_num();
+        omp_set_num_threads(threadsPerInstance_);
+#endif
+        check(instance < cmbs_.size(), "");
+        CMB& cmb = *(cmbs_[instance]);
+
+        try {
+            cmb.initialize(*(params[i]), wantT, wantPol, lensed, false);
+            if(lensed)
+                cmb.getLensedCl((clTT ? &((*clTT)[i]) : NULL), (clEE ? &((*clEE)[i]) : NULL), (clTE ? &((*clTE)[i]) : NULL), (clBB ? &((*clBB)[i]) : NULL));
+            else
+                cmb.getCl((clTT ? &((*clTT)[i]) : NULL), (clEE ? &((*clEE)[i]) : NULL), (clTE ? &((*clTE)[i]) : NULL), NULL, NULL, NULL, (clBB ? &((*clBB)[i]) : NULL));
+        } catch (std::exception& e)
+        {
+#pragma omp critical (cmb_pool_error)
+            {
+                if(error.empty())
+                    error = e.what();
+            }
+        }
+    }
+
+#ifdef COSMO_OMP
+    omp_set_max_active_levels(maxLevels);
+#endif
+
+    if(!error.empty())
+    {
+        StandardException exc;
+        exc.set(error);
+        throw exc;
+    }
+}
+
+void
+CMBPool::startCls(const std::vector<const CosmologicalParams*>& params, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE, std::vector<std::vector<double> >* clBB, bool lensed)
+{
+    check(!thread_, "the previous batch has not been finished");
+
+    asyncError_.clear();
+    thread_ = new std::thread(&CMBPool::computeClsAsync, this, &params, clTT, clEE, clTE, clBB, lensed);
+}
+
+void
+CMBPool::finishCls()
+{
+    check(thread_, "no batch has been started");
+
+    thread_->join();
+    delete thread_;
+    thread_ = NULL;
+
+    if(!asyncError_.empty())
+    {
+        StandardException exc;
+        exc.set(asyncError_);
+        throw exc;
+    }
+}
+
+void
+CMBPool::computeClsAsync(const std::vector<const CosmologicalParams*>* params, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE, std::vector<std::vector<double> >* clBB, bool lensed)
+{
+    // exceptions cannot leave the thread
+    try {
+        computeCls(*params, clTT, clEE, clTE, clBB, lensed);
+    } catch (std::exception& e)
+    {
+        asyncError_ = e.what();
+    }
+}
@@ -2,205 +2,244 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <utility>
 #include <cmath>
 #include <algorithm>
+#include <functional>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
+#include <markov_chain.hpp>
 
-struct ChainElement
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
+
+namespace
+{
+
+// a positive integer from a command line argument
+int parseIndex(const std::string& s, const char* what)
 {
-    ChainElement() : p(0), like(0)
+    std::stringstream str(s);
+    int i = 0;
+    str >> i;
+    if(!str || !str.eof() || i <= 0)
     {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Invalid " << what << " " << s << ". Needs to be a positive integer.";
+        exc.set(exceptionStr.str());
+        throw exc;
     }
+    return i;
+}
 
-    ChainElement(const ChainElement& other) : p(other.p), like(other.like), params(other.params)
+// pairs of the form p1:p2 separated by commas, the indices starting from 1
+void parsePairs(const std::string& s, std::vector<std::pair<int, int> >& pairs)
+{
+    std::stringstream str(s);
+    std::string pair;
+    while(std::getline(str, pair, ','))
     {
+        const std::size_t pos = pair.find(':');
+        if(pos == std::string::npos)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid parameter pair " << pair << ". Needs to be of the form p1:p2.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        pairs.push_back(std::make_pair(parseIndex(pair.substr(0, pos), "parameter index"), parseIndex(pair.substr(pos + 1), "parameter index")));
     }
+}
 
-    double p;
-    double like;
-    std::vector<double> params;
-
-    bool operator < (const ChainElement& other) const
+// the weights of the cells sorted in decreasing order give the cumulative probability of each cell, the contours are at the levels of this probability (0.683, 0.955, etc.)
+void cumulativeProbabilities(const std::vector<double>& z, std::vector<double>& c)
+{
+    std::vector<std::pair<double, unsigned long> > sorted(z.size());
+    for(unsigned long i = 0; i < z.size(); ++i)
+        sorted[i] = std::make_pair(z[i], i);
+    std::sort(sorted.begin(), sorted.end(), std::greater<std::pair<double, unsigned long> >());
+
+    c.resize(z.size());
+    double cumul = 0;
+    for(unsigned long i = 0; i < sorted.size(); ++i)
     {
-        return like < other.like;
+        cumul += sorted[i].first;
+        c[sorted[i].second] = cumul;
     }
-};
+}
+
+} // namespace
 
 int main(int argc, char *argv[])
 {
     try {
         StandardException exc;
-        if(argc < 5)
+        if(argc < 4)
         {
-            std::string exceptionStr = "Input chain file, the indices of the two parameters for the contour plot (starting from 1), the output file, and the posterior resolution (i.e. number of points, optional, default = 100) must be specified.";
+            std::string exceptionStr = "Usage:\n"
+                "contour_plot <chain> <p1> <p2> <output file> [<resolution>]\n"
+                "contour_plot <chain> <pairs> <output root> [<resolution>]\n"
+                "The chain can be a text, binary, compressed, or shared chain file (see MarkovChain). The parameter indices start from 1. The pairs are given as p1:p2 separated by commas (for example 1:2,1:3,2:3), or all for all of the pairs of parameters, then the output for each pair is written into <output root>_p1_p2.txt. The resolution is the number of cells for each parameter (optional, default = 100).\n"
+                "Each line of the output is x y z c, where (x, y) is the center of a cell, z is the probability density in the cell, and c is the total probability of the cells with density at least z (so the contours are at the levels of c, for example 0.683 and 0.955).";
             exc.set(exceptionStr);
             throw exc;
         }
 
-        std::stringstream paramsStr;
-        paramsStr << argv[2] << ' ' << argv[3];
-        int p1, p2;
-        paramsStr >> p1 >> p2;
-
-        if(p1 <= 0)
+        // the single pair form is kept for compatibility
+        std::vector<std::pair<int, int> > pairs;
+        std::vector<std::string> outputNames;
+        int resArg;
+        const std::string pairsStr = argv[2];
+        const bool allPairs = (pairsStr == "all");
+        if(allPairs || pairsStr.find(':') != std::string::npos)
         {
-            std::stringstream exceptionStr;
-            exceptionStr << "Invalid parameter index " << argv[2] << ". Needs to be a positive integer.";
-            exc.set(exceptionStr.str());
-            throw exc;
+            if(!allPairs)
+                parsePairs(pairsStr, pairs);
+            resArg = 4;
         }
-
-        if(p2 <= 0)
+        else
         {
-            std::stringstream exceptionStr;
-            exceptionStr << "Invalid parameter index " << argv[3] << ". Needs to be a positive integer.";
-            exc.set(exceptionStr.str());
-            throw exc;
+            if(argc < 5)
+            {
+                std::string exceptionStr = "The output file must be specified.";
+                exc.set(exceptionStr);
+                throw exc;
+            }
+            pairs.push_back(std::make_pair(parseIndex(argv[2], "parameter index"), parseIndex(argv[3], "parameter index")));
+            outputNames.push_back(argv[4]);
+            resArg = 5;
         }
 
         int res = 100;
-        if(argc > 5)
+        if(argc > resArg)
+            res = parseIndex(argv[resArg], "resolution");
+
+        // the chain is read once for all of the pairs
+        output_screen("Reading the chain..." << std::endl);
+        MarkovChain chain(argv[1]);
+        output_screen("OK" << std::endl);
+
+        const int nParams = chain.nParams();
+        if(allPairs)
         {
-            std::stringstream resStr;
-            resStr << argv[5];
-            resStr >> res;
+            for(int i = 1; i <= nParams; ++i)
+            {
+                for(int j = i + 1; j <= nParams; ++j)
+                    pairs.push_back(std::make_pair(i, j));
+            }
+        }
 
-            if(res <= 0)
+        for(int k = 0; k < pairs.size(); ++k)
+        {
+            if(pairs[k].first > nParams || pairs[k].second > nParams)
             {
                 std::stringstream exceptionStr;
-                exceptionStr << "Invalid resolution " << argv[5] << ". Needs to be a positive integer.";
+                exceptionStr << "Invalid parameter pair " << pairs[k].first << ":" << pairs[k].second << ". The chain has " << nParams << " parameters.";
                 exc.set(exceptionStr.str());
                 throw exc;
             }
-        }
 
-        std::vector<ChainElement> chain;
-
-        std::ifstream in(argv[1]);
-        if(!in)
-        {
-            std::stringstream exceptionStr;
-            exceptionStr << "Input chain file " << argv[1] << " cannot be read.";
-            exc.set(exceptionStr.str());
-            throw exc;
+            if(outputNames.size() <= k)
+            {
+                std::stringstream name;
+                name << argv[3] << '_' << pairs[k].first << '_' << pairs[k].second << ".txt";
+                outputNames.push_back(name.str());
+            }
         }
 
-        const int n = (p1 > p2 ? p1 : p2);
+        const unsigned long n = chain.size();
+        const std::vector<double>& probs = chain.probColumn();
 
-        output_screen("Reading the chain..." << std::endl);
-        double maxP = 0;
-        while(!in.eof())
+        // the ranges of all of the parameters
+        std::vector<double> mins(nParams), deltas(nParams);
+        for(int i = 0; i < nParams; ++i)
         {
-            std::string s;
-            std::getline(in, s);
-            if(s == "")
-                break;
-
-            ChainElement e;
-            chain.push_back(e);
-            
-            std::stringstream str(s);
-            str >> e.p >> e.like;
-            e.params.resize(n);
-            for(int i = 0; i < n; ++i)
-                str >> e.params[i];
-
-            if(e.p > maxP)
-                maxP = e.p;
-
-            chain.push_back(e);
+            const std::vector<double>& column = chain.paramColumn(i);
+            const std::pair<std::vector<double>::const_iterator, std::vector<double>::const_iterator> minMax = std::minmax_element(column.begin(), column.end());
+            mins[i] = *(minMax.first);
+            deltas[i] = (*(minMax.second) - mins[i]) / res;
+            if(deltas[i] == 0)
+                deltas[i] = 1;
         }
 
-        in.close();
-        output_screen("OK" << std::endl);
-
-        const double minP = maxP * 1e-6;
+        output_screen("Creating the posterior distributions for " << pairs.size() << " pairs of parameters..." << std::endl);
 
+        // all of the pairs are binned in one pass over the chain, each thread has its own grids which are added at the end
+        const unsigned long gridSize = (unsigned long) res * res;
+        std::vector<double> z(pairs.size() * gridSize, 0.0);
 
-        output_screen("Creating the posterior distributions..." << std::endl);
-        double min1 = 1e100, max1 = -1e100, min2 = 1e100, max2 = -1e100;
-        for(unsigned long i = 0; i < chain.size(); ++i)
+#pragma omp parallel default(shared)
         {
-            const ChainElement& e = chain[i];
-            if(e.p < minP)
-                continue;
-
-            if(e.params[p1] < min1)
-                min1 = e.params[p1];
-
-            if(e.params[p1] > max1)
-                max1 = e.params[p1];
+            std::vector<double> zLocal(z.size(), 0.0);
+            std::vector<int> cell(nParams);
 
-            if(e.params[p2] < min2)
-                min2 = e.params[p2];
-
-            if(e.params[p2] > max2)
-                max2 = e.params[p2];
-        }
-        const double d1 = (max1 - min1) / res;
-        const double d2 = (max2 - min2) / res;
-        std::vector<double> x(res), y(res);
-        for(int i = 0; i < res; ++i)
-        {
-            x[i] = min1 + d1 * i + d1 / 2;
-            y[i] = min2 + d2 * i + d2 / 2;
-        }
-        std::vector<std::vector<double> > z(res);
-        for(int i = 0; i < res; ++i)
-            z[i].resize(res, 0.0);
+#pragma omp for schedule(static)
+            for(long i = 0; i < (long) n; ++i)
+            {
+                for(int j = 0; j < nParams; ++j)
+                {
+                    int c = (int) std::floor((chain.paramColumn(j)[i] - mins[j]) / deltas[j]);
+                    if(c >= res)
+                        c = res - 1;
+                    if(c < 0)
+                        c = 0;
+                    cell[j] = c;
+                }
+
+                for(int k = 0; k < pairs.size(); ++k)
+                    zLocal[k * gridSize + (unsigned long) cell[pairs[k].first - 1] * res + cell[pairs[k].second - 1]] += probs[i];
+            }
 
-        double totalP = 0;
-        for(unsigned long i = 0; i < chain.size(); ++i)
-        {
-            const ChainElement& e = chain[i];
-            if(e.p < minP)
-                continue;
-
-            const double param1 = e.params[p1];
-            check(param1 >= min1, "");
-            int j1 = (int)std::floor((param1 - min1) / d1);
-            check(j1 >= 0, "");
-            if(j1 >= res)
-                j1 = res - 1;
-
-            const double param2 = e.params[p2];
-            check(param2 >= min2, "");
-            int j2 = (int)std::floor((param2 - min2) / d2);
-            check(j2 >= 0, "");
-            if(j2 >= res)
-                j2 = res - 1;
-
-            z[j1][j2] += e.p;
-            totalP += e.p;
+#pragma omp critical (contour_plot_grids)
+            {
+                for(unsigned long j = 0; j < z.size(); ++j)
+                    z[j] += zLocal[j];
+            }
         }
         output_screen("OK" << std::endl);
 
         output_screen("Writing the output..." << std::endl);
-        std::ofstream out(argv[4]);
-        if(!out)
-        {
-            std::stringstream exceptionStr;
-            exceptionStr << "Cannot write into the output file " << argv[4] << ".";
-            exc.set(exceptionStr.str());
-            throw exc;
-        }
+        double totalP = 0;
+        for(unsigned long i = 0; i < n; ++i)
+            totalP += probs[i];
+        check(totalP > 0, "");
 
-        double prob = 0;
-        unsigned long i = 0;
-        while(prob < 1 - 1e-5 && i < chain.size())
+        std::vector<double> grid(gridSize), cumul;
+        for(int k = 0; k < pairs.size(); ++k)
         {
-            if(chain[i].p > minP)
+            const int p1 = pairs[k].first - 1, p2 = pairs[k].second - 1;
+            const double norm = totalP * deltas[p1] * deltas[p2];
+            for(unsigned long j = 0; j < gridSize; ++j)
+                grid[j] = z[k * gridSize + j] / totalP;
+            cumulativeProbabilities(grid, cumul);
+
+            std::ofstream out(outputNames[k].c_str());
+            if(!out)
             {
-                out << chain[i].params[p1 - 1] << ' ' << chain[i].params[p2 - 1] << ' ' << prob << std::endl;
+                std::stringstream exceptionStr;
+                exceptionStr << "Cannot write into the output file " << outputNames[k] << ".";
+                exc.set(exceptionStr.str());
+                throw exc;
             }
-            prob += chain[i].p;
-            ++i;
+
+            for(int i1 = 0; i1 < res; ++i1)
+            {
+                const double x = mins[p1] + deltas[p1] * i1 + deltas[p1] / 2;
+                for(int i2 = 0; i2 < res; ++i2)
+                {
+                    const double y = mins[p2] + deltas[p2] * i2 + deltas[p2] / 2;
+                    const unsigned long j = (unsigned long) i1 * res + i2;
+                    out << x << ' ' << y << ' ' << z[k * gridSize + j] / norm << ' ' << cumul[j] << std::endl;
+                }
+            }
+            out.close();
         }
-        out.close();
         output_screen("OK" << std::endl);
-        
+
     } catch (std::exception& e)
     {
         output_screen("EXCEPTION CAUGHT!!! " << std::endl << e.what() << std::endl);
@@ -209,4 +248,3 @@ int main(int argc, char *argv[])
     }
     return 0;
 }
-
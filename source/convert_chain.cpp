@@ -0,0 +1,30 @@
+#include <string>
+#include <sstream>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <chain_file.hpp>
+
+int main(int argc, char *argv[])
+{
+    try {
+        StandardException exc;
+        if(argc < 3)
+        {
+            std::string exceptionStr = "The input binary chain file and the output text file must be specified. The output paramnames file can optionally be specified as a third argument.";
+            exc.set(exceptionStr);
+            throw exc;
+        }
+
+        output_screen("Converting the binary chain " << argv[1] << " into the text file " << argv[2] << "..." << std::endl);
+        const unsigned long n = BinaryChain::convertToText(argv[1], argv[2], (argc > 3 ? argv[3] : NULL));
+        output_screen("OK" << std::endl);
+        output_screen("Converted " << n << " chain elements." << std::endl);
+    } catch (std::exception& e)
+    {
+        output_screen("EXCEPTION CAUGHT!!! " << std::endl << e.what() << std::endl);
+        output_screen("Terminating!" << std::endl);
+        return 1;
+    }
+    return 0;
+}
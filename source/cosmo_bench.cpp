@@ -0,0 +1,765 @@
+#include <cosmo_mpi.hpp>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <random.hpp>
+#include <kd_tree.hpp>
+#include <cubic_spline.hpp>
+#include <table_function.hpp>
+#include <wigner_3j.hpp>
+#include <legendre.hpp>
+#include <markov_chain.hpp>
+#include <likelihood_function.hpp>
+
+#ifdef COSMO_LAPACK
+#include <matrix_impl.hpp>
+#include <fast_approximator.hpp>
+#include <mcmc.hpp>
+#endif
+
+#ifdef COSMO_HEALPIX
+#include <c_matrix_generator.hpp>
+#endif
+
+#ifdef COSMO_CLASS
+#include <cosmological_params.hpp>
+#include <cmb.hpp>
+#ifdef COSMO_PLANCK
+#include <planck_like.hpp>
+#endif
+#endif
+
+// Benchmarks of the main components, with fixed seeds and sizes so that the results of different builds can be compared.
+// Each benchmark prepares its data once, then the timed part is repeated and the minimum, median and mean times are reported, together with the number of items (points, queries, steps...) processed per second.
+// The results are printed and written into a JSON file for tracking regressions.
+
+namespace
+{
+
+// the results of the benchmarks are accumulated here so that the compiler cannot remove the calculations
+volatile double benchSink = 0;
+
+struct Benchmark
+{
+    std::string name;
+    // "micro" or "macro"
+    std::string kind;
+    // what the items are, for the output
+    std::string unit;
+    // prepares the data, called once
+    std::function<void()> setUp;
+    // the timed part, returns the number of items processed
+    std::function<unsigned long()> run;
+    // the memory traffic of each item for the memory bound benchmarks, 0 for the others
+    double bytesPerItem = 0;
+};
+
+struct BenchmarkResult
+{
+    std::string name, kind, unit;
+    int repeats;
+    unsigned long items;
+    double bytesPerItem;
+    double minSeconds, medianSeconds, meanSeconds;
+};
+
+std::vector<std::vector<double> > randomPoints(unsigned long n, int dim, int seed)
+{
+    Math::UniformRealGenerator gen(seed, -1, 1);
+    std::vector<std::vector<double> > points(n, std::vector<double>(dim));
+    for(unsigned long i = 0; i < n; ++i)
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    return points;
+}
+
+struct Wigner3JSumTreats
+{
+    Wigner3JSumTreats() : sum(0), count(0) {}
+    void process(int l1, int l2, int l3, double val) { sum += val; ++count; }
+    double sum;
+    unsigned long count;
+};
+
+class BenchGauss : public Math::LikelihoodFunction
+{
+public:
+    BenchGauss(int n) : n_(n) {}
+
+    virtual double calculate(double* params, int nPar)
+    {
+        check(nPar == n_, "");
+        double res = 0;
+        for(int i = 0; i < n_; ++i)
+            res += params[i] * params[i];
+        return res;
+    }
+
+private:
+    const int n_;
+};
+
+void addMicroBenchmarks(std::vector<Benchmark>& benchmarks)
+{
+    // kd tree
+    {
+        const int dim = 4;
+        const unsigned long nPoints = 50000, nQueries = 5000;
+        const int k = 20;
+        std::shared_ptr<std::vector<std::vector<double> > > points(new std::vector<std::vector<double> >), queries(new std::vector<std::vector<double> >);
+        std::shared_ptr<std::shared_ptr<KDTree> > treeHolder(new std::shared_ptr<KDTree>);
+
+        Benchmark b;
+        b.kind = "micro";
+
+        b.name = "kd_tree_build";
+        b.unit = "points";
+        b.setUp = [points, queries, treeHolder, nPoints, nQueries, dim]() {
+            if(points->empty())
+            {
+                *points = randomPoints(nPoints, dim, 1);
+                *queries = randomPoints(nQueries, dim, 2);
+                treeHolder->reset(new KDTree(dim, *points));
+            }
+        };
+        b.run = [points, dim]() {
+            KDTree t(dim, *points);
+            benchSink = benchSink + t.depth();
+            return (unsigned long) points->size();
+        };
+        benchmarks.push_back(b);
+
+        b.name = "kd_tree_query";
+        b.unit = "queries";
+        b.run = [queries, treeHolder, k]() {
+            std::vector<unsigned long> indices;
+            std::vector<double> dists;
+            for(unsigned long i = 0; i < queries->size(); ++i)
+            {
+                (*treeHolder)->findNearestNeighbors((*queries)[i], k, &indices, &dists);
+                benchSink = benchSink + dists[k - 1];
+            }
+            return (unsigned long) queries->size();
+        };
+        benchmarks.push_back(b);
+
+        b.name = "kd_tree_query_batch";
+        b.unit = "queries";
+        b.run = [queries, treeHolder, k, dim]() {
+            const unsigned long n = queries->size();
+            std::vector<double> flat(n * dim);
+            for(unsigned long i = 0; i < n; ++i)
+                std::copy((*queries)[i].begin(), (*queries)[i].end(), flat.begin() + i * dim);
+            std::vector<unsigned long> indices(n * k);
+            std::vector<double> dists(n * k);
+            (*treeHolder)->findNearestNeighbors(&(flat[0]), n, k, &(indices[0]), &(dists[0]));
+            benchSink = benchSink + dists[n * k - 1];
+            return n;
+        };
+        benchmarks.push_back(b);
+    }
+
+#ifdef COSMO_LAPACK
+    // fast approximator
+    {
+        const int nIn = 4, nOut = 20, k = 40;
+        const unsigned long nPoints = 20000, nQueries = 1000;
+        std::shared_ptr<std::vector<std::vector<double> > > queries(new std::vector<std::vector<double> >);
+        std::shared_ptr<std::shared_ptr<FastApproximator> > fa(new std::shared_ptr<FastApproximator>);
+
+        Benchmark b;
+        b.kind = "micro";
+        b.unit = "queries";
+        b.setUp = [queries, fa, nIn, nOut, k, nPoints, nQueries]() {
+            if(*fa)
+                return;
+            const std::vector<std::vector<double> > points = randomPoints(nPoints, nIn, 3);
+            std::vector<std::vector<double> > values(nPoints, std::vector<double>(nOut));
+            for(unsigned long i = 0; i < nPoints; ++i)
+                for(int j = 0; j < nOut; ++j)
+                    values[i][j] = std::sin((j + 1) * points[i][0]) + points[i][1] * points[i][2] - points[i][3] * points[i][3];
+            fa->reset(new FastApproximator(nIn, nOut, nPoints, points, values, k));
+            *queries = randomPoints(nQueries, nIn, 4);
+        };
+
+        b.name = "fast_approximator_approximate";
+        b.run = [queries, fa]() {
+            std::vector<double> val;
+            for(unsigned long i = 0; i < queries->size(); ++i)
+            {
+                (*fa)->approximate((*queries)[i], val);
+                benchSink = benchSink + val[0];
+            }
+            return (unsigned long) queries->size();
+        };
+        benchmarks.push_back(b);
+
+        b.name = "fast_approximator_approximate_batch";
+        b.run = [queries, fa]() {
+            std::vector<std::vector<double> > vals;
+            static_cast<const FastApproximator&>(**fa).approximate(*queries, vals);
+            benchSink = benchSink + vals[0][0];
+            return (unsigned long) queries->size();
+        };
+        benchmarks.push_back(b);
+    }
+
+    // symmetric matrix
+    {
+        const int n = 500;
+        std::shared_ptr<Math::SymmetricMatrix<double> > m(new Math::SymmetricMatrix<double>);
+
+        Benchmark b;
+        b.kind = "micro";
+        b.unit = "matrices";
+        b.setUp = [m, n]() {
+            if(m->rows() == n)
+                return;
+            // diagonally dominant, so positive definite
+            Math::UniformRealGenerator gen(5, -1, 1);
+            *m = Math::SymmetricMatrix<double>(n, n);
+            for(int i = 0; i < n; ++i)
+                for(int j = 0; j <= i; ++j)
+                    (*m)(j, i) = (i == j ? n : gen.generate());
+        };
+
+        b.name = "symmetric_matrix_cholesky";
+        b.run = [m]() {
+            Math::SymmetricMatrix<double> c(*m);
+            c.choleskyFactorize();
+            benchSink = benchSink + c(0, 0);
+            return 1UL;
+        };
+        benchmarks.push_back(b);
+
+        b.name = "symmetric_matrix_inverse";
+        b.run = [m]() {
+            Math::SymmetricMatrix<double> c(*m);
+            c.choleskyFactorize();
+            c.invertFromCholeskyFactorization();
+            benchSink = benchSink + c(0, 0);
+            return 1UL;
+        };
+        benchmarks.push_back(b);
+    }
+
+    // memory bandwidth of the parallel loops over the rows of large packed matrices, placed on the NUMA nodes by the threads that fill them (see Math::FirstTouchAllocator)
+    {
+        const int n = 4000;
+        std::shared_ptr<Math::SymmetricMatrix<double> > x(new Math::SymmetricMatrix<double>), y(new Math::SymmetricMatrix<double>), z(new Math::SymmetricMatrix<double>);
+
+        Benchmark b;
+        b.kind = "micro";
+        b.unit = "elements";
+        b.setUp = [x, y, z, n]() {
+            if(x->rows() == n)
+                return;
+            x->resize(n, n, 1.0);
+            y->resize(n, n, 2.0);
+            z->resize(n, n);
+        };
+
+        b.name = "symmetric_matrix_first_touch";
+        b.bytesPerItem = sizeof(double);
+        b.run = [n]() {
+            Math::SymmetricMatrix<double> c(n, n);
+            benchSink = benchSink + c(n - 1, n - 1);
+            return (unsigned long)(n) * (n + 1) / 2;
+        };
+        benchmarks.push_back(b);
+
+        // the same loop as in the initialization of Likelihood, two reads and one write per element
+        b.name = "symmetric_matrix_triad";
+        b.bytesPerItem = 3 * sizeof(double);
+        b.run = [x, y, z, n]() {
+#pragma omp parallel for default(shared) schedule(static)
+            for(int i = 0; i < n; ++i)
+            {
+                const double* xRow = &((*x)(i, 0));
+                const double* yRow = &((*y)(i, 0));
+                double* zRow = &((*z)(i, 0));
+                for(int j = 0; j <= i; ++j)
+                    zRow[j] = xRow[j] + 0.5 * yRow[j];
+            }
+            benchSink = benchSink + (*z)(n - 1, n - 1);
+            return (unsigned long)(n) * (n + 1) / 2;
+        };
+        benchmarks.push_back(b);
+    }
+#endif
+
+    // cubic spline and table function
+    {
+        const int nNodes = 1000;
+        const unsigned long nEval = 1000000;
+        std::shared_ptr<Math::CubicSpline> spline(new Math::CubicSpline);
+        std::shared_ptr<Math::TableFunction<double, double> > table(new Math::TableFunction<double, double>);
+        std::shared_ptr<std::vector<double> > x(new std::vector<double>);
+
+        Benchmark b;
+        b.kind = "micro";
+        b.unit = "evaluations";
+        b.setUp = [spline, table, x, nNodes, nEval]() {
+            if(!x->empty())
+                return;
+            // non-uniform nodes, so the interval is found by search
+            std::vector<double> nodes(nNodes), vals(nNodes);
+            for(int i = 0; i < nNodes; ++i)
+            {
+                const double t = double(i) / (nNodes - 1);
+                nodes[i] = t * t * 10;
+                vals[i] = std::sin(nodes[i]);
+                (*table)[nodes[i]] = vals[i];
+            }
+            *spline = Math::CubicSpline(nodes, vals);
+
+            Math::UniformRealGenerator gen(6, 0, 10);
+            x->resize(nEval);
+            for(unsigned long i = 0; i < nEval; ++i)
+                (*x)[i] = gen.generate();
+        };
+
+        b.name = "cubic_spline_evaluate";
+        b.run = [spline, x]() {
+            double s = 0;
+            for(unsigned long i = 0; i < x->size(); ++i)
+                s += spline->evaluate((*x)[i]);
+            benchSink = benchSink + s;
+            return (unsigned long) x->size();
+        };
+        benchmarks.push_back(b);
+
+        b.name = "cubic_spline_evaluate_batch";
+        b.run = [spline, x]() {
+            std::vector<double> res;
+            spline->evaluate(*x, &res);
+            benchSink = benchSink + res.back();
+            return (unsigned long) x->size();
+        };
+        benchmarks.push_back(b);
+
+        b.name = "table_function_evaluate";
+        b.run = [table, x]() {
+            double s = 0;
+            for(unsigned long i = 0; i < x->size(); ++i)
+                s += table->evaluate((*x)[i]);
+            benchSink = benchSink + s;
+            return (unsigned long) x->size();
+        };
+        benchmarks.push_back(b);
+    }
+
+    // wigner 3j symbols
+    {
+        Benchmark b;
+        b.kind = "micro";
+        b.name = "wigner_3j_zero_m";
+        b.unit = "symbols";
+        b.setUp = []() {};
+        b.run = []() {
+            Wigner3JSumTreats t;
+            Math::Wigner3JZeroM<Wigner3JSumTreats> w(t);
+            w.calculate(300);
+            benchSink = benchSink + t.sum;
+            return t.count;
+        };
+        benchmarks.push_back(b);
+    }
+
+    // legendre polynomials
+    {
+        const int lMax = 3000;
+        const int nX = 2000;
+
+        Benchmark b;
+        b.kind = "micro";
+        b.name = "legendre_calculate_all";
+        b.unit = "values";
+        b.setUp = []() {};
+        b.run = [lMax, nX]() {
+            std::vector<double> res(lMax + 1);
+            for(int i = 0; i < nX; ++i)
+            {
+                Math::Legendre::calculateAll(lMax, -1.0 + 2.0 * (i + 0.5) / nX, &(res[0]));
+                benchSink = benchSink + res[lMax];
+            }
+            return (unsigned long)(lMax + 1) * nX;
+        };
+        benchmarks.push_back(b);
+
+        b.name = "legendre_calculate_batch";
+        b.run = [lMax, nX]() {
+            std::vector<double> x(nX), res(nX);
+            for(int i = 0; i < nX; ++i)
+                x[i] = -1.0 + 2.0 * (i + 0.5) / nX;
+            for(int l = 0; l <= lMax; l += 100)
+            {
+                Math::Legendre::calculate(l, nX, &(x[0]), &(res[0]));
+                benchSink = benchSink + res[0];
+            }
+            return (unsigned long)(lMax / 100 + 1) * nX;
+        };
+        benchmarks.push_back(b);
+    }
+
+#ifdef COSMO_HEALPIX
+    // legendre polynomials between the pixels of a map
+    {
+        const int lMax = 64;
+        const long nSide = 8;
+        std::shared_ptr<std::shared_ptr<LegendrePolynomialContainer> > containerHolder(new std::shared_ptr<LegendrePolynomialContainer>);
+
+        Benchmark b;
+        b.kind = "micro";
+        b.name = "legendre_container_build";
+        b.unit = "values";
+        b.setUp = [containerHolder, lMax, nSide]() {
+            if(!(*containerHolder))
+                containerHolder->reset(new LegendrePolynomialContainer(lMax, nSide));
+        };
+        b.run = [lMax, nSide]() {
+            LegendrePolynomialContainer c(lMax, nSide);
+            const unsigned long nPix = c.getNPix();
+            benchSink = benchSink + c.value(lMax, int(nPix - 1), 0);
+            return nPix * (nPix + 1) / 2 * (lMax + 1);
+        };
+        benchmarks.push_back(b);
+
+        b.name = "legendre_container_sum";
+        b.unit = "pixel pairs";
+        b.run = [containerHolder, lMax]() {
+            const LegendrePolynomialContainer& c = **containerHolder;
+            std::vector<double> w(lMax + 1);
+            for(int l = 0; l <= lMax; ++l)
+                w[l] = (2.0 * l + 1) / (l + 1.0);
+            const int nPix = c.getNPix();
+            double s = 0;
+            for(int j = 0; j < nPix; ++j)
+                for(int i = 0; i <= j; ++i)
+                    s += c.sum(j, i, &(w[0]), 2, lMax);
+            benchSink = benchSink + s;
+            return (unsigned long)(nPix) * (nPix + 1) / 2;
+        };
+        benchmarks.push_back(b);
+    }
+#endif
+
+    // markov chain loading
+    {
+        const int nParams = 8;
+        const unsigned long nRows = 200000;
+        const std::string fileName = "cosmo_bench_chain.txt";
+
+        Benchmark b;
+        b.kind = "micro";
+        b.name = "markov_chain_load";
+        b.unit = "rows";
+        b.setUp = [fileName, nParams, nRows]() {
+            std::ofstream out(fileName.c_str());
+            Math::UniformRealGenerator gen(7, -1, 1);
+            for(unsigned long i = 0; i < nRows; ++i)
+            {
+                out << 1 + int(3 * (gen.generate() + 1)) << "   " << 10 + gen.generate();
+                for(int j = 0; j < nParams; ++j)
+                    out << "   " << gen.generate();
+                out << std::endl;
+            }
+        };
+        b.run = [fileName]() {
+            MarkovChain chain(fileName.c_str());
+            benchSink = benchSink + chain.maxLike();
+            return (unsigned long) chain.size();
+        };
+        benchmarks.push_back(b);
+    }
+}
+
+void addMacroBenchmarks(std::vector<Benchmark>& benchmarks)
+{
+#ifdef COSMO_LAPACK
+    {
+        const int n = 6;
+        const unsigned long nIter = 20000;
+
+        Benchmark b;
+        b.kind = "macro";
+        b.name = "mcmc_gauss_steps";
+        b.unit = "steps";
+        b.setUp = []() {};
+        b.run = [n, nIter]() {
+            BenchGauss like(n);
+            Math::MetropolisHastings mh(n, like, "cosmo_bench_mcmc", 1);
+            for(int i = 0; i < n; ++i)
+            {
+                std::stringstream name;
+                name << "x_" << i;
+                mh.setParam(i, name.str(), -10, 10, 0, 1, 0.5, 1e-10);
+            }
+            // a tiny accuracy so that the run does not stop before the requested number of iterations
+            mh.run(nIter, 0, 0, Math::MetropolisHastings::ACCURACY, 0.01, false);
+            return nIter * n;
+        };
+        benchmarks.push_back(b);
+    }
+#endif
+
+#ifdef COSMO_CLASS
+    {
+        const int lMax = 2500;
+        std::shared_ptr<CMB> cmb(new CMB);
+        std::shared_ptr<int> count(new int(0));
+
+        Benchmark b;
+        b.kind = "macro";
+        b.name = "cmb_initialize";
+        b.unit = "initializations";
+        b.setUp = [cmb, lMax]() { cmb->preInitialize(lMax, false, true, false); };
+        b.run = [cmb, count]() {
+            // a different point every time, so nothing is reused from the previous call
+            const double ns = 0.96 + 0.001 * ((*count)++ % 10);
+            LambdaCDMParams params(0.022, 0.12, 0.67, 0.09, ns, 2.2e-9, 0.05);
+            cmb->initialize(params, true, true, true);
+            std::vector<double> clTT;
+            cmb->getLensedCl(&clTT);
+            benchSink = benchSink + clTT[100];
+            return 1UL;
+        };
+        benchmarks.push_back(b);
+    }
+
+#ifdef COSMO_PLANCK
+    {
+        std::shared_ptr<std::shared_ptr<PlanckLikelihood> > like(new std::shared_ptr<PlanckLikelihood>);
+        std::shared_ptr<int> count(new int(0));
+
+        Benchmark b;
+        b.kind = "macro";
+        b.name = "planck_likelihood";
+        b.unit = "evaluations";
+        b.setUp = [like]() {
+            if(*like)
+                return;
+#ifdef COSMO_PLANCK_15
+            like->reset(new PlanckLikelihood(true, false, false, false, false, false, false));
+#else
+            like->reset(new PlanckLikelihood(true, false, false, false, false));
+#endif
+        };
+        b.run = [like, count]() {
+            const double ns = 0.96 + 0.001 * ((*count)++ % 10);
+            LambdaCDMParams params(0.022, 0.12, 0.67, 0.09, ns, 2.2e-9, 0.05);
+            (*like)->setCosmoParams(params);
+            benchSink = benchSink + (*like)->likelihood();
+            return 1UL;
+        };
+        benchmarks.push_back(b);
+    }
+#endif
+#endif
+}
+
+BenchmarkResult runBenchmark(const Benchmark& b, int repeats)
+{
+    b.setUp();
+
+    // one untimed run to warm up the caches and the lazy initializations
+    b.run();
+
+    std::vector<double> times(repeats);
+    unsigned long items = 0;
+    for(int r = 0; r < repeats; ++r)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        items = b.run();
+        times[r] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    BenchmarkResult res;
+    res.name = b.name;
+    res.kind = b.kind;
+    res.unit = b.unit;
+    res.repeats = repeats;
+    res.items = items;
+    res.bytesPerItem = b.bytesPerItem;
+
+    std::vector<double> sorted(times);
+    std::sort(sorted.begin(), sorted.end());
+    res.minSeconds = sorted[0];
+    res.medianSeconds = (repeats % 2 ? sorted[repeats / 2] : (sorted[repeats / 2 - 1] + sorted[repeats / 2]) / 2);
+    res.meanSeconds = 0;
+    for(int r = 0; r < repeats; ++r)
+        res.meanSeconds += times[r] / repeats;
+
+    return res;
+}
+
+void writeJSON(const std::vector<BenchmarkResult>& results, const std::string& fileName)
+{
+    std::ofstream out(fileName.c_str());
+    if(!out)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    int nThreads = 1;
+#ifdef COSMO_OMP
+    nThreads = omp_get_max_threads();
+#endif
+
+    out << std::setprecision(8);
+    out << "{" << std::endl;
+    out << "  \"context\": {\"processes\": " << CosmoMPI::create().numProcesses() << ", \"threads\": " << nThreads << ", \"checks\": ";
+#ifdef CHECKS_ON
+    out << "true";
+#else
+    out << "false";
+#endif
+    out << "}," << std::endl;
+    out << "  \"benchmarks\": [" << std::endl;
+    for(int i = 0; i < results.size(); ++i)
+    {
+        const BenchmarkResult& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"kind\": \"" << r.kind << "\", \"unit\": \"" << r.unit << "\", \"repeats\": " << r.repeats << ", \"items\": " << r.items;
+        out << ", \"min_seconds\": " << r.minSeconds << ", \"median_seconds\": " << r.medianSeconds << ", \"mean_seconds\": " << r.meanSeconds << ", \"items_per_second\": " << r.items / r.minSeconds;
+        if(r.bytesPerItem > 0)
+            out << ", \"bytes_per_second\": " << r.items * r.bytesPerItem / r.minSeconds;
+        out << "}";
+        out << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+void printUsage()
+{
+    output_screen("Usage: cosmo_bench [--list] [--micro | --macro] [--repeat N] [--out file.json] [benchmark names...]" << std::endl);
+    output_screen("By default all of the benchmarks are run 5 times each and the results are written into cosmo_bench.json." << std::endl);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    try {
+        std::vector<Benchmark> all;
+        addMicroBenchmarks(all);
+        addMacroBenchmarks(all);
+
+        bool list = false;
+        std::string kind;
+        int repeats = 5;
+        std::string outFile = "cosmo_bench.json";
+        std::vector<std::string> names;
+
+        for(int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if(arg == "--list")
+                list = true;
+            else if(arg == "--micro")
+                kind = "micro";
+            else if(arg == "--macro")
+                kind = "macro";
+            else if(arg == "--repeat" && i + 1 < argc)
+                repeats = std::atoi(argv[++i]);
+            else if(arg == "--out" && i + 1 < argc)
+                outFile = argv[++i];
+            else if(arg == "--help" || arg == "-h")
+            {
+                printUsage();
+                return 0;
+            }
+            else if(arg.size() > 1 && arg[0] == '-')
+            {
+                printUsage();
+                return 1;
+            }
+            else
+                names.push_back(arg);
+        }
+
+        if(repeats <= 0)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid number of repeats " << repeats << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        std::vector<const Benchmark*> selected;
+        for(int i = 0; i < all.size(); ++i)
+        {
+            if(!kind.empty() && all[i].kind != kind)
+                continue;
+            if(!names.empty() && std::find(names.begin(), names.end(), all[i].name) == names.end())
+                continue;
+            selected.push_back(&(all[i]));
+        }
+
+        if(list)
+        {
+            for(int i = 0; i < selected.size(); ++i)
+                output_screen(selected[i]->kind << '\t' << selected[i]->name << std::endl);
+            return 0;
+        }
+
+        for(int i = 0; i < names.size(); ++i)
+        {
+            bool found = false;
+            for(int j = 0; j < all.size(); ++j)
+                found = found || (all[j].name == names[i]);
+            if(!found)
+            {
+                StandardException exc;
+                std::stringstream exceptionStr;
+                exceptionStr << "Unknown benchmark " << names[i] << ", use --list to see the available ones.";
+                exc.set(exceptionStr.str());
+                throw exc;
+            }
+        }
+
+        std::vector<BenchmarkResult> results;
+        for(int i = 0; i < selected.size(); ++i)
+        {
+            const BenchmarkResult r = runBenchmark(*(selected[i]), repeats);
+            results.push_back(r);
+            output_screen(std::left << std::setw(40) << r.name << std::right << "  min " << std::setw(12) << r.minSeconds << " s  median " << std::setw(12) << r.medianSeconds << " s  " << std::setw(14) << r.items / r.minSeconds << ' ' << r.unit << "/s");
+            if(r.bytesPerItem > 0)
+            {
+                output_screen_clean("  " << std::setw(10) << r.items * r.bytesPerItem / r.minSeconds / 1e9 << " GB/s");
+            }
+            output_screen_clean(std::endl);
+        }
+
+        if(CosmoMPI::create().isMaster())
+            writeJSON(results, outFile);
+    } catch (std::exception& e)
+    {
+        output_screen("EXCEPTION CAUGHT!!! " << std::endl << e.what() << std::endl);
+        output_screen("Terminating!" << std::endl);
+        return 1;
+    }
+    return 0;
+}
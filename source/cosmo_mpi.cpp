@@ -2,37 +2,113 @@
 #include <mpi.h>
 #endif
 
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <mutex>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
 #include <cosmo_mpi.hpp>
 #include <macros.hpp>
+#include <exception_handler.hpp>
 
 CosmoMPI::CosmoMPI()
 {
 #ifdef COSMO_MPI
-#ifdef CHECKS_ON
     int hasMpiInitialized;
     MPI_Initialized(&hasMpiInitialized);
-    check(!hasMpiInitialized, "MPI already initialized");
-#endif
+    if(hasMpiInitialized)
+    {
+        // initialized by the caller, who is also responsible for finalizing
+        MPI_Query_thread(&threadSupport_);
+        initializedHere_ = false;
+    }
+    else
+    {
+        // the threaded mode of MetropolisHastings calls MPI from several threads at the same time
+        const int res = MPI_Init_thread(NULL, NULL, MPI_THREAD_MULTIPLE, &threadSupport_);
+        check(res == MPI_SUCCESS, "MPI initialization failed");
+        initializedHere_ = true;
+    }
+
+    nodeComm_ = new MPI_Comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, (MPI_Comm*) nodeComm_);
+
+    MPI_Comm* worldComm = new MPI_Comm;
+    *worldComm = MPI_COMM_WORLD;
+    world_ = new Communicator(worldComm, false);
+    node_ = new Communicator(nodeComm_, false);
+
+    // the node masters, ordered as in the world, so the master is the first one
+    int worldRank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
+    MPI_Comm* leaderComm = new MPI_Comm;
+    MPI_Comm_split(MPI_COMM_WORLD, (isNodeMaster() ? 0 : MPI_UNDEFINED), worldRank, leaderComm);
+    if(isNodeMaster())
+    {
+        leader_ = new Communicator(leaderComm, true);
+        numNodes_ = leader_->numProcesses();
+        nodeIndex_ = leader_->processId();
+    }
+    else
+    {
+        delete leaderComm;
+        leader_ = NULL;
+        numNodes_ = nodeIndex_ = 0;
+    }
 
-    MPI_Init(NULL, NULL);
+    int nodeInfo[2] = {numNodes_, nodeIndex_};
+    MPI_Bcast(nodeInfo, 2, MPI_INT, 0, *((MPI_Comm*) nodeComm_));
+    numNodes_ = nodeInfo[0];
+    nodeIndex_ = nodeInfo[1];
+#else
+    nodeComm_ = NULL;
+    threadSupport_ = 0;
+    initializedHere_ = true;
+    world_ = new Communicator(NULL, false);
+    node_ = new Communicator(NULL, false);
+    leader_ = new Communicator(NULL, false);
+    numNodes_ = 1;
+    nodeIndex_ = 0;
 #endif
     commTag_ = 1000;
+
+    const char* stageDir = std::getenv("COSMO_NODE_STAGE_DIR");
+    if(stageDir)
+        nodeStageDir_ = stageDir;
 }
 
 CosmoMPI::~CosmoMPI()
 {
 #ifdef COSMO_MPI
-#ifdef CHECKS_ON
-    int hasMpiInitialized;
-    MPI_Initialized(&hasMpiInitialized);
-    check(hasMpiInitialized, "MPI not initialized");
-
     int hasMpiFinalized;
     MPI_Finalized(&hasMpiFinalized);
-    check(!hasMpiFinalized, "MPI already finalized");
-#endif
-    MPI_Finalize();
+    check(!hasMpiFinalized || !initializedHere_, "MPI already finalized");
+
+    if(!hasMpiFinalized)
+    {
+        delete leader_;
+        MPI_Comm_free((MPI_Comm*) nodeComm_);
+    }
+    delete (MPI_Comm*) nodeComm_;
+    delete (MPI_Comm*) world_->comm_;
+
+    if(initializedHere_ && !hasMpiFinalized)
+        MPI_Finalize();
+
+    for(int i = 0; i < abandonedBuffers_.size(); ++i)
+        delete abandonedBuffers_[i];
+#else
+    delete leader_;
 #endif
+    delete world_;
+    delete node_;
 }
 
 int
@@ -85,14 +161,27 @@ CosmoMPI::barrier() const
 #endif
 }
 
+bool
+CosmoMPI::supportsThreads() const
+{
+#ifdef COSMO_MPI
+    return threadSupport_ == MPI_THREAD_MULTIPLE;
+#else
+    return true;
+#endif
+}
+
 int
-CosmoMPI::getCommTag()
+CosmoMPI::getCommTag(int width)
 {
+    check(width >= 1, "invalid width " << width);
+
     barrier();
 
-    commTag_ += 10 * numProcesses();
+    const int tag = commTag_ + 10 * numProcesses();
+    commTag_ += 10 * numProcesses() * width;
 
-    return commTag_;
+    return tag;
 }
 
 #ifdef COSMO_MPI
@@ -144,8 +233,416 @@ MPI_Op opToMPIOp(CosmoMPI::ReduceOp op)
     return mpiOp;
 }
 
+MPI_Comm commToMPIComm(const CosmoMPI::Communicator* comm)
+{
+    return (comm ? *((MPI_Comm*) comm->handle()) : MPI_COMM_WORLD);
+}
+
 } // namespace
+#else
+namespace
+{
+
+int typeSize(CosmoMPI::DataType type)
+{
+    switch(type)
+    {
+    case CosmoMPI::DOUBLE:
+        return sizeof(double);
+    case CosmoMPI::INT:
+        return sizeof(int);
+    case CosmoMPI::LONG:
+        return sizeof(long);
+    default:
+        check(false, "");
+        return 0;
+    }
+}
+
+} // namespace
+#endif
+
+CosmoMPI::Communicator::~Communicator()
+{
+#ifdef COSMO_MPI
+    if(owned_)
+    {
+        int hasMpiFinalized;
+        MPI_Finalized(&hasMpiFinalized);
+        // no exceptions from the destructor, the communicator is only leaked if MPI is already gone
+        if(hasMpiFinalized)
+        {
+            output_screen("WARNING: the communicator must be deleted before MPI is finalized, it has not been freed." << std::endl);
+        }
+        else
+            MPI_Comm_free((MPI_Comm*) comm_);
+        delete (MPI_Comm*) comm_;
+    }
 #endif
+}
+
+int
+CosmoMPI::Communicator::processId() const
+{
+#ifdef COSMO_MPI
+    int rank;
+    MPI_Comm_rank(*((MPI_Comm*) comm_), &rank);
+    return rank;
+#else
+    return 0;
+#endif
+}
+
+int
+CosmoMPI::Communicator::numProcesses() const
+{
+#ifdef COSMO_MPI
+    int n;
+    MPI_Comm_size(*((MPI_Comm*) comm_), &n);
+    return n;
+#else
+    return 1;
+#endif
+}
+
+CosmoMPI::Request::Request() : active_(false)
+{
+#ifdef COSMO_MPI
+    req_ = new MPI_Request;
+#else
+    req_ = NULL;
+#endif
+}
+
+CosmoMPI::Request::~Request()
+{
+    wait();
+#ifdef COSMO_MPI
+    delete (MPI_Request*) req_;
+#endif
+}
+
+bool
+CosmoMPI::Request::test()
+{
+    if(!active_)
+        return true;
+
+#ifdef COSMO_MPI
+    int flag;
+    MPI_Test((MPI_Request*) req_, &flag, MPI_STATUS_IGNORE);
+    if(flag)
+        active_ = false;
+#else
+    active_ = false;
+#endif
+    return !active_;
+}
+
+void
+CosmoMPI::Request::wait()
+{
+    if(!active_)
+        return;
+
+#ifdef COSMO_MPI
+    MPI_Wait((MPI_Request*) req_, MPI_STATUS_IGNORE);
+#endif
+    active_ = false;
+}
+
+CosmoMPI::File::File(const char* fileName, const Communicator* comm) : name_(fileName), file_(NULL), fd_(-1)
+{
+    bool opened;
+#ifdef COSMO_MPI
+    file_ = new MPI_File;
+    opened = (MPI_File_open(commToMPIComm(comm), const_cast<char*>(fileName), MPI_MODE_RDWR | MPI_MODE_CREATE, MPI_INFO_NULL, (MPI_File*) file_) == MPI_SUCCESS);
+    if(!opened)
+    {
+        delete (MPI_File*) file_;
+        file_ = NULL;
+    }
+#else
+    fd_ = open(fileName, O_RDWR | O_CREAT, 0644);
+    opened = (fd_ >= 0);
+#endif
+
+    if(!opened)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open the file " << fileName << " for writing.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+CosmoMPI::File::~File()
+{
+#ifdef COSMO_MPI
+    MPI_File_close((MPI_File*) file_);
+    delete (MPI_File*) file_;
+#else
+    close(fd_);
+#endif
+}
+
+void
+CosmoMPI::File::writeAt(long offset, const void* data, long size)
+{
+    check(offset >= 0, "invalid offset " << offset);
+    check(size >= 0, "invalid size " << size);
+
+    // MPI counts are ints, so large writes are split
+    const long maxChunk = 1L << 30;
+    const char* d = (const char*) data;
+    bool ok = true;
+    while(size > 0 && ok)
+    {
+        const long chunk = std::min(size, maxChunk);
+#ifdef COSMO_MPI
+        MPI_Status st;
+        int written = 0;
+        ok = (MPI_File_write_at(*((MPI_File*) file_), MPI_Offset(offset), const_cast<char*>(d), int(chunk), MPI_BYTE, &st) == MPI_SUCCESS);
+        if(ok)
+            MPI_Get_count(&st, MPI_BYTE, &written);
+        ok = ok && (written == chunk);
+#else
+        ok = (pwrite(fd_, d, chunk, offset) == chunk);
+#endif
+        offset += chunk;
+        d += chunk;
+        size -= chunk;
+    }
+
+    if(!ok)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into the file " << name_ << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+long
+CosmoMPI::File::readAt(long offset, void* data, long size)
+{
+    check(offset >= 0, "invalid offset " << offset);
+    check(size >= 0, "invalid size " << size);
+
+    const long maxChunk = 1L << 30;
+    char* d = (char*) data;
+    long total = 0;
+    while(size > 0)
+    {
+        const long chunk = std::min(size, maxChunk);
+        long read = 0;
+#ifdef COSMO_MPI
+        MPI_Status st;
+        int count = 0;
+        if(MPI_File_read_at(*((MPI_File*) file_), MPI_Offset(offset), d, int(chunk), MPI_BYTE, &st) == MPI_SUCCESS)
+            MPI_Get_count(&st, MPI_BYTE, &count);
+        read = count;
+#else
+        read = pread(fd_, d, chunk, offset);
+        if(read < 0)
+            read = 0;
+#endif
+        total += read;
+        if(read < chunk)
+            break;
+        offset += chunk;
+        d += chunk;
+        size -= chunk;
+    }
+    return total;
+}
+
+long
+CosmoMPI::File::size() const
+{
+#ifdef COSMO_MPI
+    MPI_Offset s = 0;
+    MPI_File_get_size(*((MPI_File*) file_), &s);
+    return long(s);
+#else
+    struct stat st;
+    if(fstat(fd_, &st) != 0)
+        return 0;
+    return long(st.st_size);
+#endif
+}
+
+void
+CosmoMPI::File::sync()
+{
+#ifdef COSMO_MPI
+    MPI_File_sync(*((MPI_File*) file_));
+#else
+    fsync(fd_);
+#endif
+}
+
+namespace
+{
+
+// the send pools of different threads can be destroyed at the same time
+std::mutex abandonedBuffersMutex;
+
+} // namespace
+
+void
+CosmoMPI::keepUntilFinalize(std::vector<double>* buffer)
+{
+    std::lock_guard<std::mutex> lock(abandonedBuffersMutex);
+    abandonedBuffers_.push_back(buffer);
+}
+
+CosmoMPI::SendPool::SendPool() : current_(-1), nPending_(0)
+{
+#ifdef COSMO_MPI
+    requests_ = new std::vector<MPI_Request>;
+#else
+    requests_ = NULL;
+#endif
+}
+
+CosmoMPI::SendPool::~SendPool()
+{
+#ifdef COSMO_MPI
+    progress();
+
+    std::vector<MPI_Request>& requests = *((std::vector<MPI_Request>*) requests_);
+    int hasMpiFinalized;
+    MPI_Finalized(&hasMpiFinalized);
+    for(int i = 0; i < requests.size(); ++i)
+    {
+        if(requests[i] == MPI_REQUEST_NULL)
+            continue;
+
+        // the send may still be using the buffer, so it is kept
+        if(!hasMpiFinalized)
+            MPI_Request_free(&(requests[i]));
+        const int b = requestBuffer_[i];
+        if(buffers_[b])
+        {
+            CosmoMPI::create().keepUntilFinalize(buffers_[b]);
+            buffers_[b] = NULL;
+        }
+    }
+    delete (std::vector<MPI_Request>*) requests_;
+#endif
+
+    for(int i = 0; i < buffers_.size(); ++i)
+        delete buffers_[i];
+}
+
+double*
+CosmoMPI::SendPool::getBuffer(int count)
+{
+    check(count > 0, "invalid count " << count);
+
+    progress();
+
+    // the previous buffer is kept until the next one is requested, more sends can be posted from it until then
+    if(current_ >= 0 && bufferSends_[current_] == 0)
+        freeBuffers_.push_back(current_);
+
+    if(freeBuffers_.empty())
+    {
+        current_ = int(buffers_.size());
+        buffers_.push_back(new std::vector<double>);
+        bufferSends_.push_back(0);
+    }
+    else
+    {
+        current_ = freeBuffers_.back();
+        freeBuffers_.pop_back();
+    }
+
+    check(bufferSends_[current_] == 0, "");
+    buffers_[current_]->resize(count);
+    return &((*(buffers_[current_]))[0]);
+}
+
+void
+CosmoMPI::SendPool::isend(double* buffer, int count, int dest, int tag)
+{
+    check(current_ >= 0 && buffer == &((*(buffers_[current_]))[0]), "the buffer must be the one returned by the last call of getBuffer");
+    check(count >= 0 && count <= buffers_[current_]->size(), "invalid count " << count);
+
+#ifdef COSMO_MPI
+    std::vector<MPI_Request>& requests = *((std::vector<MPI_Request>*) requests_);
+
+    int slot;
+    if(freeRequests_.empty())
+    {
+        slot = int(requests.size());
+        requests.push_back(MPI_REQUEST_NULL);
+        requestBuffer_.push_back(-1);
+    }
+    else
+    {
+        slot = freeRequests_.back();
+        freeRequests_.pop_back();
+    }
+
+    const int res = MPI_Isend(buffer, count, MPI_DOUBLE, dest, tag, MPI_COMM_WORLD, &(requests[slot]));
+    check(res == MPI_SUCCESS, "send failed");
+    requestBuffer_[slot] = current_;
+    ++bufferSends_[current_];
+    ++nPending_;
+#else
+    check(false, "");
+#endif
+}
+
+void
+CosmoMPI::SendPool::progress()
+{
+#ifdef COSMO_MPI
+    if(nPending_ == 0)
+        return;
+
+    std::vector<MPI_Request>& requests = *((std::vector<MPI_Request>*) requests_);
+    indices_.resize(requests.size());
+
+    int outCount = 0;
+    MPI_Testsome(int(requests.size()), &(requests[0]), &outCount, &(indices_[0]), MPI_STATUSES_IGNORE);
+    if(outCount == MPI_UNDEFINED)
+        return;
+
+    for(int i = 0; i < outCount; ++i)
+    {
+        // the completed requests are set to MPI_REQUEST_NULL by MPI_Testsome
+        const int slot = indices_[i];
+        const int b = requestBuffer_[slot];
+        check(b >= 0 && bufferSends_[b] > 0, "");
+        requestBuffer_[slot] = -1;
+        freeRequests_.push_back(slot);
+        --nPending_;
+
+        if(--bufferSends_[b] == 0 && b != current_)
+            freeBuffers_.push_back(b);
+    }
+#endif
+}
+
+CosmoMPI::Communicator*
+CosmoMPI::split(int color, int key, const Communicator* comm)
+{
+    check(color >= 0, "invalid color " << color);
+
+#ifdef COSMO_MPI
+    MPI_Comm* newComm = new MPI_Comm;
+    const int res = MPI_Comm_split(commToMPIComm(comm), color, key, newComm);
+    check(res == MPI_SUCCESS, "communicator split failed");
+    return new Communicator(newComm, true);
+#else
+    return new Communicator(NULL, true);
+#endif
+}
 
 int
 CosmoMPI::send(int dest, void *buf, int count, DataType type, int tag)
@@ -219,3 +716,392 @@ CosmoMPI::bcast(void *data, int count, DataType type)
 #endif
 }
 
+
+int
+CosmoMPI::nodeProcessId() const
+{
+#ifdef COSMO_MPI
+    int rank;
+    MPI_Comm_rank(*((MPI_Comm*) nodeComm_), &rank);
+    return rank;
+#else
+    return 0;
+#endif
+}
+
+int
+CosmoMPI::numNodeProcesses() const
+{
+#ifdef COSMO_MPI
+    int n;
+    MPI_Comm_size(*((MPI_Comm*) nodeComm_), &n);
+    return n;
+#else
+    return 1;
+#endif
+}
+
+void*
+CosmoMPI::allocateNodeShared(unsigned long size, void** window)
+{
+    check(window, "");
+
+#ifdef COSMO_MPI
+    MPI_Win* win = new MPI_Win;
+    void* base;
+    const int res = MPI_Win_allocate_shared((isNodeMaster() ? size : 0), 1, MPI_INFO_NULL, *((MPI_Comm*) nodeComm_), &base, win);
+    check(res == MPI_SUCCESS, "shared memory allocation failed");
+
+    // everyone uses the memory of the node master
+    MPI_Aint actualSize;
+    int dispUnit;
+    MPI_Win_shared_query(*win, 0, &actualSize, &dispUnit, &base);
+
+    *window = win;
+    return base;
+#else
+    char* base = new char[size];
+    *window = base;
+    return base;
+#endif
+}
+
+void
+CosmoMPI::freeNodeShared(void* window)
+{
+    check(window, "");
+
+#ifdef COSMO_MPI
+    MPI_Win_free((MPI_Win*) window);
+    delete (MPI_Win*) window;
+#else
+    delete [] (char*) window;
+#endif
+}
+
+int
+CosmoMPI::allreduce(void *send, void *recv, int count, DataType type, ReduceOp op, const Communicator* comm)
+{
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+    check(op >= 0 && op < REDUCE_OP_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+    const MPI_Op mpiOp = opToMPIOp(op);
+    const int res = MPI_Allreduce((send == recv ? MPI_IN_PLACE : send), recv, count, mpiType, mpiOp, commToMPIComm(comm));
+    check(res == MPI_SUCCESS, "allreduce failed");
+    return res;
+#else
+    if(send != recv)
+        std::memcpy(recv, send, count * typeSize(type));
+    return 0;
+#endif
+}
+
+int
+CosmoMPI::allgatherv(const void *send, int sendCount, void *recv, const int *recvCounts, const int *displs, DataType type, const Communicator* comm)
+{
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+    const int res = MPI_Allgatherv(send, sendCount, mpiType, recv, recvCounts, displs, mpiType, commToMPIComm(comm));
+    check(res == MPI_SUCCESS, "allgatherv failed");
+    return res;
+#else
+    check(sendCount == recvCounts[0], "");
+    if(sendCount)
+        std::memmove((char*) recv + displs[0] * typeSize(type), send, sendCount * typeSize(type));
+    return 0;
+#endif
+}
+
+int
+CosmoMPI::iallreduce(void *send, void *recv, int count, DataType type, ReduceOp op, Request* request, const Communicator* comm)
+{
+    check(request, "");
+    check(!request->active(), "the request is still in progress");
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+    check(op >= 0 && op < REDUCE_OP_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+    const MPI_Op mpiOp = opToMPIOp(op);
+    const int res = MPI_Iallreduce((send == recv ? MPI_IN_PLACE : send), recv, count, mpiType, mpiOp, commToMPIComm(comm), (MPI_Request*) request->req_);
+    check(res == MPI_SUCCESS, "iallreduce failed");
+    request->active_ = true;
+    return res;
+#else
+    return allreduce(send, recv, count, type, op, comm);
+#endif
+}
+
+int
+CosmoMPI::iallgatherv(const void *send, int sendCount, void *recv, const int *recvCounts, const int *displs, DataType type, Request* request, const Communicator* comm)
+{
+    check(request, "");
+    check(!request->active(), "the request is still in progress");
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+    const int res = MPI_Iallgatherv(send, sendCount, mpiType, recv, recvCounts, displs, mpiType, commToMPIComm(comm), (MPI_Request*) request->req_);
+    check(res == MPI_SUCCESS, "iallgatherv failed");
+    request->active_ = true;
+    return res;
+#else
+    return allgatherv(send, sendCount, recv, recvCounts, displs, type, comm);
+#endif
+}
+
+int
+CosmoMPI::ibcast(void *data, int count, DataType type, Request* request, const Communicator* comm)
+{
+    check(request, "");
+    check(!request->active(), "the request is still in progress");
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+    const int res = MPI_Ibcast(data, count, mpiType, 0, commToMPIComm(comm), (MPI_Request*) request->req_);
+    check(res == MPI_SUCCESS, "ibcast failed");
+    request->active_ = true;
+    return res;
+#else
+    return 0;
+#endif
+}
+
+int
+CosmoMPI::hierarchicalReduce(void *send, void *recv, int count, DataType type, ReduceOp op)
+{
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+    check(op >= 0 && op < REDUCE_OP_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+    const MPI_Op mpiOp = opToMPIOp(op);
+
+    // the node masters get the sums of their nodes in recv
+    int res;
+    if(isNodeMaster())
+        res = MPI_Reduce((send == recv ? MPI_IN_PLACE : send), recv, count, mpiType, mpiOp, 0, *((MPI_Comm*) nodeComm_));
+    else
+        res = MPI_Reduce(send, NULL, count, mpiType, mpiOp, 0, *((MPI_Comm*) nodeComm_));
+    check(res == MPI_SUCCESS, "reduce failed");
+
+    if(leader_ && numNodes_ > 1)
+    {
+        res = MPI_Reduce((leader_->isMaster() ? MPI_IN_PLACE : recv), (leader_->isMaster() ? recv : NULL), count, mpiType, mpiOp, 0, *((MPI_Comm*) leader_->handle()));
+        check(res == MPI_SUCCESS, "reduce failed");
+    }
+    return res;
+#else
+    return allreduce(send, recv, count, type, op);
+#endif
+}
+
+int
+CosmoMPI::hierarchicalAllreduce(void *send, void *recv, int count, DataType type, ReduceOp op)
+{
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+    check(op >= 0 && op < REDUCE_OP_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+    const MPI_Op mpiOp = opToMPIOp(op);
+
+    int res;
+    if(isNodeMaster())
+        res = MPI_Reduce((send == recv ? MPI_IN_PLACE : send), recv, count, mpiType, mpiOp, 0, *((MPI_Comm*) nodeComm_));
+    else
+        res = MPI_Reduce(send, NULL, count, mpiType, mpiOp, 0, *((MPI_Comm*) nodeComm_));
+    check(res == MPI_SUCCESS, "reduce failed");
+
+    if(leader_ && numNodes_ > 1)
+    {
+        res = MPI_Allreduce(MPI_IN_PLACE, recv, count, mpiType, mpiOp, *((MPI_Comm*) leader_->handle()));
+        check(res == MPI_SUCCESS, "allreduce failed");
+    }
+
+    res = MPI_Bcast(recv, count, mpiType, 0, *((MPI_Comm*) nodeComm_));
+    check(res == MPI_SUCCESS, "bcast failed");
+    return res;
+#else
+    return allreduce(send, recv, count, type, op);
+#endif
+}
+
+int
+CosmoMPI::hierarchicalBcast(void *data, int count, DataType type)
+{
+    check(type >= 0 && type < DATA_TYPE_MAX, "");
+
+#ifdef COSMO_MPI
+    const MPI_Datatype mpiType = typeToMPIType(type);
+
+    int res = MPI_SUCCESS;
+    if(leader_ && numNodes_ > 1)
+    {
+        res = MPI_Bcast(data, count, mpiType, 0, *((MPI_Comm*) leader_->handle()));
+        check(res == MPI_SUCCESS, "bcast failed");
+    }
+
+    res = MPI_Bcast(data, count, mpiType, 0, *((MPI_Comm*) nodeComm_));
+    check(res == MPI_SUCCESS, "bcast failed");
+    return res;
+#else
+    return 0;
+#endif
+}
+
+namespace
+{
+
+// copies a regular file, returns an error message if failed
+std::string copyFile(const std::string& src, const std::string& dst)
+{
+    const int in = open(src.c_str(), O_RDONLY);
+    if(in < 0)
+        return "cannot read " + src;
+
+    const int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0)
+    {
+        close(in);
+        return "cannot write into " + dst;
+    }
+
+    std::string error;
+    std::vector<char> buffer(1 << 20);
+    while(error.empty())
+    {
+        const ssize_t n = read(in, &(buffer[0]), buffer.size());
+        if(n < 0)
+            error = "cannot read " + src;
+        if(n <= 0)
+            break;
+
+        ssize_t written = 0;
+        while(written < n && error.empty())
+        {
+            const ssize_t w = write(out, &(buffer[written]), n - written);
+            if(w <= 0)
+                error = "cannot write into " + dst;
+            else
+                written += w;
+        }
+    }
+
+    close(in);
+    if(close(out) != 0 && error.empty())
+        error = "cannot write into " + dst;
+    return error;
+}
+
+// copies a file or a directory recursively, returns an error message if failed
+std::string copyPath(const std::string& src, const std::string& dst)
+{
+    struct stat st;
+    if(stat(src.c_str(), &st) != 0)
+        return src + " does not exist";
+
+    if(!S_ISDIR(st.st_mode))
+        return copyFile(src, dst);
+
+    if(mkdir(dst.c_str(), 0755) != 0 && errno != EEXIST)
+        return "cannot create the directory " + dst;
+
+    DIR* dir = opendir(src.c_str());
+    if(!dir)
+        return "cannot read the directory " + src;
+
+    std::string error;
+    struct dirent* entry;
+    while(error.empty() && (entry = readdir(dir)) != NULL)
+    {
+        const std::string name = entry->d_name;
+        if(name == "." || name == "..")
+            continue;
+        error = copyPath(src + "/" + name, dst + "/" + name);
+    }
+    closedir(dir);
+    return error;
+}
+
+} // namespace
+
+void
+CosmoMPI::setNodeStageDir(const char* dir)
+{
+    nodeStageDir_ = (dir ? dir : "");
+}
+
+std::string
+CosmoMPI::stageToNode(const std::string& path)
+{
+    if(nodeStageDir_.empty())
+        return path;
+
+    // the collective part is done by one thread at a time
+    static std::mutex stageMutex;
+    std::lock_guard<std::mutex> lock(stageMutex);
+
+    for(unsigned long i = 0; i < staged_.size(); ++i)
+    {
+        if(staged_[i].first == path)
+            return staged_[i].second;
+    }
+
+    // the local name is the whole path with / replaced, so different data with the same file name do not collide
+    std::string name = path;
+    while(name.size() > 1 && name[name.size() - 1] == '/')
+        name.erase(name.size() - 1);
+    std::replace(name.begin(), name.end(), '/', '_');
+    const std::string local = nodeStageDir_ + "/" + name;
+
+    // the marker is written after the copy is complete
+    const std::string marker = local + ".staged";
+
+    int failed = 0;
+    std::string error;
+    if(isNodeMaster())
+    {
+        struct stat st;
+        if(stat(marker.c_str(), &st) != 0)
+        {
+            output_screen("Staging " << path << " into " << local << "..." << std::endl);
+            if(mkdir(nodeStageDir_.c_str(), 0755) != 0 && errno != EEXIST)
+                error = "cannot create the directory " + nodeStageDir_;
+            if(error.empty())
+                error = copyPath(path, local);
+            if(error.empty())
+            {
+                const int fd = open(marker.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if(fd < 0)
+                    error = "cannot write into " + marker;
+                else
+                    close(fd);
+            }
+            failed = (error.empty() ? 0 : 1);
+        }
+    }
+
+    // the other processes on the node wait here until the copy is done
+    int anyFailed = 0;
+    allreduce(&failed, &anyFailed, 1, MAX, node_);
+    if(anyFailed)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Staging " << path << " into " << nodeStageDir_ << " failed";
+        if(!error.empty())
+            exceptionStr << ": " << error;
+        exceptionStr << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    staged_.push_back(std::make_pair(path, local));
+    return local;
+}
@@ -0,0 +1,601 @@
+#ifdef COSMO_CUDA
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#endif
+
+#include <cmath>
+#include <climits>
+#include <sstream>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <gpu_linear_algebra.hpp>
+#include <vector_kernels.hpp>
+#include <distributed_large_vector.hpp>
+#include <device_large_vector.hpp>
+
+namespace
+{
+
+#ifdef COSMO_CUDA
+void
+checkCuda(cudaError_t err, const char* what)
+{
+    if(err != cudaSuccess)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << what << " failed: " << cudaGetErrorString(err) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+checkCublas(cublasStatus_t status, const char* what)
+{
+    if(status != CUBLAS_STATUS_SUCCESS)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << what << " failed with cuBLAS status " << int(status) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+// the stream and the cuBLAS handle of all of the vectors, and the buffers for the reductions
+class DeviceContext
+{
+private:
+    DeviceContext() : enabled_(false), stream_(NULL), handle_(NULL), results_(NULL), hostResults_(NULL), nResults_(0), scratch_(NULL), scratchSize_(0)
+    {
+        if(!Math::GpuLinearAlgebra::create().enabled())
+        {
+            output_screen("The GPU is not used, DeviceLargeVector will be in the host memory." << std::endl);
+            return;
+        }
+
+        if(cudaStreamCreate(&stream_) != cudaSuccess)
+        {
+            output_screen("Could not create a CUDA stream, DeviceLargeVector will be in the host memory." << std::endl);
+            return;
+        }
+        if(cublasCreate(&handle_) != CUBLAS_STATUS_SUCCESS)
+        {
+            output_screen("Could not initialize cuBLAS, DeviceLargeVector will be in the host memory." << std::endl);
+            cudaStreamDestroy(stream_);
+            stream_ = NULL;
+            return;
+        }
+        cublasSetStream(handle_, stream_);
+        enabled_ = true;
+    }
+
+    ~DeviceContext()
+    {
+        if(!enabled_)
+            return;
+
+        if(results_)
+            cudaFree(results_);
+        if(hostResults_)
+            cudaFreeHost(hostResults_);
+        if(scratch_)
+            cudaFree(scratch_);
+        cublasDestroy(handle_);
+        cudaStreamDestroy(stream_);
+    }
+
+public:
+    static DeviceContext& create()
+    {
+        static DeviceContext c;
+        return c;
+    }
+
+    bool enabled() const { return enabled_; }
+    cudaStream_t stream() const { return stream_; }
+    cublasHandle_t handle() const { return handle_; }
+
+    // device memory for n reduction results, with the pointer mode set for writing them there
+    double* startReductions(int n)
+    {
+        if(nResults_ < n)
+        {
+            checkCuda(cudaStreamSynchronize(stream_), "cudaStreamSynchronize");
+            if(results_)
+                checkCuda(cudaFree(results_), "cudaFree");
+            if(hostResults_)
+                checkCuda(cudaFreeHost(hostResults_), "cudaFreeHost");
+            results_ = NULL;
+            hostResults_ = NULL;
+            nResults_ = 0;
+            checkCuda(cudaMalloc((void**) &results_, n * sizeof(double)), "cudaMalloc");
+            checkCuda(cudaMallocHost((void**) &hostResults_, n * sizeof(double)), "cudaMallocHost");
+            nResults_ = n;
+        }
+        checkCublas(cublasSetPointerMode(handle_, CUBLAS_POINTER_MODE_DEVICE), "cublasSetPointerMode");
+        return results_;
+    }
+
+    // wait for the n results queued after startReductions, the only synchronization of the reductions
+    void finishReductions(int n, double* res)
+    {
+        checkCublas(cublasSetPointerMode(handle_, CUBLAS_POINTER_MODE_HOST), "cublasSetPointerMode");
+        checkCuda(cudaMemcpyAsync(hostResults_, results_, n * sizeof(double), cudaMemcpyDeviceToHost, stream_), "cudaMemcpyAsync");
+        checkCuda(cudaStreamSynchronize(stream_), "cudaStreamSynchronize");
+        std::copy(hostResults_, hostResults_ + n, res);
+    }
+
+    // a device vector for the intermediate results
+    double* scratch(long n)
+    {
+        if(scratchSize_ < n)
+        {
+            checkCuda(cudaStreamSynchronize(stream_), "cudaStreamSynchronize");
+            if(scratch_)
+                checkCuda(cudaFree(scratch_), "cudaFree");
+            scratch_ = NULL;
+            scratchSize_ = 0;
+            checkCuda(cudaMalloc((void**) &scratch_, n * sizeof(double)), "cudaMalloc");
+            scratchSize_ = n;
+        }
+        return scratch_;
+    }
+
+private:
+    bool enabled_;
+    cudaStream_t stream_;
+    cublasHandle_t handle_;
+
+    double* results_;
+    double* hostResults_;
+    int nResults_;
+
+    double* scratch_;
+    long scratchSize_;
+};
+#endif
+
+} // namespace
+
+namespace Math
+{
+
+DeviceLargeVector::DeviceLargeVector(long size) : n_(size), device_(onDevice()), data_(NULL)
+{
+    check(n_ >= 0, "");
+
+    if(!device_)
+    {
+        host_.resize(n_, 0);
+        if(n_ > 0)
+            data_ = &(host_[0]);
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    // the cuBLAS functions take int sizes
+    if(n_ > INT_MAX)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The vector has " << n_ << " elements, too many for cuBLAS. Use DistributedLargeVector instead.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(n_ > 0)
+    {
+        checkCuda(cudaMalloc((void**) &data_, n_ * sizeof(double)), "cudaMalloc");
+        checkCuda(cudaMemsetAsync(data_, 0, n_ * sizeof(double), DeviceContext::create().stream()), "cudaMemsetAsync");
+    }
+#endif
+}
+
+DeviceLargeVector::~DeviceLargeVector()
+{
+#ifdef COSMO_CUDA
+    if(device_ && data_)
+        cudaFree(data_);
+#endif
+}
+
+bool
+DeviceLargeVector::onDevice()
+{
+#ifdef COSMO_CUDA
+    return DeviceContext::create().enabled();
+#else
+    return false;
+#endif
+}
+
+void
+DeviceLargeVector::synchronize()
+{
+#ifdef COSMO_CUDA
+    if(onDevice())
+        checkCuda(cudaStreamSynchronize(DeviceContext::create().stream()), "cudaStreamSynchronize");
+#endif
+}
+
+void*
+DeviceLargeVector::stream()
+{
+#ifdef COSMO_CUDA
+    if(onDevice())
+        return DeviceContext::create().stream();
+#endif
+    return NULL;
+}
+
+void
+DeviceLargeVector::copy(const DeviceLargeVector& other, double c)
+{
+    check(other.n_ == n_, "");
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        VectorKernels::copy(n_, c, other.data_, data_);
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    cublasHandle_t handle = DeviceContext::create().handle();
+    if(other.data_ != data_)
+        checkCublas(cublasDcopy(handle, int(n_), other.data_, 1, data_, 1), "cublasDcopy");
+    if(c != 1)
+        checkCublas(cublasDscal(handle, int(n_), &c, data_, 1), "cublasDscal");
+#endif
+}
+
+void
+DeviceLargeVector::setToZero()
+{
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        std::fill(host_.begin(), host_.end(), 0.0);
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    checkCuda(cudaMemsetAsync(data_, 0, n_ * sizeof(double), DeviceContext::create().stream()), "cudaMemsetAsync");
+#endif
+}
+
+double
+DeviceLargeVector::norm() const
+{
+    if(n_ == 0)
+        return 0;
+
+    if(!device_)
+        return std::sqrt(VectorKernels::dotProduct(n_, data_, data_));
+
+    double res = 0;
+#ifdef COSMO_CUDA
+    DeviceContext& context = DeviceContext::create();
+    double* results = context.startReductions(1);
+    checkCublas(cublasDnrm2(context.handle(), int(n_), data_, 1, results), "cublasDnrm2");
+    context.finishReductions(1, &res);
+#endif
+    return res;
+}
+
+double
+DeviceLargeVector::dotProduct(const DeviceLargeVector& other) const
+{
+    double res = 0;
+    const DeviceLargeVector* others[1] = {&other};
+    dotProducts(1, others, &res);
+    return res;
+}
+
+void
+DeviceLargeVector::dotProducts(int n, const DeviceLargeVector* const* others, double* res) const
+{
+    check(n >= 0, "");
+    for(int j = 0; j < n; ++j)
+    {
+        check(others[j]->n_ == n_, "");
+    }
+
+    if(n == 0)
+        return;
+
+    if(n_ == 0)
+    {
+        std::fill(res, res + n, 0.0);
+        return;
+    }
+
+    if(!device_)
+    {
+        std::vector<const double*> terms(n);
+        for(int j = 0; j < n; ++j)
+            terms[j] = others[j]->data_;
+        VectorKernels::dotProducts(n_, n, data_, &(terms[0]), res);
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    // all of the products are queued, then waited for together
+    DeviceContext& context = DeviceContext::create();
+    double* results = context.startReductions(n);
+    for(int j = 0; j < n; ++j)
+        checkCublas(cublasDdot(context.handle(), int(n_), data_, 1, others[j]->data_, 1, results + j), "cublasDdot");
+    context.finishReductions(n, res);
+#endif
+}
+
+void
+DeviceLargeVector::linearCombination(int n, const double* c, const DeviceLargeVector* const* v)
+{
+    check(n > 0, "");
+    for(int j = 0; j < n; ++j)
+    {
+        check(v[j]->n_ == n_, "");
+    }
+
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        std::vector<const double*> terms(n);
+        for(int j = 0; j < n; ++j)
+            terms[j] = v[j]->data_;
+        VectorKernels::linearCombination(n_, n, c, &(terms[0]), data_);
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    cublasHandle_t handle = DeviceContext::create().handle();
+
+    // the terms of the vector itself are done first, by scaling it
+    double selfCoefficient = 0;
+    bool started = false;
+    for(int j = 0; j < n; ++j)
+    {
+        if(v[j] == this)
+        {
+            selfCoefficient += c[j];
+            started = true;
+        }
+    }
+    if(started && selfCoefficient != 1)
+        checkCublas(cublasDscal(handle, int(n_), &selfCoefficient, data_, 1), "cublasDscal");
+
+    for(int j = 0; j < n; ++j)
+    {
+        if(v[j] == this)
+            continue;
+
+        if(!started)
+        {
+            copy(*(v[j]), c[j]);
+            started = true;
+        }
+        else
+            checkCublas(cublasDaxpy(handle, int(n_), c + j, v[j]->data_, 1, data_, 1), "cublasDaxpy");
+    }
+#endif
+}
+
+double
+DeviceLargeVector::addAndWeightedSquare(const DeviceLargeVector& other, double c, const DeviceLargeVector& w)
+{
+    check(other.n_ == n_, "");
+    check(w.n_ == n_, "");
+    if(n_ == 0)
+        return 0;
+
+    if(!device_)
+        return VectorKernels::addAndWeightedSquare(n_, c, other.data_, w.data_, data_);
+
+    double res = 0;
+#ifdef COSMO_CUDA
+    DeviceContext& context = DeviceContext::create();
+    cublasHandle_t handle = context.handle();
+    checkCublas(cublasDaxpy(handle, int(n_), &c, other.data_, 1, data_, 1), "cublasDaxpy");
+
+    // w x into the scratch vector, then its dot product with x
+    double* wx = context.scratch(n_);
+    checkCublas(cublasDdgmm(handle, CUBLAS_SIDE_LEFT, int(n_), 1, data_, int(n_), w.data_, 1, wx, int(n_)), "cublasDdgmm");
+    double* results = context.startReductions(1);
+    checkCublas(cublasDdot(handle, int(n_), wx, 1, data_, 1, results), "cublasDdot");
+    context.finishReductions(1, &res);
+#endif
+    return res;
+}
+
+void
+DeviceLargeVector::add(const DeviceLargeVector& other, double c)
+{
+    check(other.n_ == n_, "");
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        VectorKernels::add(n_, c, other.data_, data_);
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    checkCublas(cublasDaxpy(DeviceContext::create().handle(), int(n_), &c, other.data_, 1, data_, 1), "cublasDaxpy");
+#endif
+}
+
+void
+DeviceLargeVector::multiply(const DeviceLargeVector& other)
+{
+    check(other.n_ == n_, "");
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        VectorKernels::multiply(n_, other.data_, data_);
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    // the vector as an n x 1 matrix multiplied by the diagonal matrix of other, in place
+    checkCublas(cublasDdgmm(DeviceContext::create().handle(), CUBLAS_SIDE_LEFT, int(n_), 1, data_, int(n_), other.data_, 1, data_, int(n_)), "cublasDdgmm");
+#endif
+}
+
+void
+DeviceLargeVector::divide(const DeviceLargeVector& other)
+{
+    check(other.n_ == n_, "");
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+#ifdef CHECKS_ON
+        for(long i = 0; i < n_; ++i)
+        {
+            check(other.data_[i] != 0, "division by 0 at index" << i);
+        }
+#endif
+        VectorKernels::divide(n_, other.data_, data_);
+        return;
+    }
+
+    std::vector<double> x, y;
+    download(&x);
+    other.download(&y);
+#ifdef CHECKS_ON
+    for(long i = 0; i < n_; ++i)
+    {
+        check(y[i] != 0, "division by 0 at index" << i);
+    }
+#endif
+    VectorKernels::divide(n_, &(y[0]), &(x[0]));
+    upload(x);
+}
+
+void
+DeviceLargeVector::pow(double p)
+{
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        VectorKernels::pow(n_, p, data_);
+        return;
+    }
+
+    std::vector<double> x;
+    download(&x);
+    VectorKernels::pow(n_, p, &(x[0]));
+    upload(x);
+}
+
+void
+DeviceLargeVector::swap(DeviceLargeVector& other)
+{
+    check(other.n_ == n_, "");
+    check(other.device_ == device_, "");
+
+    // the host vectors keep their buffers when swapped, so the pointers stay valid
+    host_.swap(other.host_);
+    std::swap(data_, other.data_);
+}
+
+void
+DeviceLargeVector::download(std::vector<double>* res) const
+{
+    check(res, "");
+    res->resize(n_);
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        std::copy(host_.begin(), host_.end(), res->begin());
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    cudaStream_t stream = DeviceContext::create().stream();
+    checkCuda(cudaMemcpyAsync(&((*res)[0]), data_, n_ * sizeof(double), cudaMemcpyDeviceToHost, stream), "cudaMemcpyAsync");
+    checkCuda(cudaStreamSynchronize(stream), "cudaStreamSynchronize");
+#endif
+}
+
+void
+DeviceLargeVector::upload(const std::vector<double>& v)
+{
+    check(v.size() == n_, "the vector has size " << v.size() << ", should be " << n_);
+    if(n_ == 0)
+        return;
+
+    if(!device_)
+    {
+        std::copy(v.begin(), v.end(), host_.begin());
+        return;
+    }
+
+#ifdef COSMO_CUDA
+    // waits for the copy, since v can be changed or destroyed after returning
+    cudaStream_t stream = DeviceContext::create().stream();
+    checkCuda(cudaMemcpyAsync(data_, &(v[0]), n_ * sizeof(double), cudaMemcpyHostToDevice, stream), "cudaMemcpyAsync");
+    checkCuda(cudaStreamSynchronize(stream), "cudaStreamSynchronize");
+#endif
+}
+
+void
+DeviceLBFGSFunc::set(const DeviceLargeVector& x)
+{
+    if(!x_ || x_->size() != x.size())
+    {
+        delete x_;
+        x_ = NULL;
+        x_ = new DeviceLargeVector(x.size());
+    }
+    x_->copy(x);
+}
+
+double
+DeviceLBFGSFunc::value()
+{
+    check(x_, "set must be called first");
+    return f_.value(*x_);
+}
+
+void
+DeviceLBFGSFunc::derivative(DeviceLargeVector* res)
+{
+    check(x_, "set must be called first");
+    check(res, "");
+    check(res->size() == x_->size(), "");
+    f_.derivative(*x_, res);
+}
+
+void
+DeviceLBFGSFunc::whitenoise(int seed, DeviceLargeVector* x, double amplitude)
+{
+    check(x, "");
+    noise_.resize(x->size());
+    if(noise_.empty())
+        return;
+
+    whitenoiseBlock(seed, 0, x->size(), amplitude, &(noise_[0]));
+    x->upload(noise_);
+}
+
+} // namespace Math
+
@@ -0,0 +1,308 @@
+#include <cmath>
+#include <climits>
+#include <sstream>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <distributed_large_vector.hpp>
+#include <vector_kernels.hpp>
+#include <random.hpp>
+
+namespace Math
+{
+
+namespace
+{
+
+int communicatorProcessId(const CosmoMPI::Communicator* comm)
+{
+    return (comm ? comm->processId() : CosmoMPI::create().processId());
+}
+
+int communicatorNumProcesses(const CosmoMPI::Communicator* comm)
+{
+    return (comm ? comm->numProcesses() : CosmoMPI::create().numProcesses());
+}
+
+// the white noise is generated in chunks of this size, each with its own seed, so it does not depend on the partition
+const long noiseChunkSize = 4096;
+
+int chunkSeed(int seed, long chunk)
+{
+    unsigned long h = 2166136261ul;
+    h = (h ^ (unsigned long)(unsigned int)seed) * 16777619ul;
+    h = (h ^ (unsigned long)chunk) * 16777619ul;
+    h = (h ^ (unsigned long)(chunk >> 32)) * 16777619ul;
+    return int(h & 0x7fffffff);
+}
+
+} // namespace
+
+DistributedLargeVector::DistributedLargeVector(long totalSize, const CosmoMPI::Communicator* comm) : totalSize_(totalSize), comm_(comm)
+{
+    check(totalSize_ >= 0, "");
+    long size;
+    partition(totalSize_, communicatorNumProcesses(comm_), communicatorProcessId(comm_), &begin_, &size);
+    v_.resize(size, 0);
+}
+
+void
+DistributedLargeVector::partition(long totalSize, int nProcesses, int processId, long* begin, long* size)
+{
+    check(totalSize >= 0, "");
+    check(nProcesses > 0, "");
+    check(processId >= 0 && processId < nProcesses, "");
+    check(begin, "");
+    check(size, "");
+
+    const long base = totalSize / nProcesses;
+    const long extra = totalSize % nProcesses;
+    *begin = processId * base + std::min(long(processId), extra);
+    *size = base + (processId < extra ? 1 : 0);
+}
+
+double
+DistributedLargeVector::allSum(double s) const
+{
+    double total = s;
+    CosmoMPI::create().allreduce(&s, &total, 1, CosmoMPI::SUM, comm_);
+    return total;
+}
+
+void
+DistributedLargeVector::copy(const DistributedLargeVector& other, double c)
+{
+    check(v_.size() == other.v_.size(), "");
+    if(!v_.empty())
+        VectorKernels::copy(long(v_.size()), c, &(other.v_[0]), &(v_[0]));
+}
+
+void
+DistributedLargeVector::setToZero()
+{
+    std::fill(v_.begin(), v_.end(), 0.0);
+}
+
+double
+DistributedLargeVector::norm() const
+{
+    return std::sqrt(dotProduct(*this));
+}
+
+double
+DistributedLargeVector::dotProduct(const DistributedLargeVector& other) const
+{
+    check(other.v_.size() == v_.size(), "");
+    double s = 0;
+    if(!v_.empty())
+        s = VectorKernels::dotProduct(long(v_.size()), &(v_[0]), &(other.v_[0]));
+    return allSum(s);
+}
+
+void
+DistributedLargeVector::dotProducts(int n, const DistributedLargeVector* const* others, double* res) const
+{
+    check(n >= 0, "");
+    if(n == 0)
+        return;
+
+    terms_.resize(n);
+    for(int j = 0; j < n; ++j)
+    {
+        check(others[j]->v_.size() == v_.size(), "");
+        terms_[j] = (v_.empty() ? NULL : &(others[j]->v_[0]));
+    }
+
+    sums_.assign(n, 0);
+    if(!v_.empty())
+        VectorKernels::dotProducts(long(v_.size()), n, &(v_[0]), &(terms_[0]), &(sums_[0]));
+
+    CosmoMPI::create().allreduce(&(sums_[0]), res, n, CosmoMPI::SUM, comm_);
+}
+
+void
+DistributedLargeVector::linearCombination(int n, const double* c, const DistributedLargeVector* const* v)
+{
+    check(n > 0, "");
+
+    terms_.resize(n);
+    for(int j = 0; j < n; ++j)
+    {
+        check(v[j]->v_.size() == v_.size(), "");
+        terms_[j] = (v_.empty() ? NULL : &(v[j]->v_[0]));
+    }
+
+    if(!v_.empty())
+        VectorKernels::linearCombination(long(v_.size()), n, c, &(terms_[0]), &(v_[0]));
+}
+
+double
+DistributedLargeVector::addAndWeightedSquare(const DistributedLargeVector& other, double c, const DistributedLargeVector& w)
+{
+    check(other.v_.size() == v_.size(), "");
+    check(w.v_.size() == v_.size(), "");
+    double s = 0;
+    if(!v_.empty())
+        s = VectorKernels::addAndWeightedSquare(long(v_.size()), c, &(other.v_[0]), &(w.v_[0]), &(v_[0]));
+    return allSum(s);
+}
+
+void
+DistributedLargeVector::add(const DistributedLargeVector& other, double c)
+{
+    check(other.v_.size() == v_.size(), "");
+    if(!v_.empty())
+        VectorKernels::add(long(v_.size()), c, &(other.v_[0]), &(v_[0]));
+}
+
+void
+DistributedLargeVector::multiply(const DistributedLargeVector& other)
+{
+    check(other.v_.size() == v_.size(), "");
+    if(!v_.empty())
+        VectorKernels::multiply(long(v_.size()), &(other.v_[0]), &(v_[0]));
+}
+
+void
+DistributedLargeVector::divide(const DistributedLargeVector& other)
+{
+    check(other.v_.size() == v_.size(), "");
+#ifdef CHECKS_ON
+    for(long i = 0; i < v_.size(); ++i)
+    {
+        check(other.v_[i] != 0, "division by 0 at index" << begin_ + i);
+    }
+#endif
+    if(!v_.empty())
+        VectorKernels::divide(long(v_.size()), &(other.v_[0]), &(v_[0]));
+}
+
+void
+DistributedLargeVector::pow(double p)
+{
+    if(!v_.empty())
+        VectorKernels::pow(long(v_.size()), p, &(v_[0]));
+}
+
+void
+DistributedLargeVector::swap(DistributedLargeVector& other)
+{
+    check(other.v_.size() == v_.size(), "");
+    check(other.begin_ == begin_, "");
+    v_.swap(other.v_);
+}
+
+void
+DistributedLargeVector::blockSizes(std::vector<int>* counts, std::vector<int>* displs) const
+{
+    const int nProc = communicatorNumProcesses(comm_);
+    counts->resize(nProc);
+    displs->resize(nProc);
+    for(int i = 0; i < nProc; ++i)
+    {
+        long begin, size;
+        partition(totalSize_, nProc, i, &begin, &size);
+        (*counts)[i] = int(size);
+        (*displs)[i] = int(begin);
+    }
+}
+
+void
+DistributedLargeVector::gather(std::vector<double>* res) const
+{
+    check(res, "");
+    if(totalSize_ > INT_MAX)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The vector has " << totalSize_ << " elements, too many to gather into one process.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    res->resize(totalSize_);
+    if(totalSize_ == 0)
+        return;
+
+    std::vector<int> counts, displs;
+    blockSizes(&counts, &displs);
+    CosmoMPI::create().allgatherv((v_.empty() ? (const double*)NULL : &(v_[0])), int(v_.size()), &((*res)[0]), &(counts[0]), &(displs[0]), comm_);
+}
+
+void
+DistributedLargeVector::scatter(const std::vector<double>& v)
+{
+    check(v.size() == totalSize_, "the vector has size " << v.size() << ", should be " << totalSize_);
+    std::copy(v.begin() + begin_, v.begin() + begin_ + v_.size(), v_.begin());
+}
+
+void
+DistributedLBFGSFunc::set(const DistributedLargeVector& x)
+{
+    x_ = x.contents();
+    begin_ = x.localBegin();
+    comm_ = x.communicator();
+}
+
+double
+DistributedLBFGSFunc::value()
+{
+    double s = f_.localValue(x_, begin_);
+    double total = s;
+    CosmoMPI::create().allreduce(&s, &total, 1, CosmoMPI::SUM, comm_);
+    return total;
+}
+
+void
+DistributedLBFGSFunc::derivative(DistributedLargeVector* res)
+{
+    check(res, "");
+    check(res->localBegin() == begin_, "");
+    check(res->localSize() == x_.size(), "");
+    f_.localDerivative(x_, begin_, &(res->contents()));
+    check(res->localSize() == x_.size(), "the derivative has the wrong size");
+}
+
+void
+DistributedLBFGSFunc::whitenoise(int seed, DistributedLargeVector* x, double amplitude)
+{
+    check(x, "");
+    std::vector<double>& v = x->contents();
+    if(v.empty())
+        return;
+
+    whitenoiseBlock(seed, x->localBegin(), long(v.size()), amplitude, &(v[0]));
+}
+
+void
+whitenoiseBlock(int seed, long begin, long size, double amplitude, double* v)
+{
+    check(begin >= 0, "");
+    check(size >= 0, "");
+    if(size == 0)
+        return;
+    check(v, "");
+
+    const long end = begin + size;
+    const long firstChunk = begin / noiseChunkSize;
+    const long lastChunk = (end - 1) / noiseChunkSize;
+
+    // the chunks are independent, so they can be done by different threads
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(long chunk = firstChunk; chunk <= lastChunk; ++chunk)
+    {
+        Math::GaussianGenerator g(chunkSeed(seed, chunk), 0, 1);
+        const long chunkBegin = chunk * noiseChunkSize;
+        const long chunkEnd = chunkBegin + noiseChunkSize;
+        for(long i = chunkBegin; i < std::min(chunkEnd, end); ++i)
+        {
+            const double r = g.generate();
+            if(i >= begin)
+                v[i - begin] = amplitude * r;
+        }
+    }
+}
+
+} // namespace Math
+
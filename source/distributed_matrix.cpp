@@ -0,0 +1,272 @@
+#include <cmath>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <matrix_impl.hpp>
+#include <distributed_matrix.hpp>
+
+extern "C"
+{
+#ifdef COSMO_SCALAPACK
+    // blacs process grid
+    void Cblacs_get(int context, int what, int *val);
+    void Cblacs_gridinit(int *context, const char *order, int nprow, int npcol);
+    void Cblacs_gridinfo(int context, int *nprow, int *npcol, int *myrow, int *mycol);
+    void Cblacs_gridexit(int context);
+
+    // the number of local rows or columns, and the matrix descriptor
+    int numroc_(int *n, int *nb, int *iproc, int *isrcproc, int *nprocs);
+    void descinit_(int *desc, int *m, int *n, int *mb, int *nb, int *irsrc, int *icsrc, int *ictxt, int *lld, int *info);
+
+    // distributed Cholesky factorization and solution
+    void pdpotrf_(char *uplo, int *n, double *a, int *ia, int *ja, int *desca, int *info);
+    void pdpotrs_(char *uplo, int *n, int *nrhs, double *a, int *ia, int *ja, int *desca, double *b, int *ib, int *jb, int *descb, int *info);
+#else
+    // solution from the Cholesky factorization
+    void dpptrs_(char *uplo, int *n, int *nrhs, double *ap, double *b, int *ldb, int *info);
+#endif
+}
+
+namespace
+{
+
+#ifdef COSMO_SCALAPACK
+// the index within the local blocks of a global index
+inline int localIndex(int i, int blockSize, int nProcs)
+{
+    return (i / (blockSize * nProcs)) * blockSize + i % blockSize;
+}
+
+// the process owning a global index
+inline int owner(int i, int blockSize, int nProcs)
+{
+    return (i / blockSize) % nProcs;
+}
+#endif
+
+// sum over all of the processes, the result is on all of them
+void allReduceSum(double* x, int count)
+{
+    if(CosmoMPI::create().numProcesses() == 1)
+        return;
+
+    std::vector<double> sum(count);
+    CosmoMPI::create().reduce(x, &(sum[0]), count, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+    if(CosmoMPI::create().isMaster())
+        std::copy(sum.begin(), sum.end(), x);
+    CosmoMPI::create().bcast(x, count, CosmoMPI::DOUBLE);
+}
+
+} // namespace
+
+namespace Math
+{
+
+#ifdef COSMO_SCALAPACK
+
+DistributedSymmetricMatrix::DistributedSymmetricMatrix(int n, int blockSize) : n_(n), blockSize_(blockSize), factorized_(false)
+{
+    check(n_ > 0, "invalid size " << n_);
+    check(blockSize_ > 0, "invalid block size " << blockSize_);
+
+    // the process grid as close to square as possible
+    const int nProcs = CosmoMPI::create().numProcesses();
+    nProcRows_ = int(std::sqrt(double(nProcs)));
+    while(nProcs % nProcRows_ != 0)
+        --nProcRows_;
+    nProcCols_ = nProcs / nProcRows_;
+
+    Cblacs_get(-1, 0, &context_);
+    Cblacs_gridinit(&context_, "Row", nProcRows_, nProcCols_);
+    int nProcRows, nProcCols;
+    Cblacs_gridinfo(context_, &nProcRows, &nProcCols, &procRow_, &procCol_);
+    check(nProcRows == nProcRows_ && nProcCols == nProcCols_, "");
+
+    int nb = blockSize_;
+    int zero = 0;
+    localRows_ = numroc_(&n, &nb, &procRow_, &zero, &nProcRows_);
+    localCols_ = numroc_(&n, &nb, &procCol_, &zero, &nProcCols_);
+
+    int lld = std::max(1, localRows_);
+    int info;
+    descinit_(desc_, &n, &n, &nb, &nb, &zero, &zero, &context_, &lld, &info);
+    check(info == 0, "descinit failed, info = " << info);
+
+    local_.resize(std::max(1, localRows_ * localCols_), 0);
+}
+
+DistributedSymmetricMatrix::~DistributedSymmetricMatrix()
+{
+    Cblacs_gridexit(context_);
+}
+
+bool
+DistributedSymmetricMatrix::isLocal(int i, int j) const
+{
+    check(i >= 0 && i < n_, "invalid index " << i);
+    check(j >= 0 && j < n_, "invalid index " << j);
+
+    // only the lower triangle is stored
+    if(i < j)
+        std::swap(i, j);
+
+    return owner(i, blockSize_, nProcRows_) == procRow_ && owner(j, blockSize_, nProcCols_) == procCol_;
+}
+
+double&
+DistributedSymmetricMatrix::localElement(int i, int j)
+{
+    check(isLocal(i, j), "the element (" << i << ", " << j << ") is not stored in this process");
+
+    if(i < j)
+        std::swap(i, j);
+
+    return local_[localIndex(j, blockSize_, nProcCols_) * localRows_ + localIndex(i, blockSize_, nProcRows_)];
+}
+
+int
+DistributedSymmetricMatrix::choleskyFactorize()
+{
+    check(!factorized_, "the matrix has already been factorized");
+
+    char uplo = 'L';
+    int n = n_;
+    int one = 1;
+    int info;
+
+    pdpotrf_(&uplo, &n, &(local_[0]), &one, &one, desc_, &info);
+    factorized_ = true;
+    return info;
+}
+
+double
+DistributedSymmetricMatrix::logDetFromCholeskyFactorization() const
+{
+    check(factorized_, "the matrix needs to be factorized first");
+
+    double logDet = 0;
+    for(int i = 0; i < n_; ++i)
+    {
+        if(owner(i, blockSize_, nProcRows_) == procRow_ && owner(i, blockSize_, nProcCols_) == procCol_)
+            logDet += std::log(local_[localIndex(i, blockSize_, nProcCols_) * localRows_ + localIndex(i, blockSize_, nProcRows_)]);
+    }
+
+    allReduceSum(&logDet, 1);
+    return 2 * logDet;
+}
+
+int
+DistributedSymmetricMatrix::solveFromCholeskyFactorization(std::vector<double>& b, int nRhs) const
+{
+    check(factorized_, "the matrix needs to be factorized first");
+    check(nRhs > 0, "invalid number of right hand sides " << nRhs);
+    check(b.size() == n_ * nRhs, "invalid size " << b.size() << " of the right hand sides, should be " << n_ * nRhs);
+
+    // the right hand sides are distributed the same way as the matrix
+    int n = n_;
+    int nb = blockSize_;
+    int zero = 0;
+    int procCol = procCol_, nProcCols = nProcCols_;
+    const int localRhs = numroc_(&nRhs, &nb, &procCol, &zero, &nProcCols);
+    int lld = std::max(1, localRows_);
+    int descB[9];
+    int info;
+    descinit_(descB, &n, &nRhs, &nb, &nb, &zero, &zero, const_cast<int*>(&context_), &lld, &info);
+    check(info == 0, "descinit failed, info = " << info);
+
+    std::vector<double> localB(std::max(1, localRows_ * localRhs), 0);
+    for(int k = 0; k < nRhs; ++k)
+    {
+        if(owner(k, blockSize_, nProcCols_) != procCol_)
+            continue;
+        for(int i = 0; i < n_; ++i)
+        {
+            if(owner(i, blockSize_, nProcRows_) == procRow_)
+                localB[localIndex(k, blockSize_, nProcCols_) * localRows_ + localIndex(i, blockSize_, nProcRows_)] = b[k * n_ + i];
+        }
+    }
+
+    char uplo = 'L';
+    int one = 1;
+    pdpotrs_(&uplo, &n, &nRhs, const_cast<double*>(&(local_[0])), &one, &one, const_cast<int*>(desc_), &(localB[0]), &one, &one, descB, &info);
+
+    // every process contributes its part of the solutions
+    std::fill(b.begin(), b.end(), 0.0);
+    for(int k = 0; k < nRhs; ++k)
+    {
+        if(owner(k, blockSize_, nProcCols_) != procCol_)
+            continue;
+        for(int i = 0; i < n_; ++i)
+        {
+            if(owner(i, blockSize_, nProcRows_) == procRow_)
+                b[k * n_ + i] = localB[localIndex(k, blockSize_, nProcCols_) * localRows_ + localIndex(i, blockSize_, nProcRows_)];
+        }
+    }
+    allReduceSum(&(b[0]), n_ * nRhs);
+
+    return info;
+}
+
+#else
+
+DistributedSymmetricMatrix::DistributedSymmetricMatrix(int n, int blockSize) : n_(n), blockSize_(blockSize), factorized_(false), matrix_(n, n, 0.0)
+{
+    check(n_ > 0, "invalid size " << n_);
+    check(blockSize_ > 0, "invalid block size " << blockSize_);
+}
+
+DistributedSymmetricMatrix::~DistributedSymmetricMatrix()
+{
+}
+
+bool
+DistributedSymmetricMatrix::isLocal(int i, int j) const
+{
+    check(i >= 0 && i < n_, "invalid index " << i);
+    check(j >= 0 && j < n_, "invalid index " << j);
+    return true;
+}
+
+double&
+DistributedSymmetricMatrix::localElement(int i, int j)
+{
+    return matrix_(i, j);
+}
+
+int
+DistributedSymmetricMatrix::choleskyFactorize()
+{
+    check(!factorized_, "the matrix has already been factorized");
+    factorized_ = true;
+    return matrix_.choleskyFactorize();
+}
+
+double
+DistributedSymmetricMatrix::logDetFromCholeskyFactorization() const
+{
+    check(factorized_, "the matrix needs to be factorized first");
+    int sign;
+    return matrix_.logDetFromCholeskyFactorization(&sign);
+}
+
+int
+DistributedSymmetricMatrix::solveFromCholeskyFactorization(std::vector<double>& b, int nRhs) const
+{
+    check(factorized_, "the matrix needs to be factorized first");
+    check(nRhs > 0, "invalid number of right hand sides " << nRhs);
+    check(b.size() == n_ * nRhs, "invalid size " << b.size() << " of the right hand sides, should be " << n_ * nRhs);
+
+    // the packed storage of SymmetricMatrix is the upper triangle in column major order, as used by its Cholesky factorization
+    char uplo = 'U';
+    int n = n_;
+    int ldb = n_;
+    int info;
+    dpptrs_(&uplo, &n, &nRhs, const_cast<double*>(&(matrix_(0, 0))), &(b[0]), &ldb, &info);
+    return info;
+}
+
+#endif
+
+} // namespace Math
+
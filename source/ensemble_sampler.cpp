@@ -0,0 +1,578 @@
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <cosmo_mpi.hpp>
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <math_constants.hpp>
+#include <checkpoint_coordinator.hpp>
+#include <mapped_file.hpp>
+#include <ensemble_sampler.hpp>
+
+namespace Math
+{
+
+EnsembleSampler::EnsembleSampler(int nPar, LikelihoodFunction& like, std::string fileRoot, int nWalkers, time_t seed) : n_(nPar), like_(&like), fileRoot_(fileRoot), param1_(nPar, 0), param2_(nPar, 0), starting_(nPar, 0), startingWidth_(nPar, 0), priorMods_(nPar, PRIOR_MODE_MAX), paramNames_(nPar), externalPrior_(NULL), nWalkers_(nWalkers), move_(STRETCH_MOVE), stretchScale_(2.0), walkSubset_(0), proposals_(0), accepted_(0), resumeCode_(246810)
+{
+    check(nPar > 0, "");
+    check(nWalkers % 2 == 0, "the number of walkers must be even, " << nWalkers << " specified");
+    check(nWalkers >= 2 * nPar, "need at least " << 2 * nPar << " walkers, " << nWalkers << " specified");
+
+    nProcesses_ = CosmoMPI::create().numProcesses();
+    processId_ = CosmoMPI::create().processId();
+
+    positions_.resize(nWalkers_ * n_);
+    likes_.resize(nWalkers_);
+    priors_.resize(nWalkers_);
+
+    if(seed == 0)
+        seed_ = std::time(0);
+    else
+        seed_ = seed;
+
+    UniformRealGenerator temp(seed_, 0, 1000000);
+
+    for(int i = 0; i < 2 * processId_; ++i)
+        temp.generate();
+
+    uniformGen_ = new UniformRealGenerator(int(temp.generate()), 0, 1);
+    generator_ = new GaussianGenerator(int(temp.generate()), 0, 1);
+
+    resumeFileName_ = fileRoot_ + "ensemble_resume.dat";
+}
+
+EnsembleSampler::~EnsembleSampler()
+{
+    delete uniformGen_;
+    delete generator_;
+}
+
+void
+EnsembleSampler::setParam(int i, const std::string& name, double min, double max, double starting, double startingWidth)
+{
+    check(i >= 0 && i < n_, "invalid index = " << i);
+    check(max > min, "max = " << max << ", min = " << min << ". Need max > min.")
+
+    paramNames_[i] = name;
+    param1_[i] = min;
+    param2_[i] = max;
+    priorMods_[i] = UNIFORM_PRIOR;
+
+    if(starting == std::numeric_limits<double>::max())
+        starting_[i] = (max + min) / 2.0;
+    else
+    {
+        check(starting >= min && starting <= max, "invalid starting value " << starting << ", needs to be between " << min << " and " << max);
+        starting_[i] = starting;
+    }
+
+    check(startingWidth >= 0 && startingWidth <= (max - min), "invalid starting width " << startingWidth);
+    startingWidth_[i] = (startingWidth == 0 ? (max - min) / 100 : startingWidth);
+}
+
+void
+EnsembleSampler::setParamGauss(int i, const std::string& name, double mean, double sigma, double starting, double startingWidth)
+{
+    check(i >= 0 && i < n_, "invalid index = " << i);
+    check(sigma > 0, "invalid sigma = " << sigma);
+
+    paramNames_[i] = name;
+    param1_[i] = mean;
+    param2_[i] = sigma;
+    priorMods_[i] = GAUSSIAN_PRIOR;
+
+    starting_[i] = (starting == std::numeric_limits<double>::max() ? mean : starting);
+
+    check(startingWidth >= 0, "invalid starting width " << startingWidth);
+    startingWidth_[i] = (startingWidth == 0 ? sigma / 100 : startingWidth);
+}
+
+void
+EnsembleSampler::useStretchMove(double scale)
+{
+    check(scale > 1, "invalid scale " << scale);
+
+    move_ = STRETCH_MOVE;
+    stretchScale_ = scale;
+}
+
+void
+EnsembleSampler::useWalkMove(int subsetSize)
+{
+    check(subsetSize == 0 || (subsetSize >= 2 && subsetSize <= nWalkers_ / 2), "invalid subset size " << subsetSize);
+
+    move_ = WALK_MOVE;
+    walkSubset_ = subsetSize;
+    if(walkSubset_ == 0)
+        walkSubset_ = std::min(n_ + 1, nWalkers_ / 2);
+}
+
+double
+EnsembleSampler::calculatePrior(double* params)
+{
+    if(externalPrior_)
+        return externalPrior_->calculate(params, n_);
+
+    double result = 1.0;
+    for(int i = 0; i < n_; ++i)
+    {
+        switch(priorMods_[i])
+        {
+        case UNIFORM_PRIOR:
+            if(params[i] < param1_[i] || params[i] > param2_[i])
+                return 0.0;
+            result /= (param2_[i] - param1_[i]);
+            break;
+
+        case GAUSSIAN_PRIOR:
+            result *= std::exp(-(params[i] - param1_[i]) * (params[i] - param1_[i]) / (2 * param2_[i] * param2_[i])) / (std::sqrt(2 * Math::pi) * param2_[i]);
+            break;
+
+        default:
+            check(false, "invalid prior mode");
+            break;
+        }
+    }
+
+    return result;
+}
+
+void
+EnsembleSampler::walkerRange(int half, int processId, int& begin, int& end) const
+{
+    const int halfSize = nWalkers_ / 2;
+    begin = half * halfSize + int((long(processId) * halfSize) / nProcesses_);
+    end = half * halfSize + int((long(processId + 1) * halfSize) / nProcesses_);
+}
+
+void
+EnsembleSampler::propose(int walker, int half, double* proposed, double& logFactor)
+{
+    const int halfSize = nWalkers_ / 2;
+    const int otherBegin = (1 - half) * halfSize;
+    const double* x = &(positions_[walker * n_]);
+
+    if(move_ == STRETCH_MOVE)
+    {
+        int c = otherBegin + int(uniformGen_->generate() * halfSize);
+        if(c >= otherBegin + halfSize)
+            c = otherBegin + halfSize - 1;
+        const double* y = &(positions_[c * n_]);
+
+        // z is distributed as 1/sqrt(z) between 1/a and a
+        const double u = (stretchScale_ - 1) * uniformGen_->generate() + 1;
+        const double z = u * u / stretchScale_;
+
+        for(int i = 0; i < n_; ++i)
+            proposed[i] = y[i] + z * (x[i] - y[i]);
+
+        logFactor = (n_ - 1) * std::log(z);
+        return;
+    }
+
+    check(move_ == WALK_MOVE, "");
+
+    // a random subset of the other half, chosen with a partial Fisher-Yates shuffle
+    std::vector<int> indices(halfSize);
+    for(int i = 0; i < halfSize; ++i)
+        indices[i] = otherBegin + i;
+    for(int i = 0; i < walkSubset_; ++i)
+    {
+        int k = i + int(uniformGen_->generate() * (halfSize - i));
+        if(k >= halfSize)
+            k = halfSize - 1;
+        std::swap(indices[i], indices[k]);
+    }
+
+    std::vector<double> mean(n_, 0);
+    for(int s = 0; s < walkSubset_; ++s)
+        for(int i = 0; i < n_; ++i)
+            mean[i] += positions_[indices[s] * n_ + i];
+    for(int i = 0; i < n_; ++i)
+        mean[i] /= walkSubset_;
+
+    for(int i = 0; i < n_; ++i)
+        proposed[i] = x[i];
+    for(int s = 0; s < walkSubset_; ++s)
+    {
+        const double g = generator_->generate();
+        for(int i = 0; i < n_; ++i)
+            proposed[i] += g * (positions_[indices[s] * n_ + i] - mean[i]);
+    }
+
+    logFactor = 0;
+}
+
+void
+EnsembleSampler::evaluateHalf(int half, bool initial)
+{
+    int begin, end;
+    walkerRange(half, processId_, begin, end);
+    const int nMine = end - begin;
+
+    proposed_.resize(nMine * n_ + 1);
+    logFactors_.resize(nMine + 1);
+    std::vector<double> proposedPriors(nMine + 1);
+
+    // all of the walkers of this half are proposed first, using only the other half, then evaluated in one batch
+    int nBatch = 0;
+    batchParams_.resize(nMine * n_ + 1);
+    for(int j = 0; j < nMine; ++j)
+    {
+        double* p = &(proposed_[j * n_]);
+        if(initial)
+        {
+            for(int i = 0; i < n_; ++i)
+                p[i] = positions_[(begin + j) * n_ + i];
+            logFactors_[j] = 0;
+        }
+        else
+            propose(begin + j, half, p, logFactors_[j]);
+
+        proposedPriors[j] = calculatePrior(p);
+        if(proposedPriors[j] != 0)
+        {
+            for(int i = 0; i < n_; ++i)
+                batchParams_[nBatch * n_ + i] = p[i];
+            ++nBatch;
+        }
+    }
+
+    batchLikes_.resize(nBatch + 1);
+    if(nBatch)
+        like_->calculateBatch(&(batchParams_[0]), n_, nBatch, &(batchLikes_[0]));
+
+    int k = 0;
+    for(int j = 0; j < nMine; ++j)
+    {
+        const int w = begin + j;
+        if(proposedPriors[j] == 0)
+        {
+            check(!initial, "");
+            ++proposals_;
+            continue;
+        }
+
+        const double newLike = batchLikes_[k++];
+        bool accept = initial;
+        if(!initial)
+        {
+            ++proposals_;
+            const double logP = logFactors_[j] + std::log(proposedPriors[j] / priors_[w]) - (newLike - likes_[w]) / 2.0;
+            accept = (logP >= 0 || std::log(uniformGen_->generate()) < logP);
+        }
+
+        if(accept)
+        {
+            for(int i = 0; i < n_; ++i)
+                positions_[w * n_ + i] = proposed_[j * n_ + i];
+            likes_[w] = newLike;
+            priors_[w] = proposedPriors[j];
+            if(!initial)
+                ++accepted_;
+        }
+    }
+    check(k == nBatch, "");
+
+    gatherHalf(half);
+}
+
+void
+EnsembleSampler::gatherHalf(int half)
+{
+#ifdef COSMO_MPI
+    if(nProcesses_ == 1)
+        return;
+
+    const int recordSize = n_ + 2;
+
+    int begin, end;
+    walkerRange(half, processId_, begin, end);
+
+    gatherSend_.resize((end - begin) * recordSize + 1);
+    for(int w = begin; w < end; ++w)
+    {
+        double* r = &(gatherSend_[(w - begin) * recordSize]);
+        r[0] = likes_[w];
+        r[1] = priors_[w];
+        for(int i = 0; i < n_; ++i)
+            r[2 + i] = positions_[w * n_ + i];
+    }
+
+    std::vector<int> counts(nProcesses_), displs(nProcesses_);
+    int total = 0;
+    for(int p = 0; p < nProcesses_; ++p)
+    {
+        int b, e;
+        walkerRange(half, p, b, e);
+        counts[p] = (e - b) * recordSize;
+        displs[p] = total;
+        total += counts[p];
+    }
+
+    gatherRecv_.resize(total + 1);
+    CosmoMPI::create().allgatherv(&(gatherSend_[0]), (end - begin) * recordSize, &(gatherRecv_[0]), &(counts[0]), &(displs[0]));
+
+    // the ranges of the processes are consecutive, so the records are in the order of the walkers
+    const int halfBegin = half * (nWalkers_ / 2);
+    for(int j = 0; j < nWalkers_ / 2; ++j)
+    {
+        const double* r = &(gatherRecv_[j * recordSize]);
+        const int w = halfBegin + j;
+        likes_[w] = r[0];
+        priors_[w] = r[1];
+        for(int i = 0; i < n_; ++i)
+            positions_[w * n_ + i] = r[2 + i];
+    }
+#endif
+}
+
+void
+EnsembleSampler::openOut(bool append, long position)
+{
+    const std::string fileName = fileRoot_ + ".txt";
+
+    if(append)
+    {
+        // drop the elements written after the resume information, they will be generated again
+        if(truncate(fileName.c_str(), position) != 0)
+        {
+            output_screen("WARNING: could not truncate the chain file " << fileName << " to the resume point." << std::endl);
+        }
+        out_.open(fileName.c_str(), std::ios::app);
+    }
+    else
+        out_.open(fileName.c_str());
+
+    if(!out_)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+EnsembleSampler::writeWalkers()
+{
+    check(out_, "");
+    for(int w = 0; w < nWalkers_; ++w)
+    {
+        out_ << 1 << "   " << likes_[w];
+        for(int i = 0; i < n_; ++i)
+            out_ << "   " << positions_[w * n_ + i];
+        out_ << '\n';
+    }
+}
+
+void
+EnsembleSampler::writeResumeInfo(unsigned long iteration)
+{
+    check(processId_ == 0, "");
+
+    out_.flush();
+    const long position = out_.tellp();
+
+    // the previous resume information is kept until the new one is complete
+    try
+    {
+        Math::ReplacingOutputFile file(resumeFileName_.c_str());
+        std::ofstream& out = file.stream();
+        out.write((char*)(&iteration), sizeof(unsigned long));
+        out.write((char*)(&position), sizeof(long));
+        out.write((char*)(&nWalkers_), sizeof(int));
+        out.write((char*)(&n_), sizeof(int));
+        out.write((char*)(&(positions_[0])), nWalkers_ * n_ * sizeof(double));
+        out.write((char*)(&(likes_[0])), nWalkers_ * sizeof(double));
+        out.write((char*)(&(priors_[0])), nWalkers_ * sizeof(double));
+        out.write((char*)(&resumeCode_), sizeof(int));
+        file.commit();
+    }
+    catch (std::exception& e)
+    {
+        output_screen("WARNING: the resume file " << resumeFileName_ << " was not updated, a resumed run would start from the previous resume point. " << e.what() << std::endl);
+    }
+}
+
+bool
+EnsembleSampler::readResumeInfo(unsigned long& iteration, long& position)
+{
+    std::ifstream in(resumeFileName_.c_str(), std::ios::binary | std::ios::in);
+    if(!in)
+        return false;
+
+    int nWalkers, nPar;
+    in.read((char*)(&iteration), sizeof(unsigned long));
+    in.read((char*)(&position), sizeof(long));
+    in.read((char*)(&nWalkers), sizeof(int));
+    in.read((char*)(&nPar), sizeof(int));
+    if(!in || nWalkers != nWalkers_ || nPar != n_)
+        return false;
+
+    std::vector<double> positions(nWalkers_ * n_), likes(nWalkers_), priors(nWalkers_);
+    in.read((char*)(&(positions[0])), nWalkers_ * n_ * sizeof(double));
+    in.read((char*)(&(likes[0])), nWalkers_ * sizeof(double));
+    in.read((char*)(&(priors[0])), nWalkers_ * sizeof(double));
+
+    int code;
+    in.read((char*)(&code), sizeof(int));
+    if(!in || code != resumeCode_)
+        return false;
+
+    positions_.swap(positions);
+    likes_.swap(likes);
+    priors_.swap(priors);
+    return true;
+}
+
+double
+EnsembleSampler::run(unsigned long nIterations, int thin, int writeResumeInformationEvery)
+{
+    check(nIterations > 0, "invalid number of iterations " << nIterations);
+    check(thin > 0, "invalid thinning factor " << thin);
+    check(writeResumeInformationEvery >= 0, "invalid resume interval " << writeResumeInformationEvery);
+    for(int i = 0; i < n_; ++i)
+    {
+        check(priorMods_[i] != PRIOR_MODE_MAX, "parameter " << i << " has not been set");
+    }
+
+    const bool isMaster = (processId_ == 0);
+
+    unsigned long iteration = 0;
+    long position = 0;
+    int resumed = 0;
+
+    if(isMaster)
+    {
+        output_screen_clean("Running the ensemble sampler with " << nWalkers_ << " walkers on " << nProcesses_ << " process(es)!!!" << std::endl << std::endl);
+
+        std::stringstream paramNamesFileName;
+        paramNamesFileName << fileRoot_ << ".paramnames";
+        std::ofstream outPar(paramNamesFileName.str().c_str());
+
+        if(!outPar)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot write into paramnames file " << paramNamesFileName.str() << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        for(int i = 0; i < n_; ++i)
+            outPar << paramNames_[i] << '\t' << paramNames_[i] << std::endl;
+        outPar.close();
+
+        resumed = (readResumeInfo(iteration, position) ? 1 : 0);
+
+        if(!resumed)
+        {
+            // the starting ball, only points with non-zero prior are used
+            for(int w = 0; w < nWalkers_; ++w)
+            {
+                double* x = &(positions_[w * n_]);
+                int tries = 0;
+                do
+                {
+                    for(int i = 0; i < n_; ++i)
+                        x[i] = starting_[i] + startingWidth_[i] * generator_->generate();
+                } while(calculatePrior(x) == 0 && ++tries < 1000);
+
+                if(calculatePrior(x) == 0)
+                {
+                    StandardException exc;
+                    std::stringstream exceptionStr;
+                    exceptionStr << "Cannot find a starting point with non-zero prior for walker " << w << ".";
+                    exc.set(exceptionStr.str());
+                    throw exc;
+                }
+            }
+        }
+    }
+
+    CosmoMPI::create().bcast(&resumed, 1, CosmoMPI::INT);
+    CosmoMPI::create().bcast(&(positions_[0]), nWalkers_ * n_, CosmoMPI::DOUBLE);
+
+    if(resumed)
+    {
+        long it = iteration;
+        CosmoMPI::create().bcast(&it, 1, CosmoMPI::LONG);
+        iteration = it;
+        CosmoMPI::create().bcast(&(likes_[0]), nWalkers_, CosmoMPI::DOUBLE);
+        CosmoMPI::create().bcast(&(priors_[0]), nWalkers_, CosmoMPI::DOUBLE);
+
+        output_screen("Resuming from previous run, already have " << iteration << " iterations." << std::endl);
+        if(isMaster)
+            openOut(true, position);
+    }
+    else
+    {
+        output_screen("No resume file found (or the resume file is not complete), starting from scratch." << std::endl);
+
+        evaluateHalf(0, true);
+        evaluateHalf(1, true);
+
+        if(isMaster)
+            openOut(false, 0);
+    }
+
+    proposals_ = 0;
+    accepted_ = 0;
+
+    // all of the processes move the walkers together, so they also stop together (see CheckpointCoordinator)
+    const bool checkpoints = CheckpointCoordinator::isInstalled();
+    bool preempted = false;
+
+    for(; iteration < nIterations && !preempted; ++iteration)
+    {
+        evaluateHalf(0, false);
+        evaluateHalf(1, false);
+
+        if(isMaster && (iteration + 1) % thin == 0)
+            writeWalkers();
+
+        if(checkpoints && CheckpointCoordinator::requestedEverywhere())
+            preempted = true;
+
+        if(isMaster && writeResumeInformationEvery && ((iteration + 1) % writeResumeInformationEvery == 0 || preempted))
+            writeResumeInfo(iteration + 1);
+
+        if((iteration + 1) % 1000 == 0)
+        {
+            output_screen("Total iterations: " << iteration + 1 << std::endl);
+        }
+    }
+
+    if(isMaster)
+        out_.close();
+
+    double counts[2] = {double(proposals_), double(accepted_)};
+    double totalCounts[2] = {counts[0], counts[1]};
+#ifdef COSMO_MPI
+    CosmoMPI::create().reduce(counts, totalCounts, 2, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+    CosmoMPI::create().bcast(totalCounts, 2, CosmoMPI::DOUBLE);
+#endif
+
+    const double acceptance = (totalCounts[0] > 0 ? totalCounts[1] / totalCounts[0] : 0.0);
+    if(isMaster)
+    {
+        if(preempted)
+        {
+            output_screen("Stopped by a termination request after " << iteration << " iterations, the run can be resumed from here!" << std::endl);
+        }
+        output_screen("Acceptance fraction = " << acceptance << std::endl);
+    }
+
+    if(preempted)
+        CheckpointCoordinator::flush();
+
+    return acceptance;
+}
+
+} // namespace Math
+
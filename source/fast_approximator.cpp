@@ -3,30 +3,88 @@
 #include <sstream>
 #include <vector>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <matrix_impl.hpp>
+#include <mapped_file.hpp>
 #include <fast_approximator.hpp>
+#include <profiler.hpp>
 
-FastApproximator::FastApproximator(int nPoints, int nData, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& data, int k) : knn_(NULL), k_(k), nPoints_(nPoints), nData_(nData), x_(k, nPoints + nPoints * (nPoints + 1) / 2 + 1), xLin_(k, nPoints + 1), xT_(nPoints + nPoints * (nPoints + 1) / 2 + 1, k), xTLin_(nPoints_ + 1, k), inv_(nPoints + nPoints * (nPoints + 1) / 2 + 1, nPoints + nPoints * (nPoints + 1) / 2 + 1), invLin_(nPoints_ + 1, nPoints_ + 1), prod_(nPoints + nPoints * (nPoints + 1) / 2 + 1, k), prodLin_(nPoints_ + 1, k), pointTransformed_(nPoints), sigma_(1), l_(1e-6)
+namespace
 {
-    check(nPoints_ > 0, "");
-    check(nData_ > 0, "");
 
-    for(int i = 0; i < k; ++i)
+// the original format always contains the output values, the second one has a flag saying whether it does
+const char fastApproximatorMagic[8] = {'C', 'O', 'S', 'M', 'O', 'F', 'A', 'P'};
+const char fastApproximatorMagic2[8] = {'C', 'O', 'S', 'M', 'O', 'F', 'A', '2'};
+
+// rank-1 update of a lower triangular Cholesky factor (row-major n x n), so that l * l^T becomes l * l^T + v * v^T. v is overwritten.
+void choleskyRankOneUpdate(std::vector<double>& l, int n, std::vector<double>& v)
+{
+    for(int k = 0; k < n; ++k)
+    {
+        const double lkk = l[k * n + k];
+        const double r = std::sqrt(lkk * lkk + v[k] * v[k]);
+        const double c = r / lkk, s = v[k] / lkk;
+        l[k * n + k] = r;
+        for(int i = k + 1; i < n; ++i)
+        {
+            l[i * n + k] = (l[i * n + k] + s * v[i]) / c;
+            v[i] = c * v[i] - s * l[i * n + k];
+        }
+    }
+}
+
+// product of two lower triangular matrices (row-major n x n)
+void multiplyLower(const std::vector<double>& a, const std::vector<double>& b, int n, std::vector<double>& res)
+{
+    res.assign(n * n, 0.0);
+    for(int i = 0; i < n; ++i)
     {
-        x_(i, 0) = 1;
-        xT_(0, i) = 1;
+        for(int j = 0; j <= i; ++j)
+        {
+            double x = 0;
+            for(int k = j; k <= i; ++k)
+                x += a[i * n + k] * b[k * n + j];
+            res[i * n + j] = x;
+        }
+    }
+}
 
-        xLin_(i, 0) = 1;
-        xTLin_(0, i) = 1;
+// solves l * l^T * x = b in place, l is a lower triangular Cholesky factor (row-major m x m)
+void choleskySolve(const double* l, int m, double* x)
+{
+    for(int i = 0; i < m; ++i)
+    {
+        double y = x[i];
+        for(int k = 0; k < i; ++k)
+            y -= l[i * m + k] * x[k];
+        x[i] = y / l[i * m + i];
     }
+    for(int i = m - 1; i >= 0; --i)
+    {
+        double y = x[i];
+        for(int k = i + 1; k < m; ++k)
+            y -= l[k * m + i] * x[k];
+        x[i] = y / l[i * m + i];
+    }
+}
+
+} // namespace
+
+FastApproximator::FastApproximator(int nPoints, int nData, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& data, int k) : knn_(NULL), k_(k), nPoints_(nPoints), nData_(nData), pointTransformed_(nPoints), sigma_(1), l_(1e-6), driftThreshold_(0), workspace_(nPoints, k), memory_(MemoryTracker::EMULATOR_DATA)
+{
+    check(nPoints_ > 0, "");
+    check(nData_ > 0, "");
 
     covariance_.resize(nPoints_, nPoints_);
     choleskyMat_.resize(nPoints_, nPoints_);
-    v_.resize(nPoints_, 1);
-    w_.resize(nPoints_, 1);
+
+    mean_.resize(nPoints_);
+    scatterChol_.resize(nPoints_ * nPoints_);
+    transformInv_.resize(nPoints_ * nPoints_);
 
     indices_.resize(k_);
     dists_.resize(k_);
@@ -34,6 +92,49 @@ FastApproximator::FastApproximator(int nPoints, int nData, unsigned long dataSiz
     reset(dataSize, points, data, true);
 }
 
+FastApproximator::FastApproximator(int nPoints, int nData, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<const double*>& data, int k) : knn_(NULL), k_(k), nPoints_(nPoints), nData_(nData), pointTransformed_(nPoints), sigma_(1), l_(1e-6), driftThreshold_(0), workspace_(nPoints, k), memory_(MemoryTracker::EMULATOR_DATA)
+{
+    check(nPoints_ > 0, "");
+    check(nData_ > 0, "");
+
+    covariance_.resize(nPoints_, nPoints_);
+    choleskyMat_.resize(nPoints_, nPoints_);
+
+    mean_.resize(nPoints_);
+    scatterChol_.resize(nPoints_ * nPoints_);
+    transformInv_.resize(nPoints_ * nPoints_);
+
+    indices_.resize(k_);
+    dists_.resize(k_);
+
+    reset(dataSize, points, data, true);
+}
+
+FastApproximator::FastApproximator(int nPoints, int nData, int k, const char* fileName, unsigned long dataSize, const std::vector<const double*>* values) : knn_(NULL), k_(k), nPoints_(nPoints), nData_(nData), pointTransformed_(nPoints), sigma_(1), l_(1e-6), driftThreshold_(0), workspace_(nPoints, k), memory_(MemoryTracker::EMULATOR_DATA)
+{
+    check(nPoints_ > 0, "");
+    check(nData_ > 0, "");
+
+    covariance_.resize(nPoints_, nPoints_);
+    choleskyMat_.resize(nPoints_, nPoints_);
+
+    mean_.resize(nPoints_);
+    scatterChol_.resize(nPoints_ * nPoints_);
+    transformInv_.resize(nPoints_ * nPoints_);
+
+    indices_.resize(k_);
+    dists_.resize(k_);
+
+    if(!readFromFile(fileName, dataSize, values))
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot read the fast approximator from the file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
 FastApproximator::~FastApproximator()
 {
     check(knn_, "");
@@ -43,24 +144,51 @@ FastApproximator::~FastApproximator()
 void
 FastApproximator::addPoint(const std::vector<double>& p, const std::vector<double>& val)
 {
-    check(p.size() == nPoints_, "");
     check(val.size() == nData_, "");
 
-    for(int i = 0; i < nPoints_; ++i)
-        v_(i, 0) = p[i];
+    // the inner vectors keep their buffers when data_ grows, so the other pointers into data_ stay valid
+    data_.push_back(val);
+    addPoint(p, &(data_.back()[0]));
+}
 
-    Math::Matrix<double>::multiplyMatrices(choleskyMat_, v_, &w_);
-    pointsTransformed_.resize(pointsTransformed_.size() + 1);
-    pointsTransformed_.back().resize(nPoints_);
-    for(int i = 0; i < nPoints_; ++i)
-        pointsTransformed_.back()[i] = w_(i, 0);
+void
+FastApproximator::addPoint(const std::vector<double>& p, const double* val)
+{
+    check(p.size() == nPoints_, "");
+    check(val, "");
 
-    data_.push_back(val);
+    std::vector<double> pTransformed(nPoints_);
+    transform(&(p[0]), &(pTransformed[0]));
+
+    check(dataRows_.size() == dataSize_, "");
+    dataRows_.push_back(val);
     ++dataSize_;
+    updateMemory();
+
+    knn_->insert(pTransformed);
 
-    knn_->insert(pointsTransformed_.back());
+    // Welford update of the moments, the scatter matrix gets the rank-1 term (n - 1) / n * delta * delta^T
+    ++momentsCount_;
+    std::vector<double> delta(nPoints_);
+    const double n = double(momentsCount_);
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        const double d = p[i] - mean_[i];
+        mean_[i] += d / n;
+        delta[i] = d * std::sqrt((n - 1) / n);
+    }
+    // the factor can only be updated if the scatter matrix was positive definite to begin with
+    if(scatterValid_)
+        choleskyRankOneUpdate(scatterChol_, nPoints_, delta);
 
     check(dataSize_ == knn_->nElements(), "");
+
+    if(driftThreshold_ > 0 && scatterValid_ && whiteningDrift() > driftThreshold_)
+    {
+        reWhiten();
+        return;
+    }
+
     if(knn_->depth() > 5 * std::log(double(dataSize_)) / std::log(2.0))
     {
         output_screen("The KD Tree has become unbalanced. Rebalancing..." << std::endl);
@@ -69,8 +197,116 @@ FastApproximator::addPoint(const std::vector<double>& p, const std::vector<doubl
     }
 }
 
+void
+FastApproximator::setWhiteningDriftThreshold(double threshold)
+{
+    check(threshold >= 0, "invalid threshold " << threshold);
+    driftThreshold_ = threshold;
+}
+
+double
+FastApproximator::whiteningDrift() const
+{
+    check(momentsCount_ > 1, "");
+
+    // transform_ * (the current covariance factor) is the identity if the covariance hasn't changed since the transformation was calculated
+    std::vector<double> m;
+    multiplyLower(transform_, scatterChol_, nPoints_, m);
+
+    const double norm = 1.0 / std::sqrt(double(momentsCount_ - 1));
+    double drift = 0;
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+            drift = std::max(drift, std::abs(m[i * nPoints_ + j] * norm - (i == j ? 1.0 : 0.0)));
+    }
+
+    return drift;
+}
+
+void
+FastApproximator::updateTransform()
+{
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            choleskyMat_(i, j) = transformInv_[i * nPoints_ + j];
+    }
+
+    choleskyMat_.invert();
+
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            transform_[i * nPoints_ + j] = (j <= i ? choleskyMat_(i, j) : 0.0);
+    }
+}
+
+void
+FastApproximator::reWhiten()
+{
+    output_screen("The covariance of the Fast Approximator points has drifted. Updating the transformation..." << std::endl);
+
+    const std::vector<double> oldInv = transformInv_;
+
+    const double norm = 1.0 / std::sqrt(double(momentsCount_ - 1));
+    for(int i = 0; i < nPoints_ * nPoints_; ++i)
+        transformInv_[i] = scatterChol_[i] * norm;
+    updateTransform();
+
+    // the points in the tree are mapped to the new basis directly, the original points are not kept
+    std::vector<double> m;
+    multiplyLower(transform_, oldInv, nPoints_, m);
+
+    const unsigned long n = knn_->nElements();
+    std::vector<std::vector<double> > pointsTransformed(n, std::vector<double>(nPoints_));
+    for(unsigned long k = 0; k < n; ++k)
+    {
+        const double* y = knn_->point(k);
+        for(int i = 0; i < nPoints_; ++i)
+        {
+            double x = 0;
+            for(int j = 0; j <= i; ++j)
+                x += m[i * nPoints_ + j] * y[j];
+            pointsTransformed[k][i] = x;
+        }
+    }
+
+    knn_->reset(pointsTransformed);
+    output_screen("OK" << std::endl);
+}
+
 void
 FastApproximator::reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& data, bool updateCovariance)
+{
+    check(dataSize > 0, "");
+    check(data.size() >= dataSize, "");
+
+    data_.assign(data.begin(), data.begin() + dataSize);
+    dataRows_.resize(dataSize);
+    for(unsigned long i = 0; i < dataSize; ++i)
+    {
+        check(data_[i].size() == nData_, "");
+        dataRows_[i] = &(data_[i][0]);
+    }
+
+    resetPoints(dataSize, points, updateCovariance);
+}
+
+void
+FastApproximator::reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<const double*>& data, bool updateCovariance)
+{
+    check(dataSize > 0, "");
+    check(data.size() >= dataSize, "");
+
+    data_.clear();
+    dataRows_.assign(data.begin(), data.begin() + dataSize);
+
+    resetPoints(dataSize, points, updateCovariance);
+}
+
+void
+FastApproximator::resetPoints(unsigned long dataSize, const std::vector<std::vector<double> >& points, bool updateCovariance)
 {
     output_screen("Fast Approximator learn with " << dataSize << " points." << std::endl);
     Timer timer("FAST APPROXIMATOR LEARN");
@@ -79,84 +315,146 @@ FastApproximator::reset(unsigned long dataSize, const std::vector<std::vector<do
     dataSize_ = dataSize;
     check(dataSize_ > 0, "");
     check(points.size() >= dataSize_, "");
-    check(data.size() >= dataSize_, "");
+    check(dataRows_.size() == dataSize_, "");
+    updateMemory();
 
-    data_ = data;
+    // the running moments always describe the points in the tree
+    std::fill(mean_.begin(), mean_.end(), 0.0);
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = i; j < nPoints_; ++j)
+            covariance_(i, j) = 0;
+    }
 
-    if(updateCovariance)
+    std::vector<double> delta(nPoints_);
+    for(unsigned long k = 0; k < dataSize_; ++k)
     {
-        std::vector<double> mean(nPoints_, 0);
+        check(points[k].size() >= nPoints_, "");
 
-        for(unsigned long i = 0; i < dataSize_; ++i)
+        const double n = double(k + 1);
+        for(int i = 0; i < nPoints_; ++i)
         {
-            check(points[i].size() >= nPoints_, "");
-
-            for(int j = 0; j < nPoints_; ++j)
-                mean[j] += points[i][j];
+            delta[i] = points[k][i] - mean_[i];
+            mean_[i] += delta[i] / n;
         }
 
-        for(int i = 0; i < nPoints_; ++i)
-            mean[i] /= double(dataSize_);
-
         for(int i = 0; i < nPoints_; ++i)
         {
+            const double d = points[k][i] - mean_[i];
             for(int j = i; j < nPoints_; ++j)
-            {
-                double t1 = 0;
-                for(unsigned long k = 0; k < dataSize_; ++k)
-                    t1 += points[k][i] * points[k][j];
-
-                covariance_(i, j) = (t1 - double(dataSize_) * mean[i] * mean[j]) / double(dataSize_ - 1);
-            }
+                covariance_(i, j) += delta[j] * d;
         }
+    }
+    momentsCount_ = dataSize_;
 
-        covariance_.choleskyFactorize();
+    scatterValid_ = (covariance_.choleskyFactorize() == 0);
 
-        for(int i = 0; i < nPoints_; ++i)
-        {
-            for(int j = 0; j < nPoints_; ++j)
-                choleskyMat_(i, j) = (j <= i ? covariance_(i, j) : 0.0);
-        }
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            scatterChol_[i * nPoints_ + j] = (j <= i ? covariance_(i, j) : 0.0);
+    }
+
+    if(updateCovariance)
+    {
+        check(dataSize_ > 1, "");
+        const double norm = 1.0 / std::sqrt(double(dataSize_ - 1));
+        for(int i = 0; i < nPoints_ * nPoints_; ++i)
+            transformInv_[i] = scatterChol_[i] * norm;
 
-        choleskyMat_.invert();
+        transform_.resize(nPoints_ * nPoints_);
+        updateTransform();
     }
 
-    pointsTransformed_.resize(dataSize_);
+    // the transformed points are only kept in the kd tree
+    std::vector<std::vector<double> > pointsTransformed(dataSize_, std::vector<double>(nPoints_));
 
     for(unsigned long i = 0; i < dataSize_; ++i)
     {
-        pointsTransformed_[i].resize(nPoints_);
-
-        for(int j = 0; j < nPoints_; ++j)
-        {
-            v_(j, 0) = points[i][j];
-        }
-
-        Math::Matrix<double>::multiplyMatrices(choleskyMat_, v_, &w_);
-        for(int j = 0; j < nPoints_; ++j)
-            pointsTransformed_[i][j] = w_(j, 0);
+        check(points[i].size() >= nPoints_, "");
+        transform(&(points[i][0]), &(pointsTransformed[i][0]));
     }
 
     if(!knn_)
-        knn_ = new KDTree(nPoints_, pointsTransformed_);
+        knn_ = new KDTree(nPoints_, pointsTransformed);
     else
-        knn_->reset(pointsTransformed_);
+        knn_->reset(pointsTransformed);
 
     timer.end();
 }
 
+template<int D>
 void
-FastApproximator::findNearestNeighbors(const std::vector<double>& point, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices)
+FastApproximator::transformDim(const double* in, double* out) const
 {
-    check(point.size() == nPoints_, "");
+    const int n = (D > 0 ? D : nPoints_);
+    check(transform_.size() == n * n, "");
 
-    for(int i = 0; i < nPoints_; ++i)
+    const double* row = &(transform_[0]);
+    for(int i = 0; i < n; ++i)
     {
-        v_(i, 0) = point[i];
+        double res = 0;
+        for(int j = 0; j < n; ++j)
+            res += row[j] * in[j];
+        out[i] = res;
+        row += n;
     }
-    Math::Matrix<double>::multiplyMatrices(choleskyMat_, v_, &w_);
-    for(int i = 0; i < nPoints_; ++i)
-        pointTransformed_[i] = w_(i, 0);
+}
+
+void
+FastApproximator::transform(const double* in, double* out) const
+{
+    // fixed dimension versions for the common cases, so that the loops can be unrolled and vectorized
+    switch(nPoints_)
+    {
+    case 1:
+        transformDim<1>(in, out);
+        break;
+    case 2:
+        transformDim<2>(in, out);
+        break;
+    case 3:
+        transformDim<3>(in, out);
+        break;
+    case 4:
+        transformDim<4>(in, out);
+        break;
+    case 5:
+        transformDim<5>(in, out);
+        break;
+    case 6:
+        transformDim<6>(in, out);
+        break;
+    case 7:
+        transformDim<7>(in, out);
+        break;
+    case 8:
+        transformDim<8>(in, out);
+        break;
+    case 10:
+        transformDim<10>(in, out);
+        break;
+    case 12:
+        transformDim<12>(in, out);
+        break;
+    case 16:
+        transformDim<16>(in, out);
+        break;
+    case 20:
+        transformDim<20>(in, out);
+        break;
+    default:
+        transformDim<0>(in, out);
+        break;
+    }
+}
+
+void
+FastApproximator::findNearestNeighbors(const std::vector<double>& point, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices)
+{
+    check(point.size() == nPoints_, "");
+
+    transform(&(point[0]), &(pointTransformed_[0]));
 
     check(knn_, "");
     knn_->findNearestNeighbors(pointTransformed_, k_, &indices_, &dists_);
@@ -166,7 +464,7 @@ FastApproximator::findNearestNeighbors(const std::vector<double>& point, std::ve
         output_screen("FOUND DISTANCE = 0" << std::endl);
         for(int i = 0; i < nPoints_; ++i)
         {
-            //output_screen("\t" << pointTransformed_[i] << "\t" << pointsTransformed_[indices_[0]][i] << std::endl);
+            //output_screen("\t" << pointTransformed_[i] << "\t" << knn_->point(indices_[0])[i] << std::endl);
         }
     }
 
@@ -182,10 +480,10 @@ FastApproximator::findNearestNeighbors(const std::vector<double>& point, std::ve
         nearestNeighbors->resize(k_);
         for(int i = 0; i < k_; ++i)
         {
-            const unsigned long index = indices_[i];
-            (*nearestNeighbors)[i] = pointsTransformed_[index];
+            const double* p = knn_->point(indices_[i]);
+            (*nearestNeighbors)[i].resize(nPoints_);
             for(int j = 0; j < nPoints_; ++j)
-                (*nearestNeighbors)[i][j] -= pointTransformed_[j];
+                (*nearestNeighbors)[i][j] = p[j] - pointTransformed_[j];
         }
     }
 
@@ -195,137 +493,458 @@ FastApproximator::findNearestNeighbors(const std::vector<double>& point, std::ve
     }
 }
 
+void
+FastApproximator::writeIntoFile(const char* fileName, bool includeValues) const
+{
+    // replaced only after it is written, since the kd tree might be mapped from the old file
+    Math::ReplacingOutputFile out(fileName);
+    writeIntoStream(out.stream(), includeValues);
+    out.commit();
+}
+
+void
+FastApproximator::writeIntoStream(std::ostream& out, bool includeValues) const
+{
+    check(knn_, "");
+    check(dataRows_.size() == dataSize_, "");
+    check(knn_->nElements() == dataSize_, "");
+
+    out.write(fastApproximatorMagic2, 8);
+    out.write((const char*)(&nPoints_), sizeof(int));
+    out.write((const char*)(&nData_), sizeof(int));
+    out.write((const char*)(&dataSize_), sizeof(unsigned long));
+    const int hasValues = includeValues;
+    out.write((const char*)(&hasValues), sizeof(int));
+    out.write((const char*)(&(transform_[0])), nPoints_ * nPoints_ * sizeof(double));
+    const int scatterValid = scatterValid_;
+    out.write((const char*)(&momentsCount_), sizeof(unsigned long));
+    out.write((const char*)(&scatterValid), sizeof(int));
+    out.write((const char*)(&(mean_[0])), nPoints_ * sizeof(double));
+    out.write((const char*)(&(scatterChol_[0])), nPoints_ * nPoints_ * sizeof(double));
+    if(includeValues)
+    {
+        for(unsigned long i = 0; i < dataSize_; ++i)
+            out.write((const char*)(dataRows_[i]), nData_ * sizeof(double));
+    }
+
+    knn_->writeIntoFile(out);
+}
+
+bool
+FastApproximator::readFromFile(const char* fileName, unsigned long dataSize, const std::vector<const double*>* values)
+{
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if(!in)
+        return false;
+
+    char magic[8];
+    int nPoints, nData;
+    unsigned long size;
+    in.read(magic, 8);
+    in.read((char*)(&nPoints), sizeof(int));
+    in.read((char*)(&nData), sizeof(int));
+    in.read((char*)(&size), sizeof(unsigned long));
+
+    const bool version2 = (std::memcmp(magic, fastApproximatorMagic2, 8) == 0);
+    if(!in || (!version2 && std::memcmp(magic, fastApproximatorMagic, 8) != 0) || nPoints != nPoints_ || nData != nData_ || size == 0 || (dataSize && size != dataSize))
+        return false;
+
+    int hasValues = 1;
+    if(version2)
+        in.read((char*)(&hasValues), sizeof(int));
+
+    // the values need to come from somewhere
+    if(!in || (!hasValues && (!values || values->size() < size)))
+        return false;
+
+    std::vector<double> t(nPoints_ * nPoints_), mean(nPoints_), scatterChol(nPoints_ * nPoints_);
+    unsigned long momentsCount;
+    int scatterValid;
+    in.read((char*)(&(t[0])), nPoints_ * nPoints_ * sizeof(double));
+    in.read((char*)(&momentsCount), sizeof(unsigned long));
+    in.read((char*)(&scatterValid), sizeof(int));
+    in.read((char*)(&(mean[0])), nPoints_ * sizeof(double));
+    in.read((char*)(&(scatterChol[0])), nPoints_ * nPoints_ * sizeof(double));
+
+    std::vector<std::vector<double> > data;
+    if(hasValues && !values)
+    {
+        data.resize(size, std::vector<double>(nData_));
+        for(unsigned long i = 0; i < size; ++i)
+            in.read((char*)(&(data[i][0])), nData_ * sizeof(double));
+    }
+    else if(hasValues)
+    {
+        // the values given are used instead of the ones in the file
+        in.seekg(size * nData_ * sizeof(double), std::ios::cur);
+    }
+
+    if(!in)
+        return false;
+
+    const long treeOffset = in.tellg();
+    in.close();
+
+    KDTree* tree = new KDTree(fileName, treeOffset);
+    if(tree->dim() != nPoints_ || tree->nElements() != size)
+    {
+        delete tree;
+        return false;
+    }
+
+    output_screen("Fast Approximator read " << size << " points from " << fileName << "." << std::endl);
+
+    if(knn_)
+        delete knn_;
+    knn_ = tree;
+
+    transform_.swap(t);
+    mean_.swap(mean);
+    scatterChol_.swap(scatterChol);
+    momentsCount_ = momentsCount;
+    scatterValid_ = (scatterValid != 0);
+
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            choleskyMat_(i, j) = transform_[i * nPoints_ + j];
+    }
+    choleskyMat_.invert();
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            transformInv_[i * nPoints_ + j] = (j <= i ? choleskyMat_(i, j) : 0.0);
+    }
+
+    data_.swap(data);
+    if(data_.empty())
+    {
+        dataRows_.assign(values->begin(), values->begin() + size);
+    }
+    else
+    {
+        dataRows_.resize(size);
+        for(unsigned long i = 0; i < size; ++i)
+            dataRows_[i] = &(data_[i][0]);
+    }
+    dataSize_ = size;
+    updateMemory();
+
+    return true;
+}
+
+void
+FastApproximator::updateMemory()
+{
+    const unsigned long owned = (data_.empty() ? 0 : data_.size() * nData_ * sizeof(double));
+    memory_.set(owned + data_.capacity() * sizeof(std::vector<double>) + dataRows_.capacity() * sizeof(const double*));
+}
+
+bool
+FastApproximator::hasPointWithin(const std::vector<double>& point, double radius)
+{
+    check(point.size() == nPoints_, "");
+    check(knn_, "");
+
+    transform(&(point[0]), &(pointTransformed_[0]));
+    return knn_->hasPointWithin(pointTransformed_, radius);
+}
+
+FastApproximator::Workspace::Workspace(int nPoints, int k) : basis(k * (nPoints + nPoints * (nPoints + 1) / 2 + 1)), a((nPoints + nPoints * (nPoints + 1) / 2 + 1) * (nPoints + nPoints * (nPoints + 1) / 2 + 1)), q(nPoints + nPoints * (nPoints + 1) / 2 + 1), weights(k)
+{
+}
+
 void
 FastApproximator::getApproximation(std::vector<double>& val, InterpolationMethod method)
 {
     check(method >= 0 && method < INTERPOLATION_METHOD_MAX, "");
 
     val.resize(nData_);
+    fit(&(pointTransformed_[0]), &(indices_[0]), &(dists_[0]), method, workspace_, &(val[0]));
+}
 
-    if(std::sqrt(dists_[0]) < 1e-7)
+void
+FastApproximator::fit(const double* pointTransformed, const unsigned long* indices, const double* dists, InterpolationMethod method, Workspace& w, double* val) const
+{
+    if(std::sqrt(dists[0]) < 1e-7)
     {
-        //output_screen("FOUND distance = " << dists_[0] << std::endl);
-        const unsigned long index = indices_[0];
+        //output_screen("FOUND distance = " << dists[0] << std::endl);
+        const unsigned long index = indices[0];
         for(int i = 0; i < nData_; ++i)
-            val[i] = data_[index][i];
+            val[i] = dataRows_[index][i];
 
         return;
     }
 
-    //Timer t1("MATRIX OPERATIONS");
-    //t1.start();
-
-    std::vector<double> weights(k_);
+    std::vector<double>& weights = w.weights;
     for(int i = 0; i < k_; ++i)
-        weights[i] = 1.0 / std::sqrt(dists_[i]);
-    
+        weights[i] = 1.0 / std::sqrt(dists[i]);
+
+    // fall back to the linear interpolation if the quadratic fit is degenerate, and to the nearest neighbor if that is degenerate too
+    const int nLinear = nPoints_ + 1;
+    const int nQuadratic = nPoints_ + nPoints_ * (nPoints_ + 1) / 2 + 1;
+    if(!(method == QUADRATIC_INTERPOLATION && solveFit(pointTransformed, indices, nQuadratic, w)) && !solveFit(pointTransformed, indices, nLinear, w))
+    {
+        for(int i = 0; i < nData_; ++i)
+            val[i] = dataRows_[indices[0]][i];
+        return;
+    }
+
+    const int m = w.fitSize;
+
+    // the approximation is the constant term of the fit, q^T * b_j gives the weight of neighbor j in it
+    for(int i = 0; i < nData_; ++i)
+        val[i] = 0;
+
+    for(int j = 0; j < k_; ++j)
+    {
+        const double* b = &(w.basis[j * m]);
+        double c = 0;
+        for(int l = 0; l < m; ++l)
+            c += w.q[l] * b[l];
+        c *= weights[j];
+
+        const double* y = dataRows_[indices[j]];
+        for(int i = 0; i < nData_; ++i)
+            val[i] += c * y[i];
+    }
+}
+
+bool
+FastApproximator::solveFit(const double* pointTransformed, const unsigned long* indices, int m, Workspace& w, double scale) const
+{
+    check(m <= w.q.size(), "");
+    w.fitSize = m;
+
+    // the basis functions at the neighbors: 1, x_j, and x_j * x_l for l <= j if quadratic
     for(int i = 0; i < k_; ++i)
     {
-        const unsigned long index = indices_[i];
+        const double* p = knn_->point(indices[i]);
+        double* b = &(w.basis[i * m]);
+        b[0] = 1;
         for(int j = 0; j < nPoints_; ++j)
         {
-            const double x = pointsTransformed_[index][j] - pointTransformed_[j];
-            switch(method)
+            const double x = (p[j] - pointTransformed[j]) / scale;
+            b[j + 1] = x;
+            if(m > nPoints_ + 1)
             {
-            case LINEAR_INTERPOLATION:
-                xLin_(i, j + 1) = x * weights[i];
-                xTLin_(j + 1, i) = x;
-                break;
-            case QUADRATIC_INTERPOLATION:
-                x_(i, j + 1) = x * weights[i];
-                xT_(j + 1, i) = x;
                 for(int l = 0; l <= j; ++l)
-                {
-                    const double y = pointsTransformed_[index][l] - pointTransformed_[l];
-                    x_(i, nPoints_ + 1 + j * (j + 1) / 2 + l) = x * y * weights[i];
-                    xT_(nPoints_ + 1 + j * (j + 1) / 2 + l, i) = x * y;
-                }
-                break;
-            default:
-                check(false, "");
-                break;
+                    b[nPoints_ + 1 + j * (j + 1) / 2 + l] = x * (p[l] - pointTransformed[l]) / scale;
             }
-
         }
+    }
 
-        switch(method)
+    // the normal equations b^T * W * b with a small regularization, only the lower triangle is needed
+    double* a = &(w.a[0]);
+    for(int r = 0; r < m; ++r)
+    {
+        for(int c = 0; c <= r; ++c)
         {
-        case LINEAR_INTERPOLATION:
-            xLin_(i, 0) = weights[i];
-            break;
-        case QUADRATIC_INTERPOLATION:
-            x_(i, 0) = weights[i];
-            break;
-        default:
-            check(false, "");
-            break;
+            double sum = 0;
+            for(int i = 0; i < k_; ++i)
+                sum += w.weights[i] * w.basis[i * m + r] * w.basis[i * m + c];
+            a[r * m + c] = sum;
         }
+        a[r * m + r] += 1e-5;
     }
 
-    switch(method)
+    // Cholesky factorization in place
+    for(int j = 0; j < m; ++j)
     {
-    case LINEAR_INTERPOLATION:
-        Math::Matrix<double>::multiplyMatrices(xTLin_, xLin_, &invLin_);
+        double d = a[j * m + j];
+        for(int l = 0; l < j; ++l)
+            d -= a[j * m + l] * a[j * m + l];
+        if(!(d > 0))
+            return false;
+        d = std::sqrt(d);
+        a[j * m + j] = d;
+
+        for(int i = j + 1; i < m; ++i)
+        {
+            double x = a[i * m + j];
+            for(int l = 0; l < j; ++l)
+                x -= a[i * m + l] * a[j * m + l];
+            a[i * m + j] = x / d;
+        }
+    }
 
-        for(int i = 0; i < invLin_.rows(); ++i)
-            invLin_(i, i) += 1e-5;
+    // solve a * q = e_0, only the first row of the inverse is needed
+    double* q = &(w.q[0]);
+    for(int i = 0; i < m; ++i)
+        q[i] = (i == 0 ? 1.0 : 0.0);
+    choleskySolve(a, m, q);
 
-        invLin_.invert();
-        Math::Matrix<double>::multiplyMatrices(invLin_, xTLin_, &prodLin_);
-        break;
+    return true;
+}
 
-    case QUADRATIC_INTERPOLATION:
-        Math::Matrix<double>::multiplyMatrices(xT_, x_, &inv_);
-        for(int i = 0; i < inv_.rows(); ++i)
-            inv_(i, i) += 1e-5;
+bool
+FastApproximator::getApproximationWithGradient(std::vector<double>& val, std::vector<std::vector<double> >& gradient, InterpolationMethod method, std::vector<std::vector<double> >* hessian)
+{
+    check(method >= 0 && method < INTERPOLATION_METHOD_MAX, "");
 
-        inv_.invert();
-        Math::Matrix<double>::multiplyMatrices(inv_, xT_, &prod_);
-        break;
+    getApproximation(val, method);
 
-    default:
-        check(false, "");
-        break;
-    }
+    // the weights are capped at a training point, so that the fit still goes through it but also gives the derivatives there
+    Workspace& w = workspace_;
+    for(int i = 0; i < k_; ++i)
+        w.weights[i] = 1.0 / std::max(std::sqrt(dists_[i]), 1e-7);
 
+    // the fit is done in units of the distance to the farthest neighbor, otherwise the regularization of the normal equations would bias the small quadratic terms of dense training sets
+    const double scale = std::max(std::sqrt(dists_[k_ - 1]), 1e-7);
 
-    //t1.end();
+    const int nLinear = nPoints_ + 1;
+    const int nQuadratic = nPoints_ + nPoints_ * (nPoints_ + 1) / 2 + 1;
+    if(!(method == QUADRATIC_INTERPOLATION && solveFit(&(pointTransformed_[0]), &(indices_[0]), nQuadratic, w, scale)) && !solveFit(&(pointTransformed_[0]), &(indices_[0]), nLinear, w, scale))
+        return false;
 
-    //Timer t2("PARAMETER ESTIMATION");
-    //t2.start();
+    const int m = w.fitSize;
+    const int n = nPoints_;
+
+    // the coefficients of the fit in the transformed space are (b^T * W * b)^{-1} * b^T * W * y, then the derivatives are transformed back with the chain rule
+    std::vector<double> c(m), hessianTransformed(n * n);
+    gradient.resize(nData_);
+    if(hessian)
+        hessian->resize(nData_);
 
     for(int i = 0; i < nData_; ++i)
     {
-        double res = 0;
-        for(int j = 0; j < k_; ++j)
+        for(int l = 0; l < m; ++l)
         {
-            const unsigned long index = indices_[j];
-            const double y = data_[index][i] * weights[j];
+            double x = 0;
+            for(int j = 0; j < k_; ++j)
+                x += w.weights[j] * w.basis[j * m + l] * dataRows_[indices_[j]][i];
+            c[l] = x;
+        }
+        choleskySolve(&(w.a[0]), m, &(c[0]));
+
+        gradient[i].assign(n, 0.0);
+        for(int k = 0; k < n; ++k)
+        {
+            double x = 0;
+            for(int j = 0; j < n; ++j)
+                x += transform_[j * n + k] * c[j + 1] / scale;
+            gradient[i][k] = x;
+        }
+
+        if(!hessian)
+            continue;
 
-            switch(method)
+        for(int j = 0; j < n; ++j)
+        {
+            for(int l = 0; l <= j; ++l)
             {
-            case LINEAR_INTERPOLATION:
-                res += prodLin_(0, j) * y;
-                break;
-            case QUADRATIC_INTERPOLATION:
-                res += prod_(0, j) * y;
-                break;
-            default:
-                check(false, "");
-                break;
+                const double h = (m > nLinear ? c[n + 1 + j * (j + 1) / 2 + l] / (scale * scale) : 0.0);
+                hessianTransformed[j * n + l] = (j == l ? 2 * h : h);
+                hessianTransformed[l * n + j] = hessianTransformed[j * n + l];
             }
         }
 
-        val[i] = res;
+        std::vector<double>& hess = (*hessian)[i];
+        hess.assign(n * n, 0.0);
+        for(int a = 0; a < n; ++a)
+        {
+            for(int b = 0; b < n; ++b)
+            {
+                double x = 0;
+                for(int j = 0; j < n; ++j)
+                {
+                    for(int l = 0; l < n; ++l)
+                        x += transform_[j * n + a] * hessianTransformed[j * n + l] * transform_[l * n + b];
+                }
+                hess[a * n + b] = x;
+            }
+        }
     }
 
-    //t2.end();
+    return true;
+}
+
+bool
+FastApproximator::approximateWithGradient(const std::vector<double>& point, std::vector<double>& val, std::vector<std::vector<double> >& gradient, InterpolationMethod method, std::vector<std::vector<double> >* hessian)
+{
+    findNearestNeighbors(point);
+    return getApproximationWithGradient(val, gradient, method, hessian);
 }
 
 void
 FastApproximator::approximate(const std::vector<double>& point, std::vector<double>& val, InterpolationMethod method, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices)
 {
+    COSMO_PROFILE_REGION("fast_approximator_approximate");
     findNearestNeighbors(point, distances, nearestNeighbors, indices);
     getApproximation(val, method);
 }
 
+void
+FastApproximator::approximate(const std::vector<std::vector<double> >& points, std::vector<std::vector<double> >& vals, InterpolationMethod method, std::vector<std::vector<double> >* distances, std::vector<std::vector<std::vector<double> > >* nearestNeighbors, std::vector<std::vector<double> >* linearVals) const
+{
+    COSMO_PROFILE_REGION("fast_approximator_approximate_batch");
+
+    check(method >= 0 && method < INTERPOLATION_METHOD_MAX, "");
+    check(knn_, "");
+
+    const long n = points.size();
+    vals.resize(n);
+    if(distances)
+        distances->resize(n);
+    if(nearestNeighbors)
+        nearestNeighbors->resize(n);
+    if(linearVals)
+        linearVals->resize(n);
+    if(!n)
+        return;
+
+    std::vector<double> pointsTransformed(n * nPoints_);
+
+#pragma omp parallel for default(shared)
+    for(long i = 0; i < n; ++i)
+    {
+        check(points[i].size() == nPoints_, "");
+        transform(&(points[i][0]), &(pointsTransformed[i * nPoints_]));
+    }
+
+    std::vector<unsigned long> indices(n * k_);
+    std::vector<double> dists(n * k_);
+    knn_->findNearestNeighbors(&(pointsTransformed[0]), n, k_, &(indices[0]), &(dists[0]));
+
+    for(long i = 0; i < n; ++i)
+    {
+        vals[i].resize(nData_);
+        if(linearVals)
+            (*linearVals)[i].resize(nData_);
+    }
+
+#pragma omp parallel default(shared)
+    {
+        // each thread has its own matrices for the local fits
+        Workspace w(nPoints_, k_);
+
+#pragma omp for schedule(dynamic, 16)
+        for(long i = 0; i < n; ++i)
+        {
+            const double* p = &(pointsTransformed[i * nPoints_]);
+            fit(p, &(indices[i * k_]), &(dists[i * k_]), method, w, &(vals[i][0]));
+            if(linearVals)
+                fit(p, &(indices[i * k_]), &(dists[i * k_]), LINEAR_INTERPOLATION, w, &((*linearVals)[i][0]));
+
+            if(distances)
+            {
+                (*distances)[i].resize(k_);
+                for(int j = 0; j < k_; ++j)
+                    (*distances)[i][j] = std::sqrt(dists[i * k_ + j]);
+            }
+
+            if(nearestNeighbors)
+            {
+                std::vector<std::vector<double> >& neighbors = (*nearestNeighbors)[i];
+                neighbors.resize(k_);
+                for(int j = 0; j < k_; ++j)
+                {
+                    const double* q = knn_->point(indices[i * k_ + j]);
+                    neighbors[j].resize(nPoints_);
+                    for(int l = 0; l < nPoints_; ++l)
+                        neighbors[j][l] = q[l] - p[l];
+                }
+            }
+        }
+    }
+}
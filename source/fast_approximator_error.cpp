@@ -1,11 +1,32 @@
 #include <sstream>
 #include <string>
 #include <iomanip>
+#include <algorithm>
 
 #include <exception_handler.hpp>
+#include <profiler.hpp>
 #include <fast_approximator_error.hpp>
 
-FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testData, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0)
+FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testData, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0), sigma1_(0), sigma2_(0), ratioSum_(0), ratioSum2_(0)
+{
+    init();
+    reset(testPoints, testData, begin, end);
+}
+
+FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testData, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0), sigma1_(0), sigma2_(0), ratioSum_(0), ratioSum2_(0)
+{
+    init();
+    reset(testPoints, testData, begin, end);
+}
+
+FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::vector<double>& ratios, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0), sigma1_(0), sigma2_(0), ratioSum_(0), ratioSum2_(0), ratios_(ratios)
+{
+    init();
+    generateDistrib();
+}
+
+void
+FastApproximatorError::init()
 {
     check(precision_ > 0, "invalid precision " << precision_);
     check(decMethod_ >= 0 && decMethod_ < DECISION_METHOD_MAX, "");
@@ -28,8 +49,6 @@ FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::ve
         check(false, "");
         break;
     }
-
-    reset(testPoints, testData, begin, end);
 }
 
 FastApproximatorError::~FastApproximatorError()
@@ -46,13 +65,29 @@ FastApproximatorError::~FastApproximatorError()
 
 void
 FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testData, unsigned long begin, unsigned long end)
+{
+    check(testData.size() >= end, "");
+
+    std::vector<const double*> rows(end, (const double*)(NULL));
+    for(unsigned long i = begin; i < end; ++i)
+    {
+        check(testData[i].size() == fa_.nOut(), "");
+        rows[i] = &(testData[i][0]);
+    }
+
+    reset(testPoints, rows, begin, end);
+}
+
+void
+FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testData, unsigned long begin, unsigned long end)
 {
     check(testPoints.size() >= end, "");
     check(testData.size() >= end, "");
 
     if(end == begin)
     {
-        posteriorGood_ = false;
+        ratios_.clear();
+        generateDistrib();
         return;
     }
 
@@ -61,26 +96,72 @@ FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints
     Timer t("ERROR EVALUATION");
     t.start();
 
-    if(posterior_)
-        delete posterior_;
+    evaluateRatios(testPoints, testData, begin, end, ratios_);
+    generateDistrib();
 
-    posterior_ = new Posterior1D;
-    mean_ = 0;
-    var_ = 0;
-    double mean2 = 0;
-    unsigned long goodCount = 0;
+    if(posteriorGood_)
+        posterior_->writeIntoFile("fast_approximator_error_ratio.txt");
+
+    t.end();
+}
+
+void
+FastApproximatorError::addTestPoints(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testData, unsigned long begin, unsigned long end)
+{
+    check(testData.size() >= end, "");
 
-    ProgressMeter meter(end - begin);
+    std::vector<const double*> rows(end, (const double*)(NULL));
     for(unsigned long i = begin; i < end; ++i)
     {
-        fa_.findNearestNeighbors(testPoints[i], distances_, nearestNeighbors_);
-        fa_.getApproximation(val_, FastApproximator::QUADRATIC_INTERPOLATION);
+        check(testData[i].size() == fa_.nOut(), "");
+        rows[i] = &(testData[i][0]);
+    }
+
+    addTestPoints(testPoints, rows, begin, end);
+}
+
+void
+FastApproximatorError::addTestPoints(const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testData, unsigned long begin, unsigned long end)
+{
+    check(testPoints.size() >= end, "");
+    check(testData.size() >= end, "");
+    check(end >= begin, "");
 
-        if(method_ == LIN_QUAD_DIFF)
-            fa_.getApproximation(linVal_, FastApproximator::LINEAR_INTERPOLATION);
+    if(end == begin)
+        return;
 
-        const double estimatedError = evaluateError();
-        const double correctError = f_.evaluate(testData[i]) - f_.evaluate(val_);
+    std::vector<double> newRatios;
+    evaluateRatios(testPoints, testData, begin, end, newRatios);
+    if(newRatios.empty())
+        return;
+
+    ratios_.insert(ratios_.end(), newRatios.begin(), newRatios.end());
+    addRatios(&(newRatios[0]), newRatios.size());
+}
+
+void
+FastApproximatorError::evaluateRatios(const std::vector<std::vector<double> >& testPoints, const std::vector<const double*>& testData, unsigned long begin, unsigned long end, std::vector<double>& ratios) const
+{
+    COSMO_PROFILE_REGION("fast_approximator_error_evaluate");
+
+    const unsigned long n = end - begin;
+    const std::vector<std::vector<double> > points(testPoints.begin() + begin, testPoints.begin() + end);
+
+    // the nearest neighbor searches and the fits for all of the test points at once, in parallel
+    std::vector<std::vector<double> > vals, linVals, distances;
+    std::vector<std::vector<std::vector<double> > > nearestNeighbors;
+    fa_.approximate(points, vals, FastApproximator::QUADRATIC_INTERPOLATION, (distances_ ? &distances : NULL), (nearestNeighbors_ ? &nearestNeighbors : NULL), (method_ == LIN_QUAD_DIFF ? &linVals : NULL));
+
+    // f is not required to be thread safe, so it is evaluated serially, which is cheap compared to the fits
+    ratios.clear();
+    ratios.reserve(n);
+    std::vector<double> testVal(fa_.nOut());
+    const std::vector<double> noLinVal;
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        const double estimatedError = evaluateError(distances_ ? &(distances[i]) : NULL, nearestNeighbors_ ? &(nearestNeighbors[i]) : NULL, vals[i], method_ == LIN_QUAD_DIFF ? linVals[i] : noLinVal);
+        testVal.assign(testData[begin + i], testData[begin + i] + fa_.nOut());
+        const double correctError = f_.evaluate(testVal) - f_.evaluate(vals[i]);
 
         if(estimatedError == 0)
         {
@@ -88,43 +169,70 @@ FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints
         }
         else
         {
-            const double ratio = correctError / estimatedError;
-            posterior_->addPoint(std::abs(ratio), 1, 1);
-            mean_ += ratio;
-            mean2 += ratio * ratio;
-            ++goodCount;
+            ratios.push_back(correctError / estimatedError);
         }
-        meter.advance();
     }
+}
 
-    if(goodCount >= 100)
-    {
-        posterior_->generate();
-        posteriorGood_ = true;
-        output_screen1("Posterior 1 sigma is: " << posterior_->get1SigmaUpper() << std::endl);
-        output_screen1("Posterior 2 sigma is: " << posterior_->get2SigmaUpper() << std::endl);
-        posterior_->writeIntoFile("fast_approximator_error_ratio.txt");
+void
+FastApproximatorError::generateDistrib()
+{
+    if(posterior_)
+        delete posterior_;
+
+    posterior_ = new Posterior1D;
+    ratioSum_ = 0;
+    ratioSum2_ = 0;
+    posteriorGood_ = false;
+    mean_ = 0;
+    var_ = 0;
 
-        mean_ /= goodCount;
-        mean2 /= goodCount;
+    if(!ratios_.empty())
+        addRatios(&(ratios_[0]), ratios_.size());
+}
 
-        var_ = mean2 - mean_ * mean_;
-        check(var_ >= 0, "");
+void
+FastApproximatorError::addRatios(const double* ratios, unsigned long n)
+{
+    if(!posterior_)
+        posterior_ = new Posterior1D;
 
-        output_screen("Error ratio distrib = " << mean_ << " +/- " << std::sqrt(var_) << std::endl);
+    std::vector<double> absRatios(n);
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        absRatios[i] = std::abs(ratios[i]);
+        ratioSum_ += ratios[i];
+        ratioSum2_ += ratios[i] * ratios[i];
     }
-    else
+
+    const std::vector<double> ones(n, 1.0);
+    posterior_->addPoints(&(absRatios[0]), &(ones[0]), &(ones[0]), n);
+
+    const unsigned long goodCount = ratios_.size();
+    if(goodCount < 100)
     {
         posteriorGood_ = false;
         mean_ = 0;
         var_ = 0;
+        return;
     }
 
-    t.end();
+    posterior_->generate();
+    posteriorGood_ = true;
+    sigma1_ = posterior_->get1SigmaUpper();
+    sigma2_ = posterior_->get2SigmaUpper();
+    output_screen1("Posterior 1 sigma is: " << sigma1_ << std::endl);
+    output_screen1("Posterior 2 sigma is: " << sigma2_ << std::endl);
+
+    mean_ = ratioSum_ / goodCount;
+    // the running sums can make it slightly negative from roundoff
+    var_ = std::max(ratioSum2_ / goodCount - mean_ * mean_, 0.0);
+
+    output_screen("Error ratio distrib = " << mean_ << " +/- " << std::sqrt(var_) << std::endl);
 }
 
 double
-FastApproximatorError::evaluateError()
+FastApproximatorError::evaluateError(const std::vector<double>* distances, const std::vector<std::vector<double> >* nearestNeighbors, const std::vector<double>& val, const std::vector<double>& linVal) const
 {
     check(method_ >= 0 && method_ < ERROR_METHOD_MAX, "invalid method");
 
@@ -132,67 +240,66 @@ FastApproximatorError::evaluateError()
 
     double sumDist = 0;
 
+    std::vector<double> distanceSum;
+
     double y, linY;
 
     switch(method_)
     {
     case MIN_DISTANCE:
-        check(distances_, "");
-        check(!distances_->empty(), "");
-        return (*distances_)[0];
+        check(distances, "");
+        check(!distances->empty(), "");
+        return (*distances)[0];
 
     case AVG_DISTANCE:
-        check(distances_, "");
-        check(!distances_->empty(), "");
+        check(distances, "");
+        check(!distances->empty(), "");
 
-        for(int i = 0; i < distances_->size(); ++i)
-            avgDist += (*distances_)[i];
+        for(int i = 0; i < distances->size(); ++i)
+            avgDist += (*distances)[i];
 
-        avgDist /= distances_->size();
+        avgDist /= distances->size();
         return avgDist;
 
     case AVG_INV_DISTANCE:
-        check(distances_, "");
-        check(!distances_->empty(), "");
+        check(distances, "");
+        check(!distances->empty(), "");
 
-        for(int i = 0; i < distances_->size(); ++i)
+        for(int i = 0; i < distances->size(); ++i)
         {
-            if((*distances_)[i] == 0)
+            if((*distances)[i] == 0)
                 return 0;
 
-            avgDist += 1.0 / (*distances_)[i];
+            avgDist += 1.0 / (*distances)[i];
         }
 
-        avgDist = distances_->size() / avgDist;
+        avgDist = distances->size() / avgDist;
 
         return avgDist;
 
     case SUM_DISTANCE:
-        check(nearestNeighbors_, "");
-        check(!nearestNeighbors_->empty(), "");
-
-        distanceSum_.resize((*nearestNeighbors_)[0].size(), 0);
+        check(nearestNeighbors, "");
+        check(!nearestNeighbors->empty(), "");
 
-        for(int i = 0; i < distanceSum_.size(); ++i)
-            distanceSum_[i] = 0;
+        distanceSum.resize((*nearestNeighbors)[0].size(), 0);
 
-        for(int i = 0; i < nearestNeighbors_->size(); ++i)
+        for(int i = 0; i < nearestNeighbors->size(); ++i)
         {
-            check((*nearestNeighbors_)[i].size() == distanceSum_.size(), "");
-            for(int j = 0; j < distanceSum_.size(); ++j)
-                distanceSum_[j] += (*nearestNeighbors_)[i][j];
+            check((*nearestNeighbors)[i].size() == distanceSum.size(), "");
+            for(int j = 0; j < distanceSum.size(); ++j)
+                distanceSum[j] += (*nearestNeighbors)[i][j];
         }
 
-        for(int i = 0; i < distanceSum_.size(); ++i)
-            sumDist += distanceSum_[i] * distanceSum_[i];
+        for(int i = 0; i < distanceSum.size(); ++i)
+            sumDist += distanceSum[i] * distanceSum[i];
 
         sumDist = std::sqrt(sumDist);
 
         return sumDist;
 
     case LIN_QUAD_DIFF:
-        y = f_.evaluate(val_);
-        linY = f_.evaluate(linVal_);
+        y = f_.evaluate(val);
+        linY = f_.evaluate(linVal);
         //output_screen("Value = " << y << ", linear value = " << linY << std::endl);
         return std::abs(y - linY);
         
@@ -202,8 +309,8 @@ FastApproximatorError::evaluateError()
     }
 }
 
-bool
-FastApproximatorError::approximate(const std::vector<double>& point, std::vector<double>& val, double *error1Sigma, double *error2Sigma, double *errorMean, double *errorVar)
+double
+FastApproximatorError::estimateError(const std::vector<double>& point)
 {
     fa_.findNearestNeighbors(point, distances_, nearestNeighbors_);
     if(method_ == LIN_QUAD_DIFF)
@@ -211,13 +318,19 @@ FastApproximatorError::approximate(const std::vector<double>& point, std::vector
         fa_.getApproximation(val_);
         fa_.getApproximation(linVal_, FastApproximator::LINEAR_INTERPOLATION);
     }
-    const double e = evaluateError();
+    return evaluateError(distances_, nearestNeighbors_, val_, linVal_);
+}
+
+bool
+FastApproximatorError::approximate(const std::vector<double>& point, std::vector<double>& val, double *error1Sigma, double *error2Sigma, double *errorMean, double *errorVar)
+{
+    const double e = estimateError(point);
 
     double estimatedError1 = 1e10, estimatedError2 = 1e10, estMean = 0, estVar = 1e20;
     if(posteriorGood_)
     {
-        estimatedError1 = e * posterior_->get1SigmaUpper();
-        estimatedError2 = e * posterior_->get2SigmaUpper();
+        estimatedError1 = e * sigma1_;
+        estimatedError2 = e * sigma2_;
         estMean = e * mean_;
         estVar = e * e * var_;
     }
@@ -0,0 +1,138 @@
+#include <cmath>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <fft.hpp>
+
+namespace Math
+{
+
+void
+fft(std::vector<std::complex<double> >& data, bool inverse)
+{
+    const unsigned long n = data.size();
+    check(n > 0 && (n & (n - 1)) == 0, "the size must be a power of 2, " << n << " is not");
+
+    // bit reversal permutation
+    for(unsigned long i = 1, j = 0; i < n; ++i)
+    {
+        unsigned long bit = n >> 1;
+        for(; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+
+        if(i < j)
+            std::swap(data[i], data[j]);
+    }
+
+    for(unsigned long len = 2; len <= n; len <<= 1)
+    {
+        const double angle = 2 * M_PI / len * (inverse ? 1 : -1);
+        const std::complex<double> wLen(std::cos(angle), std::sin(angle));
+        for(unsigned long i = 0; i < n; i += len)
+        {
+            std::complex<double> w(1, 0);
+            for(unsigned long j = 0; j < len / 2; ++j)
+            {
+                const std::complex<double> u = data[i + j];
+                const std::complex<double> v = data[i + j + len / 2] * w;
+                data[i + j] = u + v;
+                data[i + j + len / 2] = u - v;
+                w *= wLen;
+            }
+        }
+    }
+
+    if(inverse)
+    {
+        for(unsigned long i = 0; i < n; ++i)
+            data[i] /= double(n);
+    }
+}
+
+void
+convolve(const std::vector<double>& data, const std::vector<double>& kernel, std::vector<double>& result)
+{
+    check(!data.empty(), "");
+    check(kernel.size() % 2 == 1, "the kernel must have an odd size");
+
+    const unsigned long m = kernel.size() / 2;
+
+    // padding so that the circular convolution does not wrap around
+    unsigned long n = 1;
+    while(n < data.size() + kernel.size())
+        n <<= 1;
+
+    std::vector<std::complex<double> > a(n, 0.0), b(n, 0.0);
+    for(unsigned long i = 0; i < data.size(); ++i)
+        a[i] = data[i];
+
+    // the kernel is stored with its center at 0, negative offsets wrap around to the end
+    for(unsigned long k = 0; k < kernel.size(); ++k)
+        b[(k + n - m) % n] = kernel[k];
+
+    fft(a);
+    fft(b);
+    for(unsigned long i = 0; i < n; ++i)
+        a[i] *= b[i];
+    fft(a, true);
+
+    result.resize(data.size());
+    for(unsigned long i = 0; i < data.size(); ++i)
+        result[i] = a[i].real();
+}
+
+void
+autocorrelation(const double* x, unsigned long n, std::vector<double>& rho, long stride)
+{
+    check(n > 0, "");
+    check(stride > 0, "invalid stride " << stride);
+
+    double mean = 0;
+    for(unsigned long i = 0; i < n; ++i)
+        mean += x[i * stride];
+    mean /= n;
+
+    // padding to at least 2n so that the circular correlation does not wrap around
+    unsigned long m = 1;
+    while(m < 2 * n)
+        m <<= 1;
+
+    std::vector<std::complex<double> > a(m, 0.0);
+    for(unsigned long i = 0; i < n; ++i)
+        a[i] = x[i * stride] - mean;
+
+    fft(a);
+    for(unsigned long i = 0; i < m; ++i)
+        a[i] = std::norm(a[i]);
+    fft(a, true);
+
+    rho.resize(n);
+    const double c0 = a[0].real();
+    for(unsigned long i = 0; i < n; ++i)
+        rho[i] = (c0 > 0 ? a[i].real() / c0 : 0.0);
+}
+
+double
+integratedAutocorrelationTime(const double* x, unsigned long n, long stride, double c)
+{
+    check(c > 0, "invalid window constant " << c);
+
+    std::vector<double> rho;
+    autocorrelation(x, n, rho, stride);
+
+    if(rho[0] == 0)
+        return 1;
+
+    double tau = 1;
+    for(unsigned long t = 1; t < n; ++t)
+    {
+        tau += 2 * rho[t];
+        if(t >= c * tau)
+            break;
+    }
+
+    return std::max(tau, 1.0);
+}
+
+} // namespace Math
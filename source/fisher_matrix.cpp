@@ -0,0 +1,422 @@
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cosmo_mpi.hpp>
+#include <fisher_matrix.hpp>
+
+namespace Math
+{
+
+FisherMatrix::FisherMatrix(LikelihoodFunction& like, const std::vector<double>& steps, Stencil stencil, bool distribute) : like_(&like), model_(NULL), n_(int(steps.size())), stencil_(stencil), distribute_(distribute && CosmoMPI::create().numProcesses() > 1), fSky_(1), lMin_(0), lMax_(-1), fiducialValue_(0)
+{
+    initialize(steps);
+
+    // the mixed derivatives need the products of the stencils for each pair of parameters
+    const int k = int(offsets_.size());
+    nPoints_ = 1 + n_ * k + k * k * n_ * (n_ - 1) / 2;
+}
+
+FisherMatrix::FisherMatrix(ClModel& model, const std::vector<double>& steps, Stencil stencil, bool distribute) : like_(NULL), model_(&model), n_(int(steps.size())), stencil_(stencil), distribute_(distribute && CosmoMPI::create().numProcesses() > 1), fSky_(1), lMin_(2), lMax_(model.lMax()), fiducialValue_(0)
+{
+    initialize(steps);
+    check(lMax_ >= lMin_, "the lMax of the model is " << lMax_);
+    nPoints_ = 1 + n_ * int(offsets_.size());
+}
+
+void
+FisherMatrix::initialize(const std::vector<double>& steps)
+{
+    check(n_ > 0, "no parameters");
+    check(stencil_ >= 0 && stencil_ < STENCIL_MAX, "invalid stencil " << stencil_);
+    steps_ = steps;
+    for(int i = 0; i < n_; ++i)
+    {
+        check(steps_[i] > 0, "invalid step " << steps_[i] << " for parameter " << i);
+    }
+
+    if(stencil_ == THREE_POINT)
+    {
+        const int offsets[2] = {1, -1};
+        const double weights[2] = {0.5, -0.5};
+        const double weights2[2] = {1.0, 1.0};
+        offsets_.assign(offsets, offsets + 2);
+        weights_.assign(weights, weights + 2);
+        weights2_.assign(weights2, weights2 + 2);
+        centerWeight_ = -2.0;
+    }
+    else
+    {
+        const int offsets[4] = {1, -1, 2, -2};
+        const double weights[4] = {8.0 / 12, -8.0 / 12, -1.0 / 12, 1.0 / 12};
+        const double weights2[4] = {16.0 / 12, 16.0 / 12, -1.0 / 12, -1.0 / 12};
+        offsets_.assign(offsets, offsets + 4);
+        weights_.assign(weights, weights + 4);
+        weights2_.assign(weights2, weights2 + 4);
+        centerWeight_ = -30.0 / 12;
+    }
+
+    fisher_.resize(n_, n_, 0);
+}
+
+void
+FisherMatrix::setExperiment(double fSky, int lMin, int lMax, const std::vector<double>* noiseTT, const std::vector<double>* noisePol)
+{
+    check(model_, "the experiment is only used for the Fisher matrix from the spectra");
+    check(fSky > 0 && fSky <= 1, "invalid fSky = " << fSky);
+    check(lMin >= 0, "invalid lMin = " << lMin);
+    if(lMax < 0)
+        lMax = model_->lMax();
+    check(lMax >= lMin && lMax <= model_->lMax(), "invalid lMax = " << lMax << ", must be between " << lMin << " and the lMax of the model " << model_->lMax());
+
+    fSky_ = fSky;
+    lMin_ = lMin;
+    lMax_ = lMax;
+
+    noiseTT_.clear();
+    noisePol_.clear();
+    if(noiseTT)
+    {
+        check(noiseTT->size() > lMax_, "the TT noise is given up to l = " << noiseTT->size() - 1 << ", need up to " << lMax_);
+        noiseTT_ = *noiseTT;
+    }
+    if(noisePol)
+    {
+        check(noisePol->size() > lMax_, "the polarization noise is given up to l = " << noisePol->size() - 1 << ", need up to " << lMax_);
+        noisePol_ = *noisePol;
+    }
+}
+
+int
+FisherMatrix::resultSize() const
+{
+    if(like_)
+        return 1;
+    return (model_->hasPolarization() ? 3 : 1) * (model_->lMax() + 1);
+}
+
+void
+FisherMatrix::setPoints(const std::vector<double>& fiducial)
+{
+    check(fiducial.size() == n_, "the number of fiducial parameters " << fiducial.size() << " is not equal to the number of parameters " << n_);
+
+    // the center first, then the points along each parameter, then (for a likelihood) the points for each pair of parameters
+    const int k = int(offsets_.size());
+    points_.resize(nPoints_ * n_);
+    for(int p = 0; p < nPoints_; ++p)
+        std::copy(fiducial.begin(), fiducial.end(), &(points_[p * n_]));
+
+    int p = 1;
+    for(int i = 0; i < n_; ++i)
+    {
+        for(int a = 0; a < k; ++a)
+            points_[(p++) * n_ + i] += offsets_[a] * steps_[i];
+    }
+
+    if(!like_)
+    {
+        check(p == nPoints_, "");
+        return;
+    }
+
+    for(int i = 0; i < n_; ++i)
+    {
+        for(int j = i + 1; j < n_; ++j)
+        {
+            for(int a = 0; a < k; ++a)
+            {
+                for(int b = 0; b < k; ++b)
+                {
+                    points_[p * n_ + i] += offsets_[a] * steps_[i];
+                    points_[p * n_ + j] += offsets_[b] * steps_[j];
+                    ++p;
+                }
+            }
+        }
+    }
+    check(p == nPoints_, "");
+}
+
+void
+FisherMatrix::evaluate(double* points, int nPoints, double* res)
+{
+    if(like_)
+    {
+        like_->calculateBatch(points, n_, nPoints, res);
+        return;
+    }
+
+    const bool pol = model_->hasPolarization();
+    model_->calculateBatch(points, n_, nPoints, &clTT_, (pol ? &clEE_ : NULL), (pol ? &clTE_ : NULL));
+    check(clTT_.size() == nPoints, "");
+
+    const int nL = model_->lMax() + 1;
+    for(int p = 0; p < nPoints; ++p)
+    {
+        double* r = res + p * resultSize();
+        check(clTT_[p].size() >= nL, "the model gave " << clTT_[p].size() << " TT values, need " << nL);
+        std::copy(clTT_[p].begin(), clTT_[p].begin() + nL, r);
+        if(pol)
+        {
+            check(clEE_[p].size() >= nL && clTE_[p].size() >= nL, "the model gave too few polarization values");
+            std::copy(clEE_[p].begin(), clEE_[p].begin() + nL, r + nL);
+            std::copy(clTE_[p].begin(), clTE_[p].begin() + nL, r + 2 * nL);
+        }
+    }
+}
+
+void
+FisherMatrix::calculateBatch()
+{
+    const int m = resultSize();
+    results_.resize(nPoints_ * m);
+
+    if(!distribute_)
+    {
+        evaluate(&(points_[0]), nPoints_, &(results_[0]));
+        return;
+    }
+
+    // the points are dealt out to the processes in turn, the results of the others are 0 for the sum
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProc = mpi.numProcesses(), processId = mpi.processId();
+    myPoints_.clear();
+    for(int j = processId; j < nPoints_; j += nProc)
+        myPoints_.insert(myPoints_.end(), &(points_[j * n_]), &(points_[(j + 1) * n_]));
+
+    const int myN = int(myPoints_.size()) / n_;
+    myResults_.resize(myN * m);
+    if(myN > 0)
+        evaluate(&(myPoints_[0]), myN, &(myResults_[0]));
+
+    std::fill(results_.begin(), results_.end(), 0.0);
+    for(int k = 0; k < myN; ++k)
+        std::copy(&(myResults_[k * m]), &(myResults_[(k + 1) * m]), &(results_[(processId + k * nProc) * m]));
+
+    mpi.allreduce(&(results_[0]), &(results_[0]), nPoints_ * m, CosmoMPI::SUM);
+}
+
+void
+FisherMatrix::calculate(const std::vector<double>& fiducial)
+{
+    setPoints(fiducial);
+    calculateBatch();
+
+    if(like_)
+        calculateLikelihood();
+    else
+        calculateCl();
+}
+
+void
+FisherMatrix::calculateLikelihood()
+{
+    const int k = int(offsets_.size());
+    const double center = results_[0];
+    fiducialValue_ = center;
+
+    // F = H / 2, where H is the Hessian of -2ln(likelihood)
+    int p = 1;
+    for(int i = 0; i < n_; ++i)
+    {
+        double d2 = centerWeight_ * center;
+        for(int a = 0; a < k; ++a)
+            d2 += weights2_[a] * results_[p++];
+        fisher_(i, i) = d2 / (2 * steps_[i] * steps_[i]);
+    }
+
+    for(int i = 0; i < n_; ++i)
+    {
+        for(int j = i + 1; j < n_; ++j)
+        {
+            double d2 = 0;
+            for(int a = 0; a < k; ++a)
+            {
+                for(int b = 0; b < k; ++b)
+                    d2 += weights_[a] * weights_[b] * results_[p++];
+            }
+            fisher_(i, j) = d2 / (2 * steps_[i] * steps_[j]);
+        }
+    }
+}
+
+void
+FisherMatrix::calculateCl()
+{
+    const int k = int(offsets_.size());
+    const bool pol = model_->hasPolarization();
+    const int nL = model_->lMax() + 1;
+    const int m = resultSize();
+
+    // the derivatives of the spectra
+    dTT_.resize(n_);
+    dEE_.resize(pol ? n_ : 0);
+    dTE_.resize(pol ? n_ : 0);
+    for(int i = 0; i < n_; ++i)
+    {
+        dTT_[i].assign(nL, 0);
+        if(pol)
+        {
+            dEE_[i].assign(nL, 0);
+            dTE_[i].assign(nL, 0);
+        }
+        for(int a = 0; a < k; ++a)
+        {
+            const double w = weights_[a] / steps_[i];
+            const double* r = &(results_[(1 + i * k + a) * m]);
+            for(int l = 0; l < nL; ++l)
+            {
+                dTT_[i][l] += w * r[l];
+                if(pol)
+                {
+                    dEE_[i][l] += w * r[nL + l];
+                    dTE_[i][l] += w * r[2 * nL + l];
+                }
+            }
+        }
+    }
+
+    // C^-1 dC/dp_i for each parameter, 2x2 for T and E
+    std::vector<double> mat(n_ * 4);
+    const double* fid = &(results_[0]);
+    for(int i = 0; i < n_; ++i)
+    {
+        for(int j = i; j < n_; ++j)
+            fisher_(i, j) = 0;
+    }
+
+    for(int l = lMin_; l <= lMax_; ++l)
+    {
+        const double tt = fid[l] + (noiseTT_.empty() ? 0.0 : noiseTT_[l]);
+        const double factor = fSky_ * (2 * l + 1) / 2;
+        if(!pol)
+        {
+            check(tt > 0, "the TT covariance at l = " << l << " is " << tt);
+            for(int i = 0; i < n_; ++i)
+            {
+                for(int j = i; j < n_; ++j)
+                    fisher_(i, j) += factor * dTT_[i][l] * dTT_[j][l] / (tt * tt);
+            }
+            continue;
+        }
+
+        const double ee = fid[nL + l] + (noisePol_.empty() ? 0.0 : noisePol_[l]);
+        const double te = fid[2 * nL + l];
+        const double det = tt * ee - te * te;
+        check(det > 0, "the TE covariance at l = " << l << " is not positive definite");
+
+        // the inverse is (ee, -te; -te, tt) / det
+        for(int i = 0; i < n_; ++i)
+        {
+            const double dT = dTT_[i][l], dE = dEE_[i][l], dX = dTE_[i][l];
+            double* mi = &(mat[4 * i]);
+            mi[0] = (ee * dT - te * dX) / det;
+            mi[1] = (ee * dX - te * dE) / det;
+            mi[2] = (tt * dX - te * dT) / det;
+            mi[3] = (tt * dE - te * dX) / det;
+        }
+        for(int i = 0; i < n_; ++i)
+        {
+            const double* mi = &(mat[4 * i]);
+            for(int j = i; j < n_; ++j)
+            {
+                const double* mj = &(mat[4 * j]);
+                const double trace = mi[0] * mj[0] + mi[1] * mj[2] + mi[2] * mj[1] + mi[3] * mj[3];
+                fisher_(i, j) += factor * trace;
+            }
+        }
+    }
+}
+
+void
+FisherMatrix::clDerivatives(int i, std::vector<double>* clTT, std::vector<double>* clEE, std::vector<double>* clTE) const
+{
+    check(model_, "not a Fisher matrix from the spectra");
+    check(i >= 0 && i < n_, "invalid index " << i);
+    check(dTT_.size() == n_, "calculate has not been called");
+    check(clTT, "");
+
+    *clTT = dTT_[i];
+    if(clEE)
+    {
+        check(!dEE_.empty(), "the model has no polarization");
+        *clEE = dEE_[i];
+    }
+    if(clTE)
+    {
+        check(!dTE_.empty(), "the model has no polarization");
+        *clTE = dTE_[i];
+    }
+}
+
+void
+FisherMatrix::covariance(SymmetricMatrix<double>* cov) const
+{
+    check(cov, "");
+    *cov = fisher_;
+    const int info = cov->invert();
+    if(info)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The Fisher matrix cannot be inverted, it is not positive definite (error code " << info << "). Some parameters may not be constrained, or the steps may be too large.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+FisherMatrix::marginalizedErrors(std::vector<double>* errors) const
+{
+    check(errors, "");
+    SymmetricMatrix<double> cov;
+    covariance(&cov);
+    errors->resize(n_);
+    for(int i = 0; i < n_; ++i)
+        (*errors)[i] = std::sqrt(cov(i, i));
+}
+
+void
+FisherMatrix::writeCovarianceFile(const char* fileName, const std::vector<std::string>* names) const
+{
+    SymmetricMatrix<double> cov;
+    covariance(&cov);
+
+    std::ofstream out(fileName);
+    if(!out)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(names)
+    {
+        check(names->size() == n_, "the number of names " << names->size() << " is not equal to the number of parameters " << n_);
+        out << '#';
+        for(int i = 0; i < n_; ++i)
+            out << ' ' << (*names)[i];
+        out << std::endl;
+    }
+
+    out << std::setprecision(10);
+    for(int i = 0; i < n_; ++i)
+    {
+        for(int j = 0; j < n_; ++j)
+        {
+            if(j)
+                out << ' ';
+            out << cov(i, j);
+        }
+        out << std::endl;
+    }
+}
+
+} // namespace Math
+
@@ -1,5 +1,6 @@
 #include <string>
 #include <sstream>
+#include <ctime>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -9,13 +10,49 @@
 #include <healpix_map.h>
 #include <healpix_map_fitsio.h>
 
+namespace
+{
+
+// writes each realization into its own file as it is generated
+class WhiteNoiseWriter : public SimulatedMapConsumer
+{
+public:
+    WhiteNoiseWriter(const std::string& fileNameRoot, bool singlePrecision) : root_(fileNameRoot), dataType_(singlePrecision ? PLANCK_FLOAT32 : PLANCK_FLOAT64) {}
+
+    std::string fileName(unsigned long realization) const
+    {
+        std::stringstream name;
+        name << root_ << '_' << realization << ".fits";
+        return name.str();
+    }
+
+    virtual void consume(unsigned long realization, const Healpix_Map<double>& map)
+    {
+        const std::string name = fileName(realization);
+
+        // cfitsio is not guaranteed to be thread safe, the maps are generated in parallel but written one at a time
+#pragma omp critical (white_noise_writer)
+        {
+            fitshandle outh;
+            outh.create(name);
+            write_Healpix_map_to_fits(outh, map, dataType_);
+        }
+    }
+
+private:
+    const std::string root_;
+    const PDT dataType_;
+};
+
+} // namespace
+
 int main(int argc, char *argv[])
 {
     try {
         StandardException exc;
         if(argc < 2)
         {
-            std::string exceptionStr = "Nside, noise (optional, default = 1.0), output file name(optional, white_noise_map.fits by default), and the seed (optional) must be specified.";
+            std::string exceptionStr = "Nside, noise (optional, default = 1.0), output file name(optional, white_noise_map.fits by default), the seed (optional), the number of realizations (optional, default = 1), and 1 for single precision output (optional, default = 0) must be specified. With more than one realization the maps are generated in parallel and realization i is written into the output file name with _i added before .fits.";
             exc.set(exceptionStr);
             throw exc;
         }
@@ -45,13 +82,48 @@ int main(int argc, char *argv[])
             seedStr >> seed;
         }
         
-        Healpix_Map<double> map;
-        map.SetNside(nSide, NEST);
-        Simulate::simulateWhiteNoise(map, noise, seed);
+        unsigned long nRealizations = 1;
+        if(argc > 5)
+        {
+            std::stringstream nStr;
+            nStr << argv[5];
+            nStr >> nRealizations;
+            if(nRealizations == 0)
+            {
+                std::stringstream exceptionStr;
+                exceptionStr << "Invalid number of realizations " << argv[5] << ". Needs to be a positive integer.";
+                exc.set(exceptionStr.str());
+                throw exc;
+            }
+        }
+
+        bool singlePrecision = false;
+        if(argc > 6)
+            singlePrecision = (std::string(argv[6]) == "1");
+
+        if(nRealizations == 1)
+        {
+            Healpix_Map<double> map;
+            map.SetNside(nSide, NEST);
+            Simulate::simulateWhiteNoise(map, noise, seed);
+
+            fitshandle outh;
+            outh.create(outFileName);
+            write_Healpix_map_to_fits(outh, map, (singlePrecision ? PLANCK_FLOAT32 : PLANCK_FLOAT64));
+            return 0;
+        }
+
+        if(seed == 0)
+            seed = std::time(0);
+
+        std::string root = outFileName;
+        if(root.size() > 5 && root.substr(root.size() - 5) == ".fits")
+            root = root.substr(0, root.size() - 5);
 
-        fitshandle outh;
-        outh.create(outFileName);
-        write_Healpix_map_to_fits(outh, map, PLANCK_FLOAT64);
+        WhiteNoiseWriter writer(root, singlePrecision);
+        output_screen("Generating " << nRealizations << " white noise maps into " << writer.fileName(0) << " to " << writer.fileName(nRealizations - 1) << "..." << std::endl);
+        Simulate::simulateWhiteNoise(nSide, NEST, noise, (unsigned long) seed, 0, nRealizations, writer);
+        output_screen("OK" << std::endl);
     } catch (std::exception& e)
     {
         output_screen("EXCEPTION CAUGHT!!! " << std::endl << e.what() << std::endl);
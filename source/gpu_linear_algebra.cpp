@@ -0,0 +1,337 @@
+#ifdef COSMO_CUDA
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#include <cusolverDn.h>
+#endif
+
+#include <sstream>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <gpu_linear_algebra.hpp>
+
+namespace
+{
+
+#ifdef COSMO_CUDA
+void
+checkCuda(cudaError_t err, const char* what)
+{
+    if(err != cudaSuccess)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << what << " failed: " << cudaGetErrorString(err) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+checkCublas(cublasStatus_t status, const char* what)
+{
+    if(status != CUBLAS_STATUS_SUCCESS)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << what << " failed with cuBLAS status " << int(status) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+checkCusolver(cusolverStatus_t status, const char* what)
+{
+    if(status != CUSOLVER_STATUS_SUCCESS)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << what << " failed with cuSOLVER status " << int(status) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+cublasOperation_t
+cublasOp(char trans)
+{
+    return (trans == 'T' || trans == 't') ? CUBLAS_OP_T : CUBLAS_OP_N;
+}
+
+cublasFillMode_t
+cublasFill(char uplo)
+{
+    return (uplo == 'U' || uplo == 'u') ? CUBLAS_FILL_MODE_UPPER : CUBLAS_FILL_MODE_LOWER;
+}
+#endif
+
+// the buffer of the solver workspace
+const int workspaceBuffer = 3;
+
+} // namespace
+
+namespace Math
+{
+
+GpuLinearAlgebra::GpuLinearAlgebra() : available_(false), enabled_(false), minSize_(1024), blasHandle_(NULL), solverHandle_(NULL), buffers_(4, NULL), bufferSizes_(4, 0), info_(NULL)
+{
+#ifdef COSMO_CUDA
+    int nDevices = 0;
+    if(cudaGetDeviceCount(&nDevices) != cudaSuccess || nDevices == 0)
+    {
+        output_screen("No GPU found, the dense linear algebra will be done on the host." << std::endl);
+        return;
+    }
+
+    cublasHandle_t blasHandle;
+    cusolverDnHandle_t solverHandle;
+    if(cublasCreate(&blasHandle) != CUBLAS_STATUS_SUCCESS)
+    {
+        output_screen("Could not initialize cuBLAS, the dense linear algebra will be done on the host." << std::endl);
+        return;
+    }
+    if(cusolverDnCreate(&solverHandle) != CUSOLVER_STATUS_SUCCESS)
+    {
+        output_screen("Could not initialize cuSOLVER, the dense linear algebra will be done on the host." << std::endl);
+        cublasDestroy(blasHandle);
+        return;
+    }
+
+    blasHandle_ = blasHandle;
+    solverHandle_ = solverHandle;
+    available_ = true;
+    enabled_ = true;
+#endif
+}
+
+GpuLinearAlgebra::~GpuLinearAlgebra()
+{
+#ifdef COSMO_CUDA
+    if(!available_)
+        return;
+
+    for(int i = 0; i < buffers_.size(); ++i)
+    {
+        if(buffers_[i])
+            cudaFree(buffers_[i]);
+    }
+    if(info_)
+        cudaFree(info_);
+    for(std::map<const double*, ResidentArray>::iterator it = resident_.begin(); it != resident_.end(); ++it)
+    {
+        if(it->second.device)
+            cudaFree(it->second.device);
+    }
+
+    cusolverDnDestroy((cusolverDnHandle_t) solverHandle_);
+    cublasDestroy((cublasHandle_t) blasHandle_);
+#endif
+}
+
+void
+GpuLinearAlgebra::setEnabled(bool enable)
+{
+    enabled_ = enable && available_;
+
+    // the resident arrays can be changed on the host while disabled
+    if(!enabled_)
+    {
+        for(std::map<const double*, ResidentArray>::iterator it = resident_.begin(); it != resident_.end(); ++it)
+            it->second.upToDate = false;
+    }
+}
+
+void
+GpuLinearAlgebra::makeResident(const double* data, unsigned long size)
+{
+    check(data, "");
+    check(size > 0, "");
+    if(!enabled_)
+        return;
+
+    release(data);
+    ResidentArray& r = resident_[data];
+    r.device = NULL;
+    r.size = size;
+    r.upToDate = false;
+}
+
+void
+GpuLinearAlgebra::invalidate(const double* data)
+{
+    std::map<const double*, ResidentArray>::iterator it = resident_.find(data);
+    if(it != resident_.end())
+        it->second.upToDate = false;
+}
+
+void
+GpuLinearAlgebra::release(const double* data)
+{
+    std::map<const double*, ResidentArray>::iterator it = resident_.find(data);
+    if(it == resident_.end())
+        return;
+
+#ifdef COSMO_CUDA
+    if(it->second.device)
+        cudaFree(it->second.device);
+#endif
+    resident_.erase(it);
+}
+
+double*
+GpuLinearAlgebra::deviceBuffer(int i, unsigned long size)
+{
+    check(i >= 0 && i < buffers_.size(), "invalid buffer " << i);
+#ifdef COSMO_CUDA
+    if(bufferSizes_[i] < size)
+    {
+        if(buffers_[i])
+            checkCuda(cudaFree(buffers_[i]), "cudaFree");
+        buffers_[i] = NULL;
+        bufferSizes_[i] = 0;
+        checkCuda(cudaMalloc((void**) &(buffers_[i]), size * sizeof(double)), "cudaMalloc");
+        bufferSizes_[i] = size;
+    }
+#endif
+    return buffers_[i];
+}
+
+double*
+GpuLinearAlgebra::upload(int i, const double* data, unsigned long size)
+{
+    std::map<const double*, ResidentArray>::iterator it = resident_.find(data);
+    if(it == resident_.end())
+    {
+        double* d = deviceBuffer(i, size);
+#ifdef COSMO_CUDA
+        checkCuda(cudaMemcpy(d, data, size * sizeof(double), cudaMemcpyHostToDevice), "cudaMemcpy");
+#endif
+        return d;
+    }
+
+    ResidentArray& r = it->second;
+    check(size <= r.size, "the resident array has " << r.size << " elements, " << size << " are used");
+#ifdef COSMO_CUDA
+    if(!r.device)
+        checkCuda(cudaMalloc((void**) &(r.device), r.size * sizeof(double)), "cudaMalloc");
+    if(!r.upToDate)
+    {
+        checkCuda(cudaMemcpy(r.device, data, r.size * sizeof(double), cudaMemcpyHostToDevice), "cudaMemcpy");
+        r.upToDate = true;
+    }
+#endif
+    return r.device;
+}
+
+double*
+GpuLinearAlgebra::output(int i, const double* data, unsigned long size)
+{
+    std::map<const double*, ResidentArray>::iterator it = resident_.find(data);
+    if(it == resident_.end())
+        return deviceBuffer(i, size);
+
+    ResidentArray& r = it->second;
+    check(size <= r.size, "the resident array has " << r.size << " elements, " << size << " are used");
+#ifdef COSMO_CUDA
+    if(!r.device)
+        checkCuda(cudaMalloc((void**) &(r.device), r.size * sizeof(double)), "cudaMalloc");
+#endif
+    // up to date again only once the result is downloaded, the elements past size are not written
+    r.upToDate = false;
+    return r.device;
+}
+
+void
+GpuLinearAlgebra::downloaded(const double* data, unsigned long size)
+{
+    std::map<const double*, ResidentArray>::iterator it = resident_.find(data);
+    if(it != resident_.end() && size == it->second.size)
+        it->second.upToDate = true;
+}
+
+int*
+GpuLinearAlgebra::deviceInfo()
+{
+#ifdef COSMO_CUDA
+    if(!info_)
+        checkCuda(cudaMalloc((void**) &info_, sizeof(int)), "cudaMalloc");
+#endif
+    return info_;
+}
+
+void
+GpuLinearAlgebra::dgemm(char transa, char transb, int m, int n, int k, const double* a, int lda, const double* b, int ldb, double* c, int ldc)
+{
+    check(enabled_, "the GPU is not enabled");
+#ifdef COSMO_CUDA
+    const bool tA = (transa == 'T' || transa == 't');
+    const bool tB = (transb == 'T' || transb == 't');
+    const unsigned long aSize = (unsigned long)(lda) * (tA ? m : k);
+    const unsigned long bSize = (unsigned long)(ldb) * (tB ? k : n);
+    const unsigned long cSize = (unsigned long)(ldc) * n;
+
+    double* dA = upload(0, a, aSize);
+    double* dB = upload(1, b, bSize);
+    double* dC = output(2, c, cSize);
+
+    const double alpha = 1, beta = 0;
+    checkCublas(cublasDgemm((cublasHandle_t) blasHandle_, cublasOp(transa), cublasOp(transb), m, n, k, &alpha, dA, lda, dB, ldb, &beta, dC, ldc), "cublasDgemm");
+
+    checkCuda(cudaMemcpy(c, dC, cSize * sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    downloaded(c, cSize);
+#endif
+}
+
+int
+GpuLinearAlgebra::dpotrf(char uplo, int n, double* a, int lda)
+{
+    check(enabled_, "the GPU is not enabled");
+    int info = 0;
+#ifdef COSMO_CUDA
+    const unsigned long aSize = (unsigned long)(lda) * n;
+    double* dA = upload(0, a, aSize);
+    int* dInfo = deviceInfo();
+    cusolverDnHandle_t handle = (cusolverDnHandle_t) solverHandle_;
+
+    int lwork;
+    checkCusolver(cusolverDnDpotrf_bufferSize(handle, cublasFill(uplo), n, dA, lda, &lwork), "cusolverDnDpotrf_bufferSize");
+    double* dWork = deviceBuffer(workspaceBuffer, lwork);
+
+    // factorized in place, the device copy of a resident array is up to date again once the result is downloaded
+    output(0, a, aSize);
+    checkCusolver(cusolverDnDpotrf(handle, cublasFill(uplo), n, dA, lda, dWork, lwork, dInfo), "cusolverDnDpotrf");
+    checkCuda(cudaMemcpy(&info, dInfo, sizeof(int), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    checkCuda(cudaMemcpy(a, dA, aSize * sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    downloaded(a, aSize);
+#endif
+    return info;
+}
+
+int
+GpuLinearAlgebra::dpotri(char uplo, int n, double* a, int lda)
+{
+    check(enabled_, "the GPU is not enabled");
+    int info = 0;
+#ifdef COSMO_CUDA
+    const unsigned long aSize = (unsigned long)(lda) * n;
+    double* dA = upload(0, a, aSize);
+    int* dInfo = deviceInfo();
+    cusolverDnHandle_t handle = (cusolverDnHandle_t) solverHandle_;
+
+    int lwork;
+    checkCusolver(cusolverDnDpotri_bufferSize(handle, cublasFill(uplo), n, dA, lda, &lwork), "cusolverDnDpotri_bufferSize");
+    double* dWork = deviceBuffer(workspaceBuffer, lwork);
+
+    // inverted in place, the device copy of a resident array is up to date again once the result is downloaded
+    output(0, a, aSize);
+    checkCusolver(cusolverDnDpotri(handle, cublasFill(uplo), n, dA, lda, dWork, lwork, dInfo), "cusolverDnDpotri");
+    checkCuda(cudaMemcpy(&info, dInfo, sizeof(int), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    checkCuda(cudaMemcpy(a, dA, aSize * sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    downloaded(a, aSize);
+#endif
+    return info;
+}
+
+} // namespace Math
+
@@ -1,17 +1,38 @@
 #include <sstream>
+#include <cstdio>
 
+#include <unistd.h>
+
+#include <cosmo_mpi.hpp>
 #include <exception_handler.hpp>
 #include <math_constants.hpp>
+#include <mapped_file.hpp>
 #include <hmc.hpp>
 
 namespace Math
 {
 
-HMC::HMC(int nPar, LikelihoodWithDerivs& like, std::string fileRoot, double tauMax, int nMax, time_t seed) : n_(nPar), like_(like), fileRoot_(fileRoot), tauMax_(tauMax), nMax_(nMax), mass_(nPar, 0), starting_(nPar, 0), derivs_(nPar, 0), currentPoint_(nPar, 0), x_(nPar, 0), p_(nPar, 0), paramNames_(nPar), gen_(seed == 0 ? std::time(0) : seed), uniformDist_(0, 1), gaussDist_(0, 1)
+HMC::HMC(int nPar, LikelihoodWithDerivs& like, std::string fileRoot, double tauMax, int nMax, time_t seed) : n_(nPar), like_(like), fileRoot_(fileRoot), tauMax_(tauMax), nMax_(nMax), mass_(nPar, 0), starting_(nPar, 0), derivs_(nPar, 0), currentPoint_(nPar, 0), x_(nPar, 0), p_(nPar, 0), paramNames_(nPar), gen_(seed == 0 ? std::time(0) : seed), uniformDist_(0, 1), gaussDist_(0, 1), nChains_(CosmoMPI::create().numProcesses()), chainI_(CosmoMPI::create().processId()), resumeCode_(123456), statN_(0), statMean_(nPar, 0), statM2_(nPar, 0), rGelmanRubin_(nPar, -1)
 {
     check(n_ > 0, "");
     check(nMax_ >= 1, "");
     check(tauMax_ > 0, "");
+
+    if(nChains_ > 1)
+    {
+        // a different stream for each chain
+        long s = (seed == 0 ? long(std::time(0)) : long(seed));
+        CosmoMPI::create().bcast(&s, 1, CosmoMPI::LONG);
+        std::seed_seq seq{(unsigned long)(s), (unsigned long)(chainI_)};
+        gen_.seed(seq);
+    }
+
+    std::stringstream resFileName;
+    resFileName << fileRoot_ << "resume";
+    if(nChains_ > 1)
+        resFileName << '_' << chainI_;
+    resFileName << ".dat";
+    resumeFileName_ = resFileName.str();
 }
 
 HMC::~HMC()
@@ -29,31 +50,58 @@ HMC::setParam(int i, const std::string& name, double mass, double starting)
 }
 
 void
-HMC::run(int iters)
+HMC::run(int iters, int writeResumeInformationEvery, double convergenceCriterion, int burnin)
 {
     check(iters > 0, "");
-    currentPoint_ = starting_;
-    currentLike_ = like_.calculate(&(currentPoint_[0]), n_);
+    check(writeResumeInformationEvery >= 0, "");
+    check(burnin >= 0, "");
 
-    std::stringstream chainFileName;
-    chainFileName << fileRoot_ << ".txt";
-    outChain_.open(chainFileName.str().c_str());
-    StandardException exc;
-    if(!outChain_)
+    CosmoMPI& mpi = CosmoMPI::create();
+
+    int start = 0, accepted = 0, total = 0;
+    long position = 0;
+    bool resumed = (writeResumeInformationEvery > 0 && readResumeInfo(start, accepted, total, position));
+
+    if(nChains_ > 1 && writeResumeInformationEvery > 0)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot write into the output file " << chainFileName.str() << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        // the chains check the convergence together, so they can only resume if they all stopped at the same iteration
+        int myStart = (resumed ? start : -1), minStart, maxStart;
+        mpi.reduce(&myStart, &minStart, 1, CosmoMPI::INT, CosmoMPI::MIN);
+        mpi.reduce(&myStart, &maxStart, 1, CosmoMPI::INT, CosmoMPI::MAX);
+        int same = (minStart == maxStart ? 1 : 0);
+        mpi.bcast(&same, 1, CosmoMPI::INT);
+        if(!same)
+        {
+            if(mpi.isMaster())
+            {
+                output_screen("The resume information of the chains is not for the same iteration, starting over!" << std::endl);
+            }
+            resumed = false;
+        }
     }
 
-    outputCurrent();
-
-    int accepted = 0, total = 0;
+    if(resumed)
+    {
+        output_screen("Resuming from iteration " << start << std::endl);
+        openOut(true, position);
+    }
+    else
+    {
+        start = 0;
+        accepted = 0;
+        total = 0;
+        statN_ = 0;
+        std::fill(statMean_.begin(), statMean_.end(), 0.0);
+        std::fill(statM2_.begin(), statM2_.end(), 0.0);
+        currentPoint_ = starting_;
+        currentLike_ = like_.calculate(&(currentPoint_[0]), n_);
+        openOut(false, 0);
+        outputCurrent();
+    }
 
-    //std::ofstream outXP("xp.txt");
+    const int checkEvery = 100;
 
-    for(int i = 0; i < iters; ++i)
+    for(int i = start; i < iters; ++i)
     {
         const double tau = uniformDist_(gen_) * tauMax_;
         const int n = (int)std::ceil(nMax_ * uniformDist_(gen_));
@@ -66,14 +114,6 @@ HMC::run(int iters)
 
         const double oldPLike = calculatePLike();
 
-        /*
-        for(int k = 0; k < n_; ++k)
-            outXP << x_[k] << '\t';
-        for(int k = 0; k < n_ - 1; ++k)
-            outXP << p_[k] << '\t';
-        outXP << p_[n_ - 1] << std::endl;
-        */
-        
         check(n > 0, "");
         for(int j = 0; j < n; ++j)
         {
@@ -85,14 +125,6 @@ HMC::run(int iters)
             calculateDerivs();
             for(int k = 0; k < n_; ++k)
                 p_[k] -= tau / 2 * derivs_[k] / 2; // divide by 2 because the derivative is of -2ln(like)
-
-            /*
-            for(int k = 0; k < n_; ++k)
-                outXP << x_[k] << '\t';
-            for(int k = 0; k < n_ - 1; ++k)
-                outXP << p_[k] << '\t';
-            outXP << p_[n_ - 1] << std::endl;
-            */
         }
 
         const double newLike = like_.calculate(&(x_[0]), n_);
@@ -101,8 +133,6 @@ HMC::run(int iters)
         const double deltaLike = newLike + newPLike - currentLike_ - oldPLike;
         const double p = std::exp(-deltaLike / 2);
 
-        //if(p > 1) p = 1;
-
         ++total;
         const double q = uniformDist_(gen_);
         if(q <= p)
@@ -117,12 +147,211 @@ HMC::run(int iters)
             output_log1("Iteration " << i << ": New point REJECTED" << std::endl);
         }
         outputCurrent();
-    }
 
-    //outXP.close();
+        if(i >= burnin)
+        {
+            ++statN_;
+            for(int k = 0; k < n_; ++k)
+            {
+                const double dx = currentPoint_[k] - statMean_[k];
+                statMean_[k] += dx / statN_;
+                statM2_[k] += dx * (currentPoint_[k] - statMean_[k]);
+            }
+        }
+
+        if(writeResumeInformationEvery > 0 && (i + 1) % writeResumeInformationEvery == 0)
+            writeResumeInfo(i + 1, accepted, total);
+
+        // all of the chains are at the same iteration here
+        if(convergenceCriterion > 0 && nChains_ > 1 && (i + 1) % checkEvery == 0 && statN_ >= checkEvery && checkConvergence(convergenceCriterion))
+        {
+            if(mpi.isMaster())
+            {
+                output_screen("The chains have converged after " << i + 1 << " iterations!" << std::endl);
+            }
+            break;
+        }
+    }
 
     outChain_.close();
+
+    if(writeResumeInformationEvery > 0)
+        std::remove(resumeFileName_.c_str());
+
     output_screen("Acceptance rate: " << double(accepted) / total * 100 << "%" << std::endl)
+    if(convergenceCriterion > 0 && nChains_ > 1 && mpi.isMaster())
+    {
+        for(int k = 0; k < n_; ++k)
+            output_screen("Parameter " << paramNames_[k] << ": Gelman-Rubin estimated potential scale reduction = " << rGelmanRubin_[k] << std::endl);
+    }
+}
+
+bool
+HMC::checkConvergence(double convergenceCriterion)
+{
+    CosmoMPI& mpi = CosmoMPI::create();
+
+    // the sums over the chains of the means, the squares of the means and the variances, reduced together
+    std::vector<double> mine(3 * n_), sums(3 * n_, 0);
+    for(int k = 0; k < n_; ++k)
+    {
+        mine[k] = statMean_[k];
+        mine[n_ + k] = statMean_[k] * statMean_[k];
+        mine[2 * n_ + k] = (statN_ > 1 ? statM2_[k] / (statN_ - 1) : 0.0);
+    }
+    mpi.reduce(&(mine[0]), &(sums[0]), 3 * n_, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+    mpi.bcast(&(sums[0]), 3 * n_, CosmoMPI::DOUBLE);
+
+    // the same number of samples after the burnin in all of the chains
+    const double total = double(statN_);
+    bool converged = true;
+    for(int k = 0; k < n_; ++k)
+    {
+        const double totalMean = sums[k] / nChains_;
+        const double B = std::max(0.0, sums[n_ + k] - nChains_ * totalMean * totalMean) * total / (nChains_ - 1);
+        const double W = sums[2 * n_ + k] / nChains_;
+        const double var = (total - 1) * W / total + B / total;
+
+        if(W == 0)
+            rGelmanRubin_[k] = (var == 0 ? 1.0 : 100.0);
+        else
+            rGelmanRubin_[k] = std::sqrt(var / W);
+
+        output_log("HMC parameter " << k << ": Gelman-Rubin estimated potential scale reduction = " << rGelmanRubin_[k] << std::endl);
+
+        if(std::abs(rGelmanRubin_[k] - 1) > convergenceCriterion)
+            converged = false;
+    }
+    return converged;
+}
+
+void
+HMC::openOut(bool append, long position)
+{
+    std::stringstream chainFileName;
+    chainFileName << fileRoot_;
+    if(nChains_ > 1)
+        chainFileName << '_' << chainI_;
+    chainFileName << ".txt";
+
+    if(append)
+    {
+        // drop the elements written after the resume information, they will be generated again
+        if(truncate(chainFileName.str().c_str(), position) != 0)
+        {
+            output_screen("WARNING: could not truncate the chain file " << chainFileName.str() << " to the resume point." << std::endl);
+        }
+        outChain_.open(chainFileName.str().c_str(), std::ios::app);
+    }
+    else
+        outChain_.open(chainFileName.str().c_str());
+
+    StandardException exc;
+    if(!outChain_)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into the output file " << chainFileName.str() << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+HMC::writeResumeInfo(int iteration, int accepted, int total)
+{
+    outChain_.flush();
+    const long position = long(outChain_.tellp());
+
+    std::stringstream genState;
+    genState << gen_ << ' ' << uniformDist_ << ' ' << gaussDist_;
+    const std::string state = genState.str();
+    const int stateSize = int(state.size());
+
+    // written into a temporary file first, so that the resume file is never corrupted
+    try
+    {
+        Math::ReplacingOutputFile file(resumeFileName_.c_str());
+        std::ofstream& out = file.stream();
+
+        out.write((char*)(&n_), sizeof(int));
+        out.write((char*)(&iteration), sizeof(int));
+        out.write((char*)(&accepted), sizeof(int));
+        out.write((char*)(&total), sizeof(int));
+        out.write((char*)(&position), sizeof(long));
+        out.write((char*)(&currentLike_), sizeof(double));
+        out.write((char*)(&(currentPoint_[0])), n_ * sizeof(double));
+        out.write((char*)(&statN_), sizeof(unsigned long));
+        out.write((char*)(&(statMean_[0])), n_ * sizeof(double));
+        out.write((char*)(&(statM2_[0])), n_ * sizeof(double));
+        out.write((char*)(&stateSize), sizeof(int));
+        out.write(state.data(), stateSize);
+        out.write((char*)(&resumeCode_), sizeof(int));
+        file.commit();
+    }
+    catch (std::exception& e)
+    {
+        output_screen("WARNING: the resume file " << resumeFileName_ << " was not updated, a resumed run would start from the previous resume point. " << e.what() << std::endl);
+    }
+}
+
+bool
+HMC::readResumeInfo(int& iteration, int& accepted, int& total, long& position)
+{
+    std::ifstream in(resumeFileName_.c_str(), std::ios::binary | std::ios::in);
+    if(!in)
+        return false;
+
+    int n = 0;
+    in.read((char*)(&n), sizeof(int));
+    if(!in || n != n_)
+    {
+        output_screen("The resume file " << resumeFileName_ << " is for a different number of parameters, ignoring it." << std::endl);
+        return false;
+    }
+
+    double like;
+    std::vector<double> point(n_), mean(n_), m2(n_);
+    unsigned long statN;
+    int stateSize = 0;
+    in.read((char*)(&iteration), sizeof(int));
+    in.read((char*)(&accepted), sizeof(int));
+    in.read((char*)(&total), sizeof(int));
+    in.read((char*)(&position), sizeof(long));
+    in.read((char*)(&like), sizeof(double));
+    in.read((char*)(&(point[0])), n_ * sizeof(double));
+    in.read((char*)(&statN), sizeof(unsigned long));
+    in.read((char*)(&(mean[0])), n_ * sizeof(double));
+    in.read((char*)(&(m2[0])), n_ * sizeof(double));
+    in.read((char*)(&stateSize), sizeof(int));
+    if(!in || stateSize <= 0 || stateSize > 1000000)
+    {
+        output_screen("Problem in the resume file " << resumeFileName_ << ", ignoring it." << std::endl);
+        return false;
+    }
+    std::string state(stateSize, ' ');
+    in.read(&(state[0]), stateSize);
+    int code = 0;
+    in.read((char*)(&code), sizeof(int));
+    if(!in || code != resumeCode_)
+    {
+        output_screen("Problem in the resume file " << resumeFileName_ << ", ignoring it." << std::endl);
+        return false;
+    }
+
+    std::stringstream genState(state);
+    genState >> gen_ >> uniformDist_ >> gaussDist_;
+    if(!genState)
+    {
+        output_screen("Problem in the resume file " << resumeFileName_ << ", ignoring it." << std::endl);
+        return false;
+    }
+
+    currentLike_ = like;
+    currentPoint_ = point;
+    statN_ = statN;
+    statMean_ = mean;
+    statM2_ = m2;
+    return true;
 }
 
 void
@@ -0,0 +1,364 @@
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cosmo_mpi.hpp>
+#include <profiler.hpp>
+#include <chain_file.hpp>
+#include <mapped_file.hpp>
+#include <importance_reweighting.hpp>
+
+namespace
+{
+
+// orders the chain elements by their parameters
+class LessParams
+{
+public:
+    LessParams(const MarkovChain& chain) : chain_(chain) {}
+
+    bool operator() (unsigned long a, unsigned long b) const
+    {
+        for(int j = 0; j < chain_.nParams(); ++j)
+        {
+            const std::vector<double>& column = chain_.paramColumn(j);
+            if(column[a] != column[b])
+                return column[a] < column[b];
+        }
+        return a < b;
+    }
+
+    bool equal(unsigned long a, unsigned long b) const
+    {
+        for(int j = 0; j < chain_.nParams(); ++j)
+        {
+            const std::vector<double>& column = chain_.paramColumn(j);
+            if(column[a] != column[b])
+                return false;
+        }
+        return true;
+    }
+
+private:
+    const MarkovChain& chain_;
+};
+
+// the number of points of a given process in a given round, the remaining points are distributed over the processes in turn
+unsigned long roundCount(unsigned long nRemaining, int nProcesses, int process, unsigned long round, int batchSize)
+{
+    const unsigned long nLocal = (nRemaining + nProcesses - 1 - process) / nProcesses;
+    const unsigned long first = round * batchSize;
+    if(nLocal <= first)
+        return 0;
+    return std::min(nLocal - first, (unsigned long) batchSize);
+}
+
+} // namespace
+
+ImportanceReweighting::ImportanceReweighting(const MarkovChain& chain, Math::LikelihoodFunction& like, const std::string& checkpointFileName, int batchSize) : chain_(chain), like_(like), checkpointFileName_(checkpointFileName), batchSize_(batchSize), calculated_(0), done_(false)
+{
+    check(batchSize_ > 0, "invalid batch size " << batchSize_);
+    check(chain_.size() > 0, "the chain is empty");
+    check(chain_.nParams() > 0, "");
+
+    findUnique();
+}
+
+void
+ImportanceReweighting::findUnique()
+{
+    const unsigned long n = chain_.size();
+    std::vector<unsigned long> sorted(n);
+    for(unsigned long i = 0; i < n; ++i)
+        sorted[i] = i;
+
+    LessParams less(chain_);
+    std::sort(sorted.begin(), sorted.end(), less);
+
+    // each element points to the first occurrence of its point in the chain, the equal points are next to each other in the sorted order with the first occurrence first
+    std::vector<unsigned long> first(n);
+    for(unsigned long i = 0; i < n; ++i)
+        first[sorted[i]] = (i > 0 && less.equal(sorted[i - 1], sorted[i]) ? first[sorted[i - 1]] : sorted[i]);
+
+    // the unique points are numbered in the order of the chain, so the numbering doesn't depend on anything else
+    uniquePoints_.clear();
+    uniqueIndex_.resize(n);
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        if(first[i] == i)
+        {
+            uniqueIndex_[i] = uniquePoints_.size();
+            uniquePoints_.push_back(i);
+        }
+        else
+            uniqueIndex_[i] = uniqueIndex_[first[i]];
+    }
+
+    uniqueLikes_.assign(uniquePoints_.size(), 0);
+    uniqueDone_.assign(uniquePoints_.size(), 0);
+
+    output_screen1("Importance reweighting: " << uniquePoints_.size() << " unique points out of " << n << " chain elements." << std::endl);
+}
+
+void
+ImportanceReweighting::readCheckpoint()
+{
+    CosmoMPI& mpi = CosmoMPI::create();
+
+    // the master reads the checkpoint and sends it to the others, the error is also sent so that all of the processes throw
+    int status = 0;
+    std::stringstream exceptionStr;
+    if(mpi.isMaster() && !checkpointFileName_.empty())
+    {
+        std::ifstream in(checkpointFileName_.c_str());
+        std::string line;
+        if(in && std::getline(in, line) && std::getline(in, line))
+        {
+            std::stringstream str(line);
+            unsigned long chainSize = 0, uniqueCount = 0;
+            str >> chainSize >> uniqueCount;
+            if(!str || chainSize != size() || uniqueCount != uniquePoints_.size())
+            {
+                status = 1;
+                exceptionStr << "The checkpoint file " << checkpointFileName_ << " is for a different chain (" << chainSize << " elements with " << uniqueCount << " unique points instead of " << size() << " with " << uniquePoints_.size() << ").";
+            }
+
+            unsigned long lineNumber = 2;
+            while(!status && std::getline(in, line))
+            {
+                ++lineNumber;
+                // a partially written last line is ignored
+                if(in.eof())
+                    break;
+
+                const char* current = line.c_str();
+                char* next;
+                const unsigned long index = std::strtoul(current, &next, 10);
+                const char* likeStart = next;
+                const double l = std::strtod(likeStart, &next);
+                if(next == likeStart || index >= uniquePoints_.size())
+                {
+                    status = 1;
+                    exceptionStr << "Invalid line " << lineNumber << " in the checkpoint file " << checkpointFileName_ << ": " << line;
+                    break;
+                }
+                uniqueLikes_[index] = l;
+                uniqueDone_[index] = 1;
+            }
+        }
+    }
+
+    mpi.bcast(&status, 1, CosmoMPI::INT);
+    if(status)
+    {
+        if(!mpi.isMaster())
+            exceptionStr << "Invalid checkpoint file " << checkpointFileName_ << ".";
+        StandardException exc;
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(mpi.numProcesses() > 1 && !checkpointFileName_.empty())
+    {
+        std::vector<int> done(uniqueDone_.begin(), uniqueDone_.end());
+        mpi.bcast(&(uniqueLikes_[0]), uniqueLikes_.size(), CosmoMPI::DOUBLE);
+        mpi.bcast(&(done[0]), done.size(), CosmoMPI::INT);
+        uniqueDone_.assign(done.begin(), done.end());
+    }
+}
+
+void
+ImportanceReweighting::run()
+{
+    COSMO_PROFILE_REGION("importance_reweighting");
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = mpi.numProcesses();
+    const int processId = mpi.processId();
+
+    uniqueLikes_.assign(uniquePoints_.size(), 0);
+    uniqueDone_.assign(uniquePoints_.size(), 0);
+    calculated_ = 0;
+    readCheckpoint();
+
+    std::vector<unsigned long> remaining;
+    for(unsigned long i = 0; i < uniquePoints_.size(); ++i)
+    {
+        if(!uniqueDone_[i])
+            remaining.push_back(i);
+    }
+
+    output_screen1("Importance reweighting: " << uniquePoints_.size() - remaining.size() << " unique points from the checkpoint, " << remaining.size() << " to calculate." << std::endl);
+
+    // the checkpoint is written again with the points read from it, since the old one might end with a partially written line
+    std::ofstream checkpoint;
+    if(mpi.isMaster() && !checkpointFileName_.empty())
+    {
+        Math::ReplacingOutputFile file(checkpointFileName_.c_str());
+        std::ofstream& out = file.stream();
+        out << "# importance reweighting checkpoint: chain size, number of unique points, then the unique point index and -2ln(likelihood) on each line" << std::endl << size() << ' ' << uniquePoints_.size() << std::endl;
+        out << std::setprecision(17);
+        for(unsigned long i = 0; i < uniquePoints_.size(); ++i)
+        {
+            if(uniqueDone_[i])
+                out << i << ' ' << uniqueLikes_[i] << std::endl;
+        }
+        file.commit();
+
+        checkpoint.open(checkpointFileName_.c_str(), std::ios::out | std::ios::app);
+        checkpoint << std::setprecision(17);
+    }
+
+    const unsigned long nRemaining = remaining.size();
+    const unsigned long nLocal0 = (nRemaining + nProcesses - 1) / nProcesses;
+    const unsigned long nRounds = (nLocal0 + batchSize_ - 1) / batchSize_;
+
+    const int nParams = chain_.nParams();
+    std::vector<double> params(batchSize_ * nParams), likes(batchSize_);
+    std::vector<double> allLikes(nProcesses * batchSize_);
+    std::vector<int> counts(nProcesses), displs(nProcesses);
+
+    for(unsigned long round = 0; round < nRounds; ++round)
+    {
+        // the j-th point of process p in this round is remaining[(round * batchSize + j) * nProcesses + p]
+        const unsigned long base = round * batchSize_;
+        const int m = roundCount(nRemaining, nProcesses, processId, round, batchSize_);
+        for(int j = 0; j < m; ++j)
+        {
+            const unsigned long element = uniquePoints_[remaining[(base + j) * nProcesses + processId]];
+            for(int k = 0; k < nParams; ++k)
+                params[j * nParams + k] = chain_.param(element, k);
+        }
+
+        if(m > 0)
+            like_.calculateBatch(&(params[0]), nParams, m, &(likes[0]));
+        calculated_ += m;
+
+        int total = 0;
+        for(int p = 0; p < nProcesses; ++p)
+        {
+            counts[p] = roundCount(nRemaining, nProcesses, p, round, batchSize_);
+            displs[p] = total;
+            total += counts[p];
+        }
+        mpi.allgatherv(&(likes[0]), m, &(allLikes[0]), &(counts[0]), &(displs[0]), CosmoMPI::DOUBLE);
+
+        for(int p = 0; p < nProcesses; ++p)
+        {
+            for(int j = 0; j < counts[p]; ++j)
+            {
+                const unsigned long index = remaining[(base + j) * nProcesses + p];
+                uniqueLikes_[index] = allLikes[displs[p] + j];
+                uniqueDone_[index] = 1;
+                if(checkpoint.is_open())
+                    checkpoint << index << ' ' << allLikes[displs[p] + j] << std::endl;
+            }
+        }
+
+        output_screen1("Importance reweighting: round " << round + 1 << " of " << nRounds << " done." << std::endl);
+    }
+
+    checkpoint.close();
+
+    for(unsigned long i = 0; i < uniqueDone_.size(); ++i)
+        check(uniqueDone_[i], "");
+
+    calculateWeights();
+    done_ = true;
+}
+
+void
+ImportanceReweighting::calculateWeights()
+{
+    // the weights are normalized to the smallest -2ln(likelihood) to avoid overflows
+    double minLike = std::numeric_limits<double>::max();
+    for(unsigned long i = 0; i < uniqueLikes_.size(); ++i)
+    {
+        if(std::isfinite(uniqueLikes_[i]) && uniqueLikes_[i] < minLike)
+            minLike = uniqueLikes_[i];
+    }
+
+    if(minLike == std::numeric_limits<double>::max())
+    {
+        StandardException exc;
+        exc.set("The extra likelihood is not finite for any of the points of the chain.");
+        throw exc;
+    }
+
+    weights_.resize(size());
+    for(unsigned long i = 0; i < size(); ++i)
+    {
+        const double l = uniqueLikes_[uniqueIndex_[i]];
+        weights_[i] = (std::isfinite(l) ? chain_.prob(i) * std::exp(-(l - minLike) / 2) : 0.0);
+    }
+}
+
+double
+ImportanceReweighting::effectiveSampleSize() const
+{
+    check(done_, "run has not been called");
+
+    double sum = 0, sum2 = 0;
+    for(unsigned long i = 0; i < weights_.size(); ++i)
+    {
+        sum += weights_[i];
+        sum2 += weights_[i] * weights_[i];
+    }
+
+    if(sum2 == 0)
+        return 0;
+
+    return sum * sum / sum2;
+}
+
+void
+ImportanceReweighting::writeChain(const char* fileName, const std::vector<std::string>* paramNames) const
+{
+    check(done_, "run has not been called");
+
+    if(!CosmoMPI::create().isMaster())
+        return;
+
+    const int nParams = chain_.nParams();
+
+    if(paramNames)
+    {
+        check(paramNames->size() == nParams, "");
+        std::vector<double> records(size() * (2 + nParams));
+        for(unsigned long i = 0; i < size(); ++i)
+        {
+            double* r = &(records[i * (2 + nParams)]);
+            r[0] = weights_[i];
+            r[1] = chain_.like(i) + extraLike(i);
+            for(int j = 0; j < nParams; ++j)
+                r[2 + j] = chain_.param(i, j);
+        }
+        BinaryChain::writeFile(fileName, *paramNames, &(records[0]), size());
+        return;
+    }
+
+    std::ofstream out(fileName);
+    if(!out)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    out << std::setprecision(15);
+    for(unsigned long i = 0; i < size(); ++i)
+    {
+        out << weights_[i] << ' ' << chain_.like(i) + extraLike(i);
+        for(int j = 0; j < nParams; ++j)
+            out << ' ' << chain_.param(i, j);
+        out << std::endl;
+    }
+}
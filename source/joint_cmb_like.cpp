@@ -0,0 +1,162 @@
+#include <string>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <joint_cmb_like.hpp>
+
+namespace
+{
+
+// exceptions cannot leave the parallel regions, so the first error message is kept and thrown after
+void
+setComponentError(std::string& error, const std::exception& e)
+{
+#pragma omp critical (joint_cmb_like_error)
+    {
+        if(error.empty())
+            error = e.what();
+    }
+}
+
+} // namespace
+
+JointCMBLikelihood::JointCMBLikelihood(PlanckLikelihood* planck, WMAP9Likelihood* wmap, bool includeTensors, double kPerDecade) : planck_(planck), wmap_(wmap), lMax_(0), wantPol_(false), haveCls_(false), planckLike_(0), wmapLike_(0), concurrent_(false), modelParams_(NULL), haveModel_(false), modelSuccess_(false), modelBadLike_(0)
+{
+    check(planck_ || wmap_, "at least one of the likelihoods must be given");
+
+    if(planck_)
+    {
+        lMax_ = std::max(lMax_, planck_->getLMax());
+        wantPol_ = wantPol_ || planck_->wantsPolarization();
+    }
+
+    if(wmap_)
+    {
+        lMax_ = std::max(lMax_, wmap_->getLMax());
+        wantPol_ = wantPol_ || wmap_->wantsPolarization();
+    }
+
+    output_screen1("Joint CMB likelihood l_max = " << lMax_ << std::endl);
+
+    // the same extra range as the components use with their own CMB
+    cmb_.preInitialize(lMax_ + 1000, false, true, includeTensors, lMax_ + 1000, kPerDecade);
+}
+
+void
+JointCMBLikelihood::setCosmoParams(const CosmologicalParams& params)
+{
+    params.getAllParameters(currentCosmoParams_);
+    if(haveCls_ && currentCosmoParams_ == prevCosmoParams_)
+        return;
+
+    // the union of the spectra needed by the components, calculated once
+    cmb_.initialize(params, true, wantPol_, true);
+    cmb_.getLensedCl(&clTT_, (wantPol_ ? &clEE_ : NULL), (wantPol_ ? &clTE_ : NULL), (wantPol_ ? &clBB_ : NULL));
+    cmb_.getCl(NULL, NULL, NULL, &clPP_);
+
+    const std::vector<double>* ee = (wantPol_ ? &clEE_ : NULL);
+    const std::vector<double>* te = (wantPol_ ? &clTE_ : NULL);
+    const std::vector<double>* bb = (wantPol_ ? &clBB_ : NULL);
+
+    if(planck_)
+    {
+#ifdef COSMO_PLANCK_15
+        planck_->setCls(&clTT_, ee, te, bb, &clPP_);
+#else
+        planck_->setCls(&clTT_, ee, te, &clPP_);
+#endif
+    }
+
+    if(wmap_)
+        wmap_->setCls(&clTT_, ee, te, bb);
+
+    prevCosmoParams_.swap(currentCosmoParams_);
+    haveCls_ = true;
+}
+
+double
+JointCMBLikelihood::likelihood()
+{
+    check(haveCls_, "need to set the cosmological parameters first");
+
+    planckLike_ = 0;
+    wmapLike_ = 0;
+    if(!concurrent_ || !planck_ || !wmap_)
+    {
+        if(planck_)
+            planckLike_ = planck_->likelihood();
+        if(wmap_)
+            wmapLike_ = wmap_->likelihood();
+        return planckLike_ + wmapLike_;
+    }
+
+    std::string error;
+#pragma omp parallel sections default(shared)
+    {
+#pragma omp section
+        {
+            try {
+                planckLike_ = planck_->likelihood();
+            } catch (std::exception& e)
+            {
+                setComponentError(error, e);
+            }
+        }
+#pragma omp section
+        {
+            try {
+                wmapLike_ = wmap_->likelihood();
+            } catch (std::exception& e)
+            {
+                setComponentError(error, e);
+            }
+        }
+    }
+
+    if(!error.empty())
+    {
+        StandardException exc;
+        exc.set(error);
+        throw exc;
+    }
+
+    return planckLike_ + wmapLike_;
+}
+
+double
+JointCMBLikelihood::calculate(double* params, int nPar)
+{
+    check(modelParams_, "model params must be set before calling this function");
+    check(!vModel_.empty(), "");
+    const int nModel = vModel_.size();
+    const int nNuisance = (planck_ ? planck_->numberOfNuisanceParams() : 0);
+
+    check(nPar == nModel + nNuisance, "");
+
+    // when only the nuisance parameters have changed the model does not need to be set again, and setCosmoParams will keep the spectra
+    if(!haveModel_ || !std::equal(vModel_.begin(), vModel_.end(), params))
+    {
+        for(int i = 0; i < nModel; ++i)
+            vModel_[i] = params[i];
+
+        modelBadLike_ = 0;
+        modelSuccess_ = modelParams_->setParameters(&(vModel_[0]), nModel, &modelBadLike_);
+        haveModel_ = true;
+    }
+
+    output_screen2("Joint CMB likelihood evaluation: " << (modelSuccess_ ? "GOOD REGION" : "BAD REGION") << std::endl);
+    if(!modelSuccess_)
+    {
+        check(modelBadLike_ >= 0, "");
+        return 1e10 + modelBadLike_;
+    }
+
+    setCosmoParams(*modelParams_);
+
+    if(planck_)
+        planck_->setNuisanceParams(params + nModel);
+
+    return likelihood();
+}
+
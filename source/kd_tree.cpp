@@ -1,43 +1,293 @@
 #include <algorithm>
+#include <cstring>
+#include <string>
+#include <sstream>
+
+#include <pthread.h>
 
 #include <macros.hpp>
+#include <exception_handler.hpp>
 #include <kd_tree.hpp>
+#include <profiler.hpp>
+
+namespace
+{
+
+const char kdTreeMagic[8] = {'C', 'O', 'S', 'M', 'O', 'K', 'D', 'T'};
+const int kdTreeVersion = 1;
+
+// scoped locks that do nothing if the lock is NULL (i.e. the concurrent access mode is off)
+class ReadLock
+{
+public:
+    ReadLock(void* lock) : lock_((pthread_rwlock_t*)lock) { if(lock_) pthread_rwlock_rdlock(lock_); }
+    ~ReadLock() { if(lock_) pthread_rwlock_unlock(lock_); }
+
+private:
+    pthread_rwlock_t* lock_;
+};
 
-KDTree::KDTree(int dim, const std::vector<std::vector<double> >& elements) : dim_(dim), elements_(elements)
+class WriteLock
+{
+public:
+    WriteLock(void* lock) : lock_((pthread_rwlock_t*)lock) { if(lock_) pthread_rwlock_wrlock(lock_); }
+    ~WriteLock() { if(lock_) pthread_rwlock_unlock(lock_); }
+
+private:
+    pthread_rwlock_t* lock_;
+};
+
+} // namespace
+
+const unsigned long KDTree::noNode;
+const unsigned long KDTree::minRebuildSize;
+
+KDTree::KDTree(int dim, const std::vector<std::vector<double> >& elements) : dim_(dim), n_(0), nodeData_(NULL), pointData_(NULL), permData_(NULL), nodeOfData_(NULL), lock_(NULL), epsilon_(0), pruneFactor_(1), maxVisits_(0), alpha_(0.75), memory_(MemoryTracker::KD_TREE)
 {
     check(dim_ > 0, "invalid dimension " << dim_ << ", must be positive");
 
-    std::vector<unsigned long> elemsIndices(elements_.size());
-    for(unsigned long i = 0; i < elemsIndices.size(); ++i)
-        elemsIndices[i] = i;
+    reset(elements);
+}
 
-    depth_ = 0;
-    root_ = construct(elemsIndices, 0, elemsIndices.size(), 0, NULL);
+KDTree::KDTree(const char* fileName, long offset) : dim_(0), n_(0), nodeData_(NULL), pointData_(NULL), permData_(NULL), nodeOfData_(NULL), lock_(NULL), depth_(0), epsilon_(0), pruneFactor_(1), maxVisits_(0), alpha_(0.75), memory_(MemoryTracker::KD_TREE)
+{
+    check(offset >= 0, "invalid offset " << offset);
+
+    StandardException exc;
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    in.seekg(offset, std::ios::beg);
+
+    char magic[8];
+    int v, nodeSize;
+    unsigned long n;
+    in.read(magic, 8);
+    in.read((char*)(&v), sizeof(int));
+    in.read((char*)(&dim_), sizeof(int));
+    in.read((char*)(&depth_), sizeof(int));
+    in.read((char*)(&nodeSize), sizeof(int));
+    in.read((char*)(&n), sizeof(unsigned long));
+
+    if(!in || std::memcmp(magic, kdTreeMagic, 8) != 0 || v != kdTreeVersion || dim_ <= 0 || nodeSize != sizeof(Node))
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " does not contain a valid kd tree at offset " << offset << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    long dataOffset = in.tellg();
+    in.close();
+    dataOffset += (8 - dataOffset % 8) % 8;
+
+    const unsigned long dataSize = n * (sizeof(Node) + 2 * sizeof(unsigned long) + dim_ * sizeof(double));
+
+    if(n == 0)
+        return;
+
+    file_.map(fileName, dataOffset + dataSize, "kd tree");
+
+    const char* data = (const char*)file_.data() + dataOffset;
+    n_ = n;
+    nodeData_ = (const Node*)data;
+    data += n * sizeof(Node);
+    permData_ = (const unsigned long*)data;
+    data += n * sizeof(unsigned long);
+    nodeOfData_ = (const unsigned long*)data;
+    data += n * sizeof(unsigned long);
+    pointData_ = (const double*)data;
 }
 
 KDTree::~KDTree()
 {
-    destruct(root_);
+    setConcurrentAccess(false);
+}
+
+void
+KDTree::setConcurrentAccess(bool concurrent)
+{
+    if(concurrent == (lock_ != NULL))
+        return;
+
+    if(concurrent)
+    {
+        pthread_rwlock_t* lock = new pthread_rwlock_t;
+        const int res = pthread_rwlock_init(lock, NULL);
+        check(res == 0, "failed to initialize the lock");
+        lock_ = lock;
+    }
+    else
+    {
+        pthread_rwlock_t* lock = (pthread_rwlock_t*)lock_;
+        pthread_rwlock_destroy(lock);
+        delete lock;
+        lock_ = NULL;
+    }
+}
+
+void
+KDTree::writeIntoFile(const char* fileName) const
+{
+    // replaced only after it is written, so that a tree mapped from the old file (possibly this one) stays valid
+    Math::ReplacingOutputFile out(fileName);
+    writeIntoFile(out.stream());
+    out.commit();
+}
+
+void
+KDTree::writeIntoFile(std::ostream& out) const
+{
+    ReadLock lock(lock_);
+
+    const int nodeSize = sizeof(Node);
+    out.write(kdTreeMagic, 8);
+    out.write((const char*)(&kdTreeVersion), sizeof(int));
+    out.write((const char*)(&dim_), sizeof(int));
+    out.write((const char*)(&depth_), sizeof(int));
+    out.write((const char*)(&nodeSize), sizeof(int));
+    out.write((const char*)(&n_), sizeof(unsigned long));
+
+    // align the data to 8 bytes
+    const long position = out.tellp();
+    const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    out.write(zeros, (8 - position % 8) % 8);
+
+    out.write((const char*)nodeData_, n_ * sizeof(Node));
+    out.write((const char*)permData_, n_ * sizeof(unsigned long));
+    out.write((const char*)nodeOfData_, n_ * sizeof(unsigned long));
+    out.write((const char*)pointData_, n_ * dim_ * sizeof(double));
+
+    if(!out)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Failed to write the kd tree.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+KDTree::attach()
+{
+    file_.unmap();
+
+    n_ = perm_.size();
+    check(nodes_.size() == n_, "");
+    check(nodeOf_.size() == n_, "");
+    check(points_.size() == n_ * dim_, "");
+
+    nodeData_ = (n_ ? &(nodes_[0]) : NULL);
+    pointData_ = (n_ ? &(points_[0]) : NULL);
+    permData_ = (n_ ? &(perm_[0]) : NULL);
+    nodeOfData_ = (n_ ? &(nodeOf_[0]) : NULL);
+
+    memory_.set(nodes_.capacity() * sizeof(Node) + points_.capacity() * sizeof(double) + (perm_.capacity() + nodeOf_.capacity()) * sizeof(unsigned long));
+}
+
+void
+KDTree::detach()
+{
+    if(!file_.data())
+        return;
+
+    nodes_.assign(nodeData_, nodeData_ + n_);
+    points_.assign(pointData_, pointData_ + n_ * dim_);
+    perm_.assign(permData_, permData_ + n_);
+    nodeOf_.assign(nodeOfData_, nodeOfData_ + n_);
+
+    attach();
+}
+
+void
+KDTree::setApproximation(double epsilon, unsigned long maxVisits)
+{
+    check(epsilon >= 0, "invalid epsilon " << epsilon);
+
+    WriteLock lock(lock_);
+    epsilon_ = epsilon;
+    pruneFactor_ = (1 + epsilon) * (1 + epsilon);
+    maxVisits_ = maxVisits;
 }
 
 void
 KDTree::reset(const std::vector<std::vector<double> >& elements)
 {
-    elements_ = elements;
-    reBalance(); // assumes that rebalance destroys and reconstructs the tree
+    std::vector<double> points(elements.size() * dim_);
+    for(unsigned long i = 0; i < elements.size(); ++i)
+    {
+        check(elements[i].size() == dim_, "");
+        std::copy(elements[i].begin(), elements[i].end(), points.begin() + i * dim_);
+    }
+
+    WriteLock lock(lock_);
+    build(points);
 }
 
 void
 KDTree::reBalance()
 {
-    destruct(root_);
+    WriteLock lock(lock_);
+    detach();
+
+    // collect the points in the original order and rebuild
+    std::vector<double> points(points_.size());
+    for(unsigned long i = 0; i < perm_.size(); ++i)
+        std::copy(points_.begin() + i * dim_, points_.begin() + (i + 1) * dim_, points.begin() + perm_[i] * dim_);
+
+    build(points);
+}
+
+void
+KDTree::build(const std::vector<double>& points)
+{
+    check(points.size() % dim_ == 0, "");
+    const unsigned long n = points.size() / dim_;
 
-    std::vector<unsigned long> elemsIndices(elements_.size());
-    for(unsigned long i = 0; i < elemsIndices.size(); ++i)
+    std::vector<unsigned long> elemsIndices(n), slots(n);
+    for(unsigned long i = 0; i < n; ++i)
+    {
         elemsIndices[i] = i;
+        slots[i] = i;
+    }
+
+    nodes_.resize(n);
+    perm_.resize(n);
 
     depth_ = 0;
-    root_ = construct(elemsIndices, 0, elemsIndices.size(), 0, NULL);
+    if(n > 0)
+    {
+        unsigned long nextSlot = 0;
+        const unsigned long root = construct(points, elemsIndices, 0, n, 0, slots, nextSlot);
+        check(root == 0, "");
+        check(nextSlot == n, "");
+    }
+
+    points_.resize(n * dim_);
+    nodeOf_.resize(n);
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        std::copy(points.begin() + perm_[i] * dim_, points.begin() + (perm_[i] + 1) * dim_, points_.begin() + i * dim_);
+        nodeOf_[perm_[i]] = i;
+    }
+
+    attach();
+}
+
+void
+KDTree::setBalanceFactor(double alpha)
+{
+    check(alpha >= 0.5 && alpha <= 1, "invalid balance factor " << alpha << ", must be between 0.5 and 1");
+
+    WriteLock lock(lock_);
+    alpha_ = alpha;
 }
 
 void
@@ -45,81 +295,184 @@ KDTree::insert(const std::vector<double>& elem)
 {
     check(elem.size() == dim_, "");
 
-    elements_.push_back(elem);
+    WriteLock lock(lock_);
+    detach();
+
+    const unsigned long node = nodes_.size();
+    Node newNode;
+    newNode.left = noNode;
+    newNode.right = noNode;
+    newNode.depth = 0;
+    newNode.size = 1;
 
-    Node *node = new Node;
-    node->index = elements_.size() - 1;
-    node->left = NULL;
-    node->right = NULL;
+    points_.insert(points_.end(), elem.begin(), elem.end());
+    nodeOf_.push_back(perm_.size());
+    perm_.push_back(nodeOf_.size() - 1);
 
-    if(!root_)
+    if(node == 0)
     {
-        check(elements_.size() == 1, "");
-        node->depth = 0;
-        node->parent = NULL;
-        root_ = node;
+        nodes_.push_back(newNode);
+        attach();
 
         check(depth_ == 0, "");
         depth_ = 1;
         return;
     }
 
-    Node *current = root_;
+    unsigned long current = 0;
+    std::vector<unsigned long> path;
 
     while(true)
     {
-        const int compareIndex = current->depth % dim_;
-        const bool goLeft = elem[compareIndex] < elements_[current->index][compareIndex];
+        path.push_back(current);
+        ++(nodes_[current].size);
 
-        if(goLeft)
+        const int compareIndex = nodes_[current].depth % dim_;
+        const bool goLeft = elem[compareIndex] < points_[current * dim_ + compareIndex];
+
+        unsigned long& next = (goLeft ? nodes_[current].left : nodes_[current].right);
+        if(next == noNode)
         {
-            if(current->left)
+            next = node;
+            break;
+        }
+
+        current = next;
+    }
+
+    newNode.depth = nodes_[current].depth + 1;
+    nodes_.push_back(newNode);
+    attach();
+
+    depth_ = std::max(newNode.depth + 1, depth_);
+
+    if(alpha_ >= 1)
+        return;
+
+    // scapegoat rebalancing: rebuild the highest subtree on the path where one side has become too heavy
+    for(unsigned long i = 0; i < path.size(); ++i)
+    {
+        const Node& n = nodes_[path[i]];
+        if(n.size < minRebuildSize)
+            break;
+
+        const unsigned long leftSize = (n.left == noNode ? 0 : nodes_[n.left].size);
+        const unsigned long rightSize = (n.right == noNode ? 0 : nodes_[n.right].size);
+        if(std::max(leftSize, rightSize) > alpha_ * n.size)
+        {
+            const unsigned long newRoot = rebuild(path[i]);
+            if(i > 0)
             {
-                current = current->left;
-                continue;
+                Node& parent = nodes_[path[i - 1]];
+                if(parent.left == path[i])
+                    parent.left = newRoot;
+                else
+                {
+                    check(parent.right == path[i], "");
+                    parent.right = newRoot;
+                }
             }
             else
             {
-                current->left = node;
-                break;
+                check(newRoot == 0, "");
             }
+            break;
         }
-        
-        check(!goLeft, "");
-        if(current->right)
-        {
-            current = current->right;
-            continue;
-        }
+    }
+}
 
-        check(!current->right, "");
-        current->right = node;
-        break;
+unsigned long
+KDTree::rebuild(unsigned long root)
+{
+    const int depth = nodes_[root].depth;
+
+    // collect the nodes of the subtree
+    std::vector<unsigned long> slots;
+    slots.reserve(nodes_[root].size);
+    std::vector<unsigned long> stack(1, root);
+    while(!stack.empty())
+    {
+        const unsigned long current = stack.back();
+        stack.pop_back();
+        slots.push_back(current);
+        if(nodes_[current].right != noNode)
+            stack.push_back(nodes_[current].right);
+        if(nodes_[current].left != noNode)
+            stack.push_back(nodes_[current].left);
+    }
+
+    // the same slots are reused in increasing order, so the subtree root keeps the smallest one
+    std::sort(slots.begin(), slots.end());
+
+    const unsigned long m = slots.size();
+    std::vector<double> points(m * dim_);
+    std::vector<unsigned long> original(m), elemsIndices(m);
+    for(unsigned long i = 0; i < m; ++i)
+    {
+        std::copy(points_.begin() + slots[i] * dim_, points_.begin() + (slots[i] + 1) * dim_, points.begin() + i * dim_);
+        original[i] = perm_[slots[i]];
+        elemsIndices[i] = i;
     }
 
-    node->parent = current;
-    node->depth = current->depth + 1;
+    unsigned long nextSlot = 0;
+    const unsigned long newRoot = construct(points, elemsIndices, 0, m, depth, slots, nextSlot);
+    check(nextSlot == m, "");
+    check(newRoot == slots[0], "");
+
+    // construct stores the local indices in perm_, map them back
+    for(unsigned long i = 0; i < m; ++i)
+    {
+        const unsigned long slot = slots[i];
+        const unsigned long local = perm_[slot];
+        std::copy(points.begin() + local * dim_, points.begin() + (local + 1) * dim_, points_.begin() + slot * dim_);
+        perm_[slot] = original[local];
+        nodeOf_[original[local]] = slot;
+    }
+
+    return newRoot;
 }
 
 void
 KDTree::findNearestNeighbors(const std::vector<double> &point, int k, std::vector<std::vector<double> > *neighbors, std::vector<double> *distanceSquares) const
 {
-    std::vector<unsigned long> indices;
-    findNearestNeighbors(point, k, &indices, distanceSquares);
+    COSMO_PROFILE_REGION("kd_tree_nearest_neighbors");
 
-    check(indices.size() == k, "");
+    check(point.size() == dim_, "");
+
+    check(k >= 0, "invalid k");
+    check(neighbors, "");
 
     neighbors->resize(k);
+
+    if(distanceSquares)
+        distanceSquares->resize(k);
+
+    if(!k)
+        return;
+
+    ReadLock lock(lock_);
+
+    check(n_ >= k, k << " nearest neighbors requested but there are only " << n_ << " elements in the kd tree");
+
+    BoundedQueue bpq;
+    bpq.reserve(k + 1);
+    knn(&(point[0]), k, bpq);
+
+    // the points are copied while the lock is held, since a concurrent insertion can move them
     for(int i = 0; i < k; ++i)
     {
-        check(indices[i] < elements_.size(), "");
-        neighbors->at(i) = elements_[indices[i]];
+        const double* p = pointData_ + bpq[i].second * dim_;
+        neighbors->at(i).assign(p, p + dim_);
+        if(distanceSquares)
+            distanceSquares->at(i) = bpq[i].first;
     }
 }
 
 void
 KDTree::findNearestNeighbors(const std::vector<double>& point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares) const
 {
+    COSMO_PROFILE_REGION("kd_tree_nearest_neighbors");
+
     check(point.size() == dim_, "");
 
     check(k >= 0, "invalid k");
@@ -133,88 +486,289 @@ KDTree::findNearestNeighbors(const std::vector<double>& point, int k, std::vecto
     if(!k)
         return;
 
-    check(nElements() >= k, k << " nearest neighbors requested but there are only " << nElements() << " elements in the kd tree");
+    ReadLock lock(lock_);
 
-    ComparePair cp;
-    std::vector<std::pair<double, unsigned long> > container;
-    container.reserve(k + 1);
-    std::priority_queue<std::pair<double, unsigned long>, std::vector<std::pair<double, unsigned long> >, ComparePair> bpq(cp, container);
-    search(root_, bpq, k, point);
+    check(n_ >= k, k << " nearest neighbors requested but there are only " << n_ << " elements in the kd tree");
 
-    check(bpq.size() == k, "");
+    BoundedQueue bpq;
+    bpq.reserve(k + 1);
+    knn(&(point[0]), k, bpq);
 
-    for(int i = k - 1; i >= 0; --i)
+    for(int i = 0; i < k; ++i)
     {
-        check(!bpq.empty(), "");
-        indices->at(i) = bpq.top().second;
+        indices->at(i) = permData_[bpq[i].second];
         if(distanceSquares)
-            distanceSquares->at(i) = bpq.top().first;
-        bpq.pop();
+            distanceSquares->at(i) = bpq[i].first;
     }
+}
+
+void
+KDTree::findNearestNeighbors(const double* points, unsigned long nPoints, int k, unsigned long* indices, double* distanceSquares) const
+{
+    COSMO_PROFILE_REGION("kd_tree_nearest_neighbors_batch");
+
+    check(k >= 0, "invalid k");
+    check(indices || nPoints == 0 || k == 0, "");
+
+    if(!k || !nPoints)
+        return;
+
+    check(points, "");
+
+    // one shared lock for the whole batch, the worker threads search under it
+    ReadLock lock(lock_);
+
+    check(n_ >= k, k << " nearest neighbors requested but there are only " << n_ << " elements in the kd tree");
+
+    const long n = nPoints;
+#pragma omp parallel default(shared)
+    {
+        // each thread reuses its own heap for all of its queries
+        BoundedQueue bpq;
+        bpq.reserve(k + 1);
 
-    check(bpq.empty(), "");
+#pragma omp for schedule(dynamic, 64)
+        for(long i = 0; i < n; ++i)
+        {
+            knn(points + i * dim_, k, bpq);
+
+            for(int j = 0; j < k; ++j)
+            {
+                indices[i * k + j] = permData_[bpq[j].second];
+                if(distanceSquares)
+                    distanceSquares[i * k + j] = bpq[j].first;
+            }
+        }
+    }
 }
 
 void
-KDTree::search(const Node *current, std::priority_queue<std::pair<double, unsigned long>, std::vector<std::pair<double, unsigned long> >, ComparePair>& bpq, int k, const std::vector<double>& point) const
+KDTree::knn(const double* point, int k, BoundedQueue& bpq) const
 {
     check(k > 0, "");
+
+    bpq.clear();
+    unsigned long visits = 0;
+
+    // fixed dimension versions for the common cases, so that the distance loops can be unrolled and vectorized
+    switch(dim_)
+    {
+    case 1:
+        search<1>(0, bpq, k, point, visits);
+        break;
+    case 2:
+        search<2>(0, bpq, k, point, visits);
+        break;
+    case 3:
+        search<3>(0, bpq, k, point, visits);
+        break;
+    case 4:
+        search<4>(0, bpq, k, point, visits);
+        break;
+    case 5:
+        search<5>(0, bpq, k, point, visits);
+        break;
+    case 6:
+        search<6>(0, bpq, k, point, visits);
+        break;
+    case 7:
+        search<7>(0, bpq, k, point, visits);
+        break;
+    case 8:
+        search<8>(0, bpq, k, point, visits);
+        break;
+    case 10:
+        search<10>(0, bpq, k, point, visits);
+        break;
+    case 12:
+        search<12>(0, bpq, k, point, visits);
+        break;
+    case 16:
+        search<16>(0, bpq, k, point, visits);
+        break;
+    case 20:
+        search<20>(0, bpq, k, point, visits);
+        break;
+    default:
+        search<0>(0, bpq, k, point, visits);
+        break;
+    }
+    check(bpq.size() == k, "");
+
+    // sorts by increasing distance
+    ComparePair cp;
+    std::sort_heap(bpq.begin(), bpq.end(), cp);
+}
+
+void
+KDTree::findWithinRadius(const std::vector<double>& point, double radius, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares) const
+{
     check(point.size() == dim_, "");
+    check(radius >= 0, "invalid radius " << radius);
+    check(indices, "");
 
-    if(!current)
-        return;
+    ReadLock lock(lock_);
 
-    check(current->index < elements_.size(), "");
-    const std::vector<double>& v = elements_[current->index];
-    check(v.size() == dim_, "");
+    std::vector<std::pair<double, unsigned long> > found;
+    if(n_ > 0)
+        searchRadius(0, &(point[0]), radius * radius, found);
 
-    // calculate distance
-    double distance = 0;
-    for(int i = 0; i < dim_; ++i)
+    std::sort(found.begin(), found.end());
+
+    indices->resize(found.size());
+    if(distanceSquares)
+        distanceSquares->resize(found.size());
+
+    for(unsigned long i = 0; i < found.size(); ++i)
     {
-        const double delta = point[i] - v[i];
-        distance += delta * delta; // euclidean distance squared
+        (*indices)[i] = permData_[found[i].second];
+        if(distanceSquares)
+            (*distanceSquares)[i] = found[i].first;
     }
+}
 
-    check(bpq.size() <= k, "");
+bool
+KDTree::hasPointWithin(const std::vector<double>& point, double radius, unsigned long *index) const
+{
+    check(point.size() == dim_, "");
+    check(radius >= 0, "invalid radius " << radius);
 
-    bpq.emplace(distance, current->index);
-    if(bpq.size() > k)
-        bpq.pop();
+    ReadLock lock(lock_);
 
-    check(bpq.size() <= k, "");
+    if(n_ == 0)
+        return false;
 
-    const int index = current->depth % dim_;
-    const bool goLeft = point[index] < v[index];
+    const unsigned long node = searchAny(0, &(point[0]), radius * radius);
+    if(node == noNode)
+        return false;
 
-    if(goLeft)
-        search(current->left, bpq, k, point);
-    else
-        search(current->right, bpq, k, point);
+    if(index)
+        *index = permData_[node];
 
-    bool goOtherSide = false;
-    if(bpq.size() < k)
-        goOtherSide = true;
-    else
+    return true;
+}
+
+void
+KDTree::searchRadius(unsigned long current, const double* point, double radiusSq, std::vector<std::pair<double, unsigned long> >& found) const
+{
+    while(current != noNode)
     {
+        const double* v = &(pointData_[current * dim_]);
+
+        double distance = 0;
+        for(int i = 0; i < dim_; ++i)
+        {
+            const double delta = point[i] - v[i];
+            distance += delta * delta;
+        }
+
+        if(distance <= radiusSq)
+            found.push_back(std::make_pair(distance, current));
+
+        const Node& node = nodeData_[current];
+        const int index = node.depth % dim_;
         const double delta = point[index] - v[index];
-        const double deltaSq = delta * delta;
+        const bool goLeft = delta < 0;
 
-        check(!bpq.empty(), "");
-        const double maxDist = bpq.top().first;
+        // the other side only needs to be searched if the splitting plane is within the radius
+        if(delta * delta <= radiusSq)
+            searchRadius(goLeft ? node.right : node.left, point, radiusSq, found);
 
-        if(deltaSq <= maxDist)
-            goOtherSide = true;
+        current = (goLeft ? node.left : node.right);
     }
+}
+
+unsigned long
+KDTree::searchAny(unsigned long current, const double* point, double radiusSq) const
+{
+    while(current != noNode)
+    {
+        const double* v = &(pointData_[current * dim_]);
+
+        double distance = 0;
+        for(int i = 0; i < dim_ && distance <= radiusSq; ++i)
+        {
+            const double delta = point[i] - v[i];
+            distance += delta * delta;
+        }
 
-    if(!goOtherSide)
+        if(distance <= radiusSq)
+            return current;
+
+        const Node& node = nodeData_[current];
+        const int index = node.depth % dim_;
+        const double delta = point[index] - v[index];
+        const bool goLeft = delta < 0;
+
+        // the near side is searched first since it is more likely to contain the point
+        if(delta * delta <= radiusSq)
+        {
+            const unsigned long res = searchAny(goLeft ? node.left : node.right, point, radiusSq);
+            if(res != noNode)
+                return res;
+
+            current = (goLeft ? node.right : node.left);
+        }
+        else
+            current = (goLeft ? node.left : node.right);
+    }
+
+    return noNode;
+}
+
+template<int D>
+void
+KDTree::search(unsigned long current, BoundedQueue& bpq, int k, const double* point, unsigned long& visits) const
+{
+    check(k > 0, "");
+
+    if(current == noNode)
         return;
 
-    // search the other branch
-    if(goLeft)
-        search(current->right, bpq, k, point);
-    else
-        search(current->left, bpq, k, point);
+    if(maxVisits_ && visits >= maxVisits_ && bpq.size() == k)
+        return;
+
+    ++visits;
+
+    check(current < n_, "");
+    const double* v = &(pointData_[current * dim_]);
+
+    // calculate distance
+    const int dim = (D > 0 ? D : dim_);
+    double distance = 0;
+    for(int i = 0; i < dim; ++i)
+    {
+        const double delta = point[i] - v[i];
+        distance += delta * delta; // euclidean distance squared
+    }
+
+    check(bpq.size() <= k, "");
+
+    ComparePair cp;
+    if(bpq.size() < k)
+    {
+        bpq.push_back(std::make_pair(distance, current));
+        std::push_heap(bpq.begin(), bpq.end(), cp);
+    }
+    else if(distance < bpq.front().first)
+    {
+        std::pop_heap(bpq.begin(), bpq.end(), cp);
+        bpq.back() = std::make_pair(distance, current);
+        std::push_heap(bpq.begin(), bpq.end(), cp);
+    }
+
+    check(bpq.size() <= k, "");
+
+    const Node& node = nodeData_[current];
+    const int index = node.depth % dim;
+    const bool goLeft = point[index] < v[index];
+    const double delta = point[index] - v[index];
+
+    search<D>(goLeft ? node.left : node.right, bpq, k, point, visits);
+
+    // search the other branch only if it can contain closer points (closer by at least a factor of 1 + epsilon for approximate searches)
+    if(bpq.size() < k || delta * delta * pruneFactor_ <= bpq.front().first)
+        search<D>(goLeft ? node.right : node.left, bpq, k, point, visits);
 }
 
 namespace
@@ -224,68 +778,52 @@ struct CompareKDTreeNode
 {
     int dim;
     int compareIndex;
-    const std::vector<std::vector<double> > *elements;
+    const double* points;
 
     bool operator() (unsigned long a, unsigned long b) const
     {
         check(dim > 0, "");
         check(compareIndex < dim, "");
 
-        check(a < elements->size(), "");
-        check(b < elements->size(), "");
-
-        const std::vector<double> &aVec = elements->at(a);
-        const std::vector<double> &bVec = elements->at(b);
-
-        check(aVec.size() == dim, "");
-        check(bVec.size() == dim, "");
-
-        return aVec[compareIndex] < bVec[compareIndex];
+        return points[a * dim + compareIndex] < points[b * dim + compareIndex];
     }
 };
 
 }
 
-KDTree::Node*
-KDTree::construct(std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, Node *parent)
+unsigned long
+KDTree::construct(const std::vector<double>& points, std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, const std::vector<unsigned long>& slots, unsigned long& nextSlot)
 {
     check(end >= begin, "");
     check(end <= elementsIndices.size(), "");
 
     if(end == begin)
-        return NULL;
+        return noNode;
 
     CompareKDTreeNode comp;
     comp.dim = dim_;
     comp.compareIndex = depth % dim_;
-    comp.elements = &elements_;
-
-    std::vector<unsigned long>::iterator beginIt = elementsIndices.begin() + begin, endIt = elementsIndices.begin() + end;
-    std::sort(beginIt, endIt, comp);
+    comp.points = &(points[0]);
 
     unsigned long median = (begin + end) / 2;
     check(median >= begin && median < end, "");
 
-    Node* node = new Node;
-    node->index = elementsIndices[median];
-    node->depth = depth;
-    node->parent = parent;
-    node->left = construct(elementsIndices, begin, median, depth + 1, node);
-    node->right = construct(elementsIndices, median + 1, end, depth + 1, node);
+    std::vector<unsigned long>::iterator beginIt = elementsIndices.begin() + begin, endIt = elementsIndices.begin() + end;
+    std::nth_element(beginIt, elementsIndices.begin() + median, endIt, comp);
 
-    depth_ = std::max(depth + 1, depth_);
+    // the nodes are assigned to the slots depth first, the left subtree immediately follows its parent
+    check(nextSlot < slots.size(), "");
+    const unsigned long node = slots[nextSlot++];
+    nodes_[node].depth = depth;
+    nodes_[node].size = end - begin;
+    perm_[node] = elementsIndices[median];
 
-    return node;
-}
+    const unsigned long left = construct(points, elementsIndices, begin, median, depth + 1, slots, nextSlot);
+    const unsigned long right = construct(points, elementsIndices, median + 1, end, depth + 1, slots, nextSlot);
+    nodes_[node].left = left;
+    nodes_[node].right = right;
 
-void
-KDTree::destruct(Node* root)
-{
-    if(!root)
-        return;
+    depth_ = std::max(depth + 1, depth_);
 
-    destruct(root->left);
-    destruct(root->right);
-    delete root;
+    return node;
 }
-
@@ -5,6 +5,7 @@
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <lbfgs.hpp>
+#include <vector_kernels.hpp>
 #include <random.hpp>
 #include <cosmo_mpi.hpp>
 
@@ -324,15 +325,14 @@ void
 BasicLargeVector::copy(const BasicLargeVector& other, double c)
 {
     check(v_.size() == other.v_.size(), "");
-    for(int i = 0; i < v_.size(); ++i)
-        v_[i] = c * other.v_[i];
+    if(!v_.empty())
+        VectorKernels::copy(long(v_.size()), c, &(other.v_[0]), &(v_[0]));
 }
 
 void
 BasicLargeVector::setToZero()
 {
-    for(int i = 0; i < v_.size(); ++i)
-        v_[i] = 0;
+    std::fill(v_.begin(), v_.end(), 0.0);
 }
 
 double
@@ -346,8 +346,67 @@ BasicLargeVector::dotProduct(const BasicLargeVector& other) const
 {
     check(other.v_.size() == v_.size(), "");
     double s = 0;
-    for(int i = 0; i < v_.size(); ++i)
-        s += v_[i] * other.v_[i];
+    if(!v_.empty())
+        s = VectorKernels::dotProduct(long(v_.size()), &(v_[0]), &(other.v_[0]));
+
+    double total = s;
+#ifdef COSMO_MPI
+    CosmoMPI::create().reduce(&s, &total, 1, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+    CosmoMPI::create().bcast(&total, 1, CosmoMPI::DOUBLE);
+#endif
+    return total;
+}
+
+void
+BasicLargeVector::dotProducts(int n, const BasicLargeVector* const* others, double* res) const
+{
+    check(n >= 0, "");
+    if(n == 0)
+        return;
+
+    terms_.resize(n);
+    for(int j = 0; j < n; ++j)
+    {
+        check(others[j]->v_.size() == v_.size(), "");
+        terms_[j] = (v_.empty() ? NULL : &(others[j]->v_[0]));
+    }
+
+    sums_.assign(n, 0);
+    if(!v_.empty())
+        VectorKernels::dotProducts(long(v_.size()), n, &(v_[0]), &(terms_[0]), &(sums_[0]));
+
+    std::copy(sums_.begin(), sums_.end(), res);
+#ifdef COSMO_MPI
+    CosmoMPI::create().reduce(&(sums_[0]), res, n, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+    CosmoMPI::create().bcast(res, n, CosmoMPI::DOUBLE);
+#endif
+}
+
+void
+BasicLargeVector::linearCombination(int n, const double* c, const BasicLargeVector* const* v)
+{
+    check(n > 0, "");
+
+    // reused, so that nothing is allocated after the first call
+    terms_.resize(n);
+    for(int j = 0; j < n; ++j)
+    {
+        check(v[j]->v_.size() == v_.size(), "");
+        terms_[j] = (v_.empty() ? NULL : &(v[j]->v_[0]));
+    }
+
+    if(!v_.empty())
+        VectorKernels::linearCombination(long(v_.size()), n, c, &(terms_[0]), &(v_[0]));
+}
+
+double
+BasicLargeVector::addAndWeightedSquare(const BasicLargeVector& other, double c, const BasicLargeVector& w)
+{
+    check(other.v_.size() == v_.size(), "");
+    check(w.v_.size() == v_.size(), "");
+    double s = 0;
+    if(!v_.empty())
+        s = VectorKernels::addAndWeightedSquare(long(v_.size()), c, &(other.v_[0]), &(w.v_[0]), &(v_[0]));
 
     double total = s;
 #ifdef COSMO_MPI
@@ -361,34 +420,37 @@ void
 BasicLargeVector::add(const BasicLargeVector& other, double c)
 {
     check(other.v_.size() == v_.size(), "");
-    for(int i = 0; i < v_.size(); ++i)
-        v_[i] += c * other.v_[i];
+    if(!v_.empty())
+        VectorKernels::add(long(v_.size()), c, &(other.v_[0]), &(v_[0]));
 }
 
 void
 BasicLargeVector::multiply(const BasicLargeVector& other)
 {
     check(other.v_.size() == v_.size(), "");
-    for(int i = 0; i < v_.size(); ++i)
-        v_[i] *= other.v_[i];
+    if(!v_.empty())
+        VectorKernels::multiply(long(v_.size()), &(other.v_[0]), &(v_[0]));
 }
 
 void
 BasicLargeVector::divide(const BasicLargeVector& other)
 {
     check(other.v_.size() == v_.size(), "");
+#ifdef CHECKS_ON
     for(int i = 0; i < v_.size(); ++i)
     {
         check(other.v_[i] != 0, "division by 0 at index" << i);
-        v_[i] /= other.v_[i];
     }
+#endif
+    if(!v_.empty())
+        VectorKernels::divide(long(v_.size()), &(other.v_[0]), &(v_[0]));
 }
 
 void
 BasicLargeVector::pow(double p)
 {
-    for(int i = 0; i < v_.size(); ++i)
-        v_[i] = std::pow(v_[i], p);
+    if(!v_.empty())
+        VectorKernels::pow(long(v_.size()), p, &(v_[0]));
 }
 
 void
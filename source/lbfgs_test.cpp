@@ -1,4 +1,5 @@
 #include <cmath>
+#include <sstream>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -9,11 +9,91 @@
 #include <sstream>
 #include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <atomic>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <learn_as_you_go.hpp>
 #include <exception_handler.hpp>
 
-LearnAsYouGo::LearnAsYouGo(int nPoints, int nData, const Math::RealFunctionMultiToMulti& f, const Math::RealFunctionMultiDim& errorFunc, unsigned long minCount, double precision, const char* fileName) : nPoints_(nPoints), nData_(nData), f_(f), errorFunc_(errorFunc), minCount_(minCount), precision_(precision), fileName_(fileName), gen_(std::time(0), 0, 1), fa_(NULL), fast_(NULL)
+const unsigned long LearnAsYouGo::noPoint;
+
+namespace
+{
+
+// the number of random candidates for each point chosen by active learning
+const int activeLearningCandidates = 20;
+
+// the header of the node shared memory, the points start right after it
+const unsigned long sharedHeaderSize = 64;
+
+inline std::atomic<unsigned long>&
+sharedCount(void* base)
+{
+    return *((std::atomic<unsigned long>*) base);
+}
+
+const char snapshotMagic[8] = {'C', 'O', 'S', 'M', 'O', 'L', 'Y', 'G'};
+const int snapshotVersion = 1;
+
+// the compressed snapshot has the same header, followed by the error ratios and then the points compressed with BlockCompression::compressRecords
+const int snapshotCompressedVersion = 2;
+const unsigned long snapshotBlockRecords = 1024;
+
+// the header of the snapshot file, followed by the error ratios and then the points (input and output values for each)
+// the checksum is of everything after the header
+struct SnapshotHeader
+{
+    char magic[8];
+    int version;
+    int nPoints;
+    int nData;
+    int hasRatios;
+    double precision;
+    unsigned long minCount;
+    unsigned long dataSize;
+    unsigned long testSize;
+    unsigned long updateErrorThreshold;
+    unsigned long nRatios;
+    unsigned long long checksum;
+};
+
+static_assert(sizeof(SnapshotHeader) % sizeof(double) == 0, "the points in the snapshot need to be aligned");
+
+// FNV-1a on 64 bit words, size must be a multiple of 8
+unsigned long long
+snapshotChecksum(const void* data, unsigned long size, unsigned long long h)
+{
+    const char* p = (const char*) data;
+    for(unsigned long i = 0; i < size; i += 8)
+    {
+        unsigned long long w;
+        std::memcpy(&w, p + i, 8);
+        h ^= w;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+const unsigned long long snapshotChecksumStart = 0xcbf29ce484222325ULL;
+
+// puts the error set (the points from begin to the end) back into the kd tree built on the rest of the points, by insertion instead of rebuilding the tree for all of the points
+// the whitening of the training part is kept, as with FastApproximator::reset without updating the covariance
+void
+addErrorSet(FastApproximator& fa, const std::vector<std::vector<double> >& points, const std::vector<const double*>& rows, unsigned long begin)
+{
+    check(rows.size() == points.size(), "");
+    for(unsigned long i = begin; i < points.size(); ++i)
+        fa.addPoint(points[i], rows[i]);
+}
+
+} // namespace
+
+LearnAsYouGo::LearnAsYouGo(int nPoints, int nData, const Math::RealFunctionMultiToMulti& f, const Math::RealFunctionMultiDim& errorFunc, unsigned long minCount, double precision, const char* fileName) : nPoints_(nPoints), nData_(nData), f_(f), errorFunc_(errorFunc), minCount_(minCount), precision_(precision), updateFile_(false), fileName_(fileName), gen_(std::time(0), 0, 1), fa_(NULL), fast_(NULL), pointTableCount_(0), syncComm_(NULL), syncReq_(NULL), syncNodeComm_(NULL), syncLeaderComm_(NULL), sharedWindow_(NULL), sharedBase_(NULL), sharedTable_(NULL), backgroundRebuild_(false), rebuildThread_(NULL), rebuildDone_(false), rebuildFa_(NULL), rebuildFast_(NULL), asyncCheckpoint_(true), checkpointThread_(NULL), checkpointDone_(false), snapshotCodec_(BlockCompression::NONE)
 {
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
@@ -24,14 +104,36 @@ LearnAsYouGo::LearnAsYouGo(int nPoints, int nData, const Math::RealFunctionMulti
     {
         updateFile_ = true;
         if(readFromFile(fileName_.c_str()))
+        {
+            CheckpointCoordinator::add(this);
             return;
+        }
     }
 
     construct();
+
+    if(updateFile_)
+        CheckpointCoordinator::add(this);
 }
 
 LearnAsYouGo::~LearnAsYouGo()
 {
+    if(updateFile_)
+        CheckpointCoordinator::remove(this);
+
+    waitForRebuild();
+    // a finished rebuild is swapped in so that the fast approximator saved below matches the order of the training set
+    if(rebuildFa_ && rebuildError_.empty())
+        finishRebuild();
+    if(rebuildFast_) delete rebuildFast_;
+    if(rebuildFa_) delete rebuildFa_;
+
+    waitForCheckpoint();
+    if(!checkpointError_.empty())
+    {
+        output_screen("WARNING: writing the checkpoint failed: " << checkpointError_ << std::endl);
+    }
+
     if(updateFile_)
         writeIntoFile(fileName_.c_str());
 
@@ -44,18 +146,46 @@ LearnAsYouGo::~LearnAsYouGo()
     if(fa_) delete fa_;
     if(fast_) delete fast_;
 
+    // all of the processes on the node need to get here, the shared memory is freed once nobody uses it
+    if(sharedWindow_)
+        CosmoMPI::create().freeNodeShared(sharedWindow_);
+
 #ifdef COSMO_MPI
-    for(int i = 0; i < updateRequests_.size(); ++i)
+    check(updateReceiveReq_.size() == nProcesses_, "");
+
+    // the pending receives are cancelled, otherwise a late update from another process would be written into the freed buffers
+    for(int i = 0; i < nProcesses_; ++i)
     {
-        //MPI_Status updateSt;
-        //MPI_Wait((MPI_Request*) updateRequests_[i], &updateSt);
-        delete (MPI_Request*) updateRequests_[i];
+        MPI_Request* req = (MPI_Request*) updateReceiveReq_[i];
+        if(*req != MPI_REQUEST_NULL)
+        {
+            MPI_Cancel(req);
+            MPI_Wait(req, MPI_STATUS_IGNORE);
+        }
+        delete req;
     }
 
-    check(updateReceiveReq_.size() == nProcesses_, "");
+    // an unfinished exchange cannot be cancelled (the other processes may have already stopped), so it is just abandoned
+    if(syncReq_)
+        delete (MPI_Request*) syncReq_;
 
-    for(int i = 0; i < nProcesses_; ++i)
-        delete (MPI_Request*) updateReceiveReq_[i];
+    if(syncComm_)
+    {
+        MPI_Comm_free((MPI_Comm*) syncComm_);
+        delete (MPI_Comm*) syncComm_;
+    }
+
+    if(syncNodeComm_)
+    {
+        MPI_Comm_free((MPI_Comm*) syncNodeComm_);
+        delete (MPI_Comm*) syncNodeComm_;
+    }
+
+    if(syncLeaderComm_)
+    {
+        MPI_Comm_free((MPI_Comm*) syncLeaderComm_);
+        delete (MPI_Comm*) syncLeaderComm_;
+    }
 #endif
 }
 
@@ -81,10 +211,23 @@ LearnAsYouGo::construct()
 
     firstUpdateRequested_ = false;
 
+    syncInterval_ = 0;
+    syncCalls_ = 0;
+    syncStage_ = 0;
+    syncSendCount_ = 0;
+
+    sharedCapacity_ = 0;
+    sharedSeen_ = 0;
+    sharedFull_ = false;
+    nodeMaster_ = true;
+
 #ifdef COSMO_MPI
     updateReceiveReq_.resize(nProcesses_);
     for(int i = 0; i < nProcesses_; ++i)
+    {
         updateReceiveReq_[i] = new MPI_Request;
+        *((MPI_Request*) updateReceiveReq_[i]) = MPI_REQUEST_NULL;
+    }
 #endif
 
     totalCount_ = 0;
@@ -92,6 +235,8 @@ LearnAsYouGo::construct()
     successfulCount_ = 0;
 
     logFile_ = NULL;
+    logTiming_ = false;
+    lastPath_ = CALCULATED;
 
     // memory allocation
     check(nPoints_ > 0, "");
@@ -114,6 +259,135 @@ LearnAsYouGo::construct()
 
 bool
 LearnAsYouGo::readFromFile(const char* fileName)
+{
+    const int fd = open(fileName, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return readLegacyFile(fileName);
+    }
+
+    SnapshotHeader header;
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || std::memcmp(header.magic, snapshotMagic, 8) != 0)
+    {
+        close(fd);
+        return readLegacyFile(fileName);
+    }
+
+    StandardException exc;
+    const unsigned long recordSize = (unsigned long)(header.nPoints + header.nData) * sizeof(double);
+    const bool compressed = (header.version == snapshotCompressedVersion);
+    const unsigned long ratiosEnd = sizeof(SnapshotHeader) + header.nRatios * sizeof(double);
+    const unsigned long expectedSize = ratiosEnd + header.dataSize * recordSize;
+    const bool sizeOk = (compressed ? st.st_size > ratiosEnd : st.st_size == expectedSize);
+    if((header.version != snapshotVersion && !compressed) || header.nPoints != nPoints_ || header.nData != nData_ || !sizeOk || header.testSize == 0)
+    {
+        close(fd);
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " cannot be used. It has version " << header.version << " (expected " << snapshotVersion << " or " << snapshotCompressedVersion << "), dimensions " << header.nPoints << " and " << header.nData << " (expected " << nPoints_ << " and " << nData_ << "), and size " << st.st_size << " (expected " << (compressed ? "more than " : "") << (compressed ? ratiosEnd : expectedSize) << ").";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    // the pages are shared by all of the processes mapping the file
+    close(fd);
+    snapshot_.map(fileName, st.st_size, "snapshot");
+
+    const char* payload = (const char*) snapshot_.data() + sizeof(SnapshotHeader);
+    if(snapshotChecksum(payload, st.st_size - sizeof(SnapshotHeader), snapshotChecksumStart) != header.checksum)
+    {
+        snapshot_.unmap();
+        std::stringstream exceptionStr;
+        exceptionStr << "The checksum of the file " << fileName << " doesn't match, the file is corrupted.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    const double* ratiosBegin = (const double*) payload;
+    const std::vector<double> ratios(ratiosBegin, ratiosBegin + header.nRatios);
+
+    if(compressed)
+    {
+        // the blocks are decompressed in parallel, the output values are then owned by this object and the file is not needed anymore
+        std::vector<double> records;
+        try
+        {
+            CompressedRecords compressedRecords((const char*) snapshot_.data() + ratiosEnd, st.st_size - ratiosEnd, fileName);
+            if(compressedRecords.recordLength() != nPoints_ + nData_ || compressedRecords.size() != header.dataSize)
+            {
+                std::stringstream exceptionStr;
+                exceptionStr << "The file " << fileName << " contains " << compressedRecords.size() << " compressed points of length " << compressedRecords.recordLength() << ", expected " << header.dataSize << " of length " << nPoints_ + nData_ << ".";
+                exc.set(exceptionStr.str());
+                throw exc;
+            }
+            records.resize(header.dataSize * (nPoints_ + nData_));
+            if(!records.empty())
+                compressedRecords.decompress(&(records[0]));
+        }
+        catch (...)
+        {
+            snapshot_.unmap();
+            throw;
+        }
+        snapshot_.unmap();
+
+        precision_ = header.precision;
+        minCount_ = header.minCount;
+        check(precision_ > 0, "");
+        check(minCount_ >= 10, "");
+
+        construct();
+
+        points_.resize(header.dataSize);
+        data_.resize(header.dataSize);
+        dataRows_.resize(header.dataSize);
+        for(unsigned long i = 0; i < header.dataSize; ++i)
+        {
+            const double* record = &(records[i * (nPoints_ + nData_)]);
+            points_[i].assign(record, record + nPoints_);
+            data_[i].assign(record + nPoints_, record + nPoints_ + nData_);
+            dataRows_[i] = &(data_[i][0]);
+        }
+    }
+    else
+    {
+        precision_ = header.precision;
+        minCount_ = header.minCount;
+        check(precision_ > 0, "");
+        check(minCount_ >= 10, "");
+
+        construct();
+
+        const double* records = ratiosBegin + header.nRatios;
+        points_.resize(header.dataSize);
+        dataRows_.resize(header.dataSize);
+        for(unsigned long i = 0; i < header.dataSize; ++i)
+        {
+            const double* record = records + i * (nPoints_ + nData_);
+            points_[i].assign(record, record + nPoints_);
+            dataRows_[i] = record + nPoints_;
+        }
+    }
+
+    testSize_ = header.testSize;
+    updateErrorThreshold_ = header.updateErrorThreshold;
+
+    resetPointMap();
+
+    output_screen1("Read " << points_.size() << " points from " << fileName << "." << std::endl);
+
+    if(points_.size() >= minCount_)
+        restoreFast(fastFileName(fileName).c_str(), (header.hasRatios ? &ratios : NULL));
+
+    return true;
+}
+
+bool
+LearnAsYouGo::readLegacyFile(const char* fileName)
 {
     std::ifstream in(fileName, std::ios::binary | std::ios::in);
     StandardException exc;
@@ -137,11 +411,13 @@ LearnAsYouGo::readFromFile(const char* fileName)
     in.read((char*)(&dataSize), sizeof(dataSize));
     points_.resize(dataSize);
     data_.resize(dataSize);
+    dataRows_.resize(dataSize);
 
     for(unsigned long i = 0; i < dataSize; ++i)
     {
         points_[i].resize(nPoints_);
         data_[i].resize(nData_);
+        dataRows_[i] = &(data_[i][0]);
 
         in.read((char*)(&(points_[i][0])), nPoints_ * sizeof(double));
         in.read((char*)(&(data_[i][0])), nData_ * sizeof(double));
@@ -153,239 +429,740 @@ LearnAsYouGo::readFromFile(const char* fileName)
 
     if(points_.size() >= minCount_)
     {
-        constructFast();
+        constructFast(fastFileName(fileName).c_str());
     }
 
     return true;
 }
 
 void
-LearnAsYouGo::writeIntoFile(const char* fileName) const
+LearnAsYouGo::restoreFast(const char* fastFile, const std::vector<double>* ratios)
 {
-    if(processId_ != 0)
-        return;
+    check(!fa_, "");
+    check(!fast_, "");
 
-    std::ofstream out(fileName, std::ios::binary | std::ios::out);
-    StandardException exc;
-    if(!out)
+    if(ratios)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot writo into output file " << fileName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        try
+        {
+            fa_ = new FastApproximator(nPoints_, nData_, neighborCount(), fastFile, points_.size(), &dataRows_);
+        }
+        catch (std::exception& e)
+        {
+            fa_ = NULL;
+        }
     }
 
-    check(nPoints_ > 0, "");
-    check(nData_ > 0, "");
-    check(precision_ > 0, "");
-    check(minCount_ > 10, "");
-
-    out.write((char*)(&nPoints_), sizeof(nPoints_));
-    out.write((char*)(&nData_), sizeof(nData_));
-    out.write((char*)(&precision_), sizeof(precision_));
-    out.write((char*)(&minCount_), sizeof(minCount_));
-
-    unsigned long dataSize = points_.size();
-    check(data_.size() == dataSize, "");
-    check(pointMap_.size() == dataSize, "");
-
-    out.write((char*)(&dataSize), sizeof(dataSize));
-    for(unsigned long i = 0; i < dataSize; ++i)
+    if(!fa_)
     {
-        out.write((char*)(&(points_[i][0])), nPoints_ * sizeof(double));
-        out.write((char*)(&(data_[i][0])), nData_ * sizeof(double));
+        constructFast(fastFile);
+        return;
     }
 
-    out.close();
-}
-
-void
-LearnAsYouGo::resetPointMap()
-{
-    pointMap_.clear();
-    for(unsigned long i = 0; i < points_.size(); ++i)
-        pointMap_[points_[i]] = i;
+    fast_ = new FastApproximatorError(*fa_, *ratios, errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, precision_);
+    output_screen1("Restored the fast approximator from " << fastFile << "." << std::endl);
 }
 
 void
-LearnAsYouGo::logIntoFile(const char* fileNameBase)
+LearnAsYouGo::writeIntoFile(const char* fileName) const
 {
-    check(!logFile_, "log file already initialized");
+    if(processId_ != 0)
+        return;
 
-    std::stringstream fileName;
-    fileName << fileNameBase;
-    
-    if(nProcesses_ > 1)
-        fileName << '_' << processId_;
+    check(dataRows_.size() == points_.size(), "");
+    check(pointTableCount_ == points_.size(), "");
 
-    fileName << ".txt";
+    // the fast approximator is written first, the main file is only replaced once it is there
+    if(fa_)
+        fa_->writeIntoFile(fastFileName(fileName).c_str(), false);
 
-    logFile_ = new std::ofstream(fileName.str().c_str());
+    writeSnapshot(fileName, points_, dataRows_, (fast_ ? &(fast_->errorRatios()) : NULL), testSize_, updateErrorThreshold_, precision_);
 }
 
 void
-LearnAsYouGo::randomizeErrorSet()
+LearnAsYouGo::writeSnapshot(const char* fileName, const std::vector<std::vector<double> >& points, const std::vector<const double*>& rows, const std::vector<double>* ratios, unsigned long testSize, unsigned long updateErrorThreshold, double precision) const
 {
-    check(testSize_ > 0, "");
-    check(points_.size() > testSize_, "");
+    check(nPoints_ > 0, "");
+    check(nData_ > 0, "");
+    check(precision > 0, "");
+    check(minCount_ >= 10, "");
+    check(rows.size() == points.size(), "");
+
+    Math::ReplacingOutputFile file(fileName);
+    std::ofstream& out = file.stream();
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, snapshotMagic, 8);
+    header.version = snapshotVersion;
+    header.nPoints = nPoints_;
+    header.nData = nData_;
+    header.hasRatios = (ratios != NULL);
+    header.precision = precision;
+    header.minCount = minCount_;
+    header.dataSize = points.size();
+    header.testSize = testSize;
+    header.updateErrorThreshold = updateErrorThreshold;
+    header.nRatios = (ratios ? ratios->size() : 0);
+
+    // the header is written again at the end with the checksum
+    out.write((const char*)(&header), sizeof(header));
+
+    unsigned long long h = snapshotChecksumStart;
+    if(header.nRatios)
+    {
+        out.write((const char*)(&((*ratios)[0])), header.nRatios * sizeof(double));
+        h = snapshotChecksum(&((*ratios)[0]), header.nRatios * sizeof(double), h);
+    }
 
-    for(unsigned long i = points_.size() - testSize_; i < points_.size(); ++i)
+    if(snapshotCodec_ != BlockCompression::NONE)
     {
-        const double r = gen_.generate() * points_.size();
-        unsigned long index = (unsigned long) std::floor(r);
+        header.version = snapshotCompressedVersion;
 
-        check(index >= 0 && index <= points_.size(), "");
-        if(index == points_.size())
-            index = points_.size() - 1;
+        std::vector<double> records(points.size() * (nPoints_ + nData_));
+        for(unsigned long i = 0; i < points.size(); ++i)
+        {
+            check(points[i].size() == nPoints_, "");
+            std::copy(points[i].begin(), points[i].end(), records.begin() + i * (nPoints_ + nData_));
+            std::copy(rows[i], rows[i] + nData_, records.begin() + i * (nPoints_ + nData_) + nPoints_);
+        }
 
-        if(index != i)
+        // the compressed records are padded to 8 bytes, as needed by the checksum
+        std::vector<char> compressed;
+        BlockCompression::compressRecords(snapshotCodec_, (records.empty() ? NULL : &(records[0])), points.size(), nPoints_ + nData_, snapshotBlockRecords, compressed);
+        out.write(&(compressed[0]), compressed.size());
+        h = snapshotChecksum(&(compressed[0]), compressed.size(), h);
+    }
+    else
+    {
+        for(unsigned long i = 0; i < points.size(); ++i)
         {
-            points_[i].swap(points_[index]);
-            data_[i].swap(data_[index]);
+            check(points[i].size() == nPoints_, "");
+            out.write((const char*)(&(points[i][0])), nPoints_ * sizeof(double));
+            out.write((const char*)(rows[i]), nData_ * sizeof(double));
+            h = snapshotChecksum(&(points[i][0]), nPoints_ * sizeof(double), h);
+            h = snapshotChecksum(rows[i], nData_ * sizeof(double), h);
         }
     }
 
-    resetPointMap();
+    header.checksum = h;
+    out.seekp(0);
+    out.write((const char*)(&header), sizeof(header));
+    file.commit();
 }
 
 void
-LearnAsYouGo::setPrecision(double p)
+LearnAsYouGo::setAsyncCheckpoint(bool async)
 {
-    check(p > 0, "invalid precision " << p << ", must be positive");
-    precision_ = p;
+    if(!async)
+        waitForCheckpoint();
 
-    if(fast_)
-        fast_->setPrecision(precision_);
+    asyncCheckpoint_ = async;
 }
 
 void
-LearnAsYouGo::evaluate(const std::vector<double>& x, std::vector<double>* res, double *error1Sigma, double *error2Sigma, double *errorMean, double *errorVar)
+LearnAsYouGo::setSnapshotCompression(BlockCompression::Codec codec)
 {
-    receive();
-
-    check(x.size() == nPoints_, "");
+    if(!BlockCompression::isAvailable(codec))
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The compression codec " << (codec >= 0 && codec < BlockCompression::CODEC_MAX ? BlockCompression::codecName(codec) : "unknown") << " is not available.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
 
-    ++totalCount_;
+    // the checkpoint thread reads the codec
+    waitForCheckpoint();
+    snapshotCodec_ = codec;
+}
 
-    const std::map<std::vector<double>, unsigned long, PointComp>::const_iterator it = pointMap_.find(x);
+void
+LearnAsYouGo::startCheckpoint()
+{
+    if(processId_ != 0)
+        return;
 
-    if(it != pointMap_.end())
+    if(checkpointThread_)
     {
-        *res = data_[it->second];
-        ++sameCount_;
+        // the previous one is still being written, this one is skipped
+        if(!checkpointDone_.load(std::memory_order_acquire))
+            return;
 
-        if(error1Sigma) *error1Sigma = 0;
-        if(error2Sigma) *error2Sigma = 0;
-        if(errorMean) *errorMean = 0;
-        if(errorVar) *errorVar = 0;
+        waitForCheckpoint();
+    }
 
-        log();
-        return;
+    if(!checkpointError_.empty())
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Writing the checkpoint failed: " << checkpointError_;
+        checkpointError_.clear();
+        exc.set(exceptionStr.str());
+        throw exc;
     }
 
-    bool good = false;
+    // during a background rebuild the error set has been reordered but the current fast approximator has not, so the two files would not match
+    if(rebuildThread_)
+        return;
+
+    check(dataRows_.size() == points_.size(), "");
+
+    // the output values never move, so copying the pointers is enough
+    checkpointPoints_ = points_;
+    checkpointRows_ = dataRows_;
+    checkpointHasRatios_ = (fast_ != NULL);
     if(fast_)
-        good = fast_->approximate(x, *res, error1Sigma, error2Sigma, errorMean, errorVar);
+        checkpointRatios_ = fast_->errorRatios();
+    checkpointTestSize_ = testSize_;
+    checkpointThreshold_ = updateErrorThreshold_;
+    checkpointPrecision_ = precision_;
 
-    if(!good)
+    checkpointFast_.clear();
+    if(fa_)
     {
-        actual(x, res);
+        std::stringstream str(std::ios::out | std::ios::binary);
+        fa_->writeIntoStream(str, false);
+        checkpointFast_ = str.str();
+    }
 
-        if(error1Sigma) *error1Sigma = 0;
-        if(error2Sigma) *error2Sigma = 0;
-        if(errorMean) *errorMean = 0;
-        if(errorVar) *errorVar = 0;
+    checkpointDone_.store(false);
+    checkpointThread_ = new std::thread(&LearnAsYouGo::checkpoint, this);
+}
 
-        log();
+void
+LearnAsYouGo::startFlush()
+{
+    if(!updateFile_)
         return;
+
+    // the snapshot is not taken during a background rebuild
+    if(rebuildThread_)
+    {
+        waitForRebuild();
+        finishRebuild();
     }
 
-    ++successfulCount_;
+    waitForCheckpoint();
+    if(!checkpointError_.empty())
+    {
+        output_screen("WARNING: writing the previous checkpoint failed: " << checkpointError_ << std::endl);
+        checkpointError_.clear();
+    }
 
-    log();
+    output_screen1("Updating the file " << fileName_ << "." << std::endl);
+    if(asyncCheckpoint_)
+        startCheckpoint();
+    else
+        writeIntoFile(fileName_.c_str());
 }
 
 void
-LearnAsYouGo::evaluateExact(const std::vector<double>& x, std::vector<double>* res)
+LearnAsYouGo::finishFlush()
 {
-    check(x.size() == nPoints_, "");
+    waitForCheckpoint();
+    if(!checkpointError_.empty())
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Writing the checkpoint failed: " << checkpointError_;
+        checkpointError_.clear();
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
 
-    const std::map<std::vector<double>, unsigned long, PointComp>::const_iterator it = pointMap_.find(x);
+void
+LearnAsYouGo::checkpoint()
+{
+    try
+    {
+        if(!checkpointFast_.empty())
+        {
+            const std::string fastFile = fastFileName(fileName_.c_str());
+            Math::ReplacingOutputFile out(fastFile.c_str());
+            out.stream().write(checkpointFast_.data(), checkpointFast_.size());
+            out.commit();
+        }
 
-    if(it != pointMap_.end())
+        writeSnapshot(fileName_.c_str(), checkpointPoints_, checkpointRows_, (checkpointHasRatios_ ? &checkpointRatios_ : NULL), checkpointTestSize_, checkpointThreshold_, checkpointPrecision_);
+    }
+    catch (std::exception& e)
     {
-        *res = data_[it->second];
-        return;
+        checkpointError_ = e.what();
     }
 
-    actual(x, res);
+    checkpointDone_.store(true, std::memory_order_release);
 }
 
 void
-LearnAsYouGo::actual(const std::vector<double>& x, std::vector<double>* res)
+LearnAsYouGo::waitForCheckpoint()
 {
-    f_.evaluate(x, res);
+    if(!checkpointThread_)
+        return;
 
-    currentParams_ = x;
-    currentData_ = *res;
+    checkpointThread_->join();
+    delete checkpointThread_;
+    checkpointThread_ = NULL;
 
-    communicate();
-    addDataPoint(x, *res);
+    std::vector<std::vector<double> >().swap(checkpointPoints_);
+    std::vector<const double*>().swap(checkpointRows_);
+    std::string().swap(checkpointFast_);
 }
 
 void
-LearnAsYouGo::log()
+LearnAsYouGo::resetPointMap()
 {
-    if(logFile_)
+    unsigned long size = 64;
+    while(size < 2 * points_.size())
+        size *= 2;
+
+    pointTable_.assign(size, noPoint);
+    pointTableCount_ = 0;
+    for(unsigned long i = 0; i < points_.size(); ++i)
+        insertPoint(i);
+}
+
+unsigned long
+LearnAsYouGo::hashPoint(const std::vector<double>& p)
+{
+    unsigned long long h = 0;
+    for(int i = 0; i < p.size(); ++i)
     {
-        (*logFile_) << totalCount_ << '\t' << sameCount_ << '\t' << successfulCount_ << '\t' << totalCount_ - sameCount_ - successfulCount_ << std::endl;
+        unsigned long long bits;
+        std::memcpy(&bits, &(p[i]), sizeof(bits));
+
+        // 0 and -0 compare equal so they need to have the same hash (checked on the bits, since -ffast-math ignores the sign of zero)
+        if((bits << 1) == 0)
+            bits = 0;
+
+        // splitmix64 finalizer
+        h ^= bits + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
     }
+
+    return (unsigned long)h;
 }
 
-void
+unsigned long
+LearnAsYouGo::findSlot(const std::vector<double>& p) const
+{
+    if(pointTable_.empty())
+        return noPoint;
+
+    const unsigned long mask = pointTable_.size() - 1;
+    for(unsigned long slot = hashPoint(p) & mask; ; slot = (slot + 1) & mask)
+    {
+        const unsigned long index = pointTable_[slot];
+        if(index == noPoint)
+            return noPoint;
+
+        if(points_[index] == p)
+            return slot;
+    }
+}
+
+unsigned long
+LearnAsYouGo::findPoint(const std::vector<double>& p) const
+{
+    const unsigned long slot = findSlot(p);
+    return (slot == noPoint ? noPoint : pointTable_[slot]);
+}
+
+void
+LearnAsYouGo::swapPoints(unsigned long i, unsigned long j)
+{
+    check(i < points_.size() && j < points_.size(), "");
+
+    if(i == j)
+        return;
+
+    // the entry of a repeated point can refer to either copy, so nothing changes in the table
+    if(points_[i] == points_[j])
+    {
+        std::swap(dataRows_[i], dataRows_[j]);
+        return;
+    }
+
+    const unsigned long slotI = findSlot(points_[i]);
+    const unsigned long slotJ = findSlot(points_[j]);
+
+    points_[i].swap(points_[j]);
+    std::swap(dataRows_[i], dataRows_[j]);
+
+    // if the entry refers to another copy of the point it stays valid
+    if(slotI != noPoint && pointTable_[slotI] == i)
+        pointTable_[slotI] = j;
+    if(slotJ != noPoint && pointTable_[slotJ] == j)
+        pointTable_[slotJ] = i;
+}
+
+void
+LearnAsYouGo::insertPoint(unsigned long index)
+{
+    check(index < points_.size(), "");
+
+    // keep the load factor at most 1/2, the rebuilt table contains all of the points including this one
+    if(2 * (pointTableCount_ + 1) > pointTable_.size())
+    {
+        resetPointMap();
+        return;
+    }
+
+    const std::vector<double>& p = points_[index];
+    const unsigned long mask = pointTable_.size() - 1;
+    for(unsigned long slot = hashPoint(p) & mask; ; slot = (slot + 1) & mask)
+    {
+        const unsigned long other = pointTable_[slot];
+        if(other == noPoint)
+        {
+            pointTable_[slot] = index;
+            ++pointTableCount_;
+            return;
+        }
+
+        // a repeated point refers to its latest index
+        if(points_[other] == p)
+        {
+            pointTable_[slot] = index;
+            return;
+        }
+    }
+}
+
+void
+LearnAsYouGo::logIntoFile(const char* fileNameBase, bool timing)
+{
+    check(!logFile_, "log file already initialized");
+
+    std::stringstream fileName;
+    fileName << fileNameBase;
+    
+    if(nProcesses_ > 1)
+        fileName << '_' << processId_;
+
+    fileName << ".txt";
+
+    logFile_ = new std::ofstream(fileName.str().c_str());
+    logTiming_ = timing;
+}
+
+void
+LearnAsYouGo::randomizeErrorSet()
+{
+    check(testSize_ > 0, "");
+    check(points_.size() > testSize_, "");
+
+    for(unsigned long i = points_.size() - testSize_; i < points_.size(); ++i)
+    {
+        const double r = gen_.generate() * points_.size();
+        unsigned long index = (unsigned long) std::floor(r);
+
+        check(index >= 0 && index <= points_.size(), "");
+        if(index == points_.size())
+            index = points_.size() - 1;
+
+        swapPoints(i, index);
+    }
+}
+
+void
+LearnAsYouGo::setPrecision(double p)
+{
+    check(p > 0, "invalid precision " << p << ", must be positive");
+    precision_ = p;
+
+    if(fast_)
+        fast_->setPrecision(precision_);
+}
+
+void
+LearnAsYouGo::evaluate(const std::vector<double>& x, std::vector<double>* res, double *error1Sigma, double *error2Sigma, double *errorMean, double *errorVar)
+{
+    if(logTiming_)
+        evaluateStart_ = std::chrono::steady_clock::now();
+
+    if(rebuildThread_)
+        finishRebuild();
+
+    receive();
+
+    check(x.size() == nPoints_, "");
+
+    ++totalCount_;
+
+    const unsigned long index = findPoint(x);
+
+    if(index != noPoint)
+    {
+        res->assign(dataRows_[index], dataRows_[index] + nData_);
+        ++sameCount_;
+
+        if(error1Sigma) *error1Sigma = 0;
+        if(error2Sigma) *error2Sigma = 0;
+        if(errorMean) *errorMean = 0;
+        if(errorVar) *errorVar = 0;
+
+        log(SAME_POINT);
+        return;
+    }
+
+    bool good = false;
+    if(fast_)
+        good = fast_->approximate(x, *res, error1Sigma, error2Sigma, errorMean, errorVar);
+
+    if(!good)
+    {
+        actual(x, res);
+
+        if(error1Sigma) *error1Sigma = 0;
+        if(error2Sigma) *error2Sigma = 0;
+        if(errorMean) *errorMean = 0;
+        if(errorVar) *errorVar = 0;
+
+        log(CALCULATED);
+        return;
+    }
+
+    ++successfulCount_;
+
+    log(APPROXIMATED);
+}
+
+bool
+LearnAsYouGo::evaluateWithGradient(const std::vector<double>& x, std::vector<double>* res, std::vector<std::vector<double> >* gradient, std::vector<std::vector<double> >* hessian)
+{
+    check(gradient, "");
+
+    evaluate(x, res);
+
+    if(!fast_)
+        return false;
+
+    check(fa_, "");
+    std::vector<double> val;
+    return fa_->approximateWithGradient(x, val, *gradient, FastApproximator::QUADRATIC_INTERPOLATION, hessian);
+}
+
+void
+LearnAsYouGo::evaluateExact(const std::vector<double>& x, std::vector<double>* res)
+{
+    check(x.size() == nPoints_, "");
+
+    const unsigned long index = findPoint(x);
+
+    if(index != noPoint)
+    {
+        res->assign(dataRows_[index], dataRows_[index] + nData_);
+        lastPath_ = SAME_POINT;
+        return;
+    }
+
+    actual(x, res);
+    lastPath_ = CALCULATED;
+}
+
+unsigned long
+LearnAsYouGo::activeLearn(unsigned long nNew, const std::vector<double>& mins, const std::vector<double>& maxs, const std::vector<std::vector<double> >* centers, double width)
+{
+    check(mins.size() == nPoints_, "");
+    check(maxs.size() == nPoints_, "");
+    for(int j = 0; j < nPoints_; ++j)
+    {
+        check(mins[j] < maxs[j], "invalid range " << mins[j] << " to " << maxs[j] << " for parameter " << j);
+    }
+    check(width > 0, "invalid width " << width);
+
+    const bool aroundCenters = (centers && !centers->empty());
+    if(aroundCenters)
+    {
+        for(unsigned long k = 0; k < centers->size(); ++k)
+        {
+            check((*centers)[k].size() == nPoints_, "");
+        }
+    }
+
+    if(rebuildThread_)
+        finishRebuild();
+
+    receive();
+
+    // before the fast approximator exists the points are a latin hypercube fill of the range
+    std::vector<std::vector<unsigned long> > hypercube;
+    if(!fast_ && !aroundCenters)
+    {
+        hypercube.resize(nPoints_, std::vector<unsigned long>(nNew));
+        for(int j = 0; j < nPoints_; ++j)
+        {
+            for(unsigned long i = 0; i < nNew; ++i)
+                hypercube[j][i] = i;
+            for(unsigned long i = nNew; i > 1; --i)
+                std::swap(hypercube[j][i - 1], hypercube[j][std::min((unsigned long)(gen_.generate() * i), i - 1)]);
+        }
+    }
+
+    Math::GaussianGenerator gauss(int(gen_.generate() * 1e9), 0, 1);
+
+    std::vector<double> x(nPoints_), best(nPoints_), res;
+    unsigned long count = 0;
+    for(unsigned long i = 0; i < nNew; ++i)
+    {
+        // with the fast approximator the candidate with the largest estimated error is chosen
+        const int nCandidates = (fast_ ? activeLearningCandidates : 1);
+        double bestError = -1;
+        for(int c = 0; c < nCandidates; ++c)
+        {
+            if(!hypercube.empty())
+            {
+                for(int j = 0; j < nPoints_; ++j)
+                    x[j] = mins[j] + (maxs[j] - mins[j]) * (hypercube[j][i] + gen_.generate()) / nNew;
+            }
+            else if(aroundCenters)
+            {
+                const std::vector<double>& center = (*centers)[std::min((unsigned long)(gen_.generate() * centers->size()), (unsigned long)centers->size() - 1)];
+                for(int j = 0; j < nPoints_; ++j)
+                    x[j] = std::min(maxs[j], std::max(mins[j], center[j] + width * (maxs[j] - mins[j]) * gauss.generate()));
+            }
+            else
+            {
+                for(int j = 0; j < nPoints_; ++j)
+                    x[j] = mins[j] + (maxs[j] - mins[j]) * gen_.generate();
+            }
+
+            if(findPoint(x) != noPoint)
+                continue;
+
+            const double e = (nCandidates > 1 ? fast_->estimateError(x) : 0);
+            if(e > bestError)
+            {
+                bestError = e;
+                best = x;
+            }
+        }
+
+        if(bestError < 0)
+            continue;
+
+        actual(best, &res);
+        ++count;
+
+        receive();
+    }
+
+    return count;
+}
+
+void
+LearnAsYouGo::actual(const std::vector<double>& x, std::vector<double>* res)
+{
+    f_.evaluate(x, res);
+
+    currentParams_ = x;
+    currentData_ = *res;
+
+    communicate();
+    addDataPoint(x, *res);
+}
+
+void
+LearnAsYouGo::log(EVALUATION_PATH path)
+{
+    lastPath_ = path;
+
+    if(logFile_)
+    {
+        (*logFile_) << totalCount_ << '\t' << sameCount_ << '\t' << successfulCount_ << '\t' << totalCount_ - sameCount_ - successfulCount_;
+        if(logTiming_)
+            (*logFile_) << '\t' << std::chrono::duration<double>(std::chrono::steady_clock::now() - evaluateStart_).count() << '\t' << int(path);
+        (*logFile_) << std::endl;
+    }
+}
+
+void
 LearnAsYouGo::addDataPoint(const std::vector<double>& p, const std::vector<double>& d)
 {
     check(p.size() == nPoints_, "");
     check(d.size() == nData_, "");
-    check(pointMap_.size() == points_.size(), "");
+    check(pointTableCount_ == points_.size(), "");
 
-    const std::map<std::vector<double>, unsigned long, PointComp>::const_iterator it = pointMap_.find(p);
+    const unsigned long index = findPoint(p);
 
-    if(it != pointMap_.end())
+    if(index != noPoint)
     {
 #ifdef CHECKS_ON
         for(int i = 0; i < nData_; ++i)
         {
-            check(d[i] == data_[it->second][i], "");
+            check(d[i] == dataRows_[index][i], "");
         }
 #endif
         return;
     }
 
+    // the processes other than the node master only keep their own points, until they get them back from the shared memory
+    if(sharedBase_ && nodeMaster_ && !sharedFull_)
+    {
+        std::atomic<unsigned long>& count = sharedCount(sharedBase_);
+        const unsigned long n = count.load(std::memory_order_relaxed);
+        if(n < sharedCapacity_)
+        {
+            double* record = sharedTable_ + n * (nPoints_ + nData_);
+            std::copy(p.begin(), p.end(), record);
+            std::copy(d.begin(), d.end(), record + nPoints_);
+
+            // the readers see the count only after the point has been written
+            count.store(n + 1, std::memory_order_release);
+            addStoredPoint(p, record + nPoints_);
+            return;
+        }
+
+        output_screen("WARNING: the node shared memory for the training set is full (" << sharedCapacity_ << " points), the other processes on this node will not get the new points." << std::endl);
+        sharedFull_ = true;
+    }
+
+    // the inner vectors keep their buffers when data_ grows, so dataRows_ stays valid
+    data_.push_back(d);
+    addStoredPoint(p, &(data_.back()[0]));
+}
+
+void
+LearnAsYouGo::addStoredPoint(const std::vector<double>& p, const double* d)
+{
     ++pointsCount_;
     ++newPointsCount_;
 
     points_.push_back(p);
-    data_.push_back(d);
-    pointMap_[p] = points_.size() - 1;
+    dataRows_.push_back(d);
+    insertPoint(points_.size() - 1);
 
     if(fast_)
     {
         check(fa_, "");
         fa_->addPoint(p, d);
     }
-    else if(points_.size() >= minCount_)
+    else if(points_.size() >= minCount_ && !rebuildThread_)
     {
-        constructFast();
+        if(backgroundRebuild_)
+            startRebuild();
+        else
+            constructFast();
         return;
     }
 
-    if(points_.size() >= updateErrorThreshold_)
+    if(fast_ && !rebuildThread_ && points_.size() >= updateErrorThreshold_ && backgroundRebuild_)
+    {
+        startRebuild();
+    }
+    else if(fast_ && !rebuildThread_ && points_.size() >= updateErrorThreshold_)
     {
         randomizeErrorSet();
-        fa_->reset(points_.size() - testSize_, points_, data_, true);
-        fast_->reset(points_, data_, points_.size() - testSize_, points_.size());
-        if(processId_ == 0)
+        const unsigned long trainingSize = points_.size() - testSize_;
+        fa_->reset(trainingSize, points_, dataRows_, true);
+        fast_->reset(points_, dataRows_, points_.size() - testSize_, points_.size());
+        if(processId_ == 0 && fast_->isDistribGenerated())
         {
             std::stringstream fileName;
             fileName << "fast_approximator_error_ratio_" << points_.size() << ".txt";
@@ -394,7 +1171,7 @@ LearnAsYouGo::addDataPoint(const std::vector<double>& p, const std::vector<doubl
         updateErrorThreshold_ = points_.size() + points_.size() / 4;
         testSize_ = std::min(updateErrorThreshold_ / 20, (unsigned long) 1000);
 
-        fa_->reset(points_.size(), points_, data_, false);
+        addErrorSet(*fa_, points_, dataRows_, trainingSize);
     }
 
     if(fast_ && newPointsCount_ >= updateCount_)
@@ -407,17 +1184,19 @@ LearnAsYouGo::addDataPoint(const std::vector<double>& p, const std::vector<doubl
         updateCount_ = (points_.size() > 10000 ? points_.size() / 1000 : 10);
         check(updateCount_ >= 10, "");
 
-        output_screen1("Updating the file " << fileName_ << "." << std::endl);
         if(updateFile_)
         {
             output_screen1("Updating the file " << fileName_ << "." << std::endl);
-            writeIntoFile(fileName_.c_str());
+            if(asyncCheckpoint_)
+                startCheckpoint();
+            else
+                writeIntoFile(fileName_.c_str());
         }
     }
 }
 
 void
-LearnAsYouGo::constructFast()
+LearnAsYouGo::constructFast(const char* fastFile)
 {
     check(!fa_, "");
     check(!fast_, "");
@@ -427,34 +1206,334 @@ LearnAsYouGo::constructFast()
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
     check(!points_.empty(), "");
-    check(data_.size() == points_.size(), "");
-    check(pointMap_.size() == points_.size(), "");
+    check(dataRows_.size() == points_.size(), "");
+    check(pointTableCount_ == points_.size(), "");
 
-    const int k = (nPoints_ + nPoints_ * (nPoints_ + 1) / 2 + 1) * 2;
+    const int k = neighborCount();
     //const int k = nPoints_ + nPoints_ * nPoints_ + 1;
 
     check(testSize_ > 0, "");
     if(points_.size() > 2 * testSize_)
     {
         randomizeErrorSet();
-        fa_ = new FastApproximator(nPoints_, nData_, points_.size() - testSize_, points_, data_, k);
-        fast_ = new FastApproximatorError(*fa_, points_, data_, points_.size() - testSize_, points_.size(), errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, precision_);
+        fa_ = new FastApproximator(nPoints_, nData_, points_.size() - testSize_, points_, dataRows_, k);
+        fast_ = new FastApproximatorError(*fa_, points_, dataRows_, points_.size() - testSize_, points_.size(), errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, precision_);
 
-        if(processId_ == 0)
+        if(processId_ == 0 && fast_->isDistribGenerated())
         {
             std::stringstream fileName;
             fileName << "fast_approximator_error_ratio_" << points_.size() << ".txt";
             fast_->getDistrib()->writeIntoFile(fileName.str().c_str());
         }
 
-        fa_->reset(points_.size(), points_, data_, false);
+        if(!fastFile || !fa_->readFromFile(fastFile, points_.size()))
+            addErrorSet(*fa_, points_, dataRows_, points_.size() - testSize_);
         updateErrorThreshold_ = points_.size() + points_.size() / 4;
         testSize_ = std::min(updateErrorThreshold_ / 20, (unsigned long) 1000);
     }
     else
     {
-        fa_ = new FastApproximator(nPoints_, nData_, points_.size(), points_, data_, k);
-        fast_ = new FastApproximatorError(*fa_, points_, data_, points_.size(), points_.size(), errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, precision_);
+        fa_ = new FastApproximator(nPoints_, nData_, points_.size(), points_, dataRows_, k);
+        fast_ = new FastApproximatorError(*fa_, points_, dataRows_, points_.size(), points_.size(), errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, precision_);
+    }
+}
+
+void
+LearnAsYouGo::setBackgroundRebuild(bool background)
+{
+    if(!background)
+    {
+        waitForRebuild();
+        finishRebuild();
+    }
+
+    backgroundRebuild_ = background;
+}
+
+void
+LearnAsYouGo::startRebuild()
+{
+    check(!rebuildThread_, "");
+    check(!rebuildFa_ && !rebuildFast_, "");
+    check(!points_.empty(), "");
+    check(testSize_ > 0, "");
+
+    output_screen1("Rebuilding the fast approximator in the background." << std::endl);
+
+    // same choice as in constructFast, the error set is only used if there are enough points
+    const unsigned long n = points_.size();
+    rebuildTestSize_ = 0;
+    if(fast_ || n > 2 * testSize_)
+    {
+        randomizeErrorSet();
+        rebuildTestSize_ = testSize_;
+        updateErrorThreshold_ = n + n / 4;
+        testSize_ = std::min(updateErrorThreshold_ / 20, (unsigned long) 1000);
+    }
+
+    // the output values never move, so copying the pointers is enough
+    rebuildPoints_ = points_;
+    rebuildRows_ = dataRows_;
+    rebuildPrecision_ = precision_;
+    rebuildError_.clear();
+
+    rebuildDone_.store(false);
+    rebuildThread_ = new std::thread(&LearnAsYouGo::rebuild, this);
+}
+
+void
+LearnAsYouGo::rebuild()
+{
+    const unsigned long n = rebuildPoints_.size();
+    check(rebuildRows_.size() == n, "");
+    check(n > rebuildTestSize_, "");
+
+    try
+    {
+        rebuildFa_ = new FastApproximator(nPoints_, nData_, n - rebuildTestSize_, rebuildPoints_, rebuildRows_, neighborCount());
+        rebuildFast_ = new FastApproximatorError(*rebuildFa_, rebuildPoints_, rebuildRows_, n - rebuildTestSize_, n, errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, rebuildPrecision_);
+        addErrorSet(*rebuildFa_, rebuildPoints_, rebuildRows_, n - rebuildTestSize_);
+    }
+    catch (std::exception& e)
+    {
+        rebuildError_ = e.what();
+    }
+
+    rebuildDone_.store(true, std::memory_order_release);
+}
+
+void
+LearnAsYouGo::waitForRebuild()
+{
+    if(!rebuildThread_)
+        return;
+
+    rebuildThread_->join();
+    delete rebuildThread_;
+    rebuildThread_ = NULL;
+}
+
+void
+LearnAsYouGo::finishRebuild()
+{
+    if(rebuildThread_)
+    {
+        if(!rebuildDone_.load(std::memory_order_acquire))
+            return;
+
+        waitForRebuild();
+    }
+
+    if(!rebuildError_.empty())
+    {
+        if(rebuildFast_) delete rebuildFast_;
+        if(rebuildFa_) delete rebuildFa_;
+        rebuildFast_ = NULL;
+        rebuildFa_ = NULL;
+
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Rebuilding the fast approximator failed: " << rebuildError_;
+        rebuildError_.clear();
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(!rebuildFa_)
+        return;
+
+    check(rebuildFast_, "");
+
+    const unsigned long n = rebuildPoints_.size();
+    check(n <= points_.size(), "");
+
+    // the points added during the rebuild are after the snapshot, in the same order
+    for(unsigned long i = n; i < points_.size(); ++i)
+        rebuildFa_->addPoint(points_[i], dataRows_[i]);
+
+    rebuildFast_->setPrecision(precision_);
+
+    if(processId_ == 0 && rebuildTestSize_ > 0 && rebuildFast_->isDistribGenerated())
+    {
+        std::stringstream fileName;
+        fileName << "fast_approximator_error_ratio_" << n << ".txt";
+        rebuildFast_->getDistrib()->writeIntoFile(fileName.str().c_str());
+    }
+
+    // the error model refers to its approximator, so they are swapped together
+    if(fast_) delete fast_;
+    if(fa_) delete fa_;
+    fa_ = rebuildFa_;
+    fast_ = rebuildFast_;
+    rebuildFa_ = NULL;
+    rebuildFast_ = NULL;
+
+    std::vector<std::vector<double> >().swap(rebuildPoints_);
+    std::vector<const double*>().swap(rebuildRows_);
+
+    output_screen1("Swapped in the rebuilt fast approximator with " << n << " points." << std::endl);
+}
+
+void
+LearnAsYouGo::useCollectiveSync(unsigned long interval)
+{
+    check(interval > 0, "");
+
+#ifdef COSMO_MPI
+    if(nProcesses_ == 1)
+        return;
+
+    check(!firstUpdateRequested_, "the collective synchronization must be turned on before evaluating");
+
+    syncInterval_ = interval;
+
+    if(syncComm_)
+        return;
+
+    // a separate communicator keeps the exchanges from interfering with any other collective operations on MPI_COMM_WORLD (the processes start the exchanges at different times)
+    syncComm_ = new MPI_Comm;
+    MPI_Comm_dup(MPI_COMM_WORLD, (MPI_Comm*) syncComm_);
+    syncReq_ = new MPI_Request;
+
+    syncCounts_.resize(nProcesses_);
+    syncDispls_.resize(nProcesses_);
+
+    if(sharedBase_)
+        setupHierarchicalSync();
+#endif
+}
+
+void
+LearnAsYouGo::setupHierarchicalSync()
+{
+#ifdef COSMO_MPI
+    check(syncComm_, "");
+    check(!syncNodeComm_, "");
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    syncNodeComm_ = new MPI_Comm;
+    MPI_Comm_dup(*((MPI_Comm*) mpi.nodeCommunicator().handle()), (MPI_Comm*) syncNodeComm_);
+
+    if(mpi.isNodeMaster())
+    {
+        syncLeaderComm_ = new MPI_Comm;
+        MPI_Comm_dup(*((MPI_Comm*) mpi.leaderCommunicator()->handle()), (MPI_Comm*) syncLeaderComm_);
+
+        syncNodeCounts_.resize(mpi.numNodeProcesses());
+        syncNodeDispls_.resize(mpi.numNodeProcesses());
+
+        // the counts and the displacements of the nodes
+        syncCounts_.resize(mpi.numNodes());
+        syncDispls_.resize(mpi.numNodes());
+    }
+#endif
+}
+
+void
+LearnAsYouGo::useNodeSharedStorage(unsigned long capacity)
+{
+    check(capacity > 0, "");
+    check(!sharedBase_, "the node shared storage is already used");
+    check(!firstUpdateRequested_, "the node shared storage must be turned on before evaluating");
+
+    if(nProcesses_ == 1)
+        return;
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    nodeMaster_ = mpi.isNodeMaster();
+
+#ifdef COSMO_MPI
+    nodeMasters_.resize(nProcesses_);
+    int isMaster = nodeMaster_;
+    MPI_Allgather(&isMaster, 1, MPI_INT, &(nodeMasters_[0]), 1, MPI_INT, MPI_COMM_WORLD);
+
+    if(syncComm_)
+        setupHierarchicalSync();
+#endif
+
+    // all of the processes on the node use the capacity of the node master
+    sharedCapacity_ = capacity;
+    const unsigned long size = sharedHeaderSize + capacity * (nPoints_ + nData_) * sizeof(double);
+    sharedBase_ = mpi.allocateNodeShared(size, &sharedWindow_);
+    sharedTable_ = (double*)((char*) sharedBase_ + sharedHeaderSize);
+
+    if(nodeMaster_)
+    {
+        new(sharedBase_) std::atomic<unsigned long>(0);
+
+        // the points read in the constructor move into the shared memory
+        std::atomic<unsigned long>& count = sharedCount(sharedBase_);
+        const unsigned long n = std::min((unsigned long) points_.size(), sharedCapacity_);
+        for(unsigned long i = 0; i < n; ++i)
+        {
+            double* record = sharedTable_ + i * (nPoints_ + nData_);
+            std::copy(points_[i].begin(), points_[i].end(), record);
+            std::copy(dataRows_[i], dataRows_[i] + nData_, record + nPoints_);
+        }
+        count.store(n, std::memory_order_release);
+    }
+    mpi.barrier();
+
+    // the capacity given by the node master is the one that counts
+    unsigned long count = sharedCount(sharedBase_).load(std::memory_order_acquire);
+
+    if(nodeMaster_)
+    {
+        check(count <= points_.size(), "");
+        if(count < points_.size())
+        {
+            output_screen("WARNING: the node shared memory for the training set is too small for the " << points_.size() << " points that have been read." << std::endl);
+            sharedFull_ = true;
+        }
+
+        // no rebuilding is needed, the same values just need to be used from the new place
+        for(unsigned long i = 0; i < count; ++i)
+            dataRows_[i] = sharedTable_ + i * (nPoints_ + nData_) + nPoints_;
+        // the error model doesn't keep the values
+        if(fa_)
+            fa_->reset(points_.size(), points_, dataRows_, false);
+        if(!sharedFull_)
+            std::vector<std::vector<double> >().swap(data_);
+        return;
+    }
+
+    // the other processes start over with the points from the shared memory
+    if(fa_) delete fa_;
+    if(fast_) delete fast_;
+    fa_ = NULL;
+    fast_ = NULL;
+
+    points_.clear();
+    std::vector<std::vector<double> >().swap(data_);
+    dataRows_.clear();
+    resetPointMap();
+
+    newPointsCount_ = 0;
+    updateCount_ = 10;
+    updateErrorThreshold_ = minCount_;
+    testSize_ = std::min(updateErrorThreshold_ / 20, (unsigned long) 1000);
+
+    receiveShared();
+}
+
+void
+LearnAsYouGo::receiveShared()
+{
+    check(sharedBase_, "");
+    check(!nodeMaster_, "");
+
+    const unsigned long count = sharedCount(sharedBase_).load(std::memory_order_acquire);
+    check(count >= sharedSeen_ && count <= sharedCapacity_, "");
+
+    for(; sharedSeen_ < count; ++sharedSeen_)
+    {
+        const double* record = sharedTable_ + sharedSeen_ * (nPoints_ + nData_);
+        tempParams_.assign(record, record + nPoints_);
+
+        if(findPoint(tempParams_) != noPoint)
+            continue;
+
+        addStoredPoint(tempParams_, record + nPoints_);
     }
 }
 
@@ -465,6 +1544,21 @@ LearnAsYouGo::receive()
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
 
+    if(!nodeMaster_)
+        receiveShared();
+
+    if(syncInterval_ > 0)
+    {
+        // this also keeps the point to point receives from being posted
+        firstUpdateRequested_ = true;
+        receiveCollective();
+        return;
+    }
+
+    // only the node masters are sent points when the node shared memory is used
+    if(!nodeMaster_)
+        return;
+
     if(!firstUpdateRequested_)
     {
         for(int i = 0; i < nProcesses_; ++i)
@@ -512,6 +1606,223 @@ LearnAsYouGo::receive()
 #endif
 }
 
+void
+LearnAsYouGo::receiveCollective()
+{
+#ifdef COSMO_MPI
+    check(syncComm_ && syncReq_, "");
+
+    if(syncNodeComm_)
+    {
+        receiveCollectiveHierarchical();
+        return;
+    }
+
+    check(syncCounts_.size() == nProcesses_ && syncDispls_.size() == nProcesses_, "");
+
+    if(syncStage_ == 0)
+    {
+        if(++syncCalls_ < syncInterval_)
+            return;
+
+        syncCalls_ = 0;
+
+        // the buffer is kept untouched until the exchange is over, the new points go into syncBuff_ in the meantime
+        syncSend_.swap(syncBuff_);
+        syncBuff_.clear();
+        syncSendCount_ = syncSend_.size();
+        MPI_Iallgather(&syncSendCount_, 1, MPI_INT, &(syncCounts_[0]), 1, MPI_INT, *((MPI_Comm*) syncComm_), (MPI_Request*) syncReq_);
+        syncStage_ = 1;
+    }
+
+    int flag = 0;
+    MPI_Test((MPI_Request*) syncReq_, &flag, MPI_STATUS_IGNORE);
+    if(!flag)
+        return;
+
+    if(syncStage_ == 1)
+    {
+        int total = 0;
+        for(int i = 0; i < nProcesses_; ++i)
+        {
+            syncDispls_[i] = total;
+            total += syncCounts_[i];
+        }
+
+        // all of the processes get the same counts, so they all either skip the second step or take it
+        if(total == 0)
+        {
+            syncStage_ = 0;
+            return;
+        }
+
+        syncRecv_.resize(total);
+        MPI_Iallgatherv((syncSendCount_ ? &(syncSend_[0]) : NULL), syncSendCount_, MPI_DOUBLE, &(syncRecv_[0]), &(syncCounts_[0]), &(syncDispls_[0]), MPI_DOUBLE, *((MPI_Comm*) syncComm_), (MPI_Request*) syncReq_);
+        syncStage_ = 2;
+        return;
+    }
+
+    check(syncStage_ == 2, "");
+    syncStage_ = 0;
+
+    // the other processes on the node get the points through the shared memory
+    if(!nodeMaster_)
+        return;
+
+    const int pointSize = nPoints_ + nData_;
+    for(int i = 0; i < nProcesses_; ++i)
+    {
+        if(i == processId_ || syncCounts_[i] == 0)
+            continue;
+
+        check(syncCounts_[i] % pointSize == 0, "");
+        output_screen1("Received an update from process " << i << "." << std::endl);
+
+        for(int l = 0; l < syncCounts_[i] / pointSize; ++l)
+        {
+            const double* p = &(syncRecv_[syncDispls_[i] + l * pointSize]);
+
+            check(tempParams_.size() == nPoints_, "");
+            for(int j = 0; j < nPoints_; ++j)
+                tempParams_[j] = p[j];
+
+            check(tempData_.size() == nData_, "");
+            for(int j = 0; j < nData_; ++j)
+                tempData_[j] = p[nPoints_ + j];
+
+            addDataPoint(tempParams_, tempData_);
+        }
+    }
+#endif
+}
+
+void
+LearnAsYouGo::receiveCollectiveHierarchical()
+{
+#ifdef COSMO_MPI
+    check(syncNodeComm_, "");
+    check(!nodeMaster_ || syncLeaderComm_, "");
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int pointSize = nPoints_ + nData_;
+
+    if(syncStage_ == 0)
+    {
+        if(++syncCalls_ < syncInterval_)
+            return;
+
+        syncCalls_ = 0;
+
+        syncSend_.swap(syncBuff_);
+        syncBuff_.clear();
+        syncSendCount_ = syncSend_.size();
+        MPI_Igather(&syncSendCount_, 1, MPI_INT, (nodeMaster_ ? &(syncNodeCounts_[0]) : NULL), 1, MPI_INT, 0, *((MPI_Comm*) syncNodeComm_), (MPI_Request*) syncReq_);
+        syncStage_ = 1;
+    }
+
+    int flag = 0;
+    MPI_Test((MPI_Request*) syncReq_, &flag, MPI_STATUS_IGNORE);
+    if(!flag)
+        return;
+
+    if(syncStage_ == 1)
+    {
+        // only the node master knows the counts, so the points are always gathered
+        syncNodeTotal_ = 0;
+        if(nodeMaster_)
+        {
+            for(int i = 0; i < syncNodeCounts_.size(); ++i)
+            {
+                syncNodeDispls_[i] = syncNodeTotal_;
+                syncNodeTotal_ += syncNodeCounts_[i];
+            }
+            syncNodeRecv_.resize(syncNodeTotal_ + 1);
+        }
+
+        MPI_Igatherv((syncSendCount_ ? &(syncSend_[0]) : NULL), syncSendCount_, MPI_DOUBLE, (nodeMaster_ ? &(syncNodeRecv_[0]) : NULL), (nodeMaster_ ? &(syncNodeCounts_[0]) : NULL), (nodeMaster_ ? &(syncNodeDispls_[0]) : NULL), MPI_DOUBLE, 0, *((MPI_Comm*) syncNodeComm_), (MPI_Request*) syncReq_);
+        syncStage_ = 2;
+        return;
+    }
+
+    if(syncStage_ == 2)
+    {
+        // the other processes on the node get the points through the shared memory
+        if(!nodeMaster_)
+        {
+            syncStage_ = 0;
+            return;
+        }
+
+        // the points from the other processes on this node
+        for(int i = 1; i < syncNodeCounts_.size(); ++i)
+        {
+            check(syncNodeCounts_[i] % pointSize == 0, "");
+            for(int l = 0; l < syncNodeCounts_[i] / pointSize; ++l)
+            {
+                const double* p = &(syncNodeRecv_[syncNodeDispls_[i] + l * pointSize]);
+                tempParams_.assign(p, p + nPoints_);
+                tempData_.assign(p + nPoints_, p + pointSize);
+                addDataPoint(tempParams_, tempData_);
+            }
+        }
+
+        if(mpi.numNodes() == 1)
+        {
+            syncStage_ = 0;
+            return;
+        }
+
+        MPI_Iallgather(&syncNodeTotal_, 1, MPI_INT, &(syncCounts_[0]), 1, MPI_INT, *((MPI_Comm*) syncLeaderComm_), (MPI_Request*) syncReq_);
+        syncStage_ = 3;
+        return;
+    }
+
+    check(nodeMaster_, "");
+
+    if(syncStage_ == 3)
+    {
+        int total = 0;
+        for(int i = 0; i < syncCounts_.size(); ++i)
+        {
+            syncDispls_[i] = total;
+            total += syncCounts_[i];
+        }
+
+        // all of the node masters get the same counts
+        if(total == 0)
+        {
+            syncStage_ = 0;
+            return;
+        }
+
+        syncRecv_.resize(total);
+        MPI_Iallgatherv(&(syncNodeRecv_[0]), syncNodeTotal_, MPI_DOUBLE, &(syncRecv_[0]), &(syncCounts_[0]), &(syncDispls_[0]), MPI_DOUBLE, *((MPI_Comm*) syncLeaderComm_), (MPI_Request*) syncReq_);
+        syncStage_ = 4;
+        return;
+    }
+
+    check(syncStage_ == 4, "");
+    syncStage_ = 0;
+
+    for(int i = 0; i < syncCounts_.size(); ++i)
+    {
+        if(i == mpi.nodeIndex() || syncCounts_[i] == 0)
+            continue;
+
+        check(syncCounts_[i] % pointSize == 0, "");
+        output_screen1("Received an update from node " << i << "." << std::endl);
+
+        for(int l = 0; l < syncCounts_[i] / pointSize; ++l)
+        {
+            const double* p = &(syncRecv_[syncDispls_[i] + l * pointSize]);
+            tempParams_.assign(p, p + nPoints_);
+            tempData_.assign(p + nPoints_, p + pointSize);
+            addDataPoint(tempParams_, tempData_);
+        }
+    }
+#endif
+}
+
 void
 LearnAsYouGo::communicate()
 {
@@ -519,6 +1830,14 @@ LearnAsYouGo::communicate()
     if(nProcesses_ == 1)
         return;
 
+    if(syncInterval_ > 0)
+    {
+        syncBuff_.insert(syncBuff_.end(), currentParams_.begin(), currentParams_.end());
+        check(currentData_.size() == nData_, "");
+        syncBuff_.insert(syncBuff_.end(), currentData_.begin(), currentData_.end());
+        return;
+    }
+
     check(communicateBuff_.size() == communicateCount_ * (nPoints_ + nData_), "");
 
     check(newCommunicateCount_ < communicateCount_, "");
@@ -533,17 +1852,17 @@ LearnAsYouGo::communicate()
 
     if(newCommunicateCount_ == communicateCount_)
     {
+        // the same buffer is sent to all of the processes, it is reused once all of the sends are complete
+        double* buff = sendPool_.getBuffer(communicateBuff_.size());
+        std::copy(communicateBuff_.begin(), communicateBuff_.end(), buff);
+
         for(int i = 0; i < nProcesses_; ++i)
         {
-            if(i == processId_)
+            if(i == processId_ || (sharedBase_ && !nodeMasters_[i]))
                 continue;
 
             output_screen1("Sending updates to process " << i << "." << std::endl);
-
-            MPI_Request* updateReq = new MPI_Request;
-            updateRequests_.push_back(updateReq);
-            communicateData_.push_back(communicateBuff_);
-            MPI_Isend(&(communicateData_[communicateData_.size() - 1][0]), communicateBuff_.size(), MPI_DOUBLE, i, communicateTag_ + processId_, MPI_COMM_WORLD, updateReq);
+            sendPool_.isend(buff, communicateBuff_.size(), i, communicateTag_ + processId_);
         }
 
         newCommunicateCount_ = 0;
@@ -4,15 +4,19 @@
 #include <sstream>
 #include <iomanip>
 #include <ctime>
+#include <algorithm>
+#include <thread>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <numerics.hpp>
 #include <progress_meter.hpp>
 #include <three_rotation.hpp>
+#include <alm_rotation.hpp>
 #include <likelihood.hpp>
 #include <utils.hpp>
 #include <matrix_impl.hpp>
+#include <mapped_matrix.hpp>
 
 #include "healpix_base.h"
 #include "alm.h"
@@ -30,6 +34,130 @@
 #include <omp.h>
 #endif
 
+extern "C"
+{
+    // solution of triangular systems with multiple right hand sides
+    void dtrsm_(char *side, char *uplo, char *transa, char *diag, int *m, int *n, double *alpha, double *a, int *lda, double *b, int *ldb);
+}
+
+namespace
+{
+
+// exceptions cannot leave the parallel regions, so the first error message is kept and thrown after
+void
+setError(std::string& error, const std::exception& e)
+{
+#pragma omp critical (likelihood_error)
+    {
+        if(error.empty())
+            error = e.what();
+    }
+}
+
+void
+throwIfError(const std::string& error)
+{
+    if(error.empty())
+        return;
+
+    StandardException exc;
+    exc.set(error);
+    throw exc;
+}
+
+// reads the list of maps, the first number is the number of maps, then each line has nColumns file names
+void
+readMapList(const char* inputListName, int nColumns, std::vector<std::vector<std::string> >* names)
+{
+    StandardException exc;
+    std::ifstream inList(inputListName);
+    if(!inList)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot read the map list file " << inputListName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    
+    int numOfMaps;
+    inList >> numOfMaps;
+    if(numOfMaps < 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The number of maps cannot be negative. It is " << numOfMaps << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    
+    names->clear();
+    names->resize(numOfMaps, std::vector<std::string>(nColumns));
+    for(int i = 0; i < numOfMaps; ++i)
+    {
+        for(int j = 0; j < nColumns; ++j)
+            inList >> (*names)[i][j];
+    }
+}
+
+// reads the maps and the noise maps first to last - 1 of the list into the rows of t, which is resized to have one row per map, the FITS files are decoded on nThreads threads
+void
+readMapRows(const std::vector<std::vector<std::string> >& names, int first, int last, const std::vector<int>& goodPixels, int nThreads, Math::Matrix<double>* t)
+{
+    check(first >= 0 && first <= last && last <= names.size(), "");
+    
+    t->resize(last - first, goodPixels.size());
+    if(first == last || goodPixels.empty())
+        return;
+    
+    if(nThreads <= 0)
+        nThreads = omp_get_max_threads();
+    
+    std::string error;
+#pragma omp parallel for default(shared) schedule(dynamic) num_threads(nThreads)
+    for(int i = first; i < last; ++i)
+    {
+        try {
+            long nSide;
+            Likelihood::readMapAndNoise(names[i][0].c_str(), names[i][1].c_str(), goodPixels, nSide, &((*t)(i - first, 0)));
+        } catch (std::exception& e)
+        {
+            setError(error, e);
+        }
+    }
+    throwIfError(error);
+}
+
+// readMapRows on a separate thread, exceptions cannot leave the thread so the error is returned
+void
+readMapRowsAsync(const std::vector<std::vector<std::string> >* names, int first, int last, const std::vector<int>* goodPixels, int nThreads, Math::Matrix<double>* t, std::string* error)
+{
+    try {
+        readMapRows(*names, first, last, *goodPixels, nThreads, t);
+    } catch (std::exception& e)
+    {
+        *error = e.what();
+    }
+}
+
+// the per thread buffers of LikelihoodPolarization::calculateAll
+struct PolarizationWorkspace
+{
+    void allocate(int lMax, long nSide)
+    {
+        almCopy.Set(lMax, lMax);
+        almE.Set(lMax, lMax);
+        alm1.Set(lMax, lMax);
+        alm2.Set(lMax, lMax);
+        mapT.SetNside(nSide, RING);
+        mapQ.SetNside(nSide, RING);
+        mapU.SetNside(nSide, RING);
+    }
+    
+    LikelihoodPolarization::AlmType almCopy, almE, alm1, alm2;
+    Healpix_Map<double> mapT, mapQ, mapU;
+};
+
+} // namespace
+
 Likelihood::Likelihood(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const char* maskFileName, const char* foregroundFileName)
 {
     construct(cMatrix, fiducialMatrix, noiseMatrix, maskFileName, foregroundFileName);
@@ -37,7 +165,15 @@ Likelihood::Likelihood(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, co
 
 Likelihood::Likelihood(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<double>& foreground)
 {
-    construct(cMatrix, fiducialMatrix, noiseMatrix, goodPixels, foreground);
+    std::vector<std::vector<double> > templates;
+    if(!foreground.empty())
+        templates.push_back(foreground);
+    construct(cMatrix, fiducialMatrix, noiseMatrix, goodPixels, templates);
+}
+
+Likelihood::Likelihood(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<std::vector<double> >& templates)
+{
+    construct(cMatrix, fiducialMatrix, noiseMatrix, goodPixels, templates);
 }
 
 void
@@ -62,16 +198,30 @@ Likelihood::construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, con
         }
     }
     
-    construct(cMatrix, fiducialMatrix, noiseMatrix, goodPixels, f);
+    std::vector<std::vector<double> > templates;
+    if(!f.empty())
+        templates.push_back(f);
+    construct(cMatrix, fiducialMatrix, noiseMatrix, goodPixels, templates);
 }
 
 void
-Likelihood::construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<double>& foreground)
+Likelihood::construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, const CMatrix& noiseMatrix, const std::vector<int>& goodPixels, const std::vector<std::vector<double> >& templates)
 {
     StandardException exc;
     
     goodPixels_ = goodPixels;
-    f_ = foreground;
+    templates_ = templates;
+    
+    for(int k = 0; k < templates_.size(); ++k)
+    {
+        if(templates_[k].size() != goodPixels_.size())
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "There are " << goodPixels_.size() << " unmasked pixels, however template " << k << " has size " << templates_[k].size() << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+    }
     
     if(cMatrix.getNPix() != goodPixels_.size())
     {
@@ -97,7 +247,7 @@ Likelihood::construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, con
         throw exc;
     }
     
-    cInv_.resize(goodPixels_.size(), goodPixels_.size());
+    Math::SymmetricMatrix<double> c(goodPixels_.size(), goodPixels_.size());
     
 #pragma omp parallel for default(shared)
     for(int i = 0; i < goodPixels_.size(); ++i)
@@ -105,17 +255,17 @@ Likelihood::construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, con
         //for(int j = 0; j < goodPixels_.size(); ++j)
         for(int j = i; j < goodPixels_.size(); ++j)
         {
-            cInv_(i, j) = cMatrix.element(i, j) + fiducialMatrix.element(i, j) + noiseMatrix.element(i, j);
+            c(i, j) = cMatrix.element(i, j) + fiducialMatrix.element(i, j) + noiseMatrix.element(i, j);
         }
     }
     
     //output_screen("Cholesky factorization of the covariance matrix..." << std::endl);
-    cInv_.choleskyFactorize();
+    c.choleskyFactorize();
     //output_screen("OK" << std::endl);
     
     //output_screen("Calculating the determinant of c..." << std::endl);
     int signC = 1;
-    logDet_ = cInv_.logDetFromCholeskyFactorization(&signC); 
+    logDet_ = c.logDetFromCholeskyFactorization(&signC); 
 
     if(signC != 1)
      {
@@ -128,27 +278,134 @@ Likelihood::construct(const CMatrix& cMatrix, const CMatrix& fiducialMatrix, con
     logDet_ -= detOffset;
     //output_screen("OK" << std::endl);
     
-    //output_screen("Taking the inverse of the covariance matrix from Cholesky factorization..." << std::endl);
-    cInv_.invertFromCholeskyFactorization();
-    //output_screen("OK" << std::endl);
+    // the factor is kept instead of the inverse, chi2 is then calculated with triangular solves
+    const int n = goodPixels_.size();
+    l_.resize(n, n, 0);
+#pragma omp parallel for default(shared)
+    for(int i = 0; i < n; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+            l_(i, j) = c(i, j);
+    }
+    
+    // the templates are solved once, only the small system depends on the priors
+    const int nTemplates = templates_.size();
+    g_.resize(nTemplates, n);
+    for(int k = 0; k < nTemplates; ++k)
+    {
+        for(int i = 0; i < n; ++i)
+            g_(k, i) = templates_[k][i];
+    }
+    
+    gTg_.resize(nTemplates, nTemplates);
+    if(nTemplates > 0)
+    {
+        solveLower(nTemplates, &(g_(0, 0)));
+        for(int k = 0; k < nTemplates; ++k)
+        {
+            for(int j = k; j < nTemplates; ++j)
+            {
+                double x = 0;
+                for(int i = 0; i < n; ++i)
+                    x += g_(k, i) * g_(j, i);
+                gTg_(k, j) = x;
+            }
+        }
+    }
+    
+    templatePriors_.clear();
+    templatePriors_.resize(nTemplates, 0);
+    calculateTemplateSystem();
 }
 
-double
-Likelihood::vmv(int n, const std::vector<double>& a, const Math::SymmetricMatrix<double>& matrix, const std::vector<double>& b) const
+void
+Likelihood::setTemplatePriors(const std::vector<double>& inverseVariances)
+{
+    check(inverseVariances.size() == templates_.size(), "need " << templates_.size() << " inverse variances, " << inverseVariances.size() << " given");
+    for(int k = 0; k < inverseVariances.size(); ++k)
+    {
+        check(inverseVariances[k] >= 0, "invalid inverse variance " << inverseVariances[k]);
+    }
+    
+    templatePriors_ = inverseVariances;
+    calculateTemplateSystem();
+}
+
+void
+Likelihood::calculateTemplateSystem()
 {
-    std::vector<double> res(n, 0);
+    logDetTemplates_ = 0;
+    const int nTemplates = templates_.size();
+    aInv_.resize(nTemplates, nTemplates);
+    if(nTemplates == 0)
+        return;
     
-#pragma omp parallel for default(shared)
-	for(int i = 0; i < n; ++i)
-	{
-		for(int j = 0; j < n; ++j)
-			res[i] += a[i] * matrix(i, j) * b[j];
-	}
+    for(int k = 0; k < nTemplates; ++k)
+    {
+        for(int j = k; j < nTemplates; ++j)
+            aInv_(k, j) = gTg_(k, j) + (j == k ? templatePriors_[k] : 0);
+    }
     
-    double result = 0;
-    for(int i = 0; i < n; ++i)
-        result += res[i];
-	return result;
+    // log det(C + F P^(-1) F^T) = log det(C) + log det(A) - log det(P), the unconstrained amplitudes are normalized by the number of pixels instead
+    int sign = 1;
+    logDetTemplates_ = aInv_.logDet(&sign);
+    if(sign != 1)
+    {
+        StandardException exc;
+        std::string exceptionStr = "The templates are not linearly independent.";
+        exc.set(exceptionStr);
+        throw exc;
+    }
+    
+    for(int k = 0; k < nTemplates; ++k)
+        logDetTemplates_ -= std::log(templatePriors_[k] > 0 ? templatePriors_[k] : double(goodPixels_.size()));
+    
+    aInv_.invert();
+}
+
+void
+Likelihood::solveLower(int nRhs, double* b) const
+{
+    // l_ is stored row major, which is the column major storage of L^T, so L x = b is solved as transpose(U) x = b with U = L^T upper triangular
+    char side = 'L', upper = 'U', trans = 'T', nonUnit = 'N';
+    int n = goodPixels_.size();
+    int nr = nRhs;
+    double alpha = 1;
+    dtrsm_(&side, &upper, &trans, &nonUnit, &n, &nr, &alpha, const_cast<double*>(&(l_(0, 0))), &n, b, &n);
+}
+
+void
+Likelihood::chi2FromMaps(Math::Matrix<double>* y, std::vector<double>* chi2) const
+{
+    const int numOfMaps = y->rows(), n = goodPixels_.size();
+    const int nTemplates = templates_.size();
+    check(y->cols() == n, "");
+    
+    solveLower(numOfMaps, &((*y)(0, 0)));
+    
+    // the projections of all of the maps on the templates with one multiplication
+    Math::Matrix<double> b;
+    if(nTemplates > 0)
+        Math::Matrix<double>::multiplyMatrices(*y, g_, &b, false, true);
+    
+    chi2->resize(numOfMaps);
+    
+    // each map writes only its own slot
+#pragma omp parallel for default(shared)
+    for(int i = 0; i < numOfMaps; ++i)
+    {
+        double c = 0;
+        for(int j = 0; j < n; ++j)
+            c += (*y)(i, j) * (*y)(i, j);
+        
+        for(int k = 0; k < nTemplates; ++k)
+        {
+            for(int l = 0; l < nTemplates; ++l)
+                c -= b(i, k) * aInv_(k, l) * b(i, l);
+        }
+        
+        (*chi2)[i] = c;
+    }
 }
 
 double
@@ -165,22 +422,35 @@ Likelihood::calculate(const std::vector<double>& t, double& chi2, double& logDet
 {
     check(t.size() == goodPixels_.size(), "");
     
-    chi2 = vmv(goodPixels_.size(), t, cInv_, t);
-    logDet = logDet_;
+    Math::Matrix<double> y(1, t.size());
+    for(int i = 0; i < t.size(); ++i)
+        y(0, i) = t[i];
     
-    if(f_.size() > 0)
-    {
-        const double tCinvf = vmv(goodPixels_.size(), t, cInv_, f_);
-        const double fCinvf = vmv(goodPixels_.size(), f_, cInv_, f_);
-        logDet += std::log(fCinvf / goodPixels_.size());
-        chi2 -= tCinvf * tCinvf / fCinvf;
-    }
+    std::vector<double> chi2Results;
+    chi2FromMaps(&y, &chi2Results);
+    chi2 = chi2Results[0];
+    logDet = logDet_ + logDetTemplates_;
     
     return chi2 + logDet;
 }
 
 void
 Likelihood::readMapAndNoise(const char* mapName, const char* noiseMapName, const std::vector<int>& goodPixels, long& nSide, std::vector<double>& t)
+{
+    t.resize(goodPixels.size());
+    if(t.empty())
+    {
+        // the maps are still read to check them and get nSide
+        double dummy;
+        readMapAndNoise(mapName, noiseMapName, goodPixels, nSide, &dummy);
+        return;
+    }
+    
+    readMapAndNoise(mapName, noiseMapName, goodPixels, nSide, &(t[0]));
+}
+
+void
+Likelihood::readMapAndNoise(const char* mapName, const char* noiseMapName, const std::vector<int>& goodPixels, long& nSide, double* t)
 {
     StandardException exc;
     
@@ -213,11 +483,24 @@ Likelihood::readMapAndNoise(const char* mapName, const char* noiseMapName, const
 
     nSide = map.Nside();
     
-    t.resize(goodPixels.size());
+    if(!goodPixels.empty())
+    {
+        const std::pair<std::vector<int>::const_iterator, std::vector<int>::const_iterator> range = std::minmax_element(goodPixels.begin(), goodPixels.end());
+        if(*(range.first) < 0 || *(range.second) >= map.Npix())
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The good pixels must be between 0 and " << map.Npix() - 1 << " for the map " << mapName << ", the range given is " << *(range.first) << " to " << *(range.second) << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+    }
+    
+    const double* m = &(map[0]);
+    const double* n = &(noise[0]);
     for(int i = 0; i < goodPixels.size(); ++i)
     {
-        int index = goodPixels[i];
-        t[i] = (double)(map[index] + noise[index]);
+        const int index = goodPixels[i];
+        t[i] = m[index] + n[index];
     }
 }
 
@@ -246,73 +529,96 @@ Likelihood::readForeground(const char* foregroundFileName, const std::vector<int
 }
 
 void
-Likelihood::readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames)
+Likelihood::addMonopoleDipole(long nSide, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& templates)
 {
-    StandardException exc;
-    std::ifstream inList(inputListName);
-    if(!inList)
+    const int n = goodPixels.size();
+    std::vector<std::vector<double> > res(4, std::vector<double>(n));
+    for(int i = 0; i < n; ++i)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot read the map list file " << inputListName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        double vec[3];
+        pix2vec_nest(nSide, goodPixels[i], vec);
+        res[0][i] = 1;
+        for(int j = 0; j < 3; ++j)
+            res[j + 1][i] = vec[j];
     }
+    templates.insert(templates.end(), res.begin(), res.end());
+}
+
+void
+Likelihood::readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames, int nThreads)
+{
+    Math::Matrix<double> block;
+    readInput(inputListName, goodPixels, &block, mapNames, nThreads);
     
-    int numOfMaps;
-    inList >> numOfMaps;
-    if(numOfMaps < 0)
+    const int numOfMaps = mapNames.size(), n = goodPixels.size();
+    t.resize(numOfMaps);
+    for(int i = 0; i < numOfMaps; ++i)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "The number of maps cannot be negative. It is " << numOfMaps << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        if(n == 0)
+        {
+            t[i].clear();
+            continue;
+        }
+        t[i].assign(&(block(i, 0)), &(block(i, 0)) + n);
     }
+}
+
+void
+Likelihood::readInput(const char* inputListName, const std::vector<int>& goodPixels, Math::Matrix<double>* t, std::vector<std::string>& mapNames, int nThreads)
+{
+    check(t, "");
     
-    t.resize(numOfMaps);
-    mapNames.resize(numOfMaps);
+    std::vector<std::vector<std::string> > names;
+    readMapList(inputListName, 2, &names);
     
-    long nSide;
+    const int numOfMaps = names.size();
+    mapNames.resize(numOfMaps);
     for(int i = 0; i < numOfMaps; ++i)
-    {
-        std::string mapName, noiseName;
-        inList >> mapName >> noiseName;
-        mapNames[i] = mapName;
-        readMapAndNoise(mapName.c_str(), noiseName.c_str(), goodPixels, nSide, t[i]);
-    }
+        mapNames[i] = names[i][0];
+    
+    readMapRows(names, 0, numOfMaps, goodPixels, nThreads, t);
 }
 
 void
 Likelihood::calculateAll(const std::vector<std::vector<double> >& t, const std::vector<std::string>& mapNames, std::vector<LikelihoodResult>& results) const
 {
-    StandardException exc;
-#ifdef COSMO_OMP
-    omp_lock_t lock;
-    omp_init_lock(&lock);
-#endif
     //output_screen("Calculating likelihood for all the maps..." << std::endl);
     const int numOfMaps = t.size();
     check(mapNames.size() == numOfMaps, "");
-    std::vector<double> chi2Results(numOfMaps), logDetResults(numOfMaps);
+    const int n = goodPixels_.size();
     
-    //ProgressMeter meter(numOfMaps);
+    if(numOfMaps == 0)
+        return;
     
+    for(int i = 0; i < numOfMaps; ++i)
+        check(t[i].size() == n, "");
     
-//#pragma omp parallel for default(shared)
+    // all of the maps stacked one after the other, so the triangular solves are done for all of them at once by a single dtrsm
+    Math::Matrix<double> y(numOfMaps, n);
+#pragma omp parallel for default(shared)
     for(int i = 0; i < numOfMaps; ++i)
     {
-        double chi2, logDet;
-        calculate(t[i], chi2, logDet);
-        
-#ifdef COSMO_OMP
-        omp_set_lock(&lock);
-#endif
-        logDetResults[i] = logDet;
-        chi2Results[i] = chi2;
-        //meter.advance();
-#ifdef COSMO_OMP
-        omp_unset_lock(&lock);
-#endif
+        for(int j = 0; j < n; ++j)
+            y(i, j) = t[i][j];
     }
+    
+    calculateAll(&y, mapNames, results);
+}
+
+void
+Likelihood::calculateAll(Math::Matrix<double>* t, const std::vector<std::string>& mapNames, std::vector<LikelihoodResult>& results) const
+{
+    check(t, "");
+    const int numOfMaps = t->rows();
+    check(mapNames.size() >= numOfMaps, "");
+    
+    if(numOfMaps == 0)
+        return;
+    
+    check(t->cols() == goodPixels_.size(), "");
+    
+    std::vector<double> chi2Results;
+    chi2FromMaps(t, &chi2Results);
     //output_screen("OK" << std::endl);
     
     LikelihoodResult res;
@@ -320,7 +626,7 @@ Likelihood::calculateAll(const std::vector<std::vector<double> >& t, const std::
     for(int i = 0; i < numOfMaps; ++i)
     {
         res.mapName = mapNames[i];
-        res.logDet = logDetResults[i];
+        res.logDet = logDet_ + logDetTemplates_;
         res.chi2 = chi2Results[i];
         res.like = res.logDet + res.chi2;
         results.push_back(res);
@@ -328,17 +634,63 @@ Likelihood::calculateAll(const std::vector<std::vector<double> >& t, const std::
 }
 
 void
-Likelihood::calculateAll(const char* inputListName, std::vector<LikelihoodResult>& results) const
+Likelihood::calculateAll(const char* inputListName, std::vector<LikelihoodResult>& results, int chunkSize, int nThreads) const
 {
-    std::vector<std::string> mapNames;
-    std::vector<std::vector<double> > t;
-    readInput(inputListName, goodPixels_, t, mapNames);
-    check(mapNames.size() == t.size(), "");
-    calculateAll(t, mapNames, results);
+    check(chunkSize > 0, "invalid chunk size " << chunkSize);
+    
+    std::vector<std::vector<std::string> > names;
+    readMapList(inputListName, 2, &names);
+    
+    const int numOfMaps = names.size();
+    if(numOfMaps == 0)
+        return;
+    
+    // the maps are read in chunks, the next chunk is read on a separate thread while the likelihood is calculated for the current one
+    const int nChunks = (numOfMaps + chunkSize - 1) / chunkSize;
+    Math::Matrix<double> chunks[2];
+    readMapRows(names, 0, std::min(chunkSize, numOfMaps), goodPixels_, nThreads, &(chunks[0]));
+    
+    for(int c = 0; c < nChunks; ++c)
+    {
+        const int first = c * chunkSize, last = std::min(first + chunkSize, numOfMaps);
+        
+        std::string readError;
+        std::thread* reader = NULL;
+        if(c + 1 < nChunks)
+        {
+            const int nextLast = std::min(last + chunkSize, numOfMaps);
+            Math::Matrix<double>* next = &(chunks[(c + 1) % 2]);
+            
+            reader = new std::thread(readMapRowsAsync, &names, last, nextLast, &goodPixels_, nThreads, next, &readError);
+        }
+        
+        Math::Matrix<double>& current = chunks[c % 2];
+        check(current.rows() == last - first, "");
+        
+        std::vector<std::string> chunkNames(last - first);
+        for(int i = first; i < last; ++i)
+            chunkNames[i - first] = names[i][0];
+        std::string error;
+        try {
+            calculateAll(&current, chunkNames, results);
+        } catch (std::exception& e)
+        {
+            error = e.what();
+        }
+        
+        if(reader)
+        {
+            reader->join();
+            delete reader;
+        }
+        
+        throwIfError(error);
+        throwIfError(readError);
+    }
 }
 
 //LikelihoodPolarization
-LikelihoodPolarization::LikelihoodPolarization(const CMatrix& cMatrix, long nSide, const std::vector<int>& goodPixels, int lMax, const WholeMatrix& etttInverse, double phi, double theta, double psi) : goodPixels_(goodPixels), nSide_(nSide), lMax_(lMax), etttInverse_(etttInverse), phi_(phi), theta_(theta), psi_(psi)
+LikelihoodPolarization::LikelihoodPolarization(const CMatrix& cMatrix, long nSide, const std::vector<int>& goodPixels, int lMax, const WholeMatrix& etttInverse, double phi, double theta, double psi) : goodPixels_(goodPixels), nSide_(nSide), lMax_(lMax), lMin_(etttInverse.getLMin()), phi_(phi), theta_(theta), psi_(psi)
 {
     StandardException exc;
     
@@ -368,18 +720,18 @@ LikelihoodPolarization::LikelihoodPolarization(const CMatrix& cMatrix, long nSid
     }
     in.close();
     
-    nInv_.resize(2 * goodSize, 2 * goodSize);
+    Math::SymmetricMatrix<double> nInvSym(2 * goodSize, 2 * goodSize);
     Math::SymmetricMatrix<double> cMat(2 * goodSize, 2 * goodSize);
-    cInv_.resize(2 * goodSize, 2 * goodSize);
+    Math::SymmetricMatrix<double> cInvSym(2 * goodSize, 2 * goodSize);
     
     for(int i = 0; i < goodSize; ++i)
     {
         for(int j = 0; j < goodSize; ++j)
         {
-            nInv_(i, j) = nInv[goodPixels_[i]][goodPixels_[j]];
-            nInv_(i, goodSize + j) = nInv[goodPixels_[i]][size / 2 + goodPixels_[j]];
-            nInv_(goodSize + i, j) = nInv[size / 2 + goodPixels_[i]][goodPixels_[j]];
-            nInv_(goodSize + i, goodSize + j) = nInv[size / 2 + goodPixels_[i]][size / 2 + goodPixels_[j]];
+            nInvSym(i, j) = nInv[goodPixels_[i]][goodPixels_[j]];
+            nInvSym(i, goodSize + j) = nInv[goodPixels_[i]][size / 2 + goodPixels_[j]];
+            nInvSym(goodSize + i, j) = nInv[size / 2 + goodPixels_[i]][goodPixels_[j]];
+            nInvSym(goodSize + i, goodSize + j) = nInv[size / 2 + goodPixels_[i]][size / 2 + goodPixels_[j]];
             
             cMat(i, j) = cMatrix.element(goodPixels_[i], goodPixels_[j]);
             cMat(i, goodSize + j) = cMatrix.element(goodPixels_[i], size / 2 + goodPixels_[j]);
@@ -388,23 +740,54 @@ LikelihoodPolarization::LikelihoodPolarization(const CMatrix& cMatrix, long nSid
         }
     }
     
-    cInv_ = nInv_;
-    cInv_ += nInv_ * cMat * nInv_;
+    cInvSym = nInvSym;
+    cInvSym += nInvSym * cMat * nInvSym;
     
-    cInv_.choleskyFactorize();
+    cInvSym.choleskyFactorize();
     
     //output_screen("Calculating the determinant of c..." << std::endl);
     int signC = 1;
-    logDet_ = cInv_.logDetFromCholeskyFactorization(&signC);
+    logDet_ = cInvSym.logDetFromCholeskyFactorization(&signC);
 
     const double detOffset = 16078.083180; // to be done better
     logDet_ -= detOffset;
 
-    cInv_.invertFromCholeskyFactorization();
+    cInvSym.invertFromCholeskyFactorization();
+    
+    // full (not packed) copies, so that they can be applied to all of the maps at once with dgemm
+    nInv_.copy(nInvSym);
+    cInv_.copy(cInvSym);
+    
+    // ET(TT)^(-1) as a dense matrix, the rows are (l, m >= 0) and the columns are (l1, m1) for -l1 <= m1 <= l1
+    ettt_.resize(eIndex(lMax_, lMax_) + 1, almIndex(lMax_, lMax_) + 1);
+#pragma omp parallel for default(shared)
+    for(int l = lMin_; l <= lMax_; ++l)
+    {
+        for(int m = 0; m <= l; ++m)
+        {
+            for(int l1 = lMin_; l1 <= lMax_; ++l1)
+            {
+                for(int m1 = -l1; m1 <= l1; ++m1)
+                    ettt_(eIndex(l, m), almIndex(l1, m1)) = etttInverse.element(l, m, l1, m1);
+            }
+        }
+    }
     
     Utils::readPixelWindowFunction(beam_, nSide, lMax, 0);
 }
 
+int
+LikelihoodPolarization::almIndex(int l, int m) const
+{
+    return l * (l + 1) + m - lMin_ * lMin_;
+}
+
+int
+LikelihoodPolarization::eIndex(int l, int m) const
+{
+    return l * (l + 1) / 2 + m - lMin_ * (lMin_ + 1) / 2;
+}
+
 void
 LikelihoodPolarization::readMaps(const char* qMapName, const char* uMapName, const char* almTTFileName, int lMax, const std::vector<int>& goodPixels, std::vector<double>& v, AlmType& alm)
 {
@@ -475,28 +858,12 @@ LikelihoodPolarization::readMaps(const char* qMapName, const char* uMapName, con
 }
 
 void
-LikelihoodPolarization::readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames, const std::vector<int>& goodPixelsPol, std::vector<std::vector<double> > & v, std::vector<AlmType>& alm, int lMaxPol)
+LikelihoodPolarization::readInput(const char* inputListName, const std::vector<int>& goodPixels, std::vector<std::vector<double> >& t, std::vector<std::string>& mapNames, const std::vector<int>& goodPixelsPol, std::vector<std::vector<double> > & v, std::vector<AlmType>& alm, int lMaxPol, int nThreads)
 {
-    StandardException exc;
-    std::ifstream inList(inputListName);
-    if(!inList)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot read the map list file " << inputListName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
-    
-    int numOfMaps;
-    inList >> numOfMaps;
-    if(numOfMaps < 0)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "The number of maps cannot be negative. It is " << numOfMaps << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
+    std::vector<std::vector<std::string> > names;
+    readMapList(inputListName, 5, &names);
     
+    const int numOfMaps = names.size();
     t.resize(numOfMaps);
     mapNames.resize(numOfMaps);
     v.clear();
@@ -504,111 +871,172 @@ LikelihoodPolarization::readInput(const char* inputListName, const std::vector<i
     alm.clear();
     alm.resize(numOfMaps);
     
-    long nSide;
+    if(nThreads <= 0)
+        nThreads = omp_get_max_threads();
+    
+    // each map is read into its own slot, so the FITS files can be decoded on several threads
+    std::string error;
+#pragma omp parallel for default(shared) schedule(dynamic) num_threads(nThreads)
     for(int i = 0; i < numOfMaps; ++i)
     {
-        std::string mapName, noiseName, almName, qName, uName;
-        inList >> mapName >> noiseName >> almName >> qName >> uName;
-        mapNames[i] = mapName;
-        Likelihood::readMapAndNoise(mapName.c_str(), noiseName.c_str(), goodPixels, nSide, t[i]);
-        readMaps(qName.c_str(), uName.c_str(), almName.c_str(), lMaxPol, goodPixelsPol, v[i], alm[i]);
+        try {
+            const std::vector<std::string>& n = names[i];
+            mapNames[i] = n[0];
+            long nSide;
+            Likelihood::readMapAndNoise(n[0].c_str(), n[1].c_str(), goodPixels, nSide, t[i]);
+            readMaps(n[3].c_str(), n[4].c_str(), n[2].c_str(), lMaxPol, goodPixelsPol, v[i], alm[i]);
+        } catch (std::exception& e)
+        {
+            setError(error, e);
+        }
     }
+    throwIfError(error);
 }
 
 void
 LikelihoodPolarization::calculateAll(const std::vector<std::vector<double> >& v, const std::vector<AlmType>& alm, const std::vector<std::string>& mapNames, std::vector<LikelihoodResult>& results) const
 {
-    int n = v.size();
+    const int n = v.size();
     check(n == alm.size(), "");
     check(n == mapNames.size(), "");
     
-    LikelihoodResult res;
-    for(int i = 0; i < n; ++i)
-    {
-        res.mapName = mapNames[i];
-        res.like = calculate(v[i], alm[i], res.chi2, res.logDet);
-        check(res.like == res.chi2 + res.logDet, "");
-        results.push_back(res);
-    }
-}
-
-double
-LikelihoodPolarization::calculate(const std::vector<double>& v, const AlmType& alm, double& chi2, double& logDet) const
-{
-    const Math::ThreeRotationMatrix rot(phi_, theta_, psi_);
-    const rotmatrix rotationMatrix(rot[0][0], rot[0][1], rot[0][2], rot[1][0], rot[1][1], rot[1][2], rot[2][0], rot[2][1], rot[2][2]);
-    
-    AlmType almCopy(alm);
-    rotate_alm(almCopy, rotationMatrix);
+    if(n == 0)
+        return;
     
-    std::vector<double> vCopy(v);
-    
-    check(vCopy.size() == 2 * goodPixels_.size(), "");
+    const int goodSize = goodPixels_.size();
+    for(int i = 0; i < n; ++i)
+        check(v[i].size() == 2 * goodSize, "");
     
-    AlmType almE(lMax_, lMax_);
-    almE.SetToZero();
+    // the Wigner d matrices are calculated once for all of the maps, only up to lMax_ since each l rotates separately
+    const Math::ThreeRotationMatrix rot(phi_, theta_, psi_);
+    const Math::AlmRotation rotation(rot, lMax_), rotationInv(rot.transpose(), lMax_);
     
-    for(int l = etttInverse_.getLMin(); l <= lMax_; ++l)
+    // the buffers are allocated once for each thread
+    int nThreads = 1;
+#ifdef COSMO_OMP
+    nThreads = omp_get_max_threads();
+#endif
+    std::vector<PolarizationWorkspace> work(nThreads);
+    for(int i = 0; i < nThreads; ++i)
+        work[i].allocate(lMax_, nSide_);
+    
+    // the rotated TT alm-s of all of the maps, the real and imaginary parts as separate rows
+    const int almSize = ettt_.cols();
+    Math::Matrix<double> a(2 * n, almSize);
+    std::string error;
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int i = 0; i < n; ++i)
     {
-#pragma omp parallel for default(shared)
-        for(int m = 0; m <= l; ++m)
-        {
-            for(int l1 = etttInverse_.getLMin(); l1 <= lMax_; ++l1)
+        try {
+            check(alm[i].Lmax() >= lMax_ && alm[i].Mmax() >= lMax_, "the alm-s must go up to l = " << lMax_);
+            AlmType& almCopy = work[CURRENT_THREAD_NUM()].almCopy;
+            for(int l = 0; l <= lMax_; ++l)
+            {
+                for(int m = 0; m <= l; ++m)
+                    almCopy(l, m) = alm[i](l, m);
+            }
+            rotation.rotate(almCopy);
+            
+            for(int l1 = lMin_; l1 <= lMax_; ++l1)
             {
                 for(int m1 = -l1; m1 <= l1; ++m1)
                 {
                     const int m1Abs = (m1 >= 0 ? m1 : -m1);
-                    xcomplex<double> a = almCopy(l1, m1Abs);
+                    xcomplex<double> x = almCopy(l1, m1Abs);
                     if(m1 < 0)
                     {
-                        a = a.conj();
+                        x = x.conj();
                         if(m1Abs % 2)
-                            a *= -1.0;
+                            x *= -1.0;
                     }
-                    almE(l, m) += etttInverse_.element(l, m, l1, m1) * a;
+                    a(2 * i, almIndex(l1, m1)) = x.re;
+                    a(2 * i + 1, almIndex(l1, m1)) = x.im;
                 }
             }
+        } catch (std::exception& e)
+        {
+            setError(error, e);
         }
     }
+    throwIfError(error);
     
-    const rotmatrix rotationMatrixInv(rot[0][0], rot[1][0], rot[2][0], rot[0][1], rot[1][1], rot[2][1], rot[0][2], rot[1][2], rot[2][2]);
-    AlmType alm1(lMax_, lMax_), alm2(lMax_, lMax_);
-    alm1.SetToZero();
-    alm2.SetToZero();
-    
-    rotate_alm(alm1, almE, alm2, rotationMatrixInv);
-    
-    Healpix_Map<double> mapT, mapQ, mapU;
-    mapT.SetNside(nSide_, RING);
-    mapQ.SetNside(nSide_, RING);
-    mapU.SetNside(nSide_, RING);
-    alm2map_pol(alm1, almE, alm2, mapT, mapQ, mapU);
-    
-    mapQ.swap_scheme();
-    mapU.swap_scheme();
+    // the E alm-s predicted from TT for all of the maps with one multiplication
+    Math::Matrix<double> eAll;
+    Math::Matrix<double>::multiplyMatrices(a, ettt_, &eAll, false, true);
     
-    std::vector<double> subtractMap;
-    for(int i = 0; i < goodPixels_.size(); ++i)
-        subtractMap.push_back(mapQ[goodPixels_[i]]);
-    for(int i = 0; i < goodPixels_.size(); ++i)
-        subtractMap.push_back(mapU[goodPixels_[i]]);
+    // the Q and U maps of the predicted E, one row for each map
+    Math::Matrix<double> sAll(n, 2 * goodSize);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int i = 0; i < n; ++i)
+    {
+        try {
+            PolarizationWorkspace& w = work[CURRENT_THREAD_NUM()];
+            w.almE.SetToZero();
+            for(int l = lMin_; l <= lMax_; ++l)
+            {
+                for(int m = 0; m <= l; ++m)
+                    w.almE(l, m) = xcomplex<double>(eAll(2 * i, eIndex(l, m)), eAll(2 * i + 1, eIndex(l, m)));
+            }
+            
+            w.alm1.SetToZero();
+            w.alm2.SetToZero();
+            rotationInv.rotate(w.almE);
+            
+            alm2map_pol(w.alm1, w.almE, w.alm2, w.mapT, w.mapQ, w.mapU);
+            w.mapQ.swap_scheme();
+            w.mapU.swap_scheme();
+            
+            for(int j = 0; j < goodSize; ++j)
+            {
+                sAll(i, j) = w.mapQ[goodPixels_[j]];
+                sAll(i, goodSize + j) = w.mapU[goodPixels_[j]];
+            }
+            
+            // the next map is calculated in ring ordering again
+            w.mapQ.swap_scheme();
+            w.mapU.swap_scheme();
+        } catch (std::exception& e)
+        {
+            setError(error, e);
+        }
+    }
+    throwIfError(error);
     
-    for(int i = 0; i < 2 * goodPixels_.size(); ++i)
+    // v - N^(-1) s for all of the maps
+    Math::Matrix<double> x(n, 2 * goodSize), y;
+    for(int i = 0; i < n; ++i)
     {
-        for(int j = 0; j < 2 * goodPixels_.size(); ++j)
-            vCopy[i] -= nInv_(i, j) * subtractMap[j];
+        for(int j = 0; j < 2 * goodSize; ++j)
+            x(i, j) = v[i][j];
     }
+    Math::Matrix<double>::multiplyMatrices(sAll, nInv_, &y);
+    x.subtract(y);
     
-    chi2 = 0;
+    Math::Matrix<double>::multiplyMatrices(x, cInv_, &y);
     
-    for(int i = 0; i < 2 * goodPixels_.size(); ++i)
+    LikelihoodResult res;
+    for(int i = 0; i < n; ++i)
     {
-        for(int j = 0; j < 2 * goodPixels_.size(); ++j)
-            chi2 += vCopy[i] * cInv_(i, j) * vCopy[j];
+        res.mapName = mapNames[i];
+        res.chi2 = 0;
+        for(int j = 0; j < 2 * goodSize; ++j)
+            res.chi2 += x(i, j) * y(i, j);
+        res.logDet = logDet_;
+        res.like = res.chi2 + res.logDet;
+        results.push_back(res);
     }
+}
+
+double
+LikelihoodPolarization::calculate(const std::vector<double>& v, const AlmType& alm, double& chi2, double& logDet) const
+{
+    std::vector<LikelihoodResult> results;
+    calculateAll(std::vector<std::vector<double> >(1, v), std::vector<AlmType>(1, alm), std::vector<std::string>(1, ""), results);
+    check(results.size() == 1, "");
     
-    logDet = logDet_;
-    return chi2 + logDet;
+    chi2 = results[0].chi2;
+    logDet = results[0].logDet;
+    return results[0].like;
 }
 
 double
@@ -632,94 +1060,82 @@ LikelihoodPolarization::getNInv(int i, int j) const
     return nInv_(i, j);
 }
 
-int myIndex(int l, int m, int lMin)
-{
-    return l * (l + 1) + m - (lMin * (lMin + 1) - lMin);
-}
-
 void
 LikelihoodPolarization::combineWholeMatrices(const WholeMatrix& tt, const WholeMatrix& te, const WholeMatrix& ee, WholeMatrix& combined, WholeMatrix& etttInverse)
 {
-    StandardException exc;
-    
     const int lMin = combined.getLMin(), lMax = combined.getLMax();
     check(etttInverse.getLMin() == lMin, "");
     check(etttInverse.getLMax() == lMax, "");
+    check(tt.getLMin() == lMin && tt.getLMax() == lMax, "");
+    check(te.getLMin() == lMin && te.getLMax() == lMax, "");
+    check(ee.getLMin() == lMin && ee.getLMax() == lMax, "");
+    
+    // isotropic input, everything is diagonal in (l, m) so the inverse and the products are done for each (l, m) separately
+    if(tt.isDiagonal() && te.isDiagonal() && ee.isDiagonal())
+    {
+        combined.setToZero();
+        etttInverse.setToZero();
+        for(int l = lMin; l <= lMax; ++l)
+        {
+            for(int m = -l; m <= l; ++m)
+            {
+                const double t = tt.element(l, m, l, m);
+                check(t > 0, "tt must be positive definite, the diagonal element for l = " << l << ", m = " << m << " is " << t);
+                const double e = te.element(l, m, l, m) / t;
+                etttInverse.element(l, m, l, m) = e;
+                combined.element(l, m, l, m) = ee.element(l, m, l, m) - e * te.element(l, m, l, m);
+            }
+        }
+        return;
+    }
+    
+    // the whole matrices are copied into full matrices (the row index is (l', m'), the column index is (l, m)) so the products are done with dgemm
+    const int size = tt.size();
+    Math::Matrix<double> ttFull, teFull, eeFull;
+    tt.copyTo(&ttFull);
+    te.copyTo(&teFull);
+    ee.copyTo(&eeFull);
     
-    int size = myIndex(lMax, lMax, lMin) + 1;
     Math::SymmetricMatrix<double> ttMat(size, size);
-    for(int l1 = lMin; l1 <= lMax; ++l1)
-        for(int m1 = -l1; m1 <= l1; ++m1)
-            for(int l = lMin; l <= lMax; ++l)
-                for(int m = -l; m <= l; ++m)
-                {
-                    int i = myIndex(l, m, lMin);
-                    int j = myIndex(l1, m1, lMin);
-                    check(i < size, "");
-                    check(j < size, "");
-                    ttMat(i, j) = tt.element(l1, m1, l, m);
-                    
-                    check(Math::areEqual(tt.element(l1, m1, l, m), tt.element(l, m, l1, m1), 1e-10), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << tt.element(l1, m1, l, m) << ' ' << tt.element(l, m, l1, m1));
-                }
+    for(int i = 0; i < size; ++i)
+        for(int j = 0; j <= i; ++j)
+        {
+            ttMat(i, j) = ttFull(i, j);
+            check(Math::areEqual(ttFull(i, j), ttFull(j, i), 1e-10), i << ' ' << j << ' ' << ttFull(i, j) << ' ' << ttFull(j, i));
+        }
     
     ttMat.invert();
     
-    WholeMatrix ttInverse(lMin, lMax);
-    for(int l1 = lMin; l1 <= lMax; ++l1)
-        for(int m1 = -l1; m1 <= l1; ++m1)
-            for(int l = lMin; l <= lMax; ++l)
-                for(int m = -l; m <= l; ++m)
-                {
-                    int i = myIndex(l, m, lMin);
-                    int j = myIndex(l1, m1, lMin);
-                    check(i < size, "");
-                    check(j < size, "");
-                    ttInverse.element(l1, m1, l, m) = ttMat(i, j);
-                }
+    Math::Matrix<double> ttInverse;
+    ttInverse.copy(ttMat);
     
-    for(int l1 = lMin; l1 <= lMax; ++l1)
-        for(int m1 = -l1; m1 <= l1; ++m1)
-            for(int l = lMin; l <= lMax; ++l)
-                for(int m = -l; m <= l; ++m)
-                {
-                    etttInverse.element(l1, m1, l, m) = 0;
-                    for(int l2 = lMin; l2 <= lMax; ++l2)
-                        for(int m2 = -l2; m2 <= l2; ++m2)
-                            etttInverse.element(l1, m1, l, m) += te.element(l2, m2, l1, m1) * ttInverse.element(l2, m2, l, m);
-                    
-                    check(Math::areEqual(te.element(l1, m1, l, m), te.element(l1, -m1, l, -m), 1e-10), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << te.element(l1, m1, l, m) << ' ' << te.element(l1, -m1, l, -m));
-                    check(Math::areEqual(ttInverse.element(l1, m1, l, m), ttInverse.element(l1, -m1, l, -m), 1e-10), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << ttInverse.element(l1, m1, l, m) << ' ' << ttInverse.element(l1, -m1, l, -m));
-                    check(Math::areEqual(ttInverse.element(l1, m1, l, m), ttInverse.element(l, m, l1, m1), 1e-10), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << ttInverse.element(l1, m1, l, m) << ' ' << ttInverse.element(l, m, l1, m1));
-                }
+    // etttInverse(l', m', l, m) = sum over (l2, m2) of te(l2, m2, l', m') ttInverse(l2, m2, l, m)
+    Math::Matrix<double> e;
+    Math::Matrix<double>::multiplyMatrices(teFull, ttInverse, &e, true, false);
     
-    for(int l1 = lMin; l1 <= lMax; ++l1)
-        for(int m1 = -l1; m1 <= l1; ++m1)
-            for(int l = lMin; l <= lMax; ++l)
-                for(int m = -l; m <= l; ++m)
-                {
-                    combined.element(l1, m1, l, m) = ee.element(l1, m1, l, m);
-                    for(int l2 = lMin; l2 <= lMax; ++l2)
-                        for(int m2 = -l2; m2 <= l2; ++m2)
-                            combined.element(l1, m1, l, m) -= etttInverse.element(l1, m1, l2, m2) * te.element(l2, m2, l, m);
-                    
-                    check(Math::areEqual(etttInverse.element(l1, m1, l, m), etttInverse.element(l1, -m1, l, -m), 1e-8), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << etttInverse.element(l1, m1, l, m) << ' ' << etttInverse.element(l1, -m1, l, -m));
-                }
+    // combined = ee - etttInverse te
+    Math::Matrix<double> et;
+    Math::Matrix<double>::multiplyMatrices(e, teFull, &et);
+    Math::Matrix<double> c;
+    Math::Matrix<double>::subtractMatrices(eeFull, et, &c);
+    
+    etttInverse.set(e);
+    combined.set(c);
     
 #ifdef CHECKS_ON
-    WholeMatrix etttInversett(lMin, lMax);
+    Math::Matrix<double> ettt;
+    Math::Matrix<double>::multiplyMatrices(e, ttFull, &ettt);
     for(int l1 = lMin; l1 <= lMax; ++l1)
         for(int m1 = -l1; m1 <= l1; ++m1)
             for(int l = lMin; l <= lMax; ++l)
                 for(int m = -l; m <= l; ++m)
                 {
-                    etttInversett.element(l1, m1, l, m) = 0;
-                    for(int l2 = lMin; l2 <= lMax; ++l2)
-                        for(int m2 = -l2; m2 <= l2; ++m2)
-                            etttInversett.element(l1, m1, l, m) += etttInverse.element(l1, m1, l2, m2) * tt.element(l2, m2, l, m);
-                    
-                    check(Math::areEqual(combined.element(l1, m1, l, m), combined.element(l, m, l1, m1), 1e-7), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << combined.element(l1, m1, l, m) << ' ' << combined.element(l, m, l1, m1));
-                    
-                    check(Math::areEqual(etttInversett.element(l1, m1, l, m), te.element(l, m, l1, m1), 1e-7), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << etttInversett.element(l1, m1, l, m) << ' ' << te.element(l, m, l1, m1));
+                    const int i = tt.index(l1, m1), j = tt.index(l, m);
+                    check(Math::areEqual(te.element(l1, m1, l, m), te.element(l1, -m1, l, -m), 1e-10), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << te.element(l1, m1, l, m) << ' ' << te.element(l1, -m1, l, -m));
+                    check(Math::areEqual(ttInverse(i, j), ttInverse(tt.index(l1, -m1), tt.index(l, -m)), 1e-10), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << ttInverse(i, j) << ' ' << ttInverse(tt.index(l1, -m1), tt.index(l, -m)));
+                    check(Math::areEqual(e(i, j), e(tt.index(l1, -m1), tt.index(l, -m)), 1e-8), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << e(i, j) << ' ' << e(tt.index(l1, -m1), tt.index(l, -m)));
+                    check(Math::areEqual(c(i, j), c(j, i), 1e-7), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << c(i, j) << ' ' << c(j, i));
+                    check(Math::areEqual(ettt(i, j), teFull(j, i), 1e-7), l1 << ' ' << m1 << ' ' << l << ' ' << m << ' ' << ettt(i, j) << ' ' << teFull(j, i));
                 }
 #endif
 }
@@ -769,22 +1185,50 @@ void readClFromFile(const char* fileName, std::vector<double>& cl, int lMax)
 }
 
 void
-LikelihoodHigh::readCouplingKernel(const char* couplingKernelFileName, std::vector<std::vector<double> >& coupling)
+LikelihoodHigh::readCouplingKernel(const char* couplingKernelFileName, Math::Matrix<double>* coupling) const
 {
     StandardException exc;
-    std::ifstream in(couplingKernelFileName);
-    if(!in)
+
+    // the binary format written by Math::MappedMatrix::writeIntoFile, or text with lMax in the beginning
+    int lMaxCK;
+    if(Math::MappedMatrix::isMappedMatrixFile(couplingKernelFileName))
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot open input file " << couplingKernelFileName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        Math::MappedMatrix mapped(couplingKernelFileName);
+        if(mapped.rows() != mapped.cols() || mapped.isSymmetric())
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The coupling kernel " << couplingKernelFileName << " must be a square (not symmetric) matrix, it is " << mapped.rows() << " x " << mapped.cols() << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        lMaxCK = mapped.rows() - 1;
+        if(lMaxCK >= lMax_)
+            mapped.copyTo(coupling);
     }
+    else
+    {
+        std::ifstream in(couplingKernelFileName);
+        if(!in)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot open input file " << couplingKernelFileName << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
 
-    coupling.clear();
+        in >> lMaxCK;
+        if(lMaxCK >= lMax_)
+        {
+            coupling->resize(lMaxCK + 1, lMaxCK + 1);
+            for(int l1 = 0; l1 <= lMaxCK; ++l1)
+            {
+                for(int l2 = 0; l2 <= lMaxCK; ++l2)
+                    in >> (*coupling)(l1, l2);
+            }
+        }
+        in.close();
+    }
 
-    int lMaxCK;
-    in >> lMaxCK;
     if(lMaxCK < lMax_)
     {
         std::stringstream exceptionStr;
@@ -792,18 +1236,50 @@ LikelihoodHigh::readCouplingKernel(const char* couplingKernelFileName, std::vect
         exc.set(exceptionStr.str());
         throw exc;
     }
+}
 
-    coupling.resize(lMaxCK + 1);
-    for(int l1 = 0; l1 <= lMaxCK; ++l1)
+void
+LikelihoodHigh::setKernels(const char* couplingKernelFileName, const char* noiseCouplingKernelFileName, double kernelThreshold)
+{
+    Math::Matrix<double> coupling, noiseCoupling;
+    readCouplingKernel(couplingKernelFileName, &coupling);
+    noiseCoupling_ = (noiseCouplingKernelFileName != NULL);
+    if(noiseCoupling_)
+        readCouplingKernel(noiseCouplingKernelFileName, &noiseCoupling);
+
+    // only the range lMin to lMax is kept, with the factors of 2l + 1
+    const int n = lMax_ - lMin_ + 1;
+    Math::Matrix<double> s(n, n), x, nMat;
+    if(noiseCoupling_)
     {
-        coupling[l1].resize(lMaxCK + 1);
-        for(int l2 = 0; l2 <= lMaxCK; ++l2)
-            in >> coupling[l1][l2];
+        x.resize(n, n);
+        nMat.resize(n, n);
+    }
+
+    const double noiseFactor = (noiseCoupling_ ? noiseCoupling(0, 0) / coupling(0, 0) : 1);
+    for(int l1 = lMin_; l1 <= lMax_; ++l1)
+    {
+        for(int l2 = lMin_; l2 <= lMax_; ++l2)
+        {
+            const int i = l1 - lMin_, j = l2 - lMin_;
+            s(i, j) = double(2 * l1 + 1) * coupling(l1, l2);
+            if(noiseCoupling_)
+            {
+                nMat(i, j) = double(2 * l1 + 1) * noiseCoupling(l1, l2) / noiseFactor;
+                x(i, j) = std::sqrt(s(i, j)) * std::sqrt(nMat(i, j));
+            }
+        }
+    }
+
+    sig_.set(s, kernelThreshold);
+    if(noiseCoupling_)
+    {
+        cross_.set(x, kernelThreshold);
+        noise_.set(nMat, kernelThreshold);
     }
-    in.close();
 }
 
-LikelihoodHigh::LikelihoodHigh(const std::vector<double>& cl, const std::vector<double>& nl, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName) : lMin_(lMin), lMax_(lMax), offset_((lMax_ - lMin_ + 1) * std::log(2 * Math::pi)), cl_(cl), nl_(nl)
+LikelihoodHigh::LikelihoodHigh(const std::vector<double>& cl, const std::vector<double>& nl, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName, double kernelThreshold) : lMin_(lMin), lMax_(lMax), offset_((lMax_ - lMin_ + 1) * std::log(2 * Math::pi)), cl_(cl), nl_(nl)
 {
     check(lMin_ >= 0, "invalid lMin");
     check(lMax_ >= lMin_, "invalid lMax");
@@ -811,12 +1287,10 @@ LikelihoodHigh::LikelihoodHigh(const std::vector<double>& cl, const std::vector<
     check(cl_.size() - 1 >= lMax_, "");
     check(nl_.size() - 1 >= lMax_, "");
 
-    readCouplingKernel(couplingKernelFileName, coupling_);
-    if(noiseCouplingKernelFileName)
-        readCouplingKernel(noiseCouplingKernelFileName, noiseCoupling_);
+    setKernels(couplingKernelFileName, noiseCouplingKernelFileName, kernelThreshold);
 }
 
-LikelihoodHigh::LikelihoodHigh(const char* dataClFileName, const char* noiseClFileName, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName) : lMin_(lMin), lMax_(lMax), offset_((lMax_ - lMin_ + 1) * std::log(2 * Math::pi))
+LikelihoodHigh::LikelihoodHigh(const char* dataClFileName, const char* noiseClFileName, const char* couplingKernelFileName, int lMin, int lMax, const char* noiseCouplingKernelFileName, double kernelThreshold) : lMin_(lMin), lMax_(lMax), offset_((lMax_ - lMin_ + 1) * std::log(2 * Math::pi))
 {
     check(lMin_ >= 0, "invalid lMin");
     check(lMax_ >= lMin_, "invalid lMax");
@@ -824,9 +1298,7 @@ LikelihoodHigh::LikelihoodHigh(const char* dataClFileName, const char* noiseClFi
     readClFromFile(dataClFileName, cl_, lMax_);
     readClFromFile(noiseClFileName, nl_, lMax_);
 
-    readCouplingKernel(couplingKernelFileName, coupling_);
-    if(noiseCouplingKernelFileName)
-        readCouplingKernel(noiseCouplingKernelFileName, noiseCoupling_);
+    setKernels(couplingKernelFileName, noiseCouplingKernelFileName, kernelThreshold);
 }
 
 double
@@ -837,49 +1309,147 @@ LikelihoodHigh::calculate(const char* clFileName) const
     return calculate(cl);
 }
 
+void
+LikelihoodHigh::weights(const std::vector<double>& cl, double* u, double* v) const
+{
+    check(cl.size() >= lMax_ + 1, "");
+
+    for(int l = lMin_; l <= lMax_; ++l)
+    {
+        const double clTot = cl[l] + nl_[l];
+        check(clTot != 0, "");
+        const double deltaCl = cl[l] - cl_[l];
+        u[l - lMin_] = deltaCl * cl[l] / (clTot * clTot);
+        v[l - lMin_] = deltaCl * nl_[l] / (clTot * clTot);
+    }
+}
+
 double
 LikelihoodHigh::calculate(const std::vector<double>& cl) const
 {
-    check(cl.size() >= lMax_ + 1, "");
+    const int n = lMax_ - lMin_ + 1;
+    std::vector<double> u(n), v(n);
+    weights(cl, &(u[0]), &(v[0]));
+
+    if(!noiseCoupling_)
+    {
+        // X = N = S
+        for(int i = 0; i < n; ++i)
+            u[i] += v[i];
+        return sig_.bilinearForm(&(u[0]), &(u[0])) / 2;
+    }
 
-    double res = 0.0;
-    std::vector<double> resVec(lMax_ + 1, 0);
+    return (sig_.bilinearForm(&(u[0]), &(u[0])) + cross_.bilinearForm(&(u[0]), &(v[0])) + cross_.bilinearForm(&(v[0]), &(u[0])) + noise_.bilinearForm(&(v[0]), &(v[0]))) / 2;
+}
 
-    double noiseFactor;
-    if(!noiseCoupling_.empty())
-        noiseFactor = noiseCoupling_[0][0] / coupling_[0][0];
+double
+LikelihoodHigh::calculateWithGradient(const std::vector<double>& cl, std::vector<double>* grad) const
+{
+    const int n = lMax_ - lMin_ + 1;
+    std::vector<double> u(n), v(n);
+    weights(cl, &(u[0]), &(v[0]));
 
+    grad->resize(lMax_ + 1);
+    for(int l = 0; l < lMin_; ++l)
+        (*grad)[l] = 0;
 
-#pragma omp parallel for default(shared)
-    for(int l1 = lMin_; l1 <= lMax_; ++l1)
+    // the kernels are not symmetric, so the gradient with respect to u of u^T S u is (S + S^T) u, etc.
+    std::vector<double> a(n), aT(n), b(n), bT(n);
+    double res;
+    if(!noiseCoupling_)
     {
-        const double clTot1 = cl[l1] + nl_[l1];
-        check(clTot1 != 0, "");
-        const double deltaCl1 = cl[l1] - cl_[l1];
-        for(int l2 = lMin_; l2 <= lMax_; ++l2)
-        {
-            const double clTot2 = cl[l2] + nl_[l2];
-            check(clTot2 != 0, "");
-            const double deltaCl2 = cl[l2] - cl_[l2];
+        // the result only depends on u + v = delta Cl / (Cl + Nl)
+        for(int i = 0; i < n; ++i)
+            u[i] += v[i];
+        sig_.multiply(&(u[0]), &(a[0]));
+        sig_.multiplyTransposed(&(u[0]), &(aT[0]));
 
-            const double fSig = double(2 * l1 + 1) * coupling_[l1][l2];
-            double fNoise = fSig;
-            
-            if(!noiseCoupling_.empty())
-                fNoise = double(2 * l1 + 1) * noiseCoupling_[l1][l2] / noiseFactor;
+        res = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            const int l = lMin_ + i;
+            const double clTot = cl[l] + nl_[l];
+            res += u[i] * a[i];
+            (*grad)[l] = (a[i] + aT[i]) / 2 * (nl_[l] + cl_[l]) / (clTot * clTot);
+        }
+        return res / 2;
+    }
 
-            const double fAvg = (cl[l1] * std::sqrt(fSig) + nl_[l1] * std::sqrt(fNoise)) * (cl[l2] * std::sqrt(fSig) + nl_[l2] * std::sqrt(fNoise)) / (clTot1 * clTot2);
+    // the gradients with respect to u and v
+    std::vector<double> gradU(n), gradV(n);
+    sig_.multiply(&(u[0]), &(a[0]));
+    sig_.multiplyTransposed(&(u[0]), &(aT[0]));
+    cross_.multiply(&(v[0]), &(b[0]));
+    cross_.multiplyTransposed(&(v[0]), &(bT[0]));
+    res = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        res += u[i] * (a[i] + b[i]);
+        gradU[i] = (a[i] + aT[i] + b[i] + bT[i]) / 2;
+    }
 
-            const double f = fAvg / (2.0 * clTot1 * clTot2);
+    cross_.multiply(&(u[0]), &(a[0]));
+    cross_.multiplyTransposed(&(u[0]), &(aT[0]));
+    noise_.multiply(&(v[0]), &(b[0]));
+    noise_.multiplyTransposed(&(v[0]), &(bT[0]));
+    for(int i = 0; i < n; ++i)
+    {
+        res += v[i] * (a[i] + b[i]);
+        gradV[i] = (a[i] + aT[i] + b[i] + bT[i]) / 2;
+    }
 
-            //const double f = double(2 * l1 + 1) * coupling_[l1][l2] / (2.0 * clTot1 * clTot2);
-            resVec[l1] += deltaCl1 * deltaCl2 * f;
-        }
+    // the derivatives of u = delta Cl Cl / (Cl + Nl)^2 and v = delta Cl Nl / (Cl + Nl)^2 with respect to Cl
+    for(int i = 0; i < n; ++i)
+    {
+        const int l = lMin_ + i;
+        const double clTot = cl[l] + nl_[l];
+        const double deltaCl = cl[l] - cl_[l];
+        const double clTot3 = clTot * clTot * clTot;
+        const double du = ((2 * cl[l] - cl_[l]) * clTot - 2 * deltaCl * cl[l]) / clTot3;
+        const double dv = nl_[l] * (clTot - 2 * deltaCl) / clTot3;
+        (*grad)[l] = gradU[i] * du + gradV[i] * dv;
     }
+    return res / 2;
+}
 
-    for(int l1 = lMin_; l1 <= lMax_; ++l1)
-        res += resVec[l1];
+void
+LikelihoodHigh::calculate(const std::vector<std::vector<double> >& cls, std::vector<double>* res) const
+{
+    const int nCl = cls.size(), n = lMax_ - lMin_ + 1;
+    res->resize(nCl);
+    if(nCl == 0)
+        return;
+
+    Math::Matrix<double> u(nCl, n), v(nCl, n);
+    for(int k = 0; k < nCl; ++k)
+        weights(cls[k], &(u(k, 0)), &(v(k, 0)));
+
+    if(!noiseCoupling_)
+        u.add(v);
 
-    return res;
+    // the products with the kernels for all of the Cl-s at once, the rows of su are S u for each Cl
+    Math::Matrix<double> kernel, su, xv, xu, nv;
+    sig_.copyTo(&kernel);
+    Math::Matrix<double>::multiplyMatrices(u, kernel, &su, false, true);
+    if(noiseCoupling_)
+    {
+        cross_.copyTo(&kernel);
+        Math::Matrix<double>::multiplyMatrices(v, kernel, &xv, false, true);
+        Math::Matrix<double>::multiplyMatrices(u, kernel, &xu, false, true);
+        noise_.copyTo(&kernel);
+        Math::Matrix<double>::multiplyMatrices(v, kernel, &nv, false, true);
+    }
+
+    for(int k = 0; k < nCl; ++k)
+    {
+        double r = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            r += u(k, i) * su(k, i);
+            if(noiseCoupling_)
+                r += u(k, i) * xv(k, i) + v(k, i) * xu(k, i) + v(k, i) * nv(k, i);
+        }
+        (*res)[k] = r / 2;
+    }
 }
 
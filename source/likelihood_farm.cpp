@@ -0,0 +1,260 @@
+#ifdef COSMO_MPI
+#include <mpi.h>
+#endif
+
+#include <algorithm>
+
+#include <cosmo_mpi.hpp>
+#include <macros.hpp>
+#include <likelihood_farm.hpp>
+
+// the work stealing needs the atomic one sided operations of MPI 3
+#if defined(COSMO_MPI) && defined(MPI_VERSION) && MPI_VERSION >= 3
+#define COSMO_FARM_ONE_SIDED
+#endif
+
+namespace
+{
+
+// the claim counter and the batch descriptor keep the generation of the batch in the upper bits
+const long long lowerMask = 0xffffffffLL;
+
+#ifdef COSMO_FARM_ONE_SIDED
+long long atomicControl(void* win, int process, int slot, long long value, MPI_Op op)
+{
+    long long result;
+    MPI_Fetch_and_op(&value, &result, MPI_LONG_LONG, process, slot, op, *((MPI_Win*) win));
+    MPI_Win_flush(process, *((MPI_Win*) win));
+    return result;
+}
+#endif
+
+} // namespace
+
+namespace Math
+{
+
+LikelihoodFarm::LikelihoodFarm(LikelihoodFunction& like, int nPar, int maxBatchSize) : like_(&like), n_(nPar), maxBatchSize_(maxBatchSize), batchSize_(0), generation_(0), stolen_(0), dataWin_(NULL), controlWin_(NULL), data_(NULL), control_(NULL), point_(nPar)
+{
+    check(n_ > 0, "invalid number of parameters " << n_);
+    check(maxBatchSize_ > 0, "invalid maximum batch size " << maxBatchSize_);
+
+    nProcesses_ = CosmoMPI::create().numProcesses();
+    processId_ = CosmoMPI::create().processId();
+    nextVictim_ = processId_;
+
+#ifdef COSMO_FARM_ONE_SIDED
+    if(nProcesses_ > 1)
+    {
+        dataWin_ = new MPI_Win;
+        controlWin_ = new MPI_Win;
+        MPI_Win_allocate(MPI_Aint(maxBatchSize_) * (n_ + 1) * sizeof(double), sizeof(double), MPI_INFO_NULL, MPI_COMM_WORLD, &data_, (MPI_Win*) dataWin_);
+        MPI_Win_allocate(3 * sizeof(long long), sizeof(long long), MPI_INFO_NULL, MPI_COMM_WORLD, &control_, (MPI_Win*) controlWin_);
+
+        for(int i = 0; i < 3; ++i)
+            control_[i] = 0;
+
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, *((MPI_Win*) dataWin_));
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, *((MPI_Win*) controlWin_));
+        MPI_Win_sync(*((MPI_Win*) controlWin_));
+
+        // nobody should steal before all of the windows are initialized
+        MPI_Barrier(MPI_COMM_WORLD);
+        return;
+    }
+#endif
+
+    localData_.resize(maxBatchSize_ * (n_ + 1));
+    data_ = &(localData_[0]);
+}
+
+LikelihoodFarm::~LikelihoodFarm()
+{
+#ifdef COSMO_FARM_ONE_SIDED
+    if(dataWin_)
+    {
+        MPI_Win_unlock_all(*((MPI_Win*) dataWin_));
+        MPI_Win_unlock_all(*((MPI_Win*) controlWin_));
+        MPI_Win_free((MPI_Win*) dataWin_);
+        MPI_Win_free((MPI_Win*) controlWin_);
+        delete (MPI_Win*) dataWin_;
+        delete (MPI_Win*) controlWin_;
+    }
+#endif
+}
+
+void
+LikelihoodFarm::calculateBatch(double* params, int nParams, int nPoints, double* results)
+{
+    check(nParams == n_, "invalid number of parameters " << nParams << ", should be " << n_);
+    check(nPoints >= 0, "invalid number of points " << nPoints);
+
+    for(int begin = 0; begin < nPoints; begin += maxBatchSize_)
+    {
+        const int size = std::min(maxBatchSize_, nPoints - begin);
+        startBatch(params + begin * n_, size);
+        finishBatch(results + begin);
+    }
+
+    // help the others as long as they have unclaimed points
+    if(dataWin_)
+    {
+        while(steal())
+        {
+        }
+    }
+}
+
+void
+LikelihoodFarm::startBatch(const double* params, int nPoints)
+{
+    check(nPoints > 0 && nPoints <= maxBatchSize_, "invalid number of points " << nPoints << ", should be between 1 and " << maxBatchSize_);
+    check(batchSize_ == 0, "the previous batch has not been finished");
+
+    batchSize_ = nPoints;
+    std::copy(params, params + nPoints * n_, data_);
+
+    if(!dataWin_)
+    {
+        like_->calculateBatch(data_, n_, nPoints, data_ + maxBatchSize_ * n_);
+        return;
+    }
+
+#ifdef COSMO_FARM_ONE_SIDED
+    MPI_Win_sync(*((MPI_Win*) dataWin_));
+
+    // the points are published by the claim counter, the done counter and the descriptor need to be set before that
+    ++generation_;
+    atomicControl(controlWin_, processId_, 2, 0, MPI_REPLACE);
+    atomicControl(controlWin_, processId_, 1, (generation_ << 32) | nPoints, MPI_REPLACE);
+    atomicControl(controlWin_, processId_, 0, generation_ << 32, MPI_REPLACE);
+#endif
+}
+
+bool
+LikelihoodFarm::progress()
+{
+    if(!dataWin_)
+        return true;
+
+    if(batchSize_ > 0)
+    {
+        const int k = claim(processId_);
+        if(k >= 0)
+        {
+            evaluate(processId_, k);
+            return batchDone();
+        }
+    }
+
+    if(batchDone())
+        return true;
+
+    steal();
+    return batchDone();
+}
+
+void
+LikelihoodFarm::finishBatch(double* results)
+{
+    while(!progress())
+    {
+    }
+
+#ifdef COSMO_FARM_ONE_SIDED
+    // the stolen results have been written into the window by the other processes
+    if(dataWin_)
+        MPI_Win_sync(*((MPI_Win*) dataWin_));
+#endif
+
+    const double* res = data_ + maxBatchSize_ * n_;
+    std::copy(res, res + batchSize_, results);
+    batchSize_ = 0;
+}
+
+int
+LikelihoodFarm::claim(int process)
+{
+#ifdef COSMO_FARM_ONE_SIDED
+    // look first, so that the counter is only incremented when there is something to claim
+    const long long current = atomicControl(controlWin_, process, 0, 0, MPI_NO_OP);
+    long long descriptor = atomicControl(controlWin_, process, 1, 0, MPI_NO_OP);
+    if((current >> 32) != (descriptor >> 32) || (current & lowerMask) >= (descriptor & lowerMask))
+        return -1;
+
+    // the owner may have published the next batch in the meantime, then the claimed index belongs to that one and must be evaluated for it, otherwise the owner would wait for it forever
+    const long long claimed = atomicControl(controlWin_, process, 0, 1, MPI_SUM);
+    if((claimed >> 32) != (descriptor >> 32))
+    {
+        // the descriptor is published before the counter, and the owner cannot go on to another batch before a claimed point is done, so if the descriptor is newer than the claimed batch, nothing has been claimed from it
+        descriptor = atomicControl(controlWin_, process, 1, 0, MPI_NO_OP);
+        if((claimed >> 32) != (descriptor >> 32))
+            return -1;
+    }
+
+    if((claimed & lowerMask) >= (descriptor & lowerMask))
+        return -1;
+
+    return int(claimed & lowerMask);
+#else
+    check(false, "");
+    return -1;
+#endif
+}
+
+void
+LikelihoodFarm::evaluate(int process, int index)
+{
+#ifdef COSMO_FARM_ONE_SIDED
+    MPI_Win& win = *((MPI_Win*) dataWin_);
+    MPI_Get(&(point_[0]), n_, MPI_DOUBLE, process, MPI_Aint(index) * n_, n_, MPI_DOUBLE, win);
+    MPI_Win_flush(process, win);
+
+    const double result = like_->calculate(&(point_[0]), n_);
+
+    // the result must be in place before the owner can see it as done
+    MPI_Put(&result, 1, MPI_DOUBLE, process, MPI_Aint(maxBatchSize_) * n_ + index, 1, MPI_DOUBLE, win);
+    MPI_Win_flush(process, win);
+    atomicControl(controlWin_, process, 2, 1, MPI_SUM);
+#else
+    check(false, "");
+#endif
+}
+
+bool
+LikelihoodFarm::steal()
+{
+    for(int j = 0; j < nProcesses_ - 1; ++j)
+    {
+        nextVictim_ = (nextVictim_ + 1) % nProcesses_;
+        if(nextVictim_ == processId_)
+            nextVictim_ = (nextVictim_ + 1) % nProcesses_;
+
+        const int k = claim(nextVictim_);
+        if(k >= 0)
+        {
+            evaluate(nextVictim_, k);
+            ++stolen_;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+LikelihoodFarm::batchDone()
+{
+    if(batchSize_ == 0)
+        return true;
+
+#ifdef COSMO_FARM_ONE_SIDED
+    const long long done = atomicControl(controlWin_, processId_, 2, 0, MPI_NO_OP);
+    return done >= batchSize_;
+#else
+    return true;
+#endif
+}
+
+} // namespace Math
+
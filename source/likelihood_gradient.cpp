@@ -0,0 +1,132 @@
+#include <limits>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <likelihood_gradient.hpp>
+
+namespace Math
+{
+
+LikelihoodGradient::LikelihoodGradient(LikelihoodFunction& like, const std::vector<double>& steps, const std::vector<double>* min, const std::vector<double>* max, bool distribute) : like_(like), n_(int(steps.size())), steps_(steps), min_(steps.size(), -std::numeric_limits<double>::max()), max_(steps.size(), std::numeric_limits<double>::max()), distribute_(distribute && CosmoMPI::create().numProcesses() > 1), evaluations_(0), points_((2 * steps.size() + 1) * steps.size()), results_(2 * steps.size() + 1), function_(*this), gradientFunction_(*this)
+{
+    check(n_ > 0, "no parameters");
+    for(int i = 0; i < n_; ++i)
+    {
+        check(steps_[i] > 0, "invalid step " << steps_[i] << " for parameter " << i);
+    }
+
+    if(min)
+    {
+        check(min->size() == n_, "the number of lower bounds " << min->size() << " is not equal to the number of parameters " << n_);
+        min_ = *min;
+    }
+    if(max)
+    {
+        check(max->size() == n_, "the number of upper bounds " << max->size() << " is not equal to the number of parameters " << n_);
+        max_ = *max;
+    }
+    for(int i = 0; i < n_; ++i)
+    {
+        check(max_[i] > min_[i], "invalid bounds " << min_[i] << ", " << max_[i] << " for parameter " << i);
+    }
+}
+
+void
+LikelihoodGradient::gradient(const double* params, double* grad)
+{
+    evaluate(params, false, grad, NULL);
+}
+
+double
+LikelihoodGradient::calculate(const double* params, double* grad)
+{
+    double value;
+    evaluate(params, true, grad, &value);
+    return value;
+}
+
+void
+LikelihoodGradient::evaluate(const double* params, bool center, double* grad, double* value)
+{
+    // the points are x + h_i e_i, x - h_i e_i for each i, then x if needed
+    const int nPoints = 2 * n_ + (center ? 1 : 0);
+    for(int j = 0; j < nPoints; ++j)
+        std::copy(params, params + n_, &(points_[j * n_]));
+
+    for(int i = 0; i < n_; ++i)
+    {
+        double* plus = &(points_[2 * i * n_]);
+        double* minus = plus + n_;
+        plus[i] = std::min(params[i] + steps_[i], max_[i]);
+        minus[i] = std::max(params[i] - steps_[i], min_[i]);
+        check(plus[i] > minus[i], "parameter " << i << " = " << params[i] << " is outside of the bounds");
+    }
+
+    calculateBatch(nPoints);
+
+    for(int i = 0; i < n_; ++i)
+    {
+        const double* plus = &(points_[2 * i * n_]);
+        const double* minus = plus + n_;
+        grad[i] = (results_[2 * i] - results_[2 * i + 1]) / (plus[i] - minus[i]);
+    }
+
+    if(center)
+        *value = results_[2 * n_];
+}
+
+void
+LikelihoodGradient::calculateBatch(int nPoints)
+{
+    if(!distribute_)
+    {
+        like_.calculateBatch(&(points_[0]), n_, nPoints, &(results_[0]));
+        evaluations_ += nPoints;
+        return;
+    }
+
+    // the points are dealt out to the processes in turn, the results of the others are 0 for the sum
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProc = mpi.numProcesses(), processId = mpi.processId();
+    myPoints_.clear();
+    for(int j = processId; j < nPoints; j += nProc)
+        myPoints_.insert(myPoints_.end(), &(points_[j * n_]), &(points_[(j + 1) * n_]));
+
+    const int myN = int(myPoints_.size()) / n_;
+    myResults_.resize(myN);
+    if(myN > 0)
+        like_.calculateBatch(&(myPoints_[0]), n_, myN, &(myResults_[0]));
+    evaluations_ += myN;
+
+    std::fill(results_.begin(), results_.begin() + nPoints, 0.0);
+    for(int k = 0; k < myN; ++k)
+        results_[processId + k * nProc] = myResults_[k];
+
+    total_.resize(nPoints);
+    mpi.reduce(&(results_[0]), &(total_[0]), nPoints, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+    mpi.bcast(&(total_[0]), nPoints, CosmoMPI::DOUBLE);
+    std::copy(total_.begin(), total_.end(), results_.begin());
+}
+
+double
+LikelihoodGradient::Function::evaluate(const std::vector<double>& x) const
+{
+    check(x.size() == g_.n_, "the number of parameters must be " << g_.n_ << ", however " << x.size() << " provided");
+
+    // calculate needs a non-const pointer
+    double* p = &(g_.points_[0]);
+    std::copy(x.begin(), x.end(), p);
+    ++g_.evaluations_;
+    return g_.like_.calculate(p, g_.n_);
+}
+
+void
+LikelihoodGradient::GradientFunction::evaluate(const std::vector<double>& x, std::vector<double>* res) const
+{
+    check(x.size() == g_.n_, "the number of parameters must be " << g_.n_ << ", however " << x.size() << " provided");
+    res->resize(g_.n_);
+    g_.gradient(&(x[0]), &((*res)[0]));
+}
+
+} // namespace Math
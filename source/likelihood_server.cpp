@@ -0,0 +1,303 @@
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <exception>
+#include <chrono>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <likelihood_server.hpp>
+
+namespace
+{
+
+// the request types
+enum RequestType { CALCULATE = 1, CALCULATE_EXACT, SHUTDOWN };
+
+// a request is a header of the type, the number of parameters and the number of points, followed by the parameters of all of the points
+// the reply is a header of the status (0 if successful) and the size, followed by the results or the error message
+const long long maxRequestSize = 1LL << 28;
+
+void throwError(const std::string& message)
+{
+    StandardException exc;
+    std::stringstream exceptionStr;
+    exceptionStr << message;
+    if(errno)
+        exceptionStr << ": " << std::strerror(errno);
+    exceptionStr << ".";
+    exc.set(exceptionStr.str());
+    throw exc;
+}
+
+void setAddress(const std::string& path, sockaddr_un& address)
+{
+    check(path.size() < sizeof(address.sun_path), "the socket path " << path << " is too long, can be at most " << sizeof(address.sun_path) - 1 << " characters");
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path.c_str());
+}
+
+// returns false if the other side has disconnected before sending anything
+bool readAll(int fd, void* data, std::size_t size)
+{
+    char* p = (char*) data;
+    std::size_t done = 0;
+    while(done < size)
+    {
+        const ssize_t n = read(fd, p + done, size - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n == 0 && done == 0)
+            return false;
+        if(n <= 0)
+        {
+            if(n == 0)
+                errno = 0;
+            throwError("Likelihood server connection lost while reading");
+        }
+        done += n;
+    }
+    return true;
+}
+
+void writeAll(int fd, const void* data, std::size_t size)
+{
+    const char* p = (const char*) data;
+    std::size_t done = 0;
+    while(done < size)
+    {
+        // no SIGPIPE if the other side has disconnected, the error is reported instead
+        const ssize_t n = send(fd, p + done, size - done, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            throwError("Likelihood server connection lost while writing");
+        done += n;
+    }
+}
+
+} // namespace
+
+namespace Math
+{
+
+LikelihoodServer::LikelihoodServer(LikelihoodFunction& like, const char* socketPath) : like_(&like), socketPath_(socketPath), socket_(-1), requests_(0), points_(0)
+{
+    sockaddr_un address;
+    setAddress(socketPath_, address);
+
+    socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(socket_ < 0)
+        throwError("Cannot create the likelihood server socket");
+
+    unlink(socketPath_.c_str());
+    if(bind(socket_, (const sockaddr*) &address, sizeof(address)) != 0 || listen(socket_, 16) != 0)
+    {
+        const int err = errno;
+        close(socket_);
+        errno = err;
+        throwError("Cannot create the likelihood server socket " + socketPath_);
+    }
+}
+
+LikelihoodServer::~LikelihoodServer()
+{
+    close(socket_);
+    unlink(socketPath_.c_str());
+}
+
+void
+LikelihoodServer::run()
+{
+    output_screen("Likelihood server listening on " << socketPath_ << std::endl);
+    while(true)
+    {
+        const int connection = accept(socket_, NULL, NULL);
+        if(connection < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throwError("Likelihood server cannot accept connections");
+        }
+
+        bool keepRunning = true;
+        try {
+            keepRunning = serve(connection);
+        } catch (std::exception& e)
+        {
+            // a broken connection only affects that client
+            output_screen("Likelihood server dropped a client: " << e.what() << std::endl);
+        }
+        close(connection);
+
+        if(!keepRunning)
+            break;
+    }
+    output_screen("Likelihood server stopped after " << requests_ << " requests and " << points_ << " points." << std::endl);
+}
+
+bool
+LikelihoodServer::serve(int connection)
+{
+    long long header[3];
+    while(readAll(connection, header, sizeof(header)))
+    {
+        const long long type = header[0], nParams = header[1], nPoints = header[2];
+        errno = 0;
+        if(type < CALCULATE || type > SHUTDOWN || nParams < 0 || nPoints < 0 || nParams * nPoints > maxRequestSize)
+            throwError("Invalid likelihood server request");
+
+        long long reply[2] = {0, 0};
+        if(type == SHUTDOWN)
+        {
+            writeAll(connection, reply, sizeof(reply));
+            return false;
+        }
+
+        params_.resize(nParams * nPoints + 1);
+        results_.resize(nPoints + 1);
+        if(nParams * nPoints > 0)
+            readAll(connection, &(params_[0]), nParams * nPoints * sizeof(double));
+
+        std::string error;
+        try {
+            if(type == CALCULATE)
+                like_->calculateBatch(&(params_[0]), int(nParams), int(nPoints), &(results_[0]));
+            else
+            {
+                for(long long i = 0; i < nPoints; ++i)
+                    results_[i] = like_->calculateExact(&(params_[i * nParams]), int(nParams));
+            }
+        } catch (std::exception& e)
+        {
+            error = e.what();
+            if(error.empty())
+                error = "unknown error";
+        }
+
+        ++requests_;
+        if(error.empty())
+        {
+            points_ += nPoints;
+            reply[1] = nPoints;
+            writeAll(connection, reply, sizeof(reply));
+            writeAll(connection, &(results_[0]), nPoints * sizeof(double));
+        }
+        else
+        {
+            reply[0] = 1;
+            reply[1] = error.size();
+            writeAll(connection, reply, sizeof(reply));
+            writeAll(connection, error.c_str(), error.size());
+        }
+    }
+    return true;
+}
+
+LikelihoodClient::LikelihoodClient(const char* socketPath, double timeout) : socketPath_(socketPath), socket_(-1)
+{
+    check(timeout >= 0, "invalid timeout " << timeout);
+
+    sockaddr_un address;
+    setAddress(socketPath_, address);
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while(true)
+    {
+        socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(socket_ < 0)
+            throwError("Cannot create a likelihood client socket");
+
+        if(connect(socket_, (const sockaddr*) &address, sizeof(address)) == 0)
+            break;
+
+        const int err = errno;
+        close(socket_);
+        socket_ = -1;
+        if(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= timeout)
+        {
+            errno = err;
+            throwError("Cannot connect to the likelihood server at " + socketPath_);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+LikelihoodClient::~LikelihoodClient()
+{
+    if(socket_ >= 0)
+        close(socket_);
+}
+
+double
+LikelihoodClient::calculate(double* params, int nParams)
+{
+    double res;
+    request(CALCULATE, params, nParams, 1, &res);
+    return res;
+}
+
+double
+LikelihoodClient::calculateExact(double* params, int nParams)
+{
+    double res;
+    request(CALCULATE_EXACT, params, nParams, 1, &res);
+    return res;
+}
+
+void
+LikelihoodClient::calculateBatch(double* params, int nParams, int nPoints, double* results)
+{
+    request(CALCULATE, params, nParams, nPoints, results);
+}
+
+void
+LikelihoodClient::shutdownServer()
+{
+    request(SHUTDOWN, NULL, 0, 0, NULL);
+    close(socket_);
+    socket_ = -1;
+}
+
+void
+LikelihoodClient::request(int type, const double* params, int nParams, int nPoints, double* results)
+{
+    check(socket_ >= 0, "the client is not connected");
+    check(nParams >= 0, "invalid number of parameters " << nParams);
+    check(nPoints >= 0, "invalid number of points " << nPoints);
+
+    const long long header[3] = {type, nParams, nPoints};
+    writeAll(socket_, header, sizeof(header));
+    if((long long) nParams * nPoints > 0)
+        writeAll(socket_, params, (std::size_t) nParams * nPoints * sizeof(double));
+
+    long long reply[2];
+    if(!readAll(socket_, reply, sizeof(reply)))
+    {
+        errno = 0;
+        throwError("The likelihood server at " + socketPath_ + " has disconnected");
+    }
+
+    if(reply[0] != 0)
+    {
+        std::string error(reply[1], ' ');
+        if(reply[1] > 0)
+            readAll(socket_, &(error[0]), reply[1]);
+        StandardException exc;
+        exc.set("Likelihood server: " + error);
+        throw exc;
+    }
+
+    check(reply[1] == nPoints, "the likelihood server returned " << reply[1] << " results, expected " << nPoints);
+    if(nPoints > 0)
+        readAll(socket_, results, nPoints * sizeof(double));
+}
+
+} // namespace Math
+
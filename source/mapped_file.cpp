@@ -0,0 +1,205 @@
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <mapped_file.hpp>
+
+namespace
+{
+
+// written as a number, reads differently on a machine with the other byte order
+const unsigned int byteOrderTag = 0x01020304;
+const unsigned int swappedByteOrderTag = 0x04030201;
+
+static_assert(sizeof(Math::MappedFileHeader) <= Math::MappedFile::headerSize, "the common fields must fit in the header");
+
+} // namespace
+
+namespace Math
+{
+
+const int MappedFile::headerSize;
+const unsigned long MappedFile::wholeFile;
+
+void
+MappedFile::map(const char* fileName, unsigned long size, const char* what, bool copyOnWrite)
+{
+    unmap();
+
+    StandardException exc;
+    const int fd = open(fileName, O_RDONLY);
+    if(fd < 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size != wholeFile && (unsigned long)(st.st_size) < size))
+    {
+        close(fd);
+        std::stringstream exceptionStr;
+        exceptionStr << "The " << what << " file " << fileName << " is incomplete.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(size == wholeFile)
+        size = st.st_size;
+
+    if(size == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    // copy on write, the elements can be changed without changing the file
+    void* map = (copyOnWrite ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0));
+    close(fd);
+
+    if(map == MAP_FAILED)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot memory map the " << what << " file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    map_ = map;
+    size_ = size;
+}
+
+void
+MappedFile::unmap()
+{
+    if(map_)
+        munmap(map_, size_);
+    map_ = NULL;
+    size_ = 0;
+}
+
+void
+MappedFile::initHeader(const char* magic, int version, int elementSize, MappedFileHeader* header)
+{
+    std::memset(header, 0, headerSize);
+    std::memcpy(header->magic, magic, 8);
+    header->byteOrder = byteOrderTag;
+    header->version = version;
+    header->elementSize = elementSize;
+}
+
+bool
+MappedFile::readHeader(const char* fileName, const char* magic, const char* what, MappedFileHeader* header)
+{
+    StandardException exc;
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    in.read((char*)header, headerSize);
+    if(!in || std::memcmp(header->magic, magic, 8) != 0)
+        return false;
+
+    if(header->byteOrder == swappedByteOrderTag)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The " << what << " file " << fileName << " was written on a machine with a different byte order, it cannot be memory mapped.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(header->byteOrder != byteOrderTag)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The " << what << " file " << fileName << " has an invalid header.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    return true;
+}
+
+bool
+MappedFile::hasMagic(const char* fileName, const char* magic)
+{
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    char fileMagic[8];
+    in.read(fileMagic, 8);
+    return in && std::memcmp(fileMagic, magic, 8) == 0;
+}
+
+void
+MappedFile::write(const char* fileName, const MappedFileHeader* header, const void* data, unsigned long dataSize)
+{
+    check(dataSize == 0 || data, "");
+
+    ReplacingOutputFile out(fileName);
+    out.stream().write((const char*)header, headerSize);
+    if(dataSize > 0)
+        out.stream().write((const char*)data, dataSize);
+    out.commit();
+}
+
+ReplacingOutputFile::ReplacingOutputFile(const char* fileName) : fileName_(fileName), tempFileName_(std::string(fileName) + ".tmp"), out_(tempFileName_.c_str(), std::ios::out | std::ios::binary | std::ios::trunc), committed_(false)
+{
+    if(!out_)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << tempFileName_ << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+ReplacingOutputFile::~ReplacingOutputFile()
+{
+    if(committed_)
+        return;
+
+    out_.close();
+    std::remove(tempFileName_.c_str());
+}
+
+void
+ReplacingOutputFile::commit()
+{
+    check(!committed_, "already committed");
+
+    out_.close();
+    StandardException exc;
+    if(!out_)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Failed to write into output file " << tempFileName_ << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(std::rename(tempFileName_.c_str(), fileName_.c_str()) != 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot rename " << tempFileName_ << " to " << fileName_ << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    committed_ = true;
+}
+
+} // namespace Math
+
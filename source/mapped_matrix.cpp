@@ -0,0 +1,95 @@
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <matrix_impl.hpp>
+#include <mapped_matrix.hpp>
+
+namespace
+{
+
+const char mappedMatrixMagic[8] = {'C', 'O', 'S', 'M', 'O', 'M', 'A', 'T'};
+const int mappedMatrixVersion = 1;
+
+struct MappedMatrixHeader : public Math::MappedFileHeader
+{
+    int symmetric;
+    long long rows;
+    long long cols;
+    char padding[Math::MappedFile::headerSize - sizeof(Math::MappedFileHeader) - sizeof(int) - 2 * sizeof(long long)];
+};
+
+static_assert(sizeof(MappedMatrixHeader) == Math::MappedFile::headerSize, "the matrix header must have the size of the MappedFile header");
+
+} // namespace
+
+namespace Math
+{
+
+MappedMatrix::MappedMatrix(const char* fileName) : rows_(0), cols_(0), symmetric_(false), size_(0), data_(NULL)
+{
+    MappedMatrixHeader header;
+    const bool valid = MappedFile::readHeader(fileName, mappedMatrixMagic, "matrix", &header);
+
+    if(!valid || header.version != mappedMatrixVersion || header.elementSize != sizeof(double) || header.rows < 0 || header.cols < 0 || (header.symmetric && header.rows != header.cols))
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " does not contain a valid matrix.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    rows_ = int(header.rows);
+    cols_ = int(header.cols);
+    symmetric_ = (header.symmetric != 0);
+    size_ = symmetric_ ? (unsigned long)(rows_) * (rows_ + 1) / 2 : (unsigned long)(rows_) * cols_;
+
+    file_.map(fileName, MappedFile::headerSize + size_ * sizeof(double), "matrix");
+    data_ = (const double*)((const char*)file_.data() + MappedFile::headerSize);
+}
+
+bool
+MappedMatrix::isMappedMatrixFile(const char* fileName)
+{
+    return MappedFile::hasMagic(fileName, mappedMatrixMagic);
+}
+
+void
+MappedMatrix::writeIntoFile(const Matrix<double>& mat, const char* fileName)
+{
+    const double* data = (mat.rows() > 0 && mat.cols() > 0) ? &(mat(0, 0)) : NULL;
+    writeIntoFile(mat.rows(), mat.cols(), mat.isSymmetric(), data, fileName);
+}
+
+void
+MappedMatrix::writeIntoFile(int rows, int cols, bool symmetric, const double* data, const char* fileName)
+{
+    check(rows >= 0, "invalid number of rows " << rows);
+    check(cols >= 0, "invalid number of columns " << cols);
+    check(!symmetric || rows == cols, "a symmetric matrix must be square");
+
+    MappedMatrixHeader header;
+    MappedFile::initHeader(mappedMatrixMagic, mappedMatrixVersion, sizeof(double), &header);
+    header.symmetric = symmetric ? 1 : 0;
+    header.rows = rows;
+    header.cols = cols;
+
+    const unsigned long size = symmetric ? (unsigned long)(rows) * (rows + 1) / 2 : (unsigned long)(rows) * cols;
+    MappedFile::write(fileName, &header, data, size * sizeof(double));
+}
+
+void
+MappedMatrix::copyTo(Matrix<double>* res) const
+{
+    check(res->isSymmetric() == symmetric_, (symmetric_ ? "the matrix is symmetric, must copy into a SymmetricMatrix" : "the matrix is not symmetric, cannot copy into a SymmetricMatrix"));
+
+    res->resize(rows_, cols_);
+    if(size_ > 0)
+        std::copy(data_, data_ + size_, &((*res)(0, 0)));
+}
+
+} // namespace Math
+
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <utility>
 #include <cmath>
+#include <cstdlib>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -12,7 +13,9 @@
 #include <gauss_smooth.hpp>
 #include <progress_meter.hpp>
 #include <markov_chain.hpp>
+#include <chain_file.hpp>
 #include <numerics.hpp>
+#include <fft.hpp>
 
 void
 Posterior1D::addPoint(double x, double prob, double like, double errMean, double errVar)
@@ -35,6 +38,39 @@ Posterior1D::addPoint(double x, double prob, double like, double errMean, double
     }
 }
 
+void
+Posterior1D::addPoints(const double* x, const double* prob, const double* like, unsigned long n, const double* errMean, const double* errVar)
+{
+    const unsigned long oldSize = points_.size();
+    points_.insert(points_.end(), x, x + n);
+    probs_.insert(probs_.end(), prob, prob + n);
+    likes_.insert(likes_.end(), like, like + n);
+
+    if(errMean)
+        errMean_.insert(errMean_.end(), errMean, errMean + n);
+    else
+        errMean_.resize(oldSize + n, 0);
+
+    if(errVar)
+        errVar_.insert(errVar_.end(), errVar, errVar + n);
+    else
+        errVar_.resize(oldSize + n, 0);
+
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        if(x[i] < min_)
+            min_ = x[i];
+        if(x[i] > max_)
+            max_ = x[i];
+
+        if(like[i] < minLike_)
+        {
+            minLike_ = like[i];
+            maxLikePoint_ = x[i];
+        }
+    }
+}
+
 namespace
 {
 
@@ -101,6 +137,12 @@ Posterior1D::generate(SmoothingMethod method, double scale)
 
     check(resolution > 0, "");
 
+    if(method == BINNED_GAUSSIAN_SMOOTHING)
+    {
+        generateBinned(scale, resolution);
+        return;
+    }
+
     std::vector<double> x(resolution + 2), y(resolution + 2, 0), vars(resolution + 2, 0);
     const double d = (max_ - min_) / resolution;
     x[0] = min_;
@@ -175,51 +217,181 @@ Posterior1D::generate(SmoothingMethod method, double scale)
         break;
     }
 
-    const int N = 100 * resolution;
-    const double delta = (x[x.size() - 1] - x[0]) / N;
-    cumulInv_ = new Math::TableFunction<double, double>;
-    double maxVal = 0, maxX;
-    norm_ = 0;
-    (*cumulInv_)[0] = 0;
-    for(int i = 0; i <= N; ++i)
+    generateCumulInv(100 * resolution);
+
+    deltaNorm_ = varNorm / totalP * norm_;
+
+    points_.clear();
+    probs_.clear();
+}
+
+void
+Posterior1D::generateBinned(double scale, int resolution)
+{
+    // the grid spacing is at most a quarter of the smoothing scale
+    const unsigned long maxGrid = 1 << 16;
+    unsigned long gridSize = (unsigned long)std::ceil(4 * (max_ - min_) / scale) + 1;
+    if(gridSize < resolution + 2)
+        gridSize = resolution + 2;
+    if(gridSize > maxGrid)
+        gridSize = maxGrid;
+
+    const double d = (max_ - min_) / (gridSize - 1);
+
+    // linear binning of the weights onto the grid
+    std::vector<double> y(gridSize, 0), vars(gridSize, 0);
+    mean_ = 0;
+    double totalP = 0;
+    for(unsigned long i = 0; i < points_.size(); ++i)
     {
-        double v = x[0] + i * delta;
-        
-        if(i == N)
-            v = x[x.size() - 1];
+        const double p = points_[i];
+        check(p >= min_, "");
+        const double t = (p - min_) / d;
+        unsigned long k = (unsigned long)t;
+        if(k >= gridSize - 1)
+            k = gridSize - 2;
+        const double f = t - k;
+
+        y[k] += (1 - f) * probs_[i];
+        y[k + 1] += f * probs_[i];
+        mean_ += p * probs_[i];
+        totalP += probs_[i];
 
-        check(v <= x[x.size() - 1], "");
+        const double v = probs_[i] * errVar_[i] / 4; // divide by 4 since the variance is for -2logL, want logL
+        vars[k] += (1 - f) * v;
+        vars[k + 1] += f * v;
+    }
 
-        double y = smooth_->evaluate(v);
-        if(y < 0)
-            y = 0;
+    double varNorm = 0;
+    for(unsigned long i = 0; i < gridSize; ++i)
+    {
+        vars[i] = std::sqrt(vars[i]);
 
-        if(y > maxVal)
-        {
-            maxVal = y;
-            maxX = v;
-        }
+        // re-weighing the points so that each point has a weight of 1 on average
+        vars[i] /= std::sqrt(points_.size() / totalP);
+        varNorm += vars[i] * vars[i];
+    }
+    varNorm = std::sqrt(varNorm);
 
-        norm_ += y * delta;
-        (*cumulInv_)[norm_] = v;
+    check(totalP, "");
+    mean_ /= totalP;
+
+    if(smooth_)
+    {
+        check(cumulInv_, "");
+        delete smooth_;
+        delete cumulInv_;
     }
 
+    smooth_ = new Math::BinnedGaussSmooth(min_, max_, y, scale, &vars);
+
+    generateCumulInv(100 * resolution);
+
     deltaNorm_ = varNorm / totalP * norm_;
 
     points_.clear();
     probs_.clear();
 }
 
+void
+Posterior1D::generateCumulInv(int N)
+{
+    const double delta = (max_ - min_) / N;
+    Math::TableFunction<double, double> cumulInv;
+    norm_ = 0;
+    cumulInv[0] = 0;
+    std::vector<double> v(N + 1), y(N + 1);
+    for(int i = 0; i <= N; ++i)
+    {
+        v[i] = (i == N ? max_ : min_ + i * delta);
+        check(v[i] <= max_, "");
+    }
+    smooth_->evaluate(N + 1, &(v[0]), &(y[0]));
+
+    for(int i = 0; i <= N; ++i)
+    {
+        if(y[i] < 0)
+            y[i] = 0;
+
+        norm_ += y[i] * delta;
+        cumulInv[norm_] = v[i];
+    }
+
+    // sampling evaluates this many times, so freeze it into contiguous arrays
+    cumulInv_ = new Math::FlatTableFunction<double, double>(cumulInv);
+}
+
+void
+Posterior1D::evaluate(unsigned long n, const double* x, double* res) const
+{
+    check(smooth_, "not generated");
+    smooth_->evaluate(n, x, res);
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        res[i] /= norm_;
+        if(res[i] < 0.0)
+            res[i] = 0.0;
+    }
+}
+
+void
+Posterior1D::generateSamples(unsigned long n, double* samples, bool sorted)
+{
+    check(cumulInv_, "not generated");
+    if(n == 0)
+        return;
+
+    if(!sorted)
+    {
+        for(unsigned long i = 0; i < n; ++i)
+            samples[i] = generator_.generate() * norm_;
+        cumulInv_->evaluate(n, samples, samples);
+        return;
+    }
+
+    // the partial sums of n + 1 exponential random numbers divided by the total are distributed as n sorted uniform random numbers
+    double sum = 0;
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        sum -= std::log(generator_.generate());
+        samples[i] = sum;
+    }
+    sum -= std::log(generator_.generate());
+
+    // the same range as for generateSample
+    const double uMin = 1e-5, uMax = 1.0 - 1e-5;
+    for(unsigned long i = 0; i < n; ++i)
+        samples[i] = (uMin + (uMax - uMin) * samples[i] / sum) * norm_;
+
+    cumulInv_->evaluateSorted(n, samples, samples);
+}
+
 double
 Posterior1D::evaluateError(double x) const
 {
     check(smooth_, "not generated");
 
-    if(method_ != GAUSSIAN_SMOOTHING)
+    double a, deltaA;
+    switch(method_)
+    {
+    case GAUSSIAN_SMOOTHING:
+        {
+            Math::GaussSmooth* gs = (Math::GaussSmooth*) smooth_;
+            a = gs->evaluate(x);
+            deltaA = gs->evaluateError(x);
+        }
+        break;
+    case BINNED_GAUSSIAN_SMOOTHING:
+        {
+            Math::BinnedGaussSmooth* gs = (Math::BinnedGaussSmooth*) smooth_;
+            a = gs->evaluate(x);
+            deltaA = gs->evaluateError(x);
+        }
+        break;
+    default:
         return 0;
+    }
 
-    Math::GaussSmooth* gs = (Math::GaussSmooth*) smooth_;
-    const double a = gs->evaluate(x), deltaA = gs->evaluateError(x);
     return a / norm_ * std::sqrt(deltaA * deltaA / (a * a) + deltaNorm_ * deltaNorm_ / (norm_ * norm_));
 }
 
@@ -302,7 +474,34 @@ Posterior2D::addPoint(double x1, double x2, double prob, double like)
 }
 
 void
-Posterior2D::generate(double scale1, double scale2)
+Posterior2D::addPoints(const double* x1, const double* x2, const double* prob, const double* like, unsigned long n)
+{
+    points1_.insert(points1_.end(), x1, x1 + n);
+    points2_.insert(points2_.end(), x2, x2 + n);
+    probs_.insert(probs_.end(), prob, prob + n);
+
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        if(x1[i] < min1_)
+            min1_ = x1[i];
+        if(x2[i] < min2_)
+            min2_ = x2[i];
+        if(x1[i] > max1_)
+            max1_ = x1[i];
+        if(x2[i] > max2_)
+            max2_ = x2[i];
+
+        if(like[i] < minLike_)
+        {
+            minLike_ = like[i];
+            maxLikePoint1_ = x1[i];
+            maxLikePoint2_ = x2[i];
+        }
+    }
+}
+
+void
+Posterior2D::generate(double scale1, double scale2, SmoothingMethod method)
 {
     std::vector<std::pair<double, double> > points1Sorted(points1_.size());
     double totalWeight = 0;
@@ -384,54 +583,6 @@ Posterior2D::generate(double scale1, double scale2)
     check(res1 > 0, "");
     check(res2 > 0, "");
 
-    std::vector<double> x1(res1 + 2), x2(res2 + 2);
-    std::vector<std::vector<double> > y(res1 + 2);
-    for(int i = 0; i < res1 + 2; ++i)
-        y[i].resize(res2 + 2, 0);
-
-    const double d1 = (max1_ - min1_) / res1;
-    x1[0] = min1_;
-    x1[res1 + 1] = max1_;
-    for(int i = 0; i < res1; ++i)
-        x1[i + 1] = min1_ + d1 * i + d1 / 2;
-
-    const double d2 = (max2_ - min2_) / res2;
-    x2[0] = min2_;
-    x2[res2 + 1] = max2_;
-    for(int i = 0; i < res2; ++i)
-        x2[i + 1] = min2_ + d2 * i + d2 / 2;
-
-    for(unsigned long i = 0; i < points1_.size(); ++i)
-    {
-        const double p1 = points1_[i];
-        const double p2 = points2_[i];
-        check(p1 >= min1_, "");
-        check(p2 >= min2_, "");
-        int k1 = (int)std::floor((p1 - min1_) / d1);
-        int k2 = (int)std::floor((p2 - min2_) / d2);
-        check(k1 >= 0, "");
-        check(k2 >= 0, "");
-        if(k1 >= res1)
-            k1 = res1 - 1;
-        if(k2 >= res2)
-            k2 = res2 - 1;
-
-        y[k1 + 1][k2 + 1] += probs_[i];
-    }
-
-    // to make sure edges are smooth
-    for(int i = 0; i < y.size(); ++i)
-    {
-        y[i][0] = y[i][1];
-        y[i][res2 + 1] = y[i][res2];
-    }
-
-    for(int i = 0; i < res2 + 2; ++i)
-    {
-        y[0][i] = y[1][i];
-        y[res1 + 1][i] = y[res1][i];
-    }
-
     if(smooth_)
     {
         check(cumulInv_, "");
@@ -440,76 +591,172 @@ Posterior2D::generate(double scale1, double scale2)
         delete cumulInv_;
     }
 
-    smooth_ = new Math::GaussSmooth2D(x1, x2, y, scale1, scale2);
+    switch(method)
+    {
+    case GAUSSIAN_SMOOTHING:
+        smooth_ = histogramSmooth(res1, res2, scale1, scale2);
+        break;
+    case BINNED_GAUSSIAN_SMOOTHING:
+        smooth_ = binnedSmooth(scale1, scale2);
+        break;
+    default:
+        check(false, "");
+        break;
+    }
 
     const int N1 = 1000, N2 = 1000;
-    const double delta1 = (x1[x1.size() - 1] - x1[0]) / N1;
-    const double delta2 = (x2[x2.size() - 1] - x2[0]) / N2;
+    const double delta1 = (max1_ - min1_) / N1;
+    const double delta2 = (max2_ - min2_) / N2;
 
     std::vector<double> probs;
     norm_ = 0;
     output_screen("Sampling the 2D distribution..." << std::endl);
     ProgressMeter met((N1 + 1) * (N2 + 1));
+
+    std::vector<double> v1Row(N2 + 1), v2Row(N2 + 1), yRow(N2 + 1);
+    for(int j = 0; j <= N2; ++j)
+    {
+        v2Row[j] = (j == N2 ? max2_ : min2_ + j * delta2);
+        check(v2Row[j] <= max2_, "");
+    }
+
     for(int i = 0; i <= N1; ++i)
     {
-        double v1 = x1[0] + i * delta1;
+        double v1 = min1_ + i * delta1;
         if(i == N1)
-            v1 = x1[x1.size() - 1];
+            v1 = max1_;
+
+        check(v1 <= max1_, "");
 
-        check(v1 <= x1[x1.size() - 1], "");
+        // a whole row at once
+        std::fill(v1Row.begin(), v1Row.end(), v1);
+        smooth_->evaluate(N2 + 1, &(v1Row[0]), &(v2Row[0]), &(yRow[0]));
         
         for(int j = 0; j <= N2; ++j)
         {
-            double v2 = x2[0] + j * delta2;
-            if(j == N2)
-                v2 = x2[x2.size() - 1];
-
-            check(v2 <= x2[x2.size() - 1], "");
-
-            double y = smooth_->evaluate(v1, v2);
+            const double y = yRow[j];
             probs.push_back(y);
             norm_ += y * delta1 * delta2;
-            met.advance();
         }
+        met.advance(N2 + 1);
     }
     output_screen("OK" << std::endl);
 
     check(norm_ > 0, "");
 
     std::sort(probs.begin(), probs.end());
-    cumulInv_ = new Math::TableFunction<double, double>;
+
+    // one pass over the sorted values gives the levels for all of the confidences, frozen into contiguous arrays for the queries
+    std::vector<double> totals, levels;
+    totals.reserve(probs.size() + 1);
+    levels.reserve(probs.size() + 1);
 
     double total = 0;
     int index = probs.size() - 1;
     while(total < 1 && index >= 0)
     {
         const double currentP = probs[index] / norm_;
-        (*cumulInv_)[total] = currentP;
+        if(!totals.empty() && totals.back() == total)
+            levels.back() = currentP;
+        else
+        {
+            totals.push_back(total);
+            levels.push_back(currentP);
+        }
         total += currentP * delta1 * delta2;
         --index;
     }
-    (*cumulInv_)[1] = 0;
+    if(totals.back() == 1)
+        levels.back() = 0;
+    else
+    {
+        totals.push_back(1);
+        levels.push_back(0);
+    }
+    cumulInv_ = new Math::FlatTableFunction<double, double>(totals, levels);
 
     points1_.clear();
     points2_.clear();
     probs_.clear();
 }
 
-bool lessMarkovChainElementPointer(MarkovChain::Element* i, MarkovChain::Element* j)
+namespace
+{
+
+struct LessLikeIndex
+{
+    LessLikeIndex(const std::vector<double>& likes) : likes_(likes) {}
+
+    bool operator() (unsigned long i, unsigned long j) const
+    {
+        return likes_[i] < likes_[j];
+    }
+
+private:
+    const std::vector<double>& likes_;
+};
+
+// The elements of a chain left after the burnin and the thinning, and their new weights.
+// With countSteps the weights are the multiplicities of the elements, and the burnin and the thinning count the steps: the element of weight w stands for w steps, and is kept with the number of its steps that are kept as the weight.
+void selectElements(const std::vector<double>& chainWeights, unsigned long burnin, unsigned int thin, bool countSteps, std::vector<unsigned long>* elements, std::vector<double>* weights)
 {
-    return (*i) < (*j);
+    const unsigned long n = chainWeights.size();
+    elements->clear();
+    weights->clear();
+
+    if(!countSteps)
+    {
+        for(unsigned long i = burnin; i < n; i += thin)
+        {
+            elements->push_back(i);
+            weights->push_back(chainWeights[i]);
+        }
+        return;
+    }
+
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        const double w = chainWeights[i];
+        if(!(w >= 1 && w == std::floor(w)))
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "The weight " << w << " of the element " << i << " is not a positive integer, the burnin and the thinning cannot be counted in steps.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+    }
+
+    // the steps of the element i are from step to end - 1, the kept steps are burnin, burnin + thin, ...
+    unsigned long step = 0;
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        const unsigned long end = step + (unsigned long)(chainWeights[i]);
+        unsigned long first = std::max(step, burnin);
+        const unsigned long r = (first - burnin) % thin;
+        if(r)
+            first += thin - r;
+        if(first < end)
+        {
+            elements->push_back(i);
+            weights->push_back(double((end - 1 - first) / thin + 1));
+        }
+        step = end;
+    }
 }
 
-MarkovChain::MarkovChain(const char* fileName, unsigned long burnin, unsigned int thin, const char *errorLogFileNameBase, int nError)
+}
+
+MarkovChain::MarkovChain(const char* fileName, unsigned long burnin, unsigned int thin, const char *errorLogFileNameBase, int nError, bool countSteps) : nParams_(-1)
 {
     if(errorLogFileNameBase)
         readErrorFiles(nError, errorLogFileNameBase);
 
     minLike_ = std::numeric_limits<double>::max();
-    addFile(fileName, burnin, thin);
+    addFile(fileName, burnin, thin, countSteps);
 }
 
-MarkovChain::MarkovChain(int nChains, const char* fileNameRoot, unsigned long burnin, unsigned int thin, const char *errorLogFileNameBase)
+MarkovChain::MarkovChain(int nChains, const char* fileNameRoot, unsigned long burnin, unsigned int thin, const char *errorLogFileNameBase, bool countSteps) : nParams_(-1)
 {
     check(nChains > 0, "need at least 1 chain");
 
@@ -518,154 +765,378 @@ MarkovChain::MarkovChain(int nChains, const char* fileNameRoot, unsigned long bu
 
     minLike_ = std::numeric_limits<double>::max();
 
-    std::vector<Element*> bigChain;
-    double maxP = std::numeric_limits<double>::min();
+    // all of the chains in one shared file, each one is read from its own slice
+    const std::string sharedFileName = std::string(fileNameRoot) + ".bin";
+    if(SharedBinaryChain::isShared(sharedFileName.c_str()))
+    {
+        MappedSharedBinaryChain mapped(sharedFileName.c_str());
+        if(mapped.nChains() != nChains)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "The shared chain file " << sharedFileName << " contains " << mapped.nChains() << " chains, expected " << nChains << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        output_screen("Reading " << nChains << " chains from the shared chain file " << sharedFileName << "..." << std::endl);
+        std::vector<ChainColumns> parts(nChains);
+        std::vector<std::string> fileNames(nChains);
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+        for(int i = 0; i < nChains; ++i)
+            readSharedChain(mapped, i, burnin, thin, countSteps, parts[i]);
+
+        for(int i = 0; i < nChains; ++i)
+        {
+            std::stringstream name;
+            name << sharedFileName << " (chain " << i << ")";
+            fileNames[i] = name.str();
+        }
+        output_screen("OK" << std::endl);
+
+        mergeParts(parts, fileNames);
+        return;
+    }
+
+    std::vector<std::string> fileNames(nChains);
     for(int i = 0; i < nChains; ++i)
     {
         std::stringstream fileName;
         fileName << fileNameRoot;
         if(nChains > 1)
             fileName << '_' << i;
-        fileName << ".txt";
-        double thisMaxP;
-        readFile(fileName.str().c_str(), burnin, thin, bigChain, thisMaxP);
-        if(thisMaxP > maxP)
-            maxP = thisMaxP;
+
+        // binary chains are used if the text chain does not exist
+        std::ifstream testIn((fileName.str() + ".txt").c_str());
+        const std::string binFileName = fileName.str() + ".bin";
+        fileName << (testIn || !(BinaryChain::isBinary(binFileName.c_str()) || CompressedBinaryChain::isCompressed(binFileName.c_str())) ? ".txt" : ".bin");
+        testIn.close();
+        fileNames[i] = fileName.str();
     }
 
-    double minP = maxP / bigChain.size() / 1000;
-    filterChain(bigChain, minP);
+    // the files are read concurrently, each one into its own part, and then merged in order
+    std::vector<ChainColumns> parts(nChains);
+    std::vector<std::string> errorMessages(nChains);
 
-    output_screen("Sorting the chain..." << std::endl);
-    std::sort(chain_.begin(), chain_.end(), lessMarkovChainElementPointer);
-    output_screen("OK" << std::endl);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int i = 0; i < nChains; ++i)
+    {
+        try {
+            readFile(fileNames[i].c_str(), burnin, thin, countSteps, parts[i]);
+        } catch (std::exception& e)
+        {
+            errorMessages[i] = e.what();
+            if(errorMessages[i].empty())
+                errorMessages[i] = "Unknown error";
+        }
+    }
+
+    for(int i = 0; i < nChains; ++i)
+    {
+        if(!errorMessages[i].empty())
+        {
+            StandardException exc;
+            exc.set(errorMessages[i]);
+            throw exc;
+        }
+    }
+
+    mergeParts(parts, fileNames);
 }
 
 MarkovChain::~MarkovChain()
 {
-    for(unsigned long i = 0; i < chain_.size(); ++i)
-        delete chain_[i];
 }
 
 void
-MarkovChain::addFile(const char* fileName, unsigned long burnin, unsigned int thin)
+MarkovChain::addFile(const char* fileName, unsigned long burnin, unsigned int thin, bool countSteps)
 {
-    std::vector<Element*> bigChain;
-    double maxP;
-    readFile(fileName, burnin, thin, bigChain, maxP);
-    double minP = maxP / bigChain.size() / 1000;
-    filterChain(bigChain, minP);
+    std::vector<ChainColumns> parts(1);
+    readFile(fileName, burnin, thin, countSteps, parts[0]);
 
-    output_screen("Sorting the chain..." << std::endl);
-    std::sort(chain_.begin(), chain_.end(), lessMarkovChainElementPointer);
-    output_screen("OK" << std::endl);
+    std::vector<std::string> fileNames(1, std::string(fileName));
+    mergeParts(parts, fileNames);
 }
 
 void
-MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int thin, std::vector<Element*>& bigChain, double& maxP)
+MarkovChain::ChainColumns::resize(int n)
 {
-    check(thin > 0, "thin factor cannot be 0");
-
-    StandardException exc;
-    std::ifstream in(fileName);
+    params.resize(n);
+}
 
-    if(!in)
+void
+MarkovChain::ChainColumns::filter(double minP, bool parallel)
+{
+    std::vector<unsigned long> kept;
+    kept.reserve(probs.size());
+    for(unsigned long i = 0; i < probs.size(); ++i)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot open input file " << fileName << ".";
+        if(probs[i] >= minP)
+            kept.push_back(i);
+    }
+
+    if(kept.size() == probs.size())
+        return;
+
+    // every column is compacted separately, keeping the order of the elements
+    const int nColumns = 4 + params.size();
+#pragma omp parallel for default(shared) if(parallel)
+    for(int k = 0; k < nColumns; ++k)
+    {
+        std::vector<double>& col = (k == 0 ? probs : (k == 1 ? likes : (k == 2 ? errMeans : (k == 3 ? errVars : params[k - 4]))));
+        for(unsigned long i = 0; i < kept.size(); ++i)
+            col[i] = col[kept[i]];
+        col.resize(kept.size());
+    }
+}
+
+void
+MarkovChain::addElement(ChainColumns& part, double prob, double like, const double* params, int& found, int& notFound) const
+{
+    part.probs.push_back(prob);
+    part.likes.push_back(like);
+    for(int j = 0; j < part.params.size(); ++j)
+        part.params[j].push_back(params[j]);
+
+    double errMean = 0, errVar = 0;
+    if(!errors_.empty())
+    {
+        if(findError(params, part.params.size(), like, errMean, errVar))
+            ++found;
+        else
+            ++notFound;
+    }
+    part.errMeans.push_back(errMean);
+    part.errVars.push_back(errVar);
+
+    if(prob > part.maxP)
+        part.maxP = prob;
+
+    if(like < part.minLike)
+        part.minLike = like;
+}
+
+void
+MarkovChain::mergeParts(std::vector<ChainColumns>& parts, const std::vector<std::string>& fileNames)
+{
+    check(parts.size() == fileNames.size(), "");
+
+    double maxP = std::numeric_limits<double>::min();
+    unsigned long total = 0;
+    for(int i = 0; i < parts.size(); ++i)
+    {
+        const int n = parts[i].params.size();
+        if(nParams_ == -1)
+        {
+            nParams_ = n;
+            params_.resize(nParams_);
+        }
+        else if(n != nParams_)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid chain file " << fileNames[i] << ". It has " << n << " parameters while the previous chains had " << nParams_ << " parameters.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        if(parts[i].maxP > maxP)
+            maxP = parts[i].maxP;
+
+        if(parts[i].minLike < minLike_)
+            minLike_ = parts[i].minLike;
+
+        total += parts[i].size();
+    }
+
+    if(total == 0)
+    {
+        sortChain();
+        return;
+    }
+
+    const double minP = maxP / total / 1000;
+
+    output_screen("Filtering the chain..." << std::endl);
+    const int nParts = parts.size();
+#pragma omp parallel for default(shared) schedule(dynamic) if(nParts > 1)
+    for(int i = 0; i < nParts; ++i)
+        parts[i].filter(minP, nParts == 1);
+
+    const unsigned long begin = probs_.size();
+    std::vector<unsigned long> offsets(nParts + 1, begin);
+    for(int i = 0; i < nParts; ++i)
+        offsets[i + 1] = offsets[i] + parts[i].size();
+
+    const unsigned long newSize = offsets[nParts];
+    probs_.resize(newSize);
+    likes_.resize(newSize);
+    errMeans_.resize(newSize);
+    errVars_.resize(newSize);
+    for(int j = 0; j < nParams_; ++j)
+        params_[j].resize(newSize);
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int i = 0; i < nParts; ++i)
+    {
+        const ChainColumns& part = parts[i];
+        std::copy(part.probs.begin(), part.probs.end(), probs_.begin() + offsets[i]);
+        std::copy(part.likes.begin(), part.likes.end(), likes_.begin() + offsets[i]);
+        std::copy(part.errMeans.begin(), part.errMeans.end(), errMeans_.begin() + offsets[i]);
+        std::copy(part.errVars.begin(), part.errVars.end(), errVars_.begin() + offsets[i]);
+        for(int j = 0; j < nParams_; ++j)
+            std::copy(part.params[j].begin(), part.params[j].end(), params_[j].begin() + offsets[i]);
+    }
+    output_screen("OK" << std::endl);
+    output_screen(newSize - begin << " elements left after filtering!" << std::endl);
+
+    sortChain();
+}
+
+void
+MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const
+{
+    check(thin > 0, "thin factor cannot be 0");
+
+    if(BinaryChain::isBinary(fileName))
+    {
+        readBinaryFile(fileName, burnin, thin, countSteps, part);
+        return;
+    }
+
+    if(CompressedBinaryChain::isCompressed(fileName))
+    {
+        readCompressedFile(fileName, burnin, thin, countSteps, part);
+        return;
+    }
+
+    if(SharedBinaryChain::isShared(fileName))
+    {
+        output_screen("Reading the shared chain file " << fileName << "..." << std::endl);
+        MappedSharedBinaryChain mapped(fileName);
+        for(int i = 0; i < mapped.nChains(); ++i)
+            readSharedChain(mapped, i, burnin, thin, countSteps, part);
+        output_screen("OK" << std::endl);
+        output_screen("Successfully read the " << mapped.nChains() << " chains from " << fileName << ". They have " << part.size() << " elements, " << part.params.size() << " parameters." << std::endl);
+        return;
+    }
+
+    StandardException exc;
+    std::ifstream in(fileName);
+
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
         exc.set(exceptionStr.str());
         throw exc;
     }
 
     output_screen("Reading the chain from file " << fileName << "..." << std::endl);
-    nParams_ = -1;
     unsigned long line = 0;
-    maxP = std::numeric_limits<double>::min();
 
     int notFound = 0, found = 0;
+    int fileParams = -1;
 
-    while(!in.eof())
+    std::string s;
+    std::vector<double> values, rows;
+    while(std::getline(in, s))
     {
-        std::string s;
-        std::getline(in, s);
         if(s == "")
             break;
 
-        std::stringstream str(s);
-        Element* elem = new Element;
-        str >> elem->prob >> elem->like;
-
-        elem->errMean = 0;
-        elem->errVar = 0;
-
-        if(elem->prob > maxP)
-            maxP = elem->prob;
-
-        if(elem->like < minLike_)
-            minLike_ = elem->like;
-
-        while(!str.eof())
+        values.clear();
+        const char* current = s.c_str();
+        while(true)
         {
-            double val = std::numeric_limits<double>::min();
-            str >> val;
-            if(val == std::numeric_limits<double>::min())
+            char* next;
+            const double val = std::strtod(current, &next);
+            if(next == current)
                 break;
-
-            elem->params.push_back(val);
+            values.push_back(val);
+            current = next;
         }
 
-        if(nParams_ == -1)
-            nParams_ = elem->params.size();
+        if(values.size() < 2)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid chain file " << fileName << ". Line " << line << " does not contain the weight and the likelihood.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
 
-        else if (nParams_ != elem->params.size())
+        const int n = values.size() - 2;
+        if(fileParams == -1)
+        {
+            fileParams = n;
+            part.resize(n);
+        }
+        else if (fileParams != n)
         {
             std::stringstream exceptionStr;
-            exceptionStr << "Invalid chain file " << fileName << ". There are " << elem->params.size() << " parameters on line " << line << " while the previous lines had " << nParams_ << " parameters.";
+            exceptionStr << "Invalid chain file " << fileName << ". There are " << n << " parameters on line " << line << " while the previous lines had " << fileParams << " parameters.";
             exc.set(exceptionStr.str());
             throw exc;
         }
 
-        if(line >= burnin && (line - burnin) % thin == 0)
-            bigChain.push_back(elem);
+        rows.insert(rows.end(), values.begin(), values.end());
+        ++line;
+    }
 
-        if(!errors_.empty())
-        {
-            ErrorEntry err;
-            err.like = elem->like - 0.05;
+    const int rowLength = fileParams + 2;
+    std::vector<double> chainWeights(line);
+    for(unsigned long i = 0; i < line; ++i)
+        chainWeights[i] = rows[i * rowLength];
+
+    std::vector<unsigned long> elements;
+    std::vector<double> weights;
+    selectElements(chainWeights, burnin, thin, countSteps, &elements, &weights);
+    for(unsigned long k = 0; k < elements.size(); ++k)
+    {
+        const double* row = &(rows[elements[k] * rowLength]);
+        addElement(part, weights[k], row[1], row + 2, found, notFound);
+    }
+    output_screen("OK" << std::endl);
+    output_screen("Successfully read the chain " << fileName << ". It has " << part.size() << " elements, " << part.params.size() << " parameters." << std::endl);
 
-            std::vector<ErrorEntry>::const_iterator it = std::lower_bound(errors_.begin(), errors_.end(), err);
-            err.like = elem->like + 0.05;
-            std::vector<ErrorEntry>::const_iterator end = std::lower_bound(errors_.begin(), errors_.end(), err);
+    if(!errors_.empty())
+    {
+        output_screen("Entries found in the error log: " << found << " not found: " << notFound << std::endl);
+    }
+}
 
-            while(it != end)
-            {
-                bool equal = true;
-                for(int i = 0; i < elem->params.size(); ++i)
-                {
-                    if(!Math::areEqual(elem->params[i], it->params[i], 1e-5))
-                    {
-                        equal = false;
-                        break;
-                    }
-                }
-
-                if(equal)
-                {
-                    elem->errMean = it->mean;
-                    elem->errVar = it->var;
-                    ++found;
-                    break;
-                }
-                ++it;
-            }
-            if(it == end)
-                ++notFound;
-        }
+void
+MarkovChain::readBinaryFile(const char* fileName, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const
+{
+    output_screen("Reading the binary chain from file " << fileName << "..." << std::endl);
+    MappedBinaryChain mapped(fileName);
+    part.resize(mapped.nParams());
 
-        ++line;
+    std::vector<double> chainWeights(mapped.size());
+    for(unsigned long i = 0; i < mapped.size(); ++i)
+        chainWeights[i] = mapped.prob(i);
+
+    std::vector<unsigned long> elements;
+    std::vector<double> weights;
+    selectElements(chainWeights, burnin, thin, countSteps, &elements, &weights);
+
+    int notFound = 0, found = 0;
+
+    part.probs.reserve(elements.size());
+    part.likes.reserve(elements.size());
+    part.errMeans.reserve(elements.size());
+    part.errVars.reserve(elements.size());
+    for(int j = 0; j < mapped.nParams(); ++j)
+        part.params[j].reserve(elements.size());
+
+    for(unsigned long k = 0; k < elements.size(); ++k)
+    {
+        const double* rec = mapped.record(elements[k]);
+        addElement(part, weights[k], rec[1], rec + 2, found, notFound);
     }
     output_screen("OK" << std::endl);
-    output_screen("Successfully read the chain. It has " << bigChain.size() << " elements, " << nParams_ << " parameters." << std::endl);
+    output_screen("Successfully read the chain " << fileName << ". It has " << part.size() << " elements, " << part.params.size() << " parameters." << std::endl);
 
     if(!errors_.empty())
     {
@@ -674,26 +1145,116 @@ MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int t
 }
 
 void
-MarkovChain::filterChain(std::vector<Element*>& bigChain, double minP)
+MarkovChain::readCompressedFile(const char* fileName, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const
 {
-    output_screen("Filtering the chain..." << std::endl);
-    ProgressMeter meter(bigChain.size());
-    unsigned long left = 0;
-    for(unsigned long i = 0; i < bigChain.size(); ++i)
+    output_screen("Reading the compressed chain from file " << fileName << "..." << std::endl);
+    MappedCompressedBinaryChain mapped(fileName);
+    const int recordLength = 2 + mapped.nParams();
+    part.resize(mapped.nParams());
+
+    // the blocks are decompressed in parallel, then the elements are added in order
+    std::vector<double> records(mapped.size() * recordLength);
+    if(!records.empty())
+        mapped.records().decompress(&(records[0]));
+
+    std::vector<double> chainWeights(mapped.size());
+    for(unsigned long i = 0; i < mapped.size(); ++i)
+        chainWeights[i] = records[i * recordLength];
+
+    std::vector<unsigned long> elements;
+    std::vector<double> weights;
+    selectElements(chainWeights, burnin, thin, countSteps, &elements, &weights);
+
+    int notFound = 0, found = 0;
+    for(unsigned long k = 0; k < elements.size(); ++k)
     {
-        Element* e = bigChain[i];
-        if(e->prob < minP)
-            delete e;
-        else
+        const double* rec = &(records[elements[k] * recordLength]);
+        addElement(part, weights[k], rec[1], rec + 2, found, notFound);
+    }
+    output_screen("OK" << std::endl);
+    output_screen("Successfully read the chain " << fileName << ". It has " << part.size() << " elements, " << part.params.size() << " parameters." << std::endl);
+
+    if(!errors_.empty())
+    {
+        output_screen("Entries found in the error log: " << found << " not found: " << notFound << std::endl);
+    }
+}
+
+void
+MarkovChain::readSharedChain(const MappedSharedBinaryChain& mapped, int chain, unsigned long burnin, unsigned int thin, bool countSteps, ChainColumns& part) const
+{
+    // the part may already contain the previous chains of the file, resizing keeps them
+    part.resize(mapped.nParams());
+
+    std::vector<double> chainWeights(mapped.chainSize(chain));
+    for(unsigned long i = 0; i < chainWeights.size(); ++i)
+        chainWeights[i] = mapped.record(chain, i)[0];
+
+    std::vector<unsigned long> elements;
+    std::vector<double> weights;
+    selectElements(chainWeights, burnin, thin, countSteps, &elements, &weights);
+
+    int notFound = 0, found = 0;
+    for(unsigned long k = 0; k < elements.size(); ++k)
+    {
+        const double* rec = mapped.record(chain, elements[k]);
+        addElement(part, weights[k], rec[1], rec + 2, found, notFound);
+    }
+}
+
+bool
+MarkovChain::findError(const double* params, int nParams, double like, double& errMean, double& errVar) const
+{
+    ErrorEntry err;
+    err.like = like - 0.05;
+
+    std::vector<ErrorEntry>::const_iterator it = std::lower_bound(errors_.begin(), errors_.end(), err);
+    err.like = like + 0.05;
+    std::vector<ErrorEntry>::const_iterator end = std::lower_bound(errors_.begin(), errors_.end(), err);
+
+    while(it != end)
+    {
+        bool equal = true;
+        for(int i = 0; i < nParams; ++i)
+        {
+            if(!Math::areEqual(params[i], it->params[i], 1e-5))
+            {
+                equal = false;
+                break;
+            }
+        }
+
+        if(equal)
         {
-            chain_.push_back(e);
-            ++left;
+            errMean = it->mean;
+            errVar = it->var;
+            return true;
         }
+        ++it;
+    }
+    return false;
+}
+
+void
+MarkovChain::sortChain()
+{
+    output_screen("Sorting the chain..." << std::endl);
+    sorted_.resize(probs_.size());
+    for(unsigned long i = 0; i < sorted_.size(); ++i)
+        sorted_[i] = i;
+
+    LessLikeIndex less(likes_);
+    std::sort(sorted_.begin(), sorted_.end(), less);
 
-        meter.advance();
+    // the cumulative probabilities along the sorted chain, shared by all of the range queries
+    cumulProbs_.resize(sorted_.size());
+    double total = 0;
+    for(unsigned long i = 0; i < sorted_.size(); ++i)
+    {
+        total += probs_[sorted_[i]];
+        cumulProbs_[i] = total;
     }
     output_screen("OK" << std::endl);
-    output_screen(left << " elements left after filtering!" << std::endl);
 }
 
 Posterior1D*
@@ -702,27 +1263,187 @@ MarkovChain::posterior(int paramIndex, Posterior1D::SmoothingMethod method, doub
     check(paramIndex >= 0 && paramIndex < nParams_, "invalid parameter index " << paramIndex);
     Posterior1D* post = new Posterior1D;
 
-    for(unsigned long i = 0; i < chain_.size(); ++i)
-        post->addPoint(chain_[i]->params[paramIndex], chain_[i]->prob, chain_[i]->like, chain_[i]->errMean, chain_[i]->errVar);
+    if(!probs_.empty())
+        post->addPoints(&(params_[paramIndex][0]), &(probs_[0]), &(likes_[0]), probs_.size(), &(errMeans_[0]), &(errVars_[0]));
 
     post->generate(method, scale);
     return post;
 }
 
 Posterior2D*
-MarkovChain::posterior(int paramIndex1, int paramIndex2, double scale1, double scale2) const
+MarkovChain::posterior(int paramIndex1, int paramIndex2, double scale1, double scale2, Posterior2D::SmoothingMethod method) const
 {
     check(paramIndex1 >= 0 && paramIndex1 < nParams_, "invalid parameter index " << paramIndex1);
     check(paramIndex2 >= 0 && paramIndex2 < nParams_, "invalid parameter index " << paramIndex2);
 
     Posterior2D* post = new Posterior2D;
-    for(unsigned long i = 0; i < chain_.size(); ++i)
-        post->addPoint(chain_[i]->params[paramIndex1], chain_[i]->params[paramIndex2], chain_[i]->prob, chain_[i]->like);
+    if(!probs_.empty())
+        post->addPoints(&(params_[paramIndex1][0]), &(params_[paramIndex2][0]), &(probs_[0]), &(likes_[0]), probs_.size());
 
-    post->generate(scale1, scale2);
+    post->generate(scale1, scale2, method);
     return post;
 }
 
+void
+MarkovChain::posteriors(const std::vector<int>& paramIndices1D, const std::vector<std::pair<int, int> >& paramIndices2D, std::vector<Posterior1D*>& posts1D, std::vector<Posterior2D*>& posts2D, Posterior1D::SmoothingMethod method, Posterior2D::SmoothingMethod method2D) const
+{
+    for(int i = 0; i < paramIndices1D.size(); ++i)
+    {
+        check(paramIndices1D[i] >= 0 && paramIndices1D[i] < nParams_, "invalid parameter index " << paramIndices1D[i]);
+    }
+    for(int i = 0; i < paramIndices2D.size(); ++i)
+    {
+        check(paramIndices2D[i].first >= 0 && paramIndices2D[i].first < nParams_, "invalid parameter index " << paramIndices2D[i].first);
+        check(paramIndices2D[i].second >= 0 && paramIndices2D[i].second < nParams_, "invalid parameter index " << paramIndices2D[i].second);
+    }
+
+    const int n1 = paramIndices1D.size();
+    const int nTotal = n1 + paramIndices2D.size();
+
+    posts1D.resize(n1);
+    posts2D.resize(paramIndices2D.size());
+    for(int i = 0; i < n1; ++i)
+        posts1D[i] = new Posterior1D;
+    for(int i = 0; i < posts2D.size(); ++i)
+        posts2D[i] = new Posterior2D;
+
+    // the columns are shared by all of the distributions, each one is then smoothed independently
+    std::vector<std::string> errorMessages(nTotal);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int k = 0; k < nTotal; ++k)
+    {
+        try {
+            if(k < n1)
+            {
+                Posterior1D* post = posts1D[k];
+                if(!probs_.empty())
+                    post->addPoints(&(params_[paramIndices1D[k]][0]), &(probs_[0]), &(likes_[0]), probs_.size(), &(errMeans_[0]), &(errVars_[0]));
+                post->generate(method);
+            }
+            else
+            {
+                const std::pair<int, int>& p = paramIndices2D[k - n1];
+                Posterior2D* post = posts2D[k - n1];
+                if(!probs_.empty())
+                    post->addPoints(&(params_[p.first][0]), &(params_[p.second][0]), &(probs_[0]), &(likes_[0]), probs_.size());
+                post->generate(0, 0, method2D);
+            }
+        } catch (std::exception& e)
+        {
+            errorMessages[k] = e.what();
+            if(errorMessages[k].empty())
+                errorMessages[k] = "Unknown error";
+        }
+    }
+
+    for(int k = 0; k < nTotal; ++k)
+    {
+        if(!errorMessages[k].empty())
+        {
+            for(int i = 0; i < posts1D.size(); ++i)
+                delete posts1D[i];
+            for(int i = 0; i < posts2D.size(); ++i)
+                delete posts2D[i];
+            posts1D.clear();
+            posts2D.clear();
+
+            StandardException exc;
+            exc.set(errorMessages[k]);
+            throw exc;
+        }
+    }
+}
+
+Math::Function2<double, double, double>*
+Posterior2D::histogramSmooth(int res1, int res2, double scale1, double scale2) const
+{
+    std::vector<double> x1(res1 + 2), x2(res2 + 2);
+    std::vector<std::vector<double> > y(res1 + 2);
+    for(int i = 0; i < res1 + 2; ++i)
+        y[i].resize(res2 + 2, 0);
+
+    const double d1 = (max1_ - min1_) / res1;
+    x1[0] = min1_;
+    x1[res1 + 1] = max1_;
+    for(int i = 0; i < res1; ++i)
+        x1[i + 1] = min1_ + d1 * i + d1 / 2;
+
+    const double d2 = (max2_ - min2_) / res2;
+    x2[0] = min2_;
+    x2[res2 + 1] = max2_;
+    for(int i = 0; i < res2; ++i)
+        x2[i + 1] = min2_ + d2 * i + d2 / 2;
+
+    for(unsigned long i = 0; i < points1_.size(); ++i)
+    {
+        const double p1 = points1_[i];
+        const double p2 = points2_[i];
+        check(p1 >= min1_, "");
+        check(p2 >= min2_, "");
+        int k1 = (int)std::floor((p1 - min1_) / d1);
+        int k2 = (int)std::floor((p2 - min2_) / d2);
+        check(k1 >= 0, "");
+        check(k2 >= 0, "");
+        if(k1 >= res1)
+            k1 = res1 - 1;
+        if(k2 >= res2)
+            k2 = res2 - 1;
+
+        y[k1 + 1][k2 + 1] += probs_[i];
+    }
+
+    // to make sure edges are smooth
+    for(int i = 0; i < y.size(); ++i)
+    {
+        y[i][0] = y[i][1];
+        y[i][res2 + 1] = y[i][res2];
+    }
+
+    for(int i = 0; i < res2 + 2; ++i)
+    {
+        y[0][i] = y[1][i];
+        y[res1 + 1][i] = y[res1][i];
+    }
+
+    return new Math::GaussSmooth2D(x1, x2, y, scale1, scale2);
+}
+
+Math::Function2<double, double, double>*
+Posterior2D::binnedSmooth(double scale1, double scale2) const
+{
+    // the grid spacing is at most a quarter of the smoothing scale in each direction
+    const int maxGrid = 1024;
+    int n1 = int(std::ceil(4 * (max1_ - min1_) / scale1)) + 1, n2 = int(std::ceil(4 * (max2_ - min2_) / scale2)) + 1;
+    if(n1 > maxGrid)
+        n1 = maxGrid;
+    if(n2 > maxGrid)
+        n2 = maxGrid;
+
+    const double d1 = (max1_ - min1_) / (n1 - 1), d2 = (max2_ - min2_) / (n2 - 1);
+
+    // linear binning of the weights onto the grid
+    std::vector<std::vector<double> > y(n1, std::vector<double>(n2, 0));
+    for(unsigned long i = 0; i < points1_.size(); ++i)
+    {
+        const double t1 = (points1_[i] - min1_) / d1, t2 = (points2_[i] - min2_) / d2;
+        check(t1 >= 0 && t2 >= 0, "");
+        int k1 = int(t1), k2 = int(t2);
+        if(k1 > n1 - 2)
+            k1 = n1 - 2;
+        if(k2 > n2 - 2)
+            k2 = n2 - 2;
+        const double f1 = t1 - k1, f2 = t2 - k2;
+        const double p = probs_[i];
+
+        y[k1][k2] += (1 - f1) * (1 - f2) * p;
+        y[k1][k2 + 1] += (1 - f1) * f2 * p;
+        y[k1 + 1][k2] += f1 * (1 - f2) * p;
+        y[k1 + 1][k2 + 1] += f1 * f2 * p;
+    }
+
+    return new Math::BinnedGaussSmooth2D(min1_, max1_, min2_, max2_, y, scale1, scale2);
+}
+
 void
 Posterior2D::writeIntoFile(const char* fileName, int n) const
 {
@@ -776,32 +1497,72 @@ Posterior2D::writeIntoFile(const char* fileName, int n) const
 }
 
 void
-MarkovChain::getRange(std::vector<Element*>& container, double pUpper, double pLower) const
+MarkovChain::getElement(unsigned long i, Element& elem) const
+{
+    check(i < probs_.size(), "invalid index " << i);
+    elem.prob = probs_[i];
+    elem.like = likes_[i];
+    elem.errMean = errMeans_[i];
+    elem.errVar = errVars_[i];
+    elem.params.resize(nParams_);
+    for(int j = 0; j < nParams_; ++j)
+        elem.params[j] = params_[j][i];
+}
+
+void
+MarkovChain::getRange(std::vector<unsigned long>& indices, double pUpper, double pLower) const
 {
     check(pUpper >= 0 && pUpper <= 1, "invalid probability " << pUpper << ", should be between 0 and 1");
     check(pLower >= 0 && pLower <= pUpper, "invalid lower probability " << pLower << ", should be between 0 and " << pUpper);
-    container.clear();
+    indices.clear();
 
     if(pUpper == 0)
         return;
 
     if(pLower == 1)
     {
-        container.insert(container.end(), chain_.begin(), chain_.end());
+        indices.insert(indices.end(), sorted_.begin(), sorted_.end());
         return;
     }
 
-    double total = 0;
-    std::vector<Element*>::const_iterator it = chain_.begin();
-    while(total <= pUpper && it != chain_.end())
+    // the elements with the cumulative probability above pLower, up to and including the first one above pUpper
+    const unsigned long begin = rangeEnd(pLower);
+    const unsigned long end = std::min(rangeEnd(pUpper) + 1, (unsigned long)sorted_.size());
+    if(begin < end)
+        indices.insert(indices.end(), sorted_.begin() + begin, sorted_.begin() + end);
+}
+
+unsigned long
+MarkovChain::rangeEnd(double p) const
+{
+    check(cumulProbs_.size() == sorted_.size(), "");
+    return std::upper_bound(cumulProbs_.begin(), cumulProbs_.end(), p) - cumulProbs_.begin();
+}
+
+void
+MarkovChain::getLikeLevels(const std::vector<double>& pUppers, std::vector<double>& likeLevels) const
+{
+    check(!sorted_.empty(), "the chain is empty");
+    likeLevels.resize(pUppers.size());
+    for(unsigned long i = 0; i < pUppers.size(); ++i)
     {
-        total += (*it)->prob;
-        if(total > pLower)
-            container.push_back(*it);
-        ++it;
+        check(pUppers[i] >= 0 && pUppers[i] <= 1, "invalid probability " << pUppers[i] << ", should be between 0 and 1");
+        const unsigned long j = std::min(rangeEnd(pUppers[i]), (unsigned long)sorted_.size() - 1);
+        likeLevels[i] = likes_[sorted_[j]];
     }
 }
 
+void
+MarkovChain::getRange(std::vector<Element>& container, double pUpper, double pLower) const
+{
+    std::vector<unsigned long> indices;
+    getRange(indices, pUpper, pLower);
+
+    container.resize(indices.size());
+    for(unsigned long i = 0; i < indices.size(); ++i)
+        getElement(indices[i], container[i]);
+}
+
 void
 MarkovChain::readErrorFiles(int nError, const char *fileNameBase)
 {
@@ -877,3 +1638,73 @@ MarkovChain::readErrorFiles(int nError, const char *fileNameBase)
     output_screen("Successfully read all of error files. A total of " << errors_.size() << " elements read." << std::endl);
 }
 
+namespace
+{
+
+// the numbers of repetitions of the elements, from the weights
+unsigned long repetitions(const std::vector<double>& probs, std::vector<unsigned long>& counts)
+{
+    counts.resize(probs.size());
+    unsigned long total = 0;
+    for(unsigned long i = 0; i < probs.size(); ++i)
+    {
+        counts[i] = (unsigned long)(probs[i] + 0.5);
+        total += counts[i];
+    }
+
+    if(total == 0)
+    {
+        StandardException exc;
+        exc.set("The weights of the chain are all smaller than 0.5, they cannot be used as the numbers of repetitions of the elements.");
+        throw exc;
+    }
+
+    return total;
+}
+
+} // namespace
+
+void
+MarkovChain::effectiveSampleSizes(std::vector<double>& ess, std::vector<double>* tau) const
+{
+    check(nParams_ > 0, "");
+    check(!probs_.empty(), "the chain is empty");
+
+    std::vector<unsigned long> counts;
+    const unsigned long total = repetitions(probs_, counts);
+
+    ess.resize(nParams_);
+    if(tau)
+        tau->resize(nParams_);
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int j = 0; j < nParams_; ++j)
+    {
+        std::vector<double> expanded;
+        expanded.reserve(total);
+        for(unsigned long i = 0; i < probs_.size(); ++i)
+            expanded.insert(expanded.end(), counts[i], params_[j][i]);
+
+        const double t = Math::integratedAutocorrelationTime(&(expanded[0]), total);
+        ess[j] = total / t;
+        if(tau)
+            (*tau)[j] = t;
+    }
+}
+
+double
+MarkovChain::effectiveSampleSize(int paramIndex) const
+{
+    check(paramIndex >= 0 && paramIndex < nParams_, "invalid parameter index " << paramIndex);
+    check(!probs_.empty(), "the chain is empty");
+
+    std::vector<unsigned long> counts;
+    const unsigned long total = repetitions(probs_, counts);
+
+    std::vector<double> expanded;
+    expanded.reserve(total);
+    for(unsigned long i = 0; i < probs_.size(); ++i)
+        expanded.insert(expanded.end(), counts[i], params_[paramIndex][i]);
+
+    return total / Math::integratedAutocorrelationTime(&(expanded[0]), total);
+}
@@ -2,11 +2,12 @@
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <progress_meter.hpp>
-#include <three_vector.hpp>
+#include <kd_tree.hpp>
 #include <math_constants.hpp>
 #include <mask_apodizer.hpp>
 
@@ -20,10 +21,6 @@
 #include <healpix_map_fitsio.h>
 */
 
-#ifdef COSMO_OMP
-#include <omp.h>
-#endif
-
 double
 MaskApodizer::correctTheta(double theta) const
 {
@@ -99,130 +96,95 @@ MaskApodizer::apodize(ApodizationType type, double angle, Healpix_Map<double>& r
     check(type >= COSINE_APODIZATION && type < APODIZATION_TYPE_MAX, "invalid apodization type");
     check(angle > 0, "invalid angle = " << angle);
 
-    /*
-    const int edgeNSide = std::min(128, mask_.Nside());
-    //const int edgeNSide = mask_.Nside();
-
-    //Healpix_Map<double> edgeMap;
-    edgeMap.SetNside(edgeNSide, NEST);
-
-    for(int i = 0; i < edgeMap.Npix(); ++i)
-        edgeMap[i] = 0;
-    */
-
     result.SetNside(mask_.Nside(), mask_.Scheme());
     result.Import(mask_);
 
-    /*
-    bool swapScheme = false;
-    if(result.Scheme() == RING)
-    {
-        result.swap_scheme();
-        swapScheme = true;
-    }
-    */
-
     const long nPix = result.Npix();
-    const double pixSize = std::sqrt(4 * Math::pi / nPix);
 
     Healpix_Base2 base2(result.Nside(), result.Scheme(), SET_NSIDE);
 
     output_screen("Input mask has " <<nPix << " pixels." << std::endl);
     
     output_screen("Finding the edge pixels..." << std::endl);
-    std::vector<Math::ThreeVectorDouble> edge;
-    ProgressMeter meter(nPix);
+    std::vector<char> isOnEdge(nPix, 0);
+#pragma omp parallel for default(shared) schedule(static)
     for(long i = 0; i < nPix; ++i)
     {
         if(result[i] == 0)
-        {
-            meter.advance();
             continue;
-        }
-        bool isOnEdge = false;
+
         fix_arr<int64, 8> neighbors;
         base2.neighbors(i, neighbors);
         const long s = neighbors.size();
         for(int j = 0; j < s; ++j)
         {
-            if(result[neighbors[j]] == 0)
-                isOnEdge = true;
-        }
-        double theta, phi;
-        result.Scheme() == NEST ? pix2ang_nest(result.Nside(), i, &theta, &phi) : pix2ang_ring(result.Nside(), i, &theta, &phi);
-        long index;
-        /*
-        result.Scheme() == NEST ? ang2pix_nest(result.Nside(), correctTheta(theta + pixSize), phi, &index) : ang2pix_ring(result.Nside(), correctTheta(theta + pixSize), phi, &index);
-        if(result[index] == 0)
-            isOnEdge = true;
-        result.Scheme() == NEST ? ang2pix_nest(result.Nside(), correctTheta(theta - pixSize), phi, &index) : ang2pix_ring(result.Nside(), correctTheta(theta - pixSize), phi, &index);
-        if(result[index] == 0)
-            isOnEdge = true;
-        result.Scheme() == NEST ? ang2pix_nest(result.Nside(), theta, phi + pixSize, &index) : ang2pix_ring(result.Nside(), theta, phi + pixSize, &index);
-        if(result[index] == 0)
-            isOnEdge = true;
-        result.Scheme() == NEST ? ang2pix_nest(result.Nside(), theta, phi - pixSize, &index) : ang2pix_ring(result.Nside(), theta, phi - pixSize, &index);
-        if(result[index] == 0)
-            isOnEdge = true;
-        */
-        if(isOnEdge)
-        {
-            edge.push_back(Math::ThreeVectorDouble(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta)));
-            //ang2pix_nest(edgeNSide, theta, phi, &index);
-            //edgeMap[index] = 1;
-            //edgeMap[i] = 1;
+            if(neighbors[j] >= 0 && result[neighbors[j]] == 0)
+                isOnEdge[i] = 1;
         }
-        meter.advance();
+    }
+
+    std::vector<std::vector<double> > edge;
+    for(long i = 0; i < nPix; ++i)
+    {
+        if(!isOnEdge[i])
+            continue;
+        std::vector<double> v(3);
+        pixelVector(result, i, &(v[0]));
+        edge.push_back(v);
     }
     output_screen("OK" << std::endl);
 
     output_screen("Found " << edge.size() << " edge pixels." << std::endl);
 
-    /*
-    fitshandle outh;
-    outh.create("edge.fits");
-    write_Healpix_map_to_fits(outh, edgeMap, PLANCK_FLOAT64);
-    */
+    // nothing to apodize
+    if(edge.empty())
+        return;
+
+    // the nearest edge pixel of each pixel is found from a k-d tree of the unit vectors of the edge pixels, the pixels are processed in blocks so that the unit vectors of all of the pixels are not needed at once
+    KDTree tree(3, edge);
 
     output_screen("Apodizing mask..." << std::endl);
-    ProgressMeter meter1(nPix);
-#ifdef COSMO_OMP
-    omp_lock_t lock;
-    omp_init_lock(&lock);
-#endif
-#pragma omp parallel for default(shared)
-    for(long i = 0; i < nPix; ++i)
+    const long blockSize = 1 << 20;
+    std::vector<double> points(3 * blockSize), distanceSquares(blockSize);
+    std::vector<unsigned long> indices(blockSize);
+    std::vector<long> pixels(blockSize);
+    ProgressMeter meter((nPix + blockSize - 1) / blockSize);
+    for(long start = 0; start < nPix; start += blockSize)
     {
-        if(result[i] == 0)
+        const long end = std::min(nPix, start + blockSize);
+        long n = 0;
+        for(long i = start; i < end; ++i)
         {
-#ifdef COSMO_OMP
-            omp_set_lock(&lock);
-#endif
-            meter1.advance();
-#ifdef COSMO_OMP
-            omp_unset_lock(&lock);
-#endif
-            continue;
+            if(result[i] != 0)
+                pixels[n++] = i;
         }
 
-        double theta, phi;
-        result.Scheme() == NEST ? pix2ang_nest(result.Nside(), i, &theta, &phi) : pix2ang_ring(result.Nside(), i, &theta, &phi);
-        Math::ThreeVectorDouble current(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
-        double minDistance = 2 * Math::pi;
-        for(int j = 0; j < edge.size(); ++j)
+#pragma omp parallel for default(shared) schedule(static)
+        for(long k = 0; k < n; ++k)
+            pixelVector(result, pixels[k], &(points[3 * k]));
+
+        if(n > 0)
+            tree.findNearestNeighbors(&(points[0]), n, 1, &(indices[0]), &(distanceSquares[0]));
+
+#pragma omp parallel for default(shared) schedule(static)
+        for(long k = 0; k < n; ++k)
         {
-            const double distance = std::acos(current * edge[j]);
-            if(distance < minDistance)
-                minDistance = distance;
+            // the angle from the chord length
+            const double chord = std::min(std::sqrt(distanceSquares[k]), 2.0);
+            const double distance = 2 * std::asin(chord / 2);
+            result[pixels[k]] = (type == COSINE_APODIZATION ? cosApodization(angle, distance) : gaussApodization(angle, distance));
         }
-        result[i] = (type == COSINE_APODIZATION ? cosApodization(angle, minDistance) : gaussApodization(angle, minDistance));
-
-#ifdef COSMO_OMP
-        omp_set_lock(&lock);
-#endif
-        meter1.advance();
-#ifdef COSMO_OMP
-        omp_unset_lock(&lock);
-#endif
+        meter.advance();
     }
+    output_screen("OK" << std::endl);
+}
+
+void
+MaskApodizer::pixelVector(const Healpix_Map<double>& map, long i, double* v) const
+{
+    double theta, phi;
+    map.Scheme() == NEST ? pix2ang_nest(map.Nside(), i, &theta, &phi) : pix2ang_ring(map.Nside(), i, &theta, &phi);
+    v[0] = std::sin(theta) * std::cos(phi);
+    v[1] = std::sin(theta) * std::sin(phi);
+    v[2] = std::cos(theta);
 }
@@ -1,6 +1,10 @@
 #include <fstream>
+#include <sstream>
+#include <string>
 #include <cmath>
 
+#include <sys/stat.h>
+
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <math_constants.hpp>
@@ -8,6 +12,11 @@
 #include <wigner_3j.hpp>
 #include <master.hpp>
 #include <matrix_impl.hpp>
+#include <mapped_matrix.hpp>
+#include <cosmo_mpi.hpp>
+#include <simulate.hpp>
+#include <spherical_harmonic_transform.hpp>
+#include <alm_utils.hpp>
 
 #include <healpix_base.h>
 #include <alm.h>
@@ -52,25 +61,6 @@ Master::Master(const char* maskName, const char* couplingKernelFileName, const s
     construct(bins, lMax);
 }
 
-double absSq(const xcomplex<double>& x)
-{
-    const double re = x.real();
-    const double im = x.imag();
-    return re * re + im * im;
-}
-
-double ps(const Alm<xcomplex<double> >& alm, int l)
-{
-    check(l >= 0 && l <= alm.Lmax(), "invalid l");
-    double res = absSq(alm(l, 0));
-    for(int m = 1; m <= l; ++m)
-        res += 2 * absSq(alm(l, m));
-    
-    res /= (2 * l + 1);
-    
-    return res;
-}
-
 void
 Master::construct(const std::vector<int>* bins, int lMax)
 {
@@ -111,18 +101,17 @@ Master::construct(const std::vector<int>* bins, int lMax)
     output_screen("f_sky = " << fSky << std::endl);
     
     Alm<xcomplex<double> > almMask(lMax_, lMax_);
-    arr<double> weight(2 * mask_.Nside(), 1);
+    SphericalHarmonicTransform sht(mask_.Nside(), lMax_);
     
     output_screen("Calculating alm..." << std::endl);
-    map2alm(mask_, almMask, weight);
+    sht.map2alm(mask_, almMask);
     output_screen("OK" << std::endl);
     
     
     //pseudo power spectra
     check(w_.empty(), "");
     
-    for(int l = 0; l <= lMax_; ++l)
-        w_.push_back(ps(almMask, l));
+    AlmUtils::powerSpectrum(almMask, &w_);
 
     calculateCoupling();
     calculateK();
@@ -140,15 +129,13 @@ Master::calculate()
         maskedMap_[i] = (*map_)[i] * mask_[i];
     
     Alm<xcomplex<double> > alm(lMax_, lMax_);
-    arr<double> weight(2 * map_->Nside(), 1);
+    SphericalHarmonicTransform sht(map_->Nside(), lMax_);
 
     output_screen("Calculating map alm..." << std::endl);
-    map2alm(maskedMap_, alm, weight);
+    sht.map2alm(maskedMap_, alm);
     output_screen("OK" << std::endl);
 
-    c_.clear();
-    for(int l = 0; l <= lMax_; ++l)
-        c_.push_back(ps(alm, l));
+    AlmUtils::powerSpectrum(alm, &c_);
 
     calculatePS();
 }
@@ -176,91 +163,246 @@ void Master::calculate(const char* mapName)
     calculate(map);
 }
 
-
-class Wigner3jTreats
+void
+Master::calculate(const std::vector<const Healpix_Map<double>*>& maps, std::vector<std::vector<double> >* ps) const
 {
-public:
-    Wigner3jTreats(const std::vector<double>& w, int lMax) : w_(w), coupling_(lMax), lMax_(lMax)
+    const int nMaps = maps.size();
+    ps->resize(nMaps);
+    if(nMaps == 0)
+        return;
+
+    std::vector<Healpix_Map<double> > masked(nMaps);
+    std::vector<Alm<xcomplex<double> > > alms(nMaps);
+    std::vector<const Healpix_Map<double>*> mapPointers(nMaps);
+    std::vector<Alm<xcomplex<double> >*> almPointers(nMaps);
+    for(int i = 0; i < nMaps; ++i)
     {
-        check(lMax_ >= 0, "");
-        coupling_.resize(lMax_ + 1);
-        for(int i = 0; i <= lMax_; ++i)
-            coupling_[i].resize(lMax_ + 1, 0);
+        check(maps[i]->Nside() == mask_.Nside(), "the map and the mask must have the same NSide");
+        check(maps[i]->Scheme() == RING, "the maps must be in the RING scheme");
+        masked[i].SetNside(mask_.Nside(), RING);
+        for(long j = 0; j < mask_.Npix(); ++j)
+            masked[i][j] = (*(maps[i]))[j] * mask_[j];
+        alms[i].Set(lMax_, lMax_);
+        mapPointers[i] = &(masked[i]);
+        almPointers[i] = &(alms[i]);
     }
 
-    void process(int l1, int l2, int l3, double val)
+    output_screen("Calculating the alm of " << nMaps << " maps..." << std::endl);
+    const SphericalHarmonicTransform sht(mask_.Nside(), lMax_);
+    sht.map2alm(nMaps, &(mapPointers[0]), &(almPointers[0]));
+    output_screen("OK" << std::endl);
+
+    // the pseudo spectra are the rows, the estimator is applied to all of them at once
+    Math::Matrix<double> pseudo(nMaps, lMax_ + 1), res;
+    std::vector<double> cl;
+    for(int i = 0; i < nMaps; ++i)
     {
-        if(l1 > lMax_ || l2 > lMax_ || l3 > lMax_)
-            return;
+        AlmUtils::powerSpectrum(alms[i], &cl);
+        for(int l = 0; l <= lMax_; ++l)
+            pseudo(i, l) = cl[l];
+    }
 
-        check(l1 >= 0, "invalid l1 = " << l1);
-        check(l2 >= 0, "invalid l2 = " << l2);
-        check(l3 >= 0, "invalid l3 = " << l3);
+    Math::Matrix<double>::multiplyMatrices(pseudo, estimator_, &res, false, true);
 
-        coupling_[l1][l2] += (double(2 * l2 + 1) / (4 * Math::pi)) * double(2 * l3 + 1) * w_[l3] * val * val;
+    const int size = numBins();
+    for(int i = 0; i < nMaps; ++i)
+    {
+        (*ps)[i].resize(size);
+        for(int b = 0; b < size; ++b)
+            (*ps)[i][b] = res(i, b);
     }
+}
+
+
+namespace
+{
 
-    double getCoupling(int l1, int l2) const
+void
+setError(std::string& error, const std::exception& e)
+{
+#pragma omp critical (master_error)
     {
-        check(l1 >= 0 && l1 <= lMax_, "invalid l1 = " << l1);
-        check(l2 >= 0 && l2 <= lMax_, "invalid l2 = " << l2);
-        return coupling_[l1][l2];
+        if(error.empty())
+            error = e.what();
     }
-
-private:
-    const std::vector<double>& w_;
-    std::vector<std::vector<double> > coupling_;
-    const int lMax_;
-};
+}
 
 void
-Master::calculateCouplingKernel(const std::vector<double>& w, int lMax, const char* fileName)
+throwIfError(const std::string& error)
 {
-    output_screen("Calculating coupling kernel..." << std::endl);
-    check(w.size() >= lMax + 1, "");
-    check(lMax > 0, "");
+    if(error.empty())
+        return;
 
-    Wigner3jTreats t(w, lMax);
-    Math::Wigner3JZeroM<Wigner3jTreats> w3j(t);
-    w3j.calculate(lMax * 3 / 2);
-    output_screen("OK" << std::endl);
+    StandardException exc;
+    exc.set(error);
+    throw exc;
+}
 
-    output_screen("Saving into file " << fileName << "..." << std::endl);
-    std::ofstream out(fileName);
-    if(!out)
+// FNV-1a over the bytes of the mask pseudo-spectrum up to lMax
+unsigned long
+hashSpectrum(const std::vector<double>& w, int lMax)
+{
+    unsigned long h = 14695981039346656037UL;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(&(w[0]));
+    for(unsigned long i = 0; i < (lMax + 1) * sizeof(double); ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+bool
+isDirectory(const std::string& name)
+{
+    struct stat st;
+    return stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool
+fileExists(const std::string& name)
+{
+    struct stat st;
+    return stat(name.c_str(), &st) == 0;
+}
+
+// the binary format written by Math::MappedMatrix::writeIntoFile, or text with lMax in the beginning
+void
+readCouplingKernel(const std::string& fileName, int lMax, std::vector<std::vector<double> >* coupling)
+{
+    StandardException exc;
+    Math::Matrix<double> kernel;
+    int lMaxCK;
+    if(Math::MappedMatrix::isMappedMatrixFile(fileName.c_str()))
+    {
+        Math::MappedMatrix mapped(fileName.c_str());
+        lMaxCK = mapped.rows() - 1;
+        if(mapped.rows() != mapped.cols() || mapped.isSymmetric())
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The coupling kernel " << fileName << " must be a square (not symmetric) matrix, it is " << mapped.rows() << " x " << mapped.cols() << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        if(lMaxCK == lMax)
+            mapped.copyTo(&kernel);
+    }
+    else
+    {
+        std::ifstream in(fileName.c_str());
+        if(!in)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot open input file " << fileName << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        in >> lMaxCK;
+        if(lMaxCK == lMax)
+        {
+            kernel.resize(lMax + 1, lMax + 1);
+            for(int l1 = 0; l1 <= lMax; ++l1)
+                for(int l2 = 0; l2 <= lMax; ++l2)
+                    in >> kernel(l1, l2);
+        }
+        in.close();
+    }
+
+    if(lMaxCK != lMax)
     {
-        StandardException exc;
         std::stringstream exceptionStr;
-        exceptionStr << "Cannot write into file " << fileName << ".";
+        exceptionStr << "Incorrect lMax = " << lMaxCK << " in file " << fileName << ", need lMax = " << lMax << ".";
         exc.set(exceptionStr.str());
         throw exc;
     }
-    out << lMax << std::endl;
+
+    coupling->resize(lMax + 1);
     for(int l1 = 0; l1 <= lMax; ++l1)
     {
-        out << t.getCoupling(l1, 0);
-        for(int l2 = 1; l2 <= lMax; ++l2)
-            out << '\t' << t.getCoupling(l1, l2);
-        out << std::endl;
+        (*coupling)[l1].resize(lMax + 1);
+        for(int l2 = 0; l2 <= lMax; ++l2)
+            (*coupling)[l1][l2] = kernel(l1, l2);
+    }
+}
+
+} // namespace
+
+void
+Master::calculateCouplingKernel(const std::vector<double>& w, int lMax, Math::Matrix<double>* kernel)
+{
+    check(w.size() >= lMax + 1, "");
+    check(lMax > 0, "");
+
+    kernel->resize(lMax + 1, lMax + 1, 0);
+
+    ProgressMeter meter(lMax + 1);
+
+    // the rows of l1 are split between the threads, for each pair (l1, l2) all of the l3 come from one 3j recursion into a buffer of the thread
+#pragma omp parallel default(shared)
+    {
+        std::vector<double> row;
+
+#pragma omp for schedule(dynamic)
+        for(int l1 = 0; l1 <= lMax; ++l1)
+        {
+            for(int l2 = 0; l2 <= l1; ++l2)
+            {
+                Math::wigner3jZeroMRow(l1, l2, lMax, &row);
+
+                // only the even l1 + l2 + l3 are non-zero, l1 + l2 + (l1 - l2) is even
+                const int l3Min = l1 - l2;
+                double sum = 0;
+                for(int k = 0; k < row.size(); k += 2)
+                {
+                    const int l3 = l3Min + k;
+                    sum += double(2 * l3 + 1) * w[l3] * row[k] * row[k];
+                }
+
+                (*kernel)(l1, l2) = (double(2 * l2 + 1) / (4 * Math::pi)) * sum;
+                (*kernel)(l2, l1) = (double(2 * l1 + 1) / (4 * Math::pi)) * sum;
+            }
+
+#pragma omp critical (master_progress)
+            meter.advance();
+        }
     }
-    out.close();
+}
+
+void
+Master::calculateCouplingKernel(const std::vector<double>& w, int lMax, const char* fileName)
+{
+    output_screen("Calculating coupling kernel..." << std::endl);
+    Math::Matrix<double> kernel;
+    calculateCouplingKernel(w, lMax, &kernel);
+    output_screen("OK" << std::endl);
+
+    output_screen("Saving into file " << fileName << "..." << std::endl);
+    Math::MappedMatrix::writeIntoFile(kernel, fileName);
     output_screen("OK" << std::endl);
 }
 
+std::string
+Master::couplingKernelCacheFileName(const char* directory, const std::vector<double>& w, int lMax)
+{
+    check(w.size() >= lMax + 1, "");
+
+    std::stringstream name;
+    name << directory << "/coupling_kernel_" << std::hex << hashSpectrum(w, lMax) << std::dec << "_" << lMax << ".dat";
+    return name.str();
+}
+
 void
 Master::calculateCouplingKernel(const Healpix_Map<double>& mask, int lMax, const char* fileName)
 {
     Alm<xcomplex<double> > almMask(lMax, lMax);
-    arr<double> weight(2 * mask.Nside(), 1);
+    SphericalHarmonicTransform sht(mask.Nside(), lMax);
     
     output_screen("Calculating alm..." << std::endl);
-    map2alm(mask, almMask, weight);
+    sht.map2alm(mask, almMask);
     output_screen("OK" << std::endl);
 
     std::vector<double> w;
-
-    for(int l = 0; l <= lMax; ++l)
-        w.push_back(ps(almMask, l));
+    AlmUtils::powerSpectrum(almMask, &w);
 
     calculateCouplingKernel(w, lMax, fileName);
 }
@@ -284,188 +426,262 @@ Master::calculateCouplingKernel(const char* maskName, int lMax, const char* file
 void
 Master::calculateCoupling()
 {
-    if(couplingKernelFileName_ != "NA")
-    {
-        output_screen("Reading the coupling kernel from file " << couplingKernelFileName_ << "..." << std::endl);
-        std::ifstream in(couplingKernelFileName_.c_str());
-        StandardException exc;
-        if(!in)
-        {
-            std::stringstream exceptionStr;
-            exceptionStr << "Cannot open input file " << couplingKernelFileName_ << ".";
-            exc.set(exceptionStr.str());
-            throw exc;
-        }
-        int lMax;
-        in >> lMax;
-        if(lMax != lMax_)
-        {
-            std::stringstream exceptionStr;
-            exceptionStr << "Incorrect lMax = " << lMax << " in file " << couplingKernelFileName_ << ", need lMax = " << lMax_ << ".";
-            exc.set(exceptionStr.str());
-            throw exc;
-        }
+    check(coupling_.empty(), "");
+    check(w_.size() == lMax_ + 1, "");
 
-        coupling_.resize(lMax_ + 1);
-        for(int l1 = 0; l1 <= lMax_; ++l1)
-        {
-            coupling_[l1].resize(lMax_ + 1);
-            for(int l2 = 0; l2 <= lMax_; ++l2)
-                in >> coupling_[l1][l2];
-        }
-        in.close();
+    // a directory is used as a cache of the kernels keyed by the pseudo-spectrum of the mask
+    std::string fileName = couplingKernelFileName_;
+    if(couplingKernelFileName_ != "NA" && isDirectory(couplingKernelFileName_))
+        fileName = couplingKernelCacheFileName(couplingKernelFileName_.c_str(), w_, lMax_);
+
+    if(fileName != "NA" && fileExists(fileName))
+    {
+        output_screen("Reading the coupling kernel from file " << fileName << "..." << std::endl);
+        readCouplingKernel(fileName, lMax_, &coupling_);
         output_screen("OK" << std::endl);
         return;
     }
 
+    if(fileName != couplingKernelFileName_)
+    {
+        calculateCouplingKernel(w_, lMax_, fileName.c_str());
+        readCouplingKernel(fileName, lMax_, &coupling_);
+        return;
+    }
+
+    if(couplingKernelFileName_ != "NA")
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << couplingKernelFileName_ << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
     output_screen("Calculating coupling kernel..." << std::endl);
-    check(coupling_.empty(), "");
-    check(w_.size() == lMax_ + 1, "");
+    Math::Matrix<double> kernel;
+    calculateCouplingKernel(w_, lMax_, &kernel);
 
-    Wigner3jTreats t(w_, lMax_);
-    Math::Wigner3JZeroM<Wigner3jTreats> w3j(t);
-    w3j.calculate(lMax_ * 3 / 2);
-    
     coupling_.resize(lMax_ + 1);
-    
     for(int l1 = 0; l1 <= lMax_; ++l1)
     {
-        coupling_[l1].resize(lMax_ + 1, 0);
+        coupling_[l1].resize(lMax_ + 1);
         for(int l2 = 0; l2 <= lMax_; ++l2)
-            coupling_[l1][l2] = t.getCoupling(l1, l2);
-    }
-    
-    /*
-    std::ofstream out("coupling_kernel.txt");
-    for(int l1 = 0; l1 <= lMax_; ++l1)
-    {
-        out << coupling_[l1][0];
-        for(int l2 = 1; l2 <= lMax_; ++l2)
-            out << ' ' << coupling_[l1][l2];
-        out << std::endl;
+            coupling_[l1][l2] = kernel(l1, l2);
     }
-    out.close();
-    */
     output_screen("OK" << std::endl);
 }
 
 void
-Master::calculateK()
+Master::calculateBinning()
 {
-    output_screen("Calculating K..." << std::endl);
-    int size;
-    if(!bins_.empty())
-        size = bins_.size() - 1;
-    else
-    {
-        check(lMax_ > 0, "invalid lMax");
-        size = lMax_ + 1;
-    }
-    k_.resize(size, size);
-    
-    if(!bins_.empty())
+    // without bins each l is its own bin
+    binOfL_.assign(lMax_ + 1, -1);
+    p_.assign(lMax_ + 1, 0);
+    q_.assign(lMax_ + 1, 0);
+    for(int l = 0; l <= lMax_; ++l)
     {
-        ProgressMeter meter(bins_.size() - 1);
-        for(int b = 0; b < size; ++b)
+        if(bins_.empty())
+            binOfL_[l] = l;
+        else
         {
-#pragma omp parallel for default(shared)
-            for(int b1 = 0; b1 < size; ++b1)
+            for(int b = 0; b < bins_.size() - 1; ++b)
             {
-                k_(b, b1) = 0;
-                for(int l = 0; l <= lMax_; ++l)
-                {
-                    for(int l1 = 0; l1 <= lMax_; ++l1)
-                    {
-                        k_(b, b1) += p(b, l) * coupling_[l][l1] * beam_[l1] * beam_[l1] * q(l1, b1);
-                    }
-                }
+                if(l >= bins_[b] && l < bins_[b + 1])
+                    binOfL_[l] = b;
             }
-            meter.advance();
         }
+
+        if(binOfL_[l] < 0)
+            continue;
+
+        const int b = binOfL_[l];
+        const int width = (bins_.empty() ? 1 : bins_[b + 1] - bins_[b]);
+        p_[l] = lFactor(l) / width;
+        q_[l] = 1.0 / lFactor(l);
     }
-    else
+}
+
+void
+Master::calculateK()
+{
+    calculateBinning();
+
+    output_screen("Calculating K..." << std::endl);
+    const int size = numBins();
+    k_.resize(size, size, 0);
+
+    // K = P M B^2 Q, each row of P and each column of Q only has the l values of one bin
+    ProgressMeter meter(size);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int b = 0; b < size; ++b)
     {
-        ProgressMeter meter(lMax_ + 1);
-        for(int l = 0; l <= lMax_; ++l)
+        const int lBegin = (bins_.empty() ? b : bins_[b]), lEnd = (bins_.empty() ? b + 1 : bins_[b + 1]);
+        for(int l = lBegin; l < lEnd; ++l)
         {
             for(int l1 = 0; l1 <= lMax_; ++l1)
             {
-                k_(l, l1) = coupling_[l][l1] * beam_[l1] * beam_[l1] * lFactor(l) / lFactor(l1);
+                if(binOfL_[l1] >= 0)
+                    k_(b, binOfL_[l1]) += p_[l] * coupling_[l][l1] * beam_[l1] * beam_[l1] * q_[l1];
             }
-            meter.advance();
         }
+#pragma omp critical (master_k_progress)
+        meter.advance();
     }
     output_screen("OK" << std::endl);
     
-    //std::ofstream out("k_matrix.txt");
-    //out << k_ << std::endl << std::endl;
-    
     output_screen("Taking the inverse of K..." << std::endl);
     kInv_.copy(k_);
     kInv_.invert();
-    //out << kInv_ << std::endl;
-    //out.close();
     output_screen("OK" << std::endl);
+
+    // K^-1 P, so that the estimate is a single matrix-vector product with the pseudo spectrum
+    estimator_.resize(size, lMax_ + 1, 0);
+    for(int b = 0; b < size; ++b)
+    {
+        for(int l = 0; l <= lMax_; ++l)
+        {
+            if(binOfL_[l] >= 0)
+                estimator_(b, l) = kInv_(b, binOfL_[l]) * p_[l];
+        }
+    }
 }
 
-void
-Master::calculatePS()
+int
+Master::numBins() const
 {
-    output_screen("Calculating final power spectrum..." << std::endl);
-    int size;
     if(!bins_.empty())
-        size = bins_.size() - 1;
-    else
+        return bins_.size() - 1;
+
+    check(lMax_ > 0, "invalid lMax");
+    return lMax_ + 1;
+}
+
+double
+Master::binCenter(int b) const
+{
+    return (bins_.empty() ? double(b) : (bins_[b] + bins_[b + 1] - 1) / 2);
+}
+
+void
+Master::estimate(const std::vector<double>& c, std::vector<double>* res) const
+{
+    check(c.size() >= lMax_ + 1, "");
+    const int size = numBins();
+
+    res->resize(size);
+    for(int b = 0; b < size; ++b)
     {
-        check(lMax_ > 0, "invalid lMax");
-        size = lMax_ + 1;
+        double x = 0;
+        for(int l = 0; l <= lMax_; ++l)
+            x += estimator_(b, l) * c[l];
+        (*res)[b] = x;
     }
-    
-    ProgressMeter meter(size);
-    for(int b = 0; b < size; ++b)
+}
+
+void
+Master::calculatePS()
+{
+    output_screen("Calculating final power spectrum..." << std::endl);
+    std::vector<double> res;
+    estimate(c_, &res);
+    for(int b = 0; b < res.size(); ++b)
+        ps_[binCenter(b)] = res[b];
+    output_screen("OK" << std::endl);
+}
+
+void
+Master::simulate(const std::vector<double>& cl, double noise, int nSims, unsigned long seed, std::vector<double>* mean, Math::Matrix<double>* covariance) const
+{
+    check(cl.size() >= lMax_ + 1, "the C_l-s are needed up to lMax = " << lMax_);
+    check(noise >= 0, "invalid noise " << noise);
+    check(nSims > 1, "need at least 2 simulations, " << nSims << " given");
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = mpi.numProcesses(), processId = mpi.processId();
+
+    const int size = numBins();
+    std::vector<double> sum(size, 0), sumSq(size * size, 0);
+    std::string error;
+
+    // one transform is shared by all of the threads, its geometry is set up only once
+    const SphericalHarmonicTransform sht(mask_.Nside(), lMax_);
+
+    // the simulations are split between the processes and then between the threads, each one only adds to the accumulators, the maps are never stored
+#pragma omp parallel default(shared)
     {
-        const double avg = (bins_.empty() ? double(b) : (bins_[b] + bins_[b + 1] - 1) / 2);
-        double c = 0;
-        for(int b1 = 0; b1 < size; ++b1)
+        Alm<xcomplex<double> > alm(lMax_, lMax_);
+        Healpix_Map<double> map, noiseMap;
+        map.SetNside(mask_.Nside(), RING);
+        if(noise > 0)
+            noiseMap.SetNside(mask_.Nside(), RING);
+        std::vector<double> pseudo(lMax_ + 1), est;
+        std::vector<double> threadSum(size, 0), threadSumSq(size * size, 0);
+
+#pragma omp for schedule(dynamic)
+        for(int i = processId; i < nSims; i += nProcesses)
         {
-            if(!bins_.empty())
-            {
+            try {
+                // the random streams depend only on the index of the simulation, so the results do not depend on the number of processes or threads
+                Simulate::simulateAlm(cl, alm, lMax_, seed, 2 * (unsigned long)(i));
                 for(int l = 0; l <= lMax_; ++l)
-                    c += kInv_(b, b1) * p(b1, l) * c_[l];
-            }
-            else
+                    for(int m = 0; m <= l; ++m)
+                        alm(l, m) *= beam_[l];
+
+                sht.alm2map(alm, map);
+                if(noise > 0)
+                {
+                    Simulate::simulateWhiteNoise(noiseMap, noise, seed, 2 * (unsigned long)(i) + 1);
+                    for(long j = 0; j < map.Npix(); ++j)
+                        map[j] += noiseMap[j];
+                }
+
+                for(long j = 0; j < map.Npix(); ++j)
+                    map[j] *= mask_[j];
+
+                sht.map2alm(map, alm);
+                AlmUtils::powerSpectrum(alm, &pseudo);
+
+                estimate(pseudo, &est);
+                for(int a = 0; a < size; ++a)
+                {
+                    threadSum[a] += est[a];
+                    for(int b = 0; b < size; ++b)
+                        threadSumSq[a * size + b] += est[a] * est[b];
+                }
+            } catch (std::exception& e)
             {
-                c += kInv_(b, b1) * c_[b1] * lFactor(b1);
+                setError(error, e);
             }
         }
-        ps_[avg] = c;
-        meter.advance();
+
+#pragma omp critical (master_simulation_sums)
+        {
+            for(int a = 0; a < size; ++a)
+                sum[a] += threadSum[a];
+            for(int k = 0; k < size * size; ++k)
+                sumSq[k] += threadSumSq[k];
+        }
     }
-    output_screen("OK" << std::endl);
-}
+    throwIfError(error);
 
-double
-Master::p(int b, int l) const
-{
-    check(bins_.size() > 1, "");
-    check(l >= 0 && l <= lMax_, "invalid l");
-    check(b >= 0 && b < bins_.size() - 1, "invalid b");
-    
-    if(l < bins_[b] || l >= bins_[b + 1])
-        return 0;
-    
-    return lFactor(l) / (bins_[b + 1] - bins_[b]);
-}
+    if(nProcesses > 1)
+    {
+        std::vector<double> total(size), totalSq(size * size);
+        mpi.reduce(&(sum[0]), &(total[0]), size, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+        mpi.reduce(&(sumSq[0]), &(totalSq[0]), size * size, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+        mpi.bcast(&(total[0]), size, CosmoMPI::DOUBLE);
+        mpi.bcast(&(totalSq[0]), size * size, CosmoMPI::DOUBLE);
+        sum.swap(total);
+        sumSq.swap(totalSq);
+    }
 
-double
-Master::q(int l, int b) const
-{
-    check(bins_.size() > 1, "");
-    check(l >= 0 && l <= lMax_, "invalid l");
-    check(b >= 0 && b < bins_.size() - 1, "invalid b");
-    
-    if(l < bins_[b] || l >= bins_[b + 1])
-        return 0;
-    
-    return 1.0 / lFactor(l);
+    mean->resize(size);
+    for(int a = 0; a < size; ++a)
+        (*mean)[a] = sum[a] / nSims;
+
+    covariance->resize(size, size);
+    for(int a = 0; a < size; ++a)
+        for(int b = 0; b < size; ++b)
+            (*covariance)(a, b) = (sumSq[a * size + b] - nSims * (*mean)[a] * (*mean)[b]) / (nSims - 1);
 }
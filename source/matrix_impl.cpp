@@ -1,4 +1,5 @@
 #include <matrix_impl.hpp>
+#include <gpu_linear_algebra.hpp>
 
 namespace Math
 {
@@ -19,47 +20,56 @@ extern "C"
 
 template<>
 void
-Matrix<double>::multiplyMatrices(const Matrix<double>& a, const Matrix<double>& b, Matrix<double>* res)
+Matrix<double>::multiplyMatrices(const Matrix<double>& a, const Matrix<double>& b, Matrix<double>* res, bool transposeA, bool transposeB)
 {
-    check(a.cols_ == b.rows_, "invalid multiplication, a must have the same number of columns as b rows");
+    check((transposeA ? a.rows_ : a.cols_) == (transposeB ? b.cols_ : b.rows_), "invalid multiplication, a must have the same number of columns as b rows");
 
     check(!res->isSymmetric(), "the product of two matrices is not necessarily symmetric, even if both are");
 
-    res->resize(a.rows_, b.cols_);
-
-    Matrix<double> &c = *res;
-
-    char transa = 'n';
-    char transb = 'n';
-    int m = a.rows_;
-    int n = b.cols_;
-    int k = a.cols_;
-    double alpha = 1;
-    double beta = 0;
-    int lda = a.rows_;
-    int ldb = b.rows_;
-    int ldc = c.rows_;
-
-    std::vector<double> aVec(a.rows_ * a.cols_), bVec(b.rows_ * b.cols_), cVec(c.rows_ * c.cols_);
-    for(int i = 0; i < a.rows_; ++i)
+    // the symmetric matrices are stored packed, and the result cannot be written over one of the operands, so these need to be copied into full matrices first
+    Matrix<double> aFull, bFull;
+    const Matrix<double>* aPt = &a;
+    const Matrix<double>* bPt = &b;
+    if(a.isSymmetric() || &a == res)
     {
-        for(int j = 0; j < a.cols_; ++j)
-            aVec[j * a.rows_ + i] = a(i, j);
+        aFull.copy(a);
+        aPt = &aFull;
     }
-    for(int i = 0; i < b.rows_; ++i)
+    if(b.isSymmetric() || &b == res)
     {
-        for(int j = 0; j < b.cols_; ++j)
-            bVec[j * b.rows_ + i] = b(i, j);
+        bFull.copy(b);
+        bPt = &bFull;
     }
 
-    double *aPt = &(aVec[0]), *bPt = &(bVec[0]);
-    const int r = dgemm_(&transa, &transb, &m, &n, &k, &alpha, aPt, &lda, bPt, &ldb, &beta, &(cVec[0]), &ldc);
+    const int rows = (transposeA ? aPt->cols_ : aPt->rows_);
+    const int cols = (transposeB ? bPt->rows_ : bPt->cols_);
+    const int inner = (transposeA ? aPt->rows_ : aPt->cols_);
+
+    res->resize(rows, cols);
+
+    if(rows == 0 || cols == 0 || inner == 0)
+        return;
 
-    for(int i = 0; i < c.rows_; ++i)
+    // the storage is row major, which is the column major storage of the transpose, so c^T = op(b)^T op(a)^T is calculated directly on the data of the matrices without any copies
+    char transa = (transposeB ? 't' : 'n');
+    char transb = (transposeA ? 't' : 'n');
+    int m = cols;
+    int n = rows;
+    int k = inner;
+    double alpha = 1;
+    double beta = 0;
+    int lda = bPt->cols_;
+    int ldb = aPt->cols_;
+    int ldc = cols;
+
+    GpuLinearAlgebra& gpu = GpuLinearAlgebra::create();
+    if(gpu.useFor(std::min(std::min(m, n), k)))
     {
-        for(int j = 0; j < c.cols_; ++j)
-            c(i, j) = cVec[j * c.rows_ + i];
+        gpu.dgemm(transa, transb, m, n, k, &(bPt->v_[0]), lda, &(aPt->v_[0]), ldb, &(res->v_[0]), ldc);
+        return;
     }
+
+    dgemm_(&transa, &transb, &m, &n, &k, &alpha, const_cast<double*>(&(bPt->v_[0])), &lda, const_cast<double*>(&(aPt->v_[0])), &ldb, &beta, &(res->v_[0]), &ldc);
 }
 
 template<>
@@ -227,13 +237,83 @@ extern "C"
     // orthogonal matrix generation after tridiagonal reduction
     void dopgtr_(char *uplo, int *n, double *a, double *tau, double *q, int *ldq, double *work, int *info);
 
-    // eigenvalue and eigenvector calculation
-    void dsteqr_(char *compz, int *n, double *d, double *e, double *z, int *ldz, double *work, int *info);
-
     // eigenvalue and eigenvector calculation positive definite
     void dpteqr_(char *compz, int *n, double *d, double *e, double *z, int *ldz, double *work, int *info);
+
+    // eigenvalue and eigenvector calculation by divide and conquer
+    void dspevd_(char *jobz, char *uplo, int *n, double *ap, double *w, double *z, int *ldz, double *work, int *lwork, int *iwork, int *liwork, int *info);
+
+    // selected eigenvalues and eigenvectors
+    void dspevx_(char *jobz, char *range, char *uplo, int *n, double *ap, double *vl, double *vu, int *il, int *iu, double *abstol, int *m, double *w, double *z, int *ldz, double *work, int *iwork, int *ifail, int *info);
+
+    // conversion between the packed and the rectangular full packed formats
+    void dtpttf_(char *transr, char *uplo, int *n, double *ap, double *arf, int *info);
+    void dtfttp_(char *transr, char *uplo, int *n, double *arf, double *ap, int *info);
+
+    // Cholesky factorization and inversion in the rectangular full packed format
+    void dpftrf_(char *transr, char *uplo, int *n, double *a, int *info);
+    void dpftri_(char *transr, char *uplo, int *n, double *a, int *info);
+
+    // conversion between the packed and the full formats
+    void dtpttr_(char *uplo, int *n, double *ap, double *a, int *lda, int *info);
+    void dtrttp_(char *uplo, int *n, double *a, int *lda, double *ap, int *info);
+}
+
+namespace
+{
+
+// from this size on the Cholesky factorization and the inversion are done in the rectangular full packed format, which has the same size as the packed format but uses level 3 BLAS
+const int rfpMinSize = 256;
+
+// type 0 is the factorization, type 1 is the inversion from the factorization
+int rfpCholesky(double* v, int n, int type)
+{
+    char transr = 'N';
+    char uplo = 'U';
+    int info;
+
+    std::vector<double> arf((unsigned long)(n) * (n + 1) / 2);
+    dtpttf_(&transr, &uplo, &n, v, &(arf[0]), &info);
+    check(info == 0, "conversion to the rectangular full packed format failed, info = " << info);
+
+    if(type == 0)
+        dpftrf_(&transr, &uplo, &n, &(arf[0]), &info);
+    else
+        dpftri_(&transr, &uplo, &n, &(arf[0]), &info);
+
+    int info1;
+    dtfttp_(&transr, &uplo, &n, &(arf[0]), v, &info1);
+    check(info1 == 0, "conversion from the rectangular full packed format failed, info = " << info1);
+
+    return info;
+}
+
+// the same as rfpCholesky but on the GPU, which needs the full format
+int gpuCholesky(double* v, int n, int type)
+{
+    char uplo = 'U';
+    int lda = n;
+    int info;
+
+    std::vector<double> a((unsigned long)(n) * n);
+    dtpttr_(&uplo, &n, v, &(a[0]), &lda, &info);
+    check(info == 0, "conversion to the full format failed, info = " << info);
+
+    GpuLinearAlgebra& gpu = GpuLinearAlgebra::create();
+    if(type == 0)
+        info = gpu.dpotrf(uplo, n, &(a[0]), lda);
+    else
+        info = gpu.dpotri(uplo, n, &(a[0]), lda);
+
+    int info1;
+    dtrttp_(&uplo, &n, &(a[0]), &lda, v, &info1);
+    check(info1 == 0, "conversion from the full format failed, info = " << info1);
+
+    return info;
 }
 
+} // namespace
+
 template<>
 int
 SymmetricMatrix<double>::choleskyFactorize()
@@ -241,6 +321,12 @@ SymmetricMatrix<double>::choleskyFactorize()
     check(rows_ == cols_, "");
     check(rows_ > 0, "cannot factorize an empty matrix");
 
+    if(GpuLinearAlgebra::create().useFor(rows_))
+        return gpuCholesky(&(v_[0]), rows_, 0);
+
+    if(rows_ >= rfpMinSize)
+        return rfpCholesky(&(v_[0]), rows_, 0);
+
     char c = 'U';
     int info;
     int n = rows_;
@@ -256,6 +342,12 @@ SymmetricMatrix<double>::invertFromCholeskyFactorization()
     check(rows_ == cols_, "");
     check(rows_ > 0, "matrix is empty");
 
+    if(GpuLinearAlgebra::create().useFor(rows_))
+        return gpuCholesky(&(v_[0]), rows_, 1);
+
+    if(rows_ >= rfpMinSize)
+        return rfpCholesky(&(v_[0]), rows_, 1);
+
     char c = 'U';
     int n = rows_;
     int info;
@@ -366,18 +458,45 @@ SymmetricMatrix<double>::getEigen(std::vector<double>* eigenvals, Matrix<double>
     check(rows_ == cols_, "");
     check(rows_ > 0, "matrix is empty");
 
-    std::vector<double> a = v_;
+    std::vector<double> a(v_.begin(), v_.end());
     char uplo = 'U';
     char compz = 'V';
     int n = rows_;
     eigenvals->resize(n);
+    StandardException exc;
+
+    // divide and conquer directly on the packed format, the positive definite case below is slower but more accurate for the small eigenvalues
+    if(!positiveDefinite)
+    {
+        eigenvecs->resize(n, n);
+        int ldz = n;
+        int lwork = 1 + 6 * n + n * n;
+        int liwork = 3 + 5 * n;
+        std::vector<double> work(lwork);
+        std::vector<int> iwork(liwork);
+        int info;
+
+        dspevd_(&compz, &uplo, &n, &(a[0]), &(eigenvals->at(0)), &((*eigenvecs)(0, 0)), &ldz, &(work[0]), &lwork, &(iwork[0]), &liwork, &info);
+        if(info)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Eigenvalue decomposition failed! info = " << info << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        // lapack returns eigenvectors as rows, we want columns
+        eigenvecs->transpose();
+
+        return info;
+    }
+
     std::vector<double> e(n - 1);
     std::vector<double> tau(n - 1);
     
     int info;
 
     dsptrd_(&uplo, &n, &(a[0]), &(eigenvals->at(0)), &(e[0]), &(tau[0]), &info);
-    StandardException exc;
     if(info)
     {
         std::stringstream exceptionStr;
@@ -400,21 +519,15 @@ SymmetricMatrix<double>::getEigen(std::vector<double>* eigenvals, Matrix<double>
         throw exc;
     }
 
-    std::vector<double> work1((positiveDefinite ? 4 : 2) * n);
-    if(positiveDefinite)
-        dpteqr_(&compz, &n, &(eigenvals->at(0)), &(e[0]), &((*eigenvecs)(0, 0)), &ldz, &(work1[0]), &info);
-    else
-        dsteqr_(&compz, &n, &(eigenvals->at(0)), &(e[0]), &((*eigenvecs)(0, 0)), &ldz, &(work1[0]), &info);
+    std::vector<double> work1(4 * n);
+    dpteqr_(&compz, &n, &(eigenvals->at(0)), &(e[0]), &((*eigenvecs)(0, 0)), &ldz, &(work1[0]), &info);
 
-    // if positive definite then eigenvals are in descending order, reversing them to still be in ascending order
-    if(positiveDefinite)
+    // the eigenvals are in descending order, reversing them to still be in ascending order
+    for(int i = 0; i < n / 2; ++i)
     {
-        for(int i = 0; i < n / 2; ++i)
-        {
-            std::swap(eigenvals->at(i), eigenvals->at(n - 1 - i));
-            for(int j = 0; j < n; ++j)
-                std::swap((*eigenvecs)(i, j), (*eigenvecs)(n - 1 - i, j));
-        }
+        std::swap(eigenvals->at(i), eigenvals->at(n - 1 - i));
+        for(int j = 0; j < n; ++j)
+            std::swap((*eigenvecs)(i, j), (*eigenvecs)(n - 1 - i, j));
     }
 
     // lapack returns eigenvectors as rows, we want columns
@@ -423,6 +536,87 @@ SymmetricMatrix<double>::getEigen(std::vector<double>* eigenvals, Matrix<double>
     return info;
 }
 
+template<>
+int
+SymmetricMatrix<double>::getEigenvalues(std::vector<double>* eigenvals) const
+{
+    check(rows_ == cols_, "");
+    check(rows_ > 0, "matrix is empty");
+
+    std::vector<double> a(v_.begin(), v_.end());
+    char jobz = 'N';
+    char uplo = 'U';
+    int n = rows_;
+    eigenvals->resize(n);
+    int ldz = 1;
+    double z;
+    int lwork = 2 * n;
+    int liwork = 1;
+    std::vector<double> work(lwork);
+    int iwork;
+    int info;
+
+    dspevd_(&jobz, &uplo, &n, &(a[0]), &(eigenvals->at(0)), &z, &ldz, &(work[0]), &lwork, &iwork, &liwork, &info);
+    return info;
+}
+
+template<>
+int
+SymmetricMatrix<double>::getEigenRange(int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const
+{
+    check(first >= 0 && first <= last && last < rows_, "invalid eigenvalue range " << first << " to " << last);
+    return getEigenSelected('I', 0, 0, first, last, eigenvals, eigenvecs);
+}
+
+template<>
+int
+SymmetricMatrix<double>::getEigenValueRange(double lower, double upper, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const
+{
+    check(lower < upper, "invalid eigenvalue interval " << lower << " to " << upper);
+    return getEigenSelected('V', lower, upper, 0, 0, eigenvals, eigenvecs);
+}
+
+template<>
+int
+SymmetricMatrix<double>::getEigenSelected(char range, double lower, double upper, int first, int last, std::vector<double>* eigenvals, Matrix<double>* eigenvecs) const
+{
+    check(rows_ == cols_, "");
+    check(rows_ > 0, "matrix is empty");
+
+    std::vector<double> a(v_.begin(), v_.end());
+    char jobz = (eigenvecs ? 'V' : 'N');
+    char uplo = 'U';
+    int n = rows_;
+    double vl = lower, vu = upper;
+    int il = first + 1, iu = last + 1;
+    double abstol = 0;
+    int m;
+
+    // the number of eigenvalues in an interval is not known in advance
+    const int maxM = (range == 'I' ? last - first + 1 : n);
+    std::vector<double> w(n);
+    int ldz = n;
+    std::vector<double> z(eigenvecs ? n * maxM : 1);
+    std::vector<double> work(8 * n);
+    std::vector<int> iwork(5 * n), ifail(n);
+    int info;
+
+    dspevx_(&jobz, &range, &uplo, &n, &(a[0]), &vl, &vu, &il, &iu, &abstol, &m, &(w[0]), &(z[0]), &ldz, &(work[0]), &(iwork[0]), &(ifail[0]), &info);
+
+    eigenvals->assign(w.begin(), w.begin() + m);
+
+    if(eigenvecs)
+    {
+        // lapack returns eigenvectors in column major order
+        eigenvecs->resize(n, m);
+        for(int i = 0; i < n; ++i)
+            for(int j = 0; j < m; ++j)
+                (*eigenvecs)(i, j) = z[j * n + i];
+    }
+
+    return info;
+}
+
 #endif
 
 } // namespace Math
@@ -0,0 +1,233 @@
+#include <cmath>
+#include <map>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <matter_ps_emulator.hpp>
+
+namespace
+{
+
+// ln P compressed onto the principal components
+class MatterPsEmulatorFunc : public Math::RealFunctionMultiToMulti
+{
+public:
+    MatterPsEmulatorFunc(const Math::RealFunctionMultiToMulti& ps, const PrincipalComponents& pca) : ps_(ps), pca_(pca), lnPs_(pca.dim()) {}
+
+    // the power spectra already calculated for the samples used to learn the basis are reused instead of being calculated again
+    void addKnown(const std::vector<double>& x, const double* lnPs) { known_[x].assign(lnPs, lnPs + pca_.dim()); }
+    void clearKnown() { known_.clear(); }
+
+    virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+    {
+        const std::vector<double>* lnPs = &lnPs_;
+        std::map<std::vector<double>, std::vector<double> >::const_iterator it = known_.find(x);
+        if(it != known_.end())
+            lnPs = &(it->second);
+        else
+        {
+            std::vector<double>& l = *const_cast<std::vector<double>*>(&lnPs_);
+            ps_.evaluate(x, &l);
+            check(l.size() == pca_.dim(), "the power spectrum has " << l.size() << " values, expected " << pca_.dim());
+            for(int i = 0; i < l.size(); ++i)
+            {
+                check(l[i] > 0, "the power spectrum must be positive, " << l[i] << " found");
+                l[i] = std::log(l[i]);
+            }
+        }
+
+        res->resize(pca_.nComponents());
+        pca_.compress(&((*lnPs)[0]), &((*res)[0]));
+    }
+
+private:
+    const Math::RealFunctionMultiToMulti& ps_;
+    const PrincipalComponents& pca_;
+
+    std::vector<double> lnPs_;
+    std::map<std::vector<double>, std::vector<double> > known_;
+};
+
+// the mean of ln P over the grid
+class MatterPsEmulatorErrorFunc : public Math::RealFunctionMultiDim
+{
+public:
+    MatterPsEmulatorErrorFunc(const PrincipalComponents& pca) : pca_(pca), lnPs_(pca.dim()) {}
+
+    virtual double evaluate(const std::vector<double>& x) const
+    {
+        check(x.size() == pca_.nComponents(), "");
+
+        std::vector<double>& lnPs = *const_cast<std::vector<double>*>(&lnPs_);
+        pca_.decompress(&(x[0]), &(lnPs[0]));
+
+        double sum = 0;
+        for(int i = 0; i < lnPs.size(); ++i)
+            sum += lnPs[i];
+        return sum / lnPs.size();
+    }
+
+private:
+    const PrincipalComponents& pca_;
+
+    std::vector<double> lnPs_;
+};
+
+} // namespace
+
+MatterPsEmulator::MatterPsEmulator(const Math::RealFunctionMultiToMulti& ps, int nParams, const std::vector<double>& k, const std::vector<double>& z, const char* fileName, double precision, unsigned long minCount, unsigned long compressionSamples, double compressionTolerance) : ps_(ps), nParams_(nParams), k_(k), z_(z), nOut_(k.size() * z.size()), fileName_(fileName), precision_(precision), minCount_(minCount), compressionSamples_(compressionSamples), compressionTolerance_(compressionTolerance), func_(NULL), errorFunc_(NULL), layg_(NULL), lastApproximate_(false)
+{
+    check(nParams_ > 0, "invalid number of parameters " << nParams_);
+    check(!k_.empty(), "no k values");
+    check(!z_.empty(), "no redshifts");
+    for(int i = 0; i < k_.size(); ++i)
+    {
+        check(k_[i] > 0, "invalid k " << k_[i]);
+        check(i == 0 || k_[i] > k_[i - 1], "the k values must be in increasing order");
+    }
+    for(int i = 1; i < z_.size(); ++i)
+    {
+        check(z_[i] > z_[i - 1], "the redshifts must be in increasing order");
+    }
+    check(precision_ > 0, "invalid precision " << precision_);
+    check(compressionSamples_ >= 2, "need at least 2 samples to learn the compression, " << compressionSamples_ << " specified");
+
+    if(!fileName_.empty() && pca_.readFromFile((fileName_ + ".basis").c_str(), nOut_))
+    {
+        output_screen("MatterPsEmulator: read the principal component basis from " << fileName_ << ".basis, " << pca_.nComponents() << " components." << std::endl);
+        createLearnAsYouGo();
+    }
+}
+
+MatterPsEmulator::~MatterPsEmulator()
+{
+    if(layg_)
+        delete layg_;
+    if(func_)
+        delete (MatterPsEmulatorFunc*) func_;
+    if(errorFunc_)
+        delete (MatterPsEmulatorErrorFunc*) errorFunc_;
+}
+
+void
+MatterPsEmulator::createLearnAsYouGo()
+{
+    check(!layg_, "");
+    check(pca_.nComponents() > 0, "the principal component basis is empty");
+
+    MatterPsEmulatorFunc* f = new MatterPsEmulatorFunc(ps_, pca_);
+    func_ = f;
+    MatterPsEmulatorErrorFunc* errorFunc = new MatterPsEmulatorErrorFunc(pca_);
+    errorFunc_ = errorFunc;
+
+    layg_ = new LearnAsYouGo(nParams_, pca_.nComponents(), *f, *errorFunc, minCount_, precision_, fileName_.c_str());
+}
+
+void
+MatterPsEmulator::calculate(const std::vector<double>& params, bool exact)
+{
+    check(params.size() == nParams_, "invalid number of parameters " << params.size() << ", expected " << nParams_);
+
+    if(!layg_)
+    {
+        // still collecting the samples for learning the basis, the exact result is used
+        ps_.evaluate(params, &lnPs_);
+        check(lnPs_.size() == nOut_, "the power spectrum has " << lnPs_.size() << " values, expected " << nOut_);
+        for(int i = 0; i < nOut_; ++i)
+        {
+            check(lnPs_[i] > 0, "the power spectrum must be positive, " << lnPs_[i] << " found");
+            lnPs_[i] = std::log(lnPs_[i]);
+        }
+        lastApproximate_ = false;
+
+        samplePoints_.insert(samplePoints_.end(), params.begin(), params.end());
+        sampleData_.insert(sampleData_.end(), lnPs_.begin(), lnPs_.end());
+
+        const unsigned long nProcesses = CosmoMPI::create().numProcesses();
+        const unsigned long samplesPerProcess = (compressionSamples_ + nProcesses - 1) / nProcesses;
+        if(samplePoints_.size() == samplesPerProcess * nParams_)
+            learnCompression();
+
+        return;
+    }
+
+    if(exact)
+        layg_->evaluateExact(params, &res_);
+    else
+        layg_->evaluate(params, &res_);
+    lastApproximate_ = (layg_->lastEvaluationPath() == LearnAsYouGo::APPROXIMATED);
+
+    check(res_.size() == pca_.nComponents(), "");
+    lnPs_.resize(nOut_);
+    pca_.decompress(&(res_[0]), &(lnPs_[0]));
+}
+
+void
+MatterPsEmulator::learnCompression()
+{
+    check(!layg_, "");
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = mpi.numProcesses();
+    const unsigned long samplesPerProcess = samplePoints_.size() / nParams_;
+    const unsigned long nSamples = samplesPerProcess * nProcesses;
+
+    // all of the processes learn the basis from all of the samples, so that they end up with the same basis
+    std::vector<double> allData(nSamples * nOut_, 0);
+    std::copy(sampleData_.begin(), sampleData_.end(), allData.begin() + mpi.processId() * samplesPerProcess * nOut_);
+    if(nProcesses > 1)
+    {
+        std::vector<double> sum(allData.size(), 0);
+        mpi.reduce(&(allData[0]), &(sum[0]), allData.size(), CosmoMPI::DOUBLE, CosmoMPI::SUM);
+        if(mpi.isMaster())
+            allData.swap(sum);
+        mpi.bcast(&(allData[0]), allData.size(), CosmoMPI::DOUBLE);
+    }
+
+    pca_.learn(&(allData[0]), nSamples, nOut_, compressionTolerance_);
+
+    output_screen1("MatterPsEmulator: learned the principal component basis from " << nSamples << " samples, " << nOut_ << " values are compressed into " << pca_.nComponents() << " components, the fraction of the variance lost is " << pca_.lostVariance() << "." << std::endl);
+
+    if(mpi.isMaster() && !fileName_.empty())
+        pca_.writeIntoFile((fileName_ + ".basis").c_str());
+
+    createLearnAsYouGo();
+
+    // the samples of this process become the first training points, the other processes send theirs
+    MatterPsEmulatorFunc* f = (MatterPsEmulatorFunc*) func_;
+    std::vector<double> x(nParams_), res;
+    for(unsigned long i = 0; i < samplesPerProcess; ++i)
+    {
+        x.assign(samplePoints_.begin() + i * nParams_, samplePoints_.begin() + (i + 1) * nParams_);
+        f->addKnown(x, &(sampleData_[i * nOut_]));
+        layg_->evaluateExact(x, &res);
+    }
+    f->clearKnown();
+
+    std::vector<double>().swap(samplePoints_);
+    std::vector<double>().swap(sampleData_);
+}
+
+void
+MatterPsEmulator::getMatterPs(double z, Math::TableFunction<double, double>* ps) const
+{
+    check(ps, "");
+    check(lnPs_.size() == nOut_, "calculate has not been called");
+    check(z >= z_.front() && z <= z_.back(), "the redshift " << z << " is outside of the range " << z_.front() << " to " << z_.back());
+
+    int iz = std::upper_bound(z_.begin(), z_.end(), z) - z_.begin() - 1;
+    if(iz == z_.size() - 1 && iz > 0)
+        --iz;
+    const double t = (z_.size() > 1 ? (z - z_[iz]) / (z_[iz + 1] - z_[iz]) : 0.0);
+
+    const int nK = k_.size();
+    ps->clear();
+    for(int i = 0; i < nK; ++i)
+    {
+        double l = lnPs_[iz * nK + i];
+        if(t != 0)
+            l = (1 - t) * l + t * lnPs_[(iz + 1) * nK + i];
+        (*ps)[k_[i]] = std::exp(l);
+    }
+}
@@ -2,27 +2,119 @@
 #include <mpi.h>
 #endif
 
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
+
+#include <string>
+#include <sstream>
+
 #include <cosmo_mpi.hpp>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
+#include <mapped_file.hpp>
 #include <mcmc.hpp>
+#include <markov_chain.hpp>
+#include <profiler.hpp>
+
+namespace
+{
+
+// used to hand the communication tags to all of the threads of a process in the hybrid mode
+int threadedCommTags[5];
+
+// completes a non-blocking request, returns false if it is not complete yet and wait is false
+bool completeRequest(void* request, bool wait)
+{
+#ifdef COSMO_MPI
+    MPI_Status st;
+    if(wait)
+    {
+        MPI_Wait((MPI_Request*) request, &st);
+        return true;
+    }
+
+    int flag = 0;
+    MPI_Test((MPI_Request*) request, &flag, &st);
+    return flag;
+#else
+    return true;
+#endif
+}
+
+} // namespace
 
 namespace Math
 {
 
-MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::string fileRoot, time_t seed, bool isLikelihoodApproximate) : n_(nPar), like_(&like), likelihoodApproximate_(isLikelihoodApproximate), spareLike_(NULL), fileRoot_(fileRoot), paramNames_(nPar), param1_(nPar, 0), param2_(nPar, 0), starting_(nPar, std::numeric_limits<double>::max()), current_(nPar), prev_(nPar), samplingWidth_(nPar, 0), accuracy_(nPar, 0), paramSum_(nPar, 0), paramSquaredSum_(nPar, 0), corSum_(nPar, 0), priorMods_(nPar, PRIOR_MODE_MAX), externalPrior_(NULL), externalProposal_(NULL), resumeCode_(123456), nChains_(1), currentChainI_(0), stop_(false), stopRequestMessage_(111222), stopRequestSent_(false), stopMessageRequested_(false), haveStoppedMessage_(476901), firstUpdateRequested_(false), reachedSigma_(nPar, -1), rGelmanRubin_(nPar, -1), adapt_(false), covEpsilon_(1e-7), covFactor_(2.4 * 2.4 / nPar), myCovUpdateInfo_(nPar), tempCovUpdateInfo_(nPar), covarianceReady_(false), firstCovUpdateRequested_(false)
+MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::string fileRoot, time_t seed, bool isLikelihoodApproximate) : MetropolisHastings(nPar, like, fileRoot, seed, isLikelihoodApproximate, 1, 0)
 {
+}
 
-    nChains_ = CosmoMPI::create().numProcesses();
+MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::string fileRoot, time_t seed, bool isLikelihoodApproximate, int nThreads, int threadIndex) : n_(nPar), like_(&like), likelihoodApproximate_(isLikelihoodApproximate), spareLike_(NULL), fileRoot_(fileRoot), paramNames_(nPar), param1_(nPar, 0), param2_(nPar, 0), starting_(nPar, std::numeric_limits<double>::max()), current_(nPar), prev_(nPar), currentOld_(nPar), lineBuff_((nPar + 2) * 32), samplingWidth_(nPar, 0), accuracy_(nPar, 0), chainStats_(nPar), priorMods_(nPar, PRIOR_MODE_MAX), externalPrior_(NULL), externalProposal_(NULL), nTries_(1), nSlowBlocks_(0), fastOversampling_(1), speculativeDepth_(0), specNext_(0), specCount_(0), specEvaluated_(0), specUsed_(0), delayedAcceptance_(false), currentApproxLike_(0), precisionStableIterations_(0), lowPrecision_(false), proposalChangedIter_(0), chainFormat_(TEXT_CHAIN), sharedOut_(NULL), sharedWritten_(0), weightedOutput_(false), pending_(nPar), pendingLike_(0), pendingWeight_(0), chainRows_(0), sharedResume_(NULL), resumeSlotSize_(0), resumeGeneration_(0), logEvaluations_(false), evalSeconds_(0), evalCount_(0), evalApproximate_(0), evalRetries_(0), flushEvery_(1), notFlushed_(0), resumeCode_(123456), asyncResume_(true), resumeThread_(NULL), resumeDone_(false), nChains_(1), currentChainI_(0), nThreads_(nThreads), threadIndex_(threadIndex), stop_(false), preempted_(false), stopRequestMessage_(111222), stopRequestSent_(false), stopMessageRequested_(false), haveStoppedMessage_(476901), firstUpdateRequested_(false), reachedSigma_(nPar, -1), reachedESS_(nPar, -1), rGelmanRubin_(nPar, -1), adapt_(false), covEpsilon_(1e-7), covFactor_(2.4 * 2.4 / nPar), covUpdateTolerance_(0.02), choleskyFactored_(false), choleskyUpdated_(false), myCovUpdateInfo_(nPar), tempCovUpdateInfo_(nPar), covarianceReady_(false), firstCovUpdateRequested_(false), protocol_(POINT_TO_POINT), collectiveStage_(COLLECTIVE_IDLE), collectiveNodeComm_(NULL), collectiveLeaderComm_(NULL), reduceRequest_(NULL), bcastRequest_(NULL), collectiveStopReason_(0), startWeight_(0), startMeanUnknown_(false)
+{
+    check(nThreads_ >= 1, "invalid number of threads " << nThreads_);
+    check(threadIndex_ >= 0 && threadIndex_ < nThreads_, "invalid thread index " << threadIndex_);
+
+    nChains_ = CosmoMPI::create().numProcesses() * nThreads_;
     check(nChains_ >= 1, "");
-    currentChainI_ = CosmoMPI::create().processId();
+    currentChainI_ = CosmoMPI::create().processId() * nThreads_ + threadIndex_;
     check(currentChainI_ >= 0 && currentChainI_  < nChains_, "");
 
-    stopRequestTag_ = CosmoMPI::create().getCommTag();
-    haveStoppedMessageTag_ = CosmoMPI::create().getCommTag();
-    updateReqTag_ = CosmoMPI::create().getCommTag();
-    covUpdateReqTag_ = CosmoMPI::create().getCommTag();
+    if(nThreads_ == 1)
+    {
+        stopRequestTag_ = CosmoMPI::create().getCommTag();
+        haveStoppedMessageTag_ = CosmoMPI::create().getCommTag();
+        updateReqTag_ = CosmoMPI::create().getCommTag();
+        covUpdateReqTag_ = CosmoMPI::create().getCommTag();
+        covSumReqTag_ = CosmoMPI::create().getCommTag();
+    }
+    else
+    {
+        StandardException exc;
+#if defined(COSMO_OMP) && defined(COSMO_MPI)
+        if(omp_get_num_threads() != nThreads_)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The hybrid mode of MetropolisHastings with " << nThreads_ << " threads must be used inside of an OpenMP parallel region with the same number of threads, currently running " << omp_get_num_threads() << " threads.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        if(!CosmoMPI::create().supportsThreads())
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The hybrid mode of MetropolisHastings needs an MPI library with MPI_THREAD_MULTIPLE support.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        // the tags need to be the same for all of the chains, and each one leaves room for all of the chain indices
+#pragma omp single
+        {
+            threadedCommTags[0] = CosmoMPI::create().getCommTag(nThreads_);
+            threadedCommTags[1] = CosmoMPI::create().getCommTag(nThreads_);
+            threadedCommTags[2] = CosmoMPI::create().getCommTag(nThreads_);
+            threadedCommTags[3] = CosmoMPI::create().getCommTag(nThreads_);
+            threadedCommTags[4] = CosmoMPI::create().getCommTag(nThreads_);
+        }
+
+        stopRequestTag_ = threadedCommTags[0];
+        haveStoppedMessageTag_ = threadedCommTags[1];
+        updateReqTag_ = threadedCommTags[2];
+        covUpdateReqTag_ = threadedCommTags[3];
+        covSumReqTag_ = threadedCommTags[4];
+
+        // make sure all of the threads have the tags before they can be overwritten by another object
+#pragma omp barrier
+#else
+        std::stringstream exceptionStr;
+        exceptionStr << "The hybrid mode of MetropolisHastings needs both MPI and OpenMP.";
+        exc.set(exceptionStr.str());
+        throw exc;
+#endif
+    }
 
 #ifdef COSMO_MPI
     sendStopRequest_ = new MPI_Request;
@@ -30,15 +122,22 @@ MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::
     haveStoppedMesReq_ = new MPI_Request;
     receiveCovUpdateRequest_ = new MPI_Request;
 
+    collectiveNodeComm_ = new MPI_Comm;
+    collectiveLeaderComm_ = new MPI_Comm;
+    reduceRequest_ = new MPI_Request;
+    bcastRequest_ = new MPI_Request;
+
     if(isMaster())
     {
         haveStoppedBuff_.resize(nChains_);
         haveStoppedReceiveReq_.resize(nChains_);
         updateReceiveReq_.resize(nChains_);
+        covSumReceiveReq_.resize(nChains_);
         for(int i = 0; i < nChains_; ++i)
         {
             haveStoppedReceiveReq_[i] = new MPI_Request;
             updateReceiveReq_[i] = new MPI_Request;
+            covSumReceiveReq_[i] = new MPI_Request;
         }
     }
 #endif
@@ -62,13 +161,10 @@ MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::
     else
         seed_ = seed;
 
-    UniformRealGenerator temp(seed_, 0, 1000000);
-
-    for(int i = 0; i < 2 * currentChainI_; ++i)
-        temp.generate();
-
-    uniformGen_ = new UniformRealGenerator(int(temp.generate()), 0, 1);
-    generator_ = new GaussianGenerator(int(temp.generate()), 0, 1);
+    // each chain has its own two streams, so the chains are reproducible for a given seed no matter how they are distributed, and the resume info only needs the positions
+    const int processId = CosmoMPI::create().processId();
+    uniformGen_ = new UniformStreamGenerator(seed_, PhiloxEngine::parallelStream(processId, 2 * threadIndex_), 0, 1);
+    generator_ = new GaussianStreamGenerator(seed_, PhiloxEngine::parallelStream(processId, 2 * threadIndex_ + 1), 0, 1);
 
     std::stringstream resFileName;
     resFileName << fileRoot_ << "resume";
@@ -80,6 +176,8 @@ MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::
 
 MetropolisHastings::~MetropolisHastings()
 {
+    waitForResumeWriting();
+
     delete uniformGen_;
     delete generator_;
 
@@ -89,18 +187,11 @@ MetropolisHastings::~MetropolisHastings()
 
     delete (MPI_Request*) receiveCovUpdateRequest_;
 
-    if(!isMaster())
-    {
-        //MPI_Status st;
-        //MPI_Wait((MPI_Request*) haveStoppedMesReq_, &st);
+    delete (MPI_Comm*) collectiveNodeComm_;
+    delete (MPI_Comm*) collectiveLeaderComm_;
+    delete (MPI_Request*) reduceRequest_;
+    delete (MPI_Request*) bcastRequest_;
 
-        for(int i = 0; i < updateRequests_.size(); ++i)
-        {
-            //MPI_Status updateSt;
-            //MPI_Wait((MPI_Request*) updateRequests_[i], &updateSt);
-            delete (MPI_Request*) updateRequests_[i];
-        }
-    }
     delete (MPI_Request*) haveStoppedMesReq_;
 
     if(isMaster())
@@ -109,10 +200,9 @@ MetropolisHastings::~MetropolisHastings()
         {
             delete (MPI_Request*) haveStoppedReceiveReq_[i];
             delete (MPI_Request*) updateReceiveReq_[i];
+            delete (MPI_Request*) covSumReceiveReq_[i];
         }
 
-        for(int i = 0; i < covarianceUpdateRequests_.size(); ++i)
-            delete (MPI_Request*) covarianceUpdateRequests_[i];
     }
 #endif
 }
@@ -132,17 +222,607 @@ MetropolisHastings::useAdaptiveProposal()
 
 
     cholesky_.resize(n_, n_);
+    factoredCovariance_.resize(n_, n_);
+    choleskyFactored_ = false;
+    choleskyUpdated_ = false;
 
     for(int i = 0; i < n_; ++i)
         for(int j = i; j < n_; ++j)
             covariance_(i, j) = 0;
 
+    covSumBuff_.resize(nChains_);
     for(int i = 0; i < nChains_; ++i)
+        covSumBuff_[i].resize(n_ * (n_ + 1) / 2 + n_ + 1, -1);
+
+    if(!startCov_.empty())
+        applyStartingCovariance();
+}
+
+void
+MetropolisHastings::setChainFormat(CHAIN_FORMAT format, int flushEvery)
+{
+    check(format >= 0 && format < CHAIN_FORMAT_MAX, "invalid chain format");
+    check(flushEvery > 0, "invalid flush interval " << flushEvery);
+
+    if(format == SHARED_BINARY_CHAIN && nThreads_ > 1)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The shared chain file of MetropolisHastings cannot be used in the hybrid MPI + OpenMP mode.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    chainFormat_ = format;
+    flushEvery_ = flushEvery;
+}
+
+void
+MetropolisHastings::useFastSlowSampling(int nSlowBlocks, int fastOversampling)
+{
+    check(nSlowBlocks >= 0, "invalid number of slow blocks " << nSlowBlocks);
+    check(fastOversampling >= 1, "invalid fast oversampling " << fastOversampling);
+
+    nSlowBlocks_ = nSlowBlocks;
+    fastOversampling_ = fastOversampling;
+}
+
+void
+MetropolisHastings::useSpeculativeEvaluation(int depth)
+{
+    check(depth >= 0, "invalid speculative depth " << depth);
+
+    speculativeDepth_ = depth;
+    specParams_.resize((depth + 1) * n_);
+    specPriors_.resize(depth + 1);
+    specLikes_.resize(depth + 1);
+    specBlocks_.resize(depth + 1);
+    if(batchParams_.size() < (depth + 1) * n_)
+    {
+        batchParams_.resize((depth + 1) * n_);
+        batchLikes_.resize(depth + 1);
+    }
+}
+
+void
+MetropolisHastings::setCommunicationProtocol(COMMUNICATION_PROTOCOL protocol)
+{
+    check(protocol >= 0 && protocol < COMMUNICATION_PROTOCOL_MAX, "invalid communication protocol " << protocol);
+
+    if(protocol == COLLECTIVE)
+    {
+        StandardException exc;
+        if(nThreads_ > 1)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The collective communication protocol of MetropolisHastings cannot be used in the hybrid MPI + OpenMP mode.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+#if defined(COSMO_MPI) && (!defined(MPI_VERSION) || MPI_VERSION < 3)
+        std::stringstream exceptionStr;
+        exceptionStr << "The collective communication protocol of MetropolisHastings needs the non-blocking collective operations of MPI 3.";
+        exc.set(exceptionStr.str());
+        throw exc;
+#endif
+    }
+
+    protocol_ = protocol;
+}
+
+void
+MetropolisHastings::setCovarianceUpdateTolerance(double tolerance)
+{
+    check(tolerance >= 0, "invalid tolerance " << tolerance);
+    covUpdateTolerance_ = tolerance;
+}
+
+void
+MetropolisHastings::setStartingCovariance(const Math::SymmetricMatrix<double>& cov, const std::vector<std::string>& names, const std::vector<double>& mean, unsigned long weight)
+{
+    const int m = cov.rows();
+    check(m > 0, "empty covariance matrix");
+    check(names.empty() || names.size() == m, "the covariance matrix has " << m << " parameters but " << names.size() << " names are given");
+    check(!names.empty() || m == n_, "the covariance matrix has " << m << " parameters, should be " << n_ << " when the names are not given");
+    check(mean.empty() || mean.size() == m, "the mean has " << mean.size() << " elements, should be " << m);
+    check(weight >= 2, "the weight of the starting covariance must be at least 2");
+
+    startCov_.resize(m * m);
+    for(int i = 0; i < m; ++i)
+        for(int j = 0; j < m; ++j)
+            startCov_[i * m + j] = cov(std::min(i, j), std::max(i, j));
+
+    startNames_ = names;
+    startMean_ = mean;
+    startWeight_ = weight;
+}
+
+void
+MetropolisHastings::setStartingCovariance(const MarkovChain& chain, const std::vector<std::string>& names, unsigned long weight)
+{
+    const int m = chain.nParams();
+    check(names.size() == m, "the chain has " << m << " parameters but " << names.size() << " names are given");
+    check(chain.size() > 1, "the chain is too short");
+
+    std::vector<double> mean(m, 0);
+    double totalProb = 0;
+    for(unsigned long k = 0; k < chain.size(); ++k)
+    {
+        const double p = chain.prob(k);
+        totalProb += p;
+        for(int i = 0; i < m; ++i)
+            mean[i] += p * chain.param(k, i);
+    }
+    check(totalProb > 0, "");
+    for(int i = 0; i < m; ++i)
+        mean[i] /= totalProb;
+
+    Math::SymmetricMatrix<double> cov(m, m);
+    for(int i = 0; i < m; ++i)
+    {
+        const std::vector<double>& x = chain.paramColumn(i);
+        for(int j = i; j < m; ++j)
+        {
+            const std::vector<double>& y = chain.paramColumn(j);
+            double c = 0;
+            for(unsigned long k = 0; k < chain.size(); ++k)
+                c += chain.prob(k) * (x[k] - mean[i]) * (y[k] - mean[j]);
+            cov(i, j) = c / totalProb;
+        }
+    }
+
+    setStartingCovariance(cov, names, mean, weight);
+}
+
+void
+MetropolisHastings::setStartingCovariance(const char* fileName, unsigned long weight)
+{
+    StandardException exc;
+    std::ifstream in(fileName);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot read the covariance matrix file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    std::vector<std::string> names;
+    std::vector<std::vector<double> > rows;
+    std::string line;
+    while(std::getline(in, line))
+    {
+        std::stringstream str(line);
+        if(!line.empty() && line[0] == '#')
+        {
+            if(names.empty() && rows.empty())
+            {
+                str.get();
+                std::string name;
+                while(str >> name)
+                    names.push_back(name);
+            }
+            continue;
+        }
+
+        std::vector<double> row;
+        double x;
+        while(str >> x)
+            row.push_back(x);
+        if(!row.empty())
+            rows.push_back(row);
+    }
+
+    const int m = rows.size();
+    bool valid = (m > 0 && (names.empty() || names.size() == m));
+    for(int i = 0; i < m; ++i)
+        valid = valid && (rows[i].size() == m);
+    if(!valid)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The covariance matrix file " << fileName << " must have a square matrix with one row per line, and as many names as rows if given.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    Math::SymmetricMatrix<double> cov(m, m);
+    for(int i = 0; i < m; ++i)
+        for(int j = i; j < m; ++j)
+            cov(i, j) = rows[i][j];
+
+    setStartingCovariance(cov, names, std::vector<double>(), weight);
+}
+
+void
+MetropolisHastings::readParamNames(const char* fileName, std::vector<std::string>* names)
+{
+    check(names, "");
+    std::ifstream in(fileName);
+    if(!in)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot read the paramnames file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    names->clear();
+    std::string line;
+    while(std::getline(in, line))
+    {
+        std::stringstream str(line);
+        std::string name;
+        if(!(str >> name))
+            continue;
+        if(name[name.size() - 1] == '*')
+            name.erase(name.size() - 1);
+        names->push_back(name);
+    }
+}
+
+void
+MetropolisHastings::applyStartingCovariance()
+{
+    const int m = int(std::sqrt(double(startCov_.size())) + 0.5);
+    check(m * m == startCov_.size(), "");
+
+    // the index of each parameter in the starting matrix, -1 if not found
+    std::vector<int> index(n_, -1);
+    int found = 0;
+    for(int i = 0; i < n_; ++i)
+    {
+        if(startNames_.empty())
+            index[i] = i;
+        else
+        {
+            const std::vector<std::string>::const_iterator it = std::find(startNames_.begin(), startNames_.end(), paramNames_[i]);
+            if(it != startNames_.end())
+                index[i] = int(it - startNames_.begin());
+        }
+
+        if(index[i] >= 0)
+            ++found;
+        else
+            check(samplingWidth_[i] > 0, "the parameter " << paramNames_[i] << " is not in the starting covariance matrix and has no sampling width");
+    }
+
+    for(int i = 0; i < n_; ++i)
+    {
+        for(int j = i; j < n_; ++j)
+        {
+            double c = 0;
+            if(index[i] >= 0 && index[j] >= 0)
+                c = startCov_[index[i] * m + index[j]];
+            else if(i == j)
+                c = samplingWidth_[i] * samplingWidth_[i];
+
+            // the same scaling as in the adaptive updates
+            covariance_(i, j) = covFactor_ * (c + (i == j ? covEpsilon_ : 0.0));
+            cholesky_(i, j) = covariance_(i, j);
+            factoredCovariance_(i, j) = covariance_(i, j);
+        }
+
+        if(index[i] >= 0 && !startMean_.empty())
+            paramMean_[i] = startMean_[index[i]];
+        else
+            paramMean_[i] = (starting_[i] != std::numeric_limits<double>::max() ? starting_[i] : (priorMods_[i] == GAUSSIAN_PRIOR ? param1_[i] : (param1_[i] + param2_[i]) / 2));
+    }
+
+    cholesky_.choleskyFactorize();
+    choleskyFactored_ = true;
+    choleskyUpdated_ = false;
+    covarianceElementsNum_ = startWeight_;
+    startMeanUnknown_ = startMean_.empty();
+    covarianceReady_ = true;
+    proposalChangedIter_ = 0;
+
+    output_screen1("Starting the adaptive proposal from the given covariance matrix, " << found << " of " << n_ << " parameters found in it." << std::endl);
+}
+
+void
+MetropolisHastings::setAsyncResumeWriting(bool async)
+{
+    if(!async)
+        waitForResumeWriting();
+
+    asyncResume_ = async;
+}
+
+void
+MetropolisHastings::writeResumeInfo()
+{
+    std::stringstream str(std::ios::out | std::ios::binary);
+    serializeResumeInfo(str);
+
+    if(!asyncResume_)
+    {
+        resumeWriting_ = str.str();
+        writeResumeBuffer();
+        reportResumeError();
+        return;
+    }
+
+    if(resumeThread_)
+    {
+        // the previous one is still being written, keep this one in case it is the last one
+        if(!resumeDone_.load(std::memory_order_acquire))
+        {
+            resumePending_ = str.str();
+            return;
+        }
+
+        resumeThread_->join();
+        delete resumeThread_;
+        resumeThread_ = NULL;
+        reportResumeError();
+    }
+
+    // this one is newer than the pending one
+    resumePending_.clear();
+    resumeWriting_ = str.str();
+    resumeDone_.store(false);
+    resumeThread_ = new std::thread(&MetropolisHastings::writeResumeBuffer, this);
+}
+
+void
+MetropolisHastings::writeResumeBuffer()
+{
+    if(useSharedResume())
+    {
+        writeSharedResume();
+        resumeDone_.store(true, std::memory_order_release);
+        return;
+    }
+
+    // the old resume file stays if the new one could not be written completely, the error is reported by the calling thread
+    try
+    {
+        Math::ReplacingOutputFile out(resumeFileName_.c_str());
+        out.stream().write(resumeWriting_.data(), resumeWriting_.size());
+        out.commit();
+    }
+    catch (std::exception& e)
+    {
+        resumeError_ = e.what();
+    }
+
+    resumeDone_.store(true, std::memory_order_release);
+}
+
+void
+MetropolisHastings::waitForResumeWriting()
+{
+    if(resumeThread_)
+    {
+        resumeThread_->join();
+        delete resumeThread_;
+        resumeThread_ = NULL;
+        reportResumeError();
+    }
+
+    if(!resumePending_.empty())
+    {
+        resumeWriting_.swap(resumePending_);
+        resumePending_.clear();
+        writeResumeBuffer();
+        reportResumeError();
+    }
+
+    std::string().swap(resumeWriting_);
+}
+
+void
+MetropolisHastings::reportResumeError()
+{
+    if(resumeError_.empty())
+        return;
+
+    output_screen("WARNING: the resume file " << resumeFileName_ << " was not updated, a resumed run would start from the previous resume point. " << resumeError_ << std::endl);
+    resumeError_.clear();
+}
+
+namespace
+{
+
+// the size of the header of the shared resume file (the number of chains, the number of parameters, and the slot size), and of the header of each slot (the size, the generation, and the resume code)
+const long sharedResumeHeaderSize = 24;
+const long sharedResumeSlotHeaderSize = 32;
+
+} // namespace
+
+void
+MetropolisHastings::openSharedOut(bool append)
+{
+    check(!sharedOut_, "");
+    CosmoMPI& mpi = CosmoMPI::create();
+
+    std::stringstream fileName;
+    fileName << fileRoot_ << ".bin";
+    sharedOut_ = new CosmoMPI::File(fileName.str().c_str());
+
+    // the existing file is kept if it has the same layout, the chains that are not resuming just start over in their own blocks
+    const std::string header = SharedBinaryChain::header(paramNames_, nChains_, SharedBinaryChain::defaultBlockRecords, sharedLayout_);
+    std::string existing(header.size(), 0);
+    const long nRead = sharedOut_->readAt(0, &(existing[0]), long(existing.size()));
+    int valid = (nRead == long(header.size()) && existing.compare(0, sharedLayout_.countsOffset, header, 0, sharedLayout_.countsOffset) == 0 ? 1 : 0);
+    mpi.allreduce(&valid, &valid, 1, CosmoMPI::MIN);
+
+    if(append && !valid)
+    {
+        output_screen("WARNING: the shared chain file " << fileName.str() << " does not match the resume information, the elements before the resume point are lost." << std::endl);
+    }
+
+    // nobody reads the old header after it is replaced
+    mpi.barrier();
+    if(!valid && mpi.isMaster())
+        sharedOut_->writeAt(0, header.data(), long(header.size()));
+    mpi.barrier();
+
+    // drop the elements written after the resume information, they will be generated again
+    sharedWritten_ = (append ? chainRows_ : 0);
+    const long count = long(sharedWritten_);
+    sharedOut_->writeAt(sharedLayout_.countOffset(currentChainI_), &count, sizeof(long));
+
+    sharedBuffer_.clear();
+    sharedBuffer_.reserve(flushEvery_ * (2 + n_));
+}
+
+void
+MetropolisHastings::flushSharedOut()
+{
+    check(sharedOut_, "");
+    if(sharedBuffer_.empty())
+        return;
+
+    const long recSize = BinaryChain::recordSize(n_);
+    const unsigned long nRecords = sharedBuffer_.size() / (2 + n_);
+    check(nRecords * (2 + n_) == sharedBuffer_.size(), "");
+
+    // the records are contiguous up to the end of each block
+    unsigned long done = 0;
+    while(done < nRecords)
+    {
+        const unsigned long i = sharedWritten_ + done;
+        const unsigned long m = std::min(sharedLayout_.contiguousRecords(i), nRecords - done);
+        sharedOut_->writeAt(sharedLayout_.recordOffset(currentChainI_, i), &(sharedBuffer_[done * (2 + n_)]), m * recSize);
+        done += m;
+    }
+
+    // the count is written after the records, so the readers never see records that are not there
+    sharedWritten_ += nRecords;
+    const long count = long(sharedWritten_);
+    sharedOut_->writeAt(sharedLayout_.countOffset(currentChainI_), &count, sizeof(long));
+    sharedBuffer_.clear();
+}
+
+void
+MetropolisHastings::closeSharedOut()
+{
+    flushSharedOut();
+    delete sharedOut_;
+    sharedOut_ = NULL;
+}
+
+void
+MetropolisHastings::openSharedResume()
+{
+    check(!sharedResume_, "");
+    CosmoMPI& mpi = CosmoMPI::create();
+
+    std::stringstream fileName;
+    fileName << fileRoot_ << "resume_shared.dat";
+    sharedResume_ = new CosmoMPI::File(fileName.str().c_str());
+
+    // the slots have the size of the resume information of the chains other than the master, which does not depend on the state
+    long mySize = 0;
+    if(!isMaster())
+    {
+        std::stringstream str(std::ios::out | std::ios::binary);
+        serializeResumeInfo(str);
+        mySize = long(str.str().size());
+    }
+    mpi.allreduce(&mySize, &resumeSlotSize_, 1, CosmoMPI::MAX);
+
+    long header[3] = {0, 0, 0};
+    const long expected[3] = {long(nChains_), long(n_), resumeSlotSize_};
+    int valid = (sharedResume_->readAt(0, header, sharedResumeHeaderSize) == sharedResumeHeaderSize && std::equal(header, header + 3, expected) ? 1 : 0);
+    mpi.allreduce(&valid, &valid, 1, CosmoMPI::MIN);
+
+    // the slots of a different layout are not used, they are overwritten
+    mpi.barrier();
+    if(!valid && mpi.isMaster())
+    {
+        sharedResume_->writeAt(0, expected, sharedResumeHeaderSize);
+        const std::vector<char> zeros(sharedResumeSlotHeaderSize, 0);
+        for(int i = 0; i < 2 * (nChains_ - 1); ++i)
+            sharedResume_->writeAt(sharedResumeHeaderSize + i * (sharedResumeSlotHeaderSize + resumeSlotSize_), &(zeros[0]), sharedResumeSlotHeaderSize);
+    }
+    mpi.barrier();
+
+    resumeGeneration_ = 0;
+}
+
+void
+MetropolisHastings::closeSharedResume()
+{
+    delete sharedResume_;
+    sharedResume_ = NULL;
+}
+
+bool
+MetropolisHastings::readSharedResume(std::string& buffer)
+{
+    check(sharedResume_, "");
+    check(!isMaster(), "");
+
+    // the newest complete slot
+    int best = -1;
+    long bestHeader[4] = {0, 0, 0, 0};
+    for(int s = 0; s < 2; ++s)
+    {
+        const long offset = sharedResumeHeaderSize + (2 * (currentChainI_ - 1) + s) * (sharedResumeSlotHeaderSize + resumeSlotSize_);
+        long h[4] = {0, 0, 0, 0};
+        if(sharedResume_->readAt(offset, h, sharedResumeSlotHeaderSize) != sharedResumeSlotHeaderSize)
+            continue;
+        if(h[2] != resumeCode_ || h[0] <= 0 || h[0] > resumeSlotSize_ || h[1] <= 0)
+            continue;
+        if(best == -1 || h[1] > bestHeader[1])
+        {
+            best = s;
+            std::copy(h, h + 4, bestHeader);
+        }
+    }
+
+    if(best == -1)
+        return false;
+
+    const long offset = sharedResumeHeaderSize + (2 * (currentChainI_ - 1) + best) * (sharedResumeSlotHeaderSize + resumeSlotSize_);
+    buffer.resize(bestHeader[0]);
+    if(sharedResume_->readAt(offset + sharedResumeSlotHeaderSize, &(buffer[0]), bestHeader[0]) != bestHeader[0])
+        return false;
+
+    resumeGeneration_ = bestHeader[1];
+    return true;
+}
+
+void
+MetropolisHastings::writeSharedResume()
+{
+    check(sharedResume_, "");
+    check(long(resumeWriting_.size()) <= resumeSlotSize_, "the resume information has " << resumeWriting_.size() << " bytes, the slot only " << resumeSlotSize_);
+
+    // the older of the two slots is replaced, its header is written last so the other one stays valid until the new one is complete
+    ++resumeGeneration_;
+    const int s = int(resumeGeneration_ % 2);
+    const long offset = sharedResumeHeaderSize + (2 * (currentChainI_ - 1) + s) * (sharedResumeSlotHeaderSize + resumeSlotSize_);
+    try {
+        sharedResume_->writeAt(offset + sharedResumeSlotHeaderSize, resumeWriting_.data(), long(resumeWriting_.size()));
+        const long h[4] = {long(resumeWriting_.size()), resumeGeneration_, long(resumeCode_), 0};
+        sharedResume_->writeAt(offset, h, sharedResumeSlotHeaderSize);
+    } catch (std::exception& e)
     {
-        communicationBuff_[i].resize(n_ * n_ + n_ + 1 + 1 + 3 * n_, -1);
+        // like for the resume file, the previous resume information stays
+        output_screen("WARNING: could not write the resume information: " << e.what() << std::endl);
     }
 }
 
+void
+MetropolisHastings::useMultipleTry(int nTries)
+{
+    check(nTries >= 1, "invalid number of tries " << nTries);
+
+    nTries_ = nTries;
+    tryParams_.resize(nTries_ * n_);
+    tryPriors_.resize(nTries_);
+    tryLikes_.resize(nTries_);
+    tryWeights_.resize(nTries_);
+    batchParams_.resize(nTries_ * n_);
+    batchLikes_.resize(nTries_);
+    trySelected_.resize(n_);
+}
+
 void
 MetropolisHastings::setParam(int i, const std::string& name, double min, double max, double starting, double startingWidth, double samplingWidth, double accuracy)
 {
@@ -224,17 +904,25 @@ MetropolisHastings::setParamGauss(int i, const std::string& name, double mean, d
 void
 MetropolisHastings::communicate()
 {
+    COSMO_PROFILE_REGION("mcmc_communicate");
+
     if(iteration_ >= burnin_ + 100)
         calculateStoppingData();
 
     if(isMaster())
     {
+        // the accuracy diagnostic only needs the latest summary of each chain
+        if(cd_ != GELMAN_RUBIN)
+            commInfo_[0].clear();
+
         CommunicationInfo info;
         commInfo_[0].push_back(info);
         std::list<CommunicationInfo>::iterator it = commInfo_[0].end();
         --it;
-        (*it).sums = paramSum_;
-        (*it).sqSums = paramSquaredSum_;
+        (*it).means = chainStats_.mean;
+        (*it).vars.resize(n_);
+        for(int i = 0; i < n_; ++i)
+            (*it).vars[i] = chainStats_.variance(i);
         (*it).stdMean = myStdMean_;
         (*it).iter = double(iteration_ - burnin_);
 
@@ -245,47 +933,51 @@ MetropolisHastings::communicate()
         }
     }
 
-    int covarianceUpdateSize = 0;
-    if(adapt_)
-        covarianceUpdateSize = n_ * n_ + n_ + 1;
+    const int summarySize = 1 + 3 * n_;
+    const int covSumSize = n_ * (n_ + 1) / 2 + n_ + 1;
+    const int packedSize = n_ * (n_ + 1) / 2;
 
 #ifdef COSMO_MPI
+    // recycles the buffers of the completed sends
+    sendPool_.progress();
+
     if(!isMaster() && !stop_)
     {
         output_screen1("Sending updates about progress to master." << std::endl);
-        MPI_Request* updateReq = new MPI_Request;
-        updateRequests_.push_back(updateReq);
-        sendComBuff_.resize(sendComBuff_.size() + 1); 
-        std::vector<double>& currentCom = sendComBuff_[sendComBuff_.size() - 1];
-
-        currentCom.resize(covarianceUpdateSize + 1 + 3 * n_);
+        double* currentCom = sendPool_.getBuffer(summarySize);
+        for(int i = 0; i < n_; ++i)
+        {
+            currentCom[i] = chainStats_.mean[i];
+            currentCom[n_ + i] = chainStats_.variance(i);
+            currentCom[2 * n_ + i] = myStdMean_[i];
+        }
+        currentCom[3 * n_] = double(iteration_ - burnin_);
+        sendPool_.isend(currentCom, summarySize, 0, updateReqTag_ + currentChainI_);
 
         if(adapt_)
         {
+            double* covCom = sendPool_.getBuffer(covSumSize);
+
+            int k = 0;
             check(myCovUpdateInfo_.matrixSum.size() == n_, "");
             for(int i = 0; i < n_; ++i)
             {
                 check(myCovUpdateInfo_.matrixSum[i].size() == n_, "");
-                for(int j = 0; j < n_; ++j)
-                    currentCom[i * n_ + j] = myCovUpdateInfo_.matrixSum[i][j];
+                for(int j = i; j < n_; ++j)
+                    covCom[k++] = myCovUpdateInfo_.matrixSum[i][j];
             }
 
             check(myCovUpdateInfo_.paramSum.size() == n_, "");
             for(int i = 0; i < n_; ++i)
-                currentCom[n_ * n_ + i] = myCovUpdateInfo_.paramSum[i];
+                covCom[k++] = myCovUpdateInfo_.paramSum[i];
 
-            currentCom[n_ * n_ + n_] = double(myCovUpdateInfo_.n);
+            covCom[k++] = double(myCovUpdateInfo_.n);
+            check(k == covSumSize, "");
 
             myCovUpdateInfo_.flush();
+
+            sendPool_.isend(covCom, covSumSize, 0, covSumReqTag_ + currentChainI_);
         }
-        for(int i = 0; i < n_; ++i)
-        {
-            currentCom[covarianceUpdateSize + i] = paramSum_[i];
-            currentCom[covarianceUpdateSize + n_ + i] = paramSquaredSum_[i];
-            currentCom[covarianceUpdateSize + 2 * n_ + i] = myStdMean_[i];
-        }
-        currentCom[covarianceUpdateSize + 3 * n_] = double(iteration_ - burnin_);
-        MPI_Isend(&(currentCom[0]), covarianceUpdateSize + 1 + 3 * n_, MPI_DOUBLE, 0, updateReqTag_ + currentChainI_, MPI_COMM_WORLD, updateReq);
     }
 
     if(isMaster())
@@ -294,8 +986,14 @@ MetropolisHastings::communicate()
         {
             for(int i = 1; i < nChains_; ++i)
             {
-                check(communicationBuff_[i].size() == covarianceUpdateSize + 1 + 3 * n_, "");
-                MPI_Irecv(&(communicationBuff_[i][0]), covarianceUpdateSize + 1 + 3 * n_, MPI_DOUBLE, i, updateReqTag_ + i, MPI_COMM_WORLD, (MPI_Request*) updateReceiveReq_[i]);
+                check(communicationBuff_[i].size() == summarySize, "");
+                MPI_Irecv(&(communicationBuff_[i][0]), summarySize, MPI_DOUBLE, chainProcess(i), updateReqTag_ + i, MPI_COMM_WORLD, (MPI_Request*) updateReceiveReq_[i]);
+
+                if(adapt_)
+                {
+                    check(covSumBuff_[i].size() == covSumSize, "");
+                    MPI_Irecv(&(covSumBuff_[i][0]), covSumSize, MPI_DOUBLE, chainProcess(i), covSumReqTag_ + i, MPI_COMM_WORLD, (MPI_Request*) covSumReceiveReq_[i]);
+                }
             }
 
             firstUpdateRequested_ = true;
@@ -311,62 +1009,71 @@ MetropolisHastings::communicate()
                 if(updateFlag)
                 {
                     output_screen1("Received an update from chain " << i << "." << std::endl);
+                    if(cd_ != GELMAN_RUBIN)
+                        commInfo_[i].clear();
                     CommunicationInfo temp(n_);
                     commInfo_[i].push_back(temp);
                     std::list<CommunicationInfo>::iterator it = commInfo_[i].end();
                     --it;
                     for(int j = 0; j < n_; ++j)
                     {
-                        (*it).sums[j] = communicationBuff_[i][covarianceUpdateSize + j];
-                        (*it).sqSums[j] = communicationBuff_[i][covarianceUpdateSize + n_ + j];
-                        (*it).stdMean[j] = communicationBuff_[i][covarianceUpdateSize + 2 * n_ + j];
+                        (*it).means[j] = communicationBuff_[i][j];
+                        (*it).vars[j] = communicationBuff_[i][n_ + j];
+                        (*it).stdMean[j] = communicationBuff_[i][2 * n_ + j];
                     }
-                    (*it).iter = communicationBuff_[i][covarianceUpdateSize + 3 * n_];
+                    (*it).iter = communicationBuff_[i][3 * n_];
+
+                    MPI_Irecv(&(communicationBuff_[i][0]), summarySize, MPI_DOUBLE, chainProcess(i), updateReqTag_ + i, MPI_COMM_WORLD, (MPI_Request*) updateReceiveReq_[i]);
+                }
 
-                    if(adapt_ && !stop_)
+                if(!adapt_)
+                    continue;
+
+                int covSumFlag = 0;
+                MPI_Status covSumSt;
+                MPI_Test((MPI_Request*) covSumReceiveReq_[i], &covSumFlag, &covSumSt);
+                if(covSumFlag)
+                {
+                    if(!stop_)
                     {
+                        int k = 0;
                         check(tempCovUpdateInfo_.matrixSum.size() == n_, "");
-                        for(int k = 0; k < n_; ++k)
+                        for(int l = 0; l < n_; ++l)
                         {
-                            check(tempCovUpdateInfo_.matrixSum[k].size() == n_, "");
-                            for(int j = 0; j < n_; ++j)
-                                tempCovUpdateInfo_.matrixSum[k][j] = communicationBuff_[i][k * n_ + j];
+                            check(tempCovUpdateInfo_.matrixSum[l].size() == n_, "");
+                            for(int j = l; j < n_; ++j)
+                                tempCovUpdateInfo_.matrixSum[l][j] = covSumBuff_[i][k++];
                         }
 
                         check(tempCovUpdateInfo_.paramSum.size() == n_, "");
                         for(int j = 0; j < n_; ++j)
-                            tempCovUpdateInfo_.paramSum[j] = communicationBuff_[i][n_ * n_ + j];
+                            tempCovUpdateInfo_.paramSum[j] = covSumBuff_[i][k++];
 
-                        tempCovUpdateInfo_.n = (unsigned long)(communicationBuff_[i][n_ * n_ + n_]);
+                        tempCovUpdateInfo_.n = (unsigned long)(covSumBuff_[i][k++]);
+                        check(k == covSumSize, "");
 
                         updateCovarianceMatrix(tempCovUpdateInfo_);
                     }
 
-                    MPI_Irecv(&(communicationBuff_[i][0]), covarianceUpdateSize + 1 + 3 * n_, MPI_DOUBLE, i, updateReqTag_ + i, MPI_COMM_WORLD, (MPI_Request*) updateReceiveReq_[i]);
+                    MPI_Irecv(&(covSumBuff_[i][0]), covSumSize, MPI_DOUBLE, chainProcess(i), covSumReqTag_ + i, MPI_COMM_WORLD, (MPI_Request*) covSumReceiveReq_[i]);
                 }
             }
 
-            // update everybody's covariance matrix
-            if(adapt_ && !stop_ && covarianceReady_)
+            // update everybody's covariance matrix, only if the factor has been recomputed since the last time
+            if(adapt_ && !stop_ && covarianceReady_ && choleskyUpdated_)
             {
+                // the same packed lower triangle is sent to all of the chains
+                double* currentCom = sendPool_.getBuffer(packedSize);
+                packCholesky(currentCom);
+
                 for(int i = 1; i < nChains_; ++i)
                 {
                     output_screen1("Sending the covariance matrix update to chain " << i << "." << std::endl);
 
-                    MPI_Request* covUpdateReq = new MPI_Request;
-                    covarianceUpdateRequests_.push_back(covUpdateReq);
-                    covUpdateBuff_.resize(covUpdateBuff_.size() + 1); 
-                    std::vector<double>& currentCom = covUpdateBuff_[covUpdateBuff_.size() - 1];
-
-                    currentCom.resize(n_ * n_);
-                    for(int j = 0; j < n_; ++j)
-                    {
-                        for(int k = 0; k < n_; ++k)
-                            currentCom[j * n_ + k] = cholesky_(j, k);
-                    }
-
-                    MPI_Isend(&(currentCom[0]), n_ * n_, MPI_DOUBLE, i, covUpdateReqTag_ + i, MPI_COMM_WORLD, covUpdateReq);
+                    sendPool_.isend(currentCom, packedSize, chainProcess(i), covUpdateReqTag_ + i);
                 }
+
+                choleskyUpdated_ = false;
             }
         }
     }
@@ -378,9 +1085,9 @@ MetropolisHastings::communicate()
             for(int i = 1; i < nChains_; ++i)
             {
                 output_screen1("Sending stop request to chain " << i << "." << std::endl);
-                MPI_Isend(&stopRequestMessage_, 1, MPI_INT, i, stopRequestTag_ + i, MPI_COMM_WORLD, (MPI_Request*) sendStopRequest_);
+                MPI_Isend(&stopRequestMessage_, 1, MPI_INT, chainProcess(i), stopRequestTag_ + i, MPI_COMM_WORLD, (MPI_Request*) sendStopRequest_);
 
-                MPI_Irecv(&(haveStoppedBuff_[i]), 1, MPI_INT, i, haveStoppedMessageTag_ + i, MPI_COMM_WORLD, (MPI_Request*) haveStoppedReceiveReq_[i]);
+                MPI_Irecv(&(haveStoppedBuff_[i]), 1, MPI_INT, chainProcess(i), haveStoppedMessageTag_ + i, MPI_COMM_WORLD, (MPI_Request*) haveStoppedReceiveReq_[i]);
             }
 
             stopRequestSent_ = true;
@@ -398,8 +1105,8 @@ MetropolisHastings::communicate()
 
     if(adapt_ && !firstCovUpdateRequested_)
     {
-        eigenUpdateBuff_.resize(n_ * n_);
-        MPI_Irecv(&(eigenUpdateBuff_[0]), n_ * n_, MPI_DOUBLE, 0, covUpdateReqTag_ + currentChainI_, MPI_COMM_WORLD, (MPI_Request*) receiveCovUpdateRequest_);
+        eigenUpdateBuff_.resize(packedSize);
+        MPI_Irecv(&(eigenUpdateBuff_[0]), packedSize, MPI_DOUBLE, 0, covUpdateReqTag_ + currentChainI_, MPI_COMM_WORLD, (MPI_Request*) receiveCovUpdateRequest_);
         firstCovUpdateRequested_ = true;
     }
 
@@ -413,50 +1120,318 @@ MetropolisHastings::communicate()
         {
             output_screen1("Received an updated covariance matrix from the master." << std::endl);
             check(cholesky_.rows() == n_, "");
-            for(int i = 0; i < n_; ++i)
+            unpackCholesky(&(eigenUpdateBuff_[0]));
+            proposalChangedIter_ = iteration_;
+
+            covarianceReady_ = true;
+
+            MPI_Irecv(&(eigenUpdateBuff_[0]), packedSize, MPI_DOUBLE, 0, covUpdateReqTag_ + currentChainI_, MPI_COMM_WORLD, (MPI_Request*) receiveCovUpdateRequest_);
+        }
+    }
+
+    if(!stop_)
+    {
+        int stopFlag = 0;
+        MPI_Status stopSt;
+        MPI_Test((MPI_Request*) receiveStopRequest_, &stopFlag, &stopSt);
+        if(stopFlag)
+        {
+            check(stopMessageBuff_ == stopRequestMessage_, "wrong message received");
+            output_screen1("Received stop request." << std::endl);
+            stop_ = true;
+        }
+    }
+#endif
+}
+
+void
+MetropolisHastings::sendHaveStopped()
+{
+#ifdef COSMO_MPI
+    check(!isMaster(), "");
+
+    output_screen1("Informing master that I have stopped." << std::endl);
+    MPI_Isend(&haveStoppedMessage_, 1, MPI_INT, 0, haveStoppedMessageTag_ + currentChainI_, MPI_COMM_WORLD, (MPI_Request*) haveStoppedMesReq_);
+#endif
+}
+
+void
+MetropolisHastings::startCollectiveRound(bool done)
+{
+    COSMO_PROFILE_REGION("mcmc_communicate");
+
+    check(protocol_ == COLLECTIVE, "");
+    check(collectiveStage_ == COLLECTIVE_IDLE, "");
+
+    // the layout is the sums over the chains of the means, the squared means, the variances, and the squared standard deviations of the means, followed by the sum of the chain lengths, the number of chains that are not ready, the number of chains that are done, the number of chains that have been asked to terminate, and the sums for the covariance matrix
+    const int summarySize = 4 * n_ + 4;
+    const int covSumSize = (adapt_ ? n_ * (n_ + 1) / 2 + n_ + 1 : 0);
+    reduceSendBuff_.resize(summarySize + covSumSize);
+    nodeReduceBuff_.resize(summarySize + covSumSize);
+    reduceRecvBuff_.resize(summarySize + covSumSize);
+
+    bool ready = (iteration_ >= burnin_ + 100);
+    if(ready)
+        calculateStoppingData();
+
+    for(int i = 0; i < n_; ++i)
+    {
+        const double mean = (ready ? chainStats_.mean[i] : 0.0);
+        reduceSendBuff_[i] = mean;
+        reduceSendBuff_[n_ + i] = mean * mean;
+        reduceSendBuff_[2 * n_ + i] = (ready ? chainStats_.variance(i) : 0.0);
+        reduceSendBuff_[3 * n_ + i] = (ready ? myStdMean_[i] * myStdMean_[i] : 0.0);
+        if(cd_ != GELMAN_RUBIN && myStdMean_[i] == -1)
+            ready = false;
+    }
+    reduceSendBuff_[4 * n_] = (ready ? double(iteration_ - burnin_) : 0.0);
+    reduceSendBuff_[4 * n_ + 1] = (ready ? 0.0 : 1.0);
+    reduceSendBuff_[4 * n_ + 2] = (done ? 1.0 : 0.0);
+    reduceSendBuff_[4 * n_ + 3] = (preempted_ ? 1.0 : 0.0);
+
+    if(adapt_)
+    {
+        int k = summarySize;
+        for(int i = 0; i < n_; ++i)
+            for(int j = i; j < n_; ++j)
+                reduceSendBuff_[k++] = myCovUpdateInfo_.matrixSum[i][j];
+
+        for(int i = 0; i < n_; ++i)
+            reduceSendBuff_[k++] = myCovUpdateInfo_.paramSum[i];
+
+        reduceSendBuff_[k++] = double(myCovUpdateInfo_.n);
+        check(k == reduceSendBuff_.size(), "");
+
+        myCovUpdateInfo_.flush();
+    }
+
+    bcastBuff_.resize(2 + (adapt_ ? n_ * (n_ + 1) / 2 : 0));
+
+#ifdef COSMO_MPI
+    // the sums over the node first, then over the node masters in progressCollectiveRound
+    MPI_Ireduce(&(reduceSendBuff_[0]), &(nodeReduceBuff_[0]), reduceSendBuff_.size(), MPI_DOUBLE, MPI_SUM, 0, *((MPI_Comm*) collectiveNodeComm_), (MPI_Request*) reduceRequest_);
+#else
+    reduceRecvBuff_ = reduceSendBuff_;
+#endif
+
+    collectiveStage_ = COLLECTIVE_REDUCING;
+}
+
+bool
+MetropolisHastings::progressCollectiveRound(bool wait)
+{
+    COSMO_PROFILE_REGION("mcmc_communicate");
+
+    check(protocol_ == COLLECTIVE, "");
+
+    if(collectiveStage_ == COLLECTIVE_REDUCING)
+    {
+        if(!completeRequest(reduceRequest_, wait))
+            return false;
+
+#ifdef COSMO_MPI
+        if(CosmoMPI::create().isNodeMaster())
+        {
+            MPI_Ireduce(&(nodeReduceBuff_[0]), &(reduceRecvBuff_[0]), nodeReduceBuff_.size(), MPI_DOUBLE, MPI_SUM, 0, *((MPI_Comm*) collectiveLeaderComm_), (MPI_Request*) reduceRequest_);
+            collectiveStage_ = COLLECTIVE_REDUCING_LEADERS;
+        }
+        else
+        {
+            // waiting for the decision from the node master
+            MPI_Ibcast(&(bcastBuff_[0]), bcastBuff_.size(), MPI_DOUBLE, 0, *((MPI_Comm*) collectiveNodeComm_), (MPI_Request*) bcastRequest_);
+            collectiveStage_ = COLLECTIVE_BROADCASTING;
+        }
+#else
+        collectiveStage_ = COLLECTIVE_REDUCING_LEADERS;
+#endif
+    }
+
+    if(collectiveStage_ == COLLECTIVE_REDUCING_LEADERS)
+    {
+        if(!completeRequest(reduceRequest_, wait))
+            return false;
+
+        if(isMaster())
+            collectiveDecision();
+
+#ifdef COSMO_MPI
+        MPI_Ibcast(&(bcastBuff_[0]), bcastBuff_.size(), MPI_DOUBLE, 0, *((MPI_Comm*) collectiveLeaderComm_), (MPI_Request*) bcastRequest_);
+#endif
+        collectiveStage_ = COLLECTIVE_BROADCASTING_LEADERS;
+    }
+
+    if(collectiveStage_ == COLLECTIVE_BROADCASTING_LEADERS)
+    {
+        if(!completeRequest(bcastRequest_, wait))
+            return false;
+
+#ifdef COSMO_MPI
+        MPI_Ibcast(&(bcastBuff_[0]), bcastBuff_.size(), MPI_DOUBLE, 0, *((MPI_Comm*) collectiveNodeComm_), (MPI_Request*) bcastRequest_);
+#endif
+        collectiveStage_ = COLLECTIVE_BROADCASTING;
+    }
+
+    if(collectiveStage_ == COLLECTIVE_BROADCASTING)
+    {
+        if(!completeRequest(bcastRequest_, wait))
+            return false;
+
+        if(bcastBuff_[0] != 0)
+        {
+            stop_ = true;
+            collectiveStopReason_ = int(bcastBuff_[0]);
+            if(collectiveStopReason_ == 3)
+                preempted_ = true;
+        }
+
+        if(adapt_ && bcastBuff_[1] != 0)
+        {
+            if(!isMaster())
+            {
+                output_screen1("Received an updated covariance matrix from the master." << std::endl);
+                unpackCholesky(&(bcastBuff_[2]));
+                proposalChangedIter_ = iteration_;
+            }
+            covarianceReady_ = true;
+        }
+
+        collectiveStage_ = COLLECTIVE_IDLE;
+    }
+
+    return true;
+}
+
+void
+MetropolisHastings::collectiveDecision()
+{
+    check(isMaster(), "");
+
+    const double* r = &(reduceRecvBuff_[0]);
+    const int summarySize = 4 * n_ + 4;
+    const double nChains = nChains_;
+
+    int stopReason = 0;
+    if(r[4 * n_ + 3] > 0)
+        stopReason = 3;
+    else if(r[4 * n_ + 2] > 0)
+        stopReason = 2;
+    else if(r[4 * n_ + 1] == 0)
+    {
+        // the same diagnostics as checkStoppingCrit, from the sums over the chains
+        const double total = r[4 * n_] / nChains;
+        bool doStop = (cd_ != GELMAN_RUBIN || total >= 100);
+        for(int i = 0; i < n_; ++i)
+        {
+            if(cd_ == GELMAN_RUBIN)
             {
-                for(int j = 0; j < n_; ++j)
-                    cholesky_(i, j) = eigenUpdateBuff_[i * n_ + j];
-            }
+                const double totalMean = r[i] / nChains;
+                const double B = std::max(0.0, r[n_ + i] - nChains * totalMean * totalMean) * total / (nChains - 1);
+                const double W = r[2 * n_ + i] / nChains;
+                const double var = (total - 1) * W / total + B / total;
 
-            covarianceReady_ = true;
+                if(W == 0)
+                    rGelmanRubin_[i] = (var == 0 ? 1.0 : 100.0);
+                else
+                    rGelmanRubin_[i] = std::sqrt(var / W);
 
-            MPI_Irecv(&(eigenUpdateBuff_[0]), n_ * n_, MPI_DOUBLE, 0, covUpdateReqTag_ + currentChainI_, MPI_COMM_WORLD, (MPI_Request*) receiveCovUpdateRequest_);
+                if(std::abs(rGelmanRubin_[i] - 1) > cc_)
+                    doStop = false;
+            }
+            else if(cd_ == ACCURACY)
+            {
+                reachedSigma_[i] = std::sqrt(r[3 * n_ + i]) / nChains;
+                if(reachedSigma_[i] > accuracy_[i])
+                    doStop = false;
+            }
+            else
+            {
+                reachedSigma_[i] = std::sqrt(r[3 * n_ + i]) / nChains;
+                reachedESS_[i] = (r[3 * n_ + i] > 0 ? r[2 * n_ + i] / nChains / (reachedSigma_[i] * reachedSigma_[i]) : 0.0);
+                if(reachedESS_[i] < cc_)
+                    doStop = false;
+            }
         }
-    }
 
-    if(!stop_)
-    {
-        int stopFlag = 0;
-        MPI_Status stopSt;
-        MPI_Test((MPI_Request*) receiveStopRequest_, &stopFlag, &stopSt);
-        if(stopFlag)
-        {
-            check(stopMessageBuff_ == stopRequestMessage_, "wrong message received");
-            output_screen1("Received stop request." << std::endl);
-            stop_ = true;
-        }
+        if(doStop)
+            stopReason = 1;
     }
-#endif
+
+    bcastBuff_[0] = stopReason;
+    bcastBuff_[1] = 0;
+
+    if(!adapt_ || stopReason)
+        return;
+
+    int k = summarySize;
+    for(int i = 0; i < n_; ++i)
+        for(int j = i; j < n_; ++j)
+            tempCovUpdateInfo_.matrixSum[i][j] = r[k++];
+
+    for(int i = 0; i < n_; ++i)
+        tempCovUpdateInfo_.paramSum[i] = r[k++];
+
+    tempCovUpdateInfo_.n = (unsigned long)(r[k++]);
+    check(k == reduceRecvBuff_.size(), "");
+
+    if(tempCovUpdateInfo_.n < 2)
+        return;
+
+    updateCovarianceMatrix(tempCovUpdateInfo_);
+    if(!covarianceReady_ || !choleskyUpdated_)
+        return;
+
+    bcastBuff_[1] = 1;
+    packCholesky(&(bcastBuff_[2]));
+    choleskyUpdated_ = false;
 }
 
 void
-MetropolisHastings::sendHaveStopped()
+MetropolisHastings::barrier() const
 {
 #ifdef COSMO_MPI
-    check(!isMaster(), "");
+#ifdef COSMO_OMP
+    if(nThreads_ > 1)
+    {
+#pragma omp barrier
+    }
+#endif
+    // only one thread per process can take part in the collective call
+    if(threadIndex_ == 0)
+        MPI_Barrier(MPI_COMM_WORLD);
+#ifdef COSMO_OMP
+    if(nThreads_ > 1)
+    {
+#pragma omp barrier
+    }
+#endif
+#endif
+}
 
-    output_screen1("Informing master that I have stopped." << std::endl);
-    MPI_Isend(&haveStoppedMessage_, 1, MPI_INT, 0, haveStoppedMessageTag_ + currentChainI_, MPI_COMM_WORLD, (MPI_Request*) haveStoppedMesReq_);
+bool
+MetropolisHastings::preemptedEverywhere() const
+{
+#ifdef COSMO_OMP
+    if(nThreads_ > 1)
+    {
+#pragma omp barrier
+    }
+#endif
+    // only one thread per process can take part in the collective call, the result is kept by CheckpointCoordinator for the others
+    if(threadIndex_ == 0)
+        CheckpointCoordinator::requestedEverywhere();
+#ifdef COSMO_OMP
+    if(nThreads_ > 1)
+    {
+#pragma omp barrier
+    }
 #endif
+    return CheckpointCoordinator::requested();
 }
 
 int
 MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformationEvery, unsigned long burnin, CONVERGENCE_DIAGNOSTIC cd, double convergenceCriterion, bool adaptiveProposal)
 {
-#ifdef COSMO_MPI
-    MPI_Barrier(MPI_COMM_WORLD);
-#endif
+    barrier();
 
     check(maxChainLength > 0, "invalid maxChainLength = " << maxChainLength);
     check(!blocks_.empty(), "");
@@ -465,6 +1440,9 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
 
     check(convergenceCriterion > 0, "invalid convergence criterion " << convergenceCriterion << ", needs to be positive");
 
+    check(!(delayedAcceptance_ && nTries_ > 1), "delayed acceptance cannot be combined with multiple-try Metropolis");
+    check(!(speculativeDepth_ > 0 && (nTries_ > 1 || delayedAcceptance_)), "speculative evaluation cannot be combined with multiple-try Metropolis or delayed acceptance");
+
     if(adaptiveProposal)
         useAdaptiveProposal();
     
@@ -477,10 +1455,30 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
 
     cc_ = convergenceCriterion;
 
+    if(protocol_ == COLLECTIVE)
+    {
+        collectiveStage_ = COLLECTIVE_IDLE;
+        collectiveStopReason_ = 0;
+#ifdef COSMO_MPI
+        // the master is the first process on its node and among the node masters
+        CosmoMPI& mpi = CosmoMPI::create();
+        MPI_Comm_dup(*((MPI_Comm*) mpi.nodeCommunicator().handle()), (MPI_Comm*) collectiveNodeComm_);
+        if(mpi.isNodeMaster())
+            MPI_Comm_dup(*((MPI_Comm*) mpi.leaderCommunicator()->handle()), (MPI_Comm*) collectiveLeaderComm_);
+#endif
+    }
+
 #ifdef COSMO_MPI
     if(currentChainI_ == 0)
     {
-        output_screen_clean("Running the MPI version of MetropolisHastings with " << nChains_ << " tasks!!!" << std::endl << std::endl);
+        if(nThreads_ > 1)
+        {
+            output_screen_clean("Running the hybrid MPI + OpenMP version of MetropolisHastings with " << nChains_ << " chains, " << nThreads_ << " threads per process!!!" << std::endl << std::endl);
+        }
+        else
+        {
+            output_screen_clean("Running the MPI version of MetropolisHastings with " << nChains_ << " tasks!!!" << std::endl << std::endl);
+        }
     }
 #endif
 
@@ -508,10 +1506,27 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         outPar.close();
     }
 
+    if(chainFormat_ == SHARED_BINARY_CHAIN)
+    {
+        openSharedResume();
+
+        // the resume information is written from the background thread with MPI-IO
+        if(!CosmoMPI::create().supportsThreads())
+            setAsyncResumeWriting(false);
+    }
+
     if(readResumeInfo())
     {
         output_screen("Resuming from previous run, already have " << iteration_ << " iterations." << std::endl);
         openOut(true);
+
+        // the last state of a weighted run, if this one is not weighted
+        if(!weightedOutput_)
+            writePendingRow();
+
+        // the resume file only has the exact likelihood of the current point
+        if(delayedAcceptance_)
+            currentApproxLike_ = like_->calculate(&(current_[0]), n_);
     }
     else
     {
@@ -520,17 +1535,20 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         maxChainLength_ = maxChainLength;
 
         current_ = starting_;
-        currentLike_ = like_->calculate(&(current_[0]), n_);
-        currentPrior_ = calculatePrior();
+        if(delayedAcceptance_)
+        {
+            currentApproxLike_ = like_->calculate(&(current_[0]), n_);
+            currentLike_ = like_->calculateExact(&(current_[0]), n_);
+        }
+        else
+            currentLike_ = like_->calculate(&(current_[0]), n_);
+        currentPrior_ = calculatePrior(&(current_[0]));
         prev_ = current_;
         iteration_ = 0;
+        chainRows_ = 0;
+        pendingWeight_ = 0;
 
-        for(int i = 0; i < n_; ++i)
-        {
-            paramSum_[i] = 0;
-            paramSquaredSum_[i] = 0;
-            corSum_[i] = 0;
-        }
+        chainStats_.reset();
 
         commInfo_.clear();
         commInfo_.resize(nChains_);
@@ -538,60 +1556,135 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         openOut(false);
     }
 
+    lowPrecision_ = false;
+    if(precisionStableIterations_ > 0 && iteration_ < burnin_)
+    {
+        if(like_->setLowPrecision(true))
+        {
+            output_screen("Precision schedule: starting with the low precision of the likelihood." << std::endl);
+            lowPrecision_ = true;
+            proposalChangedIter_ = iteration_;
+
+            // the likelihood of the current point is compared to the low precision proposals
+            if(delayedAcceptance_)
+            {
+                currentApproxLike_ = like_->calculate(&(current_[0]), n_);
+                currentLike_ = like_->calculateExact(&(current_[0]), n_);
+            }
+            else
+                currentLike_ = like_->calculate(&(current_[0]), n_);
+        }
+        else
+        {
+            output_screen("WARNING: the likelihood does not support the low precision, the precision schedule is ignored." << std::endl);
+        }
+    }
+
+    // the order in which the blocks are updated in each iteration, the fast blocks are repeated for fast-slow sampling
+    std::vector<int> blockSchedule;
+    std::vector<int> blockSteps(blocks_.size(), 1);
+    if(fastOversampling_ > 1)
+    {
+        check(nSlowBlocks_ < blocks_.size(), "there are no fast blocks, " << nSlowBlocks_ << " slow blocks out of " << blocks_.size());
+        output_screen("Fast-slow sampling: " << nSlowBlocks_ << " slow blocks, " << blocks_.size() - nSlowBlocks_ << " fast blocks updated " << fastOversampling_ << " times per iteration." << std::endl);
+
+        for(int i = 0; i < nSlowBlocks_; ++i)
+            blockSchedule.push_back(i);
+        for(int k = 0; k < fastOversampling_; ++k)
+            for(int i = nSlowBlocks_; i < blocks_.size(); ++i)
+                blockSchedule.push_back(i);
+        for(int i = nSlowBlocks_; i < blocks_.size(); ++i)
+            blockSteps[i] = fastOversampling_;
+    }
+    else
+    {
+        for(int i = 0; i < blocks_.size(); ++i)
+            blockSchedule.push_back(i);
+    }
+
     std::vector<unsigned long> accepted(blocks_.size(), 0);
+    std::vector<unsigned long> passedFirstStage(blocks_.size(), 0);
     unsigned long currentIter = 0;
 
+    specCount_ = 0;
+    specEvaluated_ = 0;
+    specUsed_ = 0;
+
     int notAcceptedCount = 0;
     while(!stop())
     {
-        int blockBegin = 0;
-        for(int i = 0; i < blocks_.size(); ++i)
+        for(int s = 0; s < blockSchedule.size(); ++s)
         {
-            int blockEnd = blocks_[i];
+            COSMO_PROFILE_REGION("mcmc_step");
 
-            std::vector<double> currentOld = current_;
+            const int i = blockSchedule[s];
+            const int blockBegin = (i == 0 ? 0 : blocks_[i - 1]);
+            const int blockEnd = blocks_[i];
 
-            std::vector<double> block(blockEnd - blockBegin);
+            if(nTries_ > 1)
+            {
+                if(multipleTryStep(i, blockBegin, blockEnd))
+                    ++accepted[i];
+
+                continue;
+            }
+
+            std::copy(current_.begin(), current_.end(), currentOld_.begin());
 
-            if(adapt_ && covarianceReady_)
+            double speculativeLike = 0;
+            if(speculativeDepth_ > 0)
             {
-                for(int j = 0; j < n_; ++j)
-                    generatedVec_[j] = 0;
+                if(specCount_ == 0)
+                    speculate(blockSchedule, s);
 
-                for(int j = blockBegin; j < blockEnd; ++j)
-                    generatedVec_[j] = generator_->generate();
+                check(specBlocks_[specNext_] == i, "");
+                for(int j = 0; j < n_; ++j)
+                    current_[j] = specParams_[specNext_ * n_ + j];
+                speculativeLike = specLikes_[specNext_];
+                if(specPriors_[specNext_] != 0)
+                    ++specUsed_;
+                ++specNext_;
+                --specCount_;
+            }
+            else if(adapt_ && covarianceReady_)
+            {
+                generator_->generate(blockEnd - blockBegin, &(generatedVec_[blockBegin]));
 
-                for(int i = 0; i < rotatedVec_.size(); ++i)
+                // only the block is generated, so only the parameters starting from the block move
+                for(int k = blockBegin; k < n_; ++k)
                 {
-                    rotatedVec_[i] = 0;
+                    double r = 0;
                     // note the upper bound! cholesky_ is used here as lower diagonal
-                    for(int j = 0; j <= i; ++j)
-                        rotatedVec_[i] += cholesky_(i, j) * generatedVec_[j];
+                    const int jEnd = std::min(k + 1, blockEnd);
+                    for(int j = blockBegin; j < jEnd; ++j)
+                        r += cholesky_(k, j) * generatedVec_[j];
+                    current_[k] += r;
                 }
-
-                for(int j = 0; j < n_; ++j)
-                    current_[j] += rotatedVec_[j];
             }
             else
             {
+                // the proposal is generated in place, reading the point from the copy
                 if(externalProposal_)
-                    externalProposal_->generate(&(current_[0]), n_, &(block[0]), i);
+                    externalProposal_->generate(&(currentOld_[0]), n_, &(current_[blockBegin]), i);
                 else
                 {
                     for(int j = blockBegin; j < blockEnd; ++j)
-                        block[j - blockBegin] = generateNewPoint(j);
+                        current_[j] = generateNewPoint(j);
                 }
-
-                for(int j = blockBegin; j < blockEnd; ++j)
-                    current_[j] = block[j - blockBegin];
             }
 
 
-            const double newPrior = calculatePrior();
+            const double newPrior = calculatePrior(&(current_[0]));
             const double oldLike = currentLike_;
+            const double oldApproxLike = currentApproxLike_;
             if(newPrior != 0)
             {
-                currentLike_ = like_->calculate(&(current_[0]), n_);
+                if(speculativeDepth_ > 0)
+                    currentLike_ = speculativeLike;
+                else if(delayedAcceptance_)
+                    currentApproxLike_ = calculateLike(false);
+                else
+                    currentLike_ = calculateLike(false);
                 /*
                 if(iteration_ > burnin_ / 3 && likelihoodApproximate_ && std::abs(currentLike_ - oldLike) > 10)
                 {
@@ -604,20 +1697,18 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
             }
 
             double p = newPrior / currentPrior_;
-            const double deltaLike = currentLike_ - oldLike;
+            // for delayed acceptance this is the first stage, using the approximate likelihood only
+            const double deltaLike = (delayedAcceptance_ ? currentApproxLike_ - oldApproxLike : currentLike_ - oldLike);
             p *= std::exp(-deltaLike / 2.0);
 
             if(!(adapt_ && covarianceReady_) && externalProposal_ && !externalProposal_->isSymmetric(i))
             {
-                std::vector<double> oldBlock(blockEnd - blockBegin);
-                for(int j = blockBegin; j < blockEnd; ++j)
-                    oldBlock[j - blockBegin] = currentOld[j];
-
-                p *= externalProposal_->calculate(&(current_[0]), n_, &(oldBlock[0]), i);
-                p /= externalProposal_->calculate(&(currentOld[0]), n_, &(block[0]), i);
+                p *= externalProposal_->calculate(&(current_[0]), n_, &(currentOld_[blockBegin]), i);
+                p /= externalProposal_->calculate(&(currentOld_[0]), n_, &(current_[blockBegin]), i);
             }
 
-            if(notAcceptedCount > 4 * n_)
+            // with delayed acceptance the chain likelihood is exact, so there is no need to force the chain to move
+            if(notAcceptedCount > 4 * n_ && !delayedAcceptance_)
             {
                 output_screen("WARNING! Haven't moved for " << notAcceptedCount << " iterations because the likelihood difference is too large!" << std::endl);
                 output_screen("\tcurrent like = " << currentLike_ << std::endl);
@@ -635,23 +1726,38 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
             if(p > 1)
                 p = 1;
             
-            const double q = uniformGen_->generate(); 
+            double q = uniformGen_->generate(); 
+
+            if(delayedAcceptance_ && q <= p)
+            {
+                ++passedFirstStage[i];
+
+                // the second stage, the prior and the proposal cancel out in the ratio, only the error of the approximation needs to be corrected
+                currentLike_ = calculateLike(true);
+                p = std::exp(-(currentLike_ - oldLike) / 2.0 + (currentApproxLike_ - oldApproxLike) / 2.0);
+                if(p > 1)
+                    p = 1;
+
+                q = uniformGen_->generate();
+            }
 
             if(q <= p)
             {
                 currentPrior_ = newPrior;
                 ++accepted[i];
                 notAcceptedCount = 0;
+
+                // the remaining speculative proposals assumed that this one would be rejected
+                specCount_ = 0;
             }
             else
             {
-                current_ = currentOld;
+                std::copy(currentOld_.begin(), currentOld_.end(), current_.begin());
                 currentLike_ = oldLike;
+                currentApproxLike_ = oldApproxLike;
                 if(deltaLike > 10)
                     ++notAcceptedCount;
             }
-
-            blockBegin = blockEnd;
         }
 
         writeChainElement();
@@ -659,9 +1765,21 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         ++currentIter;
         update();
 
+        // all of the elements after the burnin need to be at full precision
+        if(lowPrecision_ && (iteration_ >= burnin_ || (adapt_ && covarianceReady_ && iteration_ - proposalChangedIter_ >= precisionStableIterations_)))
+            switchToFullPrecision();
+
         if(iteration_ % 100 == 0)
         {
-            communicate();
+            // the proposal distribution may change
+            specCount_ = 0;
+            if(protocol_ == COLLECTIVE)
+            {
+                if(progressCollectiveRound(false) && !stop_)
+                    startCollectiveRound(false);
+            }
+            else
+                communicate();
             if(isMaster())
             {
                 logProgress();
@@ -669,33 +1787,70 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         }
 
         if(writeResumeInformationEvery && iteration_ % writeResumeInformationEvery == 0)
+        {
+            // the chain file must contain all of the elements up to the resume point
+            flushOut();
             writeResumeInfo();
+        }
 
         if(iteration_ % 100 == 0)
         {
-            closeOut();
-            openOut(true);
-
             output_screen(std::endl);
             output_screen(std::endl);
             output_screen("Total iterations: " << iteration_ << std::endl);
             for(int i = 0; i < accepted.size(); ++i)
             {
-                output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(currentIter) << std::endl);
+                output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(currentIter * blockSteps[i]) << std::endl);
+                if(delayedAcceptance_)
+                {
+                    output_screen("\tFirst stage acceptance rate = " << double(passedFirstStage[i]) / double(currentIter * blockSteps[i]) << ", second stage acceptance rate = " << (passedFirstStage[i] ? double(accepted[i]) / double(passedFirstStage[i]) : 0.0) << std::endl);
+                }
             }
         }
     }
 
-    if(isMaster())
-        stop_ = true;
+    if(protocol_ == COLLECTIVE)
+    {
+        // a chain that has reached the maximum length keeps taking part in the rounds until the other chains hear about it
+        while(!stop_)
+        {
+            if(progressCollectiveRound(true) && !stop_)
+                startCollectiveRound(true);
+        }
+    }
+    else
+    {
+        if(isMaster())
+            stop_ = true;
+
+        communicate();
+    }
+
+    // a chain stopped by another chain's termination request also writes its resume point, so that no elements are lost
+    if(CheckpointCoordinator::isInstalled() && preemptedEverywhere())
+        preempted_ = true;
+
+    if(preempted_ && writeResumeInformationEvery)
+    {
+        flushOut();
+        writeResumeInfo();
+    }
 
-    communicate();
+    // the last state is written after the resume information, which keeps it as pending, so a resumed run replaces this row
+    writePendingRow();
 
+    waitForResumeWriting();
     closeOut();
+    if(sharedResume_)
+        closeSharedResume();
 
     if(isMaster())
     {
-        if(iteration_ >= maxChainLength_)
+        if(preempted_)
+        {
+            output_screen("Stopped by a termination request after " << iteration_ << " iterations, the run can be resumed from here!" << std::endl);
+        }
+        else if(iteration_ >= maxChainLength_ || collectiveStopReason_ == 2)
         {
             output_screen("Maximum number of iterations (" << maxChainLength_ << ") reached, stopping!" << std::endl);
         }
@@ -712,10 +1867,23 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
 
     for(int i = 0; i < blocks_.size(); ++i)
     {
-        output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(iteration_) << std::endl);
+        output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(iteration_ * blockSteps[i]) << std::endl);
     }
 
-    if(!isMaster())
+    if(speculativeDepth_ > 0)
+    {
+        output_screen("Speculative evaluation: " << specUsed_ << " out of " << specEvaluated_ << " evaluated likelihoods have been used." << std::endl);
+    }
+
+    if(protocol_ == COLLECTIVE)
+    {
+#ifdef COSMO_MPI
+        MPI_Comm_free((MPI_Comm*) collectiveNodeComm_);
+        if(CosmoMPI::create().isNodeMaster())
+            MPI_Comm_free((MPI_Comm*) collectiveLeaderComm_);
+#endif
+    }
+    else if(!isMaster())
         sendHaveStopped();
     else
     {
@@ -735,9 +1903,10 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
 #endif
     }
 
-#ifdef COSMO_MPI
-    MPI_Barrier(MPI_COMM_WORLD);
-#endif
+    barrier();
+
+    if(preempted_ && threadIndex_ == 0)
+        CheckpointCoordinator::flush();
 
     return nChains_;
 }
@@ -757,6 +1926,236 @@ MetropolisHastings::specifyParameterBlocks(const std::vector<int>& blocks)
     blocks_ = blocks;
 }
 
+void
+MetropolisHastings::generateProposal(double* from, int blockBegin, int blockEnd, int blockIndex, double* to)
+{
+    for(int j = 0; j < n_; ++j)
+        to[j] = from[j];
+
+    if(adapt_ && covarianceReady_)
+    {
+        generator_->generate(blockEnd - blockBegin, &(generatedVec_[blockBegin]));
+
+        // cholesky_ is used here as lower diagonal, only the parameters starting from the block move
+        for(int j = blockBegin; j < n_; ++j)
+        {
+            const int kEnd = std::min(j + 1, blockEnd);
+            for(int k = blockBegin; k < kEnd; ++k)
+                to[j] += cholesky_(j, k) * generatedVec_[k];
+        }
+        return;
+    }
+
+    if(externalProposal_)
+    {
+        check(externalProposal_->isSymmetric(blockIndex), "multiple-try Metropolis and speculative evaluation need a symmetric proposal distribution");
+        externalProposal_->generate(from, n_, to + blockBegin, blockIndex);
+        return;
+    }
+
+    for(int j = blockBegin; j < blockEnd; ++j)
+        to[j] = from[j] + generator_->generate() * samplingWidth_[j];
+}
+
+double
+MetropolisHastings::calculateLike(bool exact)
+{
+    if(!logEvaluations_)
+        return (exact ? like_->calculateExact(&(current_[0]), n_) : like_->calculate(&(current_[0]), n_));
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const double res = (exact ? like_->calculateExact(&(current_[0]), n_) : like_->calculate(&(current_[0]), n_));
+    evalSeconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ++evalCount_;
+
+    bool approximate;
+    int retries;
+    if(like_->lastEvaluationInfo(&approximate, &retries))
+    {
+        evalApproximate_ += (approximate ? 1 : 0);
+        evalRetries_ += retries;
+    }
+
+    return res;
+}
+
+void
+MetropolisHastings::evaluateTries(double* params, int nPoints, double* priors, double* likes)
+{
+    check(nPoints > 0 && nPoints * n_ <= batchParams_.size(), "");
+
+    // only the points inside the prior are sent to the likelihood
+    int nBatch = 0;
+    for(int j = 0; j < nPoints; ++j)
+    {
+        priors[j] = calculatePrior(params + j * n_);
+        likes[j] = std::numeric_limits<double>::max();
+        if(priors[j] == 0)
+            continue;
+
+        for(int k = 0; k < n_; ++k)
+            batchParams_[nBatch * n_ + k] = params[j * n_ + k];
+        ++nBatch;
+    }
+
+    if(nBatch == 0)
+        return;
+
+    if(logEvaluations_)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        like_->calculateBatch(&(batchParams_[0]), n_, nBatch, &(batchLikes_[0]));
+        evalSeconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        evalCount_ += nBatch;
+    }
+    else
+        like_->calculateBatch(&(batchParams_[0]), n_, nBatch, &(batchLikes_[0]));
+
+    int b = 0;
+    for(int j = 0; j < nPoints; ++j)
+    {
+        if(priors[j] != 0)
+            likes[j] = batchLikes_[b++];
+    }
+    check(b == nBatch, "");
+}
+
+void
+MetropolisHastings::switchToFullPrecision()
+{
+    check(lowPrecision_, "");
+
+    const bool res = like_->setLowPrecision(false);
+    check(res, "the likelihood supported the low precision but not the full precision");
+    lowPrecision_ = false;
+
+    output_screen("Precision schedule: switching to the full precision of the likelihood after " << iteration_ << " iterations." << std::endl);
+
+    // the speculative proposals have been evaluated with the low precision
+    specCount_ = 0;
+
+    if(delayedAcceptance_)
+        currentApproxLike_ = like_->calculate(&(current_[0]), n_);
+    currentLike_ = calculateLike(delayedAcceptance_);
+}
+
+void
+MetropolisHastings::speculate(const std::vector<int>& blockSchedule, int schedulePos)
+{
+    check(speculativeDepth_ > 0, "");
+    check(!blockSchedule.empty(), "");
+
+    // the blocks that will be updated next, continuing into the next iteration if needed
+    const int nPoints = speculativeDepth_ + 1;
+    for(int d = 0; d < nPoints; ++d)
+    {
+        const int b = blockSchedule[(schedulePos + d) % blockSchedule.size()];
+        specBlocks_[d] = b;
+        generateProposal(&(current_[0]), (b == 0 ? 0 : blocks_[b - 1]), blocks_[b], b, &(specParams_[d * n_]));
+    }
+
+    evaluateTries(&(specParams_[0]), nPoints, &(specPriors_[0]), &(specLikes_[0]));
+    for(int d = 0; d < nPoints; ++d)
+    {
+        if(specPriors_[d] != 0)
+            ++specEvaluated_;
+    }
+
+    specNext_ = 0;
+    specCount_ = nPoints;
+}
+
+bool
+MetropolisHastings::multipleTryStep(int blockIndex, int blockBegin, int blockEnd)
+{
+    check(nTries_ > 1, "");
+    check(currentPrior_ > 0, "");
+
+    // the trial points around the current point
+    for(int j = 0; j < nTries_; ++j)
+        generateProposal(&(current_[0]), blockBegin, blockEnd, blockIndex, &(tryParams_[j * n_]));
+
+    evaluateTries(&(tryParams_[0]), nTries_, &(tryPriors_[0]), &(tryLikes_[0]));
+
+    // the weights are prior * likelihood, kept in log space and rescaled by the maximum to avoid overflow
+    double maxLogWeight = -std::numeric_limits<double>::max();
+    for(int j = 0; j < nTries_; ++j)
+    {
+        if(tryPriors_[j] == 0)
+            tryWeights_[j] = -std::numeric_limits<double>::max();
+        else
+            tryWeights_[j] = std::log(tryPriors_[j]) - tryLikes_[j] / 2;
+
+        if(tryWeights_[j] > maxLogWeight)
+            maxLogWeight = tryWeights_[j];
+    }
+
+    if(maxLogWeight == -std::numeric_limits<double>::max())
+        return false;
+
+    double trySum = 0;
+    for(int j = 0; j < nTries_; ++j)
+    {
+        tryWeights_[j] = (tryPriors_[j] == 0 ? 0.0 : std::exp(tryWeights_[j] - maxLogWeight));
+        trySum += tryWeights_[j];
+    }
+    check(trySum >= 1, "");
+
+    const double u = uniformGen_->generate() * trySum;
+    int selected = -1, lastPositive = -1;
+    double cumul = 0;
+    for(int j = 0; j < nTries_; ++j)
+    {
+        if(tryWeights_[j] == 0)
+            continue;
+
+        lastPositive = j;
+        cumul += tryWeights_[j];
+        if(u <= cumul)
+        {
+            selected = j;
+            break;
+        }
+    }
+
+    // can happen only because of rounding
+    if(selected == -1)
+        selected = lastPositive;
+    check(selected >= 0 && selected < nTries_, "");
+
+    const double selectedLike = tryLikes_[selected];
+    const double selectedPrior = tryPriors_[selected];
+    for(int k = 0; k < n_; ++k)
+        trySelected_[k] = tryParams_[selected * n_ + k];
+
+    // the reference points around the selected point, the last reference point is the current point itself
+    for(int j = 0; j < nTries_ - 1; ++j)
+        generateProposal(&(trySelected_[0]), blockBegin, blockEnd, blockIndex, &(tryParams_[j * n_]));
+
+    evaluateTries(&(tryParams_[0]), nTries_ - 1, &(tryPriors_[0]), &(tryLikes_[0]));
+    tryPriors_[nTries_ - 1] = currentPrior_;
+    tryLikes_[nTries_ - 1] = currentLike_;
+
+    double refSum = 0;
+    for(int j = 0; j < nTries_; ++j)
+    {
+        if(tryPriors_[j] != 0)
+            refSum += std::exp(std::log(tryPriors_[j]) - tryLikes_[j] / 2 - maxLogWeight);
+    }
+
+    // the reference sum can only underflow if the current point is much less likely than the trial points
+    const double p = (refSum == 0 ? 1.0 : trySum / refSum);
+    const double q = uniformGen_->generate();
+    if(q > p)
+        return false;
+
+    current_ = trySelected_;
+    currentLike_ = selectedLike;
+    currentPrior_ = selectedPrior;
+
+    return true;
+}
+
 bool
 MetropolisHastings::synchronizeCommInfo()
 {
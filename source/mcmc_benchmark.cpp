@@ -0,0 +1,83 @@
+#include <string>
+#include <sstream>
+#include <cstdlib>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <likelihood_function.hpp>
+#include <mcmc.hpp>
+#include <timer.hpp>
+
+namespace
+{
+
+// a trivial gaussian likelihood, so that the timing is dominated by the sampler itself
+class BenchmarkGauss : public Math::LikelihoodFunction
+{
+public:
+    BenchmarkGauss(int n) : n_(n) {}
+
+    virtual double calculate(double* params, int nPar)
+    {
+        check(nPar == n_, "");
+        double res = 0;
+        for(int i = 0; i < n_; ++i)
+            res += params[i] * params[i];
+        return res;
+    }
+
+private:
+    const int n_;
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    try {
+        StandardException exc;
+        if(argc < 3)
+        {
+            std::string exceptionStr = "The number of parameters and the number of iterations must be specified. The chain file root can optionally be specified as a third argument.";
+            exc.set(exceptionStr);
+            throw exc;
+        }
+
+        const int n = std::atoi(argv[1]);
+        const unsigned long nIter = std::strtoul(argv[2], NULL, 10);
+        const std::string root = (argc > 3 ? argv[3] : "mcmc_benchmark");
+        if(n <= 0 || nIter == 0)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid number of parameters " << argv[1] << " or iterations " << argv[2] << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        BenchmarkGauss like(n);
+        Math::MetropolisHastings mh(n, like, root, 1);
+        for(int i = 0; i < n; ++i)
+        {
+            std::stringstream name;
+            name << "x_" << i;
+            mh.setParam(i, name.str(), -10, 10, 0, 1, 0.5, 1e-10);
+        }
+
+        // a tiny accuracy so that the run does not stop before the requested number of iterations, and no resume information since it would otherwise dominate the timing
+        Timer timer("MCMC BENCHMARK");
+        timer.start();
+        mh.run(nIter, 0, 0, Math::MetropolisHastings::ACCURACY, 0.01, false);
+        const unsigned long t = timer.end();
+
+        const double steps = double(nIter) * n;
+        output_screen("Iterations: " << nIter << ", parameters: " << n << std::endl);
+        output_screen("Iterations per second: " << double(nIter) / (t * 1e-6) << std::endl);
+        output_screen("Block steps per second: " << steps / (t * 1e-6) << std::endl);
+    } catch (std::exception& e)
+    {
+        output_screen("EXCEPTION CAUGHT!!! " << std::endl << e.what() << std::endl);
+        output_screen("Terminating!" << std::endl);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <sstream>
+#include <iomanip>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <memory_tracker.hpp>
+
+MemoryTracker::MemoryTracker() : totalCurrent_(0), totalPeak_(0)
+{
+    for(int i = 0; i < SUBSYSTEM_MAX; ++i)
+    {
+        current_[i] = 0;
+        peak_[i] = 0;
+    }
+}
+
+const char*
+MemoryTracker::subsystemName(Subsystem s)
+{
+    check(s >= 0 && s < SUBSYSTEM_MAX, "invalid subsystem " << s);
+    static const char* names[SUBSYSTEM_MAX] = {"c_matrix", "whole_matrix", "legendre_container", "kd_tree", "emulator_data"};
+    return names[s];
+}
+
+void
+MemoryTracker::updateMax(std::atomic<long>& m, long value)
+{
+    long old = m.load();
+    while(value > old && !m.compare_exchange_weak(old, value))
+    {
+    }
+}
+
+void
+MemoryTracker::add(Subsystem s, long bytes)
+{
+    check(s >= 0 && s < SUBSYSTEM_MAX, "invalid subsystem " << s);
+    const long c = current_[s].fetch_add(bytes) + bytes;
+    check(c >= 0, "more memory released than allocated for " << subsystemName(s));
+    updateMax(peak_[s], c);
+
+    const long t = totalCurrent_.fetch_add(bytes) + bytes;
+    updateMax(totalPeak_, t);
+}
+
+long
+MemoryTracker::current(Subsystem s) const
+{
+    check(s >= 0 && s < SUBSYSTEM_MAX, "invalid subsystem " << s);
+    return current_[s].load();
+}
+
+long
+MemoryTracker::peak(Subsystem s) const
+{
+    check(s >= 0 && s < SUBSYSTEM_MAX, "invalid subsystem " << s);
+    return peak_[s].load();
+}
+
+long
+MemoryTracker::processPeak()
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    // bytes on mac, kilobytes on linux
+    return long(usage.ru_maxrss);
+#else
+    return long(usage.ru_maxrss) * 1024;
+#endif
+}
+
+void
+MemoryTracker::resetPeaks()
+{
+    for(int i = 0; i < SUBSYSTEM_MAX; ++i)
+        peak_[i] = current_[i].load();
+    totalPeak_ = totalCurrent_.load();
+}
+
+std::string
+MemoryTracker::report(bool acrossProcesses)
+{
+    // the current and the peak memory of each subsystem, then the totals and the process peak
+    const int n = 2 * SUBSYSTEM_MAX + 3;
+    std::vector<double> mem(n);
+    for(int i = 0; i < SUBSYSTEM_MAX; ++i)
+    {
+        mem[2 * i] = double(current_[i].load());
+        mem[2 * i + 1] = double(peak_[i].load());
+    }
+    mem[2 * SUBSYSTEM_MAX] = double(totalCurrent_.load());
+    mem[2 * SUBSYSTEM_MAX + 1] = double(totalPeak_.load());
+    mem[2 * SUBSYSTEM_MAX + 2] = double(processPeak());
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = (acrossProcesses ? mpi.numProcesses() : 1);
+
+    std::vector<double> sumMem(mem), minMem(mem), maxMem(mem);
+    if(nProcesses > 1)
+    {
+        mpi.allreduce(&(mem[0]), &(sumMem[0]), n, CosmoMPI::SUM);
+        mpi.allreduce(&(mem[0]), &(minMem[0]), n, CosmoMPI::MIN);
+        mpi.allreduce(&(mem[0]), &(maxMem[0]), n, CosmoMPI::MAX);
+    }
+
+    if(acrossProcesses && !mpi.isMaster())
+        return std::string();
+
+    if(maxMem[2 * SUBSYSTEM_MAX + 1] == 0)
+        return std::string();
+
+    const double mb = 1024.0 * 1024.0;
+    std::stringstream str;
+    str << "Memory report";
+    if(nProcesses > 1)
+        str << " (" << nProcesses << " processes, MB, min / mean / max over the processes)";
+    else
+        str << " (MB)";
+    str << ":" << std::endl;
+
+    str << std::left << std::setw(24) << "subsystem" << std::right;
+    if(nProcesses > 1)
+        str << std::setw(12) << "current" << std::setw(12) << "peak min" << std::setw(12) << "peak mean" << std::setw(12) << "peak max" << std::endl;
+    else
+        str << std::setw(12) << "current" << std::setw(12) << "peak" << std::endl;
+
+    str << std::fixed << std::setprecision(1);
+    for(int i = 0; i <= SUBSYSTEM_MAX + 1; ++i)
+    {
+        const int j = (i < SUBSYSTEM_MAX ? 2 * i : (i == SUBSYSTEM_MAX ? 2 * SUBSYSTEM_MAX : 2 * SUBSYSTEM_MAX + 2));
+        if(i < SUBSYSTEM_MAX && maxMem[j + 1] == 0)
+            continue;
+
+        std::string name;
+        if(i < SUBSYSTEM_MAX)
+            name = subsystemName(Subsystem(i));
+        else
+            name = (i == SUBSYSTEM_MAX ? "total" : "process resident");
+
+        str << std::left << std::setw(24) << name << std::right;
+
+        // the process resident memory has only a peak
+        const int peakIndex = (i == SUBSYSTEM_MAX + 1 ? j : j + 1);
+        if(i == SUBSYSTEM_MAX + 1)
+            str << std::setw(12) << "-";
+        else
+            str << std::setw(12) << sumMem[j] / nProcesses / mb;
+
+        if(nProcesses > 1)
+            str << std::setw(12) << minMem[peakIndex] / mb << std::setw(12) << sumMem[peakIndex] / nProcesses / mb << std::setw(12) << maxMem[peakIndex] / mb;
+        else
+            str << std::setw(12) << sumMem[peakIndex] / mb;
+        str << std::endl;
+    }
+
+    return str.str();
+}
+
+void
+MemoryTracker::printReport(bool acrossProcesses)
+{
+    const std::string r = report(acrossProcesses);
+    if(!r.empty())
+        output_screen(r);
+}
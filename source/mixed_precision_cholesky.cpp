@@ -0,0 +1,183 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <matrix_impl.hpp>
+#include <mixed_precision_cholesky.hpp>
+
+extern "C"
+{
+    // single precision Cholesky factorization and solution in the packed format
+    void spptrf_(char *uplo, int *n, float *ap, int *info);
+    void spptrs_(char *uplo, int *n, int *nrhs, float *ap, float *b, int *ldb, int *info);
+
+    // double precision solution from the Cholesky factorization
+    void dpptrs_(char *uplo, int *n, int *nrhs, double *ap, double *b, int *ldb, int *info);
+
+    // y = alpha A x + beta y for a packed symmetric matrix
+    void dspmv_(char *uplo, int *n, double *alpha, double *ap, double *x, int *incx, double *beta, double *y, int *incy);
+}
+
+namespace
+{
+
+double
+maxAbs(const std::vector<double>& x, int begin, int n)
+{
+    double m = 0;
+    for(int i = begin; i < begin + n; ++i)
+        m = std::max(m, std::abs(x[i]));
+    return m;
+}
+
+} // namespace
+
+namespace Math
+{
+
+MixedPrecisionCholesky::MixedPrecisionCholesky(const SymmetricMatrix<double>& mat) : mat_(&mat), n_(mat.rows()), factorized_(false), iterations_(0), norm_(0)
+{
+    check(n_ > 0, "cannot factorize an empty matrix");
+}
+
+int
+MixedPrecisionCholesky::factorize()
+{
+    check(!factorized_, "the matrix has already been factorized");
+    factorized_ = true;
+
+    // the packed storage of SymmetricMatrix is the upper triangle in column major order
+    const unsigned long size = (unsigned long)(n_) * (n_ + 1) / 2;
+    const double* a = &((*mat_)(0, 0));
+    factor_.resize(size);
+
+    // the infinity norm is needed for the convergence criterion of the refinement
+    std::vector<double> rowSums(n_, 0);
+    for(int i = 0; i < n_; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+        {
+            const double x = a[(unsigned long)(i) * (i + 1) / 2 + j];
+            factor_[(unsigned long)(i) * (i + 1) / 2 + j] = float(x);
+            rowSums[i] += std::abs(x);
+            if(j != i)
+                rowSums[j] += std::abs(x);
+        }
+    }
+    norm_ = *std::max_element(rowSums.begin(), rowSums.end());
+
+    char uplo = 'U';
+    int n = n_;
+    int info;
+    spptrf_(&uplo, &n, &(factor_[0]), &info);
+
+    // may still be positive definite in double precision
+    if(info != 0)
+        return switchToDouble();
+
+    return 0;
+}
+
+int
+MixedPrecisionCholesky::switchToDouble()
+{
+    std::vector<float>().swap(factor_);
+    doubleFactor_.copy(*mat_);
+    return doubleFactor_.choleskyFactorize();
+}
+
+double
+MixedPrecisionCholesky::logDet() const
+{
+    check(factorized_, "the matrix needs to be factorized first");
+
+    if(!isSinglePrecision())
+    {
+        int sign;
+        return doubleFactor_.logDetFromCholeskyFactorization(&sign);
+    }
+
+    double logDet = 0;
+    for(int i = 0; i < n_; ++i)
+        logDet += std::log(double(factor_[(unsigned long)(i) * (i + 1) / 2 + i]));
+
+    return 2 * logDet;
+}
+
+int
+MixedPrecisionCholesky::solve(std::vector<double>& b, int nRhs, int maxIterations)
+{
+    check(factorized_, "the matrix needs to be factorized first");
+    check(nRhs > 0, "invalid number of right hand sides " << nRhs);
+    check(b.size() == n_ * nRhs, "invalid size " << b.size() << " of the right hand sides, should be " << n_ * nRhs);
+    check(maxIterations > 0, "invalid maximum number of iterations " << maxIterations);
+
+    char uplo = 'U';
+    int n = n_;
+    int ldb = n_;
+    int info;
+
+    if(isSinglePrecision())
+    {
+        // the convergence criterion of dsposv
+        const double threshold = norm_ * std::numeric_limits<double>::epsilon() * std::sqrt(double(n_));
+
+        double* a = const_cast<double*>(&((*mat_)(0, 0)));
+        std::vector<double> x(b.size(), 0);
+        std::vector<double> r = b;
+        std::vector<float> d(b.size());
+        double minusOne = -1, one = 1;
+        int inc = 1, rhs = 1;
+
+        iterations_ = 0;
+        bool converged = true;
+        for(int k = 0; k < nRhs && converged; ++k)
+        {
+            double* xk = &(x[k * n_]);
+            double* rk = &(r[k * n_]);
+            float* dk = &(d[k * n_]);
+
+            converged = false;
+            for(int it = 1; it <= maxIterations; ++it)
+            {
+                for(int i = 0; i < n_; ++i)
+                    dk[i] = float(rk[i]);
+                spptrs_(&uplo, &n, &rhs, &(factor_[0]), dk, &ldb, &info);
+                check(info == 0, "spptrs failed, info = " << info);
+                for(int i = 0; i < n_; ++i)
+                    xk[i] += dk[i];
+
+                // r = b - A x
+                std::copy(b.begin() + k * n_, b.begin() + (k + 1) * n_, rk);
+                dspmv_(&uplo, &n, &minusOne, a, xk, &inc, &one, rk, &inc);
+
+                if(maxAbs(r, k * n_, n_) <= maxAbs(x, k * n_, n_) * threshold)
+                {
+                    iterations_ = std::max(iterations_, it);
+                    converged = true;
+                    break;
+                }
+            }
+        }
+
+        if(converged)
+        {
+            b.swap(x);
+            return 0;
+        }
+
+        // too ill conditioned for single precision
+        output_screen("The iterative refinement did not converge, switching to double precision." << std::endl);
+        info = switchToDouble();
+        if(info != 0)
+            return info;
+    }
+
+    iterations_ = 0;
+    dpptrs_(&uplo, &n, &nRhs, &(doubleFactor_(0, 0)), &(b[0]), &ldb, &info);
+    return info;
+}
+
+} // namespace Math
+
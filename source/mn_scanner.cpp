@@ -1,22 +1,31 @@
 #include <cosmo_mpi.hpp>
 
+#include <cstdio>
 #include <fstream>
 #include <sstream>
 #include <cmath>
 #include <iomanip>
+#include <algorithm>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
-#include <math_constants.hpp>
 #include <mn_scanner.hpp>
+#include <threaded_likelihood.hpp>
+#include <chain_file.hpp>
+#include <mapped_file.hpp>
 
 #include <multinest.h>
 
 
-MnScanner::MnScanner(int nPar, Math::LikelihoodFunction& like, int nLive, std::string fileRoot, bool accurateEvidence) : n_(nPar), like_(like), nLive_(nLive), paramsStarting_(nPar, 0), paramNames_(nPar), paramsBest_(nPar, 0), paramsMean_(nPar, 0), paramsStd_(nPar, 0), paramsCurrent_(nPar, 0), paramPriors_(nPar), paramsFixed_(nPar, 0), fileRoot_(fileRoot), accurateEvidence_(accurateEvidence)
+MnScanner::MnScanner(int nPar, Math::LikelihoodFunction& like, int nLive, std::string fileRoot, bool accurateEvidence) : n_(nPar), like_(like), nLive_(nLive), paramsStarting_(nPar, 0), paramNames_(nPar), paramsBest_(nPar, 0), paramsMean_(nPar, 0), paramsStd_(nPar, 0), paramsCurrent_(nPar, 0), paramPriors_(nPar), paramsFixed_(nPar, 0), fileRoot_(fileRoot), accurateEvidence_(accurateEvidence), likeThreads_(0), binaryOutput_(false), asyncDump_(true), dumpInterval_(30), dumpStarted_(false), hasPendingDump_(false), dumpThread_(NULL), dumpDone_(false)
 {
 }
 
+MnScanner::~MnScanner()
+{
+    waitForDump();
+}
+
 void
 MnScanner::setParam(int i, const std::string& name, double min, double max)
 {
@@ -30,11 +39,7 @@ MnScanner::setParam(int i, const std::string& name, double min, double max)
     }
 
     paramNames_[i] = name;
-    paramPriors_[i].clear();
-
-    const double epsilon = 1e-7; // for numerics
-    paramPriors_[i][0 - epsilon] = min;
-    paramPriors_[i][1 + epsilon] = max;
+    paramPriors_[i].setUniform(min, max);
 }
 
 void
@@ -59,81 +64,33 @@ MnScanner::setParamGauss(int i, const std::string& name, double mean, double sig
     }
 
     paramNames_[i] = name;
+    paramPriors_[i].setGauss(mean, sigma, 10);
+}
 
-    const double xMin = mean - 10 * sigma, xMax = mean + 10 * sigma;
-    const int N = 100000;
-
-    const double epsilon = 1e-7; // for numerics
-    paramPriors_[i][0 - epsilon] = xMin;
-    double xPrev = xMin;
-    double yPrev = 0;
-    double res = 0;
-    const double delta = (xMax - xMin) / N;
+void
+MnScanner::setParamLogUniform(int i, const std::string& name, double min, double max)
+{
+    check(i >= 0 && i < n_, "invalid index " << i);
+    check(max >= min, "");
 
-    const double norm = 1.0 / (std::sqrt(2 * Math::pi) * sigma);
-    for(int j = 1; j <= N; ++j)
+    if(min == max)
     {
-        const double x = xMin + j * delta;
-        const double y = norm * std::exp(-(x - mean) * (x - mean) / (2 * sigma * sigma));
-
-        res += (x - xPrev) * (y + yPrev) / 2.0;
-        
-        check(res <= 1.0, "");
-
-        paramPriors_[i][res] = x;
-        xPrev = x;
-        yPrev = y;
+        setParamFixed(i, name, min);
+        return;
     }
 
-    paramPriors_[i][1 + epsilon] = xMax;
+    paramNames_[i] = name;
+    paramPriors_[i].setLogUniform(min, max);
 }
 
 void
-MnScanner::setParamGeneral(int i, const std::string& name, double min, double max, const Math::RealFunction& distrib)
+MnScanner::setParamGeneral(int i, const std::string& name, double min, double max, const Math::RealFunction& distrib, bool cubic)
 {
     check(i >= 0 && i < n_, "invalid index " << i);
     check(max > min, "");
 
     paramNames_[i] = name;
-    paramPriors_[i].clear();
-    const int N = 100000;
-
-    const double epsilon = 1e-7; // for numerics
-    paramPriors_[i][0 - epsilon] = min;
-    double xPrev = min;
-    double yPrev = 0;
-    double res = 0;
-    const double delta = (max - min) / N;
-
-    for(int j = 1; j <= N; ++j)
-    {
-        const double x = min + j * delta;
-        const double y = distrib.evaluate(x);
-
-        res += (x - xPrev) * (y + yPrev) / 2.0;
-        
-        xPrev = x;
-        yPrev = y;
-    }
-
-    const double norm = 1.0 / res;
-    xPrev = min;
-    yPrev = 0;
-    res = 0;
-    for(int j = 1; j <= N; ++j)
-    {
-        const double x = min + j * delta;
-        const double y = norm * distrib.evaluate(x);
-
-        res += (x - xPrev) * (y + yPrev) / 2.0;
-        check(res <= 1.0 + 1e-5, "");
-
-        paramPriors_[i][res] = x;
-        xPrev = x;
-        yPrev = y;
-    }
-
-    paramPriors_[i][1 + epsilon] = max;
+    paramPriors_[i].setGeneral(min, max, distrib, cubic);
 }
 
 namespace
@@ -164,13 +121,21 @@ MnScanner::logLike(double *cube, int &ndim, int &npars, double &lnew)
         }
         else
         {
-            x = paramPriors_[i].evaluate(cube[j]);
+            x = paramPriors_[i].transform(cube[j]);
             cube[j] = x;
             ++j;
         }
         paramsCurrent_[i] = x;
     }
 
+    // the threads are set for this evaluation only, so MultiNest itself runs with the setting of the caller
+    if(likeThreads_ > 0)
+    {
+        Math::ThreadedLikelihood threaded(like_, likeThreads_);
+        lnew = - threaded.calculate(&(paramsCurrent_[0]), n_) / 2.0;
+        return;
+    }
+
     lnew = - like_.calculate(&(paramsCurrent_[0]), n_) / 2.0;
 }
 
@@ -188,88 +153,271 @@ void myDumper(int &nSamples, int &nlive, int &nPar, double **physLive, double **
 void
 MnScanner::dumper(int &nSamples, int &nlive, int &nPar, double **physLive, double **posterior, double **paramConstr, double &maxLogLike, double &logZ, double &INSLogZ, double &logZerr)
 {
-    StandardException exc;
     check(nPar == n_ - nFixed_, "");
 
-	// convert the 2D Fortran arrays to C++ arrays
-	
-	
-	// the posterior distribution
-	// postdist will have nPar parameters in the first nPar columns & loglike value & the posterior probability in the last two columns
-	
-	int i, j;
+	// parameter constraints
+    int j = 0;
+    for(int i = 0; i < n_; ++i)
+    {
+        if(paramPriors_[i].empty())
+        {
+            paramsMean_[i] = paramsFixed_[i];
+            paramsStd_[i] = 0.0;
+            paramsBest_[i] = paramsFixed_[i];
+        }
+        else
+        {
+            paramsMean_[i] = paramConstr[0][j];
+            paramsStd_[i] = paramConstr[0][nPar + j];
+            paramsBest_[i] = paramConstr[0][2 * nPar + j];
+            ++j;
+        }
+    }
 
+    // copying is much cheaper than writing, the sampler only waits for this
+    // posterior has nPar parameters in the first nPar columns & loglike value & the posterior probability in the last two columns
+    // physLive has nPar parameters in the first nPar columns & loglike value in the last column
+    dumpPending_.nSamples = nSamples;
+    dumpPending_.nLive = nlive;
+    dumpPending_.nPar = nPar;
+    dumpPending_.posterior.assign(posterior[0], posterior[0] + nSamples * (nPar + 2));
+    dumpPending_.physLive.assign(physLive[0], physLive[0] + nlive * (nPar + 1));
+    dumpPending_.paramConstr.assign(paramConstr[0], paramConstr[0] + 4 * nPar);
+    dumpPending_.logZ = logZ;
+    dumpPending_.INSLogZ = INSLogZ;
+    dumpPending_.logZerr = logZerr;
+    hasPendingDump_ = true;
+
+    if(binaryOutput_)
+    {
+        std::stringstream evidenceLine;
+        evidenceLine << std::setprecision(15) << nSamples << '\t' << logZ << '\t' << INSLogZ << '\t' << logZerr << std::endl;
+        dumpPending_.evidence += evidenceLine.str();
+    }
 
-    std::stringstream postFileName;
-    postFileName << fileRoot_ << "posterior.txt";
-    std::ofstream outPost(postFileName.str().c_str());
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if(dumpStarted_ && std::chrono::duration<double>(now - lastDump_).count() < dumpInterval_)
+        return;
 
-    if(!outPost)
+    if(!asyncDump_)
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot write into posterior distribution file " << postFileName.str() << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        dumpStarted_ = true;
+        lastDump_ = now;
+        hasPendingDump_ = false;
+        writeDump(dumpPending_);
+        dumpPending_.evidence.clear();
+        return;
     }
-	double postdist[nSamples][nPar + 2];
-	for( i = 0; i < nPar + 2; i++ )
-		for( j = 0; j < nSamples; j++ )
-			postdist[j][i] = posterior[0][i * nSamples + j];
 
-    for(i = 0; i < nSamples; ++i)
+    if(dumpThread_)
     {
-        for(j = 0; j < nPar + 1; ++j)
-            outPost << postdist[i][j] << ' ';
-        outPost << postdist[i][nPar + 1] << std::endl;
+        // the previous one is still being written, this one stays pending in case it is the last one
+        if(!dumpDone_.load(std::memory_order_acquire))
+            return;
+
+        dumpThread_->join();
+        delete dumpThread_;
+        dumpThread_ = NULL;
+
+        if(!dumpError_.empty())
+        {
+            StandardException exc;
+            exc.set(dumpError_);
+            dumpError_.clear();
+            throw exc;
+        }
     }
-    outPost.close();
-	
-	// last set of live points
-	// pLivePts will have nPar parameters in the first nPar columns & loglike value in the last column
-	
-	double pLivePts[nlive][nPar + 1];
-	for( i = 0; i < nPar + 1; i++ )
-		for( j = 0; j < nlive; j++ )
-			pLivePts[j][i] = physLive[0][i * nlive + j];
 
+    dumpStarted_ = true;
+    lastDump_ = now;
+    startDumpWriting();
+}
+
+void
+MnScanner::setAsyncDump(bool async)
+{
+    if(!async)
+        waitForDump();
+
+    asyncDump_ = async;
+}
+
+void
+MnScanner::startDumpWriting()
+{
+    check(!dumpThread_, "");
+
+    std::swap(dumpWriting_, dumpPending_);
+    dumpPending_.evidence.clear();
+    hasPendingDump_ = false;
+    dumpDone_.store(false);
+    dumpThread_ = new std::thread(&MnScanner::writeDumpInBackground, this);
+}
 
-    std::stringstream constrFileName;
-    constrFileName << fileRoot_ << "parameter_constraints.txt";
-    std::ofstream outConstr(constrFileName.str().c_str());
-    
-    if(!outConstr)
+void
+MnScanner::writeDumpInBackground()
+{
+    // the exceptions cannot leave the thread, they are thrown by the next dumper or at the end of run
+    try
     {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot write into constraints file " << constrFileName.str() << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
+        writeDump(dumpWriting_);
+    }
+    catch(std::exception& e)
+    {
+        dumpError_ = e.what();
     }
 
+    dumpDone_.store(true, std::memory_order_release);
+}
 
-    outConstr << "Constraints from " << nSamples << " samples:" << std::endl;
-    outConstr << "log(Z) = " << logZ << "+-" << logZerr << std::endl;
-    outConstr << "INS log(Z) = " << INSLogZ << "+-" << logZerr << std::endl;
-	// parameter constraints
-    j = 0;
-    for(i = 0; i < n_; ++i)
+void
+MnScanner::waitForDump()
+{
+    if(dumpThread_)
     {
-        if(paramPriors_[i].empty())
+        dumpThread_->join();
+        delete dumpThread_;
+        dumpThread_ = NULL;
+    }
+
+    if(hasPendingDump_)
+    {
+        hasPendingDump_ = false;
+        try
         {
-            paramsMean_[i] = paramsFixed_[i];
-            paramsStd_[i] = 0.0;
-            paramsBest_[i] = paramsFixed_[i];
+            writeDump(dumpPending_);
         }
-        else
+        catch(std::exception& e)
         {
-            paramsMean_[i] = paramConstr[0][j];
-            paramsStd_[i] = paramConstr[0][nPar + j];
-            paramsBest_[i] = paramConstr[0][2 * nPar + j];
+            dumpError_ = e.what();
+        }
+        dumpPending_.evidence.clear();
+    }
+}
+
+void
+MnScanner::writeDump(const DumpBuffer& buffer) const
+{
+    if(binaryOutput_)
+        dumpBinary(buffer);
+    else
+        dumpText(buffer);
+
+    dumpConstraints(buffer);
+}
+
+void
+MnScanner::dumpText(const DumpBuffer& buffer) const
+{
+    const int nSamples = buffer.nSamples;
+    const int nPar = buffer.nPar;
+
+    const std::string postFileName = fileRoot_ + "posterior.txt";
+    Math::ReplacingOutputFile postFile(postFileName.c_str());
+    std::ofstream& outPost = postFile.stream();
+
+    // the Fortran array is stored column by column
+    for(int i = 0; i < nSamples; ++i)
+    {
+        for(int j = 0; j < nPar + 1; ++j)
+            outPost << buffer.posterior[j * nSamples + i] << ' ';
+        outPost << buffer.posterior[(nPar + 1) * nSamples + i] << std::endl;
+    }
+
+    postFile.commit();
+}
+
+void
+MnScanner::dumpConstraints(const DumpBuffer& buffer) const
+{
+    const int nPar = buffer.nPar;
+
+    const std::string constrFileName = fileRoot_ + "parameter_constraints.txt";
+    Math::ReplacingOutputFile constrFile(constrFileName.c_str());
+    std::ofstream& outConstr = constrFile.stream();
+
+    outConstr << "Constraints from " << buffer.nSamples << " samples:" << std::endl;
+    outConstr << "log(Z) = " << buffer.logZ << "+-" << buffer.logZerr << std::endl;
+    outConstr << "INS log(Z) = " << buffer.INSLogZ << "+-" << buffer.logZerr << std::endl;
+
+    int j = 0;
+    for(int i = 0; i < n_; ++i)
+    {
+        double mean = paramsFixed_[i], std = 0, best = paramsFixed_[i];
+        if(!paramPriors_[i].empty())
+        {
+            mean = buffer.paramConstr[j];
+            std = buffer.paramConstr[nPar + j];
+            best = buffer.paramConstr[2 * nPar + j];
             ++j;
         }
-        
-        outConstr << paramNames_[i] << ":   " << paramsBest_[i] << "    " << paramsMean_[i] << "+-" << paramsStd_[i] << std::endl;
+
+        outConstr << paramNames_[i] << ":   " << best << "    " << mean << "+-" << std << std::endl;
     }
-    outConstr.close();
+
+    constrFile.commit();
+}
+
+void
+MnScanner::dumpBinary(const DumpBuffer& buffer) const
+{
+    StandardException exc;
+
+    const int nSamples = buffer.nSamples;
+    const int nLive = buffer.nLive;
+    const int nPar = buffer.nPar;
+    const double* posterior = (buffer.posterior.empty() ? NULL : &(buffer.posterior[0]));
+    const double* physLive = (buffer.physLive.empty() ? NULL : &(buffer.physLive[0]));
+
+    // the Fortran arrays are stored column by column, the records contain the fixed parameters too
+    std::vector<double> records;
+    const int recordSize = 2 + n_;
+
+    records.resize(nSamples * recordSize);
+    for(int k = 0; k < nSamples; ++k)
+    {
+        double* record = &(records[k * recordSize]);
+        record[0] = posterior[(nPar + 1) * nSamples + k];
+        record[1] = -2 * posterior[nPar * nSamples + k];
+        int j = 0;
+        for(int i = 0; i < n_; ++i)
+            record[2 + i] = (paramPriors_[i].empty() ? paramsFixed_[i] : posterior[(j++) * nSamples + k]);
+    }
+
+    std::stringstream postFileName;
+    postFileName << fileRoot_ << "posterior.bin";
+    BinaryChain::writeFile(postFileName.str().c_str(), paramNames_, (nSamples ? &(records[0]) : NULL), nSamples);
+
+    records.resize(nLive * recordSize);
+    for(int k = 0; k < nLive; ++k)
+    {
+        double* record = &(records[k * recordSize]);
+        record[0] = 1;
+        record[1] = -2 * physLive[nPar * nLive + k];
+        int j = 0;
+        for(int i = 0; i < n_; ++i)
+            record[2 + i] = (paramPriors_[i].empty() ? paramsFixed_[i] : physLive[(j++) * nLive + k]);
+    }
+
+    std::stringstream liveFileName;
+    liveFileName << fileRoot_ << "live.bin";
+    BinaryChain::writeFile(liveFileName.str().c_str(), paramNames_, (nLive ? &(records[0]) : NULL), nLive);
+
+    if(buffer.evidence.empty())
+        return;
+
+    std::stringstream evidenceFileName;
+    evidenceFileName << fileRoot_ << "evidence.txt";
+    std::ofstream outEvidence(evidenceFileName.str().c_str(), std::ios::out | std::ios::app);
+    if(!outEvidence)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into evidence file " << evidenceFileName.str() << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    outEvidence << buffer.evidence;
+    outEvidence.close();
 }
 
 void
@@ -336,6 +484,21 @@ MnScanner::run(bool res)
     }
     outPar.close();
 
+    if(likeThreads_ > 0)
+        output_screen("Running the likelihood on " << likeThreads_ << " threads in each process." << std::endl);
+
+    // the evidence updates are appended, so a new run starts a new file
+    if(binaryOutput_ && !res && CosmoMPI::create().isMaster())
+    {
+        std::stringstream evidenceFileName;
+        evidenceFileName << fileRoot_ << "evidence.txt";
+        std::remove(evidenceFileName.str().c_str());
+    }
+
+    waitForDump();
+    dumpError_.clear();
+    dumpStarted_ = false;
+
 	// calling MultiNest
 
     try
@@ -345,11 +508,22 @@ MnScanner::run(bool res)
     } 
     catch (std::exception& e)
     {
+        waitForDump();
         dumpInfo(e.what());
         throw e;
     }
 
+    // the last output may still be pending or being written
+    waitForDump();
+
     CosmoMPI::create().barrier();
+
+    if(!dumpError_.empty())
+    {
+        exc.set(dumpError_);
+        dumpError_.clear();
+        throw exc;
+    }
 }
 
 void
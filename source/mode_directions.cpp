@@ -1,7 +1,15 @@
+#include <cmath>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <functional>
+#include <utility>
+
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <angular_coordinates.hpp>
 #include <three_rotation.hpp>
+#include <alm_rotation.hpp>
 #include <progress_meter.hpp>
 #include <math_constants.hpp>
 #include <numerics.hpp>
@@ -16,9 +24,56 @@
 #include <alm_powspec_tools.h>
 #include <chealpix.h>
 
-#ifdef COSMO_OMP
-#include <omp.h>
-#endif
+namespace
+{
+
+// the dispersion is the same in opposite directions, the one in the southern hemisphere is used
+void toSouthernHemisphere(double& theta, double& phi)
+{
+    if(theta < Math::pi / 2)
+    {
+        theta = Math::pi - theta;
+        phi += Math::pi;
+        if(phi > 2 * Math::pi)
+            phi -= 2 * Math::pi;
+    }
+}
+
+// brings theta to [0, pi] and phi to [0, 2pi) after a step that might go over a pole
+void normalizeDirection(double& theta, double& phi)
+{
+    if(theta < 0)
+    {
+        theta = -theta;
+        phi += Math::pi;
+    }
+    if(theta > Math::pi)
+    {
+        theta = 2 * Math::pi - theta;
+        phi += Math::pi;
+    }
+    phi = std::fmod(phi, 2 * Math::pi);
+    if(phi < 0)
+        phi += 2 * Math::pi;
+}
+
+// the n pixels with the largest dispersion for one l, the dispersions are stored pixel by pixel with the given stride
+void selectBest(const std::vector<long>& pixels, const std::vector<double>& disp, int stride, int j, int n, std::vector<long>* best, double* bestDisp)
+{
+    std::vector<std::pair<double, long> > values(pixels.size());
+    for(long i = 0; i < pixels.size(); ++i)
+        values[i] = std::make_pair(disp[i * stride + j], pixels[i]);
+
+    n = std::min(n, int(values.size()));
+    std::partial_sort(values.begin(), values.begin() + n, values.end(), std::greater<std::pair<double, long> >());
+
+    best->resize(n);
+    for(int i = 0; i < n; ++i)
+        (*best)[i] = values[i].second;
+    *bestDisp = values[0].first;
+}
+
+} // namespace
 
 ModeDirections::ModeDirections(const Alm<xcomplex<double> >& alm) : alm_(alm.Lmax(), alm.Mmax())
 {
@@ -36,27 +91,9 @@ ModeDirections::calculateAngularMomentumDispersion(int l, double theta, double p
 {
     check(l >= 0 && l <= alm_.Lmax(), "invalid l");
     
-    Alm<xcomplex<double> > almCopy(alm_.Lmax(), alm_.Mmax());
-    check(alm_.Lmax() == alm_.Mmax(), "");
-    for(int l1 = 0; l1 <= alm_.Lmax(); ++l1)
-    {
-        for(int m1 = 0; m1 <= l1; ++m1)
-            almCopy(l1, m1) = alm_(l1, m1);
-    }
-    
-    const Math::ThreeRotationMatrix rot(phi + Math::pi / 2, theta, 0);
-    //const rotmatrix rotationMatrix(rot[0][0], rot[1][0], rot[2][0], rot[0][1], rot[1][1], rot[2][1], rot[0][2], rot[1][2], rot[2][2]);
-    const rotmatrix rotationMatrix(rot[0][0], rot[0][1], rot[0][2], rot[1][0], rot[1][1], rot[1][2], rot[2][0], rot[2][1], rot[2][2]);
-    
-    rotate_alm(almCopy, rotationMatrix);
-    
-    double res = 0;
-    for(int m = 1; m <= l; ++m)
-    {
-        xcomplex<double> x = almCopy(l, m);
-        res += m * m * (x.real() * x.real() + x.imag() * x.imag());
-    }
-    
+    // only l needs to be rotated, so the Wigner d matrices are calculated only up to l and only the coefficients of l are copied
+    double res;
+    calculateDispersions(l, l, theta, phi, &res);
     return res;
 }
 
@@ -64,52 +101,222 @@ void
 ModeDirections::maximizeAngularMomentumDispersion(int l, long nSide, double& theta, double& phi, Healpix_Map<double>* map) const
 {
     long nPix = nside2npix(nSide);
-    double max = 0;
     output_screen("Maximizing over directions..." << std::endl);
     
     if(map)
         map->SetNside(nSide, NEST);
     
     ProgressMeter meter(nPix);
-    
-#ifdef COSMO_OMP
-    omp_lock_t lock;
-    omp_init_lock(&lock);
-#endif
 
-#pragma omp parallel for default(shared)
+    // every pixel writes only its own value, the maximum is found afterwards
+    std::vector<double> disp(nPix);
+
+#pragma omp parallel for default(shared) schedule(dynamic, 16)
     for(long i = 0; i < nPix; ++i)
     {
         double t, p;
         pix2ang_nest(nSide, i, &t, &p);
-        double disp = calculateAngularMomentumDispersion(l, t, p);
+        disp[i] = calculateAngularMomentumDispersion(l, t, p);
         
-#ifdef COSMO_OMP
-        omp_set_lock(&lock);
-#endif
         if(map)
-            (*map)[i] = disp;
+            (*map)[i] = disp[i];
         
-        if(disp > max)
-        {
-            max = disp;
-            theta = t;
-            phi = p;
-        }
         meter.advance();
-#ifdef COSMO_OMP
-        omp_unset_lock(&lock);
-#endif
     }
+
+    const long best = std::max_element(disp.begin(), disp.end()) - disp.begin();
+    const double max = disp[best];
+    pix2ang_nest(nSide, best, &theta, &phi);
     
     if(theta < Math::pi / 2)
     {
-        theta = Math::pi - theta;
-        phi += Math::pi;
-        if(phi > 2 * Math::pi)
-            phi -= 2 * Math::pi;
-        
+        toSouthernHemisphere(theta, phi);
         check(Math::areEqual(max, calculateAngularMomentumDispersion(l, theta, phi), 1e-7), "");
     }
     output_screen("OK" << std::endl);
 }
+
+void
+ModeDirections::calculateDispersions(int lMin, int lMax, double theta, double phi, double* disp) const
+{
+    check(lMin >= 0 && lMin <= lMax && lMax <= alm_.Lmax(), "invalid l range " << lMin << " to " << lMax);
+
+    // the Wigner d matrices up to lMax are shared by all of the l-s
+    const Math::ThreeRotationMatrix rot(phi + Math::pi / 2, theta, 0);
+    const Math::AlmRotation rotation(rot, lMax);
+
+    std::vector<ComplexDouble> almL(lMax + 1);
+    for(int l = lMin; l <= lMax; ++l)
+    {
+        for(int m = 0; m <= l; ++m)
+            almL[m] = ComplexDouble(alm_(l, m).real(), alm_(l, m).imag());
+
+        rotation.rotate(l, 1, &(almL[0]));
+
+        double res = 0;
+        for(int m = 1; m <= l; ++m)
+            res += m * m * std::norm(almL[m]);
+
+        disp[l - lMin] = res;
+    }
+}
+
+void
+ModeDirections::calculateAngularMomentumDispersion(int lMax, double theta, double phi, std::vector<double>* disp) const
+{
+    check(disp, "");
+    disp->resize(lMax + 1);
+    calculateDispersions(0, lMax, theta, phi, &((*disp)[0]));
+}
+
+void
+ModeDirections::calculatePixels(int lMin, int lMax, long nSide, const std::vector<long>& pixels, std::vector<double>* disp) const
+{
+    const int nL = lMax - lMin + 1;
+    disp->resize(pixels.size() * nL);
+
+#pragma omp parallel for default(shared) schedule(dynamic, 4)
+    for(long i = 0; i < pixels.size(); ++i)
+    {
+        double t, p;
+        pix2ang_nest(nSide, pixels[i], &t, &p);
+        calculateDispersions(lMin, lMax, t, p, &((*disp)[i * nL]));
+    }
+}
+
+double
+ModeDirections::refine(int l, double& theta, double& phi, double disp, double step, double tolerance) const
+{
+    // compass search, the step is halved when none of the 4 directions improves
+    const int maxIterations = 10000;
+    int iteration = 0;
+    while(step >= tolerance && iteration++ < maxIterations)
+    {
+        const double s = std::sin(theta);
+        const double phiStep = (s > step / Math::pi ? step / s : Math::pi);
+        const double dTheta[4] = {step, -step, 0, 0};
+        const double dPhi[4] = {0, 0, phiStep, -phiStep};
+
+        bool improved = false;
+        for(int k = 0; k < 4; ++k)
+        {
+            double t = theta + dTheta[k], p = phi + dPhi[k];
+            normalizeDirection(t, p);
+            const double d = calculateAngularMomentumDispersion(l, t, p);
+            if(d > disp)
+            {
+                disp = d;
+                theta = t;
+                phi = p;
+                improved = true;
+            }
+        }
+
+        if(!improved)
+            step /= 2;
+    }
+
+    return disp;
+}
+
+void
+ModeDirections::search(int lMin, int lMax, long nSideCoarse, long nSide, int nCandidates, double tolerance, std::vector<double>* theta, std::vector<double>* phi, std::vector<double>* maxDisp) const
+{
+    check(lMin >= 1 && lMin <= lMax && lMax <= alm_.Lmax(), "invalid l range " << lMin << " to " << lMax);
+    check(nSideCoarse > 0, "invalid nSideCoarse = " << nSideCoarse);
+    long n = nSideCoarse;
+    while(n < nSide)
+        n *= 2;
+    check(n == nSide, "nSide = " << nSide << " must be nSideCoarse = " << nSideCoarse << " times a power of 2");
+    check(nCandidates > 0, "invalid number of candidates " << nCandidates);
+    check(tolerance >= 0, "invalid tolerance " << tolerance);
+
+    const int nL = lMax - lMin + 1;
+
+    std::vector<long> pixels(nside2npix(nSideCoarse));
+    for(long i = 0; i < pixels.size(); ++i)
+        pixels[i] = i;
+
+    std::vector<double> disp, bestDisp(nL);
+    std::vector<std::vector<long> > candidates(nL);
+    long currentNSide = nSideCoarse;
+    while(true)
+    {
+        calculatePixels(lMin, lMax, currentNSide, pixels, &disp);
+        for(int j = 0; j < nL; ++j)
+            selectBest(pixels, disp, nL, j, nCandidates, &(candidates[j]), &(bestDisp[j]));
+
+        if(currentNSide == nSide)
+            break;
+
+        // the subpixels of the candidates of all of the l-s are calculated together
+        std::set<long> next;
+        for(int j = 0; j < nL; ++j)
+        {
+            for(int i = 0; i < candidates[j].size(); ++i)
+            {
+                for(int k = 0; k < 4; ++k)
+                    next.insert(4 * candidates[j][i] + k);
+            }
+        }
+        pixels.assign(next.begin(), next.end());
+        currentNSide *= 2;
+    }
+
+    theta->resize(nL);
+    phi->resize(nL);
+    if(maxDisp)
+        maxDisp->resize(nL);
+
+    // start from half of the pixel size
+    const double step = std::sqrt(4 * Math::pi / nside2npix(nSide)) / 2;
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int j = 0; j < nL; ++j)
+    {
+        double t, p;
+        pix2ang_nest(nSide, candidates[j][0], &t, &p);
+        double d = bestDisp[j];
+        if(tolerance > 0)
+            d = refine(lMin + j, t, p, d, step, tolerance);
+        toSouthernHemisphere(t, p);
+
+        (*theta)[j] = t;
+        (*phi)[j] = p;
+        if(maxDisp)
+            (*maxDisp)[j] = d;
+    }
+}
+
+double
+ModeDirections::searchAngularMomentumDispersion(int l, long nSideCoarse, long nSide, double& theta, double& phi, int nCandidates, double tolerance) const
+{
+    std::vector<double> t, p, d;
+    search(l, l, nSideCoarse, nSide, nCandidates, tolerance, &t, &p, &d);
+    theta = t[0];
+    phi = p[0];
+    return d[0];
+}
+
+void
+ModeDirections::searchAngularMomentumDispersion(int lMax, long nSideCoarse, long nSide, std::vector<double>* theta, std::vector<double>* phi, std::vector<double>* maxDisp, int nCandidates, double tolerance) const
+{
+    check(theta, "");
+    check(phi, "");
+
+    std::vector<double> t, p, d;
+    search(1, lMax, nSideCoarse, nSide, nCandidates, tolerance, &t, &p, &d);
+
+    theta->resize(lMax + 1);
+    phi->resize(lMax + 1);
+    (*theta)[0] = Math::pi;
+    (*phi)[0] = 0;
+    std::copy(t.begin(), t.end(), theta->begin() + 1);
+    std::copy(p.begin(), p.end(), phi->begin() + 1);
+    if(maxDisp)
+    {
+        maxDisp->resize(lMax + 1);
+        (*maxDisp)[0] = 0;
+        std::copy(d.begin(), d.end(), maxDisp->begin() + 1);
+    }
+}
@@ -0,0 +1,635 @@
+#ifdef COSMO_MPI
+#include <mpi.h>
+#endif
+
+#include <sstream>
+#include <cmath>
+#include <utility>
+
+#include <unistd.h>
+
+#include <cosmo_mpi.hpp>
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <math_constants.hpp>
+#include <checkpoint_coordinator.hpp>
+#include <mapped_file.hpp>
+#include <parallel_tempering.hpp>
+
+namespace Math
+{
+
+ParallelTempering::ParallelTempering(int nPar, LikelihoodFunction& like, std::string fileRoot, int nTemperatures, double maxTemperature, time_t seed) : n_(nPar), like_(&like), fileRoot_(fileRoot), param1_(nPar, 0), param2_(nPar, 0), starting_(nPar, 0), startingWidth_(nPar, 0), samplingWidth_(nPar, 0), priorMods_(nPar, PRIOR_MODE_MAX), paramNames_(nPar), externalPrior_(NULL), externalProposal_(NULL), nTemps_(nTemperatures), resumeCode_(654321)
+{
+    check(nPar > 0, "");
+    check(nTemperatures >= 1, "invalid number of temperatures " << nTemperatures);
+    check(maxTemperature >= 1, "invalid maximum temperature " << maxTemperature);
+
+    for(int i = 1; i <= nPar; ++i)
+        blocks_.push_back(i);
+
+    temperatures_.resize(nTemps_);
+    for(int i = 0; i < nTemps_; ++i)
+        temperatures_[i] = (nTemps_ == 1 ? 1.0 : std::pow(maxTemperature, double(i) / double(nTemps_ - 1)));
+
+    nProcesses_ = CosmoMPI::create().numProcesses();
+    processId_ = CosmoMPI::create().processId();
+
+    StandardException exc;
+    if(nProcesses_ >= nTemps_)
+    {
+        if(nProcesses_ % nTemps_ != 0)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The number of processes " << nProcesses_ << " must be a multiple of the number of temperatures " << nTemps_ << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        chainsPerProcess_ = 1;
+        nLadders_ = nProcesses_ / nTemps_;
+    }
+    else
+    {
+        if(nTemps_ % nProcesses_ != 0)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The number of temperatures " << nTemps_ << " must be a multiple of the number of processes " << nProcesses_ << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        chainsPerProcess_ = nTemps_ / nProcesses_;
+        nLadders_ = 1;
+    }
+
+    firstChain_ = processId_ * chainsPerProcess_;
+    chains_.resize(chainsPerProcess_);
+    for(int i = 0; i < chainsPerProcess_; ++i)
+    {
+        Chain& c = chains_[i];
+        c.tempIndex = (firstChain_ + i) % nTemps_;
+        c.beta = 1.0 / temperatures_[c.tempIndex];
+        c.current.resize(n_);
+        c.like = 0;
+        c.prior = 0;
+        c.accepted = 0;
+        c.swapsProposed = 0;
+        c.swapsAccepted = 0;
+    }
+
+    stateTag_ = CosmoMPI::create().getCommTag();
+    decisionTag_ = CosmoMPI::create().getCommTag();
+
+    if(seed == 0)
+        seed_ = std::time(0);
+    else
+        seed_ = seed;
+
+    UniformRealGenerator temp(seed_, 0, 1000000);
+
+    for(int i = 0; i < 2 * processId_; ++i)
+        temp.generate();
+
+    uniformGen_ = new UniformRealGenerator(int(temp.generate()), 0, 1);
+    generator_ = new GaussianGenerator(int(temp.generate()), 0, 1);
+
+    std::stringstream resFileName;
+    resFileName << fileRoot_ << "pt_resume";
+    if(nProcesses_ > 1)
+        resFileName << '_' << processId_;
+    resFileName << ".dat";
+    resumeFileName_ = resFileName.str();
+}
+
+ParallelTempering::~ParallelTempering()
+{
+    delete uniformGen_;
+    delete generator_;
+}
+
+void
+ParallelTempering::setParam(int i, const std::string& name, double min, double max, double starting, double startingWidth, double samplingWidth)
+{
+    check(i >= 0 && i < n_, "invalid index = " << i);
+    check(max > min, "max = " << max << ", min = " << min << ". Need max > min.")
+
+    paramNames_[i] = name;
+    param1_[i] = min;
+    param2_[i] = max;
+    priorMods_[i] = UNIFORM_PRIOR;
+
+    if(starting == std::numeric_limits<double>::max())
+        starting_[i] = (max + min) / 2.0;
+    else
+    {
+        check(starting >= min && starting <= max, "invalid starting value " << starting << ", needs to be between " << min << " and " << max);
+        starting_[i] = starting;
+    }
+
+    check(startingWidth >= 0 && startingWidth <= (max - min), "invalid starting width " << startingWidth);
+    startingWidth_[i] = (startingWidth == 0 ? (max - min) / 100 : startingWidth);
+
+    check(samplingWidth >= 0, "invalid sampling width " << samplingWidth);
+    samplingWidth_[i] = (samplingWidth == 0 ? (max - min) / 100 : samplingWidth);
+}
+
+void
+ParallelTempering::setParamGauss(int i, const std::string& name, double mean, double sigma, double starting, double startingWidth, double samplingWidth)
+{
+    check(i >= 0 && i < n_, "invalid index = " << i);
+    check(sigma > 0, "invalid sigma = " << sigma);
+
+    paramNames_[i] = name;
+    param1_[i] = mean;
+    param2_[i] = sigma;
+    priorMods_[i] = GAUSSIAN_PRIOR;
+
+    starting_[i] = (starting == std::numeric_limits<double>::max() ? mean : starting);
+
+    check(startingWidth >= 0, "invalid starting width " << startingWidth);
+    startingWidth_[i] = (startingWidth == 0 ? sigma / 100 : startingWidth);
+
+    check(samplingWidth >= 0, "invalid sampling width " << samplingWidth);
+    samplingWidth_[i] = (samplingWidth == 0 ? sigma / 100 : samplingWidth);
+}
+
+void
+ParallelTempering::specifyParameterBlocks(const std::vector<int>& blocks)
+{
+    check(!blocks.empty(), "");
+#ifdef CHECKS_ON
+    for(int i = 1; i < blocks.size(); ++i)
+    {
+        check(blocks[i] > blocks[i - 1], "");
+        check(blocks[i] <= n_, "");
+    }
+#endif
+
+    blocks_ = blocks;
+}
+
+double
+ParallelTempering::calculatePrior(double* params)
+{
+    if(externalPrior_)
+        return externalPrior_->calculate(params, n_);
+
+    double result = 1.0;
+    for(int i = 0; i < n_; ++i)
+    {
+        switch(priorMods_[i])
+        {
+        case UNIFORM_PRIOR:
+            if(params[i] < param1_[i] || params[i] > param2_[i])
+                return 0.0;
+            result /= (param2_[i] - param1_[i]);
+            break;
+
+        case GAUSSIAN_PRIOR:
+            result *= std::exp(-(params[i] - param1_[i]) * (params[i] - param1_[i]) / (2 * param2_[i] * param2_[i])) / (std::sqrt(2 * Math::pi) * param2_[i]);
+            break;
+
+        default:
+            check(false, "invalid prior mode");
+            break;
+        }
+    }
+
+    return result;
+}
+
+void
+ParallelTempering::step(Chain& chain)
+{
+    const double widthFactor = std::sqrt(temperatures_[chain.tempIndex]);
+
+    int blockBegin = 0;
+    for(int i = 0; i < blocks_.size(); ++i)
+    {
+        const int blockEnd = blocks_[i];
+
+        std::vector<double> old = chain.current;
+        std::vector<double> block(blockEnd - blockBegin);
+
+        if(externalProposal_)
+            externalProposal_->generate(&(chain.current[0]), n_, &(block[0]), i);
+        else
+        {
+            for(int j = blockBegin; j < blockEnd; ++j)
+                block[j - blockBegin] = chain.current[j] + generator_->generate() * samplingWidth_[j] * widthFactor;
+        }
+
+        for(int j = blockBegin; j < blockEnd; ++j)
+            chain.current[j] = block[j - blockBegin];
+
+        const double newPrior = calculatePrior(&(chain.current[0]));
+        double p = 0;
+        double newLike = chain.like;
+        if(newPrior != 0)
+        {
+            newLike = like_->calculate(&(chain.current[0]), n_);
+
+            // the likelihood is tempered, the prior is not
+            p = newPrior / chain.prior * std::exp(-chain.beta * (newLike - chain.like) / 2.0);
+
+            if(externalProposal_ && !externalProposal_->isSymmetric(i))
+            {
+                std::vector<double> oldBlock(blockEnd - blockBegin);
+                for(int j = blockBegin; j < blockEnd; ++j)
+                    oldBlock[j - blockBegin] = old[j];
+
+                p *= externalProposal_->calculate(&(chain.current[0]), n_, &(oldBlock[0]), i);
+                p /= externalProposal_->calculate(&(old[0]), n_, &(block[0]), i);
+            }
+        }
+
+        if(p > 1)
+            p = 1;
+
+        if(newPrior != 0 && uniformGen_->generate() <= p)
+        {
+            chain.prior = newPrior;
+            chain.like = newLike;
+            ++chain.accepted;
+        }
+        else
+            chain.current = old;
+
+        blockBegin = blockEnd;
+    }
+}
+
+void
+ParallelTempering::swap(unsigned long round)
+{
+    // the pairs (t, t + 1) with even t are tried in the even rounds, the ones with odd t in the odd rounds
+    const int parity = round % 2;
+
+    // the state sent to the other process is -2ln(likelihood), the prior, and the parameters
+    const int stateSize = 2 + n_;
+
+    // at most one pair crosses each boundary of the range of chains of this process
+    std::vector<int> crossLocal, crossIsLower;
+    std::vector<std::vector<double> > sendBuff, recvBuff;
+
+    for(int l = 0; l < chainsPerProcess_; ++l)
+    {
+        Chain& c = chains_[l];
+        const int t = c.tempIndex;
+        const bool isLower = (t % 2 == parity);
+
+        if(isLower && t + 1 < nTemps_)
+        {
+            if(l + 1 < chainsPerProcess_)
+            {
+                // both chains are here
+                Chain& u = chains_[l + 1];
+                ++c.swapsProposed;
+                const double lnA = (c.beta - u.beta) * (c.like - u.like) / 2.0;
+                if(lnA >= 0 || uniformGen_->generate() < std::exp(lnA))
+                {
+                    c.current.swap(u.current);
+                    std::swap(c.like, u.like);
+                    std::swap(c.prior, u.prior);
+                    ++c.swapsAccepted;
+                }
+            }
+            else
+            {
+                crossLocal.push_back(l);
+                crossIsLower.push_back(1);
+            }
+        }
+        else if(!isLower && t > 0 && l == 0)
+        {
+            crossLocal.push_back(l);
+            crossIsLower.push_back(0);
+        }
+    }
+
+    if(crossLocal.empty())
+        return;
+
+#ifdef COSMO_MPI
+    const int nCross = crossLocal.size();
+    sendBuff.resize(nCross, std::vector<double>(stateSize));
+    recvBuff.resize(nCross, std::vector<double>(stateSize));
+    std::vector<MPI_Request> requests(2 * nCross);
+
+    for(int k = 0; k < nCross; ++k)
+    {
+        const Chain& c = chains_[crossLocal[k]];
+        const int partner = processOfChain(firstChain_ + crossLocal[k] + (crossIsLower[k] ? 1 : -1));
+        sendBuff[k][0] = c.like;
+        sendBuff[k][1] = c.prior;
+        for(int j = 0; j < n_; ++j)
+            sendBuff[k][2 + j] = c.current[j];
+
+        MPI_Irecv(&(recvBuff[k][0]), stateSize, MPI_DOUBLE, partner, stateTag_, MPI_COMM_WORLD, &(requests[2 * k]));
+        MPI_Isend(&(sendBuff[k][0]), stateSize, MPI_DOUBLE, partner, stateTag_, MPI_COMM_WORLD, &(requests[2 * k + 1]));
+    }
+    MPI_Waitall(2 * nCross, &(requests[0]), MPI_STATUSES_IGNORE);
+
+    // the lower chain of each pair decides
+    std::vector<int> decisions(nCross, 0);
+    for(int k = 0; k < nCross; ++k)
+    {
+        Chain& c = chains_[crossLocal[k]];
+        const int partner = processOfChain(firstChain_ + crossLocal[k] + (crossIsLower[k] ? 1 : -1));
+        if(crossIsLower[k])
+        {
+            const double upperBeta = 1.0 / temperatures_[c.tempIndex + 1];
+            ++c.swapsProposed;
+            const double lnA = (c.beta - upperBeta) * (c.like - recvBuff[k][0]) / 2.0;
+            decisions[k] = (lnA >= 0 || uniformGen_->generate() < std::exp(lnA)) ? 1 : 0;
+            if(decisions[k])
+                ++c.swapsAccepted;
+            MPI_Isend(&(decisions[k]), 1, MPI_INT, partner, decisionTag_, MPI_COMM_WORLD, &(requests[k]));
+        }
+        else
+            MPI_Irecv(&(decisions[k]), 1, MPI_INT, partner, decisionTag_, MPI_COMM_WORLD, &(requests[k]));
+    }
+    MPI_Waitall(nCross, &(requests[0]), MPI_STATUSES_IGNORE);
+
+    for(int k = 0; k < nCross; ++k)
+    {
+        if(!decisions[k])
+            continue;
+
+        Chain& c = chains_[crossLocal[k]];
+        c.like = recvBuff[k][0];
+        c.prior = recvBuff[k][1];
+        for(int j = 0; j < n_; ++j)
+            c.current[j] = recvBuff[k][2 + j];
+    }
+#else
+    check(false, "");
+#endif
+}
+
+void
+ParallelTempering::openOut(bool append, long position)
+{
+    std::stringstream fileName;
+    fileName << fileRoot_;
+    if(nLadders_ > 1)
+        fileName << '_' << firstChain_ / nTemps_;
+    fileName << ".txt";
+
+    if(append)
+    {
+        // drop the elements written after the resume information, they will be generated again
+        if(truncate(fileName.str().c_str(), position) != 0)
+        {
+            output_screen("WARNING: could not truncate the chain file " << fileName.str() << " to the resume point." << std::endl);
+        }
+        out_.open(fileName.str().c_str(), std::ios::app);
+    }
+    else
+        out_.open(fileName.str().c_str());
+
+    if(!out_)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << fileName.str() << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+ParallelTempering::writeChainElement(const Chain& chain)
+{
+    check(out_, "");
+    out_ << 1 << "   " << chain.like;
+    for(int i = 0; i < n_; ++i)
+        out_ << "   " << chain.current[i];
+    out_ << '\n';
+}
+
+void
+ParallelTempering::writeResumeInfo(unsigned long iteration)
+{
+    long position = -1;
+    if(out_.is_open())
+    {
+        out_.flush();
+        position = out_.tellp();
+    }
+
+    // the previous resume information is kept until the new one is complete
+    try
+    {
+        Math::ReplacingOutputFile file(resumeFileName_.c_str());
+        std::ofstream& out = file.stream();
+        out.write((char*)(&iteration), sizeof(unsigned long));
+        out.write((char*)(&position), sizeof(long));
+        out.write((char*)(&chainsPerProcess_), sizeof(int));
+        for(int i = 0; i < chainsPerProcess_; ++i)
+        {
+            const Chain& c = chains_[i];
+            out.write((char*)(&(c.current[0])), n_ * sizeof(double));
+            out.write((char*)(&(c.like)), sizeof(double));
+            out.write((char*)(&(c.prior)), sizeof(double));
+            out.write((char*)(&(c.accepted)), sizeof(unsigned long));
+            out.write((char*)(&(c.swapsProposed)), sizeof(unsigned long));
+            out.write((char*)(&(c.swapsAccepted)), sizeof(unsigned long));
+        }
+        out.write((char*)(&resumeCode_), sizeof(int));
+        file.commit();
+    }
+    catch (std::exception& e)
+    {
+        output_screen("WARNING: the resume file " << resumeFileName_ << " was not updated, a resumed run would start from the previous resume point. " << e.what() << std::endl);
+    }
+}
+
+bool
+ParallelTempering::readResumeInfo(unsigned long& iteration, long& position)
+{
+    std::ifstream in(resumeFileName_.c_str(), std::ios::binary | std::ios::in);
+    if(!in)
+        return false;
+
+    int nChains;
+    in.read((char*)(&iteration), sizeof(unsigned long));
+    in.read((char*)(&position), sizeof(long));
+    in.read((char*)(&nChains), sizeof(int));
+    if(!in || nChains != chainsPerProcess_)
+        return false;
+
+    std::vector<Chain> chains = chains_;
+    for(int i = 0; i < chainsPerProcess_; ++i)
+    {
+        Chain& c = chains[i];
+        in.read((char*)(&(c.current[0])), n_ * sizeof(double));
+        in.read((char*)(&(c.like)), sizeof(double));
+        in.read((char*)(&(c.prior)), sizeof(double));
+        in.read((char*)(&(c.accepted)), sizeof(unsigned long));
+        in.read((char*)(&(c.swapsProposed)), sizeof(unsigned long));
+        in.read((char*)(&(c.swapsAccepted)), sizeof(unsigned long));
+    }
+
+    int code;
+    in.read((char*)(&code), sizeof(int));
+    if(!in || code != resumeCode_)
+        return false;
+
+    chains_.swap(chains);
+    return true;
+}
+
+int
+ParallelTempering::run(unsigned long nIterations, int swapEvery, int writeResumeInformationEvery)
+{
+    check(nIterations > 0, "invalid number of iterations " << nIterations);
+    check(swapEvery > 0, "invalid swap interval " << swapEvery);
+    check(writeResumeInformationEvery >= 0, "invalid resume interval " << writeResumeInformationEvery);
+    check(!blocks_.empty(), "");
+    for(int i = 0; i < n_; ++i)
+    {
+        check(priorMods_[i] != PRIOR_MODE_MAX, "parameter " << i << " has not been set");
+    }
+
+    if(processId_ == 0)
+    {
+        output_screen_clean("Running parallel tempering with " << nLadders_ << " ladder(s) of " << nTemps_ << " temperatures between 1 and " << temperatures_[nTemps_ - 1] << ", " << chainsPerProcess_ << " chain(s) per process!!!" << std::endl << std::endl);
+
+        std::stringstream paramNamesFileName;
+        paramNamesFileName << fileRoot_ << ".paramnames";
+        std::ofstream outPar(paramNamesFileName.str().c_str());
+
+        if(!outPar)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot write into paramnames file " << paramNamesFileName.str() << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        for(int i = 0; i < n_; ++i)
+            outPar << paramNames_[i] << '\t' << paramNames_[i] << std::endl;
+        outPar.close();
+    }
+
+    const bool hasColdChain = (chains_[0].tempIndex == 0);
+
+    unsigned long iteration = 0;
+    long position = 0;
+    long resumed = (readResumeInfo(iteration, position) ? long(iteration) : -1);
+
+    // all of the chains need to continue from the same iteration for the swaps to match
+    long minResumed = resumed, maxResumed = resumed;
+#ifdef COSMO_MPI
+    CosmoMPI::create().reduce(&resumed, &minResumed, 1, CosmoMPI::LONG, CosmoMPI::MIN);
+    CosmoMPI::create().reduce(&resumed, &maxResumed, 1, CosmoMPI::LONG, CosmoMPI::MAX);
+    CosmoMPI::create().bcast(&minResumed, 1, CosmoMPI::LONG);
+    CosmoMPI::create().bcast(&maxResumed, 1, CosmoMPI::LONG);
+#endif
+
+    if(minResumed >= 0 && minResumed == maxResumed)
+    {
+        output_screen("Resuming from previous run, already have " << iteration << " iterations." << std::endl);
+        if(hasColdChain)
+            openOut(true, position);
+    }
+    else
+    {
+        if(minResumed != maxResumed)
+        {
+            output_screen("The resume information of the processes does not match, starting from scratch." << std::endl);
+        }
+        else
+        {
+            output_screen("No resume file found (or the resume file is not complete), starting from scratch." << std::endl);
+        }
+
+        iteration = 0;
+        for(int l = 0; l < chainsPerProcess_; ++l)
+        {
+            Chain& c = chains_[l];
+            c.accepted = 0;
+            c.swapsProposed = 0;
+            c.swapsAccepted = 0;
+
+            // pick a random starting point within the starting widths with non-zero prior
+            int tries = 0;
+            do
+            {
+                for(int i = 0; i < n_; ++i)
+                    c.current[i] = starting_[i] + startingWidth_[i] * generator_->generate();
+                c.prior = calculatePrior(&(c.current[0]));
+            } while(c.prior == 0 && ++tries < 1000);
+
+            if(c.prior == 0)
+            {
+                c.current = starting_;
+                c.prior = calculatePrior(&(c.current[0]));
+            }
+            check(c.prior > 0, "the starting point has zero prior");
+
+            c.like = like_->calculate(&(c.current[0]), n_);
+        }
+
+        if(hasColdChain)
+            openOut(false, 0);
+    }
+
+    // the swaps need all of the processes, so they also stop together (see CheckpointCoordinator)
+    const bool checkpoints = CheckpointCoordinator::isInstalled();
+    bool preempted = false;
+
+    for(; iteration < nIterations && !preempted; ++iteration)
+    {
+        for(int l = 0; l < chainsPerProcess_; ++l)
+            step(chains_[l]);
+
+        if((iteration + 1) % swapEvery == 0)
+            swap((iteration + 1) / swapEvery);
+
+        if(hasColdChain)
+            writeChainElement(chains_[0]);
+
+        if(checkpoints && CheckpointCoordinator::requestedEverywhere())
+            preempted = true;
+
+        if(writeResumeInformationEvery && ((iteration + 1) % writeResumeInformationEvery == 0 || preempted))
+            writeResumeInfo(iteration + 1);
+
+        if((iteration + 1) % 1000 == 0)
+        {
+            output_screen("Total iterations: " << iteration + 1 << std::endl);
+        }
+    }
+
+    if(hasColdChain)
+        out_.close();
+
+    if(preempted && processId_ == 0)
+    {
+        output_screen("Stopped by a termination request after " << iteration << " iterations, the run can be resumed from here!" << std::endl);
+    }
+
+    const unsigned long done = iteration;
+    for(int l = 0; l < chainsPerProcess_; ++l)
+    {
+        const Chain& c = chains_[l];
+        output_screen("Temperature " << temperatures_[c.tempIndex] << ": acceptance rate = " << double(c.accepted) / double(done * blocks_.size()));
+        if(c.swapsProposed)
+        {
+            output_screen_clean(", swap acceptance rate with the next temperature = " << double(c.swapsAccepted) / double(c.swapsProposed));
+        }
+        output_screen_clean(std::endl);
+    }
+
+    CosmoMPI::create().barrier();
+
+    if(preempted)
+        CheckpointCoordinator::flush();
+
+    return nLadders_;
+}
+
+} // namespace Math
+
@@ -0,0 +1,264 @@
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cosmo_mpi.hpp>
+#include <distributed_large_vector.hpp>
+#include <planck_cl_scorer.hpp>
+
+namespace
+{
+
+// the most components a PlanckLikelihood can have, for the size of the batches of the pool
+const int maxComponents = 5;
+
+// the likelihood of the pool, the parameters are the index of the set and the index of the component
+class ClSetComponentLike : public Math::LikelihoodFunction
+{
+public:
+    ClSetComponentLike(PlanckLikelihood* like, const MappedClSets& sets) : like_(like), sets_(sets), current_(-1) {}
+    ~ClSetComponentLike() { delete like_; }
+
+    double calculate(double* params, int nParams)
+    {
+        check(nParams == 2, "");
+        const long i = long(params[0]);
+        const int c = int(params[1]);
+
+        try
+        {
+            // the components of the same set are often given to the same worker one after the other
+            if(i != current_)
+            {
+                current_ = -1;
+                setCls(i);
+                current_ = i;
+            }
+            return like_->componentLike(c);
+        }
+        catch (std::exception& e)
+        {
+            output_screen("The likelihood component " << c << " of the set " << i << " failed: " << e.what() << std::endl);
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+
+private:
+    void setCls(long i)
+    {
+        sets_.getSpectrum(i, ClSetFile::TT, &tt_);
+        if(sets_.hasSpectrum(ClSetFile::EE))
+            sets_.getSpectrum(i, ClSetFile::EE, &ee_);
+        if(sets_.hasSpectrum(ClSetFile::TE))
+            sets_.getSpectrum(i, ClSetFile::TE, &te_);
+        if(sets_.hasSpectrum(ClSetFile::PP))
+            sets_.getSpectrum(i, ClSetFile::PP, &pp_);
+
+        const std::vector<double>* ee = (sets_.hasSpectrum(ClSetFile::EE) ? &ee_ : NULL);
+        const std::vector<double>* te = (sets_.hasSpectrum(ClSetFile::TE) ? &te_ : NULL);
+        const std::vector<double>* pp = (sets_.hasSpectrum(ClSetFile::PP) ? &pp_ : NULL);
+#ifdef COSMO_PLANCK_15
+        if(sets_.hasSpectrum(ClSetFile::BB))
+            sets_.getSpectrum(i, ClSetFile::BB, &bb_);
+        const std::vector<double>* bb = (sets_.hasSpectrum(ClSetFile::BB) ? &bb_ : NULL);
+        like_->setCls(&tt_, ee, te, bb, pp);
+#else
+        like_->setCls(&tt_, ee, te, pp);
+#endif
+    }
+
+private:
+    PlanckLikelihood* like_;
+    const MappedClSets& sets_;
+    long current_;
+    std::vector<double> tt_, ee_, te_, bb_, pp_;
+};
+
+class ClSetFactory : public Math::LikelihoodFactory
+{
+public:
+    ClSetFactory(PlanckClScorer::Factory& factory, const MappedClSets& sets) : factory_(factory), sets_(sets) {}
+
+    Math::LikelihoodFunction* create(int worker) { return new ClSetComponentLike(factory_.create(worker), sets_); }
+
+private:
+    PlanckClScorer::Factory& factory_;
+    const MappedClSets& sets_;
+};
+
+} // namespace
+
+PlanckClScorer::PlanckClScorer(Factory& factory, const char* clSetFile, int nWorkers, int chunkSize) : sets_(clSetFile), chunkSize_(chunkSize), like_(NULL), local_(NULL), poolFactory_(NULL), pool_(NULL)
+{
+    check(nWorkers >= 0, "invalid number of workers " << nWorkers);
+    check(chunkSize_ > 0, "invalid chunk size " << chunkSize_);
+
+    // the workers are forked first, before the likelihood of this process is created
+    if(nWorkers > 0)
+    {
+        poolFactory_ = new ClSetFactory(factory, sets_);
+        pool_ = new Math::ProcessLikelihoodPool(*poolFactory_, 2, nWorkers, chunkSize_ * maxComponents);
+    }
+
+    like_ = factory.create(-1);
+    check(like_, "");
+    local_ = new ClSetComponentLike(like_, sets_);
+
+    check(like_->numberOfComponents() <= maxComponents, "");
+    names_.resize(like_->numberOfComponents());
+    for(int i = 0; i < names_.size(); ++i)
+        names_[i] = like_->componentName(i);
+
+    output_screen1("Scoring " << sets_.size() << " Cl sets with " << names_.size() << " likelihood components on " << nWorkers << " workers." << std::endl);
+}
+
+PlanckClScorer::~PlanckClScorer()
+{
+    delete pool_;
+    delete poolFactory_;
+
+    // deletes like_ too
+    delete local_;
+}
+
+void
+PlanckClScorer::makePairs(unsigned long begin, unsigned long end, std::vector<double>* pairs) const
+{
+    const int nComp = numberOfComponents();
+    pairs->resize((end - begin) * nComp * 2);
+    for(unsigned long i = begin; i < end; ++i)
+    {
+        for(int c = 0; c < nComp; ++c)
+        {
+            double* pair = &((*pairs)[((i - begin) * nComp + c) * 2]);
+            pair[0] = double(i);
+            pair[1] = double(c);
+        }
+    }
+}
+
+void
+PlanckClScorer::collect(unsigned long nSets, const std::vector<double>& values, double* results) const
+{
+    const int nComp = numberOfComponents();
+    for(unsigned long k = 0; k < nSets; ++k)
+    {
+        double* res = results + k * resultSize();
+        double total = 0;
+        for(int c = 0; c < nComp; ++c)
+        {
+            res[1 + c] = values[k * nComp + c];
+            total += res[1 + c];
+        }
+        res[0] = total;
+    }
+}
+
+void
+PlanckClScorer::score(unsigned long begin, unsigned long end, std::vector<double>* results)
+{
+    check(results, "");
+    check(begin <= end && end <= size(), "invalid range " << begin << " to " << end << " of " << size() << " sets");
+
+    results->resize((end - begin) * resultSize());
+    if(begin == end)
+        return;
+
+    const int nComp = numberOfComponents();
+    std::vector<double> pairs, nextPairs;
+    std::vector<double> values(chunkSize_ * nComp);
+
+    unsigned long chunkBegin = begin;
+    unsigned long chunkEnd = std::min(begin + chunkSize_, end);
+    sets_.prefetch(chunkBegin, chunkEnd);
+    makePairs(chunkBegin, chunkEnd, &pairs);
+
+    if(!pool_)
+    {
+        while(chunkBegin < end)
+        {
+            const unsigned long nextEnd = std::min(chunkEnd + chunkSize_, end);
+            sets_.prefetch(chunkEnd, nextEnd);
+
+            const unsigned long nPairs = (chunkEnd - chunkBegin) * nComp;
+            for(unsigned long k = 0; k < nPairs; ++k)
+                values[k] = local_->calculate(&(pairs[2 * k]), 2);
+            collect(chunkEnd - chunkBegin, values, &((*results)[(chunkBegin - begin) * resultSize()]));
+
+            chunkBegin = chunkEnd;
+            chunkEnd = nextEnd;
+            makePairs(chunkBegin, chunkEnd, &pairs);
+        }
+        return;
+    }
+
+    pool_->startBatch(&(pairs[0]), int((chunkEnd - chunkBegin) * nComp));
+    while(chunkBegin < end)
+    {
+        // the next chunk is read while the workers are busy with this one
+        const unsigned long nextEnd = std::min(chunkEnd + chunkSize_, end);
+        sets_.prefetch(chunkEnd, nextEnd);
+        makePairs(chunkEnd, nextEnd, &nextPairs);
+
+        pool_->finishBatch(&(values[0]));
+        if(chunkEnd < end)
+            pool_->startBatch(&(nextPairs[0]), int((nextEnd - chunkEnd) * nComp));
+
+        collect(chunkEnd - chunkBegin, values, &((*results)[(chunkBegin - begin) * resultSize()]));
+
+        pairs.swap(nextPairs);
+        chunkBegin = chunkEnd;
+        chunkEnd = nextEnd;
+    }
+}
+
+void
+PlanckClScorer::scoreAll(std::vector<double>* results)
+{
+    check(results, "");
+
+    const int nProcesses = CosmoMPI::create().numProcesses();
+    const int processId = CosmoMPI::create().processId();
+
+    long begin, n;
+    Math::DistributedLargeVector::partition(long(size()), nProcesses, processId, &begin, &n);
+
+    std::vector<double> mine;
+    score(begin, begin + n, &mine);
+
+    if(nProcesses == 1)
+    {
+        results->swap(mine);
+        return;
+    }
+
+    StandardException exc;
+    const unsigned long total = size() * resultSize();
+    if(total == 0)
+    {
+        results->clear();
+        return;
+    }
+
+    if(total > (unsigned long)std::numeric_limits<int>::max())
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "There are " << total << " results, too many to collect into one process. Use score on parts of the sets instead.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    // the parts don't overlap, so summing puts them together
+    std::vector<double> all(total, 0.0);
+    std::copy(mine.begin(), mine.end(), all.begin() + begin * resultSize());
+
+    results->clear();
+    if(CosmoMPI::create().isMaster())
+        results->resize(total);
+
+    CosmoMPI::create().reduce(&(all[0]), (CosmoMPI::create().isMaster() ? &((*results)[0]) : NULL), int(total), CosmoMPI::DOUBLE, CosmoMPI::SUM);
+}
+
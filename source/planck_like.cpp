@@ -3,11 +3,15 @@
 #include <cstring>
 #include <fstream>
 #include <ctime>
+#include <algorithm>
+#include <vector>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <planck_like.hpp>
 #include <timer.hpp>
+#include <profiler.hpp>
+#include <cosmo_mpi.hpp>
 
 #include <clik.h>
 
@@ -15,6 +19,43 @@
 #define MY_STRINGIZE(P) MY_STRINGIZE1(P)
 #define PLANCK_DATA_DIR_STR MY_STRINGIZE(PLANCK_DATA_DIR)
 
+namespace
+{
+
+// exceptions cannot leave the parallel regions, so the first error message is kept and thrown after
+void
+setComponentError(std::string& error, const std::exception& e)
+{
+#pragma omp critical (planck_like_error)
+    {
+        if(error.empty())
+            error = e.what();
+    }
+}
+
+// the path of the data staged into node-local storage (see CosmoMPI::stageToNode, nothing is done if the staging is off), as a C string for clik
+std::vector<char>
+stagedPath(const std::string& path)
+{
+    const std::string staged = CosmoMPI::create().stageToNode(path);
+    std::vector<char> cStr(staged.begin(), staged.end());
+    cStr.push_back('\0');
+    return cStr;
+}
+
+void
+throwIfComponentError(const std::string& error)
+{
+    if(error.empty())
+        return;
+
+    StandardException exc;
+    exc.set(error);
+    throw exc;
+}
+
+} // namespace
+
 #ifdef COSMO_PLANCK_15
 
 namespace
@@ -34,9 +75,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/low_l/commander/commander_rc2_v1.1_l2_29_B.clik";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        lowT_ = clik_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        lowT_ = clik_init(&(pathCStr[0]), NULL);
         return lowT_;
     }
 
@@ -47,9 +87,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/low_l/bflike/lowl_SMW_70_dx11d_2014_10_03_v5c_Ap.clik";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        lowTP_ = clik_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        lowTP_ = clik_init(&(pathCStr[0]), NULL);
         return lowTP_;
     }
 
@@ -60,9 +99,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/hi_l/plik/plik_dx11dr2_HM_v18_TT.clik";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        highT_ = clik_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        highT_ = clik_init(&(pathCStr[0]), NULL);
         return highT_;
     }
 
@@ -73,9 +111,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/hi_l/plik/plik_dx11dr2_HM_v18_TTTEEE.clik";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        highTP_ = clik_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        highTP_ = clik_init(&(pathCStr[0]), NULL);
         return highTP_;
     }
 
@@ -88,9 +125,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/hi_l/plik_lite/plik_lite_v18_TT.clik";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        highTLite_ = clik_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        highTLite_ = clik_init(&(pathCStr[0]), NULL);
         return highTLite_;
     }
 
@@ -103,9 +139,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/hi_l/plik_lite/plik_lite_v18_TTTEEE.clik";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        highTPLite_ = clik_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        highTPLite_ = clik_init(&(pathCStr[0]), NULL);
         return highTPLite_;
     }
 
@@ -116,9 +151,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/lensing/smica_g30_ftl_full_pttptt.clik_lensing";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        lensT_ = clik_lensing_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        lensT_ = clik_lensing_init(&(pathCStr[0]), NULL);
         return lensT_;
     }
 
@@ -129,9 +163,8 @@ public:
 
         std::stringstream path;
         path << planckLikeDir_ << "/lensing/smica_g30_ftl_full_pp.clik_lensing";
-        char pathCStr[200];
-        std::strcpy(pathCStr, path.str().c_str());
-        lensTP_ = clik_lensing_init(pathCStr, NULL);
+        std::vector<char> pathCStr = stagedPath(path.str());
+        lensTP_ = clik_lensing_init(&(pathCStr[0]), NULL);
         return lensTP_;
     }
 
@@ -161,7 +194,7 @@ private:
 
 }
 
-PlanckLikelihood::PlanckLikelihood(bool lowT, bool lowP, bool highT, bool highP, bool highLikeLite, bool lensingT, bool lensingP, bool includeTensors, double kPerDecade, bool useOwnCmb) : spectraNames_(6), lensSpectraNames_(7), low_(NULL), high_(NULL), lens_(NULL), lowT_(lowT), lowP_(lowP), highT_(highT), highP_(highP), highLikeLite_(highLikeLite), lensingT_(lensingT), lensingP_(lensingP), cmb_(NULL), modelParams_(NULL), aPlanck_(1), aPol_(1), szPrior_(false)
+PlanckLikelihood::PlanckLikelihood(bool lowT, bool lowP, bool highT, bool highP, bool highLikeLite, bool lensingT, bool lensingP, bool includeTensors, double kPerDecade, bool useOwnCmb) : spectraNames_(6), lensSpectraNames_(7), low_(NULL), high_(NULL), lens_(NULL), lowT_(lowT), lowP_(lowP), highT_(highT), highP_(highP), highLikeLite_(highLikeLite), lensingT_(lensingT), lensingP_(lensingP), cmb_(NULL), modelParams_(NULL), haveModel_(false), modelSuccess_(false), modelBadLike_(0), aPlanck_(1), aPol_(1), szPrior_(false), haveLow_(false), haveHigh_(false), haveLens_(false), haveCosmoCls_(false), haveCachedCls_(false), cachedHaveLow_(false), cachedHaveHigh_(false), cachedHaveLens_(false), concurrent_(false), clVersion_(1)
 {
     check(!lowP || lowT, "cannot include lowP without lowT");
     check(!highP || highT, "cannot include highP without highT");
@@ -309,7 +342,39 @@ PlanckLikelihood::PlanckLikelihood(bool lowT, bool lowP, bool highT, bool highP,
         cmb_->preInitialize(lMax_ + 1000, false, true, includeTensors, lMax_ + 1000, kPerDecade);
     }
 
-    input_.resize(3 * lMax_ + 10000);
+    // the order of the spectra in the inputs is TT, EE, BB, TE for low-l, TT, EE, TE for high-l, and PP, TT, EE, TE for lensing, followed by the extra parameters
+    if(low_)
+    {
+        lowPlan_.add(&clTT_, lowLMax_);
+        if(lowP_)
+        {
+            lowPlan_.add(&clEE_, lowLMax_);
+            lowPlan_.add(&clBB_, lowLMax_);
+            lowPlan_.add(&clTE_, lowLMax_);
+        }
+        lowInput_.resize(lowPlan_.extraOffset + 1);
+    }
+    if(high_)
+    {
+        highPlan_.add(&clTT_, highLMax_);
+        if(highP_)
+        {
+            highPlan_.add(&clEE_, highLMax_);
+            highPlan_.add(&clTE_, highLMax_);
+        }
+        highInput_.resize(highPlan_.extraOffset + 100);
+    }
+    if(lens_)
+    {
+        lensPlan_.add(&clPP_, lensLMax_);
+        lensPlan_.add(&clTT_, lensLMax_);
+        if(lensingP_)
+        {
+            lensPlan_.add(&clEE_, lensLMax_);
+            lensPlan_.add(&clTE_, lensLMax_);
+        }
+        lensInput_.resize(lensPlan_.extraOffset + 1);
+    }
     if(highT)
     {
         highExtra_.resize(highP ? 32 : 15, 0);
@@ -329,33 +394,32 @@ PlanckLikelihood::setCosmoParams(const CosmologicalParams& params)
 {
     check(cmb_, "own CMB must be used (set in constructor)");
 
-    bool needToCalculate = true;
     params.getAllParameters(currentCosmoParams_);
-    if(params.name() == prevCosmoParamsName_)
+    if(params.name() != prevCosmoParamsName_)
     {
-        check(currentCosmoParams_.size() == prevCosmoParams_.size(), "");
-        bool areParamsEqual = true;
-        for(int i = 0; i < prevCosmoParams_.size(); ++i)
-        {
-            if(prevCosmoParams_[i] != currentCosmoParams_[i])
-            {
-                areParamsEqual = false;
-                break;
-            }
-        }
-
-        needToCalculate = !areParamsEqual;
-    }
-    else
         prevCosmoParamsName_ = params.name();
+        haveCosmoCls_ = false;
+        haveCachedCls_ = false;
+    }
+
+    if(haveCosmoCls_ && currentCosmoParams_ == prevCosmoParams_)
+        return;
 
-    if(!needToCalculate)
+    params_ = &params;
+
+    // the spectra for the previous cosmological parameters are kept, so going back to them needs no recalculation
+    // this is the case for fast-slow sampling when a step in the cosmological parameters is rejected and is followed by steps in the nuisance parameters only
+    const bool useCached = (haveCachedCls_ && currentCosmoParams_ == cachedCosmoParams_);
+    swapCachedCls();
+    haveCachedCls_ = haveCosmoCls_;
+    haveCosmoCls_ = true;
+    if(useCached)
         return;
 
     haveLow_ = false;
+    haveHigh_ = false;
     haveLens_ = false;
 
-    params_ = &params;
     prevCosmoParams_.swap(currentCosmoParams_);
 
     const bool wantT = true;
@@ -364,15 +428,44 @@ PlanckLikelihood::setCosmoParams(const CosmologicalParams& params)
 
     cmb_->initialize(params, wantT, wantPol, true);
 
-    std::vector<double>* tt = &clTT_;
-    std::vector<double>* ee = (wantPol ? &clEE_ : NULL);
-    std::vector<double>* te = (wantPol ? &clTE_ : NULL);
-    std::vector<double>* bb = (lowP_ ? &clBB_ : NULL);
+    // the vectors keep their size between the calls, so the spectra are written in place without reallocation
+    const int lMaxLensed = cmb_->lMaxLensed();
+    clTT_.resize(lMaxLensed + 1);
+    if(wantPol)
+    {
+        clEE_.resize(lMaxLensed + 1);
+        clTE_.resize(lMaxLensed + 1);
+    }
+    if(lowP_)
+        clBB_.resize(lMaxLensed + 1);
 
-    cmb_->getLensedCl(tt, ee, te, bb);
+    cmb_->getLensedClInto(lMaxLensed, &(clTT_[0]), (wantPol ? &(clEE_[0]) : NULL), (wantPol ? &(clTE_[0]) : NULL), (lowP_ ? &(clBB_[0]) : NULL));
 
     if(wantLens)
-        cmb_->getCl(NULL, NULL, NULL, &clPP_, NULL, NULL);
+    {
+        clPP_.resize(cmb_->lMax() + 1);
+        cmb_->getClInto(cmb_->lMax(), NULL, NULL, NULL, &(clPP_[0]));
+    }
+
+    ++clVersion_;
+}
+
+void
+PlanckLikelihood::swapCachedCls()
+{
+    ++clVersion_;
+    prevCosmoParams_.swap(cachedCosmoParams_);
+    clTT_.swap(cachedClTT_);
+    clEE_.swap(cachedClEE_);
+    clTE_.swap(cachedClTE_);
+    clBB_.swap(cachedClBB_);
+    clPP_.swap(cachedClPP_);
+    std::swap(haveLow_, cachedHaveLow_);
+    std::swap(prevLow_, cachedLow_);
+    std::swap(haveHigh_, cachedHaveHigh_);
+    std::swap(prevHigh_, cachedHigh_);
+    std::swap(haveLens_, cachedHaveLens_);
+    std::swap(prevLens_, cachedLens_);
 }
 
 void
@@ -403,17 +496,27 @@ PlanckLikelihood::setCls(const std::vector<double>* tt, const std::vector<double
         clPP_.clear();
 
     haveLow_ = false;
+    haveHigh_ = false;
     haveLens_ = false;
+    haveCosmoCls_ = false;
+    ++clVersion_;
 }
 
 void
 PlanckLikelihood::setAPlanck(double aPlanck)
 {
     check(aPlanck > 0, "");
+    if(aPlanck == aPlanck_)
+        return;
+
     aPlanck_ = aPlanck;
 
     haveLow_ = false;
+    haveHigh_ = false;
     haveLens_ = false;
+    cachedHaveLow_ = false;
+    cachedHaveHigh_ = false;
+    cachedHaveLens_ = false;
 }
 
 void
@@ -421,10 +524,17 @@ PlanckLikelihood::setAPol(double aPol)
 {
     check(lowP_ || highP_ || lensingP_, "polarization not initialized");
     check(aPol > 0, "");
+    if(aPol == aPol_)
+        return;
+
     aPol_ = aPol;
 
     haveLow_ = false;
+    haveHigh_ = false;
     haveLens_ = false;
+    cachedHaveLow_ = false;
+    cachedHaveHigh_ = false;
+    cachedHaveLens_ = false;
 }
 
 void
@@ -433,8 +543,14 @@ PlanckLikelihood::setHighExtraParams(const std::vector<double>& params)
     check(highT_, "high l likelihood not initialized");
     check(params.size() == (highP_ ? 32 : 15), "");
     check(highExtra_.size() == params.size(), "");
-    for(int i = 0; i < highExtra_.size(); ++i)
-        highExtra_[i] = params[i];
+    if(params == highExtra_)
+        return;
+
+    highExtra_ = params;
+
+    // only the high-l likelihood depends on these
+    haveHigh_ = false;
+    cachedHaveHigh_ = false;
 }
 
 void
@@ -443,8 +559,13 @@ PlanckLikelihood::setBeamLeakageParams(const std::vector<double>& params)
     check(highP_, "high l polarization likelihood not initialized");
     check(params.size() == 60, "");
     check(beamExtra_.size() == 60, "");
-    for(int i = 0; i < 60; ++i)
-        beamExtra_[i] = params[i];
+    if(params == beamExtra_)
+        return;
+
+    beamExtra_ = params;
+
+    haveHigh_ = false;
+    cachedHaveHigh_ = false;
 }
 
 void
@@ -453,7 +574,30 @@ PlanckLikelihood::setSZPrior(bool szPrior)
     check(high_, "high likelihood not initialized");
     check(!highLikeLite_, "using the lite version of high likelihood");
 
+    if(szPrior == szPrior_)
+        return;
+
     szPrior_ = szPrior;
+
+    haveHigh_ = false;
+    cachedHaveHigh_ = false;
+}
+
+void
+PlanckLikelihood::gatherCls(InputPlan& plan, std::vector<double>* input)
+{
+    // the Cl part of the input is still there if the Cl-s have not changed since the last time (for example if only the nuisance parameters have changed)
+    if(plan.clVersion == clVersion_)
+        return;
+
+    for(int i = 0; i < plan.spectra.size(); ++i)
+    {
+        const std::vector<double>& cl = *(plan.spectra[i]);
+        check(cl.size() >= plan.lMax[i] + 1, "Cl-s not computed");
+        check(plan.offsets[i] + plan.lMax[i] + 1 <= input->size(), "");
+        std::copy(cl.begin(), cl.begin() + plan.lMax[i] + 1, input->begin() + plan.offsets[i]);
+    }
+    plan.clVersion = clVersion_;
 }
 
 double
@@ -464,46 +608,16 @@ PlanckLikelihood::lowLike()
     if(haveLow_)
         return prevLow_;
 
-    check(!clTT_.empty(), "Cl-s not computed");
-    check(clTT_.size() >= lowLMax_ + 1, "");
-    check(!lowP_ || !clTE_.empty(), "Cl-s not computed");
-    check(!lowP_ || clTE_.size() >= lowLMax_ + 1, "");
-    check(!lowP_ || !clEE_.empty(), "Cl-s not computed");
-    check(!lowP_ || clEE_.size() >= lowLMax_ + 1, "");
-    check(!lowP_ || !clBB_.empty(), "Cl-s not computed");
-    check(!lowP_ || clBB_.size() >= lowLMax_ + 1, "");
-    check(input_.size() >= 4 * (lowLMax_ + 1) + 1, "");
+    COSMO_PROFILE_REGION("clik_low");
+
     output_screen2("Calculating low-l likelihood..." << std::endl);
 
     //Timer timer("PLANCK LOW-L LIKELIHOOD");
     //timer.start();
 
-    std::vector<double>::iterator it = input_.begin();
-    for(int l = 0; l <= lowLMax_; ++l)
-    {
-        *it = clTT_[l];
-        ++it;
-    }
-    if(lowP_)
-    {
-        for(int l = 0; l <= lowLMax_; ++l)
-        {
-            *it = clEE_[l];
-            ++it;
-        }
-        for(int l = 0; l <= lowLMax_; ++l)
-        {
-            *it = clBB_[l];
-            ++it;
-        }
-        for(int l = 0; l <= lowLMax_; ++l)
-        {
-            *it = clTE_[l];
-            ++it;
-        }
-    }
-    *it = aPlanck_;
-    const double l = clik_compute(low_, &(input_[0]), NULL);
+    gatherCls(lowPlan_, &lowInput_);
+    lowInput_[lowPlan_.extraOffset] = aPlanck_;
+    const double l = clik_compute(low_, &(lowInput_[0]), NULL);
 
     //timer.end();
 
@@ -520,37 +634,18 @@ PlanckLikelihood::highLike()
 {
     check(high_, "high l likelihood not initialized");
 
-    check(!clTT_.empty(), "Cl-s not computed");
-    check(clTT_.size() >= highLMax_ + 1, "");
-    check(!highP_ || !clTE_.empty(), "Cl-s not computed");
-    check(!highP_ || clTE_.size() >= highLMax_ + 1, "");
-    check(!highP_ || !clEE_.empty(), "Cl-s not computed");
-    check(!highP_ || clEE_.size() >= highLMax_ + 1, "");
-    check(input_.size() >= 3 * (highLMax_ + 1) + 100, "");
+    if(haveHigh_)
+        return prevHigh_;
+
+    COSMO_PROFILE_REGION("clik_high");
+
     output_screen2("Calculating high-l likelihood..." << std::endl);
 
     //Timer timer("PLANCK HIGH-L LIKELIHOOD");
     //timer.start();
 
-    std::vector<double>::iterator it = input_.begin();
-    for(int l = 0; l <= highLMax_; ++l)
-    {
-        *it = clTT_[l];
-        ++it;
-    }
-    if(highP_)
-    {
-        for(int l = 0; l <= highLMax_; ++l)
-        {
-            *it = clEE_[l];
-            ++it;
-        }
-        for(int l = 0; l <= highLMax_; ++l)
-        {
-            *it = clTE_[l];
-            ++it;
-        }
-    }
+    gatherCls(highPlan_, &highInput_);
+    std::vector<double>::iterator it = highInput_.begin() + highPlan_.extraOffset;
     if(!highLikeLite_)
     {
         if(highP_)
@@ -586,7 +681,7 @@ PlanckLikelihood::highLike()
         }
     }
     *it = aPlanck_;
-    double l = clik_compute(high_, &(input_[0]), NULL);
+    double l = clik_compute(high_, &(highInput_[0]), NULL);
 
     if(szPrior_)
     {
@@ -600,7 +695,11 @@ PlanckLikelihood::highLike()
 
     //timer.end();
     output_screen2("OK" << std::endl);
-    return -2.0 * l;
+
+    prevHigh_ = -2.0 * l;
+    haveHigh_ = true;
+
+    return prevHigh_;
 }
 
 double
@@ -611,46 +710,16 @@ PlanckLikelihood::lensingLike()
     if(haveLens_)
         return prevLens_;
 
-    check(!clPP_.empty(), "Cl-s not computed");
-    check(clPP_.size() >= lensLMax_ + 1, "");
-    check(!clTT_.empty(), "Cl-s not computed");
-    check(clTT_.size() >= lensLMax_ + 1, "");
-    check(!lensingP_ || !clTE_.empty(), "Cl-s not computed");
-    check(!lensingP_ || clTE_.size() >= lensLMax_ + 1, "");
-    check(!lensingP_ || !clEE_.empty(), "Cl-s not computed");
-    check(!lensingP_ || clEE_.size() >= lensLMax_ + 1, "");
-    check(input_.size() >= 4 * (lensLMax_ + 1) + 1, "");
+    COSMO_PROFILE_REGION("clik_lensing");
+
     output_screen2("Calculating lensing likelihood..." << std::endl);
 
     //Timer timer("PLANCK LENSING LIKELIHOOD");
     //timer.start();
 
-    std::vector<double>::iterator it = input_.begin();
-    for(int l = 0; l <= lensLMax_; ++l)
-    {
-        *it = clPP_[l];
-        ++it;
-    }
-    for(int l = 0; l <= lensLMax_; ++l)
-    {
-        *it = clTT_[l];
-        ++it;
-    }
-    if(lensingP_)
-    {
-        for(int l = 0; l <= lensLMax_; ++l)
-        {
-            *it = clEE_[l];
-            ++it;
-        }
-        for(int l = 0; l <= lensLMax_; ++l)
-        {
-            *it = clTE_[l];
-            ++it;
-        }
-    }
-    *it = aPlanck_;
-    const double l = clik_lensing_compute(static_cast<clik_lensing_object*>(lens_), &(input_[0]), NULL);
+    gatherCls(lensPlan_, &lensInput_);
+    lensInput_[lensPlan_.extraOffset] = aPlanck_;
+    const double l = clik_lensing_compute(static_cast<clik_lensing_object*>(lens_), &(lensInput_[0]), NULL);
 
     //timer.end();
     output_screen2("OK" << std::endl);
@@ -682,37 +751,114 @@ PlanckLikelihood::calculate(double* params, int nPar)
     
     check(nPar == (nModel + 1 + (highT_ && !highLikeLite_ ? (highP_ ? 33 : 15) : 0)), "");
 
-    for(int i = 0; i < nModel; ++i)
-        vModel_[i] = params[i];
+    // when only the nuisance parameters have changed the model does not need to be set again, and setCosmoParams will keep the spectra
+    bool cosmoChanged = false;
+    if(!haveModel_ || !std::equal(vModel_.begin(), vModel_.end(), params))
+    {
+        for(int i = 0; i < nModel; ++i)
+            vModel_[i] = params[i];
 
-    double badLike = 0;
-    const bool success = modelParams_->setAllParameters(vModel_, &badLike);
+        modelBadLike_ = 0;
+        modelSuccess_ = modelParams_->setParameters(&(vModel_[0]), nModel, &modelBadLike_);
+        haveModel_ = true;
+        cosmoChanged = true;
+    }
+
+    const double badLike = modelBadLike_;
+    const bool success = modelSuccess_;
     output_screen2("Planck likelihood evaluation: " << (success ? "GOOD REGION" : "BAD REGION") << std::endl);
     if(success)
     {
-        setCosmoParams(*modelParams_);
+        // fast path: the spectra set by the previous call are for the same model, so there is nothing to check
+        if(cosmoChanged || !haveCosmoCls_ || params_ != modelParams_)
+            setCosmoParams(*modelParams_);
         check(badLike == 0, "");
     }
 
-    setAPlanck(params[nModel]);
+    // only the components that depend on the changed nuisance parameters are recalculated (the others are remembered)
+    setNuisanceParams(params + nModel);
+
+    //timer.end();
+    if(success)
+        return likelihood();
+    else
+    {
+        check(badLike >= 0, "");
+        return 1e10 + badLike;
+    }
+}
+
+bool
+PlanckLikelihood::setLowPrecision(bool low)
+{
+    if(!cmb_)
+        return false;
+
+    if(low == cmb_->isLowPrecision())
+        return true;
+
+    cmb_->setLowPrecision(low);
+
+    // the spectra calculated with the other precision cannot be reused
+    haveCosmoCls_ = false;
+    haveCachedCls_ = false;
+    return true;
+}
+
+void
+PlanckLikelihood::setNuisanceParams(const double* params)
+{
+    setAPlanck(params[0]);
 
     if(highT_ && !highLikeLite_)
     {
         check(highExtra_.size() == (highP_ ? 32 : 15), "");
-        for(int i = 0; i < highExtra_.size(); ++i)
-            highExtra_[i] = params[nModel + 1 + i];
+        nuisance_.assign(params + 1, params + 1 + highExtra_.size());
+        setHighExtraParams(nuisance_);
 
         if(highP_)
-            setAPol(params[nModel + 33]);
+            setAPol(params[33]);
     }
+}
 
-    //timer.end();
-    if(success)
-        return likelihood();
-    else
+int
+PlanckLikelihood::numberOfComponents() const
+{
+    return (low_ ? 1 : 0) + (high_ ? 1 : 0) + (lens_ ? 1 : 0);
+}
+
+int
+PlanckLikelihood::componentId(int i) const
+{
+    check(i >= 0 && i < numberOfComponents(), "invalid component index " << i);
+
+    const void* components[3] = {low_, high_, lens_};
+    for(int id = 0; id < 3; ++id)
     {
-        check(badLike >= 0, "");
-        return 1e10 + badLike;
+        if(components[id] && i-- == 0)
+            return id;
+    }
+    return -1;
+}
+
+std::string
+PlanckLikelihood::componentName(int i) const
+{
+    const char* names[3] = {"low", "high", "lensing"};
+    return names[componentId(i)];
+}
+
+double
+PlanckLikelihood::componentLike(int i)
+{
+    switch(componentId(i))
+    {
+    case 0:
+        return lowLike();
+    case 1:
+        return highLike();
+    default:
+        return lensingLike();
     }
 }
 
@@ -720,9 +866,52 @@ double
 PlanckLikelihood::likelihood()
 {
     double l = 0;
-    if(low_) l += lowLike();
-    if(high_) l += highLike();
-    if(lens_) l += lensingLike();
+    if(!concurrent_)
+    {
+        if(low_) l += lowLike();
+        if(high_) l += highLike();
+        if(lens_) l += lensingLike();
+        return l;
+    }
+
+    double low = 0, high = 0, lens = 0;
+    std::string error;
+#pragma omp parallel sections default(shared)
+    {
+#pragma omp section
+        {
+            try {
+                if(low_) low = lowLike();
+            } catch (std::exception& e)
+            {
+                setComponentError(error, e);
+            }
+        }
+#pragma omp section
+        {
+            try {
+                if(high_) high = highLike();
+            } catch (std::exception& e)
+            {
+                setComponentError(error, e);
+            }
+        }
+#pragma omp section
+        {
+            try {
+                if(lens_) lens = lensingLike();
+            } catch (std::exception& e)
+            {
+                setComponentError(error, e);
+            }
+        }
+    }
+    throwIfComponentError(error);
+
+    // summed in the same order as above
+    l += low;
+    l += high;
+    l += lens;
     return l;
 }
 
@@ -775,7 +964,7 @@ struct PlanckLikelihoodContainer
 
 }
 
-PlanckLikelihood::PlanckLikelihood(bool useCommander, bool useCamspec, bool useLensing, bool usePol, bool useActSpt, bool includeTensors, double kPerDecade, bool useOwnCmb) : spectraNames_(6), haveCommander_(false), havePol_(false), haveLens_(false), commander_(NULL), camspec_(NULL), lens_(NULL), pol_(NULL), actspt_(NULL), cmb_(NULL), modelParams_(NULL)
+PlanckLikelihood::PlanckLikelihood(bool useCommander, bool useCamspec, bool useLensing, bool usePol, bool useActSpt, bool includeTensors, double kPerDecade, bool useOwnCmb) : spectraNames_(6), haveCommander_(false), havePol_(false), haveLens_(false), commander_(NULL), camspec_(NULL), lens_(NULL), pol_(NULL), actspt_(NULL), cmb_(NULL), modelParams_(NULL), haveModel_(false), modelSuccess_(false), modelBadLike_(0), haveCosmoCls_(false), haveCachedCls_(false), cachedHaveCommander_(false), cachedHavePol_(false), cachedHaveLens_(false), concurrent_(false)
 {
     check(useCommander || useCamspec || useLensing || usePol || useActSpt, "at least one likelihood must be specified");
 
@@ -806,11 +995,10 @@ PlanckLikelihood::PlanckLikelihood(bool useCommander, bool useCamspec, bool useL
     {
         std::stringstream commanderPath;
         commanderPath << planckLikeDir << "/commander_v4.1_lm49.clik";
-        char commanderPathCStr[100];
-        std::strcpy(commanderPathCStr, commanderPath.str().c_str());
+        std::vector<char> commanderPathCStr = stagedPath(commanderPath.str());
 
         if(!cont.commander)
-            cont.commander = clik_init(commanderPathCStr, NULL);
+            cont.commander = clik_init(&(commanderPathCStr[0]), NULL);
 
         commander_ = cont.commander;
 
@@ -842,11 +1030,10 @@ PlanckLikelihood::PlanckLikelihood(bool useCommander, bool useCamspec, bool useL
     {
         std::stringstream camspecPath;
         camspecPath << planckLikeDir << "/CAMspec_v6.2TN_2013_02_26_dist.clik";
-        char camspecPathCStr[100];
-        std::strcpy(camspecPathCStr, camspecPath.str().c_str());
+        std::vector<char> camspecPathCStr = stagedPath(camspecPath.str());
 
         if(!cont.camspec)
-            cont.camspec = clik_init(camspecPathCStr, NULL);
+            cont.camspec = clik_init(&(camspecPathCStr[0]), NULL);
 
         camspec_ = cont.camspec;
 
@@ -878,11 +1065,10 @@ PlanckLikelihood::PlanckLikelihood(bool useCommander, bool useCamspec, bool useL
     {
         std::stringstream polPath;
         polPath << planckLikeDir << "/lowlike_v222.clik";
-        char polPathCStr[100];
-        std::strcpy(polPathCStr, polPath.str().c_str());
+        std::vector<char> polPathCStr = stagedPath(polPath.str());
 
         if(!cont.pol)
-            cont.pol = clik_init(polPathCStr, NULL);
+            cont.pol = clik_init(&(polPathCStr[0]), NULL);
 
         pol_ = cont.pol;
 
@@ -914,11 +1100,10 @@ PlanckLikelihood::PlanckLikelihood(bool useCommander, bool useCamspec, bool useL
     {
         std::stringstream lensPath;
         lensPath << planckLikeDir << "/lensing_likelihood_v4_ref.clik_lensing";
-        char lensPathCStr[100];
-        std::strcpy(lensPathCStr, lensPath.str().c_str());
+        std::vector<char> lensPathCStr = stagedPath(lensPath.str());
 
         if(!cont.lens)
-            cont.lens = clik_lensing_init(lensPathCStr, NULL);
+            cont.lens = clik_lensing_init(&(lensPathCStr[0]), NULL);
 
         lens_ = cont.lens;
 
@@ -944,11 +1129,10 @@ PlanckLikelihood::PlanckLikelihood(bool useCommander, bool useCamspec, bool useL
     {
         std::stringstream actSptPath;
         actSptPath << planckLikeDir << "/actspt_2013_01.clik";
-        char actSptPathCStr[100];
-        std::strcpy(actSptPathCStr, actSptPath.str().c_str());
+        std::vector<char> actSptPathCStr = stagedPath(actSptPath.str());
 
         if(!cont.actspt)
-            cont.actspt = clik_init(actSptPathCStr, NULL);
+            cont.actspt = clik_init(&(actSptPathCStr[0]), NULL);
 
         actspt_ = cont.actspt;
 
@@ -996,34 +1180,32 @@ PlanckLikelihood::setCosmoParams(const CosmologicalParams& params)
 {
     check(cmb_, "own CMB must be used (set in constructor)");
 
-    bool needToCalculate = true;
     params.getAllParameters(currentCosmoParams_);
-    if(params.name() == prevCosmoParamsName_)
+    if(params.name() != prevCosmoParamsName_)
     {
-        check(currentCosmoParams_.size() == prevCosmoParams_.size(), "");
-        bool areParamsEqual = true;
-        for(int i = 0; i < prevCosmoParams_.size(); ++i)
-        {
-            if(prevCosmoParams_[i] != currentCosmoParams_[i])
-            {
-                areParamsEqual = false;
-                break;
-            }
-        }
-
-        needToCalculate = !areParamsEqual;
-    }
-    else
         prevCosmoParamsName_ = params.name();
+        haveCosmoCls_ = false;
+        haveCachedCls_ = false;
+    }
+
+    if(haveCosmoCls_ && currentCosmoParams_ == prevCosmoParams_)
+        return;
+
+    params_ = &params;
 
-    if(!needToCalculate)
+    // the spectra for the previous cosmological parameters are kept, so going back to them needs no recalculation
+    // this is the case for fast-slow sampling when a step in the cosmological parameters is rejected and is followed by steps in the nuisance parameters only
+    const bool useCached = (haveCachedCls_ && currentCosmoParams_ == cachedCosmoParams_);
+    swapCachedCls();
+    haveCachedCls_ = haveCosmoCls_;
+    haveCosmoCls_ = true;
+    if(useCached)
         return;
 
     haveCommander_ = false;
     havePol_ = false;
     haveLens_ = false;
 
-    params_ = &params;
     prevCosmoParams_.swap(currentCosmoParams_);
 
     bool wantT = true;
@@ -1042,6 +1224,22 @@ PlanckLikelihood::setCosmoParams(const CosmologicalParams& params)
         cmb_->getCl(NULL, NULL, NULL, &clPP_, NULL, NULL);
 }
 
+void
+PlanckLikelihood::swapCachedCls()
+{
+    prevCosmoParams_.swap(cachedCosmoParams_);
+    clTT_.swap(cachedClTT_);
+    clEE_.swap(cachedClEE_);
+    clTE_.swap(cachedClTE_);
+    clPP_.swap(cachedClPP_);
+    std::swap(haveCommander_, cachedHaveCommander_);
+    std::swap(prevCommander_, cachedCommander_);
+    std::swap(havePol_, cachedHavePol_);
+    std::swap(prevPol_, cachedPol_);
+    std::swap(haveLens_, cachedHaveLens_);
+    std::swap(prevLens_, cachedLens_);
+}
+
 void
 PlanckLikelihood::setCls(const std::vector<double>* tt, const std::vector<double>* ee, const std::vector<double>* te, const std::vector<double>* pp)
 {
@@ -1070,6 +1268,7 @@ PlanckLikelihood::setCls(const std::vector<double>* tt, const std::vector<double
     haveCommander_ = false;
     havePol_ = false;
     haveLens_ = false;
+    haveCosmoCls_ = false;
 }
 
 void
@@ -1134,6 +1333,8 @@ PlanckLikelihood::commanderLike()
     if(haveCommander_)
         return prevCommander_;
 
+    COSMO_PROFILE_REGION("clik_commander");
+
     check(!clTT_.empty(), "Cl-s not computed");
 
     check(clTT_.size() >= commanderLMax_ + 1, "");
@@ -1151,6 +1352,8 @@ PlanckLikelihood::commanderLike()
 double
 PlanckLikelihood::camspecLike()
 {
+    COSMO_PROFILE_REGION("clik_camspec");
+
     check(camspec_, "camspec not initialized");
     check(!clTT_.empty(), "Cl-s not computed");
     check(!camspecExtra_.empty(), "camspec extra parameters not initialized");
@@ -1171,6 +1374,8 @@ PlanckLikelihood::camspecLike()
 double
 PlanckLikelihood::polLike()
 {
+    COSMO_PROFILE_REGION("clik_pol");
+
     check(pol_, "pol not initialized");
     
     if(havePol_)
@@ -1208,6 +1413,8 @@ PlanckLikelihood::lensingLike()
     if(haveLens_)
         return prevLens_;
 
+    COSMO_PROFILE_REGION("clik_lensing");
+
     check(!clTT_.empty(), "Cl-s not computed");
     check(!clPP_.empty(), "Lensing Cl-s missing");
 
@@ -1231,6 +1438,8 @@ PlanckLikelihood::lensingLike()
 double
 PlanckLikelihood::actSptLike()
 {
+    COSMO_PROFILE_REGION("clik_actspt");
+
     check(actspt_, "actspt not initialized");
     check(!clTT_.empty(), "Cl-s not computed");
     check(!actSptExtra_.empty(), "actspt extra parameters not initialized");
@@ -1261,11 +1470,19 @@ PlanckLikelihood::calculate(double* params, int nPar)
     
     check(nPar == (nModel + (camspec_ ? 14 : 0) + (actspt_ ? 24 : 0)), "");
 
-    for(int i = 0; i < nModel; ++i)
-        vModel_[i] = params[i];
+    // when only the nuisance parameters have changed the model does not need to be set again, and setCosmoParams will keep the spectra
+    if(!haveModel_ || !std::equal(vModel_.begin(), vModel_.end(), params))
+    {
+        for(int i = 0; i < nModel; ++i)
+            vModel_[i] = params[i];
+
+        modelBadLike_ = 0;
+        modelSuccess_ = modelParams_->setParameters(&(vModel_[0]), nModel, &modelBadLike_);
+        haveModel_ = true;
+    }
 
-    double badLike = 0;
-    const bool success = modelParams_->setAllParameters(vModel_, &badLike);
+    const double badLike = modelBadLike_;
+    const bool success = modelSuccess_;
     output_screen2("Planck likelihood evaluation: " << (success ? "GOOD REGION" : "BAD REGION") << std::endl);
     if(success)
     {
@@ -1273,26 +1490,94 @@ PlanckLikelihood::calculate(double* params, int nPar)
         check(badLike == 0, "");
     }
 
+    setNuisanceParams(params + nModel);
+
+    //timer.end();
+    if(success)
+        return likelihood();
+    else
+    {
+        check(badLike >= 0, "");
+        return 1e10 + badLike;
+    }
+}
+
+bool
+PlanckLikelihood::setLowPrecision(bool low)
+{
+    if(!cmb_)
+        return false;
+
+    if(low == cmb_->isLowPrecision())
+        return true;
+
+    cmb_->setLowPrecision(low);
+
+    // the spectra calculated with the other precision cannot be reused
+    haveCosmoCls_ = false;
+    haveCachedCls_ = false;
+    return true;
+}
+
+void
+PlanckLikelihood::setNuisanceParams(const double* params)
+{
     if(camspec_)
     {
         camspecExtra_.clear();
-        camspecExtra_.insert(camspecExtra_.end(), params + nModel, params + nModel + 14);
+        camspecExtra_.insert(camspecExtra_.end(), params, params + 14);
     }
 
     if(actspt_)
     {
-        int paramShift = nModel + (camspec_ ? 14 : 0);
+        int paramShift = (camspec_ ? 14 : 0);
         actSptExtra_.clear();
         actSptExtra_.insert(actSptExtra_.end(), params + paramShift, params + paramShift + 24);
     }
+}
 
-    //timer.end();
-    if(success)
-        return likelihood();
-    else
+int
+PlanckLikelihood::numberOfComponents() const
+{
+    return (commander_ ? 1 : 0) + (camspec_ ? 1 : 0) + (pol_ ? 1 : 0) + (lens_ ? 1 : 0) + (actspt_ ? 1 : 0);
+}
+
+int
+PlanckLikelihood::componentId(int i) const
+{
+    check(i >= 0 && i < numberOfComponents(), "invalid component index " << i);
+
+    const void* components[5] = {commander_, camspec_, pol_, lens_, actspt_};
+    for(int id = 0; id < 5; ++id)
     {
-        check(badLike >= 0, "");
-        return 1e10 + badLike;
+        if(components[id] && i-- == 0)
+            return id;
+    }
+    return -1;
+}
+
+std::string
+PlanckLikelihood::componentName(int i) const
+{
+    const char* names[5] = {"commander", "camspec", "pol", "lensing", "actspt"};
+    return names[componentId(i)];
+}
+
+double
+PlanckLikelihood::componentLike(int i)
+{
+    switch(componentId(i))
+    {
+    case 0:
+        return commanderLike();
+    case 1:
+        return camspecLike();
+    case 2:
+        return polLike();
+    case 3:
+        return lensingLike();
+    default:
+        return actSptLike();
     }
 }
 
@@ -1301,20 +1586,60 @@ PlanckLikelihood::likelihood()
 {
     double l = 0;
 
-    if(commander_)
-        l += commanderLike();
+    if(!concurrent_)
+    {
+        if(commander_)
+            l += commanderLike();
 
-    if(camspec_)
-        l += camspecLike();
+        if(camspec_)
+            l += camspecLike();
 
-    if(pol_)
-        l += polLike();
+        if(pol_)
+            l += polLike();
 
-    if(lens_)
-        l += lensingLike();
+        if(lens_)
+            l += lensingLike();
 
-    if(actspt_)
-        l+= actSptLike();
+        if(actspt_)
+            l+= actSptLike();
+
+        return l;
+    }
+
+    // each component builds its own input vector
+    double res[5] = {0, 0, 0, 0, 0};
+    std::string error;
+#pragma omp parallel for default(shared) schedule(dynamic, 1)
+    for(int i = 0; i < 5; ++i)
+    {
+        try {
+            switch(i)
+            {
+            case 0:
+                if(commander_) res[i] = commanderLike();
+                break;
+            case 1:
+                if(camspec_) res[i] = camspecLike();
+                break;
+            case 2:
+                if(pol_) res[i] = polLike();
+                break;
+            case 3:
+                if(lens_) res[i] = lensingLike();
+                break;
+            default:
+                if(actspt_) res[i] = actSptLike();
+                break;
+            }
+        } catch (std::exception& e)
+        {
+            setComponentError(error, e);
+        }
+    }
+    throwIfComponentError(error);
+
+    for(int i = 0; i < 5; ++i)
+        l += res[i];
 
     return l;
 }
@@ -2,8 +2,16 @@
 
 #include <string>
 #include <sstream>
+#include <fstream>
 #include <iomanip>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
 #include <ctime>
+#include <map>
+#include <algorithm>
+
+#include <sys/stat.h>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -13,6 +21,101 @@
 namespace
 {
 
+std::string& emulatorStoreDir()
+{
+    static std::string dir(std::getenv("COSMO_EMULATOR_STORE") ? std::getenv("COSMO_EMULATOR_STORE") : "");
+    return dir;
+}
+
+// FNV-1a over the configuration text
+unsigned long
+hashConfiguration(const std::string& configuration)
+{
+    unsigned long h = 14695981039346656037UL;
+    for(unsigned long i = 0; i < configuration.size(); ++i)
+    {
+        h ^= (unsigned char) configuration[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// emulates the principal component coefficients of the first pca.dim() outputs of a function, the rest of the outputs are passed through
+class PlanckLikeFastCompressedFunc : public Math::RealFunctionMultiToMulti
+{
+public:
+    PlanckLikeFastCompressedFunc(const Math::RealFunctionMultiToMulti& f, const PrincipalComponents& pca, int nFull) : f_(f), pca_(pca), nFull_(nFull)
+    {
+        check(pca_.dim() <= nFull_, "");
+    }
+
+    ~PlanckLikeFastCompressedFunc() {}
+
+    // the full outputs already calculated for the samples used to learn the basis are reused instead of being calculated again
+    void addKnown(const std::vector<double>& x, const double* full) { known_[x].assign(full, full + nFull_); }
+    void clearKnown() { known_.clear(); }
+
+    virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+    {
+        const std::vector<double>* full = &full_;
+        std::map<std::vector<double>, std::vector<double> >::const_iterator it = known_.find(x);
+        if(it != known_.end())
+            full = &(it->second);
+        else
+            f_.evaluate(x, const_cast<std::vector<double>*>(&full_));
+
+        check(full->size() == nFull_, "");
+
+        const int nComp = pca_.nComponents();
+        const int dim = pca_.dim();
+        res->resize(nComp + nFull_ - dim);
+        pca_.compress(&((*full)[0]), &((*res)[0]));
+        for(int i = dim; i < nFull_; ++i)
+            (*res)[nComp + i - dim] = (*full)[i];
+    }
+
+private:
+    const Math::RealFunctionMultiToMulti& f_;
+    const PrincipalComponents& pca_;
+    const int nFull_;
+
+    std::vector<double> full_;
+    std::map<std::vector<double>, std::vector<double> > known_;
+};
+
+// reconstructs the full outputs from the coefficients and calls the original error function
+class PlanckLikeFastCompressedErrorFunc : public Math::RealFunctionMultiDim
+{
+public:
+    PlanckLikeFastCompressedErrorFunc(const Math::RealFunctionMultiDim& f, const PrincipalComponents& pca, int nFull) : f_(f), pca_(pca), nFull_(nFull), full_(nFull)
+    {
+        check(pca_.dim() <= nFull_, "");
+    }
+
+    ~PlanckLikeFastCompressedErrorFunc() {}
+
+    virtual double evaluate(const std::vector<double>& x) const
+    {
+        const int nComp = pca_.nComponents();
+        const int dim = pca_.dim();
+        check(x.size() == nComp + nFull_ - dim, "");
+
+        std::vector<double>& full = *const_cast<std::vector<double>*>(&full_);
+        pca_.decompress(&(x[0]), &(full[0]));
+        for(int i = dim; i < nFull_; ++i)
+            full[i] = x[nComp + i - dim];
+
+        return f_.evaluate(full);
+    }
+
+private:
+    const Math::RealFunctionMultiDim& f_;
+    const PrincipalComponents& pca_;
+    const int nFull_;
+
+    std::vector<double> full_;
+};
+
 #ifdef COSMO_PLANCK_15
 
 class PlanckLikeFastClFunc : public Math::RealFunctionMultiToMulti
@@ -480,7 +583,7 @@ private:
 
 #ifdef COSMO_PLANCK_15
 
-PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP, bool highT, bool highP, bool highLikeLite, bool lensingT, bool lensingP, bool includeTensors, double kPerDecade, double precision, unsigned long minCount) : cosmoParams_(params), lowT_(lowT), lowP_(lowP), highT_(highT), highP_(highP), highLikeLite_(highLikeLite), lensingT_(lensingT), lensingP_(lensingP), like_(lowT, lowP, highT, highP, highLikeLite, lensingT, lensingP, includeTensors, kPerDecade, !highT || highLikeLite), logError_(false), rand_(std::time(0), 0, 1)
+PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP, bool highT, bool highP, bool highLikeLite, bool lensingT, bool lensingP, bool includeTensors, double kPerDecade, double precision, unsigned long minCount, unsigned long compressionSamples, double compressionTolerance) : cosmoParams_(params), lowT_(lowT), lowP_(lowP), highT_(highT), highP_(highP), highLikeLite_(highLikeLite), lensingT_(lensingT), lensingP_(lensingP), like_(lowT, lowP, highT, highP, highLikeLite, lensingT, lensingP, includeTensors, kPerDecade, !highT || highLikeLite), layg_(NULL), fullFunc_(NULL), fullErrorFunc_(NULL), precision_(precision), minCount_(minCount), pca_(NULL), compressedFunc_(NULL), compressedErrorFunc_(NULL), logError_(false), rand_(std::time(0), 0, 1), lastApproximate_(false), lastRetries_(0)
 {
     check(!lowP || lowT, "cannot include lowP without lowT");
     check(!highP || highT, "cannot include highP without highT");
@@ -519,17 +622,31 @@ PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP,
         PlanckLikeFastClErrorFunc* errorFunc = new PlanckLikeFastClErrorFunc(&like_, lList_, usePol, useBB, useLensing, highP);
         errorFunc_ = errorFunc;
 
-        std::stringstream fileName;
-        fileName << "planck_fast_" << cosmoParams_->name() << ".dat";
+        fullFunc_ = f;
+        fullErrorFunc_ = errorFunc;
 
         int nCl = 1;
         if(usePol) nCl += 2;
         if(useBB) ++nCl;
         if(useLensing) ++nCl;
 
-        layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), nCl * lList_.size(), *f, *errorFunc, minCount, precision, fileName.str().c_str());
+        // the emulated Cl depend on the l values, the spectra included, and the settings of CMB
+        std::stringstream config;
+        config << "PlanckLikeFast 2015 Cl model " << cosmoParams_->name() << " nParams " << cosmoParamsVec_.size() << " lowT " << lowT << " lowP " << lowP << " highT " << highT << " highP " << highP << " lensingT " << lensingT << " lensingP " << lensingP << " tensors " << includeTensors << " kPerDecade " << std::setprecision(17) << kPerDecade << " lMax " << lMax_ << " nCl " << nCl << " l";
+        for(int i = 0; i < lList_.size(); ++i)
+            config << ' ' << lList_[i];
 
-        layg_->logIntoFile("planck_like_fast_log");
+        if(compressionSamples)
+        {
+            config << " compression " << compressionSamples << ' ' << compressionTolerance;
+            initCompression(storeFileName(config.str(), "_pca.dat"), cosmoParamsVec_.size(), nCl * lList_.size(), nCl * lList_.size(), compressionSamples, compressionTolerance);
+        }
+        else
+        {
+            layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), nCl * lList_.size(), *f, *errorFunc, minCount, precision, storeFileName(config.str(), ".dat").c_str());
+
+            layg_->logIntoFile("planck_like_fast_log");
+        }
 
         tt_.resize(lList_.size(), 0);
         clTT_.resize(lMax_ + 1, 0);
@@ -569,10 +686,11 @@ PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP,
         PlanckLikeFastErrorFunc *errorFunc = new PlanckLikeFastErrorFunc;
         errorFunc_ = errorFunc;
 
-        std::stringstream fileName;
-        fileName << "planck_fast_" << cosmoParams_->name() << ".dat";
+        // the likelihood itself is emulated
+        std::stringstream config;
+        config << "PlanckLikeFast 2015 likelihood model " << cosmoParams_->name() << " nParams " << cosmoParamsVec_.size() << " lowT " << lowT << " lowP " << lowP << " highT " << highT << " highP " << highP << " highLikeLite " << highLikeLite << " lensingT " << lensingT << " lensingP " << lensingP << " tensors " << includeTensors << " kPerDecade " << std::setprecision(17) << kPerDecade << " lMax " << lMax_;
 
-        layg_ = new LearnAsYouGo(cosmoParamsVec_.size() + 1, 1, *f, *errorFunc, minCount, precision, fileName.str().c_str());
+        layg_ = new LearnAsYouGo(cosmoParamsVec_.size() + 1, 1, *f, *errorFunc, minCount, precision, storeFileName(config.str(), ".dat").c_str());
 
         layg_->logIntoFile("planck_like_fast_log");
     }
@@ -581,6 +699,9 @@ PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP,
 PlanckLikeFast::~PlanckLikeFast()
 {
     delete layg_;
+    delete (PlanckLikeFastCompressedFunc*) compressedFunc_;
+    delete (PlanckLikeFastCompressedErrorFunc*) compressedErrorFunc_;
+    delete pca_;
     if(highT_ && !highLikeLite_)
     {
         delete (PlanckLikeFastClFunc*) func_;
@@ -629,10 +750,7 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
 
     if(highT_ && !highLikeLite_)
     {
-        if(exact)
-            layg_->evaluateExact(cosmoParamsVec_, &res_);
-        else
-            layg_->evaluate(cosmoParamsVec_, &res_, &error1Sigma, &error2Sigma, &errorMean, &errorVar);
+        const std::vector<double>& cl = evaluateFunc(cosmoParamsVec_, exact, &error1Sigma, &error2Sigma, &errorMean, &errorVar);
 
         const int lSize = lList_.size();
 
@@ -645,14 +763,14 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
         if(useBB) ++nCl;
         if(useLensing) ++nCl;
 
-        check(res_.size() == nCl * lSize, "");
+        check(cl.size() == nCl * lSize, "");
 
-        std::vector<double>::const_iterator it = res_.begin();
+        std::vector<double>::const_iterator it = cl.begin();
 
         check(tt_.size() == lSize, "");
         for(int i = 0; i < lSize; ++i)
         {
-            check(it < res_.end(), "");
+            check(it < cl.end(), "");
             const double l = lList_[i];
             (*const_cast<std::vector<double>* >(&tt_))[i] = *(it++) * l * (l + 1);
         }
@@ -664,14 +782,14 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
 
             for(int i = 0; i < lSize; ++i)
             {
-                check(it < res_.end(), "");
+                check(it < cl.end(), "");
                 const double l = lList_[i];
                 (*const_cast<std::vector<double>* >(&ee_))[i] = *(it++) * l * (l + 1);
             }
 
             for(int i = 0; i < lSize; ++i)
             {
-                check(it < res_.end(), "");
+                check(it < cl.end(), "");
                 const double l = lList_[i];
                 (*const_cast<std::vector<double>* >(&te_))[i] = *(it++) * l * (l + 1);
             }
@@ -683,7 +801,7 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
 
             for(int i = 0; i < lSize; ++i)
             {
-                check(it < res_.end(), "");
+                check(it < cl.end(), "");
                 const double l = lList_[i];
                 (*const_cast<std::vector<double>* >(&bb_))[i] = *(it++) * l * (l + 1);
             }
@@ -695,13 +813,13 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
 
             for(int i = 0; i < lSize; ++i)
             {
-                check(it < res_.end(), "");
+                check(it < cl.end(), "");
                 const double l = lList_[i];
                 (*const_cast<std::vector<double>* >(&pp_))[i] = *(it++) * l * l * l * l;
             }
         }
 
-        check(it == res_.end(), "");
+        check(it == cl.end(), "");
 
         Math::CubicSpline cs(lList_, tt_);
         const int lMax = like_.getLMax();
@@ -767,6 +885,7 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
             layg_->evaluateExact(allParamsVec_, &res_);
         else
             layg_->evaluate(allParamsVec_, &res_, &error1Sigma, &error2Sigma, &errorMean, &errorVar);
+        lastApproximate_ = (layg_->lastEvaluationPath() == LearnAsYouGo::APPROXIMATED);
 
         check(res_.size() == 1, "");
 
@@ -785,7 +904,7 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
 
 #else
 
-PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool useCommander, bool useCamspec, bool useLensing, bool usePolarization, bool useActSpt, bool includeTensors, double kPerDecade, double precision, unsigned long minCount) : cosmoParams_(params), useCommander_(useCommander), useCamspec_(useCamspec), useLensing_(useLensing), usePol_(usePolarization), useActSpt_(useActSpt), like_(useCommander, useCamspec, useLensing, usePolarization, useActSpt, includeTensors, kPerDecade, false), logError_(false), rand_(std::time(0), 0, 1)
+PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool useCommander, bool useCamspec, bool useLensing, bool usePolarization, bool useActSpt, bool includeTensors, double kPerDecade, double precision, unsigned long minCount, unsigned long compressionSamples, double compressionTolerance) : cosmoParams_(params), useCommander_(useCommander), useCamspec_(useCamspec), useLensing_(useLensing), usePol_(usePolarization), useActSpt_(useActSpt), like_(useCommander, useCamspec, useLensing, usePolarization, useActSpt, includeTensors, kPerDecade, false), layg_(NULL), fullFunc_(NULL), fullErrorFunc_(NULL), precision_(precision), minCount_(minCount), pca_(NULL), compressedFunc_(NULL), compressedErrorFunc_(NULL), logError_(false), rand_(std::time(0), 0, 1), lastApproximate_(false), lastRetries_(0)
 {
     check(useCommander_ || useCamspec_ || useLensing_ || usePol_ || useActSpt_, "at least one likelihood must be used");
 
@@ -815,12 +934,27 @@ PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool useCommander, bo
     PlanckLikeFastErrorFunc* errorFunc = new PlanckLikeFastErrorFunc(&like_, lList_, useCamspec_, useActSpt_);
     errorFunc_ = errorFunc;
 
-    std::stringstream fileName;
-    fileName << "planck_fast_" << cosmoParams_->name() << ".dat";
+    fullFunc_ = f;
+    fullErrorFunc_ = errorFunc;
 
-    layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), lList_.size() + 3, *f, *errorFunc, minCount, precision, fileName.str().c_str());
+    std::stringstream config;
+    config << "PlanckLikeFast 2013 model " << cosmoParams_->name() << " nParams " << cosmoParamsVec_.size() << " commander " << useCommander_ << " camspec " << useCamspec_ << " lensing " << useLensing_ << " polarization " << usePol_ << " actspt " << useActSpt_ << " tensors " << includeTensors << " kPerDecade " << std::setprecision(17) << kPerDecade << " lMax " << lMax_ << " l";
+    for(int i = 0; i < lList_.size(); ++i)
+        config << ' ' << lList_[i];
 
-    layg_->logIntoFile("planck_like_fast_log");
+    if(compressionSamples)
+    {
+        config << " compression " << compressionSamples << ' ' << compressionTolerance;
+
+        // only the Cl values are compressed, the last 3 outputs are likelihoods
+        initCompression(storeFileName(config.str(), "_pca.dat"), cosmoParamsVec_.size(), lList_.size() + 3, lList_.size(), compressionSamples, compressionTolerance);
+    }
+    else
+    {
+        layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), lList_.size() + 3, *f, *errorFunc, minCount, precision, storeFileName(config.str(), ".dat").c_str());
+
+        layg_->logIntoFile("planck_like_fast_log");
+    }
 
     cl_.resize(lList_.size(), 0);
     clTT_.resize(lMax_ + 1, 0);
@@ -829,6 +963,9 @@ PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool useCommander, bo
 PlanckLikeFast::~PlanckLikeFast()
 {
     delete layg_;
+    delete (PlanckLikeFastCompressedFunc*) compressedFunc_;
+    delete (PlanckLikeFastCompressedErrorFunc*) compressedErrorFunc_;
+    delete pca_;
     delete (PlanckLikeFastFunc*) func_;
     delete (PlanckLikeFastErrorFunc*) errorFunc_;
 
@@ -865,13 +1002,10 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
         return res;
     }
 
-    if(exact)
-        layg_->evaluateExact(cosmoParamsVec_, &res_);
-    else
-        layg_->evaluate(cosmoParamsVec_, &res_, &error1Sigma, &error2Sigma, &errorMean, &errorVar);
+    const std::vector<double>& cl = evaluateFunc(cosmoParamsVec_, exact, &error1Sigma, &error2Sigma, &errorMean, &errorVar);
 
     const int lSize = lList_.size();
-    double res = res_[lSize] + res_[lSize + 1] + res_[lSize + 2];
+    double res = cl[lSize] + cl[lSize + 1] + cl[lSize + 2];
 
     if(!useCamspec_ && !useActSpt_)
         return res;
@@ -882,7 +1016,7 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
     for(int i = 0; i < cl_.size(); ++i)
     {
         const double l = lList_[i];
-        cl_[i] = res_[i] * l * (l + 1);
+        cl_[i] = cl[i] * l * (l + 1);
     }
 
     Math::CubicSpline cs(lList_, cl_);
@@ -927,7 +1061,204 @@ void
 PlanckLikeFast::setPrecision(double p)
 {
     check(p > 0, "");
-    layg_->setPrecision(p);
+    precision_ = p;
+    if(layg_)
+        layg_->setPrecision(p);
+}
+
+void
+PlanckLikeFast::setEmulatorStore(const char* directory)
+{
+    emulatorStoreDir() = (directory ? directory : "");
+}
+
+std::string
+PlanckLikeFast::emulatorStore()
+{
+    return emulatorStoreDir();
+}
+
+std::string
+PlanckLikeFast::storeFileName(const std::string& configuration, const char* suffix) const
+{
+    const std::string& dir = emulatorStoreDir();
+    StandardException exc;
+    if(!dir.empty() && mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot create the emulator store directory " << dir << ": " << std::strerror(errno) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    std::stringstream name;
+    if(!dir.empty())
+        name << dir << '/';
+    name << "planck_fast_" << cosmoParams_->name() << '_' << std::hex << std::setw(16) << std::setfill('0') << hashConfiguration(configuration) << std::dec << suffix;
+
+    // the configuration is kept next to the file, also to catch the (unlikely) hash collisions
+    const std::string configFileName = name.str() + ".config";
+    std::ifstream in(configFileName.c_str());
+    if(in)
+    {
+        std::stringstream existing;
+        existing << in.rdbuf();
+        if(existing.str() != configuration + "\n")
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The emulator store file " << configFileName << " has a different configuration.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+    }
+    else if(CosmoMPI::create().isMaster())
+    {
+        std::ofstream out(configFileName.c_str());
+        out << configuration << std::endl;
+    }
+
+    output_screen("Emulator store file: " << name.str() << std::endl);
+    return name.str();
+}
+
+void
+PlanckLikeFast::initCompression(const std::string& fileName, int nIn, int nOut, int nCompressed, unsigned long compressionSamples, double compressionTolerance)
+{
+    check(compressionSamples >= 2, "need at least 2 samples to learn the compression, " << compressionSamples << " specified");
+    check(nCompressed > 0 && nCompressed <= nOut, "");
+
+    fileName_ = fileName;
+    nIn_ = nIn;
+    nOut_ = nOut;
+    nCompressed_ = nCompressed;
+    compressionSamples_ = compressionSamples;
+    compressionTolerance_ = compressionTolerance;
+
+    pca_ = new PrincipalComponents;
+
+    const std::string basisFileName = fileName_ + ".basis";
+    if(pca_->readFromFile(basisFileName.c_str(), nCompressed_))
+    {
+        output_screen("PlanckLikeFast: read the principal component basis from " << basisFileName << ", " << pca_->nComponents() << " components." << std::endl);
+        createCompressedLearnAsYouGo();
+    }
+}
+
+void
+PlanckLikeFast::createCompressedLearnAsYouGo()
+{
+    check(pca_, "");
+    check(!layg_, "");
+    check(pca_->nComponents() > 0, "the principal component basis is empty");
+
+    PlanckLikeFastCompressedFunc* f = new PlanckLikeFastCompressedFunc(*fullFunc_, *pca_, nOut_);
+    compressedFunc_ = f;
+
+    PlanckLikeFastCompressedErrorFunc* errorFunc = new PlanckLikeFastCompressedErrorFunc(*fullErrorFunc_, *pca_, nOut_);
+    compressedErrorFunc_ = errorFunc;
+
+    layg_ = new LearnAsYouGo(nIn_, pca_->nComponents() + nOut_ - nCompressed_, *f, *errorFunc, minCount_, precision_, fileName_.c_str());
+
+    layg_->logIntoFile("planck_like_fast_log");
+}
+
+const std::vector<double>&
+PlanckLikeFast::evaluateFunc(const std::vector<double>& x, bool exact, double* error1Sigma, double* error2Sigma, double* errorMean, double* errorVar)
+{
+    if(!pca_)
+    {
+        if(exact)
+            layg_->evaluateExact(x, &res_);
+        else
+            layg_->evaluate(x, &res_, error1Sigma, error2Sigma, errorMean, errorVar);
+        lastApproximate_ = (layg_->lastEvaluationPath() == LearnAsYouGo::APPROXIMATED);
+
+        return res_;
+    }
+
+    if(!layg_)
+    {
+        // still collecting the samples for learning the basis, the exact result is used
+        fullFunc_->evaluate(x, &fullRes_);
+        check(fullRes_.size() == nOut_, "");
+
+        samplePoints_.insert(samplePoints_.end(), x.begin(), x.end());
+        sampleData_.insert(sampleData_.end(), fullRes_.begin(), fullRes_.end());
+
+        const unsigned long nProcesses = CosmoMPI::create().numProcesses();
+        const unsigned long samplesPerProcess = (compressionSamples_ + nProcesses - 1) / nProcesses;
+        if(samplePoints_.size() == samplesPerProcess * nIn_)
+            learnCompression();
+
+        return fullRes_;
+    }
+
+    if(exact)
+        layg_->evaluateExact(x, &res_);
+    else
+        layg_->evaluate(x, &res_, error1Sigma, error2Sigma, errorMean, errorVar);
+    lastApproximate_ = (layg_->lastEvaluationPath() == LearnAsYouGo::APPROXIMATED);
+
+    const int nComp = pca_->nComponents();
+    check(res_.size() == nComp + nOut_ - nCompressed_, "");
+
+    fullRes_.resize(nOut_);
+    pca_->decompress(&(res_[0]), &(fullRes_[0]));
+    for(int i = nCompressed_; i < nOut_; ++i)
+        fullRes_[i] = res_[nComp + i - nCompressed_];
+
+    return fullRes_;
+}
+
+void
+PlanckLikeFast::learnCompression()
+{
+    check(pca_, "");
+    check(!layg_, "");
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = mpi.numProcesses();
+    const unsigned long samplesPerProcess = samplePoints_.size() / nIn_;
+    const unsigned long nSamples = samplesPerProcess * nProcesses;
+
+    // all of the processes learn the basis from all of the samples, so that they end up with the same basis
+    std::vector<double> allData(nSamples * nOut_, 0);
+    std::copy(sampleData_.begin(), sampleData_.end(), allData.begin() + mpi.processId() * samplesPerProcess * nOut_);
+    if(nProcesses > 1)
+    {
+        std::vector<double> sum(allData.size(), 0);
+        mpi.reduce(&(allData[0]), &(sum[0]), allData.size(), CosmoMPI::DOUBLE, CosmoMPI::SUM);
+        if(mpi.isMaster())
+            allData.swap(sum);
+        mpi.bcast(&(allData[0]), allData.size(), CosmoMPI::DOUBLE);
+    }
+
+    std::vector<double> samples(nSamples * nCompressed_);
+    for(unsigned long i = 0; i < nSamples; ++i)
+        std::copy(allData.begin() + i * nOut_, allData.begin() + i * nOut_ + nCompressed_, samples.begin() + i * nCompressed_);
+
+    pca_->learn(&(samples[0]), nSamples, nCompressed_, compressionTolerance_);
+
+    output_screen("PlanckLikeFast: learned the principal component basis from " << nSamples << " samples, " << nCompressed_ << " values are compressed into " << pca_->nComponents() << " components, the fraction of the variance lost is " << pca_->lostVariance() << "." << std::endl);
+
+    if(mpi.isMaster())
+        pca_->writeIntoFile((fileName_ + ".basis").c_str());
+
+    createCompressedLearnAsYouGo();
+
+    // the samples of this process become the first training points, the other processes send theirs
+    PlanckLikeFastCompressedFunc* f = (PlanckLikeFastCompressedFunc*) compressedFunc_;
+    std::vector<double> x(nIn_), res;
+    for(unsigned long i = 0; i < samplesPerProcess; ++i)
+    {
+        x.assign(samplePoints_.begin() + i * nIn_, samplePoints_.begin() + (i + 1) * nIn_);
+        f->addKnown(x, &(sampleData_[i * nOut_]));
+        layg_->evaluateExact(x, &res);
+    }
+    f->clearKnown();
+
+    std::vector<double>().swap(samplePoints_);
+    std::vector<double>().swap(sampleData_);
 }
  
 void
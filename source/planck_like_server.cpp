@@ -0,0 +1,66 @@
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <memory>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cosmological_params.hpp>
+#include <planck_like.hpp>
+#include <planck_like_fast.hpp>
+#include <likelihood_server.hpp>
+
+int main(int argc, char *argv[])
+{
+    try {
+        StandardException exc;
+        if(argc < 2)
+        {
+            std::string exceptionStr = "Usage:\n"
+                "planck_like_server <socket path> [fast [<precision>]]\n"
+                "Keeps the Planck likelihoods (with the default choice of the likelihoods and the LambdaCDM model) loaded and evaluates them for LikelihoodClient on the same machine, until a client asks the server to stop. With fast, PlanckLikeFast is used (reading its training set once), with the given precision (optional, default = 0.2).";
+            exc.set(exceptionStr);
+            throw exc;
+        }
+
+        const double pivot = 0.05;
+        LambdaCDMParams par(0.022, 0.12, 0.7, 0.1, 1.0, std::exp(3.0) / 1e10, pivot);
+
+        std::unique_ptr<Math::LikelihoodFunction> like;
+        if(argc > 2 && std::string(argv[2]) == "fast")
+        {
+            PlanckLikeFast* fast = new PlanckLikeFast(&par);
+            like.reset(fast);
+            if(argc > 3)
+            {
+                std::stringstream str(argv[3]);
+                double precision;
+                str >> precision;
+                if(!str || precision <= 0)
+                {
+                    std::stringstream exceptionStr;
+                    exceptionStr << "Invalid precision " << argv[3] << ".";
+                    exc.set(exceptionStr.str());
+                    throw exc;
+                }
+                fast->setPrecision(precision);
+            }
+        }
+        else
+        {
+            PlanckLikelihood* planck = new PlanckLikelihood;
+            like.reset(planck);
+            planck->setModelCosmoParams(&par);
+            output_screen("The parameters are " << planck->numberOfCosmoParams() << " cosmological and " << planck->numberOfNuisanceParams() << " nuisance parameters." << std::endl);
+        }
+
+        Math::LikelihoodServer server(*like, argv[1]);
+        server.run();
+    } catch (std::exception& e)
+    {
+        output_screen("EXCEPTION CAUGHT!!! " << std::endl << e.what() << std::endl);
+        output_screen("Terminating!" << std::endl);
+        return 1;
+    }
+    return 0;
+}
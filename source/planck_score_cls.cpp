@@ -0,0 +1,103 @@
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cosmo_mpi.hpp>
+#include <mapped_file.hpp>
+#include <planck_cl_scorer.hpp>
+
+namespace
+{
+
+// the default choice of the likelihoods, with the spectra given directly
+class DefaultPlanckFactory : public PlanckClScorer::Factory
+{
+public:
+    PlanckLikelihood* create(int worker)
+    {
+#ifdef COSMO_PLANCK_15
+        return new PlanckLikelihood(true, true, true, true, true, true, true, false, 100, false);
+#else
+        PlanckLikelihood* like = new PlanckLikelihood(true, true, true, false, false, false, 100, false);
+        like->setCamspecExtraParams(153, 54.9, 55.8, 4, 55.5, 4, 0.91, 0.63, 0.6, 1, 1, 0.1, 1, 0.3);
+        return like;
+#endif
+    }
+};
+
+int readPositive(const char* arg, const char* what)
+{
+    std::stringstream str(arg);
+    int n;
+    str >> n;
+    if(!str || n < 0)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Invalid " << what << " " << arg << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    return n;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    try {
+        StandardException exc;
+        if(argc < 3)
+        {
+            std::string exceptionStr = "Usage:\n"
+                "planck_score_cls <Cl set file> <output file> [<workers> [<chunk size>]]\n"
+                "Calculates the Planck likelihoods (with the default choice of the likelihoods) for all of the Cl sets in the file (see ClSetFile). The sets are split between the MPI processes, and each process scores its part on the given number of worker processes (optional, default = 0, the process itself), chunk size sets at a time (optional, default = 64).\n"
+                "The output file contains one line for each set: its index, -2ln(likelihood) in total, and for each likelihood component.";
+            exc.set(exceptionStr);
+            throw exc;
+        }
+
+        const int nWorkers = (argc > 3 ? readPositive(argv[3], "number of workers") : 0);
+        const int chunkSize = (argc > 4 ? readPositive(argv[4], "chunk size") : 64);
+
+        DefaultPlanckFactory factory;
+        PlanckClScorer scorer(factory, argv[1], nWorkers, chunkSize);
+        output_screen("Scoring " << scorer.size() << " Cl sets from " << argv[1] << "..." << std::endl);
+
+        std::vector<double> results;
+        scorer.scoreAll(&results);
+        output_screen("OK" << std::endl);
+
+        if(CosmoMPI::create().isMaster())
+        {
+            Math::ReplacingOutputFile file(argv[2]);
+            std::ofstream& out = file.stream();
+            out << "# set\ttotal";
+            for(int c = 0; c < scorer.numberOfComponents(); ++c)
+                out << '\t' << scorer.componentNames()[c];
+            out << std::endl;
+
+            out << std::setprecision(15);
+            const int m = scorer.resultSize();
+            for(unsigned long i = 0; i < scorer.size(); ++i)
+            {
+                out << i;
+                for(int j = 0; j < m; ++j)
+                    out << '\t' << results[i * m + j];
+                out << std::endl;
+            }
+            file.commit();
+            output_screen("The results are written into " << argv[2] << "." << std::endl);
+        }
+    } catch (std::exception& e)
+    {
+        output_screen("EXCEPTION CAUGHT!!! " << std::endl << e.what() << std::endl);
+        output_screen("Terminating!" << std::endl);
+        return 1;
+    }
+    return 0;
+}
+
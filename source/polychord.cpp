@@ -10,12 +10,13 @@
 #include <math_constants.hpp>
 #include <numerics.hpp>
 #include <polychord.hpp>
+#include <chain_file.hpp>
 
 #include <polychord_wrapper.h>
 
 bool PolyChord::running_ = false;
 
-PolyChord::PolyChord(int nPar, Math::LikelihoodFunction& like, int nLive, std::string fileRoot, int nRepeats) : n_(nPar), like_(like), nLive_(nLive), paramsStarting_(nPar, 0), paramNames_(nPar), paramsBest_(nPar, 0), paramsMean_(nPar, 0), paramsStd_(nPar, 0), paramsCurrent_(nPar, 0), priorTypes_(nPar, 1), priorBlocks_(nPar, 1), priorMins_(nPar, 0), priorMaxs_(nPar, 1), speeds_(nPar, 1), paramsFixed_(nPar, 0), isFixed_(nPar, false), fileRoot_(fileRoot), nRepeats_(nRepeats), fracs_(1, 1.0)
+PolyChord::PolyChord(int nPar, Math::LikelihoodFunction& like, int nLive, std::string fileRoot, int nRepeats) : n_(nPar), like_(like), nLive_(nLive), paramsStarting_(nPar, 0), paramNames_(nPar), paramsBest_(nPar, 0), paramsMean_(nPar, 0), paramsStd_(nPar, 0), paramsCurrent_(nPar, 0), priorTypes_(nPar, 1), priorBlocks_(nPar, 1), priorMins_(nPar, 0), priorMaxs_(nPar, 1), speeds_(nPar, 1), paramsFixed_(nPar, 0), isFixed_(nPar, false), fileRoot_(fileRoot), nRepeats_(nRepeats), fracs_(1, 1.0), binaryOutput_(false)
 {
 }
 
@@ -175,6 +176,21 @@ PolyChord::setParameterHierarchy(const std::vector<double>& fracs)
     fracs_ = fracs;
 }
 
+void
+PolyChord::setFastParameters(int firstFast, double slowFraction)
+{
+    check(firstFast > 0 && firstFast < n_, "invalid index " << firstFast << " for the first fast parameter");
+    check(slowFraction > 0 && slowFraction < 1, "invalid slow fraction " << slowFraction);
+
+    for(int i = 0; i < n_; ++i)
+        speeds_[i] = (i < firstFast ? 1 : 2);
+
+    std::vector<double> fracs(2);
+    fracs[0] = slowFraction;
+    fracs[1] = 1.0 - slowFraction;
+    setParameterHierarchy(fracs);
+}
+
 void
 PolyChord::run(bool res)
 {
@@ -284,4 +300,19 @@ PolyChord::run(bool res)
     output_screen_clean("Number of dead points = " << nDead << std::endl);
     output_screen_clean("Number of likelihood evaluations = " << nLike << std::endl);
     output_screen_clean("log(Z) + log(prior vol) = " << logZPlusLogP << std::endl);
+
+    if(binaryOutput_)
+    {
+        std::vector<std::string> names;
+        for(int i = 0; i < n_; ++i)
+        {
+            if(!isFixed_[i])
+                names.push_back(paramNames_[i]);
+        }
+
+        const std::string textFileName = fileRoot_ + ".txt";
+        const std::string binaryFileName = fileRoot_ + ".bin";
+        const unsigned long count = BinaryChain::convertFromText(textFileName.c_str(), binaryFileName.c_str(), names);
+        output_screen_clean("The chain with " << count << " elements has been written into " << binaryFileName << std::endl);
+    }
 }
@@ -0,0 +1,224 @@
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <matrix_impl.hpp>
+#include <mapped_file.hpp>
+#include <principal_components.hpp>
+
+namespace
+{
+
+const char principalComponentsMagic[8] = {'C', 'O', 'S', 'M', 'O', 'P', 'C', 'A'};
+
+} // namespace
+
+void
+PrincipalComponents::learn(const double* samples, unsigned long nSamples, int dim, double tolerance, int maxComponents)
+{
+    check(nSamples >= 2, "need at least 2 samples, " << nSamples << " specified");
+    check(dim > 0, "invalid dimension " << dim);
+    check(tolerance >= 0 && tolerance < 1, "invalid tolerance " << tolerance);
+    check(maxComponents >= 0, "invalid maximum number of components " << maxComponents);
+
+    dim_ = dim;
+    mean_.resize(dim_);
+    scale_.resize(dim_);
+
+    for(int j = 0; j < dim_; ++j)
+    {
+        double m = 0;
+        for(unsigned long i = 0; i < nSamples; ++i)
+            m += samples[i * dim_ + j];
+        m /= nSamples;
+
+        double v = 0;
+        for(unsigned long i = 0; i < nSamples; ++i)
+        {
+            const double d = samples[i * dim_ + j] - m;
+            v += d * d;
+        }
+        v /= nSamples;
+
+        mean_[j] = m;
+        // components that do not vary are not rescaled, they are reconstructed from the mean
+        scale_[j] = (v > 0 ? std::sqrt(v) : 1.0);
+    }
+
+    std::vector<double> z(nSamples * dim_);
+    for(unsigned long i = 0; i < nSamples; ++i)
+        for(int j = 0; j < dim_; ++j)
+            z[i * dim_ + j] = (samples[i * dim_ + j] - mean_[j]) / scale_[j];
+
+    // the covariance z^T z / n has the same non-zero eigenvalues as the gram matrix z z^T / n, which is much smaller when there are fewer samples than dimensions
+    const int n = nSamples;
+    Math::SymmetricMatrix<double> gram(n, n);
+#pragma omp parallel for default(shared) schedule(dynamic, 4)
+    for(int i = 0; i < n; ++i)
+    {
+        for(int k = i; k < n; ++k)
+        {
+            double s = 0;
+            for(int j = 0; j < dim_; ++j)
+                s += z[i * dim_ + j] * z[k * dim_ + j];
+            gram(i, k) = s / n;
+        }
+    }
+
+    // the number of components is found from the eigenvalues, and then only the eigenvectors of the kept ones are calculated
+    std::vector<double> eigenvals;
+    gram.getEigenvalues(&eigenvals);
+
+    double total = 0;
+    for(int i = 0; i < n; ++i)
+        total += std::max(eigenvals[i], 0.0);
+
+    nComponents_ = 0;
+    double kept = 0;
+    // the eigenvalues are in ascending order
+    for(int i = n - 1; i >= 0; --i)
+    {
+        if(total <= 0 || kept >= (1 - tolerance) * total)
+            break;
+        if(maxComponents && nComponents_ == maxComponents)
+            break;
+        if(eigenvals[i] <= 1e-14 * total)
+            break;
+        kept += eigenvals[i];
+        ++nComponents_;
+    }
+
+    lostVariance_ = (total > 0 ? (total - kept) / total : 0);
+
+    Math::Matrix<double> eigenvecs;
+    if(nComponents_ > 0)
+    {
+        std::vector<double> leading;
+        gram.getEigenRange(n - nComponents_, n - 1, &leading, &eigenvecs);
+        std::copy(leading.begin(), leading.end(), eigenvals.begin() + n - nComponents_);
+    }
+
+    basis_.resize(nComponents_ * dim_);
+    for(int c = 0; c < nComponents_; ++c)
+    {
+        const int e = n - 1 - c;
+        const int eVec = nComponents_ - 1 - c;
+        const double norm = 1.0 / std::sqrt(n * eigenvals[e]);
+        double* v = &(basis_[c * dim_]);
+        for(int j = 0; j < dim_; ++j)
+        {
+            double s = 0;
+            for(int i = 0; i < n; ++i)
+                s += z[i * dim_ + j] * eigenvecs(i, eVec);
+            v[j] = s * norm;
+        }
+
+        // fix the sign so that the largest element is positive, this makes the basis independent of the details of the eigensolver
+        int largest = 0;
+        for(int j = 1; j < dim_; ++j)
+        {
+            if(std::abs(v[j]) > std::abs(v[largest]))
+                largest = j;
+        }
+        if(v[largest] < 0)
+        {
+            for(int j = 0; j < dim_; ++j)
+                v[j] = -v[j];
+        }
+    }
+}
+
+void
+PrincipalComponents::compress(const double* x, double* c) const
+{
+    check(dim_ > 0, "the basis has not been learned");
+
+    for(int k = 0; k < nComponents_; ++k)
+    {
+        const double* v = &(basis_[k * dim_]);
+        double s = 0;
+        for(int j = 0; j < dim_; ++j)
+            s += v[j] * (x[j] - mean_[j]) / scale_[j];
+        c[k] = s;
+    }
+}
+
+void
+PrincipalComponents::decompress(const double* c, double* x) const
+{
+    check(dim_ > 0, "the basis has not been learned");
+
+    for(int j = 0; j < dim_; ++j)
+        x[j] = 0;
+
+    for(int k = 0; k < nComponents_; ++k)
+    {
+        const double* v = &(basis_[k * dim_]);
+        for(int j = 0; j < dim_; ++j)
+            x[j] += c[k] * v[j];
+    }
+
+    for(int j = 0; j < dim_; ++j)
+        x[j] = mean_[j] + scale_[j] * x[j];
+}
+
+void
+PrincipalComponents::writeIntoFile(const char* fileName) const
+{
+    check(dim_ > 0, "the basis has not been learned");
+
+    Math::ReplacingOutputFile file(fileName);
+    std::ofstream& out = file.stream();
+    out.write(principalComponentsMagic, 8);
+    out.write((const char*)(&dim_), sizeof(int));
+    out.write((const char*)(&nComponents_), sizeof(int));
+    out.write((const char*)(&lostVariance_), sizeof(double));
+    out.write((const char*)(&(mean_[0])), dim_ * sizeof(double));
+    out.write((const char*)(&(scale_[0])), dim_ * sizeof(double));
+    if(nComponents_)
+        out.write((const char*)(&(basis_[0])), nComponents_ * dim_ * sizeof(double));
+    file.commit();
+}
+
+bool
+PrincipalComponents::readFromFile(const char* fileName, int dim)
+{
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    if(!in)
+        return false;
+
+    char magic[8];
+    int d, nComponents;
+    double lostVariance;
+    in.read(magic, 8);
+    in.read((char*)(&d), sizeof(int));
+    in.read((char*)(&nComponents), sizeof(int));
+    in.read((char*)(&lostVariance), sizeof(double));
+
+    if(!in || std::memcmp(magic, principalComponentsMagic, 8) != 0 || d <= 0 || nComponents < 0 || nComponents > d || (dim && d != dim))
+        return false;
+
+    std::vector<double> mean(d), scale(d), basis(nComponents * d);
+    in.read((char*)(&(mean[0])), d * sizeof(double));
+    in.read((char*)(&(scale[0])), d * sizeof(double));
+    if(nComponents)
+        in.read((char*)(&(basis[0])), nComponents * d * sizeof(double));
+
+    if(!in)
+        return false;
+
+    dim_ = d;
+    nComponents_ = nComponents;
+    lostVariance_ = lostVariance;
+    mean_.swap(mean);
+    scale_.swap(scale);
+    basis_.swap(basis);
+    return true;
+}
+
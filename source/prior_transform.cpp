@@ -0,0 +1,249 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <math_constants.hpp>
+#include <prior_transform.hpp>
+
+namespace Math
+{
+
+namespace
+{
+
+// the cumulative distribution function of the standard normal distribution
+double normalCDF(double x)
+{
+    return 0.5 * std::erfc(-x / std::sqrt(2.0));
+}
+
+} // namespace
+
+double inverseNormalCDF(double p)
+{
+    check(p > 0 && p < 1, "invalid probability " << p);
+
+    // the rational approximation of P. J. Acklam (relative error 1.15e-9), followed by one step of Halley's method
+    const double a[6] = {-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+    const double b[5] = {-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01};
+    const double c[6] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+    const double d[4] = {7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00};
+    const double pLow = 0.02425;
+
+    double x;
+    if(p < pLow)
+    {
+        const double q = std::sqrt(-2 * std::log(p));
+        x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    }
+    else if(p <= 1 - pLow)
+    {
+        const double q = p - 0.5;
+        const double r = q * q;
+        x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+    }
+    else
+    {
+        const double q = std::sqrt(-2 * std::log(1 - p));
+        x = -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    }
+
+    const double e = normalCDF(x) - p;
+    const double u = e * std::sqrt(2 * Math::pi) * std::exp(x * x / 2);
+    return x - u / (1 + x * u / 2);
+}
+
+void
+PriorTransform::clear()
+{
+    type_ = NONE;
+    x_.clear();
+    slopes_.clear();
+}
+
+void
+PriorTransform::setUniform(double min, double max)
+{
+    check(max > min, "invalid range " << min << " to " << max);
+    clear();
+    type_ = UNIFORM;
+    a_ = min;
+    b_ = max - min;
+    min_ = min;
+    max_ = max;
+}
+
+void
+PriorTransform::setLogUniform(double min, double max)
+{
+    check(min > 0, "the lower bound must be positive for a log-uniform prior, " << min << " given");
+    check(max > min, "invalid range " << min << " to " << max);
+    clear();
+    type_ = LOG_UNIFORM;
+    a_ = min;
+    b_ = std::log(max / min);
+    min_ = min;
+    max_ = max;
+}
+
+void
+PriorTransform::setGauss(double mean, double sigma, double nSigma)
+{
+    check(sigma > 0, "invalid sigma " << sigma);
+    check(nSigma > 0, "invalid truncation " << nSigma);
+    clear();
+    type_ = GAUSSIAN;
+    a_ = mean;
+    b_ = sigma;
+    min_ = mean - nSigma * sigma;
+    max_ = mean + nSigma * sigma;
+    pLow_ = normalCDF(-nSigma);
+    pRange_ = normalCDF(nSigma) - pLow_;
+}
+
+double
+PriorTransform::gaussTransform(double u) const
+{
+    const double p = pLow_ + std::min(std::max(u, 0.0), 1.0) * pRange_;
+    if(p <= 0)
+        return min_;
+    if(p >= 1)
+        return max_;
+    return std::min(std::max(a_ + b_ * inverseNormalCDF(p), min_), max_);
+}
+
+void
+PriorTransform::setGeneral(double min, double max, const RealFunction& distrib, bool cubic, int nTable, int nIntegration)
+{
+    check(max > min, "invalid range " << min << " to " << max);
+    check(nTable > 0, "invalid table size " << nTable);
+    check(nIntegration > 0, "invalid number of integration intervals " << nIntegration);
+
+    // the cumulative distribution on a uniform grid in x, the distribution is evaluated in one batch
+    const double delta = (max - min) / nIntegration;
+    std::vector<double> xs(nIntegration + 1), ys(nIntegration + 1);
+    for(int j = 0; j <= nIntegration; ++j)
+        xs[j] = min + j * delta;
+    distrib.evaluate((unsigned long)(nIntegration + 1), &(xs[0]), &(ys[0]));
+
+    std::vector<double> cdf(nIntegration + 1);
+    cdf[0] = 0;
+    for(int j = 0; j <= nIntegration; ++j)
+    {
+        check(ys[j] >= 0, "the distribution is negative at " << xs[j]);
+        if(j > 0)
+            cdf[j] = cdf[j - 1] + delta * (ys[j] + ys[j - 1]) / 2;
+    }
+    check(cdf[nIntegration] > 0, "the distribution is 0 everywhere between " << min << " and " << max);
+    const double norm = 1.0 / cdf[nIntegration];
+    for(int j = 0; j <= nIntegration; ++j)
+        cdf[j] *= norm;
+
+    clear();
+    type_ = TABLE;
+    min_ = min;
+    max_ = max;
+    cubic_ = cubic;
+
+    // invert onto a uniform grid in u, the cumulative distribution is increasing so one pass is enough
+    x_.resize(nTable + 1);
+    x_[0] = min;
+    x_[nTable] = max;
+    int j = 0;
+    for(int k = 1; k < nTable; ++k)
+    {
+        const double t = double(k) / nTable;
+        while(j < nIntegration - 1 && cdf[j + 1] < t)
+            ++j;
+        const double dc = cdf[j + 1] - cdf[j];
+        x_[k] = min + delta * (j + (dc > 0 ? (t - cdf[j]) / dc : 0.0));
+        x_[k] = std::min(std::max(x_[k], x_[k - 1]), max);
+    }
+
+    if(!cubic_)
+        return;
+
+    // the derivatives of the monotonic cubic interpolation (Fritsch and Carlson), in units of the grid spacing
+    std::vector<double> secants(nTable);
+    for(int k = 0; k < nTable; ++k)
+        secants[k] = x_[k + 1] - x_[k];
+
+    // the end points use the one-sided three point derivatives, limited so that the interpolation stays monotonic
+    slopes_.resize(nTable + 1);
+    if(nTable == 1)
+    {
+        slopes_[0] = secants[0];
+        slopes_[1] = secants[0];
+    }
+    else
+    {
+        slopes_[0] = std::min(std::max((3 * secants[0] - secants[1]) / 2, 0.0), 3 * secants[0]);
+        slopes_[nTable] = std::min(std::max((3 * secants[nTable - 1] - secants[nTable - 2]) / 2, 0.0), 3 * secants[nTable - 1]);
+    }
+    for(int k = 1; k < nTable; ++k)
+        slopes_[k] = (secants[k - 1] * secants[k] > 0 ? (secants[k - 1] + secants[k]) / 2 : 0.0);
+
+    for(int k = 0; k < nTable; ++k)
+    {
+        if(secants[k] == 0)
+        {
+            slopes_[k] = 0;
+            slopes_[k + 1] = 0;
+            continue;
+        }
+        const double alpha = slopes_[k] / secants[k], beta = slopes_[k + 1] / secants[k];
+        const double s = alpha * alpha + beta * beta;
+        if(s > 9)
+        {
+            const double tau = 3 / std::sqrt(s);
+            slopes_[k] = tau * alpha * secants[k];
+            slopes_[k + 1] = tau * beta * secants[k];
+        }
+    }
+}
+
+double
+PriorTransform::tableTransform(double u) const
+{
+    const int n = int(x_.size()) - 1;
+    const double s = std::min(std::max(u, 0.0), 1.0) * n;
+    const int k = std::min(int(s), n - 1);
+    const double t = s - k;
+
+    if(!cubic_)
+        return x_[k] + t * (x_[k + 1] - x_[k]);
+
+    // cubic Hermite on the unit interval
+    const double t2 = t * t, t3 = t2 * t;
+    return (2 * t3 - 3 * t2 + 1) * x_[k] + (t3 - 2 * t2 + t) * slopes_[k] + (-2 * t3 + 3 * t2) * x_[k + 1] + (t3 - t2) * slopes_[k + 1];
+}
+
+void
+PriorTransform::transform(int n, const double* u, double* x) const
+{
+    check(type_ != NONE, "the prior has not been set");
+    check(n >= 0, "");
+
+    switch(type_)
+    {
+    case UNIFORM:
+        for(int i = 0; i < n; ++i)
+            x[i] = a_ + u[i] * b_;
+        break;
+    case LOG_UNIFORM:
+        for(int i = 0; i < n; ++i)
+            x[i] = a_ * std::exp(u[i] * b_);
+        break;
+    case GAUSSIAN:
+        for(int i = 0; i < n; ++i)
+            x[i] = gaussTransform(u[i]);
+        break;
+    default:
+        for(int i = 0; i < n; ++i)
+            x[i] = tableTransform(u[i]);
+        break;
+    }
+}
+
+} // namespace Math
@@ -0,0 +1,390 @@
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <atomic>
+#include <sstream>
+#include <iostream>
+#include <exception>
+#include <new>
+#include <algorithm>
+
+#include <unistd.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <process_likelihood_pool.hpp>
+
+namespace
+{
+
+// the control block in the shared memory, the atomics work between processes since they are lock free
+struct PoolControl
+{
+    std::atomic<long> next;
+    std::atomic<int> errorClaimed;
+    std::atomic<int> initFailed;
+    int nPoints;
+    int exact;
+    int shutdown;
+};
+
+const std::size_t errorSize = 1024;
+
+std::size_t aligned(std::size_t size)
+{
+    return (size + 63) / 64 * 64;
+}
+
+// only the first error message of a batch is kept
+void setError(PoolControl* control, char* error, const char* message)
+{
+    int expected = 0;
+    if(control->errorClaimed.compare_exchange_strong(expected, 1))
+    {
+        std::strncpy(error, message, errorSize - 1);
+        error[errorSize - 1] = '\0';
+    }
+}
+
+// waits on the semaphore, returns false if the timeout has passed
+bool semWait(sem_t* sem, bool timed)
+{
+    while(true)
+    {
+        int r;
+        if(timed)
+        {
+            timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if(ts.tv_nsec >= 1000000000)
+            {
+                ts.tv_nsec -= 1000000000;
+                ++ts.tv_sec;
+            }
+            r = sem_timedwait(sem, &ts);
+        }
+        else
+            r = sem_wait(sem);
+
+        if(r == 0)
+            return true;
+        if(errno == EINTR)
+            continue;
+        check(timed && errno == ETIMEDOUT, "waiting for a worker failed: " << std::strerror(errno));
+        return false;
+    }
+}
+
+} // namespace
+
+namespace Math
+{
+
+ProcessLikelihoodPool::ProcessLikelihoodPool(LikelihoodFactory& factory, int nPar, int nWorkers, int maxBatchSize) : n_(nPar), maxBatchSize_(maxBatchSize), nWorkers_(nWorkers), shared_(NULL), batchSize_(-1), broken_(false)
+{
+    check(n_ > 0, "invalid number of parameters " << n_);
+    check(nWorkers > 0, "invalid number of workers " << nWorkers);
+    check(maxBatchSize_ > 0, "invalid maximum batch size " << maxBatchSize_);
+    check(ATOMIC_LONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "the atomic operations must be lock free to be shared between processes");
+
+    const std::size_t controlSize = aligned(sizeof(PoolControl));
+    const std::size_t paramsSize = aligned(std::size_t(maxBatchSize_) * n_ * sizeof(double));
+    const std::size_t resultsSize = aligned(maxBatchSize_ * sizeof(double));
+    const std::size_t statusSize = aligned(maxBatchSize_ * sizeof(int));
+    const std::size_t semSize = aligned(nWorkers * sizeof(sem_t));
+    sharedSize_ = controlSize + paramsSize + resultsSize + statusSize + aligned(errorSize) + 2 * semSize;
+
+    // shared between the processes after the fork
+    shared_ = mmap(NULL, sharedSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared_ == MAP_FAILED)
+    {
+        shared_ = NULL;
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot allocate " << sharedSize_ << " bytes of shared memory: " << std::strerror(errno) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    char* p = (char*) shared_;
+    PoolControl* control = new(p) PoolControl;
+    control->next = 0;
+    control->errorClaimed = 0;
+    control->initFailed = 0;
+    control->nPoints = 0;
+    control->exact = 0;
+    control->shutdown = 0;
+    control_ = control;
+    p += controlSize;
+    params_ = (double*) p;
+    p += paramsSize;
+    results_ = (double*) p;
+    p += resultsSize;
+    status_ = (int*) p;
+    p += statusSize;
+    error_ = p;
+    error_[0] = '\0';
+    p += aligned(errorSize);
+    start_ = p;
+    p += semSize;
+    done_ = p;
+
+    for(int i = 0; i < nWorkers; ++i)
+    {
+        sem_init((sem_t*) start_ + i, 1, 0);
+        sem_init((sem_t*) done_ + i, 1, 0);
+    }
+
+    // the buffered output would be written by the workers too
+    std::cout.flush();
+    std::cerr.flush();
+
+    for(int i = 0; i < nWorkers; ++i)
+    {
+        const int pid = fork();
+        if(pid == 0)
+        {
+            // the worker never returns into the code of the parent
+            try {
+                runWorker(factory, i);
+            } catch (...)
+            {
+                _exit(2);
+            }
+            _exit(0);
+        }
+
+        if(pid < 0)
+        {
+            const int err = errno;
+            stopWorkers();
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Cannot create the worker process " << i << ": " << std::strerror(err) << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        pids_.push_back(pid);
+    }
+
+    // each worker reports once its likelihood is created
+    try {
+        for(int i = 0; i < nWorkers; ++i)
+            waitForWorker(i);
+    } catch (...)
+    {
+        stopWorkers();
+        throw;
+    }
+
+    if(control->initFailed != 0)
+    {
+        const std::string error = error_;
+        stopWorkers();
+        StandardException exc;
+        exc.set("Creating the likelihood of a worker failed: " + error);
+        throw exc;
+    }
+}
+
+ProcessLikelihoodPool::~ProcessLikelihoodPool()
+{
+    stopWorkers();
+}
+
+void
+ProcessLikelihoodPool::stopWorkers()
+{
+    if(!shared_)
+        return;
+
+    PoolControl* control = (PoolControl*) control_;
+    control->shutdown = 1;
+    for(int i = 0; i < pids_.size(); ++i)
+        sem_post((sem_t*) start_ + i);
+
+    for(int i = 0; i < pids_.size(); ++i)
+    {
+        if(pids_[i] <= 0)
+            continue;
+
+        // a broken pool may have a worker that is stuck
+        if(broken_)
+            kill(pids_[i], SIGKILL);
+        while(waitpid(pids_[i], NULL, 0) < 0 && errno == EINTR) {}
+    }
+    pids_.clear();
+
+    for(int i = 0; i < nWorkers_; ++i)
+    {
+        sem_destroy((sem_t*) start_ + i);
+        sem_destroy((sem_t*) done_ + i);
+    }
+
+    ((PoolControl*) control_)->~PoolControl();
+    munmap(shared_, sharedSize_);
+    shared_ = NULL;
+}
+
+void
+ProcessLikelihoodPool::runWorker(LikelihoodFactory& factory, int worker)
+{
+    PoolControl* control = (PoolControl*) control_;
+    sem_t* start = (sem_t*) start_ + worker;
+    sem_t* done = (sem_t*) done_ + worker;
+
+    LikelihoodFunction* like = NULL;
+    try {
+        like = factory.create(worker);
+        check(like, "the factory returned NULL");
+    } catch (std::exception& e)
+    {
+        setError(control, error_, e.what());
+        ++(control->initFailed);
+        sem_post(done);
+        return;
+    }
+    sem_post(done);
+
+    while(true)
+    {
+        semWait(start, false);
+        if(control->shutdown)
+            break;
+
+        while(true)
+        {
+            const long i = control->next.fetch_add(1);
+            if(i >= control->nPoints)
+                break;
+
+            try {
+                double* params = params_ + i * n_;
+                results_[i] = (control->exact ? like->calculateExact(params, n_) : like->calculate(params, n_));
+                status_[i] = 0;
+            } catch (std::exception& e)
+            {
+                status_[i] = 1;
+                setError(control, error_, e.what());
+            }
+        }
+        sem_post(done);
+    }
+
+    delete like;
+}
+
+void
+ProcessLikelihoodPool::waitForWorker(int worker)
+{
+    while(!semWait((sem_t*) done_ + worker, true))
+    {
+        int status;
+        if(waitpid(pids_[worker], &status, WNOHANG) == pids_[worker])
+        {
+            pids_[worker] = -1;
+            broken_ = true;
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "The worker process " << worker << " has died";
+            if(WIFSIGNALED(status))
+                exceptionStr << " (signal " << WTERMSIG(status) << ")";
+            exceptionStr << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+    }
+}
+
+double
+ProcessLikelihoodPool::calculate(double* params, int nParams)
+{
+    check(nParams == n_, "invalid number of parameters " << nParams << ", should be " << n_);
+    double res;
+    startBatch(params, 1, false);
+    finishBatch(&res);
+    return res;
+}
+
+double
+ProcessLikelihoodPool::calculateExact(double* params, int nParams)
+{
+    check(nParams == n_, "invalid number of parameters " << nParams << ", should be " << n_);
+    double res;
+    startBatch(params, 1, true);
+    finishBatch(&res);
+    return res;
+}
+
+void
+ProcessLikelihoodPool::calculateBatch(double* params, int nParams, int nPoints, double* results)
+{
+    check(nParams == n_, "invalid number of parameters " << nParams << ", should be " << n_);
+    check(nPoints >= 0, "invalid number of points " << nPoints);
+
+    for(int i = 0; i < nPoints; i += maxBatchSize_)
+    {
+        const int size = std::min(maxBatchSize_, nPoints - i);
+        startBatch(params + (long) i * n_, size, false);
+        finishBatch(results + i);
+    }
+}
+
+void
+ProcessLikelihoodPool::startBatch(const double* params, int nPoints, bool exact)
+{
+    check(!broken_, "the pool cannot be used after a worker has died");
+    check(batchSize_ < 0, "the previous batch has not been finished");
+    check(nPoints >= 0 && nPoints <= maxBatchSize_, "invalid number of points " << nPoints << ", must be at most " << maxBatchSize_);
+
+    PoolControl* control = (PoolControl*) control_;
+    std::memcpy(params_, params, std::size_t(nPoints) * n_ * sizeof(double));
+    control->nPoints = nPoints;
+    control->exact = (exact ? 1 : 0);
+    control->next = 0;
+    control->errorClaimed = 0;
+    error_[0] = '\0';
+
+    batchSize_ = nPoints;
+    if(nPoints == 0)
+        return;
+
+    for(int i = 0; i < pids_.size(); ++i)
+        sem_post((sem_t*) start_ + i);
+}
+
+void
+ProcessLikelihoodPool::finishBatch(double* results)
+{
+    check(batchSize_ >= 0, "no batch has been started");
+    const int nPoints = batchSize_;
+    batchSize_ = -1;
+    if(nPoints == 0)
+        return;
+
+    for(int i = 0; i < pids_.size(); ++i)
+        waitForWorker(i);
+
+    bool failed = false;
+    for(int i = 0; i < nPoints; ++i)
+    {
+        results[i] = results_[i];
+        if(status_[i] != 0)
+            failed = true;
+    }
+
+    if(failed)
+    {
+        StandardException exc;
+        exc.set(std::string("Likelihood worker: ") + error_);
+        throw exc;
+    }
+}
+
+} // namespace Math
+
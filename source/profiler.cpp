@@ -0,0 +1,343 @@
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <profiler.hpp>
+#include <memory_tracker.hpp>
+
+bool Profiler::enabled_ = false;
+
+struct Profiler::Node
+{
+    Node(const char* n, Node* p) : name(n), parent(p), calls(0), seconds(0) {}
+    ~Node()
+    {
+        for(int i = 0; i < children.size(); ++i)
+            delete children[i];
+    }
+
+    Node* child(const char* n)
+    {
+        // the same literal usually has the same pointer, compare the strings only if not found
+        for(int i = 0; i < children.size(); ++i)
+        {
+            if(children[i]->name == n)
+                return children[i];
+        }
+        for(int i = 0; i < children.size(); ++i)
+        {
+            if(std::strcmp(children[i]->name, n) == 0)
+                return children[i];
+        }
+        children.push_back(new Node(n, this));
+        return children.back();
+    }
+
+    const char* name;
+    Node* parent;
+    std::vector<Node*> children;
+    unsigned long calls;
+    double seconds;
+};
+
+struct Profiler::ThreadTree
+{
+    ThreadTree() : root("", NULL), current(&root) {}
+
+    Node root;
+    Node* current;
+};
+
+Profiler::~Profiler()
+{
+    for(int i = 0; i < trees_.size(); ++i)
+        delete trees_[i];
+}
+
+Profiler::ThreadTree*
+Profiler::threadTree()
+{
+    // the trees are owned by the profiler, so they outlive the threads and can be merged later
+    static thread_local ThreadTree* tree = NULL;
+    if(!tree)
+    {
+        tree = new ThreadTree;
+        std::lock_guard<std::mutex> lock(mutex_);
+        trees_.push_back(tree);
+    }
+    return tree;
+}
+
+void
+Profiler::Region::enter(const char* name)
+{
+    ThreadTree* tree = Profiler::instance().threadTree();
+    Node* node = tree->current->child(name);
+    tree->current = node;
+    node_ = node;
+    start_ = std::chrono::steady_clock::now();
+}
+
+void
+Profiler::Region::leave()
+{
+    const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    Node* node = (Node*) node_;
+    ++(node->calls);
+    node->seconds += t;
+
+    ThreadTree* tree = Profiler::instance().threadTree();
+    check(tree->current == node, "the profiler regions are not nested properly");
+    tree->current = node->parent;
+}
+
+void
+Profiler::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(int i = 0; i < trees_.size(); ++i)
+    {
+        check(trees_[i]->current == &(trees_[i]->root), "a profiler region is still active");
+
+        // the nodes are kept since the threads may still be pointing to them, only the statistics are cleared
+        std::vector<Node*> stack(1, &(trees_[i]->root));
+        while(!stack.empty())
+        {
+            Node* node = stack.back();
+            stack.pop_back();
+            node->calls = 0;
+            node->seconds = 0;
+            stack.insert(stack.end(), node->children.begin(), node->children.end());
+        }
+    }
+}
+
+namespace
+{
+
+// orders the paths as a depth first traversal of the tree, i.e. '/' comes before everything else
+bool pathLess(const std::string& a, const std::string& b)
+{
+    const int n = int(std::min(a.size(), b.size()));
+    for(int i = 0; i < n; ++i)
+    {
+        if(a[i] == b[i])
+            continue;
+        if(a[i] == '/')
+            return true;
+        if(b[i] == '/')
+            return false;
+        return a[i] < b[i];
+    }
+    return a.size() < b.size();
+}
+
+} // namespace
+
+void
+Profiler::collect(std::vector<Entry>* entries)
+{
+    std::map<std::string, std::pair<unsigned long, double> > stats;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::pair<std::string, const Node*> > stack;
+        for(int i = 0; i < trees_.size(); ++i)
+        {
+            const Node& root = trees_[i]->root;
+            for(int j = 0; j < root.children.size(); ++j)
+                stack.push_back(std::make_pair(std::string(root.children[j]->name), root.children[j]));
+        }
+
+        while(!stack.empty())
+        {
+            const std::string path = stack.back().first;
+            const Node* node = stack.back().second;
+            stack.pop_back();
+
+            if(node->calls)
+            {
+                std::pair<unsigned long, double>& s = stats[path];
+                s.first += node->calls;
+                s.second += node->seconds;
+            }
+
+            for(int j = 0; j < node->children.size(); ++j)
+                stack.push_back(std::make_pair(path + '/' + node->children[j]->name, node->children[j]));
+        }
+    }
+
+    entries->clear();
+    for(std::map<std::string, std::pair<unsigned long, double> >::const_iterator it = stats.begin(); it != stats.end(); ++it)
+    {
+        Entry e;
+        e.path = it->first;
+        e.calls = it->second.first;
+        e.seconds = it->second.second;
+        entries->push_back(e);
+    }
+}
+
+unsigned long
+Profiler::regionStats(const std::string& path, double* seconds)
+{
+    check(seconds, "");
+    std::vector<Entry> entries;
+    collect(&entries);
+    for(int i = 0; i < entries.size(); ++i)
+    {
+        if(entries[i].path == path)
+        {
+            *seconds = entries[i].seconds;
+            return entries[i].calls;
+        }
+    }
+    *seconds = 0;
+    return 0;
+}
+
+std::string
+Profiler::report(bool acrossProcesses)
+{
+    std::vector<Entry> entries;
+    collect(&entries);
+
+    std::vector<std::string> paths(entries.size());
+    for(int i = 0; i < entries.size(); ++i)
+        paths[i] = entries[i].path;
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProcesses = (acrossProcesses ? mpi.numProcesses() : 1);
+
+    if(nProcesses > 1)
+    {
+        // usually all of the processes have the same regions, in that case there is no need to exchange the paths
+        unsigned long h = 1469598103934665603UL;
+        for(int i = 0; i < paths.size(); ++i)
+        {
+            for(int j = 0; j <= paths[i].size(); ++j)
+                h = (h ^ (unsigned char)(paths[i].c_str()[j])) * 1099511628211UL;
+        }
+        long hash = long(h >> 1), hashMin, hashMax;
+        mpi.allreduce(&hash, &hashMin, 1, CosmoMPI::MIN);
+        mpi.allreduce(&hash, &hashMax, 1, CosmoMPI::MAX);
+
+        if(hashMin != hashMax)
+        {
+            // the union of the paths of all of the processes, each path followed by 0
+            std::vector<int> myChars;
+            for(int i = 0; i < paths.size(); ++i)
+            {
+                for(int j = 0; j <= paths[i].size(); ++j)
+                    myChars.push_back(int(paths[i].c_str()[j]));
+            }
+
+            int mySize = int(myChars.size());
+            std::vector<int> sizes(nProcesses), ones(nProcesses, 1), displs(nProcesses);
+            for(int i = 0; i < nProcesses; ++i)
+                displs[i] = i;
+            mpi.allgatherv(&mySize, 1, &(sizes[0]), &(ones[0]), &(displs[0]));
+
+            int total = 0;
+            for(int i = 0; i < nProcesses; ++i)
+            {
+                displs[i] = total;
+                total += sizes[i];
+            }
+
+            std::vector<int> allChars(total + 1);
+            mpi.allgatherv((myChars.empty() ? &(allChars[total]) : &(myChars[0])), mySize, &(allChars[0]), &(sizes[0]), &(displs[0]));
+
+            std::string current;
+            for(int i = 0; i < total; ++i)
+            {
+                if(allChars[i])
+                    current += char(allChars[i]);
+                else
+                {
+                    paths.push_back(current);
+                    current.clear();
+                }
+            }
+
+            std::sort(paths.begin(), paths.end());
+            paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        }
+    }
+
+    std::sort(paths.begin(), paths.end(), pathLess);
+
+    // the statistics of this process for all of the paths, 0 for the ones that this process does not have
+    const int n = int(paths.size());
+    std::vector<double> calls(n, 0), seconds(n, 0);
+    for(int i = 0; i < entries.size(); ++i)
+    {
+        const int k = int(std::lower_bound(paths.begin(), paths.end(), entries[i].path, pathLess) - paths.begin());
+        check(k < n && paths[k] == entries[i].path, "");
+        calls[k] = double(entries[i].calls);
+        seconds[k] = entries[i].seconds;
+    }
+
+    std::vector<double> totalCalls(calls), sumSeconds(seconds), minSeconds(seconds), maxSeconds(seconds);
+    if(nProcesses > 1 && n > 0)
+    {
+        mpi.allreduce(&(calls[0]), &(totalCalls[0]), n, CosmoMPI::SUM);
+        mpi.allreduce(&(seconds[0]), &(sumSeconds[0]), n, CosmoMPI::SUM);
+        mpi.allreduce(&(seconds[0]), &(minSeconds[0]), n, CosmoMPI::MIN);
+        mpi.allreduce(&(seconds[0]), &(maxSeconds[0]), n, CosmoMPI::MAX);
+    }
+
+    // the memory of the tracked data structures is reported together with the time
+    const std::string memory = MemoryTracker::instance().report(acrossProcesses);
+
+    if(acrossProcesses && !mpi.isMaster())
+        return std::string();
+
+    std::stringstream str;
+    str << "Profiler report";
+    if(nProcesses > 1)
+        str << " (" << nProcesses << " processes, time in seconds summed over the threads, min / mean / max over the processes)";
+    else
+        str << " (time in seconds summed over the threads)";
+    str << ":" << std::endl;
+    str << std::left << std::setw(40) << "region" << std::right << std::setw(14) << "calls" << std::setw(14) << "min" << std::setw(14) << "mean" << std::setw(14) << "max" << std::setw(10) << "% parent" << std::endl;
+
+    std::map<std::string, double> meanSeconds;
+    for(int i = 0; i < n; ++i)
+    {
+        const std::string& path = paths[i];
+        const double mean = sumSeconds[i] / nProcesses;
+        meanSeconds[path] = mean;
+
+        int depth = 0;
+        std::size_t slash = path.rfind('/');
+        for(int j = 0; j < path.size(); ++j)
+            depth += (path[j] == '/');
+        const std::string name = (slash == std::string::npos ? path : path.substr(slash + 1));
+
+        str << std::left << std::setw(40) << (std::string(2 * depth, ' ') + name) << std::right << std::setw(14) << (unsigned long)(totalCalls[i]) << std::setw(14) << minSeconds[i] << std::setw(14) << mean << std::setw(14) << maxSeconds[i];
+        if(slash != std::string::npos)
+        {
+            const std::map<std::string, double>::const_iterator parent = meanSeconds.find(path.substr(0, slash));
+            if(parent != meanSeconds.end() && parent->second > 0)
+                str << std::setw(10) << std::setprecision(3) << 100 * mean / parent->second << std::setprecision(6);
+        }
+        str << std::endl;
+    }
+
+    if(!memory.empty())
+        str << std::endl << memory;
+
+    return str.str();
+}
+
+void
+Profiler::printReport(bool acrossProcesses)
+{
+    const std::string r = report(acrossProcesses);
+    if(!r.empty())
+        output_screen(r);
+}
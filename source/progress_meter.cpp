@@ -0,0 +1,116 @@
+#include <progress_meter.hpp>
+
+namespace
+{
+
+// the number of operations at which a given percent is reached
+unsigned long percentCount(unsigned progress, unsigned long total)
+{
+    return (progress * total + 99) / 100;
+}
+
+} // namespace
+
+ProgressMeter::ProgressMeter(unsigned long total, bool acrossProcesses, double minInterval) : total_(total), completed_(0), next_(0), previous_(0), shown_(0), minInterval_(minInterval), lastShown_(std::chrono::steady_clock::now()), acrossProcesses_(acrossProcesses && CosmoMPI::create().numProcesses() > 1), globalTotal_(double(total)), roundsStarted_(0), roundsDone_(0), comm_(NULL)
+{
+    check(total_ > 0, "");
+    check(minInterval_ >= 0, "invalid interval " << minInterval_);
+    next_ = percentCount(1, total_);
+
+    if(acrossProcesses_)
+    {
+        // the reductions go on their own communicator, so they do not interfere with the other communications of the processes
+        CosmoMPI& mpi = CosmoMPI::create();
+        comm_ = mpi.split(0, mpi.processId());
+        double t = double(total_);
+        mpi.allreduce(&t, &globalTotal_, 1, CosmoMPI::DOUBLE, CosmoMPI::SUM, comm_);
+
+        roundSend_.resize(100);
+        roundRecv_.resize(100);
+        requests_.resize(100, NULL);
+    }
+
+    if(!acrossProcesses_ || CosmoMPI::create().isMaster())
+        output_screen_clean(shown_ << '%' << std::flush);
+}
+
+ProgressMeter::~ProgressMeter()
+{
+    if(acrossProcesses_)
+    {
+        // the other processes need all of the reductions, even if this meter has not reached its total
+        previous_ = 100;
+        progressRounds();
+        for(unsigned i = roundsDone_; i < roundsStarted_; ++i)
+            requests_[i]->wait();
+        roundsDone_ = roundsStarted_;
+        if(CosmoMPI::create().isMaster())
+            show((unsigned)(100.0 * roundRecv_[roundsDone_ - 1] / globalTotal_), true);
+    }
+
+    for(int i = 0; i < requests_.size(); ++i)
+        delete requests_[i];
+    delete comm_;
+}
+
+void
+ProgressMeter::update(unsigned long completed)
+{
+    // the last operation always gets to the display, otherwise there is no need to wait for another thread that is updating it
+    std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+    if(completed == total_)
+        lock.lock();
+    else if(!lock.try_lock())
+        return;
+
+    const unsigned progress = (unsigned)(100.0 * completed / total_);
+    if(progress > previous_)
+    {
+        previous_ = progress;
+        if(progress < 100)
+            next_.store(percentCount(progress + 1, total_), std::memory_order_relaxed);
+    }
+
+    if(acrossProcesses_)
+        progressRounds();
+    else
+        show(previous_, completed == total_);
+}
+
+void
+ProgressMeter::show(unsigned progress, bool force)
+{
+    if(progress <= shown_)
+        return;
+
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if(!force && std::chrono::duration<double>(now - lastShown_).count() < minInterval_)
+        return;
+
+    shown_ = progress;
+    lastShown_ = now;
+    output_screen_clean('\r' << shown_ << '%' << std::flush);
+
+    if(shown_ == 100)
+        output_screen_clean(std::endl);
+}
+
+void
+ProgressMeter::progressRounds()
+{
+    // every process starts one reduction for each percent of its own operations, 100 in total, in order
+    CosmoMPI& mpi = CosmoMPI::create();
+    for(; roundsStarted_ < previous_; ++roundsStarted_)
+    {
+        roundSend_[roundsStarted_] = double(completed_.load());
+        requests_[roundsStarted_] = new CosmoMPI::Request;
+        mpi.iallreduce(&(roundSend_[roundsStarted_]), &(roundRecv_[roundsStarted_]), 1, CosmoMPI::DOUBLE, CosmoMPI::SUM, requests_[roundsStarted_], comm_);
+    }
+
+    const unsigned done = roundsDone_;
+    while(roundsDone_ < roundsStarted_ && requests_[roundsDone_]->test())
+        ++roundsDone_;
+
+    if(roundsDone_ > done && mpi.isMaster())
+        show((unsigned)(100.0 * roundRecv_[roundsDone_ - 1] / globalTotal_), roundsDone_ == 100);
+}
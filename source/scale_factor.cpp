@@ -1,6 +1,5 @@
 #include <cmath>
 #include <algorithm>
-#include <set>
 
 #include <unit_conversions.hpp>
 #include <table_function.hpp>
@@ -9,14 +8,47 @@
 using namespace Phys;
 using namespace Math;
 
+namespace
+{
+
+// the number of points of the ln(a) and ln(t) grids
+const int gridSize = 8192;
+
+// a grid uniform in ln(x) between xMin and xMax, with the last point exactly ln(xMax)
+void
+logGrid(double xMin, double xMax, std::vector<double>& grid)
+{
+	const double start = std::log(xMin), end = std::log(xMax);
+	grid.resize(gridSize);
+	for(int i = 0; i < gridSize - 1; ++i)
+		grid[i] = start + (end - start) * i / (gridSize - 1);
+	grid[gridSize - 1] = end;
+}
+
+} // namespace
+
 void
 ScaleFactorFunctionClass::initialize(const CosmologicalParams& params)
 {
-	omegaM_ = params.getOmM();
-	omegaLambda_ = params.getOmLambda();
-	omegaR_ = params.getOmR();
-	omegaK_ = params.getOmK();
-	h0_ = params.getHubbleUnitless();
+	std::vector<double> p(5);
+	p[0] = params.getOmM();
+	p[1] = params.getOmLambda();
+	p[2] = params.getOmR();
+	p[3] = params.getOmK();
+	p[4] = params.getHubbleUnitless();
+
+	// the tables are already there for this cosmology
+	if(initialized_ && p == params_)
+		return;
+
+	initialized_ = false;
+	params_ = p;
+
+	omegaM_ = p[0];
+	omegaLambda_ = p[1];
+	omegaR_ = p[2];
+	omegaK_ = p[3];
+	h0_ = p[4];
 
 	const double deltaAFactor = double(1) / 10000;
 	const double aFactor = 1 - deltaAFactor;
@@ -26,59 +58,96 @@ ScaleFactorFunctionClass::initialize(const CosmologicalParams& params)
 	const double radiationDominationFactor = 10000;
 	
 	double a = 1;
-	double t = 0;
 	
 	output_screen2("Calculating the scale factor..." << std::endl);
-    
-    std::set<double> aSet;
+
+	// the time step and the scale factor at each step, going back from today
+	std::vector<double> deltaTBack(1, 0.0), aBack(1, a);
 	
-	TableFunctionType::iterator it = tableFunction_.insert(tableFunction_.end(), std::make_pair(t, a));
-    aSet.insert(a);
-    
 	while(omegaR_ / omegaM_ < radiationDominationFactor)
 	{
 		double aPrime = a * h0_ * std::sqrt(omegaLambda_ + omegaM_ + omegaR_ + omegaK_);
 		double deltaA = a * deltaAFactor;
 		double deltaT = deltaA / aPrime;
-		t += deltaT;
-		tableFunction_.insert(it, std::make_pair(t, a));
-        aSet.insert(a);
 		
 		a *= aFactor;
 		omegaM_ /= aFactorCube;
 		omegaR_ /= aFactorForth;
 		omegaK_ /= aFactorSq;
+
+		deltaTBack.push_back(deltaT);
+		aBack.push_back(a);
 	}
 	
-	output_screen2("Scale factor determined at " << tableFunction_.size() << " points!" << std::endl);
+	output_screen2("Scale factor determined at " << aBack.size() << " points!" << std::endl);
 	
-	tCut_ = t;
 	aCut_ = a;
 	
 	radDomCoeff_ = std::sqrt(2 * h0_ * aCut_ * aCut_ * std::sqrt(omegaR_));
 	tRadDom_ = 1 / (2 * h0_ * std::sqrt(omegaR_));
 
-	omegaM_ = params.getOmM();
-	omegaLambda_ = params.getOmLambda();
-	omegaR_ = params.getOmR();
-	omegaK_ = params.getOmK();
-	h0_ = params.getHubbleUnitless();
-    
-    double gf = growthFactorUnnormalizedRadDom(aCut_);
-    growthFactor_[aCut_] = gf;
-    double aPrev = aCut_;
-    double fPrev = growthFactorFunction(aPrev);
-    for(std::set<double>::const_iterator it = aSet.begin(); it != aSet.end(); ++it)
-    {
-        double aNew = *it;
-        double fNew = growthFactorFunction(aNew);
-        gf += (fNew + fPrev) * (aNew - aPrev) / 2;
-        growthFactor_[aNew] = gf;
-        aPrev = aNew;
-        fPrev = fNew;
-    }
-    
-    growthFactorCoefficient_ = 1 / gf;
+	omegaM_ = p[0];
+	omegaLambda_ = p[1];
+	omegaR_ = p[2];
+	omegaK_ = p[3];
+	h0_ = p[4];
+
+	// the cosmic time and the conformal time at each step, accumulated forward from aCut so that the early steps are not lost in rounding (the lookback time stops changing there)
+	const unsigned long m = aBack.size();
+	std::vector<double> cosmic(m), eta(m), growth(m);
+	cosmic[m - 1] = tRadDom_;
+	eta[m - 1] = 2 * std::sqrt(tRadDom_) / radDomCoeff_;
+	for(long k = long(m) - 2; k >= 0; --k)
+	{
+		cosmic[k] = cosmic[k + 1] + deltaTBack[k + 1];
+		eta[k] = eta[k + 1] + (1 / aBack[k] + 1 / aBack[k + 1]) / 2 * deltaTBack[k + 1];
+	}
+	eta0_ = eta[0];
+	tCut_ = cosmic[0] - tRadDom_;
+
+	// the unnormalized growth factor at each step
+	growth[m - 1] = growthFactorUnnormalizedRadDom(aCut_);
+	double fPrev = growthFactorFunction(aBack[m - 1]);
+	for(long k = long(m) - 2; k >= 0; --k)
+	{
+		const double f = growthFactorFunction(aBack[k]);
+		growth[k] = growth[k + 1] + (f + fPrev) * (aBack[k] - aBack[k + 1]) / 2;
+		fPrev = f;
+	}
+	growthFactorCoefficient_ = 1 / growth[0];
+
+	// the steps in increasing order of a (and t)
+	std::vector<double> logAStep(m), logTStep(m), logEtaStep(m), logGrowthStep(m);
+	for(unsigned long k = 0; k < m; ++k)
+	{
+		logAStep[k] = std::log(aBack[m - 1 - k]);
+		logTStep[k] = std::log(cosmic[m - 1 - k]);
+		logEtaStep[k] = std::log(eta[m - 1 - k]);
+		logGrowthStep[k] = std::log(growth[m - 1 - k]);
+	}
+
+	// resample on grids uniform in ln(a) and ln(t), so that the splines find the intervals directly
+	const FlatTableFunction<double, double> logTOfLogA(logAStep, logTStep), logEtaOfLogA(logAStep, logEtaStep), logGrowthOfLogA(logAStep, logGrowthStep);
+
+	std::vector<double> logA, logT(gridSize), logEta(gridSize), logGrowth(gridSize);
+	logGrid(aCut_, 1.0, logA);
+	logTOfLogA.evaluate(gridSize, &(logA[0]), &(logT[0]));
+	logEtaOfLogA.evaluate(gridSize, &(logA[0]), &(logEta[0]));
+	logGrowthOfLogA.evaluate(gridSize, &(logA[0]), &(logGrowth[0]));
+	logTOfLogA_ = CubicSpline(logA, logT);
+	logEtaOfLogA_ = CubicSpline(logA, logEta);
+	logGrowthOfLogA_ = CubicSpline(logA, logGrowth);
+
+	const FlatTableFunction<double, double> logAOfLogT(logTStep, logAStep), logEtaOfLogT(logTStep, logEtaStep);
+
+	std::vector<double> logTGrid, logAOfT(gridSize), logEtaOfT(gridSize);
+	logGrid(tRadDom_, cosmic[0], logTGrid);
+	logAOfLogT.evaluate(gridSize, &(logTGrid[0]), &(logAOfT[0]));
+	logEtaOfLogT.evaluate(gridSize, &(logTGrid[0]), &(logEtaOfT[0]));
+	logAOfLogT_ = CubicSpline(logTGrid, logAOfT);
+	logEtaOfLogT_ = CubicSpline(logTGrid, logEtaOfT);
+
+	initialized_ = true;
 }
 
 double
@@ -89,103 +158,133 @@ ScaleFactorFunctionClass::growthFactorFunction(double a) const
     return result;
 }
 
+void
+ScaleFactorFunctionClass::evaluateLogSpline(const Math::CubicSpline& spline, double xMin, double xMax, unsigned long n, const double* x, double* res)
+{
+	for(unsigned long i = 0; i < n; ++i)
+		res[i] = std::log(std::min(std::max(x[i], xMin), xMax));
+
+	spline.evaluate(n, res, res);
+
+	for(unsigned long i = 0; i < n; ++i)
+		res[i] = std::exp(res[i]);
+}
+
 double
 ScaleFactorFunctionClass::evaluate(double t) const
 {
-	check(!tableFunction_.empty(), "");
-	
-	if(t <= tRadDom_)
-		return radDomCoeff_ * std::sqrt(t);
-	
-	t = tRadDom_ + tCut_ - t;
-	check(t >= 0, "cannot evaluate at times bigger than the current age");
-	check(t <= tCut_, "");
-	
-	return tableFunction_.evaluate(t);
+	double res;
+	evaluate(1, &t, &res);
+	return res;
+}
+
+void
+ScaleFactorFunctionClass::evaluate(unsigned long n, const double* t, double* res) const
+{
+	check(initialized_, "");
+
+	for(unsigned long i = 0; i < n; ++i)
+	{
+		check(t[i] >= 0, "invalid time " << t[i]);
+		check(t[i] <= age(), "cannot evaluate at times bigger than the current age");
+	}
+
+	evaluateLogSpline(logAOfLogT_, tRadDom_, age(), n, t, res);
+
+	for(unsigned long i = 0; i < n; ++i)
+	{
+		if(t[i] <= tRadDom_)
+			res[i] = radDomCoeff_ * std::sqrt(t[i]);
+	}
 }
 
 double
 ScaleFactorFunctionClass::time(double a) const
 {
-	check(!tableFunction_.empty(), "");
-	check(a <= 1 && a >= 0, "invalid value for a");
-	
-	if(a <= aCut_)
-		return a * a / (radDomCoeff_ * radDomCoeff_);
-	
-	double t1 = 0, t2 = tCut_;
-	double tMiddle = (t1 + t2) / 2;
-	double currentA = tableFunction_.evaluate(tMiddle);
-	while(std::abs(a - currentA) / a > 0.0001)
+	double res;
+	time(1, &a, &res);
+	return res;
+}
+
+void
+ScaleFactorFunctionClass::time(unsigned long n, const double* a, double* res) const
+{
+	check(initialized_, "");
+
+	for(unsigned long i = 0; i < n; ++i)
 	{
-		if(a < currentA)
-			t1 = tMiddle;
-		else
-			t2 = tMiddle;
-		
-		tMiddle = (t1 + t2) / 2;
+		check(a[i] <= 1 && a[i] >= 0, "invalid value for a");
+	}
 
-		currentA = tableFunction_.evaluate(tMiddle);
+	evaluateLogSpline(logTOfLogA_, aCut_, 1.0, n, a, res);
+
+	for(unsigned long i = 0; i < n; ++i)
+	{
+		if(a[i] <= aCut_)
+			res[i] = a[i] * a[i] / (radDomCoeff_ * radDomCoeff_);
+		else
+			res[i] = std::min(res[i], age());
 	}
-	return tRadDom_ + tCut_ - tMiddle;	
+}
+
+double
+ScaleFactorFunctionClass::conformalTime(double t) const
+{
+	if(t <= tRadDom_)
+		return 2 / radDomCoeff_ * std::sqrt(t);
+
+	double res;
+	evaluateLogSpline(logEtaOfLogT_, tRadDom_, age(), 1, &t, &res);
+	return res;
 }
 
 double
 ScaleFactorFunctionClass::comovingDistance(double t1, double t2) const
 {
-	check(!tableFunction_.empty(), "");
+	check(initialized_, "");
 	
 	check(t1 < t2, "");
 	check(t1 >= 0, "");
 	check(t2 <= age(), t2 << ' ' << age());
-	
-	if(t2 <= tRadDom_)
-		return 2 / radDomCoeff_ * (std::sqrt(t2) - std::sqrt(t1));
-	
-	double res = 0;
-	if(t1 < tRadDom_)
+
+	return conformalTime(t2) - conformalTime(t1);
+}
+
+double
+ScaleFactorFunctionClass::comovingDistanceToRedshift(double z) const
+{
+	double res;
+	comovingDistanceToRedshift(1, &z, &res);
+	return res;
+}
+
+void
+ScaleFactorFunctionClass::comovingDistanceToRedshift(unsigned long n, const double* z, double* res) const
+{
+	check(initialized_, "");
+
+	for(unsigned long i = 0; i < n; ++i)
 	{
-		res = 2 / radDomCoeff_ * (std::sqrt(tRadDom_) - std::sqrt(t1));
-		t1 = tRadDom_;
+		check(z[i] >= 0, "invalid redshift " << z[i]);
+		res[i] = 1 / (1 + z[i]);
 	}
-	
-	t2 = age() - t2;
-	t1 = age() - t1;
-	
-	std::swap(t1, t2);
-	
-	if(t1 < 0)
-		t1 = 0;
-	if(t2 > tCut_)
-		t2 = tCut_;
-	
-	check(t1 <= t2, "");
 
-	TableFunctionType::const_iterator beg = tableFunction_.lower_bound(t1), end = tableFunction_.lower_bound(t2);
-	check(beg != tableFunction_.end(), "");
-	check(end != tableFunction_.end(), "");
-	if(beg == end)
-		return res;
-	
-	double f1 = 1 / (*beg).second;
-	double x1 = (*beg).first;
-	
-	while(beg++ != end)
+	evaluateLogSpline(logEtaOfLogA_, aCut_, 1.0, n, res, res);
+
+	for(unsigned long i = 0; i < n; ++i)
 	{
-		double f2 = 1 / (*beg).second;
-		double x2 = (*beg).first;
-		res += (f1 + f2) / 2 * (x2 - x1);
-		f1 = f2;
-		x1 = x2;
+		const double a = 1 / (1 + z[i]);
+
+		// the conformal time is 2 a / radDomCoeff_^2 in radiation domination
+		const double eta = (a <= aCut_ ? 2 * a / (radDomCoeff_ * radDomCoeff_) : res[i]);
+		res[i] = eta0_ - eta;
 	}
-	
-	return res;
 }
 
 double
 ScaleFactorFunctionClass::hubble(double a) const
 {
-	check(!tableFunction_.empty(), "");
+	check(!params_.empty(), "not initialized");
 	
 	check(a >= 0 && a <= 1, "invalid value");
 	
@@ -204,15 +303,28 @@ ScaleFactorFunctionClass::growthFactorUnnormalizedRadDom(double a) const
 double
 ScaleFactorFunctionClass::growthFactor(double a) const
 {
-    check(a >= 0 && a <= 1, "");
-    
-    double result;
-    if(a <= aCut_)
-        result = growthFactorUnnormalizedRadDom(a);
-    else
-        result = growthFactor_.evaluate(a);
-    
-    result *= (growthFactorCoefficient_ * hubble(a) / h0_);
-    return result;
+    double res;
+    growthFactor(1, &a, &res);
+    return res;
 }
 
+void
+ScaleFactorFunctionClass::growthFactor(unsigned long n, const double* a, double* res) const
+{
+    check(initialized_, "");
+
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        check(a[i] >= 0 && a[i] <= 1, "");
+    }
+
+    evaluateLogSpline(logGrowthOfLogA_, aCut_, 1.0, n, a, res);
+
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        if(a[i] <= aCut_)
+            res[i] = growthFactorUnnormalizedRadDom(a[i]);
+    
+        res[i] *= (growthFactorCoefficient_ * hubble(a[i]) / h0_);
+    }
+}
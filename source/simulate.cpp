@@ -4,6 +4,7 @@
 #include <sstream>
 #include <cmath>
 #include <ctime>
+#include <algorithm>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -17,6 +18,10 @@
 #include "xcomplex.h"
 #include "chealpix.h"
 
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
+
 int index(int l, int m, int lMin)
 {
     return l * (l + 1) / 2 + m - lMin * (lMin + 1) / 2;
@@ -27,18 +32,13 @@ int index1(int l, int m, int lMin)
     return l * (l + 1) + m - (lMin * (lMin + 1) - lMin);
 }
 
-void
-Simulate::simulateAlm(const WholeMatrix& wholeMatrix, Alm<xcomplex<double> >& alm, double* chi2, int* dof, time_t seed)
+AlmSimulator::AlmSimulator(const WholeMatrix& wholeMatrix) : lMin_(wholeMatrix.getLMin()), lMax_(wholeMatrix.getLMax())
 {
-    if(seed == 0)
-        seed = std::time(0);
-    
-    const int lMin = wholeMatrix.getLMin(), lMax = wholeMatrix.getLMax();
-    
-    
-    
+    const int lMin = lMin_, lMax = lMax_;
+
     //output_screen("Preparing the real and imaginary covariance matrices..." << std::endl);
     const int matrixSize = index(lMax, lMax, lMin) + 1;
+    size_ = matrixSize;
     Math::SymmetricMatrix<double> reMatrix(matrixSize, matrixSize), imMatrix(matrixSize, matrixSize);
     
     for(int l1 = lMin; l1 <= lMax; ++l1)
@@ -62,45 +62,101 @@ Simulate::simulateAlm(const WholeMatrix& wholeMatrix, Alm<xcomplex<double> >& al
     }
     //output_screen("OK" << std::endl);
     
-    std::vector<double> reEigenvalsRe, imEigenvalsRe;
-    Math::Matrix<double> reVecs, imVecs;
+    std::vector<double> reEigenvals, imEigenvals;
+    reMatrix.getEigen(&reEigenvals, &reFactor_, true);
+    imMatrix.getEigen(&imEigenvals, &imFactor_, true);
 
-    reMatrix.getEigen(&reEigenvalsRe, &reVecs, true);
-    imMatrix.getEigen(&imEigenvalsRe, &imVecs, true);
-    
-    //output_screen("Simulating with seed " << seed << "..." << std::endl)
-    Math::GaussianGenerator generator(seed, 0, 1);
-    
-    const xcomplex<double> zero(0, 0);
-    Math::Matrix<double> re(matrixSize, 1), im(matrixSize, 1), reRot(matrixSize, 1), imRot(matrixSize, 1);
-        
-    for(int i = 0; i < matrixSize; ++i)
+    // the factors are the eigenvectors times the square roots of the eigenvalues, the small negative eigenvalues from the roundoff are set to 0
+    for(int k = 0; k < matrixSize; ++k)
     {
-        re(i, 0) = generator.generate() * std::sqrt(reEigenvalsRe[i]);
-        im(i, 0) = generator.generate() * std::sqrt(imEigenvalsRe[i]);
+        const double reSqrt = std::sqrt(std::max(reEigenvals[k], 0.0));
+        const double imSqrt = std::sqrt(std::max(imEigenvals[k], 0.0));
+        for(int i = 0; i < matrixSize; ++i)
+        {
+            reFactor_(i, k) *= reSqrt;
+            imFactor_(i, k) *= imSqrt;
+        }
     }
-    
-    Math::Matrix<double>::multiplyMatrices(reVecs, re, &reRot);
-    Math::Matrix<double>::multiplyMatrices(imVecs, im, &imRot);
-    
-    alm.Set(lMax, lMax);
-    for(int l = 0; l <= lMax; ++l)
+}
+
+void
+AlmSimulator::setAlm(const Math::Matrix<double>& re, const Math::Matrix<double>& im, int col, Alm<xcomplex<double> >& alm) const
+{
+    const xcomplex<double> zero(0, 0);
+    alm.Set(lMax_, lMax_);
+    for(int l = 0; l <= lMax_; ++l)
     {
         for(int m = 0; m <= l; ++m)
         {
-            if(l < lMin)
+            if(l < lMin_)
             {
                 alm(l, m) = zero;
                 continue;
             }
             
-            const int i = index(l, m, lMin);
-            check(i < matrixSize, "");
+            const int i = index(l, m, lMin_);
+            check(i < size_, "");
             
-            alm(l, m) = xcomplex<double>(reRot(i, 0), imRot(i, 0));
+            alm(l, m) = xcomplex<double>(re(i, col), im(i, col));
         }
     }
-    //output_screen("OK" << std::endl);
+}
+
+void
+AlmSimulator::simulate(unsigned long seed, unsigned long realization, Alm<xcomplex<double> >& alm) const
+{
+    Math::GaussianStreamGenerator generator(seed, realization, 0, 1);
+    
+    Math::Matrix<double> re(size_, 1), im(size_, 1), reRot(size_, 1), imRot(size_, 1);
+    for(int i = 0; i < size_; ++i)
+    {
+        re(i, 0) = generator.generate();
+        im(i, 0) = generator.generate();
+    }
+    
+    Math::Matrix<double>::multiplyMatrices(reFactor_, re, &reRot);
+    Math::Matrix<double>::multiplyMatrices(imFactor_, im, &imRot);
+    setAlm(reRot, imRot, 0, alm);
+}
+
+void
+AlmSimulator::simulate(unsigned long seed, unsigned long first, int n, std::vector<Alm<xcomplex<double> > >& alms) const
+{
+    check(n > 0, "invalid number of realizations " << n);
+
+    // the random numbers of each realization are the same as in the single realization version, the realizations are the columns so all of them are rotated in one matrix product
+    Math::Matrix<double> re(size_, n), im(size_, n), reRot, imRot;
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int j = 0; j < n; ++j)
+    {
+        Math::GaussianStreamGenerator generator(seed, first + j, 0, 1);
+        for(int i = 0; i < size_; ++i)
+        {
+            re(i, j) = generator.generate();
+            im(i, j) = generator.generate();
+        }
+    }
+
+    Math::Matrix<double>::multiplyMatrices(reFactor_, re, &reRot);
+    Math::Matrix<double>::multiplyMatrices(imFactor_, im, &imRot);
+
+    alms.resize(n);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int j = 0; j < n; ++j)
+        setAlm(reRot, imRot, j, alms[j]);
+}
+
+void
+Simulate::simulateAlm(const WholeMatrix& wholeMatrix, Alm<xcomplex<double> >& alm, double* chi2, int* dof, time_t seed)
+{
+    if(seed == 0)
+        seed = std::time(0);
+    
+    const int lMin = wholeMatrix.getLMin(), lMax = wholeMatrix.getLMax();
+
+    //output_screen("Simulating with seed " << seed << "..." << std::endl)
+    AlmSimulator simulator(wholeMatrix);
+    simulator.simulate(seed, 0, alm);
     
     if(chi2 != NULL)
     {
@@ -159,12 +215,13 @@ Simulate::simulateAlm(const WholeMatrix& wholeMatrix, Alm<xcomplex<double> >& al
     }
 }
 
-void
-Simulate::simulateAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm, int lMax, time_t seed)
+namespace
 {
-    if(seed == 0)
-        seed = std::time(0);
 
+template<typename Generator>
+void
+fillAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm, int lMax, Generator& generator)
+{
     check(!cl.empty(), "");
 
     if(lMax == 0)
@@ -172,11 +229,6 @@ Simulate::simulateAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm
 
     check(lMax <= cl.size() - 1 || lMax >= 0, "invalid lMax = " << lMax);
     
-    const int lMin = 0;
-    
-    //output_screen("Simulating with seed " << seed << "..." << std::endl)
-    Math::GaussianGenerator generator(seed, 0, 1);
-    
     alm.Set(lMax, lMax);
     for(int l = 0; l <= lMax; ++l)
     {
@@ -188,7 +240,34 @@ Simulate::simulateAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm
             alm(l, m) = xcomplex<double>(re, im);
         }
     }
-    //output_screen("OK" << std::endl);
+}
+
+template<typename Generator>
+void
+fillWhiteNoise(Healpix_Map<double>& map, Generator& generator)
+{
+    for(long i = 0; i < map.Npix(); ++i)
+        map[i] = generator.generate();
+}
+
+} // namespace
+
+void
+Simulate::simulateAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm, int lMax, time_t seed)
+{
+    if(seed == 0)
+        seed = std::time(0);
+
+    //output_screen("Simulating with seed " << seed << "..." << std::endl)
+    Math::GaussianGenerator generator(seed, 0, 1);
+    fillAlm(cl, alm, lMax, generator);
+}
+
+void
+Simulate::simulateAlm(const std::vector<double>& cl, Alm<xcomplex<double> >& alm, int lMax, unsigned long seed, unsigned long stream)
+{
+    Math::GaussianStreamGenerator generator(seed, stream, 0, 1);
+    fillAlm(cl, alm, lMax, generator);
 }
 
 void
@@ -198,7 +277,76 @@ Simulate::simulateWhiteNoise(Healpix_Map<double>& map, double noiseVal, time_t s
         seed = std::time(0);
 
     Math::GaussianGenerator generator(seed, 0, noiseVal);
-    for(long i = 0; i < map.Npix(); ++i)
-        map[i] = generator.generate();
+    fillWhiteNoise(map, generator);
 }
 
+void
+Simulate::simulateWhiteNoise(Healpix_Map<double>& map, double noiseVal, unsigned long seed, unsigned long stream)
+{
+    Math::GaussianStreamGenerator generator(seed, stream, 0, noiseVal);
+    fillWhiteNoise(map, generator);
+}
+
+void
+Simulate::simulateWhiteNoise(long nSide, Healpix_Ordering_Scheme scheme, double noiseVal, unsigned long seed, unsigned long first, int n, std::vector<Healpix_Map<double> >& maps)
+{
+    check(nSide > 0, "invalid nSide " << nSide);
+    check(n > 0, "invalid number of realizations " << n);
+
+    maps.resize(n);
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int j = 0; j < n; ++j)
+    {
+        if(maps[j].Nside() != nSide || maps[j].Scheme() != scheme)
+            maps[j].SetNside(nSide, scheme);
+        simulateWhiteNoise(maps[j], noiseVal, seed, first + j);
+    }
+}
+
+void
+Simulate::simulateWhiteNoise(long nSide, Healpix_Ordering_Scheme scheme, double noiseVal, unsigned long seed, unsigned long first, unsigned long n, SimulatedMapConsumer& consumer, int nThreads)
+{
+    check(nSide > 0, "invalid nSide " << nSide);
+    check(nThreads >= 0, "invalid number of threads " << nThreads);
+
+#ifdef COSMO_OMP
+    if(nThreads == 0)
+        nThreads = omp_get_max_threads();
+#else
+    nThreads = 1;
+#endif
+
+    // the exceptions thrown by the consumer are passed on from the parallel region
+    std::string error;
+
+#pragma omp parallel default(shared) num_threads(nThreads)
+    {
+        Healpix_Map<double> map;
+        map.SetNside(nSide, scheme);
+
+#pragma omp for schedule(dynamic)
+        for(long j = 0; j < (long) n; ++j)
+        {
+            try
+            {
+                simulateWhiteNoise(map, noiseVal, seed, first + j);
+                consumer.consume(first + j, map);
+            }
+            catch (std::exception& e)
+            {
+#pragma omp critical (simulate_white_noise_error)
+                {
+                    if(error.empty())
+                        error = e.what();
+                }
+            }
+        }
+    }
+
+    if(!error.empty())
+    {
+        StandardException exc;
+        exc.set(error);
+        throw exc;
+    }
+}
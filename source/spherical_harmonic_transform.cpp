@@ -0,0 +1,213 @@
+#include <vector>
+
+#include <macros.hpp>
+#include <spherical_harmonic_transform.hpp>
+
+#include <alm_healpix_tools.h>
+#include <sharp_lowlevel.h>
+#include <sharp_geomhelpers.h>
+#include <sharp_almhelpers.h>
+
+namespace
+{
+
+// runs n libsharp transforms of spin 0 at once, or one of spin 2 if spin is 2 (then alms and maps have two components)
+void sharpExecute(sharp_jobtype type, int spin, void* geometry, void* almInfo, int n, const std::vector<void*>& alms, const std::vector<void*>& maps, bool add)
+{
+    check(alms.size() == (spin == 0 ? n : 2 * n), "");
+    check(maps.size() == alms.size(), "");
+
+    const int flags = SHARP_DP | (add ? SHARP_ADD : 0);
+    sharp_execute(type, spin, const_cast<void**>(&(alms[0])), const_cast<void**>(&(maps[0])), (const sharp_geom_info*) geometry, (const sharp_alm_info*) almInfo, n, flags, NULL, NULL);
+}
+
+} // namespace
+
+SphericalHarmonicTransform::SphericalHarmonicTransform(long nSide, int lMax, const std::vector<double>* ringWeights, Backend backend) : nSide_(nSide), lMax_(lMax), backend_(backend), weights_(2 * nSide, 1.0), geometry_(NULL), almInfo_(NULL)
+{
+    check(nSide_ > 0, "invalid nSide " << nSide_);
+    check(lMax_ >= 0, "invalid lMax " << lMax_);
+    check(backend_ >= 0 && backend_ < BACKEND_MAX, "invalid backend " << backend_);
+
+    if(ringWeights)
+    {
+        check(ringWeights->size() == 2 * nSide_, "the ring weights must have 2 * nSide = " << 2 * nSide_ << " values, " << ringWeights->size() << " given");
+        for(long i = 0; i < 2 * nSide_; ++i)
+            weights_[i] = (*ringWeights)[i];
+    }
+
+    if(backend_ == SHARP_BACKEND)
+    {
+        sharp_geom_info* geometry;
+        sharp_make_weighted_healpix_geom_info(int(nSide_), 1, &(weights_[0]), &geometry);
+        geometry_ = geometry;
+
+        sharp_alm_info* almInfo;
+        sharp_make_triangular_alm_info(lMax_, lMax_, 1, &almInfo);
+        almInfo_ = almInfo;
+    }
+}
+
+SphericalHarmonicTransform::~SphericalHarmonicTransform()
+{
+    if(geometry_)
+        sharp_destroy_geom_info((sharp_geom_info*) geometry_);
+    if(almInfo_)
+        sharp_destroy_alm_info((sharp_alm_info*) almInfo_);
+}
+
+void
+SphericalHarmonicTransform::checkMap(const Healpix_Map<double>& map) const
+{
+    check(map.Nside() == nSide_, "the map has nSide " << map.Nside() << ", expected " << nSide_);
+    check(map.Scheme() == RING, "the map must be in the RING scheme");
+}
+
+void
+SphericalHarmonicTransform::checkAlm(const Alm<xcomplex<double> >& alm) const
+{
+    check(alm.Lmax() == lMax_ && alm.Mmax() == lMax_, "the alm has lMax " << alm.Lmax() << " and mMax " << alm.Mmax() << ", expected " << lMax_);
+}
+
+void
+SphericalHarmonicTransform::scaleAlm(Alm<xcomplex<double> >& alm, double weight) const
+{
+    if(weight == 1)
+        return;
+
+    for(int m = 0; m <= lMax_; ++m)
+        for(int l = m; l <= lMax_; ++l)
+            alm(l, m) *= weight;
+}
+
+void
+SphericalHarmonicTransform::alm2map(const Alm<xcomplex<double> >& alm, Healpix_Map<double>& map) const
+{
+    const Alm<xcomplex<double> >* alms[1] = {&alm};
+    Healpix_Map<double>* maps[1] = {&map};
+    alm2map(1, alms, maps);
+}
+
+void
+SphericalHarmonicTransform::map2alm(const Healpix_Map<double>& map, Alm<xcomplex<double> >& alm, double weight) const
+{
+    const Healpix_Map<double>* maps[1] = {&map};
+    Alm<xcomplex<double> >* alms[1] = {&alm};
+    map2alm(1, maps, alms, weight);
+}
+
+void
+SphericalHarmonicTransform::alm2map(int n, const Alm<xcomplex<double> >* const* alms, Healpix_Map<double>* const* maps) const
+{
+    check(n >= 0, "invalid number of transforms " << n);
+    if(n == 0)
+        return;
+
+    for(int i = 0; i < n; ++i)
+    {
+        checkAlm(*(alms[i]));
+        checkMap(*(maps[i]));
+    }
+
+    if(backend_ == HEALPIX_BACKEND)
+    {
+        for(int i = 0; i < n; ++i)
+            ::alm2map(*(alms[i]), *(maps[i]));
+        return;
+    }
+
+    std::vector<void*> a(n), m(n);
+    for(int i = 0; i < n; ++i)
+    {
+        a[i] = const_cast<xcomplex<double>*>(&((*(alms[i]))(0, 0)));
+        m[i] = &((*(maps[i]))[0]);
+    }
+    sharpExecute(SHARP_ALM2MAP, 0, geometry_, almInfo_, n, a, m, false);
+}
+
+void
+SphericalHarmonicTransform::map2alm(int n, const Healpix_Map<double>* const* maps, Alm<xcomplex<double> >* const* alms, double weight) const
+{
+    check(n >= 0, "invalid number of transforms " << n);
+    if(n == 0)
+        return;
+
+    for(int i = 0; i < n; ++i)
+    {
+        checkMap(*(maps[i]));
+        checkAlm(*(alms[i]));
+    }
+
+    if(backend_ == HEALPIX_BACKEND)
+    {
+        arr<double> w(2 * nSide_);
+        for(long i = 0; i < 2 * nSide_; ++i)
+            w[i] = weights_[i] * weight;
+        for(int i = 0; i < n; ++i)
+            ::map2alm(*(maps[i]), *(alms[i]), w);
+        return;
+    }
+
+    std::vector<void*> a(n), m(n);
+    for(int i = 0; i < n; ++i)
+    {
+        a[i] = &((*(alms[i]))(0, 0));
+        m[i] = const_cast<double*>(&((*(maps[i]))[0]));
+    }
+    sharpExecute(SHARP_MAP2ALM, 0, geometry_, almInfo_, n, a, m, false);
+
+    for(int i = 0; i < n; ++i)
+        scaleAlm(*(alms[i]), weight);
+}
+
+void
+SphericalHarmonicTransform::map2almIter(const Healpix_Map<double>& map, Alm<xcomplex<double> >& alm, int nIter) const
+{
+    check(nIter >= 0, "invalid number of iterations " << nIter);
+
+    map2alm(map, alm);
+    if(nIter == 0)
+        return;
+
+    Healpix_Map<double> residual;
+    residual.SetNside(nSide_, RING);
+    Alm<xcomplex<double> > correction(lMax_, lMax_);
+    for(int iter = 0; iter < nIter; ++iter)
+    {
+        alm2map(alm, residual);
+        for(long i = 0; i < residual.Npix(); ++i)
+            residual[i] = map[i] - residual[i];
+
+        map2alm(residual, correction);
+        for(int m = 0; m <= lMax_; ++m)
+            for(int l = m; l <= lMax_; ++l)
+                alm(l, m) += correction(l, m);
+    }
+}
+
+void
+SphericalHarmonicTransform::alm2mapPol(const Alm<xcomplex<double> >& almT, const Alm<xcomplex<double> >& almE, const Alm<xcomplex<double> >& almB, Healpix_Map<double>& mapT, Healpix_Map<double>& mapQ, Healpix_Map<double>& mapU) const
+{
+    checkAlm(almT);
+    checkAlm(almE);
+    checkAlm(almB);
+    checkMap(mapT);
+    checkMap(mapQ);
+    checkMap(mapU);
+
+    if(backend_ == HEALPIX_BACKEND)
+    {
+        ::alm2map_pol(almT, almE, almB, mapT, mapQ, mapU);
+        return;
+    }
+
+    alm2map(almT, mapT);
+
+    // Q and U from E and B with spin 2, the same as in HEALPix
+    std::vector<void*> a(2), m(2);
+    a[0] = const_cast<xcomplex<double>*>(&(almE(0, 0)));
+    a[1] = const_cast<xcomplex<double>*>(&(almB(0, 0)));
+    m[0] = &(mapQ[0]);
+    m[1] = &(mapU[0]);
+    sharpExecute(SHARP_ALM2MAP, 2, geometry_, almInfo_, 1, a, m, false);
+}
@@ -0,0 +1,477 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <chain_file.hpp>
+#include <streaming_chain.hpp>
+
+namespace
+{
+
+// the scale function of the t-digest, relating the quantile q to the centroid index k
+double
+kFromQ(double q, double compression)
+{
+    return compression / (2 * M_PI) * std::asin(2 * q - 1);
+}
+
+double
+qFromK(double k, double compression)
+{
+    if(k >= compression / 4)
+        return 1;
+    return (std::sin(k * 2 * M_PI / compression) + 1) / 2;
+}
+
+struct LessPairFirst
+{
+    bool operator() (const std::pair<double, double>& a, const std::pair<double, double>& b) const
+    {
+        return a.first < b.first;
+    }
+};
+
+// the elements are passed one at a time, either to the chain or to the range update
+void
+consumeElement(StreamingChain* chain, std::vector<double>* mins, std::vector<double>* maxs, double prob, double like, const double* params, int n)
+{
+    if(chain)
+    {
+        chain->addElement(prob, like, params);
+        return;
+    }
+
+    if(mins->empty())
+    {
+        mins->assign(params, params + n);
+        maxs->assign(params, params + n);
+        return;
+    }
+
+    for(int j = 0; j < n; ++j)
+    {
+        if(params[j] < (*mins)[j])
+            (*mins)[j] = params[j];
+        if(params[j] > (*maxs)[j])
+            (*maxs)[j] = params[j];
+    }
+}
+
+} // namespace
+
+QuantileSketch::QuantileSketch(double compression) : compression_(compression), totalWeight_(0), min_(std::numeric_limits<double>::max()), max_(-std::numeric_limits<double>::max())
+{
+    check(compression > 0, "invalid compression " << compression);
+}
+
+void
+QuantileSketch::add(double x, double w)
+{
+    check(w >= 0, "invalid weight " << w);
+    if(w == 0)
+        return;
+
+    buffer_.push_back(std::make_pair(x, w));
+    totalWeight_ += w;
+    if(x < min_)
+        min_ = x;
+    if(x > max_)
+        max_ = x;
+
+    if(buffer_.size() >= 5 * compression_)
+        flush();
+}
+
+void
+QuantileSketch::flush() const
+{
+    if(buffer_.empty())
+        return;
+
+    for(int i = 0; i < means_.size(); ++i)
+        buffer_.push_back(std::make_pair(means_[i], weights_[i]));
+
+    LessPairFirst less;
+    std::sort(buffer_.begin(), buffer_.end(), less);
+
+    means_.clear();
+    weights_.clear();
+
+    double weightSoFar = 0;
+    double weightLimit = totalWeight_ * qFromK(kFromQ(0, compression_) + 1, compression_);
+    double currentMean = buffer_[0].first, currentWeight = buffer_[0].second;
+    for(int i = 1; i < buffer_.size(); ++i)
+    {
+        const double x = buffer_[i].first, w = buffer_[i].second;
+        if(weightSoFar + currentWeight + w <= weightLimit)
+        {
+            currentWeight += w;
+            currentMean += (x - currentMean) * w / currentWeight;
+            continue;
+        }
+
+        means_.push_back(currentMean);
+        weights_.push_back(currentWeight);
+        weightSoFar += currentWeight;
+        weightLimit = totalWeight_ * qFromK(kFromQ(std::min(weightSoFar / totalWeight_, 1.0), compression_) + 1, compression_);
+        currentMean = x;
+        currentWeight = w;
+    }
+    means_.push_back(currentMean);
+    weights_.push_back(currentWeight);
+
+    buffer_.clear();
+}
+
+double
+QuantileSketch::quantile(double q) const
+{
+    check(q >= 0 && q <= 1, "invalid quantile " << q);
+    check(totalWeight_ > 0, "no points added");
+
+    flush();
+    check(!means_.empty(), "");
+
+    const double target = q * totalWeight_;
+
+    // each centroid is assumed to be centered at its cumulative weight midpoint
+    double cumul = weights_[0] / 2;
+    if(target <= cumul)
+    {
+        if(cumul == 0)
+            return min_;
+        return min_ + (means_[0] - min_) * target / cumul;
+    }
+
+    for(int i = 1; i < means_.size(); ++i)
+    {
+        const double next = cumul + (weights_[i - 1] + weights_[i]) / 2;
+        if(target <= next)
+            return means_[i - 1] + (means_[i] - means_[i - 1]) * (target - cumul) / (next - cumul);
+        cumul = next;
+    }
+
+    const double rest = totalWeight_ - cumul;
+    if(rest <= 0)
+        return max_;
+    return means_[means_.size() - 1] + (max_ - means_[means_.size() - 1]) * (target - cumul) / rest;
+}
+
+StreamingChain::StreamingChain(int nParams, const std::vector<double>& mins, const std::vector<double>& maxs, int nBins, const std::vector<std::pair<int, int> >& pairs, int nBins2D, double compression) : nParams_(nParams), nBins_(nBins), nBins2D_(nBins2D), mins_(mins), maxs_(maxs), pairs_(pairs), size_(0), totalWeight_(0), minLike_(std::numeric_limits<double>::max()), maxLikePoint_(nParams, 0), mean_(nParams, 0), comoment_(nParams * nParams, 0), sketches_(nParams, QuantileSketch(compression)), delta_(nParams)
+{
+    check(nParams > 0, "invalid number of parameters " << nParams);
+    check(mins.size() == nParams, "");
+    check(maxs.size() == nParams, "");
+    check(nBins > 0, "invalid number of bins " << nBins);
+    check(nBins2D > 0, "invalid number of bins " << nBins2D);
+
+    for(int i = 0; i < nParams_; ++i)
+    {
+        check(maxs_[i] > mins_[i], "invalid range for parameter " << i << ": " << mins_[i] << " to " << maxs_[i]);
+    }
+
+    hist_.resize(nParams_, std::vector<double>(nBins_, 0));
+    histLike_.resize(nParams_, std::vector<double>(nBins_, std::numeric_limits<double>::max()));
+
+    hist2D_.resize(pairs_.size(), std::vector<double>(nBins2D_ * nBins2D_, 0));
+    hist2DLike_.resize(pairs_.size(), std::vector<double>(nBins2D_ * nBins2D_, std::numeric_limits<double>::max()));
+    for(int p = 0; p < pairs_.size(); ++p)
+    {
+        check(pairs_[p].first >= 0 && pairs_[p].first < nParams_, "invalid parameter index " << pairs_[p].first);
+        check(pairs_[p].second >= 0 && pairs_[p].second < nParams_, "invalid parameter index " << pairs_[p].second);
+    }
+}
+
+int
+StreamingChain::bin(int i, double x) const
+{
+    if(x < mins_[i] || x > maxs_[i])
+        return -1;
+
+    int k = int((x - mins_[i]) / (maxs_[i] - mins_[i]) * nBins_);
+    if(k >= nBins_)
+        k = nBins_ - 1;
+    return k;
+}
+
+void
+StreamingChain::addElement(double prob, double like, const double* params)
+{
+    check(prob >= 0, "invalid weight " << prob);
+    ++size_;
+
+    if(like < minLike_)
+    {
+        minLike_ = like;
+        maxLikePoint_.assign(params, params + nParams_);
+    }
+
+    if(prob == 0)
+        return;
+
+    // weighted Welford update of the means and the co-moments
+    totalWeight_ += prob;
+    const double f = prob / totalWeight_;
+    for(int i = 0; i < nParams_; ++i)
+    {
+        delta_[i] = params[i] - mean_[i];
+        mean_[i] += f * delta_[i];
+    }
+    for(int i = 0; i < nParams_; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+            comoment_[i * nParams_ + j] += prob * delta_[i] * (params[j] - mean_[j]);
+    }
+
+    for(int i = 0; i < nParams_; ++i)
+    {
+        sketches_[i].add(params[i], prob);
+
+        const int k = bin(i, params[i]);
+        if(k == -1)
+            continue;
+
+        hist_[i][k] += prob;
+        if(like < histLike_[i][k])
+            histLike_[i][k] = like;
+    }
+
+    for(int p = 0; p < pairs_.size(); ++p)
+    {
+        const int i = pairs_[p].first, j = pairs_[p].second;
+        if(params[i] < mins_[i] || params[i] > maxs_[i] || params[j] < mins_[j] || params[j] > maxs_[j])
+            continue;
+
+        int k1 = int((params[i] - mins_[i]) / (maxs_[i] - mins_[i]) * nBins2D_);
+        int k2 = int((params[j] - mins_[j]) / (maxs_[j] - mins_[j]) * nBins2D_);
+        if(k1 >= nBins2D_)
+            k1 = nBins2D_ - 1;
+        if(k2 >= nBins2D_)
+            k2 = nBins2D_ - 1;
+
+        const int k = k1 * nBins2D_ + k2;
+        hist2D_[p][k] += prob;
+        if(like < hist2DLike_[p][k])
+            hist2DLike_[p][k] = like;
+    }
+}
+
+double
+StreamingChain::covariance(int i, int j) const
+{
+    check(i >= 0 && i < nParams_, "invalid parameter index " << i);
+    check(j >= 0 && j < nParams_, "invalid parameter index " << j);
+    check(totalWeight_ > 0, "no elements added");
+
+    if(j > i)
+        std::swap(i, j);
+
+    return comoment_[i * nParams_ + j] / totalWeight_;
+}
+
+void
+StreamingChain::addFile(const char* fileName, unsigned long burnin, unsigned int thin)
+{
+    int n = nParams_;
+    readFile(fileName, burnin, thin, this, NULL, NULL, n);
+}
+
+int
+StreamingChain::findRanges(const std::vector<std::string>& fileNames, std::vector<double>& mins, std::vector<double>& maxs, unsigned long burnin, unsigned int thin)
+{
+    check(!fileNames.empty(), "");
+
+    int nParams = -1;
+    mins.clear();
+    maxs.clear();
+    for(int i = 0; i < fileNames.size(); ++i)
+        readFile(fileNames[i].c_str(), burnin, thin, NULL, &mins, &maxs, nParams);
+
+    return nParams;
+}
+
+void
+StreamingChain::readFile(const char* fileName, unsigned long burnin, unsigned int thin, StreamingChain* chain, std::vector<double>* mins, std::vector<double>* maxs, int& nParams)
+{
+    check(thin > 0, "thin factor cannot be 0");
+    check(chain || (mins && maxs), "");
+
+    StandardException exc;
+
+    if(BinaryChain::isBinary(fileName))
+    {
+        output_screen("Streaming the binary chain from file " << fileName << "..." << std::endl);
+        MappedBinaryChain mapped(fileName, burnin, thin);
+        if(nParams == -1)
+            nParams = mapped.nParams();
+
+        if(mapped.nParams() != nParams)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid chain file " << fileName << ". It has " << mapped.nParams() << " parameters, expected " << nParams << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        for(unsigned long i = 0; i < mapped.size(); ++i)
+        {
+            const double* rec = mapped.record(i);
+            consumeElement(chain, mins, maxs, rec[0], rec[1], rec + 2, nParams);
+        }
+        output_screen("OK" << std::endl);
+        return;
+    }
+
+    if(CompressedBinaryChain::isCompressed(fileName))
+    {
+        // one block at a time, so the memory stays bounded
+        output_screen("Streaming the compressed chain from file " << fileName << "..." << std::endl);
+        MappedCompressedBinaryChain mapped(fileName);
+        if(nParams == -1)
+            nParams = mapped.nParams();
+
+        if(mapped.nParams() != nParams)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid chain file " << fileName << ". It has " << mapped.nParams() << " parameters, expected " << nParams << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        const CompressedRecords& records = mapped.records();
+        const int recordLength = 2 + nParams;
+        std::vector<double> block;
+        for(unsigned long b = 0; b < records.nBlocks(); ++b)
+        {
+            const unsigned long start = records.blockStart(b), n = records.blockSize(b);
+            if(start + n <= burnin)
+                continue;
+
+            block.resize(n * recordLength);
+            records.decompressBlock(b, &(block[0]));
+
+            // the first element of the block after the burnin that is kept by the thinning
+            unsigned long i = (start < burnin ? burnin : start + (thin - (start - burnin) % thin) % thin);
+            for(; i < start + n; i += thin)
+            {
+                const double* rec = &(block[(i - start) * recordLength]);
+                consumeElement(chain, mins, maxs, rec[0], rec[1], rec + 2, nParams);
+            }
+        }
+        output_screen("OK" << std::endl);
+        return;
+    }
+
+    std::ifstream in(fileName);
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    output_screen("Streaming the chain from file " << fileName << "..." << std::endl);
+    unsigned long line = 0;
+    std::string s;
+    std::vector<double> values;
+    while(std::getline(in, s))
+    {
+        if(s == "")
+            break;
+
+        values.clear();
+        const char* current = s.c_str();
+        while(true)
+        {
+            char* next;
+            const double val = std::strtod(current, &next);
+            if(next == current)
+                break;
+            values.push_back(val);
+            current = next;
+        }
+
+        const int n = int(values.size()) - 2;
+        if(nParams == -1 && n > 0)
+            nParams = n;
+
+        if(n != nParams)
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid chain file " << fileName << ". There are " << n << " parameters on line " << line << ", expected " << nParams << ".";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        if(line >= burnin && (line - burnin) % thin == 0)
+            consumeElement(chain, mins, maxs, values[0], values[1], &(values[2]), nParams);
+
+        ++line;
+    }
+    output_screen("OK" << std::endl);
+}
+
+Posterior1D*
+StreamingChain::posterior(int paramIndex, Posterior1D::SmoothingMethod method, double scale) const
+{
+    check(paramIndex >= 0 && paramIndex < nParams_, "invalid parameter index " << paramIndex);
+
+    Posterior1D* post = new Posterior1D;
+    for(int k = 0; k < nBins_; ++k)
+    {
+        if(hist_[paramIndex][k] > 0)
+            post->addPoint(binCenter(paramIndex, k), hist_[paramIndex][k], histLike_[paramIndex][k]);
+    }
+
+    post->generate(method, scale);
+    return post;
+}
+
+Posterior2D*
+StreamingChain::posterior(int paramIndex1, int paramIndex2, double scale1, double scale2, Posterior2D::SmoothingMethod method) const
+{
+    int p = -1;
+    bool swapped = false;
+    for(int i = 0; i < pairs_.size(); ++i)
+    {
+        if(pairs_[i].first == paramIndex1 && pairs_[i].second == paramIndex2)
+        {
+            p = i;
+            break;
+        }
+        if(pairs_[i].first == paramIndex2 && pairs_[i].second == paramIndex1)
+        {
+            p = i;
+            swapped = true;
+            break;
+        }
+    }
+
+    check(p != -1, "the pair " << paramIndex1 << ", " << paramIndex2 << " has not been requested in the constructor");
+
+    Posterior2D* post = new Posterior2D;
+    for(int k1 = 0; k1 < nBins2D_; ++k1)
+    {
+        for(int k2 = 0; k2 < nBins2D_; ++k2)
+        {
+            const int k = k1 * nBins2D_ + k2;
+            if(hist2D_[p][k] == 0)
+                continue;
+
+            const double x1 = binCenter2D(pairs_[p].first, k1), x2 = binCenter2D(pairs_[p].second, k2);
+            if(swapped)
+                post->addPoint(x2, x1, hist2D_[p][k], hist2DLike_[p][k]);
+            else
+                post->addPoint(x1, x2, hist2D_[p][k], hist2DLike_[p][k]);
+        }
+    }
+
+    post->generate(scale1, scale2, method);
+    return post;
+}
@@ -1,6 +1,7 @@
 #include <cosmo_mpi.hpp>
 
 #include <fstream>
+#include <cstdlib>
 #include <set>
 #include <sstream>
 #include <iostream>
@@ -33,11 +34,43 @@
 #include <test_wigner_3j.hpp>
 #include <test_table_function.hpp>
 #include <test_cubic_spline.hpp>
+#include <test_histogram.hpp>
 #include <test_three_rotation.hpp>
 #include <test_mask_apodizer.hpp>
+#include <test_spherical_harmonic_transform.hpp>
 #include <test_kd_tree.hpp>
+#include <test_likelihood_farm.hpp>
+#include <test_likelihood_server.hpp>
+#include <test_process_likelihood_pool.hpp>
+#include <test_threaded_likelihood.hpp>
+#include <test_cl_cache.hpp>
+#include <test_random.hpp>
+#include <test_scale_factor.hpp>
+#include <test_likelihood_gradient.hpp>
+#include <test_nuts_general.hpp>
+#include <test_distributed_large_vector.hpp>
+#include <test_fisher_matrix.hpp>
+#include <test_prior_transform.hpp>
+#include <test_cl_set_file.hpp>
+#include <test_checkpoint_coordinator.hpp>
+#include <test_device_large_vector.hpp>
+#include <test_hmc.hpp>
+#include <test_cosmo_mpi.hpp>
+#include <test_profiler.hpp>
+#include <test_memory_tracker.hpp>
+#include <test_importance_reweighting.hpp>
+#include <test_chain_compression.hpp>
+#include <test_whole_matrix.hpp>
 #include <test_fast_approximator.hpp>
 #include <test_fast_approximator_error.hpp>
+#include <test_principal_components.hpp>
+#include <test_distributed_matrix.hpp>
+#include <test_mixed_precision_cholesky.hpp>
+#include <test_tiled_matrix.hpp>
+#include <test_emulated_likelihood.hpp>
+#include <test_matter_ps_emulator.hpp>
+#include <test_parallel_tempering.hpp>
+#include <test_ensemble_sampler.hpp>
 #include <test_mcmc_planck_fast.hpp>
 #include <test_multinest_planck_fast.hpp>
 
@@ -64,6 +97,10 @@ TestFramework* createTest(const std::string& name)
 #ifdef COSMO_LAPACK
     else if(name == "mcmc_fast")
         test = new TestMCMCFast;
+    else if(name == "parallel_tempering")
+        test = new TestParallelTempering;
+    else if(name == "ensemble_sampler")
+        test = new TestEnsembleSampler;
 #endif
 #ifdef COSMO_MULTINEST
     else if(name == "multinest_fast")
@@ -127,19 +164,79 @@ TestFramework* createTest(const std::string& name)
         test = new TestTableFunction;
     else if(name == "cubic_spline")
         test = new TestCubicSpline;
+    else if(name == "histogram")
+        test = new TestHistogram;
     else if(name == "three_rotation")
         test = new TestThreeRotation;
 #ifdef COSMO_HEALPIX
     else if(name == "mask_apodizer")
         test = new TestMaskApodizer(1e-2);
+    else if(name == "spherical_harmonic_transform")
+        test = new TestSphericalHarmonicTransform;
 #endif
     else if(name == "kd_tree")
         test = new TestKDTree;
+    else if(name == "likelihood_farm")
+        test = new TestLikelihoodFarm;
+    else if(name == "likelihood_server")
+        test = new TestLikelihoodServer;
+    else if(name == "process_likelihood_pool")
+        test = new TestProcessLikelihoodPool;
+    else if(name == "threaded_likelihood")
+        test = new TestThreadedLikelihood;
+    else if(name == "cl_cache")
+        test = new TestClCache;
+    else if(name == "random")
+        test = new TestRandom;
+    else if(name == "scale_factor")
+        test = new TestScaleFactor;
+    else if(name == "likelihood_gradient")
+        test = new TestLikelihoodGradient;
+    else if(name == "nuts_general")
+        test = new TestNUTSGeneral;
+    else if(name == "distributed_large_vector")
+        test = new TestDistributedLargeVector;
+    else if(name == "fisher_matrix")
+        test = new TestFisherMatrix;
+    else if(name == "prior_transform")
+        test = new TestPriorTransform;
+    else if(name == "cl_set_file")
+        test = new TestClSetFile;
+    else if(name == "checkpoint_coordinator")
+        test = new TestCheckpointCoordinator;
+    else if(name == "device_large_vector")
+        test = new TestDeviceLargeVector;
+    else if(name == "hmc")
+        test = new TestHMC;
+    else if(name == "cosmo_mpi")
+        test = new TestCosmoMPI;
+    else if(name == "profiler")
+        test = new TestProfiler;
+    else if(name == "memory_tracker")
+        test = new TestMemoryTracker;
+    else if(name == "importance_reweighting")
+        test = new TestImportanceReweighting;
+    else if(name == "chain_compression")
+        test = new TestChainCompression;
+    else if(name == "whole_matrix")
+        test = new TestWholeMatrix;
 #ifdef COSMO_LAPACK
     else if(name == "fast_approximator")
         test = new TestFastApproximator(1e-3);
     else if(name == "fast_approximator_error")
         test = new TestFastApproximatorError(1e-3);
+    else if(name == "principal_components")
+        test = new TestPrincipalComponents;
+    else if(name == "distributed_matrix")
+        test = new TestDistributedMatrix;
+    else if(name == "mixed_precision_cholesky")
+        test = new TestMixedPrecisionCholesky;
+    else if(name == "tiled_matrix")
+        test = new TestTiledMatrix;
+    else if(name == "emulated_likelihood")
+        test = new TestEmulatedLikelihood;
+    else if(name == "matter_ps_emulator")
+        test = new TestMatterPsEmulator;
 #endif
 #ifdef COSMO_LAPACK
 #ifdef COSMO_CLASS
@@ -157,10 +254,22 @@ TestFramework* createTest(const std::string& name)
     return test;
 }
 
-bool runTest(const std::string& name)
+struct TimingOptions
+{
+    TimingOptions() : warmUp(1), repetitions(0), maxSlowdown(1.5), updateBaseline(false) {}
+
+    int warmUp;
+    int repetitions;
+    std::string baselineFileName;
+    double maxSlowdown;
+    bool updateBaseline;
+};
+
+bool runTest(const std::string& name, const TimingOptions& timing)
 {
     TestFramework* test = createTest(name);
     check(test, "The test name was not found");
+    test->setTiming(timing.warmUp, timing.repetitions, timing.baselineFileName, timing.maxSlowdown, timing.updateBaseline);
     unsigned int pass, fail;
     bool res = test->run(pass, fail);
     delete test;
@@ -184,6 +293,37 @@ int main(int argc, char *argv[])
         }
 
         std::string argument(argv[1]);
+
+        // optional timing of the subtests for catching performance regressions
+        TimingOptions timing;
+        for(int i = 2; i < argc; ++i)
+        {
+            const std::string option(argv[i]);
+            if(option == "--time")
+            {
+                if(timing.repetitions == 0)
+                    timing.repetitions = 5;
+            }
+            else if(option == "--repeat" && i + 1 < argc)
+                timing.repetitions = std::atoi(argv[++i]);
+            else if(option == "--warmup" && i + 1 < argc)
+                timing.warmUp = std::atoi(argv[++i]);
+            else if(option == "--baseline" && i + 1 < argc)
+                timing.baselineFileName = argv[++i];
+            else if(option == "--max-slowdown" && i + 1 < argc)
+                timing.maxSlowdown = std::atof(argv[++i]);
+            else if(option == "--update-baseline")
+                timing.updateBaseline = true;
+            else
+            {
+                std::stringstream exceptionStr;
+                exceptionStr << "Invalid option " << option << ". The options are --time (time the subtests), --repeat N (the number of timed runs, 5 by default), --warmup N (the number of untimed runs before, 1 by default), --baseline FILE (compare the times to the baseline file), --max-slowdown X (fail if slower than the baseline by more than a factor of X, 1.5 by default), and --update-baseline (write the times into the baseline file).";
+                exc.set(exceptionStr.str());
+                throw exc;
+            }
+        }
+        if(timing.repetitions == 0 && !timing.baselineFileName.empty())
+            timing.repetitions = 5;
         std::set<std::string> fastTests, slowTests;
 
         fastTests.insert("unit_conversions");
@@ -196,6 +336,8 @@ int main(int argc, char *argv[])
         fastTests.insert("matrix");
 #ifdef COSMO_LAPACK
         fastTests.insert("mcmc_fast");
+        fastTests.insert("parallel_tempering");
+        fastTests.insert("ensemble_sampler");
 #endif
 #ifdef COSMO_MULTINEST
         fastTests.insert("multinest_fast");
@@ -222,11 +364,43 @@ int main(int argc, char *argv[])
         fastTests.insert("wigner_3j");
         fastTests.insert("table_function");
         fastTests.insert("cubic_spline");
+        fastTests.insert("histogram");
         fastTests.insert("three_rotation");
         fastTests.insert("kd_tree");
+        fastTests.insert("likelihood_farm");
+        fastTests.insert("likelihood_server");
+        fastTests.insert("process_likelihood_pool");
+        fastTests.insert("threaded_likelihood");
+        fastTests.insert("cl_cache");
+        fastTests.insert("random");
+        fastTests.insert("scale_factor");
+        fastTests.insert("likelihood_gradient");
+        fastTests.insert("nuts_general");
+        fastTests.insert("distributed_large_vector");
+        fastTests.insert("fisher_matrix");
+        fastTests.insert("prior_transform");
+        fastTests.insert("cl_set_file");
+        fastTests.insert("checkpoint_coordinator");
+        fastTests.insert("device_large_vector");
+        fastTests.insert("hmc");
+        fastTests.insert("cosmo_mpi");
+        fastTests.insert("profiler");
+        fastTests.insert("memory_tracker");
+        fastTests.insert("importance_reweighting");
+        fastTests.insert("chain_compression");
+        fastTests.insert("whole_matrix");
+#ifdef COSMO_HEALPIX
+        fastTests.insert("spherical_harmonic_transform");
+#endif
 #ifdef COSMO_LAPACK
         fastTests.insert("fast_approximator");
         fastTests.insert("fast_approximator_error");
+        fastTests.insert("principal_components");
+        fastTests.insert("distributed_matrix");
+        fastTests.insert("mixed_precision_cholesky");
+        fastTests.insert("tiled_matrix");
+        fastTests.insert("emulated_likelihood");
+        fastTests.insert("matter_ps_emulator");
 #endif
 
 #ifdef COSMO_PLANCK
@@ -271,7 +445,7 @@ int main(int argc, char *argv[])
             for(std::set<std::string>::const_iterator it = fastTests.begin(); it != fastTests.end(); ++it)
             {
                 ++total;
-                if(runTest(*it))
+                if(runTest(*it, timing))
                     ++pass;
                 else
                     ++fail;
@@ -279,7 +453,7 @@ int main(int argc, char *argv[])
             for(std::set<std::string>::const_iterator it = slowTests.begin(); it != slowTests.end(); ++it)
             {
                 ++total;
-                if(runTest(*it))
+                if(runTest(*it, timing))
                     ++pass;
                 else
                     ++fail;
@@ -290,7 +464,7 @@ int main(int argc, char *argv[])
             for(std::set<std::string>::const_iterator it = fastTests.begin(); it != fastTests.end(); ++it)
             {
                 ++total;
-                if(runTest(*it))
+                if(runTest(*it, timing))
                     ++pass;
                 else
                     ++fail;
@@ -301,7 +475,7 @@ int main(int argc, char *argv[])
             for(std::set<std::string>::const_iterator it = slowTests.begin(); it != slowTests.end(); ++it)
             {
                 ++total;
-                if(runTest(*it))
+                if(runTest(*it, timing))
                     ++pass;
                 else
                     ++fail;
@@ -347,7 +521,7 @@ int main(int argc, char *argv[])
             }
 
             ++total;
-            if(runTest(argument))
+            if(runTest(argument, timing))
                 ++pass;
             else
                 ++fail;
@@ -366,6 +540,7 @@ int main(int argc, char *argv[])
             else
             {
                 output_screen_clean(std::endl << "\033[1;31mFAIL\033[0m" << std::endl << std::endl);
+                return 1;
             }
         }
 
@@ -0,0 +1,273 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+#include <macros.hpp>
+#include <random.hpp>
+#include <numerics.hpp>
+#include <block_compression.hpp>
+#include <chain_file.hpp>
+#include <markov_chain.hpp>
+#include <streaming_chain.hpp>
+#include <test_chain_compression.hpp>
+
+std::string
+TestChainCompression::name() const
+{
+    return std::string("CHAIN COMPRESSION TESTER");
+}
+
+unsigned int
+TestChainCompression::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// a random walk with repeated points, like a Metropolis-Hastings chain
+void generateCompressionTestChain(unsigned long n, int nParams, std::vector<double>& records)
+{
+    Math::UniformRealGenerator gen(4321, 0, 1);
+    records.resize(n * (2 + nParams));
+    std::vector<double> p(nParams, 0);
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        double like = 0;
+        for(int j = 0; j < nParams; ++j)
+        {
+            p[j] += 0.1 * (gen.generate() - 0.5);
+            like += p[j] * p[j];
+        }
+        double* rec = &(records[i * (2 + nParams)]);
+        rec[0] = 1 + int(gen.generate() * 3);
+        rec[1] = like;
+        for(int j = 0; j < nParams; ++j)
+            rec[2 + j] = p[j];
+    }
+}
+
+long fileSize(const char* fileName)
+{
+    std::ifstream in(fileName, std::ios::in | std::ios::binary | std::ios::ate);
+    return (in ? long(in.tellg()) : -1);
+}
+
+} // namespace
+
+void
+TestChainCompression::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    if(i == 0)
+    {
+        subTestName = std::string("round_trip");
+
+        std::vector<double> values(5000);
+        Math::UniformRealGenerator gen(111, -1, 1);
+        for(int j = 0; j < values.size(); ++j)
+            values[j] = gen.generate() * std::exp(10 * gen.generate());
+
+        std::vector<double> shuffled(values.size()), unshuffled(values.size());
+        BlockCompression::shuffle(&(values[0]), values.size(), sizeof(double), &(shuffled[0]));
+        BlockCompression::unshuffle(&(shuffled[0]), values.size(), sizeof(double), &(unshuffled[0]));
+        if(std::memcmp(&(values[0]), &(unshuffled[0]), values.size() * sizeof(double)) != 0)
+        {
+            output_screen("FAIL: unshuffle doesn't give back the original values." << std::endl);
+            res = 0;
+        }
+
+        for(int c = 0; c < BlockCompression::CODEC_MAX; ++c)
+        {
+            const BlockCompression::Codec codec = BlockCompression::Codec(c);
+            if(!BlockCompression::isAvailable(codec))
+                continue;
+
+            std::vector<char> compressed;
+            BlockCompression::compress(codec, &(values[0]), values.size(), compressed);
+            std::vector<double> decompressed(values.size());
+            BlockCompression::decompress(codec, &(compressed[0]), compressed.size(), &(decompressed[0]), decompressed.size());
+            if(std::memcmp(&(values[0]), &(decompressed[0]), values.size() * sizeof(double)) != 0)
+            {
+                output_screen("FAIL: the values are not the same after compression with " << BlockCompression::codecName(codec) << "." << std::endl);
+                res = 0;
+            }
+
+            // the records are compressed in blocks, the last one is shorter
+            const int recordLength = 7;
+            const unsigned long nRecords = values.size() / recordLength;
+            BlockCompression::compressRecords(codec, &(values[0]), nRecords, recordLength, 100, compressed);
+            CompressedRecords records(&(compressed[0]), compressed.size(), "test");
+            if(records.size() != nRecords || records.recordLength() != recordLength || records.nBlocks() != (nRecords + 99) / 100 || records.compressedSize() != compressed.size())
+            {
+                output_screen("FAIL: the compressed records have " << records.size() << " records of length " << records.recordLength() << " in " << records.nBlocks() << " blocks." << std::endl);
+                res = 0;
+                continue;
+            }
+            records.decompress(&(decompressed[0]));
+            if(std::memcmp(&(values[0]), &(decompressed[0]), nRecords * recordLength * sizeof(double)) != 0)
+            {
+                output_screen("FAIL: the records are not the same after compression with " << BlockCompression::codecName(codec) << "." << std::endl);
+                res = 0;
+            }
+
+            // a corrupted block must be detected, with zlib and zstd by the codec, without compression by the size
+            if(codec != BlockCompression::NONE)
+            {
+                std::vector<char> corrupted(compressed);
+                for(unsigned long k = compressed.size() / 2; k < compressed.size(); ++k)
+                    corrupted[k] = char(k);
+                CompressedRecords corruptedRecords(&(corrupted[0]), corrupted.size(), "corrupted");
+                bool thrown = false;
+                try
+                {
+                    corruptedRecords.decompress(&(decompressed[0]));
+                }
+                catch (std::exception& e)
+                {
+                    thrown = true;
+                }
+                if(!thrown)
+                {
+                    output_screen("FAIL: the corrupted data compressed with " << BlockCompression::codecName(codec) << " has not been detected." << std::endl);
+                    res = 0;
+                }
+            }
+        }
+    }
+    else if(i == 1)
+    {
+        subTestName = std::string("compressed_chain");
+
+        const int nParams = 3;
+        const unsigned long n = 20000;
+        std::vector<double> records;
+        generateCompressionTestChain(n, nParams, records);
+
+        std::vector<std::string> paramNames(nParams);
+        paramNames[0] = "a";
+        paramNames[1] = "b";
+        paramNames[2] = "c";
+
+        const std::string binFileName = "test_files/chain_compression_test.bin";
+        const std::string zFileName = "test_files/chain_compression_test_z.bin";
+        const std::string decompressedFileName = "test_files/chain_compression_test_decompressed.bin";
+        BinaryChain::writeFile(binFileName.c_str(), paramNames, &(records[0]), n);
+        const unsigned long nCompressed = CompressedBinaryChain::compress(binFileName.c_str(), zFileName.c_str(), BlockCompression::defaultCodec(), 1000);
+
+        if(nCompressed != n || !CompressedBinaryChain::isCompressed(zFileName.c_str()) || BinaryChain::isBinary(zFileName.c_str()))
+        {
+            output_screen("FAIL: compressed " << nCompressed << " elements, expected " << n << "." << std::endl);
+            res = 0;
+        }
+
+        const long binSize = fileSize(binFileName.c_str()), zSize = fileSize(zFileName.c_str());
+        output_screen1("Binary chain " << binSize << " bytes, compressed with " << BlockCompression::codecName(BlockCompression::defaultCodec()) << " " << zSize << " bytes." << std::endl);
+        if(BlockCompression::defaultCodec() != BlockCompression::NONE && zSize >= binSize)
+        {
+            output_screen("FAIL: the compressed chain has " << zSize << " bytes, the binary chain has " << binSize << " bytes." << std::endl);
+            res = 0;
+        }
+
+        // the decompressed file must be identical to the original
+        CompressedBinaryChain::decompress(zFileName.c_str(), decompressedFileName.c_str());
+        {
+            MappedBinaryChain original(binFileName.c_str()), decompressed(decompressedFileName.c_str());
+            if(decompressed.size() != n || decompressed.paramNames() != paramNames || std::memcmp(original.record(0), decompressed.record(0), n * BinaryChain::recordSize(nParams)) != 0)
+            {
+                output_screen("FAIL: the decompressed chain is not the same as the original." << std::endl);
+                res = 0;
+            }
+        }
+
+        // the burnin and the thinning, the last elements are in a block of their own
+        const unsigned long burnin = 1537;
+        const unsigned int thin = 3;
+        MarkovChain chain(binFileName.c_str(), burnin, thin);
+        MarkovChain zChain(zFileName.c_str(), burnin, thin);
+        if(zChain.size() != chain.size() || zChain.size() != (n - burnin + thin - 1) / thin)
+        {
+            output_screen("FAIL: the compressed chain has " << zChain.size() << " elements, expected " << chain.size() << "." << std::endl);
+            res = 0;
+        }
+        else
+        {
+            for(unsigned long k = 0; k < chain.size(); ++k)
+            {
+                bool equal = (chain.prob(k) == zChain.prob(k) && chain.like(k) == zChain.like(k));
+                for(int j = 0; j < nParams; ++j)
+                    equal = equal && (chain.param(k, j) == zChain.param(k, j));
+                if(!equal)
+                {
+                    output_screen("FAIL: element " << k << " of the compressed chain is different." << std::endl);
+                    res = 0;
+                    break;
+                }
+            }
+        }
+
+        // streaming reads one block at a time
+        std::vector<double> mins(nParams, -10), maxs(nParams, 10);
+        StreamingChain streaming(nParams, mins, maxs), zStreaming(nParams, mins, maxs);
+        streaming.addFile(binFileName.c_str(), burnin, thin);
+        zStreaming.addFile(zFileName.c_str(), burnin, thin);
+        if(zStreaming.size() != streaming.size() || zStreaming.totalWeight() != streaming.totalWeight() || zStreaming.mean(1) != streaming.mean(1))
+        {
+            output_screen("FAIL: streaming the compressed chain gives " << zStreaming.size() << " elements with total weight " << zStreaming.totalWeight() << ", expected " << streaming.size() << " and " << streaming.totalWeight() << "." << std::endl);
+            res = 0;
+        }
+
+        std::remove(binFileName.c_str());
+        std::remove(zFileName.c_str());
+        std::remove(decompressedFileName.c_str());
+    }
+    else if(i == 2)
+    {
+        subTestName = std::string("convert_to_text");
+
+        const int nParams = 2;
+        const unsigned long n = 2500;
+        std::vector<double> records;
+        generateCompressionTestChain(n, nParams, records);
+
+        std::vector<std::string> paramNames(nParams);
+        paramNames[0] = "x";
+        paramNames[1] = "y";
+
+        const std::string zFileName = "test_files/chain_compression_text_test.bin";
+        const std::string textFileName = "test_files/chain_compression_text_test.txt";
+        CompressedBinaryChain::writeFile(zFileName.c_str(), paramNames, &(records[0]), n, BlockCompression::defaultCodec(), 300);
+        const unsigned long count = BinaryChain::convertToText(zFileName.c_str(), textFileName.c_str());
+
+        MarkovChain chain(textFileName.c_str());
+        if(count != n || chain.size() != n)
+        {
+            output_screen("FAIL: converted " << count << " elements, read " << chain.size() << ", expected " << n << "." << std::endl);
+            res = 0;
+        }
+        else
+        {
+            for(unsigned long k = 0; k < n; ++k)
+            {
+                const double* rec = &(records[k * (2 + nParams)]);
+                if(!Math::areEqual(chain.like(k), rec[1], 1e-12) || !Math::areEqual(chain.param(k, 1), rec[3], 1e-12))
+                {
+                    output_screen("FAIL: element " << k << " of the converted chain is different." << std::endl);
+                    res = 0;
+                    break;
+                }
+            }
+        }
+
+        std::remove(zFileName.c_str());
+        std::remove(textFileName.c_str());
+    }
+}
@@ -0,0 +1,136 @@
+#include <string>
+#include <csignal>
+
+#include <cosmo_mpi.hpp>
+#include <exception_handler.hpp>
+#include <test_checkpoint_coordinator.hpp>
+#include <checkpoint_coordinator.hpp>
+
+std::string
+TestCheckpointCoordinator::name() const
+{
+    return std::string("CHECKPOINT COORDINATOR TESTER");
+}
+
+unsigned int
+TestCheckpointCoordinator::numberOfSubtests() const
+{
+    return 2;
+}
+
+namespace
+{
+
+class CountingCheckpointable : public CheckpointCoordinator::Checkpointable
+{
+public:
+    CountingCheckpointable(bool fail) : fail_(fail), started(0), finished(0) {}
+
+    void startFlush() { ++started; }
+
+    void finishFlush()
+    {
+        ++finished;
+        if(fail_)
+        {
+            StandardException exc;
+            exc.set("test failure");
+            throw exc;
+        }
+    }
+
+private:
+    bool fail_;
+
+public:
+    int started, finished;
+};
+
+} // namespace
+
+void
+TestCheckpointCoordinator::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    CheckpointCoordinator::reset();
+
+    if(i == 0)
+    {
+        subTestName = std::string("signal");
+
+        CheckpointCoordinator::installSignal(SIGUSR1);
+        if(!CheckpointCoordinator::isInstalled())
+        {
+            output_screen("FAIL: The signal handler is not installed." << std::endl);
+            res = 0;
+        }
+        if(CheckpointCoordinator::requested())
+        {
+            output_screen("FAIL: A stop is requested before the signal." << std::endl);
+            res = 0;
+        }
+
+        // only the master gets the signal, the others should hear about it
+        if(CosmoMPI::create().isMaster())
+        {
+            std::raise(SIGUSR1);
+            if(!CheckpointCoordinator::requested())
+            {
+                output_screen("FAIL: The signal has not been trapped." << std::endl);
+                res = 0;
+            }
+        }
+        else
+            std::signal(SIGUSR1, SIG_DFL);
+
+        if(!CheckpointCoordinator::requestedEverywhere() || !CheckpointCoordinator::requested())
+        {
+            output_screen("FAIL: The request has not reached all of the processes." << std::endl);
+            res = 0;
+        }
+
+        CheckpointCoordinator::reset();
+        if(CheckpointCoordinator::requested() || CheckpointCoordinator::requestedEverywhere())
+        {
+            output_screen("FAIL: The request has not been reset." << std::endl);
+            res = 0;
+        }
+        return;
+    }
+
+    subTestName = std::string("flush");
+
+    CountingCheckpointable failing(true), good(false), removed(false);
+    CheckpointCoordinator::add(&failing);
+    CheckpointCoordinator::add(&good);
+    CheckpointCoordinator::add(&good);
+    CheckpointCoordinator::add(&removed);
+    CheckpointCoordinator::remove(&removed);
+
+    // only once for each request, and a failing object doesn't stop the others
+    CheckpointCoordinator::request();
+    CheckpointCoordinator::flush();
+    CheckpointCoordinator::flush();
+
+    if(failing.started != 1 || failing.finished != 1 || good.started != 1 || good.finished != 1 || removed.started != 0)
+    {
+        output_screen("FAIL: Expected every registered object to be checkpointed once, got " << failing.started << ", " << failing.finished << ", " << good.started << ", " << good.finished << ", " << removed.started << "." << std::endl);
+        res = 0;
+    }
+
+    CheckpointCoordinator::reset();
+    CheckpointCoordinator::flush();
+    if(good.started != 2 || good.finished != 2)
+    {
+        output_screen("FAIL: The object has not been checkpointed again after a reset." << std::endl);
+        res = 0;
+    }
+
+    CheckpointCoordinator::remove(&failing);
+    CheckpointCoordinator::remove(&good);
+    CheckpointCoordinator::reset();
+}
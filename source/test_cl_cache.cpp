@@ -0,0 +1,115 @@
+#include <vector>
+
+#include <macros.hpp>
+#include <cl_cache.hpp>
+#include <test_cl_cache.hpp>
+
+std::string
+TestClCache::name() const
+{
+    return std::string("CL CACHE TESTER");
+}
+
+unsigned int
+TestClCache::numberOfSubtests() const
+{
+    return 2;
+}
+
+void
+TestClCache::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        return;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        return;
+    default:
+        check(false, "");
+        return;
+    }
+}
+
+namespace
+{
+
+std::vector<double>
+testKey(double x)
+{
+    std::vector<double> key(3);
+    key[0] = 0.022;
+    key[1] = x;
+    key[2] = 3000;
+    return key;
+}
+
+// one non-empty spectrum and one empty
+std::vector<std::vector<double> >
+testSpectra(double x)
+{
+    std::vector<std::vector<double> > spectra(2);
+    for(int l = 0; l <= 10; ++l)
+        spectra[0].push_back(x * l);
+    return spectra;
+}
+
+} // namespace
+
+void
+TestClCache::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    ClCache cache(3);
+    for(int i = 0; i < 3; ++i)
+        cache.insert(testKey(i), testSpectra(i));
+
+    std::vector<std::vector<double> > spectra;
+    // using 0 makes 1 the least recently used, so it is the one dropped
+    check(cache.find(testKey(0), &spectra), "");
+    cache.insert(testKey(3), testSpectra(3));
+
+    res = 1;
+    if(cache.size() != 3 || cache.find(testKey(1), &spectra))
+        res = 0;
+    if(!cache.find(testKey(0), &spectra) || spectra != testSpectra(0))
+        res = 0;
+    if(!cache.find(testKey(2), &spectra) || spectra != testSpectra(2))
+        res = 0;
+    if(!cache.find(testKey(3), &spectra) || spectra != testSpectra(3))
+        res = 0;
+    if(cache.hits() != 4 || cache.misses() != 1 || cache.sharedHits() != 0)
+        res = 0;
+
+    expected = 1;
+    subTestName = "lru";
+}
+
+void
+TestClCache::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    ClCache cache(2);
+    cache.insert(testKey(1), testSpectra(1));
+    cache.insert(testKey(1), testSpectra(5));
+
+    std::vector<std::vector<double> > spectra;
+    res = 1;
+    if(cache.size() != 1 || !cache.find(testKey(1), &spectra) || spectra != testSpectra(5))
+        res = 0;
+
+    // the keys must match exactly
+    std::vector<double> key = testKey(1);
+    key[1] += 1e-12;
+    if(cache.find(key, &spectra))
+        res = 0;
+
+    cache.clear();
+    if(cache.size() != 0 || cache.find(testKey(1), &spectra))
+        res = 0;
+
+    expected = 1;
+    subTestName = "replace";
+}
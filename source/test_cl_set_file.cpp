@@ -0,0 +1,142 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <fstream>
+
+#include <test_cl_set_file.hpp>
+#include <cl_set_file.hpp>
+
+std::string
+TestClSetFile::name() const
+{
+    return std::string("CL SET FILE TESTER");
+}
+
+unsigned int
+TestClSetFile::numberOfSubtests() const
+{
+    return 2;
+}
+
+void
+TestClSetFile::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    const std::string fileName = "test_files/cl_set_file_test.bin";
+    const int lMax = 100;
+    const int mask = (1 << ClSetFile::TT) | (1 << ClSetFile::TE) | (1 << ClSetFile::PP);
+    const int nSpectra = ClSetFile::nSpectra(mask);
+    const unsigned long nSets = 300;
+
+    // spectrum s of set k has the value k * 10000 + s * 1000 + l
+    std::vector<double> sets(nSets * nSpectra * (lMax + 1));
+    for(unsigned long k = 0; k < nSets; ++k)
+    {
+        int j = 0;
+        for(int s = 0; s < ClSetFile::SPECTRUM_MAX; ++s)
+        {
+            if(!(mask & (1 << s)))
+                continue;
+            for(int l = 0; l <= lMax; ++l)
+                sets[(k * nSpectra + j) * (lMax + 1) + l] = k * 10000.0 + s * 1000.0 + l;
+            ++j;
+        }
+    }
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("round_trip");
+        ClSetFile::writeFile(fileName.c_str(), lMax, mask, &(sets[0]), nSets);
+        if(!ClSetFile::isClSetFile(fileName.c_str()))
+        {
+            output_screen("FAIL: the file is not recognized." << std::endl);
+            res = 0;
+        }
+
+        MappedClSets mapped(fileName.c_str());
+        if(mapped.size() != nSets || mapped.lMax() != lMax || mapped.spectraMask() != mask || mapped.setLength() != nSpectra * (lMax + 1))
+        {
+            output_screen("FAIL: the file has " << mapped.size() << " sets with l_max " << mapped.lMax() << " and mask " << mapped.spectraMask() << ", expected " << nSets << ", " << lMax << ", " << mask << "." << std::endl);
+            res = 0;
+        }
+
+        if(mapped.hasSpectrum(ClSetFile::EE) || mapped.spectrum(0, ClSetFile::EE) || !mapped.hasSpectrum(ClSetFile::TE))
+        {
+            output_screen("FAIL: wrong spectra included." << std::endl);
+            res = 0;
+        }
+
+        mapped.prefetch(0, nSets);
+        std::vector<double> cl;
+        for(unsigned long k = 0; k < nSets && res == 1; ++k)
+        {
+            for(int s = 0; s < ClSetFile::SPECTRUM_MAX; ++s)
+            {
+                if(!(mask & (1 << s)))
+                    continue;
+                mapped.getSpectrum(k, ClSetFile::Spectrum(s), &cl);
+                const double* p = mapped.spectrum(k, ClSetFile::Spectrum(s));
+                for(int l = 0; l <= lMax; ++l)
+                {
+                    const double e = k * 10000.0 + s * 1000.0 + l;
+                    if(cl[l] != e || p[l] != e)
+                    {
+                        output_screen("FAIL: set " << k << " spectrum " << s << " l = " << l << " is " << cl[l] << ", expected " << e << "." << std::endl);
+                        res = 0;
+                        break;
+                    }
+                }
+            }
+        }
+        std::remove(fileName.c_str());
+    }
+        break;
+
+    case 1:
+    {
+        subTestName = std::string("truncated");
+        ClSetFile::writeFile(fileName.c_str(), lMax, mask, &(sets[0]), nSets);
+
+        // drop the last value, the file must be refused
+        std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        in.close();
+        std::ofstream out(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), contents.size() - sizeof(double));
+        out.close();
+
+        bool thrown = false;
+        try
+        {
+            MappedClSets mapped(fileName.c_str());
+        }
+        catch (std::exception& e)
+        {
+            thrown = true;
+        }
+        if(!thrown)
+        {
+            output_screen("FAIL: the truncated file was accepted." << std::endl);
+            res = 0;
+        }
+
+        if(ClSetFile::isClSetFile("test_files/no_such_cl_set_file.bin"))
+        {
+            output_screen("FAIL: a missing file is recognized." << std::endl);
+            res = 0;
+        }
+        std::remove(fileName.c_str());
+    }
+        break;
+
+    default:
+        check(false, "");
+        break;
+    }
+}
@@ -1,4 +1,5 @@
 #include <cmb.hpp>
+#include <cmb_pool.hpp>
 #include <test_cmb.hpp>
 
 std::string
@@ -10,13 +11,13 @@ TestCMB::name() const
 unsigned int
 TestCMB::numberOfSubtests() const
 {
-    return 1;
+    return 2;
 }
 
 void
 TestCMB::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 1, "invalid index " << i);
+    check(i >= 0 && i < 2, "invalid index " << i);
 
     const double h = 0.6704;
     const double omBH2 = 0.022032;
@@ -54,6 +55,21 @@ TestCMB::runSubTest(unsigned int i, double& res, double& expected, std::string&
         res = clTT[10];
         expected = 47.8189;
         break;
+    case 1:
+        {
+            // two different points in one batch, the second one should give the same result as above
+            CMBPool pool(2, lMax, false, true, false);
+            std::vector<const CosmologicalParams*> batch;
+            batch.push_back(&paramsLCDM1);
+            batch.push_back(&paramsLCDM);
+            std::vector<std::vector<double> > batchClTT;
+            pool.computeCls(batch, &batchClTT, NULL, NULL, NULL, true);
+
+            subTestName = std::string("pool");
+            res = batchClTT[1][10];
+            expected = 47.8189;
+        }
+        break;
     default:
         check(false, "");
         break;
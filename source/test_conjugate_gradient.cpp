@@ -1,5 +1,99 @@
+#include <cmath>
+
 #include <test_conjugate_gradient.hpp>
 #include <conjugate_gradient.hpp>
+#include <conjugate_gradient_general.hpp>
+#include <cg_preconditioners.hpp>
+#include <lbfgs.hpp>
+
+namespace
+{
+
+// f(x) = sum_i d_i (x_i - i)^2 / 2, with very different curvatures
+class CGScaledQuadratic
+{
+public:
+    CGScaledQuadratic(int n) : d_(n), x_(n)
+    {
+        for(int i = 0; i < n; ++i)
+            d_[i] = std::pow(10.0, 4.0 * i / n);
+    }
+
+    void set(const Math::BasicLargeVector& x) { x_ = x.contents(); }
+
+    double value()
+    {
+        double res = 0;
+        for(int i = 0; i < d_.size(); ++i)
+            res += d_[i] * (x_[i] - i) * (x_[i] - i) / 2;
+        return res;
+    }
+
+    void derivative(Math::BasicLargeVector* res)
+    {
+        for(int i = 0; i < d_.size(); ++i)
+            res->contents()[i] = d_[i] * (x_[i] - i);
+    }
+
+protected:
+    std::vector<double> d_, x_;
+};
+
+class CGScaledQuadraticPreconditioned : public CGScaledQuadratic
+{
+public:
+    CGScaledQuadraticPreconditioned(int n) : CGScaledQuadratic(n), precond_(d_) {}
+
+    void preconditioner(const Math::BasicLargeVector& g, Math::BasicLargeVector* res) { precond_.apply(g.contents(), res->contents()); }
+
+private:
+    Math::DiagonalPreconditioner precond_;
+};
+
+// counts the calls, the value and the derivative should only be calculated together
+class CGScaledQuadraticCombined : public CGScaledQuadratic
+{
+public:
+    CGScaledQuadraticCombined(int n) : CGScaledQuadratic(n), combined(0), separate(0) {}
+
+    double value() { ++separate; return CGScaledQuadratic::value(); }
+    void derivative(Math::BasicLargeVector* res) { ++separate; CGScaledQuadratic::derivative(res); }
+
+    double valueAndDerivative(Math::BasicLargeVector* res)
+    {
+        ++combined;
+        CGScaledQuadratic::derivative(res);
+        return CGScaledQuadratic::value();
+    }
+
+    int combined, separate;
+};
+
+struct CGIterationCounter
+{
+    CGIterationCounter() : iters(0) {}
+    void operator()(int i, double f, double gn, const Math::BasicLargeVector& x, const Math::BasicLargeVector& g, const Math::BasicLargeVector& z) { iters = i; }
+    int iters;
+};
+
+template<typename Function>
+int
+minimizeScaledQuadratic(int n, int maxIter, double* maxError)
+{
+    Function f(n);
+    Math::BasicLargeVectorFactory factory(n);
+    Math::BasicLargeVector x(n);
+    Math::CG_General<Math::BasicLargeVector, Math::BasicLargeVectorFactory, Function> cg(&factory, &f, x);
+    CGIterationCounter counter;
+    cg.minimize(&x, 1e-30, 1e-8, maxIter, Math::CG_General<Math::BasicLargeVector, Math::BasicLargeVectorFactory, Function>::FLETCHER_REEVES, &counter);
+
+    *maxError = 0;
+    for(int i = 0; i < n; ++i)
+        *maxError = std::max(*maxError, std::abs(x.contents()[i] - i));
+    return counter.iters;
+}
+
+}
 
 std::string
 TestConjugateGradient::name() const
@@ -10,7 +104,7 @@ TestConjugateGradient::name() const
 unsigned int
 TestConjugateGradient::numberOfSubtests() const
 {
-    return 4;
+    return 8;
 }
 
 void
@@ -18,6 +112,12 @@ TestConjugateGradient::runSubTest(unsigned int i, double& res, double& expected,
 {
     check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
     
+    if(i >= 4)
+    {
+        runPreconditionerSubTest(i, res, expected, subTestName);
+        return;
+    }
+
     using namespace Math;
     BasicCGTreats t1(2);
     std::vector<double> b1(2);
@@ -104,3 +204,173 @@ TestConjugateGradient::runSubTest(unsigned int i, double& res, double& expected,
         break;
     }
 }
+
+void
+TestConjugateGradient::runPreconditionerSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    using namespace Math;
+    switch(i)
+    {
+    case 4:
+    {
+        // badly scaled A = D^1/2 C D^1/2 with well conditioned C, the diagonal preconditioner removes the scaling
+        subTestName = std::string("jacobi");
+        const int n = 200;
+        BasicCGTreats t(n);
+        std::vector<double> diag(n), x(n), b(n);
+        for(int i = 0; i < n; ++i)
+            diag[i] = std::pow(10.0, 4.0 * i / n);
+        for(int i = 0; i < n; ++i)
+        {
+            for(int j = 0; j < n; ++j)
+                t.setMatrix(i, j, std::sqrt(diag[i] * diag[j]) * (i == j ? 1.0 : 0.1 * std::pow(0.5, std::abs(i - j))));
+            x[i] = double(i % 7) - 3;
+        }
+        t.multiplyByMatrix(x, b);
+
+        int plainIters, precondIters;
+        ConjugateGradient<BasicCGTreats> cgPlain(n, &t, b);
+        cgPlain.solve(1e-10, &plainIters);
+
+        DiagonalPreconditioner jacobi(diag);
+        PreconditionedCGTreats<BasicCGTreats, DiagonalPreconditioner> pt(t, jacobi);
+        ConjugateGradient<PreconditionedCGTreats<BasicCGTreats, DiagonalPreconditioner> > cgPrecond(n, &pt, b);
+        const std::vector<double>& sol = cgPrecond.solve(1e-10, &precondIters);
+
+        double maxError = 0;
+        for(int i = 0; i < n; ++i)
+            maxError = std::max(maxError, std::abs(sol[i] - x[i]));
+
+        res = 1;
+        expected = 1;
+        if(maxError > 1e-4)
+        {
+            output_screen("FAIL: the maximum error of the solution is " << maxError << std::endl);
+            res = 0;
+        }
+        if(precondIters * 5 > plainIters)
+        {
+            output_screen("FAIL: " << precondIters << " iterations with the preconditioner, " << plainIters << " without it" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 5:
+    {
+        // harmonic space blocks with strong couplings between the m-s of each l, scaled by l, with weak couplings between different l-s
+        subTestName = std::string("block");
+        const int lMax = 15;
+        BlockPreconditioner block(BlockPreconditioner::harmonicBlocks(lMax));
+        const int n = block.size();
+        std::vector<double> scale(n), x(n), b(n);
+        std::vector<int> blockOf(n);
+        for(int k = 0; k < block.numBlocks(); ++k)
+        {
+            for(int i = block.blockStart(k); i < block.blockStart(k) + block.blockSize(k); ++i)
+            {
+                scale[i] = (k + 1) * (k + 1);
+                blockOf[i] = k;
+            }
+        }
+
+        BasicCGTreats t(n);
+        std::vector<double> diag(n);
+        for(int i = 0; i < n; ++i)
+        {
+            for(int j = 0; j < n; ++j)
+            {
+                double c = 0.05 * std::pow(0.5, std::abs(i - j));
+                if(blockOf[i] == blockOf[j])
+                    c += (i == j ? 1.0 : 0.9);
+                t.setMatrix(i, j, scale[i] * scale[j] * c);
+            }
+            diag[i] = scale[i] * scale[i] * 1.05;
+            x[i] = double(i % 5) - 2;
+        }
+        t.multiplyByMatrix(x, b);
+
+        block.setBlocks([&scale, &blockOf](int i, int j) { return scale[i] * scale[j] * ((blockOf[i] == blockOf[j] ? (i == j ? 1.0 : 0.9) : 0.0) + 0.05 * std::pow(0.5, std::abs(i - j))); });
+
+        int jacobiIters, blockIters;
+        DiagonalPreconditioner jacobi(diag);
+        PreconditionedCGTreats<BasicCGTreats, DiagonalPreconditioner> jt(t, jacobi);
+        ConjugateGradient<PreconditionedCGTreats<BasicCGTreats, DiagonalPreconditioner> > cgJacobi(n, &jt, b);
+        cgJacobi.solve(1e-10, &jacobiIters);
+
+        PreconditionedCGTreats<BasicCGTreats, BlockPreconditioner> bt(t, block);
+        ConjugateGradient<PreconditionedCGTreats<BasicCGTreats, BlockPreconditioner> > cgBlock(n, &bt, b);
+        const std::vector<double>& sol = cgBlock.solve(1e-10, &blockIters);
+
+        double maxError = 0;
+        for(int i = 0; i < n; ++i)
+            maxError = std::max(maxError, std::abs(sol[i] - x[i]));
+
+        res = 1;
+        expected = 1;
+        if(maxError > 1e-4)
+        {
+            output_screen("FAIL: the maximum error of the solution is " << maxError << std::endl);
+            res = 0;
+        }
+        if(blockIters * 3 > jacobiIters)
+        {
+            output_screen("FAIL: " << blockIters << " iterations with the block preconditioner, " << jacobiIters << " with the diagonal one" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 6:
+    {
+        subTestName = std::string("general_preconditioned");
+        const int n = 200;
+        double plainError, precondError;
+        const int plainIters = minimizeScaledQuadratic<CGScaledQuadratic>(n, 1000, &plainError);
+        const int precondIters = minimizeScaledQuadratic<CGScaledQuadraticPreconditioned>(n, 1000, &precondError);
+
+        res = 1;
+        expected = 1;
+        if(precondError > 1e-5)
+        {
+            output_screen("FAIL: the maximum error of the minimum is " << precondError << " with the preconditioner" << std::endl);
+            res = 0;
+        }
+        if(precondIters * 5 > plainIters)
+        {
+            output_screen("FAIL: " << precondIters << " iterations with the preconditioner, " << plainIters << " without it" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 7:
+    {
+        subTestName = std::string("value_and_derivative");
+        const int n = 50;
+        CGScaledQuadraticCombined f(n);
+        Math::BasicLargeVectorFactory factory(n);
+        Math::BasicLargeVector x(n);
+        Math::CG_General<Math::BasicLargeVector, Math::BasicLargeVectorFactory, CGScaledQuadraticCombined> cg(&factory, &f, x);
+        cg.minimize(&x, 1e-30, 1e-8, 1000, Math::CG_General<Math::BasicLargeVector, Math::BasicLargeVectorFactory, CGScaledQuadraticCombined>::POLAK_RIBIERE);
+
+        double maxError = 0;
+        for(int j = 0; j < n; ++j)
+            maxError = std::max(maxError, std::abs(x.contents()[j] - j));
+
+        res = 1;
+        expected = 1;
+        if(maxError > 1e-5)
+        {
+            output_screen("FAIL: the maximum error of the minimum is " << maxError << std::endl);
+            res = 0;
+        }
+        if(f.separate != 0 || f.combined == 0)
+        {
+            output_screen("FAIL: " << f.combined << " combined and " << f.separate << " separate function calls" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
@@ -0,0 +1,222 @@
+#include <string>
+#include <vector>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <test_cosmo_mpi.hpp>
+
+std::string
+TestCosmoMPI::name() const
+{
+    return std::string("COSMO MPI TESTER");
+}
+
+unsigned int
+TestCosmoMPI::numberOfSubtests() const
+{
+    return 6;
+}
+
+void
+TestCosmoMPI::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 6, "invalid index " << i);
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    const int nProc = mpi.numProcesses();
+    const int id = mpi.processId();
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("iallreduce");
+        std::vector<double> x(3);
+        x[0] = id;
+        x[1] = 1;
+        x[2] = 2 * id + 1;
+        std::vector<double> sum(3);
+        long maxId = id;
+
+        CosmoMPI::Request sumReq, maxReq;
+        mpi.iallreduce(&(x[0]), &(sum[0]), 3, CosmoMPI::SUM, &sumReq);
+        mpi.iallreduce(&maxId, &maxId, 1, CosmoMPI::MAX, &maxReq);
+        sumReq.wait();
+        while(!maxReq.test()) {}
+
+        if(sum[0] != nProc * (nProc - 1) / 2 || sum[1] != nProc || sum[2] != nProc * nProc || maxId != nProc - 1)
+        {
+            output_screen("FAIL: the sums are " << sum[0] << ", " << sum[1] << ", " << sum[2] << " and the maximum is " << maxId << " for " << nProc << " processes" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("iallgatherv");
+        // process p sends p + 1 values, all equal to p
+        std::vector<int> counts(nProc), displs(nProc);
+        int total = 0;
+        for(int p = 0; p < nProc; ++p)
+        {
+            counts[p] = p + 1;
+            displs[p] = total;
+            total += counts[p];
+        }
+        std::vector<int> send(id + 1, id), recv(total, -1);
+
+        {
+            CosmoMPI::Request req;
+            mpi.iallgatherv(&(send[0]), id + 1, &(recv[0]), &(counts[0]), &(displs[0]), &req);
+            // the destructor of the request waits
+        }
+
+        for(int p = 0; p < nProc; ++p)
+        {
+            for(int j = 0; j < counts[p]; ++j)
+            {
+                if(recv[displs[p] + j] != p)
+                {
+                    output_screen("FAIL: element " << j << " from process " << p << " is " << recv[displs[p] + j] << std::endl);
+                    res = 0;
+                }
+            }
+        }
+    }
+        break;
+    case 2:
+    {
+        subTestName = std::string("ibcast");
+        std::vector<double> data(5, -1);
+        if(mpi.isMaster())
+        {
+            for(int j = 0; j < 5; ++j)
+                data[j] = j * j;
+        }
+
+        CosmoMPI::Request req;
+        mpi.ibcast(&(data[0]), 5, &req);
+        req.wait();
+
+        for(int j = 0; j < 5; ++j)
+        {
+            if(data[j] != j * j)
+            {
+                output_screen("FAIL: element " << j << " is " << data[j] << std::endl);
+                res = 0;
+            }
+        }
+    }
+        break;
+    case 3:
+    {
+        subTestName = std::string("split");
+        // groups of two consecutive processes
+        CosmoMPI::Communicator* group = mpi.split(id / 2);
+        const int expectedSize = (id / 2 * 2 + 1 < nProc ? 2 : 1);
+
+        int sum = id;
+        mpi.allreduce(&sum, &sum, 1, CosmoMPI::SUM, group);
+        const int expectedSum = (expectedSize == 2 ? 4 * (id / 2) + 1 : id);
+
+        if(group->numProcesses() != expectedSize || group->processId() != id % 2 || sum != expectedSum)
+        {
+            output_screen("FAIL: process " << id << " is " << group->processId() << " out of " << group->numProcesses() << " in its group, the sum is " << sum << std::endl);
+            res = 0;
+        }
+
+        if(mpi.world().numProcesses() != nProc || mpi.nodeCommunicator().numProcesses() != mpi.numNodeProcesses())
+        {
+            output_screen("FAIL: invalid world or node communicator" << std::endl);
+            res = 0;
+        }
+        delete group;
+    }
+        break;
+    case 4:
+    {
+        subTestName = std::string("hierarchical");
+        std::vector<double> x(2), sum(2), reduced(2, 0);
+        x[0] = id;
+        x[1] = 1;
+        mpi.hierarchicalAllreduce(&(x[0]), &(sum[0]), 2, CosmoMPI::SUM);
+        mpi.hierarchicalReduce(&(x[0]), &(reduced[0]), 2, CosmoMPI::SUM);
+
+        int b = (mpi.isMaster() ? 12345 : -1);
+        mpi.hierarchicalBcast(&b, 1);
+
+        int nodes = (mpi.isNodeMaster() ? 1 : 0);
+        mpi.allreduce(&nodes, &nodes, 1, CosmoMPI::SUM);
+
+        if(sum[0] != nProc * (nProc - 1) / 2 || sum[1] != nProc || (mpi.isMaster() && (reduced[0] != sum[0] || reduced[1] != sum[1])))
+        {
+            output_screen("FAIL: the sums are " << sum[0] << ", " << sum[1] << " and the reduced sums " << reduced[0] << ", " << reduced[1] << std::endl);
+            res = 0;
+        }
+        if(b != 12345)
+        {
+            output_screen("FAIL: received " << b << " in the broadcast" << std::endl);
+            res = 0;
+        }
+        if(nodes != mpi.numNodes() || mpi.nodeIndex() < 0 || mpi.nodeIndex() >= mpi.numNodes() || (mpi.leaderCommunicator() != NULL) != mpi.isNodeMaster())
+        {
+            output_screen("FAIL: " << nodes << " node masters, " << mpi.numNodes() << " nodes, node index " << mpi.nodeIndex() << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 5:
+    {
+        subTestName = std::string("send_pool");
+        // each message is received and acknowledged before the next one is sent, so the pool should keep reusing the same buffer
+        const int nMessages = 20, size = 10;
+        const int tag = mpi.getCommTag();
+        CosmoMPI::SendPool pool;
+        for(int k = 0; k < nMessages; ++k)
+        {
+            if(mpi.isMaster())
+            {
+                for(int p = 1; p < nProc; ++p)
+                {
+                    std::vector<double> buff(size);
+                    mpi.recv(p, &(buff[0]), size, CosmoMPI::DOUBLE, tag);
+                    for(int j = 0; j < size; ++j)
+                    {
+                        if(buff[j] != p * 1000 + k * 10 + j)
+                        {
+                            output_screen("FAIL: element " << j << " of message " << k << " from process " << p << " is " << buff[j] << std::endl);
+                            res = 0;
+                        }
+                    }
+                    int ack = k;
+                    mpi.send(p, &ack, 1, CosmoMPI::INT, tag + 1);
+                }
+            }
+            else
+            {
+                double* buff = pool.getBuffer(size);
+                for(int j = 0; j < size; ++j)
+                    buff[j] = id * 1000 + k * 10 + j;
+                pool.isend(buff, size, 0, tag);
+
+                int ack;
+                mpi.recv(0, &ack, 1, CosmoMPI::INT, tag + 1);
+            }
+        }
+
+        pool.progress();
+        if(pool.pending() != 0 || pool.numBuffers() > 2)
+        {
+            output_screen("FAIL: " << pool.pending() << " sends are still pending and " << pool.numBuffers() << " buffers have been allocated for " << nMessages << " messages" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
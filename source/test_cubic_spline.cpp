@@ -1,4 +1,10 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <macros.hpp>
 #include <cubic_spline.hpp>
+#include <power_spectrum.hpp>
 #include <test_cubic_spline.hpp>
 
 std::string
@@ -10,13 +16,13 @@ TestCubicSpline::name() const
 unsigned int
 TestCubicSpline::numberOfSubtests() const
 {
-    return 3;
+    return 7;
 }
 
 void
 TestCubicSpline::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 3, "invalid index " << i);
+    check(i >= 0 && i < 7, "invalid index " << i);
 
     std::vector<double> x(3), y(3);
     x[0] = -1;
@@ -49,6 +55,165 @@ TestCubicSpline::runSubTest(unsigned int i, double& res, double& expected, std::
         res = cs1.evaluate(p);
         expected = -11.7187;
         break;
+    case 3:
+        {
+            subTestName = std::string("batch_monotonic");
+            std::vector<double> xs, ys;
+            for(int j = 0; j < 200; ++j)
+            {
+                xs.push_back(0.1 * j + 0.001 * j * j);
+                ys.push_back(std::sin(xs.back()));
+            }
+            const Math::CubicSpline cs(xs, ys);
+
+            // increasing, then decreasing, including the end points
+            const int n = 3001;
+            std::vector<double> in(2 * n), out;
+            for(int j = 0; j < n; ++j)
+            {
+                in[j] = xs[0] + (xs.back() - xs[0]) * j / (n - 1);
+                in[2 * n - 1 - j] = in[j];
+            }
+            in[n - 1] = xs.back();
+            in[n] = xs.back();
+            cs.evaluate(in, &out);
+            res = (out.size() == in.size() ? 1 : 0);
+            for(int j = 0; j < in.size(); ++j)
+            {
+                if(out[j] != cs.evaluate(in[j]))
+                {
+                    output_screen("FAIL: at x = " << in[j] << " batch evaluation gives " << out[j] << ", single evaluation gives " << cs.evaluate(in[j]) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 4:
+        {
+            subTestName = std::string("batch_random");
+            std::vector<double> xs, ys;
+            for(int j = 0; j < 50; ++j)
+            {
+                // unsorted input points
+                xs.push_back((j * 17) % 50);
+                ys.push_back(std::exp(-0.01 * xs.back() * xs.back()));
+            }
+            const Math::CubicSpline cs(xs, ys);
+
+            const int n = 1000;
+            std::vector<double> in(n), out(n);
+            for(int j = 0; j < n; ++j)
+                in[j] = 49.0 * ((j * 389) % n) / (n - 1);
+            cs.evaluate(n, &(in[0]), &(out[0]));
+            res = 1;
+            for(int j = 0; j < n; ++j)
+            {
+                double x0, a, b, c, d;
+                cs.getSplineParams(in[j], x0, a, b, c, d);
+                const double dx = in[j] - x0;
+                const double e = a + b * dx + c * dx * dx + d * dx * dx * dx;
+                if(std::abs(out[j] - e) > 1e-12)
+                {
+                    output_screen("FAIL: at x = " << in[j] << " batch evaluation gives " << out[j] << ", the spline parameters give " << e << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 5:
+        {
+            subTestName = std::string("power_spectrum_batch");
+            std::vector<double> kVals, amplitudes;
+            for(int j = 0; j < 20; ++j)
+            {
+                kVals.push_back(1e-6 * std::pow(10.0, 0.4 * j));
+                amplitudes.push_back(2e-9 * (1 + 0.1 * std::sin(double(j))));
+            }
+            const StandardPowerSpectrum ps1(2.2e-9, 0.965, 0.05, -0.01, 0.001);
+            const CutoffPowerSpectrum ps2(1e-3, 2.2e-9, 0.965, 0.05);
+            const StandardPowerSpectrumTensor ps3(1e-10, -0.01, 0.05, 0.001);
+            const LinearSplinePowerSpectrum ps4(kVals, amplitudes);
+            const CubicSplinePowerSpectrum ps5(kVals, amplitudes);
+            const Math::RealFunction* ps[5] = {&ps1, &ps2, &ps3, &ps4, &ps5};
+
+            const int n = 500;
+            std::vector<double> k(n), out(n);
+            for(int j = 0; j < n; ++j)
+                k[j] = std::min(1e-6 * std::pow(10.0, 7.6 * j / (n - 1)), kVals.back());
+
+            res = 1;
+            for(int m = 0; m < 5; ++m)
+            {
+                ps[m]->evaluate(n, &(k[0]), &(out[0]));
+                for(int j = 0; j < n; ++j)
+                {
+                    const double e = ps[m]->evaluate(k[j]);
+                    if(std::abs(out[j] - e) > 1e-14 * std::abs(e))
+                    {
+                        output_screen("FAIL: power spectrum " << m << " at k = " << k[j] << " batch evaluation gives " << out[j] << ", single evaluation gives " << e << std::endl);
+                        res = 0;
+                    }
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 6:
+        {
+            subTestName = std::string("set_values");
+            std::vector<double> xs, ys, ys2;
+            for(int j = 0; j < 30; ++j)
+            {
+                // unsorted input points
+                xs.push_back((j * 7) % 30);
+                ys.push_back(std::cos(0.2 * xs.back()));
+                ys2.push_back(std::exp(-0.05 * xs.back()));
+            }
+            Math::CubicSpline cs(xs, ys);
+            cs.setValues(&(ys2[0]));
+            const Math::CubicSpline cs2(xs, ys2);
+
+            res = 1;
+            for(int j = 0; j <= 290; ++j)
+            {
+                const double x = 0.1 * j;
+                if(std::abs(cs.evaluate(x) - cs2.evaluate(x)) > 1e-12)
+                {
+                    output_screen("FAIL: at x = " << x << " the spline with new values gives " << cs.evaluate(x) << ", the new spline gives " << cs2.evaluate(x) << std::endl);
+                    res = 0;
+                }
+            }
+
+            // the same for the spline parameters
+            std::vector<double> kVals, amplitudes, lnAmplitudes;
+            for(int j = 0; j < 10; ++j)
+            {
+                kVals.push_back(1e-5 * std::pow(10.0, 0.5 * j));
+                amplitudes.push_back(2e-9 * (1 + 0.1 * std::sin(double(j))));
+                lnAmplitudes.push_back(std::log(2.1e-9 * (1 + 0.2 * std::cos(double(j)))));
+            }
+            LinearSplinePowerSpectrum ps1(kVals, amplitudes);
+            CubicSplinePowerSpectrum ps2(kVals, amplitudes);
+            ps1.setLnAmplitudes(&(lnAmplitudes[0]));
+            ps2.setLnAmplitudes(&(lnAmplitudes[0]));
+            for(int j = 0; j < 10; ++j)
+                amplitudes[j] = std::exp(lnAmplitudes[j]);
+            const LinearSplinePowerSpectrum ps3(kVals, amplitudes);
+            const CubicSplinePowerSpectrum ps4(kVals, amplitudes);
+            for(int j = 0; j <= 100; ++j)
+            {
+                const double k = std::min(1e-5 * std::pow(10.0, 4.5 * j / 100), kVals.back());
+                if(std::abs(ps1.evaluate(k) - ps3.evaluate(k)) > 1e-12 * ps3.evaluate(k) || std::abs(ps2.evaluate(k) - ps4.evaluate(k)) > 1e-12 * ps4.evaluate(k))
+                {
+                    output_screen("FAIL: the power spectra with new amplitudes at k = " << k << " are " << ps1.evaluate(k) << " and " << ps2.evaluate(k) << ", expected " << ps3.evaluate(k) << " and " << ps4.evaluate(k) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
     default:
         check(false, "");
         break;
@@ -0,0 +1,254 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <test_device_large_vector.hpp>
+#include <device_large_vector.hpp>
+#include <lbfgs_general.hpp>
+#include <conjugate_gradient_general.hpp>
+
+std::string
+TestDeviceLargeVector::name() const
+{
+    return std::string("DEVICE LARGE VECTOR TESTER");
+}
+
+unsigned int
+TestDeviceLargeVector::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// the element i of the test vector number k
+double testElement(long i, int k)
+{
+    return std::sin(0.1 * (i + 1) * (k + 1)) + 0.01 * k;
+}
+
+void setTestVector(Math::DeviceLargeVector* v, int k)
+{
+    std::vector<double> x(v->size());
+    for(long i = 0; i < x.size(); ++i)
+        x[i] = testElement(i, k);
+    v->upload(x);
+}
+
+bool compareVector(const Math::DeviceLargeVector& v, const std::vector<double>& expected, const char* what)
+{
+    std::vector<double> x;
+    v.download(&x);
+    for(long i = 0; i < x.size(); ++i)
+    {
+        if(std::abs(x[i] - expected[i]) > 1e-10 * (std::abs(expected[i]) + 1))
+        {
+            output_screen("FAIL: the element " << i << " after " << what << " is " << x[i] << ", expected " << expected[i] << std::endl);
+            return false;
+        }
+    }
+    return true;
+}
+
+// sum_i (x_i - m_i)^2 / s_i^2 with the widths changing by a factor of 100, calculated with the operations of the vectors only, so it stays on the device
+class QuadraticFunction : public Math::DeviceFunction
+{
+public:
+    static double mean(long i) { return std::cos(0.01 * i); }
+    static double sigma(long i, long n) { return std::pow(10.0, 2.0 * i / (n - 1) - 1); }
+
+    QuadraticFunction(long n) : m_(n), w_(n), d_(n)
+    {
+        std::vector<double> m(n), w(n);
+        for(long i = 0; i < n; ++i)
+        {
+            m[i] = mean(i);
+            const double s = sigma(i, n);
+            w[i] = 1.0 / (s * s);
+        }
+        m_.upload(m);
+        w_.upload(w);
+    }
+
+    double value(const Math::DeviceLargeVector& x)
+    {
+        d_.copy(x);
+        return d_.addAndWeightedSquare(m_, -1, w_);
+    }
+
+    void derivative(const Math::DeviceLargeVector& x, Math::DeviceLargeVector* grad)
+    {
+        const Math::DeviceLargeVector* terms[2] = {&x, &m_};
+        const double c[2] = {2, -2};
+        grad->linearCombination(2, c, terms);
+        grad->multiply(w_);
+    }
+
+private:
+    Math::DeviceLargeVector m_, w_, d_;
+};
+
+bool checkMinimum(const Math::DeviceLargeVector& x)
+{
+    const long n = x.size();
+    std::vector<double> v;
+    x.download(&v);
+    for(long j = 0; j < n; ++j)
+    {
+        if(std::abs(v[j] - QuadraticFunction::mean(j)) > 1e-3 * QuadraticFunction::sigma(j, n))
+        {
+            output_screen("FAIL: the minimum is at " << v[j] << " for element " << j << ", expected " << QuadraticFunction::mean(j) << std::endl);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+void
+TestDeviceLargeVector::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    using namespace Math;
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("operations");
+        const long n = 100003;
+        const int k = 4;
+        DeviceLargeVector x(n), w(n), y0(n), y1(n), y2(n), y3(n);
+        DeviceLargeVector* y[k] = {&y0, &y1, &y2, &y3};
+        setTestVector(&x, k);
+        for(int j = 0; j < k; ++j)
+            setTestVector(y[j], j);
+
+        std::vector<double> wHost(n);
+        for(long j = 0; j < n; ++j)
+            wHost[j] = 1.0 + 0.5 * std::cos(0.3 * j);
+        w.upload(wHost);
+
+        std::vector<double> expectedDots(k, 0);
+        double expectedSquare = 0, expectedNorm = 0;
+        const double c = 0.7;
+        for(long j = 0; j < n; ++j)
+        {
+            const double xj = testElement(j, k);
+            expectedNorm += xj * xj;
+            for(int l = 0; l < k; ++l)
+                expectedDots[l] += xj * testElement(j, l);
+            const double sum = xj + c * testElement(j, 0);
+            expectedSquare += wHost[j] * sum * sum;
+        }
+        expectedNorm = std::sqrt(expectedNorm);
+
+        if(std::abs(x.norm() - expectedNorm) > 1e-10 * expectedNorm)
+        {
+            output_screen("FAIL: the norm is " << x.norm() << ", expected " << expectedNorm << std::endl);
+            res = 0;
+        }
+
+        double dots[k];
+        x.dotProducts(k, y, dots);
+        for(int l = 0; l < k; ++l)
+        {
+            const double single = x.dotProduct(*(y[l]));
+            if(std::abs(dots[l] - expectedDots[l]) > 1e-8 * std::abs(expectedDots[l]) + 1e-8 || std::abs(single - expectedDots[l]) > 1e-8 * std::abs(expectedDots[l]) + 1e-8)
+            {
+                output_screen("FAIL: dot product " << l << " is " << dots[l] << " (fused) and " << single << ", expected " << expectedDots[l] << std::endl);
+                res = 0;
+            }
+        }
+
+        const double square = x.addAndWeightedSquare(y0, c, w);
+        if(std::abs(square - expectedSquare) > 1e-8 * expectedSquare)
+        {
+            output_screen("FAIL: the weighted square is " << square << ", expected " << expectedSquare << std::endl);
+            res = 0;
+        }
+
+        // x is now x + c y0, then the linear combination with x itself as the second term
+        std::vector<double> e(n);
+        const double coefs[3] = {0.5, -2.0, 3.0};
+        const DeviceLargeVector* terms[3] = {&y1, &x, &y2};
+        x.linearCombination(3, coefs, terms);
+        for(long j = 0; j < n; ++j)
+            e[j] = 0.5 * testElement(j, 1) - 2.0 * (testElement(j, k) + c * testElement(j, 0)) + 3.0 * testElement(j, 2);
+        if(!compareVector(x, e, "linearCombination"))
+            res = 0;
+
+        x.multiply(w);
+        for(long j = 0; j < n; ++j)
+            e[j] *= wHost[j];
+        if(!compareVector(x, e, "multiply"))
+            res = 0;
+
+        x.divide(w);
+        x.add(y3, -1.5);
+        for(long j = 0; j < n; ++j)
+            e[j] = e[j] / wHost[j] - 1.5 * testElement(j, 3);
+        if(!compareVector(x, e, "divide and add"))
+            res = 0;
+
+        w.pow(-0.5);
+        x.copy(w, 2.0);
+        for(long j = 0; j < n; ++j)
+            e[j] = 2.0 / std::sqrt(wHost[j]);
+        if(!compareVector(x, e, "pow and copy"))
+            res = 0;
+
+        x.swap(y0);
+        if(!compareVector(y0, e, "swap"))
+            res = 0;
+
+        y0.setToZero();
+        if(y0.norm() != 0)
+        {
+            output_screen("FAIL: the norm after setToZero is " << y0.norm() << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("lbfgs");
+        const long n = 1000;
+        QuadraticFunction f(n);
+        DeviceLBFGSFunc func(f);
+        DeviceLargeVectorFactory factory(n);
+        DeviceLargeVector starting(n);
+        LBFGS_General<DeviceLargeVector, DeviceLargeVectorFactory, DeviceLBFGSFunc> lbfgs(&factory, &func, starting);
+        DeviceLargeVector x(n);
+        lbfgs.minimize(&x, 1e-10, 1e-8, 10000);
+        if(!checkMinimum(x))
+            res = 0;
+    }
+        break;
+    case 2:
+    {
+        subTestName = std::string("cg");
+        const long n = 1000;
+        QuadraticFunction f(n);
+        DeviceLBFGSFunc func(f);
+        DeviceLargeVectorFactory factory(n);
+        DeviceLargeVector starting(n);
+        CG_General<DeviceLargeVector, DeviceLargeVectorFactory, DeviceLBFGSFunc> cg(&factory, &func, starting);
+        DeviceLargeVector x(n);
+        cg.minimize(&x, 1e-30, 1e-8, 100000, CG_General<DeviceLargeVector, DeviceLargeVectorFactory, DeviceLBFGSFunc>::POLAK_RIBIERE);
+        if(!checkMinimum(x))
+            res = 0;
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
+
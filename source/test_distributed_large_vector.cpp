@@ -0,0 +1,214 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <test_distributed_large_vector.hpp>
+#include <distributed_large_vector.hpp>
+#include <lbfgs_general.hpp>
+#include <cosmo_mpi.hpp>
+
+std::string
+TestDistributedLargeVector::name() const
+{
+    return std::string("DISTRIBUTED LARGE VECTOR TESTER");
+}
+
+unsigned int
+TestDistributedLargeVector::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// the element i of the test vector number k
+double testElement(long i, int k)
+{
+    return std::sin(0.1 * (i + 1) * (k + 1)) + 0.01 * k;
+}
+
+void setTestVector(Math::DistributedLargeVector* v, int k)
+{
+    for(long i = 0; i < v->localSize(); ++i)
+        v->contents()[i] = testElement(v->localBegin() + i, k);
+}
+
+// sum_i (x_i - m_i)^2 / s_i^2 with the widths changing by a factor of 100
+class QuadraticFunction : public Math::DistributedFunction
+{
+public:
+    static double mean(long i) { return std::cos(0.01 * i); }
+    static double sigma(long i, long n) { return std::pow(10.0, 2.0 * i / (n - 1) - 1); }
+
+    QuadraticFunction(long n) : n_(n) {}
+
+    double localValue(const std::vector<double>& x, long begin) const
+    {
+        double res = 0;
+        for(long i = 0; i < x.size(); ++i)
+        {
+            const double d = (x[i] - mean(begin + i)) / sigma(begin + i, n_);
+            res += d * d;
+        }
+        return res;
+    }
+
+    void localDerivative(const std::vector<double>& x, long begin, std::vector<double>* grad) const
+    {
+        for(long i = 0; i < x.size(); ++i)
+        {
+            const double s = sigma(begin + i, n_);
+            (*grad)[i] = 2 * (x[i] - mean(begin + i)) / (s * s);
+        }
+    }
+
+private:
+    const long n_;
+};
+
+} // namespace
+
+void
+TestDistributedLargeVector::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    using namespace Math;
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("reductions");
+        const long n = 100003;
+        const int k = 4;
+        DistributedLargeVector x(n), w(n), y0(n), y1(n), y2(n), y3(n);
+        DistributedLargeVector* y[k] = {&y0, &y1, &y2, &y3};
+        setTestVector(&x, k);
+        for(int j = 0; j < k; ++j)
+            setTestVector(y[j], j);
+        for(long j = 0; j < w.localSize(); ++j)
+            w.contents()[j] = 1.0 + 0.5 * std::cos(0.3 * (w.localBegin() + j));
+
+        // the expected results from the whole vectors, summed in the same order
+        std::vector<double> expectedDots(k, 0);
+        double expectedSquare = 0;
+        const double c = 0.7;
+        for(long j = 0; j < n; ++j)
+        {
+            const double xj = testElement(j, k);
+            for(int l = 0; l < k; ++l)
+                expectedDots[l] += xj * testElement(j, l);
+            const double sum = xj + c * testElement(j, 0);
+            expectedSquare += (1.0 + 0.5 * std::cos(0.3 * j)) * sum * sum;
+        }
+
+        double dots[k];
+        x.dotProducts(k, y, dots);
+        for(int l = 0; l < k; ++l)
+        {
+            const double single = x.dotProduct(*(y[l]));
+            if(std::abs(dots[l] - expectedDots[l]) > 1e-8 * std::abs(expectedDots[l]) + 1e-8 || std::abs(single - expectedDots[l]) > 1e-8 * std::abs(expectedDots[l]) + 1e-8)
+            {
+                output_screen("FAIL: dot product " << l << " is " << dots[l] << " (fused) and " << single << ", expected " << expectedDots[l] << std::endl);
+                res = 0;
+            }
+        }
+
+        const double square = x.addAndWeightedSquare(y0, c, w);
+        if(std::abs(square - expectedSquare) > 1e-8 * expectedSquare)
+        {
+            output_screen("FAIL: the weighted square is " << square << ", expected " << expectedSquare << std::endl);
+            res = 0;
+        }
+
+        // the gathered vector must be x + c y0 on all of the processes
+        std::vector<double> whole;
+        x.gather(&whole);
+        for(long j = 0; j < n; ++j)
+        {
+            const double e = testElement(j, k) + c * testElement(j, 0);
+            if(std::abs(whole[j] - e) > 1e-12)
+            {
+                output_screen("FAIL: the gathered element " << j << " is " << whole[j] << ", expected " << e << std::endl);
+                res = 0;
+                break;
+            }
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("whitenoise");
+        const long n = 10000;
+        QuadraticFunction f(n);
+        DistributedLBFGSFunc func(f);
+        DistributedLargeVector x(n);
+        func.whitenoise(100, &x, 2.0);
+        std::vector<double> whole;
+        x.gather(&whole);
+
+        // the noise of the elements of one process must be the same as from a vector with a different partition
+        CosmoMPI::Communicator* single = CosmoMPI::create().split(CosmoMPI::create().processId());
+        DistributedLargeVector xSingle(n, single);
+        func.whitenoise(100, &xSingle, 2.0);
+        for(long j = 0; j < n; ++j)
+        {
+            if(whole[j] != xSingle.contents()[j])
+            {
+                output_screen("FAIL: the noise element " << j << " is " << whole[j] << " from all of the processes and " << xSingle.contents()[j] << " from one" << std::endl);
+                res = 0;
+                break;
+            }
+        }
+
+        double mean = 0, var = 0;
+        for(long j = 0; j < n; ++j)
+        {
+            mean += whole[j];
+            var += whole[j] * whole[j];
+        }
+        mean /= n;
+        var = var / n - mean * mean;
+        if(std::abs(mean) > 0.1 || std::abs(std::sqrt(var) / 2.0 - 1) > 0.05)
+        {
+            output_screen("FAIL: the noise has mean " << mean << " and sigma " << std::sqrt(var) << ", expected 0 and 2" << std::endl);
+            res = 0;
+        }
+        delete single;
+    }
+        break;
+    case 2:
+    {
+        subTestName = std::string("lbfgs");
+        const long n = 1000;
+        QuadraticFunction f(n);
+        DistributedLBFGSFunc func(f);
+        DistributedLargeVectorFactory factory(n);
+        DistributedLargeVector starting(n);
+        LBFGS_General<DistributedLargeVector, DistributedLargeVectorFactory, DistributedLBFGSFunc> lbfgs(&factory, &func, starting);
+        DistributedLargeVector x(n);
+        lbfgs.minimize(&x, 1e-10, 1e-8, 10000);
+
+        std::vector<double> whole;
+        x.gather(&whole);
+        for(long j = 0; j < n; ++j)
+        {
+            if(std::abs(whole[j] - QuadraticFunction::mean(j)) > 1e-3 * QuadraticFunction::sigma(j, n))
+            {
+                output_screen("FAIL: the minimum is at " << whole[j] << " for element " << j << ", expected " << QuadraticFunction::mean(j) << std::endl);
+                res = 0;
+                break;
+            }
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
@@ -0,0 +1,124 @@
+#include <cmath>
+#include <vector>
+
+#include <macros.hpp>
+#include <matrix_impl.hpp>
+#include <distributed_matrix.hpp>
+#include <test_distributed_matrix.hpp>
+
+std::string
+TestDistributedMatrix::name() const
+{
+    return std::string("DISTRIBUTED MATRIX TESTER");
+}
+
+unsigned int
+TestDistributedMatrix::numberOfSubtests() const
+{
+    return 2;
+}
+
+void
+TestDistributedMatrix::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        return;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        return;
+    default:
+        check(false, "");
+        return;
+    }
+}
+
+namespace
+{
+
+// a positive definite matrix with a slowly decaying correlation, like a pixel covariance matrix
+double
+testElement(int i, int j)
+{
+    return (i == j ? 2.0 : 0.0) + 1.0 / (1.0 + std::abs(i - j));
+}
+
+// the matrix is blocked with small blocks so that it is spread over all of the processes
+const int testSize = 50;
+const int testBlockSize = 8;
+
+void
+fillTestMatrix(Math::DistributedSymmetricMatrix& mat)
+{
+    for(int i = 0; i < mat.size(); ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+        {
+            if(mat.isLocal(i, j))
+                mat.set(i, j, testElement(i, j));
+        }
+    }
+}
+
+} // namespace
+
+void
+TestDistributedMatrix::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    Math::DistributedSymmetricMatrix mat(testSize, testBlockSize);
+    fillTestMatrix(mat);
+    const int info = mat.choleskyFactorize();
+    check(info == 0, "factorization failed, info = " << info);
+    res = mat.logDetFromCholeskyFactorization();
+
+    Math::SymmetricMatrix<double> full(testSize, testSize);
+    for(int i = 0; i < testSize; ++i)
+        for(int j = 0; j <= i; ++j)
+            full(i, j) = testElement(i, j);
+    int sign;
+    expected = full.logDet(&sign);
+
+    subTestName = "log_det";
+}
+
+void
+TestDistributedMatrix::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    Math::DistributedSymmetricMatrix mat(testSize, testBlockSize);
+    fillTestMatrix(mat);
+    const int info = mat.choleskyFactorize();
+    check(info == 0, "factorization failed, info = " << info);
+
+    // two right hand sides, the solutions are checked by multiplying back
+    const int nRhs = 2;
+    std::vector<double> b(testSize * nRhs);
+    for(int i = 0; i < testSize; ++i)
+    {
+        b[i] = std::sin(0.3 * i);
+        b[testSize + i] = 1.0;
+    }
+    std::vector<double> x = b;
+    const int info1 = mat.solveFromCholeskyFactorization(x, nRhs);
+    check(info1 == 0, "solution failed, info = " << info1);
+
+    double maxDiff = 0;
+    for(int k = 0; k < nRhs; ++k)
+    {
+        for(int i = 0; i < testSize; ++i)
+        {
+            double y = 0;
+            for(int j = 0; j < testSize; ++j)
+                y += testElement(i, j) * x[k * testSize + j];
+            maxDiff = std::max(maxDiff, std::abs(y - b[k * testSize + i]));
+        }
+    }
+
+    res = maxDiff;
+    expected = 0;
+    subTestName = "solve";
+}
+
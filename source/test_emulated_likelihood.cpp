@@ -0,0 +1,453 @@
+#include <cmath>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <random.hpp>
+#include <numerics.hpp>
+#include <emulated_likelihood.hpp>
+#include <learn_as_you_go.hpp>
+#include <test_emulated_likelihood.hpp>
+
+std::string
+TestEmulatedLikelihood::name() const
+{
+    return std::string("EMULATED LIKELIHOOD TESTER");
+}
+
+unsigned int
+TestEmulatedLikelihood::numberOfSubtests() const
+{
+    return 6;
+}
+
+namespace
+{
+
+class EmulatedTestLike : public Math::LikelihoodFunction
+{
+public:
+    EmulatedTestLike() : count_(0) {}
+
+    double calculate(double* params, int nParams)
+    {
+        ++count_;
+        return value(params);
+    }
+
+    static double value(const double* params)
+    {
+        const double x = (params[0] - 0.1) / 0.2, y = (params[1] + 0.2) / 0.3;
+        return x * x + y * y + params[0] * params[1];
+    }
+
+    static void gradient(const double* params, double* grad)
+    {
+        grad[0] = 2 * (params[0] - 0.1) / 0.04 + params[1];
+        grad[1] = 2 * (params[1] + 0.2) / 0.09 + params[0];
+    }
+
+    int count() const { return count_; }
+
+private:
+    int count_;
+};
+
+// evaluates random points with the emulator, returns the number of approximated ones and their largest error
+int evaluateEmulatedTestPoints(EmulatedLikelihood<EmulatedTestLike>& emulated, int n, Math::UniformRealGenerator& gen, double& maxError)
+{
+    int approximated = 0;
+    maxError = 0;
+    double x[2];
+    for(int i = 0; i < n; ++i)
+    {
+        x[0] = 0.8 * gen.generate();
+        x[1] = 0.8 * gen.generate();
+        const double res = emulated.calculate(x, 2);
+
+        bool approximate;
+        int retries;
+        emulated.lastEvaluationInfo(&approximate, &retries);
+        if(approximate)
+        {
+            ++approximated;
+            maxError = std::max(maxError, std::abs(res - EmulatedTestLike::value(x)));
+        }
+    }
+    return approximated;
+}
+
+// a function for LearnAsYouGo directly, counting its calls
+class CountingTestFunction : public Math::RealFunctionMultiToMulti
+{
+public:
+    CountingTestFunction() : count_(0) {}
+
+    virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+    {
+        ++count_;
+        res->resize(2);
+        (*res)[0] = value(x);
+        (*res)[1] = x[0] - x[1] * x[2];
+    }
+
+    static double value(const std::vector<double>& x) { return x[0] * x[0] + 2 * x[1] + std::cos(x[2]); }
+
+    int count() const { return count_; }
+
+private:
+    mutable int count_;
+};
+
+class FirstOutput : public Math::RealFunctionMultiDim
+{
+public:
+    virtual double evaluate(const std::vector<double>& x) const { return x[0]; }
+};
+
+// the points of each process are different from the ones of the other processes, some of the coordinates are 0
+void testPoint(int processId, int j, std::vector<double>* p)
+{
+    p->resize(3);
+    (*p)[0] = processId + 0.001 * j;
+    (*p)[1] = std::sin(0.1 * j);
+    (*p)[2] = (j % 5 == 0 ? 0.0 : 1.0 / (j + 1));
+}
+
+} // namespace
+
+void
+TestEmulatedLikelihood::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 6, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    Math::UniformRealGenerator gen(1000 + 17 * mpi.processId() + i, -1, 1);
+
+    const double precision = 0.05;
+    const int nTest = 300;
+
+    if(i == 0)
+    {
+        subTestName = std::string("approximation");
+
+        EmulatedTestLike like;
+        EmulatedLikelihood<EmulatedTestLike> emulated(like, 2, "", precision, 2000);
+
+        double x[2];
+        for(int j = 0; j < 2500; ++j)
+        {
+            x[0] = gen.generate();
+            x[1] = gen.generate();
+            const double l = emulated.calculateExact(x, 2);
+            if(l != EmulatedTestLike::value(x))
+            {
+                output_screen("FAIL: the exact calculation gives " << l << ", expected " << EmulatedTestLike::value(x) << "." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+
+        const int exactBefore = like.count();
+        double maxError;
+        const int approximated = evaluateEmulatedTestPoints(emulated, nTest, gen, maxError);
+        const int exactCount = like.count() - exactBefore;
+
+        output_screen1("Approximated " << approximated << " out of " << nTest << " points, the largest error is " << maxError << "." << std::endl);
+        if(approximated < nTest / 2 || maxError > 10 * precision)
+        {
+            output_screen("FAIL: approximated " << approximated << " out of " << nTest << " points with the largest error " << maxError << "." << std::endl);
+            res = 0;
+        }
+
+        // the wrapped likelihood is only called for the points that are not approximated
+        if(exactCount != nTest - approximated)
+        {
+            output_screen("FAIL: the likelihood has been called " << exactCount << " times for " << nTest - approximated << " exact calculations." << std::endl);
+            res = 0;
+        }
+    }
+    else if(i == 1)
+    {
+        subTestName = std::string("training_set_file");
+
+        const std::string fileName = "test_files/emulated_likelihood_test.dat";
+        if(mpi.isMaster())
+        {
+            std::remove(fileName.c_str());
+            std::remove((fileName + ".fast").c_str());
+        }
+        mpi.barrier();
+
+        {
+            EmulatedTestLike like;
+            EmulatedLikelihood<EmulatedTestLike> emulated(like, 2, fileName.c_str(), precision, 2000);
+            double x[2];
+            for(int j = 0; j < 2500; ++j)
+            {
+                x[0] = gen.generate();
+                x[1] = gen.generate();
+                emulated.calculateExact(x, 2);
+            }
+        }
+
+        // the training set is written by the master process in the destructor
+        mpi.barrier();
+
+        // a new run starts with the saved training set, so the approximation is used right away
+        {
+            EmulatedTestLike like;
+            EmulatedLikelihood<EmulatedTestLike> emulated(like, 2, fileName.c_str(), precision, 2000);
+            double maxError;
+            const int approximated = evaluateEmulatedTestPoints(emulated, nTest, gen, maxError);
+            if(approximated < nTest / 2 || maxError > 10 * precision || like.count() != nTest - approximated)
+            {
+                output_screen("FAIL: after reading the training set approximated " << approximated << " out of " << nTest << " points with the largest error " << maxError << ", the likelihood has been called " << like.count() << " times." << std::endl);
+                res = 0;
+            }
+        }
+
+        mpi.barrier();
+        if(mpi.isMaster())
+        {
+            std::remove(fileName.c_str());
+            std::remove((fileName + ".fast").c_str());
+        }
+    }
+    else if(i == 2)
+    {
+        subTestName = std::string("active_learning");
+
+        EmulatedTestLike like;
+        EmulatedLikelihood<EmulatedTestLike> emulated(like, 2, "", precision, 2000);
+
+        // the training set is built by active learning only, first a latin hypercube fill, then the points with the largest errors
+        const std::vector<double> mins(2, -1), maxs(2, 1);
+        const unsigned long count = emulated.emulator().activeLearn(2500, mins, maxs);
+        if(count != like.count())
+        {
+            output_screen("FAIL: active learning reports " << count << " calculations, the likelihood has been called " << like.count() << " times." << std::endl);
+            res = 0;
+        }
+
+        // around a center the candidates stay within the range
+        std::vector<std::vector<double> > centers(1, std::vector<double>(2, 0.95));
+        const unsigned long countCenters = emulated.emulator().activeLearn(100, mins, maxs, &centers, 0.1);
+        if(countCenters != like.count() - count)
+        {
+            output_screen("FAIL: active learning around a center reports " << countCenters << " calculations, the likelihood has been called " << like.count() - count << " times." << std::endl);
+            res = 0;
+        }
+
+        double maxError;
+        const int approximated = evaluateEmulatedTestPoints(emulated, nTest, gen, maxError);
+        output_screen1("After active learning approximated " << approximated << " out of " << nTest << " points, the largest error is " << maxError << "." << std::endl);
+        if(approximated < nTest / 2 || maxError > 10 * precision)
+        {
+            output_screen("FAIL: after active learning approximated " << approximated << " out of " << nTest << " points with the largest error " << maxError << "." << std::endl);
+            res = 0;
+        }
+    }
+    else if(i == 3)
+    {
+        subTestName = std::string("gradient");
+
+        EmulatedTestLike like;
+        EmulatedLikelihood<EmulatedTestLike> emulated(like, 2, "", precision, 2000);
+        EmulatedLikelihoodWithDerivs<EmulatedTestLike> derivs(emulated, std::vector<double>(2, 1e-4));
+
+        // before the emulator is constructed the gradient comes from finite differences
+        double x[2] = {0.3, -0.1};
+        double grad[2], expectedGrad[2];
+        EmulatedTestLike::gradient(x, expectedGrad);
+        for(int k = 0; k < 2; ++k)
+        {
+            const double d = derivs.calculateDeriv(x, 2, k);
+            if(derivs.isGradientFromEmulator() || !Math::areEqual(d, expectedGrad[k], 1e-5))
+            {
+                output_screen("FAIL: the finite difference derivative " << k << " is " << d << ", expected " << expectedGrad[k] << "." << std::endl);
+                res = 0;
+            }
+        }
+
+        for(int j = 0; j < 2500; ++j)
+        {
+            x[0] = gen.generate();
+            x[1] = gen.generate();
+            emulated.calculateExact(x, 2);
+        }
+
+        // the test function is quadratic, so the local quadratic fit gives its derivatives
+        const double expectedHessian[4] = {2 / 0.04, 1, 1, 2 / 0.09};
+        double maxGradError = 0, maxHessianError = 0;
+        for(int j = 0; j < 100; ++j)
+        {
+            x[0] = 0.8 * gen.generate();
+            x[1] = 0.8 * gen.generate();
+            double value, hessian[4];
+            if(!emulated.calculateWithGradient(x, 2, &value, grad, hessian))
+            {
+                output_screen("FAIL: the emulator gives no gradient after training." << std::endl);
+                res = 0;
+                return;
+            }
+            EmulatedTestLike::gradient(x, expectedGrad);
+            for(int k = 0; k < 2; ++k)
+                maxGradError = std::max(maxGradError, std::abs(grad[k] - expectedGrad[k]));
+            for(int k = 0; k < 4; ++k)
+                maxHessianError = std::max(maxHessianError, std::abs(hessian[k] - expectedHessian[k]));
+        }
+
+        output_screen1("The largest gradient error is " << maxGradError << ", the largest Hessian error is " << maxHessianError << "." << std::endl);
+        if(maxGradError > 0.05 || maxHessianError > 0.5)
+        {
+            output_screen("FAIL: the largest gradient error is " << maxGradError << ", the largest Hessian error is " << maxHessianError << "." << std::endl);
+            res = 0;
+        }
+
+        // the adapter evaluates the emulator once for the value and all of the derivatives at the same point
+        x[0] = 0.25;
+        x[1] = 0.15;
+        const double l = derivs.calculate(x, 2);
+        const int countBefore = like.count();
+        derivs.calculateDeriv(x, 2, 0);
+        derivs.calculateDeriv(x, 2, 1);
+        EmulatedTestLike::gradient(x, expectedGrad);
+        if(!derivs.isGradientFromEmulator() || like.count() != countBefore || std::abs(derivs.calculateDeriv(x, 2, 1) - expectedGrad[1]) > 0.05 || std::abs(l - EmulatedTestLike::value(x)) > 10 * precision)
+        {
+            output_screen("FAIL: the adapter gives " << l << " and derivative " << derivs.calculateDeriv(x, 2, 1) << ", expected " << EmulatedTestLike::value(x) << " and " << expectedGrad[1] << "." << std::endl);
+            res = 0;
+        }
+    }
+    else if(i == 4)
+    {
+        subTestName = std::string("point_lookup");
+
+        // no approximation, so every new point is calculated and added to the training set
+        CountingTestFunction f;
+        FirstOutput errorFunc;
+        LearnAsYouGo lagy(3, 2, f, errorFunc, 1000000, precision, "");
+
+        // many more points than the initial size of the lookup table, so it is rebuilt a few times
+        const int nPoints = 1000;
+        std::vector<double> p, r;
+        for(int j = 0; j < nPoints; ++j)
+        {
+            testPoint(mpi.processId(), j, &p);
+            lagy.evaluate(p, &r);
+        }
+
+        if(f.count() != nPoints || lagy.getTrainingSetSize() < nPoints)
+        {
+            output_screen("FAIL: the function has been called " << f.count() << " times for " << nPoints << " different points, the training set has " << lagy.getTrainingSetSize() << " points." << std::endl);
+            res = 0;
+        }
+
+        // all of the points are found again, also with -0 instead of 0
+        for(int j = 0; j < nPoints; ++j)
+        {
+            testPoint(mpi.processId(), j, &p);
+            if(p[2] == 0)
+                p[2] = -0.0;
+            lagy.evaluate(p, &r);
+            if(lagy.lastEvaluationPath() != LearnAsYouGo::SAME_POINT || r[0] != CountingTestFunction::value(p))
+            {
+                output_screen("FAIL: the point " << j << " has not been found again, the result is " << r[0] << ", expected " << CountingTestFunction::value(p) << "." << std::endl);
+                res = 0;
+                break;
+            }
+        }
+
+        if(f.count() != nPoints)
+        {
+            output_screen("FAIL: the function has been called " << f.count() - nPoints << " times for the repeated points." << std::endl);
+            res = 0;
+        }
+
+        // a point that differs only in the last bit is a new point
+        testPoint(mpi.processId(), 1, &p);
+        p[1] = std::nextafter(p[1], 10.0);
+        lagy.evaluate(p, &r);
+        const bool calculated = (lagy.lastEvaluationPath() == LearnAsYouGo::CALCULATED);
+
+        // and evaluateExact finds it after that
+        lagy.evaluateExact(p, &r);
+        if(!calculated || f.count() != nPoints + 1)
+        {
+            output_screen("FAIL: a point that differs from the training set in the last bit has been calculated " << f.count() - nPoints << " times, expected once." << std::endl);
+            res = 0;
+        }
+
+        double total = res;
+        mpi.reduce(&res, &total, 1, CosmoMPI::DOUBLE, CosmoMPI::MIN);
+        res = total;
+    }
+    else if(i == 5)
+    {
+        subTestName = std::string("collective_sync");
+
+        CountingTestFunction f;
+        FirstOutput errorFunc;
+        LearnAsYouGo lagy(3, 2, f, errorFunc, 1000000, precision, "");
+        lagy.useCollectiveSync(7);
+
+        // the number of points is not a multiple of the exchange interval, so the last exchange happens while the processes are only reading
+        const int nPoints = 200;
+        std::vector<double> p, r;
+        for(int j = 0; j < nPoints; ++j)
+        {
+            testPoint(mpi.processId(), j, &p);
+            lagy.evaluate(p, &r);
+        }
+
+        // keep evaluating a known point until all of the processes have all of the points, the exchanges only make progress in evaluate
+        const unsigned long totalPoints = (unsigned long)(nPoints) * mpi.numProcesses();
+        testPoint(mpi.processId(), 0, &p);
+        int iterations = 0;
+        for(; iterations < 100000; ++iterations)
+        {
+            double haveAll = (lagy.getTrainingSetSize() == totalPoints ? 1 : 0), allHaveAll = 0;
+            mpi.allreduce(&haveAll, &allHaveAll, 1, CosmoMPI::DOUBLE, CosmoMPI::MIN);
+            if(allHaveAll == 1)
+                break;
+            lagy.evaluate(p, &r);
+        }
+
+        if(lagy.getTrainingSetSize() != totalPoints)
+        {
+            output_screen("FAIL: the training set has " << lagy.getTrainingSetSize() << " points after " << iterations << " exchanges, expected " << totalPoints << "." << std::endl);
+            res = 0;
+        }
+
+        // the points of all of the processes are found with their values, without calculating them again
+        for(int k = 0; k < mpi.numProcesses() && res == 1; ++k)
+        {
+            for(int j = 0; j < nPoints; ++j)
+            {
+                testPoint(k, j, &p);
+                lagy.evaluate(p, &r);
+                if(lagy.lastEvaluationPath() != LearnAsYouGo::SAME_POINT || r[0] != CountingTestFunction::value(p) || r[1] != p[0] - p[1] * p[2])
+                {
+                    output_screen("FAIL: the point " << j << " of process " << k << " is not in the training set with the right values." << std::endl);
+                    res = 0;
+                    break;
+                }
+            }
+        }
+
+        if(f.count() != nPoints)
+        {
+            output_screen("FAIL: the function has been called " << f.count() << " times, expected " << nPoints << "." << std::endl);
+            res = 0;
+        }
+
+        double total = res;
+        mpi.reduce(&res, &total, 1, CosmoMPI::DOUBLE, CosmoMPI::MIN);
+        res = total;
+    }
+}
@@ -0,0 +1,122 @@
+#include <string>
+#include <sstream>
+#include <cmath>
+
+#include <test_ensemble_sampler.hpp>
+#include <ensemble_sampler.hpp>
+#include <markov_chain.hpp>
+#include <numerics.hpp>
+
+std::string
+TestEnsembleSampler::name() const
+{
+    return std::string("ENSEMBLE SAMPLER TESTER");
+}
+
+unsigned int
+TestEnsembleSampler::numberOfSubtests() const
+{
+    return 2;
+}
+
+namespace
+{
+
+// a strongly correlated two dimensional gaussian, x has mean 1 and sigma 2, y has mean -2 and sigma 1, the correlation coefficient is 0.9
+class EnsembleSamplerTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    virtual double calculate(double* params, int nParams)
+    {
+        check(nParams == 2, "");
+        const double dx = (params[0] - 1) / 2, dy = (params[1] + 2);
+        const double rho = 0.9;
+        return (dx * dx + dy * dy - 2 * rho * dx * dy) / (1 - rho * rho);
+    }
+};
+
+} // namespace
+
+void
+TestEnsembleSampler::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    using namespace Math;
+
+    subTestName = (i == 0 ? std::string("stretch_move") : std::string("walk_move"));
+    res = 1;
+    expected = 1;
+
+    EnsembleSamplerTestLikelihood like;
+
+    std::stringstream root;
+    root << "test_files/ensemble_sampler_test_" << i;
+
+    const int nWalkers = 32;
+    EnsembleSampler es(2, like, root.str(), nWalkers);
+    es.setParam(0, "x", -20, 20, 0, 0.5);
+    es.setParam(1, "y", -20, 20, 0, 0.5);
+    if(i == 1)
+        es.useWalkMove();
+
+    const unsigned long burnin = 500;
+    const double acceptance = es.run(5000, 1, 0);
+
+    if(!isMaster())
+        return;
+
+    if(acceptance < 0.1 || acceptance > 0.9)
+    {
+        output_screen("FAIL: The acceptance fraction " << acceptance << " is unreasonable." << std::endl);
+        res = 0;
+    }
+
+    std::stringstream fileName;
+    fileName << root.str() << ".txt";
+    MarkovChain chain(fileName.str().c_str(), burnin * nWalkers);
+
+    double total = 0, sumX = 0, sumY = 0, sumXX = 0, sumYY = 0, sumXY = 0;
+    for(unsigned long j = 0; j < chain.size(); ++j)
+    {
+        const double p = chain.prob(j);
+        const double x = chain.param(j, 0), y = chain.param(j, 1);
+        total += p;
+        sumX += p * x;
+        sumY += p * y;
+        sumXX += p * x * x;
+        sumYY += p * y * y;
+        sumXY += p * x * y;
+    }
+
+    const double meanX = sumX / total, meanY = sumY / total;
+    const double sigmaX = std::sqrt(sumXX / total - meanX * meanX), sigmaY = std::sqrt(sumYY / total - meanY * meanY);
+    const double rho = (sumXY / total - meanX * meanY) / (sigmaX * sigmaY);
+
+    if(!Math::areEqual(1.0, meanX, 0.2))
+    {
+        output_screen("FAIL: Expected x mean is 1, the result is " << meanX << std::endl);
+        res = 0;
+    }
+    if(!Math::areEqual(-2.0, meanY, 0.1))
+    {
+        output_screen("FAIL: Expected y mean is -2, the result is " << meanY << std::endl);
+        res = 0;
+    }
+    if(!Math::areEqual(2.0, sigmaX, 0.1))
+    {
+        output_screen("FAIL: Expected x sigma is 2, the result is " << sigmaX << std::endl);
+        res = 0;
+    }
+    if(!Math::areEqual(1.0, sigmaY, 0.1))
+    {
+        output_screen("FAIL: Expected y sigma is 1, the result is " << sigmaY << std::endl);
+        res = 0;
+    }
+    if(!Math::areEqual(0.9, rho, 0.03))
+    {
+        output_screen("FAIL: Expected correlation coefficient is 0.9, the result is " << rho << std::endl);
+        res = 0;
+    }
+}
+
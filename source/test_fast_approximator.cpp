@@ -13,7 +13,7 @@ TestFastApproximator::name() const
 unsigned int
 TestFastApproximator::numberOfSubtests() const
 {
-    return 1;
+    return 3;
 }
 
 double fastApproxTestFunc(double x)
@@ -21,11 +21,36 @@ double fastApproxTestFunc(double x)
     return 5 * x * x - 3 * x + 10;
 }
 
+double fastApproxTestFunc2(double x, double y)
+{
+    return 2 * x * x + x * y - 3 * y * y + x - 4 * y + 7;
+}
+
 void
 TestFastApproximator::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i == 0, "invalid index " << i);
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        break;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        break;
+    case 2:
+        runSubTest2(res, expected, subTestName);
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
 
+void
+TestFastApproximator::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
     std::vector<std::vector<double> > points, data;
 
     Math::UniformRealGenerator gen(std::time(0), -10, 10);
@@ -46,7 +71,7 @@ TestFastApproximator::runSubTest(unsigned int i, double& res, double& expected,
         data.push_back(d);
     }
 
-    FastApproximator fa(1, 1, points.size(), points, data, (i == 0 ? 10 : 10));
+    FastApproximator fa(1, 1, points.size(), points, data, 10);
 
     p[0] = 0;
 
@@ -56,3 +81,102 @@ TestFastApproximator::runSubTest(unsigned int i, double& res, double& expected,
     res = d[0];
     expected = fastApproxTestFunc(p[0]);
 }
+
+void
+TestFastApproximator::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    std::vector<double> p(2), d(1);
+
+    // the initial training set is small and isotropic
+    for(int i = 0; i < 1000; ++i)
+    {
+        p[0] = gen.generate();
+        p[1] = gen.generate();
+        d[0] = fastApproxTestFunc2(p[0], p[1]);
+        points.push_back(p);
+        data.push_back(d);
+    }
+
+    FastApproximator fa(2, 1, points.size(), points, data, 20);
+    fa.setWhiteningDriftThreshold(0.1);
+
+    // the added points are stretched and correlated, so the transformation needs to be updated while they are added
+    for(int i = 0; i < 20000; ++i)
+    {
+        const double x = gen.generate(), y = gen.generate();
+        p[0] = 5 * x;
+        p[1] = 3 * x + 0.5 * y;
+        d[0] = fastApproxTestFunc2(p[0], p[1]);
+        fa.addPoint(p, d);
+    }
+
+    p[0] = 0.3;
+    p[1] = 0.2;
+    fa.approximate(p, d, FastApproximator::QUADRATIC_INTERPOLATION);
+
+    subTestName = "whitening_drift";
+    res = d[0];
+    expected = fastApproxTestFunc2(p[0], p[1]);
+}
+
+void
+TestFastApproximator::runSubTest2(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    std::vector<double> p(2), d(2);
+
+    for(int i = 0; i < 10000; ++i)
+    {
+        p[0] = gen.generate();
+        p[1] = 2 * gen.generate();
+        d[0] = fastApproxTestFunc2(p[0], p[1]);
+        d[1] = p[0] * p[1];
+        points.push_back(p);
+        data.push_back(d);
+    }
+
+    FastApproximator fa(2, 2, points.size(), points, data, 20);
+
+    std::vector<std::vector<double> > queries(1000, std::vector<double>(2));
+    for(int i = 0; i < queries.size(); ++i)
+    {
+        queries[i][0] = 0.9 * gen.generate();
+        queries[i][1] = 1.8 * gen.generate();
+    }
+
+    std::vector<std::vector<double> > vals;
+    fa.approximate(queries, vals, FastApproximator::QUADRATIC_INTERPOLATION);
+
+    subTestName = "batch";
+    res = 1;
+    expected = 1;
+
+    if(vals.size() != queries.size())
+    {
+        output_screen("FAIL: " << vals.size() << " outputs returned for " << queries.size() << " points." << std::endl);
+        res = 0;
+        return;
+    }
+
+    // the batch results should be exactly the same as for the points one by one
+    for(int i = 0; i < queries.size(); ++i)
+    {
+        fa.approximate(queries[i], d, FastApproximator::QUADRATIC_INTERPOLATION);
+        for(int j = 0; j < 2; ++j)
+        {
+            if(vals[i][j] != d[j])
+            {
+                output_screen("FAIL: Output " << j << " for point " << i << " is " << vals[i][j] << " from the batch, " << d[j] << " alone." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+    }
+}
@@ -4,6 +4,7 @@
 
 #include <macros.hpp>
 #include <random.hpp>
+#include <numerics.hpp>
 #include <fast_approximator_error.hpp>
 #include <test_fast_approximator_error.hpp>
 
@@ -16,7 +17,7 @@ TestFastApproximatorError::name() const
 unsigned int
 TestFastApproximatorError::numberOfSubtests() const
 {
-    return 1;
+    return 2;
 }
 
 double fastApproxErrorTestFunc(double x, double y, double z)
@@ -31,7 +32,7 @@ double fastApproxErrorTestFunc(double x, double y, double z)
 void
 TestFastApproximatorError::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 1, "invalid index " << i);
+    check(i >= 0 && i < 2, "invalid index " << i);
 
     const int n = 1000;
 
@@ -70,9 +71,74 @@ TestFastApproximatorError::runSubTest(unsigned int i, double& res, double& expec
 
     FastApproximator fa(3, 1, points.size(), points, data, 50);
     BasicFAErrorFunctionAvg func;
-    FastApproximatorError faError(fa, testPoints, testData, 0, testPoints.size(), func);
 
-    subTestName = "complicated_function";
-    res = 0;
-    expected = 0;
+    if(i == 0)
+    {
+        FastApproximatorError faError(fa, testPoints, testData, 0, testPoints.size(), func);
+
+        subTestName = "complicated_function";
+        res = 0;
+        expected = 0;
+        return;
+    }
+
+    subTestName = "batch_incremental";
+    res = 1;
+    expected = 1;
+
+    // the batch evaluation should give the same ratios as approximating the points one by one
+    FastApproximatorError faError(fa, testPoints, testData, 0, testPoints.size(), func, FastApproximatorError::AVG_DISTANCE);
+    const std::vector<double>& ratios = faError.errorRatios();
+
+    std::vector<double> val, distances;
+    std::vector<double> single;
+    for(int j = 0; j < testPoints.size(); ++j)
+    {
+        fa.approximate(testPoints[j], val, FastApproximator::QUADRATIC_INTERPOLATION, &distances);
+        double avgDist = 0;
+        for(int l = 0; l < distances.size(); ++l)
+            avgDist += distances[l];
+        avgDist /= distances.size();
+        if(avgDist != 0)
+            single.push_back((func.evaluate(testData[j]) - func.evaluate(val)) / avgDist);
+    }
+
+    if(ratios.size() != single.size())
+    {
+        output_screen("FAIL: " << ratios.size() << " ratios from the batch evaluation, " << single.size() << " from the single points." << std::endl);
+        res = 0;
+        return;
+    }
+
+    for(int j = 0; j < ratios.size(); ++j)
+    {
+        if(!Math::areEqual(ratios[j], single[j], 1e-7))
+        {
+            output_screen("FAIL: ratio " << j << " is " << ratios[j] << " from the batch evaluation, " << single[j] << " from the single point." << std::endl);
+            res = 0;
+            return;
+        }
+    }
+
+    // adding the test points in two parts should give the same distribution as all at once
+    const unsigned long half = testPoints.size() / 2;
+    FastApproximatorError faErrorIncremental(fa, testPoints, testData, 0, half, func, FastApproximatorError::AVG_DISTANCE);
+    faErrorIncremental.addTestPoints(testPoints, testData, half, testPoints.size());
+
+    if(faErrorIncremental.errorRatios() != ratios)
+    {
+        output_screen("FAIL: the ratios after adding the test points are different." << std::endl);
+        res = 0;
+        return;
+    }
+
+    std::vector<double> v1, v2;
+    double mean1, var1, sigma1, mean2, var2, sigma2;
+    faError.approximate(testPoints[0], v1, &sigma1, NULL, &mean1, &var1);
+    faErrorIncremental.approximate(testPoints[0], v2, &sigma2, NULL, &mean2, &var2);
+    if(!Math::areEqual(mean1, mean2, 1e-7) || !Math::areEqual(var1, var2, 1e-7) || !Math::areEqual(sigma1, sigma2, 1e-7))
+    {
+        output_screen("FAIL: the error distribution after adding the test points is different. Mean " << mean1 << " vs " << mean2 << ", variance " << var1 << " vs " << var2 << ", 1 sigma " << sigma1 << " vs " << sigma2 << "." << std::endl);
+        res = 0;
+    }
 }
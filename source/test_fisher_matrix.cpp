@@ -0,0 +1,254 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <test_fisher_matrix.hpp>
+#include <fisher_matrix.hpp>
+#include <cosmo_mpi.hpp>
+
+std::string
+TestFisherMatrix::name() const
+{
+    return std::string("FISHER MATRIX TESTER");
+}
+
+unsigned int
+TestFisherMatrix::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// a gaussian with a given inverse covariance matrix, plus x0^3 x1 + x1^4 / 4 if quartic (which changes the Hessian away from the origin)
+class FisherTestLike : public Math::LikelihoodFunction
+{
+public:
+    FisherTestLike(const Math::SymmetricMatrix<double>& invCov, bool quartic) : invCov_(invCov), quartic_(quartic) {}
+
+    virtual double calculate(double* params, int nParams)
+    {
+        check(nParams == invCov_.rows(), "");
+        double res = 0;
+        for(int i = 0; i < nParams; ++i)
+        {
+            for(int j = 0; j < nParams; ++j)
+                res += params[i] * invCov_(i, j) * params[j];
+        }
+        if(quartic_)
+            res += params[0] * params[0] * params[0] * params[1] + params[1] * params[1] * params[1] * params[1] / 4;
+        return res;
+    }
+
+private:
+    const Math::SymmetricMatrix<double>& invCov_;
+    const bool quartic_;
+};
+
+// C_l = A (l / 100)^n times fixed TT, EE, TE shapes
+class FisherTestClModel : public Math::ClModel
+{
+public:
+    FisherTestClModel(int lMax) : lMax_(lMax) {}
+
+    static double tt(int l) { return 1000.0 / (l * (l + 1.0)); }
+    static double ee(int l) { return 20.0 / (l + 10.0); }
+    static double te(int l) { return 0.8 * std::sqrt(tt(l) * ee(l)) * std::cos(0.05 * l); }
+
+    virtual int lMax() const { return lMax_; }
+    virtual bool hasPolarization() const { return true; }
+
+    virtual void calculateBatch(const double* params, int nParams, int nPoints, std::vector<std::vector<double> >* clTT, std::vector<std::vector<double> >* clEE, std::vector<std::vector<double> >* clTE)
+    {
+        check(nParams == 2, "");
+        clTT->resize(nPoints);
+        clEE->resize(nPoints);
+        clTE->resize(nPoints);
+        for(int p = 0; p < nPoints; ++p)
+        {
+            const double a = params[2 * p], n = params[2 * p + 1];
+            (*clTT)[p].assign(lMax_ + 1, 0);
+            (*clEE)[p].assign(lMax_ + 1, 0);
+            (*clTE)[p].assign(lMax_ + 1, 0);
+            for(int l = 2; l <= lMax_; ++l)
+            {
+                const double f = a * std::pow(l / 100.0, n);
+                (*clTT)[p][l] = f * tt(l);
+                (*clEE)[p][l] = f * ee(l);
+                (*clTE)[p][l] = f * te(l);
+            }
+        }
+    }
+
+private:
+    const int lMax_;
+};
+
+} // namespace
+
+void
+TestFisherMatrix::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    using namespace Math;
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("gaussian");
+        const int n = 3;
+        SymmetricMatrix<double> cov(n, n, 0);
+        const double sigma[n] = {1.0, 0.1, 3.0};
+        const double corr[n][n] = {{1, 0.5, -0.3}, {0.5, 1, 0.2}, {-0.3, 0.2, 1}};
+        for(int j = 0; j < n; ++j)
+        {
+            for(int k = j; k < n; ++k)
+                cov(j, k) = corr[j][k] * sigma[j] * sigma[k];
+        }
+        SymmetricMatrix<double> invCov = cov;
+        invCov.invert();
+
+        FisherTestLike like(invCov, false);
+        std::vector<double> steps(sigma, sigma + n);
+        FisherMatrix fisher(like, steps, FisherMatrix::THREE_POINT, true);
+        fisher.calculate(std::vector<double>(n, 0.5));
+
+        // -2ln(like) is quadratic, so F = C^-1 exactly
+        for(int j = 0; j < n; ++j)
+        {
+            for(int k = 0; k < n; ++k)
+            {
+                if(std::abs(fisher.fisher()(j, k) - invCov(j, k)) > 1e-8 * std::abs(invCov(j, j)))
+                {
+                    output_screen("FAIL: F(" << j << ", " << k << ") = " << fisher.fisher()(j, k) << ", expected " << invCov(j, k) << std::endl);
+                    res = 0;
+                }
+            }
+        }
+
+        std::vector<double> errors;
+        fisher.marginalizedErrors(&errors);
+        for(int j = 0; j < n; ++j)
+        {
+            if(std::abs(errors[j] / sigma[j] - 1) > 1e-6)
+            {
+                output_screen("FAIL: the error of parameter " << j << " is " << errors[j] << ", expected " << sigma[j] << std::endl);
+                res = 0;
+            }
+        }
+
+        if(fisher.nPoints() != 1 + 2 * n * n)
+        {
+            output_screen("FAIL: " << fisher.nPoints() << " points, expected " << 1 + 2 * n * n << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("five_point");
+        const int n = 2;
+        SymmetricMatrix<double> invCov(n, n, 0);
+        invCov(0, 0) = 2;
+        invCov(0, 1) = 0.5;
+        invCov(1, 1) = 1;
+        FisherTestLike like(invCov, true);
+
+        const double x0 = 0.7, x1 = -0.4;
+        std::vector<double> fiducial(2);
+        fiducial[0] = x0;
+        fiducial[1] = x1;
+
+        // half of the Hessian at the fiducial point
+        double expectedF[n][n];
+        expectedF[0][0] = invCov(0, 0) + 3 * x0 * x1;
+        expectedF[0][1] = invCov(0, 1) + 1.5 * x0 * x0;
+        expectedF[1][1] = invCov(1, 1) + 1.5 * x1 * x1;
+        expectedF[1][0] = expectedF[0][1];
+
+        std::vector<double> steps(n, 0.1);
+        FisherMatrix three(like, steps, FisherMatrix::THREE_POINT);
+        FisherMatrix five(like, steps, FisherMatrix::FIVE_POINT);
+        three.calculate(fiducial);
+        five.calculate(fiducial);
+
+        // the five point stencil is exact up to the sixth derivatives, the three point one has errors of order h^2 from x1^4
+        for(int j = 0; j < n; ++j)
+        {
+            for(int k = 0; k < n; ++k)
+            {
+                if(std::abs(five.fisher()(j, k) - expectedF[j][k]) > 1e-8)
+                {
+                    output_screen("FAIL: the five point F(" << j << ", " << k << ") = " << five.fisher()(j, k) << ", expected " << expectedF[j][k] << std::endl);
+                    res = 0;
+                }
+            }
+        }
+        if(std::abs(three.fisher()(1, 1) - expectedF[1][1]) < 1e-4)
+        {
+            output_screen("FAIL: the three point F(1, 1) = " << three.fisher()(1, 1) << " should have an error of order h^2" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 2:
+    {
+        subTestName = std::string("cl");
+        const int lMax = 1000, lMin = 30;
+        const double fSky = 0.7;
+        FisherTestClModel model(lMax);
+        std::vector<double> steps(2);
+        steps[0] = 0.01;
+        steps[1] = 0.01;
+        FisherMatrix fisher(model, steps, FisherMatrix::FIVE_POINT, true);
+        fisher.setExperiment(fSky, lMin);
+        const double a = 2.0, tilt = 0.1;
+        std::vector<double> fiducial(2);
+        fiducial[0] = a;
+        fiducial[1] = tilt;
+        fisher.calculate(fiducial);
+
+        // all of the spectra scale together, dC/dA = C / A, dC/dn = ln(l / 100) C, so Tr(C^-1 dC_i C^-1 dC_j) = 2 a_i a_j
+        double expectedF[2][2] = {{0, 0}, {0, 0}};
+        for(int l = lMin; l <= lMax; ++l)
+        {
+            const double d[2] = {1.0 / a, std::log(l / 100.0)};
+            for(int j = 0; j < 2; ++j)
+            {
+                for(int k = 0; k < 2; ++k)
+                    expectedF[j][k] += fSky * (2 * l + 1) * d[j] * d[k];
+            }
+        }
+
+        for(int j = 0; j < 2; ++j)
+        {
+            for(int k = 0; k < 2; ++k)
+            {
+                if(std::abs(fisher.fisher()(j, k) / expectedF[j][k] - 1) > 1e-6)
+                {
+                    output_screen("FAIL: F(" << j << ", " << k << ") = " << fisher.fisher()(j, k) << ", expected " << expectedF[j][k] << std::endl);
+                    res = 0;
+                }
+            }
+        }
+
+        std::vector<double> dTT;
+        fisher.clDerivatives(0, &dTT);
+        if(std::abs(dTT[500] / (std::pow(5.0, tilt) * FisherTestClModel::tt(500)) - 1) > 1e-8)
+        {
+            output_screen("FAIL: dC_500/dA = " << dTT[500] << ", expected " << std::pow(5.0, tilt) * FisherTestClModel::tt(500) << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
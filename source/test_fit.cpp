@@ -16,18 +16,50 @@ TestFit::name() const
 unsigned int
 TestFit::numberOfSubtests() const
 {
-    return 1;
+    return 2;
 }
 
 void
 TestFit::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 1, "invalid index " << i);
+    check(i >= 0 && i < 2, "invalid index " << i);
     
     using namespace Math;
 
     double testParams[4] = { 5, -2.5, 3.7, 2 };
 
+    if(i == 1)
+    {
+        Polynomial testP(4);
+        for(int j = 0; j < 4; ++j)
+            testP.parameter(j) = testParams[j];
+
+        const int n = 200000;
+        std::vector<double> testX(n), testY(n);
+        for(int j = 0; j < n; ++j)
+            testX[j] = -10 + 15.0 * j / n;
+        testP.evaluate(n, &(testX[0]), &(testY[0]));
+
+        std::vector<double> starting(4, 0);
+        std::vector<double> error(4, 0.01);
+        std::vector<double> min(4, -20);
+        std::vector<double> max(4, 20);
+
+        Polynomial f(4);
+        Fit fit(f, testX, testY, starting, error, min, max, true);
+
+        std::vector<double> resultP, resultE;
+        fit.fit(resultP, resultE);
+
+        for(int j = 0; j < 4; ++j)
+            output_screen1(std::setprecision(7) << "Original parameter " << j << " = " << testParams[j] << ", result = " << resultP[j] << std::endl);
+
+        subTestName = std::string("cubic_polynomial_parallel");
+        res = resultP[2];
+        expected = testParams[2];
+        return;
+    }
+
     Polynomial testP(4);
 
     for(int i = 0; i < 4; ++i)
@@ -1,14 +1,115 @@
 #include <cosmo_mpi.hpp>
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
 #include <macros.hpp>
+#include <exception_handler.hpp>
 #include <numerics.hpp>
 #include <test_framework.hpp>
 
-TestFramework::TestFramework(double precision) : precision_(precision)
+TestFramework::TestFramework(double precision) : precision_(precision), warmUp_(0), repetitions_(0), maxSlowdown_(1.5), updateBaseline_(false)
 {
     check(precision > 0, "invalid precision " << precision << ", must be positive");
     check(precision < 1, "precision " << precision << " is too big, needs to be smaller than 1");
 }
 
+void
+TestFramework::setTiming(int warmUp, int repetitions, const std::string& baselineFileName, double maxSlowdown, bool updateBaseline)
+{
+    check(warmUp >= 0, "invalid number of warm-up runs " << warmUp);
+    check(repetitions >= 0, "invalid number of repetitions " << repetitions);
+    check(maxSlowdown >= 1, "invalid maximum slowdown " << maxSlowdown << ", must be at least 1");
+
+    warmUp_ = warmUp;
+    repetitions_ = repetitions;
+    baselineFileName_ = baselineFileName;
+    maxSlowdown_ = maxSlowdown;
+    updateBaseline_ = updateBaseline;
+}
+
+namespace
+{
+
+struct BaselineEntry
+{
+    double seconds;
+    std::string subTestName;
+};
+
+typedef std::map<std::pair<std::string, unsigned int>, BaselineEntry> Baseline;
+
+// a missing file is an empty baseline
+void readBaseline(const std::string& fileName, Baseline* baseline)
+{
+    baseline->clear();
+    std::ifstream in(fileName.c_str());
+    if(!in)
+        return;
+
+    std::string line;
+    while(std::getline(in, line))
+    {
+        if(line.empty() || line[0] == '#')
+            continue;
+        // the test and subtest names can have spaces, the fields are separated by tabs
+        std::vector<std::string> fields;
+        std::size_t begin = 0;
+        while(fields.size() < 3)
+        {
+            const std::size_t end = line.find('\t', begin);
+            if(end == std::string::npos)
+                break;
+            fields.push_back(line.substr(begin, end - begin));
+            begin = end + 1;
+        }
+
+        std::stringstream str;
+        unsigned int i = 0;
+        BaselineEntry e;
+        if(fields.size() == 3)
+        {
+            str << fields[1] << ' ' << fields[2];
+            str >> i >> e.seconds;
+        }
+        if(fields.size() != 3 || !str)
+        {
+            StandardException exc;
+            std::stringstream exceptionStr;
+            exceptionStr << "Invalid line in the baseline file " << fileName << ": " << line;
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+        const std::string& test = fields[0];
+        e.subTestName = line.substr(begin);
+        (*baseline)[std::make_pair(test, i)] = e;
+    }
+}
+
+void writeBaseline(const std::string& fileName, const Baseline& baseline)
+{
+    std::ofstream out(fileName.c_str());
+    if(!out)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into the baseline file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    out << "# test\tsubtest index\tseconds\tsubtest name" << std::endl;
+    out.precision(6);
+    for(Baseline::const_iterator it = baseline.begin(); it != baseline.end(); ++it)
+        out << it->first.first << '\t' << it->first.second << '\t' << it->second.seconds << '\t' << it->second.subTestName << std::endl;
+}
+
+} // namespace
+
 bool
 TestFramework::run(unsigned int& pass, unsigned int& fail)
 {
@@ -21,31 +122,103 @@ TestFramework::run(unsigned int& pass, unsigned int& fail)
     }
     const unsigned int n = numberOfSubtests();
     check(n > 0, "need at least 1 subtest");
+
+    const bool timing = (repetitions_ > 0);
+    Baseline baseline;
+    bool baselineChanged = false;
+    if(timing && isMaster() && !baselineFileName_.empty())
+        readBaseline(baselineFileName_, &baseline);
+
     for(unsigned int i = 0; i < n; ++i)
     {
         double res, expected;
         std::string subTestName;
+        double seconds = 0;
         if(isMaster() || isParallel(i))
-            runSubTest(i, res, expected, subTestName);
+        {
+            // the result of the first run is checked, the first warmUp_ runs are not timed
+            const int nRuns = (timing ? warmUp_ + repetitions_ : 1);
+            for(int j = 0; j < nRuns; ++j)
+            {
+                const bool timed = (timing && j >= warmUp_);
+                if(timed && isParallel(i))
+                    CosmoMPI::create().barrier();
+                const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                if(j == 0)
+                    runSubTest(i, res, expected, subTestName);
+                else
+                {
+                    double r, e;
+                    std::string s;
+                    runSubTest(i, r, e, s);
+                }
+
+                if(timed)
+                {
+                    if(isParallel(i))
+                        CosmoMPI::create().barrier();
+                    const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    seconds = (j == warmUp_ ? t : std::min(seconds, t));
+                }
+            }
+        }
 
         if(isMaster())
         {
-            const bool testRes = Math::areEqual(expected, res, precision_);
+            bool testRes = Math::areEqual(expected, res, precision_);
             output_screen_clean("   " << subTestName << ": ");
-            if(testRes)
+
+            bool slower = false;
+            double baselineSeconds = 0;
+            if(timing && !baselineFileName_.empty())
+            {
+                const std::pair<std::string, unsigned int> key(name(), i);
+                Baseline::iterator it = baseline.find(key);
+                if(it == baseline.end() || updateBaseline_)
+                {
+                    BaselineEntry& e = baseline[key];
+                    e.seconds = seconds;
+                    e.subTestName = subTestName;
+                    baselineChanged = true;
+                }
+                else
+                {
+                    baselineSeconds = it->second.seconds;
+                    slower = (seconds > maxSlowdown_ * baselineSeconds && seconds - baselineSeconds > 1e-3);
+                }
+            }
+
+            if(testRes && !slower)
             {
                 ++pass;
-                output_screen_clean("\033[1;32mPASS\033[0m" << std::endl);
+                output_screen_clean("\033[1;32mPASS\033[0m");
             }
             else
             {
                 ++fail;
-                output_screen_clean("\033[1;31mFAIL\033[0m" << std::endl);
-                output_screen_clean("      Result: " << res << "   Expected result: " << expected << std::endl);
+                output_screen_clean("\033[1;31mFAIL\033[0m");
             }
+
+            if(timing)
+            {
+                output_screen_clean("   (" << seconds << " s");
+                if(baselineSeconds > 0)
+                    output_screen_clean(", baseline " << baselineSeconds << " s");
+                output_screen_clean(")");
+            }
+            output_screen_clean(std::endl);
+
+            if(!testRes)
+                output_screen_clean("      Result: " << res << "   Expected result: " << expected << std::endl);
+            if(slower)
+                output_screen_clean("      Slower than the baseline by a factor of " << seconds / baselineSeconds << ", the maximum allowed is " << maxSlowdown_ << std::endl);
         }
     }
 
+    if(baselineChanged)
+        writeBaseline(baselineFileName_, baseline);
+
     CosmoMPI::create().barrier();
     if(isMaster())
     {
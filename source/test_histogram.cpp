@@ -0,0 +1,105 @@
+#include <cmath>
+#include <vector>
+
+#include <macros.hpp>
+#include <histogram.hpp>
+#include <test_histogram.hpp>
+
+std::string
+TestHistogram::name() const
+{
+    return std::string("HISTOGRAM TESTER");
+}
+
+unsigned int
+TestHistogram::numberOfSubtests() const
+{
+    return 2;
+}
+
+void
+TestHistogram::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    // deterministic data in [-1.2, 1.2], some of it outside of the bins
+    const int n = 10000;
+    std::vector<double> data(n);
+    for(int j = 0; j < n; ++j)
+        data[j] = 1.2 * std::sin(0.37 * j + 0.001 * j * j);
+
+    const double min = -1, max = 1;
+    const int nBins = 20;
+
+    typedef Math::Histogram<double>::HistogramType HistogramType;
+
+    switch(i)
+    {
+    case 0:
+        {
+            subTestName = std::string("streaming");
+            Math::Histogram<double> h, hs(min, max, nBins);
+            for(int j = 0; j < n; ++j)
+            {
+                h.addData(data[j]);
+                hs.addData(data[j]);
+            }
+            h.createHistogram(min, max, nBins);
+            hs.createHistogram();
+
+            const HistogramType& hist = h.getHistogram();
+            const HistogramType& histS = hs.getHistogram();
+            res = (hist.size() == histS.size() && hs.getDataSize() == n && hs.min() == h.min() && hs.max() == h.max() ? 1 : 0);
+            long total = hs.underflow() + hs.overflow();
+            HistogramType::const_iterator it = hist.begin(), itS = histS.begin();
+            for(; it != hist.end() && itS != histS.end(); ++it, ++itS)
+            {
+                total += itS->second;
+                if(std::abs(it->first - itS->first) > 1e-12 || it->second != itS->second)
+                {
+                    output_screen("FAIL: bin at " << it->first << " has " << it->second << " points, the streaming histogram has " << itS->second << " points in the bin at " << itS->first << std::endl);
+                    res = 0;
+                }
+            }
+            if(total != n)
+            {
+                output_screen("FAIL: the streaming histogram counted " << total << " points, expected " << n << std::endl);
+                res = 0;
+            }
+            expected = 1;
+        }
+        break;
+    case 1:
+        {
+            subTestName = std::string("merge");
+            Math::Histogram<double> h(min, max, nBins), h1(min, max, nBins), h2(min, max, nBins);
+            for(int j = 0; j < n; ++j)
+            {
+                h.addData(data[j]);
+                if(j % 3)
+                    h1.addData(data[j]);
+                else
+                    h2.addData(data[j]);
+            }
+            h1.merge(h2);
+            h1.allreduce();
+            CosmoMPI& mpi = CosmoMPI::create();
+            const int nProcesses = mpi.numProcesses();
+
+            res = (h1.getDataSize() == nProcesses * h.getDataSize() && h1.underflow() == nProcesses * h.underflow() && h1.overflow() == nProcesses * h.overflow() && h1.min() == h.min() && h1.max() == h.max() ? 1 : 0);
+            for(int j = 0; j < nBins; ++j)
+            {
+                if(h1.binCount(j) != nProcesses * h.binCount(j))
+                {
+                    output_screen("FAIL: bin " << j << " of the merged histogram has " << h1.binCount(j) << " points, expected " << nProcesses * h.binCount(j) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
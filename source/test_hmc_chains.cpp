@@ -0,0 +1,212 @@
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <cmath>
+
+#include <cosmo_mpi.hpp>
+#include <exception_handler.hpp>
+#include <test_hmc.hpp>
+#include <hmc.hpp>
+#include <markov_chain.hpp>
+
+std::string
+TestHMC::name() const
+{
+    return std::string("HMC TESTER");
+}
+
+unsigned int
+TestHMC::numberOfSubtests() const
+{
+    return 2;
+}
+
+namespace
+{
+
+// an uncorrelated gaussian, can throw after a given number of likelihood calculations to simulate an interrupted run
+class HMCTestLikelihood : public Math::LikelihoodWithDerivs
+{
+public:
+    HMCTestLikelihood(int failAfter = -1) : failAfter_(failAfter), calls_(0) {}
+
+    virtual double calculate(double* params, int nParams)
+    {
+        if(failAfter_ >= 0 && calls_++ >= failAfter_)
+        {
+            StandardException exc;
+            exc.set("Interrupted.");
+            throw exc;
+        }
+
+        double res = 0;
+        for(int i = 0; i < nParams; ++i)
+        {
+            const double delta = (params[i] - mean(i)) / sigma(i);
+            res += delta * delta;
+        }
+        return res;
+    }
+
+    virtual double calculateDeriv(double* params, int nParams, int i)
+    {
+        return 2 * (params[i] - mean(i)) / (sigma(i) * sigma(i));
+    }
+
+    static double mean(int i) { return i - 1.0; }
+    static double sigma(int i) { return 1.0 + i; }
+
+private:
+    const int failAfter_;
+    int calls_;
+};
+
+void
+setHMCParams(Math::HMC& hmc, int n)
+{
+    for(int i = 0; i < n; ++i)
+    {
+        std::stringstream paramName;
+        paramName << "x_" << i;
+        hmc.setParam(i, paramName.str(), 1.0 / (HMCTestLikelihood::sigma(i) * HMCTestLikelihood::sigma(i)), 0);
+    }
+}
+
+std::string
+hmcChainFileName(const std::string& root)
+{
+    std::stringstream fileName;
+    fileName << root;
+    if(CosmoMPI::create().numProcesses() > 1)
+        fileName << '_' << CosmoMPI::create().processId();
+    fileName << ".txt";
+    return fileName.str();
+}
+
+} // namespace
+
+void
+TestHMC::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    using namespace Math;
+
+    const int n = 3;
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        // an interrupted and resumed run must give exactly the same chain as an uninterrupted one
+        subTestName = std::string("resume");
+        const int iters = 300, resumeEvery = 10;
+
+        const std::string rootFull = "test_files/hmc_resume_test_full";
+        HMCTestLikelihood like;
+        HMC hmcFull(n, like, rootFull, 1.0, 10, 7);
+        setHMCParams(hmcFull, n);
+        hmcFull.run(iters, resumeEvery);
+
+        const std::string root = "test_files/hmc_resume_test";
+        {
+            // fails in the same iteration in all of the chains
+            HMCTestLikelihood failingLike(155);
+            HMC hmc(n, failingLike, root, 1.0, 10, 7);
+            setHMCParams(hmc, n);
+            bool interrupted = false;
+            try
+            {
+                hmc.run(iters, resumeEvery);
+            }
+            catch (StandardException& e)
+            {
+                interrupted = true;
+            }
+            if(!interrupted)
+            {
+                output_screen("FAIL: the run was not interrupted." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+
+        HMC hmc(n, like, root, 1.0, 10, 7);
+        setHMCParams(hmc, n);
+        hmc.run(iters, resumeEvery);
+
+        std::ifstream inFull(hmcChainFileName(rootFull).c_str()), in(hmcChainFileName(root).c_str());
+        std::string lineFull, line;
+        int lines = 0;
+        while(std::getline(inFull, lineFull))
+        {
+            ++lines;
+            if(!std::getline(in, line) || line != lineFull)
+            {
+                output_screen("FAIL: line " << lines << " of the resumed chain is different." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+        if(std::getline(in, line))
+        {
+            output_screen("FAIL: the resumed chain is longer." << std::endl);
+            res = 0;
+        }
+        if(lines != iters + 1)
+        {
+            output_screen("FAIL: the chain has " << lines << " elements, expected " << iters + 1 << "." << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 1:
+    {
+        // with several processes the chains stop when they have converged
+        subTestName = std::string("chains");
+        const std::string root = "test_files/hmc_chains_test";
+        HMCTestLikelihood like;
+        HMC hmc(n, like, root, 1.0, 10, 11);
+        setHMCParams(hmc, n);
+        const int burnin = 200;
+        hmc.run(20000, 0, 0.002, burnin);
+
+        CosmoMPI::create().barrier();
+        if(!isMaster())
+            return;
+
+        const int nChains = CosmoMPI::create().numProcesses();
+        std::unique_ptr<MarkovChain> chain(nChains > 1 ? new MarkovChain(nChains, root.c_str(), burnin) : new MarkovChain(hmcChainFileName(root).c_str(), burnin));
+        for(int j = 0; j < n; ++j)
+        {
+            double total = 0, sum = 0, sumSq = 0;
+            for(unsigned long k = 0; k < chain->size(); ++k)
+            {
+                const double x = chain->param(k, j), p = chain->prob(k);
+                total += p;
+                sum += p * x;
+                sumSq += p * x * x;
+            }
+            const double mean = sum / total;
+            const double sigma = std::sqrt(sumSq / total - mean * mean);
+            if(std::abs(mean - HMCTestLikelihood::mean(j)) > 0.15 * HMCTestLikelihood::sigma(j) || std::abs(sigma / HMCTestLikelihood::sigma(j) - 1) > 0.15)
+            {
+                output_screen("FAIL: parameter " << j << " has mean " << mean << " and sigma " << sigma << ", expected " << HMCTestLikelihood::mean(j) << " and " << HMCTestLikelihood::sigma(j) << "." << std::endl);
+                res = 0;
+            }
+            if(nChains > 1 && std::abs(hmc.gelmanRubin(j) - 1) > 0.002 && chain->size() < 20000 * nChains)
+            {
+                output_screen("FAIL: the chains stopped without converging, R - 1 = " << hmc.gelmanRubin(j) - 1 << " for parameter " << j << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
@@ -0,0 +1,247 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <cstdio>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <random.hpp>
+#include <numerics.hpp>
+#include <markov_chain.hpp>
+#include <importance_reweighting.hpp>
+#include <test_importance_reweighting.hpp>
+
+std::string
+TestImportanceReweighting::name() const
+{
+    return std::string("IMPORTANCE REWEIGHTING TESTER");
+}
+
+unsigned int
+TestImportanceReweighting::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+class ReweightingTestLike : public Math::LikelihoodFunction
+{
+public:
+    ReweightingTestLike() : count_(0) {}
+
+    double calculate(double* params, int nParams)
+    {
+        ++count_;
+        const double x = (params[0] - 0.3) / 2;
+        return x * x;
+    }
+
+    // the total number of calculations by all of the processes
+    int totalCount() const
+    {
+        int c = count_, total = 0;
+        CosmoMPI::create().allreduce(&c, &total, 1, CosmoMPI::SUM);
+        return total;
+    }
+
+private:
+    int count_;
+};
+
+// a chain of a random walk with repeated points, like rejected Metropolis-Hastings steps, written by the master process
+int writeReweightingTestChain(const char* fileName)
+{
+    const int nUnique = 200;
+    if(CosmoMPI::create().isMaster())
+    {
+        Math::UniformRealGenerator gen(1234, 0, 1);
+        std::ofstream out(fileName);
+        out << std::setprecision(17);
+        std::vector<double> p(2, 0);
+        for(int i = 0; i < nUnique; ++i)
+        {
+            p[0] += gen.generate() - 0.5;
+            p[1] += gen.generate() - 0.5;
+            const int repeat = 1 + int(gen.generate() * 3);
+            for(int j = 0; j < repeat; ++j)
+                out << 1 << ' ' << p[0] * p[0] + p[1] * p[1] << ' ' << p[0] << ' ' << p[1] << std::endl;
+        }
+    }
+    CosmoMPI::create().barrier();
+    return nUnique;
+}
+
+bool checkReweightingWeights(const MarkovChain& chain, const ImportanceReweighting& reweighting)
+{
+    double minLike = 1e100;
+    for(unsigned long i = 0; i < chain.size(); ++i)
+    {
+        const double x = (chain.param(i, 0) - 0.3) / 2;
+        minLike = std::min(minLike, x * x);
+    }
+
+    for(unsigned long i = 0; i < chain.size(); ++i)
+    {
+        const double x = (chain.param(i, 0) - 0.3) / 2;
+        const double expected = chain.prob(i) * std::exp(-(x * x - minLike) / 2);
+        if(!Math::areEqual(reweighting.weight(i), expected, 1e-10))
+        {
+            output_screen("FAIL: the weight of element " << i << " is " << reweighting.weight(i) << ", expected " << expected << "." << std::endl);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+void
+TestImportanceReweighting::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    CosmoMPI& mpi = CosmoMPI::create();
+
+    res = 1;
+    expected = 1;
+
+    const char* chainFileName = "test_files/importance_reweighting_chain.txt";
+    const int nUnique = writeReweightingTestChain(chainFileName);
+    MarkovChain chain(chainFileName);
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("unique_points");
+        ReweightingTestLike like;
+        ImportanceReweighting reweighting(chain, like, "", 7);
+        reweighting.run();
+
+        if(reweighting.uniqueCount() != nUnique)
+        {
+            output_screen("FAIL: found " << reweighting.uniqueCount() << " unique points, expected " << nUnique << "." << std::endl);
+            res = 0;
+        }
+
+        const int count = like.totalCount();
+        if(count != nUnique)
+        {
+            output_screen("FAIL: the likelihood was calculated " << count << " times, expected " << nUnique << "." << std::endl);
+            res = 0;
+        }
+
+        if(!checkReweightingWeights(chain, reweighting))
+            res = 0;
+
+        const double ess = reweighting.effectiveSampleSize();
+        if(!(ess > 1 && ess <= chain.size()))
+        {
+            output_screen("FAIL: invalid effective sample size " << ess << "." << std::endl);
+            res = 0;
+        }
+        break;
+    }
+    case 1:
+    {
+        subTestName = std::string("checkpoint");
+        const char* checkpointFileName = "test_files/importance_reweighting_checkpoint.txt";
+        if(mpi.isMaster())
+            std::remove(checkpointFileName);
+        mpi.barrier();
+
+        {
+            ReweightingTestLike like;
+            ImportanceReweighting reweighting(chain, like, checkpointFileName, 10);
+            reweighting.run();
+        }
+
+        // keep the header and the first 50 points only, as if the run was interrupted in the middle of a line
+        const int kept = 50;
+        if(mpi.isMaster())
+        {
+            std::vector<std::string> lines;
+            std::ifstream in(checkpointFileName);
+            std::string line;
+            while(std::getline(in, line))
+                lines.push_back(line);
+            in.close();
+
+            std::ofstream out(checkpointFileName);
+            for(int j = 0; j < 2 + kept; ++j)
+                out << lines[j] << std::endl;
+            out << lines[2 + kept].substr(0, 3);
+        }
+        mpi.barrier();
+
+        ReweightingTestLike like;
+        ImportanceReweighting reweighting(chain, like, checkpointFileName, 10);
+        reweighting.run();
+        int count = like.totalCount();
+        if(count != nUnique - kept)
+        {
+            output_screen("FAIL: after the checkpoint the likelihood was calculated " << count << " times, expected " << nUnique - kept << "." << std::endl);
+            res = 0;
+        }
+        if(!checkReweightingWeights(chain, reweighting))
+            res = 0;
+
+        // now everything is in the checkpoint
+        ReweightingTestLike like2;
+        ImportanceReweighting reweighting2(chain, like2, checkpointFileName, 10);
+        reweighting2.run();
+        count = like2.totalCount();
+        if(count != 0)
+        {
+            output_screen("FAIL: with a complete checkpoint the likelihood was calculated " << count << " times." << std::endl);
+            res = 0;
+        }
+        if(!checkReweightingWeights(chain, reweighting2))
+            res = 0;
+        break;
+    }
+    case 2:
+    {
+        subTestName = std::string("write_chain");
+        ReweightingTestLike like;
+        ImportanceReweighting reweighting(chain, like);
+        reweighting.run();
+
+        const char* outFileName = "test_files/importance_reweighting_out.txt";
+        const char* outBinaryFileName = "test_files/importance_reweighting_out.dat";
+        std::vector<std::string> names(2);
+        names[0] = "x";
+        names[1] = "y";
+        reweighting.writeChain(outFileName);
+        reweighting.writeChain(outBinaryFileName, &names);
+        mpi.barrier();
+
+        MarkovChain out(outFileName), outBinary(outBinaryFileName);
+        if(out.size() != chain.size() || outBinary.size() != chain.size())
+        {
+            output_screen("FAIL: the reweighted chain has " << out.size() << " and " << outBinary.size() << " elements, expected " << chain.size() << "." << std::endl);
+            res = 0;
+            break;
+        }
+
+        for(unsigned long j = 0; j < chain.size(); ++j)
+        {
+            const double totalLike = chain.like(j) + reweighting.extraLike(j);
+            if(!Math::areEqual(out.prob(j), reweighting.weight(j), 1e-8) || !Math::areEqual(out.like(j), totalLike, 1e-8) || !Math::areEqual(outBinary.like(j), totalLike, 1e-12) || !Math::areEqual(out.param(j, 1), chain.param(j, 1), 1e-10))
+            {
+                output_screen("FAIL: element " << j << " of the reweighted chain is wrong." << std::endl);
+                res = 0;
+                break;
+            }
+        }
+        break;
+    }
+    default:
+        check(false, "");
+        break;
+    }
+}
@@ -1,3 +1,6 @@
+#include <cmath>
+
+#include <macros.hpp>
 #include <test_integral.hpp>
 #include <integral.hpp>
 
@@ -12,6 +15,40 @@ public:
     }
 };
 
+// counts the number of evaluations
+class TestCountedFunction : public Math::RealFunction
+{
+public:
+    enum Type { EXPONENTIAL = 0, PEAK, INVERSE_SQRT };
+
+    TestCountedFunction(Type type) : type_(type), count_(0) {}
+    ~TestCountedFunction() {}
+
+    double evaluate(double x) const
+    {
+        ++count_;
+        switch(type_)
+        {
+        case EXPONENTIAL:
+            return std::exp(x);
+        case PEAK:
+            return 1.0 / (1e-6 + (x - 0.3) * (x - 0.3));
+        case INVERSE_SQRT:
+            check(x > 0, "");
+            return 1.0 / std::sqrt(x);
+        default:
+            check(false, "");
+            return 0;
+        }
+    }
+
+    unsigned long count() const { return count_; }
+
+private:
+    Type type_;
+    mutable unsigned long count_;
+};
+
 std::string
 TestIntegral::name() const
 {
@@ -21,13 +58,13 @@ TestIntegral::name() const
 unsigned int
 TestIntegral::numberOfSubtests() const
 {
-    return 1;
+    return 5;
 }
 
 void
 TestIntegral::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 1, "invalid index " << i);
+    check(i >= 0 && i < 5, "invalid index " << i);
     
     using namespace Math;
 
@@ -40,6 +77,65 @@ TestIntegral::runSubTest(unsigned int i, double& res, double& expected, std::str
         res = realIntegral1D(f, -1.0, 3.0, 1000);
         expected = double(28) / 3;
         break;
+    case 1:
+        {
+            subTestName = std::string("gauss_kronrod_smooth");
+            TestCountedFunction g(TestCountedFunction::EXPONENTIAL);
+            double err;
+            const double r = realIntegralGaussKronrod(g, 0.0, 2.0, 1e-12, 0, 1000, &err);
+            const double e = std::exp(2.0) - 1;
+            res = (std::abs(r - e) < 1e-12 * e && err < 1e-12 * e && g.count() <= 45 ? 1 : 0);
+            if(!res)
+            {
+                output_screen("FAIL: the integral is " << r << " with error " << err << " after " << g.count() << " evaluations, expected " << e << std::endl);
+            }
+            expected = 1;
+        }
+        break;
+    case 2:
+        {
+            subTestName = std::string("gauss_kronrod_peak");
+            TestCountedFunction g(TestCountedFunction::PEAK);
+            double err;
+            const double r = realIntegralGaussKronrod(g, 0.0, 1.0, 1e-10, 0, 1000, &err);
+            const double e = 1e3 * (std::atan(0.7e3) + std::atan(0.3e3));
+            res = (std::abs(r - e) < 1e-9 * e && g.count() < 10000 ? 1 : 0);
+            if(!res)
+            {
+                output_screen("FAIL: the integral is " << r << " with error " << err << " after " << g.count() << " evaluations, expected " << e << std::endl);
+            }
+            expected = 1;
+        }
+        break;
+    case 3:
+        {
+            subTestName = std::string("tanh_sinh_singular");
+            TestCountedFunction g(TestCountedFunction::INVERSE_SQRT);
+            double err;
+            const double r = realIntegralTanhSinh(g, 0.0, 4.0, 1e-10, 0, 10, &err);
+            const double e = 4.0;
+            res = (std::abs(r - e) < 1e-9 * e && g.count() < 500 ? 1 : 0);
+            if(!res)
+            {
+                output_screen("FAIL: the integral is " << r << " with error " << err << " after " << g.count() << " evaluations, expected " << e << std::endl);
+            }
+            expected = 1;
+        }
+        break;
+    case 4:
+        {
+            subTestName = std::string("tanh_sinh_reversed");
+            TestCountedFunction g(TestCountedFunction::EXPONENTIAL);
+            const double r = realIntegralTanhSinh(g, 1.0, -1.0, 1e-12);
+            const double e = std::exp(-1.0) - std::exp(1.0);
+            res = (std::abs(r - e) < 1e-11 * std::abs(e) ? 1 : 0);
+            if(!res)
+            {
+                output_screen("FAIL: the integral is " << r << ", expected " << e << std::endl);
+            }
+            expected = 1;
+        }
+        break;
     default:
         check(false, "");
         break;
@@ -1,5 +1,7 @@
 #include <utility>
+#include <cmath>
 #include <algorithm>
+#include <cstdio>
 
 #include <macros.hpp>
 #include <random.hpp>
@@ -17,7 +19,7 @@ TestKDTree::name() const
 unsigned int
 TestKDTree::numberOfSubtests() const
 {
-    return 9;
+    return 15;
 }
 
 void
@@ -75,6 +77,24 @@ TestKDTree::runSubTest(unsigned int i, double& res, double& expected, std::strin
         seed = 0;
         subTestName = "10_20_1000000";
         break;
+    case 9:
+        runSubTest9(res, expected, subTestName);
+        return;
+    case 10:
+        runSubTest10(res, expected, subTestName);
+        return;
+    case 11:
+        runSubTest11(res, expected, subTestName);
+        return;
+    case 12:
+        runSubTest12(res, expected, subTestName);
+        return;
+    case 13:
+        runSubTest13(res, expected, subTestName);
+        return;
+    case 14:
+        runSubTest14(res, expected, subTestName);
+        return;
     default:
         check(false, "");
         break;
@@ -316,6 +336,438 @@ TestKDTree::runSubTest4(double& res, double& expected, std::string& subTestName)
     }
 }
 
+void
+TestKDTree::runSubTest9(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 4, k = 5;
+    const unsigned long nPoints = 10000, nQueries = 1000;
+
+    std::vector<std::vector<double> > points(nPoints);
+    for(unsigned long i = 0; i < nPoints; ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    KDTree kdTree(dim, points);
+
+    std::vector<double> queries(nQueries * dim);
+    for(unsigned long i = 0; i < queries.size(); ++i)
+        queries[i] = gen.generate();
+
+    std::vector<unsigned long> indices(nQueries * k);
+    std::vector<double> distances(nQueries * k);
+    kdTree.findNearestNeighbors(&(queries[0]), nQueries, k, &(indices[0]), &(distances[0]));
+
+    res = 1;
+    expected = 1;
+    subTestName = "batch";
+
+    std::vector<unsigned long> ind;
+    std::vector<double> dist;
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        const std::vector<double> q(queries.begin() + i * dim, queries.begin() + (i + 1) * dim);
+        kdTree.findNearestNeighbors(q, k, &ind, &dist);
+        for(int j = 0; j < k; ++j)
+        {
+            if(ind[j] != indices[i * k + j] || dist[j] != distances[i * k + j])
+            {
+                output_screen("FAIL: Neighbor " << j << " of query " << i << " is " << indices[i * k + j] << " at distance squared " << distances[i * k + j] << " in the batch query but " << ind[j] << " at distance squared " << dist[j] << " in the single query." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+    }
+}
+
+void
+TestKDTree::runSubTest10(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 10, k = 5;
+    const unsigned long nPoints = 100000, nQueries = 100;
+    const double epsilon = 0.5;
+
+    std::vector<std::vector<double> > points(nPoints);
+    for(unsigned long i = 0; i < nPoints; ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    KDTree kdTree(dim, points);
+
+    res = 1;
+    expected = 1;
+    subTestName = "approximate";
+
+    std::vector<double> q(dim);
+    std::vector<unsigned long> exactInd, approxInd;
+    std::vector<double> exactDist, approxDist;
+
+    Timer tExact("KD TREE EXACT SEARCHES"), tApprox("KD TREE APPROXIMATE SEARCHES");
+    unsigned long timeExact = 0, timeApprox = 0;
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        for(int j = 0; j < dim; ++j)
+            q[j] = gen.generate();
+
+        kdTree.setApproximation(0);
+        tExact.start();
+        kdTree.findNearestNeighbors(q, k, &exactInd, &exactDist);
+        timeExact += tExact.end();
+
+        kdTree.setApproximation(epsilon);
+        tApprox.start();
+        kdTree.findNearestNeighbors(q, k, &approxInd, &approxDist);
+        timeApprox += tApprox.end();
+
+        for(int j = 0; j < k; ++j)
+        {
+            if(approxDist[j] > (1 + epsilon) * (1 + epsilon) * exactDist[j] * (1 + 1e-10))
+            {
+                output_screen("FAIL: Approximate neighbor " << j << " of query " << i << " is at distance squared " << approxDist[j] << " while the exact one is at " << exactDist[j] << "." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+    }
+
+    output_screen("Exact searches took " << timeExact << " microseconds, approximate searches took " << timeApprox << " microseconds." << std::endl);
+}
+
+void
+TestKDTree::runSubTest11(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 3, k = 4;
+    const unsigned long nPoints = 100000;
+
+    std::vector<std::vector<double> > points(10, std::vector<double>(dim));
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    KDTree kdTree(dim, points);
+
+    // insert the points in sorted order, the worst case without rebalancing
+    Timer t("KD TREE INSERTIONS");
+    t.start();
+    std::vector<double> p(dim);
+    for(unsigned long i = 0; i < nPoints; ++i)
+    {
+        p[0] = double(i) / nPoints;
+        for(int j = 1; j < dim; ++j)
+            p[j] = gen.generate();
+        kdTree.insert(p);
+        points.push_back(p);
+    }
+    t.end();
+
+    res = 1;
+    expected = 1;
+    subTestName = "incremental_insert";
+
+    const double maxDepth = 3 * std::log(double(points.size())) / std::log(2.0) + 16;
+    if(kdTree.depth() > maxDepth)
+    {
+        output_screen("FAIL: The depth of the tree after insertions is " << kdTree.depth() << ", it should be at most " << maxDepth << "." << std::endl);
+        res = 0;
+    }
+
+    std::vector<unsigned long> indices;
+    for(int q = 0; q < 10; ++q)
+    {
+        for(int j = 0; j < dim; ++j)
+            p[j] = gen.generate();
+
+        kdTree.findNearestNeighbors(p, k, &indices);
+
+        std::vector<std::pair<double, unsigned long> > v(points.size());
+        for(unsigned long i = 0; i < points.size(); ++i)
+        {
+            double d = 0;
+            for(int j = 0; j < dim; ++j)
+                d += (p[j] - points[i][j]) * (p[j] - points[i][j]);
+            v[i].first = d;
+            v[i].second = i;
+        }
+        std::sort(v.begin(), v.end());
+
+        for(int j = 0; j < k; ++j)
+        {
+            if(indices[j] != v[j].second)
+            {
+                output_screen("FAIL: Neighbor " << j << " of query " << q << " is " << indices[j] << ", expected " << v[j].second << "." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+    }
+}
+
+void
+TestKDTree::runSubTest12(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 4;
+    const unsigned long nPoints = 10000;
+
+    std::vector<std::vector<double> > points(nPoints, std::vector<double>(dim));
+    for(unsigned long i = 0; i < nPoints; ++i)
+    {
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    KDTree kdTree(dim, points);
+
+    res = 1;
+    expected = 1;
+    subTestName = "radius";
+
+    std::vector<double> p(dim);
+    std::vector<unsigned long> indices;
+    std::vector<double> dists;
+    for(int q = 0; q < 20; ++q)
+    {
+        for(int j = 0; j < dim; ++j)
+            p[j] = gen.generate();
+
+        const double radius = 0.05 * (q + 1) / 10;
+
+        std::vector<unsigned long> expectedIndices;
+        for(unsigned long i = 0; i < nPoints; ++i)
+        {
+            double d = 0;
+            for(int j = 0; j < dim; ++j)
+                d += (p[j] - points[i][j]) * (p[j] - points[i][j]);
+            if(d <= radius * radius)
+                expectedIndices.push_back(i);
+        }
+
+        kdTree.findWithinRadius(p, radius, &indices, &dists);
+
+        for(unsigned long i = 1; i < dists.size(); ++i)
+        {
+            if(dists[i] < dists[i - 1])
+            {
+                output_screen("FAIL: The points found for query " << q << " are not sorted by distance." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+
+        std::sort(indices.begin(), indices.end());
+        if(indices != expectedIndices)
+        {
+            output_screen("FAIL: Found " << indices.size() << " points within " << radius << " for query " << q << ", expected " << expectedIndices.size() << "." << std::endl);
+            res = 0;
+            return;
+        }
+
+        unsigned long index;
+        const bool found = kdTree.hasPointWithin(p, radius, &index);
+        if(found != !expectedIndices.empty() || (found && !std::binary_search(expectedIndices.begin(), expectedIndices.end(), index)))
+        {
+            output_screen("FAIL: The existence query " << q << " returned " << found << ", expected " << !expectedIndices.empty() << "." << std::endl);
+            res = 0;
+            return;
+        }
+    }
+}
+
+void
+TestKDTree::runSubTest13(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 3, k = 5;
+    const unsigned long nPoints = 10000;
+
+    std::vector<std::vector<double> > points(nPoints, std::vector<double>(dim));
+    for(unsigned long i = 0; i < nPoints; ++i)
+    {
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    KDTree kdTree(dim, std::vector<std::vector<double> >(points.begin(), points.begin() + nPoints / 2));
+    for(unsigned long i = nPoints / 2; i < nPoints; ++i)
+        kdTree.insert(points[i]);
+
+    const char* fileName = "test_kd_tree_snapshot.dat";
+    kdTree.writeIntoFile(fileName);
+
+    KDTree mapped(fileName);
+
+    res = 1;
+    expected = 1;
+    subTestName = "snapshot";
+
+    if(!mapped.isMapped() || mapped.nElements() != nPoints || mapped.dim() != dim || mapped.depth() != kdTree.depth())
+    {
+        output_screen("FAIL: The mapped tree has " << mapped.nElements() << " elements in " << mapped.dim() << " dimensions, expected " << nPoints << " in " << dim << "." << std::endl);
+        res = 0;
+        std::remove(fileName);
+        return;
+    }
+
+    for(unsigned long i = 0; i < nPoints; ++i)
+    {
+        if(!std::equal(points[i].begin(), points[i].end(), mapped.point(i)))
+        {
+            output_screen("FAIL: Point " << i << " of the mapped tree is different from the original." << std::endl);
+            res = 0;
+            std::remove(fileName);
+            return;
+        }
+    }
+
+    std::vector<double> p(dim);
+    std::vector<unsigned long> indices, indicesMapped;
+    for(int q = 0; q < 20; ++q)
+    {
+        for(int j = 0; j < dim; ++j)
+            p[j] = gen.generate();
+
+        // the mapped tree is copied into memory by the first insertion, after that it should still agree with the original
+        if(q == 10)
+        {
+            kdTree.insert(p);
+            mapped.insert(p);
+            if(mapped.isMapped())
+            {
+                output_screen("FAIL: The tree is still mapped after an insertion." << std::endl);
+                res = 0;
+            }
+            for(int j = 0; j < dim; ++j)
+                p[j] = gen.generate();
+        }
+
+        kdTree.findNearestNeighbors(p, k, &indices);
+        mapped.findNearestNeighbors(p, k, &indicesMapped);
+        if(indices != indicesMapped)
+        {
+            output_screen("FAIL: The nearest neighbors of query " << q << " in the mapped tree are different from the original." << std::endl);
+            res = 0;
+        }
+    }
+
+    std::remove(fileName);
+}
+
+void
+TestKDTree::runSubTest14(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 3, k = 4;
+    const long nTasks = 40000;
+
+    std::vector<std::vector<double> > points(nTasks, std::vector<double>(dim));
+    for(long i = 0; i < nTasks; ++i)
+    {
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    const unsigned long nInitial = 1000;
+    KDTree kdTree(dim, std::vector<std::vector<double> >(points.begin(), points.begin() + nInitial));
+    kdTree.setConcurrentAccess(true);
+
+    // every fourth task inserts a point, the others search around a point in parallel with the insertions
+    int failures = 0;
+#pragma omp parallel for default(shared) schedule(dynamic, 16) reduction(+:failures)
+    for(long i = nInitial; i < nTasks; ++i)
+    {
+        if(i % 4 == 0)
+        {
+            kdTree.insert(points[i]);
+            continue;
+        }
+
+        std::vector<std::vector<double> > neighbors;
+        std::vector<double> dists;
+        kdTree.findNearestNeighbors(points[i], k, &neighbors, &dists);
+
+        // the point itself is not in the tree, the neighbors should be sorted and the distances consistent
+        for(int j = 0; j < k; ++j)
+        {
+            double d = 0;
+            for(int l = 0; l < dim; ++l)
+                d += (points[i][l] - neighbors[j][l]) * (points[i][l] - neighbors[j][l]);
+            if(std::abs(d - dists[j]) > 1e-10 || (j > 0 && dists[j] < dists[j - 1]))
+                ++failures;
+        }
+    }
+
+    kdTree.setConcurrentAccess(false);
+
+    res = 1;
+    expected = 1;
+    subTestName = "concurrent";
+
+    if(failures)
+    {
+        output_screen("FAIL: " << failures << " inconsistent neighbors found during concurrent insertions." << std::endl);
+        res = 0;
+    }
+
+    std::vector<std::vector<double> > inserted(points.begin(), points.begin() + nInitial);
+    for(long i = nInitial; i < nTasks; ++i)
+    {
+        if(i % 4 == 0)
+            inserted.push_back(points[i]);
+    }
+
+    if(kdTree.nElements() != inserted.size())
+    {
+        output_screen("FAIL: The tree has " << kdTree.nElements() << " elements, expected " << inserted.size() << "." << std::endl);
+        res = 0;
+        return;
+    }
+
+    std::vector<double> p(dim), dists;
+    std::vector<unsigned long> indices;
+    for(int q = 0; q < 10; ++q)
+    {
+        for(int j = 0; j < dim; ++j)
+            p[j] = gen.generate();
+
+        kdTree.findNearestNeighbors(p, k, &indices, &dists);
+
+        std::vector<double> v(inserted.size());
+        for(unsigned long i = 0; i < inserted.size(); ++i)
+        {
+            v[i] = 0;
+            for(int j = 0; j < dim; ++j)
+                v[i] += (p[j] - inserted[i][j]) * (p[j] - inserted[i][j]);
+        }
+        std::sort(v.begin(), v.end());
+
+        for(int j = 0; j < k; ++j)
+        {
+            if(std::abs(dists[j] - v[j]) > 1e-10)
+            {
+                output_screen("FAIL: Neighbor " << j << " of query " << q << " is at distance squared " << dists[j] << ", expected " << v[j] << "." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+    }
+}
+
 bool
 TestKDTree::test(int dim, unsigned long nPoints, int k, int seed)
 {
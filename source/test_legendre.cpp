@@ -1,6 +1,12 @@
 #include <macros.hpp>
 #include <test_legendre.hpp>
 #include <legendre.hpp>
+#include <spherical_harmonics.hpp>
+#include <math_constants.hpp>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
 
 std::string
 TestLegendre::name() const
@@ -11,7 +17,7 @@ TestLegendre::name() const
 unsigned int
 TestLegendre::numberOfSubtests() const
 {
-    return 16;
+    return 20;
 }
 
 void
@@ -104,6 +110,75 @@ TestLegendre::runSubTest(unsigned int i, double& res, double& expected, std::str
         res = associatedLegendre.calculate(10000, -50, -0.1);
         expected = 7.16389192e-203;
         break;
+    case 16:
+    {
+        subTestName = std::string("all_up_to_500");
+        const int lMax = 500;
+        std::vector<double> all(lMax + 1);
+        Legendre::calculateAll(lMax, 0.37, &(all[0]));
+        res = 0;
+        for(int l = 0; l <= lMax; ++l)
+            res = std::max(res, std::abs(all[l] - legendre.calculate(l, 0.37)));
+        expected = 0;
+        break;
+    }
+    case 17:
+    {
+        subTestName = std::string("many_x_200");
+        const int n = 150;
+        std::vector<double> x(n), p(n);
+        for(int i = 0; i < n; ++i)
+            x[i] = -1 + 2.0 * i / (n - 1);
+        Legendre::calculate(200, n, &(x[0]), &(p[0]));
+        res = 1;
+        for(int i = 0; i < n; ++i)
+        {
+            if(std::abs(p[i] - legendre.calculate(200, x[i])) > 1e-12)
+                res = 0;
+        }
+        expected = 1;
+        break;
+    }
+    case 18:
+    {
+        subTestName = std::string("normalized_100_50");
+        std::vector<double> lambda(101);
+        AssociatedLegendre::calculateNormalizedAll(100, 50, std::cos(0.7), &(lambda[0]));
+        SphericalHarmonics sh;
+        res = lambda[100];
+        expected = sh.calculate(100, 50, 0.7, 0).real();
+        break;
+    }
+    case 19:
+    {
+        // 2 pi times the integral of lambda_lm^2 over x is 1, the many x version is checked against the all l version too
+        subTestName = std::string("normalized_2000_1000");
+        const int l = 2000, m = 1000, n = 200000;
+        std::vector<double> x(n), lambda(n), all(l + 1);
+        for(int i = 0; i < n; ++i)
+            x[i] = -1 + (i + 0.5) * 2.0 / n;
+        AssociatedLegendre::calculateNormalized(l, m, n, &(x[0]), &(lambda[0]));
+        double integral = 0;
+        res = 1;
+        for(int i = 0; i < n; ++i)
+        {
+            integral += lambda[i] * lambda[i] * 2.0 / n;
+            if(i % 1000 == 0)
+            {
+                AssociatedLegendre::calculateNormalizedAll(l, m, x[i], &(all[0]));
+                if(std::abs(all[l] - lambda[i]) > 1e-12 * (1 + std::abs(lambda[i])))
+                    res = 0;
+            }
+        }
+        integral *= 2 * Math::pi;
+        if(std::abs(integral - 1) > 1e-3)
+        {
+            output_screen("FAIL: the normalization integral is " << integral << std::endl);
+            res = 0;
+        }
+        expected = 1;
+        break;
+    }
     default:
         check(false, "");
         break;
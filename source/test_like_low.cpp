@@ -182,8 +182,7 @@ TestLikeLow::runSubTest(unsigned int i, double& res, double& expected, std::stri
     clCopy.resize(lMax + 1);
     CMatrix* cMatrix = CMatrixGenerator::clToCMatrix(clCopy, nSide, fwhm, &goodPixels);
     CMatrix* fiducialMatrix = CMatrixGenerator::getFiducialMatrix(clTT, nSide, lMax, fwhm, &goodPixels);
-    CMatrix* noiseMatrix = CMatrixGenerator::generateNoiseMatrix(nSide, pixelNoise);
-    noiseMatrix->maskMatrix(goodPixels);
+    CMatrix* noiseMatrix = CMatrixGenerator::generateNoiseMatrix(nSide, pixelNoise, &goodPixels);
     std::vector<double> foreground;
     Likelihood like(*cMatrix, *fiducialMatrix, *noiseMatrix, goodPixels, foreground);
     std::vector<std::string> mapNames(n, "test_map");
@@ -0,0 +1,166 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <unistd.h>
+
+#include <cosmo_mpi.hpp>
+#include <test_likelihood_farm.hpp>
+#include <likelihood_farm.hpp>
+#include <numerics.hpp>
+
+std::string
+TestLikelihoodFarm::name() const
+{
+    return std::string("LIKELIHOOD FARM TESTER");
+}
+
+unsigned int
+TestLikelihoodFarm::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// the points with positive x are much slower
+class LikelihoodFarmTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    LikelihoodFarmTestLikelihood(int slowMicroseconds = 2000) : slow_(slowMicroseconds) {}
+
+    virtual double calculate(double* params, int nParams)
+    {
+        check(nParams == 3, "");
+        if(params[0] > 0)
+            usleep(slow_);
+        return params[0] * params[0] + 2 * params[1] * params[1] + 3 * params[2] * params[2];
+    }
+
+private:
+    const int slow_;
+};
+
+double expectedLike(const double* params)
+{
+    return params[0] * params[0] + 2 * params[1] * params[1] + 3 * params[2] * params[2];
+}
+
+// many batches back to back, of different sizes, with the slow points on a different process each time, so the batches are published while the other processes are stealing from the previous ones
+bool runMultiBatch(int processId)
+{
+    LikelihoodFarmTestLikelihood like(20);
+    const int maxBatchSize = 8;
+    Math::LikelihoodFarm farm(like, 3, maxBatchSize);
+    const int nProcesses = CosmoMPI::create().numProcesses();
+
+    bool ok = true;
+    const int nBatches = 1000;
+    std::vector<double> params(3 * maxBatchSize), results(maxBatchSize);
+    for(int b = 0; b < nBatches; ++b)
+    {
+        const int nPoints = 1 + (7 * b + 3 * processId) % maxBatchSize;
+        const bool slow = (b % nProcesses == processId);
+        for(int j = 0; j < nPoints; ++j)
+        {
+            params[3 * j] = (slow ? 1.0 : -1.0) * (j + 1);
+            params[3 * j + 1] = 0.1 * b;
+            params[3 * j + 2] = processId;
+            results[j] = -1;
+        }
+
+        // the fast processes go on with their next batch right away, without waiting for the others to finish stealing
+        farm.startBatch(&(params[0]), nPoints);
+        farm.finishBatch(&(results[0]));
+
+        for(int j = 0; j < nPoints; ++j)
+        {
+            const double exp = expectedLike(&(params[3 * j]));
+            if(!Math::areEqual(exp, results[j], 1e-12))
+            {
+                output_screen("FAIL: Point " << j << " of batch " << b << " of process " << processId << " should have the likelihood " << exp << ", the result is " << results[j] << std::endl);
+                ok = false;
+            }
+        }
+    }
+
+    // help the others finish
+    farm.calculateBatch(&(params[0]), 3, 0, &(results[0]));
+    output_screen1("Evaluated " << farm.stolen() << " points of the other processes in the multiple batches." << std::endl);
+    return ok;
+}
+
+} // namespace
+
+void
+TestLikelihoodFarm::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    const int processId = CosmoMPI::create().processId();
+
+    if(i == 2)
+    {
+        subTestName = std::string("multiple_batches");
+        if(!runMultiBatch(processId))
+            res = 0;
+
+        double total = res;
+        CosmoMPI::create().reduce(&res, &total, 1, CosmoMPI::DOUBLE, CosmoMPI::MIN);
+        res = total;
+        return;
+    }
+
+    subTestName = (i == 0 ? std::string("batch") : std::string("asynchronous"));
+
+    LikelihoodFarmTestLikelihood like;
+    const int maxBatchSize = 16;
+    Math::LikelihoodFarm farm(like, 3, maxBatchSize);
+
+    // only the master has slow points, the other processes should steal them
+    const int nPoints = (i == 0 ? 40 : maxBatchSize);
+    std::vector<double> params(3 * nPoints), results(nPoints, -1);
+    for(int j = 0; j < nPoints; ++j)
+    {
+        params[3 * j] = (processId == 0 ? 1.0 : -1.0) * (j + 1);
+        params[3 * j + 1] = 0.5 * j;
+        params[3 * j + 2] = processId;
+    }
+
+    if(i == 0)
+        farm.calculateBatch(&(params[0]), 3, nPoints, &(results[0]));
+    else
+    {
+        farm.startBatch(&(params[0]), nPoints);
+        while(!farm.progress())
+        {
+        }
+        farm.finishBatch(&(results[0]));
+
+        // keep helping the others, just like calculateBatch
+        std::vector<double> none(3, -1);
+        farm.calculateBatch(&(none[0]), 3, 0, &(results[0]));
+    }
+
+    for(int j = 0; j < nPoints; ++j)
+    {
+        const double exp = expectedLike(&(params[3 * j]));
+        if(!Math::areEqual(exp, results[j], 1e-12))
+        {
+            output_screen("FAIL: Point " << j << " of process " << processId << " should have the likelihood " << exp << ", the result is " << results[j] << std::endl);
+            res = 0;
+        }
+    }
+
+    output_screen1("Evaluated " << farm.stolen() << " points of the other processes." << std::endl);
+
+    // the master reports the result of all of the processes
+    double total = res;
+    CosmoMPI::create().reduce(&res, &total, 1, CosmoMPI::DOUBLE, CosmoMPI::MIN);
+    res = total;
+}
+
@@ -0,0 +1,137 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <cosmo_mpi.hpp>
+#include <test_likelihood_gradient.hpp>
+#include <likelihood_gradient.hpp>
+#include <lbfgs.hpp>
+#include <numerics.hpp>
+
+std::string
+TestLikelihoodGradient::name() const
+{
+    return std::string("LIKELIHOOD GRADIENT TESTER");
+}
+
+unsigned int
+TestLikelihoodGradient::numberOfSubtests() const
+{
+    return 2;
+}
+
+namespace
+{
+
+// counts the batches to make sure that each gradient is one batch
+class LikelihoodGradientTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    LikelihoodGradientTestLikelihood() : batches_(0) {}
+
+    virtual double calculate(double* params, int nParams)
+    {
+        check(nParams == 3, "");
+        const double x = params[0] - 1, y = params[1] + 2, z = params[2] - 0.5;
+        return x * x + 2 * y * y + 3 * z * z + x * y;
+    }
+
+    virtual void calculateBatch(double* params, int nParams, int nPoints, double* results)
+    {
+        ++batches_;
+        LikelihoodFunction::calculateBatch(params, nParams, nPoints, results);
+    }
+
+    int batches() const { return batches_; }
+
+private:
+    int batches_;
+};
+
+} // namespace
+
+void
+TestLikelihoodGradient::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    LikelihoodGradientTestLikelihood like;
+    const std::vector<double> steps(3, 1e-3);
+    std::vector<double> min(3, -10), max(3, 10);
+
+    if(i == 0)
+    {
+        subTestName = std::string("gradient");
+
+        // the third parameter is at its upper bound, its difference is one-sided
+        max[2] = 2;
+        Math::LikelihoodGradient gradient(like, steps, &min, &max, true);
+        double params[3] = {0.3, -1.1, 2};
+        double grad[3];
+        const double value = gradient.calculate(params, grad);
+
+        const double x = params[0] - 1, y = params[1] + 2, z = params[2] - 0.5;
+        const double expValue = x * x + 2 * y * y + 3 * z * z + x * y;
+        const double expGrad[3] = {2 * x + y, 4 * y + x, 6 * z};
+        if(!Math::areEqual(value, expValue, 1e-12))
+        {
+            output_screen("FAIL: The value should be " << expValue << ", the result is " << value << std::endl);
+            res = 0;
+        }
+        for(int j = 0; j < 3; ++j)
+        {
+            const double tolerance = (j == 2 ? 1e-3 : 1e-8);
+            if(!Math::areEqual(grad[j], expGrad[j], tolerance))
+            {
+                output_screen("FAIL: Component " << j << " of the gradient should be " << expGrad[j] << ", the result is " << grad[j] << std::endl);
+                res = 0;
+            }
+        }
+
+        // one batch per process, with its share of the 7 points
+        const int processId = CosmoMPI::create().processId();
+        const int expBatches = (processId < 7 ? 1 : 0);
+        if(like.batches() != expBatches)
+        {
+            output_screen("FAIL: Process " << processId << " should calculate the gradient in " << expBatches << " batches, " << like.batches() << " batches were used." << std::endl);
+            res = 0;
+        }
+        double evaluations = gradient.evaluations(), total = 0;
+        CosmoMPI::create().reduce(&evaluations, &total, 1, CosmoMPI::DOUBLE, CosmoMPI::SUM);
+        CosmoMPI::create().bcast(&total, 1, CosmoMPI::DOUBLE);
+        if(total != 7)
+        {
+            output_screen("FAIL: The gradient should take 7 evaluations, " << total << " were used." << std::endl);
+            res = 0;
+        }
+    }
+    else
+    {
+        subTestName = std::string("lbfgs");
+
+        Math::LikelihoodGradient gradient(like, steps, &min, &max, true);
+        std::vector<double> starting(3, 0), result;
+        Math::LBFGS lbfgs(3, gradient.function(), gradient.gradientFunction(), starting);
+        lbfgs.minimize(&result, 1e-10, 1e-7, 1000);
+
+        // the minimum is at the center, the x y term does not move it
+        const double expResult[3] = {1, -2, 0.5};
+        for(int j = 0; j < 3; ++j)
+        {
+            if(!Math::areEqual(result[j], expResult[j], 1e-4))
+            {
+                output_screen("FAIL: Parameter " << j << " at the minimum should be " << expResult[j] << ", the result is " << result[j] << std::endl);
+                res = 0;
+            }
+        }
+    }
+
+    // the master reports the result of all of the processes
+    double total = res;
+    CosmoMPI::create().reduce(&res, &total, 1, CosmoMPI::DOUBLE, CosmoMPI::MIN);
+    res = total;
+}
+
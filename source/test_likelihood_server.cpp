@@ -0,0 +1,134 @@
+#include <cmath>
+#include <vector>
+#include <sstream>
+#include <thread>
+
+#include <unistd.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <likelihood_server.hpp>
+#include <test_likelihood_server.hpp>
+
+namespace
+{
+
+// a gaussian likelihood that fails for negative x
+class ServerTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    double calculate(double* params, int nParams)
+    {
+        check(params[0] >= 0, "negative x");
+        double res = 0;
+        for(int i = 0; i < nParams; ++i)
+            res += (params[i] - i) * (params[i] - i);
+        return res;
+    }
+
+    double calculateExact(double* params, int nParams) { return 2 * calculate(params, nParams); }
+};
+
+} // namespace
+
+std::string
+TestLikelihoodServer::name() const
+{
+    return std::string("LIKELIHOOD SERVER TESTER");
+}
+
+unsigned int
+TestLikelihoodServer::numberOfSubtests() const
+{
+    return 2;
+}
+
+void
+TestLikelihoodServer::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    std::stringstream path;
+    path << "/tmp/cosmopp_test_likelihood_server_" << getpid() << '_' << i;
+
+    ServerTestLikelihood like;
+    Math::LikelihoodServer server(like, path.str().c_str());
+    std::thread serverThread(&Math::LikelihoodServer::run, &server);
+
+    const int nPar = 3, nPoints = 10;
+    std::vector<double> params(nPar * nPoints);
+    for(int j = 0; j < nPar * nPoints; ++j)
+        params[j] = 0.1 * j;
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+        {
+            subTestName = std::string("batch");
+            Math::LikelihoodClient client(path.str().c_str());
+            std::vector<double> results(nPoints);
+            client.calculateBatch(&(params[0]), nPar, nPoints, &(results[0]));
+            for(int j = 0; j < nPoints; ++j)
+            {
+                const double single = client.calculate(&(params[j * nPar]), nPar);
+                const double exact = client.calculateExact(&(params[j * nPar]), nPar);
+                const double direct = like.calculate(&(params[j * nPar]), nPar);
+                if(results[j] != direct || single != direct || exact != 2 * direct)
+                {
+                    output_screen("FAIL: point " << j << " direct " << direct << ", batch " << results[j] << ", single " << single << ", exact " << exact << std::endl);
+                    res = 0;
+                }
+            }
+            client.shutdownServer();
+        }
+        break;
+    case 1:
+        {
+            subTestName = std::string("errors");
+            // the error is thrown in the client and the server keeps serving, also the next clients
+            {
+                Math::LikelihoodClient client(path.str().c_str());
+                params[0] = -1;
+                bool thrown = false;
+                try {
+                    client.calculate(&(params[0]), nPar);
+                } catch (StandardException&)
+                {
+                    thrown = true;
+                }
+                if(!thrown)
+                {
+                    output_screen("FAIL: the error of the likelihood was not thrown in the client" << std::endl);
+                    res = 0;
+                }
+                params[0] = 0;
+                if(client.calculate(&(params[0]), nPar) != like.calculate(&(params[0]), nPar))
+                {
+                    output_screen("FAIL: wrong result after an error" << std::endl);
+                    res = 0;
+                }
+            }
+            Math::LikelihoodClient client(path.str().c_str());
+            if(client.calculate(&(params[nPar]), nPar) != like.calculate(&(params[nPar]), nPar))
+            {
+                output_screen("FAIL: wrong result for the second client" << std::endl);
+                res = 0;
+            }
+            client.shutdownServer();
+        }
+        break;
+    default:
+        check(false, "");
+    }
+
+    serverThread.join();
+    if(server.requests() == 0)
+    {
+        output_screen("FAIL: the server has no requests" << std::endl);
+        res = 0;
+    }
+}
+
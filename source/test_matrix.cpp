@@ -1,5 +1,10 @@
+#include <utility>
+#include <cmath>
+
 #include <macros.hpp>
 #include <matrix_impl.hpp>
+#include <mapped_matrix.hpp>
+#include <banded_matrix.hpp>
 #include <test_matrix.hpp>
 #include <numerics.hpp>
 
@@ -12,7 +17,7 @@ TestMatrix::name() const
 unsigned int
 TestMatrix::numberOfSubtests() const
 {
-    return 22;
+    return 28;
 }
 
 void
@@ -86,6 +91,24 @@ TestMatrix::runSubTest(unsigned int i, double& res, double& expected, std::strin
     case 21:
         runSubTestEigen(res, expected, subTestName, true);
         break;
+    case 22:
+        runSubTest22(res, expected, subTestName);
+        break;
+    case 23:
+        runSubTest23(res, expected, subTestName);
+        break;
+    case 24:
+        runSubTest24(res, expected, subTestName);
+        break;
+    case 25:
+        runSubTest25(res, expected, subTestName);
+        break;
+    case 26:
+        runSubTest26(res, expected, subTestName);
+        break;
+    case 27:
+        runSubTest27(res, expected, subTestName);
+        break;
     default:
         check(false, "");
         break;
@@ -486,6 +509,378 @@ TestMatrix::runSubTest19(double& res, double& expected, std::string& subTestName
 #endif
 }
 
+void
+TestMatrix::runSubTest22(double& res, double& expected, std::string& subTestName)
+{
+    Math::Matrix<double> mat(2, 3), mat1(3, 4);
+    Math::SymmetricMatrix<double> sym(3, 3);
+    for(int i = 0; i < 3; ++i)
+    {
+        for(int j = 0; j < 2; ++j)
+            mat(j, i) = i * i - 2 * j + 1;
+        for(int j = 0; j < 4; ++j)
+            mat1(i, j) = 3 * i - j * j;
+        for(int j = 0; j <= i; ++j)
+            sym(i, j) = i + 2 * j + 1;
+    }
+
+    Math::Matrix<double> mat2;
+    Math::Matrix<double>::multiplyMatrices(mat, mat1, &mat2);
+
+    // symmetric operand, and the result written over the first operand
+    Math::Matrix<double> mat3;
+    Math::Matrix<double>::multiplyMatrices(mat, sym, &mat3);
+    Math::Matrix<double>::multiplyMatrices(mat3, mat1, &mat3);
+
+    expected = 1;
+    res = 1;
+    subTestName = "nonuniform_multiply";
+
+    if(mat2.rows() != 2 || mat2.cols() != 4 || mat3.rows() != 2 || mat3.cols() != 4)
+    {
+        output_screen_clean("FAIL! The product has the wrong size." << std::endl);
+        res = 0;
+        return;
+    }
+
+    for(int i = 0; i < 2; ++i)
+    {
+        for(int j = 0; j < 4; ++j)
+        {
+            double x = 0, y = 0;
+            for(int k = 0; k < 3; ++k)
+            {
+                x += mat(i, k) * mat1(k, j);
+                double s = 0;
+                for(int l = 0; l < 3; ++l)
+                    s += mat(i, l) * sym(l, k);
+                y += s * mat1(k, j);
+            }
+
+            if(!Math::areEqual(mat2(i, j), x, 1e-10) || !Math::areEqual(mat3(i, j), y, 1e-10))
+            {
+                output_screen_clean("FAIL! The products at (" << i << ", " << j << ") are " << mat2(i, j) << " and " << mat3(i, j) << ", expected " << x << " and " << y << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+}
+
+void
+TestMatrix::runSubTest23(double& res, double& expected, std::string& subTestName)
+{
+    expected = 1;
+    res = 1;
+    subTestName = "simple_symmetric_eigen_range";
+
+#ifdef COSMO_LAPACK
+    const int n = 6;
+    Math::SymmetricMatrix<double> mat(n, n);
+    for(int i = 0; i < n; ++i)
+        for(int j = 0; j <= i; ++j)
+            mat(i, j) = (i == j ? i + 1.0 : 0.3 / (i + j));
+
+    std::vector<double> all, values, range, interval;
+    Math::Matrix<double> allVecs, rangeVecs;
+    mat.getEigen(&all, &allVecs);
+    mat.getEigenvalues(&values);
+    mat.getEigenRange(n - 2, n - 1, &range, &rangeVecs);
+    mat.getEigenValueRange(all[1] - 1e-3, all[3] + 1e-3, &interval);
+
+    if(values.size() != n || range.size() != 2 || rangeVecs.rows() != n || rangeVecs.cols() != 2 || interval.size() != 3)
+    {
+        output_screen_clean("FAIL! Got " << values.size() << " eigenvalues, " << range.size() << " in the index range with eigenvectors of size " << rangeVecs.rows() << " x " << rangeVecs.cols() << ", " << interval.size() << " in the interval." << std::endl);
+        res = 0;
+        return;
+    }
+
+    for(int i = 0; i < n; ++i)
+    {
+        if(!Math::areEqual(values[i], all[i], 1e-8))
+        {
+            output_screen_clean("FAIL! Eigenvalue " << i << " is " << values[i] << ", expected " << all[i] << "." << std::endl);
+            res = 0;
+        }
+    }
+
+    for(int k = 0; k < 3; ++k)
+    {
+        if(!Math::areEqual(interval[k], all[k + 1], 1e-8))
+        {
+            output_screen_clean("FAIL! Eigenvalue " << k << " in the interval is " << interval[k] << ", expected " << all[k + 1] << "." << std::endl);
+            res = 0;
+        }
+    }
+
+    for(int k = 0; k < 2; ++k)
+    {
+        if(!Math::areEqual(range[k], all[n - 2 + k], 1e-8))
+        {
+            output_screen_clean("FAIL! Eigenvalue " << k << " in the index range is " << range[k] << ", expected " << all[n - 2 + k] << "." << std::endl);
+            res = 0;
+        }
+
+        // the eigenvectors are the same up to the sign
+        double dot = 0;
+        for(int i = 0; i < n; ++i)
+            dot += rangeVecs(i, k) * allVecs(i, n - 2 + k);
+        if(!Math::areEqual(std::abs(dot), 1.0, 1e-8))
+        {
+            output_screen_clean("FAIL! Eigenvector " << k << " in the index range has the product " << dot << " with the one from getEigen." << std::endl);
+            res = 0;
+        }
+    }
+#else
+    output_screen_clean("This test (below) is skipped because Cosmo++ has not been linked to lapack" << std::endl);
+#endif
+}
+
+void
+TestMatrix::runSubTest24(double& res, double& expected, std::string& subTestName)
+{
+    expected = 1;
+    res = 1;
+    subTestName = "transposed_multiply_move";
+
+    Math::Matrix<double> mat(3, 2), mat1(4, 3);
+    Math::Matrix<int> matInt(3, 2), matInt1(4, 3);
+    for(int i = 0; i < 3; ++i)
+    {
+        for(int j = 0; j < 2; ++j)
+            matInt(i, j) = mat(i, j) = i * i - 2 * j + 1;
+        for(int j = 0; j < 4; ++j)
+            matInt1(j, i) = mat1(j, i) = 3 * i - j * j;
+    }
+
+    // (mat^T)(mat1^T) is 2 x 4
+    Math::Matrix<double> prod;
+    Math::Matrix<int> prodInt;
+    Math::Matrix<double>::multiplyMatrices(mat, mat1, &prod, true, true);
+    Math::Matrix<int>::multiplyMatrices(matInt, matInt1, &prodInt, true, true);
+
+    if(prod.rows() != 2 || prod.cols() != 4 || prodInt.rows() != 2 || prodInt.cols() != 4)
+    {
+        output_screen_clean("FAIL! The transposed product has the wrong size." << std::endl);
+        res = 0;
+        return;
+    }
+
+    for(int i = 0; i < 2; ++i)
+    {
+        for(int j = 0; j < 4; ++j)
+        {
+            double x = 0;
+            for(int k = 0; k < 3; ++k)
+                x += mat(k, i) * mat1(j, k);
+
+            if(!Math::areEqual(prod(i, j), x, 1e-10) || prodInt(i, j) != int(x))
+            {
+                output_screen_clean("FAIL! The transposed products at (" << i << ", " << j << ") are " << prod(i, j) << " and " << prodInt(i, j) << ", expected " << x << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+
+    Math::Matrix<double> moved(std::move(prod));
+    if(moved.rows() != 2 || moved.cols() != 4 || prod.rows() != 0 || moved(1, 3) != prodInt(1, 3))
+    {
+        output_screen_clean("FAIL! The move constructor did not take over the storage." << std::endl);
+        res = 0;
+    }
+
+    // a symmetric temporary has a different storage, so it must be converted
+    Math::SymmetricMatrix<double> sym(3, 3);
+    for(int i = 0; i < 3; ++i)
+        for(int j = 0; j <= i; ++j)
+            sym(i, j) = i + 2 * j + 1;
+
+    Math::Matrix<double> full = sym + sym;
+    for(int i = 0; i < 3; ++i)
+    {
+        for(int j = 0; j < 3; ++j)
+        {
+            if(full(i, j) != 2 * sym(i, j))
+            {
+                output_screen_clean("FAIL! The element (" << i << ", " << j << ") of the matrix constructed from a symmetric temporary is " << full(i, j) << ", expected " << 2 * sym(i, j) << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+}
+
+void
+TestMatrix::runSubTest25(double& res, double& expected, std::string& subTestName)
+{
+    expected = 1;
+    res = 1;
+    subTestName = "mapped_file";
+
+    Math::Matrix<double> mat(3, 5);
+    Math::SymmetricMatrix<double> sym(4, 4);
+    for(int i = 0; i < 3; ++i)
+        for(int j = 0; j < 5; ++j)
+            mat(i, j) = 0.5 * i - j * j;
+    for(int i = 0; i < 4; ++i)
+        for(int j = 0; j <= i; ++j)
+            sym(i, j) = i * i + 0.25 * j;
+
+    Math::MappedMatrix::writeIntoFile(mat, "test_mapped_matrix.dat");
+    Math::MappedMatrix::writeIntoFile(sym, "test_mapped_sym_matrix.dat");
+
+    Math::MappedMatrix mapped("test_mapped_matrix.dat");
+    Math::MappedMatrix mappedSym("test_mapped_sym_matrix.dat");
+
+    if(mapped.rows() != 3 || mapped.cols() != 5 || mapped.isSymmetric() || mappedSym.rows() != 4 || mappedSym.cols() != 4 || !mappedSym.isSymmetric())
+    {
+        output_screen_clean("FAIL! The mapped matrices have the wrong sizes." << std::endl);
+        res = 0;
+        return;
+    }
+
+    for(int i = 0; i < 3; ++i)
+    {
+        for(int j = 0; j < 5; ++j)
+        {
+            if(mapped(i, j) != mat(i, j))
+            {
+                output_screen_clean("FAIL! The mapped element (" << i << ", " << j << ") is " << mapped(i, j) << ", expected " << mat(i, j) << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+
+    Math::SymmetricMatrix<double> symCopy;
+    mappedSym.copyTo(&symCopy);
+    for(int i = 0; i < 4; ++i)
+    {
+        for(int j = 0; j < 4; ++j)
+        {
+            if(mappedSym(i, j) != sym(i, j) || symCopy(i, j) != sym(i, j))
+            {
+                output_screen_clean("FAIL! The mapped symmetric element (" << i << ", " << j << ") is " << mappedSym(i, j) << " and the copied one is " << symCopy(i, j) << ", expected " << sym(i, j) << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+
+    // the old format is not accepted
+    sym.writeIntoFile("test_mapped_sym_matrix.dat");
+    bool thrown = false;
+    try
+    {
+        Math::MappedMatrix invalid("test_mapped_sym_matrix.dat");
+    }
+    catch(std::exception&)
+    {
+        thrown = true;
+    }
+    if(!thrown)
+    {
+        output_screen_clean("FAIL! A file in the old format was mapped." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestMatrix::runSubTest26(double& res, double& expected, std::string& subTestName)
+{
+    expected = 1;
+    res = 1;
+    subTestName = "banded";
+
+    // a band of half width 2 with small elements further out, the last row is empty
+    const int n = 8;
+    Math::Matrix<double> mat(n, n, 0);
+    for(int i = 0; i < n - 1; ++i)
+    {
+        for(int j = 0; j < n; ++j)
+        {
+            const int d = std::abs(i - j);
+            if(d <= 2)
+                mat(i, j) = 2.0 + i + 0.5 * j;
+            else if(d == 3)
+                mat(i, j) = 1e-8;
+        }
+    }
+
+    std::vector<double> x(n), y(n), yExpected(n, 0), yT(n), yTExpected(n);
+    for(int i = 0; i < n; ++i)
+        x[i] = 0.3 * i - 1;
+
+    for(int k = 0; k < 2; ++k)
+    {
+        const double threshold = (k == 0 ? 0 : 1e-6);
+        Math::BandedMatrix banded(mat, threshold);
+
+        double bilinearExpected = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            yExpected[i] = 0;
+            yTExpected[i] = 0;
+            for(int j = 0; j < n; ++j)
+                yTExpected[i] += (std::abs(mat(j, i)) > threshold ? mat(j, i) : 0) * x[j];
+            for(int j = 0; j < n; ++j)
+            {
+                const double a = (std::abs(mat(i, j)) > threshold ? mat(i, j) : 0);
+                if(banded(i, j) != a)
+                {
+                    output_screen_clean("FAIL! The banded element (" << i << ", " << j << ") is " << banded(i, j) << ", expected " << a << "." << std::endl);
+                    res = 0;
+                }
+                yExpected[i] += a * x[j];
+            }
+            bilinearExpected += x[i] * yExpected[i];
+        }
+
+        if(banded.width(n - 1) != 0 || (k == 1 && banded.size() != 31))
+        {
+            output_screen_clean("FAIL! The banded matrix with threshold " << threshold << " has " << banded.size() << " elements." << std::endl);
+            res = 0;
+        }
+
+        banded.multiply(&(x[0]), &(y[0]));
+        for(int i = 0; i < n; ++i)
+        {
+            if(!Math::areEqual(y[i], yExpected[i], 1e-12))
+            {
+                output_screen_clean("FAIL! Element " << i << " of the product is " << y[i] << ", expected " << yExpected[i] << "." << std::endl);
+                res = 0;
+            }
+        }
+
+        banded.multiplyTransposed(&(x[0]), &(yT[0]));
+        for(int i = 0; i < n; ++i)
+        {
+            if(!Math::areEqual(yT[i], yTExpected[i], 1e-12))
+            {
+                output_screen_clean("FAIL! Element " << i << " of the transposed product is " << yT[i] << ", expected " << yTExpected[i] << "." << std::endl);
+                res = 0;
+            }
+        }
+
+        const double bilinear = banded.bilinearForm(&(x[0]), &(x[0]));
+        if(!Math::areEqual(bilinear, bilinearExpected, 1e-12))
+        {
+            output_screen_clean("FAIL! The bilinear form is " << bilinear << ", expected " << bilinearExpected << "." << std::endl);
+            res = 0;
+        }
+
+        Math::Matrix<double> full;
+        banded.copyTo(&full);
+        for(int i = 0; i < n; ++i)
+        {
+            for(int j = 0; j < n; ++j)
+            {
+                if(full(i, j) != banded(i, j))
+                {
+                    output_screen_clean("FAIL! The copied element (" << i << ", " << j << ") is " << full(i, j) << ", expected " << banded(i, j) << "." << std::endl);
+                    res = 0;
+                }
+            }
+        }
+    }
+}
+
 void
 TestMatrix::runSubTestEigen(double& res, double& expected, std::string& subTestName, bool pd)
 {
@@ -570,3 +965,82 @@ TestMatrix::runSubTestEigen(double& res, double& expected, std::string& subTestN
 #endif
 }
 
+void
+TestMatrix::runSubTest27(double& res, double& expected, std::string& subTestName)
+{
+    expected = 1;
+    res = 1;
+    subTestName = "large_symmetric";
+
+#ifdef COSMO_LAPACK
+    // large enough for the rectangular full packed Cholesky factorization, the eigenvalues are from dspevd
+    const int n = 300;
+    Math::SymmetricMatrix<double> mat(n, n);
+    for(int i = 0; i < n; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+            mat(i, j) = (i == j ? 2.0 + 0.01 * i : 0) + 1.0 / (1.0 + (i - j) * (i - j)) + 0.01 * std::sin(0.3 * i + 0.5 * j);
+    }
+
+    Math::SymmetricMatrix<double> invMat = mat;
+    const int info = invMat.invert();
+    if(info)
+    {
+        output_screen_clean("FAIL! Inversion failed. Info = " << info << std::endl);
+        res = 0;
+        return;
+    }
+
+    Math::Matrix<double> prod = mat;
+    prod *= invMat;
+    for(int i = 0; i < n; ++i)
+    {
+        for(int j = 0; j < n; ++j)
+        {
+            if(!Math::areEqual(prod(i, j), (i == j ? 1.0 : 0.0), 1e-8))
+            {
+                output_screen_clean("FAIL! The element (" << i << ", " << j << ") of the matrix times its inverse is " << prod(i, j) << "." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+    }
+
+    std::vector<double> eigenvals;
+    Math::Matrix<double> eigenvecs;
+    mat.getEigen(&eigenvals, &eigenvecs, false);
+
+    double logDetExpected = 0;
+    for(int k = 0; k < n; ++k)
+    {
+        if(k > 0 && eigenvals[k] < eigenvals[k - 1])
+        {
+            output_screen_clean("FAIL! The eigenvalues are not in ascending order at " << k << "." << std::endl);
+            res = 0;
+        }
+        logDetExpected += std::log(eigenvals[k]);
+        for(int i = 0; i < n; ++i)
+        {
+            double mv = 0;
+            for(int j = 0; j < n; ++j)
+                mv += mat(i, j) * eigenvecs(j, k);
+            if(std::abs(mv - eigenvals[k] * eigenvecs(i, k)) > 1e-10 * eigenvals[n - 1])
+            {
+                output_screen_clean("FAIL! The eigenvalue " << k << " times the eigenvector doesn't match the matrix times the eigenvector at index " << i << ", expected " << eigenvals[k] * eigenvecs(i, k) << " obtained " << mv << "." << std::endl);
+                res = 0;
+                return;
+            }
+        }
+    }
+
+    int sign;
+    const double logDet = mat.logDet(&sign);
+    if(sign != 1 || !Math::areEqual(logDet, logDetExpected, 1e-10))
+    {
+        output_screen_clean("FAIL! The log determinant is " << logDet << " with sign " << sign << ", the sum of the logs of the eigenvalues is " << logDetExpected << "." << std::endl);
+        res = 0;
+    }
+#else
+    output_screen_clean("This test (below) is skipped because Cosmo++ has not been linked to lapack" << std::endl);
+#endif
+}
@@ -0,0 +1,181 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <random.hpp>
+#include <numerics.hpp>
+#include <matter_ps_emulator.hpp>
+#include <test_matter_ps_emulator.hpp>
+
+std::string
+TestMatterPsEmulator::name() const
+{
+    return std::string("MATTER PS EMULATOR TESTER");
+}
+
+unsigned int
+TestMatterPsEmulator::numberOfSubtests() const
+{
+    return 2;
+}
+
+namespace
+{
+
+// a smooth power spectrum shape with an amplitude, a tilt, a turnover scale and a growth rate as the parameters
+class MatterPsTestFunc : public Math::RealFunctionMultiToMulti
+{
+public:
+    MatterPsTestFunc(const std::vector<double>& k, const std::vector<double>& z) : k_(k), z_(z), count_(0) {}
+
+    virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+    {
+        ++count_;
+        res->resize(k_.size() * z_.size());
+        for(int j = 0; j < z_.size(); ++j)
+            for(int i = 0; i < k_.size(); ++i)
+                (*res)[j * k_.size() + i] = value(x, k_[i], z_[j]);
+    }
+
+    static double value(const std::vector<double>& x, double k, double z)
+    {
+        const double q = k / x[2];
+        const double growth = std::pow(1 + z, -x[3]);
+        return std::exp(x[0]) * std::pow(k, x[1]) / std::pow(1 + q * q, 2) * growth * growth;
+    }
+
+    int count() const { return count_; }
+
+private:
+    const std::vector<double> k_, z_;
+    mutable int count_;
+};
+
+void
+randomMatterPsTestPoint(Math::UniformRealGenerator& gen, double width, std::vector<double>& x)
+{
+    x.resize(4);
+    x[0] = 3 + width * gen.generate();
+    x[1] = 0.96 + 0.05 * width * gen.generate();
+    x[2] = 0.02 + 0.005 * width * gen.generate();
+    x[3] = 1 + 0.1 * width * gen.generate();
+}
+
+} // namespace
+
+void
+TestMatterPsEmulator::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    Math::UniformRealGenerator gen(2000 + 31 * mpi.processId() + i, -1, 1);
+
+    std::vector<double> k, z;
+    for(int j = 0; j < 60; ++j)
+        k.push_back(1e-4 * std::pow(10.0, j * 4.0 / 59));
+    z.push_back(0);
+    z.push_back(0.5);
+    z.push_back(1);
+    z.push_back(2);
+
+    const double precision = 0.01;
+    MatterPsTestFunc f(k, z);
+    std::vector<double> x;
+
+    if(i == 0)
+    {
+        subTestName = std::string("approximation");
+
+        MatterPsEmulator emulator(f, 4, k, z, "", precision, 2000, 100);
+
+        // the first calls are exact and learn the basis
+        for(int j = 0; j < 2500; ++j)
+        {
+            randomMatterPsTestPoint(gen, 1, x);
+            emulator.calculate(x, true);
+        }
+
+        const int nCompressed = emulator.principalComponents().nComponents();
+        if(nCompressed <= 0 || nCompressed >= k.size() * z.size())
+        {
+            output_screen("FAIL: " << k.size() * z.size() << " values are compressed into " << nCompressed << " components." << std::endl);
+            res = 0;
+        }
+
+        const int nTest = 300;
+        const int countBefore = f.count();
+        int approximated = 0;
+        double maxError = 0;
+        for(int j = 0; j < nTest; ++j)
+        {
+            randomMatterPsTestPoint(gen, 0.8, x);
+            emulator.calculate(x);
+            if(!emulator.lastApproximate())
+                continue;
+
+            ++approximated;
+            double meanError = 0;
+            for(int iz = 0; iz < z.size(); ++iz)
+                for(int ik = 0; ik < k.size(); ++ik)
+                    meanError += std::log(emulator.value(iz, ik) / MatterPsTestFunc::value(x, k[ik], z[iz]));
+            maxError = std::max(maxError, std::abs(meanError / (k.size() * z.size())));
+        }
+
+        output_screen1("Approximated " << approximated << " out of " << nTest << " power spectra, the largest error in the mean of ln P is " << maxError << "." << std::endl);
+        if(approximated < nTest / 2 || maxError > 10 * precision || f.count() - countBefore != nTest - approximated)
+        {
+            output_screen("FAIL: approximated " << approximated << " out of " << nTest << " power spectra with the largest error " << maxError << ", the power spectrum has been calculated " << f.count() - countBefore << " times." << std::endl);
+            res = 0;
+        }
+    }
+    else if(i == 1)
+    {
+        subTestName = std::string("get_matter_ps");
+
+        // before the basis is learned the exact power spectrum is used
+        MatterPsEmulator emulator(f, 4, k, z, "", precision, 2000, 100);
+        randomMatterPsTestPoint(gen, 1, x);
+        emulator.calculate(x);
+
+        // at a redshift of the grid the exact values are returned, between them ln P is interpolated linearly in z
+        Math::TableFunction<double, double> ps;
+        emulator.getMatterPs(0.5, &ps);
+        if(emulator.lastApproximate() || ps.size() != k.size())
+        {
+            output_screen("FAIL: the power spectrum has " << ps.size() << " values, expected " << k.size() << "." << std::endl);
+            res = 0;
+            return;
+        }
+
+        for(int ik = 0; ik < k.size(); ++ik)
+        {
+            if(!Math::areEqual(ps[k[ik]], MatterPsTestFunc::value(x, k[ik], 0.5), 1e-10))
+            {
+                output_screen("FAIL: P(" << k[ik] << ") = " << ps[k[ik]] << ", expected " << MatterPsTestFunc::value(x, k[ik], 0.5) << "." << std::endl);
+                res = 0;
+                break;
+            }
+        }
+
+        emulator.getMatterPs(1.5, &ps);
+        const double t = 0.5;
+        for(int ik = 0; ik < k.size(); ++ik)
+        {
+            const double expectedPs = std::exp((1 - t) * std::log(MatterPsTestFunc::value(x, k[ik], 1)) + t * std::log(MatterPsTestFunc::value(x, k[ik], 2)));
+            if(!Math::areEqual(ps[k[ik]], expectedPs, 1e-10))
+            {
+                output_screen("FAIL: at z = 1.5 P(" << k[ik] << ") = " << ps[k[ik]] << ", expected " << expectedPs << "." << std::endl);
+                res = 0;
+                break;
+            }
+        }
+    }
+}
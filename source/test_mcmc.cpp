@@ -1,10 +1,23 @@
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <vector>
+#include <utility>
+#include <cstdio>
+#include <cmath>
+
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
 
 #include <test_mcmc.hpp>
 #include <mcmc.hpp>
 #include <markov_chain.hpp>
+#include <chain_file.hpp>
+#include <streaming_chain.hpp>
 #include <numerics.hpp>
+#include <random.hpp>
+#include <fft.hpp>
 
 std::string
 TestMCMCFast::name() const
@@ -15,7 +28,7 @@ TestMCMCFast::name() const
 unsigned int
 TestMCMCFast::numberOfSubtests() const
 {
-    return 1;
+    return 13;
 }
 
 class MCMCFastTestLikelihood : public Math::LikelihoodFunction
@@ -42,29 +55,247 @@ private:
     const double x0_, y0_, sigmaX_, sigmaY_;
 };
 
+// calculate returns a deliberately inaccurate approximation (shifted and too wide), calculateExact returns the true likelihood
+class MCMCFastTestApproxLikelihood : public MCMCFastTestLikelihood
+{
+public:
+    MCMCFastTestApproxLikelihood(double x0 = 0, double y0 = 0, double sigmaX = 1, double sigmaY = 1) : MCMCFastTestLikelihood(x0, y0, sigmaX, sigmaY), approx_(x0 + 0.5 * sigmaX, y0 - 0.3 * sigmaY, 1.3 * sigmaX, 1.2 * sigmaY), lastApproximate_(false) {}
+
+    ~MCMCFastTestApproxLikelihood() {}
+
+    virtual double calculate(double* params, int nParams) { lastApproximate_ = true; return approx_.calculate(params, nParams); }
+    virtual double calculateExact(double* params, int nParams) { lastApproximate_ = false; return MCMCFastTestLikelihood::calculate(params, nParams); }
+
+    virtual bool lastEvaluationInfo(bool* approximate, int* retries) const
+    {
+        *approximate = lastApproximate_;
+        *retries = 0;
+        return true;
+    }
+
+private:
+    MCMCFastTestLikelihood approx_;
+    bool lastApproximate_;
+};
+
+// the low precision is a deliberately shifted likelihood, used for the precision schedule
+class MCMCFastTestPrecisionLikelihood : public MCMCFastTestLikelihood
+{
+public:
+    MCMCFastTestPrecisionLikelihood(double x0 = 0, double y0 = 0, double sigmaX = 1, double sigmaY = 1) : MCMCFastTestLikelihood(x0, y0, sigmaX, sigmaY), low_(x0 + sigmaX, y0 + sigmaY, sigmaX, sigmaY), lowPrecision_(false), lowCount_(0), lowAfterSwitch_(0), switched_(false) {}
+
+    ~MCMCFastTestPrecisionLikelihood() {}
+
+    virtual double calculate(double* params, int nParams)
+    {
+        if(!lowPrecision_)
+            return MCMCFastTestLikelihood::calculate(params, nParams);
+
+        ++lowCount_;
+        if(switched_)
+            ++lowAfterSwitch_;
+        return low_.calculate(params, nParams);
+    }
+
+    virtual bool setLowPrecision(bool low)
+    {
+        if(lowPrecision_ && !low)
+            switched_ = true;
+        lowPrecision_ = low;
+        return true;
+    }
+
+    unsigned long lowCount() const { return lowCount_; }
+    unsigned long lowAfterSwitch() const { return lowAfterSwitch_; }
+    bool switched() const { return switched_; }
+
+private:
+    MCMCFastTestLikelihood low_;
+    bool lowPrecision_;
+    unsigned long lowCount_, lowAfterSwitch_;
+    bool switched_;
+};
+
+
+namespace
+{
+
+int runMCMCFastTestChain(Math::MetropolisHastings& mh, unsigned int i, unsigned long burnin)
+{
+    const double xMin = -20, xMax = 20, yMin = -20, yMax = 20;
+    mh.setParam(0, "x", xMin, xMax, 0, 2, 0.5, 0.1);
+    mh.setParam(1, "y", yMin, yMax, 0, 2, 0.5, 0.1);
+    if(i == 1)
+        mh.useMultipleTry(4);
+    if(i == 2)
+        mh.setChainFormat(Math::MetropolisHastings::BINARY_CHAIN, 100);
+    if(i == 3)
+    {
+        mh.useDelayedAcceptance();
+        mh.logEvaluations();
+    }
+    if(i == 5)
+    {
+        std::vector<int> blocks(2);
+        blocks[0] = 1;
+        blocks[1] = 2;
+        mh.specifyParameterBlocks(blocks);
+        mh.useFastSlowSampling(1, 3);
+    }
+    if(i == 6)
+        mh.useSpeculativeEvaluation(3);
+    if(i == 7)
+        mh.setCommunicationProtocol(Math::MetropolisHastings::COLLECTIVE);
+    if(i == 10)
+        mh.usePrecisionSchedule(50);
+    if(i == 11)
+        mh.setStartingCovariance("test_files/mcmc_fast_test_11.covmat");
+
+    if(i == 8)
+        return mh.run(1000000, 0, burnin, Math::MetropolisHastings::EFFECTIVE_SAMPLE_SIZE, 3000, true);
+
+    if(i == 9)
+    {
+        // the resume slots of the shared file are written too
+        mh.setChainFormat(Math::MetropolisHastings::SHARED_BINARY_CHAIN, 50);
+        return mh.run(1000000, 10, burnin, Math::MetropolisHastings::GELMAN_RUBIN, 0.001, true);
+    }
+
+    if(i == 12)
+    {
+        // the pending rows are kept in the resume information
+        mh.setWeightedOutput();
+        return mh.run(1000000, 10, burnin, Math::MetropolisHastings::GELMAN_RUBIN, 0.001, true);
+    }
+
+    return mh.run(1000000, 0, burnin, Math::MetropolisHastings::GELMAN_RUBIN, 0.001, true);
+}
+
+} // namespace
 
 void
 TestMCMCFast::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 1, "invalid index " << i);
+    check(i >= 0 && i < 13, "invalid index " << i);
     
     using namespace Math;
 
-    MCMCFastTestLikelihood l1(5, -4, 2, 3);
-    MCMCFastTestLikelihood l2(5, -4, 2, 3);
     std::stringstream root1;
     root1 << "test_files/mcmc_fast_test_" << i;
-    MetropolisHastings mh1(2, l1, root1.str());
 
-    const double xMin = -20, xMax = 20, yMin = -20, yMax = 20;
-    mh1.setParam(0, "x", xMin, xMax, 0, 2, 0.5, 0.1);
-    mh1.setParam(1, "y", yMin, yMax, 0, 2, 0.5, 0.1);
     const unsigned long burnin = 100;
     const unsigned int thin = 2;
 
-    const int nChains = mh1.run(1000000, 0, burnin, MetropolisHastings::GELMAN_RUBIN, 0.001, true);
+    if(i == 9 || i == 12)
+    {
+        // not resuming from the previous test run
+        if(isMaster())
+        {
+            std::remove((root1.str() + "resume.dat").c_str());
+            std::remove((root1.str() + "resume_0.dat").c_str());
+            std::remove((root1.str() + "resume_shared.dat").c_str());
+        }
+        CosmoMPI::create().barrier();
+    }
+
+    if(i == 11)
+    {
+        // the starting covariance has the parameters in a different order and an extra one
+        if(isMaster())
+        {
+            std::ofstream outCov("test_files/mcmc_fast_test_11.covmat");
+            outCov << "# y z x" << std::endl;
+            outCov << "9 0 0.1" << std::endl;
+            outCov << "0 1 0" << std::endl;
+            outCov << "0.1 0 4" << std::endl;
+        }
+        CosmoMPI::create().barrier();
+    }
+
+    int nChains = 0;
+    unsigned long lowCount = 0, lowAfterSwitch = 0;
+    bool switched = false;
+    if(i == 4)
+    {
+#if defined(COSMO_OMP) && defined(COSMO_MPI)
+        const int nThreads = 2;
+#pragma omp parallel num_threads(nThreads)
+        {
+            MCMCFastTestLikelihood l(5, -4, 2, 3);
+            const int threadIndex = omp_get_thread_num();
+            MetropolisHastings mh(2, l, root1.str(), 0, false, nThreads, threadIndex);
+            const int n = runMCMCFastTestChain(mh, i, burnin);
+            if(threadIndex == 0)
+                nChains = n;
+        }
+#else
+        MCMCFastTestLikelihood l(5, -4, 2, 3);
+        MetropolisHastings mh(2, l, root1.str(), 0, false, 1, 0);
+        nChains = runMCMCFastTestChain(mh, i, burnin);
+#endif
+    }
+    else if(i == 10)
+    {
+        MCMCFastTestPrecisionLikelihood l(5, -4, 2, 3);
+        MetropolisHastings mh(2, l, root1.str());
+        nChains = runMCMCFastTestChain(mh, i, burnin);
+        lowCount = l.lowCount();
+        lowAfterSwitch = l.lowAfterSwitch();
+        switched = l.switched();
+    }
+    else
+    {
+        MCMCFastTestLikelihood l1(5, -4, 2, 3);
+        MCMCFastTestApproxLikelihood l2(5, -4, 2, 3);
+        MetropolisHastings mh1(2, (i == 3 ? static_cast<LikelihoodFunction&>(l2) : static_cast<LikelihoodFunction&>(l1)), root1.str());
+        nChains = runMCMCFastTestChain(mh1, i, burnin);
+    }
 
-    subTestName = std::string("2_param_gauss");
+    switch(i)
+    {
+    case 0:
+        subTestName = std::string("2_param_gauss");
+        break;
+    case 1:
+        subTestName = std::string("2_param_gauss_multiple_try");
+        break;
+    case 2:
+        subTestName = std::string("2_param_gauss_binary_chain");
+        break;
+    case 3:
+        subTestName = std::string("2_param_gauss_delayed_acceptance");
+        break;
+    case 4:
+        subTestName = std::string("2_param_gauss_threaded");
+        break;
+    case 5:
+        subTestName = std::string("2_param_gauss_fast_slow");
+        break;
+    case 6:
+        subTestName = std::string("2_param_gauss_speculative");
+        break;
+    case 7:
+        subTestName = std::string("2_param_gauss_collective");
+        break;
+    case 8:
+        subTestName = std::string("2_param_gauss_effective_sample_size");
+        break;
+    case 9:
+        subTestName = std::string("2_param_gauss_shared_chain");
+        break;
+    case 10:
+        subTestName = std::string("2_param_gauss_precision_schedule");
+        break;
+    case 11:
+        subTestName = std::string("2_param_gauss_warm_start");
+        break;
+    case 12:
+        subTestName = std::string("2_param_gauss_weighted_chain");
+        break;
+    default:
+        check(false, "");
+        break;
+    }
 
     res = 1;
     expected = 1;
@@ -72,9 +303,32 @@ TestMCMCFast::runSubTest(unsigned int i, double& res, double& expected, std::str
     if(!isMaster())
         return;
 
-    MarkovChain chain(nChains, root1.str().c_str(), burnin, thin);
-    Posterior1D* px = chain.posterior(0);
-    Posterior1D* py = chain.posterior(1);
+    MarkovChain chain(nChains, root1.str().c_str(), burnin, thin, NULL, i == 12);
+    Posterior1D* px;
+    Posterior1D* py;
+    if(i == 1)
+    {
+        std::vector<int> indices1D(2);
+        indices1D[0] = 0;
+        indices1D[1] = 1;
+        std::vector<std::pair<int, int> > indices2D(1, std::make_pair(0, 1));
+        std::vector<Posterior1D*> posts1D;
+        std::vector<Posterior2D*> posts2D;
+        chain.posteriors(indices1D, indices2D, posts1D, posts2D);
+        px = posts1D[0];
+        py = posts1D[1];
+        delete posts2D[0];
+    }
+    else if(i == 2)
+    {
+        px = chain.posterior(0, Posterior1D::BINNED_GAUSSIAN_SMOOTHING);
+        py = chain.posterior(1, Posterior1D::BINNED_GAUSSIAN_SMOOTHING);
+    }
+    else
+    {
+        px = chain.posterior(0);
+        py = chain.posterior(1);
+    }
 
     const int nPoints = 1000;
 
@@ -115,6 +369,91 @@ TestMCMCFast::runSubTest(unsigned int i, double& res, double& expected, std::str
     delete px;
     delete py;
 
+    if(i == 10)
+    {
+        // the burnin starts with the low precision, and everything after the switch is at full precision
+        if(lowCount == 0 || !switched || lowAfterSwitch != 0)
+        {
+            output_screen("FAIL: The low precision has been used for " << lowCount << " evaluations, " << lowAfterSwitch << " of them after the switch, the switch " << (switched ? "has" : "has not") << " happened." << std::endl);
+            res = 0;
+        }
+    }
+
+    if(i == 3)
+    {
+        // the evaluation log has one row for each chain element, the first stage evaluations are approximate
+        std::stringstream chainFileName, evalFileName;
+        chainFileName << root1.str() << (nChains > 1 ? "_0" : "") << ".txt";
+        evalFileName << root1.str() << "_evaluations" << (nChains > 1 ? "_0" : "") << ".txt";
+        std::ifstream inChain(chainFileName.str().c_str()), inEval(evalFileName.str().c_str());
+        std::string line;
+        unsigned long chainRows = 0, evalRows = 0, evaluations = 0, approximate = 0;
+        while(std::getline(inChain, line))
+            ++chainRows;
+        double seconds;
+        int count, approx, retries;
+        while(inEval >> seconds >> count >> approx >> retries)
+        {
+            ++evalRows;
+            evaluations += count;
+            approximate += approx;
+        }
+
+        if(evalRows != chainRows || approximate == 0 || evaluations <= approximate)
+        {
+            output_screen("FAIL: The evaluation log has " << evalRows << " rows for " << chainRows << " chain elements, with " << evaluations << " evaluations, " << approximate << " of them approximate." << std::endl);
+            res = 0;
+        }
+    }
+
+    if(i == 12)
+    {
+        // each state is written once with its multiplicity, and the burnin and the thinning count the steps
+        unsigned long merged = 0;
+        for(int j = 0; j < nChains; ++j)
+        {
+            std::stringstream chainFileName;
+            chainFileName << root1.str();
+            if(nChains > 1)
+                chainFileName << '_' << j;
+            chainFileName << ".txt";
+            std::ifstream in(chainFileName.str().c_str());
+            std::vector<double> row(4), prevRow(4, 0);
+            unsigned long rows = 0, steps = 0;
+            while(in >> row[0] >> row[1] >> row[2] >> row[3])
+            {
+                if(row[0] < 1 || row[0] != std::floor(row[0]) || (rows > 0 && row == prevRow))
+                {
+                    output_screen("FAIL: Row " << rows << " of the weighted chain " << j << " has weight " << row[0] << ", or repeats the previous row." << std::endl);
+                    res = 0;
+                    break;
+                }
+                if(row[0] > 1)
+                    ++merged;
+                steps += (unsigned long)(row[0]);
+                prevRow = row;
+                ++rows;
+            }
+
+            MarkovChain single(chainFileName.str().c_str(), burnin, thin, NULL, 1, true);
+            double total = 0;
+            for(unsigned long k = 0; k < single.size(); ++k)
+                total += single.prob(k);
+            const unsigned long expectedTotal = (steps > burnin ? (steps - burnin + thin - 1) / thin : 0);
+            if(total != double(expectedTotal))
+            {
+                output_screen("FAIL: The weighted chain " << j << " has " << steps << " steps, after the burnin and the thinning the total weight is " << total << ", expected " << expectedTotal << "." << std::endl);
+                res = 0;
+            }
+        }
+
+        if(merged == 0)
+        {
+            output_screen("FAIL: No rejected steps have been merged in the weighted chains." << std::endl);
+            res = 0;
+        }
+    }
+
     if(!Math::areEqual(5.0, xMedian, 0.4))
     {
         output_screen("FAIL: Expected x median is 5, the result is " << xMedian << std::endl);
@@ -146,4 +485,124 @@ TestMCMCFast::runSubTest(unsigned int i, double& res, double& expected, std::str
         output_screen("FAIL: Expected y upper limit is -1, the result is " << yUpper << std::endl);
         res = 0;
     }
+
+    if(i == 8)
+    {
+        // the run stops when the effective sample size reaches 3000, the post-processing estimate from the thinned chain should be of the same order
+        std::vector<double> ess, tau;
+        chain.effectiveSampleSizes(ess, &tau);
+        for(int j = 0; j < 2; ++j)
+        {
+            if(ess[j] < 1500 || ess[j] > 20000 || tau[j] < 1)
+            {
+                output_screen("FAIL: The effective sample size of parameter " << j << " is " << ess[j] << " (autocorrelation time " << tau[j] << "), expected about 3000." << std::endl);
+                res = 0;
+            }
+            if(!Math::areEqual(ess[j], chain.effectiveSampleSize(j), 1e-10))
+            {
+                output_screen("FAIL: The effective sample size of parameter " << j << " is different when calculated alone." << std::endl);
+                res = 0;
+            }
+        }
+
+        // an AR(1) series x_t = phi x_{t-1} + noise has tau = (1 + phi) / (1 - phi)
+        const double phi = 0.9;
+        const unsigned long n = 200000;
+        Math::GaussianGenerator gen(12345, 0, 1);
+        std::vector<double> x(n);
+        x[0] = gen.generate();
+        for(unsigned long j = 1; j < n; ++j)
+            x[j] = phi * x[j - 1] + gen.generate();
+        const double arTau = Math::integratedAutocorrelationTime(&(x[0]), n);
+        if(!Math::areEqual((1 + phi) / (1 - phi), arTau, 0.15))
+        {
+            output_screen("FAIL: The autocorrelation time of the AR(1) series is " << arTau << ", expected " << (1 + phi) / (1 - phi) << "." << std::endl);
+            res = 0;
+        }
+    }
+
+    if(i == 9)
+    {
+        // all of the chains are in one file, reading it as a single file gives the same chain
+        const std::string sharedFileName = root1.str() + ".bin";
+        std::stringstream chain0FileName;
+        chain0FileName << root1.str() << "_0.bin";
+        std::ifstream chain0In(chain0FileName.str().c_str());
+        if(!SharedBinaryChain::isShared(sharedFileName.c_str()) || chain0In)
+        {
+            output_screen("FAIL: The chains should be written into the shared file " << sharedFileName << " only." << std::endl);
+            res = 0;
+        }
+        else
+        {
+            MappedSharedBinaryChain mapped(sharedFileName.c_str());
+            if(mapped.nChains() != nChains || mapped.nParams() != 2 || mapped.paramNames()[1] != "y")
+            {
+                output_screen("FAIL: The shared file has " << mapped.nChains() << " chains and " << mapped.nParams() << " parameters, expected " << nChains << " and 2." << std::endl);
+                res = 0;
+            }
+            for(int j = 0; j < mapped.nChains(); ++j)
+            {
+                if(mapped.chainSize(j) <= burnin)
+                {
+                    output_screen("FAIL: Chain " << j << " in the shared file has only " << mapped.chainSize(j) << " elements." << std::endl);
+                    res = 0;
+                }
+            }
+
+            MarkovChain single(sharedFileName.c_str(), burnin, thin);
+            if(single.size() != chain.size() || !Math::areEqual(single.maxLike(), chain.maxLike(), 1e-12))
+            {
+                output_screen("FAIL: Reading the shared file as one file gives " << single.size() << " elements, as " << nChains << " chains " << chain.size() << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+
+    if(i != 0)
+        return;
+
+    // the streaming analysis of the same files should agree with the full chain
+    std::vector<std::string> fileNames;
+    for(int j = 0; j < nChains; ++j)
+    {
+        std::stringstream fileName;
+        fileName << root1.str();
+        if(nChains > 1)
+            fileName << '_' << j;
+        fileName << ".txt";
+        fileNames.push_back(fileName.str());
+    }
+
+    std::vector<double> mins, maxs;
+    const int nParams = StreamingChain::findRanges(fileNames, mins, maxs, burnin, thin);
+    StreamingChain streaming(nParams, mins, maxs, 200, std::vector<std::pair<int, int> >(1, std::make_pair(0, 1)));
+    for(int j = 0; j < fileNames.size(); ++j)
+        streaming.addFile(fileNames[j].c_str(), burnin, thin);
+
+    Posterior1D* sx = streaming.posterior(0);
+    const double sxMedian = sx->median();
+    delete sx;
+    delete streaming.posterior(0, 1);
+
+    if(!Math::areEqual(xMedian, sxMedian, 0.02))
+    {
+        output_screen("FAIL: The streaming x median is " << sxMedian << ", expected " << xMedian << std::endl);
+        res = 0;
+    }
+    if(!Math::areEqual(xMedian, streaming.quantile(0, 0.5), 0.02))
+    {
+        output_screen("FAIL: The streaming x median quantile is " << streaming.quantile(0, 0.5) << ", expected " << xMedian << std::endl);
+        res = 0;
+    }
+    if(!Math::areEqual(yLower, streaming.quantile(1, (1.0 - 0.683) / 2), 0.03))
+    {
+        output_screen("FAIL: The streaming y lower limit is " << streaming.quantile(1, (1.0 - 0.683) / 2) << ", expected " << yLower << std::endl);
+        res = 0;
+    }
+    if(!Math::areEqual(4.0, streaming.covariance(0, 0), 0.2))
+    {
+        output_screen("FAIL: The streaming x variance is " << streaming.covariance(0, 0) << ", expected 4" << std::endl);
+        res = 0;
+    }
 }
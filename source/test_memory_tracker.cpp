@@ -0,0 +1,135 @@
+#include <string>
+#include <vector>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <memory_tracker.hpp>
+#include <whole_matrix.hpp>
+#include <kd_tree.hpp>
+#include <random.hpp>
+#include <test_memory_tracker.hpp>
+
+std::string
+TestMemoryTracker::name() const
+{
+    return std::string("MEMORY TRACKER TESTER");
+}
+
+unsigned int
+TestMemoryTracker::numberOfSubtests() const
+{
+    return 3;
+}
+
+void
+TestMemoryTracker::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    MemoryTracker& tracker = MemoryTracker::instance();
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("whole_matrix");
+        const long before = tracker.current(MemoryTracker::WHOLE_MATRIX);
+        const unsigned long estimate = WholeMatrix::memoryEstimate(2, 40, 5);
+        {
+            WholeMatrix m(2, 40, 5);
+            const long used = tracker.current(MemoryTracker::WHOLE_MATRIX) - before;
+            if(used != long(estimate))
+            {
+                output_screen("FAIL: the whole matrix uses " << used << " bytes, the estimate is " << estimate << "." << std::endl);
+                res = 0;
+            }
+
+            // a copy is counted separately
+            WholeMatrix copy(m);
+            if(tracker.current(MemoryTracker::WHOLE_MATRIX) - before != 2 * used)
+            {
+                output_screen("FAIL: the copy of the whole matrix is not counted." << std::endl);
+                res = 0;
+            }
+            if(tracker.peak(MemoryTracker::WHOLE_MATRIX) < before + 2 * used)
+            {
+                output_screen("FAIL: the peak " << tracker.peak(MemoryTracker::WHOLE_MATRIX) << " is too small." << std::endl);
+                res = 0;
+            }
+        }
+        if(tracker.current(MemoryTracker::WHOLE_MATRIX) != before)
+        {
+            output_screen("FAIL: the memory of the whole matrices is not released." << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("kd_tree");
+        const int dim = 3;
+        const unsigned long n = 1000;
+        Math::UniformRealGenerator gen(100, -1, 1);
+        std::vector<std::vector<double> > points(n, std::vector<double>(dim));
+        for(unsigned long j = 0; j < n; ++j)
+            for(int k = 0; k < dim; ++k)
+                points[j][k] = gen.generate();
+
+        const long before = tracker.current(MemoryTracker::KD_TREE);
+        {
+            KDTree tree(dim, points);
+            const long used = tracker.current(MemoryTracker::KD_TREE) - before;
+            if(used != long(KDTree::memoryEstimate(dim, n)))
+            {
+                output_screen("FAIL: the kd tree uses " << used << " bytes, the estimate is " << KDTree::memoryEstimate(dim, n) << "." << std::endl);
+                res = 0;
+            }
+
+            for(unsigned long j = 0; j < 100; ++j)
+                tree.insert(points[j]);
+            if(tracker.current(MemoryTracker::KD_TREE) - before < long(KDTree::memoryEstimate(dim, n + 100)))
+            {
+                output_screen("FAIL: the insertions are not counted." << std::endl);
+                res = 0;
+            }
+        }
+        if(tracker.current(MemoryTracker::KD_TREE) != before)
+        {
+            output_screen("FAIL: the memory of the kd tree is not released." << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 2:
+    {
+        subTestName = std::string("report");
+        CosmoMPI& mpi = CosmoMPI::create();
+
+        // only the second process has a matrix, the report should still show it
+        WholeMatrix* m = (mpi.processId() == mpi.numProcesses() - 1 ? new WholeMatrix(0, 30) : NULL);
+        const std::string r = tracker.report();
+        delete m;
+
+        if(mpi.isMaster())
+        {
+            if(r.find("whole_matrix") == std::string::npos || r.find("total") == std::string::npos || r.find("process resident") == std::string::npos)
+            {
+                output_screen("FAIL: the report is incomplete:" << std::endl << r);
+                res = 0;
+            }
+        }
+        else if(!r.empty())
+        {
+            output_screen("FAIL: the report should only be given to the master process." << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
@@ -0,0 +1,163 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <matrix_impl.hpp>
+#include <mixed_precision_cholesky.hpp>
+#include <test_mixed_precision_cholesky.hpp>
+
+std::string
+TestMixedPrecisionCholesky::name() const
+{
+    return std::string("MIXED PRECISION CHOLESKY TESTER");
+}
+
+unsigned int
+TestMixedPrecisionCholesky::numberOfSubtests() const
+{
+    return 3;
+}
+
+void
+TestMixedPrecisionCholesky::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        return;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        return;
+    case 2:
+        runSubTest2(res, expected, subTestName);
+        return;
+    default:
+        check(false, "");
+        return;
+    }
+}
+
+namespace
+{
+
+// the Kac-Murdock-Szego matrix rho^|i - j|, its condition number is close to ((1 + rho) / (1 - rho))^2, about 4e4 here
+// the single precision factor alone only gives a few correct digits of the solution, so the iterative refinement has to do the rest, but it still converges
+const double testRho = 0.99;
+
+void
+fillTestMatrix(Math::SymmetricMatrix<double>& mat)
+{
+    for(int i = 0; i < mat.rows(); ++i)
+        for(int j = 0; j <= i; ++j)
+            mat(i, j) = std::pow(testRho, i - j);
+}
+
+const int testSize = 300;
+
+// the determinant of the Kac-Murdock-Szego matrix is (1 - rho^2)^(n - 1)
+const double testLogDet = (testSize - 1) * std::log(1 - testRho * testRho);
+
+} // namespace
+
+void
+TestMixedPrecisionCholesky::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    Math::SymmetricMatrix<double> mat(testSize, testSize);
+    fillTestMatrix(mat);
+
+    const int nRhs = 2;
+    std::vector<double> b(testSize * nRhs);
+    for(int i = 0; i < testSize; ++i)
+    {
+        b[i] = std::sin(0.3 * i);
+        b[testSize + i] = 1.0;
+    }
+
+    Math::MixedPrecisionCholesky mixed(mat);
+    const int info = mixed.factorize();
+    check(info == 0, "factorization failed, info = " << info);
+    std::vector<double> x = b;
+    const int info1 = mixed.solve(x, nRhs);
+    check(info1 == 0, "solution failed, info = " << info1);
+    check(mixed.isSinglePrecision(), "should not have switched to double precision");
+
+    // the double precision solution, through the inverse
+    Math::SymmetricMatrix<double> inv = mat;
+    inv.invert();
+    double maxDiff = 0, maxX = 0;
+    for(int k = 0; k < nRhs; ++k)
+    {
+        for(int i = 0; i < testSize; ++i)
+        {
+            double y = 0;
+            for(int j = 0; j < testSize; ++j)
+                y += inv(i, j) * b[k * testSize + j];
+            maxDiff = std::max(maxDiff, std::abs(y - x[k * testSize + i]));
+            maxX = std::max(maxX, std::abs(y));
+        }
+    }
+
+    res = maxDiff / maxX;
+    expected = 0;
+    subTestName = "solve";
+}
+
+void
+TestMixedPrecisionCholesky::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    Math::SymmetricMatrix<double> mat(testSize, testSize);
+    fillTestMatrix(mat);
+
+    Math::MixedPrecisionCholesky mixed(mat);
+    const int info = mixed.factorize();
+    check(info == 0, "factorization failed, info = " << info);
+    const double logDet = mixed.logDet();
+
+    const double logDetDouble = testLogDet;
+
+    // the log determinant only has single precision accuracy
+    res = 1;
+    expected = 1;
+    if(std::abs(logDet - logDetDouble) > 1e-5 * std::abs(logDetDouble))
+    {
+        output_screen("FAIL: log det = " << logDet << ", expected " << logDetDouble << std::endl);
+        res = 0;
+    }
+    subTestName = "log_det";
+}
+
+void
+TestMixedPrecisionCholesky::runSubTest2(double& res, double& expected, std::string& subTestName)
+{
+    // the Hilbert matrix is too ill conditioned for single precision
+    const int n = 8;
+    Math::SymmetricMatrix<double> mat(n, n);
+    for(int i = 0; i < n; ++i)
+        for(int j = 0; j <= i; ++j)
+            mat(i, j) = 1.0 / (i + j + 1);
+
+    std::vector<double> b(n, 1.0);
+    Math::MixedPrecisionCholesky mixed(mat);
+    mixed.factorize();
+    std::vector<double> x = b;
+    const int info = mixed.solve(x);
+    check(info == 0, "solution failed, info = " << info);
+    check(!mixed.isSinglePrecision(), "should have switched to double precision");
+
+    double maxDiff = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        double y = 0;
+        for(int j = 0; j < n; ++j)
+            y += mat(i, j) * x[j];
+        maxDiff = std::max(maxDiff, std::abs(y - b[i]));
+    }
+
+    res = maxDiff;
+    expected = 0;
+    subTestName = "double_fallback";
+}
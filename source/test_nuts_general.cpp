@@ -0,0 +1,185 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <test_nuts_general.hpp>
+#include <nuts_general.hpp>
+#include <lbfgs.hpp>
+#include <random.hpp>
+
+std::string
+TestNUTSGeneral::name() const
+{
+    return std::string("NUTS GENERAL TESTER");
+}
+
+unsigned int
+TestNUTSGeneral::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// -2ln(like) of a gaussian with very different widths in different directions
+class NUTSTestFunc
+{
+public:
+    NUTSTestFunc(int n) : mean_(n), sigma_(n), x_(n)
+    {
+        for(int i = 0; i < n; ++i)
+        {
+            mean_[i] = double(i) / 4;
+            sigma_[i] = std::pow(10.0, 2.0 * i / (n - 1) - 1);
+        }
+    }
+
+    void set(const Math::BasicLargeVector& x) { x_ = x.contents(); }
+
+    double value()
+    {
+        double res = 0;
+        for(int i = 0; i < x_.size(); ++i)
+            res += (x_[i] - mean_[i]) * (x_[i] - mean_[i]) / (sigma_[i] * sigma_[i]);
+        return res;
+    }
+
+    void derivative(Math::BasicLargeVector *res)
+    {
+        for(int i = 0; i < x_.size(); ++i)
+            res->contents()[i] = 2 * (x_[i] - mean_[i]) / (sigma_[i] * sigma_[i]);
+    }
+
+    void whitenoise(int seed, Math::BasicLargeVector* x, double amplitude)
+    {
+        Math::GaussianGenerator g(seed, 0, 1);
+        for(int i = 0; i < x->contents().size(); ++i)
+            x->contents()[i] = amplitude * g.generate();
+    }
+
+    const std::vector<double>& mean() const { return mean_; }
+    const std::vector<double>& sigma() const { return sigma_; }
+
+private:
+    std::vector<double> mean_, sigma_, x_;
+};
+
+class NUTSTestCallback
+{
+public:
+    NUTSTestCallback(int n) : n_(0), sum_(n, 0), sum2_(n, 0) {}
+
+    void operator()(const Math::BasicLargeVector& v, double like)
+    {
+        const std::vector<double>& x = v.contents();
+        for(int i = 0; i < x.size(); ++i)
+        {
+            sum_[i] += x[i];
+            sum2_[i] += x[i] * x[i];
+        }
+        ++n_;
+    }
+
+    double mean(int i) const { return sum_[i] / n_; }
+    double sigma(int i) const { return std::sqrt(sum2_[i] / n_ - mean(i) * mean(i)); }
+
+private:
+    int n_;
+    std::vector<double> sum_, sum2_;
+};
+
+} // namespace
+
+void
+TestNUTSGeneral::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    using namespace Math;
+
+    const int n = 20;
+    NUTSTestFunc f(n);
+    BasicLargeVectorFactory factory(n);
+    BasicLargeVector starting(n), masses(n);
+    for(int j = 0; j < n; ++j)
+    {
+        starting.contents()[j] = 0;
+        masses.contents()[j] = 1;
+    }
+
+    NUTSGeneral<BasicLargeVector, BasicLargeVectorFactory, NUTSTestFunc> nuts(&factory, &f, starting, masses, 0, 10, 100);
+    NUTSTestCallback cb(n);
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("moments");
+        nuts.run(1000, 4000, &cb);
+        for(int j = 0; j < n; ++j)
+        {
+            if(std::abs(cb.mean(j) - f.mean()[j]) > 0.1 * f.sigma()[j])
+            {
+                output_screen("FAIL: the mean of parameter " << j << " is " << cb.mean(j) << ", expected " << f.mean()[j] << std::endl);
+                res = 0;
+            }
+            if(std::abs(cb.sigma(j) / f.sigma()[j] - 1) > 0.1)
+            {
+                output_screen("FAIL: the sigma of parameter " << j << " is " << cb.sigma(j) << ", expected " << f.sigma()[j] << std::endl);
+                res = 0;
+            }
+        }
+        if(std::abs(nuts.acceptanceStatistic() - 0.8) > 0.1)
+        {
+            output_screen("FAIL: the mean acceptance statistic is " << nuts.acceptanceStatistic() << ", the target is 0.8" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("masses");
+        nuts.run(1000, 10, &cb);
+        BasicLargeVector m(n);
+        nuts.getMasses(&m);
+        for(int j = 0; j < n; ++j)
+        {
+            // the masses should approach the inverse variances
+            const double ratio = m.contents()[j] * f.sigma()[j] * f.sigma()[j];
+            if(ratio < 0.6 || ratio > 1.6)
+            {
+                output_screen("FAIL: the mass of parameter " << j << " is " << m.contents()[j] << ", expected about " << 1.0 / (f.sigma()[j] * f.sigma()[j]) << std::endl);
+                res = 0;
+            }
+        }
+    }
+        break;
+    case 2:
+    {
+        subTestName = std::string("fewer_steps");
+        nuts.run(1000, 500, &cb);
+        const double adaptedSteps = nuts.meanSteps();
+
+        NUTSGeneral<BasicLargeVector, BasicLargeVectorFactory, NUTSTestFunc> nutsFixed(&factory, &f, starting, masses, 0, 10, 100);
+        nutsFixed.setMassAdaptation(false);
+        NUTSTestCallback cbFixed(n);
+        nutsFixed.run(1000, 500, &cbFixed);
+        const double fixedSteps = nutsFixed.meanSteps();
+
+        // the widths differ by a factor of 100, the adapted masses should save most of the steps
+        if(adaptedSteps * 4 > fixedSteps)
+        {
+            output_screen("FAIL: " << adaptedSteps << " steps per sample with the mass adaptation, " << fixedSteps << " without it" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
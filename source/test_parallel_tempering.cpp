@@ -0,0 +1,112 @@
+#include <string>
+#include <cmath>
+
+#include <cosmo_mpi.hpp>
+#include <test_parallel_tempering.hpp>
+#include <parallel_tempering.hpp>
+#include <markov_chain.hpp>
+#include <numerics.hpp>
+
+std::string
+TestParallelTempering::name() const
+{
+    return std::string("PARALLEL TEMPERING TESTER");
+}
+
+unsigned int
+TestParallelTempering::numberOfSubtests() const
+{
+    return 1;
+}
+
+namespace
+{
+
+// two well separated modes of equal weight in x, a gaussian in y
+class ParallelTemperingTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    ParallelTemperingTestLikelihood(double x0, double sigmaX) : x0_(x0), sigmaX_(sigmaX) {}
+
+    virtual double calculate(double* params, int nParams)
+    {
+        check(nParams == 2, "");
+        const double x = params[0], y = params[1];
+        const double d1 = (x - x0_) / sigmaX_, d2 = (x + x0_) / sigmaX_;
+        const double like = std::exp(-d1 * d1 / 2) + std::exp(-d2 * d2 / 2);
+        return -2 * std::log(like) + y * y;
+    }
+
+private:
+    const double x0_, sigmaX_;
+};
+
+} // namespace
+
+void
+TestParallelTempering::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i == 0, "invalid index " << i);
+
+    using namespace Math;
+
+    subTestName = std::string("bimodal");
+    res = 1;
+    expected = 1;
+
+    // the barrier between the modes is 32 in -2ln(likelihood), the single temperature sampler practically never crosses it
+    ParallelTemperingTestLikelihood like(4, 0.5);
+
+    const int nProcesses = CosmoMPI::create().numProcesses();
+    const int nTemps = (4 % nProcesses == 0 || nProcesses % 4 == 0) ? 4 : 4 * nProcesses;
+
+    const std::string root = "test_files/parallel_tempering_test";
+    ParallelTempering pt(2, like, root, nTemps, 100);
+    pt.setParam(0, "x", -10, 10, 4, 0.1, 0.5);
+    pt.setParam(1, "y", -5, 5, 0, 0.1, 0.5);
+
+    const unsigned long burnin = 1000;
+    const int nChains = pt.run(40000, 2, 0);
+
+    if(!isMaster())
+        return;
+
+    MarkovChain chain(nChains, root.c_str(), burnin);
+
+    double total = 0, positive = 0, absSum = 0;
+    for(unsigned long j = 0; j < chain.size(); ++j)
+    {
+        const double p = chain.prob(j);
+        const double x = chain.param(j, 0);
+        total += p;
+        if(x > 0)
+            positive += p;
+        absSum += p * std::abs(x);
+    }
+
+    const double fraction = positive / total;
+    const double absMean = absSum / total;
+
+    if(!Math::areEqual(0.5, fraction, 0.2))
+    {
+        output_screen("FAIL: Expected the fraction of the samples in the positive mode to be 0.5, the result is " << fraction << std::endl);
+        res = 0;
+    }
+
+    if(!Math::areEqual(4.0, absMean, 0.05))
+    {
+        output_screen("FAIL: Expected the mean of |x| to be 4, the result is " << absMean << std::endl);
+        res = 0;
+    }
+
+    Posterior1D* py = chain.posterior(1);
+    const double yMedian = py->median();
+    delete py;
+
+    if(std::abs(yMedian) > 0.1)
+    {
+        output_screen("FAIL: Expected y median is 0, the result is " << yMedian << std::endl);
+        res = 0;
+    }
+}
+
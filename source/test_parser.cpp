@@ -1,3 +1,5 @@
+#include <sstream>
+
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <parser.hpp>
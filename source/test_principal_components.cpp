@@ -0,0 +1,145 @@
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <macros.hpp>
+#include <random.hpp>
+#include <principal_components.hpp>
+#include <test_principal_components.hpp>
+
+std::string
+TestPrincipalComponents::name() const
+{
+    return std::string("PRINCIPAL COMPONENTS TESTER");
+}
+
+unsigned int
+TestPrincipalComponents::numberOfSubtests() const
+{
+    return 2;
+}
+
+void
+TestPrincipalComponents::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        return;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        return;
+    default:
+        check(false, "");
+        return;
+    }
+}
+
+namespace
+{
+
+// vectors of dimension dim that depend on 3 parameters only, with components of very different magnitudes
+void
+generatePCASamples(int n, int dim, std::vector<double>& samples)
+{
+    Math::UniformRealGenerator gen(123, -1, 1);
+    samples.resize(n * dim);
+    for(int i = 0; i < n; ++i)
+    {
+        const double a = gen.generate(), b = gen.generate(), c = gen.generate();
+        for(int j = 0; j < dim; ++j)
+        {
+            const double x = double(j) / dim;
+            samples[i * dim + j] = std::pow(10.0, 3 * x) * (2 + a * std::sin(5 * x) + b * x * x + c * std::cos(x));
+        }
+    }
+}
+
+} // namespace
+
+void
+TestPrincipalComponents::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    const int n = 200, dim = 500;
+    std::vector<double> samples;
+    generatePCASamples(n, dim, samples);
+
+    PrincipalComponents pca;
+    pca.learn(&(samples[0]), n, dim, 1e-10);
+
+    res = 1;
+    expected = 1;
+    subTestName = "low_rank";
+
+    if(pca.nComponents() != 3)
+    {
+        output_screen("FAIL: expected 3 components, got " << pca.nComponents() << "." << std::endl);
+        res = 0;
+        return;
+    }
+
+    std::vector<double> c(pca.nComponents()), x(dim);
+    double maxError = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        pca.compress(&(samples[i * dim]), &(c[0]));
+        pca.decompress(&(c[0]), &(x[0]));
+        for(int j = 0; j < dim; ++j)
+            maxError = std::max(maxError, std::abs(x[j] - samples[i * dim + j]) / std::abs(samples[i * dim + j]));
+    }
+
+    if(maxError > 1e-8)
+    {
+        output_screen("FAIL: the maximum relative reconstruction error is " << maxError << "." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestPrincipalComponents::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    const int n = 100, dim = 300;
+    std::vector<double> samples;
+    generatePCASamples(n, dim, samples);
+
+    PrincipalComponents pca;
+    pca.learn(&(samples[0]), n, dim, 1e-10, 2);
+
+    const char* fileName = "test_files/pca_test.dat";
+    pca.writeIntoFile(fileName);
+
+    PrincipalComponents pca1;
+    const bool success = pca1.readFromFile(fileName, dim);
+    std::remove(fileName);
+
+    res = 1;
+    expected = 1;
+    subTestName = "file";
+
+    if(!success || pca1.nComponents() != 2 || pca1.dim() != dim)
+    {
+        output_screen("FAIL: could not read the basis back from the file." << std::endl);
+        res = 0;
+        return;
+    }
+
+    std::vector<double> c(2), c1(2), x(dim), x1(dim);
+    pca.compress(&(samples[0]), &(c[0]));
+    pca1.compress(&(samples[0]), &(c1[0]));
+    pca.decompress(&(c[0]), &(x[0]));
+    pca1.decompress(&(c1[0]), &(x1[0]));
+
+    for(int j = 0; j < dim; ++j)
+    {
+        if(x[j] != x1[j])
+        {
+            output_screen("FAIL: the basis read from the file is different." << std::endl);
+            res = 0;
+            return;
+        }
+    }
+}
+
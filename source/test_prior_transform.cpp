@@ -0,0 +1,197 @@
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <test_prior_transform.hpp>
+#include <prior_transform.hpp>
+#include <math_constants.hpp>
+
+std::string
+TestPriorTransform::name() const
+{
+    return std::string("PRIOR TRANSFORM TESTER");
+}
+
+unsigned int
+TestPriorTransform::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// the density 1 + x, the inverse cumulative distribution on [0, 1] is sqrt(1 + 3u) - 1
+class LinearDensity : public Math::RealFunction
+{
+public:
+    virtual double evaluate(double x) const { return 1 + x; }
+};
+
+class GaussDensity : public Math::RealFunction
+{
+public:
+    GaussDensity(double mean, double sigma) : mean_(mean), sigma_(sigma) {}
+    virtual double evaluate(double x) const { return std::exp(-(x - mean_) * (x - mean_) / (2 * sigma_ * sigma_)); }
+
+private:
+    const double mean_, sigma_;
+};
+
+} // namespace
+
+void
+TestPriorTransform::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    using namespace Math;
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("closed_forms");
+        PriorTransform uniform, logUniform, gauss;
+        uniform.setUniform(-1, 3);
+        logUniform.setLogUniform(1e-3, 10);
+        gauss.setGauss(2, 0.5);
+
+        if(std::abs(uniform.transform(0.25)) > 1e-15 || std::abs(uniform.transform(1) - 3) > 1e-15)
+        {
+            output_screen("FAIL: the uniform transform gives " << uniform.transform(0.25) << " and " << uniform.transform(1) << ", expected 0 and 3" << std::endl);
+            res = 0;
+        }
+        if(std::abs(logUniform.transform(0.75) / 1.0 - 1) > 1e-12 || std::abs(logUniform.transform(0) / 1e-3 - 1) > 1e-12)
+        {
+            output_screen("FAIL: the log-uniform transform gives " << logUniform.transform(0.75) << " and " << logUniform.transform(0) << ", expected 1 and 0.001" << std::endl);
+            res = 0;
+        }
+
+        // the truncation at 10 sigma changes the probabilities by about 1e-23
+        const double p1 = 0.5 * std::erfc(-1 / std::sqrt(2.0));
+        if(std::abs(gauss.transform(0.5) - 2) > 1e-12 || std::abs(gauss.transform(p1) - 2.5) > 1e-12)
+        {
+            output_screen("FAIL: the gaussian transform gives " << gauss.transform(0.5) << " and " << gauss.transform(p1) << ", expected 2 and 2.5" << std::endl);
+            res = 0;
+        }
+        if(gauss.transform(0) != gauss.min() || gauss.transform(1) != gauss.max())
+        {
+            output_screen("FAIL: the gaussian transform gives " << gauss.transform(0) << " and " << gauss.transform(1) << " at the ends, expected " << gauss.min() << " and " << gauss.max() << std::endl);
+            res = 0;
+        }
+
+        const double ps[] = {1e-300, 1e-20, 1e-5, 0.01, 0.02425, 0.1, 0.3, 0.5, 0.7, 0.975, 0.99, 1 - 1e-10};
+        for(int j = 0; j < sizeof(ps) / sizeof(double); ++j)
+        {
+            const double x = inverseNormalCDF(ps[j]);
+            const double p = (x < 0 ? 0.5 * std::erfc(-x / std::sqrt(2.0)) : 1 - 0.5 * std::erfc(x / std::sqrt(2.0)));
+            const double q = std::min(ps[j], 1 - ps[j]);
+            if(std::abs(p - ps[j]) > 1e-13 * q)
+            {
+                output_screen("FAIL: the inverse normal CDF of " << ps[j] << " is " << x << ", which has the CDF " << p << std::endl);
+                res = 0;
+            }
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("table");
+        LinearDensity density;
+        PriorTransform linear, cubic;
+        linear.setGeneral(0, 1, density, false, 1000);
+        cubic.setGeneral(0, 1, density, true, 1000);
+
+        double linearError = 0, cubicError = 0, prev = -1;
+        bool monotonic = true;
+        const int n = 100000;
+        for(int j = 0; j <= n; ++j)
+        {
+            const double u = double(j) / n;
+            const double x = std::sqrt(1 + 3 * u) - 1;
+            linearError = std::max(linearError, std::abs(linear.transform(u) - x));
+            const double c = cubic.transform(u);
+            cubicError = std::max(cubicError, std::abs(c - x));
+            if(c < prev)
+                monotonic = false;
+            prev = c;
+        }
+
+        // the trapezoid integration is exact for a linear density, the errors are from the inversion and the interpolation
+        if(linearError > 5e-7 || cubicError > 5e-8 || cubicError * 5 > linearError)
+        {
+            output_screen("FAIL: the maximum errors are " << linearError << " with the linear and " << cubicError << " with the cubic interpolation" << std::endl);
+            res = 0;
+        }
+        if(!monotonic)
+        {
+            output_screen("FAIL: the cubic interpolation is not monotonic" << std::endl);
+            res = 0;
+        }
+
+        // a tabulated gaussian against the closed form
+        GaussDensity gaussDensity(1, 2);
+        PriorTransform table, gauss;
+        table.setGeneral(-19, 21, gaussDensity, true);
+        gauss.setGauss(1, 2);
+        for(int j = 1; j < 100; ++j)
+        {
+            const double u = j / 100.0;
+            if(std::abs(table.transform(u) - gauss.transform(u)) > 1e-5)
+            {
+                output_screen("FAIL: the tabulated gaussian gives " << table.transform(u) << " for u = " << u << ", the closed form gives " << gauss.transform(u) << std::endl);
+                res = 0;
+                break;
+            }
+        }
+    }
+        break;
+    case 2:
+    {
+        subTestName = std::string("batch");
+        LinearDensity density;
+        PriorTransform priors[4];
+        priors[0].setUniform(-1, 3);
+        priors[1].setLogUniform(1e-3, 10);
+        priors[2].setGauss(2, 0.5);
+        priors[3].setGeneral(0, 1, density, true, 1000);
+
+        const int n = 1001;
+        std::vector<double> u(n), x(n);
+        for(int j = 0; j < n; ++j)
+            u[j] = double(j) / (n - 1);
+
+        for(int k = 0; k < 4; ++k)
+        {
+            priors[k].transform(n, &(u[0]), &(x[0]));
+            for(int j = 0; j < n; ++j)
+            {
+                if(x[j] != priors[k].transform(u[j]))
+                {
+                    output_screen("FAIL: the batch transform of prior " << k << " gives " << x[j] << " for u = " << u[j] << ", the single one gives " << priors[k].transform(u[j]) << std::endl);
+                    res = 0;
+                    break;
+                }
+            }
+        }
+
+        // in place
+        std::vector<double> v = u;
+        priors[2].transform(n, &(v[0]), &(v[0]));
+        priors[2].transform(n, &(u[0]), &(x[0]));
+        if(v != x)
+        {
+            output_screen("FAIL: the in place batch transform is different" << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
@@ -0,0 +1,153 @@
+#include <cmath>
+#include <vector>
+#include <set>
+
+#include <unistd.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <process_likelihood_pool.hpp>
+#include <test_process_likelihood_pool.hpp>
+
+namespace
+{
+
+// keeps its state in a global, like the Fortran likelihoods, so it would give wrong results if evaluated from several threads
+double poolTestState = 0;
+
+// a gaussian likelihood that fails for negative x, or returns the process id if asked
+class PoolTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    PoolTestLikelihood(bool returnPid) : returnPid_(returnPid) {}
+
+    double calculate(double* params, int nParams)
+    {
+        check(params[0] >= 0, "negative x");
+        if(returnPid_)
+        {
+            usleep(2000);
+            return getpid();
+        }
+
+        poolTestState = 0;
+        for(int i = 0; i < nParams; ++i)
+            poolTestState += (params[i] - i) * (params[i] - i);
+        return poolTestState;
+    }
+
+    double calculateExact(double* params, int nParams) { return 2 * calculate(params, nParams); }
+
+private:
+    bool returnPid_;
+};
+
+class PoolTestFactory : public Math::LikelihoodFactory
+{
+public:
+    PoolTestFactory(bool returnPid) : returnPid_(returnPid) {}
+
+    Math::LikelihoodFunction* create(int worker) { return new PoolTestLikelihood(returnPid_); }
+
+private:
+    bool returnPid_;
+};
+
+} // namespace
+
+std::string
+TestProcessLikelihoodPool::name() const
+{
+    return std::string("PROCESS LIKELIHOOD POOL TESTER");
+}
+
+unsigned int
+TestProcessLikelihoodPool::numberOfSubtests() const
+{
+    return 3;
+}
+
+void
+TestProcessLikelihoodPool::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    const int nPar = 3, nPoints = 50, nWorkers = 4;
+    std::vector<double> params(nPar * nPoints), results(nPoints);
+    for(int j = 0; j < nPar * nPoints; ++j)
+        params[j] = 0.1 * j;
+
+    PoolTestFactory factory(i == 2);
+    Math::ProcessLikelihoodPool pool(factory, nPar, nWorkers, 16);
+    PoolTestLikelihood like(false);
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+        {
+            subTestName = std::string("batch");
+            // more points than the maximum batch size
+            pool.calculateBatch(&(params[0]), nPar, nPoints, &(results[0]));
+            for(int j = 0; j < nPoints; ++j)
+            {
+                const double direct = like.calculate(&(params[j * nPar]), nPar);
+                const double single = pool.calculate(&(params[j * nPar]), nPar);
+                const double exact = pool.calculateExact(&(params[j * nPar]), nPar);
+                if(results[j] != direct || single != direct || exact != 2 * direct)
+                {
+                    output_screen("FAIL: point " << j << " direct " << direct << ", batch " << results[j] << ", single " << single << ", exact " << exact << std::endl);
+                    res = 0;
+                }
+            }
+        }
+        break;
+    case 1:
+        {
+            subTestName = std::string("errors");
+            params[5 * nPar] = -1;
+            bool thrown = false;
+            try {
+                pool.calculateBatch(&(params[0]), nPar, nPoints, &(results[0]));
+            } catch (StandardException&)
+            {
+                thrown = true;
+            }
+            if(!thrown)
+            {
+                output_screen("FAIL: the error of the likelihood was not thrown" << std::endl);
+                res = 0;
+            }
+
+            // the workers keep running
+            params[5 * nPar] = 0;
+            pool.calculateBatch(&(params[0]), nPar, nPoints, &(results[0]));
+            for(int j = 0; j < nPoints; ++j)
+            {
+                if(results[j] != like.calculate(&(params[j * nPar]), nPar))
+                {
+                    output_screen("FAIL: wrong result for point " << j << " after an error" << std::endl);
+                    res = 0;
+                }
+            }
+        }
+        break;
+    case 2:
+        {
+            subTestName = std::string("processes");
+            pool.startBatch(&(params[0]), 16);
+            pool.finishBatch(&(results[0]));
+            std::set<double> pids(results.begin(), results.begin() + 16);
+            if(pids.size() < 2 || pids.count(getpid()))
+            {
+                output_screen("FAIL: the points were evaluated by " << pids.size() << " processes, expected several worker processes" << std::endl);
+                res = 0;
+            }
+        }
+        break;
+    default:
+        check(false, "");
+    }
+}
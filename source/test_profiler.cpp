@@ -0,0 +1,147 @@
+#include <string>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+#include <macros.hpp>
+#include <cosmo_mpi.hpp>
+#include <profiler.hpp>
+#include <test_profiler.hpp>
+
+std::string
+TestProfiler::name() const
+{
+    return std::string("PROFILER TESTER");
+}
+
+unsigned int
+TestProfiler::numberOfSubtests() const
+{
+    return 2;
+}
+
+namespace
+{
+
+void profiledInner()
+{
+    COSMO_PROFILE_REGION("inner");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+}
+
+void profiledOuter(int nInner)
+{
+    COSMO_PROFILE_REGION("outer");
+    for(int i = 0; i < nInner; ++i)
+        profiledInner();
+}
+
+} // namespace
+
+void
+TestProfiler::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 2, "invalid index " << i);
+
+    CosmoMPI& mpi = CosmoMPI::create();
+    Profiler& profiler = Profiler::instance();
+    const bool wasEnabled = Profiler::enabled();
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+    {
+        subTestName = std::string("nested_regions");
+        Profiler::setEnabled(true);
+        profiler.reset();
+
+        profiledOuter(3);
+
+        // each thread has its own tree, the statistics are merged
+        std::thread t(profiledOuter, 2);
+        t.join();
+
+        // not timed
+        Profiler::setEnabled(false);
+        profiledOuter(5);
+        Profiler::setEnabled(true);
+
+        // a region of the same name at a different place in the tree is different
+        profiledInner();
+
+        double outerTime, innerTime, topInnerTime;
+        const unsigned long outerCalls = profiler.regionStats("outer", &outerTime);
+        const unsigned long innerCalls = profiler.regionStats("outer/inner", &innerTime);
+        const unsigned long topInnerCalls = profiler.regionStats("inner", &topInnerTime);
+
+        if(outerCalls != 2 || innerCalls != 5 || topInnerCalls != 1)
+        {
+            output_screen("FAIL: the numbers of calls are " << outerCalls << ", " << innerCalls << ", " << topInnerCalls << ", expected 2, 5, 1." << std::endl);
+            res = 0;
+        }
+
+        if(!(innerTime >= 0.009 && outerTime >= innerTime && topInnerTime >= 0.0019))
+        {
+            output_screen("FAIL: the times are " << outerTime << ", " << innerTime << ", " << topInnerTime << " seconds." << std::endl);
+            res = 0;
+        }
+
+        const std::string report = profiler.report(false);
+        const std::size_t outerPos = report.find("\nouter "), nestedPos = report.find("\n  inner ");
+        if(outerPos == std::string::npos || nestedPos == std::string::npos || nestedPos < outerPos)
+        {
+            output_screen("FAIL: the report is" << std::endl << report);
+            res = 0;
+        }
+
+        profiler.reset();
+        if(profiler.regionStats("outer", &outerTime) != 0 || outerTime != 0)
+        {
+            output_screen("FAIL: reset did not clear the statistics." << std::endl);
+            res = 0;
+        }
+    }
+        break;
+    case 1:
+    {
+        subTestName = std::string("across_processes");
+        Profiler::setEnabled(true);
+        profiler.reset();
+
+        profiledOuter(1);
+
+        // a region that only the last process has, the processes have different trees
+        if(mpi.processId() == mpi.numProcesses() - 1)
+        {
+            COSMO_PROFILE_REGION("last_process_only");
+        }
+
+        const std::string report = profiler.report();
+        if(mpi.isMaster())
+        {
+            if(report.find("outer") == std::string::npos || report.find("inner") == std::string::npos || report.find("last_process_only") == std::string::npos)
+            {
+                output_screen("FAIL: the report is" << std::endl << report);
+                res = 0;
+            }
+            output_screen1(report);
+        }
+        else if(!report.empty())
+        {
+            output_screen("FAIL: the report should only be returned to the master process." << std::endl);
+            res = 0;
+        }
+
+        profiler.reset();
+    }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+
+    Profiler::setEnabled(wasEnabled);
+}
@@ -0,0 +1,181 @@
+#include <cmath>
+#include <vector>
+
+#include <macros.hpp>
+#include <random.hpp>
+#include <test_random.hpp>
+
+std::string
+TestRandom::name() const
+{
+    return std::string("RANDOM TESTER");
+}
+
+unsigned int
+TestRandom::numberOfSubtests() const
+{
+    return 3;
+}
+
+void
+TestRandom::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        return;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        return;
+    case 2:
+        runSubTest2(res, expected, subTestName);
+        return;
+    default:
+        check(false, "");
+        return;
+    }
+}
+
+void
+TestRandom::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    // the known answers of Philox4x32-10 from the reference implementation (Random123)
+    const unsigned int ctr[3][4] = {{0, 0, 0, 0}, {0xFFFFFFFFU, 0xFFFFFFFFU, 0xFFFFFFFFU, 0xFFFFFFFFU}, {0x243F6A88U, 0x85A308D3U, 0x13198A2EU, 0x03707344U}};
+    const unsigned int key[3][2] = {{0, 0}, {0xFFFFFFFFU, 0xFFFFFFFFU}, {0xA4093822U, 0x299F31D0U}};
+    const unsigned int known[3][4] = {{0x6627E8D5U, 0xE169C58DU, 0xBC57AC4CU, 0x9B00DBD8U}, {0x408F276DU, 0x41C83B0EU, 0xA20BC7C6U, 0x6D5451FDU}, {0xD16CFE09U, 0x94FDCCEBU, 0x5001E420U, 0x24126EA1U}};
+
+    res = 1;
+    for(int k = 0; k < 3; ++k)
+    {
+        unsigned int out[4];
+        Math::PhiloxEngine::block(ctr[k], key[k], out);
+        for(int i = 0; i < 4; ++i)
+        {
+            if(out[i] != known[k][i])
+                res = 0;
+        }
+    }
+
+    // the counter of the engine is the position in the stream, the stream and the seed are the rest of the counter and the key
+    Math::PhiloxEngine engine(0x299F31D0A4093822ULL, 0x0370734413198A2EULL);
+    engine.discard(4 * 3);
+    const unsigned int streamCtr[4] = {3, 0, 0x13198A2EU, 0x03707344U};
+    unsigned int streamOut[4];
+    Math::PhiloxEngine::block(streamCtr, key[2], streamOut);
+    for(int i = 0; i < 4; ++i)
+    {
+        if(engine() != streamOut[i])
+            res = 0;
+    }
+
+    Math::PhiloxEngine a(5, 7), b(5, 7);
+    for(int i = 0; i < 13; ++i)
+        a();
+    b.discard(6);
+    b.discard(7);
+    if(a() != b())
+        res = 0;
+
+    expected = 1;
+    subTestName = "philox_known_answer";
+}
+
+void
+TestRandom::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    const int n = 1000000;
+    Math::GaussianStreamGenerator gen0(100, 0, 0, 1), gen1(100, 1, 0, 1), gen0Again(100, 0, 0, 1);
+
+    double mean = 0, var = 0, cross = 0;
+    res = 1;
+    for(int i = 0; i < n; ++i)
+    {
+        const double x = gen0.generate(), y = gen1.generate();
+        if(x != gen0Again.generate())
+            res = 0;
+        mean += x;
+        var += x * x;
+        cross += x * y;
+    }
+    mean /= n;
+    var /= n;
+    cross /= n;
+
+    // all of these are 0 with a standard deviation of about 1/sqrt(n) = 0.001
+    if(std::abs(mean) > 0.005 || std::abs(var - 1) > 0.01 || std::abs(cross) > 0.005)
+    {
+        output_screen("FAIL: mean = " << mean << ", variance = " << var << ", correlation between the streams = " << cross << std::endl);
+        res = 0;
+    }
+
+    expected = 1;
+    subTestName = "gaussian_streams";
+}
+
+
+void
+TestRandom::runSubTest2(double& res, double& expected, std::string& subTestName)
+{
+    res = 1;
+
+    // the bulk generation must give the same numbers as the one by one generation, in any split
+    const int n = 1001;
+    Math::PhiloxEngine engine(3, 4), engineBulk(3, 4);
+    std::vector<unsigned int> words(n);
+    engineBulk.fill(3, &(words[0]));
+    engineBulk.fill(n - 3, &(words[3]));
+    for(int i = 0; i < n; ++i)
+    {
+        if(engine() != words[i])
+        {
+            output_screen("FAIL: engine bulk number " << i << " is different." << std::endl);
+            res = 0;
+            break;
+        }
+    }
+
+    Math::UniformStreamGenerator uniform(10, 2, -1, 1), uniformBulk(10, 2, -1, 1);
+    Math::GaussianStreamGenerator gauss(10, 3, 1, 2), gaussBulk(10, 3, 1, 2);
+    std::vector<double> u(n), g(n);
+    uniformBulk.generate(5, &(u[0]));
+    uniformBulk.generate(n - 5, &(u[5]));
+    gaussBulk.generate(5, &(g[0]));
+    gaussBulk.generate(n - 5, &(g[5]));
+    for(int i = 0; i < n; ++i)
+    {
+        const double x = uniform.generate(), y = gauss.generate();
+        if(x != u[i] || std::abs(y - g[i]) > 1e-12 * (1 + std::abs(y)) || x <= -1 || x >= 1)
+        {
+            output_screen("FAIL: bulk number " << i << " is different. Uniform: " << x << " vs " << u[i] << ", Gaussian: " << y << " vs " << g[i] << std::endl);
+            res = 0;
+            break;
+        }
+    }
+
+    if(uniform.position() != n || gauss.position() != n)
+    {
+        output_screen("FAIL: the positions are " << uniform.position() << " and " << gauss.position() << ", expected " << n << std::endl);
+        res = 0;
+    }
+
+    // continuing from a saved position must reproduce the rest of the stream
+    Math::UniformStreamGenerator uniformResumed(10, 2, -1, 1);
+    Math::GaussianStreamGenerator gaussResumed(10, 3, 1, 2);
+    uniformResumed.seek(uniform.position());
+    gaussResumed.seek(gauss.position());
+    for(int i = 0; i < 10; ++i)
+    {
+        if(uniformResumed.generate() != uniform.generate() || std::abs(gaussResumed.generate() - gauss.generate()) > 1e-12)
+        {
+            output_screen("FAIL: the resumed streams are different." << std::endl);
+            res = 0;
+            break;
+        }
+    }
+
+    expected = 1;
+    subTestName = "bulk_and_seek";
+}
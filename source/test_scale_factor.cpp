@@ -0,0 +1,169 @@
+#include <cmath>
+#include <vector>
+
+#include <macros.hpp>
+#include <cosmological_params.hpp>
+#include <scale_factor.hpp>
+#include <integral.hpp>
+#include <test_scale_factor.hpp>
+
+namespace
+{
+
+// the integrands for t(a), the comoving distance, and the unnormalized growth factor in terms of a
+class TestScaleFactorIntegrand : public Math::RealFunction
+{
+public:
+    enum Type { TIME = 0, DISTANCE, GROWTH };
+
+    TestScaleFactorIntegrand(const ScaleFactorFunctionClass& sf, Type type) : sf_(sf), type_(type) {}
+
+    double evaluate(double a) const
+    {
+        const double aH = a * sf_.hubble(a);
+        switch(type_)
+        {
+        case TIME:
+            return 1 / aH;
+        case DISTANCE:
+            return 1 / (a * aH);
+        case GROWTH:
+            {
+                const double r = aH / sf_.hubble(1);
+                return 1 / (r * r * r);
+            }
+        default:
+            check(false, "");
+            return 0;
+        }
+    }
+
+private:
+    const ScaleFactorFunctionClass& sf_;
+    const Type type_;
+};
+
+} // namespace
+
+std::string
+TestScaleFactor::name() const
+{
+    return std::string("SCALE FACTOR");
+}
+
+unsigned int
+TestScaleFactor::numberOfSubtests() const
+{
+    return 5;
+}
+
+void
+TestScaleFactor::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 5, "invalid index " << i);
+
+    const LambdaCDMParams params(0.022, 0.12, 0.7, 0.1, 1.0, 2e-9, 0.05);
+    ScaleFactorFunctionClass sf;
+    sf.initialize(params);
+
+    const int n = 1000;
+    std::vector<double> a(n), z(n);
+    for(int j = 0; j < n; ++j)
+    {
+        a[j] = std::pow(10.0, -7.0 + 7.0 * j / (n - 1));
+        z[j] = 1 / a[j] - 1;
+    }
+    a[n - 1] = 1;
+    z[n - 1] = 0;
+
+    res = 1;
+    expected = 1;
+
+    switch(i)
+    {
+    case 0:
+        subTestName = std::string("time_roundtrip");
+        for(int j = 0; j < n; ++j)
+        {
+            const double t = sf.time(a[j]);
+            const double aa = sf.evaluate(t);
+            if(std::abs(aa - a[j]) > 1e-7 * a[j])
+            {
+                output_screen("FAIL: a = " << a[j] << " gives t = " << t << " which gives a = " << aa << std::endl);
+                res = 0;
+            }
+        }
+        break;
+    case 1:
+        {
+            subTestName = std::string("time_integral");
+            const TestScaleFactorIntegrand f(sf, TestScaleFactorIntegrand::TIME);
+            for(int j = 0; j < n; j += 37)
+            {
+                const double t = sf.time(a[j]);
+                const double e = Math::realIntegralGaussKronrod(f, 0.0, a[j], 1e-10);
+                if(std::abs(t - e) > 1e-3 * e)
+                {
+                    output_screen("FAIL: at a = " << a[j] << " the time is " << t << ", the integral is " << e << std::endl);
+                    res = 0;
+                }
+            }
+        }
+        break;
+    case 2:
+        {
+            subTestName = std::string("comoving_distance");
+            const TestScaleFactorIntegrand f(sf, TestScaleFactorIntegrand::DISTANCE);
+            for(int j = 0; j < n - 1; j += 37)
+            {
+                const double d = sf.comovingDistanceToRedshift(z[j]);
+                const double d1 = sf.comovingDistance(sf.time(a[j]), sf.age());
+                const double e = Math::realIntegralGaussKronrod(f, a[j], 1.0, 1e-10);
+                if(std::abs(d - e) > 1e-3 * e || std::abs(d1 - d) > 1e-3 * e)
+                {
+                    output_screen("FAIL: at z = " << z[j] << " the comoving distance is " << d << " (" << d1 << " from the times), the integral is " << e << std::endl);
+                    res = 0;
+                }
+            }
+        }
+        break;
+    case 3:
+        {
+            subTestName = std::string("growth_factor");
+            const TestScaleFactorIntegrand f(sf, TestScaleFactorIntegrand::GROWTH);
+            const double norm = Math::realIntegralGaussKronrod(f, 0.0, 1.0, 1e-12);
+            for(int j = 0; j < n; j += 37)
+            {
+                const double g = sf.growthFactor(a[j]);
+                const double e = Math::realIntegralGaussKronrod(f, 0.0, a[j], 1e-12) / norm * sf.hubble(a[j]) / sf.hubble(1);
+                if(std::abs(g - e) > 1e-4 * e)
+                {
+                    output_screen("FAIL: at a = " << a[j] << " the growth factor is " << g << ", the integral gives " << e << std::endl);
+                    res = 0;
+                }
+            }
+        }
+        break;
+    case 4:
+        {
+            subTestName = std::string("batch");
+            std::vector<double> t(n), aa(n), d(n), g(n);
+            sf.time(n, &(a[0]), &(t[0]));
+            sf.evaluate(n, &(t[0]), &(aa[0]));
+            sf.comovingDistanceToRedshift(n, &(z[0]), &(d[0]));
+            sf.growthFactor(n, &(a[0]), &(g[0]));
+            for(int j = 0; j < n; ++j)
+            {
+                if(t[j] != sf.time(a[j]) || aa[j] != sf.evaluate(t[j]) || d[j] != sf.comovingDistanceToRedshift(z[j]) || g[j] != sf.growthFactor(a[j]))
+                {
+                    output_screen("FAIL: batch evaluation is different from single evaluation at a = " << a[j] << std::endl);
+                    res = 0;
+                }
+            }
+        }
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
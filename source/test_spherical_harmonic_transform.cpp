@@ -0,0 +1,128 @@
+#include <cmath>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <random.hpp>
+#include <math_constants.hpp>
+#include <spherical_harmonic_transform.hpp>
+#include <test_spherical_harmonic_transform.hpp>
+
+#include <alm_healpix_tools.h>
+
+namespace
+{
+
+void randomAlm(int lMax, unsigned long seed, Alm<xcomplex<double> >& alm)
+{
+    Math::GaussianGenerator gen(seed, 0, 1);
+    alm.Set(lMax, lMax);
+    for(int l = 0; l <= lMax; ++l)
+    {
+        alm(l, 0) = xcomplex<double>(gen.generate(), 0);
+        for(int m = 1; m <= l; ++m)
+            alm(l, m) = xcomplex<double>(gen.generate(), gen.generate());
+    }
+}
+
+double maxDiff(const Healpix_Map<double>& a, const Healpix_Map<double>& b)
+{
+    double d = 0;
+    for(long i = 0; i < a.Npix(); ++i)
+        d = std::max(d, std::abs(a[i] - b[i]));
+    return d;
+}
+
+double maxDiff(const Alm<xcomplex<double> >& a, const Alm<xcomplex<double> >& b)
+{
+    double d = 0;
+    for(int m = 0; m <= a.Mmax(); ++m)
+        for(int l = m; l <= a.Lmax(); ++l)
+            d = std::max(d, std::abs(a(l, m) - b(l, m)));
+    return d;
+}
+
+} // namespace
+
+std::string
+TestSphericalHarmonicTransform::name() const
+{
+    return std::string("SPHERICAL HARMONIC TRANSFORM TESTER");
+}
+
+unsigned int
+TestSphericalHarmonicTransform::numberOfSubtests() const
+{
+    return 3;
+}
+
+void
+TestSphericalHarmonicTransform::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    const long nSide = 32;
+    const int lMax = 2 * nSide;
+
+    Alm<xcomplex<double> > alm, alm1;
+    randomAlm(lMax, 100, alm);
+    randomAlm(lMax, 200, alm1);
+
+    Healpix_Map<double> map, map1, other, other1;
+    map.SetNside(nSide, RING);
+    map1.SetNside(nSide, RING);
+    other.SetNside(nSide, RING);
+    other1.SetNside(nSide, RING);
+
+    const SphericalHarmonicTransform sharp(nSide, lMax), healpix(nSide, lMax, NULL, SphericalHarmonicTransform::HEALPIX_BACKEND);
+
+    expected = 0;
+    switch(i)
+    {
+    case 0:
+        // the two backends must give the same maps
+        sharp.alm2map(alm, map);
+        healpix.alm2map(alm, other);
+        res = maxDiff(map, other);
+        subTestName = "alm2map_backends";
+        break;
+
+    case 1:
+        {
+            // batched transforms must be the same as single ones, with the same weight as in the HEALPix functions
+            healpix.alm2map(alm, map);
+            healpix.alm2map(alm1, map1);
+
+            const double weight = map.Npix() / (4 * Math::pi);
+            Alm<xcomplex<double> > a(lMax, lMax), a1(lMax, lMax), b(lMax, lMax), b1(lMax, lMax);
+            const Healpix_Map<double>* maps[2] = {&map, &map1};
+            Alm<xcomplex<double> >* alms[2] = {&a, &a1};
+            sharp.map2alm(2, maps, alms, weight);
+
+            arr<double> w(2 * nSide, weight);
+            map2alm(map, b, w);
+            map2alm(map1, b1, w);
+
+            res = std::max(maxDiff(a, b), maxDiff(a1, b1));
+        }
+        subTestName = "map2alm_batched";
+        break;
+
+    case 2:
+        {
+            // the iterations must recover the a_lm of a band limited map
+            const int lMaxIter = nSide;
+            const SphericalHarmonicTransform sharpIter(nSide, lMaxIter);
+            Alm<xcomplex<double> > a, b(lMaxIter, lMaxIter);
+            randomAlm(lMaxIter, 300, a);
+            sharpIter.alm2map(a, map);
+            sharpIter.map2almIter(map, b, 5);
+            res = maxDiff(a, b);
+        }
+        subTestName = "map2alm_iter";
+        break;
+
+    default:
+        check(false, "");
+        break;
+    }
+}
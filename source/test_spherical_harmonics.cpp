@@ -1,4 +1,6 @@
+#include <vector>
 #include <cmath>
+#include <algorithm>
 
 #include <macros.hpp>
 #include <spherical_harmonics.hpp>
@@ -13,7 +15,7 @@ TestSphericalHarmonics::name() const
 unsigned int
 TestSphericalHarmonics::numberOfSubtests() const
 {
-    return 10;
+    return 12;
 }
 
 void
@@ -75,6 +77,38 @@ TestSphericalHarmonics::runSubTest(unsigned int i, double& res, double& expected
         res = std::imag(sh.calculate(10000, -101, 3.0, 0.1));
         expected = 0.495898;
         break;
+    case 10:
+    {
+        // all of them at once compared to the single ones, the result is the largest difference
+        subTestName = "all_100";
+        const int lMax = 100;
+        Math::SphericalHarmonicsRecursion rec(lMax);
+        std::vector<ComplexDouble> all(rec.size());
+        rec.calculate(1.0, -2.0, &(all[0]));
+        res = 0;
+        for(int l = 0; l <= lMax; ++l)
+            for(int m = 0; m <= l; ++m)
+                res = std::max(res, std::abs(all[rec.index(l, m)] - sh.calculate(l, m, 1.0, -2.0)));
+        expected = 0;
+        break;
+    }
+    case 11:
+    {
+        subTestName = "many_directions_500";
+        const int lMax = 500, n = 20;
+        Math::SphericalHarmonicsRecursion rec(lMax);
+        std::vector<double> theta(n), phi(n);
+        for(int k = 0; k < n; ++k)
+        {
+            theta[k] = 0.05 + 3.0 * k / n;
+            phi[k] = -3.0 + 0.31 * k;
+        }
+        std::vector<ComplexDouble> all(n * rec.size());
+        rec.calculate(n, &(theta[0]), &(phi[0]), &(all[0]));
+        res = std::imag(all[(n / 2) * rec.size() + rec.index(500, 250)]);
+        expected = std::imag(sh.calculate(500, 250, theta[n / 2], phi[n / 2]));
+        break;
+    }
     default:
         check(false, "");
         break;
@@ -1,3 +1,8 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <macros.hpp>
 #include <table_function.hpp>
 #include <test_table_function.hpp>
 
@@ -10,13 +15,13 @@ TestTableFunction::name() const
 unsigned int
 TestTableFunction::numberOfSubtests() const
 {
-    return 3;
+    return 11;
 }
 
 void
 TestTableFunction::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 3, "invalid index " << i);
+    check(i >= 0 && i < 11, "invalid index " << i);
 
     Math::TableFunction<double, double> t1;
     const double x[3] = {-1, 0, 5};
@@ -46,6 +51,239 @@ TestTableFunction::runSubTest(unsigned int i, double& res, double& expected, std
         res = t1.evaluate(p);
         expected = (y[2] + y[1]) / 2;
         break;
+    case 3:
+        {
+            subTestName = std::string("flat_general");
+            const Math::FlatTableFunction<double, double> f(t1);
+            res = (f.gridType() == Math::FlatTableAxis<double>::GENERAL_GRID ? 1 : 0);
+            for(int j = 0; j <= 100; ++j)
+            {
+                p = x[0] + (x[2] - x[0]) * j / 100;
+                if(std::abs(f.evaluate(p) - t1.evaluate(p)) > 1e-12)
+                {
+                    output_screen("FAIL: at x = " << p << " flat table function gives " << f.evaluate(p) << ", table function gives " << t1.evaluate(p) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 4:
+        {
+            subTestName = std::string("flat_uniform");
+            Math::TableFunction<double, double> t;
+            for(int j = 0; j <= 1000; ++j)
+            {
+                const double v = -3.0 + 0.01 * j;
+                t[v] = v * v;
+            }
+            const Math::FlatTableFunction<double, double> f(t);
+            res = (f.gridType() == Math::FlatTableAxis<double>::UNIFORM_GRID ? 1 : 0);
+            for(int j = 0; j <= 10000; ++j)
+            {
+                p = -3.0 + 10.0 * j / 10000;
+                if(std::abs(f.evaluate(p) - t.evaluate(p)) > 1e-10)
+                {
+                    output_screen("FAIL: at x = " << p << " flat table function gives " << f.evaluate(p) << ", table function gives " << t.evaluate(p) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 5:
+        {
+            subTestName = std::string("flat_log_uniform");
+            Math::TableFunction<double, double> t;
+            for(int j = 0; j <= 500; ++j)
+            {
+                const double v = 1e-4 * std::pow(10.0, 0.01 * j);
+                t[v] = std::log(v);
+            }
+            const Math::FlatTableFunction<double, double> f(t);
+            res = (f.gridType() == Math::FlatTableAxis<double>::LOG_UNIFORM_GRID ? 1 : 0);
+            for(int j = 0; j <= 10000; ++j)
+            {
+                p = 1e-4 * std::pow(10.0, 5.0 * j / 10000);
+                if(p > t.rbegin()->first)
+                    p = t.rbegin()->first;
+                if(std::abs(f.evaluate(p) - t.evaluate(p)) > 1e-10)
+                {
+                    output_screen("FAIL: at x = " << p << " flat table function gives " << f.evaluate(p) << ", table function gives " << t.evaluate(p) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 6:
+        {
+            subTestName = std::string("flat_batch");
+            Math::TableFunction<double, double> t;
+            for(int j = 0; j <= 100; ++j)
+            {
+                const double v = 0.1 * j * j;
+                t[v] = std::sin(v);
+            }
+            const Math::FlatTableFunction<double, double> f(t);
+            std::vector<double> in(5000), out;
+            for(int j = 0; j < in.size(); ++j)
+                in[j] = 1000.0 * j / (in.size() - 1);
+            f.evaluate(in, &out);
+            res = (out.size() == in.size() ? 1 : 0);
+            for(int j = 0; j < in.size(); ++j)
+            {
+                if(std::abs(out[j] - t.evaluate(in[j])) > 1e-12)
+                {
+                    output_screen("FAIL: at x = " << in[j] << " batch evaluation gives " << out[j] << ", table function gives " << t.evaluate(in[j]) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 7:
+        {
+            subTestName = std::string("flat_2d");
+            Math::TableFunction2<double, double, double> t;
+            for(int j = 0; j <= 20; ++j)
+            {
+                const double v1 = 0.05 * j * j;
+                for(int k = 0; k <= 30; ++k)
+                {
+                    const double v2 = -1.0 + 0.1 * k;
+                    t[v1][v2] = std::sin(v1) * std::cos(v2) + v1 * v2;
+                }
+            }
+            const Math::FlatTableFunction2<double, double, double> f(t);
+            res = (f.axis1().gridType() == Math::FlatTableAxis<double>::GENERAL_GRID && f.axis2().gridType() == Math::FlatTableAxis<double>::UNIFORM_GRID ? 1 : 0);
+
+            const int n = 2000;
+            std::vector<double> in1(n), in2(n), out(n);
+            for(int j = 0; j < n; ++j)
+            {
+                in1[j] = 20.0 * j / (n - 1);
+                in2[j] = -1.0 + 3.0 * ((j * 7) % n) / (n - 1);
+            }
+            f.evaluate(n, &(in1[0]), &(in2[0]), &(out[0]));
+            for(int j = 0; j < n; ++j)
+            {
+                const double e = t.evaluate(in1[j], in2[j]);
+                if(std::abs(out[j] - e) > 1e-10 || std::abs(f.evaluate(in1[j], in2[j]) - e) > 1e-10)
+                {
+                    output_screen("FAIL: at (" << in1[j] << ", " << in2[j] << ") flat table function gives " << out[j] << ", table function gives " << e << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 8:
+        {
+            subTestName = std::string("flat_3d");
+            Math::TableFunction3<double, double, double, double> t;
+            for(int j = 0; j <= 10; ++j)
+            {
+                const double v1 = 0.1 * j;
+                for(int k = 0; k <= 12; ++k)
+                {
+                    const double v2 = 0.01 * std::pow(10.0, 0.25 * k);
+                    for(int l = 0; l <= 8; ++l)
+                    {
+                        const double v3 = l * l - 5.0;
+                        t[v1][v2][v3] = v1 * v2 + std::exp(-v1) * v3 + v2 * v3 * v3;
+                    }
+                }
+            }
+            const Math::FlatTableFunction3<double, double, double, double> f(t);
+            res = (f.axis1().gridType() == Math::FlatTableAxis<double>::UNIFORM_GRID && f.axis2().gridType() == Math::FlatTableAxis<double>::LOG_UNIFORM_GRID && f.axis3().gridType() == Math::FlatTableAxis<double>::GENERAL_GRID ? 1 : 0);
+
+            const int n = 2000;
+            std::vector<double> in1(n), in2(n), in3(n), out(n);
+            for(int j = 0; j < n; ++j)
+            {
+                in1[j] = 1.0 * j / (n - 1);
+                in2[j] = std::min(0.01 * std::pow(10.0, 3.0 * ((j * 7) % n) / (n - 1)), t.begin()->second.rbegin()->first);
+                in3[j] = -5.0 + 64.0 * ((j * 13) % n) / (n - 1);
+            }
+            f.evaluate(n, &(in1[0]), &(in2[0]), &(in3[0]), &(out[0]));
+            for(int j = 0; j < n; ++j)
+            {
+                const double e = t.evaluate(in1[j], in2[j], in3[j]);
+                if(std::abs(out[j] - e) > 1e-10 * (1 + std::abs(e)))
+                {
+                    output_screen("FAIL: at (" << in1[j] << ", " << in2[j] << ", " << in3[j] << ") flat table function gives " << out[j] << ", table function gives " << e << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 9:
+        {
+            subTestName = std::string("table_batch");
+            Math::TableFunction<double, double> t;
+            for(int j = 0; j <= 100; ++j)
+            {
+                const double v = std::sqrt(double(j));
+                t[v] = std::cos(v);
+            }
+
+            // increasing, decreasing, then jumping around, through the base class
+            const int n = 3000;
+            std::vector<double> in(3 * n), out(3 * n);
+            for(int j = 0; j < n; ++j)
+            {
+                in[j] = 10.0 * j / (n - 1);
+                in[2 * n - 1 - j] = in[j];
+                in[2 * n + j] = 10.0 * ((j * 1031) % n) / (n - 1);
+            }
+            const Math::RealFunction& f = t;
+            f.evaluate(in.size(), &(in[0]), &(out[0]));
+            res = 1;
+            for(int j = 0; j < in.size(); ++j)
+            {
+                if(out[j] != t.evaluate(in[j]))
+                {
+                    output_screen("FAIL: at x = " << in[j] << " batch evaluation gives " << out[j] << ", single evaluation gives " << t.evaluate(in[j]) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 10:
+        {
+            subTestName = std::string("flat_sorted");
+            Math::TableFunction<double, double> t;
+            for(int j = 0; j <= 100; ++j)
+            {
+                const double v = std::sqrt(double(j));
+                t[v] = std::cos(v);
+            }
+            const Math::FlatTableFunction<double, double> f(t);
+
+            // increasing with repeated values and the end points, evaluated in place
+            const int n = 3000;
+            std::vector<double> in(n), out(n);
+            for(int j = 0; j < n; ++j)
+                in[j] = 10.0 * (j / 2) / (n / 2 - 1);
+            in[0] = 0;
+            in[n - 1] = 10;
+            out = in;
+            f.evaluateSorted(n, &(out[0]), &(out[0]));
+            res = 1;
+            for(int j = 0; j < n; ++j)
+            {
+                if(std::abs(out[j] - f.evaluate(in[j])) > 1e-14)
+                {
+                    output_screen("FAIL: at x = " << in[j] << " sorted evaluation gives " << out[j] << ", single evaluation gives " << f.evaluate(in[j]) << std::endl);
+                    res = 0;
+                }
+            }
+            expected = 1;
+        }
+        break;
     default:
         check(false, "");
         break;
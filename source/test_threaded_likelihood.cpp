@@ -0,0 +1,192 @@
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <test_threaded_likelihood.hpp>
+#include <threaded_likelihood.hpp>
+#include <numerics.hpp>
+
+std::string
+TestThreadedLikelihood::name() const
+{
+    return std::string("THREADED LIKELIHOOD TESTER");
+}
+
+unsigned int
+TestThreadedLikelihood::numberOfSubtests() const
+{
+    return 3;
+}
+
+namespace
+{
+
+// a chi^2 summed in a parallel region, records the number of threads of the region
+class ThreadedTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    ThreadedTestLikelihood(int n) : data_(n), threads_(0)
+    {
+        for(int i = 0; i < n; ++i)
+            data_[i] = std::sin(0.01 * i);
+    }
+
+    virtual double calculate(double* params, int nParams)
+    {
+        check(nParams == 2, "");
+        if(params[0] < -100)
+        {
+            StandardException exc;
+            exc.set("the test likelihood is not defined here");
+            throw exc;
+        }
+
+        const int n = data_.size();
+        double res = 0;
+        int threads = 1;
+#pragma omp parallel default(shared)
+        {
+#ifdef COSMO_OMP
+#pragma omp single
+            threads = omp_get_num_threads();
+#endif
+
+#pragma omp for reduction(+:res) schedule(static)
+            for(int i = 0; i < n; ++i)
+            {
+                const double d = data_[i] - params[0] - params[1] * i / n;
+                res += d * d;
+            }
+        }
+
+        threads_ = threads;
+        return res;
+    }
+
+    int lastThreads() const { return threads_; }
+
+private:
+    std::vector<double> data_;
+    int threads_;
+};
+
+int maxThreads()
+{
+#ifdef COSMO_OMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+void setThreads(int nThreads)
+{
+#ifdef COSMO_OMP
+    omp_set_num_threads(nThreads);
+#endif
+}
+
+} // namespace
+
+void
+TestThreadedLikelihood::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 3, "invalid index " << i);
+
+    res = 1;
+    expected = 1;
+
+    const int nThreads = 4;
+    ThreadedTestLikelihood like(100000);
+    Math::ThreadedLikelihood threaded(like, nThreads);
+
+    const int nPoints = 8;
+    std::vector<double> params(2 * nPoints);
+    for(int j = 0; j < nPoints; ++j)
+    {
+        params[2 * j] = 0.1 * j - 0.3;
+        params[2 * j + 1] = 0.05 * j * j;
+    }
+
+    // the serial path, the likelihood called directly on one thread
+    const int threadsBefore = maxThreads();
+    setThreads(1);
+    std::vector<double> serial(nPoints);
+    for(int j = 0; j < nPoints; ++j)
+        serial[j] = like.calculate(&(params[2 * j]), 2);
+    setThreads(threadsBefore);
+
+    if(i == 0)
+    {
+        subTestName = std::string("single");
+        for(int j = 0; j < nPoints; ++j)
+        {
+            const double r = threaded.calculate(&(params[2 * j]), 2);
+            if(!Math::areEqual(serial[j], r, 1e-10))
+            {
+                output_screen("FAIL: Point " << j << " should have the likelihood " << serial[j] << ", the result is " << r << std::endl);
+                res = 0;
+            }
+#ifdef COSMO_OMP
+            if(like.lastThreads() != nThreads)
+            {
+                output_screen("FAIL: The likelihood ran on " << like.lastThreads() << " threads, should be " << nThreads << "." << std::endl);
+                res = 0;
+            }
+#endif
+        }
+
+        if(maxThreads() != threadsBefore)
+        {
+            output_screen("FAIL: The number of threads after the evaluations is " << maxThreads() << ", should be " << threadsBefore << "." << std::endl);
+            res = 0;
+        }
+        return;
+    }
+
+    if(i == 1)
+    {
+        subTestName = std::string("batch");
+        std::vector<double> results(nPoints, -1);
+        threaded.calculateBatch(&(params[0]), 2, nPoints, &(results[0]));
+        for(int j = 0; j < nPoints; ++j)
+        {
+            if(!Math::areEqual(serial[j], results[j], 1e-10))
+            {
+                output_screen("FAIL: Point " << j << " of the batch should have the likelihood " << serial[j] << ", the result is " << results[j] << std::endl);
+                res = 0;
+            }
+        }
+        return;
+    }
+
+    subTestName = std::string("exception");
+    std::vector<double> bad(2, -1000);
+    bool thrown = false;
+    try
+    {
+        threaded.calculate(&(bad[0]), 2);
+    } catch (std::exception& e)
+    {
+        thrown = true;
+    }
+
+    if(!thrown)
+    {
+        output_screen("FAIL: The exception of the likelihood was not rethrown." << std::endl);
+        res = 0;
+    }
+
+    if(maxThreads() != threadsBefore)
+    {
+        output_screen("FAIL: The number of threads after the exception is " << maxThreads() << ", should be " << threadsBefore << "." << std::endl);
+        res = 0;
+    }
+}
+
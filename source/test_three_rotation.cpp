@@ -1,9 +1,37 @@
 #include <cmath>
+#include <vector>
 
 #include <three_rotation.hpp>
+#include <alm_rotation.hpp>
+#include <spherical_harmonics.hpp>
+#include <random.hpp>
 #include <math_constants.hpp>
 #include <test_three_rotation.hpp>
 
+namespace
+{
+
+// the real field with the coefficients alm (m >= 0 in the Healpix order) at a given direction
+double
+fieldValue(const std::vector<ComplexDouble>& alm, int lMax, const Math::ThreeVectorDouble& v)
+{
+    const double theta = std::acos(v.z() / std::sqrt(v.normSquared()));
+    const double phi = std::atan2(v.y(), v.x());
+    Math::SphericalHarmonics sh;
+    double res = 0;
+    for(int l = 0; l <= lMax; ++l)
+    {
+        for(int m = 0; m <= l; ++m)
+        {
+            const ComplexDouble y = alm[m * (2 * lMax + 1 - m) / 2 + l] * sh.calculate(l, m, theta, phi);
+            res += (m == 0 ? 1.0 : 2.0) * y.real();
+        }
+    }
+    return res;
+}
+
+} // namespace
+
 std::string
 TestThreeRotation::name() const
 {
@@ -13,7 +41,7 @@ TestThreeRotation::name() const
 unsigned int
 TestThreeRotation::numberOfSubtests() const
 {
-    return 2;
+    return 5;
 }
 
 void
@@ -44,6 +72,127 @@ TestThreeRotation::runSubTest(unsigned int i, double& res, double& expected, std
         res = r.z();
         expected = 1;
         break;
+    case 2:
+        {
+            subTestName = std::string("apply_batch");
+            const ThreeRotationMatrix rot(0.3, 1.1, -0.7);
+            const int n = 101;
+            std::vector<double> v(3 * n), rotated(3 * n);
+            std::vector<ThreeVectorDouble> vectors(n), rotatedVectors(n);
+            for(int j = 0; j < n; ++j)
+            {
+                vectors[j] = ThreeVectorDouble(std::sin(0.1 * j), std::cos(0.3 * j), 0.01 * j);
+                v[3 * j] = vectors[j].x();
+                v[3 * j + 1] = vectors[j].y();
+                v[3 * j + 2] = vectors[j].z();
+            }
+            rot.apply(n, &(v[0]), &(rotated[0]));
+            rot.apply(n, &(vectors[0]), &(rotatedVectors[0]));
+            res = 1;
+            for(int j = 0; j < n; ++j)
+            {
+                const ThreeVectorDouble r = rot * vectors[j];
+                if(std::abs(r.x() - rotated[3 * j]) > 1e-14 || std::abs(r.y() - rotated[3 * j + 1]) > 1e-14 || std::abs(r.z() - rotated[3 * j + 2]) > 1e-14 || std::abs(r.x() - rotatedVectors[j].x()) > 1e-14 || std::abs(r.y() - rotatedVectors[j].y()) > 1e-14 || std::abs(r.z() - rotatedVectors[j].z()) > 1e-14)
+                {
+                    output_screen("FAIL: vector " << j << " is rotated differently." << std::endl);
+                    res = 0;
+                }
+            }
+            if(!(rot.transpose() * rot == ThreeRotationMatrix()))
+            {
+                output_screen("FAIL: the transpose is not the inverse." << std::endl);
+                res = 0;
+            }
+            expected = 1;
+        }
+        break;
+    case 3:
+        {
+            subTestName = std::string("wigner_d");
+            const ThreeRotationMatrix rot(0.2, 0.9, 0.4);
+            const AlmRotation rotation(rot, 30);
+            const double b = rotation.beta(), c = std::cos(b), s = std::sin(b);
+            res = 1;
+            // a few known elements for l = 1 and 2
+            const double known[5][4] = {{1, 1, 0, -s / std::sqrt(2.0)}, {1, 0, 0, c}, {2, 2, 1, -(1 + c) * s / 2}, {2, 1, -1, (1 - c) * (2 * c + 1) / 2}, {2, 0, 0, (3 * c * c - 1) / 2}};
+            for(int j = 0; j < 5; ++j)
+            {
+                const double x = rotation.d(int(known[j][0]), int(known[j][1]), int(known[j][2]));
+                if(std::abs(x - known[j][3]) > 1e-14)
+                {
+                    output_screen("FAIL: d^" << known[j][0] << "_" << known[j][1] << known[j][2] << " = " << x << ", expected " << known[j][3] << std::endl);
+                    res = 0;
+                }
+            }
+            if(std::abs(b - 0.9) > 1e-12)
+            {
+                output_screen("FAIL: beta = " << b << ", expected 0.9." << std::endl);
+                res = 0;
+            }
+            // the matrices must be orthogonal
+            for(int l = 0; l <= 30; l += 10)
+            {
+                for(int m = -l; m <= l; ++m)
+                {
+                    for(int m1 = -l; m1 <= l; ++m1)
+                    {
+                        double sum = 0;
+                        for(int k = -l; k <= l; ++k)
+                            sum += rotation.d(l, m, k) * rotation.d(l, m1, k);
+                        if(std::abs(sum - (m == m1 ? 1 : 0)) > 1e-12)
+                        {
+                            output_screen("FAIL: d^" << l << " is not orthogonal, row " << m << " times row " << m1 << " is " << sum << std::endl);
+                            res = 0;
+                        }
+                    }
+                }
+            }
+            expected = 1;
+        }
+        break;
+    case 4:
+        {
+            subTestName = std::string("alm_rotation");
+            const int lMax = 8;
+            const int nAlm = (lMax + 1) * (lMax + 2) / 2;
+            std::vector<ComplexDouble> alm1(nAlm), alm2(nAlm);
+            Math::GaussianStreamGenerator gen(1, 0, 0, 1);
+            for(int l = 0; l <= lMax; ++l)
+            {
+                for(int m = 0; m <= l; ++m)
+                {
+                    const double re = gen.generate(), im = (m == 0 ? 0.0 : gen.generate());
+                    alm1[m * (2 * lMax + 1 - m) / 2 + l] = ComplexDouble(re, im);
+                    alm2[m * (2 * lMax + 1 - m) / 2 + l] = ComplexDouble(re + im, m == 0 ? 0.0 : re - im);
+                }
+            }
+
+            res = 1;
+            const ThreeRotationMatrix rots[2] = {ThreeRotationMatrix(0.5, 1.2, -0.8), ThreeRotationMatrix(1.0, 0, 0.5)};
+            for(int k = 0; k < 2; ++k)
+            {
+                const AlmRotation rotation(rots[k], lMax);
+                std::vector<ComplexDouble> rotated1 = alm1, rotated2 = alm2;
+                ComplexDouble* sets[2] = {&(rotated1[0]), &(rotated2[0])};
+                rotation.rotate(2, sets);
+
+                // the rotated field at rot * v is the original field at v
+                for(int j = 0; j < 20; ++j)
+                {
+                    const ThreeVectorDouble v(std::sin(0.7 * j + 0.1), std::cos(1.3 * j), 0.1 * j - 1);
+                    const ThreeVectorDouble r = rots[k] * v;
+                    const double f1 = fieldValue(alm1, lMax, v), g1 = fieldValue(rotated1, lMax, r);
+                    const double f2 = fieldValue(alm2, lMax, v), g2 = fieldValue(rotated2, lMax, r);
+                    if(std::abs(f1 - g1) > 1e-10 || std::abs(f2 - g2) > 1e-10)
+                    {
+                        output_screen("FAIL: rotation " << k << ", direction " << j << ": the field values " << f1 << " and " << f2 << " became " << g1 << " and " << g2 << std::endl);
+                        res = 0;
+                    }
+                }
+            }
+            expected = 1;
+        }
+        break;
     default:
         check(false, "");
         break;
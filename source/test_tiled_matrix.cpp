@@ -0,0 +1,132 @@
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <matrix_impl.hpp>
+#include <tiled_matrix.hpp>
+#include <test_tiled_matrix.hpp>
+
+std::string
+TestTiledMatrix::name() const
+{
+    return std::string("TILED MATRIX TESTER");
+}
+
+unsigned int
+TestTiledMatrix::numberOfSubtests() const
+{
+    return 2;
+}
+
+void
+TestTiledMatrix::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        return;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        return;
+    default:
+        check(false, "");
+        return;
+    }
+}
+
+namespace
+{
+
+// a squared exponential correlation with a rank one term and a diagonal growing along the matrix, so that the elements are different in all of the tiles and a misplaced tile is noticed
+class TestElements : public Math::TiledMatrix::ElementGenerator
+{
+public:
+    double evaluate(int i, int j) const { return (i == j ? 1.0 + 0.01 * i : 0.0) + std::exp(-0.005 * (i - j) * (i - j)) + 0.1 * std::cos(0.3 * i) * std::cos(0.3 * j); }
+};
+
+// the sizes are not a multiple of the tile size (the last tiles are smaller, the last one has a single row), a multiple of it, and smaller than one tile
+const int nTestSizes = 4;
+const int testSizes[nTestSizes] = {107, 51, 100, 20};
+const int testTileSize = 25;
+
+std::string
+testDirectory(int n)
+{
+    std::stringstream dir;
+    dir << "test_tiled_matrix_" << n;
+    return dir.str();
+}
+
+} // namespace
+
+void
+TestTiledMatrix::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    TestElements elements;
+    double maxDiff = 0;
+    for(int s = 0; s < nTestSizes; ++s)
+    {
+        const int n = testSizes[s];
+        Math::TiledMatrix tiled(n, testTileSize, testDirectory(n).c_str());
+        tiled.generate(elements);
+
+        Math::SymmetricMatrix<double> mat;
+        tiled.copyTo(&mat);
+
+        for(int i = 0; i < n; ++i)
+            for(int j = 0; j < n; ++j)
+                maxDiff = std::max(maxDiff, std::abs(mat(i, j) - elements.evaluate(std::max(i, j), std::min(i, j))));
+    }
+
+    res = maxDiff;
+    expected = 0;
+    subTestName = "generate";
+}
+
+void
+TestTiledMatrix::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    TestElements elements;
+    res = 0;
+    for(int s = 0; s < nTestSizes; ++s)
+    {
+        const int n = testSizes[s];
+        Math::TiledMatrix tiled(n, testTileSize, testDirectory(n).c_str());
+        tiled.generate(elements);
+
+        Math::SymmetricMatrix<double> mat;
+        tiled.copyTo(&mat);
+
+        const int info = tiled.choleskyFactorize();
+        check(info == 0, "factorization failed, info = " << info);
+
+        // L L^T should give back the original matrix
+        Math::SymmetricMatrix<double> l;
+        tiled.copyTo(&l);
+        double maxDiff = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            for(int j = 0; j <= i; ++j)
+            {
+                double x = 0;
+                for(int k = 0; k <= j; ++k)
+                    x += l(i, k) * l(j, k);
+                maxDiff = std::max(maxDiff, std::abs(x - mat(i, j)));
+            }
+        }
+
+        int sign;
+        const double logDet = mat.logDet(&sign);
+        const double logDetTiled = tiled.logDetFromCholeskyFactorization();
+
+        res = std::max(res, maxDiff + std::abs(logDet - logDetTiled) / std::abs(logDet));
+    }
+
+    expected = 0;
+    subTestName = "cholesky";
+}
@@ -0,0 +1,173 @@
+#include <cstdio>
+#include <cmath>
+
+#include <macros.hpp>
+#include <matrix_impl.hpp>
+#include <whole_matrix.hpp>
+#include <test_whole_matrix.hpp>
+
+std::string
+TestWholeMatrix::name() const
+{
+    return std::string("WHOLE MATRIX TESTER");
+}
+
+unsigned int
+TestWholeMatrix::numberOfSubtests() const
+{
+    return 3;
+}
+
+void
+TestWholeMatrix::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        return;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        return;
+    case 2:
+        runSubTest2(res, expected, subTestName);
+        return;
+    default:
+        check(false, "");
+        return;
+    }
+}
+
+namespace
+{
+
+double
+testElement(int l1, int m1, int l, int m)
+{
+    return 1.0 / (1 + std::abs(l1 - l)) + 0.01 * m1 - 0.001 * m + 0.1 * l;
+}
+
+void
+fill(WholeMatrix& wm)
+{
+    for(int l1 = wm.getLMin(); l1 <= wm.getLMax(); ++l1)
+        for(int m1 = -l1; m1 <= l1; ++m1)
+            for(int l = wm.getLMin(); l <= wm.getLMax(); ++l)
+                for(int m = -l; m <= l; ++m)
+                    if(wm.isStored(l1, l))
+                        wm.element(l1, m1, l, m) = testElement(l1, m1, l, m);
+}
+
+// the number of elements different from the expected values (0 outside of the band)
+int
+countWrong(const WholeMatrix& wm, int deltaL)
+{
+    int wrong = 0;
+    for(int l1 = wm.getLMin(); l1 <= wm.getLMax(); ++l1)
+        for(int m1 = -l1; m1 <= l1; ++m1)
+            for(int l = wm.getLMin(); l <= wm.getLMax(); ++l)
+                for(int m = -l; m <= l; ++m)
+                {
+                    const double expected = (deltaL < 0 || std::abs(l - l1) <= deltaL ? testElement(l1, m1, l, m) : 0.0);
+                    if(wm.element(l1, m1, l, m) != expected)
+                        ++wrong;
+                }
+    return wrong;
+}
+
+} // namespace
+
+void
+TestWholeMatrix::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    const int lMin = 2, lMax = 6;
+    WholeMatrix full(lMin, lMax), banded(lMin, lMax, 1);
+    fill(full);
+    fill(banded);
+
+    res = 0;
+    res += countWrong(full, -1);
+    res += countWrong(banded, 1);
+
+    // the full matrix copy has the elements at index(l', m'), index(l, m)
+    Math::Matrix<double> mat;
+    banded.copyTo(&mat);
+    if(mat.rows() != banded.size() || mat(banded.index(3, -2), banded.index(4, 1)) != testElement(3, -2, 4, 1) || mat(banded.index(3, -2), banded.index(5, 1)) != 0)
+        res += 1;
+
+    WholeMatrix copy(lMin, lMax, 1);
+    copy.set(mat);
+    res += countWrong(copy, 1);
+
+    WholeMatrix assigned(0, 1);
+    assigned = banded;
+    res += countWrong(assigned, 1);
+
+    expected = 0;
+    subTestName = "banded";
+}
+
+void
+TestWholeMatrix::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    const int lMin = 2, lMax = 5;
+    WholeMatrix banded(lMin, lMax, 0);
+    fill(banded);
+
+    const char* fileName = "test_whole_matrix.dat";
+    banded.writeIntoFile(fileName);
+
+    res = 0;
+    {
+        WholeMatrix mapped(fileName);
+        if(mapped.getLMin() != lMin || mapped.getLMax() != lMax || mapped.getDeltaL() != 0)
+            res += 1;
+        res += countWrong(mapped, 0);
+
+        // the mapping is copy on write, the file does not change
+        mapped.element(3, 1, 3, -2) = 100;
+        WholeMatrix again(fileName);
+        res += countWrong(again, 0);
+    }
+
+    std::remove(fileName);
+
+    expected = 0;
+    subTestName = "file";
+}
+
+void
+TestWholeMatrix::runSubTest2(double& res, double& expected, std::string& subTestName)
+{
+    const int lMin = 2, lMax = 5;
+    WholeMatrix full(lMin, lMax), banded(lMin, lMax, 1);
+
+    res = 0;
+    for(int l = lMin; l <= lMax; ++l)
+        for(int m = -l; m <= l; ++m)
+        {
+            full.element(l, m, l, m) = l + 0.1 * m;
+            banded.element(l, m, l, m) = l + 0.1 * m;
+        }
+    if(!full.isDiagonal() || !banded.isDiagonal())
+        res += 1;
+
+    full.element(3, 1, 3, -1) = 0.5;
+    banded.element(4, 0, 5, 2) = 0.5;
+    if(full.isDiagonal() || banded.isDiagonal())
+        res += 1;
+
+    full.setToZero();
+    for(int l1 = lMin; l1 <= lMax; ++l1)
+        for(int m1 = -l1; m1 <= l1; ++m1)
+            for(int l = lMin; l <= lMax; ++l)
+                for(int m = -l; m <= l; ++m)
+                    if(full.element(l1, m1, l, m) != 0)
+                        res += 1;
+
+    expected = 0;
+    subTestName = "diagonal";
+}
+
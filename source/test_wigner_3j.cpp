@@ -1,4 +1,10 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+
 #include <wigner_3j.hpp>
+#include <wigner_3j_table.hpp>
 #include <test_wigner_3j.hpp>
 
 std::string
@@ -10,7 +16,7 @@ TestWigner3J::name() const
 unsigned int
 TestWigner3J::numberOfSubtests() const
 {
-    return 6;
+    return 10;
 }
 
 struct TestWigner3JTreats
@@ -31,10 +37,31 @@ struct TestWigner3JTreats
     double val_;
 };
 
+// compares all of the symbols up to lMax to a table
+struct TestWigner3JTableTreats
+{
+    TestWigner3JTableTreats(const Math::Wigner3jZeroMTable& table) : table_(table), maxDiff_(0), count_(0)
+    {
+    }
+
+    void process(int l1, int l2, int l3, double val)
+    {
+        const int lMax = table_.getLMax();
+        if(l1 > lMax || l2 > lMax || l3 > lMax)
+            return;
+        maxDiff_ = std::max(maxDiff_, std::abs(table_(l1, l2, l3) - val));
+        ++count_;
+    }
+
+    const Math::Wigner3jZeroMTable& table_;
+    double maxDiff_;
+    long count_;
+};
+
 void
 TestWigner3J::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 6, "invalid index " << i);
+    check(i >= 0 && i < numberOfSubtests(), "invalid index " << i);
 
     TestWigner3JTreats t(0, 0, 0);
     Math::Wigner3JZeroM<TestWigner3JTreats> w(t);
@@ -101,6 +128,73 @@ TestWigner3J::runSubTest(unsigned int i, double& res, double& expected, std::str
         res = t.val_;
         subTestName = std::string("500_1000_500");
         break;
+    case 6:
+    {
+        std::vector<double> row;
+        Math::wigner3jZeroMRow(1000, 500, -1, &row);
+        expected = 0.004222;
+        res = row[500 - 500];
+        subTestName = std::string("row_500_1000_500");
+        break;
+    }
+    case 7:
+    {
+        // the whole row compared to the triangle recursion, the result is the largest difference
+        const int l1 = 37, l2 = 52;
+        std::vector<double> row;
+        Math::wigner3jZeroMRow(l1, l2, 80, &row);
+        res = 0;
+        for(int l3 = l2 - l1; l3 <= 80; ++l3)
+        {
+            t.l1_ = l1;
+            t.l2_ = l2;
+            t.l3_ = l3;
+            t.val_ = 0;
+            w.calculate((l1 + l2 + l3) / 2);
+            res = std::max(res, std::abs(row[l3 - (l2 - l1)] - t.val_));
+        }
+        expected = 0;
+        subTestName = std::string("row_37_52");
+        break;
+    }
+    case 8:
+    {
+        // all of the symbols in the table compared to the triangle recursion, the result is the largest difference
+        const int lMax = 40;
+        Math::Wigner3jZeroMTable table(lMax);
+        TestWigner3JTableTreats tableTreats(table);
+        Math::Wigner3JZeroM<TestWigner3JTableTreats> tableW(tableTreats);
+        tableW.calculate(3 * lMax / 2);
+        res = tableTreats.maxDiff_;
+
+        // the vanishing ones
+        if(table(3, 2, 4) != 0 || table(1, 2, 10) != 0 || tableTreats.count_ == 0)
+            res = 1;
+        expected = 0;
+        subTestName = std::string("table");
+        break;
+    }
+    case 9:
+    {
+        const int lMax = 30;
+        const char* fileName = "test_wigner_3j_table.dat";
+        Math::Wigner3jZeroMTable table(lMax);
+        table.writeIntoFile(fileName);
+        res = 0;
+        {
+            Math::Wigner3jZeroMTable mapped(fileName);
+            if(mapped.getLMax() != lMax || mapped.size() != table.size())
+                res = 1;
+            for(int l1 = 0; l1 <= lMax; ++l1)
+                for(int l2 = 0; l2 <= lMax; ++l2)
+                    for(int l3 = 0; l3 <= lMax; ++l3)
+                        res = std::max(res, std::abs(mapped(l1, l2, l3) - table(l1, l2, l3)));
+        }
+        std::remove(fileName);
+        expected = 0;
+        subTestName = std::string("table_file");
+        break;
+    }
     default:
         check(false, "");
         break;
@@ -0,0 +1,60 @@
+#ifdef COSMO_OMP
+#include <omp.h>
+#endif
+
+#include <threaded_likelihood.hpp>
+
+namespace
+{
+
+// sets the number of threads of the calling thread while it exists, the previous setting is restored by the destructor so that it is restored when the likelihood throws too
+class ThreadSetting
+{
+public:
+    ThreadSetting(int nThreads)
+    {
+#ifdef COSMO_OMP
+        threads_ = omp_get_max_threads();
+        omp_set_num_threads(nThreads);
+#endif
+    }
+
+    ~ThreadSetting()
+    {
+#ifdef COSMO_OMP
+        omp_set_num_threads(threads_);
+#endif
+    }
+
+private:
+    int threads_;
+};
+
+} // namespace
+
+namespace Math
+{
+
+double
+ThreadedLikelihood::calculate(double* params, int nParams)
+{
+    ThreadSetting setting(nThreads_);
+    return like_.calculate(params, nParams);
+}
+
+double
+ThreadedLikelihood::calculateExact(double* params, int nParams)
+{
+    ThreadSetting setting(nThreads_);
+    return like_.calculateExact(params, nParams);
+}
+
+void
+ThreadedLikelihood::calculateBatch(double* params, int nParams, int nPoints, double* results)
+{
+    ThreadSetting setting(nThreads_);
+    like_.calculateBatch(params, nParams, nPoints, results);
+}
+
+} // namespace Math
+
@@ -0,0 +1,277 @@
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <errno.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <matrix_impl.hpp>
+#include <mapped_matrix.hpp>
+#include <tiled_matrix.hpp>
+
+#ifdef COSMO_LAPACK
+extern "C"
+{
+    // Cholesky factorization
+    void dpotrf_(char *uplo, int *n, double *a, int *lda, int *info);
+
+    // solution of triangular systems with multiple right hand sides
+    void dtrsm_(char *side, char *uplo, char *transa, char *diag, int *m, int *n, double *alpha, double *a, int *lda, double *b, int *ldb);
+
+    // multiplication
+    void dgemm_(char *transa, char *transb, int *m, int *n, int *k, double *alpha, double *a, int *lda, double *b, int *ldb, double *beta, double *c, int *ldc);
+}
+#endif
+
+namespace
+{
+
+// exceptions cannot leave the parallel regions, so the first error message is kept and thrown after
+void
+setError(std::string& error, const std::exception& e)
+{
+#pragma omp critical (tiled_matrix_error)
+    {
+        if(error.empty())
+            error = e.what();
+    }
+}
+
+void
+throwIfError(const std::string& error)
+{
+    if(error.empty())
+        return;
+
+    StandardException exc;
+    exc.set(error);
+    throw exc;
+}
+
+} // namespace
+
+namespace Math
+{
+
+TiledMatrix::TiledMatrix(int n, int tileSize, const char* directory) : n_(n), tileSize_(tileSize), directory_(directory), factorized_(false)
+{
+    check(n > 0, "invalid size " << n);
+    check(tileSize > 0, "invalid tile size " << tileSize);
+
+    nTiles_ = (n_ + tileSize_ - 1) / tileSize_;
+
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot create the directory " << directory << " for the matrix tiles.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+std::string
+TiledMatrix::tileFileName(int i, int j) const
+{
+    check(j >= 0 && j <= i && i < nTiles_, "invalid tile (" << i << ", " << j << ")");
+
+    std::stringstream fileName;
+    fileName << directory_ << "/tile_" << i << "_" << j << ".dat";
+    return fileName.str();
+}
+
+void
+TiledMatrix::readTile(int i, int j, Matrix<double>* tile) const
+{
+    MappedMatrix mapped(tileFileName(i, j).c_str());
+    if(mapped.rows() != tileRows(i) || mapped.cols() != tileRows(j) || mapped.isSymmetric())
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The tile file " << tileFileName(i, j) << " has the wrong size " << mapped.rows() << " x " << mapped.cols() << ", expected " << tileRows(i) << " x " << tileRows(j) << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    mapped.copyTo(tile);
+}
+
+void
+TiledMatrix::writeTile(int i, int j, const Matrix<double>& tile)
+{
+    check(!tile.isSymmetric(), "the tiles are stored as full matrices");
+    check(tile.rows() == tileRows(i) && tile.cols() == tileRows(j), "invalid tile size " << tile.rows() << " x " << tile.cols());
+
+    MappedMatrix::writeIntoFile(tile, tileFileName(i, j).c_str());
+}
+
+void
+TiledMatrix::generate(const ElementGenerator& generator)
+{
+    factorized_ = false;
+
+    std::vector<std::pair<int, int> > tiles;
+    for(int i = 0; i < nTiles_; ++i)
+        for(int j = 0; j <= i; ++j)
+            tiles.push_back(std::make_pair(i, j));
+
+    std::string error;
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(int k = 0; k < tiles.size(); ++k)
+    {
+        const int i = tiles[k].first, j = tiles[k].second;
+        try {
+            Matrix<double> tile(tileRows(i), tileRows(j));
+            for(int a = 0; a < tile.rows(); ++a)
+            {
+                const int row = i * tileSize_ + a;
+                for(int b = 0; b < tile.cols(); ++b)
+                {
+                    const int col = j * tileSize_ + b;
+                    // only the lower triangle is generated, the diagonal tiles are filled in by symmetry
+                    if(col <= row)
+                        tile(a, b) = generator.evaluate(row, col);
+                    else
+                        tile(a, b) = tile(b, a);
+                }
+            }
+
+            writeTile(i, j, tile);
+        } catch (std::exception& e)
+        {
+            setError(error, e);
+        }
+    }
+    throwIfError(error);
+}
+
+void
+TiledMatrix::copyTo(SymmetricMatrix<double>* res) const
+{
+    res->resize(n_, n_);
+    Matrix<double> tile;
+    for(int i = 0; i < nTiles_; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+        {
+            readTile(i, j, &tile);
+            for(int a = 0; a < tile.rows(); ++a)
+            {
+                const int bMax = (i == j ? a + 1 : tile.cols());
+                for(int b = 0; b < bMax; ++b)
+                    (*res)(i * tileSize_ + a, j * tileSize_ + b) = tile(a, b);
+            }
+        }
+    }
+}
+
+#ifdef COSMO_LAPACK
+
+// The tiles are stored in row major order, so for LAPACK (column major) each tile appears transposed. The factor L (lower) of A = L L^T is then the upper factor U = L^T of dpotrf.
+// The right looking algorithm: for each k factorize the diagonal tile, then L_ik = A_ik L_kk^-T for i > k, then A_ij -= L_ik L_jk^T for i >= j > k.
+int
+TiledMatrix::choleskyFactorize()
+{
+    check(!factorized_, "the matrix has already been factorized");
+
+    std::string error;
+    for(int k = 0; k < nTiles_; ++k)
+    {
+        Matrix<double> diag;
+        readTile(k, k, &diag);
+
+        char uplo = 'U';
+        int nk = tileRows(k);
+        int info;
+        dpotrf_(&uplo, &nk, &(diag(0, 0)), &nk, &info);
+        if(info != 0)
+            return k * tileSize_ + info;
+
+        for(int a = 0; a < nk; ++a)
+            for(int b = a + 1; b < nk; ++b)
+                diag(a, b) = 0;
+        writeTile(k, k, diag);
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+        for(int i = k + 1; i < nTiles_; ++i)
+        {
+            try {
+                Matrix<double> tile;
+                readTile(i, k, &tile);
+
+                char side = 'L', upper = 'U', trans = 'T', nonUnit = 'N';
+                int m = nk;
+                int ni = tileRows(i);
+                double alpha = 1;
+                dtrsm_(&side, &upper, &trans, &nonUnit, &m, &ni, &alpha, &(diag(0, 0)), &m, &(tile(0, 0)), &m);
+
+                writeTile(i, k, tile);
+            } catch (std::exception& e)
+            {
+                setError(error, e);
+            }
+        }
+        throwIfError(error);
+
+        std::vector<std::pair<int, int> > updates;
+        for(int i = k + 1; i < nTiles_; ++i)
+            for(int j = k + 1; j <= i; ++j)
+                updates.push_back(std::make_pair(i, j));
+
+#pragma omp parallel for default(shared) schedule(dynamic)
+        for(int u = 0; u < updates.size(); ++u)
+        {
+            const int i = updates[u].first, j = updates[u].second;
+            try {
+                Matrix<double> tile, li, lj;
+                readTile(i, j, &tile);
+                readTile(i, k, &li);
+                if(i != j)
+                    readTile(j, k, &lj);
+                Matrix<double>& ljRef = (i == j ? li : lj);
+
+                char transA = 'T', transB = 'N';
+                int m = tileRows(j);
+                int ni = tileRows(i);
+                int kk = nk;
+                double alpha = -1, beta = 1;
+                dgemm_(&transA, &transB, &m, &ni, &kk, &alpha, &(ljRef(0, 0)), &kk, &(li(0, 0)), &kk, &beta, &(tile(0, 0)), &m);
+
+                writeTile(i, j, tile);
+            } catch (std::exception& e)
+            {
+                setError(error, e);
+            }
+        }
+        throwIfError(error);
+    }
+
+    factorized_ = true;
+    return 0;
+}
+
+#endif
+
+double
+TiledMatrix::logDetFromCholeskyFactorization() const
+{
+    check(factorized_, "the matrix needs to be factorized first");
+
+    double logDet = 0;
+    Matrix<double> diag;
+    for(int k = 0; k < nTiles_; ++k)
+    {
+        readTile(k, k, &diag);
+        for(int a = 0; a < diag.rows(); ++a)
+            logDet += std::log(diag(a, a));
+    }
+
+    return 2 * logDet;
+}
+
+} // namespace Math
+
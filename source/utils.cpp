@@ -4,6 +4,8 @@
 #include <cstring>
 #include <sstream>
 #include <fstream>
+#include <map>
+#include <utility>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -22,49 +24,12 @@
 #define MY_STRINGIZE(P) MY_STRINGIZE1(P)
 #define HEALPIX_DATA_DIR_STR MY_STRINGIZE(HEALPIX_DATA_DIR)
 
-void
-Utils::readMask(const char* maskFileName, long& nSide, std::vector<int>& goodPixels)
+namespace
 {
-    Healpix_Map<double> mask;
-    read_Healpix_map_from_fits(std::string(maskFileName), mask);
-    
-    if(mask.Scheme() != NEST)
-    {
-        StandardException exc;
-        std::string exceptionStr = "The mask must have nested ordering.";
-        exc.set(exceptionStr);
-        throw exc;
-    }
-
-    nSide = mask.Nside();
-    
-    const int nPix = (int)mask.Npix();
-    
-    goodPixels.clear();
-    
-    for(int i = 0; i < nPix; ++i)
-    {
-        if(mask[i] > 0.5)
-        {
-            goodPixels.push_back(i);
-        }
-    }
-}
-
-double
-Utils::beamFunction(int l, double fwhm)
-{
-    if(fwhm == 0)
-        return 1.0;
-    
-    check(fwhm > 0, "invalid fwhm");
-    
-    const double sigma = std::sqrt(8 * std::log(2.0)) / (fwhm * Math::pi / 180);
-    return std::exp(-l * (l + 1) / (2 * sigma * sigma));
-}
 
+// reads the whole column of the pixel window function file
 void
-Utils::readPixelWindowFunction(std::vector<double>& f, long nSide, int lMax, double fwhm, bool polarization)
+readPixelWindowFile(long nSide, bool polarization, std::vector<double>* f)
 {
     StandardException exc;
 
@@ -77,8 +42,6 @@ Utils::readPixelWindowFunction(std::vector<double>& f, long nSide, int lMax, dou
 
     check(numDigits <= 4, "nSide = " << nSide << " is too big");
     
-    f.resize(lMax + 1);
-    
     std::string healpixDataDir = HEALPIX_DATA_DIR_STR;
 
     std::stringstream pixelWindowFileName;
@@ -122,14 +85,6 @@ Utils::readPixelWindowFunction(std::vector<double>& f, long nSide, int lMax, dou
         throw exc;
     }
 
-    if(nrows < lMax + 1)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "The pixel windows function file " << pixelWindowFileName.str() << " contains values only up to l = " << nrows - 1 << ". Cannot read up to lMax = " << lMax << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
-
     i = (polarization ? 2 : 1);
 
     std::stringstream s;
@@ -151,12 +106,12 @@ Utils::readPixelWindowFunction(std::vector<double>& f, long nSide, int lMax, dou
     
     fits_read_col(fptr, TSTRING, colnum, 1, 1, (LONGLONG) nrows, 0, column, &anynul, &status);
     
-    for(int l = 0; l <= lMax; ++l)
+    f->resize(nrows);
+    for(int l = 0; l < nrows; ++l)
     {
         std::stringstream str;
         str << column[l];
-        str >> f[l];
-        f[l] *= Utils::beamFunction(l, fwhm);
+        str >> (*f)[l];
     }
 
     for(int j = 0; j < nrows; ++j)
@@ -169,6 +124,149 @@ Utils::readPixelWindowFunction(std::vector<double>& f, long nSide, int lMax, dou
 		fits_report_error(stderr, status);
 }
 
+// the pixel window functions read so far, for each nSide and polarization, must only be used in the critical section utils_pixel_window_cache
+std::map<std::pair<long, bool>, std::vector<double> >&
+pixelWindowCache()
+{
+    static std::map<std::pair<long, bool>, std::vector<double> > cache;
+    return cache;
+}
+
+} // namespace
+
+void
+Utils::readMask(const char* maskFileName, long& nSide, std::vector<int>& goodPixels)
+{
+    Healpix_Map<double> mask;
+    read_Healpix_map_from_fits(std::string(maskFileName), mask);
+    
+    if(mask.Scheme() != NEST)
+    {
+        StandardException exc;
+        std::string exceptionStr = "The mask must have nested ordering.";
+        exc.set(exceptionStr);
+        throw exc;
+    }
+
+    nSide = mask.Nside();
+    
+    const int nPix = (int)mask.Npix();
+    
+    goodPixels.clear();
+    
+    for(int i = 0; i < nPix; ++i)
+    {
+        if(mask[i] > 0.5)
+        {
+            goodPixels.push_back(i);
+        }
+    }
+}
+
+double
+Utils::beamFunction(int l, double fwhm)
+{
+    if(fwhm == 0)
+        return 1.0;
+    
+    check(fwhm > 0, "invalid fwhm");
+    
+    const double sigma = std::sqrt(8 * std::log(2.0)) / (fwhm * Math::pi / 180);
+    return std::exp(-l * (l + 1) / (2 * sigma * sigma));
+}
+
+std::vector<double>
+Utils::beamFunctions(int lMax, double fwhm)
+{
+    check(lMax >= 0, "invalid lMax " << lMax);
+    
+    std::vector<double> b(lMax + 1, 1.0);
+    if(fwhm == 0)
+        return b;
+    
+    check(fwhm > 0, "invalid fwhm");
+    
+    // B_l / B_(l-1) = exp(-l / sigma^2), and the ratio itself is multiplied by the same factor for each l, so only two exponentials are needed
+    const double sigma = std::sqrt(8 * std::log(2.0)) / (fwhm * Math::pi / 180);
+    const double q = std::exp(-1.0 / (sigma * sigma));
+    double ratio = 1;
+    for(int l = 1; l <= lMax; ++l)
+    {
+        ratio *= q;
+        b[l] = b[l - 1] * ratio;
+    }
+    return b;
+}
+
+void
+Utils::readPixelWindowFunction(std::vector<double>& f, long nSide, int lMax, double fwhm, bool polarization)
+{
+    f = pixelWindowFunction(nSide, lMax, fwhm, polarization);
+}
+
+std::vector<double>
+Utils::pixelWindowFunction(long nSide, int lMax, double fwhm, bool polarization)
+{
+    check(nSide > 0, "invalid nSide = " << nSide);
+    check(lMax >= 0, "invalid lMax " << lMax);
+    
+    // the files are read only once for each nSide, all of the l values are kept so that any lMax can be served from the cache
+    const std::pair<long, bool> key(nSide, polarization);
+    std::string error;
+    std::vector<double> f;
+#pragma omp critical (utils_pixel_window_cache)
+    {
+        std::map<std::pair<long, bool>, std::vector<double> >::const_iterator it = pixelWindowCache().find(key);
+        if(it == pixelWindowCache().end())
+        {
+            try {
+                std::vector<double> w;
+                readPixelWindowFile(nSide, polarization, &w);
+                it = pixelWindowCache().insert(std::make_pair(key, w)).first;
+            } catch (std::exception& e)
+            {
+                error = e.what();
+            }
+        }
+        
+        if(error.empty())
+        {
+            if(it->second.size() < lMax + 1)
+            {
+                std::stringstream exceptionStr;
+                exceptionStr << "The pixel windows function file for nSide = " << nSide << " contains values only up to l = " << int(it->second.size()) - 1 << ". Cannot read up to lMax = " << lMax << ".";
+                error = exceptionStr.str();
+            }
+            else
+                f.assign(it->second.begin(), it->second.begin() + lMax + 1);
+        }
+    }
+    
+    if(!error.empty())
+    {
+        StandardException exc;
+        exc.set(error);
+        throw exc;
+    }
+    
+    if(fwhm != 0)
+    {
+        const std::vector<double> b = beamFunctions(lMax, fwhm);
+        for(int l = 0; l <= lMax; ++l)
+            f[l] *= b[l];
+    }
+    return f;
+}
+
+void
+Utils::clearPixelWindowCache()
+{
+#pragma omp critical (utils_pixel_window_cache)
+    {
+        pixelWindowCache().clear();
+    }
+}
+
 void
 Utils::readClFromFile(const char* fileName, std::vector<double>& cl, bool hasL, bool isDl)
 {
@@ -1,11 +1,15 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <numerics.hpp>
 #include <three_rotation.hpp>
+#include <matrix_impl.hpp>
 #include <whole_matrix.hpp>
 
 /*#include "healpix_base.h"
@@ -17,30 +21,133 @@
 #include "alm_powspec_tools.h"
 #include "chealpix.h"*/
 
-WholeMatrix::WholeMatrix(int lMin, int lMax) : lMin_(lMin), lMax_(lMax)
+namespace
+{
+
+const char wholeMatrixMagic[8] = {'C', 'O', 'S', 'M', 'O', 'W', 'H', 'M'};
+const int wholeMatrixVersion = 1;
+
+struct WholeMatrixHeader : public Math::MappedFileHeader
+{
+    int lMin;
+    int lMax;
+    int deltaL;
+    char padding[Math::MappedFile::headerSize - sizeof(Math::MappedFileHeader) - 3 * sizeof(int)];
+};
+
+static_assert(sizeof(WholeMatrixHeader) == Math::MappedFile::headerSize, "the whole matrix header must have the size of the MappedFile header");
+
+} // namespace
+
+WholeMatrix::WholeMatrix(int lMin, int lMax, int deltaL) : lMin_(lMin), lMax_(lMax), deltaL_(deltaL < 0 ? -1 : deltaL), n_(0), values_(NULL), memory_(MemoryTracker::WHOLE_MATRIX)
 {
     initialize();
 }
 
+WholeMatrix::WholeMatrix(const char* fileName, bool textFile) : lMin_(0), lMax_(0), deltaL_(-1), n_(0), values_(NULL), memory_(MemoryTracker::WHOLE_MATRIX)
+{
+    if(textFile)
+        readFromTextFile(fileName);
+    else
+        readFromFile(fileName);
+}
+
+WholeMatrix::WholeMatrix(const WholeMatrix& other) : lMin_(other.lMin_), lMax_(other.lMax_), deltaL_(other.deltaL_), n_(other.n_), rowFirst_(other.rowFirst_), rowStart_(other.rowStart_), data_(other.values_, other.values_ + other.rowStart_[other.n_]), values_(&(data_[0])), memory_(MemoryTracker::WHOLE_MATRIX)
+{
+    updateMemory();
+}
+
+WholeMatrix::~WholeMatrix()
+{
+    release();
+}
+
+WholeMatrix&
+WholeMatrix::operator=(const WholeMatrix& other)
+{
+    if(this == &other)
+        return *this;
+
+    release();
+    lMin_ = other.lMin_;
+    lMax_ = other.lMax_;
+    deltaL_ = other.deltaL_;
+    n_ = other.n_;
+    rowFirst_ = other.rowFirst_;
+    rowStart_ = other.rowStart_;
+    data_.assign(other.values_, other.values_ + other.rowStart_[other.n_]);
+    values_ = &(data_[0]);
+    updateMemory();
+    return *this;
+}
+
 void
-WholeMatrix::initialize()
+WholeMatrix::release()
+{
+    file_.unmap();
+    values_ = NULL;
+
+    // swap rather than clear, so that the memory is released
+    std::vector<double>().swap(data_);
+    updateMemory();
+}
+
+void
+WholeMatrix::updateMemory()
+{
+    memory_.set(data_.capacity() * sizeof(double) + rowFirst_.capacity() * sizeof(int) + rowStart_.capacity() * sizeof(unsigned long));
+}
+
+unsigned long
+WholeMatrix::memoryEstimate(int lMin, int lMax, int deltaL)
+{
+    check(lMin >= 0, "");
+    check(lMax >= lMin, "");
+
+    const unsigned long n = (lMax + 1) * (lMax + 1) - lMin * lMin;
+    unsigned long size = 0;
+    for(int l1 = lMin; l1 <= lMax; ++l1)
+    {
+        const int lFirst = (deltaL < 0 ? lMin : std::max(lMin, l1 - deltaL));
+        const int lLast = (deltaL < 0 ? lMax : std::min(lMax, l1 + deltaL));
+        const unsigned long width = (unsigned long)(lLast + 1) * (lLast + 1) - (unsigned long)(lFirst) * lFirst;
+        size += (2 * l1 + 1) * width;
+    }
+    return size * sizeof(double) + n * sizeof(int) + (n + 1) * sizeof(unsigned long);
+}
+
+void
+WholeMatrix::initialize(bool allocate)
 {
     check(lMin_ >= 0, "");
     check(lMax_ >= lMin_, "");
-    
-    data_.resize(lMax_ + 1);
+
+    n_ = (lMax_ + 1) * (lMax_ + 1) - lMin_ * lMin_;
+    rowFirst_.resize(n_);
+    rowStart_.resize(n_ + 1);
+
+    // the stored columns of a row are all of the (l, m) with l in the band, which is a contiguous range of indices
+    rowStart_[0] = 0;
     for(int l1 = lMin_; l1 <= lMax_; ++l1)
     {
-        data_[l1].resize(2 * l1 + 1);
+        const int lFirst = (deltaL_ < 0 ? lMin_ : std::max(lMin_, l1 - deltaL_));
+        const int lLast = (deltaL_ < 0 ? lMax_ : std::min(lMax_, l1 + deltaL_));
+        const int first = index(lFirst, -lFirst), last = index(lLast, lLast);
         for(int m1 = -l1; m1 <= l1; ++m1)
         {
-            data_[l1][l1 + m1].resize(lMax_ + 1);
-            for(int l = lMin_; l <= lMax_; ++l)
-            {
-                data_[l1][l1 + m1][l].resize(2 * l + 1, 0);
-            }
+            const int i = index(l1, m1);
+            rowFirst_[i] = first;
+            rowStart_[i + 1] = rowStart_[i] + (last - first + 1);
         }
     }
+
+    release();
+    if(allocate)
+    {
+        data_.resize(rowStart_[n_], 0);
+        values_ = &(data_[0]);
+    }
+    updateMemory();
 }
 
 bool
@@ -55,20 +162,50 @@ WholeMatrix::checkIndices(int l, int m) const
     return true;
 }
 
-double
-WholeMatrix::element(int l1, int m1, int l, int m) const
+void
+WholeMatrix::copyTo(Math::Matrix<double>* mat) const
+{
+    mat->resize(n_, n_, 0);
+    for(int i = 0; i < n_; ++i)
+    {
+        const int w = rowWidth(i);
+        for(int k = 0; k < w; ++k)
+            (*mat)(i, rowFirst_[i] + k) = values_[rowStart_[i] + k];
+    }
+}
+
+void
+WholeMatrix::set(const Math::Matrix<double>& mat)
+{
+    check(mat.rows() == n_ && mat.cols() == n_, "the matrix has size " << mat.rows() << " x " << mat.cols() << ", should be " << n_ << " x " << n_);
+    for(int i = 0; i < n_; ++i)
+    {
+        const int w = rowWidth(i);
+        for(int k = 0; k < w; ++k)
+            values_[rowStart_[i] + k] = mat(i, rowFirst_[i] + k);
+    }
+}
+
+bool
+WholeMatrix::isDiagonal() const
 {
-    check(checkIndices(l1, m1), "invalid l1, m1, l1 = " << l1 << " m1 = " << m1);
-    check(checkIndices(l, m), "invalid l, m, l = " << l << " m = " << m);
-    return data_[l1][l1 + m1][l][l + m];
+    for(int i = 0; i < n_; ++i)
+    {
+        const double* row = values_ + rowStart_[i];
+        const int w = rowWidth(i), diag = i - rowFirst_[i];
+        for(int k = 0; k < w; ++k)
+        {
+            if(k != diag && row[k] != 0)
+                return false;
+        }
+    }
+    return true;
 }
 
-double&
-WholeMatrix::element(int l1, int m1, int l, int m)
+void
+WholeMatrix::setToZero()
 {
-    check(checkIndices(l1, m1), "invalid l1, m1, l1 = " << l1 << " m1 = " << m1);
-    check(checkIndices(l, m), "invalid l, m, l = " << l << " m = " << m);
-    return data_[l1][l1 + m1][l][l + m];
+    std::fill(values_, values_ + rowStart_[n_], 0.0);
 }
 
 void
@@ -89,8 +226,8 @@ WholeMatrix::readFromTextFile(const char* fileName)
     std::getline(in, str);
     std::stringstream sstr(str);
     sstr >> lMin_ >> lMax_;
+    deltaL_ = -1;
     
-    data_.clear();
     initialize();
     
     while(!in.eof())
@@ -142,63 +279,53 @@ void
 WholeMatrix::readFromFile(const char* fileName)
 {
     StandardException exc;
-    std::ifstream in(fileName, std::ios::in | std::ios::binary);
-    if(!in)
-    {
-        std::stringstream exceptionStr;
-        exceptionStr << "Cannot read the input file " << fileName << ".";
-        exc.set(exceptionStr.str());
-        throw exc;
-    }
-    
-    in.read((char*)(&lMin_), sizeof(int));
-    in.read((char*)(&lMax_), sizeof(int));
-    
-    data_.clear();
-    
-    initialize();
-    
-    for(int l1 = lMin_; l1 <= lMax_; ++l1)
+    WholeMatrixHeader header;
+    if(!Math::MappedFile::readHeader(fileName, wholeMatrixMagic, "whole matrix", &header))
     {
-        for(int m1 = -l1; m1 <= l1; ++m1)
+        // the old format, the two l values followed by all of the elements
+        std::ifstream in(fileName, std::ios::in | std::ios::binary);
+        in.read((char*)(&lMin_), sizeof(int));
+        in.read((char*)(&lMax_), sizeof(int));
+        deltaL_ = -1;
+        
+        initialize();
+        
+        in.read((char*)(values_), rowStart_[n_] * sizeof(double));
+        if(!in)
         {
-            for(int l = lMin_; l <= lMax_; ++l)
-            {
-                check(data_[l1][l1 + m1][l].size() == 2 * l + 1, "");
-                in.read((char*)(&(data_[l1][l1 + m1][l][0])), (2 * l + 1) * sizeof(double));
-            }
+            std::stringstream exceptionStr;
+            exceptionStr << "The whole matrix file " << fileName << " is incomplete.";
+            exc.set(exceptionStr.str());
+            throw exc;
         }
+        in.close();
+        return;
     }
-    in.close();
-}
-
-void
-WholeMatrix::writeIntoFile(const char* fileName) const
-{
-    std::ofstream out(fileName, std::ios::binary | std::ios::out);
-    if(!out)
+    
+    if(header.version != wholeMatrixVersion || header.elementSize != sizeof(double) || header.lMin < 0 || header.lMax < header.lMin)
     {
-        StandardException exc;
         std::stringstream exceptionStr;
-        exceptionStr << "Cannot write into output file " << fileName << ".";
+        exceptionStr << "The file " << fileName << " does not contain a valid whole matrix.";
         exc.set(exceptionStr.str());
         throw exc;
     }
     
-    out.write((char*)(&lMin_), sizeof(int));
-    out.write((char*)(&lMax_), sizeof(int));
+    lMin_ = header.lMin;
+    lMax_ = header.lMax;
+    deltaL_ = header.deltaL;
+    initialize(false);
     
-    for(int l1 = lMin_; l1 <= lMax_; ++l1)
-    {
-        for(int m1 = -l1; m1 <= l1; ++m1)
-        {
-            for(int l = lMin_; l <= lMax_; ++l)
-            {
-                check(data_[l1][l1 + m1][l].size() == 2 * l + 1, "");
-                out.write((char*)(&(data_[l1][l1 + m1][l][0])), (2 * l + 1) * sizeof(double));
-            }
-        }
-    }
-    out.close();
+    file_.map(fileName, Math::MappedFile::headerSize + rowStart_[n_] * sizeof(double), "whole matrix", true);
+    values_ = (double*)((char*)file_.data() + Math::MappedFile::headerSize);
 }
 
+void
+WholeMatrix::writeIntoFile(const char* fileName) const
+{
+    WholeMatrixHeader header;
+    Math::MappedFile::initHeader(wholeMatrixMagic, wholeMatrixVersion, sizeof(double), &header);
+    header.lMin = lMin_;
+    header.lMax = lMax_;
+    header.deltaL = deltaL_;
+    Math::MappedFile::write(fileName, &header, values_, rowStart_[n_] * sizeof(double));
+}
@@ -0,0 +1,111 @@
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <wigner_3j.hpp>
+#include <wigner_3j_table.hpp>
+
+namespace
+{
+
+const char wignerTableMagic[8] = {'C', 'O', 'S', 'M', 'O', 'W', '3', 'J'};
+const int wignerTableVersion = 1;
+
+struct WignerTableHeader : public Math::MappedFileHeader
+{
+    int lMax;
+    char padding[Math::MappedFile::headerSize - sizeof(Math::MappedFileHeader) - sizeof(int)];
+};
+
+static_assert(sizeof(WignerTableHeader) == Math::MappedFile::headerSize, "the Wigner 3j table header must have the size of the MappedFile header");
+
+} // namespace
+
+namespace Math
+{
+
+Wigner3jZeroMTable::Wigner3jZeroMTable(int lMax) : lMax_(lMax), values_(NULL)
+{
+    initialize();
+    data_.resize(size());
+    values_ = &(data_[0]);
+
+#pragma omp parallel default(shared)
+    {
+        std::vector<double> row;
+
+#pragma omp for schedule(dynamic)
+        for(int l1 = 0; l1 <= lMax_; ++l1)
+        {
+            for(int l2 = l1; l2 <= lMax_; ++l2)
+            {
+                // the row is indexed by l3 - (l2 - l1)
+                wigner3jZeroMRow(l1, l2, lMax_, &row);
+                const unsigned long start = offsets_[pairIndex(l1, l2)], end = offsets_[pairIndex(l1, l2) + 1];
+                int l3 = l2 + l1 % 2;
+                for(unsigned long i = start; i < end; ++i, l3 += 2)
+                    data_[i] = row[l3 - (l2 - l1)];
+            }
+        }
+    }
+}
+
+Wigner3jZeroMTable::Wigner3jZeroMTable(const char* fileName) : lMax_(0), values_(NULL)
+{
+    WignerTableHeader header;
+    const bool valid = MappedFile::readHeader(fileName, wignerTableMagic, "Wigner 3j table", &header);
+
+    if(!valid || header.version != wignerTableVersion || header.elementSize != sizeof(double) || header.lMax < 0)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " does not contain a valid Wigner 3j table.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    lMax_ = header.lMax;
+    initialize();
+
+    file_.map(fileName, MappedFile::headerSize + size() * sizeof(double), "Wigner 3j table");
+    values_ = (const double*)((const char*)file_.data() + MappedFile::headerSize);
+}
+
+void
+Wigner3jZeroMTable::initialize()
+{
+    check(lMax_ >= 0, "invalid lMax = " << lMax_);
+
+    const unsigned long nPairs = (unsigned long)(lMax_ + 1) * (lMax_ + 2) / 2;
+    offsets_.resize(nPairs + 1);
+    offsets_[0] = 0;
+    for(int l1 = 0; l1 <= lMax_; ++l1)
+    {
+        for(int l2 = l1; l2 <= lMax_; ++l2)
+        {
+            const int start = l2 + l1 % 2;
+            const int end = std::min(l1 + l2, lMax_);
+            const unsigned long n = (end >= start ? (end - start) / 2 + 1 : 0);
+            const unsigned long i = pairIndex(l1, l2);
+            check(i < nPairs, "");
+            offsets_[i + 1] = offsets_[i] + n;
+        }
+    }
+}
+
+void
+Wigner3jZeroMTable::writeIntoFile(const char* fileName) const
+{
+    WignerTableHeader header;
+    MappedFile::initHeader(wignerTableMagic, wignerTableVersion, sizeof(double), &header);
+    header.lMax = lMax_;
+    MappedFile::write(fileName, &header, values_, size() * sizeof(double));
+}
+
+} // namespace Math
+
@@ -1,6 +1,7 @@
 #include <string>
 #include <sstream>
 #include <cstring>
+#include <algorithm>
 //#include <fstream>
 
 #include <macros.hpp>
@@ -44,7 +45,7 @@ extern "C" bool wmap_options_mp_use_tt_beam_ptsrc_;
 
 bool WMAP9Likelihood::initialized_ = false;
 
-WMAP9Likelihood::WMAP9Likelihood(bool useLowlT, bool useHighlT, bool useLowlP, bool useHighlP, bool useGibbs, bool useTTBeam) : useLowlT_(useLowlT), useHighlT_(useHighlT), useLowlP_(useLowlP), useHighlP_(useHighlP), useGibbs_(useGibbs), useTTBeam_(useTTBeam), like_(10, 0.0), cosmoParams_(6), prevCosmoCalculated_(false)
+WMAP9Likelihood::WMAP9Likelihood(bool useLowlT, bool useHighlT, bool useLowlP, bool useHighlP, bool useGibbs, bool useTTBeam, bool useOwnCmb) : cmb_(NULL), useLowlT_(useLowlT), useHighlT_(useHighlT), useLowlP_(useLowlP), useHighlP_(useHighlP), useGibbs_(useGibbs), useTTBeam_(useTTBeam), like_(10, 0.0), cosmoParams_(6), prevCosmoCalculated_(false)
 {
     check(!initialized_, "WMAP 9 likelihood can be initialized only once through the runtime of the program");
 
@@ -56,6 +57,7 @@ WMAP9Likelihood::WMAP9Likelihood(bool useLowlT, bool useHighlT, bool useLowlP, b
     int lMax = wmap_options_mp_ttmax_;
 #endif
     output_screen1("lMax = " << lMax << std::endl);
+    lMax_ = lMax;
     lMax += 1000;
 
 #ifdef WMAP9_GFORT
@@ -76,7 +78,11 @@ WMAP9Likelihood::WMAP9Likelihood(bool useLowlT, bool useHighlT, bool useLowlP, b
     wmap_options_mp_use_tt_beam_ptsrc_ = useTTBeam;
 #endif
 
-    cmb_.preInitialize(lMax);
+    if(useOwnCmb)
+    {
+        cmb_ = new CMB;
+        cmb_->preInitialize(lMax);
+    }
 
 #ifdef WMAP9_GFORT
     __wmap_likelihood_9yr_MOD_wmap_likelihood_init();
@@ -112,7 +118,8 @@ WMAP9Likelihood::setCosmoParams(const CosmologicalParams& params)
     const bool wantPol = (useLowlP_ || useHighlP_);
     const bool wantLens = true;
 
-    cmb_.initialize(params, wantT, wantPol, wantLens);
+    check(cmb_, "own CMB must be used (set in constructor)");
+    cmb_->initialize(params, wantT, wantPol, wantLens);
 }
 
 void
@@ -126,7 +133,8 @@ WMAP9Likelihood::calculateCls()
     std::vector<double>* te = (wantPol ? &clTE_ : NULL);
     std::vector<double>* bb = (wantPol ? &clBB_ : NULL);
     
-    cmb_.getLensedCl(tt, ee, te, bb);
+    check(cmb_, "own CMB must be used (set in constructor)");
+    cmb_->getLensedCl(tt, ee, te, bb);
 
     for(int l = 0; l < clTT_.size(); ++l)
         clTT_[l] *= (l * (l + 1) / (2 * Math::pi));
@@ -149,10 +157,45 @@ WMAP9Likelihood::calculateCls()
     */
 }
 
+namespace
+{
+
+// copy the Cl-s (the ones that fit) and multiply by l(l+1)/2pi, the rest are set to 0
+void
+copyWMAPCl(const std::vector<double>* cl, std::vector<double>* res)
+{
+    std::fill(res->begin(), res->end(), 0.0);
+    if(!cl)
+        return;
+
+    const int n = std::min(cl->size(), res->size());
+    for(int l = 0; l < n; ++l)
+        (*res)[l] = (*cl)[l] * (l * (l + 1) / (2 * Math::pi));
+}
+
+} // namespace
+
+void
+WMAP9Likelihood::setCls(const std::vector<double>* tt, const std::vector<double>* ee, const std::vector<double>* te, const std::vector<double>* bb)
+{
+    check(tt, "TT must be specified");
+    check(tt->size() >= lMax_ + 1, "TT is needed up to l = " << lMax_);
+    check(!wantsPolarization() || (ee && te && bb), "polarization Cl-s must be specified");
+
+    copyWMAPCl(tt, &clTT_);
+    copyWMAPCl(ee, &clEE_);
+    copyWMAPCl(te, &clTE_);
+    copyWMAPCl(bb, &clBB_);
+
+    // the cosmological parameters of calculate do not correspond to these Cl-s
+    prevCosmoCalculated_ = false;
+}
+
 double
 WMAP9Likelihood::calculate(double* params, int nPar)
 {
     check(nPar == 6, "");
+    check(cmb_, "own CMB must be used (set in constructor)");
 
     const double pivot = 0.05;
 
@@ -220,5 +263,7 @@ WMAP9Likelihood::likelihood()
 
 WMAP9Likelihood::~WMAP9Likelihood()
 {
+    if(cmb_)
+        delete cmb_;
 }
 